@@ -0,0 +1,207 @@
+/* Copyright (C) 2019-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+// Polynomial evaluation on its own: customPolyEval (the Paterson-Stockmeyer
+// engine of the polyfunction approach) over the degree, the number of
+// polynomials evaluated together, their odd/even structure and the
+// relinearization policy, and the built-in polyEval over the degree. Every
+// benchmark reports the non-scalar multiplications (tensor products), the
+// relinearizations and the capacity consumed per iteration, and the
+// customPolyEval ones also the multiplications that getBestParameters
+// planned, which they should match.
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <helib/helib.h>
+#include <helib/polyEval.h>
+
+namespace {
+
+struct EvalParams
+{
+  long m, p, r, c, bits;
+};
+
+// A binary and an odd plaintext space on the same ring
+const EvalParams p2_params{4095, 2, 8, 3, 800};
+const EvalParams p17_params{4095, 17, 2, 3, 800};
+
+struct Setup
+{
+  std::unique_ptr<helib::Context> context;
+  std::unique_ptr<helib::SecKey> secretKey;
+  std::unique_ptr<helib::Ctxt> fresh; // encryption of random slots
+};
+
+// Key generation dominates everything else, so the context and keys of a
+// parameter set are made once and shared by all benchmarks using it
+const Setup& getSetup(const EvalParams& params)
+{
+  static std::map<const EvalParams*, Setup> setups;
+  Setup& setup = setups[&params];
+  if (setup.context)
+    return setup;
+
+  setup.context.reset(helib::ContextBuilder<helib::BGV>()
+                          .m(params.m)
+                          .p(params.p)
+                          .r(params.r)
+                          .bits(params.bits)
+                          .c(params.c)
+                          .buildPtr());
+  setup.secretKey = std::make_unique<helib::SecKey>(*setup.context);
+  setup.secretKey->GenSecKey();
+
+  const helib::EncryptedArray& ea = setup.context->getEA();
+  long p2r = setup.context->getAlMod().getPPowR();
+  std::vector<long> ptxt(ea.size());
+  for (auto& x : ptxt)
+    x = std::rand() % p2r;
+  setup.fresh = std::make_unique<helib::Ctxt>(*setup.secretKey);
+  ea.encrypt(*setup.fresh, *setup.secretKey, ptxt);
+  return setup;
+}
+
+enum Structure
+{
+  GENERAL,
+  ODD,
+  EVEN
+};
+
+// count random polynomials of the given degree mod p2r, with only odd or
+// even powers for the ODD and EVEN structures
+std::vector<NTL::ZZX> randomPolynomials(long degree,
+                                        long count,
+                                        Structure structure,
+                                        long p2r)
+{
+  std::vector<NTL::ZZX> polynomials(count);
+  for (NTL::ZZX& poly : polynomials) {
+    for (long i = 0; i <= degree; i++)
+      if (structure == GENERAL || (i % 2 == 1) == (structure == ODD))
+        NTL::SetCoeff(poly, i, 1 + std::rand() % (p2r - 1));
+    // The leading coefficient must not vanish
+    NTL::SetCoeff(poly, degree, 1);
+  }
+  return polynomials;
+}
+
+void withRealTime(benchmark::internal::Benchmark* b)
+{
+  b->Unit(benchmark::kMillisecond)->UseRealTime();
+}
+
+// The sweep of customPolyEval: the degrees are one less than a power of two
+// for odd polynomials, where Paterson-Stockmeyer is at its best, and the
+// even structure gets the degree below
+void sweep(benchmark::internal::Benchmark* b)
+{
+  b->ArgNames({"degree", "count", "structure", "lazy"});
+  for (long degree : {7, 15, 31, 63, 127})
+    for (long count : {1, 2, 4})
+      for (long structure : {GENERAL, ODD, EVEN})
+        for (long lazy : {0, 1})
+          b->Args({structure == EVEN ? degree - 1 : degree,
+                   count,
+                   structure,
+                   lazy});
+  withRealTime(b);
+}
+
+void degrees(benchmark::internal::Benchmark* b)
+{
+  b->ArgName("degree");
+  for (long degree : {7, 15, 31, 63, 127})
+    b->Arg(degree);
+  withRealTime(b);
+}
+
+void setCounters(benchmark::State& state,
+                 double multiplications,
+                 double relin,
+                 double capacity)
+{
+  state.SetItemsProcessed(state.iterations());
+  state.counters["multiplications"] =
+      benchmark::Counter(multiplications, benchmark::Counter::kAvgIterations);
+  state.counters["relinearizations"] =
+      benchmark::Counter(relin, benchmark::Counter::kAvgIterations);
+  state.counters["capacity"] =
+      benchmark::Counter(capacity, benchmark::Counter::kAvgIterations);
+}
+
+void BM_customPolyEval(benchmark::State& state, const EvalParams& params)
+{
+  const Setup& setup = getSetup(params);
+  long degree = state.range(0);
+  long count = state.range(1);
+  Structure structure = Structure(state.range(2));
+  bool lazy = state.range(3);
+  std::vector<NTL::ZZX> polynomials =
+      randomPolynomials(degree,
+                        count,
+                        structure,
+                        setup.context->getAlMod().getPPowR());
+  helib::PS_parameters plan = helib::getBestParameters(polynomials, lazy);
+
+  double multiplications = 0, relin = 0, capacity = 0;
+  for (auto _ : state) {
+    std::vector<helib::Ctxt> results;
+    helib::OpCountScope ops;
+    helib::customPolyEval(results, polynomials, *setup.fresh, lazy);
+    multiplications += ops.counts()[helib::OpType::TensorProduct];
+    relin += ops.counts()[helib::OpType::Relinearization];
+    double lowest = setup.fresh->capacity();
+    for (const helib::Ctxt& result : results)
+      lowest = std::min(lowest, result.capacity());
+    capacity += setup.fresh->capacity() - lowest;
+  }
+  setCounters(state, multiplications, relin, capacity);
+  state.counters["planned"] = plan.multiplications;
+}
+
+void BM_polyEval(benchmark::State& state, const EvalParams& params)
+{
+  const Setup& setup = getSetup(params);
+  long degree = state.range(0);
+  NTL::ZZX poly = randomPolynomials(degree,
+                                    1,
+                                    GENERAL,
+                                    setup.context->getAlMod().getPPowR())[0];
+
+  double multiplications = 0, relin = 0, capacity = 0;
+  for (auto _ : state) {
+    helib::Ctxt result(*setup.secretKey);
+    helib::OpCountScope ops;
+    helib::polyEval(result, poly, *setup.fresh);
+    multiplications += ops.counts()[helib::OpType::TensorProduct];
+    relin += ops.counts()[helib::OpType::Relinearization];
+    capacity += setup.fresh->capacity() - result.capacity();
+  }
+  setCounters(state, multiplications, relin, capacity);
+}
+
+// clang-format off
+BENCHMARK_CAPTURE(BM_customPolyEval, p2_params, p2_params)->Apply(sweep);
+BENCHMARK_CAPTURE(BM_customPolyEval, p17_params, p17_params)->Apply(sweep);
+
+BENCHMARK_CAPTURE(BM_polyEval, p2_params, p2_params)->Apply(degrees);
+BENCHMARK_CAPTURE(BM_polyEval, p17_params, p17_params)->Apply(degrees);
+// clang-format on
+
+} // namespace
@@ -0,0 +1,322 @@
+/* Copyright (C) 2019-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+// Digit extraction and bootstrapping with the polyfunction approach against
+// the built-in HElib version, on the parameter sets of Polynomials/main.cpp.
+// Every benchmark reports the throughput (items_per_second), the capacity
+// consumed (remaining for fat bootstrapping) and the number of
+// relinearizations per iteration, and is repeated so that the median and p99
+// latencies are reported as aggregates.
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <helib/helib.h>
+#include <helib/polyEval.h>
+
+namespace {
+
+struct BootParams
+{
+  long m, p, r, c, bits, t;
+  std::vector<long> mvec, gens, ords;
+};
+
+// Bootstrapping parameters
+const BootParams toy_params{105, 2, 20, 3, 1200, 120, {3, 35}, {71, 76}, {2, 2}};
+const BootParams p2_params{42799,
+                           2,
+                           8,
+                           3,
+                           1200,
+                           120,
+                           {127, 337},
+                           {25276, 40133},
+                           {126, 16}};
+const BootParams p17_params{45551,
+                            17,
+                            4,
+                            3,
+                            1200,
+                            120,
+                            {101, 451},
+                            {19394, 7677},
+                            {100, 10}};
+const BootParams p127_params{32551,
+                             127,
+                             2,
+                             3,
+                             1200,
+                             120,
+                             {43, 757},
+                             {7571, 28768},
+                             {42, 54}};
+
+// Digit extraction parameters, r is the full precision
+const BootParams p2_extract_params{42799, 2, 59, 3, 1200, 120, {}, {}, {}};
+const BootParams p3_extract_params{63973, 3, 37, 3, 1400, 120, {}, {}, {}};
+
+struct Setup
+{
+  std::unique_ptr<helib::Context> context;
+  std::unique_ptr<helib::SecKey> secretKey;
+  std::unique_ptr<helib::Ctxt> fresh; // encryption of random slots
+};
+
+// Key generation dominates everything else, so the context and keys of a
+// parameter set are made once and shared by all benchmarks using it
+const Setup& getSetup(const BootParams& params, bool thick)
+{
+  static std::map<std::pair<const BootParams*, bool>, Setup> setups;
+  Setup& setup = setups[{&params, thick}];
+  if (setup.context)
+    return setup;
+
+  bool bootstrappable = !params.mvec.empty();
+  helib::ContextBuilder<helib::BGV> builder;
+  builder.m(params.m)
+      .p(params.p)
+      .r(params.r)
+      .bits(params.bits)
+      .c(params.c)
+      .skHwt(params.t);
+  if (bootstrappable) {
+    builder.gens(params.gens)
+        .ords(params.ords)
+        .mvec(params.mvec)
+        .bootstrappable(true);
+    if (thick)
+      builder.thickboot();
+  }
+  setup.context.reset(builder.buildPtr());
+
+  setup.secretKey = std::make_unique<helib::SecKey>(*setup.context);
+  setup.secretKey->GenSecKey();
+  if (bootstrappable) {
+    helib::addSome1DMatrices(*setup.secretKey);
+    helib::addFrbMatrices(*setup.secretKey);
+    setup.secretKey->genRecryptData();
+  }
+
+  const helib::EncryptedArray& ea = setup.context->getEA();
+  std::vector<long> ptxt(ea.size());
+  for (auto& x : ptxt)
+    x = std::rand() % 256;
+  setup.fresh = std::make_unique<helib::Ctxt>(*setup.secretKey);
+  ea.encrypt(*setup.fresh, *setup.secretKey, ptxt);
+  return setup;
+}
+
+double p99(const std::vector<double>& v)
+{
+  std::vector<double> sorted(v);
+  std::sort(sorted.begin(), sorted.end());
+  long k = std::ceil(0.99 * sorted.size()) - 1;
+  return sorted[std::max(k, 0l)];
+}
+
+void withStatistics(benchmark::internal::Benchmark* b)
+{
+  b->Unit(benchmark::kMillisecond)
+      ->Repetitions(10)
+      ->ReportAggregatesOnly(true)
+      ->ComputeStatistics("p99", p99);
+}
+
+// Wall-clock time, since NTL runs the heavy parts on several threads
+void withRealTime(benchmark::internal::Benchmark* b)
+{
+  withStatistics(b);
+  b->UseRealTime();
+}
+
+// Built-in (ours = 0) and polyfunction (ours = 1) versions
+void versions(benchmark::internal::Benchmark* b)
+{
+  b->ArgName("ours")->Arg(0)->Arg(1);
+  withRealTime(b);
+}
+
+// Every stage of thin bootstrapping, in both versions, timed manually
+void stagesAndVersions(benchmark::internal::Benchmark* b)
+{
+  b->ArgNames({"stage", "ours"});
+  for (long stage = 0; stage < 4; stage++)
+    for (long ours = 0; ours < 2; ours++)
+      b->Args({stage, ours});
+  withStatistics(b);
+  b->UseManualTime();
+}
+
+void setCounters(benchmark::State& state, double capacity, double relin)
+{
+  state.SetItemsProcessed(state.iterations());
+  state.counters["capacity"] =
+      benchmark::Counter(capacity, benchmark::Counter::kAvgIterations);
+  state.counters["relinearizations"] =
+      benchmark::Counter(relin, benchmark::Counter::kAvgIterations);
+}
+
+// Capacity used by a thin bootstrapping, i.e. by all stages but the boot key
+// switch, which starts from the fresh bootstrapping key
+long capacityConsumed(const helib::BootstrapReport& report)
+{
+  long consumed = 0;
+  for (const auto& stage : report.stages)
+    if (stage.name != "bootKeySwitch")
+      consumed += stage.capacityConsumed();
+  return consumed;
+}
+
+void BM_extractDigitsThin(benchmark::State& state,
+                          const BootParams& params,
+                          long botHigh,
+                          bool ours,
+                          std::vector<std::vector<long>> e_inner_compose_list)
+{
+  const Setup& setup = getSetup(params, false);
+  double capacity = 0, relin = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    helib::Ctxt ctxt(*setup.fresh);
+    state.ResumeTiming();
+
+    helib::BootstrapReport report;
+    helib::wrapExtractDigitsThin(ctxt,
+                                 botHigh,
+                                 params.r - botHigh,
+                                 ours,
+                                 /*lazy=*/false,
+                                 e_inner_compose_list,
+                                 &report);
+    capacity += report.stages[0].capacityConsumed();
+    relin += report.stages[0].ops[helib::OpType::Relinearization];
+  }
+  setCounters(state, capacity, relin);
+}
+
+void BM_thinReCrypt(benchmark::State& state, const BootParams& params)
+{
+  const Setup& setup = getSetup(params, false);
+  bool ours = state.range(0);
+  double capacity = 0, remaining = 0, relin = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    helib::Ctxt ctxt(*setup.fresh);
+    state.ResumeTiming();
+
+    helib::BootstrapReport report;
+    setup.secretKey->thinReCrypt(ctxt, ours, /*lazy=*/false, &report);
+    capacity += capacityConsumed(report);
+    remaining += report.finalCapacity();
+    for (const auto& stage : report.stages)
+      relin += stage.ops[helib::OpType::Relinearization];
+  }
+  setCounters(state, capacity, relin);
+  state.counters["remaining"] =
+      benchmark::Counter(remaining, benchmark::Counter::kAvgIterations);
+}
+
+// One stage of thin bootstrapping, timed from the BootstrapReport of a full
+// bootstrapping so that every stage sees realistic inputs
+void BM_thinReCryptStage(benchmark::State& state, const BootParams& params)
+{
+  const Setup& setup = getSetup(params, false);
+  long stage = state.range(0);
+  bool ours = state.range(1);
+  double capacity = 0, relin = 0;
+  std::string name;
+  for (auto _ : state) {
+    helib::Ctxt ctxt(*setup.fresh);
+    helib::BootstrapReport report;
+    setup.secretKey->thinReCrypt(ctxt, ours, /*lazy=*/false, &report);
+    const helib::BootstrapStageReport& entry = report.stages.at(stage);
+    name = entry.name;
+    state.SetIterationTime(entry.wallSeconds);
+    capacity += entry.capacityConsumed();
+    relin += entry.ops[helib::OpType::Relinearization];
+  }
+  state.SetLabel(name);
+  setCounters(state, capacity, relin);
+}
+
+// reCrypt has no report, so only the remaining capacity and the operations
+// are known
+void BM_fatReCrypt(benchmark::State& state, const BootParams& params)
+{
+  const Setup& setup = getSetup(params, true);
+  bool ours = state.range(0);
+  double remaining = 0, relin = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    helib::Ctxt ctxt(*setup.fresh);
+    state.ResumeTiming();
+
+    helib::OpCountScope ops;
+    setup.secretKey->reCrypt(ctxt, ours, /*lazy=*/false);
+    relin += ops.counts()[helib::OpType::Relinearization];
+    remaining += ctxt.bitCapacity();
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.counters["remaining"] =
+      benchmark::Counter(remaining, benchmark::Counter::kAvgIterations);
+  state.counters["relinearizations"] =
+      benchmark::Counter(relin, benchmark::Counter::kAvgIterations);
+}
+
+// clang-format off
+BENCHMARK_CAPTURE(BM_extractDigitsThin, p2_builtin, p2_extract_params, 8, false, {{1}})
+    ->Apply(withRealTime);
+BENCHMARK_CAPTURE(BM_extractDigitsThin, p2_ours, p2_extract_params, 8, true, {{1}})
+    ->Apply(withRealTime);
+BENCHMARK_CAPTURE(BM_extractDigitsThin, p2_ours_16, p2_extract_params, 8, true, {{1, 16}})
+    ->Apply(withRealTime);
+BENCHMARK_CAPTURE(BM_extractDigitsThin, p2_ours_16_trapezoid, p2_extract_params, 8, true,
+                  {{1, 16}, {1, 16}, {1, 16}, {1, 16}, {1, 16}, {1, 16}, {1, 16}, {1}})
+    ->Apply(withRealTime);
+BENCHMARK_CAPTURE(BM_extractDigitsThin, p3_builtin, p3_extract_params, 5, false, {{1}})
+    ->Apply(withRealTime);
+BENCHMARK_CAPTURE(BM_extractDigitsThin, p3_ours, p3_extract_params, 5, true, {{1}})
+    ->Apply(withRealTime);
+BENCHMARK_CAPTURE(BM_extractDigitsThin, p3_ours_6, p3_extract_params, 5, true, {{1, 6}})
+    ->Apply(withRealTime);
+BENCHMARK_CAPTURE(BM_extractDigitsThin, p3_ours_6_trapezoid, p3_extract_params, 5, true,
+                  {{1, 6}, {1, 6}, {1, 6}, {1, 6}, {1}})
+    ->Apply(withRealTime);
+
+BENCHMARK_CAPTURE(BM_thinReCrypt, toy_params, toy_params)->Apply(versions);
+BENCHMARK_CAPTURE(BM_thinReCrypt, p2_params, p2_params)->Apply(versions);
+BENCHMARK_CAPTURE(BM_thinReCrypt, p17_params, p17_params)->Apply(versions);
+BENCHMARK_CAPTURE(BM_thinReCrypt, p127_params, p127_params)->Apply(versions);
+
+BENCHMARK_CAPTURE(BM_thinReCryptStage, toy_params, toy_params)
+    ->Apply(stagesAndVersions);
+BENCHMARK_CAPTURE(BM_thinReCryptStage, p2_params, p2_params)
+    ->Apply(stagesAndVersions);
+BENCHMARK_CAPTURE(BM_thinReCryptStage, p17_params, p17_params)
+    ->Apply(stagesAndVersions);
+BENCHMARK_CAPTURE(BM_thinReCryptStage, p127_params, p127_params)
+    ->Apply(stagesAndVersions);
+
+BENCHMARK_CAPTURE(BM_fatReCrypt, toy_params, toy_params)->Apply(versions);
+BENCHMARK_CAPTURE(BM_fatReCrypt, p2_params, p2_params)->Apply(versions);
+BENCHMARK_CAPTURE(BM_fatReCrypt, p17_params, p17_params)->Apply(versions);
+BENCHMARK_CAPTURE(BM_fatReCrypt, p127_params, p127_params)->Apply(versions);
+// clang-format on
+
+} // namespace
@@ -0,0 +1,173 @@
+/* Copyright (C) 2019-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+// The kernels under the ciphertext operations: the key switch of a
+// relinearization, DoubleCRT automorphisms, products and sums, the
+// scaling of a modulus switch and the raw modulus switch of bootstrapping.
+// Every kernel runs over m, the number of primes (from the bits of the
+// modulus chain) and c, the number of digits, and reports them as counters
+// next to whether the library uses HEXL. Run with
+// --benchmark_format=json (or --benchmark_out=<file>) to compare machines
+// and releases.
+
+#include <benchmark/benchmark.h>
+
+#include <map>
+#include <memory>
+#include <tuple>
+#include <vector>
+
+#include <helib/helib.h>
+#include <helib/version.h>
+
+namespace {
+
+struct Setup
+{
+  std::unique_ptr<helib::Context> context;
+  std::unique_ptr<helib::SecKey> secretKey;
+  std::unique_ptr<helib::Ctxt> fresh;   // encryption of random slots
+  std::unique_ptr<helib::Ctxt> product; // fresh squared, not relinearized
+  std::unique_ptr<helib::DoubleCRT> a, b; // random, over the ctxt primes
+};
+
+// Key generation dominates everything else, so the context and keys of a
+// parameter set are made once and shared by all benchmarks using it
+const Setup& getSetup(long m, long bits, long c)
+{
+  static std::map<std::tuple<long, long, long>, Setup> setups;
+  Setup& setup = setups[{m, bits, c}];
+  if (setup.context)
+    return setup;
+
+  setup.context.reset(helib::ContextBuilder<helib::BGV>()
+                          .m(m)
+                          .p(2)
+                          .r(1)
+                          .bits(bits)
+                          .c(c)
+                          .buildPtr());
+  setup.secretKey = std::make_unique<helib::SecKey>(*setup.context);
+  setup.secretKey->GenSecKey();
+
+  const helib::EncryptedArray& ea = setup.context->getEA();
+  std::vector<long> ptxt(ea.size());
+  for (auto& x : ptxt)
+    x = std::rand() % 2;
+  setup.fresh = std::make_unique<helib::Ctxt>(*setup.secretKey);
+  ea.encrypt(*setup.fresh, *setup.secretKey, ptxt);
+  setup.product = std::make_unique<helib::Ctxt>(*setup.fresh);
+  setup.product->multLowLvl(*setup.fresh);
+
+  const helib::IndexSet& primes = setup.context->getCtxtPrimes();
+  setup.a = std::make_unique<helib::DoubleCRT>(*setup.context, primes);
+  setup.b = std::make_unique<helib::DoubleCRT>(*setup.context, primes);
+  setup.a->randomize();
+  setup.b->randomize();
+  return setup;
+}
+
+// m, bits of the modulus chain and c
+void sweep(benchmark::internal::Benchmark* b)
+{
+  b->ArgNames({"m", "bits", "c"});
+  for (long m : {4095, 16383})
+    for (long bits : {300, 600, 1200})
+      for (long c : {2, 3, 4})
+        b->Args({m, bits, c});
+  b->Unit(benchmark::kMicrosecond);
+}
+
+const Setup& setupOf(benchmark::State& state)
+{
+  const Setup& setup = getSetup(state.range(0), state.range(1), state.range(2));
+  const helib::Context& context = *setup.context;
+  state.counters["phim"] = context.getPhiM();
+  state.counters["primes"] = context.getCtxtPrimes().card();
+  state.counters["specialPrimes"] = context.getSpecialPrimes().card();
+  state.counters["digits"] = context.getDigits().size();
+  state.counters["hexl"] = helib::version::usesHexl();
+  return setup;
+}
+
+// The key switch of the s^2 part of a product, i.e. the breaking into
+// digits and their products with the key-switching matrix
+void BM_keySwitch(benchmark::State& state)
+{
+  const Setup& setup = setupOf(state);
+  for (auto _ : state) {
+    state.PauseTiming();
+    helib::Ctxt ctxt(*setup.product);
+    state.ResumeTiming();
+    ctxt.reLinearize();
+  }
+}
+
+void BM_automorph(benchmark::State& state)
+{
+  const Setup& setup = setupOf(state);
+  const helib::PAlgebra& zMStar = setup.context->getZMStar();
+  long k = zMStar.numOfGens() > 0 ? zMStar.genToPow(0, 1)
+                                  : zMStar.genToPow(-1, 1);
+  helib::DoubleCRT dcrt(*setup.a);
+  for (auto _ : state)
+    dcrt.automorph(k);
+}
+
+void BM_mul(benchmark::State& state)
+{
+  const Setup& setup = setupOf(state);
+  helib::DoubleCRT dcrt(*setup.a);
+  for (auto _ : state)
+    dcrt.Mul(*setup.b);
+}
+
+void BM_add(benchmark::State& state)
+{
+  const Setup& setup = setupOf(state);
+  helib::DoubleCRT dcrt(*setup.a);
+  for (auto _ : state)
+    dcrt.Add(*setup.b);
+}
+
+// Dropping the last prime, as a modulus switch does
+void BM_scaleDownToSet(benchmark::State& state)
+{
+  const Setup& setup = setupOf(state);
+  helib::IndexSet target = setup.a->getIndexSet();
+  target.remove(target.last());
+  NTL::ZZX delta;
+  for (auto _ : state) {
+    state.PauseTiming();
+    helib::DoubleCRT dcrt(*setup.a);
+    state.ResumeTiming();
+    dcrt.scaleDownToSet(target, 2, delta);
+  }
+}
+
+// The switch to a small odd modulus that starts bootstrapping
+void BM_rawModSwitch(benchmark::State& state)
+{
+  const Setup& setup = setupOf(state);
+  std::vector<NTL::ZZX> parts;
+  for (auto _ : state)
+    setup.fresh->rawModSwitch(parts, (1L << 20) + 1);
+}
+
+BENCHMARK(BM_keySwitch)->Apply(sweep);
+BENCHMARK(BM_automorph)->Apply(sweep);
+BENCHMARK(BM_mul)->Apply(sweep);
+BENCHMARK(BM_add)->Apply(sweep);
+BENCHMARK(BM_scaleDownToSet)->Apply(sweep);
+BENCHMARK(BM_rawModSwitch)->Apply(sweep);
+
+} // namespace
@@ -0,0 +1,306 @@
+/* Copyright (C) 2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+// Strong and weak scaling over the number of threads and the number of
+// ciphertexts processed together (the batch) of thin and fat bootstrapping,
+// customPolyEval and the key switch of a relinearization (one by one, and
+// batched). Every case runs under an ExecutionPolicy limiting it to its
+// number of threads, and reports
+//  - throughput: ciphertexts per second (items_per_second)
+//  - speedup: over the same batch on one thread (strong scaling)
+//  - efficiency: speedup / threads
+//  - weakEfficiency: throughput per thread over the throughput of a single
+//    ciphertext on one thread (1 when batch/threads ciphertexts per thread
+//    take as long as one on one thread)
+//  - peakResidueMB: the high-water mark of the residues held (MemoryScope)
+// The one-thread cases of a batch run first and are the baselines of the
+// others, so run every operation with all its thread counts (filter on the
+// operation and the batch, not on the threads).
+//
+// The environment variables HELIB_SCALING_THREADS (default: the hardware
+// threads) and HELIB_SCALING_BATCH (default: 8) bound the sweep, which goes
+// over the powers of two and the bound itself. HELIB_SCALING_PIN=1 pins the
+// workers per NUMA node (pinWorkers()) before the first case.
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <NTL/BasicThreadPool.h>
+
+#include <helib/helib.h>
+#include <helib/memoryStats.h>
+#include <helib/multicore.h>
+#include <helib/polyEval.h>
+
+namespace {
+
+struct BootParams
+{
+  long m, p, r, c, bits, t;
+  std::vector<long> mvec, gens, ords;
+};
+
+// The tiny parameters of bgv_thinboot, and p2_params of bgv_polyfunctions
+const BootParams tiny_params{31 * 41,
+                             2,
+                             1,
+                             2,
+                             580,
+                             64,
+                             {31, 41},
+                             {1026, 249},
+                             {30, -2}};
+const BootParams p2_params{42799,
+                           2,
+                           8,
+                           3,
+                           1200,
+                           120,
+                           {127, 337},
+                           {25276, 40133},
+                           {126, 16}};
+
+struct Setup
+{
+  std::unique_ptr<helib::Context> context;
+  std::unique_ptr<helib::SecKey> secretKey;
+  std::unique_ptr<helib::Ctxt> fresh;   // encryption of random slots
+  std::unique_ptr<helib::Ctxt> product; // fresh squared, not relinearized
+};
+
+// Key generation dominates everything else, so the context and keys of a
+// parameter set are made once and shared by all benchmarks using it
+const Setup& getSetup(const BootParams& params, bool thick)
+{
+  static std::map<std::pair<const BootParams*, bool>, Setup> setups;
+  Setup& setup = setups[{&params, thick}];
+  if (setup.context)
+    return setup;
+
+  helib::ContextBuilder<helib::BGV> builder;
+  builder.m(params.m)
+      .p(params.p)
+      .r(params.r)
+      .bits(params.bits)
+      .c(params.c)
+      .skHwt(params.t)
+      .gens(params.gens)
+      .ords(params.ords)
+      .mvec(params.mvec)
+      .bootstrappable(true);
+  if (thick)
+    builder.thickboot();
+  setup.context.reset(builder.buildPtr());
+
+  setup.secretKey = std::make_unique<helib::SecKey>(*setup.context);
+  setup.secretKey->GenSecKey();
+  helib::addSome1DMatrices(*setup.secretKey);
+  helib::addFrbMatrices(*setup.secretKey);
+  setup.secretKey->genRecryptData();
+
+  const helib::EncryptedArray& ea = setup.context->getEA();
+  long p2r = setup.context->getAlMod().getPPowR();
+  std::vector<long> ptxt(ea.size());
+  for (auto& x : ptxt)
+    x = std::rand() % p2r;
+  setup.fresh = std::make_unique<helib::Ctxt>(*setup.secretKey);
+  ea.encrypt(*setup.fresh, *setup.secretKey, ptxt);
+  setup.product = std::make_unique<helib::Ctxt>(*setup.fresh);
+  setup.product->multLowLvl(*setup.fresh);
+  return setup;
+}
+
+long fromEnvironment(const char* name, long otherwise)
+{
+  const char* value = std::getenv(name);
+  return value != nullptr && std::atol(value) > 0 ? std::atol(value)
+                                                  : otherwise;
+}
+
+// The powers of two up to bound, and bound itself
+std::vector<long> upTo(long bound)
+{
+  std::vector<long> values;
+  for (long v = 1; v < bound; v *= 2)
+    values.push_back(v);
+  values.push_back(bound);
+  return values;
+}
+
+// Batches outermost, so that the one-thread baseline of a batch runs before
+// the other thread counts
+void sweep(benchmark::internal::Benchmark* b)
+{
+  long hardware = std::max(1u, std::thread::hardware_concurrency());
+  long maxThreads = fromEnvironment("HELIB_SCALING_THREADS", hardware);
+  long maxBatch = fromEnvironment("HELIB_SCALING_BATCH", 8);
+  b->ArgNames({"batch", "threads"});
+  for (long batch : upTo(maxBatch))
+    for (long threads : upTo(maxThreads))
+      b->Args({batch, threads});
+  b->Unit(benchmark::kMillisecond)->UseManualTime();
+}
+
+// Seconds per iteration of the one-thread cases, by operation and batch
+std::map<std::pair<std::string, long>, double>& baselines()
+{
+  static std::map<std::pair<std::string, long>, double> times;
+  return times;
+}
+
+// Run op(batch) under an ExecutionPolicy of the given threads, timing every
+// iteration but the copy of the inputs, and report the scaling counters
+void runScaling(benchmark::State& state,
+                const std::string& name,
+                const helib::Ctxt& input,
+                const std::function<void(std::vector<helib::Ctxt>&)>& op)
+{
+  static const bool pinned =
+      fromEnvironment("HELIB_SCALING_PIN", 0) != 0 && helib::pinWorkers();
+
+  long batch = state.range(0);
+  long threads = state.range(1);
+  NTL::SetNumThreads(threads);
+  helib::ExecutionPolicy policy;
+  policy.threads = threads;
+  helib::ExecutionPolicy::Scope scope(policy);
+
+  double seconds = 0;
+  long peak = 0;
+  for (auto _ : state) {
+    std::vector<helib::Ctxt> ctxts(batch, input);
+    helib::MemoryScope memory;
+    auto start = std::chrono::steady_clock::now();
+    op(ctxts);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    state.SetIterationTime(elapsed.count());
+    seconds += elapsed.count();
+    memory.stop();
+    peak = std::max(peak, memory.peakBytes());
+  }
+
+  double perIteration = seconds / state.iterations();
+  if (threads == 1)
+    baselines()[{name, batch}] = perIteration;
+  state.SetItemsProcessed(state.iterations() * batch);
+  state.counters["peakResidueMB"] = peak / double(1L << 20);
+  state.counters["pinned"] = pinned;
+  state.counters["nodes"] = helib::nodeCount();
+
+  auto strong = baselines().find({name, batch});
+  if (strong != baselines().end()) {
+    double speedup = strong->second / perIteration;
+    state.counters["speedup"] = speedup;
+    state.counters["efficiency"] = speedup / threads;
+  }
+  auto weak = baselines().find({name, 1});
+  if (weak != baselines().end())
+    state.counters["weakEfficiency"] =
+        weak->second * batch / (threads * perIteration);
+}
+
+// The whole batch in one batched thinReCrypt
+void BM_thinReCrypt(benchmark::State& state, const BootParams& params)
+{
+  const Setup& setup = getSetup(params, false);
+  runScaling(state,
+             "thinReCrypt" + std::to_string(params.m),
+             *setup.fresh,
+             [&](std::vector<helib::Ctxt>& ctxts) {
+               setup.secretKey->thinReCrypt(ctxts);
+             });
+}
+
+// Fat bootstrapping has no batched form, the batch is bootstrapped in a
+// parallel loop
+void BM_fatReCrypt(benchmark::State& state, const BootParams& params)
+{
+  const Setup& setup = getSetup(params, true);
+  runScaling(state,
+             "reCrypt" + std::to_string(params.m),
+             *setup.fresh,
+             [&](std::vector<helib::Ctxt>& ctxts) {
+               helib::parallelForEach(ctxts.size(), [&](long i) {
+                 setup.secretKey->reCrypt(ctxts[i]);
+               });
+             });
+}
+
+void BM_customPolyEval(benchmark::State& state, const BootParams& params)
+{
+  const Setup& setup = getSetup(params, false);
+  long p2r = setup.context->getAlMod().getPPowR();
+  std::vector<NTL::ZZX> polynomials(1);
+  for (long i = 0; i <= 31; i++)
+    NTL::SetCoeff(polynomials[0], i, 1 + std::rand() % (p2r - 1));
+  runScaling(state,
+             "customPolyEval" + std::to_string(params.m),
+             *setup.fresh,
+             [&](std::vector<helib::Ctxt>& ctxts) {
+               helib::parallelForEach(ctxts.size(), [&](long i) {
+                 std::vector<helib::Ctxt> results;
+                 helib::customPolyEval(results, polynomials, ctxts[i], false);
+               });
+             });
+}
+
+// The key switch of the s^2 part of a product
+void BM_keySwitch(benchmark::State& state, const BootParams& params)
+{
+  const Setup& setup = getSetup(params, false);
+  runScaling(state,
+             "keySwitch" + std::to_string(params.m),
+             *setup.product,
+             [&](std::vector<helib::Ctxt>& ctxts) {
+               helib::parallelForEach(ctxts.size(),
+                                      [&](long i) { ctxts[i].reLinearize(); });
+             });
+}
+
+// The same key switches, batched so that the matrix is read once per tile
+// for the whole batch
+void BM_batchedKeySwitch(benchmark::State& state, const BootParams& params)
+{
+  const Setup& setup = getSetup(params, false);
+  runScaling(state,
+             "batchedKeySwitch" + std::to_string(params.m),
+             *setup.product,
+             [&](std::vector<helib::Ctxt>& ctxts) {
+               std::vector<helib::Ctxt*> ptrs;
+               for (helib::Ctxt& ctxt : ctxts)
+                 ptrs.push_back(&ctxt);
+               helib::reLinearize(ptrs);
+             });
+}
+
+BENCHMARK_CAPTURE(BM_thinReCrypt, tiny_params, tiny_params)->Apply(sweep);
+BENCHMARK_CAPTURE(BM_thinReCrypt, p2_params, p2_params)->Apply(sweep);
+BENCHMARK_CAPTURE(BM_fatReCrypt, tiny_params, tiny_params)->Apply(sweep);
+BENCHMARK_CAPTURE(BM_fatReCrypt, p2_params, p2_params)->Apply(sweep);
+BENCHMARK_CAPTURE(BM_customPolyEval, tiny_params, tiny_params)->Apply(sweep);
+BENCHMARK_CAPTURE(BM_customPolyEval, p2_params, p2_params)->Apply(sweep);
+BENCHMARK_CAPTURE(BM_keySwitch, tiny_params, tiny_params)->Apply(sweep);
+BENCHMARK_CAPTURE(BM_keySwitch, p2_params, p2_params)->Apply(sweep);
+BENCHMARK_CAPTURE(BM_batchedKeySwitch, tiny_params, tiny_params)->Apply(sweep);
+BENCHMARK_CAPTURE(BM_batchedKeySwitch, p2_params, p2_params)->Apply(sweep);
+
+} // namespace
@@ -34,6 +34,7 @@
 #include <helib/NumbTh.h>
 #include <helib/PAlgebra.h>
 #include <helib/bluestein.h>
+#include <helib/primeFactorFFT.h>
 #include <helib/ClonedPtr.h>
 
 namespace helib {
@@ -85,14 +86,21 @@ private:
   NTL::Vec<NTL::mulmod_precon_t> ipowers_aux;
   CopiedPtr<NTL::fftRep> iRb;
 
+  // Good-Thomas transforms over coprime factors of m, for the odd m where
+  // they beat BluesteinFFT (null otherwise)
+  CopiedPtr<PrimeFactorFFT> pfa;
+  CopiedPtr<PrimeFactorFFT> ipfa;
+
   // PhimX modulo q, for faster division w/ remainder
   CopiedPtr<zz_pXModulus1> phimx;
 
   // Allocate memory and compute roots
   void privateInit(const PAlgebra&, long rt);
 
-  // auxiliary routine used by the two FFT routines
-  void FFT_aux(NTL::vec_long& y, NTL::zz_pX& tmp) const;
+  // auxiliary routines used by the FFT routines, they expect the zp context
+  // to be set already
+  void FFT_aux(long* y, NTL::zz_pX& tmp) const;
+  void iFFT_aux(NTL::zz_pX& x, const long* y) const;
 
 public:
 #ifdef HELIB_OPENCL
@@ -130,6 +138,13 @@ public:
   //! @brief Restore NTL's current modulus
   void restoreModulus() const { context.restore(); }
 
+  //! @brief Take the FFTs as multi-dimensional ones over the given pairwise
+  //! coprime factors of m (see primeFactorFFT.h), or with BluesteinFFT if
+  //! factors is empty. The constructor picks factors itself when it expects
+  //! them to be faster.
+  //! @throws InvalidArgument if m is even or the factors do not multiply to m
+  void setPrimeFactors(const std::vector<long>& factors);
+
   // FFT routines
 
   // sets zp context internally
@@ -140,10 +155,26 @@ public:
   // y = FFT(x)
   void FFT(NTL::vec_long& y, NTL::zz_pX& x) const;
 
+  // The same, writing the phi(m) entries of y to a caller-provided buffer
+  void FFT(long* y, const NTL::ZZX& x) const;
+  void FFT(long* y, const zzX& x) const;
+  void FFT(long* y, NTL::zz_pX& x) const;
+
 
   // expects zp context to be set externally
   // x = FFT^{-1}(y)
   void iFFT(NTL::zz_pX& x, const NTL::vec_long& y) const;
+  // The same, reading the phi(m) entries of y from a buffer
+  void iFFT(NTL::zz_pX& x, const long* y) const;
+
+  //! @brief Batched transforms: y[t] = FFT(x[t]) for all t < n. The zp
+  //! context is set once for the whole batch, and the tables of this modulus
+  //! stay in cache from one polynomial to the next
+  void FFT(long* const* y, const NTL::ZZX* const* x, long n) const;
+  void FFT(long* const* y, const zzX* const* x, long n) const;
+
+  //! @brief Batched inverse transforms: x[t] = FFT^{-1}(y[t]) for all t < n
+  void iFFT(NTL::zz_pX* x, const long* const* y, long n) const;
 
   // returns thread-local scratch space
   // DIRT: this zz_pX is used for several zz_p moduli,
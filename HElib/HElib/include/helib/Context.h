@@ -15,7 +15,9 @@
  * @file Context.h
  * @brief Keeps the parameters of an instance of the cryptosystem
  **/
+#include <map>
 #include <optional>
+#include <unordered_map>
 #include <helib/PAlgebra.h>
 #include <helib/CModulus.h>
 #include <helib/IndexSet.h>
@@ -26,6 +28,7 @@
 #include <helib/range.h>
 #include <helib/scheme.h>
 #include <helib/JsonWrapper.h>
+#include <helib/multicore.h>
 
 #include <NTL/Lazy.h>
 
@@ -88,6 +91,11 @@ long FindM(long k,
 
 class EncryptedArray;
 struct PolyModRing;
+class RefreshPolicy;
+struct TuningProfile;
+class ResidueBackend;
+struct ModDownTable;
+struct CRTTable;
 
 // Forward declaration of ContextBuilder
 template <typename SCHEME>
@@ -122,6 +130,23 @@ private:
   // The structure of Zm*.
   PAlgebra zMStar;
 
+  // The tables of getAutomorphPerm, keyed by k mod m. Entries are never
+  // erased, so references to them stay valid.
+  mutable HELIB_SHARED_MUTEX_TYPE automorphPermsMutex;
+  mutable std::unordered_map<long, std::vector<long>> automorphPerms;
+
+  // The tables of getModDownTable, keyed by (p, dropped primes, -1, kept
+  // primes). Entries are never erased either.
+  mutable HELIB_SHARED_MUTEX_TYPE modDownTablesMutex;
+  mutable std::map<std::vector<long>, std::shared_ptr<const ModDownTable>>
+      modDownTables;
+
+  // The tables of getCRTTable, keyed by the indexes of the primes. Entries
+  // are never erased either.
+  mutable HELIB_SHARED_MUTEX_TYPE crtTablesMutex;
+  mutable std::map<std::vector<long>, std::shared_ptr<const CRTTable>>
+      crtTables;
+
   // Parameters stored in alMod.
   // These are NOT invariant: it is possible to work
   // with View objects that use a different PAlgebra object.
@@ -138,6 +163,9 @@ private:
   long e_param = 0;   // parameters specific to bootstrapping
   long ePrime_param = 0;
 
+  // The largest size of the primes of the chain built by buildModChain
+  long maxPrimeBits = HELIB_SP_NBITS;
+
   std::shared_ptr<const PowerfulDCRT> pwfl_converter;
 
   // The structure of a single slot of the plaintext space.
@@ -185,6 +213,18 @@ private:
   // Bootstrapping-related data in the context includes both thin and thick
   ThinRecryptData rcData;
 
+  // Bootstraps the operands of products when they need it, if set
+  std::shared_ptr<const RefreshPolicy> refreshPolicy;
+
+  // Runs the element-wise kernels of the DoubleCRTs, if set
+  std::shared_ptr<const ResidueBackend> residueBackend;
+
+  // The strategy thresholds measured on this host, if set
+  std::shared_ptr<const TuningProfile> tuningProfile;
+
+  // The execution resources of the bootstraps and linear maps
+  ExecutionPolicy executionPolicy;
+
   // Helper for serialisation.
   static SerializableContent readParamsFrom(std::istream& str);
 
@@ -197,11 +237,13 @@ private:
   // r BGV: The Hensel lifting parameter. CKKS: The bit precision.
   // gens The generators of `(Z/mZ)^*` (other than `p`).
   // ords The orders of each of the generators of `(Z/mZ)^*`.
+  // tables The tables of `alMod`, computed if null.
   Context(unsigned long m,
           unsigned long p,
           unsigned long r,
           const std::vector<long>& gens = std::vector<long>(),
-          const std::vector<long>& ords = std::vector<long>());
+          const std::vector<long>& ords = std::vector<long>(),
+          const PAlgebraTables* tables = nullptr);
 
   // Used by ContextBuilder
   Context(long m,
@@ -212,13 +254,21 @@ private:
           const std::optional<ModChainParams>& mparams,
           const std::optional<BootStrapParams>& bparams);
 
-  // Used for serialisation
-  Context(const SerializableContent& content);
+  // Used for serialisation. The recryption data of a bootstrappable context
+  // is read from bootstrapBundle if it is not null, see
+  // enableBootStrappingFrom, and computed otherwise.
+  Context(const SerializableContent& content,
+          std::istream* bootstrapBundle = nullptr);
+
+  // The recryption data part of a bootstrap bundle, which follows the
+  // tables of alMod
+  void readRecryptDataFrom(std::istream& str);
 
   // Methods for adding primes.
   void addSpecialPrimes(long nDgts,
                         bool willBeBootstrappable,
-                        long bitsInSpecialPrimes);
+                        long bitsInSpecialPrimes,
+                        bool polyfunction = false);
 
   void addCtxtPrimes(long nBits, long targetSize);
 
@@ -236,6 +286,13 @@ private:
   // q The prime to add.
   void addSpecialPrime(long q);
 
+  // Append the Cmodulus objects of the primes qs to the chain, built in
+  // parallel, and return the index of the first one.
+  long addModuli(const std::vector<long>& qs);
+
+  // Add the given primes to the chain and to the set primes.
+  void addPrimes(const std::vector<long>& qs, IndexSet& primes);
+
 public:
   /**
    * @brief Class label to be added to JSON serialization as object type
@@ -365,12 +422,111 @@ public:
    **/
   const IndexSet& getDigit(long i) const { return digits[i]; }
 
+  /**
+   * @brief The special primes needed to key-switch a ciphertext with the
+   * primes in `s`.
+   * @param s The (ciphertext) primes of the ciphertext.
+   * @return The shortest prefix of the special primes whose product exceeds
+   * that of `s` by as much as the full special primes exceed the largest
+   * digit, or all the special primes if `s` spans more than the first digit.
+   * @note Switching with fewer special primes needs matrices generated for
+   * them, see `SecKey::GenLevelKeySWmatrices`.
+   **/
+  IndexSet specialPrimesForLevel(const IndexSet& s) const;
+
   /**
    * @brief Getter method for a recryption data object.
    * @return A `const` reference to the recryption data object.
    **/
   const ThinRecryptData& getRcData() const { return rcData; }
 
+  /**
+   * @brief Attach a policy that bootstraps the operands of the products of
+   * the ciphertexts of this `Context` when they need it (see
+   * refreshPolicy.h), or detach it with `nullptr`.
+   * @param policy The policy.
+   * @note Not thread safe: set the policy before computing with the
+   * `Context`.
+   **/
+  void setRefreshPolicy(std::shared_ptr<const RefreshPolicy> policy)
+  {
+    refreshPolicy = std::move(policy);
+  }
+
+  /**
+   * @brief Getter method for the refresh policy.
+   * @return The policy attached to this `Context`, `nullptr` if none is.
+   **/
+  const RefreshPolicy* getRefreshPolicy() const { return refreshPolicy.get(); }
+
+  /**
+   * @brief Attach the strategy thresholds to use with this `Context` (see
+   * autotune.h), or detach them with `nullptr` to use the built-in ones.
+   * @param profile The thresholds.
+   * @note Not thread safe: set the profile before computing with the
+   * `Context`.
+   **/
+  void setTuningProfile(std::shared_ptr<const TuningProfile> profile)
+  {
+    tuningProfile = std::move(profile);
+  }
+
+  /**
+   * @brief Getter method for the tuning profile.
+   * @return The profile attached to this `Context`, `nullptr` if none is.
+   **/
+  const TuningProfile* getTuningProfile() const { return tuningProfile.get(); }
+
+  /**
+   * @brief Set the execution resources (see multicore.h) of the bootstraps
+   * and linear maps of this `Context` whose caller did not install a policy
+   * of its own, e.g. fewer threads for the `Context` of a background batch
+   * job. The default policy leaves those of the caller.
+   * @param policy The policy.
+   * @note Not thread safe: set the policy before computing with the
+   * `Context`.
+   **/
+  void setExecutionPolicy(const ExecutionPolicy& policy)
+  {
+    executionPolicy = policy;
+  }
+
+  /**
+   * @brief Getter method for the execution policy.
+   * @return The policy set with setExecutionPolicy.
+   **/
+  const ExecutionPolicy& getExecutionPolicy() const { return executionPolicy; }
+
+  //! @brief The policy installed on the calling thread, else the one set
+  //! with setExecutionPolicy, which the entry points of the bootstraps and
+  //! linear maps install for their loops
+  ExecutionPolicy effectiveExecutionPolicy() const
+  {
+    return ExecutionPolicy::current().orElse(executionPolicy);
+  }
+
+  /**
+   * @brief Attach a backend that runs the element-wise kernels of the
+   * `DoubleCRT`s of this `Context` (see residueBackend.h), or detach it with
+   * `nullptr` to use the built-in loops.
+   * @param backend The backend.
+   * @note Not thread safe: set the backend before computing with the
+   * `Context`.
+   **/
+  void setResidueBackend(std::shared_ptr<const ResidueBackend> backend)
+  {
+    residueBackend = std::move(backend);
+  }
+
+  /**
+   * @brief Getter method for the residue backend.
+   * @return The backend attached to this `Context`, `nullptr` if none is.
+   **/
+  const ResidueBackend* getResidueBackend() const
+  {
+    return residueBackend.get();
+  }
+
   /**
    * @brief Return whether this is a CKKS context or not `Context`.
    * @return A `bool`, `true` if the `Context` object uses CKKS scheme false
@@ -409,6 +565,37 @@ public:
    **/
   const PAlgebraMod& getAlMod() const { return alMod; };
 
+  /**
+   * @brief The evaluation-domain permutation of the automorphism X -> X^k:
+   * entry j of the image of a DoubleCRT row is entry perm[j] of the row.
+   * The table is the same for all the primes, it is computed on first use
+   * and kept for the lifetime of the context.
+   * @param k An element of Zm*.
+   * @return A reference to the phi(m) entries of the table.
+   **/
+  const std::vector<long>& getAutomorphPerm(long k) const;
+
+  /**
+   * @brief The RNS constants of modulus switching from the primes in
+   * `dropped | kept` down to those in `kept`, with plaintext space
+   * `ptxtSpace` (see `DoubleCRT::scaleDownToSet`). They are computed on first
+   * use and kept for the lifetime of the context.
+   **/
+  const ModDownTable& getModDownTable(const IndexSet& dropped,
+                                      const IndexSet& kept,
+                                      long ptxtSpace) const;
+
+  /**
+   * @brief The CRT constants of the primes in `s`: their product, the
+   * products of all but one of them and the inverses of these modulo the
+   * left-out prime (see `DoubleCRT::toPolys`, `DoubleCRT::scaleToModulus`
+   * and `Ctxt::rawModSwitch`). They are computed on first use and kept for
+   * the lifetime of the context, so they are meant for the few prime sets
+   * that recur, such as the ciphertext and special primes and the levels of
+   * bootstrapping, rather than for `productOfPrimes` in general.
+   **/
+  const CRTTable& getCRTTable(const IndexSet& s) const;
+
   /**
    * @brief Getter method returning the default `view` object of the created
    * `context`.
@@ -454,6 +641,16 @@ public:
 
   //=======================================
 
+  /**
+   * @brief The smallest scale for which phim * erfc(scale/sqrt(2)) <= prob,
+   * i.e., for which the high-probability bounds below fail with probability
+   * at most prob.
+   * @param prob The failure probability, in (0, 1).
+   * @param phim The number of random variables of the union bound.
+   * @return The scale parameter.
+   **/
+  static double scaleForFailureProbability(double prob, long phim);
+
   // Assume the polynomial f(x) = sum_{i < k} f_i x^i is chosen so
   // that each f_i is chosen uniformly and independently from the
   // interval [-magBound, magBound], and that k = degBound.
@@ -689,18 +886,77 @@ public:
    * Default is false.
    * @param alsoThick Flag for initialising additional information needed for
    * thick bootstrapping. Default is true.
+   * @param usedSlots The number of slots that the thin bootstrapped
+   * ciphertexts use, from slot 0 (see `ThinRecryptData::init`). Default is
+   * 0, for all of them.
+   * @param cacheBudget With `build_cache`, the bytes that the `DoubleCRT`
+   * constants of the linear maps may add to the compact ones they replace,
+   * the thin maps first. The constants that do not fit are encoded again
+   * every time they are used. Default is -1, for no limit.
+   * @param lazy Flag for building the linear maps and the other
+   * precomputations on their first use (see `RecryptData::lazy`), for
+   * processes that only run some stages of bootstrapping. Default is false.
    **/
   void enableBootStrapping(const NTL::Vec<long>& mvec,
                            bool build_cache = false,
-                           bool alsoThick = true)
+                           bool alsoThick = true,
+                           long usedSlots = 0,
+                           long cacheBudget = -1,
+                           bool lazy = false)
   {
     assertTrue(e_param > 0,
                "enableBootStrapping invoked but willBeBootstrappable "
                "not set in buildModChain");
 
-    rcData.init(*this, mvec, alsoThick, build_cache);
+    rcData.init(*this,
+                mvec,
+                alsoThick,
+                build_cache,
+                false,
+                usedSlots,
+                cacheBudget,
+                lazy);
   }
 
+  /**
+   * @brief Take the FFTs of all the primes of the chain as multi-dimensional
+   * ones over the hypercube of the pairwise coprime factors in `mvec` (see
+   * primeFactorFFT.h), with the slices of every dimension transformed in
+   * parallel, instead of one `BluesteinFFT` per prime. The `mvec` of a
+   * bootstrappable context is such a factorization. Primes added to the chain
+   * later keep their own choice.
+   * @param mvec Pairwise coprime factors of an odd `m`, or an empty vector to
+   * go back to the default choice of every prime.
+   * @throws InvalidArgument if `m` is even or `mvec` does not multiply to it.
+   **/
+  void useFactoredFFT(const NTL::Vec<long>& mvec);
+
+  /**
+   * @brief Write out the recryption data of a bootstrappable `Context`, i.e.
+   * the encoded matrices of its linear maps and its other precomputed
+   * constants, in a versioned binary format. The factorizations of
+   * `Phi_m(X)` of the context and of the recryption data are written too
+   * (see `PAlgebraTables`), so that reading the context back with the bundle
+   * does not compute them.
+   * @param str Output `std::ostream`.
+   * @note Reading the bundle back with `enableBootStrappingFrom` takes a
+   * fraction of the time of `enableBootStrapping`, most of it spent
+   * converting the constants to `DoubleCRT` again when the bundle was written
+   * with a cache.
+   **/
+  void writeBootstrapBundleTo(std::ostream& str) const;
+
+  /**
+   * @brief Initialises the recryption data from a bundle written by
+   * `writeBootstrapBundleTo` for a `Context` with the same parameters,
+   * including the values of `mvec`, `build_cache` and `alsoThick` it was
+   * enabled with.
+   * @param str Input `std::istream`.
+   * @throws IOError if the bundle is corrupt or was written for other
+   * parameters.
+   **/
+  void enableBootStrappingFrom(std::istream& str);
+
   /**
    * @brief Check if a `Context` is bootstrappable.
    * @return `true` if recryption data is found, `false` otherwise.
@@ -952,6 +1208,27 @@ public:
    **/
   static Context* readPtrFrom(std::istream& str);
 
+  /**
+   * @brief Read from the stream the serialized `Context` object in binary
+   * format, taking its recryption data from a bundle written by
+   * `writeBootstrapBundleTo` rather than computing it.
+   * @param str Input `std::istream`.
+   * @param bootstrapBundle Input `std::istream` of the bundle.
+   * @return The deserialized `Context` object.
+   **/
+  static Context readFrom(std::istream& str, std::istream& bootstrapBundle);
+
+  /**
+   * @brief Read from the stream the serialized `Context` object in binary
+   * format, taking its recryption data from a bundle written by
+   * `writeBootstrapBundleTo` rather than computing it.
+   * @param str Input `std::istream`.
+   * @param bootstrapBundle Input `std::istream` of the bundle.
+   * @return Raw pointer to the deserialized `Context` object.
+   **/
+  static Context* readPtrFrom(std::istream& str,
+                              std::istream& bootstrapBundle);
+
   /**
    * @brief Write out the `Context` object to the output stream using JSON
    * format.
@@ -1015,13 +1292,22 @@ public:
    * is 3.
    * @param bitsInSpecialPrimes The bit size of the special primes in the
    *modulus chain. Default is 0.
+   * @param polyfunction Choose e and e' for the polyfunction digit
+   *extraction (`our_version`) of thin bootstrapping rather than the built-in
+   *one, see RecryptData::setAE. Default is `false`.
+   * @param primeBits The largest size of the primes, between 30 and
+   *`HELIB_SP_NBITS`, 0 for `HELIB_SP_NBITS`. With primes below 2^31 the
+   *chain has about twice as many primes, and the element-wise kernels
+   *reduce with less work (see NarrowResidueBackend). Default is 0.
    **/
   void buildModChain(long nBits,
                      long nDgts = 3,
                      bool willBeBootstrappable = false,
                      long skHwt = 0,
                      long resolution = 3,
-                     long bitsInSpecialPrimes = 0);
+                     long bitsInSpecialPrimes = 0,
+                     bool polyfunction = false,
+                     long primeBits = 0);
 
   // should be called if after you build the mod chain in some way
   // *other* than calling buildModChain.
@@ -1075,16 +1361,20 @@ private:
   long skHwt_ = 0;
   long resolution_ = 3;
   long bitsInSpecialPrimes_ = 0;
+  long primeBits_ = 0; // 0 means HELIB_SP_NBITS
   bool buildModChainFlag_ = true; // Default build the modchain.
 
   double stdev_ = 3.2;
   double scale_ = 10;
+  double failureProb_ = 0; // if positive, overrides scale_
 
   // Boostrap params (BGV only)
   NTL::Vec<long> mvec_;
   bool buildCacheFlag_ = false;
   bool thickFlag_ = false;
   bool bootstrappableFlag_ = false; // Default not boostrappable.
+  bool polyfunctionFlag_ = false;   // Default built-in digit extraction.
+  bool lazyRecryptDataFlag_ = false; // Default recryption data built at once.
 
 public:
   /**
@@ -1154,6 +1444,24 @@ public:
   ContextBuilder& scale(double scale)
   {
     scale_ = scale;
+    failureProb_ = 0;
+    return *this;
+  }
+
+  /**
+   * @brief Sets `scale` from a target failure probability of the noise
+   * bounds, see `Context::scaleForFailureProbability`. The default scale of
+   * 10 corresponds to about 2^{-75} per coefficient; a larger probability
+   * gives smaller noise estimates, hence fewer primes dropped by the modulus
+   * switches and smaller special primes.
+   * @param prob The failure probability, in (0, 1).
+   * @return Reference to the `ContextBuilder` object.
+   **/
+  ContextBuilder& failureProbability(double prob)
+  {
+    assertTrue<InvalidArgument>(prob > 0.0 && prob < 1.0,
+                                "Failure probability must be in (0, 1)");
+    failureProb_ = prob;
     return *this;
   }
 
@@ -1252,6 +1560,21 @@ public:
     return *this;
   }
 
+  /**
+   * @brief Sets the largest size of the primes in the modulus chain.
+   * @param bits The size, between 30 and `HELIB_SP_NBITS`.
+   * @return Reference to this `ContextBuilder` object.
+   * @note With 30- or 31-bit primes the chain has about twice as many
+   * primes, and the `DoubleCRT` element-wise kernels reduce with less work,
+   * e.g. only every third term of a key-switching inner product (see
+   * NarrowResidueBackend). The residues are still stored in 64 bits.
+   **/
+  ContextBuilder& primeBits(long bits)
+  {
+    primeBits_ = bits;
+    return *this;
+  }
+
   /**
    * @brief Sets a flag determining whether the modulus chain will be built.
    * @param `yesno` A `bool` to determine whether the modulus chain should be
@@ -1350,6 +1673,41 @@ public:
     return *this;
   }
 
+  /**
+   * @brief Sets a flag determining if e and e' are chosen for the
+   * polyfunction digit extraction (`our_version`) of thin bootstrapping.
+   * @param yesno A `bool` to determine whether the polyfunction cost model
+   * is used.
+   * @return Reference to this `ContextBuilder` object.
+   * @note Only has an effect on bootstrappable contexts.
+   * @note Only exists when the `SCHEME` is `BGV`.
+   **/
+  template <typename S = SCHEME,
+            std::enable_if_t<std::is_same<S, BGV>::value>* = nullptr>
+  ContextBuilder& polyfunction(bool yesno = true)
+  {
+    polyfunctionFlag_ = yesno;
+    return *this;
+  }
+
+  /**
+   * @brief Sets a flag determining if the linear maps and the other
+   * precomputations of bootstrapping are built on their first use rather
+   * than with the context (see `RecryptData::lazy`).
+   * @param yesno A `bool` to determine whether the recryption data is built
+   * lazily.
+   * @return Reference to this `ContextBuilder` object.
+   * @note Only has an effect on bootstrappable contexts.
+   * @note Only exists when the `SCHEME` is `BGV`.
+   **/
+  template <typename S = SCHEME,
+            std::enable_if_t<std::is_same<S, BGV>::value>* = nullptr>
+  ContextBuilder& lazyRecryptData(bool yesno = true)
+  {
+    lazyRecryptDataFlag_ = yesno;
+    return *this;
+  }
+
   /**
    * @brief Builds a `Context` object from the arguments stored in the
    * `ContextBuilder` object.
@@ -74,6 +74,7 @@ class PubKey;
 class SecKey;
 
 class PtxtArray;
+class CtxtExpr;
 
 /**
  * @class SKHandle
@@ -329,6 +330,13 @@ public:
    **/
   JsonWrapper writeToJSON() const;
 
+  /**
+   * @brief Write out the ciphertext part (`CtxtPart`) object with the
+   * streaming JSON writer behind `writeToJSON(std::ostream&)`.
+   * @param w The writer.
+   **/
+  void writeToJSON(JsonStreamWriter& w) const;
+
   /**
    * @brief Read from the stream the serialized ciphertext part (`CtxtPart`)
    * object using JSON format.
@@ -354,6 +362,13 @@ public:
    **/
   void readJSON(std::istream& str);
 
+  /**
+   * @brief In-place read with the streaming JSON reader behind
+   * `readJSON(std::istream&)`.
+   * @param r The reader.
+   **/
+  void readJSON(JsonStreamReader& r);
+
   /**
    * @brief Read from the `JsonWrapper` the serialized ciphertext part
    *(`CtxtPart`) object.
@@ -372,6 +387,22 @@ struct ZeroCtxtLike_type
 const ZeroCtxtLike_type ZeroCtxtLike = ZeroCtxtLike_type();
 //! \endcond
 
+//! @brief When the products of a computation are relinearized. A ciphertext
+//! is in extended form when it has parts beyond (1,s), see
+//! Ctxt::inExtendedForm(). The operands of a product are always
+//! relinearized first, so extended forms never grow beyond s^2.
+enum class RelinPolicy
+{
+  //! Relinearize every product right away
+  Eager,
+  //! Leave products extended, the evaluator relinearizes the sums of them
+  //! it hands back to its caller
+  Lazy,
+  //! Leave products and the results of the evaluator extended, they are
+  //! relinearized when they next enter a product
+  Deferred
+};
+
 /**
  * @class Ctxt
  * @brief A Ctxt object holds a single ciphertext
@@ -400,6 +431,12 @@ class Ctxt
   friend class PubKey;
   friend class SecKey;
   friend class BasicAutomorphPrecon;
+  friend class CtxtExpr;
+  friend void linearCombination(Ctxt& result,
+                                const std::vector<const Ctxt*>& ctxts,
+                                const std::vector<const DoubleCRT*>& constants,
+                                const std::vector<double>& sizes);
+  friend void reLinearize(const std::vector<Ctxt*>& ctxts, long keyID);
 
   const Context& context;      // points to the parameters of this FHE instance
   const PubKey& pubKey;        // points to the public encryption key;
@@ -414,11 +451,27 @@ class Ctxt
   NTL::xdouble ratFactor; // rational factor to divide on decryption (for CKKS)
   NTL::xdouble ptxtMag;   // bound on the plaintext size (for CKKS)
 
+  // The seed that parts[1] was expanded from by a seeded secret-key
+  // encryption, zero otherwise. It may be stale once the parts change, so
+  // writeTo only uses it after checking that it still gives parts[1]
+  NTL::ZZ partSeed;
+
+  // Whether parts[1] is still the expansion of partSeed
+  bool hasSeededPart() const;
+
   // Create a tensor product of c1,c2. It is assumed that *this,c1,c2
   // are defined relative to the same set of primes and plaintext space,
   // and that *this DOES NOT point to the same object as c1,c2
   void tensorProduct(const Ctxt& c1, const Ctxt& c2);
 
+  // Multiply *this by other and relinearize the s^2 part of the product with
+  // W, without ever storing that part in the ciphertext. Both must be
+  // canonical BGV ciphertexts over the same primeSet (other may be *this).
+  void tensorProductRelin(const Ctxt& other, const KeySwitch& W);
+
+  // multLowLvl, followed by reLinearize() if relinearize is set
+  void multLowLvl(const Ctxt& other, bool destructive, bool relinearize);
+
   // Add/subtract a ciphertext part to/from a ciphertext. These are private
   // methods, they cannot update the noiseBound so they must be called
   // from a procedure that will eventually update that estimate.
@@ -480,7 +533,8 @@ class Ctxt
   void keySwitchPart(const CtxtPart& p, const KeySwitch& W);
 
   // internal procedure used in key-switching
-  void keySwitchDigits(const KeySwitch& W, std::vector<DoubleCRT>& digits);
+  void keySwitchDigits(const KeySwitch& W,
+                       const std::vector<DoubleCRT>& digits);
 
   long getPartIndexByHandle(const SKHandle& handle) const
   {
@@ -499,10 +553,19 @@ class Ctxt
   // different public keys.
   Ctxt& privateAssign(const Ctxt& other);
 
+  // Everything but the parts, for the assignments
+  void privateAssignScalars(const Ctxt& other);
+
   // explicitly multiply intFactor by e, which should be
   // in the interval [0, ptxtSpace)
   void mulIntFactor(long e);
 
+  // *this = (*this + c0 * other) / divisor in a single pass, for non-empty
+  // BGV ciphertexts with the same prime set and plaintext space, where
+  // c0 in (0, ptxtSpace). Does not touch ptxtSpace, intFactor is only
+  // adjusted for the harmonization with other.
+  void addScaledParts(const Ctxt& other, long c0, long divisor);
+
 public:
   /**
    * @brief Class label to be added to JSON serialization as object type
@@ -510,9 +573,13 @@ public:
    */
   static constexpr std::string_view typeName = "Ctxt";
 
-  // Default copy-constructor
+  // Default copy-constructor, the parts share their residues with other
+  // until one of them is written
   Ctxt(const Ctxt& other) = default;
 
+  // Moving takes over the parts of other
+  Ctxt(Ctxt&& other) = default;
+
   // VJS-FIXME: this was really a messy design choice to not
   // have ciphertext constructors that specify prime sets.
   // The default value of ctxtPrimes is kind of pointless.
@@ -541,6 +608,21 @@ public:
     return privateAssign(other);
   }
 
+  Ctxt& operator=(Ctxt&& other)
+  {
+    assertEq(&context,
+             &other.context,
+             "Cannot assign Ctxts with different context");
+    assertEq(&pubKey,
+             &other.pubKey,
+             "Cannot assign Ctxts with different pubKey");
+    if (this != &other) {
+      privateAssignScalars(other);
+      parts = std::move(other.parts);
+    }
+    return *this;
+  }
+
   bool operator==(const Ctxt& other) const { return equalsTo(other); }
   bool operator!=(const Ctxt& other) const { return !equalsTo(other); }
 
@@ -566,8 +648,33 @@ public:
     return *this;
   }
 
+  //! @brief Evaluate a lazy expression (see CtxtExpr.h) into *this, which
+  //! may be one of its ciphertexts
+  Ctxt& operator=(const CtxtExpr& expr);
+
+  //! @brief Add a lazy expression, same as *this = lazy(*this) + expr
+  Ctxt& operator+=(const CtxtExpr& expr);
+
   void addCtxt(const Ctxt& other, bool negative = false);
 
+  //! @brief Fused multiply-accumulate, *this += c * other.
+  //! Same result as multiplying a copy of other by c and adding it, but the
+  //! scalar multiplication and the addition are a single pass over the
+  //! DoubleCRT data when both ciphertexts have the same prime set and
+  //! plaintext space.
+  void addScaledCtxt(const Ctxt& other, const NTL::ZZ& c);
+  void addScaledCtxt(const Ctxt& other, long c)
+  {
+    addScaledCtxt(other, NTL::to_ZZ(c));
+  }
+
+  //! @brief Fused subtract-and-divide, same result as addCtxt(other, true)
+  //! followed by divideByP(), but in a single pass over the DoubleCRT data
+  //! when both ciphertexts have the same prime set and plaintext space.
+  //! As with divideByP(), *this - other must encrypt a polynomial which is
+  //! zero mod p, and the plaintext space is reduced from p^r to p^{r-1}.
+  void subtractAndDivideByP(const Ctxt& other);
+
   // Multiply by another ciphertext
   void multLowLvl(const Ctxt& other, bool destructive = false);
 
@@ -617,6 +724,7 @@ public:
   //! For the other variants, explicit bounds are computed (if not CKKS).
   void addConstant(const DoubleCRT& dcrt, double size = -1.0);
   void addConstant(const NTL::ZZX& poly, double size = -1.0);
+  void addConstant(const zzX& poly, double size = -1.0);
 
   /**
    * @brief Add a plaintext to this `Ctxt`.
@@ -718,9 +826,31 @@ public:
   //! explicitly computed bounds (if not CKKS).
   void multByConstant(const DoubleCRT& dcrt, double size = -1.0);
 
+  //! Multiply-by-constant, using the precomputed Shoup companions of a
+  //! constant that is used many times. The prime set of dcrtPrecon must
+  //! contain the prime set of *this.
+  void multByConstant(const DoubleCRT& dcrt,
+                      const DoubleCRTPrecon& dcrtPrecon,
+                      double size = -1.0);
+
   void multByConstant(const NTL::ZZX& poly, double size = -1.0);
   void multByConstant(const zzX& poly, double size = -1.0);
 
+  //! The Shoup companions of the parts, for a ciphertext that is used many
+  //! times as a fixed operand
+  std::vector<DoubleCRTPrecon> partsPrecon() const;
+
+  //! Set *this to ekey*a + b, the same as
+  //!   *this = ekey; multByConstant(a); addConstant(b);
+  //! but a and b are encoded in one batch of transforms and every part is
+  //! written in one pass over the residues, parallel over the primes. This
+  //! is the inner product with the bootstrapping key. ekeyPrecon holds the
+  //! Shoup companions of the parts of ekey, or is empty.
+  void setToInnerProduct(const Ctxt& ekey,
+                         const std::vector<DoubleCRTPrecon>& ekeyPrecon,
+                         const zzX& a,
+                         const zzX& b);
+
   //=========== new multByConstant interface =========
 
   /**
@@ -741,6 +871,13 @@ public:
    * `helib::DoubleCRT` data.
    **/
   void multByConstant(const FatEncodedPtxt& ptxt);
+  /**
+   * @brief Multiply a `Ctxt` with a specified plaintext constant.
+   * @param ptxt The constant to multiply as a `PreparedPtxt` object.
+   * @note `PreparedPtxt` keeps the `helib::DoubleCRT` form of the constant
+   * for the prime set of `*this`, for the next uses.
+   **/
+  void multByConstant(const PreparedPtxt& ptxt);
 
   /**
    * @brief Multiply a `Ctxt` with an `NTL::ZZ` scalar.
@@ -799,6 +936,19 @@ public:
     return *this;
   }
 
+  /**
+   * @brief Times equals operator with a plaintext constant.
+   * @param ptxt Right hand side of multiplication.
+   * @return Reference to `*this` post multiplication.
+   * @note `PreparedPtxt` keeps the `helib::DoubleCRT` form of the constant
+   * for the prime set of `*this`, for the next uses.
+   **/
+  Ctxt& operator*=(const PreparedPtxt& ptxt)
+  {
+    multByConstant(ptxt);
+    return *this;
+  }
+
   /**
    * @brief Times equals operator with an `NTL::ZZ` scalar.
    * @param ptxt Right hand side of multiplication.
@@ -874,6 +1024,15 @@ public:
    * `helib::DoubleCRT` data.
    **/
   void addConstant(const FatEncodedPtxt& ptxt, bool neg = false);
+  /**
+   * @brief Add to a `Ctxt` a specified plaintext constant.
+   * @param ptxt The constant to add as a `PreparedPtxt` object.
+   * @param neg Flag to specify if the constant is negative. Default is
+   * `false`.
+   * @note `PreparedPtxt` keeps the `helib::DoubleCRT` form of the constant
+   * for the prime set of `*this`, for the next uses.
+   **/
+  void addConstant(const PreparedPtxt& ptxt, bool neg = false);
 
   /**
    * @brief Add to a `Ctxt` an `NTL::ZZ` scalar.
@@ -940,6 +1099,19 @@ public:
     return *this;
   }
 
+  /**
+   * @brief Plus equals operator with plaintext constant.
+   * @param ptxt Right hand side of addition.
+   * @return Reference to `*this` post addition.
+   * @note `PreparedPtxt` keeps the `helib::DoubleCRT` form of the constant
+   * for the prime set of `*this`, for the next uses.
+   **/
+  Ctxt& operator+=(const PreparedPtxt& ptxt)
+  {
+    addConstant(ptxt);
+    return *this;
+  }
+
   /**
    * @brief Plus equals operator with an `NTL::ZZ` scalar.
    * @param ptxt Right hand side of addition.
@@ -1020,6 +1192,19 @@ public:
     return *this;
   }
 
+  /**
+   * @brief Minus equals operator with plaintext constant.
+   * @param ptxt Right hand side of subtraction.
+   * @return Reference to `*this` post subtraction.
+   * @note `PreparedPtxt` keeps the `helib::DoubleCRT` form of the constant
+   * for the prime set of `*this`, for the next uses.
+   **/
+  Ctxt& operator-=(const PreparedPtxt& ptxt)
+  {
+    addConstant(ptxt, true);
+    return *this;
+  }
+
   /**
    * @brief Minus equals operator with an `NTL::ZZ` scalar.
    * @param ptxt Right hand side of subtraction.
@@ -1225,9 +1410,20 @@ public:
   void divideBy2();
   void extractBits(std::vector<Ctxt>& bits, long nBits2extract = 0);
 
-  // Higher-level multiply routines
+  // Higher-level multiply routines. The refresh policy of the context, if
+  // any, first bootstraps the operands that need it (see refreshPolicy.h)
   void multiplyBy(const Ctxt& other);
-  void customMultiplyBy(Ctxt& other, bool lazy);
+  //! @brief Multiply by other, relinearizing the product unless the policy is
+  //! not Eager. An extended other is relinearized in a copy, so callers that
+  //! own other should use customMultiplyBy() instead.
+  void multiplyBy(const Ctxt& other, RelinPolicy policy);
+  //! @brief Same as multiplyBy(other, policy), but an extended other is
+  //! relinearized in place
+  void customMultiplyBy(Ctxt& other, RelinPolicy policy);
+  void customMultiplyBy(Ctxt& other, bool lazy)
+  {
+    customMultiplyBy(other, lazy ? RelinPolicy::Lazy : RelinPolicy::Eager);
+  }
   void multiplyBy2(const Ctxt& other1, const Ctxt& other2);
   void square() { multiplyBy(*this); }
   void cube() { multiplyBy2(*this, *this); }
@@ -1285,6 +1481,22 @@ public:
   double naturalSize() const;       //! "natural size" is size before squaring
   IndexSet naturalPrimeSet() const; //! the corresponding primeSet
 
+  //! @brief Mod-switch down to naturalPrimeSet() if it is a proper subset of
+  //! the current prime set. This is where the next multiplication would
+  //! drop to anyway, so the capacity is unchanged, but the operations before
+  //! it run on fewer primes. It never adds primes, and does nothing if the
+  //! noise is already close to the mod-switching added noise.
+  void dropToNaturalPrimeSet();
+
+  //! @brief Mod-switch down to the smallest set of primes that still leaves
+  //! room for decryption, with a bit to spare, dropping the largest primes
+  //! first. For CKKS the set is also large enough that the switch costs less
+  //! than a bit of precision. Nothing but decryption can follow; this is
+  //! meant for ciphertexts that are sent back to the owner of the key, see
+  //! writeCompactTo(). Does nothing if the ciphertext is too noisy to
+  //! decrypt already.
+  void dropToDecryptionPrimeSet();
+
   //! @brief drop all smallPrimes and specialPrimes, adding ctxtPrimes
   //! as necessary to ensure that the scaled noise is above the
   //! modulus-switching added noise term.
@@ -1336,6 +1548,11 @@ public:
   //! additive mod switching noise)
   double rawModSwitch(std::vector<NTL::ZZX>& zzParts, long toModulus) const;
 
+  //! @brief The same, returning the parts as zzX'es. When m is a prime power
+  //! the parts are scaled directly from their residues in word-size
+  //! arithmetic, with no multi-precision CRT.
+  double rawModSwitch(std::vector<zzX>& zzParts, long toModulus) const;
+
   //! @brief compute the power X,X^2,...,X^n
   //  void computePowers(std::vector<Ctxt>& v, long nPowers) const;
 
@@ -1370,6 +1587,17 @@ public:
     return true;
   }
 
+  //! @brief Has parts beyond (1,s), i.e. needs a relinearization
+  bool inExtendedForm(long keyID = 0) const
+  {
+    return !inCanonicalForm(keyID);
+  }
+
+  //! @brief Highest power of s(X) that the parts point to: 0 for an empty
+  //! ciphertext, 1 for a canonical one, -1 if some part is not a power of
+  //! s(X) (e.g. after a raw automorphism)
+  long getPowerOfS() const;
+
   //! @brief Would this ciphertext be decrypted without errors?
   bool isCorrect() const;
 
@@ -1410,9 +1638,24 @@ public:
   /**
    * @brief Write out the `Ctxt` object in binary format.
    * @param str Output `std::ostream`.
+   * @note A ciphertext from a seeded secret-key encryption (see
+   * `SecKey::setSeededEncryption`) whose part relative to s is unchanged is
+   * written as its other part and the seed of that one, in about half the
+   * space. `read` expands the seed again.
    **/
   void writeTo(std::ostream& str) const;
 
+  /**
+   * @brief Write out a copy of the `Ctxt` object that is mod-switched by
+   * `dropToDecryptionPrimeSet`, with every residue packed into the bit
+   * width of its prime.
+   * @param str Output `std::ostream`.
+   * @note This is for shipping results that only remain to be decrypted: it
+   * keeps no capacity for further operations. `read` reads it like any other
+   * ciphertext.
+   **/
+  void writeCompactTo(std::ostream& str) const;
+
   /**
    * @brief Read from the stream the serialized `Ctxt` object in binary format.
    * @param str Input `std::istream`.
@@ -1431,6 +1674,8 @@ public:
    * @brief Write out the ciphertext (`Ctxt`) object to the output
    * stream using JSON format.
    * @param str Output `std::ostream`.
+   * @note The residues are written as they are, without building a JSON
+   * tree; see `jsonBase64Residues` for a denser form of them.
    **/
   void writeToJSON(std::ostream& str) const;
 
@@ -1440,6 +1685,13 @@ public:
    **/
   JsonWrapper writeToJSON() const;
 
+  /**
+   * @brief Write out the ciphertext (`Ctxt`) object with the streaming JSON
+   * writer behind `writeToJSON(std::ostream&)`.
+   * @param w The writer.
+   **/
+  void writeToJSON(JsonStreamWriter& w) const;
+
   /**
    * @brief Read from the stream the serialized ciphertext (`Ctxt`) object using
    * JSON format.
@@ -1462,6 +1714,8 @@ public:
    * @brief In-place read from the `str` `std::istream` the serialized
    * ciphertext (`Ctxt`) object.
    * @param j The `JsonWrapper` containing the serialized `Ctxt` object.
+   * @note The stream is parsed as it is read, and the residues go straight
+   * into the parts.
    **/
   void readJSON(std::istream& str);
 
@@ -1472,6 +1726,13 @@ public:
    **/
   void readJSON(const JsonWrapper& j);
 
+  /**
+   * @brief In-place read with the streaming JSON reader behind
+   * `readJSON(std::istream&)`.
+   * @param r The reader.
+   **/
+  void readJSON(JsonStreamReader& r);
+
   // scale up c1, c2 so they have the same ratFactor
   static void equalizeRationalFactors(Ctxt& c1, Ctxt& c2);
 
@@ -1484,15 +1745,31 @@ public:
                                    NTL::ZZX& noise) const;
 };
 
-// set out=prod_{i=0}^{n-1} v[j], takes depth log n and n-1 products
-// out could point to v[0], but having it pointing to any other v[i]
-// will make the result unpredictable.
+// set out=prod_{i=0}^{n-1} v[j], takes depth log n and n-1 products, the
+// independent ones in parallel. out may point to any of the v[i].
 void totalProduct(Ctxt& out, const std::vector<Ctxt>& v);
 
+//! @brief out = the product of the factors, as a tree ordered by capacity
+//! (level and noise): every round sorts the operands by capacity and
+//! multiplies them pairwise, the highest two first, so with k factors of
+//! similar capacity the depth is ceil(log2 k), and a factor with less
+//! capacity is multiplied last. The products of a round are made in
+//! parallel and left extended unless the policy is Eager; the result is
+//! relinearized unless it is Deferred. out may point to any factor, an
+//! empty factor gives an empty product and no factors leave out unchanged.
+void levelOrderedProduct(Ctxt& out,
+                         const std::vector<const Ctxt*>& factors,
+                         RelinPolicy policy = RelinPolicy::Lazy);
+
 //! For i=n-1...0, set v[i]=prod_{j<=i} v[j]
-//! This implementation uses depth log n and (nlog n)/2 products
+//! This implementation uses depth log n and (nlog n)/2 products, the
+//! independent ones in parallel, in place
 void incrementalProduct(std::vector<Ctxt>& v);
 
+//! @brief result = sum_i v1[i] * v2[i] with a single relinearization: the
+//! operands are dropped to their lowest natural level, the 3-part tensor
+//! products are made in parallel with multLowLvl, added up as a tree and
+//! relinearized once. Empty ciphertexts count as zero.
 void innerProduct(Ctxt& result,
                   const std::vector<Ctxt>& v1,
                   const std::vector<Ctxt>& v2);
@@ -1504,6 +1781,46 @@ inline Ctxt innerProduct(const std::vector<Ctxt>& v1,
   return ret;
 }
 
+//! @brief Relinearize every ciphertext of ctxts, as Ctxt::reLinearize.
+//! The ciphertexts with the same part to switch (the s^2 part of products
+//! of the same key, at the same level) are switched together: every tile of
+//! their key-switching matrix is read from memory once for all of them, and
+//! in the COMPACT mode its pseudorandom half is expanded once. The others
+//! (and all of them when there are level variants of the matrices) are
+//! relinearized one at a time.
+void reLinearize(const std::vector<Ctxt*>& ctxts, long keyID = 0);
+
+//! @brief Set result = sum_i coeffs[i] * ctxts[i] for i < n, using
+//! Ctxt::addScaledCtxt for every term. Terms with a zero coefficient are
+//! skipped, result is empty if all coefficients are zero.
+void linearCombination(Ctxt& result,
+                       const Ctxt* ctxts,
+                       const NTL::ZZ* coeffs,
+                       long n);
+inline void linearCombination(Ctxt& result,
+                              const std::vector<Ctxt>& ctxts,
+                              const std::vector<NTL::ZZ>& coeffs)
+{
+  assertEq(ctxts.size(), coeffs.size(), "Size mismatch in linearCombination");
+  linearCombination(result, ctxts.data(), coeffs.data(), ctxts.size());
+}
+
+//! @brief Set result = sum_i constants[i] * ctxts[i], where sizes[i] bounds
+//! constants[i] as for Ctxt::multByConstant(const DoubleCRT&, double).
+//! If all the ctxts are BGV ciphertexts with the same prime set, plaintext
+//! space, integer factor and parts, every part of result is a single
+//! DoubleCRT::innerProduct and no ciphertext is copied. result must not be
+//! one of the ctxts.
+void linearCombination(Ctxt& result,
+                       const std::vector<const Ctxt*>& ctxts,
+                       const std::vector<const DoubleCRT*>& constants,
+                       const std::vector<double>& sizes);
+
+//! @brief Call targets[i]->subtractAndDivideByP(digit) for every i, e.g. to
+//! remove the same extracted digit from several accumulators. The targets
+//! must be distinct and are updated in parallel on the NTL thread pool.
+void subtractAndDivideByP(const std::vector<Ctxt*>& targets, const Ctxt& digit);
+
 //! Compute the inner product of a vectors of ciphertexts and a constant vector
 void innerProduct(Ctxt& result,
                   const std::vector<Ctxt>& v1,
@@ -1607,6 +1924,19 @@ void extendExtractDigits(std::vector<Ctxt>& digits,
                          long e);
 // implemented in extractDigits.cpp
 
+// @brief The lifting polynomial used by extractDigits.
+
+// Computes a degree-p polynomial L(x) s.t. for any t<e and integer z of the
+// form z = z0 + p^t*z1, we have L(z) = z0 (mod p^{t+1}). Here z0 is in the
+// interval [0,1] if p == 2 (and L(x) = x^2), and otherwise in (-p/2, p/2).
+void buildLiftingPolynomial(NTL::ZZX& result, long p, long e);
+
+// @brief The polynomial G of Chen and Han used by extendExtractDigits.
+
+// G(x) = (x mod p) (mod p^e), with (x mod p) in the same interval as above.
+void buildChenHanPolynomial(NTL::ZZX& result, long p, long e);
+// implemented in extractDigits.cpp
+
 } // namespace helib
 
 #endif // ifndef HELIB_CTXT_H
@@ -0,0 +1,118 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef HELIB_CTXTEXPR_H
+#define HELIB_CTXTEXPR_H
+/**
+ * @file CtxtExpr.h
+ * @brief Lazy linear combinations of ciphertexts
+ *
+ * An expression such as `out = lazy(a)*3 + lazy(b) - lazy(c)*prepared`
+ * evaluated with the Ctxt operators makes a temporary ciphertext for every
+ * operator, and every addition matches the prime sets, plaintext spaces and
+ * integer factors of its operands again. A CtxtExpr only records the terms
+ * (a ciphertext times an integer, and possibly times a PreparedPtxt), and
+ * evaluates them on assignment to a Ctxt:
+ *  - the prime sets are matched once, every term is brought down to the
+ *    lowest of them (as a product would do);
+ *  - the plaintext spaces and the integer factors are matched once, by
+ *    folding the correction of every term into its integer;
+ *  - every part of the result is written in one pass over its residues,
+ *    DoubleCRT::scaledSum for the integer terms and DoubleCRT::innerProduct
+ *    for the terms with a constant;
+ *  - the noise bound is summed up once.
+ *
+ * BGV only: the CKKS expressions, and those whose terms do not have the
+ * same parts (e.g. a term that is not relinearized), are evaluated term by
+ * term with the Ctxt operators, with the same result.
+ *
+ * An expression keeps pointers to its ciphertexts and constants, so these
+ * must outlive it. The result may be one of them.
+ */
+
+#include <vector>
+
+#include <NTL/ZZ.h>
+
+#include <helib/Ctxt.h>
+#include <helib/EncodedPtxt.h>
+
+namespace helib {
+
+/**
+ * @class CtxtExpr
+ * @brief A sum of ciphertexts times integers and plaintext constants, that
+ * is evaluated on assignment to a Ctxt
+ **/
+class CtxtExpr
+{
+public:
+  //! @brief One term, scalar * ctxt, times ptxt unless it is null
+  struct Term
+  {
+    const Ctxt* ctxt;
+    NTL::ZZ scalar;
+    const PreparedPtxt* ptxt;
+  };
+
+  //! @brief The expression with the single term ctxt
+  explicit CtxtExpr(const Ctxt& ctxt) : terms{{&ctxt, NTL::ZZ(1), nullptr}}
+  {}
+
+  CtxtExpr& operator+=(const CtxtExpr& other);
+  CtxtExpr& operator-=(const CtxtExpr& other);
+  CtxtExpr& operator*=(const NTL::ZZ& c);
+  CtxtExpr& operator*=(long c) { return *this *= NTL::ZZ(c); }
+
+  //! @brief Multiply every term by the constant. A term can only have one
+  //! constant, an expression whose terms already have one throws an
+  //! InvalidArgument.
+  CtxtExpr& operator*=(const PreparedPtxt& ptxt);
+
+  void negate() { *this *= -1; }
+
+  const std::vector<Term>& getTerms() const { return terms; }
+
+  //! @brief Evaluate the expression into out
+  void assignTo(Ctxt& out) const;
+
+private:
+  std::vector<Term> terms;
+};
+
+//! @brief The expression with the single term ctxt, the start of a lazy
+//! expression, e.g. `out = lazy(a) + lazy(b)*2`
+inline CtxtExpr lazy(const Ctxt& ctxt) { return CtxtExpr(ctxt); }
+
+inline CtxtExpr operator+(CtxtExpr a, const CtxtExpr& b) { return a += b; }
+inline CtxtExpr operator-(CtxtExpr a, const CtxtExpr& b) { return a -= b; }
+inline CtxtExpr operator-(CtxtExpr a)
+{
+  a.negate();
+  return a;
+}
+
+inline CtxtExpr operator*(CtxtExpr a, const NTL::ZZ& c) { return a *= c; }
+inline CtxtExpr operator*(const NTL::ZZ& c, CtxtExpr a) { return a *= c; }
+inline CtxtExpr operator*(CtxtExpr a, long c) { return a *= c; }
+inline CtxtExpr operator*(long c, CtxtExpr a) { return a *= c; }
+inline CtxtExpr operator*(CtxtExpr a, const PreparedPtxt& ptxt)
+{
+  return a *= ptxt;
+}
+inline CtxtExpr operator*(const PreparedPtxt& ptxt, CtxtExpr a)
+{
+  return a *= ptxt;
+}
+
+} // namespace helib
+
+#endif // ifndef HELIB_CTXTEXPR_H
@@ -29,39 +29,20 @@
  * @file DoubleCRT.h
  * @brief Integer polynomials (elements in the ring R_Q) in double-CRT form
  **/
+#include <functional>
+
 #include <helib/zzX.h>
 #include <helib/NumbTh.h>
 #include <helib/IndexMap.h>
+#include <helib/ResidueSlab.h>
 #include <helib/timing.h>
 
 namespace helib {
 
 class Context;
-
-/**
- * @class DoubleCRTHelper
- * @brief A helper class to enforce consistency within an DoubleCRTHelper object
- *
- * See Section 2.6.2 of the design document (IndexMap)
- */
-class DoubleCRTHelper : public IndexMapInit<NTL::vec_long>
-{
-public:
-  DoubleCRTHelper() = delete;
-  DoubleCRTHelper(const Context& context);
-
-  /** @brief the init method ensures that all rows have the same size */
-  virtual void init(NTL::vec_long& v) { v.FixLength(val); }
-
-  /** @brief clone allocates a new object and copies the content */
-  virtual IndexMapInit<NTL::vec_long>* clone() const
-  {
-    return new DoubleCRTHelper(*this);
-  }
-
-private:
-  long val;
-};
+class DoubleCRTPrecon;
+class JsonStreamWriter;
+class JsonStreamReader;
 
 /**
  * @class DoubleCRT
@@ -74,10 +55,12 @@ private:
  * The polynomial thus represented is defined modulo the product of all the
  * primes in use.
  *
- * The list of primes is defined by the data member indexMap.
- * indexMap.getIndexSet() defines the set of indices of primes
+ * The list of primes is defined by the data member map.
+ * map.getIndexSet() defines the set of indices of primes
  * associated with this DoubleCRT object: they index the
- * primes stored in the associated Context.
+ * primes stored in the associated Context. All the rows are kept in one
+ * contiguous ResidueSlab, shared by the copies of a DoubleCRT until one of
+ * them is written.
  *
  * Arithmetic operations are computed modulo the product of the primes in use
  * and also modulo Phi_m(X). Arithmetic operations can only be applied to
@@ -89,9 +72,9 @@ class DoubleCRT
 private:
   const Context& context; // the context
 
-  // the data itself: if the i'th prime is in use then map[i] is the std::vector
-  // of evaluations wrt this prime
-  IndexMap<NTL::vec_long> map;
+  // the data itself: if the i'th prime is in use then map[i] points to the
+  // phi(m) evaluations wrt this prime, all the rows live in one slab
+  ResidueSlab map;
 
   //! a "sanity check" method, verifies consistency of the map with
   //! current moduli chain, an error is raised if they are not consistent
@@ -111,6 +94,16 @@ private:
 
   DoubleCRT& do_mul(const DoubleCRT& other, bool matchIndexSets = true);
 
+  template <typename RX>
+  static void fromPolysImpl(const std::vector<DoubleCRT*>& out,
+                            const std::vector<const RX*>& polys,
+                            const IndexSet& s);
+
+  // The inner products, with bPrecon == nullptr if there are no companions
+  DoubleCRT& innerProductImpl(const std::vector<const DoubleCRT*>& a,
+                              const std::vector<const DoubleCRT*>& b,
+                              const std::vector<DoubleCRTPrecon>* bPrecon);
+
   template <typename Fun>
   DoubleCRT& Op(const NTL::ZZ& num, Fun fun);
 
@@ -128,6 +121,9 @@ public:
   // Default copy-constructor:
   DoubleCRT(const DoubleCRT& other) = default;
 
+  // Moving takes over the slab and leaves other with an empty index set
+  DoubleCRT(DoubleCRT&& other) = default;
+
   //! @brief Initializing DoubleCRT from a ZZX polynomial
   //! @param poly The ring element itself, zero if not specified
   //! @param _context The context for this DoubleCRT object, use "current active
@@ -181,6 +177,9 @@ public:
 
   DoubleCRT& operator=(const DoubleCRT& other);
 
+  // Moving takes over the slab of other, which must have the same context
+  DoubleCRT& operator=(DoubleCRT&& other);
+
   // Copy only the primes in s \intersect other.getIndexSet()
   //  void partialCopy(const DoubleCRT& other, const IndexSet& s);
 
@@ -222,6 +221,38 @@ public:
   void toPoly(NTL::ZZX& p, const IndexSet& s, bool positive = false) const;
   void toPoly(NTL::ZZX& p, bool positive = false) const;
 
+  //! @brief CRT-and-scale to a word-size modulus q, using only word-size
+  //! arithmetic. Let c be the h'th coefficient of this polynomial modulo the
+  //! product Q of its primes, X = round(c*q/Q) and Y = c*q - Q*X. This sets
+  //! x[h] = X mod q, y[h] = Y mod t (both non-negative) and frac[h] = Y/Q.
+  //! None of these depend on whether c is taken in [0,Q) or in [-Q/2,Q/2).
+  void scaleToModulus(zzX& x,
+                      zzX& y,
+                      std::vector<double>& frac,
+                      long q,
+                      long t) const;
+
+  //! @brief Batched toPoly: *polys[t] = dcrts[t]->toPoly(s, positive) for
+  //! every t. All the dcrts must have the same primes in s. The inverse
+  //! transforms are scheduled over the threads by prime, each thread
+  //! setting up a modulus once for all the polynomials, and the CRT tables
+  //! are computed once for the whole batch.
+  static void toPolys(const std::vector<NTL::ZZX*>& polys,
+                      const std::vector<const DoubleCRT*>& dcrts,
+                      const IndexSet& s,
+                      bool positive = false);
+
+  //! @brief Batched conversion from coefficient representation: *out[t] is
+  //! set to polys[t] over the primes in s, for every t. The transforms are
+  //! scheduled over the threads by prime, each thread setting up a modulus
+  //! once for all the polynomials and keeping its tables in cache.
+  static void fromPolys(const std::vector<DoubleCRT*>& out,
+                        const std::vector<const zzX*>& polys,
+                        const IndexSet& s);
+  static void fromPolys(const std::vector<DoubleCRT*>& out,
+                        const std::vector<const NTL::ZZX*>& polys,
+                        const IndexSet& s);
+
   // The variant toPolyMod has another argument, which is a modulus Q, and it
   // computes toPoly() mod Q. This is offered as a separate function in the
   // hope that one day we will figure out a more efficient method of computing
@@ -258,6 +289,18 @@ public:
   //! Returns the sum of the canonical embedding of the digits
   NTL::xdouble breakIntoDigits(std::vector<DoubleCRT>& dgts) const;
 
+  //! @brief As above, with the digits extended to the primes of
+  //! specialPrimes rather than to all the special primes
+  NTL::xdouble breakIntoDigits(std::vector<DoubleCRT>& dgts,
+                               const IndexSet& specialPrimes) const;
+
+  //! @brief The same digits, handed to f(i, digit) one at a time as soon as
+  //! digit i is ready, so that no more than one digit exists at any time.
+  //! f may modify or move from the digit. Returns the same noise estimate.
+  NTL::xdouble forEachDigit(
+      const IndexSet& specialPrimes,
+      const std::function<void(long, DoubleCRT&)>& f) const;
+
   //! @brief Expand the index set by s1.
   //! It is assumed that s1 is disjoint from the current index set.
   //! If poly_p != 0, then *poly_p will first be set to the result of applying
@@ -320,11 +363,82 @@ public:
   // Also, if matchIndexSets == true and the prime set of *this does
   // not contain the prime set of other, an exception is also raised.
 
+  //! @brief Fused scale-and-add, *this = (thisFactor * (*this) +
+  //! otherFactor * other) / divisor, computed in a single pass over the data.
+  //! The prime set of other must contain the prime set of *this, and divisor
+  //! must be invertible modulo all of its primes.
+  DoubleCRT& addScaled(const DoubleCRT& other,
+                       long otherFactor,
+                       long thisFactor = 1,
+                       long divisor = 1);
+
   // Procedural equivalents, supporting also the matchIndexSets flag
   void Add(const DoubleCRT& other, bool matchIndexSets = true);
   void Sub(const DoubleCRT& other, bool matchIndexSets = true);
   void Mul(const DoubleCRT& other, bool matchIndexSets = true);
 
+  //! @brief Multiply by other, using its precomputed Shoup companions. The
+  //! prime set of otherPrecon (which must be that of other, unchanged since
+  //! it was prepared) must contain the prime set of *this.
+  void Mul(const DoubleCRT& other, const DoubleCRTPrecon& otherPrecon);
+
+  //! @brief Set to the inner product sum_i a[i]*b[i] over i < a.size(),
+  //! with the index set of a[0]. All the a[i] must have the same index set,
+  //! contained in the index set of every b[i], and none of them may be
+  //! *this. The work is split over a grid of primes times blocks of
+  //! columns, so all the threads are used even when there are few primes.
+  DoubleCRT& innerProduct(const std::vector<DoubleCRT>& a,
+                          const std::vector<DoubleCRT>& b);
+
+  //! @brief The same inner product, with the Shoup companions bPrecon[i] of
+  //! the fixed operands b[i]
+  DoubleCRT& innerProduct(const std::vector<DoubleCRT>& a,
+                          const std::vector<DoubleCRT>& b,
+                          const std::vector<DoubleCRTPrecon>& bPrecon);
+
+  //! @brief The same inner product, of operands that are not stored in
+  //! vectors of their own, e.g. the parts of several ciphertexts
+  DoubleCRT& innerProduct(const std::vector<const DoubleCRT*>& a,
+                          const std::vector<const DoubleCRT*>& b);
+
+  //! @brief Set every out[c] to the inner product sum_i a[c][i]*b[i], with
+  //! the index set of a[0][0], for operands a[c] that share the fixed
+  //! operands b (and their companions bPrecon, if not null): e.g. the
+  //! digits of several ciphertexts and the columns of one key-switching
+  //! matrix. All the a[c][i] must have the same index set. The columns are
+  //! tiled so that a tile of the b[i] stays in cache while it is used for
+  //! all the out[c], rather than being read from memory once per product.
+  static void innerProducts(const std::vector<DoubleCRT*>& out,
+                            const std::vector<std::vector<const DoubleCRT*>>& a,
+                            const std::vector<const DoubleCRT*>& b,
+                            const std::vector<DoubleCRTPrecon>* bPrecon);
+
+  //! @brief Set to the scaled sum sum_t factors[t]*a[t] over t < a.size(),
+  //! with the index set of a[0], in one pass over the output: a linear
+  //! combination with small integer factors (|factors[t]| < p_i). All the
+  //! a[t] must have the same index set, and none of them may be *this.
+  DoubleCRT& scaledSum(const std::vector<const DoubleCRT*>& a,
+                       const std::vector<long>& factors);
+
+  //! @brief Set to x*a + f*b, with the index set of x, where f is a small
+  //! integer (|f| < p_i) and b is ignored if f is zero. Every residue is
+  //! written in one pass, over the same grid as innerProduct. The index sets
+  //! of a and b must contain that of x, and so must that of xPrecon (the
+  //! companions of x) unless it is empty. None of x, a, b may be *this.
+  DoubleCRT& setMulAdd(const DoubleCRT& x,
+                       const DoubleCRTPrecon& xPrecon,
+                       const DoubleCRT& a,
+                       const DoubleCRT& b,
+                       long f);
+
+  //! @brief Add a scalar given by its residues: residues[i] (in [0, p_i)) is
+  //! added to every entry of row i, for each i in the index set
+  DoubleCRT& addScalar(const std::vector<long>& residues);
+
+  //! @brief Multiply by a scalar given by its residues: every entry of row i
+  //! is multiplied by residues[i] (in [0, p_i)), for each i in the index set
+  DoubleCRT& mulScalar(const std::vector<long>& residues);
+
   // Division by constant
   DoubleCRT& operator/=(const NTL::ZZ& num);
   DoubleCRT& operator/=(long num) { return (*this /= NTL::to_ZZ(num)); }
@@ -347,15 +461,29 @@ public:
   // Utilities
 
   const Context& getContext() const { return context; }
-  const IndexMap<NTL::vec_long>& getMap() const { return map; }
+  const ResidueSlab& getMap() const { return map; }
   const IndexSet& getIndexSet() const { return map.getIndexSet(); }
 
+  //! @brief Refer to rows with the index set s kept elsewhere, e.g. in a
+  //! mapped file, with the layout and lifetime of ResidueSlab::attach
+  void attachRows(long* rows, const IndexSet& s) { map.attach(rows, s); }
+
+  //! @brief Make a private copy of the rows if they are shared with copies
+  //! of this DoubleCRT, allocated by the calling thread
+  void makeUnique() { map.makeUnique(); }
+
   // Choose random DoubleCRT's, either at random or with small/Gaussian
   // coefficients.
 
   //! @brief Fills each row i with random ints mod pi, uses NTL's PRG
   void randomize(const NTL::ZZ* seed = nullptr);
 
+  //! @brief Fills each row i with random ints mod pi, from a ChaCha20
+  //! stream (NTL::RandomStream) of its own, keyed by seed, stream and pi.
+  //! Unlike randomize, a row depends on neither the other rows nor the
+  //! index set, the rows are filled in parallel, and NTL's PRG is untouched
+  void randomizeKeyed(const NTL::ZZ& seed, long stream);
+
   //! Sampling routines:
   //! Each of these return a high probability bound on L-infty norm
   //! of canonical embedding
@@ -381,6 +509,18 @@ public:
   // used to implement modulus switching
   void scaleDownToSet(const IndexSet& s, long ptxtSpace, NTL::ZZX& delta);
 
+  //! @brief Modulus switching of several DoubleCRTs with the same index set
+  //! at once, in RNS form and without big integers: each of them is divided
+  //! by the product D of the primes not in s, after subtracting the balanced
+  //! remainder mod D made divisible by ptxtSpace (as above). If fdeltas is
+  //! not null, (*fdeltas)[t] is set to the coefficients of the remainder of
+  //! parts[t] divided by D. The constants come from Context::getModDownTable.
+  static void scaleDownToSet(const std::vector<DoubleCRT*>& parts,
+                             const IndexSet& s,
+                             long ptxtSpace,
+                             std::vector<std::vector<double>>* fdeltas =
+                                 nullptr);
+
   void FFT(const NTL::ZZX& poly, const IndexSet& s);
   void FFT(const zzX& poly, const IndexSet& s);
   // for internal use
@@ -410,6 +550,20 @@ public:
    **/
   void read(std::istream& str);
 
+  /**
+   * @brief Write out the `DoubleCRT` object in binary format, with every
+   * residue packed into the bit width of its prime.
+   * @param str Output `std::ostream`.
+   **/
+  void writePackedTo(std::ostream& str) const;
+
+  /**
+   * @brief In-place read from the stream a `DoubleCRT` object written by
+   * `writePackedTo`.
+   * @param str Input `std::istream`.
+   **/
+  void readPacked(std::istream& str);
+
   /**
    * @brief Write out the ciphertext (`Ctxt`) object to the output
    * stream using JSON format.
@@ -423,6 +577,14 @@ public:
    **/
   JsonWrapper writeToJSON() const;
 
+  /**
+   * @brief Write out the `DoubleCRT` object with the streaming JSON writer
+   * behind `writeToJSON(std::ostream&)`: the rows go to the stream as they
+   * are, without a JSON tree in between.
+   * @param w The writer.
+   **/
+  void writeToJSON(JsonStreamWriter& w) const;
+
   /**
    * @brief Read from the stream the serialized ciphertext (`Ctxt`) object using
    * JSON format.
@@ -448,6 +610,13 @@ public:
    **/
   void readJSON(std::istream& str);
 
+  /**
+   * @brief In-place read with the streaming JSON reader behind
+   * `readJSON(std::istream&)`, which parses the rows straight into place.
+   * @param r The reader.
+   **/
+  void readJSON(JsonStreamReader& r);
+
   /**
    * @brief In-place read from the `JsonWrapper` the serialized ciphertext
    * (`Ctxt`) object.
@@ -462,6 +631,56 @@ public:
   friend std::istream& operator>>(std::istream& s, DoubleCRT& d);
 };
 
+/**
+ * @class DoubleCRTPrecon
+ * @brief The Shoup companions of the residues of a DoubleCRT that is used
+ * many times as a fixed multiplicand.
+ *
+ * For every residue x modulo p_i this stores NTL::PrepMulModPrecon(x, p_i),
+ * so that multiplying by x costs one NTL::MulModPrecon instead of a full
+ * NTL::MulMod. This doubles the memory of the operand, so it is only worth
+ * it for data that is built once and used often, such as the key-switching
+ * matrices and the constants of the linear maps. The companions are only
+ * valid as long as the DoubleCRT they were prepared from is unchanged.
+ **/
+class DoubleCRTPrecon
+{
+public:
+  //! @brief An empty object, with no primes
+  DoubleCRTPrecon() : rowLen(0) {}
+
+  //! @brief The companions of all the rows of dcrt
+  explicit DoubleCRTPrecon(const DoubleCRT& dcrt);
+
+  //! @brief Companions kept elsewhere, e.g. in a mapped file: rows points to
+  //! s.card() consecutive rows of rowLen companions, in increasing order of
+  //! the primes, and owner keeps them alive
+  DoubleCRTPrecon(const IndexSet& s,
+                  long rowLen,
+                  const NTL::mulmod_precon_t* rows,
+                  std::shared_ptr<const void> owner);
+
+  //! @brief Get the index set of the DoubleCRT this was prepared from
+  const IndexSet& getIndexSet() const { return indexSet; }
+
+  //! @brief The companions of row i, raises an error if i is not in the
+  //! index set
+  const NTL::mulmod_precon_t* operator[](long i) const
+  {
+    assertTrue(indexSet.contains(i), "Key not found");
+    return data.get() + offsets[i];
+  }
+
+private:
+  IndexSet indexSet;
+  long rowLen;
+  // indexSet.card() rows of rowLen, never modified, so copies share them
+  std::shared_ptr<const NTL::mulmod_precon_t> data;
+  std::vector<long> offsets; // offsets[i] is the start of row i
+
+  void setOffsets();
+};
+
 inline void conv(DoubleCRT& d, const NTL::ZZX& p) { d = p; }
 
 // FIXME-IndexSet
@@ -0,0 +1,107 @@
+/* Copyright (C) 2021 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef HELIB_DUALDOUBLECRT_H
+#define HELIB_DUALDOUBLECRT_H
+/**
+ * @file DualDoubleCRT.h
+ * @brief A DoubleCRT that also keeps its coefficient representation
+ *
+ * Every conversion between the coefficient and the evaluation form of a
+ * DoubleCRT is a full set of NTTs, one per prime. A DualDoubleCRT holds
+ * either form or both, and converts only when an operation needs the form
+ * it does not have. Constants added in coefficient form are collected until
+ * the evaluation form is needed, so that adding several constants and then
+ * multiplying costs a single forward transform.
+ */
+
+#include <helib/DoubleCRT.h>
+
+namespace helib {
+
+/**
+ * @class DualDoubleCRT
+ * @brief An element of R_Q in coefficient form, evaluation form or both.
+ *
+ * The coefficient form has balanced coefficients modulo the product Q of the
+ * primes in the index set, as DoubleCRT::toPoly. The accessors are const and
+ * cache the form they compute, so a DualDoubleCRT must not be shared between
+ * threads without synchronization.
+ **/
+class DualDoubleCRT
+{
+public:
+  //! @brief Zero over the primes in s, valid in both forms
+  DualDoubleCRT(const Context& context, const IndexSet& s);
+
+  //! @brief dcrt, in evaluation form
+  explicit DualDoubleCRT(const DoubleCRT& dcrt);
+  explicit DualDoubleCRT(DoubleCRT&& dcrt);
+
+  //! @brief poly over the primes in s, in coefficient form
+  DualDoubleCRT(const NTL::ZZX& poly,
+                const Context& context,
+                const IndexSet& s);
+
+  const Context& getContext() const { return evalForm.getContext(); }
+  const IndexSet& getIndexSet() const { return evalForm.getIndexSet(); }
+
+  //! Whether the evaluation form is available without a transform
+  bool hasEval() const { return evalValid && NTL::IsZero(pending); }
+
+  //! Whether the coefficient form is available without a transform
+  bool hasCoeffs() const { return coeffValid; }
+
+  //! @brief The evaluation form, transforming the coefficient form or the
+  //! pending constants if needed
+  const DoubleCRT& eval() const;
+
+  //! @brief The coefficient form, transforming the evaluation form if needed
+  const NTL::ZZX& coeffs() const;
+
+  //! @brief The evaluation form for changes in place, after which the
+  //! coefficient form is no longer valid
+  DoubleCRT& evalForUpdate();
+
+  //! @brief Add or subtract a constant in coefficient form. Nothing is
+  //! transformed: the constant is added to the coefficient form if it is
+  //! valid, and kept for the evaluation form until it is needed.
+  DualDoubleCRT& operator+=(const NTL::ZZX& poly);
+  DualDoubleCRT& operator-=(const NTL::ZZX& poly);
+
+  //! @brief Operations in evaluation form, which invalidate the coefficient
+  //! form. The index set of other must contain that of *this.
+  DualDoubleCRT& operator+=(const DoubleCRT& other);
+  DualDoubleCRT& operator-=(const DoubleCRT& other);
+  DualDoubleCRT& operator*=(const DoubleCRT& other);
+
+  //! @brief Multiply by a constant in coefficient form, in evaluation form
+  DualDoubleCRT& operator*=(const NTL::ZZX& poly);
+
+  //! @brief Multiply by a scalar, in every valid form
+  DualDoubleCRT& operator*=(long num);
+
+private:
+  // evalForm + pending is the element when evalValid, and coeffForm is (up
+  // to a reduction mod Q) when coeffValid. One of them is always valid.
+  mutable DoubleCRT evalForm;
+  mutable NTL::ZZX coeffForm;
+  mutable NTL::ZZX pending;
+  mutable bool evalValid;
+  mutable bool coeffValid;
+  mutable bool coeffReduced; // coeffForm is balanced mod Q
+
+  void invalidateCoeffs() { coeffValid = false; }
+};
+
+} // namespace helib
+
+#endif // ifndef HELIB_DUALDOUBLECRT_H
@@ -12,6 +12,11 @@
 #ifndef HELIB_ENCODED_PTXT_H
 #define HELIB_ENCODED_PTXT_H
 
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
 #include <helib/DoubleCRT.h>
 #include <helib/norms.h>
 
@@ -350,6 +355,55 @@ public:
   void reset() { rep.reset(); }
 };
 
+/**
+ * @class PreparedPtxt
+ * @brief An EncodedPtxt that is used as a constant many times.
+ *
+ * Ctxt::multByConstant and Ctxt::addConstant expand an EncodedPtxt to a
+ * DoubleCRT over the prime set of the ciphertext on every use. A
+ * PreparedPtxt keeps these FatEncodedPtxt forms, made on first use, for
+ * the next ciphertexts with the same prime set, so the NTTs of the constant
+ * and its size estimate are paid once per prime set. The BGV additions keep
+ * their scaling in the plaintext space (see
+ * Ctxt::addConstant(const EncodedPtxt_BGV&)), so their forms are also kept
+ * per scaling factor. Thread safe.
+ **/
+class PreparedPtxt
+{
+public:
+  explicit PreparedPtxt(const EncodedPtxt& eptxt) : eptxt(eptxt) {}
+
+  PreparedPtxt(const PreparedPtxt&) = delete;
+  PreparedPtxt& operator=(const PreparedPtxt&) = delete;
+
+  const EncodedPtxt& getEncoded() const { return eptxt; }
+  bool isBGV() const { return eptxt.isBGV(); }
+  bool isCKKS() const { return eptxt.isCKKS(); }
+
+  //! @brief The constant over the primes s
+  const FatEncodedPtxt& expand(const IndexSet& s) const;
+
+  //! @brief A BGV constant times f, balanced mod ptxtSpace, over the primes
+  //! s. Without scaling (f = 1 and the plaintext space of the constant),
+  //! this is expand(s).
+  const FatEncodedPtxt& expandScaled(const IndexSet& s,
+                                     long f,
+                                     long ptxtSpace) const;
+
+  //! @brief The number of forms kept
+  long forms() const;
+
+  //! @brief Drop the forms, e.g. once the ciphertexts are at lower levels
+  void clear();
+
+private:
+  EncodedPtxt eptxt;
+
+  mutable std::mutex mutex;
+  // By {f, ptxtSpace, the primes...}, f = 0 for the unscaled forms
+  mutable std::map<std::vector<long>, std::unique_ptr<FatEncodedPtxt>> cache;
+};
+
 } // namespace helib
 
 #endif
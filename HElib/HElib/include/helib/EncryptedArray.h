@@ -18,6 +18,7 @@
 #include <exception>
 #include <cmath>
 #include <complex>
+#include <memory>
 #include <NTL/Lazy.h>
 #include <NTL/pair.h>
 #include <NTL/SmartPtr.h>
@@ -241,22 +242,48 @@ public:
   // otherwise)
   virtual void random(std::vector<NTL::ZZX>& array) const = 0;
 
-  // FIXME: Inefficient implementation, calls usual decode and returns one slot
+  //! @brief Decode only the given slots, array[k] is slot slots[k]
+  virtual void decodeSlots(std::vector<long>& array,
+                           const NTL::ZZX& ptxt,
+                           const std::vector<long>& slots) const = 0;
+  virtual void decodeSlots(std::vector<NTL::ZZX>& array,
+                           const NTL::ZZX& ptxt,
+                           const std::vector<long>& slots) const = 0;
+
   long decode1Slot(const NTL::ZZX& ptxt, long i) const
   {
     std::vector<long> v;
-    decode(v, ptxt);
-    return v.at(i);
+    decodeSlots(v, ptxt, {i});
+    return v[0];
   }
   void decode1Slot(NTL::ZZX& slot, const NTL::ZZX& ptxt, long i) const
   {
     std::vector<NTL::ZZX> v;
-    decode(v, ptxt);
-    slot = v.at(i);
+    decodeSlots(v, ptxt, {i});
+    slot = v[0];
   }
 
   //! @brief Encodes a std::vector with 1 at position i and 0 everywhere else
   virtual void encodeUnitSelector(zzX& ptxt, long i) const = 0;
+
+  //! @brief Encodes arrays[i] into ptxts[i] for all i. The BGV arrays do
+  //! this in parallel, sharing the CRT tables of the slots.
+  virtual void encodeBatch(std::vector<zzX>& ptxts,
+                           const std::vector<std::vector<long>>& arrays) const
+  {
+    ptxts.resize(arrays.size());
+    for (std::size_t i = 0; i < arrays.size(); i++)
+      encode(ptxts[i], arrays[i]);
+  }
+
+  //! @brief Decodes ptxts[i] into arrays[i] for all i, as encodeBatch
+  virtual void decodeBatch(std::vector<std::vector<long>>& arrays,
+                           const std::vector<NTL::ZZX>& ptxts) const
+  {
+    arrays.resize(ptxts.size());
+    for (std::size_t i = 0; i < ptxts.size(); i++)
+      decode(arrays[i], ptxts[i]);
+  }
   ///@}
 
   ///@{
@@ -316,12 +343,35 @@ public:
                               const SecKey& sKey,
                               PlaintextArray& ptxt) const = 0;
 
-  // FIXME: Inefficient implementation, calls usual decrypt and returns one slot
+  //! @brief Decrypt only the given slots, ptxt[k] is slot slots[k]. A copy
+  //! of ctxt is first switched down to the fewest primes that still decrypt
+  //! it (a single one if the noise allows, see
+  //! Ctxt::dropToDecryptionPrimeSet), and only these slots are decoded.
+  virtual void decryptSlots(const Ctxt& ctxt,
+                            const SecKey& sKey,
+                            std::vector<long>& ptxt,
+                            const std::vector<long>& slots) const = 0;
+  virtual void decryptSlots(const Ctxt& ctxt,
+                            const SecKey& sKey,
+                            std::vector<NTL::ZZX>& ptxt,
+                            const std::vector<long>& slots) const = 0;
+
+  //! @brief Decrypt only the given coefficients of the plaintext polynomial,
+  //! reduced to [0, ptxtSpace), e.g. the results of a thinly packed
+  //! ciphertext. ctxt is switched down as in decryptSlots, and nothing is
+  //! decoded. BGV only.
+  //! @throws LogicError for CKKS ciphertexts
+  //! @throws OutOfRange if an index is not in [0, phi(m))
+  void decryptCoeffs(const Ctxt& ctxt,
+                     const SecKey& sKey,
+                     std::vector<long>& coeffs,
+                     const std::vector<long>& indices) const;
+
   long decrypt1Slot(const Ctxt& ctxt, const SecKey& sKey, long i) const
   {
     std::vector<long> v;
-    decrypt(ctxt, sKey, v);
-    return v.at(i);
+    decryptSlots(ctxt, sKey, v, {i});
+    return v[0];
   }
   void decrypt1Slot(NTL::ZZX& slot,
                     const Ctxt& ctxt,
@@ -329,8 +379,8 @@ public:
                     long i) const
   {
     std::vector<NTL::ZZX> v;
-    decrypt(ctxt, sKey, v);
-    slot = v.at(i);
+    decryptSlots(ctxt, sKey, v, {i});
+    slot = v[0];
   }
   ///@}
 
@@ -625,6 +675,12 @@ public:
 
   virtual void encodeUnitSelector(zzX& ptxt, long i) const override;
 
+  virtual void encodeBatch(
+      std::vector<zzX>& ptxts,
+      const std::vector<std::vector<long>>& arrays) const override;
+  virtual void decodeBatch(std::vector<std::vector<long>>& arrays,
+                           const std::vector<NTL::ZZX>& ptxts) const override;
+
   virtual void encode(zzX& ptxt,
                       const std::vector<NTL::ZZX>& array) const override
   {
@@ -708,6 +764,20 @@ public:
     genericDecode(array, ptxt);
   }
 
+  virtual void decodeSlots(std::vector<long>& array,
+                           const NTL::ZZX& ptxt,
+                           const std::vector<long>& slots) const override
+  {
+    genericDecodeSlots(array, ptxt, slots);
+  }
+
+  virtual void decodeSlots(std::vector<NTL::ZZX>& array,
+                           const NTL::ZZX& ptxt,
+                           const std::vector<long>& slots) const override
+  {
+    genericDecodeSlots(array, ptxt, slots);
+  }
+
   virtual void decode(PlaintextArray& array,
                       const NTL::ZZX& ptxt) const override;
   virtual void decode(PlaintextArray& array, const zzX& ptxt) const;
@@ -748,6 +818,32 @@ public:
     }
   }
 
+  virtual void decryptSlots(const Ctxt& ctxt,
+                            const SecKey& sKey,
+                            std::vector<long>& ptxt,
+                            const std::vector<long>& slots) const override
+  {
+    genericDecryptSlots(ctxt, sKey, ptxt, slots);
+    if (ctxt.getPtxtSpace() < getP2R()) {
+      helib::Warning("EncryptedArray::decrypt: reducing plaintext modulus");
+      for (long i = 0; i < (long)ptxt.size(); i++)
+        ptxt[i] %= ctxt.getPtxtSpace();
+    }
+  }
+
+  virtual void decryptSlots(const Ctxt& ctxt,
+                            const SecKey& sKey,
+                            std::vector<NTL::ZZX>& ptxt,
+                            const std::vector<long>& slots) const override
+  {
+    genericDecryptSlots(ctxt, sKey, ptxt, slots);
+    if (ctxt.getPtxtSpace() < getP2R()) {
+      helib::Warning("EncryptedArray::decrypt: reducing plaintext modulus");
+      for (long i = 0; i < (long)ptxt.size(); i++)
+        PolyRed(ptxt[i], ctxt.getPtxtSpace(), /*abs=*/true);
+    }
+  }
+
   virtual void decrypt(const Ctxt& ctxt,
                        const SecKey& sKey,
                        PlaintextArray& ptxt,
@@ -872,6 +968,39 @@ private:
     sKey.Decrypt(pp, ctxt);
     decode(array, pp);
   }
+
+  template <typename T>
+  void genericDecodeSlots(T& array,
+                          const NTL::ZZX& ptxt,
+                          const std::vector<long>& slots) const
+  {
+    RBak bak;
+    bak.save();
+    tab.restoreContext();
+
+    RX pp;
+    conv(pp, ptxt);
+    std::vector<RX> array1;
+    tab.decodeSlots(array1, pp, mappingData, slots);
+    convert(array, array1);
+  }
+
+  template <typename T>
+  void genericDecryptSlots(const Ctxt& ctxt,
+                           const SecKey& sKey,
+                           T& array,
+                           const std::vector<long>& slots) const
+  {
+    assertEq(&context,
+             &ctxt.getContext(),
+             "Cannot decrypt when ciphertext has different context than "
+             "EncryptedArray");
+    Ctxt dropped(ctxt);
+    dropped.dropToDecryptionPrimeSet();
+    NTL::ZZX pp;
+    sKey.Decrypt(pp, dropped);
+    genericDecodeSlots(array, pp, slots);
+  }
 };
 
 //! A different derived class to be used for the approximate-numbers scheme
@@ -1043,6 +1172,34 @@ public:
   {
     throw LogicError("Unimplemented: EncryptedArrayCx::decode for BGV type");
   }
+  /**
+   * @brief Unimplemented decodeSlots function for BGV. It will always throw
+   * helib::LogicError.
+   * @param array Unused.
+   * @param ptxt Unused.
+   * @param slots Unused.
+   */
+  void decodeSlots(UNUSED std::vector<long>& array,
+                   UNUSED const NTL::ZZX& ptxt,
+                   UNUSED const std::vector<long>& slots) const override
+  {
+    throw LogicError(
+        "Unimplemented: EncryptedArrayCx::decodeSlots for BGV type");
+  }
+  /**
+   * @brief Unimplemented decodeSlots function for BGV. It will always throw
+   * helib::LogicError.
+   * @param array Unused.
+   * @param ptxt Unused.
+   * @param slots Unused.
+   */
+  void decodeSlots(UNUSED std::vector<NTL::ZZX>& array,
+                   UNUSED const NTL::ZZX& ptxt,
+                   UNUSED const std::vector<long>& slots) const override
+  {
+    throw LogicError(
+        "Unimplemented: EncryptedArrayCx::decodeSlots for BGV type");
+  }
 
   // random
   /**
@@ -1083,6 +1240,39 @@ public:
     throw LogicError("Unimplemented: EncryptedArrayCx::decrypt for BGV type");
   }
 
+  /**
+   * @brief Unimplemented decryptSlots function for BGV. It will always throw
+   * helib::LogicError.
+   * @param ctxt Unused.
+   * @param sKey Unused.
+   * @param ptxt Unused.
+   * @param slots Unused.
+   */
+  void decryptSlots(UNUSED const Ctxt& ctxt,
+                    UNUSED const SecKey& sKey,
+                    UNUSED std::vector<long>& ptxt,
+                    UNUSED const std::vector<long>& slots) const override
+  {
+    throw LogicError(
+        "Unimplemented: EncryptedArrayCx::decryptSlots for BGV type");
+  }
+  /**
+   * @brief Unimplemented decryptSlots function for BGV. It will always throw
+   * helib::LogicError.
+   * @param ctxt Unused.
+   * @param sKey Unused.
+   * @param ptxt Unused.
+   * @param slots Unused.
+   */
+  void decryptSlots(UNUSED const Ctxt& ctxt,
+                    UNUSED const SecKey& sKey,
+                    UNUSED std::vector<NTL::ZZX>& ptxt,
+                    UNUSED const std::vector<long>& slots) const override
+  {
+    throw LogicError(
+        "Unimplemented: EncryptedArrayCx::decryptSlots for BGV type");
+  }
+
   // buildLinPolyCoeffs
   /**
    * @brief Unimplemented buildLinPolyCoeffs function for BGV. It will always
@@ -1229,6 +1419,24 @@ public:
     // VJS-FIXME: this could be much more efficient
   }
 
+  using EncryptedArrayBase::decodeBatch;
+  using EncryptedArrayBase::encodeBatch;
+
+  //! @brief Encodes arrays[i] into eptxts[i] for all i, in parallel.
+  //! mag and prec apply to every array, as in encode.
+  void encodeBatch(std::vector<EncodedPtxt>& eptxts,
+                   const std::vector<std::vector<cx_double>>& arrays,
+                   double mag = -1,
+                   OptLong prec = OptLong()) const;
+  // implemented in EaCx.cpp
+
+  //! @brief Decodes ptxts[i], scaled by scaling, into arrays[i] for all i,
+  //! in parallel
+  void decodeBatch(std::vector<std::vector<cx_double>>& arrays,
+                   const std::vector<zzX>& ptxts,
+                   double scaling) const;
+  // implemented in EaCx.cpp
+
   //==========================================
 
   void encryptOneNum(Ctxt& ctxt,
@@ -1576,6 +1784,8 @@ EncryptedArrayBase* buildEncryptedArray(const Context& context,
                                         const PAlgebraMod& alMod,
                                         const NTL::ZZX& G = NTL::ZZX::zero());
 
+class RotationPlanner;
+
 //! @class EncryptedArray
 //! @brief A simple wrapper for a smart pointer to an EncryptedArrayBase.
 //! This is the interface that higher-level code should use
@@ -1585,6 +1795,9 @@ private:
   const PAlgebraMod& alMod;
   ClonedPtr<EncryptedArrayBase> rep;
 
+  // Built on first use by getRotationPlanner
+  mutable std::shared_ptr<RotationPlanner> rotationPlanner;
+
 public:
   //! constructor: G defaults to the monomial X, PAlgebraMod from context
   EncryptedArray(const Context& context, const NTL::ZZX& G = NTL::ZZX(1, 1)) :
@@ -1601,7 +1814,10 @@ public:
   //  (2) we do not currently provide a constructor that allows
   //      the user to select both G and alMod, but this could be added
 
-  // copy constructor:
+  // copy constructor: the copy plans its own rotations
+  EncryptedArray(const EncryptedArray& other) :
+      alMod(other.alMod), rep(other.rep)
+  {}
 
 #if 1
   EncryptedArray& operator=(const EncryptedArray& other) = delete;
@@ -1677,6 +1893,10 @@ public:
   }
   void shift1D(Ctxt& ctxt, long i, long k) const { rep->shift1D(ctxt, i, k); }
 
+  //! @brief The rotation planner of this array, built on first use (see
+  //! rotationPlanner.h)
+  const RotationPlanner& getRotationPlanner() const;
+
   void encode(zzX& ptxt, const std::vector<long>& array) const
   {
     rep->encode(ptxt, array);
@@ -1765,12 +1985,47 @@ public:
     rep->encodeUnitSelector(ptxt, i);
   }
 
+  void encodeBatch(std::vector<zzX>& ptxts,
+                   const std::vector<std::vector<long>>& arrays) const
+  {
+    rep->encodeBatch(ptxts, arrays);
+  }
+
+  void decodeBatch(std::vector<std::vector<long>>& arrays,
+                   const std::vector<NTL::ZZX>& ptxts) const
+  {
+    rep->decodeBatch(arrays, ptxts);
+  }
+
+  void encodeBatch(std::vector<EncodedPtxt>& eptxts,
+                   const std::vector<std::vector<cx_double>>& arrays,
+                   double mag = -1,
+                   OptLong prec = OptLong()) const
+  {
+    getCx().encodeBatch(eptxts, arrays, mag, prec);
+  }
+
+  void decodeBatch(std::vector<std::vector<cx_double>>& arrays,
+                   const std::vector<zzX>& ptxts,
+                   double scaling) const
+  {
+    getCx().decodeBatch(arrays, ptxts, scaling);
+  }
+
   template <typename PTXT, typename ARRAY>
   void decode(ARRAY& array, const PTXT& ptxt) const
   {
     rep->decode(array, ptxt);
   }
 
+  template <typename ARRAY>
+  void decodeSlots(ARRAY& array,
+                   const NTL::ZZX& ptxt,
+                   const std::vector<long>& slots) const
+  {
+    rep->decodeSlots(array, ptxt, slots);
+  }
+
   template <typename T>
   void random(std::vector<T>& array) const
   {
@@ -1901,6 +2156,28 @@ public:
     rep->rawDecrypt(ctxt, sKey, ptxt);
   }
 
+  template <typename T>
+  void decryptSlots(const Ctxt& ctxt,
+                    const SecKey& sKey,
+                    T& ptxt,
+                    const std::vector<long>& slots) const
+  {
+    rep->decryptSlots(ctxt, sKey, ptxt, slots);
+  }
+
+  long decrypt1Slot(const Ctxt& ctxt, const SecKey& sKey, long i) const
+  {
+    return rep->decrypt1Slot(ctxt, sKey, i);
+  }
+
+  void decryptCoeffs(const Ctxt& ctxt,
+                     const SecKey& sKey,
+                     std::vector<long>& coeffs,
+                     const std::vector<long>& indices) const
+  {
+    rep->decryptCoeffs(ctxt, sKey, coeffs, indices);
+  }
+
   void decryptComplex(const Ctxt& ctxt,
                       const SecKey& sKey,
                       PlaintextArray& ptxt,
@@ -2623,6 +2900,23 @@ inline double Distance(const PtxtArray& a, const PtxtArray& b)
 inline void totalSums(PtxtArray& a) { totalSums(a.ea, a.pa); }
 inline void runningSums(PtxtArray& a) { runningSums(a.ea, a.pa); }
 
+//! @brief Encrypt ptxts[i] into ctxts[i] for every i, in parallel on the NTL
+//! thread pool, as by PtxtArray::encrypt. Every ciphertext already refers to
+//! the key to encrypt with, and ctxts must have as many as ptxts. Each
+//! plaintext is encrypted with a PRG stream of its own, seeded from the
+//! current one, so the result does not depend on the number of threads.
+void encrypt(std::vector<Ctxt>& ctxts,
+             const std::vector<PtxtArray>& ptxts,
+             double mag = -1,
+             OptLong prec = OptLong());
+
+//! @brief Decrypt ctxts[i] into ptxts[i] for every i, in parallel, as by
+//! PtxtArray::decrypt. ptxts must have as many entries as ctxts.
+void decrypt(std::vector<PtxtArray>& ptxts,
+             const std::vector<Ctxt>& ctxts,
+             const SecKey& sKey,
+             OptLong prec = OptLong());
+
 //=====================================
 
 // Following are functions for performing "higher level"
@@ -2633,7 +2927,13 @@ inline void runningSums(PtxtArray& a) { runningSums(a.ea, a.pa); }
 //! @brief A ctxt that encrypts \f$(x_1, ..., x_n)\f$ is replaced by an
 //! encryption of \f$(y_1, ..., y_n)\f$, where \f$y_i = sum_{j\le i} x_j\f$.
 void runningSums(const EncryptedArray& ea, Ctxt& ctxt);
-// The implementation uses O(log n) shift operations.
+// When the key has the baby-step/giant-step matrices of addSome1DMatrices,
+// the shifts along every dimension are hoisted, with O(sqrt(ord))
+// automorphisms per dimension. Otherwise, the implementation uses O(log n)
+// shift operations.
+
+//! @brief runningSums of each of ctxts, in parallel.
+void runningSums(const EncryptedArray& ea, std::vector<Ctxt>& ctxts);
 
 inline void runningSums(Ctxt& ctxt)
 {
@@ -2643,6 +2943,12 @@ inline void runningSums(Ctxt& ctxt)
 //! @brief A ctxt that encrypts \f$(x_1, ..., x_n)\f$ is replaced by an
 //! encryption of \f$(y, ..., y)\$, where \f$y = sum_{j=1}^n x_j.\f$
 void totalSums(const EncryptedArray& ea, Ctxt& ctxt);
+// As for runningSums, the rotations of every dimension are hoisted when the
+// key has the matrices of addSome1DMatrices, otherwise O(log n) rotations
+// double the sums.
+
+//! @brief totalSums of each of ctxts, in parallel.
+void totalSums(const EncryptedArray& ea, std::vector<Ctxt>& ctxts);
 
 inline void totalSums(Ctxt& ctxt)
 {
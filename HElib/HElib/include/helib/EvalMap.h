@@ -66,14 +66,35 @@ public:
           const NTL::Vec<long>& mvec,
           bool _invert,
           bool build_cache,
-          bool normal_basis = true);
+          bool normal_basis = true,
+          bool doubleHoist = false);
 
   // the normal_basis parameter indicates that we want the
   // normal basis transformation when invert == true.
   // On by default, off for testing
+  // the doubleHoist parameter selects the double-hoisted
+  // baby-step/giant-step strategy of MatMul1DExec for the
+  // 1D transformations (the block matrix does not use BSGS)
+
+  // Read a map written by writeTo, for the same EncryptedArray, without
+  // building its matrices again
+  EvalMap(const EncryptedArray& _ea, std::istream& str);
+  void writeTo(std::ostream& str) const;
 
   void upgrade();
   void apply(Ctxt& ctxt) const;
+
+  // Upgrade the constants of the matrices, in order, as long as the memory
+  // this adds fits in budget bytes, at once or lazily over the prime sets
+  // they are used at (see ConstMultiplierCache::upgradeWithin), and the bytes
+  // held by all the constants
+  void upgradeWithin(long& budget, bool lazily = false);
+  long cacheBytes() const;
+
+  // Adds to autos[dim] the automorphisms that apply uses in every dimension
+  // dim (-1 for the Frobenius), when the key has the HELIB_KSS_FULL strategy
+  // in all of them
+  void automorphisms(std::map<long, std::set<long>>& autos) const;
 };
 
 //! @class ThinEvalMap
@@ -83,13 +104,20 @@ public:
 //! The interface is exactly the same as for EvalMap,
 //! except that the constructor does not have a normal_basis
 //! parameter.
+//!
+//! With sparseDims > 0, only the slots whose coordinates are 0 in the
+//! dimensions 0, ..., sparseDims-1 are used. In these dimensions the forward
+//! map replicates the used slots and the inverse map only computes the
+//! coefficients of index 0, which it replicates to all the slots. Each of
+//! these steps takes O(log D) rotations, for a dimension of size D.
 
 class ThinEvalMap
 {
 private:
   const EncryptedArray& ea;
-  bool invert;   // apply transformation in inverse order?
-  long nfactors; // how many factors of m
+  bool invert;     // apply transformation in inverse order?
+  long nfactors;   // how many factors of m
+  long sparseDims; // how many leading dimensions only use coordinate 0
   NTL::Vec<std::unique_ptr<MatMulExecBase>> matvec; // regular matrices
 
 public:
@@ -97,10 +125,34 @@ public:
               bool minimal,
               const NTL::Vec<long>& mvec,
               bool _invert,
-              bool build_cache);
+              bool build_cache,
+              bool doubleHoist = false,
+              long _sparseDims = 0);
+
+  // sparseDims may be at most the number of dimensions of the factors of
+  // mvec but the last one
+
+  // Read a map written by writeTo, for the same EncryptedArray, without
+  // building its matrices again
+  ThinEvalMap(const EncryptedArray& _ea, std::istream& str);
+  void writeTo(std::ostream& str) const;
 
   void upgrade();
   void apply(Ctxt& ctxt) const;
+
+  // Upgrade the constants of the matrices, in order, as long as the memory
+  // this adds fits in budget bytes, at once or lazily over the prime sets
+  // they are used at (see ConstMultiplierCache::upgradeWithin), and the bytes
+  // held by all the constants
+  void upgradeWithin(long& budget, bool lazily = false);
+  long cacheBytes() const;
+
+  long getSparseDims() const { return sparseDims; }
+
+  // Adds to autos[dim] the automorphisms that apply uses in every dimension
+  // dim (-1 for the Frobenius), when the key has the HELIB_KSS_FULL strategy
+  // in all of them
+  void automorphisms(std::map<long, std::set<long>>& autos) const;
 };
 
 } // namespace helib
@@ -16,7 +16,7 @@
  * @brief Implementation of a map indexed by a dynamic set of integers.
  **/
 
-#include <unordered_map>
+#include <vector>
 #include <helib/IndexSet.h>
 #include <helib/ClonedPtr.h>
 
@@ -38,12 +38,15 @@ public:
 //! @brief IndexMap<T> implements a generic map indexed by a dynamic index set.
 //!
 //! Additionally, it allows new elements of the map to be initialized in a
-//! flexible manner.
+//! flexible manner. The elements are kept in a vector indexed directly by j,
+//! as the index sets are small and dense.
 template <typename T>
 class IndexMap
 {
 
-  std::unordered_map<long, T> map;
+  // map[j] is the element of j for j in indexSet, and a default-constructed
+  // one for the other j < map.size()
+  std::vector<T> map;
 
   IndexSet indexSet;
   ClonedPtr<IndexMapInit<T>> init;
@@ -75,11 +78,7 @@ public:
   const T& operator[](long j) const
   {
     assertTrue(indexSet.contains(j), "Key not found");
-    // unordered_map does not support a const [] operator,
-    // so we have to artificially strip away the const-ness here
-    std::unordered_map<long, T>& map1 =
-        const_cast<std::unordered_map<long, T>&>(map);
-    return map1[j];
+    return map[j];
   }
 
   //! @brief Insert indexes to the IndexSet.
@@ -89,12 +88,16 @@ public:
   {
     if (!indexSet.contains(j)) {
       indexSet.insert(j);
+      if (j >= long(map.size()))
+        map.resize(j + 1);
       if (init)
         init->init(map[j]);
     }
   }
   void insert(const IndexSet& s)
   {
+    if (s.last() >= long(map.size()))
+      map.resize(s.last() + 1);
     for (long i = s.first(); i <= s.last(); i = s.next(i))
       insert(i);
   }
@@ -102,13 +105,15 @@ public:
   //! @brief Delete indexes from IndexSet, may cause objects to be destroyed.
   void remove(long j)
   {
+    if (indexSet.contains(j))
+      map[j] = T();
     indexSet.remove(j);
-    map.erase(j);
   }
   void remove(const IndexSet& s)
   {
     for (long i = s.first(); i <= s.last(); i = s.next(i))
-      map.erase(i);
+      if (indexSet.contains(i))
+        map[i] = T();
     indexSet.remove(s);
   }
 
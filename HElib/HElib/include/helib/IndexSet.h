@@ -16,6 +16,8 @@
  * @brief A dynamic set of integers
  **/
 
+#include <cstdint>
+
 #include <helib/NumbTh.h>
 
 #include <helib/JsonWrapper.h>
@@ -24,6 +26,10 @@ namespace helib {
 
 //! @brief A dynamic set of non-negative integers.
 //!
+//! The set is a bit-vector whose first INLINE_BITS bits are stored in the
+//! object itself, so the sets of primes of a usual modulus chain are copied
+//! and combined without touching the heap, a machine word at a time.
+//!
 //! You can iterate through a set as follows:
 //! \code
 //!    for (long i = s.first(); i <= s.last(); i = s.next(i)) ...
@@ -31,17 +37,48 @@ namespace helib {
 //! \endcode
 class IndexSet
 {
-  std::vector<bool> rep;
-  // NOTE: modern versions of C++ are supposed
-  // to implement this efficiently as a "specialized template class".
+public:
+  //! @brief The number of elements stored without a heap allocation
+  static constexpr long INLINE_BITS = 128;
+
+private:
+  using Word = std::uint64_t;
+  static constexpr long WORD_BITS = 64;
+  static constexpr long INLINE_WORDS = INLINE_BITS / WORD_BITS;
+
+  // The characteristic function of the set: word w is inlineRep[w] for
+  // w < INLINE_WORDS and extraRep[w - INLINE_WORDS] after that, the missing
+  // words are zero
+  Word inlineRep[INLINE_WORDS];
+  std::vector<Word> extraRep;
 
   long _first, _last, _card;
 
   // Invariant: if _card == 0, then _first = 0, _last = -1;
   // otherwise, _first (resp. _last) is the lowest (resp. highest)
   // index in the set.
-  // In any case, the std::vector rep always defines the characteristic
-  // function of the set.
+
+  long numWords() const { return INLINE_WORDS + long(extraRep.size()); }
+
+  Word word(long w) const
+  {
+    if (w < INLINE_WORDS)
+      return inlineRep[w];
+    return w < numWords() ? extraRep[w - INLINE_WORDS] : 0;
+  }
+
+  // Word w, with the storage grown to hold it
+  Word& wordRef(long w)
+  {
+    if (w < INLINE_WORDS)
+      return inlineRep[w];
+    if (w >= numWords())
+      extraRep.resize(w - INLINE_WORDS + 1, 0);
+    return extraRep[w - INLINE_WORDS];
+  }
+
+  // Recompute _first, _last and _card from the words
+  void recount();
 
   // private helper function
   void intervalConstructor(long low, long high);
@@ -50,19 +87,30 @@ public:
   /*** constructors ***/
 
   // @brief No-argument constructor, creates empty set
-  IndexSet() : _first(0), _last(-1), _card(0) {}
+  IndexSet() : inlineRep(), _first(0), _last(-1), _card(0) {}
 
   // @brief Constructs an interval, low to high
-  IndexSet(long low, long high) { intervalConstructor(low, high); }
+  IndexSet(long low, long high) : inlineRep()
+  {
+    intervalConstructor(low, high);
+  }
 
   // @brief Constructs a singleton set
-  explicit IndexSet(long j) { intervalConstructor(j, j); }
+  explicit IndexSet(long j) : inlineRep() { intervalConstructor(j, j); }
 
   // copy constructor: use the built-in copy constructor
+  IndexSet(const IndexSet& other) = default;
+
+  // move constructor: leaves other empty
+  IndexSet(IndexSet&& other) noexcept;
 
   /*** assignment ***/
 
   // assignment: use the built-in assignment operator
+  IndexSet& operator=(const IndexSet& other) = default;
+
+  // move assignment: leaves other empty
+  IndexSet& operator=(IndexSet&& other) noexcept;
 
   //! @brief Returns the first element, 0 if the set is empty
   long first() const { return _first; }
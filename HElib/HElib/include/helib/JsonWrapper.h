@@ -2,6 +2,7 @@
 #define JSONWRAPPER_HIDDEN_H
 #include <string>
 #include <any>
+#include <ostream>
 
 namespace helib {
 
@@ -23,6 +24,15 @@ private:
   std::any json_obj;
 };
 
+//! @brief Stream manipulator: make the JSON writers of DoubleCRT, Ctxt,
+//! KeySwitch, PubKey and SecKey write the residues on this stream as base64
+//! strings of their 64-bit words instead of arrays of numbers. The readers
+//! accept either form.
+std::ostream& jsonBase64Residues(std::ostream& str);
+
+//! @brief Stream manipulator: write the residues as arrays of numbers again
+std::ostream& jsonNumericResidues(std::ostream& str);
+
 } // namespace helib
 
 #endif // JSONWRAPPER_HIDDEN_H
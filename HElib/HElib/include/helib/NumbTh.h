@@ -66,16 +66,18 @@ namespace FHEglobals {
 //! The dry-run option disables most operations, to save time. This lets
 //! us quickly go over the evaluation of a circuit and estimate the
 //! resulting noise magnitude, without having to actually compute anything.
-extern bool dryRun;
+//! The flag is set per thread, see threadSettings.h.
+extern thread_local bool dryRun;
 
 //! @brief A list of required automorphisms
 //! When non-nullptr, causes Ctxt::smartAutomorphism to just record the
 //! requested automorphism rather than actually performing it. This can
 //! be used to get a list of needed automorphisms for certain operations
 //! and then generate all these key-switching matrices. Should only be
-//! used in conjunction with dryRun=true
-extern std::set<long>* automorphVals;
-extern std::set<long>* automorphVals2;
+//! used in conjunction with dryRun=true. Set per thread like dryRun, the
+//! workers of a parallel region record into the set of the calling thread.
+extern thread_local std::set<long>* automorphVals;
+extern thread_local std::set<long>* automorphVals2;
 
 } // namespace FHEglobals
 
@@ -96,7 +98,8 @@ inline bool isSetAutomorphVals()
   return FHEglobals::automorphVals != nullptr;
 }
 
-inline void recordAutomorphVal(long k) { FHEglobals::automorphVals->insert(k); }
+// Thread-safe, the workers of a parallel region share the set
+void recordAutomorphVal(long k);
 
 inline void setAutomorphVals2(std::set<long>* aVals)
 {
@@ -108,10 +111,7 @@ inline bool isSetAutomorphVals2()
   return FHEglobals::automorphVals2 != nullptr;
 }
 
-inline void recordAutomorphVal2(long k)
-{
-  FHEglobals::automorphVals2->insert(k);
-}
+void recordAutomorphVal2(long k);
 
 typedef long LONG; // using this to identify casts that we should
                    // really get rid of at some point in the future
@@ -236,6 +236,45 @@ void applyLinPoly(NTL::GF2E& beta,
 //! Base-2 logarithm
 inline double log2(const NTL::xdouble& x) { return log(x) * 1.442695040889; }
 
+//! @brief Inline versions of a += b and a *= b for the noise bookkeeping of
+//! the cheap ciphertext operations. An xdouble is x * NTL_XD_BOUND^e, so when
+//! the exponents agree (and the double operand is within the range of the
+//! mantissa) this is double arithmetic on x, followed by NTL's normalization
+//! only if x leaves its range. Otherwise they fall back to NTL's operators.
+inline void xdoubleAddTo(NTL::xdouble& a, const NTL::xdouble& b)
+{
+  if (a.e != b.e) {
+    a += b;
+    return;
+  }
+  a.x += b.x;
+  if (std::fabs(a.x) > NTL_XD_HBOUND || std::fabs(a.x) < NTL_XD_HBOUND_INV)
+    a.normalize();
+}
+
+inline void xdoubleAddTo(NTL::xdouble& a, double b)
+{
+  if (a.e != 0 || std::fabs(b) > NTL_XD_HBOUND) {
+    a += NTL::to_xdouble(b);
+    return;
+  }
+  a.x += b;
+  if (std::fabs(a.x) > NTL_XD_HBOUND || std::fabs(a.x) < NTL_XD_HBOUND_INV)
+    a.normalize();
+}
+
+inline void xdoubleMulBy(NTL::xdouble& a, double b)
+{
+  double ab = std::fabs(b);
+  if (ab > NTL_XD_HBOUND || (ab < NTL_XD_HBOUND_INV && b != 0.0)) {
+    a *= NTL::to_xdouble(b);
+    return;
+  }
+  a.x *= b;
+  if (std::fabs(a.x) > NTL_XD_HBOUND || std::fabs(a.x) < NTL_XD_HBOUND_INV)
+    a.normalize();
+}
+
 //! @brief Factoring by trial division, only works for N<2^{60}, only the
 //! primes are recorded, not their multiplicity.
 void factorize(std::vector<long>& factors, long N);
@@ -448,6 +448,22 @@ public:
 
 //! \endcond
 
+//! @brief The factors of Phi_m(X) mod p^r and their CRT coefficients, i.e.
+//! the tables of a PAlgebraMod that are expensive to compute. They are
+//! carried in the bootstrap bundle so that reading a context back does not
+//! factor Phi_m(X) again.
+struct PAlgebraTables
+{
+  long m = 0;
+  long p = 0;
+  long r = 0;
+  std::vector<zzX> factors;   // factors[i] = F_t with t = T[i], in [0, p^r)
+  std::vector<zzX> crtCoeffs; // (prod_{j != i} F_j)^{-1} mod F_i
+
+  void writeTo(std::ostream& str) const;
+  static PAlgebraTables readFrom(std::istream& str);
+};
+
 //! Virtual base class for PAlgebraMod
 class PAlgebraModBase
 {
@@ -475,6 +491,9 @@ public:
   virtual void restoreContext() const = 0;
 
   virtual zzX getMask_zzX(long i, long j) const = 0;
+
+  //! Returns the factors and CRT coefficients, see PAlgebraTables
+  virtual PAlgebraTables getTables() const = 0;
 };
 
 #ifndef DOXYGEN_IGNORE
@@ -584,13 +603,28 @@ private:
   std::vector<RX> crtTable;
   std::shared_ptr<TNode<RX>> crtTree;
 
+  // When Phi_m(X) splits into linear factors mod p^r, the slots are the
+  // values at zeta^slotExps[i] for an m'th root of unity zeta, and the CRT
+  // maps are evaluations/interpolations over all powers of zeta. These are
+  // computed with one multiplication each (Bluestein's chirp transform).
+  std::vector<long> slotExps; // empty unless all factors are linear
+  vec_R rootPows;             // rootPows[e] = zeta^e, e < m
+  RX chirp, invChirp; // coefficient l is zeta^{l(l-1)/2} and its inverse
+
+  void computeFactors();
   void genMaskTable();
   void genCrtTable();
+  void genChirpTables();
 
 public:
   PAlgebraModDerived& operator=(const PAlgebraModDerived&) = delete;
 
-  PAlgebraModDerived(const PAlgebra& zMStar, long r);
+  //! If tables is not null, the factors and CRT coefficients are taken from
+  //! it rather than computed.
+  //! @throws IOError if tables was computed for other parameters
+  PAlgebraModDerived(const PAlgebra& zMStar,
+                     long r,
+                     const PAlgebraTables* tables = nullptr);
 
   PAlgebraModDerived(const PAlgebraModDerived& other) // copy constructor
       :
@@ -604,9 +638,15 @@ public:
     restoreContext();
     PhimXMod = other.PhimXMod;
     factors = other.factors;
+    factorsOverZZ = other.factorsOverZZ;
+    crtCoeffs = other.crtCoeffs;
     maskTable = other.maskTable;
     crtTable = other.crtTable;
     crtTree = other.crtTree;
+    slotExps = other.slotExps;
+    rootPows = other.rootPows;
+    chirp = other.chirp;
+    invChirp = other.invChirp;
   }
 
   //! Returns a pointer to a "clone"
@@ -636,6 +676,8 @@ public:
   //! Restores the NTL context for p^r
   virtual void restoreContext() const override { pPowRContext.restore(); }
 
+  virtual PAlgebraTables getTables() const override;
+
   /* In all of the following functions, it is expected that the caller
      has already restored the relevant modulus (p^r), which
      can be done by invoking the method restoreContext()
@@ -675,6 +717,10 @@ public:
     return balanced_zzX(maskTable.at(i).at(j));
   }
 
+  //! @brief Whether the CRT maps below use the transform for linear factors
+  //! (i.e., the order of p modulo m is 1) rather than the factor tree
+  bool hasLinearSlots() const { return !slotExps.empty(); }
+
   ///@{
   //! @name Embedding in the plaintext slots and decoding back
   //! In all the functions below, G must be irreducible mod p,
@@ -723,6 +769,16 @@ public:
                        const RX& ptxt,
                        const MappingData<type>& mappingData) const;
 
+  //! @brief As decodePlaintext, but only for the given slots: alphas[k]
+  //! corresponds to t = T[slots[k]]. Every slot costs one reduction mod Ft
+  //! (one evaluation if the slots are linear) rather than a share of the CRT
+  //! decomposition of all of them.
+  //! @throws OutOfRange if a slot index is not in [0, nSlots)
+  void decodeSlots(std::vector<RX>& alphas,
+                   const RX& ptxt,
+                   const MappingData<type>& mappingData,
+                   const std::vector<long>& slots) const;
+
   //! @brief Returns a coefficient std::vector C for the linearized polynomial
   //! representing M.
   //!
@@ -751,6 +807,10 @@ private:
   //! optional rF1 contains the output of mapToF1, to speed this operation.
   void mapToFt(RX& w, const RX& G, long t, const RX* rF1 = nullptr) const;
 
+  //! out[j] = sum_k in[k] w^{jk} for j < m, where w = zeta or w = zeta^{-1}
+  //! (inverse), and in has at most m coefficients
+  void chirpTransform(vec_R& out, const RX& in, bool inverse) const;
+
   void buildTree(std::shared_ptr<TNode<RX>>& res,
                  long offset,
                  long extent) const;
@@ -796,12 +856,20 @@ public:
   {
     throw LogicError("PAlgebraModCx::getMask_zzX undefined");
   }
+
+  PAlgebraTables getTables() const override
+  {
+    throw LogicError("PAlgebraModCx::getTables undefined");
+  }
 };
 
 typedef PAlgebraModDerived<PA_cx> PAlgebraModCx;
 
-//! Builds a table, of type PA_GF2 if p == 2 and r == 1, and PA_zz_p otherwise
-PAlgebraModBase* buildPAlgebraMod(const PAlgebra& zMStar, long r);
+//! Builds a table, of type PA_GF2 if p == 2 and r == 1, and PA_zz_p otherwise,
+//! from the given tables if they are not null
+PAlgebraModBase* buildPAlgebraMod(const PAlgebra& zMStar,
+                                  long r,
+                                  const PAlgebraTables* tables = nullptr);
 
 // A simple wrapper for a pointer to an object of type PAlgebraModBase.
 //
@@ -823,8 +891,10 @@ public:
 
   PAlgebraMod& operator=(const PAlgebraMod&) = delete;
 
-  explicit PAlgebraMod(const PAlgebra& zMStar, long r) :
-      rep(buildPAlgebraMod(zMStar, r))
+  explicit PAlgebraMod(const PAlgebra& zMStar,
+                       long r,
+                       const PAlgebraTables* tables = nullptr) :
+      rep(buildPAlgebraMod(zMStar, r, tables))
   {}
   // constructor
 
@@ -869,6 +939,9 @@ public:
   void restoreContext() const { rep->restoreContext(); }
 
   zzX getMask_zzX(long i, long j) const { return rep->getMask_zzX(i, j); }
+
+  //! Returns the factors and CRT coefficients, see PAlgebraTables
+  PAlgebraTables getTables() const { return rep->getTables(); }
 };
 
 //! returns true if the palg parameters match the rest, false otherwise
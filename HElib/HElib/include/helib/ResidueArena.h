@@ -0,0 +1,155 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef HELIB_RESIDUEARENA_H
+#define HELIB_RESIDUEARENA_H
+/**
+ * @file ResidueArena.h
+ * @brief Recycling the storage of short-lived DoubleCRTs
+ *
+ * Digit extraction, polynomial evaluation and key switching create and
+ * destroy many temporary ciphertexts, and every one of them allocates and
+ * frees the slabs of its DoubleCRTs. While a ResidueArena is active, the
+ * freed slabs are kept in a cache of the freeing thread and handed out again
+ * to the next slab of the same size, so a steady-state loop does no system
+ * allocation for its residues. The cached slabs are released when the arena
+ * is destroyed.
+ *
+ * The parallel regions of the library run through HELIB_EXEC_RANGE and
+ * HELIB_EXEC_INDEX, which make the workers adopt the arena of the calling
+ * thread. Every thread has its own cache, so the workers do not contend on a
+ * lock either.
+ *
+ * The storage that is taken from the system for the slabs, and for the
+ * Shoup companions of the key-switching matrices and of the constants, may
+ * come from huge pages (see setHugePageMode): the slabs of large parameters
+ * span megabytes, and the NTTs and automorphisms that walk them miss the TLB
+ * on every 4 KiB page.
+ */
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <helib/multicore.h>
+
+namespace helib {
+
+//! @class ResidueArena
+//! @brief Recycles the slabs of the DoubleCRTs freed by the thread that
+//! created it, and by the threads that adopt it, for its lifetime. Arenas
+//! nest: a slab is cached by the current arena of the thread that frees it.
+//! An arena must be destroyed on the thread that created it, in reverse order
+//! of construction, when no other thread is using it.
+class ResidueArena
+{
+public:
+  //! @brief The default bound on the bytes cached by each thread
+  static constexpr long DEFAULT_MAX_CACHED_BYTES = 1L << 28;
+
+  //! @brief An arena caching at most maxCachedBytes bytes on every thread
+  explicit ResidueArena(long maxCachedBytes = DEFAULT_MAX_CACHED_BYTES);
+  ~ResidueArena();
+  ResidueArena(const ResidueArena&) = delete;
+  ResidueArena& operator=(const ResidueArena&) = delete;
+
+  //! @brief The innermost arena of the calling thread, nullptr if there is
+  //! none
+  static ResidueArena* current();
+
+  //! @brief Number of slabs that had to be allocated from the system
+  long systemAllocations() const { return allocated; }
+
+  //! @brief Number of slabs that were served from a cache
+  long reuses() const { return reused; }
+
+  //! @brief Make arena (which may be null) the current arena of the calling
+  //! thread for the lifetime of this object, e.g. in a worker thread
+  class Adopt
+  {
+  public:
+    explicit Adopt(ResidueArena* arena);
+    ~Adopt();
+    Adopt(const Adopt&) = delete;
+    Adopt& operator=(const Adopt&) = delete;
+
+  private:
+    ResidueArena* previous;
+  };
+
+  //! @brief Allocate n longs, aligned to ALIGNMENT bytes, from the cache of
+  //! the current arena of the calling thread if there is one
+  static long* allocate(long n);
+
+  //! @brief Free a block of n longs obtained from allocate, keeping it in the
+  //! cache of the current arena of the calling thread if there is one
+  static void release(long* p, long n);
+
+  //! @brief The alignment of the blocks, in bytes
+  static constexpr long ALIGNMENT = 64;
+
+private:
+  // The blocks cached by one thread, by size
+  struct Cache
+  {
+    std::unordered_map<long, std::vector<long*>> blocks;
+    long bytes = 0;
+  };
+
+  Cache& threadCache();
+
+  ResidueArena* parent;
+  long id; // distinguishes this arena from earlier ones at the same address
+  long maxCachedBytes;
+  HELIB_atomic_long allocated;
+  HELIB_atomic_long reused;
+
+  HELIB_MUTEX_TYPE mx; // protects caches
+  std::vector<std::unique_ptr<Cache>> caches;
+};
+
+//! @brief Where the system allocations of residues come from. NONE uses the
+//! default allocator. TRANSPARENT asks the kernel to back the blocks with
+//! transparent huge pages, which it does if they are enabled (the "madvise"
+//! or "always" setting). EXPLICIT takes them from the pool of reserved huge
+//! pages (vm.nr_hugepages), and falls back to TRANSPARENT when the pool is
+//! empty. Only the blocks of at least HUGE_PAGE_BYTES use huge pages, as the
+//! smaller ones would waste most of a page.
+enum class HugePageMode
+{
+  NONE,
+  TRANSPARENT,
+  EXPLICIT
+};
+
+//! @brief The size of the huge pages used for residues
+constexpr std::size_t HUGE_PAGE_BYTES = std::size_t(1) << 21;
+
+//! @brief Set the mode of the allocations made from now on, the blocks
+//! allocated before keep theirs. The default is NONE.
+//! @return false, leaving the mode unchanged, if huge pages are not
+//! supported on this platform
+bool setHugePageMode(HugePageMode mode);
+HugePageMode getHugePageMode();
+
+//! @brief Allocate bytes from the system, aligned to ResidueArena::ALIGNMENT
+//! bytes, on huge pages according to getHugePageMode()
+void* allocateResidueStorage(std::size_t bytes);
+
+//! @brief Free a block of the given bytes obtained from
+//! allocateResidueStorage
+void releaseResidueStorage(void* p, std::size_t bytes);
+
+} // namespace helib
+
+#endif // ifndef HELIB_RESIDUEARENA_H
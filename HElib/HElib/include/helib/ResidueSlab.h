@@ -0,0 +1,174 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef HELIB_RESIDUESLAB_H
+#define HELIB_RESIDUESLAB_H
+/**
+ * @file ResidueSlab.h
+ * @brief Contiguous storage for the rows of a DoubleCRT
+ **/
+
+#include <atomic>
+#include <vector>
+#include <helib/IndexSet.h>
+#include <helib/assertions.h>
+#include <helib/ResidueArena.h>
+
+namespace helib {
+
+/**
+ * @class ResidueSlab
+ * @brief The rows of a DoubleCRT, one per prime in an IndexSet, stored in a
+ * single cache-aligned allocation.
+ *
+ * The rows are laid out in increasing order of their prime index, each row
+ * starting on a cache line, and the position of every row is computed from
+ * the IndexSet when it changes. Changing the index set allocates a new slab
+ * and moves the kept rows into it. The interface follows that of IndexMap,
+ * except that the rows are plain pointers to rowLength() longs. The slabs
+ * are allocated through the current ResidueArena, if any.
+ *
+ * Copies share the slab, which carries a reference count, and the first
+ * non-const access to a shared slab makes a private copy of it. So copying
+ * a ciphertext that is only read costs no residues at all. Copies of one
+ * slab may be used by different threads, including the first write to each
+ * of them, but one ResidueSlab object is not: its private copy replaces its
+ * rows. A kernel that writes the rows of one object from several threads
+ * calls makeUnique() (or setIndexSet()) before the loop and writes through
+ * uniqueRow(), which throws if the slab is still shared.
+ **/
+class ResidueSlab
+{
+public:
+  //! @brief The alignment of the slab and of every row, in bytes
+  static constexpr long ALIGNMENT = ResidueArena::ALIGNMENT;
+
+  //! @brief An empty slab with rows of length rowLen
+  explicit ResidueSlab(long rowLen);
+
+  ResidueSlab(const ResidueSlab& other);
+  ResidueSlab(ResidueSlab&& other) noexcept;
+  ResidueSlab& operator=(const ResidueSlab& other);
+  ResidueSlab& operator=(ResidueSlab&& other) noexcept;
+  ~ResidueSlab();
+
+  //! @brief Get the underlying index set
+  const IndexSet& getIndexSet() const { return indexSet; }
+
+  //! @brief The number of entries in every row
+  long rowLength() const { return rowLen; }
+
+  //! @brief The distance between consecutive rows, in longs
+  long rowStride() const { return stride; }
+
+  //! @brief Access functions: will raise an error
+  //! if j does not belong to the current index set. The non-const one makes
+  //! the slab unique first.
+  long* operator[](long j)
+  {
+    makeUnique();
+    return data + rowOffset(j);
+  }
+  const long* operator[](long j) const { return data + rowOffset(j); }
+
+  //! @brief Write access to row j for the threads of a parallel loop: the
+  //! slab must already be unique, see makeUnique()
+  //! @throws LogicError if the slab is shared
+  long* uniqueRow(long j)
+  {
+    assertFalse(isShared(), "Parallel write to a shared slab");
+    return data + rowOffset(j);
+  }
+
+  //! @brief Make a private copy of the slab if it is shared with other
+  //! copies
+  void makeUnique()
+  {
+    if (data != nullptr && refs().load(std::memory_order_acquire) > 1)
+      unshare();
+  }
+
+  //! @brief Whether the slab is shared with other copies
+  bool isShared() const
+  {
+    return data != nullptr && refs().load(std::memory_order_acquire) > 1;
+  }
+
+  //! @brief Add s to the index set, the new rows are set to zero
+  void insert(const IndexSet& s);
+
+  //! @brief Remove s from the index set
+  void remove(const IndexSet& s);
+
+  //! @brief Make the index set equal to s, the new rows are set to zero.
+  //! The slab is unique afterwards.
+  void setIndexSet(const IndexSet& s);
+
+  //! @brief Empty the index set and release the slab
+  void clear();
+
+  //! @brief Make the slab refer to rows kept outside of the arena, e.g. in a
+  //! mapped file. rows must be aligned to ALIGNMENT bytes and point to
+  //! s.card() rows of rowStride() longs, in increasing order of the primes,
+  //! preceded by a header of ALIGNMENT bytes that starts with a reference
+  //! count (a std::atomic<long>). The owner of the storage holds one of these
+  //! references, and must keep the storage alive and writable (if only
+  //! privately) as long as the slab or any of its copies exists. The count
+  //! never drops to zero, so the rows are never freed, and the first write
+  //! through the slab makes a private copy of them.
+  void attach(long* rows, const IndexSet& s);
+
+  //! @brief The size in bytes of the header that precedes the rows of a slab
+  static constexpr long headerBytes() { return HEADER * sizeof(long); }
+
+  //! @brief Slabs are equal if they have the same index set and rows
+  bool operator==(const ResidueSlab& other) const;
+  bool operator!=(const ResidueSlab& other) const { return !(*this == other); }
+
+private:
+  IndexSet indexSet;
+  long rowLen;
+  long stride;  // rowLen rounded up to a whole number of cache lines
+  long* data;   // indexSet.card() rows of stride longs each
+  // offsets[j] is the position of row j in data, for j in indexSet
+  std::vector<long> offsets;
+
+  // The rows of a block are preceded by a header of one cache line, which
+  // holds the number of slabs that share the block
+  static constexpr long HEADER = ALIGNMENT / sizeof(long);
+
+  static std::atomic<long>& refs(long* rows)
+  {
+    return *reinterpret_cast<std::atomic<long>*>(rows - HEADER);
+  }
+  std::atomic<long>& refs() const { return refs(data); }
+
+  // A block for n longs of rows, referenced once, nullptr if n is zero
+  static long* allocateBlock(long n);
+
+  // Drop the reference of this slab to its block, freeing the block if it
+  // was the last one
+  void releaseBlock();
+
+  void unshare();
+
+  long rowOffset(long j) const
+  {
+    assertTrue(indexSet.contains(j), "Key not found");
+    return offsets[j];
+  }
+
+  void relayout(const IndexSet& s);
+};
+
+} // namespace helib
+
+#endif // ifndef HELIB_RESIDUESLAB_H
@@ -0,0 +1,136 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef HELIB_ASYNCEVAL_H
+#define HELIB_ASYNCEVAL_H
+/**
+ * @file asyncEval.h
+ * @brief Bootstrapping and other long evaluations behind futures
+ *
+ * An AsyncEvaluator queues evaluations by priority and runs at most
+ * maxConcurrent of them at a time, each on one of its runner threads, so
+ * that a server can have many bootstraps in flight without a thread per
+ * request. The parallel loops inside the evaluations all share the
+ * work-stealing scheduler of multicore.h, which overlaps them on the
+ * machine. An evaluation runs with the OpCountScope, the ResidueArena and
+ * the ThreadSettings of the thread that submitted it (see
+ * adoptCallerState() in opCounters.h).
+ */
+
+#include <atomic>
+#include <functional>
+#include <future>
+#include <memory>
+#include <type_traits>
+
+#include <helib/Ctxt.h>
+#include <helib/exceptions.h>
+#include <helib/opCounters.h>
+
+namespace helib {
+
+class PubKey;
+
+//! @brief Cancels the evaluations it was given to. Copies share the flag.
+//! An evaluation that has not started when it is cancelled never runs, and
+//! its future throws a RuntimeError. One that has started runs to the end,
+//! unless it polls cancelled() itself.
+class CancelToken
+{
+public:
+  CancelToken() : flag(std::make_shared<std::atomic<bool>>(false)) {}
+
+  void cancel() { flag->store(true); }
+  bool cancelled() const { return flag->load(); }
+
+private:
+  std::shared_ptr<std::atomic<bool>> flag;
+};
+
+//! @class AsyncEvaluator
+//! @brief A queue of evaluations whose results are futures. The evaluations
+//! with the highest priority start first, in the order they were submitted
+//! among equal priorities. Without HELIB_THREADS they run within submit().
+//! The destructor waits for all the evaluations, queued ones included,
+//! that were not cancelled.
+class AsyncEvaluator
+{
+public:
+  explicit AsyncEvaluator(long maxConcurrent = 1);
+  ~AsyncEvaluator();
+  AsyncEvaluator(const AsyncEvaluator&) = delete;
+  AsyncEvaluator& operator=(const AsyncEvaluator&) = delete;
+
+  //! @brief Queue f(), whose result or exception the future receives
+  template <typename F>
+  std::future<std::invoke_result_t<F&>> submit(F f,
+                                               long priority = 0,
+                                               CancelToken token = {})
+  {
+    using R = std::invoke_result_t<F&>;
+    auto promise = std::make_shared<std::promise<R>>();
+    std::future<R> result = promise->get_future();
+    enqueue(adoptCallerState([promise, f]() mutable {
+              try {
+                if constexpr (std::is_void_v<R>) {
+                  f();
+                  promise->set_value();
+                } else
+                  promise->set_value(f());
+              } catch (...) {
+                promise->set_exception(std::current_exception());
+              }
+            }),
+            [promise]() {
+              promise->set_exception(std::make_exception_ptr(
+                  RuntimeError("AsyncEvaluator: evaluation cancelled")));
+            },
+            priority,
+            token);
+    return result;
+  }
+
+  //! @brief Thin bootstrapping of ctxt with key.thinReCrypt(), which must
+  //! stay alive until the future is ready
+  std::future<Ctxt> thinReCryptAsync(const PubKey& key,
+                                     Ctxt ctxt,
+                                     long priority = 0,
+                                     CancelToken token = {});
+
+  //! @brief Same as thinReCryptAsync() with key.reCrypt()
+  std::future<Ctxt> reCryptAsync(const PubKey& key,
+                                 Ctxt ctxt,
+                                 long priority = 0,
+                                 CancelToken token = {});
+
+  long maxConcurrent() const { return width; }
+
+  //! The evaluations queued and not started yet, cancelled ones included
+  long pending() const;
+
+  //! The evaluations running now
+  long running() const;
+
+private:
+  struct State;
+
+  void enqueue(std::function<void()> run,
+               std::function<void()> cancel,
+               long priority,
+               const CancelToken& token);
+
+  long width;
+  std::unique_ptr<State> state;
+};
+
+} // namespace helib
+
+#endif // ifndef HELIB_ASYNCEVAL_H
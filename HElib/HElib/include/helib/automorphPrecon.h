@@ -0,0 +1,112 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef HELIB_AUTOMORPHPRECON_H
+#define HELIB_AUTOMORPHPRECON_H
+/**
+ * @file automorphPrecon.h
+ * @brief Hoisted automorphisms: many automorphisms of the same ciphertext
+ *
+ * The expensive part of a homomorphic automorphism is breaking the
+ * ciphertext into digits. When many automorphisms are applied to the same
+ * ciphertext, it is faster to break it into digits once and to rotate the
+ * digits, than to break every rotated ciphertext. The objects below do the
+ * breaking in their constructor, after which each automorphism costs only
+ * the native automorphism of the digits and the key switching. All the
+ * methods are const, so one object can be used by many threads at once.
+ */
+
+#include <memory>
+#include <vector>
+
+#include <helib/Ctxt.h>
+#include <helib/EncryptedArray.h>
+#include <helib/PtrVector.h>
+
+namespace helib {
+
+/**
+ * @class BasicAutomorphPrecon
+ * @brief Pre-computation to speed many automorphism on the same ciphertext.
+ *
+ * An BasicAutomorphPrecon object breaks the original ciphertext and keeps
+ * the digits, then when you call automorph is only needs to apply the
+ * native automorphism and key switching to the digits, which is fast(er).
+ * The results contain the special primes, they are dropped by the next
+ * cleanUp() or modulus switch.
+ **/
+class BasicAutomorphPrecon
+{
+  Ctxt ctxt;
+  NTL::xdouble noise;
+  std::vector<DoubleCRT> polyDigits;
+
+public:
+  explicit BasicAutomorphPrecon(const Ctxt& _ctxt);
+
+  //! @brief The automorphism X -> X^k of the ciphertext. If there is no
+  //! key-switching matrix for k itself, the remaining automorphisms are
+  //! applied with Ctxt::smartAutomorph
+  std::shared_ptr<Ctxt> automorph(long k) const;
+
+  //! @brief The automorphisms X -> X^ks[i] of the ciphertext, computed in
+  //! parallel
+  std::vector<Ctxt> automorph(const std::vector<long>& ks) const;
+};
+
+/**
+ * @class GeneralAutomorphPrecon
+ * @brief Hoisted automorphisms along one dimension of the hypercube (or the
+ * Frobenius automorphisms for dim == -1): automorph(i) is the automorphism
+ * by g^i, where g is the generator of dimension dim. The implementation
+ * built by buildGeneralAutomorphPrecon depends on the key-switching
+ * strategy of the dimension: a single BasicAutomorphPrecon when there are
+ * matrices for all the powers of g, baby-step/giant-step otherwise.
+ **/
+class GeneralAutomorphPrecon
+{
+public:
+  virtual ~GeneralAutomorphPrecon() {}
+
+  virtual std::shared_ptr<Ctxt> automorph(long i) const = 0;
+
+  //! @brief automorph(i) for all i in [0, n), computed in parallel. If
+  //! clean is set, cleanUp() is also called on the results.
+  std::vector<Ctxt> automorphAll(long n, bool clean = false) const;
+};
+
+//! @brief Build the hoisted automorphisms of ctxt along dimension dim
+//! (-1 for Frobenius, ea.dimension() for the dummy generator of order 1)
+std::shared_ptr<GeneralAutomorphPrecon> buildGeneralAutomorphPrecon(
+    const Ctxt& ctxt,
+    long dim,
+    const EncryptedArray& ea);
+
+//! @brief The Frobenius automorphisms X -> X^{p^j} of ctxt for j < d,
+//! hoisted and cleaned up (the first one is ctxt itself)
+std::vector<Ctxt> frobeniusImages(const Ctxt& ctxt, long d);
+
+//! @brief The Frobenius linear combinations of ctxt:
+//! out[i] = sum_{j<d} frob^j(ctxt) * constants[(i + j) mod d] for
+//! i < out.size(), with d = constants.size(). This is the shape of the
+//! unpacking of GF(p^d) slots into their coefficients. The automorphisms
+//! are those of frobeniusImages, and the out[i] are computed in parallel,
+//! each with one linearCombination. sizes bound the constants as for
+//! Ctxt::multByConstant (negative for the default).
+//! @throws InvalidArgument if there are more outputs than constants
+void frobeniusCombinations(const PtrVector<Ctxt>& out,
+                           const Ctxt& ctxt,
+                           const std::vector<const DoubleCRT*>& constants,
+                           const std::vector<double>& sizes);
+
+} // namespace helib
+
+#endif // ifndef HELIB_AUTOMORPHPRECON_H
@@ -0,0 +1,103 @@
+/* Copyright (C) 2021 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef HELIB_AUTOTUNE_H
+#define HELIB_AUTOTUNE_H
+/**
+ * @file autotune.h
+ * @brief Strategy thresholds measured on the host
+ *
+ * A few strategy choices depend on the relative speed of operations on the
+ * host rather than on operation counts:
+ *  - MatMul1DExec uses baby-step/giant-step in the dimensions larger than
+ *    bsgsThreshold;
+ *  - the digit extraction of thin bootstrapping uses the Chen/Han technique
+ *    when its degree is chenHanThreshold times smaller than the basic one
+ *    (chenHanThresholdP2 for p = 2, where the basic technique only squares);
+ *  - DoubleCRT::innerProduct splits the primes into blocks of columns, no
+ *    smaller than innerProductMinBlock, when there are more threads than
+ *    primes.
+ *
+ * A TuningProfile attached to a Context (Context::setTuningProfile) sets
+ * them, and the built-in values are used otherwise. autotune measures them
+ * with short micro-benchmarks, and useTuningProfile keeps the profile in a
+ * file: the first run on a host measures and writes it, the later runs on
+ * the same host with the same parameters read it.
+ */
+
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include <helib/Context.h>
+
+namespace helib {
+
+/**
+ * @struct TuningProfile
+ * @brief The strategy thresholds, and the host and parameters that they
+ * were measured for
+ **/
+struct TuningProfile
+{
+  // Where the thresholds were measured
+  std::string host;
+  long m = 0;
+  long p = 0;
+  long r = 0;
+  long bits = 0;
+  long threads = 0;
+
+  long bsgsThreshold = 50; // HELIB_KEYSWITCH_THRESH
+  double chenHanThreshold = 1.5;
+  double chenHanThresholdP2 = 1.75;
+  long innerProductMinBlock = 256;
+
+  //! @brief The built-in thresholds, for context on this host
+  static TuningProfile defaults(const Context& context);
+
+  //! @brief Whether the profile was measured on this host for the
+  //! parameters of context, with the same number of threads
+  bool matches(const Context& context) const;
+
+  //! @brief Write out the profile in JSON format
+  void writeTo(std::ostream& str) const;
+
+  //! @brief Read a profile written by writeTo. Throws an IOError if str
+  //! does not hold one
+  static TuningProfile readFrom(std::istream& str);
+};
+
+//! @brief The profile attached to context, or the built-in thresholds
+const TuningProfile& tuningProfile(const Context& context);
+
+/**
+ * @brief Measure the thresholds for context on this host.
+ * @param context The `Context`, its profile is restored on return.
+ * @return The measured profile, to attach with Context::setTuningProfile.
+ * @note Generates a secret key with the key-switching matrices of
+ * addSome1DMatrices, so it takes about as long as a key generation and a
+ * few dozen multiplications. Not thread safe.
+ **/
+TuningProfile autotune(Context& context);
+
+/**
+ * @brief Attach to context the profile kept in the file path, or the one
+ * measured by autotune if the file holds none for this host and these
+ * parameters, and then write that one to path.
+ * @return The attached profile.
+ **/
+std::shared_ptr<const TuningProfile> useTuningProfile(Context& context,
+                                                      const std::string& path);
+
+} // namespace helib
+
+#endif // ifndef HELIB_AUTOTUNE_H
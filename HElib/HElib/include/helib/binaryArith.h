@@ -14,6 +14,11 @@
 /**
  * @file binaryArith.h
  * @brief Implementing integer addition, multiplication in binary representation
+ *
+ * The additions, multiplications and comparisons recycle the residues of
+ * their temporary ciphertexts through a ResidueArena, the caller's if there
+ * is one and a fresh one for the call otherwise. A caller running many of
+ * them can keep one ResidueArena for the whole circuit.
  **/
 #include <helib/EncryptedArray.h>
 #include <helib/CtPtrs.h> //  defines CtPtrs, CtPtrMat
@@ -242,6 +247,32 @@ void multTwoNumbers(CtPtrs& product,
                     long sizeLimit = 0,
                     std::vector<zzX>* unpackSlotEncoding = nullptr);
 
+/**
+ * @brief Decomposes the integers in the slots of a packed ciphertext into
+ * bits, without bootstrapping.
+ * @param bits the `nBits` lowest bits, LSB first, each with plaintext space 2.
+ * @param packed ciphertext with plaintext space 2^r whose slots hold integers
+ * mod 2^r (with p = 2).
+ * @param nBits number of bits to extract, `r` if 0.
+ *
+ * The bits come from the digit extraction of extractDigitsPolyfunc. A signed
+ * integer gives its bits in 2's complement.
+ **/
+void packedToBinary(CtPtrs& bits, const Ctxt& packed, long nBits = 0);
+
+/**
+ * @brief Recomposes bits into a packed ciphertext, the inverse of
+ * `packedToBinary`.
+ * @param packed set to the sum of 2^j * `bits[j]`, mod 2^r.
+ * @param bits the bits, LSB first, with plaintext space 2. Those of index r
+ * and above do not contribute.
+ * @param r the packed plaintext space is 2^r.
+ *
+ * Bit j is first lifted to plaintext space 2^(r-j) with liftDigit, which
+ * takes r-j-1 squarings, the rest are scalar multiply-adds.
+ **/
+void binaryToPacked(Ctxt& packed, const CtPtrs& bits, long r);
+
 /**
  * @brief Decrypt the binary numbers that are encrypted in eNums.
  * @param pNums vector to decrypt the binary numbers into.
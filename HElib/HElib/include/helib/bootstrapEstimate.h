@@ -0,0 +1,77 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef HELIB_BOOTSTRAPESTIMATE_H
+#define HELIB_BOOTSTRAPESTIMATE_H
+/**
+ * @file bootstrapEstimate.h
+ * @brief Predicting the time and capacity of bootstrapping without running it
+ *
+ * The estimates are BootstrapReport objects with the same stages as the
+ * report of PubKey::thinReCrypt, so that they can be compared with measured
+ * ones. Every stage is reduced to counts of key switches, automorphisms,
+ * products with constants and ciphertext multiplications:
+ *  - the linear maps use the automorphisms of their EvalMap or ThinEvalMap
+ *    in every dimension, the key switches of a dimension are hoisted
+ *  - the digit extraction uses the multiplications and the depth of the
+ *    plan of planDigitExtraction(), i.e. of getBestParameters()
+ * These are priced with OperationCosts at the number of primes that the
+ * capacity of the stage needs. The capacity follows the noise bounds of the
+ * Context: a level of products with constants takes the bits of a constant
+ * mod the plaintext space, a level of multiplications the bits of the noise
+ * added by a modulus switch. The times are for one thread.
+ */
+
+#include <helib/bootstrapReport.h>
+
+namespace helib {
+
+class Context;
+class PubKey;
+
+//! @brief Seconds taken by the basic operations on one host, per prime of
+//! the modulus they work on
+struct OperationCosts
+{
+  double ntt = 0; //!< one forward or inverse NTT modulo one prime
+  //! multiplying one digit with a key-switching matrix, per prime, without
+  //! the NTTs
+  double keySwitch = 0;
+  double automorphism = 0; //!< of one ciphertext part, per prime
+  double scalarMult = 0;   //!< one ciphertext part times a constant, per prime
+};
+
+//! @brief Time the operations of OperationCosts on the calling thread, on
+//! ciphertexts of publicKey at the top of the modulus chain
+//! @param repetitions number of times every operation is timed
+OperationCosts measureOperationCosts(const PubKey& publicKey,
+                                     long repetitions = 10);
+
+//! @brief Predict the stages of PubKey::thinReCrypt(ctxt, our_version,
+//! lazy, report) without running it
+//! @throws LogicError if the context is not bootstrappable
+BootstrapReport estimateThinReCrypt(const Context& context,
+                                    const OperationCosts& costs,
+                                    bool our_version = false,
+                                    bool lazy = false);
+
+//! @brief Predict the stages of PubKey::reCrypt(ctxt, our_version, lazy):
+//! bootKeySwitch, coeffToSlot, digitExtraction (including the unpacking
+//! and repacking of the slots) and slotToCoeff
+//! @throws LogicError if the context has no data for thick bootstrapping
+BootstrapReport estimateReCrypt(const Context& context,
+                                const OperationCosts& costs,
+                                bool our_version = false,
+                                bool lazy = false);
+
+} // namespace helib
+
+#endif // ifndef HELIB_BOOTSTRAPESTIMATE_H
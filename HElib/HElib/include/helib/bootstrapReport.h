@@ -0,0 +1,86 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef HELIB_BOOTSTRAPREPORT_H
+#define HELIB_BOOTSTRAPREPORT_H
+/**
+ * @file bootstrapReport.h
+ * @brief Machine-readable telemetry of a bootstrapping call
+ */
+
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <helib/JsonWrapper.h>
+#include <helib/opCounters.h>
+
+namespace helib {
+
+//! @brief What one stage of bootstrapping cost
+struct BootstrapStageReport
+{
+  std::string name;
+  double wallSeconds = 0;
+  double cpuSeconds = 0; // process CPU time, i.e. summed over all threads
+  long capacityBefore = 0, capacityAfter = 0; // bits
+  OpCounts ops; // operations of the stage, including those of its workers
+  long peakMemoryKB = 0; // process high-water mark after the stage
+  // High-water mark of the residue memory during the stage, and what it
+  // allocated, in bytes, see memoryStats.h
+  long residuePeakBytes = 0;
+  long residueAllocatedBytes = 0;
+
+  //! Bits of capacity used by the stage, negative if it raised the capacity
+  long capacityConsumed() const { return capacityBefore - capacityAfter; }
+};
+
+//! @class BootstrapReport
+//! @brief Optional output of PubKey::thinReCrypt describing every stage
+//! (slotToCoeff, boot key switch, coeffToSlot, digit extraction) of the
+//! bootstrapping, or of wrapExtractDigitsThin (digit extraction only). The
+//! operations are counted with an OpCountScope per stage, so the work of
+//! other bootstrappings running at the same time is not included.
+struct BootstrapReport
+{
+  //! @brief Class label to be added to JSON serialization as object type
+  //! information.
+  static constexpr std::string_view typeName = "BootstrapReport";
+
+  long digits = 0; // number of digits extracted
+  double wallSeconds = 0, cpuSeconds = 0;
+  long peakMemoryKB = 0;
+  std::vector<BootstrapStageReport> stages;
+
+  void clear() { *this = BootstrapReport(); }
+
+  //! @brief Add the stage with the given name, or return the existing one
+  BootstrapStageReport& stage(const std::string& name);
+
+  //! Capacities before the first and after the last stage
+  long initialCapacity() const;
+  long finalCapacity() const;
+
+  void writeToJSON(std::ostream& str) const;
+  JsonWrapper writeToJSON() const;
+};
+
+//! Human-readable summary
+std::ostream& operator<<(std::ostream& str, const BootstrapReport& report);
+
+//! @brief High-water mark of the resident memory of the process in KB, 0 if
+//! it is not available on this platform
+long peakMemoryKB();
+
+} // namespace helib
+
+#endif // ifndef HELIB_BOOTSTRAPREPORT_H
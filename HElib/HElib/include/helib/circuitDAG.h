@@ -0,0 +1,113 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef HELIB_CIRCUITDAG_H
+#define HELIB_CIRCUITDAG_H
+/**
+ * @file circuitDAG.h
+ * @brief Recording a binary circuit over ciphertexts, then evaluating it with
+ * as few batched bootstrappings as possible
+ *
+ * A CircuitDAG records sums, products and negations of encrypted bits, much
+ * as the AddDAG of binaryArith.cpp does for the carries of an addition. When
+ * applied, the nodes are evaluated in layers: the nodes of a layer are those
+ * whose longest path from the inputs has the same length, so they are
+ * independent and are evaluated in parallel.
+ *
+ * Before a layer with a product that would leave less than Context::BPL()
+ * bits of capacity, the live values that lack the capacity for the products
+ * still ahead of them (on the way to the outputs) are bootstrapped together,
+ * with a single packedRecrypt. Bootstrapping only when a layer forces it,
+ * and then every value that will need it, gives the fewest batches.
+ *
+ * As with packedRecrypt, the bits are assumed to have plaintext space 2.
+ */
+
+#include <vector>
+
+#include <helib/CtPtrs.h>
+
+namespace helib {
+
+class CircuitDAG
+{
+public:
+  //! The index of a node, standing for the value it computes
+  typedef long Wire;
+
+  //! @brief An input, read from *ct when the circuit is applied. A null or
+  //! empty ciphertext is a zero.
+  Wire input(const Ctxt* ct);
+
+  //! One input for every entry of v
+  std::vector<Wire> inputs(const CtPtrs& v);
+
+  //! a + b, the XOR of two bits
+  //! @throws InvalidArgument if a or b is not a wire of this circuit
+  Wire add(Wire a, Wire b);
+
+  //! a * b, the AND of two bits
+  //! @throws InvalidArgument if a or b is not a wire of this circuit
+  Wire multiply(Wire a, Wire b);
+
+  //! 1 + a, the NOT of a bit
+  //! @throws InvalidArgument if a is not a wire of this circuit
+  Wire negate(Wire a);
+
+  //! The number of nodes, inputs included
+  long size() const { return nodes.size(); }
+
+  //! The most products on a path from the inputs to w
+  long multDepth(Wire w) const;
+
+  //! @brief Evaluate the circuit, out[i] getting the value of outputs[i]
+  //! (out is resized to match). The nodes that no output depends on are
+  //! skipped. unpackSlotEncoding is as for addTwoNumbers, it is only used if
+  //! something needs bootstrapping. Any RefreshPolicy of the context is
+  //! suspended meanwhile.
+  //! @throws InvalidArgument if an output is not a wire of this circuit, or
+  //! if bootstrapping is needed and unpackSlotEncoding is null
+  //! @throws LogicError if bootstrapping is needed and is not possible, or
+  //! does not give enough capacity
+  void apply(CtPtrs& out,
+             const std::vector<Wire>& outputs,
+             std::vector<zzX>* unpackSlotEncoding = nullptr);
+
+  //! The number of batched bootstrappings of the last apply
+  long recryptCount() const { return recrypts; }
+
+private:
+  enum class Op
+  {
+    INPUT,
+    ADD,
+    MULT,
+    NOT
+  };
+
+  struct Node
+  {
+    Op op;
+    Wire a, b;          // the operands (b is a again for NOT)
+    const Ctxt* source; // the ciphertext of an input
+    long layer;         // the longest path from the inputs
+    long multDepth;     // the most products on a path from the inputs
+  };
+
+  std::vector<Node> nodes;
+  long recrypts = 0;
+
+  Wire addNode(Op op, Wire a, Wire b);
+};
+
+} // namespace helib
+
+#endif // ifndef HELIB_CIRCUITDAG_H
@@ -0,0 +1,59 @@
+/* Copyright (C) 2021 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef HELIB_DIGITCOMPARE_H
+#define HELIB_DIGITCOMPARE_H
+/**
+ * @file digitCompare.h
+ * @brief Comparing the integers in the slots of a single ciphertext
+ *
+ * Unlike compareTwoNumbers of binaryCompare.h, which takes one ciphertext per
+ * bit, these work on a ciphertext whose slots hold integers mod p^e (its
+ * plaintext space), as after the coefficient-to-slot map of thin
+ * bootstrapping. The values are signed: x must lie in [-p^(e-1), p^(e-1)),
+ * so that the top digit of x + p^(e-1), taken with homDivideByPk, is 1 for
+ * x >= 0 and 0 for x < 0. For p = 2 this is every e-bit two's complement
+ * integer. Unsigned values below p^(e-1) can be compared with each other.
+ */
+
+#include <helib/Ctxt.h>
+
+namespace helib {
+
+//! @brief Replace x with 1 if x < 0 and 0 otherwise, mod p
+void homIsNegative(Ctxt& ctxt, RelinPolicy policy = RelinPolicy::Eager);
+
+//! @brief Set result to 1 where a < b and 0 elsewhere, mod p. a - b must lie
+//! in [-p^(e-1), p^(e-1)).
+void homIsLessThan(Ctxt& result,
+                   const Ctxt& a,
+                   const Ctxt& b,
+                   RelinPolicy policy = RelinPolicy::Eager);
+
+//! @brief Replace x with 1 if x >= 0 and -1 otherwise, mod p^e
+void homSign(Ctxt& ctxt, RelinPolicy policy = RelinPolicy::Eager);
+
+//! @brief Set result to max(a, b), mod p^e. a - b must lie in
+//! [-p^(e-1), p^(e-1)).
+void homMax(Ctxt& result,
+            const Ctxt& a,
+            const Ctxt& b,
+            RelinPolicy policy = RelinPolicy::Eager);
+
+//! @brief Set result to min(a, b), mod p^e, see homMax
+void homMin(Ctxt& result,
+            const Ctxt& a,
+            const Ctxt& b,
+            RelinPolicy policy = RelinPolicy::Eager);
+
+} // namespace helib
+
+#endif // ifndef HELIB_DIGITCOMPARE_H
@@ -0,0 +1,135 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef HELIB_DIGITPROGRAM_H
+#define HELIB_DIGITPROGRAM_H
+/**
+ * @file digitProgram.h
+ * @brief Straight-line programs for multivariate digit extraction
+ *
+ * A program computes digit extraction polynomials of increasing precision
+ * from an input x of precision 1. Register 0 holds x, and every square,
+ * mul or lin instruction defines the next register. In text form there is
+ * one instruction per line, lines starting with '#' are comments:
+ *
+ *   square a             r = r_a^2
+ *   mul a b              r = r_a * r_b
+ *   lin c1 a1 c2 a2 ...  r = c1 * r_a1 + c2 * r_a2 + ...
+ *   output a e           r_a is the digit extraction polynomial of precision e
+ *
+ * Outputs must be listed in increasing order of precision.
+ */
+
+#include <istream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <NTL/ZZ.h>
+
+namespace helib {
+
+class Ctxt;
+template <typename T>
+class SimulatedCtxt;
+
+//! @class DigitProgram
+//! @brief A straight-line program of squares, products and scalar linear
+//! combinations, such as the multivariate bit extraction chain for p = 2
+class DigitProgram
+{
+public:
+  //! @brief Parse a program in the text format described above
+  //! @throws InvalidArgument if the program is malformed
+  static DigitProgram parse(std::istream& str);
+
+  //! @brief Read a program from a file in the text format
+  //! @throws IOError if the file cannot be opened
+  static DigitProgram read(const std::string& fileName);
+
+  //! @brief The chain f2 = x^2, f4 = f2^2, f8 = 112*f2 + (94*f2 + 121*f4)^2,
+  //! f16 = 11136*f4 - (15364*f4 - 14115*f8) * (28504*f2 + 8968*f4 - f8)
+  //! for p = 2, built from BINARY_DIGIT_CHAIN in fixedProgram.h
+  static DigitProgram binary();
+
+  //! Same instructions and outputs
+  bool operator==(const DigitProgram& other) const;
+  bool operator!=(const DigitProgram& other) const
+  {
+    return !(*this == other);
+  }
+
+  //! Each of these defines the next register and returns its index
+  long addSquare(long a);
+  long addMultiply(long a, long b);
+  long addCombine(const std::vector<std::pair<NTL::ZZ, long>>& terms);
+
+  //! @brief Declare register reg to be the polynomial of precision e
+  void addOutput(long reg, long precision);
+
+  //! Number of registers, including the input
+  long registers() const { return instructions.size() + 1; }
+
+  //! Highest precision computed by the program, 1 if there is no output
+  long getMaxPrecision() const
+  {
+    return outputs.empty() ? 1 : outputs.back().second;
+  }
+
+  //! Number of outputs needed for a row of the given size: the first one,
+  //! and then every one that the previous output does not already cover
+  long outputsFor(long rowSize) const;
+
+  //! @brief Number of non-scalar multiplications and multiplicative depth
+  //! of evaluate() for a row of the given size
+  void cost(long& multiplications, long& depth, long rowSize) const;
+
+  //! @brief Evaluate the first outputsFor(rowSize) outputs on x and append
+  //! them to ctxtEval together with their precisions. Only the instructions
+  //! these outputs depend on are executed, and registers are released (or
+  //! updated in place) after their last use.
+  void evaluate(std::vector<std::pair<Ctxt, long>>& ctxtEval,
+                const Ctxt& x,
+                long rowSize) const;
+
+  //! @brief Same as evaluate() on a plaintext integer, see
+  //! digitSimulation.h. Instantiated for long and NTL::ZZ.
+  template <typename T>
+  void simulate(std::vector<std::pair<SimulatedCtxt<T>, long>>& ctxtEval,
+                const SimulatedCtxt<T>& x,
+                long rowSize) const;
+
+private:
+  enum class Op
+  {
+    Square,
+    Multiply,
+    Combine
+  };
+
+  struct Instruction
+  {
+    Op op;
+    std::vector<long> args;      // registers read
+    std::vector<NTL::ZZ> coeffs; // for Combine, one per argument
+  };
+
+  std::vector<Instruction> instructions; // instruction i defines register i+1
+  std::vector<std::pair<long, long>> outputs; // register, precision
+
+  // Registers that the first nOutputs outputs depend on
+  std::vector<bool> needed(long nOutputs) const;
+  void checkRegister(long reg) const;
+};
+
+} // namespace helib
+
+#endif // ifndef HELIB_DIGITPROGRAM_H
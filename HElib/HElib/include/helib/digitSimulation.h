@@ -0,0 +1,383 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef HELIB_DIGITSIMULATION_H
+#define HELIB_DIGITSIMULATION_H
+/**
+ * @file digitSimulation.h
+ * @brief Running the digit extraction on plaintext integers
+ *
+ * A SimulatedCtxt stands in for a Ctxt: it holds the plaintext of one slot
+ * as an integer mod its plaintext space, with the Ctxt operations that the
+ * digit extraction uses. It keeps the multiplicative depth of its value and
+ * the power of s its ciphertext would be extended to, and relinearizes
+ * under the same rules as Ctxt::multiplyBy() with a RelinPolicy. Every
+ * operation is counted in a SimulationCounts, and can be recorded in a
+ * trace with the level it runs at. PolyEvalPlan::simulate(),
+ * DigitProgram::simulate() and simulateExtractDigitsThin() follow the exact
+ * schedule of their ciphertext counterparts on it, including their
+ * relinearizations, so a plan can be checked and costed in microseconds,
+ * without keys or ciphertexts. They are instantiated for long and NTL::ZZ.
+ *
+ * Modulus switches are not simulated: they depend on the noise, which a
+ * plaintext does not have. The depth of an operation is the level that the
+ * capacity model of bootstrapEstimate.h prices it at.
+ */
+
+#include <algorithm>
+#include <map>
+#include <type_traits>
+#include <vector>
+
+#include <NTL/ZZ.h>
+
+#include <helib/assertions.h>
+#include <helib/Ctxt.h>
+#include <helib/exceptions.h>
+
+namespace helib {
+
+class Context;
+
+//! @brief One operation of a simulation
+struct SimulatedOperation
+{
+  enum Kind
+  {
+    Multiplication,       //!< non-scalar, including squarings
+    Relinearization,      //!< of a ciphertext extended to s^e, e > 1
+    ScalarMultiplication, //!< by a constant other than 1
+    Addition              //!< of two ciphertexts
+  };
+
+  Kind kind;
+  long depth;       //!< multiplicative depth of the operands
+  long keySwitches; //!< e - 1 for a relinearization up to s^e, else 0
+
+  bool operator==(const SimulatedOperation& other) const
+  {
+    return kind == other.kind && depth == other.depth &&
+           keySwitches == other.keySwitches;
+  }
+};
+
+//! @brief Operations counted by a simulation
+struct SimulationCounts
+{
+  long multiplications = 0;       //!< non-scalar, including squarings
+  long relinearizations = 0;      //!< of ciphertexts in extended form
+  long keySwitches = 0;           //!< of the relinearizations
+  long scalarMultiplications = 0; //!< by constants other than 1
+  long additions = 0;             //!< of two ciphertexts
+  //! If not null, every operation is appended to it in order
+  std::vector<SimulatedOperation>* trace = nullptr;
+};
+
+//! @class SimulatedCtxt
+//! @brief A plaintext integer of type T (long or NTL::ZZ) in place of a
+//! ciphertext, see digitSimulation.h. Copies share the counts they report to.
+template <typename T>
+class SimulatedCtxt
+{
+  static_assert(std::is_same_v<T, long> || std::is_same_v<T, NTL::ZZ>,
+                "SimulatedCtxt is only defined for long and NTL::ZZ");
+
+public:
+  //! @param p         the plaintext prime, divided out by
+  //! subtractAndDivideByP()
+  //! @param value     the plaintext, reduced mod ptxtSpace
+  //! @param ptxtSpace a power of p, below NTL_SP_BOUND for long values
+  //! @param counts    where the operations are counted, or null
+  //! @param maxRelinPower highest power of s that the keys relinearize,
+  //! see PubKey::maxRelinPower()
+  SimulatedCtxt(long p,
+                const T& value,
+                long ptxtSpace,
+                SimulationCounts* counts = nullptr,
+                long maxRelinPower = 2) :
+      p(p),
+      ptxtSpace(ptxtSpace),
+      maxRelinPower(std::max(maxRelinPower, 2L)),
+      counts(counts)
+  {
+    assertTrue<InvalidArgument>(ptxtSpace > 1,
+                                "Plaintext space must be larger than 1");
+    if constexpr (std::is_same_v<T, long>)
+      assertTrue<InvalidArgument>(ptxtSpace < NTL_SP_BOUND,
+                                  "Plaintext space too large for long "
+                                  "values, use NTL::ZZ");
+    this->value = reduce(value);
+  }
+
+  const T& getValue() const { return value; }
+  long getPtxtSpace() const { return ptxtSpace; }
+  long getDepth() const { return depth; }
+  SimulationCounts* getCounts() const { return counts; }
+
+  //! Highest power of s of the ciphertext, 1 if it is canonical
+  long getPower() const { return sPower; }
+  bool inExtendedForm() const { return sPower > 1; }
+  long getMaxRelinPower() const { return maxRelinPower; }
+
+  //! Zero, of depth 0, as after Ctxt::clear()
+  void clear()
+  {
+    value = T(0);
+    depth = 0;
+    sPower = 1;
+    empty = true;
+  }
+  bool isEmpty() const { return empty; }
+
+  //! @brief Same relinearizations as Ctxt::multiplyBy(other, policy): the
+  //! operands are relinearized first if the keys cannot relinearize their
+  //! product, and the product is relinearized right away with
+  //! RelinPolicy::Eager
+  void multiplyBy(const SimulatedCtxt& other,
+                  RelinPolicy policy = RelinPolicy::Eager)
+  {
+    long otherPower = other.sPower;
+    if (sPower + otherPower > maxRelinPower)
+      reLinearize();
+    if (sPower + otherPower > maxRelinPower) {
+      record(SimulatedOperation::Relinearization, other.depth, otherPower - 1);
+      otherPower = 1;
+    }
+    record(SimulatedOperation::Multiplication, std::max(depth, other.depth));
+    matchPtxtSpace(other.ptxtSpace);
+    value = NTL::MulMod(value, reduce(other.value), modulus());
+    depth = std::max(depth, other.depth) + 1;
+    sPower += otherPower;
+    empty = empty || other.empty;
+    if (policy == RelinPolicy::Eager)
+      reLinearize();
+  }
+  void square() { multiplyBy(*this); }
+
+  //! @brief Back to (1, s), power - 1 key switches if in extended form
+  void reLinearize()
+  {
+    if (sPower <= 1)
+      return;
+    record(SimulatedOperation::Relinearization, depth, sPower - 1);
+    sPower = 1;
+  }
+
+  //! @brief Raise to the power e with the least depth, computing every
+  //! x^i as x^(i/2) * x^(i - i/2)
+  void power(long e)
+  {
+    assertTrue<InvalidArgument>(e >= 1,
+                                "Cannot raise a ctxt to a non positive "
+                                "exponent");
+    std::map<long, SimulatedCtxt> powers{{1, *this}};
+    *this = powerOf(powers, e);
+  }
+
+  void multByConstant(const NTL::ZZ& c)
+  {
+    if (c != 1)
+      record(SimulatedOperation::ScalarMultiplication, depth);
+    value = NTL::MulMod(value, fromZZ(c), modulus());
+  }
+
+  void addConstant(const NTL::ZZ& c)
+  {
+    value = NTL::AddMod(value, fromZZ(c), modulus());
+    empty = false;
+  }
+
+  void addCtxt(const SimulatedCtxt& other, bool negative = false)
+  {
+    if (other.empty)
+      return;
+    if (empty) {
+      long ptxt = ptxtSpace;
+      *this = other;
+      if (negative)
+        negate();
+      matchPtxtSpace(ptxt);
+      return;
+    }
+    record(SimulatedOperation::Addition, std::max(depth, other.depth));
+    matchPtxtSpace(other.ptxtSpace);
+    value = negative ? NTL::SubMod(value, reduce(other.value), modulus())
+                     : NTL::AddMod(value, reduce(other.value), modulus());
+    depth = std::max(depth, other.depth);
+    sPower = std::max(sPower, other.sPower);
+  }
+
+  //! @brief this += c * other, one scalar multiplication and one addition
+  void addScaledCtxt(const SimulatedCtxt& other, const NTL::ZZ& c)
+  {
+    SimulatedCtxt scaled(other);
+    scaled.multByConstant(c);
+    addCtxt(scaled);
+  }
+
+  void negate() { value = NTL::NegateMod(value, modulus()); }
+
+  //! @brief Same as Ctxt::subtractAndDivideByP(): the difference must be
+  //! divisible by p, which holds whenever other has the right lowest digit
+  //! @throws LogicError if it is not
+  void subtractAndDivideByP(const SimulatedCtxt& other)
+  {
+    addCtxt(other, /*negative=*/true);
+    assertTrue<LogicError>(ptxtSpace > p && ptxtSpace % p == 0,
+                           "ptxtSpace must be a multiple of p larger than p");
+    bool divisible;
+    if constexpr (std::is_same_v<T, long>) {
+      divisible = (value % p == 0);
+      value /= p;
+    } else {
+      divisible = NTL::divide(value, value, p);
+    }
+    assertTrue<LogicError>(divisible,
+                           "Subtracted value has the wrong lowest digit");
+    ptxtSpace /= p;
+  }
+
+private:
+  long p;
+  T value;
+  long ptxtSpace;
+  long maxRelinPower;
+  long depth = 0;
+  long sPower = 1;
+  bool empty = false;
+  SimulationCounts* counts;
+
+  T modulus() const { return T(ptxtSpace); }
+
+  T reduce(const T& x) const
+  {
+    if constexpr (std::is_same_v<T, long>)
+      return ((x % ptxtSpace) + ptxtSpace) % ptxtSpace;
+    else
+      return x % modulus();
+  }
+
+  T fromZZ(const NTL::ZZ& c) const
+  {
+    if constexpr (std::is_same_v<T, long>)
+      return NTL::rem(c, ptxtSpace);
+    else
+      return c % modulus();
+  }
+
+  // As in Ctxt, operands with different plaintext spaces are reduced to
+  // the smaller one, both are powers of p
+  void matchPtxtSpace(long otherPtxtSpace)
+  {
+    if (otherPtxtSpace < ptxtSpace) {
+      ptxtSpace = otherPtxtSpace;
+      value = reduce(value);
+    }
+  }
+
+  void record(SimulatedOperation::Kind kind,
+              long operandDepth,
+              long keySwitches = 0) const
+  {
+    if (!counts)
+      return;
+    switch (kind) {
+    case SimulatedOperation::Multiplication:
+      counts->multiplications++;
+      break;
+    case SimulatedOperation::Relinearization:
+      counts->relinearizations++;
+      counts->keySwitches += keySwitches;
+      break;
+    case SimulatedOperation::ScalarMultiplication:
+      counts->scalarMultiplications++;
+      break;
+    case SimulatedOperation::Addition:
+      counts->additions++;
+      break;
+    }
+    if (counts->trace)
+      counts->trace->push_back({kind, operandDepth, keySwitches});
+  }
+
+  static const SimulatedCtxt& powerOf(std::map<long, SimulatedCtxt>& powers,
+                                      long e)
+  {
+    auto it = powers.find(e);
+    if (it != powers.end())
+      return it->second;
+    SimulatedCtxt result(powerOf(powers, e / 2));
+    result.multiplyBy(powerOf(powers, e - e / 2));
+    return powers.emplace(e, std::move(result)).first->second;
+  }
+};
+
+//! @brief Same as linearCombination() for ciphertexts: result is the sum of
+//! coeffs[i] * ctxts[i], or empty if all coefficients are zero
+template <typename T>
+void linearCombination(SimulatedCtxt<T>& result,
+                       const SimulatedCtxt<T>* ctxts,
+                       const NTL::ZZ* coeffs,
+                       long n)
+{
+  bool first = true;
+  for (long i = 0; i < n; i++) {
+    if (coeffs[i] == 0)
+      continue;
+    if (first) {
+      result = ctxts[i];
+      result.multByConstant(coeffs[i]);
+      first = false;
+    } else {
+      result.addScaledCtxt(ctxts[i], coeffs[i]);
+    }
+  }
+  if (first)
+    result.clear();
+}
+
+//! @brief Run customExtractDigitsThin(ctxt, botHigh, r, policy,
+//! e_inner_compose_list) on a simulated ciphertext of plaintext space
+//! p^(botHigh + r): every step uses the method of digitStepMethod() and the
+//! same polynomials and Paterson-Stockmeyer schedule, and the trapezoid
+//! updates the same rows. The result is the negation of the remaining r
+//! digits, mod p^r.
+//! @param context gives p and the polynomials, nothing is encrypted
+//! @throws LogicError if a step subtracts a wrong digit, i.e. the plan or
+//! the polynomials are not correct for this input
+template <typename T>
+void simulateExtractDigitsThin(
+    SimulatedCtxt<T>& ctxt,
+    const Context& context,
+    long botHigh,
+    long r,
+    RelinPolicy policy,
+    const std::vector<std::vector<long>>& e_inner_compose_list);
+template <typename T>
+inline void simulateExtractDigitsThin(
+    SimulatedCtxt<T>& ctxt,
+    const Context& context,
+    long botHigh,
+    long r,
+    bool lazy,
+    const std::vector<std::vector<long>>& e_inner_compose_list)
+{
+  simulateExtractDigitsThin(ctxt,
+                            context,
+                            botHigh,
+                            r,
+                            lazy ? RelinPolicy::Lazy : RelinPolicy::Eager,
+                            e_inner_compose_list);
+}
+
+} // namespace helib
+
+#endif // ifndef HELIB_DIGITSIMULATION_H
@@ -0,0 +1,109 @@
+/* Copyright (C) 2021 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef HELIB_DISTRIBUTEDBOOT_H
+#define HELIB_DISTRIBUTEDBOOT_H
+/**
+ * @file distributedBoot.h
+ * @brief Bootstrapping batches of ciphertexts on several machines
+ *
+ * A BootstrapCoordinator talks to worker processes over pairs of binary
+ * streams, e.g. the two directions of a socket or of a pair of pipes. It
+ * first ships the Context, its recryption data (see
+ * Context::writeBootstrapBundleTo) and the public key to every worker, which
+ * serves it with serveBootstrapWorker(). It then sends shards of ciphertexts
+ * to the workers, each bootstrapping its shard with all its threads, and
+ * hands the results back as they come.
+ *
+ * Every worker has at most one shard in flight, and the coordinator only
+ * takes the next ciphertexts from its source when a worker is free for them,
+ * so neither side ever holds more than a shard per worker. The coordinator
+ * collects the results of the workers in turn: it needs no threads of its own,
+ * and the workers compute at the same time while it waits for one of them.
+ */
+
+#include <functional>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+#include <helib/Ctxt.h>
+
+namespace helib {
+
+class PubKey;
+
+//! @brief The two directions of the connection to a worker
+struct BootChannel
+{
+  std::istream* in;  // from the worker
+  std::ostream* out; // to the worker
+};
+
+//! @class BootstrapCoordinator
+//! @brief Shards batches of ciphertexts over remote workers that bootstrap
+//! them. The key must stay alive as long as the coordinator.
+class BootstrapCoordinator
+{
+public:
+  //! @brief Connect to the workers, shipping them the context and key
+  //! @param thin Whether the workers use thinReCrypt() or reCrypt()
+  //! @param shardSize The number of ciphertexts sent to a worker at once
+  //! @throws InvalidArgument if there are no workers or the shards are empty
+  //! @throws LogicError if the context is not bootstrappable
+  BootstrapCoordinator(const PubKey& key,
+                       const std::vector<BootChannel>& workers,
+                       bool thin = true,
+                       long shardSize = 1);
+
+  //! Calls close(), ignoring the errors of the workers
+  ~BootstrapCoordinator();
+
+  BootstrapCoordinator(const BootstrapCoordinator&) = delete;
+  BootstrapCoordinator& operator=(const BootstrapCoordinator&) = delete;
+
+  //! @brief Bootstrap the ciphertexts that next() gives until it returns
+  //! false, passing every result and its position in the stream to done()
+  //! as soon as it comes back. The results may come out of order.
+  //! @return The number of ciphertexts bootstrapped
+  //! @throws IOError if a worker connection fails
+  //! @throws RuntimeError if a worker fails to bootstrap a shard
+  long bootstrap(const std::function<bool(Ctxt&)>& next,
+                 const std::function<void(long, Ctxt&)>& done);
+
+  //! @brief Bootstrap ctxts in place
+  void bootstrap(std::vector<Ctxt>& ctxts);
+
+  //! @brief Tell the workers to stop, after which serveBootstrapWorker()
+  //! returns on their side. Further bootstraps throw a LogicError.
+  void close();
+
+  long numWorkers() const { return channels.size(); }
+  long getShardSize() const { return shardSize; }
+
+private:
+  const PubKey& key;
+  std::vector<BootChannel> channels;
+  long shardSize;
+  bool open = true;
+};
+
+//! @brief Serve a BootstrapCoordinator on the other end of in and out: read
+//! the context and key it ships, then bootstrap its shards until it closes
+//! the connection. A shard that fails to bootstrap is reported to the
+//! coordinator, and the worker goes on with the next one.
+//! @return The number of ciphertexts bootstrapped
+//! @throws IOError if the connection fails
+long serveBootstrapWorker(std::istream& in, std::ostream& out);
+
+} // namespace helib
+
+#endif // ifndef HELIB_DISTRIBUTEDBOOT_H
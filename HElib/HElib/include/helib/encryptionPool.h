@@ -0,0 +1,85 @@
+/* Copyright (C) 2021 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef HELIB_ENCRYPTIONPOOL_H
+#define HELIB_ENCRYPTIONPOOL_H
+/**
+ * @file encryptionPool.h
+ * @brief Public-key encryption in two steps: fresh encryptions of zero
+ * computed ahead of time, then cheap encryptions that use them up
+ *
+ * Almost all of the cost of PubKey::Encrypt is in the encryption of zero
+ * r*pk + p*(e0,e1) that hides the plaintext (PubKey::encryptZero). An
+ * EncryptionPool computes these offline, in parallel, and Encrypt then only
+ * adds an encoded plaintext to one of them (PubKey::addEncoded): one
+ * conversion of the plaintext to DoubleCRT form and an addition. The
+ * ciphertexts are those of PubKey::Encrypt.
+ *
+ * Every encryption of zero is used once and then removed from the pool. A
+ * pool may be used from several threads at once, and can be written out and
+ * read back to keep it across runs. A written pool must be kept as secret as
+ * the plaintexts: whoever knows the encryption of zero that went into a
+ * ciphertext can decrypt it.
+ */
+
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+#include <helib/Ctxt.h>
+
+namespace helib {
+
+class EncodedPtxt;
+
+class EncryptionPool
+{
+public:
+  //! @brief A pool of encryptions of zero under publicKey, initially empty.
+  //! For BGV their noise is a multiple of the plaintext space of the key, so
+  //! they serve any plaintext space that divides it.
+  explicit EncryptionPool(const PubKey& publicKey);
+
+  EncryptionPool(const EncryptionPool&) = delete;
+  EncryptionPool& operator=(const EncryptionPool&) = delete;
+
+  //! @brief Adds n fresh encryptions of zero, computed in parallel on the NTL
+  //! thread pool
+  //! @note As with the batch PubKey::Encrypt, every one comes from a PRG
+  //! stream of its own, seeded from the current one
+  void fill(long n);
+
+  //! Number of encryptions of zero left in the pool
+  long size() const;
+
+  //! @brief Encrypts eptxt into ctxt with an encryption of zero from the
+  //! pool, or with a fresh one if the pool is empty
+  //! @return Whether the pool had one
+  bool Encrypt(Ctxt& ctxt, const EncodedPtxt& eptxt);
+
+  //! Writes out the encryptions of zero left in the pool, in binary
+  void writeTo(std::ostream& str) const;
+
+  //! Adds the encryptions of zero written out by writeTo to the pool
+  //! @throws IOError if they are not under the same public key parameters
+  void read(std::istream& str);
+
+private:
+  const PubKey& publicKey;
+  long ptxtSpace;
+
+  mutable std::mutex mutex;
+  std::vector<Ctxt> zeros;
+};
+
+} // namespace helib
+
+#endif // ifndef HELIB_ENCRYPTIONPOOL_H
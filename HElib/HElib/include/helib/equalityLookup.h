@@ -0,0 +1,86 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef HELIB_EQUALITYLOOKUP_H
+#define HELIB_EQUALITYLOOKUP_H
+/**
+ * @file equalityLookup.h
+ * @brief Encrypted key-value lookups by equality of the keys
+ *
+ * The database is a list of rows, each an encrypted key and an encrypted
+ * value. A key takes a block of keySlots consecutive slots (one character
+ * per slot, say), and its value the same block. The result of a query is
+ * the value of the row whose key equals the query, or zero if there is none.
+ *
+ * A row matches where mapTo01(key - query) is zero in every slot of the
+ * block: the products over the blocks take O(log keySlots) rotations, and
+ * the rows are evaluated in parallel and summed with a tree. A ciphertext
+ * holds ea.size()/keySlots blocks, so as many queries are answered at once
+ * when the rows hold their key and value in every block and the query holds
+ * one key per block.
+ */
+
+#include <vector>
+
+#include <NTL/ZZX.h>
+
+#include <helib/Ctxt.h>
+#include <helib/EncryptedArray.h>
+
+namespace helib {
+
+//! @brief Every slot of ctxt gets the product of the slots of its block of
+//! blockSize consecutive slots, which must divide ea.size(). The products use
+//! the doubling of totalSums, and the rotations of the original ciphertext
+//! are hoisted when a rotation is a single automorphism.
+//! @throws InvalidArgument if blockSize does not divide ea.size()
+void blockProducts(const EncryptedArray& ea, Ctxt& ctxt, long blockSize);
+
+//! @brief The product of all the slots in every slot, with O(log ea.size())
+//! rotations (where totalProduct of Ctxt.h takes the rotated copies)
+inline void totalProducts(const EncryptedArray& ea, Ctxt& ctxt)
+{
+  blockProducts(ea, ctxt, ea.size());
+}
+
+class EqualityLookup
+{
+public:
+  //! @brief Lookups of keys of keySlots slots
+  //! @throws InvalidArgument if keySlots does not divide ea.size()
+  EqualityLookup(const EncryptedArray& ea, long keySlots);
+
+  long keySlots() const { return blockSize; }
+
+  //! The number of queries a ciphertext holds
+  long batchSize() const { return ea.size() / blockSize; }
+
+  //! @brief 1 in all the slots of the blocks where key equals query, 0 in
+  //! the others
+  void matchMask(Ctxt& mask, const Ctxt& key, const Ctxt& query) const;
+
+  //! @brief In every block, the sum of the values of the rows whose key
+  //! equals the query in that block. The rows are evaluated in parallel.
+  //! @throws InvalidArgument if keys and values differ in size or are empty
+  void lookup(Ctxt& result,
+              const std::vector<Ctxt>& keys,
+              const std::vector<Ctxt>& values,
+              const Ctxt& query) const;
+
+private:
+  const EncryptedArray& ea;
+  long blockSize;
+  NTL::ZZX blockEnds; // 1 in the last slot of every block
+};
+
+} // namespace helib
+
+#endif // ifndef HELIB_EQUALITYLOOKUP_H
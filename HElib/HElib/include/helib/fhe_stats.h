@@ -13,26 +13,62 @@
 #ifndef HELIB_STATS_H
 #define HELIB_STATS_H
 
+#include <array>
+#include <atomic>
 #include <vector>
 #include <iostream>
 
 namespace helib {
 
+//! @brief A statistic: the number, sum, extremes and a histogram of the
+//! values it was updated with. update() takes no lock and the memory is
+//! fixed: every thread updates one of SHARDS shards of atomic counters,
+//! merged when the record is read. The histogram has BUCKETS_PER_OCTAVE
+//! logarithmic buckets per power of 2 between 2^MIN_EXP and 2^MAX_EXP, so a
+//! percentile is known within a factor 2^(1/BUCKETS_PER_OCTAVE).
 struct fhe_stats_record
 {
+  static constexpr long BUCKETS_PER_OCTAVE = 4;
+  static constexpr long MIN_EXP = -48;
+  static constexpr long MAX_EXP = 48;
+  // One bucket for values below 2^MIN_EXP, zero and negative values, and
+  // one for values from 2^MAX_EXP
+  static constexpr long BUCKETS =
+      (MAX_EXP - MIN_EXP) * BUCKETS_PER_OCTAVE + 2;
+  static constexpr long SHARDS = 8;
+
   const char* name;
-  long count;
-  double sum;
-  double max;
 
   std::vector<double> saved_values;
   // save all values --- only used if explicitly requested
 
-  static std::vector<fhe_stats_record*> map;
-
   fhe_stats_record(const char* _name);
   void update(double val);
   void save(double val);
+
+  long getCount() const;
+  double getSum() const;
+  double getMax() const; // 0 if there are no values
+  double getMin() const; // 0 if there are no values
+
+  //! @brief The smallest value of the histogram that is not exceeded by a
+  //! fraction q of the values, e.g. the median for q = 0.5. The value is
+  //! the middle of its bucket, clamped to the extremes; 0 if there are no
+  //! values.
+  double percentile(double q) const;
+
+  //! @brief The bucket of a value
+  static long bucketOf(double val);
+
+private:
+  struct Shard
+  {
+    std::atomic<long> count;
+    std::atomic<double> sum, max, min;
+    std::array<std::atomic<long>, BUCKETS> buckets;
+  };
+
+  std::array<Shard, SHARDS> shards;
 };
 
 #define HELIB_STATS_UPDATE(name, val)                                          \
@@ -55,6 +91,9 @@ void print_stats(std::ostream& s);
 
 const std::vector<double>* fetch_saved_values(const char*);
 
+//! @brief The record with the given name, nullptr if there is none
+const fhe_stats_record* fetch_stats_record(const char* name);
+
 extern bool fhe_stats;
 
 } // namespace helib
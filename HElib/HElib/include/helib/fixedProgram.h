@@ -0,0 +1,261 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef HELIB_FIXEDPROGRAM_H
+#define HELIB_FIXEDPROGRAM_H
+/**
+ * @file fixedProgram.h
+ * @brief Digit extraction chains that are fixed at compile time
+ *
+ * A FixedProgram is the constexpr counterpart of a DigitProgram. For a
+ * given number of outputs, FixedEvaluator works out at compile time which
+ * instructions are needed, which of them can run in place and how many
+ * ciphertext temporaries are needed, so that evaluate() is a straight
+ * sequence of Ctxt operations on exactly that many temporaries.
+ */
+
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <helib/Ctxt.h>
+
+namespace helib {
+
+//! One instruction of a FixedProgram, same operations as in DigitProgram
+struct FixedInstruction
+{
+  enum Op
+  {
+    Square,
+    Multiply,
+    Combine
+  };
+  static constexpr std::size_t MAX_TERMS = 3;
+
+  Op op;
+  long args[MAX_TERMS];   // registers read, unused ones are -1
+  long coeffs[MAX_TERMS]; // for Combine, one per argument
+};
+
+//! @brief N instructions (instruction i defines register i + 1, register 0
+//! is the input) and NOut outputs of increasing precision
+template <std::size_t N, std::size_t NOut>
+struct FixedProgram
+{
+  FixedInstruction instructions[N];
+  long outputs[NOut];    // registers
+  long precisions[NOut]; // precision of each output
+
+  static constexpr std::size_t size() { return N; }
+  static constexpr std::size_t outputCount() { return NOut; }
+
+  //! Same as DigitProgram::outputsFor
+  constexpr long outputsFor(long rowSize) const
+  {
+    long count = 0;
+    for (long precision = 1; count < long(NOut) && rowSize > precision;
+         count++)
+      precision = precisions[count];
+    return count;
+  }
+};
+
+//! The multivariate bit extraction chain for p = 2, see DigitProgram::binary
+inline constexpr FixedProgram<9, 4> BINARY_DIGIT_CHAIN{
+    {{FixedInstruction::Square, {0, -1, -1}, {}},            // 1: f2
+     {FixedInstruction::Square, {1, -1, -1}, {}},            // 2: f4
+     {FixedInstruction::Combine, {1, 2, -1}, {94, 121}},     // 3
+     {FixedInstruction::Square, {3, -1, -1}, {}},            // 4
+     {FixedInstruction::Combine, {1, 4, -1}, {112, 1}},      // 5: f8
+     {FixedInstruction::Combine, {2, 5, -1}, {15364, -14115}}, // 6
+     {FixedInstruction::Combine, {1, 2, 5}, {28504, 8968, -1}}, // 7
+     {FixedInstruction::Multiply, {6, 7, -1}, {}},           // 8
+     {FixedInstruction::Combine, {2, 8, -1}, {11136, -1}}},  // 9: f16
+    {1, 2, 5, 9},
+    {2, 4, 8, 16}};
+
+namespace fixed_impl {
+
+template <std::size_t N>
+struct Schedule
+{
+  bool live[N + 1];
+  long slot[N + 1];  // temporary holding each register
+  long nSlots;
+};
+
+// Liveness and slot assignment for the first nOutputs outputs: a result is
+// computed in the slot of its first argument if that argument dies there,
+// otherwise in a free slot
+template <std::size_t N, std::size_t NOut>
+constexpr Schedule<N> makeSchedule(const FixedProgram<N, NOut>& program,
+                                   std::size_t nOutputs)
+{
+  Schedule<N> s{};
+  long lastUse[N + 1] = {};
+  for (std::size_t r = 0; r <= N; r++) {
+    s.slot[r] = -1;
+    lastUse[r] = -1;
+  }
+  for (std::size_t k = 0; k < nOutputs; k++)
+    s.live[program.outputs[k]] = true;
+  for (std::size_t i = N; i-- > 0;)
+    if (s.live[i + 1])
+      for (long a : program.instructions[i].args)
+        if (a >= 0)
+          s.live[a] = true;
+  for (std::size_t i = 0; i < N; i++)
+    if (s.live[i + 1])
+      for (long a : program.instructions[i].args)
+        if (a >= 0)
+          lastUse[a] = i;
+  for (std::size_t k = 0; k < nOutputs; k++)
+    lastUse[program.outputs[k]] = N;
+
+  long freeSlots[N + 1] = {};
+  long nFree = 0;
+  s.slot[0] = 0;
+  s.nSlots = 1;
+  for (std::size_t i = 0; i < N; i++) {
+    if (!s.live[i + 1])
+      continue;
+    const FixedInstruction& instruction = program.instructions[i];
+    long first = instruction.args[0];
+    if (lastUse[first] == long(i))
+      s.slot[i + 1] = s.slot[first];
+    else if (nFree > 0)
+      s.slot[i + 1] = freeSlots[--nFree];
+    else
+      s.slot[i + 1] = s.nSlots++;
+    for (std::size_t j = 1; j < FixedInstruction::MAX_TERMS; j++) {
+      long a = instruction.args[j];
+      if (a >= 0 && lastUse[a] == long(i))
+        freeSlots[nFree++] = s.slot[a];
+    }
+  }
+  return s;
+}
+
+} // namespace fixed_impl
+
+//! @class FixedEvaluator
+//! @brief Evaluator of the first NOutputs outputs of Program, specialized
+//! at compile time
+template <const auto& Program, std::size_t NOutputs>
+class FixedEvaluator
+{
+  static constexpr std::size_t N = std::decay_t<decltype(Program)>::size();
+  static_assert(NOutputs <= std::decay_t<decltype(Program)>::outputCount(),
+                "Program does not have that many outputs");
+  static constexpr fixed_impl::Schedule<N> schedule =
+      fixed_impl::makeSchedule(Program, NOutputs);
+
+  template <std::size_t I>
+  static void step(std::vector<Ctxt>& slots)
+  {
+    if constexpr (schedule.live[I + 1]) {
+      constexpr const FixedInstruction& instruction = Program.instructions[I];
+      constexpr long dest = schedule.slot[I + 1];
+      constexpr long first = schedule.slot[instruction.args[0]];
+      if constexpr (dest != first)
+        slots[dest] = slots[first];
+
+      if constexpr (instruction.op == FixedInstruction::Square) {
+        slots[dest].square();
+      } else if constexpr (instruction.op == FixedInstruction::Multiply) {
+        slots[dest].multiplyBy(slots[schedule.slot[instruction.args[1]]]);
+      } else {
+        if constexpr (instruction.coeffs[0] != 1)
+          slots[dest].multByConstant(instruction.coeffs[0]);
+        addTerms<I>(slots,
+                    std::make_index_sequence<FixedInstruction::MAX_TERMS - 1>{});
+      }
+    }
+  }
+
+  // Fused multiply-adds for the remaining terms of a Combine
+  template <std::size_t I, std::size_t... J>
+  static void addTerms(std::vector<Ctxt>& slots, std::index_sequence<J...>)
+  {
+    constexpr const FixedInstruction& instruction = Program.instructions[I];
+    constexpr long dest = schedule.slot[I + 1];
+    (
+        [&] {
+          if constexpr (instruction.args[J + 1] >= 0)
+            slots[dest].addScaledCtxt(
+                slots[schedule.slot[instruction.args[J + 1]]],
+                instruction.coeffs[J + 1]);
+        }(),
+        ...);
+  }
+
+  template <std::size_t... I>
+  static void run(std::vector<Ctxt>& slots, std::index_sequence<I...>)
+  {
+    (step<I>(slots), ...);
+  }
+
+public:
+  //! Number of ciphertext temporaries used, including the input
+  static constexpr long temporaries = schedule.nSlots;
+
+  //! @brief Append the first NOutputs outputs of Program evaluated on x,
+  //! together with their precisions, to ctxtEval
+  static void evaluate(std::vector<std::pair<Ctxt, long>>& ctxtEval,
+                       const Ctxt& x)
+  {
+    if constexpr (NOutputs > 0) {
+      std::vector<Ctxt> slots(temporaries, Ctxt(ZeroCtxtLike, x));
+      slots[0] = x;
+      run(slots, std::make_index_sequence<N>{});
+      for (std::size_t k = 0; k < NOutputs; k++)
+        ctxtEval.emplace_back(slots[schedule.slot[Program.outputs[k]]],
+                              Program.precisions[k]);
+    }
+  }
+};
+
+namespace fixed_impl {
+
+template <const auto& Program, std::size_t... K>
+void evaluateOutputs(std::vector<std::pair<Ctxt, long>>& ctxtEval,
+                     const Ctxt& x,
+                     long nOutputs,
+                     std::index_sequence<K...>)
+{
+  ((nOutputs == long(K) ? FixedEvaluator<Program, K>::evaluate(ctxtEval, x)
+                        : void()),
+   ...);
+}
+
+} // namespace fixed_impl
+
+//! @brief Evaluate the outputs of Program needed for a row of the given
+//! size (see DigitProgram::outputsFor), picking the FixedEvaluator for
+//! that number of outputs
+template <const auto& Program>
+void evaluateFixedProgram(std::vector<std::pair<Ctxt, long>>& ctxtEval,
+                          const Ctxt& x,
+                          long rowSize)
+{
+  using ProgramType = std::decay_t<decltype(Program)>;
+  fixed_impl::evaluateOutputs<Program>(
+      ctxtEval,
+      x,
+      Program.outputsFor(rowSize),
+      std::make_index_sequence<ProgramType::outputCount() + 1>{});
+}
+
+} // namespace helib
+
+#endif // ifndef HELIB_FIXEDPROGRAM_H
@@ -0,0 +1,145 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef HELIB_KEYSETOPTIMIZER_H
+#define HELIB_KEYSETOPTIMIZER_H
+/**
+ * @file keySetOptimizer.h
+ * @brief Choosing the automorphism key-switching matrices from the
+ * automorphisms that a workload applies
+ *
+ * An automorphism X -> X^k without its own matrix is reached by chaining
+ * matrices s(X^e) -> s(X) along the keySwitchMap, with one key switch per
+ * link. The fixed strategies (addAllMatrices, addSome1DMatrices, the BSGS and
+ * minimal ones) trade key memory for the length of these chains without
+ * knowing which automorphisms are used. An AutomorphismProfile records how
+ * often every k is asked for (Ctxt::smartAutomorph, and the hoisted
+ * BasicAutomorphPrecon::automorph) while it captures a run of the workload.
+ * planKeySet then picks the matrices that minimize the expected number of
+ * key switches of that profile within a memory budget, and
+ * addOptimizedMatrices generates them.
+ */
+
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+
+namespace helib {
+
+class Context;
+class SecKey;
+
+//! @class AutomorphismProfile
+//! @brief How often every automorphism X -> X^k was asked for, k mod m
+class AutomorphismProfile
+{
+public:
+  AutomorphismProfile() = default;
+  AutomorphismProfile(const AutomorphismProfile& other);
+  AutomorphismProfile& operator=(const AutomorphismProfile& other);
+
+  //! Count n more uses of X -> X^k (k must already be reduced mod m)
+  void add(long k, long n = 1);
+
+  //! The counts, by k
+  std::map<long, long> counts() const;
+
+  //! The number of automorphisms counted
+  long total() const;
+
+  void clear();
+
+  //! @brief Write the profile as lines "<k> <count>", to keep the profile
+  //! of a workload
+  void writeTo(std::ostream& str) const;
+
+  //! @brief Read a profile written by writeTo
+  //! @throws IOError on a malformed profile
+  static AutomorphismProfile readFrom(std::istream& str);
+
+  //! @brief Record the automorphisms X -> X^k asked for by every thread in
+  //! profile, until destroyed. Captures nest, the innermost one records.
+  class Capture
+  {
+  public:
+    explicit Capture(AutomorphismProfile& profile);
+    ~Capture();
+    Capture(const Capture&) = delete;
+    Capture& operator=(const Capture&) = delete;
+
+  private:
+    AutomorphismProfile* previous;
+  };
+
+  //! @brief Do not record the automorphisms asked for by the calling
+  //! thread until destroyed, e.g. the rest of a chain already recorded
+  class Suspend
+  {
+  public:
+    Suspend();
+    ~Suspend();
+    Suspend(const Suspend&) = delete;
+    Suspend& operator=(const Suspend&) = delete;
+
+  private:
+    bool previous;
+  };
+
+  //! @brief Record X -> X^k (mod m) in the capturing profile, if any
+  static void record(long k, long m);
+
+private:
+  mutable std::mutex mutex;
+  std::map<long, long> uses;
+};
+
+//! @brief The memory of one key-switching matrix s(X^k) -> s, for the
+//! current KSMemoryMode (the pseudorandom row is not stored when COMPACT)
+long keySwitchMatrixBytes(const Context& context);
+
+//! @brief A choice of automorphism matrices, see planKeySet
+struct KeySetPlan
+{
+  //! The k of the matrices s(X^k) -> s to generate, beyond the base ones
+  std::set<long> keys;
+  //! The key switches of the profile with the base matrices only, and with
+  //! the keys as well. A k that stays unreachable counts as phi(m).
+  double baseKeySwitches = 0;
+  double expectedKeySwitches = 0;
+  //! The memory of the keys
+  long bytes = 0;
+  //! The automorphisms of the profile (counting their uses) that cannot be
+  //! reached with the base matrices and the keys
+  long unreachable = 0;
+};
+
+//! @brief Choose matrices s(X^k) -> s to add to the base ones, within
+//! budgetBytes, that minimize the number of key switches of the profile.
+//! The choice is greedy: the candidate that saves the most key switches
+//! (over the uses in the profile) is added first. The candidates are the
+//! automorphisms of the profile and the generators of Zm* (with their
+//! inverses for the bad dimensions, and p) that chain to them.
+KeySetPlan planKeySet(const Context& context,
+                      const AutomorphismProfile& profile,
+                      long budgetBytes,
+                      const std::set<long>& base = {});
+
+//! @brief Plan with the automorphism matrices that sKey already has as the
+//! base, generate the planned ones and recompute the keySwitchMap
+KeySetPlan addOptimizedMatrices(SecKey& sKey,
+                                const AutomorphismProfile& profile,
+                                long budgetBytes,
+                                long keyID = 0);
+
+} // namespace helib
+
+#endif // ifndef HELIB_KEYSETOPTIMIZER_H
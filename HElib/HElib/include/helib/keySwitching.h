@@ -21,6 +21,8 @@
  */
 
 #include <climits>
+#include <optional>
+#include <NTL/ZZ.h>
 #include <helib/DoubleCRT.h>
 #include <helib/Context.h>
 #include <helib/Ctxt.h>
@@ -101,6 +103,16 @@ public:
   NTL::xdouble noiseBound; // high probability bound on noise magnitude
   // in each column
 
+  // The Shoup companions of the bi's, for the inner products with the digits.
+  // Not serialized, they are recomputed by prepare() whenever b is set
+  std::vector<DoubleCRTPrecon> bPrecon;
+
+  // The ai's expanded from prgSeed, with their Shoup companions, in the
+  // KSMemoryMode::EXPANDED mode. Empty in the COMPACT mode, where every key
+  // switch expands them again. Never serialized either
+  std::vector<DoubleCRT> a;
+  std::vector<DoubleCRTPrecon> aPrecon;
+
   explicit KeySwitch(long sPow = 0,
                      long xPow = 0,
                      long fromID = 0,
@@ -120,6 +132,22 @@ public:
   static const KeySwitch& dummy();
   bool isDummy() const;
 
+  //! @brief The special primes of the bi's: all of them, except for the
+  //! level matrices of SecKey::GenLevelKeySWmatrices
+  IndexSet specialPrimes() const;
+
+  //! @brief Recompute bPrecon from b, and a and aPrecon from prgSeed
+  //! according to the current KSMemoryMode, must be called after b is modified
+  void prepare();
+
+  //! @brief Recompute only a and aPrecon, according to the current
+  //! KSMemoryMode
+  void prepareA();
+
+  //! @brief A copy that shares none of the residues and companions of this
+  //! matrix, all of them allocated by the calling thread, see NodeReplicas
+  KeySwitch privateCopy() const;
+
   //! A debugging method
   void verify(SecKey& sk);
 
@@ -154,6 +182,13 @@ public:
    **/
   JsonWrapper writeToJSON() const;
 
+  /**
+   * @brief Write out the switch key (`KeySwitch`) object with the streaming
+   * JSON writer behind `writeToJSON(std::ostream&)`.
+   * @param w The writer.
+   **/
+  void writeToJSON(JsonStreamWriter& w) const;
+
   /**
    * @brief Read from the stream the serialized switch key (`KeySwitch`) object
    * using JSON format.
@@ -180,6 +215,14 @@ public:
    **/
   void readJSON(std::istream& str, const Context& context);
 
+  /**
+   * @brief In-place read with the streaming JSON reader behind
+   * `readJSON(std::istream&, const Context&)`.
+   * @param r The reader.
+   * @param context The `Context` to be used.
+   **/
+  void readJSON(JsonStreamReader& r, const Context& context);
+
   /**
    * @brief In-place read from the `JsonWrapper` the serialized switch key
    * (`KeySwitch`) object.
@@ -193,6 +236,56 @@ std::ostream& operator<<(std::ostream& str, const KeySwitch& matrix);
 // matrix); instead must use the readMatrix method above, where you can specify
 // context
 
+/**
+ * @class KeySwitchASampler
+ * @brief The pseudorandom ai's of a key-switching matrix, one column after
+ * the other, from its prgSeed
+ *
+ * The seeds made by newSeed are keyed: every row of every ai comes from a
+ * ChaCha20 stream of its own (DoubleCRT::randomizeKeyed), so an ai can be
+ * expanded over any primes, e.g. only those of the ciphertext at hand, its
+ * rows are expanded in parallel, and NTL's PRG is untouched. The other
+ * seeds, of the matrices made by earlier versions, expand the ai's one
+ * after the other from NTL's PRG set to the seed (pushed and restored by
+ * the sampler), over the primes of the bi's.
+ **/
+class KeySwitchASampler
+{
+public:
+  explicit KeySwitchASampler(const NTL::ZZ& seed);
+
+  //! @brief Set ai to the next column. Unless the seed is keyed, ai must be
+  //! defined over the primes of the bi's
+  void next(DoubleCRT& ai);
+
+  //! @brief A fresh keyed seed, 256 random bits from NTL's PRG and a marker
+  static NTL::ZZ newSeed();
+
+  //! @brief Whether seed was made by newSeed
+  static bool isKeyed(const NTL::ZZ& seed);
+
+private:
+  NTL::ZZ seed;
+  long column = 0;
+  std::optional<NTL::RandomStreamPush> push; // for the other seeds
+};
+
+//! @brief How the pseudorandom ai's of the key-switching matrices are kept
+//! in memory. COMPACT keeps only their seed, and expands them again in every
+//! key switch. EXPANDED keeps them expanded and preconditioned, which doubles
+//! the memory of the matrices and saves their expansion in every key switch.
+//! In both modes, only the seed is serialized.
+enum class KSMemoryMode
+{
+  COMPACT,
+  EXPANDED
+};
+
+//! @brief Set the mode of the matrices that are prepared from now on, i.e.
+//! generated or read. The default is COMPACT
+void setKSMemoryMode(KSMemoryMode mode);
+KSMemoryMode getKSMemoryMode();
+
 //! @name Strategies for generating key-switching matrices
 //! These functions are implemented in KeySwitching.cpp
 
@@ -253,6 +346,19 @@ void addTheseMatrices(SecKey& sKey,
                       const std::set<long>& automVals,
                       long keyID = 0);
 
+//! @brief Generate the matrices s^e->s for 2 <= e <= maxPower, so that
+//! products of extended ciphertexts up to s^maxPower can be relinearized
+//! (GenSecKey already adds them up to its maxDegKswitch)
+void addRelinMatrices(SecKey& sKey, long maxPower, long keyID = 0);
+
+//! @brief Generate exactly the matrices s(X^e)->s that the linear maps of the
+//! bootstrapping data of the context apply, and for the thick bootstrapping
+//! also those of the unpacking of the slots, using the HELIB_KSS_FULL
+//! strategy in every dimension that they touch. The context must be
+//! bootstrappable, and the maps must be used with this strategy: other
+//! operations may need to chain several automorphisms.
+void addBootstrappingMatrices(SecKey& sKey, long keyID = 0);
+
 } // namespace helib
 
 #endif // HELIB_KEY_SWITCHING_H
@@ -20,8 +20,12 @@
  * Copyright IBM Corporation 2019 All rights reserved.
  */
 
+#include <atomic>
+
 #include <helib/keySwitching.h>
 #include <helib/EncodedPtxt.h>
+#include <helib/bootstrapReport.h>
+#include <helib/multicore.h>
 
 namespace helib {
 
@@ -37,6 +41,9 @@ namespace helib {
 #define HELIB_KSS_MIN (3)
 // minimal strategy (for g_i, and for g_i^{-ord_i} for bad dims)
 
+template <typename T>
+struct PtrVector;
+
 /**
  * @class PubKey
  * @brief The public key
@@ -62,12 +69,72 @@ private:
   // use when re-linearizing s_i(X^n).
   std::vector<std::vector<long>> keySwitchMap;
 
+  // Single-digit variants of some of the matrices in keySwitching, for the
+  // low levels, with fewer special primes (see GenLevelKeySWmatrices). They
+  // are not serialized, a key that is read back uses the full matrices.
+  std::vector<KeySwitch> levelKeySwitching;
+
   NTL::Vec<long> KS_strategy; // NTL Vec's support I/O, which is more convenient
 
   // bootstrapping data
 
   long recryptKeyID; // index of the bootstrapping key
   Ctxt recryptEkey;  // the key itself, encrypted under key #0
+  // The Shoup companions of the parts of recryptEkey, not serialized
+  std::vector<DoubleCRTPrecon> recryptEkeyPrecon;
+
+  // The mapped file that the columns of the key-switching matrices refer to,
+  // for a key read by readMappedFrom
+  std::shared_ptr<const void> mappedStorage;
+
+  // The noise growth of the slotToCoeff map of thin bootstrapping, in bits,
+  // the largest seen so far (-1 before the first one), raised atomically by
+  // concurrent bootstrappings
+  mutable std::atomic<long> slotToCoeffGrowthBits;
+
+  // The copies of the matrices of keySwitching and levelKeySwitching for
+  // every NUMA node, see replicatePerNode()
+  NodeReplicas<KeySwitch> keySwitchingReplicas;
+
+  // The copy of matrix, one of keySwitching or levelKeySwitching, for the
+  // node of the calling thread. Any other matrix is returned as is.
+  const KeySwitch& nodeLocal(const KeySwitch& matrix) const;
+
+  // The shortest prefix of the ciphertext primes of ctxt to which it can be
+  // mod-switched before bootstrapping: its noise, times growth, must still
+  // be within the bound that the bootstrapping parameters assume after the
+  // switch to the bootstrapping key and the raw mod-switch to q. This uses
+  // the same high-probability bounds as the noise estimates of Ctxt.
+  IndexSet recryptPrimeSet(const Ctxt& ctxt, long q, double growth = 1.0) const;
+
+  static constexpr long THIN_RECRYPT_STAGES = 4;
+
+  // What thin bootstrapping keeps between its stages
+  struct ThinReCryptState
+  {
+    long ptxtSpace = 0, intFactor = 1;
+    long targetR = 0; // the digits of the result, 0 for all r of them
+  };
+
+  // Stage 0 <= stage < THIN_RECRYPT_STAGES of thin bootstrapping, returns
+  // false if there is nothing more to do
+  bool thinReCryptStage(Ctxt& ctxt,
+                        long stage,
+                        bool our_version,
+                        bool lazy,
+                        const std::vector<std::vector<long>>* plan,
+                        ThinReCryptState& state) const;
+
+  // One thin bootstrapping with the given digit extraction plan (nullptr for
+  // the default one), returns false if ctxt was empty or a dummy encryption.
+  // The stages that ran are added to report if it is not null. The result
+  // keeps targetR digits, all r of them if it is 0.
+  bool thinReCryptOnce(Ctxt& ctxt,
+                       bool our_version,
+                       bool lazy,
+                       const std::vector<std::vector<long>>* plan,
+                       BootstrapReport* report,
+                       long targetR = 0) const;
 
 public:
   /**
@@ -123,6 +190,23 @@ public:
   const KeySwitch& getAnyKeySWmatrix(const SKHandle& from) const;
   bool haveAnyKeySWmatrix(const SKHandle& from) const;
 
+  //! @brief The level variants of the key-switching matrices, see
+  //! SecKey::GenLevelKeySWmatrices
+  const std::vector<KeySwitch>& levelKeySWlist() const
+  {
+    return levelKeySwitching;
+  }
+
+  //! @brief The level variant from -> toID with the fewest primes that can
+  //! switch a ciphertext part with the primes in s, nullptr if there is none
+  const KeySwitch* getLevelKeySWmatrix(const SKHandle& from,
+                                       long toID,
+                                       const IndexSet& s) const;
+
+  //! @brief The largest e such that there are matrices s^2->s, ..., s^e->s
+  //! for the given key, 1 if there are none
+  long maxRelinPower(long keyID = 0) const;
+
   //!@brief Get the next matrix to use for multi-hop automorphism
   //! See Section 3.2.2 in the design document
   const KeySwitch& getNextKSWmatrix(long fromXPower, long fromID = 0) const;
@@ -216,12 +300,38 @@ public:
   template <typename Scheme>
   void Encrypt(Ctxt& ciphertxt, const Ptxt<Scheme>& plaintxt) const;
 
+  /**
+   * @brief Encrypts a batch of plaintexts, in parallel on the NTL thread
+   * pool.
+   * @tparam Scheme Encryption scheme used (must be `BGV` or `CKKS`).
+   * @param ciphertxts Set to one ciphertext under this key per plaintext.
+   * @param plaintxts Plaintexts to encrypt.
+   * @note Every plaintext is encrypted with a PRG stream of its own, seeded
+   * from the current one, so the ciphertexts do not depend on the number of
+   * threads.
+   **/
+  template <typename Scheme>
+  void Encrypt(std::vector<Ctxt>& ciphertxts,
+               const std::vector<Ptxt<Scheme>>& plaintxts) const;
+
   //=============== new EncodedPtxt interface ==================
 
   virtual void Encrypt(Ctxt& ctxt, const EncodedPtxt& eptxt) const;
   virtual void Encrypt(Ctxt& ctxt, const EncodedPtxt_BGV& eptxt) const;
   virtual void Encrypt(Ctxt& ctxt, const EncodedPtxt_CKKS& eptxt) const;
 
+  //! @brief Sets ctxt to a fresh encryption of zero under this key, with
+  //! noise a multiple of ptxtSpace (which must be 1 for CKKS, and divide the
+  //! plaintext space of the key for BGV). This is the part of public-key
+  //! encryption that depends on the randomness, see EncryptionPool.
+  void encryptZero(Ctxt& ctxt, long ptxtSpace) const;
+
+  //! @brief Adds eptxt to zero, a fresh encryption of zero from encryptZero,
+  //! which is then the public-key encryption of eptxt. Each encryption of
+  //! zero must be used only once.
+  void addEncoded(Ctxt& zero, const EncodedPtxt_BGV& eptxt) const;
+  void addEncoded(Ctxt& zero, const EncodedPtxt_CKKS& eptxt) const;
+
   //============================================================
 
   bool isCKKS() const;
@@ -229,8 +339,45 @@ public:
 
   bool isBootstrappable() const;
   void reCrypt(Ctxt& ctxt, bool our_version = false, bool lazy = false) const;                            // bootstrap a ciphertext to reduce noise
-  void thinReCrypt(Ctxt& ctxt, bool our_version = false, bool lazy = false, int nb_iterations = 1) const; // bootstrap a "thin" ciphertext, where
-  // slots are assumed to contain constants
+  void thinReCrypt(Ctxt& ctxt, bool our_version = false, bool lazy = false, BootstrapReport* report = nullptr) const; // bootstrap a "thin" ciphertext, where
+  // slots are assumed to contain constants. Nothing is printed: if report is
+  // not null, it is cleared and filled with the wall and CPU time, capacity,
+  // operation counts and peak memory of every stage.
+
+  //! @brief Thin bootstrapping whose result only keeps targetR <= r digits:
+  //! it is an encryption mod p^targetR rather than p^r, for circuits that
+  //! need less precision after the refresh. The digit extraction is planned
+  //! for these digits only, with shorter rows, lower-degree polynomials and
+  //! fewer multiplications. The other arguments are those of thinReCrypt.
+  //! @throws InvalidArgument if targetR is not in [1, r]
+  void thinReCryptTo(Ctxt& ctxt,
+                     long targetR,
+                     bool our_version = false,
+                     bool lazy = false,
+                     BootstrapReport* report = nullptr) const;
+
+  //! @brief Thin bootstrapping of a batch of ciphertexts. The digit
+  //! extraction plan and the other precomputed data are shared, and with
+  //! HELIB_BOOT_THREADS the ciphertexts are bootstrapped in parallel.
+  void thinReCrypt(const PtrVector<Ctxt>& ctxts, bool our_version = false, bool lazy = false) const;
+  void thinReCrypt(std::vector<Ctxt>& ctxts, bool our_version = false, bool lazy = false) const;
+
+  //! @brief Thin bootstrapping with the execution resources of policy (see
+  //! multicore.h), e.g. more threads and urgent loops for a latency-critical
+  //! refresh. Otherwise they are those installed on the calling thread, else
+  //! those of the Context (Context::setExecutionPolicy), as for all the
+  //! bootstraps.
+  void thinReCrypt(Ctxt& ctxt, const ExecutionPolicy& policy, bool our_version = false, bool lazy = false, BootstrapReport* report = nullptr) const;
+  void thinReCrypt(const PtrVector<Ctxt>& ctxts, const ExecutionPolicy& policy, bool our_version = false, bool lazy = false) const;
+  void thinReCrypt(std::vector<Ctxt>& ctxts, const ExecutionPolicy& policy, bool our_version = false, bool lazy = false) const;
+
+  //! @brief Batched thin bootstrapping as a pipeline over its four stages
+  //! (slotToCoeff, boot key switch, coeffToSlot, digit extraction): every
+  //! thread takes the ready ciphertext in the latest stage, so rotation-bound
+  //! and multiplication-bound stages of different ciphertexts run at the
+  //! same time. At most maxInFlight ciphertexts are in progress at once,
+  //! which bounds the memory.
+  void thinReCryptPipelined(const PtrVector<Ctxt>& ctxts, long maxInFlight, bool our_version = false, bool lazy = false) const;
 
   friend class SecKey;
   friend std::ostream& operator<<(std::ostream& str, const PubKey& pk);
@@ -250,6 +397,30 @@ public:
    **/
   static PubKey readFrom(std::istream& str, const Context& context);
 
+  /**
+   * @brief Write out the key in a format that `readMappedFrom` maps into
+   * memory. The columns of the key-switching matrices, and their Shoup
+   * companions, are written as aligned rows in the byte order of this
+   * machine, the rest of the key as by `writeTo`.
+   * @param str Output `std::ostream`.
+   **/
+  void writeMappableTo(std::ostream& str) const;
+
+  /**
+   * @brief Map a file written by `writeMappableTo`, without reading the
+   * columns of the key-switching matrices: they refer to the mapped file,
+   * which stays mapped as long as the returned key or a copy of it exists,
+   * so copies of the matrices themselves must not outlive the key.
+   * The file is mapped privately, so several processes that map the same
+   * file share its pages in memory, e.g. a file in /dev/shm. Throws
+   * `IOError` if the file cannot be mapped or was written on a machine with
+   * another layout.
+   * @param path The file to map.
+   * @param context The `Context` to be used.
+   * @return The mapped `PubKey`.
+   **/
+  static PubKey readMappedFrom(const std::string& path, const Context& context);
+
   /**
    * @brief Write out the public key (`PubKey`) object to the output
    * stream using JSON format.
@@ -263,6 +434,14 @@ public:
    **/
   JsonWrapper writeToJSON() const;
 
+  /**
+   * @brief Write out the public key (`PubKey`) object with the streaming JSON
+   * writer behind `writeToJSON(std::ostream&)`, which writes the residues of
+   * the key-switching matrices as they are, without a JSON tree.
+   * @param w The writer.
+   **/
+  void writeToJSON(JsonStreamWriter& w) const;
+
   /**
    * @brief Read from the stream the serialized public key (`PubKey`) object
    * using JSON format.
@@ -288,6 +467,15 @@ public:
    **/
   void readJSON(std::istream& str);
 
+  /**
+   * @brief In-place read with the streaming JSON reader behind
+   * `readJSON(std::istream&)`, which parses the residues straight into the
+   * key-switching matrices. On errors the key is left cleared or partly
+   * read.
+   * @param r The reader.
+   **/
+  void readJSON(JsonStreamReader& r);
+
   /**
    * @brief In-place read from the `JsonWrapper` the serialized public key
    * (`PubKey`) object.
@@ -314,6 +502,44 @@ private:
   std::vector<DoubleCRT> sKeys; // The secret key(s) themselves
   explicit SecKey(const PubKey& pk);
 
+  // The nonzero coefficients (index, value) of every secret key, empty if
+  // they do not fit in a long. Derived from sKeys, not serialized
+  std::vector<std::vector<std::pair<long, long>>> sparseKeys;
+
+  // Add a key together with its nonzero coefficients
+  long importSecKey(const DoubleCRT& sKey,
+                    std::vector<std::pair<long, long>> sparseKey,
+                    double bound,
+                    long ptxtSpace,
+                    long maxDegKswitch);
+
+  // Rebuild sparseKeys from sKeys, after reading them
+  void setSparseKeys();
+
+  // The secret key skIdx modulo the primes s
+  DoubleCRT keyModulo(long skIdx, const IndexSet& s) const;
+
+  // Whether secret-key encryption expands the part relative to s from a seed
+  // (see setSeededEncryption), not serialized
+  bool seededEncryption = false;
+
+  // Sample the RLWE instance of a secret-key encryption into ctxt.parts,
+  // seeded or not, returns its noise bound
+  double encryptRLWE(Ctxt& ctxt, long skIdx, long ptxtSpace) const;
+
+  // The matrix for GenKeySWmatrix, built without storing it so that several
+  // can be built at once
+  KeySwitch buildKeySWmatrix(long fromSPower,
+                             long fromXPower,
+                             long fromIdx,
+                             long toIdx,
+                             long p) const;
+
+  // The single-column variant of W over the primes ctxtPrimes | special
+  KeySwitch buildLevelKeySWmatrix(const KeySwitch& W,
+                                  const IndexSet& ctxtPrimes,
+                                  const IndexSet& special) const;
+
 public:
   /**
    * @brief Class label to be added to JSON serialization as object type
@@ -363,6 +589,25 @@ public:
                       long toKeyIdx = 0,
                       long ptxtSpace = 0);
 
+  //! Generate the matrices s(X^e)->s for all the automorphisms e in
+  //! fromXPowers that are still missing, in parallel. The seeds of the
+  //! matrices are drawn from the PRG in the order of fromXPowers, so the
+  //! matrices do not depend on the number of threads.
+  void GenKeySWmatrices(const std::vector<long>& fromXPowers,
+                        long fromKeyIdx = 0,
+                        long toKeyIdx = 0,
+                        long ptxtSpace = 0);
+
+  //! Generate level variants of all the key-switching matrices, for the
+  //! ciphertexts with the first k ciphertext primes, for every k in levels.
+  //! A variant has a single column over these primes and the special primes
+  //! of Context::specialPrimesForLevel, so that key switching at these
+  //! levels mods up by fewer special primes and skips the other digits.
+  //! Levels that span more than the first digit, or that need all the
+  //! special primes anyway, are skipped. Call this after all the matrices
+  //! are generated. The variants are not serialized.
+  void GenLevelKeySWmatrices(const std::vector<long>& levels);
+
   // Decryption
   void Decrypt(NTL::ZZX& plaintxt, const Ctxt& ciphertxt) const;
 
@@ -380,10 +625,32 @@ public:
                const Ctxt& ciphertxt,
                OptLong prec = OptLong()) const;
 
+  /**
+   * @brief Decrypt a batch of ciphertexts, in parallel on the NTL thread
+   * pool.
+   * @tparam Scheme Encryption scheme used (must be `BGV` or `CKKS`).
+   * @param plaintxts Set to the decryptions of the ciphertexts.
+   * @param ciphertxts Ciphertexts to decrypt.
+   * @param prec `CKKS` precision to be used, as in `Decrypt` above.
+   * @note Like the batch `Encrypt`, the result does not depend on the number
+   * of threads.
+   **/
+  template <typename Scheme>
+  void Decrypt(std::vector<Ptxt<Scheme>>& plaintxts,
+               const std::vector<Ctxt>& ciphertxts,
+               OptLong prec = OptLong()) const;
+
   //! @brief Debugging version, returns in f the polynomial
   //! before reduction modulo the ptxtSpace
   void Decrypt(NTL::ZZX& plaintxt, const Ctxt& ciphertxt, NTL::ZZX& f) const;
 
+  //! @brief Make the secret-key encryptions below expand the part of the
+  //! ciphertext relative to s from a short seed, which the ciphertext keeps.
+  //! Until that part changes, `Ctxt::writeTo` writes the seed instead of it,
+  //! so the serialized ciphertext takes about half the space. Off by default.
+  void setSeededEncryption(bool seeded) { seededEncryption = seeded; }
+  bool getSeededEncryption() const { return seededEncryption; }
+
   //! @brief Symmetric encryption using the secret key.
   long skEncrypt(Ctxt& ctxt,
                  const NTL::ZZX& ptxt,
@@ -447,6 +714,14 @@ public:
    **/
   JsonWrapper writeToJSON() const;
 
+  /**
+   * @brief Write out the secret key (`SecKey`) object with the streaming JSON
+   * writer behind `writeToJSON(std::ostream&)`, which writes the residues of
+   * the key-switching matrices as they are, without a JSON tree.
+   * @param w The writer.
+   **/
+  void writeToJSON(JsonStreamWriter& w) const;
+
   /**
    * @brief Read from the stream the serialized secret key (`SecKey`) object
    * using JSON format.
@@ -472,6 +747,13 @@ public:
    **/
   void readJSON(std::istream& str);
 
+  /**
+   * @brief In-place read with the streaming JSON reader behind
+   * `readJSON(std::istream&)`.
+   * @param r The reader.
+   **/
+  void readJSON(JsonStreamReader& r);
+
   /**
    * @brief Read from the `JsonWrapper` the serialized secret key (`SecKey`)
    * object.
@@ -0,0 +1,89 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef HELIB_LAZYCARRY_H
+#define HELIB_LAZYCARRY_H
+/**
+ * @file lazyCarry.h
+ * @brief Integer arithmetic in mod-2^r slots, with the carries resolved by
+ * digit extraction only when the bits are needed
+ *
+ * The functions of binaryArith.h take every bit of an integer in a
+ * ciphertext of its own (plaintext space 2), and resolve the carries of
+ * every sum with a circuit over these bits. A LazyCarryInteger instead
+ * keeps nBits-bit integers, one per slot, in a single ciphertext with
+ * plaintext space 2^r, r >= nBits. Sums, differences and products are the
+ * native ones mod 2^r, which are correct mod 2^nBits: the carries are left
+ * in the bits above nBits, where they do no harm, and cost no levels.
+ *
+ * The bits are only computed when something needs them: toBits() extracts
+ * them with extractDigits (for the comparisons of binaryCompare.h, say),
+ * and normalize() brings the value back into [0, 2^nBits) when the canonical
+ * representative is needed.
+ */
+
+#include <vector>
+
+#include <helib/Ctxt.h>
+#include <helib/CtPtrs.h>
+
+namespace helib {
+
+class LazyCarryInteger
+{
+public:
+  //! @brief The integers in the slots of ctxt, taken mod 2^nBits. The
+  //! plaintext space of ctxt must be 2^r with r >= nBits, and the slots
+  //! must hold integers (only the free terms are non-zero). They are
+  //! assumed to be below 2^nBits, as when encrypted that way.
+  //! @throws InvalidArgument if p is not 2 or nBits is out of range
+  LazyCarryInteger(const Ctxt& ctxt, long nBits);
+
+  //! The ciphertext, its slots hold the values mod 2^nBits
+  const Ctxt& getCtxt() const { return ctxt; }
+
+  long bitCount() const { return nBits; }
+
+  //! Whether the slots are known to hold values below 2^nBits
+  bool isNormalized() const { return normalized; }
+
+  //! @throws InvalidArgument if the two do not have the same nBits and
+  //! plaintext space
+  LazyCarryInteger& operator+=(const LazyCarryInteger& other);
+  LazyCarryInteger& operator-=(const LazyCarryInteger& other);
+  LazyCarryInteger& operator*=(const LazyCarryInteger& other);
+
+  LazyCarryInteger& operator*=(long c);
+  void addConstant(long c);
+
+  //! @brief Reduce the slots to their value mod 2^nBits, from the first
+  //! nBits digits of extractDigits. Nothing is done if they already are.
+  void normalize();
+
+  //! @brief The nBits bits of the values, lowest first, each with plaintext
+  //! space 2 as binaryArith.h takes them. bits is resized to match.
+  void toBits(CtPtrs& bits) const;
+
+  //! @brief The sum of numbers, with native additions only
+  //! @throws InvalidArgument if numbers is empty or they do not match
+  static LazyCarryInteger sum(const std::vector<LazyCarryInteger>& numbers);
+
+private:
+  Ctxt ctxt;
+  long nBits;
+  bool normalized = true;
+
+  void assertMatches(const LazyCarryInteger& other) const;
+};
+
+} // namespace helib
+
+#endif // ifndef HELIB_LAZYCARRY_H
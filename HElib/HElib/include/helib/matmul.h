@@ -14,6 +14,8 @@
 
 #include <helib/EncryptedArray.h>
 #include <functional>
+#include <map>
+#include <set>
 
 namespace helib {
 
@@ -261,6 +263,24 @@ struct ConstMultiplierCache
 
   // Upgrade zzX constants to DoubleCRT constants.
   void upgrade(const Context& context);
+
+  // Upgrade zzX constants to DoubleCRT constants, in order, as long as the
+  // memory this adds fits in budget bytes, and decrease budget by it. The
+  // other constants stay zzX and are encoded again on every use. A negative
+  // budget upgrades all of them. If lazily is set, the upgraded constants
+  // are only encoded when they are used, over the prime set of the
+  // ciphertext, and keep this encoding while the prime sets of the next
+  // ciphertexts are contained in it. Each of them is charged for an
+  // encoding over all the primes.
+  void upgradeWithin(const Context& context, long& budget, bool lazily = false);
+
+  // The bytes held by the constants, in the format they are in
+  long bytes() const;
+
+  // Binary IO of the constants. The DoubleCRT constants are written as zzX
+  // and converted back when they are read, for the same context.
+  void writeTo(std::ostream& str) const;
+  void readFrom(std::istream& str, const Context& context);
 };
 
 //====================================
@@ -277,12 +297,27 @@ public:
   // Upgrade zzX constants to DoubleCRT constants.
   virtual void upgrade() = 0;
 
+  // Upgrade the zzX constants whose DoubleCRT form fits in budget bytes, see
+  // ConstMultiplierCache::upgradeWithin. By default there are none.
+  virtual void upgradeWithin(UNUSED long& budget, UNUSED bool lazily) {}
+
+  // The bytes held by the constants
+  virtual long cacheBytes() const { return 0; }
+
   // If ctxt encrypts a row std::vector v, then this replaces ctxt
   // by an encryption of the row std::vector v*mat, where mat is
   // a matrix provided to the constructor of one of the
   // concrete subclasses MatMul1DExec, BlockMatMul1DExec,
   // MatMulFullExec, BlockMatMulFullExec, defined below.
   virtual void mul(Ctxt& ctxt) const = 0;
+
+  // The same, with the execution resources of policy (see multicore.h)
+  // rather than those of the caller or of the Context
+  void mul(Ctxt& ctxt, const ExecutionPolicy& policy) const
+  {
+    ExecutionPolicy::Scope policyScope(policy);
+    mul(ctxt);
+  }
 };
 
 //====================================
@@ -298,6 +333,7 @@ public:
   long D;
   bool native;
   bool minimal;
+  bool doubleHoist;
   long g;
 
   ConstMultiplierCache cache;
@@ -313,16 +349,35 @@ public:
   // addMinimal{1D,Frb}Matrices routines declared in helib.h.
   // If the minimal flag is false, it is best to use the
   // addSome{1D,Frb}Matrices routines declared in helib.h.
-  explicit MatMul1DExec(const MatMul1D& mat, bool minimal = false);
+  // If the doubleHoist flag is set, the baby-step/giant-step strategy keeps
+  // the hoisted baby steps in the extended (special-primes) domain rather
+  // than mod-switching each of them down, so the inner sum of a giant step
+  // is computed there and mod-switched down once, before its rotation.
+  // Where addSome1DMatrices generates matrices for all the powers of the
+  // generator, the baby/giant split is chosen by DoubleHoistGiantStepSize.
+  explicit MatMul1DExec(const MatMul1D& mat,
+                        bool minimal = false,
+                        bool doubleHoist = false);
+
+  // Read the strategy and the encoded constants written by writeTo, for the
+  // same EncryptedArray, without building the matrix again.
+  MatMul1DExec(const EncryptedArray& ea, std::istream& str);
+  void writeTo(std::ostream& str) const;
 
   // VJS-FIXME: it seems that the minimal flag is currently
   // redundant, as the decision is essentially based on
   // ctxt.getPubKey().getKSStrategy(dim0). Need to look into this
   // and re-assess.
 
+  using MatMulExecBase::mul;
+
   // Replaces an encryption of row std::vector v by encryption of v*mat
   void mul(Ctxt& ctxt) const override;
 
+  // Adds to autos[dim] the automorphisms that mul applies when the key has
+  // the HELIB_KSS_FULL strategy in dimension dim.
+  void automorphisms(std::map<long, std::set<long>>& autos) const;
+
   // Upgrades encoded constants from zzX to DoubleCRT.
   void upgrade() override
   {
@@ -330,6 +385,14 @@ public:
     cache1.upgrade(ea.getContext());
   }
 
+  void upgradeWithin(long& budget, bool lazily) override
+  {
+    cache.upgradeWithin(ea.getContext(), budget, lazily);
+    cache1.upgradeWithin(ea.getContext(), budget, lazily);
+  }
+
+  long cacheBytes() const override { return cache.bytes() + cache1.bytes(); }
+
   const EncryptedArray& getEA() const override { return ea; }
 };
 
@@ -372,9 +435,21 @@ public:
   // addSome{1D,Frb}Matrices routines declared in helib.h.
   explicit BlockMatMul1DExec(const BlockMatMul1D& mat, bool minimal = false);
 
+  // Read the strategy and the encoded constants written by writeTo, for the
+  // same EncryptedArray, without building the matrix again.
+  BlockMatMul1DExec(const EncryptedArray& ea, std::istream& str);
+  void writeTo(std::ostream& str) const;
+
+  using MatMulExecBase::mul;
+
   // Replaces an encryption of row std::vector v by encryption of v*mat
   void mul(Ctxt& ctxt) const override;
 
+  // Adds to autos[dim] and autos[-1] the automorphisms that mul applies when
+  // the key has the HELIB_KSS_FULL strategy in dimension dim and for the
+  // Frobenius.
+  void automorphisms(std::map<long, std::set<long>>& autos) const;
+
   // Upgrades encoded constants from zzX to DoubleCRT.
   void upgrade() override
   {
@@ -382,6 +457,14 @@ public:
     cache1.upgrade(ea.getContext());
   }
 
+  void upgradeWithin(long& budget, bool lazily) override
+  {
+    cache.upgradeWithin(ea.getContext(), budget, lazily);
+    cache1.upgradeWithin(ea.getContext(), budget, lazily);
+  }
+
+  long cacheBytes() const override { return cache.bytes() + cache1.bytes(); }
+
   const EncryptedArray& getEA() const override { return ea; }
 };
 
@@ -409,6 +492,8 @@ public:
   // addSome{1D,Frb}Matrices routines declared in helib.h.
   explicit MatMulFullExec(const MatMulFull& mat, bool minimal = false);
 
+  using MatMulExecBase::mul;
+
   // Replaces an encryption of row std::vector v by encryption of v*mat
   void mul(Ctxt& ctxt) const override;
 
@@ -419,6 +504,20 @@ public:
       t.upgrade();
   }
 
+  void upgradeWithin(long& budget, bool lazily) override
+  {
+    for (auto& t : transforms)
+      t.upgradeWithin(budget, lazily);
+  }
+
+  long cacheBytes() const override
+  {
+    long total = 0;
+    for (const auto& t : transforms)
+      total += t.cacheBytes();
+    return total;
+  }
+
   const EncryptedArray& getEA() const override { return ea; }
 
   // This really should be private.
@@ -450,6 +549,8 @@ public:
   explicit BlockMatMulFullExec(const BlockMatMulFull& mat,
                                bool minimal = false);
 
+  using MatMulExecBase::mul;
+
   // Replaces an encryption of row std::vector v by encryption of v*mat
   void mul(Ctxt& ctxt) const override;
 
@@ -460,6 +561,20 @@ public:
       t.upgrade();
   }
 
+  void upgradeWithin(long& budget, bool lazily) override
+  {
+    for (auto& t : transforms)
+      t.upgradeWithin(budget, lazily);
+  }
+
+  long cacheBytes() const override
+  {
+    long total = 0;
+    for (const auto& t : transforms)
+      total += t.cacheBytes();
+    return total;
+  }
+
   const EncryptedArray& getEA() const override { return ea; }
 
   // This really should be private.
@@ -473,6 +588,11 @@ public:
 
 void traceMap(Ctxt& ctxt);
 
+// Adds to autos[-1] the Frobenius automorphisms that traceMap applies when the
+// key has the HELIB_KSS_FULL strategy for the Frobenius.
+void traceMapAutomorphisms(const Context& context,
+                           std::map<long, std::set<long>>& autos);
+
 //====================================
 
 // These routines apply linear transformation to plaintext arrays.
@@ -574,13 +694,24 @@ inline Ctxt& operator*=(Ctxt& a, const MatMulExecBase& mat)
 
 // These are used mainly for performance evaluation.
 
-extern int fhe_test_force_bsgs;
+// The number of baby steps of a double-hoisted baby-step/giant-step
+// multiplication in a dimension of size D, if the key-switching matrices for
+// all the powers of the generator are available. It minimizes an estimate
+// of the cost, in which a giant step costs HELIB_DOUBLE_HOIST_GIANT_COST
+// baby steps: the giant steps need a mod-down and a decomposition into
+// digits, the hoisted baby steps only an inner product with the digits.
+#define HELIB_DOUBLE_HOIST_GIANT_COST (4)
+long DoubleHoistGiantStepSize(long D);
+
+extern thread_local int fhe_test_force_bsgs;
 // Controls whether or not we use BSGS multiplication.
 // 1 to force on, -1 to force off, 0 for default behaviour.
+// Set per thread, see threadSettings.h.
 
-extern int fhe_test_force_hoist;
+extern thread_local int fhe_test_force_hoist;
 // Controls whether ot not we use hoisting.
 // -1 to force off, 0 for default behaviour.
+// Set per thread, see threadSettings.h.
 
 } // namespace helib
 
@@ -0,0 +1,248 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef HELIB_MATRIXENGINE_H
+#define HELIB_MATRIXENGINE_H
+/**
+ * @file matrixEngine.h
+ * @brief Products of encrypted matrices, by plaintext or encrypted matrices
+ *
+ * The linear transformations of matmul.h multiply one encrypted vector by a
+ * plaintext matrix. A MatrixEngine multiplies n x n matrices packed in the
+ * slots of a ciphertext, in the linear order of the slots across the
+ * hypercube: entry (i, j) is in slot i*n + j, and the slots from n*n on are
+ * zero. With the slot maps
+ *
+ *   sigma(A)[i, j] = A[i, i+j],    tau(B)[i, j] = B[i+j, j],
+ *   phi(A)[i, j] = A[i, j+1],      psi(B)[i, j] = B[i+1, j]
+ *
+ * (indices mod n), the product is
+ *
+ *   A*B = sum_{k<n} phi^k(sigma(A)) . psi^k(tau(B))
+ *
+ * where . is the slot-wise product (Jiang, Kim, Lauter and Song, CCS 2018).
+ * Every slot map is a sum of rotations times 0/1 diagonals (the masks of
+ * the slots that the rotation moves to their place). The rotations of one
+ * ciphertext are hoisted (BasicAutomorphPrecon) when the slots form a
+ * single native dimension, and run in parallel otherwise.
+ *
+ * By an encrypted matrix B, the product costs about 6n rotations and n
+ * products of ciphertexts. By a plaintext matrix W, the operands
+ * psi^k(tau(W)) are plaintext, and are only loaded when they are used from
+ * a WeightSource: InMemoryWeights computes them from W, MappedWeights reads
+ * them from a file written beforehand, memory-mapped like the polynomial
+ * bundles, so that the weights of a whole network need not be held at
+ * once. Either product takes three levels: the masks of sigma (and tau),
+ * those of phi^k (and psi^k), and the product itself.
+ *
+ * A MatrixPipeline applies layers of plaintext products (each optionally
+ * followed by an activation) to a batch of ciphertexts, and bootstraps the
+ * batch together (RefreshPolicy::refresh of a batch, i.e. a single batched
+ * PubKey::thinReCrypt) before a layer that would leave some of them too
+ * little capacity to be bootstrapped.
+ */
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <helib/Ctxt.h>
+#include <helib/EncryptedArray.h>
+#include <helib/PtrVector.h>
+
+namespace helib {
+
+class RefreshPolicy;
+
+/**
+ * @class WeightSource
+ * @brief The plaintext operand W of the products of a MatrixEngine, as the
+ * packed matrices psi^k(tau(W)) for k < n
+ **/
+class WeightSource
+{
+public:
+  virtual ~WeightSource() {}
+
+  //! The dimension n of the matrix
+  virtual long dimension() const = 0;
+
+  //! @brief Load psi^k(tau(W)) into out, packed as by MatrixEngine::pack
+  virtual void operand(PtxtArray& out, long k) const = 0;
+};
+
+/**
+ * @class InMemoryWeights
+ * @brief The operands of a matrix held in memory, made on demand
+ **/
+class InMemoryWeights : public WeightSource
+{
+public:
+  //! @brief The n x n matrix w, row by row, for BGV
+  InMemoryWeights(long n, std::vector<long> w);
+
+  //! @brief The n x n matrix w, row by row, for CKKS
+  InMemoryWeights(long n, std::vector<double> w);
+
+  long dimension() const override { return n; }
+  void operand(PtxtArray& out, long k) const override;
+
+private:
+  long n;
+  std::vector<long> integers;
+  std::vector<double> reals;
+};
+
+/**
+ * @class MappedWeights
+ * @brief The operands of a matrix read from a file written by write(),
+ * which is memory-mapped: only the operand in use is read.
+ *
+ * The layout is
+ *
+ *   magic "HEMATW01" | n | kind | operand 0 | ... | operand n-1
+ *
+ * where kind is 0 for integers and 1 for reals, and every operand is the
+ * n*n entries of psi^k(tau(W)), row by row. All the words are 64-bit
+ * little-endian (the reals as the bits of a double).
+ **/
+class MappedWeights : public WeightSource
+{
+public:
+  //! @throws IOError if the file cannot be opened or is not a weight file
+  explicit MappedWeights(const std::string& path);
+  ~MappedWeights();
+
+  MappedWeights(const MappedWeights&) = delete;
+  MappedWeights& operator=(const MappedWeights&) = delete;
+
+  //! @brief Write the operands of the n x n matrix w (row by row) to path
+  //! @throws IOError if the file cannot be written
+  static void write(const std::string& path,
+                    long n,
+                    const std::vector<long>& w);
+  static void write(const std::string& path,
+                    long n,
+                    const std::vector<double>& w);
+
+  long dimension() const override { return n; }
+  void operand(PtxtArray& out, long k) const override;
+
+private:
+  std::string path;
+  const unsigned char* data = nullptr;
+  std::size_t length = 0;
+  long n = 0;
+  bool real = false;
+#ifdef _WIN32
+  std::vector<unsigned char> buffer;
+#endif
+
+  void release();
+};
+
+/**
+ * @class MatrixEngine
+ * @brief Products of n x n matrices packed in the slots of a ciphertext
+ **/
+class MatrixEngine
+{
+public:
+  //! The levels taken by a product
+  static constexpr long levels = 3;
+
+  //! @brief The engine for n x n matrices in the slots of ea. The masks of
+  //! the slot maps are encoded here, about 8n of them.
+  //! @throws InvalidArgument if n*n is larger than the number of slots
+  MatrixEngine(const EncryptedArray& ea, long n);
+  ~MatrixEngine();
+
+  MatrixEngine(const MatrixEngine&) = delete;
+  MatrixEngine& operator=(const MatrixEngine&) = delete;
+
+  const EncryptedArray& getEA() const { return ea; }
+  long dimension() const { return n; }
+
+  //! @brief Pack the n x n matrix m, row by row, into out
+  void pack(PtxtArray& out, const std::vector<long>& m) const;
+  void pack(PtxtArray& out, const std::vector<double>& m) const;
+
+  //! @brief The n x n matrix packed in in, row by row
+  void unpack(std::vector<long>& m, const PtxtArray& in) const;
+  void unpack(std::vector<double>& m, const PtxtArray& in) const;
+
+  //! @brief a = a * w
+  //! @throws InvalidArgument if w is not n x n
+  void multiply(Ctxt& a, const WeightSource& w) const;
+
+  //! @brief a = a * b
+  void multiply(Ctxt& a, const Ctxt& b) const;
+
+private:
+  struct SlotMap;
+
+  const EncryptedArray& ea;
+  long n;
+  std::unique_ptr<SlotMap> sigma;
+  std::unique_ptr<SlotMap> tau;
+  std::vector<std::unique_ptr<SlotMap>> phi; // phi^k for 0 < k < n
+  std::vector<std::unique_ptr<SlotMap>> psi; // psi^k for 0 < k < n
+
+  // The maps of x, with the rotations of all of them hoisted together
+  std::vector<Ctxt> apply(const Ctxt& x,
+                          const std::vector<const SlotMap*>& maps) const;
+};
+
+/**
+ * @class MatrixPipeline
+ * @brief Layers of products by plaintext matrices, applied to a batch of
+ * packed matrices with batched bootstrapping between the layers
+ **/
+class MatrixPipeline
+{
+public:
+  //! @brief A pipeline of products by engine, bootstrapping with policy,
+  //! or with the RefreshPolicy of the Context when it is null (no
+  //! bootstrapping if there is none either). Both must outlive the
+  //! pipeline.
+  explicit MatrixPipeline(const MatrixEngine& engine,
+                          const RefreshPolicy* policy = nullptr);
+
+  //! @brief Add a layer x = activation(x * weights), whose activation
+  //! takes activationLevels levels
+  void addLayer(std::shared_ptr<const WeightSource> weights,
+                std::function<void(Ctxt&)> activation = nullptr,
+                long activationLevels = 0);
+
+  long size() const { return layers.size(); }
+
+  //! @brief Run the layers on every ciphertext of the batch
+  //! @return The number of batched bootstraps made
+  long run(const PtrVector<Ctxt>& batch) const;
+  long run(std::vector<Ctxt>& batch) const;
+
+private:
+  struct Layer
+  {
+    std::shared_ptr<const WeightSource> weights;
+    std::function<void(Ctxt&)> activation;
+    long levels;
+  };
+
+  const MatrixEngine& engine;
+  const RefreshPolicy* policy;
+  std::vector<Layer> layers;
+};
+
+} // namespace helib
+
+#endif // ifndef HELIB_MATRIXENGINE_H
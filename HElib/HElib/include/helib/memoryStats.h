@@ -0,0 +1,97 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef HELIB_MEMORYSTATS_H
+#define HELIB_MEMORYSTATS_H
+/**
+ * @file memoryStats.h
+ * @brief Accounting of the memory held by the residues of the DoubleCRTs
+ *
+ * The residues of every DoubleCRT, and so of every ciphertext and every
+ * key-switching matrix, are allocated through ResidueArena, which counts the
+ * bytes it takes from and returns to the system. A MemoryScope records the
+ * high-water mark of these bytes, and the bytes allocated, while it is
+ * active. The bytes cached by an arena are still held, as they are in the
+ * resident memory of the process.
+ *
+ * Scopes are process-wide rather than per thread, since the workers of a
+ * stage allocate on its behalf. They are meant for stages that run one at a
+ * time, such as those of a bootstrapping: with concurrent scopes, every one
+ * sees the allocations of the others.
+ */
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace helib {
+
+//! @brief Bytes of residues currently held from the system
+long residueBytes();
+
+//! @brief Bytes of residues allocated from the system so far
+long residueBytesAllocated();
+
+//! @brief Count bytes of residues taken from the system, or returned to it if
+//! negative
+void countResidueBytes(long bytes);
+
+//! @class MemoryScope
+//! @brief Records the high-water mark of residueBytes() and the bytes
+//! allocated from its construction until stop() or its destruction. Scopes
+//! nest, and may be stopped in any order.
+class MemoryScope
+{
+public:
+  //! @brief If name is not null and fhe_stats is set, stop() updates the
+  //! fhe_stats records <name>-residuePeakBytes and
+  //! <name>-residueAllocatedBytes
+  explicit MemoryScope(const char* name = nullptr);
+  ~MemoryScope();
+  MemoryScope(const MemoryScope&) = delete;
+  MemoryScope& operator=(const MemoryScope&) = delete;
+
+  //! @brief Stop recording, does nothing if already stopped
+  void stop();
+
+  //! High-water mark of residueBytes() so far
+  long peakBytes() const;
+
+  //! Bytes allocated from the system so far
+  long allocatedBytes() const;
+
+private:
+  const char* name;
+  bool running;
+  long startAllocated;
+  long peak;      // once stopped
+  long allocated; // once stopped
+  // The high-water mark of the enclosing scope before this one started
+  long enclosingPeak;
+
+  static long runningPeakOf(const std::vector<MemoryScope*>& scopes,
+                            std::size_t index);
+};
+
+//! @brief If fhe_stats is set, update the fhe_stats records
+//! prefix-residuePeakBytes and prefix-residueAllocatedBytes with the values
+//! of scope
+void updateMemoryStats(const std::string& prefix, const MemoryScope& scope);
+
+// Like HELIB_NTIMER_START and HELIB_NTIMER_STOP, reporting to fhe_stats
+#define HELIB_NMEMORY_START(n)                                                 \
+  helib::MemoryScope _named_memory_scope##n(#n)
+
+#define HELIB_NMEMORY_STOP(n) _named_memory_scope##n.stop()
+
+} // namespace helib
+
+#endif // ifndef HELIB_MEMORYSTATS_H
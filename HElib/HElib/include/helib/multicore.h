@@ -12,6 +12,18 @@
 /**
  * @file multicore.h
  * @brief Support for multi-threaded implementations
+ *
+ * The parallel loops of the library (HELIB_EXEC_RANGE and HELIB_EXEC_INDEX,
+ * see opCounters.h) run on a work-stealing scheduler rather than directly
+ * on the NTL thread pool, whose loops run serially when they are nested.
+ * Every worker of the scheduler has a deque of the loops it started: a loop
+ * is split into chunks, the worker that starts it runs chunks until none is
+ * left, and idle workers steal the remaining chunks of the loops in the
+ * other deques. A loop started inside a chunk is thus shared by all the idle
+ * workers, so that e.g. the d digit extractions of thick bootstrapping and
+ * the loops over the primes inside them use the whole machine together.
+ * Independent pieces of work that are not a loop can be forked and joined
+ * with a TaskGroup, which runs on the same workers.
  **/
 
 #ifndef HELIB_MULTICORE_H
@@ -21,6 +33,7 @@
 
 #include <atomic>
 #include <mutex>
+#include <shared_mutex>
 
 namespace helib {
 
@@ -30,6 +43,13 @@ namespace helib {
 #define HELIB_MUTEX_TYPE std::mutex
 #define HELIB_MUTEX_GUARD(mx) std::lock_guard<std::mutex> _lock##__LINE__(mx)
 
+// Readers take HELIB_SHARED_GUARD, writers HELIB_EXCLUSIVE_GUARD
+#define HELIB_SHARED_MUTEX_TYPE std::shared_mutex
+#define HELIB_SHARED_GUARD(mx)                                                 \
+  std::shared_lock<std::shared_mutex> _slock##__LINE__(mx)
+#define HELIB_EXCLUSIVE_GUARD(mx)                                              \
+  std::unique_lock<std::shared_mutex> _xlock##__LINE__(mx)
+
 } // namespace helib
 
 #else
@@ -42,8 +62,205 @@ namespace helib {
 #define HELIB_MUTEX_TYPE int
 #define HELIB_MUTEX_GUARD(mx) ((void)mx)
 
+#define HELIB_SHARED_MUTEX_TYPE int
+#define HELIB_SHARED_GUARD(mx) ((void)mx)
+#define HELIB_EXCLUSIVE_GUARD(mx) ((void)mx)
+
 } // namespace helib
 
 #endif // ifdef HELIB_THREADS
 
+#include <functional>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace helib {
+
+//! @brief Run body(first, last) on ranges that partition [0, n) and return
+//! once all of them are done, as NTL_EXEC_RANGE does. Called from a thread
+//! that is not a worker of the scheduler, the loop is split into
+//! availableThreads() ranges (it runs serially if that is 1) and the
+//! calling thread waits for the workers; called from a worker, it is split
+//! into availableThreads() ranges that the idle workers steal. The first
+//! exception thrown by body is rethrown once all the ranges are done.
+void parallelFor(long n, const std::function<void(long, long)>& body);
+
+//! @brief Same as parallelFor(n, body) with ranges of at least grain indices
+//! (a single range if n <= grain), for loops whose iterations are too cheap
+//! to be worth a range each
+void parallelFor(long n,
+                 long grain,
+                 const std::function<void(long, long)>& body);
+
+//! @brief Run body(index) for every index in [0, n), as NTL_EXEC_INDEX
+//! does. Unlike with NTL_EXEC_INDEX, the indices may run one after another
+//! on the same thread, so they must not wait for each other.
+void parallelForEach(long n, const std::function<void(long)>& body);
+
+//! @brief The number of threads a parallel loop started by the calling
+//! thread may use: the threads of its ExecutionPolicy if set, else the
+//! number of workers of the scheduler on one of them, else
+//! NTL::AvailableThreads(). Use it instead of NTL::AvailableThreads()
+//! to size the work of a parallel loop, as the latter is 1 on the workers.
+long availableThreads();
+
+//! @struct ExecutionPolicy
+//! @brief The execution resources of the parallel loops and tasks started by
+//! a thread, so that the workloads sharing the scheduler can be isolated and
+//! prioritized: a latency-critical bootstrap can use more threads than a
+//! background batch job, and have its loops taken first. The workers adopt
+//! the policy of the thread that started their loop with its ThreadSettings,
+//! so it applies to the nested loops too. Attach one to a Context
+//! (Context::setExecutionPolicy) for its bootstraps and linear maps, or
+//! install one on the calling thread with a Scope, which takes precedence.
+struct ExecutionPolicy
+{
+  //! The number of threads a loop may use, both on the calling thread and
+  //! on the workers, instead of availableThreads(); 0 to keep it. It may be
+  //! larger than NTL::AvailableThreads(), the scheduler starts the workers
+  //! it needs. Each loop is limited on its own: a loop nested in another
+  //! may use this many threads as well.
+  long threads = 0;
+
+  //! Whether the idle workers take the loops and tasks started under this
+  //! policy before the others
+  bool urgent = false;
+
+  bool isDefault() const { return threads == 0 && !urgent; }
+
+  //! @brief This policy, or other if this one is the default
+  const ExecutionPolicy& orElse(const ExecutionPolicy& other) const
+  {
+    return isDefault() ? other : *this;
+  }
+
+  //! @brief The policy of the calling thread
+  static ExecutionPolicy current();
+
+  class Scope;
+};
+
+//! @brief Make policy that of the calling thread for the lifetime of this
+//! object. A null policy leaves it unchanged.
+class ExecutionPolicy::Scope
+{
+public:
+  explicit Scope(const ExecutionPolicy* policy);
+  explicit Scope(const ExecutionPolicy& policy) : Scope(&policy) {}
+  ~Scope();
+  Scope(const Scope&) = delete;
+  Scope& operator=(const Scope&) = delete;
+
+private:
+  ExecutionPolicy previous;
+  bool installed;
+};
+
+//! @class TaskGroup
+//! @brief Fork-join tasks on the scheduler of parallelFor: run() makes a
+//! task available to the idle workers at once and wait() returns when all
+//! the tasks of the group are done, rethrowing the first exception that one
+//! of them threw. On a worker, wait() first runs the tasks that nobody took.
+//! Tasks may start loops and groups of their own. run() and wait() must be
+//! called by the thread that created the group, which must call wait()
+//! before destroying it (the destructor waits but drops the exceptions).
+//! The tasks do not adopt the OpCountScope and the other state of the
+//! caller, see adoptCallerState() in opCounters.h.
+class TaskGroup
+{
+public:
+  TaskGroup();
+  ~TaskGroup();
+  TaskGroup(const TaskGroup&) = delete;
+  TaskGroup& operator=(const TaskGroup&) = delete;
+
+  void run(std::function<void()> task);
+  void wait();
+
+private:
+  struct Task;
+  std::vector<std::unique_ptr<Task>> tasks;
+};
+
+//! @brief Pin every worker of the scheduler, including those started later,
+//! to one CPU of the process, or undo it. Consecutive workers get CPUs of
+//! the same NUMA node where possible, and a worker steals from the workers
+//! that follow it first, so the chunks of a loop tend to stay on one node.
+//! @return false if pinning is not supported on this platform
+bool pinWorkers(bool pin = true);
+
+//! @brief The NUMA node of the CPU the calling thread runs on, 0 if it is
+//! unknown. Unless the thread is pinned (see pinWorkers()), it may have
+//! moved to another node by the time this returns.
+long currentNode();
+
+//! @brief The number of NUMA nodes of the machine, 1 if it is unknown
+long nodeCount();
+
+//! @brief Have the read-only data that the workers of every node read over
+//! and over, i.e. the key-switching matrices and the DoubleCRT constants of
+//! the linear maps, copied to every NUMA node on first use, or stop it (the
+//! copies made so far are kept). Off by default: it takes a copy of the data
+//! per node, and is only worth it with pinWorkers() on a machine with
+//! several nodes.
+void replicatePerNode(bool replicate = true);
+
+//! @brief Whether replicatePerNode() is on
+bool replicatingPerNode();
+
+//! @class NodeReplicas
+//! @brief Copies of the items of some read-only data, one per NUMA node.
+//! get(i, copy) returns the copy of item i for the node of the calling
+//! thread, made by copy() the first time a thread of that node asks for it,
+//! so that its memory is allocated and first touched on the node. It
+//! returns nullptr if replicatePerNode() is off or there is a single node,
+//! and the caller then uses the original item. The copies live until
+//! clear() is called or the object is destroyed, and copying the object
+//! copies none of them.
+template <typename T>
+class NodeReplicas
+{
+public:
+  NodeReplicas() = default;
+  NodeReplicas(const NodeReplicas&) {}
+  NodeReplicas& operator=(const NodeReplicas&)
+  {
+    clear();
+    return *this;
+  }
+
+  template <typename Copy>
+  const T* get(long i, Copy copy) const
+  {
+    if (!replicatingPerNode() || nodeCount() <= 1)
+      return nullptr;
+    std::pair<long, long> key(currentNode(), i);
+    {
+      HELIB_SHARED_GUARD(mx);
+      auto it = copies.find(key);
+      if (it != copies.end())
+        return it->second.get();
+    }
+    // Made outside of the lock, another thread of the node may make it too
+    std::unique_ptr<const T> made(new T(copy()));
+    HELIB_EXCLUSIVE_GUARD(mx);
+    return copies.emplace(key, std::move(made)).first->second.get();
+  }
+
+  void clear()
+  {
+    HELIB_EXCLUSIVE_GUARD(mx);
+    copies.clear();
+  }
+
+private:
+  mutable HELIB_SHARED_MUTEX_TYPE mx{};
+  // Indexed by (node, item)
+  mutable std::map<std::pair<long, long>, std::unique_ptr<const T>> copies;
+};
+
+} // namespace helib
+
 #endif // ifndef HELIB_MULTICORE_H
@@ -96,6 +96,17 @@ void embeddingLargestCoeff_x2(double& norm1,
 
 NTL::xdouble embeddingLargestCoeff(const NTL::ZZX& f, const PAlgebra& palg);
 
+//! Batch versions: norms[i] = embeddingLargestCoeff(*fs[i], palg). The inputs
+//! are taken two at a time as in embeddingLargestCoeff_x2, and the pairs are
+//! processed in parallel.
+void embeddingLargestCoeffs(std::vector<double>& norms,
+                            const std::vector<const std::vector<double>*>& fs,
+                            const PAlgebra& palg);
+
+void embeddingLargestCoeffs(std::vector<NTL::xdouble>& norms,
+                            const std::vector<const NTL::ZZX*>& fs,
+                            const PAlgebra& palg);
+
 //! Computes canonical embedding.
 //! Requires p==-1 and m==2^k where k >=2 and f.length() < m/2.
 //! Sets v[m/4-1-i] = DFT[palg.ith_rep(i)] for i in range(m/4),
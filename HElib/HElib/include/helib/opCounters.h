@@ -0,0 +1,230 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef HELIB_OPCOUNTERS_H
+#define HELIB_OPCOUNTERS_H
+/**
+ * @file opCounters.h
+ * @brief Thread-safe counters of the expensive ciphertext operations
+ *
+ * Every thread counts the operations it performs in its own block of
+ * counters, without locking. The blocks of all threads are merged on demand
+ * by totalOpCounts(). An OpCountScope counts the operations of a region of
+ * code: the operations of the thread that created it, and of the worker
+ * threads that adopt it. The parallel regions of the library run through
+ * HELIB_EXEC_RANGE and HELIB_EXEC_INDEX, which make the workers adopt the
+ * scope of the calling thread, so a scope also sees the work that the
+ * library hands to the scheduler of multicore.h.
+ *
+ * The operations that have a prime set also count its size, so that a scope
+ * knows e.g. the average number of primes of its key switches. Configuring
+ * with ENABLE_OP_COUNTERS=OFF defines HELIB_NO_OP_COUNTERS, which turns
+ * countOp() into an empty inline function: all the counts are then zero.
+ */
+
+#include <array>
+#include <cstddef>
+#include <functional>
+#include <iostream>
+#include <string>
+
+#include <NTL/BasicThreadPool.h>
+
+#include <helib/multicore.h>
+#include <helib/ResidueArena.h>
+#include <helib/refreshPolicy.h>
+#include <helib/threadSettings.h>
+
+namespace helib {
+
+//! The operations that are counted
+enum class OpType
+{
+  Relinearization, // one key switch of a ciphertext part in reLinearize
+  KeySwitch,       // one product of digits with a key-switching matrix
+  Automorphism,
+  TensorProduct,
+  NTT,       // one forward or inverse transform modulo one prime
+  ModSwitch, // one modulus switch that drops primes, or a raw one
+  // The key switches of a ciphertext part, by the key of the part: a power
+  // of s, s(X^k) for a Frobenius k = p^j, or s(X^k) for another k
+  RelinKeySwitch,
+  FrobeniusKeySwitch,
+  AutomorphKeySwitch,
+  Digit,      // one digit multiplied by a key-switching matrix
+  ScalarMult, // one product of a ciphertext by a constant or a plaintext
+};
+
+constexpr std::size_t OP_TYPES = 11;
+
+//! Name of an operation, as used in JSON and in fhe_stats
+const char* opName(OpType op);
+
+//! @brief Number of operations of each type
+struct OpCounts
+{
+  std::array<long, OP_TYPES> counts{};
+  // The sizes of the prime sets of the operations, summed
+  std::array<long, OP_TYPES> primes{};
+
+  long operator[](OpType op) const { return counts[std::size_t(op)]; }
+  long& operator[](OpType op) { return counts[std::size_t(op)]; }
+
+  //! The average size of the prime sets of the operations of type op (0 if
+  //! there were none, or if they do not report their prime sets)
+  double averagePrimes(OpType op) const
+  {
+    long n = counts[std::size_t(op)];
+    return n ? double(primes[std::size_t(op)]) / n : 0.0;
+  }
+
+  OpCounts& operator+=(const OpCounts& other);
+  OpCounts& operator-=(const OpCounts& other);
+  OpCounts operator+(const OpCounts& other) const
+  {
+    OpCounts result(*this);
+    return result += other;
+  }
+  OpCounts operator-(const OpCounts& other) const
+  {
+    OpCounts result(*this);
+    return result -= other;
+  }
+  bool operator==(const OpCounts& other) const
+  {
+    return counts == other.counts && primes == other.primes;
+  }
+  bool operator!=(const OpCounts& other) const { return !(*this == other); }
+};
+
+std::ostream& operator<<(std::ostream& str, const OpCounts& counts);
+
+//! @brief Count n operations of the given type on the calling thread, each
+//! on a prime set of the given size (0 if it has none)
+#ifdef HELIB_NO_OP_COUNTERS
+inline void countOp(OpType, long = 1, long = 0) {}
+#else
+void countOp(OpType op, long n = 1, long primes = 0);
+#endif
+
+//! Operations performed by the calling thread so far
+OpCounts threadOpCounts();
+
+//! Operations performed by all threads so far, including finished ones
+OpCounts totalOpCounts();
+
+//! @class OpCountScope
+//! @brief Counts the operations from its construction on, made by the thread
+//! that constructed it and by the threads that adopt it. Scopes nest: an
+//! operation is counted by the current scope of the thread and by all the
+//! scopes enclosing it. A scope must be destroyed on the thread that created
+//! it, in reverse order of construction.
+class OpCountScope
+{
+public:
+  OpCountScope();
+  ~OpCountScope();
+  OpCountScope(const OpCountScope&) = delete;
+  OpCountScope& operator=(const OpCountScope&) = delete;
+
+  //! Operations counted so far
+  OpCounts counts() const;
+
+  //! The innermost scope of the calling thread, nullptr if there is none
+  static OpCountScope* current();
+
+  //! @brief Make scope (which may be null) the current scope of the calling
+  //! thread for the lifetime of this object, e.g. in a worker thread
+  class Adopt
+  {
+  public:
+    explicit Adopt(OpCountScope* scope);
+    ~Adopt();
+    Adopt(const Adopt&) = delete;
+    Adopt& operator=(const Adopt&) = delete;
+
+  private:
+    OpCountScope* previous;
+  };
+
+private:
+  friend void countOp(OpType op, long n, long primes);
+
+  OpCountScope* parent;
+  // The counts, then the sums of the prime set sizes
+  std::array<HELIB_atomic_long, 2 * OP_TYPES> totals;
+};
+
+//! @brief If fhe_stats is set, update the fhe_stats records prefix-<op> for
+//! every operation type with the given counts, e.g. once per bootstrapping
+void updateOpCountStats(const std::string& prefix, const OpCounts& counts);
+
+// NTL_EXEC_RANGE and NTL_EXEC_INDEX on the scheduler of multicore.h, whose
+// workers adopt the OpCountScope, the ResidueArena and the ThreadSettings of
+// the calling thread, and whether the refresh policies are suspended on it
+#define HELIB_EXEC_RANGE(n, first, last)                                       \
+  {                                                                            \
+    ::helib::OpCountScope* _helib_op_scope = ::helib::OpCountScope::current(); \
+    ::helib::ResidueArena* _helib_arena = ::helib::ResidueArena::current();    \
+    bool _helib_refresh_suspended = ::helib::RefreshPolicy::suspended();       \
+    ::helib::ThreadSettings _helib_settings =                                  \
+        ::helib::ThreadSettings::current();                                    \
+    ::helib::parallelFor((n), [&](long first, long last) {                     \
+      ::helib::OpCountScope::Adopt _helib_op_adopt(_helib_op_scope);           \
+      ::helib::ResidueArena::Adopt _helib_arena_adopt(_helib_arena);           \
+      ::helib::RefreshPolicy::Suspend _helib_refresh_adopt(                    \
+          _helib_refresh_suspended);                                           \
+      ::helib::ThreadSettings::Adopt _helib_settings_adopt(_helib_settings);
+
+#define HELIB_EXEC_RANGE_END                                                   \
+  });                                                                          \
+  }
+
+#define HELIB_EXEC_INDEX(n, index)                                             \
+  {                                                                            \
+    ::helib::OpCountScope* _helib_op_scope = ::helib::OpCountScope::current(); \
+    ::helib::ResidueArena* _helib_arena = ::helib::ResidueArena::current();    \
+    bool _helib_refresh_suspended = ::helib::RefreshPolicy::suspended();       \
+    ::helib::ThreadSettings _helib_settings =                                  \
+        ::helib::ThreadSettings::current();                                    \
+    ::helib::parallelForEach((n), [&](long index) {                            \
+      ::helib::OpCountScope::Adopt _helib_op_adopt(_helib_op_scope);           \
+      ::helib::ResidueArena::Adopt _helib_arena_adopt(_helib_arena);           \
+      ::helib::RefreshPolicy::Suspend _helib_refresh_adopt(                    \
+          _helib_refresh_suspended);                                           \
+      ::helib::ThreadSettings::Adopt _helib_settings_adopt(_helib_settings);
+
+#define HELIB_EXEC_INDEX_END                                                   \
+  });                                                                          \
+  }
+
+//! @brief task wrapped to run with the OpCountScope, the ResidueArena, the
+//! ThreadSettings and the refresh suspension of the calling thread, as the
+//! loops above do, e.g. for TaskGroup::run
+template <typename F>
+std::function<void()> adoptCallerState(F task)
+{
+  OpCountScope* scope = OpCountScope::current();
+  ResidueArena* arena = ResidueArena::current();
+  bool refreshSuspended = RefreshPolicy::suspended();
+  ThreadSettings settings = ThreadSettings::current();
+  return [=]() mutable {
+    OpCountScope::Adopt opAdopt(scope);
+    ResidueArena::Adopt arenaAdopt(arena);
+    RefreshPolicy::Suspend refreshAdopt(refreshSuspended);
+    ThreadSettings::Adopt settingsAdopt(settings);
+    task();
+  };
+}
+
+} // namespace helib
+
+#endif // ifndef HELIB_OPCOUNTERS_H
@@ -598,6 +598,39 @@ public:
   auto getScore(const Query_t& weighted_query,
                 const Matrix<TXT2>& query_data) const;
 
+  /**
+   * @brief The masks of `query_data` against the database, as computed by
+   * `contains` and `getScore`. These are the costly part of a lookup, and do
+   * not depend on the query expression, so several expressions over the same
+   * query data can share them.
+   * @tparam TXT2 The type of the query data, can be either a `Ctxt` or
+   * `Ptxt<BGV>`.
+   * @param query_data The query data to compare with the database.
+   * @return The masks, of the same size as the database.
+   **/
+  template <typename TXT2>
+  auto getMasks(const Matrix<TXT2>& query_data) const;
+
+  /**
+   * @brief Same as `contains`, from the masks of `getMasks`.
+   * @param lookup_query The lookup query expression to perform.
+   * @param masks The masks of the query data against this database.
+   * @return As for `contains`.
+   **/
+  template <typename TXT2>
+  Matrix<TXT2> containsFromMasks(const Query_t& lookup_query,
+                                 const Matrix<TXT2>& masks) const;
+
+  /**
+   * @brief Same as `getScore`, from the masks of `getMasks`.
+   * @param weighted_query The weighted lookup query expression to perform.
+   * @param masks The masks of the query data against this database.
+   * @return As for `getScore`.
+   **/
+  template <typename TXT2>
+  Matrix<TXT2> getScoreFromMasks(const Query_t& weighted_query,
+                                 const Matrix<TXT2>& masks) const;
+
   // TODO - correct name?
   /**
    * @brief Returns number of columns in the database.
@@ -618,7 +651,32 @@ inline auto Database<TXT>::contains(
     const Query_t& lookup_query,
     const Matrix<TXT2>& query_data) const
 {
-  auto result = getScore<TXT2>(lookup_query, query_data);
+  return containsFromMasks(lookup_query, getMasks(query_data));
+}
+
+template <typename TXT>
+template <typename TXT2>
+inline auto Database<TXT>::getScore(
+    const Query_t& weighted_query,
+    const Matrix<TXT2>& query_data) const
+{
+  return getScoreFromMasks(weighted_query, getMasks(query_data));
+}
+
+template <typename TXT>
+template <typename TXT2>
+inline auto Database<TXT>::getMasks(const Matrix<TXT2>& query_data) const
+{
+  return calculateMasks(context->getEA(), query_data, this->data);
+}
+
+template <typename TXT>
+template <typename TXT2>
+inline Matrix<TXT2> Database<TXT>::containsFromMasks(
+    const Query_t& lookup_query,
+    const Matrix<TXT2>& masks) const
+{
+  auto result = getScoreFromMasks(lookup_query, masks);
 
   if (lookup_query.containsOR) {
     // FLT on the scores
@@ -633,18 +691,14 @@ inline auto Database<TXT>::contains(
 
 template <typename TXT>
 template <typename TXT2>
-inline auto Database<TXT>::getScore(
+inline Matrix<TXT2> Database<TXT>::getScoreFromMasks(
     const Query_t& weighted_query,
-    const Matrix<TXT2>& query_data) const
+    const Matrix<TXT2>& masks) const
 {
-  auto mask = calculateMasks(context->getEA(), query_data, this->data);
-
-  auto result = calculateScores(weighted_query.Fs,
-                                weighted_query.mus,
-                                weighted_query.taus,
-                                mask);
-
-  return result;
+  return calculateScores(weighted_query.Fs,
+                         weighted_query.mus,
+                         weighted_query.taus,
+                         masks);
 }
 
 template <typename TXT>
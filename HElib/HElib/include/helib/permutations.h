@@ -21,6 +21,9 @@
 #include <helib/hypercube.h>
 #include <helib/apiAttributes.h>
 
+#include <memory>
+#include <set>
+
 namespace helib {
 
 //! A simple permutation is just a vector with p[i]=\pi_i
@@ -537,6 +540,8 @@ class EncryptedArray;
 class Context;
 class PermNetwork;
 class PtxtArray;
+class DoubleCRT;
+class DoubleCRTPrecon;
 
 //! @class PermNetLayer
 //! @brief The information needed to apply one layer of a permutation network
@@ -639,9 +644,67 @@ public:
 
   void apply(PtxtArray& a) const;
 
+  const EncryptedArray& getEA() const { return ea; }
+  const PermNetwork& getNetwork() const { return net; }
+
   // VJS-FIXME: add support for addMatrices4Network?
 };
 
+/**
+ * @class CompiledPermutation
+ * @brief A permutation network prepared once for many applications, e.g. a
+ * fixed shuffle of the data.
+ *
+ * PermNetwork::applyToCtxt computes every layer as the sum of
+ * sigma_{k_t}(mask_t * c), encoding the masks each time. Here the masks
+ * are moved through the automorphisms once, sigma_{k_t}(mask_t * c) =
+ * sigma_{k_t}(mask_t) * sigma_{k_t}(c), and kept as DoubleCRT (with their
+ * Shoup companions) over all the primes. All the automorphisms of a layer
+ * then apply to c itself, so they are hoisted together, and the products
+ * by the masks run in parallel. Only BGV is supported.
+ **/
+class CompiledPermutation
+{
+public:
+  //! @brief The identity, e.g. to readFrom() a compiled permutation
+  explicit CompiledPermutation(const EncryptedArray& ea) : ea(ea) {}
+
+  CompiledPermutation(const EncryptedArray& ea, const PermNetwork& net);
+
+  explicit CompiledPermutation(const PermPrecomp& pp) :
+      CompiledPermutation(pp.getEA(), pp.getNetwork())
+  {}
+
+  //! @brief The slots [a_0,a_1,...] of ctxt become [a_pi[0],a_pi[1],...]
+  void apply(Ctxt& ctxt) const;
+
+  //! @brief The number of layers that are not the identity
+  long depth() const { return layers.size(); }
+
+  //! @brief The automorphisms of all the layers, e.g. for addTheseMatrices
+  std::set<long> automorphisms() const;
+
+  //! @brief Binary IO. The masks are written as zzX and encoded again when
+  //! they are read, for an EncryptedArray of the same context.
+  void writeTo(std::ostream& str) const;
+  void readFrom(std::istream& str);
+
+private:
+  struct Term
+  {
+    long k; // the automorphism
+    zzX mask; // sigma_k of the mask of the shift
+    double size;
+    std::shared_ptr<DoubleCRT> dcrt;
+    std::shared_ptr<DoubleCRTPrecon> precon;
+  };
+
+  const EncryptedArray& ea;
+  std::vector<std::vector<Term>> layers;
+
+  void encodeMasks();
+};
+
 /* EXAMPLE USE:
 
   // do some permutation-independent pre-computations
@@ -658,6 +721,10 @@ public:
   // apply the permutation
   pp.apply(ctxt);
 
+  // or, for a permutation applied many times, compile it once
+  CompiledPermutation cp(pp);
+  cp.apply(ctxt);
+
 
   // if the slots are originally [a_0,a_1,a_2,...]
   // then they become [a_pi[0],a_pi[1],a_pi[2],...]
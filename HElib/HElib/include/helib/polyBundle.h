@@ -0,0 +1,217 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef HELIB_POLYBUNDLE_H
+#define HELIB_POLYBUNDLE_H
+/**
+ * @file polyBundle.h
+ * @brief Binary store for the digit extraction polynomials
+ *
+ * A bundle is a single file holding every polynomial that used to live in
+ * `polynomials/poly{p}_{e_inner}_{e}.txt`. The layout is
+ *
+ *   magic "HEPOLYB1" | number of entries | index | coefficient data
+ *
+ * where each index record is (p, e_inner, e, offset, number of coefficients)
+ * and each coefficient is stored as a signed 64-bit byte count (the sign is
+ * the sign of the coefficient, zero for a zero coefficient) followed by the
+ * little-endian magnitude bytes. All integers are 64-bit little-endian.
+ * The index is kept sorted so lookups are a binary search, and the file is
+ * memory-mapped so that only the polynomials that are actually used get
+ * decoded.
+ */
+
+#include <iosfwd>
+#include <string>
+#include <vector>
+#include <cstddef>
+
+#include <NTL/ZZX.h>
+
+namespace helib {
+
+class DigitProgram;
+
+class PolynomialBundle
+{
+public:
+  //! An entry of a bundle, as used when writing one
+  struct Entry
+  {
+    long p;
+    long e_inner;
+    long e;
+    NTL::ZZX poly;
+  };
+
+  //! @brief Memory-map the bundle stored at `path`
+  //! @throws IOError if the file cannot be opened or is not a bundle
+  explicit PolynomialBundle(const std::string& path);
+  ~PolynomialBundle();
+
+  //! @brief Whether the file at `path` starts like a bundle
+  static bool isBundle(const std::string& path);
+
+  PolynomialBundle(const PolynomialBundle&) = delete;
+  PolynomialBundle& operator=(const PolynomialBundle&) = delete;
+
+  const std::string& getPath() const { return path; }
+
+  //! Number of polynomials in the bundle
+  long size() const { return index.size(); }
+
+  bool contains(long p, long e_inner, long e) const;
+
+  //! Largest precision e stored for (p, e_inner), or 0 if there is none
+  long maxPrecision(long p, long e_inner) const;
+
+  //! @brief Decode the polynomial stored under (p, e_inner, e)
+  //! @throws OutOfRangeError if the bundle has no such entry
+  void decode(NTL::ZZX& poly, long p, long e_inner, long e) const;
+
+  //! @brief Every polynomial stored for the plaintext prime p
+  std::vector<Entry> entries(long p) const;
+
+  //! @brief Number of bytes of the bundle. Its file may hold other data
+  //! after them, see `write(std::ostream&, std::vector<Entry>)`.
+  std::size_t byteSize() const;
+
+  //! @brief Write `entries` to `path` in bundle format
+  //! @throws IOError if the file cannot be written
+  static void write(const std::string& path, std::vector<Entry> entries);
+
+  //! @brief Write `entries` in bundle format to `out`, which must be at the
+  //! start of its file as the offsets of the index are absolute. Anything
+  //! written after the bundle is ignored when it is read.
+  //! @throws IOError if the stream fails
+  static void write(std::ostream& out, std::vector<Entry> entries);
+
+private:
+  struct IndexEntry
+  {
+    long p;
+    long e_inner;
+    long e;
+    std::size_t offset;
+    long nCoeffs;
+  };
+
+  std::string path;
+  const unsigned char* data = nullptr;
+  std::size_t length = 0;
+  std::vector<unsigned char> buffer; // used where mmap is not available
+  std::vector<IndexEntry> index;
+
+  const IndexEntry* find(long p, long e_inner, long e) const;
+  void release();
+};
+
+//! @brief Read a polynomial stored as whitespace-separated decimal
+//! coefficients, constant term first
+void parsePolynomial(NTL::ZZX& poly_result, const char* fileName);
+
+//! @brief Read every `poly{p}_{e_inner}_{e}.txt` file in `dir`,
+//! e.g. to convert them to a bundle
+std::vector<PolynomialBundle::Entry> readPolynomialDirectory(
+    const std::string& dir);
+
+//! @brief Every polynomial of the plaintext prime p in `path`, a bundle file
+//! or a directory of text files as for setPolynomialSource()
+//! @throws IOError if `path` is neither
+std::vector<PolynomialBundle::Entry> readPolynomialSource(
+    const std::string& path,
+    long p);
+
+//! @brief Set where the digit extraction polynomials are loaded from.
+//! `path` is either a bundle file or a directory of text files. This drops
+//! every polynomial decoded so far.
+//! @throws LogicError if a DigitPolynomialUse exists
+void setPolynomialSource(const std::string& path);
+
+//! @brief Where the digit extraction polynomials are loaded from: the path
+//! given to setPolynomialSource(), else the environment variable
+//! HELIB_POLYNOMIALS, else the directory "polynomials" relative to the
+//! current working directory
+std::string getPolynomialSource();
+
+//! @brief Compute the digit extraction polynomial for plaintext prime p,
+//! input precision e_inner and output precision e without the Magma scripts.
+//! The result f has the lowest possible degree and satisfies
+//! f(x) = d (mod p^e) for every x = d (mod p^e_inner), where d is a digit in
+//! [-(p-1)/2, p/2]. As with the scripts, f is odd for odd p and even for
+//! p = 2 and e_inner = 1, and its coefficients are the ones of
+//! minimizeDigitPolynomial(). The cost is quadratic in the number of
+//! interpolation nodes, which is about p * (e / e_inner).
+void generateDigitPolynomial(NTL::ZZX& poly, long p, long e_inner, long e);
+
+//! @brief Replace the digit extraction polynomial poly for (p, e_inner, e)
+//! by an equivalent one with smaller coefficients. Adding a polynomial that
+//! vanishes mod p^e on every input of precision e_inner does not change the
+//! function, and those of degree i can cancel coefficient i down to
+//! p^(e - v) / 2 in absolute value, where v grows with i / p. The top
+//! coefficients, which multiply the noisiest baby steps, shrink the most.
+//! The degree of poly does not grow, its parity is kept, and the result is
+//! balanced mod p^e.
+void minimizeDigitPolynomial(NTL::ZZX& poly, long p, long e_inner, long e);
+
+//! @brief Set whether getDigitPolynomial() generates the polynomials that
+//! getPolynomialSource() does not have with generateDigitPolynomial(),
+//! instead of reporting them missing
+void setGenerateDigitPolynomials(bool generate);
+
+//! @brief Whether missing polynomials are generated: the value given to
+//! setGenerateDigitPolynomials(), else whether the environment variable
+//! HELIB_GENERATE_POLYNOMIALS is set to 1
+bool getGenerateDigitPolynomials();
+
+//! @brief The digit extraction polynomial for plaintext prime p, input
+//! precision e_inner and output precision e, with the coefficients of
+//! minimizeDigitPolynomial().
+//! It is decoded from getPolynomialSource(), or generated if it is not there
+//! and getGenerateDigitPolynomials() is set, the first time it is requested
+//! and then kept in a registry that is safe to query from several threads.
+//! @throws OutOfRangeError if no such polynomial was generated
+const NTL::ZZX& getDigitPolynomial(long p, long e_inner, long e);
+
+//! @brief The multivariate digit extraction program for plaintext prime p,
+//! or nullptr if there is none. It is read from `slp{p}.txt` in the
+//! directory of getPolynomialSource() (see digitProgram.h for the format);
+//! without such a file, p = 2 gets DigitProgram::binary().
+//! @throws InvalidArgument if the file is not a valid program
+const DigitProgram* getDigitProgram(long p);
+
+//! @class DigitPolynomialUse
+//! @brief Keeps the polynomials and the program of prime p in the registry
+//! while it exists, so that the references returned by getDigitPolynomial()
+//! and getDigitProgram() stay valid. The digit extraction functions of
+//! polyEval.h hold one while they use them.
+class DigitPolynomialUse
+{
+public:
+  explicit DigitPolynomialUse(long p);
+  ~DigitPolynomialUse();
+  DigitPolynomialUse(const DigitPolynomialUse&) = delete;
+  DigitPolynomialUse& operator=(const DigitPolynomialUse&) = delete;
+
+private:
+  long p;
+};
+
+//! @brief Remove the polynomials and the program of prime p from the
+//! registry, e.g. once the last Context using p is gone. References
+//! previously returned for p become invalid, a caller that keeps them
+//! must hold a DigitPolynomialUse of p.
+//! @throws LogicError if a DigitPolynomialUse of p exists
+void releaseDigitPolynomials(long p);
+
+} // namespace helib
+
+#endif // ifndef HELIB_POLYBUNDLE_H
@@ -17,43 +17,386 @@
  * @brief Homomorphic Polynomial Evaluation
  */
 
+#include <functional>
+#include <map>
+#include <memory>
+
+#include <helib/bootstrapReport.h>
 #include <helib/Context.h>
 #include <helib/Ctxt.h>
+#include <helib/multicore.h>
 
 namespace helib {
 
-extern int nb_relin;
-
-extern long nb_primes;
-extern std::vector<long> primes_list;
-extern long nb_e_inner;
-extern std::vector<long> e_inner_list;
+template <typename T>
+class SimulatedCtxt;
 
 //! @brief Evaluate a cleartext polynomial on an encrypted input
 //! @param[out] res  to hold the return value
 //! @param[in]  poly the degree-d polynomial to evaluate
 //! @param[in]  x    the point on which to evaluate
-//! @param[in]  k    optional optimization parameter, defaults to sqrt(d/2)
-//! rounded up or down to a power of two
+//! @param[in]  k    optional number of baby steps. If it is not set and x
+//! has an integer plaintext space, the polynomial goes through the
+//! evaluation engine of the multi-polynomial polyEval() below, otherwise
+//! through the classic Paterson-Stockmeyer evaluation with k defaulting to
+//! sqrt(d/2) rounded up or down to a power of two
 void polyEval(Ctxt& ret, NTL::ZZX poly, const Ctxt& x, long k = 0);
 // Note: poly is passed by value, so caller keeps the original
 
+//! @brief Evaluate several cleartext polynomials on the same encrypted
+//! input, sharing the baby steps and giant steps between them. Polynomials
+//! in x^j (e.g. even ones) are evaluated in x^j and odd ones only use odd
+//! baby steps, see PolyEvalPlan; constant polynomials give constant
+//! ciphertexts.
+//! @param[out] ret    to hold the evaluation of each polynomial
+//! @param[in]  polys  the polynomials to evaluate
+//! @param[in]  x      the point on which to evaluate
+//! @param[in]  policy when the products are relinearized, with
+//! RelinPolicy::Deferred the results may be in extended form
+//! @param[in]  parallel evaluate the giant steps on the NTL thread pool
+void polyEval(std::vector<Ctxt>& ret, const std::vector<NTL::ZZX>& polys, const Ctxt& x, RelinPolicy policy = RelinPolicy::Eager, bool parallel = false);
+
 //! @brief Evaluate an encrypted polynomial on an encrypted input
 //! @param[out] res  to hold the return value
 //! @param[in]  poly the degree-d polynomial to evaluate
 //! @param[in]  x    the point on which to evaluate
+//! Same as the overload below with RelinPolicy::Lazy, in parallel
 void polyEval(Ctxt& ret, const NTL::Vec<Ctxt>& poly, const Ctxt& x);
 
+//! @brief Evaluate an encrypted polynomial on an encrypted input with the
+//! Paterson-Stockmeyer schedule of customPolyEval: the baby steps are
+//! computed once and shared, every block of coefficients is a sum of
+//! ciphertext-ciphertext products relinearized once (unless the policy is
+//! eager), and the giant-step subtrees are evaluated in parallel if
+//! parallel is set. Empty coefficients are zero. CKKS ciphertexts use the
+//! serial binary splitting of the polynomial instead.
+//! @param[out] res    to hold the return value, may alias x or poly
+//! @param[in]  poly   the coefficients of the polynomial
+//! @param[in]  x      the point on which to evaluate
+//! @param[in]  policy when the products are relinearized
+//! @param[in]  parallel evaluate the two halves of every giant step on the
+//! NTL thread pool
+void polyEval(Ctxt& ret, const NTL::Vec<Ctxt>& poly, const Ctxt& x, RelinPolicy policy, bool parallel = false);
+
 struct PS_parameters {
   int m;
   int k;
   int multiplications;
   bool odd;
+  int keySwitches;  // estimate, used to break ties between equal multiplications
+  double scalarNoise; // log2 of the largest sum of |coefficients| of a baby step, breaks the remaining ties
+};
+
+//! @brief The Paterson-Stockmeyer parameters with the fewest non-scalar
+//! multiplications, among those the fewest key switches, and then the least
+//! noise added by the scalar multiplications of the baby steps
+//! @param maxPower highest power of s that can be relinearized, see
+//! PubKey::maxRelinPower(): lazy giant-step products are only relinearized
+//! once they would exceed it
+PS_parameters getBestParameters(const std::vector<NTL::ZZX>& polynomials, bool lazy = false, long maxPower = 2);
+//! @brief Evaluate several cleartext polynomials on the same encrypted input,
+//! sharing the baby steps and giant steps of the Paterson-Stockmeyer algorithm
+//! @param[out] result      to hold the evaluation of each polynomial
+//! @param[in]  polynomials the polynomials to evaluate (degree at least 1)
+//! @param[in]  element     the point on which to evaluate
+//! @param[in]  policy      when the products are relinearized, with
+//! RelinPolicy::Deferred the results may be in extended form
+//! @param[in]  parallel    evaluate the polynomials (or the two halves of the
+//! recursion if there is only one) on the NTL thread pool
+void customPolyEval(std::vector<Ctxt>& result, const std::vector<NTL::ZZX>& polynomials, const Ctxt& element, RelinPolicy policy, bool parallel = false);
+//! @brief Same as customPolyEval() with RelinPolicy::Lazy if lazy is set and
+//! RelinPolicy::Eager otherwise
+void customPolyEval(std::vector<Ctxt>& result, const std::vector<NTL::ZZX>& polynomials, const Ctxt& element, bool lazy = false, bool parallel = false);
+
+//! @class PolyEvalPlan
+//! @brief The ciphertext-independent part of customPolyEval: spacing,
+//! Paterson-Stockmeyer parameters, baby-step schedule and coefficients
+//! reduced mod the plaintext space. Build it once, then call evaluate()
+//! for every ciphertext.
+class PolyEvalPlan
+{
+public:
+  //! @param context     the Context of the ciphertexts to evaluate on
+  //! @param polynomials the polynomials to evaluate (degree at least 1)
+  //! @param policy      when the products are relinearized
+  //! @param ptxtSpace   plaintext space of the ciphertexts to evaluate on,
+  //! evaluation is also valid for any divisor of it
+  //! @param maxPower    highest power of s the keys can relinearize, only
+  //! used by the cost model
+  PolyEvalPlan(const Context& context, const std::vector<NTL::ZZX>& polynomials, RelinPolicy policy, long ptxtSpace, long maxPower = 2);
+  PolyEvalPlan(const Context& context, const std::vector<NTL::ZZX>& polynomials, bool lazy, long ptxtSpace, long maxPower = 2) :
+      PolyEvalPlan(context, polynomials, lazy ? RelinPolicy::Lazy : RelinPolicy::Eager, ptxtSpace, maxPower) {}
+
+  //! @brief Same as customPolyEval(result, polynomials, element, policy, parallel)
+  void evaluate(std::vector<Ctxt>& result, const Ctxt& element, bool parallel = false) const;
+
+  //! @brief Slot-wise evaluation with the schedule of this plan, which must
+  //! be built on the single polynomial slotPolynomialShape(coefficients),
+  //! see customPolyEval(Ctxt&, const std::vector<const PreparedPtxt*>&, ...)
+  //! @throws InvalidArgument if the coefficients do not have that shape
+  void evaluate(Ctxt& result, const std::vector<const PreparedPtxt*>& coefficients, const Ctxt& element, bool parallel = false) const;
+
+  //! @brief Evaluation with encrypted coefficients (nullptr for zero) and the
+  //! schedule of this plan, which must be built on the single polynomial
+  //! encryptedPolynomialShape(coefficients), see polyEval(Ctxt&, const
+  //! NTL::Vec<Ctxt>&, const Ctxt&, RelinPolicy, bool)
+  //! @throws InvalidArgument if the coefficients do not have that shape
+  void evaluate(Ctxt& result, const std::vector<const Ctxt*>& coefficients, const Ctxt& element, bool parallel = false) const;
+
+  //! @brief Same as evaluate() on a plaintext integer, with the same
+  //! baby steps, giant steps and relinearizations, see digitSimulation.h.
+  //! x^spacing is taken with SimulatedCtxt::power(). Instantiated for long
+  //! and NTL::ZZ.
+  template <typename T>
+  void simulate(std::vector<SimulatedCtxt<T>>& result, const SimulatedCtxt<T>& element) const;
+
+  long getSpacing() const { return spacing; }
+  const PS_parameters& getParameters() const { return parameters; }
+  RelinPolicy getRelinPolicy() const { return policy; }
+  bool isLazy() const { return policy != RelinPolicy::Eager; }
+  long getPtxtSpace() const { return ptxtSpace; }
+  long size() const { return constants.size(); }
+
+private:
+  struct BabyStep {
+    int ind1, ind2;     // x^exp = x^ind1 * x^ind2, both 0 if x^exp is not needed
+  };
+
+  // The baby steps x^spacing, ..., x^(k*spacing) and the giant steps
+  void powers(std::vector<Ctxt>& xExp1, std::vector<Ctxt>& xExp2, const Ctxt& element) const;
+
+  const Context& context;
+  RelinPolicy policy;
+  long ptxtSpace;
+  long spacing;
+  PS_parameters parameters;
+  std::vector<BabyStep> babySteps;                // for exp = 2, ..., k
+  std::vector<std::vector<NTL::ZZ>> coefficients; // balanced mod ptxtSpace, without constant term
+  std::vector<NTL::ZZ> constants;
 };
 
-PS_parameters getBestParameters(const std::vector<NTL::ZZX>& polynomials, bool lazy = false);
-void customPolyEval(std::vector<Ctxt>& result, const std::vector<NTL::ZZX>& polynomials, const Ctxt& element, bool lazy = false);
-void wrapExtractDigitsThin(Ctxt& ctxt, long botHigh, long r, bool our_version, bool lazy, std::vector<std::vector<long>> e_inner_compose_list, int nb_iterations);
+//! @brief The scalar polynomial with a coefficient 1 where coefficients has
+//! a constant and 0 where it has nullptr: a PolyEvalPlan built on it
+//! evaluates these slot-wise coefficients, with the same spacing and
+//! odd-polynomial detection as scalar ones
+NTL::ZZX slotPolynomialShape(const std::vector<const PreparedPtxt*>& coefficients);
+//! @brief Same as slotPolynomialShape() for encrypted coefficients
+NTL::ZZX encryptedPolynomialShape(const std::vector<const Ctxt*>& coefficients);
+
+//! @brief Evaluate a different polynomial in every slot: result is the sum
+//! of coefficients[i] * x^i, where the coefficients are BGV slot vectors
+//! (nullptr for a zero coefficient), encoded for the plaintext space of x
+//! or a divisor of it. The schedule is the Paterson-Stockmeyer one of
+//! customPolyEval, with the scalar multiplications of the baby steps
+//! replaced by plaintext-ciphertext multiply-adds.
+//! @throws InvalidArgument if x is a CKKS ciphertext
+void customPolyEval(Ctxt& result, const std::vector<const PreparedPtxt*>& coefficients, const Ctxt& element, RelinPolicy policy = RelinPolicy::Eager, bool parallel = false);
+//! @brief As above, with every coefficient prepared for this evaluation only
+void customPolyEval(Ctxt& result, const std::vector<EncodedPtxt>& coefficients, const Ctxt& element, RelinPolicy policy = RelinPolicy::Eager, bool parallel = false);
+
+//! @brief The coefficients, as slot vectors, of the slot-wise polynomials
+//! of degree < n that interpolate tables: in slot s, the polynomial takes
+//! the value tables[s][v] at v = 0, ..., n-1, mod the plaintext space p^r
+//! of context. coefficients[i][s] is the coefficient of x^i in slot s.
+//! @throws InvalidArgument if the tables do not all have the same size n,
+//! or if n > p (the points must be distinct mod p)
+std::vector<std::vector<long>> interpolateSlotTables(const Context& context, const std::vector<std::vector<long>>& tables);
+
+enum class SlotLookupMethod
+{
+  Interpolation, // customPolyEval on the interpolateSlotTables coefficients
+  TableLookup    // tableLookup on the bits of the index
+};
+
+//! @brief The cheaper way, in non-scalar multiplications, to look up slot-wise
+//! tables of tableSize entries: interpolation needs tableSize <= p, the
+//! table lookup needs the bits of the index, which are only extracted here
+//! for p = 2 (indexBits tells whether the caller already has them)
+SlotLookupMethod chooseSlotLookup(const Context& context, long tableSize, bool indexBits, RelinPolicy policy = RelinPolicy::Eager);
+
+//! @class PolyEvalPlanCache
+//! @brief Thread-safe cache of evaluation plans, keyed by a caller-chosen
+//! description of the polynomial set
+class PolyEvalPlanCache
+{
+public:
+  //! @brief The plan stored under key, built by calling build() on first use
+  std::shared_ptr<const PolyEvalPlan> get(const std::vector<long>& key, const std::function<std::shared_ptr<const PolyEvalPlan>()>& build);
+
+private:
+  HELIB_SHARED_MUTEX_TYPE mx;
+  std::map<std::vector<long>, std::shared_ptr<const PolyEvalPlan>> plans;
+};
+//! @class DigitPolynomialCache
+//! @brief Thread-safe cache of the polynomials of the built-in digit
+//! extraction, which only depend on p and the precision e
+class DigitPolynomialCache
+{
+public:
+  //! @brief buildLiftingPolynomial(p, e), computed on first use
+  const NTL::ZZX& getLifting(long p, long e);
+
+  //! @brief buildChenHanPolynomial(p, e), computed on first use
+  const NTL::ZZX& getChenHan(long p, long e);
+
+private:
+  const NTL::ZZX& get(long kind, long p, long e);
+
+  HELIB_SHARED_MUTEX_TYPE mx;
+  std::map<std::vector<long>, NTL::ZZX> polynomials;
+};
+
+//! @brief The digit extraction of thin bootstrapping: ctxt, whose plaintext
+//! space is p^(botHigh + r), is replaced with minus its digits above the
+//! botHigh lowest ones, plus p^ePrime times itself if ePrime < r, mod p^r.
+//! our_version uses customExtractDigitsThin, otherwise the built-in digit
+//! extraction.
+void extractDigitsThin(Ctxt& ctxt, long botHigh, long r, long ePrime, bool our_version = false, bool lazy = false, std::vector<std::vector<long>> e_inner_compose_list = {{1}});
+
+//! @brief Remove the botHigh lowest digits of ctxt, whose plaintext space is
+//! p^(botHigh + r), with extractDigitsThin (ePrime = r) and correct the sign
+//! of the result. If report is not null, it is cleared and receives the
+//! digit extraction stage.
+void wrapExtractDigitsThin(Ctxt& ctxt, long botHigh, long r, bool our_version, bool lazy, std::vector<std::vector<long>> e_inner_compose_list, BootstrapReport* report = nullptr);
+
+//! @brief Remove the botHigh lowest digits of ctxt, whose plaintext space is
+//! p^(botHigh + r), with the trapezoid of the polyfunction approach. The
+//! result is the negation of the remaining r digits.
+//! @param policy when the products are relinearized, the result is always
+//! canonical
+//! @param e_inner_compose_list splitting of every row, see
+//! planDigitExtraction(), the last one is used for all remaining rows
+void customExtractDigitsThin(Ctxt& ctxt, long botHigh, long r, RelinPolicy policy, std::vector<std::vector<long>> e_inner_compose_list);
+inline void customExtractDigitsThin(Ctxt& ctxt, long botHigh, long r, bool lazy, std::vector<std::vector<long>> e_inner_compose_list)
+{
+  customExtractDigitsThin(ctxt, botHigh, r, lazy ? RelinPolicy::Lazy : RelinPolicy::Eager, e_inner_compose_list);
+}
+
+//! @name Digit operations without bootstrapping
+//! The slots of ctxt must hold integers mod p^e (its plaintext space), as
+//! after the coefficient-to-slot map of thin bootstrapping. They all use the
+//! trapezoid of customExtractDigitsThin, with the plan of
+//! ThinRecryptData::digitExtractionPlans if the context has bootstrapping
+//! data, and of planDigitExtraction() otherwise.
+//! @throws InvalidArgument if the plaintext space is not a power of p with
+//! more than k digits
+///@{
+
+//! @brief Replace x with floor(x / p^k), mod p^(e-k)
+void homDivideByPk(Ctxt& ctxt, long k, RelinPolicy policy = RelinPolicy::Eager);
+
+//! @brief Replace x with the nearest multiple of p^k (halves round up for
+//! p = 2), mod p^e. The noise grows by a factor p^k.
+void homRound(Ctxt& ctxt, long k, RelinPolicy policy = RelinPolicy::Eager);
+
+//! @brief The nDigits lowest base-p digits of ctxt, all of them if nDigits
+//! is 0. As with extractDigits, digits[j] holds the j'th digit, in [0, p),
+//! mod p^(e-j). Every digit but the last of the plaintext space costs one
+//! row of the trapezoid, evaluated to full precision.
+void extractDigitsPolyfunc(std::vector<Ctxt>& digits, const Ctxt& ctxt, long nDigits = 0, RelinPolicy policy = RelinPolicy::Eager);
+
+//! @brief Raise the plaintext space of ctxt from p to p^e, keeping its
+//! digit, which must be 0 or 1 (or, for odd p, in (-p/2, p/2)). The digits
+//! above it are made correct one at a time by e - 1 evaluations of the
+//! lifting polynomial of extractDigits (squarings for p = 2).
+void liftDigit(Ctxt& ctxt, long e);
+///@}
+
+//! @brief How one step of a row of customExtractDigitsThin, from precision
+//! e_inner_previous to e_inner, is evaluated
+enum class DigitStepMethod
+{
+  Multivariate, //!< the straight-line program of getDigitProgram()
+  Composition,  //!< the polynomials of getDigitPolynomial()
+  Lifting,      //!< the lifting polynomial of extractDigits (one digit)
+  ChenHan       //!< the polynomial of Chen and Han of extendExtractDigits
+};
+
+//! @brief The method used for a step of a row of the given sizes. The
+//! program of getDigitProgram() is used from precision 1 unless the
+//! polynomials of getDigitPolynomial() take fewer multiplications (or as
+//! many at a lower depth). The optimized polynomials are used whenever they
+//! are available, otherwise the step falls back to the polynomials of the
+//! built-in digit extraction, which exist for every p and precision.
+DigitStepMethod digitStepMethod(const Context& context, long triangleSize, long rowSize, long e_inner_previous, long e_inner);
+
+//! @brief Choose the e_inner_compose_list for customExtractDigitsThin.
+//! For every row of the trapezoid, the splitting with the smallest number of
+//! non-scalar multiplications (Paterson-Stockmeyer cost of getBestParameters)
+//! is chosen among those that are not deeper than evaluating the row
+//! directly from precision 1. Every step is costed with the method that
+//! digitStepMethod() picks for it, so missing polynomials only make the
+//! plan more expensive.
+//! @param context the Context of the ciphertexts, gives p
+//! @param botHigh number of digits to remove (e - e')
+//! @param r       number of digits to keep
+//! @param lazy    use lazy relinearization
+std::vector<std::vector<long>> planDigitExtraction(const Context& context, long botHigh, long r, bool lazy = false);
+
+//! @brief Cost of customExtractDigitsThin with the given plan, as counted by
+//! planDigitExtraction(): the non-scalar multiplications of all rows, and
+//! the depth of all rows added up, which bounds the depth of the result as
+//! every row starts from a digit of the row above it
+void digitExtractionCost(long& multiplications, long& depth, const Context& context, long botHigh, long r, bool lazy, const std::vector<std::vector<long>>& e_inner_compose_list);
+
+//! @class DigitExtractionPlanCache
+//! @brief Thread-safe cache of the results of planDigitExtraction()
+class DigitExtractionPlanCache
+{
+public:
+  //! @brief The plan for (botHigh, r, lazy), computed on first use
+  const std::vector<std::vector<long>>& get(const Context& context, long botHigh, long r, bool lazy);
+
+  //! @brief Use plan for (botHigh, r, lazy) instead of computing it, e.g. a
+  //! plan stored with the keys. A plan that is already cached is kept, as
+  //! references to it may be in use.
+  void set(long botHigh, long r, bool lazy, std::vector<std::vector<long>> plan);
+
+  //! @brief Write every cached plan in binary format
+  void writeTo(std::ostream& str) const;
+
+  //! @brief Add the plans written by writeTo, see set()
+  //! @throws IOError if the stream does not hold plans
+  void readFrom(std::istream& str);
+
+private:
+  mutable HELIB_SHARED_MUTEX_TYPE mx;
+  std::map<std::vector<long>, std::vector<std::vector<long>>> plans;
+};
+
+//! @class UnpackConstantCache
+//! @brief Thread-safe cache of the constants of thick bootstrapping encoded
+//! as DoubleCRTs, per prime set, with the size bounds that multByConstant
+//! takes for them: the unpacking constants RecryptData::unpackSlotEncoding
+//! and the repacking constants x^i in all slots, for i < ordP.
+//! Bootstrapping always unpacks and repacks at the same levels, so there is
+//! normally a single prime set of each.
+class UnpackConstantCache
+{
+public:
+  //! @brief The constants encoding over primes, computed on first use.
+  //! encoding must be the same in every call.
+  const std::vector<DoubleCRT>& getConstants(const Context& context, const std::vector<NTL::ZZX>& encoding, const IndexSet& primes);
+
+  //! @brief embeddingLargestCoeff() of every constant, computed on first use
+  const std::vector<double>& getSizes(const Context& context, const std::vector<NTL::ZZX>& encoding);
+
+  //! @brief The repacking constants over primes, computed on first use
+  const std::vector<DoubleCRT>& getRepackConstants(const Context& context, const IndexSet& primes);
+
+  //! @brief embeddingLargestCoeff() of every repacking constant
+  const std::vector<double>& getRepackSizes(const Context& context);
+
+private:
+  const std::vector<NTL::ZZX>& repackEncoding(const Context& context);
+  const std::vector<DoubleCRT>& encode(std::map<IndexSet, std::vector<DoubleCRT>>& cache, const Context& context, const std::vector<NTL::ZZX>& encoding, const IndexSet& primes);
+  const std::vector<double>& bound(std::vector<double>& cache, const Context& context, const std::vector<NTL::ZZX>& encoding);
+
+  HELIB_SHARED_MUTEX_TYPE mx;
+  std::map<IndexSet, std::vector<DoubleCRT>> constants, repackConstants;
+  std::vector<double> sizes, repackSizes;
+  std::vector<NTL::ZZX> repackPolys;
+};
 
 // A useful helper class
 
@@ -154,12 +154,33 @@ public:
   }
   const PowerfulConversion& getPConv(long i) const { return pConvVec.at(i); }
 
+  //! @brief Whether the powerful basis is the same as the polynomial one,
+  //! i.e. m is a prime power
+  bool isTrivial() const { return triv; }
+
   // coefficients are reduced to the interval [-Q/2,Q/2], where
   // Q = product of primes in dcrt.getIndexSet();
   void dcrtToPowerful(NTL::Vec<NTL::ZZ>& powerful, const DoubleCRT& dcrt) const;
 
+  // The same for several DoubleCRTs, which are converted back to
+  // coefficients in one batch if they have the same index set
+  void dcrtToPowerful(std::vector<NTL::Vec<NTL::ZZ>>& powerful,
+                      const std::vector<const DoubleCRT*>& dcrts) const;
+
   void ZZXtoPowerful(NTL::Vec<NTL::ZZ>& powerful, const NTL::ZZX& poly) const;
   void powerfulToZZX(NTL::ZZX& poly, const NTL::Vec<NTL::ZZ>& powerful) const;
+
+  // The same for several polynomials at once. The conversions mod the primes
+  // of all the polynomials run in parallel, and so do the reductions of the
+  // slices of the hypercube inside every conversion.
+  void ZZXtoPowerful(std::vector<NTL::Vec<NTL::ZZ>>& powerful,
+                     const std::vector<const NTL::ZZX*>& polys) const;
+  void powerfulToZZX(
+      std::vector<NTL::ZZX>& polys,
+      const std::vector<const NTL::Vec<NTL::ZZ>*>& powerful) const;
+
+private:
+  long numPrimesFor(long target_bits) const;
 };
 
 /********************************************************************/
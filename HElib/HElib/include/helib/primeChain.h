@@ -15,6 +15,7 @@
  * @file primeChain.h
  * @brief handling the chain of moduli
  */
+#include <string>
 #include <vector>
 #include <helib/IndexSet.h>
 
@@ -74,6 +75,20 @@ private:
   long iFFT_cost = -1;
 };
 
+//! @brief Keep the primes that Context::buildModChain searches for in the
+//! directory dir, one file per prime size and m, so that later processes
+//! building the same chains do not search for them again. With an empty dir
+//! they are only kept in memory. The directory must exist.
+void setPrimeCacheDirectory(const std::string& dir);
+
+//! @brief The directory given to setPrimeCacheDirectory(), else the
+//! environment variable HELIB_PRIME_CACHE, else the empty string
+std::string getPrimeCacheDirectory();
+
+//! @brief Forget the primes kept in memory, which are read again from the
+//! directory on their next use
+void clearPrimeCache();
+
 std::ostream& operator<<(std::ostream& s, const ModuliSizes::Entry& e);
 std::istream& operator>>(std::istream& s, ModuliSizes::Entry& e);
 void write(std::ostream& s, const ModuliSizes::Entry& e);
@@ -0,0 +1,91 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef HELIB_PRIMEFACTORFFT_H
+#define HELIB_PRIMEFACTORFFT_H
+/**
+ * @file primeFactorFFT.h
+ * @brief Length-m FFT over coprime factors of an odd m (Good-Thomas)
+ *
+ * With m = m_1 * ... * m_k for pairwise coprime m_i, the length-m DFT is a
+ * k-dimensional DFT of lengths m_1, ..., m_k once the inputs are indexed by
+ * their residues mod the m_i (CRT) and the outputs by k = sum_i k_i m/m_i.
+ * There are no twiddle factors between the dimensions. Every dimension is
+ * transformed with a direct product by its DFT matrix when m_i is tiny, and
+ * with BluesteinFFT of length m_i otherwise, whose padding to the next power
+ * of two above 2m_i-1 can be much smaller than the one above 2m-1.
+ *
+ * Whether this beats a single BluesteinFFT depends on m: chooseFactors()
+ * compares the estimated costs of all the groupings of the prime powers of m,
+ * and Cmodulus only uses a PrimeFactorFFT when it does.
+ **/
+
+#include <vector>
+
+#include <helib/NumbTh.h>
+#include <helib/ClonedPtr.h>
+
+namespace helib {
+
+class PrimeFactorFFT
+{
+public:
+  PrimeFactorFFT() = default;
+
+  //! @brief The transform for m = the product of factors, which must be odd
+  //! and pairwise coprime. root has order m modulo the current zz_p modulus,
+  //! and as for BluesteinFFT the DFT is with root^2. The tables are relative
+  //! to the current modulus, which must be set when calling apply().
+  PrimeFactorFFT(const std::vector<long>& factors, const NTL::zz_p& root);
+
+  long size() const { return m; }
+
+  //! @brief y[k] = x(root^{2k}) for all k < m, y must have room for m
+  //! entries. The coefficients of x above m are ignored.
+  void apply(long* y, const NTL::zz_pX& x) const;
+
+  //! @brief A grouping of the prime powers of m into coprime factors whose
+  //! estimated cost is lower than the one of BluesteinFFT of length m, or an
+  //! empty vector if there is none (or m is even).
+  static std::vector<long> chooseFactors(long m);
+
+private:
+  // A dimension of the transform, of length n
+  struct Dimension
+  {
+    long n;
+    long stride; // distance of consecutive entries in the row-major layout
+
+    // the powers of root^{2m/n} for a direct DFT, with their precon
+    std::vector<long> w;
+    std::vector<NTL::mulmod_precon_t> wPrecon;
+
+    // the BluesteinFFT tables otherwise, for the root root^{m/n}
+    NTL::zz_p blueRoot;
+    NTL::zz_pX powers;
+    NTL::Vec<NTL::mulmod_precon_t> powers_aux;
+    CopiedPtr<NTL::fftRep> Rb;
+  };
+
+  long m = 0;
+  std::vector<Dimension> dims;
+
+  // inMap[i] is the exponent of the input at position i of the row-major
+  // layout, and outMap[i] the exponent of the output there
+  std::vector<long> inMap;
+  std::vector<long> outMap;
+
+  void transform(long* a, const Dimension& dim) const;
+};
+
+} // namespace helib
+
+#endif // ifndef HELIB_PRIMEFACTORFFT_H
@@ -15,12 +15,17 @@
  *  @brief Define some data structures to hold recryption data
  */
 
+#include <atomic>
+#include <functional>
+#include <mutex>
+
 #include <helib/NumbTh.h>
+#include <helib/assertions.h>
 
 namespace helib {
 
 extern long thinRecrypt_initial_level;
-extern long fhe_force_chen_han;
+extern thread_local long fhe_force_chen_han; // see threadSettings.h
 extern long printFlag;
 
 class PAlgebraMod;
@@ -30,6 +35,83 @@ class ThinEvalMap;
 class PowerfulDCRT;
 class Context;
 class PubKey;
+class PolyEvalPlanCache;
+class DigitPolynomialCache;
+class UnpackConstantCache;
+class DigitExtractionPlanCache;
+
+//! @class LazyComponent
+//! @brief A component of the recryption data, either set at once by
+//! assigning it, or built on first use by the function given to defer().
+//! Concurrent first uses build it once, the other threads wait for it.
+//! Testing it tells whether the component is part of the data, without
+//! building it.
+template <typename T>
+class LazyComponent
+{
+public:
+  LazyComponent() = default;
+  LazyComponent(const LazyComponent&) = delete;
+  LazyComponent& operator=(const LazyComponent&) = delete;
+
+  LazyComponent& operator=(std::shared_ptr<const T> value)
+  {
+    std::lock_guard<std::mutex> lock(mx);
+    builder = nullptr;
+    built = std::move(value);
+    ready.store(built.get());
+    return *this;
+  }
+
+  //! @brief Build the component with build() when it is first used
+  void defer(std::function<std::shared_ptr<const T>()> build)
+  {
+    std::lock_guard<std::mutex> lock(mx);
+    built.reset();
+    ready.store(nullptr);
+    builder = std::move(build);
+  }
+
+  //! @brief The component, built if it was deferred, nullptr if there is
+  //! none
+  const T* get() const
+  {
+    if (const T* p = ready.load())
+      return p;
+    std::lock_guard<std::mutex> lock(mx);
+    if (!built && builder) {
+      built = builder();
+      builder = nullptr;
+      ready.store(built.get());
+    }
+    return built.get();
+  }
+
+  const T& operator*() const
+  {
+    const T* p = get();
+    assertNotNull(p, "The recryption data has no such component");
+    return *p;
+  }
+  const T* operator->() const { return &**this; }
+
+  explicit operator bool() const
+  {
+    if (ready.load())
+      return true;
+    std::lock_guard<std::mutex> lock(mx);
+    return built || builder;
+  }
+
+  //! @brief Whether the component is there and already built
+  bool isBuilt() const { return ready.load() != nullptr; }
+
+private:
+  mutable std::mutex mx;
+  mutable std::function<std::shared_ptr<const T>()> builder;
+  mutable std::shared_ptr<const T> built;
+  mutable std::atomic<const T*> ready{nullptr};
+};
 
 //! @class RecryptData
 //! @brief A structure to hold recryption-related data inside the Context
@@ -53,31 +135,70 @@ public:
 
   bool build_cache;
 
+  //! With build_cache, the bytes that the DoubleCRT constants of the linear
+  //! maps may add to their zzX ones, negative for no limit. The constants
+  //! that do not fit are encoded again on every use. This is not recorded by
+  //! the serialization, but the bootstrap bundle keeps the format of every
+  //! constant.
+  long cacheBudget;
+
   bool alsoThick;
 
+  //! Whether the linear maps, p2dConv and unpackSlotEncoding are built on
+  //! their first use rather than by init, so that a process that only runs
+  //! some stages of bootstrapping only builds what these stages use. With
+  //! build_cache and a cacheBudget that is not negative, a linear map first
+  //! builds the ones before it in the budget (see ThinRecryptData::init), as
+  //! they decide what is left of it. Not recorded by the serialization.
+  bool lazy;
+
   //! linear maps
-  std::shared_ptr<const EvalMap> firstMap = nullptr, secondMap = nullptr;
+  LazyComponent<EvalMap> firstMap, secondMap;
 
   //! conversion between ZZX and Powerful
-  std::shared_ptr<const PowerfulDCRT> p2dConv = nullptr;
+  LazyComponent<PowerfulDCRT> p2dConv;
 
   //! linPolys for unpacking the slots
-  std::vector<NTL::ZZX> unpackSlotEncoding;
+  LazyComponent<std::vector<NTL::ZZX>> unpackSlotEncoding;
+
+  //! evaluation plans of the digit extraction polynomials, built on first use
+  std::shared_ptr<PolyEvalPlanCache> polyEvalPlans = nullptr;
+
+  //! polynomials of the built-in digit extraction, built on first use
+  std::shared_ptr<DigitPolynomialCache> digitPolynomials = nullptr;
+
+  //! unpackSlotEncoding as DoubleCRTs, built on first use
+  std::shared_ptr<UnpackConstantCache> unpackConstants = nullptr;
 
   RecryptData()
   {
     skHwt = 0;
     e = ePrime = 0;
     build_cache = false;
+    cacheBudget = -1;
     alsoThick = false;
+    lazy = false;
   }
 
-  //! Initialize the recryption data in the context
+  //! Initialize the recryption data in the context. With build_cache, the
+  //! constants of the linear maps are upgraded to DoubleCRT within
+  //! cacheBudget_ bytes, see cacheBudget. With lazy_, the components are
+  //! built on first use, see lazy.
   void init(const Context& context,
             const NTL::Vec<long>& mvec_,
             bool enableThick, /*init linear transforms for non-thin*/
             bool build_cache = false,
-            bool minimal = false);
+            bool minimal = false,
+            long cacheBudget_ = -1,
+            bool lazy_ = false);
+
+  //! Write the linear maps and the slot-unpacking constants computed by
+  //! init in binary format, see Context::writeBootstrapBundleTo
+  void writeTo(std::ostream& str) const;
+
+  //! Initialize the recryption data in the context from what writeTo wrote
+  //! for the same parameters, without computing the linear maps again
+  void readFrom(const Context& context, std::istream& str);
 
   bool operator==(const RecryptData& other) const;
   bool operator!=(const RecryptData& other) const
@@ -90,6 +211,39 @@ public:
   // VJS-FIXME: this needs to be documented.
   // It is based on the most recent version of our bootstrapping
   // paper (see Section 6.2)
+
+  //! Choose e and e' for the digit extraction of thin bootstrapping.
+  //! The built-in extraction (our_version = false) uses the heuristic above.
+  //! For customExtractDigitsThin, every e' (also e' < r) is a candidate,
+  //! and the pair is chosen by the cost of the planDigitExtraction() plan
+  //! for e - e' digits: fewest multiplications, then smallest depth, then
+  //! smallest e for that number of digits, among the pairs that satisfy the
+  //! same noise bound (boundForRecryption).
+  static void setAE(long& e,
+                    long& ePrime,
+                    const Context& context,
+                    bool our_version,
+                    bool lazy = false);
+
+protected:
+  // The part of init that is cheap enough to be redone by readFrom, given
+  // the tables of alMod if they were read
+  void initCommon(const Context& context,
+                  const NTL::Vec<long>& mvec_,
+                  bool enableThick,
+                  bool build_cache,
+                  const PAlgebraTables* tables = nullptr);
+
+  // With build_cache, what is left of cacheBudget for the linear maps that
+  // are not built yet
+  long budgetLeft = -1;
+
+  // The linear maps and the slot-unpacking constants of thick bootstrapping,
+  // or their builders if lazy, with constants upgraded within budgetLeft.
+  // With a budget, firstMap first builds previous if it is not null.
+  void initThick(const Context& context,
+                 bool minimal,
+                 const LazyComponent<ThinEvalMap>* previous = nullptr);
 };
 
 //! @class ThinRecryptData
@@ -99,14 +253,37 @@ class ThinRecryptData : public RecryptData
 {
 public:
   //! linear maps
-  std::shared_ptr<const ThinEvalMap> coeffToSlot, slotToCoeff;
+  LazyComponent<ThinEvalMap> coeffToSlot, slotToCoeff;
+
+  //! e_inner_compose_list chosen by planDigitExtraction, built on first use
+  std::shared_ptr<DigitExtractionPlanCache> digitExtractionPlans = nullptr;
 
-  //! Initialize the recryption data in the context
+  //! The bootstrapped ciphertexts only use the slots [0, usedSlots). The
+  //! other slots are ignored, and hold copies of the used ones afterwards.
+  long usedSlots = 0;
+
+  //! Initialize the recryption data in the context. With 0 < usedSlots_ <
+  //! nslots, the linear maps only keep the slots of index below usedSlots_,
+  //! rounded up to the product of the sizes of the trailing dimensions
+  //! (see ThinEvalMap). This is not recorded by the serialization of the
+  //! context, only by its bootstrap bundle. With build_cache, the thin
+  //! linear maps come first in cacheBudget_ and the thick ones, if any, get
+  //! what is left, see cacheBudget. The constants of the thin maps are
+  //! encoded on first use, over the prime set they are used at. With lazy_,
+  //! the components are built on first use, see lazy.
+  //! @throws InvalidArgument if usedSlots_ is not in [0, nslots]
   void init(const Context& context,
             const NTL::Vec<long>& mvec_,
             bool alsoThick, /*init linear transforms also for non-thin*/
             bool build_cache = false,
-            bool minimal = false);
+            bool minimal = false,
+            long usedSlots_ = 0,
+            long cacheBudget_ = -1,
+            bool lazy_ = false);
+
+  //! Binary IO of the precomputed data, including the thin linear maps
+  void writeTo(std::ostream& str) const;
+  void readFrom(const Context& context, std::istream& str);
 };
 
 #define HELIB_MIN_CAP_FRAC (2.0 / 3.0)
@@ -0,0 +1,99 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef HELIB_REFRESHPOLICY_H
+#define HELIB_REFRESHPOLICY_H
+/**
+ * @file refreshPolicy.h
+ * @brief Bootstrapping ciphertexts automatically, just before a product
+ * would leave them too little capacity to be bootstrapped
+ *
+ * A RefreshPolicy attached to a Context (Context::setRefreshPolicy) is
+ * consulted by Ctxt::multiplyBy, multiplyBy2, square and cube. A product
+ * leaves about the capacity of its weaker operand, minus the bits of the
+ * noise added by a modulus switch (see Ctxt::modSwitchAddedNoiseBound). An
+ * operand is bootstrapped first if that would fall below the capacity that
+ * bootstrapping needs, as predicted by estimateThinReCrypt (or
+ * estimateReCrypt), and if bootstrapping gives it more capacity than it has.
+ * An operand that the product does not own is bootstrapped in a copy.
+ *
+ * The policy leaves alone the ciphertexts that cannot be bootstrapped
+ * (CKKS, or a plaintext space that does not divide p^r), and the products
+ * computed while it bootstraps, on the calling thread and on the workers of
+ * the parallel loops that the bootstrapping starts.
+ */
+
+namespace helib {
+
+class Ctxt;
+class PubKey;
+template <typename T>
+struct PtrVector;
+
+class RefreshPolicy
+{
+public:
+  //! @brief Bootstrap with publicKey, with PubKey::thinReCrypt (or
+  //! PubKey::reCrypt if thick) and the given options, keeping marginBits
+  //! more capacity than bootstrapping needs
+  //! @throws LogicError if the context has no data for that bootstrapping
+  explicit RefreshPolicy(const PubKey& publicKey,
+                         bool thick = false,
+                         bool our_version = false,
+                         bool lazy = false,
+                         double marginBits = 0);
+
+  //! Capacity (in bits) below which a ciphertext is not bootstrapped safely
+  double inputCapacity() const { return minCapacity; }
+
+  //! Predicted capacity (in bits) of a bootstrapped ciphertext
+  double outputCapacity() const { return maxCapacity; }
+
+  //! @brief Whether ctxt is to be bootstrapped before it goes through levels
+  //! levels of products
+  bool needsRefresh(const Ctxt& ctxt, long levels = 1) const;
+
+  //! Bootstrap ctxt, with the policy suspended
+  void refresh(Ctxt& ctxt) const;
+
+  //! Bootstrap a batch of ciphertexts together (with the batched
+  //! PubKey::thinReCrypt if thin), with the policy suspended
+  void refresh(const PtrVector<Ctxt>& ctxts) const;
+
+  //! Whether the policies are suspended on the calling thread
+  static bool suspended();
+
+  //! Suspends the policies on the calling thread (or resumes them), until
+  //! destroyed
+  class Suspend
+  {
+  public:
+    explicit Suspend(bool suspend = true);
+    ~Suspend();
+    Suspend(const Suspend&) = delete;
+    Suspend& operator=(const Suspend&) = delete;
+
+  private:
+    bool previous;
+  };
+
+private:
+  const PubKey& publicKey;
+  bool thick;
+  bool our_version;
+  bool lazy;
+  double minCapacity;
+  double maxCapacity;
+};
+
+} // namespace helib
+
+#endif // ifndef HELIB_REFRESHPOLICY_H
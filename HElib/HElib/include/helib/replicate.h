@@ -31,6 +31,7 @@
  * use the SIMD operations on these ciphertexts.
  **/
 
+#include <helib/apiAttributes.h>
 #include <helib/EncryptedArray.h>
 #include <helib/Ptxt.h>
 
@@ -58,6 +59,17 @@ public:
   virtual void handle(const Ctxt& ctxt) = 0;
   virtual ~ReplicateHandler() {}
 
+  //! @brief Whether handleAt (and earlyStop) may be called concurrently,
+  //! from several threads and out of order. If so, replicateAll processes
+  //! the replication tree in parallel; if not (the default), the replicated
+  //! ciphertexts are handed over one at a time, in order.
+  virtual bool concurrent() const { return false; }
+
+  //! @brief Called for every replicated ciphertext with the slot that it
+  //! replicates (after an early stop, the first of the slots it holds). The
+  //! default calls handle(ctxt).
+  virtual void handleAt(const Ctxt& ctxt, UNUSED long slot) { handle(ctxt); }
+
   // The earlyStop call can be used to quit the replication mid-way, leaving
   // a ciphertext with (e.g.) two different entries, each replicated n/2 times
   // FIXME: Why does this function have arguments? Maybe remove them and then
@@ -86,6 +98,12 @@ public:
  * based only on the heuristic, which will introduce noise corresponding to
  * O(log log n) levels of recursion, but still gives an algorithm that
  * theoretically runs in time O(n).
+ *
+ * The two rotations of every node of the recursion are hoisted (they are
+ * applied to the same ciphertext, and the masks are applied after them). If
+ * the handler is concurrent(), the independent subtrees are processed in
+ * parallel: about twice as many as there are threads at a time, each one
+ * depth-first, so that only O(threads * log n) ciphertexts are live.
  **/
 void replicateAll(const EncryptedArray& ea,
                   const Ctxt& ctxt,
@@ -166,9 +184,22 @@ public:
 };
 
 class RepAuxDim
-{ // two tables per dimension
+{ // two tables per dimension, and the masks of the hoisted rotations
 private:
   std::vector<std::vector<CopiedPtr<FatEncodedPtxt>>> _tab, _tab1;
+  std::vector<std::vector<CopiedPtr<FatEncodedPtxt>>> _tabLeft, _tabRight;
+
+  static CopiedPtr<FatEncodedPtxt>& entry(
+      std::vector<std::vector<CopiedPtr<FatEncodedPtxt>>>& table,
+      long d,
+      long i)
+  {
+    if (d >= lsize(table))
+      table.resize(d + 1);
+    if (i >= lsize(table[d]))
+      table[d].resize(i + 1);
+    return table[d][i];
+  }
 
 public:
   CopiedPtr<FatEncodedPtxt>& tab(long d, long i)
@@ -188,6 +219,17 @@ public:
       _tab1[d].resize(i + 1);
     return _tab1[d][i];
   }
+
+  // tab(d, i) rotated by 2^{i-1} in dimension d, and the complement of
+  // tab(d, i) in the same range rotated by -2^{i-1}
+  CopiedPtr<FatEncodedPtxt>& tabLeft(long d, long i)
+  {
+    return entry(_tabLeft, d, i);
+  }
+  CopiedPtr<FatEncodedPtxt>& tabRight(long d, long i)
+  {
+    return entry(_tabRight, d, i);
+  }
 };
 //! @endcond
 
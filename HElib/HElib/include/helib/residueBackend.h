@@ -0,0 +1,166 @@
+/* Copyright (C) 2021 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef HELIB_RESIDUEBACKEND_H
+#define HELIB_RESIDUEBACKEND_H
+/**
+ * @file residueBackend.h
+ * @brief Running the element-wise kernels of DoubleCRT on another device
+ *
+ * A ResidueBackend attached to a Context (Context::setResidueBackend) takes
+ * over the element-wise kernels of the DoubleCRTs of that Context: sums,
+ * differences and products with another DoubleCRT or with a scalar, the
+ * inner products of key switching (DoubleCRT::innerProduct) and the
+ * permutations of DoubleCRT::automorph. Each call covers all the rows of a
+ * DoubleCRT, one row of n residues per prime, so that a device such as a GPU
+ * launches one kernel for a whole operation.
+ *
+ * The rows are passed in host memory, and must hold the results in host
+ * memory when a call returns. A backend may keep device copies between calls.
+ * The number-theoretic transforms of Cmodulus stay on the host.
+ * HostResidueBackend computes the kernels as the built-in loops do, and is
+ * the reference for other backends.
+ */
+
+namespace helib {
+
+enum class ResidueOp
+{
+  Add,
+  Sub,
+  Mul
+};
+
+class ResidueBackend
+{
+public:
+  virtual ~ResidueBackend() = default;
+
+  //! result[i][j] = a[i][j] op b[i][j] mod q[i], for i < rows and j < n.
+  //! result may be a.
+  virtual void apply(ResidueOp op,
+                     long* const* result,
+                     const long* const* a,
+                     const long* const* b,
+                     const long* q,
+                     long rows,
+                     long n) const = 0;
+
+  //! result[i][j] = a[i][j] op s[i] mod q[i], for i < rows and j < n.
+  //! result may be a.
+  virtual void applyScalar(ResidueOp op,
+                           long* const* result,
+                           const long* const* a,
+                           const long* s,
+                           const long* q,
+                           long rows,
+                           long n) const = 0;
+
+  //! result[i][j] = sum_{t < terms} a[t][i][j] * b[t][i][j] mod q[i], for
+  //! i < rows and j < n. result is none of the operands.
+  virtual void innerProduct(long* const* result,
+                            const long* const* const* a,
+                            const long* const* const* b,
+                            long terms,
+                            const long* q,
+                            long rows,
+                            long n) const = 0;
+
+  //! rows[i][j] = (the old) rows[i][perm[j]], for i < count and j < n
+  virtual void permute(long* const* rows,
+                       const long* perm,
+                       long count,
+                       long n) const = 0;
+};
+
+//! The kernels on the host, with the rows split over the threads
+class HostResidueBackend : public ResidueBackend
+{
+public:
+  void apply(ResidueOp op,
+             long* const* result,
+             const long* const* a,
+             const long* const* b,
+             const long* q,
+             long rows,
+             long n) const override;
+
+  void applyScalar(ResidueOp op,
+                   long* const* result,
+                   const long* const* a,
+                   const long* s,
+                   const long* q,
+                   long rows,
+                   long n) const override;
+
+  void innerProduct(long* const* result,
+                    const long* const* const* a,
+                    const long* const* const* b,
+                    long terms,
+                    const long* q,
+                    long rows,
+                    long n) const override;
+
+  void permute(long* const* rows,
+               const long* perm,
+               long count,
+               long n) const override;
+};
+
+/**
+ * @brief The kernels for the chains of primes below 2^31
+ * (ContextBuilder::primeBits)
+ *
+ * With such primes a residue and the sum of two fit in 32 bits, and a
+ * product fits in 62 bits, so the kernels need no multi-word arithmetic:
+ * branch-free additions and subtractions, products reduced with a
+ * floating-point quotient rather than a division, and inner products that
+ * only reduce every third term. The rows of the wider primes, if any, use
+ * the HostResidueBackend loops.
+ *
+ * The residues are stored as long, as all of DoubleCRT and the NTTs of
+ * Cmodulus expect, so the loads and stores, and the memory of a DoubleCRT,
+ * are the same as with the 64-bit kernels.
+ */
+class NarrowResidueBackend : public HostResidueBackend
+{
+public:
+  //! The primes that the narrow kernels are used for are below 2^maxBits
+  static constexpr long maxBits = 31;
+
+  void apply(ResidueOp op,
+             long* const* result,
+             const long* const* a,
+             const long* const* b,
+             const long* q,
+             long rows,
+             long n) const override;
+
+  void applyScalar(ResidueOp op,
+                   long* const* result,
+                   const long* const* a,
+                   const long* s,
+                   const long* q,
+                   long rows,
+                   long n) const override;
+
+  void innerProduct(long* const* result,
+                    const long* const* const* a,
+                    const long* const* const* b,
+                    long terms,
+                    const long* q,
+                    long rows,
+                    long n) const override;
+};
+
+} // namespace helib
+
+#endif // ifndef HELIB_RESIDUEBACKEND_H
@@ -0,0 +1,145 @@
+/* Copyright (C) 2021 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef HELIB_ROTATIONPLANNER_H
+#define HELIB_ROTATIONPLANNER_H
+/**
+ * @file rotationPlanner.h
+ * @brief Rotations of the slots as sums of masked automorphisms
+ *
+ * EncryptedArray::rotate moves the slots one dimension at a time, with two
+ * automorphisms and a masking for every dimension but the last. A rotation
+ * by amt can also be written as
+ *   sum_t masks[t] * sigma_{ks[t]}(ctxt),
+ * with one term for every set of dimensions into which the coordinates of
+ * the slots carry. All the automorphisms then apply to the same ciphertext,
+ * so they are hoisted, and the masking costs a single multiplication by a
+ * constant. The planner counts the key switches of both ways with the
+ * key-switching matrices of the actual key, and takes the cheaper one.
+ **/
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <helib/EncryptedArray.h>
+
+namespace helib {
+
+/**
+ * @struct RotationPlan
+ * @brief A rotation (or shift, with zero fill) by amount as the sum of
+ * masks[t] * sigma_{automorphisms[t]}(ctxt). With a single term that covers
+ * all the slots, masks is empty.
+ **/
+struct RotationPlan
+{
+  long amount;
+  bool zeroFill;
+  std::vector<long> automorphisms;
+  std::vector<zzX> masks;
+  std::vector<double> sizes; // of the masks, as for Ctxt::multByConstant
+};
+
+/**
+ * @class RotationPlanner
+ * @brief The rotation plans of an EncryptedArray, built on first use and
+ * kept for all the ciphertexts. Get the planner of an EncryptedArray with
+ * EncryptedArray::getRotationPlanner. Only BGV arrays are planned, CKKS ones
+ * always use EncryptedArray::rotate.
+ **/
+class RotationPlanner
+{
+public:
+  explicit RotationPlanner(const EncryptedArray& ea) : ea(ea) {}
+
+  RotationPlanner(const RotationPlanner&) = delete;
+  RotationPlanner& operator=(const RotationPlanner&) = delete;
+
+  //! @brief The plan of a rotation by amount, or of a shift if zeroFill is
+  //! set. Thread safe.
+  const RotationPlan& plan(long amount, bool zeroFill = false) const;
+
+  //! @brief The key switches of a plan, with the matrices of key keyID, or
+  //! -1 if some automorphism is not reachable
+  long plannedKeySwitches(const RotationPlan& plan,
+                          const PubKey& key,
+                          long keyID = 0) const;
+
+  //! @brief The key switches of EncryptedArray::rotate (or shift) by the
+  //! amount of a plan, with the matrices of key keyID, or -1 if some
+  //! automorphism is not reachable
+  long sequentialKeySwitches(const RotationPlan& plan,
+                             const PubKey& key,
+                             long keyID = 0) const;
+
+  //! @brief Rotate ctxt by amount like EncryptedArray::rotate, with the plan
+  //! when it needs no more key switches
+  void rotate(Ctxt& ctxt, long amount) const;
+
+  //! @brief Shift ctxt by amount, with zero fill, like EncryptedArray::shift
+  void shift(Ctxt& ctxt, long amount) const;
+
+  //! @brief The rotations of ctxt by amounts. The automorphisms of all the
+  //! planned ones are hoisted together, so ctxt is broken into digits only
+  //! once, and they are computed in parallel.
+  std::vector<Ctxt> rotations(const Ctxt& ctxt,
+                              const std::vector<long>& amounts) const;
+
+  //! @brief For every group of amounts in [1, sizeOfDimension(i)), the sum
+  //! of the rotations of ctxt along dimension i by them, like
+  //! EncryptedArray::rotate1D (or shift1D, if zeroFill is set). The
+  //! automorphisms of all the groups are hoisted together. In a non-native
+  //! dimension, the parts that wrap around share a single key switch by
+  //! sigma_{g_i^{-ord}} per group. An empty group sums to zero.
+  std::vector<Ctxt> rotationSums1D(const Ctxt& ctxt,
+                                   long i,
+                                   const std::vector<std::vector<long>>& groups,
+                                   bool zeroFill = false) const;
+
+  //! @brief Whether rotationSums1D of ctxt by amounts only uses
+  //! key-switching matrices that the key of ctxt has, so that no
+  //! automorphism takes several key switches. Always false for CKKS.
+  bool canHoist1D(const Ctxt& ctxt,
+                  long i,
+                  const std::vector<long>& amounts,
+                  bool zeroFill = false) const;
+
+private:
+  // The masks of a rotation by amt along a dimension: mask selects the
+  // slots that do not wrap around. In a non-native dimension, wrap is
+  // sigma_{g_i^{ord}} of the complement of mask, so that
+  // (1 - mask) * sigma_{g_i^{-ord}}(x) = sigma_{g_i^{-ord}}(wrap * x).
+  struct Masks1D
+  {
+    zzX mask;
+    double size;
+    zzX wrap;
+    double wrapSize;
+  };
+  const EncryptedArray& ea;
+
+  mutable std::mutex mutex;
+  mutable std::map<std::pair<long, bool>, std::unique_ptr<RotationPlan>> plans;
+  mutable std::map<std::pair<long, long>, std::unique_ptr<Masks1D>> masks1D;
+
+  RotationPlan* buildPlan(long amount, bool zeroFill) const;
+  bool usePlan(const RotationPlan& plan, const Ctxt& ctxt) const;
+  void apply(Ctxt& ctxt, const RotationPlan& plan) const;
+  const Masks1D& getMasks1D(long i, long amt) const;
+  Masks1D* buildMasks1D(long i, long amt) const;
+};
+
+} // namespace helib
+
+#endif // ifndef HELIB_ROTATIONPLANNER_H
@@ -67,6 +67,21 @@ NTL::xdouble sampleGaussianBounded(NTL::ZZX& poly,
                                    const Context& context,
                                    NTL::xdouble stdev);
 
+//! @brief Batch versions of the bounded samplers, which fill every entry of
+//! polys in parallel and return their bounds. Each entry is sampled from a
+//! PRG stream of its own, seeded from the current one, so the results do not
+//! depend on the number of threads.
+///@{
+std::vector<double> sampleSmallBounded(std::vector<zzX>& polys,
+                                       const Context& context);
+std::vector<double> sampleHWtBounded(std::vector<zzX>& polys,
+                                     const Context& context,
+                                     long Hwt = 100);
+std::vector<double> sampleGaussianBounded(std::vector<zzX>& polys,
+                                          const Context& context,
+                                          double stdev);
+///@}
+
 // Return value times stdev is the bound used in sampleGaussianBounded
 double sampleGaussianBoundedEffectiveBound(const Context& context);
 
@@ -0,0 +1,137 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef HELIB_SLOTPACKING_H
+#define HELIB_SLOTPACKING_H
+/**
+ * @file slotPacking.h
+ * @brief Thin bootstrapping of ciphertexts that use only some of their slots
+ *
+ * Thin bootstrapping costs the same however many slots carry data. When the
+ * ciphertexts of a batch use few slots each, they are first packed into
+ * fewer ciphertexts: every ciphertext is masked to its used slots and
+ * rotated (EncryptedArray::rotate) to slots that no other ciphertext of the
+ * same packed one uses. The packed ciphertexts are bootstrapped together
+ * with PubKey::thinReCrypt, then every ciphertext is rotated back and
+ * masked out of its packed one.
+ *
+ * A ciphertext that joins a packed one costs at most two rotations and two
+ * products with a mask, and saves a whole bootstrapping, so the plan puts
+ * as many ciphertexts as possible together: first fit, largest first,
+ * trying the rotations in increasing order from 0 (which needs none).
+ *
+ * CoalescedRequests does the same for any slot-wise circuit: independent
+ * small requests (e.g. of different tenants) share the lanes of a few
+ * ciphertexts, the circuit runs once on these, and the result of every
+ * request is split back out.
+ */
+
+#include <vector>
+
+#include <NTL/ZZX.h>
+
+#include <helib/Ctxt.h>
+#include <helib/PtrVector.h>
+
+namespace helib {
+
+class EncryptedArray;
+class PubKey;
+
+//! @brief How the used slots of a batch of ciphertexts are packed
+struct SlotPackingPlan
+{
+  //! A ciphertext of the batch inside a packed one: its slot j is at
+  //! slot j + shift (mod the number of slots), as with rotate(ctxt, shift)
+  struct Piece
+  {
+    long source; //!< index of the ciphertext in the batch
+    long shift;
+  };
+
+  //! The pieces of every packed ciphertext, in the order they were placed.
+  //! A packed ciphertext of a single piece is the ciphertext itself.
+  std::vector<std::vector<Piece>> packed;
+};
+
+//! @brief Plan the packing of a batch of ciphertexts whose used slots are
+//! occupancy[i] (indices of the slots of ea, in any order)
+//! @throws InvalidArgument if a slot index is out of range
+SlotPackingPlan planSlotPacking(
+    const EncryptedArray& ea,
+    const std::vector<std::vector<long>>& occupancy);
+
+//! @class CoalescedRequests
+//! @brief Independent small requests coalesced into disjoint slot lanes of
+//! shared ciphertexts, with planSlotPacking. Run a common circuit on
+//! getShared() once instead of once per request, then extract() the result
+//! of every request. The circuit must be slot-wise (no rotations or other
+//! moves between slots), otherwise the lanes of the requests mix.
+class CoalescedRequests
+{
+public:
+  //! @brief Pack the requests, whose used slots are occupancy[i]. A request
+  //! that shares a ciphertext with others is masked to its used slots, which
+  //! takes the capacity of a product with a constant, and moved to its lane.
+  //! @throws InvalidArgument if occupancy does not match requests, or if a
+  //! slot index is out of range
+  CoalescedRequests(const EncryptedArray& ea,
+                    const PtrVector<Ctxt>& requests,
+                    const std::vector<std::vector<long>>& occupancy);
+
+  //! The number of requests
+  long size() const { return where.size(); }
+
+  const SlotPackingPlan& getPlan() const { return plan; }
+
+  //! The shared ciphertexts, the common circuit runs on them in place
+  std::vector<Ctxt>& getShared() { return shared; }
+  const std::vector<Ctxt>& getShared() const { return shared; }
+
+  //! @brief The result of request i: its lane moved back to its own slots.
+  //! Its unused slots are zero if it shares a ciphertext, a request alone
+  //! in its ciphertext gets that whole ciphertext. With replicateSlot >= 0,
+  //! out instead holds slot replicateSlot of the request in every slot
+  //! (see replicate()), e.g. for a request whose answer is a single value.
+  void extract(Ctxt& out, long i, long replicateSlot = -1) const;
+
+  //! @brief extract() every request, into out[i], in parallel
+  void extractAll(const PtrVector<Ctxt>& out) const;
+
+private:
+  struct Lane
+  {
+    long packed; // index of the shared ciphertext
+    long shift;
+  };
+
+  const EncryptedArray& ea;
+  SlotPackingPlan plan;
+  std::vector<std::vector<long>> occupancy;
+  std::vector<Lane> where; // of every request
+  std::vector<NTL::ZZX> masks; // of the requests that share a ciphertext
+  std::vector<Ctxt> shared;
+};
+
+//! @brief Thin-bootstrap the ciphertexts, whose slots outside occupancy[i]
+//! are not used, as CoalescedRequests on context.getEA(). The
+//! ciphertexts that are packed with others need the capacity of a product
+//! with a constant, and their unused slots are zero afterwards.
+//! @throws InvalidArgument if occupancy does not match ctxts
+void thinReCryptPacked(const PubKey& publicKey,
+                       const PtrVector<Ctxt>& ctxts,
+                       const std::vector<std::vector<long>>& occupancy,
+                       bool our_version = false,
+                       bool lazy = false);
+
+} // namespace helib
+
+#endif // ifndef HELIB_SLOTPACKING_H
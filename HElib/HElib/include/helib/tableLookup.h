@@ -16,8 +16,10 @@
  * @brief Code for homomorphic table lookup and fixed-point functions
  **/
 #include <functional>
+#include <map>
 #include <helib/EncryptedArray.h>
 #include <helib/CtPtrs.h>
+#include <helib/multicore.h>
 
 namespace helib {
 
@@ -30,14 +32,104 @@ void computeAllProducts(CtPtrs& products,
                         const CtPtrs& array,
                         std::vector<zzX>* unpackSlotEncoding = nullptr);
 
+//! @class LookupTable
+//! @brief A plaintext table for tableLookup that keeps its entries encoded as
+//! DoubleCRTs, per prime set, so that repeated lookups do not encode them
+//! again. The encodings are never released and a table of 2^n entries takes
+//! about as much memory as 2^n ciphertext parts for each prime set, so this
+//! is for tables that are looked up many times at the same levels.
+//! Thread-safe.
+class LookupTable
+{
+public:
+  explicit LookupTable(const std::vector<zzX>& entries) : entries(entries) {}
+
+  const std::vector<zzX>& getEntries() const { return entries; }
+  long size() const { return entries.size(); }
+
+  //! @brief The entries encoded over primes, computed on first use
+  const std::vector<DoubleCRT>& getEncoding(const Context& context,
+                                            const IndexSet& primes) const;
+
+  //! @brief embeddingLargestCoeff() of every entry, computed on first use
+  const std::vector<double>& getSizes(const Context& context) const;
+
+private:
+  std::vector<zzX> entries;
+  mutable HELIB_SHARED_MUTEX_TYPE mx;
+  mutable std::map<IndexSet, std::vector<DoubleCRT>> encodings;
+  mutable std::vector<double> sizes;
+};
+
+//! @class IndexProducts
+//! @brief The products of the bits of an encrypted index that tableLookup
+//! takes, computed once to look several tables up at the same index: the
+//! 2^{n/2} products of the low half of the n bits, and those of the high half.
+class IndexProducts
+{
+public:
+  //! @brief The products of the bits of idx that index a table of tableSize
+  //! entries. idx is bootstrapped first if it lacks the levels, as in
+  //! computeAllProducts.
+  IndexProducts(const CtPtrs& idx,
+                long tableSize,
+                std::vector<zzX>* unpackSlotEncoding = nullptr);
+
+  //! The number of index bits in the products
+  long bitCount() const { return nBits; }
+
+  //! The number of low bits, those of the lowProducts()
+  long lowBitCount() const { return nLow; }
+
+  //! @brief Whether the products index a table of tableSize entries, that is
+  //! the table takes as many bits of the index
+  bool fits(long tableSize) const;
+
+  const std::vector<Ctxt>& lowProducts() const { return low; }
+  const std::vector<Ctxt>& highProducts() const { return high; }
+
+private:
+  long idxBits; // the size of the index
+  long nBits;
+  long nLow;
+  std::vector<Ctxt> low, high;
+};
+
 //! The input is a plaintext table T[] and an array of encrypted bits
 //! I[], holding the binary representation of an index i into T.
 //! The output is the encrypted value T[i].
+//! The products of the index bits are not all computed: with the index split
+//! into its low and high halves, T[i] is the sum over the high products of
+//! high[h] * (sum_j T[h*k+j] * low[j]), so only about 2*2^{n/2} products and
+//! partial sums are ever live.
 void tableLookup(Ctxt& out,
                  const std::vector<zzX>& table,
                  const CtPtrs& idx,
                  std::vector<zzX>* unpackSlotEncoding = nullptr);
 
+//! As above, with the entries encoded once and for all by table
+void tableLookup(Ctxt& out,
+                 const LookupTable& table,
+                 const CtPtrs& idx,
+                 std::vector<zzX>* unpackSlotEncoding = nullptr);
+
+//! @brief As above, with the products of the index computed beforehand
+//! @throws InvalidArgument if the products do not fit the size of table
+void tableLookup(Ctxt& out,
+                 const std::vector<zzX>& table,
+                 const IndexProducts& products);
+void tableLookup(Ctxt& out,
+                 const LookupTable& table,
+                 const IndexProducts& products);
+
+//! @brief out[t] = tables[t][i] for the index i in idx, as tableLookup does
+//! it, with one IndexProducts for all the tables that take as many bits of
+//! idx, and the lookups evaluated in parallel. out is resized to match.
+void tableLookups(CtPtrs& out,
+                  const std::vector<std::vector<zzX>>& tables,
+                  const CtPtrs& idx,
+                  std::vector<zzX>* unpackSlotEncoding = nullptr);
+
 //! The input is an encrypted table T[] and an array of encrypted bits
 //! I[], holding the binary representation of an index i into T.
 //! This function increments by one the entry T[i].
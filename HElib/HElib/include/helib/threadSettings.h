@@ -0,0 +1,69 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef HELIB_THREADSETTINGS_H
+#define HELIB_THREADSETTINGS_H
+/**
+ * @file threadSettings.h
+ * @brief The settings that the workers of a parallel region inherit
+ *
+ * The dry-run flag and the automorphism recorders of FHEglobals, and the
+ * test switches fhe_force_chen_han, fhe_test_force_bsgs and
+ * fhe_test_force_hoist, are thread-local: threads bootstrapping independent
+ * ciphertexts, possibly of different Contexts, do not see each other's
+ * settings. So is the ExecutionPolicy of the parallel loops. HELIB_EXEC_RANGE and HELIB_EXEC_INDEX make their workers adopt
+ * the settings of the calling thread.
+ */
+
+#include <set>
+
+#include <helib/multicore.h>
+
+namespace helib {
+
+//! @brief A copy of the thread-local settings of a thread
+struct ThreadSettings
+{
+  bool dryRun = false;
+  std::set<long>* automorphVals = nullptr;
+  std::set<long>* automorphVals2 = nullptr;
+  long forceChenHan = 0;
+  int forceBsgs = 0;
+  int forceHoist = 0;
+  ExecutionPolicy execution;
+
+  //! The settings of the calling thread
+  static ThreadSettings current();
+
+  class Adopt;
+
+private:
+  void install() const;
+};
+
+//! @brief Make settings those of the calling thread for the lifetime of
+//! this object, e.g. in a worker thread
+class ThreadSettings::Adopt
+{
+public:
+  explicit Adopt(const ThreadSettings& settings);
+  ~Adopt();
+  Adopt(const Adopt&) = delete;
+  Adopt& operator=(const Adopt&) = delete;
+
+private:
+  ThreadSettings previous;
+  ExecutionPolicy::Scope executionScope;
+};
+
+} // namespace helib
+
+#endif // ifndef HELIB_THREADSETTINGS_H
@@ -27,16 +27,28 @@
  * built-in macro \_\_func\_\_). We can also use the "lower level" methods
  * startFHEtimer(name), stopFHEtimer(name), and resetFHEtimer(name) to add
  * timers with arbitrary names (not necessarily associated with functions).
+ *
+ * Every thread also keeps a tree of the timers it runs: a timer started
+ * while another one is running on the same thread is a child of it, so the
+ * time of keySwitchDigits under customPolyEval is kept apart from the time
+ * of keySwitchDigits elsewhere. The trees of all threads are merged on
+ * demand by getTimerTree() and printed by printTimerTree(). Between
+ * startTimerTrace() and stopTimerTrace(), every timed call is also recorded
+ * with its thread, and writeTimerTrace() exports the calls in the Chrome
+ * trace format that chrome://tracing and Perfetto load.
  **/
 #ifndef HELIB_TIMING_H
 #define HELIB_TIMING_H
 
+#include <vector>
+
 #include <helib/NumbTh.h>
 #include <helib/multicore.h>
 
 namespace helib {
 
 class FHEtimer;
+struct TimerNode;
 void registerTimer(FHEtimer* timer);
 unsigned long GetTimerClock();
 
@@ -77,6 +89,37 @@ void printAllTimers(std::ostream& str = std::cerr);
 // return true if timer was found, false otherwise
 bool printNamedTimer(std::ostream& str, const char* name);
 
+//! @brief The time spent in a timer when started under the timers of its
+//! ancestors
+struct TimerTreeNode
+{
+  const FHEtimer* timer = nullptr; // nullptr at the root
+  double time = 0;                 // seconds
+  long numCalls = 0;
+  std::vector<TimerTreeNode> children;
+};
+
+//! Timer tree of the calling thread
+TimerTreeNode getThreadTimerTree();
+
+//! Timer trees of all threads, including finished ones, merged by path
+TimerTreeNode getTimerTree();
+
+//! @brief Print the merged timer tree to stream, the children of a node by
+//! decreasing time
+void printTimerTree(std::ostream& str = std::cerr);
+
+//! @brief Record every timed call from now on, for writeTimerTrace().
+//! Records made before are dropped.
+void startTimerTrace();
+
+//! Stop recording timed calls, the records are kept
+void stopTimerTrace();
+
+//! @brief Write the recorded calls to stream as a Chrome trace (JSON), one
+//! track per thread
+void writeTimerTrace(std::ostream& str);
+
 //! \cond FALSE (make doxygen ignore these classes)
 class auto_timer
 {
@@ -85,23 +128,22 @@ public:
   unsigned long amt;
   bool running;
 
-  auto_timer(FHEtimer* _timer) :
-      timer(_timer), amt(GetTimerClock()), running(true)
-  {}
+  // The enclosing timer of the thread and our node of the thread tree
+  auto_timer* parent;
+  TimerNode* node;
 
-  void stop()
-  {
-    amt = GetTimerClock() - amt;
-    timer->counter += amt;
-    timer->numCalls++;
-    running = false;
-  }
+  auto_timer(FHEtimer* _timer) : timer(_timer), running(true) { start(); }
+
+  void stop();
 
   ~auto_timer()
   {
     if (running)
       stop();
   }
+
+private:
+  void start();
 };
 //! \endcond
 
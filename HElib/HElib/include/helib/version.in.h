@@ -71,6 +71,12 @@ struct version
    **/
   static const char* libString();
 
+  /**
+   * @brief Whether the compiled library uses Intel HEXL for its NTTs and
+   * residue arithmetic (`USE_INTEL_HEXL`).
+   **/
+  static bool usesHexl();
+
 }; // struct version
 
 } // namespace helib
@@ -27,11 +27,10 @@ typedef NTL::Vec<long> zzX;
 inline bool IsZero(const zzX& a) { return a.length() == 0; }
 inline void clear(zzX& a) { a.SetLength(0); }
 
-inline void convert(NTL::zz_pX& x, const zzX& a)
-{
-  NTL::conv(x.rep, a);
-  x.normalize();
-}
+//! @brief x = a mod the current zz_p modulus, reusing the storage of x.
+//! Coefficients of absolute value below the modulus (the usual case) are
+//! reduced without divisions, in a loop that the compiler vectorizes.
+void convert(NTL::zz_pX& x, const zzX& a);
 
 void add(zzX& res, const zzX& a, const zzX& b);
 inline zzX operator+(const zzX& a, const zzX& b)
@@ -75,6 +74,11 @@ inline zzX& operator*=(zzX& a, long b)
 void normalize(zzX& f);
 
 const NTL::zz_pXModulus& getPhimXMod(const PAlgebra& palg);
+
+//! @brief poly = poly mod Phi_m(X), in place. Nothing is computed for a
+//! poly of degree below phi(m) but its normalization, and for m a power of
+//! two the reduction mod X^{phi(m)}+1 is a negacyclic fold of the
+//! coefficients. Other reductions go through a 60-bit FFT prime.
 void reduceModPhimX(zzX& poly, const PAlgebra& palg);
 
 void MulMod(zzX& res, const zzX& a, const zzX& b, const PAlgebra& palg);
@@ -59,6 +59,9 @@ int main(int argc, char **argv)
   bool packed=true;
   amap.arg("packed", packed, "use packed bootstrapping");
 
+  bool thin=false;
+  amap.arg("thin", thin, "use thin bootstrapping between rounds (encryption)");
+
   amap.parse(argc, argv);
   if (idx>5) idx = 5;
 
@@ -98,6 +101,7 @@ int main(int argc, char **argv)
        << ", B=" << B
        << ", boot=" << boot
        << ", packed=" << packed
+       << ", thin=" << thin
        << ", m=" << m
        << " (=" << mvec << "), gens="<<gens<<", ords="<<ords
        << endl;
@@ -174,7 +178,7 @@ int main(int argc, char **argv)
   long blocksPerCtxt = ea2.size() / 16;
 
   long nBlocks;
-  if (boot && packed)
+  if (boot && (packed || thin))
     nBlocks = blocksPerCtxt * e;
   else
     nBlocks = blocksPerCtxt;
@@ -201,7 +205,8 @@ int main(int argc, char **argv)
   cout << "AES encryption "<< std::flush;
   vector< Ctxt > doublyEncrypted;
   tm = -GetTime();
-  hAES.homAESenc(doublyEncrypted, encryptedAESkey, ptxt);
+  hAES.homAESenc(doublyEncrypted, encryptedAESkey, ptxt,
+                 thin? HomAES::THIN_PER_ROUND : HomAES::PER_STAGE);
   tm += GetTime();
 
   // Check that AES succeeeded
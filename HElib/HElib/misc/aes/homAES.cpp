@@ -82,6 +82,12 @@ static void decRowShift(Ctxt& c, const vector<PolyType>& decLinTran,
 
 static void invert(vector<Ctxt>& data); // Z -> Z^{-1} in GF(2^8)
 
+// The maps from Z in GF(2^8) to the coefficients of X^j in Z, and the
+// constants X^j to put the coefficients back together
+static void buildBitMaps(vector< vector<PolyType> >& bitExtract,
+			 vector<PolyType>& bitWeights,
+			 const EncryptedArrayDerived<PA_GF2>& ea2);
+
 // Pack the ciphertexts in c in as few "fully packed" cipehrtext as possible.
 static void packCtxt(vector<Ctxt>& to, const vector<Ctxt>& from,
 		     const GF2X& XinSlots);
@@ -114,8 +120,10 @@ HomAES::HomAES(const Context& context): ea2(context,aesPoly,context.alMod)
   buildLinEnc(encLinTran, ea2);
   buildLinDec(decLinTran, ea2);
 
-  if (context.isBootstrappable())
+  if (context.isBootstrappable()) {
     setPackingConstants();
+    buildBitMaps(bitExtract, bitWeights, ea2);
+  }
 }
 
 // run the AES key-expansion and then encrypt the expanded key.
@@ -207,25 +215,41 @@ void HomAES::setPackingConstants()
 // expanded AES key, the number of AES rounds is aesKey.size() -1.
 // It is assumed that all the input data cipehrtexts are at the same
 // level, as they will be recrypted together.
-void HomAES::homAESenc(vector<Ctxt>& eData, const vector<Ctxt>& aesKey) const
+//
+// With mode=THIN_PER_ROUND the refreshing is amortized over the rounds and
+// over all the blocks: the data is only recrypted at the start of a round
+// whose cost exceeds the capacity left, and then the bits of all of it are
+// recrypted together with thin bootstrapping. The cost of a round is taken
+// as eight levels (four for the inversion, two each for the affine map and
+// RowShift/ColMix) until a round measures it.
+void HomAES::homAESenc(vector<Ctxt>& eData, const vector<Ctxt>& aesKey,
+		       RefreshMode mode) const
 {
   if (1>(long)eData.size() || 1>(long)aesKey.size()) return; // no data/key
   //  long lvlBits = eData[0].getContext().bitsPerLevel;
+  bool perStage = (mode == PER_STAGE);
+  double roundCost = 8 * eData[0].getContext().BPL();
 
   for (long j=0; j<(long)eData.size(); j++)
     eData[j] += aesKey[0];  // initial key addition
 
   for (long i=1; i<(long)aesKey.size(); i++) { // apply the AES rounds
+    if (!perStage && eData[0].capacity() < roundCost) {
+      thinBatchRecrypt(eData);
+      helib::assertTrue<helib::LogicError>(eData[0].capacity() >= roundCost,
+                              "Not enough capacity for an AES round after recryption");
+    }
+    double capacityBefore = eData[0].capacity();
 
     // ByteSub
-    if (eData[0].findBaseLevel() < 4) batchRecrypt(eData);
+    if (perStage && eData[0].findBaseLevel() < 4) batchRecrypt(eData);
     invert(eData);     // apply Z -> Z^{-1} to all elements of eData
 #ifdef DEBUG_PRINTOUT
     CheckCtxt(eData[0], "+ After invert");
     //    cerr << " + After invert ";
     //    decryptAndPrint(cerr, eData[0], *dbgKey, *dbgEa);
 #endif
-    if (eData[0].findBaseLevel() < 2) batchRecrypt(eData);
+    if (perStage && eData[0].findBaseLevel() < 2) batchRecrypt(eData);
     for (long j=0; j<(long)eData.size(); j++) { // GF2 affine transformation
       applyLinPolyLL(eData[j], encAffMat, ea2.getDegree());
       eData[j].addConstant(affVec);
@@ -237,7 +261,7 @@ void HomAES::homAESenc(vector<Ctxt>& eData, const vector<Ctxt>& aesKey) const
 #endif
 
     // Apply RowShift/ColMix to each ciphertext
-    if (eData[0].findBaseLevel() < 2) batchRecrypt(eData);
+    if (perStage && eData[0].findBaseLevel() < 2) batchRecrypt(eData);
     if (i<(long)aesKey.size()-1) {
       for (long j=0; j<(long)eData.size(); j++)
 	encRowColTran(eData[j], encLinTran, ea2);
@@ -254,6 +278,11 @@ void HomAES::homAESenc(vector<Ctxt>& eData, const vector<Ctxt>& aesKey) const
 
     // Key addition
     for (long j=0; j<(long)eData.size(); j++) eData[j] += aesKey[i];
+
+    if (!perStage) { // the costliest round measured so far
+      double cost = capacityBefore - eData[0].capacity();
+      roundCost = (i==1)? cost : max(roundCost, cost);
+    }
   }
 }
 
@@ -264,7 +293,7 @@ void HomAES::homAESenc(vector<Ctxt>& eData, const vector<Ctxt>& aesKey) const
 // AES rounds is aesKey.size() -1.
 // NOTE: This is a rather useless method, other than for benchmarking
 void HomAES::homAESenc(vector<Ctxt>& eData, const vector<Ctxt>& aesKey,
-		       const Vec<uint8_t> inBytes) const
+		       const Vec<uint8_t> inBytes, RefreshMode mode) const
 {
   {Vec<ZZX> encodedBytes;
   encode4AES(encodedBytes, inBytes, ea2); // encode as HE plaintext
@@ -274,7 +303,7 @@ void HomAES::homAESenc(vector<Ctxt>& eData, const vector<Ctxt>& aesKey,
   for (long i=0; i<(long)eData.size(); i++)   // encode ptxt as HE ctxt
     eData[i].DummyEncrypt(encodedBytes[i]);}
 
-  homAESenc(eData, aesKey); // do the real work
+  homAESenc(eData, aesKey, mode); // do the real work
 }
 
 
@@ -413,6 +442,38 @@ void HomAES::batchRecrypt(vector<Ctxt>& data) const
 
 
 
+// Recrypt all of data with thin bootstrapping: the eight bits of the bytes
+// are constants in the slots, so each byte is split into its bits, the bits
+// of all the ciphertexts are recrypted in one batch and then put back together
+void HomAES::thinBatchRecrypt(vector<Ctxt>& data) const
+{
+  FHE_TIMER_START;
+  const PubKey& pk = data[0].getPubKey();
+  if (!pk.isBootstrappable()) return;
+
+  vector<Ctxt> bits(8*data.size(), Ctxt(ZeroCtxtLike, data[0]));
+  for (long i=0; i<(long)data.size(); i++) {
+    data[i].cleanUp();
+    for (long j=0; j<8; j++) { // the coefficient of X^j
+      bits[8*i +j] = data[i];
+      applyLinPolyLL(bits[8*i +j], bitExtract[j], ea2.getDegree());
+    }
+  }
+
+  FHE_NTIMER_START(recryption);
+  pk.thinReCrypt(bits);
+  FHE_NTIMER_STOP(recryption);
+
+  for (long i=0; i<(long)data.size(); i++) { // data[i] = sum_j bit_j * X^j
+    data[i] = bits[8*i];
+    for (long j=1; j<8; j++) {
+      bits[8*i +j].multByConstant(bitWeights[j]);
+      data[i] += bits[8*i +j];
+    }
+  }
+}
+
+
 // Buils a GF2-affine transformation from the constants in cc
 static void buildAffine(vector<PolyType>& binMat, PolyType* binVec,
 			const unsigned char cc[],
@@ -460,6 +521,30 @@ static void buildAffine(vector<PolyType>& binMat, PolyType* binVec,
 }
 
 
+// The maps from Z in GF(2^8) to the coefficients of X^j in Z, and the
+// constants X^j to put the coefficients back together
+static void buildBitMaps(vector< vector<PolyType> >& bitExtract,
+			 vector<PolyType>& bitWeights,
+			 const EncryptedArrayDerived<PA_GF2>& ea2)
+{
+  bitExtract.resize(8);
+#ifdef USE_ZZX_POLY
+  bitWeights.resize(8);
+#else
+  bitWeights.resize(8,DoubleCRT(ea2.getContext()));
+#endif
+  for (long j=0; j<8; j++) {
+    // The j'th coefficient maps X^j to 1 and the other X^i to 0
+    unsigned char cc[9] = { 0 };
+    cc[j] = 1;
+    buildAffine(bitExtract[j], nullptr, cc, ea2);
+
+    vector<GF2X> slots(ea2.size(), GF2X(j,1)); // X^j in all the slots
+    ZZX tmp; ea2.encode(tmp, slots);
+    bitWeights[j] = tmp;
+  }
+}
+
 // Compute the constants for the shoftRow/mixCol transformations
 static void buildLinEnc(vector<PolyType>& encLinTran,
 			const EncryptedArrayDerived<PA_GF2>& ea2)
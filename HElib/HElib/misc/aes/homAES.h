@@ -27,11 +27,24 @@ class HomAES {
   GF2X XinSlots; // "Fully packed" poly with X in all the slots, for packing
   Mat<GF2X> unpacking; // constants for unpacking after recryption
 
+  vector< vector<PolyType> > bitExtract; // Z -> the coefficient of X^j in Z
+  vector<PolyType> bitWeights;           // X^j in all the slots
+
   void batchRecrypt(vector<Ctxt>& data) const; // recryption during AES computation
+  void thinBatchRecrypt(vector<Ctxt>& data) const; // same, with thin recryption
 
 public:
   static const GF2X aesPoly;  // The AES polynomial: X^8+X^4+X^3+X+1
 
+  //! How homAESenc refreshes the data ciphertexts
+  enum RefreshMode {
+    //! Packed recryption before any step that is short of levels
+    PER_STAGE,
+    //! Thin recryption of the bits of all the data, only between rounds and
+    //! only when the capacity left would not cover the next round
+    THIN_PER_ROUND
+  };
+
   //! Constructor. If context is bootstrappable then also
   //! the packing/unpacking constants are computed.
   explicit HomAES(const Context& context);
@@ -46,12 +59,13 @@ public:
   //! Perform AES encryption/decryption on "raw bytes" (ECB mode)
   //! The input bytes are either plaintext or AES-encrypted ciphertext
   void homAESenc(vector<Ctxt>& eData, const vector<Ctxt>& eKey,
-		 const Vec<uint8_t> inBytes) const;
+		 const Vec<uint8_t> inBytes, RefreshMode mode=PER_STAGE) const;
   void homAESdec(vector<Ctxt>& eData, const vector<Ctxt>& eKey,
 		 const Vec<uint8_t> inBytes) const;
 
   //! In-place AES encryption/decryption on HE encrypted bytes (ECB mode)
-  void homAESenc(vector<Ctxt>& eData, const vector<Ctxt>& eKey) const;
+  void homAESenc(vector<Ctxt>& eData, const vector<Ctxt>& eKey,
+		 RefreshMode mode=PER_STAGE) const;
   void homAESdec(vector<Ctxt>& eData, const vector<Ctxt>& eKey) const;
 
   // utility functions
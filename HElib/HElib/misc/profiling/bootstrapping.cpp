@@ -0,0 +1,267 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+// This program bootstraps a ciphertext n times, with thin and/or fat
+// bootstrapping and with the built-in and/or our_version digit extraction,
+// and reports where the time, the operations and the memory went: the tree
+// of the timers, the operation counts, the residue memory of the stages and
+// the fhe_stats records. A Chrome trace of the timers can be written too.
+//
+// To profile only the bootstrappings with perf, create a FIFO and pass it as
+// perfctl, e.g.
+//   mkfifo /tmp/perfctl
+//   perf record --delay=-1 --control fifo:/tmp/perfctl ./bootstrapping \
+//     perfctl=/tmp/perfctl
+// Built with USE_ITT=ON, every bootstrapping is also a task of the HElib
+// domain in VTune.
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <helib/helib.h>
+#include <helib/ArgMap.h>
+#include <helib/bootstrapReport.h>
+#include <helib/fhe_stats.h>
+#include <helib/memoryStats.h>
+#include <helib/opCounters.h>
+#include <helib/timing.h>
+#include <NTL/BasicThreadPool.h>
+
+#ifdef HELIB_PROFILING_ITT
+#include <ittnotify.h>
+#endif
+
+namespace {
+
+// Marks the bootstrappings for the external profilers
+class ProfiledRegion
+{
+public:
+  ProfiledRegion(std::ofstream* perfctl, const std::string& name) :
+      perfctl(perfctl)
+  {
+    if (perfctl)
+      *perfctl << "enable" << std::endl;
+#ifdef HELIB_PROFILING_ITT
+    static __itt_domain* domain = __itt_domain_create("HElib");
+    __itt_task_begin(domain,
+                     __itt_null,
+                     __itt_null,
+                     __itt_string_handle_create(name.c_str()));
+#else
+    (void)name;
+#endif
+  }
+
+  ~ProfiledRegion()
+  {
+#ifdef HELIB_PROFILING_ITT
+    __itt_task_end(__itt_domain_create("HElib"));
+#endif
+    if (perfctl)
+      *perfctl << "disable" << std::endl;
+  }
+
+private:
+  std::ofstream* perfctl;
+};
+
+struct Params
+{
+  long m = 31 * 41;
+  long p = 2;
+  long r = 1;
+  long bits = 580;
+  long c = 2;
+  long t = 64;
+  NTL::Vec<long> mvec;
+  NTL::Vec<long> gens;
+  NTL::Vec<long> ords;
+};
+
+std::vector<long> toVector(const NTL::Vec<long>& v)
+{
+  return std::vector<long>(v.begin(), v.end());
+}
+
+void profile(const Params& params,
+             bool thick,
+             bool ourVersion,
+             long iter,
+             std::ofstream* perfctl)
+{
+  std::string name = std::string(thick ? "fat" : "thin") +
+                     (ourVersion ? "-our_version" : "-builtin");
+  std::cout << "\n=== " << name << " bootstrapping ===" << std::endl;
+
+  helib::ContextBuilder<helib::BGV> builder;
+  builder.m(params.m)
+      .p(params.p)
+      .r(params.r)
+      .bits(params.bits)
+      .c(params.c)
+      .skHwt(params.t)
+      .mvec(params.mvec)
+      .gens(toVector(params.gens))
+      .ords(toVector(params.ords))
+      .bootstrappable(true);
+  if (thick)
+    builder.thickboot();
+  helib::Context context = builder.build();
+  context.printout();
+
+  helib::SecKey secretKey(context);
+  secretKey.GenSecKey();
+  helib::addSome1DMatrices(secretKey);
+  helib::addFrbMatrices(secretKey);
+  secretKey.genRecryptData();
+  const helib::PubKey& publicKey = secretKey;
+  const helib::EncryptedArray& ea = context.getEA();
+
+  std::vector<long> ptxt(ea.size());
+  for (long& slot : ptxt)
+    slot = std::rand() % params.p;
+  helib::Ctxt fresh(publicKey);
+  ea.encrypt(fresh, publicKey, ptxt);
+
+  helib::resetAllTimers();
+  helib::OpCountScope ops;
+  helib::MemoryScope memory;
+  helib::BootstrapReport report;
+  double total = 0;
+  for (long i = 0; i < iter; i++) {
+    helib::Ctxt ctxt(fresh);
+    auto start = std::chrono::steady_clock::now();
+    {
+      ProfiledRegion region(perfctl, name);
+      if (thick)
+        publicKey.reCrypt(ctxt, ourVersion);
+      else
+        publicKey.thinReCrypt(ctxt, ourVersion, /*lazy=*/false, &report);
+    }
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    total += seconds;
+    std::cout << name << " #" << i << ": " << seconds << " s, capacity "
+              << ctxt.capacity() << std::endl;
+  }
+  memory.stop();
+
+  std::cout << "\naverage: " << total / iter << " s" << std::endl;
+  std::cout << "operations per bootstrapping:";
+  helib::OpCounts counts = ops.counts();
+  for (std::size_t i = 0; i < helib::OP_TYPES; i++)
+    std::cout << " " << helib::opName(helib::OpType(i)) << "="
+              << double(counts.counts[i]) / iter;
+  std::cout << std::endl;
+  std::cout << "residue memory: peak " << memory.peakBytes() << " bytes, "
+            << memory.allocatedBytes() << " bytes allocated" << std::endl;
+  if (!thick)
+    std::cout << "\nlast thin bootstrapping:\n" << report << std::endl;
+  std::cout << "\ntimers:" << std::endl;
+  helib::printTimerTree(std::cout);
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+  Params params;
+  params.mvec.SetLength(2);
+  params.mvec[0] = 31;
+  params.mvec[1] = 41;
+  params.gens.SetLength(2);
+  params.gens[0] = 1026;
+  params.gens[1] = 249;
+  params.ords.SetLength(2);
+  params.ords[0] = 30;
+  params.ords[1] = -2;
+
+  std::string mode = "both";
+  std::string variant = "both";
+  long iter = 3;
+  long nthreads = 1;
+  bool stats = false;
+  std::string trace;
+  std::string perfctlPath;
+
+  helib::ArgMap()
+      .optional()
+      .named()
+      .arg("m", params.m, "Cyclotomic polynomial ring")
+      .arg("p", params.p, "Plaintext prime modulus")
+      .arg("r", params.r, "Hensel lifting")
+      .arg("bits", params.bits, "# of bits in the modulus chain")
+      .arg("c", params.c, "# of columns of Key-Switching matrix")
+      .arg("t", params.t, "Hamming weight of recryption secret key")
+      .arg("mvec", params.mvec, "Factorization of m, e.g. [31 41]")
+      .arg("gens", params.gens, "Generators of (Z/mZ)^*, e.g. [1026 249]")
+      .arg("ords", params.ords, "Orders of the generators, e.g. [30 -2]")
+      .arg("mode", mode, "thin, fat or both")
+      .arg("variant", variant, "builtin, our_version or both")
+      .arg("iter", iter, "# of bootstrappings of each kind")
+      .arg("nthreads", nthreads, "Size of NTL thread pool")
+      .arg("trace", trace, "Write a Chrome trace of the timers to this file")
+      .arg("perfctl", perfctlPath, "perf control FIFO, see the header")
+      .toggle()
+      .arg("-stats", stats, "Print the fhe_stats records", nullptr)
+      .parse(argc, argv);
+
+  if (nthreads > 1)
+    NTL::SetNumThreads(nthreads);
+  helib::fhe_stats = stats;
+  iter = std::max(iter, 1L);
+
+  std::ofstream perfctlFile;
+  std::ofstream* perfctl = nullptr;
+  if (!perfctlPath.empty()) {
+    perfctlFile.open(perfctlPath);
+    if (!perfctlFile) {
+      std::cerr << "Cannot open " << perfctlPath << std::endl;
+      return 1;
+    }
+    perfctl = &perfctlFile;
+  }
+
+  if (!trace.empty())
+    helib::startTimerTrace();
+  helib::setTimersOn();
+  for (bool thick : {false, true}) {
+    if (mode != "both" && mode != (thick ? "fat" : "thin"))
+      continue;
+    for (bool ourVersion : {false, true}) {
+      if (variant != "both" &&
+          variant != (ourVersion ? "our_version" : "builtin"))
+        continue;
+      profile(params, thick, ourVersion, iter, perfctl);
+    }
+  }
+  helib::setTimersOff();
+
+  if (stats) {
+    std::cout << "\nfhe_stats:" << std::endl;
+    helib::print_stats(std::cout);
+  }
+  if (!trace.empty()) {
+    helib::stopTimerTrace();
+    std::ofstream file(trace);
+    helib::writeTimerTrace(file);
+    std::cout << "\nWrote the timer trace to " << trace << std::endl;
+  }
+
+  return 0;
+}
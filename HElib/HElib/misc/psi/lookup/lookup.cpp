@@ -9,6 +9,7 @@
  * See the License for the specific language governing permissions and
  * limitations under the License. See accompanying LICENSE file.
  */
+#include <algorithm>
 #include <iostream>
 
 #include <helib/helib.h>
@@ -34,8 +35,57 @@ struct CmdLineOpts
   bool isColumn = false;
   long nthreads = 1;
   long offset = 0;
+  long chunkRows = 0;
 };
 
+// Runs the lookups chunkRows rows of the database at a time, in bounded
+// memory: the next chunk is prefetched while the current one is processed,
+// the masks of a chunk are shared by all the queries, and its results are
+// written out before the next chunk is read.
+static void streamLookups(const CmdLineOpts& cmdLineOpts,
+                          const sharedContext& contextp,
+                          const helib::PubKey& pk,
+                          const helib::Matrix<helib::Ctxt>& queryData,
+                          const std::vector<helib::Query_t>& queries,
+                          const std::vector<std::string>& outFilePaths)
+{
+  helib::Ctxt zero_ctxt(pk);
+  Reader<helib::Ctxt> reader(cmdLineOpts.databaseFilePath, zero_ctxt);
+  const long rows = reader.getTOC().getRows();
+
+  std::vector<Writer<helib::Ctxt>> writers;
+  for (const auto& outFilePath : outFilePaths)
+    writers.emplace_back(outFilePath,
+                         rows,
+                         1,
+                         estimateCtxtSize(*contextp, cmdLineOpts.offset));
+
+  for (long firstRow = 0; firstRow < rows; firstRow += cmdLineOpts.chunkRows) {
+    long lastRow = std::min(rows, firstRow + cmdLineOpts.chunkRows);
+    prefetchDbRows(reader, lastRow, std::min(rows, lastRow + cmdLineOpts.chunkRows));
+
+    HELIB_NTIMER_START(readDatabase);
+    helib::Database<helib::Ctxt> chunk(
+        readDbRowsFromFile(reader, firstRow, lastRow, pk), contextp);
+    HELIB_NTIMER_STOP(readDatabase);
+
+    HELIB_NTIMER_START(lookupMasks);
+    auto masks = chunk.getMasks(queryData);
+    HELIB_NTIMER_STOP(lookupMasks);
+
+    for (std::size_t i = 0; i < queries.size(); ++i) {
+      HELIB_NTIMER_START(lookupQueries);
+      auto clean = [](auto& x){x.cleanUp();};
+      auto match = chunk.containsFromMasks(queries[i], masks).apply(clean);
+      HELIB_NTIMER_STOP(lookupQueries);
+
+      HELIB_NTIMER_START(writeResults);
+      writeResultRows(writers[i], match, firstRow);
+      HELIB_NTIMER_STOP(writeResults);
+    }
+  }
+}
+
 int main(int argc, char *argv[])
 {
   // PSI STUFF
@@ -60,6 +110,8 @@ int main(int argc, char *argv[])
     .optional()
     .named()
     .arg("--offset", cmdLineOpts.offset, "Offset in bytes when writing to file.")
+    .arg("--chunk", cmdLineOpts.chunkRows,
+      "Process the database this many rows at a time (0 for all at once).")
     .toggle()
     .arg("--column", cmdLineOpts.isColumn,
       "Flag to signify input is in column format.", nullptr)
@@ -71,6 +123,11 @@ int main(int argc, char *argv[])
     cmdLineOpts.nthreads = 1;
   }
 
+  if (cmdLineOpts.chunkRows < 0) {
+    std::cerr << "Chunk size must be non-negative. Setting chunk = 0." << std::endl;
+    cmdLineOpts.chunkRows = 0;
+  }
+
   NTL::SetNumThreads(cmdLineOpts.nthreads);
 
   HELIB_NTIMER_START(readKey);
@@ -81,12 +138,6 @@ int main(int argc, char *argv[])
     loadContextAndKey<helib::PubKey>(cmdLineOpts.pkFilePath);
   HELIB_NTIMER_STOP(readKey);
 
-  HELIB_NTIMER_START(readDatabase);
-  // Read in database
-  helib::Database<helib::Ctxt> database =
-    readDbFromFile(cmdLineOpts.databaseFilePath, contextp, *pkp);
-  HELIB_NTIMER_STOP(readDatabase);
-
   HELIB_NTIMER_START(readQuery);
   // Read in the query data
   helib::Matrix<helib::Ctxt> queryData = readQueryFromFile(cmdLineOpts.queryFilePath, *pkp);
@@ -102,33 +153,44 @@ int main(int argc, char *argv[])
   helib::QueryBuilder qbOr(a || b);
   helib::QueryBuilder qbExpand(a || (b && c));
 
-  helib::Query_t query = qb.build(database.columns());
-  helib::Query_t queryAnd = qbAnd.build(database.columns());
-  helib::Query_t queryOr = qbOr.build(database.columns());
-  helib::Query_t queryExpand = qbExpand.build(database.columns());
+  // The query has as many columns as the database
+  long columns = queryData.dims(1);
+  std::vector<helib::Query_t> queries = {qb.build(columns),
+                                         qbAnd.build(columns),
+                                         qbOr.build(columns),
+                                         qbExpand.build(columns)};
+  std::vector<std::string> outFilePaths = {cmdLineOpts.outFilePath,
+                                           cmdLineOpts.outFilePath+"_and",
+                                           cmdLineOpts.outFilePath+"_or",
+                                           cmdLineOpts.outFilePath+"_expand"};
   HELIB_NTIMER_STOP(buildQuery);
 
-  HELIB_NTIMER_START(lookupSame);
-  auto clean = [](auto& x){x.cleanUp();};
-  auto match = database.contains(query, queryData).apply(clean);
-  HELIB_NTIMER_STOP(lookupSame);
-  HELIB_NTIMER_START(lookupAnd);
-  auto matchAnd = database.contains(queryAnd, queryData).apply(clean);
-  HELIB_NTIMER_STOP(lookupAnd);
-  HELIB_NTIMER_START(lookupOr);
-  auto matchOr = database.contains(queryOr, queryData).apply(clean);
-  HELIB_NTIMER_STOP(lookupOr);
-  HELIB_NTIMER_START(lookupExpand);
-  auto matchExpand = database.contains(queryExpand, queryData).apply(clean);
-  HELIB_NTIMER_STOP(lookupExpand);
-
-  HELIB_NTIMER_START(writeResults);
-  // Write results to file
-  writeResultsToFile(cmdLineOpts.outFilePath, match, cmdLineOpts.offset);
-  writeResultsToFile(cmdLineOpts.outFilePath+"_and", matchAnd, cmdLineOpts.offset);
-  writeResultsToFile(cmdLineOpts.outFilePath+"_or", matchOr, cmdLineOpts.offset);
-  writeResultsToFile(cmdLineOpts.outFilePath+"_expand", matchExpand, cmdLineOpts.offset);
-  HELIB_NTIMER_STOP(writeResults);
+  if (cmdLineOpts.chunkRows > 0) {
+    streamLookups(cmdLineOpts, contextp, *pkp, queryData, queries, outFilePaths);
+  } else {
+    HELIB_NTIMER_START(readDatabase);
+    // Read in database
+    helib::Database<helib::Ctxt> database =
+      readDbFromFile(cmdLineOpts.databaseFilePath, contextp, *pkp);
+    HELIB_NTIMER_STOP(readDatabase);
+
+    // The masks are the costly part, all the queries share them
+    HELIB_NTIMER_START(lookupMasks);
+    auto masks = database.getMasks(queryData);
+    HELIB_NTIMER_STOP(lookupMasks);
+
+    for (std::size_t i = 0; i < queries.size(); ++i) {
+      HELIB_NTIMER_START(lookupQueries);
+      auto clean = [](auto& x){x.cleanUp();};
+      auto match = database.containsFromMasks(queries[i], masks).apply(clean);
+      HELIB_NTIMER_STOP(lookupQueries);
+
+      HELIB_NTIMER_START(writeResults);
+      // Write results to file
+      writeResultsToFile(outFilePaths[i], match, cmdLineOpts.offset);
+      HELIB_NTIMER_STOP(writeResults);
+    }
+  }
 
   std::ofstream timers("times.log");
   if (timers.is_open()) {
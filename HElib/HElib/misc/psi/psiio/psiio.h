@@ -60,6 +60,43 @@ inline helib::Database<helib::Ctxt> readDbFromFile(
   return helib::Database<helib::Ctxt>(data, contextp);
 }
 
+// Reads in rows [firstRow, lastRow) of an encrypted database, in parallel.
+// Every thread reads with its own copy of reader, which shares the mapping.
+inline helib::Matrix<helib::Ctxt> readDbRowsFromFile(
+                                          const Reader<helib::Ctxt>& reader,
+                                          long firstRow,
+                                          long lastRow,
+                                          const helib::PubKey& pk)
+{
+  const long cols = reader.getTOC().getCols();
+  helib::Ctxt zero_ctxt(pk);
+  helib::Matrix<helib::Ctxt> data(zero_ctxt, lastRow - firstRow, cols);
+
+  NTL_EXEC_RANGE((lastRow - firstRow) * cols, first, last)
+  Reader<helib::Ctxt> threadReader(reader);
+  for (long i = first; i < last; ++i) {
+    long row = i / cols;
+    long col = i % cols;
+    threadReader.readDatum(data(row, col), firstRow + row, col);
+  }
+  NTL_EXEC_RANGE_END
+
+  return data;
+}
+
+// Asks the kernel to read ahead rows [firstRow, lastRow) of a database, e.g.
+// the next chunk while the current one is being processed
+inline void prefetchDbRows(const Reader<helib::Ctxt>& reader,
+                           long firstRow,
+                           long lastRow)
+{
+  const long rows = reader.getTOC().getRows();
+  const long cols = reader.getTOC().getCols();
+  // The records are in column-major order
+  for (long j = 0; j < cols; ++j)
+    reader.prefetch(j * rows + firstRow, j * rows + lastRow);
+}
+
 // Reads in encrypted query from file
 inline helib::Matrix<helib::Ctxt> readQueryFromFile(
                                              const std::string& queryFilePath,
@@ -102,6 +139,22 @@ inline helib::Matrix<helib::Ctxt> readQueryFromFile(
   return query;
 }
 
+// Writes out a matrix as the rows of the file of writer from firstRow on,
+// so that the results of a chunk can be written as soon as they are ready
+inline void writeResultRows(Writer<helib::Ctxt>& writer,
+                            const helib::Matrix<helib::Ctxt>& results,
+                            long firstRow)
+{
+  NTL_EXEC_RANGE(results.dims(0) * results.dims(1), first, last)
+  Writer<helib::Ctxt> threadWriter(writer);
+  for (long i = first; i < last; ++i) {
+    long row = i / results.dims(1);
+    long col = i % results.dims(1);
+    threadWriter.writeByLocation(results(row, col), firstRow + row, col);
+  }
+  NTL_EXEC_RANGE_END
+}
+
 // Writes out a matrix to file
 inline void writeResultsToFile(const std::string& outFilePath,
                                const helib::Matrix<helib::Ctxt>& results,
@@ -113,14 +166,7 @@ inline void writeResultsToFile(const std::string& outFilePath,
                              estimateCtxtSize(results(0,0).getContext(), offset));
 
   // Write the data
-  NTL_EXEC_RANGE(results.dims(0) * results.dims(1), first, last)
-  Writer<helib::Ctxt> threadWriter(writer);
-  for (long i = first; i < last; ++i) {
-    long row = i / results.dims(1);
-    long col = i % results.dims(1);
-    threadWriter.writeByLocation(results(row, col), row, col);
-  }
-  NTL_EXEC_RANGE_END
+  writeResultRows(writer, results, 0);
 }
 
 #endif
@@ -9,6 +9,7 @@
  * See the License for the specific language governing permissions and
  * limitations under the License. See accompanying LICENSE file.
  */
+#include <algorithm>
 #include <iostream>
 
 #include <helib/helib.h>
@@ -34,8 +35,46 @@ struct CmdLineOpts
   bool isColumn = false;
   long nthreads = 1;
   long offset = 0;
+  long chunkRows = 0;
 };
 
+// Scores chunkRows rows of the database at a time, in bounded memory: the
+// next chunk is prefetched while the current one is processed, and its
+// scores are written out before the next chunk is read.
+static void streamScores(const CmdLineOpts& cmdLineOpts,
+                         const sharedContext& contextp,
+                         const helib::PubKey& pk,
+                         const helib::Matrix<helib::Ctxt>& query,
+                         const helib::Query_t& weighted_query)
+{
+  helib::Ctxt zero_ctxt(pk);
+  Reader<helib::Ctxt> reader(cmdLineOpts.databaseFilePath, zero_ctxt);
+  const long rows = reader.getTOC().getRows();
+  Writer<helib::Ctxt> writer(cmdLineOpts.outFilePath,
+                             rows,
+                             1,
+                             estimateCtxtSize(*contextp, cmdLineOpts.offset));
+
+  for (long firstRow = 0; firstRow < rows; firstRow += cmdLineOpts.chunkRows) {
+    long lastRow = std::min(rows, firstRow + cmdLineOpts.chunkRows);
+    prefetchDbRows(reader, lastRow, std::min(rows, lastRow + cmdLineOpts.chunkRows));
+
+    HELIB_NTIMER_START(readDatabase);
+    helib::Database<helib::Ctxt> chunk(
+        readDbRowsFromFile(reader, firstRow, lastRow, pk), contextp);
+    HELIB_NTIMER_STOP(readDatabase);
+
+    HELIB_NTIMER_START(scoring);
+    auto clean = [](auto& x){x.cleanUp();};
+    auto scores = chunk.getScore(weighted_query, query).apply(clean);
+    HELIB_NTIMER_STOP(scoring);
+
+    HELIB_NTIMER_START(writeResults);
+    writeResultRows(writer, scores, firstRow);
+    HELIB_NTIMER_STOP(writeResults);
+  }
+}
+
 int main(int argc, char *argv[])
 {
   // PSI STUFF
@@ -61,6 +100,8 @@ int main(int argc, char *argv[])
     .optional()
     .named()
     .arg("--offset", cmdLineOpts.offset, "Offset in bytes when writing to file.")
+    .arg("--chunk", cmdLineOpts.chunkRows,
+      "Process the database this many rows at a time (0 for all at once).")
     .toggle()
     .arg("--column", cmdLineOpts.isColumn,
       "Flag to signify input is in column format.", nullptr)
@@ -72,6 +113,11 @@ int main(int argc, char *argv[])
     cmdLineOpts.nthreads = 1;
   }
 
+  if (cmdLineOpts.chunkRows < 0) {
+    std::cerr << "Chunk size must be non-negative. Setting chunk = 0." << std::endl;
+    cmdLineOpts.chunkRows = 0;
+  }
+
   NTL::SetNumThreads(cmdLineOpts.nthreads);
 
   HELIB_NTIMER_START(readKey);
@@ -82,11 +128,6 @@ int main(int argc, char *argv[])
     loadContextAndKey<helib::PubKey>(cmdLineOpts.pkFilePath);
   HELIB_NTIMER_STOP(readKey);
 
-  HELIB_NTIMER_START(readDatabase);
-  // Read in database
-  helib::Database<helib::Ctxt> database = readDbFromFile(cmdLineOpts.databaseFilePath, contextp, *pkp);
-  HELIB_NTIMER_STOP(readDatabase);
-
   HELIB_NTIMER_START(readQuery);
   // Read in the query data
   helib::Matrix<helib::Ctxt> query = readQueryFromFile(cmdLineOpts.queryFilePath, *pkp);
@@ -109,17 +150,26 @@ int main(int argc, char *argv[])
   helib::Query_t weighted_query(Fs, mus, taus, false);
   HELIB_NTIMER_STOP(buildQuery);
 
-  HELIB_NTIMER_START(scoring);
-  // Calculate scores
-  // FIXME: Query currently must always be a row vector.
-  auto clean = [](auto& x){x.cleanUp();};
-  auto scores = database.getScore(weighted_query, query).apply(clean);
-  HELIB_NTIMER_STOP(scoring);
-
-  HELIB_NTIMER_START(writeResults);
-  // Write results to file
-  writeResultsToFile(cmdLineOpts.outFilePath, scores);
-  HELIB_NTIMER_STOP(writeResults);
+  if (cmdLineOpts.chunkRows > 0) {
+    streamScores(cmdLineOpts, contextp, *pkp, query, weighted_query);
+  } else {
+    HELIB_NTIMER_START(readDatabase);
+    // Read in database
+    helib::Database<helib::Ctxt> database = readDbFromFile(cmdLineOpts.databaseFilePath, contextp, *pkp);
+    HELIB_NTIMER_STOP(readDatabase);
+
+    HELIB_NTIMER_START(scoring);
+    // Calculate scores
+    // FIXME: Query currently must always be a row vector.
+    auto clean = [](auto& x){x.cleanUp();};
+    auto scores = database.getScore(weighted_query, query).apply(clean);
+    HELIB_NTIMER_STOP(scoring);
+
+    HELIB_NTIMER_START(writeResults);
+    // Write results to file
+    writeResultsToFile(cmdLineOpts.outFilePath, scores);
+    HELIB_NTIMER_STOP(writeResults);
+  }
 
   std::ofstream timers("times.log");
   if (timers.is_open()) {
@@ -185,3 +185,24 @@ function teardown {
   diff "result.ptxt_or" "expected.mask_or"
   diff "result.ptxt_expand" "expected.mask_expand"
 }
+
+@test "lookup 4 threads streaming" {
+  skip
+  echo "lookup 4 threads streaming" > README
+  $lookup ${data_prefix}/${prefix_bgv}.pk $data_prefix/db.ctxt $data_prefix/query.ctxt result.ctxt -n=4 --chunk=2
+
+  $decrypt ${data_prefix}/${prefix_bgv}.sk result.ctxt -o "result.ptxt"
+  $decrypt ${data_prefix}/${prefix_bgv}.sk result.ctxt_and -o "result.ptxt_and"
+  $decrypt ${data_prefix}/${prefix_bgv}.sk result.ctxt_or -o "result.ptxt_or"
+  $decrypt ${data_prefix}/${prefix_bgv}.sk result.ctxt_expand -o "result.ptxt_expand"
+
+  ../gen-expected-mask.py ${query_encoded} ${db_encoded} --mod-p $modulus --test SAME > "expected.mask"
+  ../gen-expected-mask.py ${query_encoded} ${db_encoded} --mod-p $modulus --test AND > "expected.mask_and"
+  ../gen-expected-mask.py ${query_encoded} ${db_encoded} --mod-p $modulus --test OR > "expected.mask_or"
+  ../gen-expected-mask.py ${query_encoded} ${db_encoded} --mod-p $modulus --test EXPAND > "expected.mask_expand"
+
+  diff "result.ptxt" "expected.mask"
+  diff "result.ptxt_and" "expected.mask_and"
+  diff "result.ptxt_or" "expected.mask_or"
+  diff "result.ptxt_expand" "expected.mask_expand"
+}
@@ -122,3 +122,15 @@ function teardown {
 
   diff "result.ptxt" "expected.mask"
 }
+
+@test "scoring 4 threads streaming" {
+  skip
+  echo "scoring 4 threads streaming" > README
+  $scoring ${data_prefix}/${prefix_bgv}.pk $data_prefix/db.ctxt $data_prefix/query.ctxt result.ctxt -n=4 --chunk=2
+
+  $decrypt ${data_prefix}/${prefix_bgv}.sk result.ctxt -o "result.ptxt"
+
+  ../gen-expected-mask.py ${query_encoded} ${db_encoded} --mod-p $modulus --test SCORE > "expected.mask"
+
+  diff "result.ptxt" "expected.mask"
+}
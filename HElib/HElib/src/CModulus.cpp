@@ -40,6 +40,7 @@
  */
 #include <helib/CModulus.h>
 #include <helib/timing.h>
+#include <helib/opCounters.h>
 
 #ifdef USE_INTEL_HEXL
 #include "intelExt.h"
@@ -178,6 +179,13 @@ Cmodulus::Cmodulus(const PAlgebra& zms, long qq, long rt) :
 
   BluesteinInit(mm, NTL::conv<NTL::zz_p>(root), *powers, powers_aux, *Rb);
   BluesteinInit(mm, NTL::conv<NTL::zz_p>(rInv), *ipowers, ipowers_aux, *iRb);
+
+  // For odd m the root has order m, as the prime-factor transforms need
+  std::vector<long> factors = PrimeFactorFFT::chooseFactors(mm);
+  if (!factors.empty()) {
+    pfa.reset(new PrimeFactorFFT(factors, NTL::conv<NTL::zz_p>(root)));
+    ipfa.reset(new PrimeFactorFFT(factors, NTL::conv<NTL::zz_p>(rInv)));
+  }
 }
 
 Cmodulus& Cmodulus::operator=(const Cmodulus& other)
@@ -215,6 +223,8 @@ Cmodulus& Cmodulus::operator=(const Cmodulus& other)
   ipowers = other.ipowers;
   iRb = other.iRb;
   phimx = other.phimx;
+  pfa = other.pfa;
+  ipfa = other.ipfa;
 
 #ifdef HELIB_OPENCL
   altFFTInfo = other.altFFTInfo;
@@ -223,6 +233,29 @@ Cmodulus& Cmodulus::operator=(const Cmodulus& other)
   return *this;
 }
 
+void Cmodulus::setPrimeFactors(const std::vector<long>& factors)
+{
+  if (factors.empty()) {
+    pfa.reset();
+    ipfa.reset();
+    return;
+  }
+
+  long m = getM();
+  assertTrue<InvalidArgument>(m % 2 == 1,
+                              "Prime-factor FFTs need an odd m");
+  long product = 1;
+  for (long n : factors)
+    product *= n;
+  assertEq<InvalidArgument>(product, m, "The factors must multiply to m");
+
+  NTL::zz_pBak bak;
+  bak.save();
+  context.restore();
+  pfa.reset(new PrimeFactorFFT(factors, NTL::conv<NTL::zz_p>(root)));
+  ipfa.reset(new PrimeFactorFFT(factors, NTL::conv<NTL::zz_p>(rInv)));
+}
+
 //==================================================================
 // Starting with NTL 11.1.0, the NTL FFT routines do not do any bit reversal.
 // Specifically, FFTFwd leaves its outputs bit reversed, and FFTInv1
@@ -355,7 +388,7 @@ static void BitReverseCopy(long* NTL_RESTRICT B,
 
 //================================================
 
-void Cmodulus::FFT_aux(NTL::vec_long& y, NTL::zz_pX& tmp) const
+void Cmodulus::FFT_aux(long* y, NTL::zz_pX& tmp) const
 {
   HELIB_TIMER_START;
 
@@ -367,8 +400,7 @@ void Cmodulus::FFT_aux(NTL::vec_long& y, NTL::zz_pX& tmp) const
     long dx = deg(tmp);
     long p = NTL::zz_p::modulus();
 
-    y.SetLength(phim);
-    long* yp = y.elts();
+    long* yp = y;
 
     const NTL::zz_p* tmp_p = tmp.rep.elts();
 
@@ -428,6 +460,17 @@ void Cmodulus::FFT_aux(NTL::vec_long& y, NTL::zz_pX& tmp) const
     return;
   }
 
+  if (pfa) {
+    NTL::vec_long& values = Cmodulus::getScratch_vec_long();
+    values.SetLength(getM());
+    pfa->apply(values.elts(), tmp);
+
+    for (long i = 0, j = 0; i < long(this->getM()); i++)
+      if (zMStar->inZmStar(i))
+        y[j++] = values[i];
+    return;
+  }
+
   NTL::zz_p rt;
   conv(rt, root); // convert root to zp format
 
@@ -436,14 +479,12 @@ void Cmodulus::FFT_aux(NTL::vec_long& y, NTL::zz_pX& tmp) const
 
   // copy the result to the output vector y, keeping only the
   // entries corresponding to primitive roots of unity
-  y.SetLength(zMStar->getPhiM());
-
   for (long i = 0, j = 0; i < long(this->getM()); i++)
     if (zMStar->inZmStar(i))
       y[j++] = rep(coeff(tmp, i));
 }
 
-void Cmodulus::FFT(NTL::vec_long& y, const NTL::ZZX& x) const
+void Cmodulus::FFT(long* y, const NTL::ZZX& x) const
 {
   HELIB_TIMER_START;
   NTL::zz_pBak bak;
@@ -459,7 +500,7 @@ void Cmodulus::FFT(NTL::vec_long& y, const NTL::ZZX& x) const
   FFT(y, tmp);
 }
 
-void Cmodulus::FFT(NTL::vec_long& y, const zzX& x) const
+void Cmodulus::FFT(long* y, const zzX& x) const
 {
   HELIB_TIMER_START;
   NTL::zz_pBak bak;
@@ -474,22 +515,87 @@ void Cmodulus::FFT(NTL::vec_long& y, const zzX& x) const
   FFT(y, tmp);
 }
 
-void Cmodulus::FFT(NTL::vec_long& y, NTL::zz_pX& x) const
+void Cmodulus::FFT(long* y, NTL::zz_pX& x) const
 {
   HELIB_TIMER_START;
+  countOp(OpType::NTT);
   NTL::zz_pBak bak;
   bak.save();
   context.restore();
   FFT_aux(y, x);
 }
 
-void Cmodulus::iFFT(NTL::zz_pX& x, const NTL::vec_long& y) const
+void Cmodulus::FFT(NTL::vec_long& y, const NTL::ZZX& x) const
+{
+  y.SetLength(getPhiM());
+  FFT(y.elts(), x);
+}
+
+void Cmodulus::FFT(NTL::vec_long& y, const zzX& x) const
+{
+  y.SetLength(getPhiM());
+  FFT(y.elts(), x);
+}
+
+void Cmodulus::FFT(NTL::vec_long& y, NTL::zz_pX& x) const
+{
+  y.SetLength(getPhiM());
+  FFT(y.elts(), x);
+}
+
+void Cmodulus::FFT(long* const* y, const NTL::ZZX* const* x, long n) const
 {
   HELIB_TIMER_START;
+  countOp(OpType::NTT, n);
   NTL::zz_pBak bak;
   bak.save();
   context.restore();
 
+  NTL::zz_pX& tmp = Cmodulus::getScratch_zz_pX();
+  for (long t : range(n)) {
+    convert(tmp, *x[t]);
+    FFT_aux(y[t], tmp);
+  }
+}
+
+void Cmodulus::FFT(long* const* y, const zzX* const* x, long n) const
+{
+  HELIB_TIMER_START;
+  countOp(OpType::NTT, n);
+  NTL::zz_pBak bak;
+  bak.save();
+  context.restore();
+
+  NTL::zz_pX& tmp = Cmodulus::getScratch_zz_pX();
+  for (long t : range(n)) {
+    convert(tmp, *x[t]);
+    FFT_aux(y[t], tmp);
+  }
+}
+
+void Cmodulus::iFFT(NTL::zz_pX& x, const long* y) const
+{
+  HELIB_TIMER_START;
+  countOp(OpType::NTT);
+  NTL::zz_pBak bak;
+  bak.save();
+  context.restore();
+  iFFT_aux(x, y);
+}
+
+void Cmodulus::iFFT(NTL::zz_pX* x, const long* const* y, long n) const
+{
+  HELIB_TIMER_START;
+  countOp(OpType::NTT, n);
+  NTL::zz_pBak bak;
+  bak.save();
+  context.restore();
+  for (long t : range(n))
+    iFFT_aux(x[t], y[t]);
+}
+
+void Cmodulus::iFFT_aux(NTL::zz_pX& x, const long* y) const
+{
   if (zMStar->getPow2()) {
     // special case when m is a power of 2
 
@@ -497,7 +603,7 @@ void Cmodulus::iFFT(NTL::zz_pX& x, const NTL::vec_long& y) const
     long phim = (1L << (k - 1));
     long p = NTL::zz_p::modulus();
 
-    const long* yp = y.elts();
+    const long* yp = y;
 
     NTL::vec_long& tmp = Cmodulus::getScratch_vec_long();
     tmp.SetLength(phim);
@@ -561,9 +667,21 @@ void Cmodulus::iFFT(NTL::zz_pX& x, const NTL::vec_long& y) const
     if (zMStar->inZmStar(i))
       x.rep[i].LoopHole() = y[j++]; // DIRT: y[j] already reduced
   x.normalize();
-  conv(rt, rInv); // convert rInv to zp format
 
-  BluesteinFFT(x, m, rt, *ipowers, ipowers_aux, *iRb); // call the FFT routine
+  if (ipfa) {
+    NTL::vec_long& values = Cmodulus::getScratch_vec_long();
+    values.SetLength(m);
+    ipfa->apply(values.elts(), x);
+
+    x.rep.SetLength(m);
+    for (long i = 0; i < m; i++)
+      x.rep[i].LoopHole() = values[i];
+    x.normalize();
+  } else {
+    conv(rt, rInv); // convert rInv to zp format
+
+    BluesteinFFT(x, m, rt, *ipowers, ipowers_aux, *iRb); // call the FFT routine
+  }
 
   // reduce the result mod (Phi_m(X),q) and copy to the output polynomial x
   {
@@ -577,6 +695,14 @@ void Cmodulus::iFFT(NTL::zz_pX& x, const NTL::vec_long& y) const
   x *= mm_inv;
 }
 
+void Cmodulus::iFFT(NTL::zz_pX& x, const NTL::vec_long& y) const
+{
+  assertEq<InvalidArgument>(y.length(),
+                            long(getPhiM()),
+                            "iFFT input must have phi(m) entries");
+  iFFT(x, y.elts());
+}
+
 NTL::zz_pX& Cmodulus::getScratch_zz_pX()
 {
   NTL_THREAD_LOCAL static NTL::zz_pX scratch;
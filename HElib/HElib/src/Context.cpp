@@ -9,6 +9,7 @@
  * See the License for the specific language governing permissions and
  * limitations under the License. See accompanying LICENSE file.
  */
+#include <cmath>
 #include <cstring>
 #include <algorithm>
 #include <optional>
@@ -23,10 +24,14 @@ using json = ::nlohmann::json;
 #include <helib/EncryptedArray.h>
 #include <helib/PolyModRing.h>
 #include <helib/fhe_stats.h>
+#include <helib/opCounters.h>
+#include <helib/residueBackend.h>
 
 #include "macro.h"
 #include "PrimeGenerator.h"
 #include "binio.h"
+#include "crtTable.h"
+#include "modDown.h"
 #include "io.h"
 
 namespace helib {
@@ -81,8 +86,10 @@ struct Context::ModChainParams
   long skHwt;
   long resolution;
   long bitsInSpecialPrimes;
+  long primeBits;
   double stdev;
   double scale;
+  bool polyfunctionFlag;
 };
 
 struct Context::BootStrapParams
@@ -90,6 +97,7 @@ struct Context::BootStrapParams
   NTL::Vec<long> mvec;
   bool buildCacheFlag;
   bool thickFlag;
+  bool lazyFlag;
 };
 
 struct Context::SerializableContent
@@ -274,6 +282,74 @@ void Context::productOfPrimes(NTL::ZZ& p, const IndexSet& s) const
     p *= ithPrime(i);
 }
 
+const std::vector<long>& Context::getAutomorphPerm(long k) const
+{
+  long m = zMStar.getM();
+  k = mcMod(k, m);
+  assertTrue<InvalidArgument>(zMStar.inZmStar(k), "k is not in Zm*");
+  {
+    HELIB_SHARED_GUARD(automorphPermsMutex);
+    auto it = automorphPerms.find(k);
+    if (it != automorphPerms.end())
+      return it->second;
+  }
+
+  // Build outside of the lock, if another thread got there first we keep its
+  // table. The image of a row has new[j] = old[j*k mod m], where j runs over
+  // the representatives of Zm*.
+  long phim = zMStar.getPhiM();
+  std::vector<long> perm(phim);
+  NTL::mulmod_precon_t precon = NTL::PrepMulModPrecon(k, m);
+  for (long j : range(phim))
+    perm[j] = zMStar.indexInZmstar_unchecked(
+        NTL::MulModPrecon(zMStar.repInZmstar_unchecked(j), k, m, precon));
+
+  HELIB_EXCLUSIVE_GUARD(automorphPermsMutex);
+  return automorphPerms.emplace(k, std::move(perm)).first->second;
+}
+
+const ModDownTable& Context::getModDownTable(const IndexSet& dropped,
+                                             const IndexSet& kept,
+                                             long ptxtSpace) const
+{
+  std::vector<long> key = {ptxtSpace};
+  for (long i : dropped)
+    key.push_back(i);
+  key.push_back(-1);
+  for (long i : kept)
+    key.push_back(i);
+  {
+    HELIB_SHARED_GUARD(modDownTablesMutex);
+    auto it = modDownTables.find(key);
+    if (it != modDownTables.end())
+      return *it->second;
+  }
+
+  // Build outside of the lock, as for getAutomorphPerm
+  auto table =
+      std::make_shared<const ModDownTable>(*this, dropped, kept, ptxtSpace);
+  HELIB_EXCLUSIVE_GUARD(modDownTablesMutex);
+  return *modDownTables.emplace(std::move(key), std::move(table)).first->second;
+}
+
+const CRTTable& Context::getCRTTable(const IndexSet& s) const
+{
+  std::vector<long> key;
+  for (long i : s)
+    key.push_back(i);
+  {
+    HELIB_SHARED_GUARD(crtTablesMutex);
+    auto it = crtTables.find(key);
+    if (it != crtTables.end())
+      return *it->second;
+  }
+
+  // Build outside of the lock, as for getAutomorphPerm
+  auto table = std::make_shared<const CRTTable>(*this, s);
+  HELIB_EXCLUSIVE_GUARD(crtTablesMutex);
+  return *crtTables.emplace(std::move(key), std::move(table)).first->second;
+}
+
 bool Context::operator==(const Context& other) const
 {
   if (&other == this)
@@ -451,6 +527,16 @@ Context* Context::readPtrFrom(std::istream& str)
   return new Context(readParamsFrom(str));
 }
 
+Context Context::readFrom(std::istream& str, std::istream& bootstrapBundle)
+{
+  return Context(readParamsFrom(str), &bootstrapBundle);
+}
+
+Context* Context::readPtrFrom(std::istream& str, std::istream& bootstrapBundle)
+{
+  return new Context(readParamsFrom(str), &bootstrapBundle);
+}
+
 Context::SerializableContent Context::readParamsFromJSON(
     const JsonWrapper& jwrap)
 {
@@ -601,9 +687,10 @@ Context::Context(unsigned long m,
                  unsigned long p,
                  unsigned long r,
                  const std::vector<long>& gens,
-                 const std::vector<long>& ords) :
+                 const std::vector<long>& ords,
+                 const PAlgebraTables* tables) :
     zMStar(m, p, gens, ords),
-    alMod(zMStar, r),
+    alMod(zMStar, r, tables),
 
     // VJS-FIXME: I'm not sure this makes sense.
     // This constrictor was provided mainly for bootstrapping.
@@ -664,18 +751,65 @@ Context::Context(long m,
                         mparams->bootstrappableFlag,
                         mparams->skHwt,
                         mparams->resolution,
-                        mparams->bitsInSpecialPrimes);
+                        mparams->bitsInSpecialPrimes,
+                        mparams->polyfunctionFlag,
+                        mparams->primeBits);
 
     if (mparams->bootstrappableFlag && bparams) {
       this->enableBootStrapping(bparams->mvec,
                                 bparams->buildCacheFlag,
-                                bparams->thickFlag);
+                                bparams->thickFlag,
+                                /*usedSlots=*/0,
+                                /*cacheBudget=*/-1,
+                                bparams->lazyFlag);
     }
   }
 }
 
-Context::Context(const SerializableContent& content) :
-    Context(content.m, content.p, content.r, content.gens, content.ords)
+// The tables of the PAlgebraMod of the context open the bootstrap bundle in a
+// record of their own, so that they can be read before the context is built
+static void writeAlgebraRecord(std::ostream& str, const PAlgebraTables& tables)
+{
+  SerializeHeader<PAlgebraTables>().writeTo(str);
+  writeEyeCatcher(str, EyeCatcher::ALG_BEGIN);
+  tables.writeTo(str);
+  writeEyeCatcher(str, EyeCatcher::ALG_END);
+}
+
+static PAlgebraTables readAlgebraRecord(std::istream& str)
+{
+  const auto header = SerializeHeader<PAlgebraTables>::readFrom(str);
+  assertTrue<IOError>(header.version == Binio::VERSION_0_0_1_0 &&
+                          header.structId == nameToStructId<PAlgebraTables>(),
+                      "Header: not a supported bootstrap bundle");
+  assertTrue<IOError>(readEyeCatcher(str, EyeCatcher::ALG_BEGIN),
+                      "Could not find pre-PAlgebra-tables eye catcher");
+  PAlgebraTables tables = PAlgebraTables::readFrom(str);
+  assertTrue<IOError>(readEyeCatcher(str, EyeCatcher::ALG_END),
+                      "Could not find post-PAlgebra-tables eye catcher");
+  return tables;
+}
+
+// The tables at the front of bootstrapBundle, or null if there is none
+static std::unique_ptr<PAlgebraTables> readAlgebraTables(
+    std::istream* bootstrapBundle)
+{
+  if (bootstrapBundle == nullptr)
+    return nullptr;
+  return std::make_unique<PAlgebraTables>(
+      readAlgebraRecord(*bootstrapBundle));
+}
+
+Context::Context(const SerializableContent& content,
+                 std::istream* bootstrapBundle) :
+    Context(content.m,
+            content.p,
+            content.r,
+            content.gens,
+            content.ords,
+            readAlgebraTables(content.mvec.length() > 0 ? bootstrapBundle
+                                                        : nullptr)
+                .get())
 {
   this->stdev = content.stdev;
   this->scale = content.scale;
@@ -684,11 +818,8 @@ Context::Context(const SerializableContent& content) :
   this->e_param = content.e_param;
   this->ePrime_param = content.ePrime_param;
 
+  addModuli(content.qs);
   for (long i = 0; i < lsize(content.qs); i++) {
-    long q = content.qs[i];
-
-    this->moduli.emplace_back(this->zMStar, q, 0);
-
     // FIXME: Consider serializing all 3 sets and setting them directly.
     if (content.smallPrimes.contains(i))
       this->smallPrimes.insert(i); // small prime
@@ -701,7 +832,14 @@ Context::Context(const SerializableContent& content) :
   endBuildModChain();
 
   // Read in the partition of m into co-prime factors (if bootstrappable)
-  if (content.mvec.length() > 0) {
+  if (content.mvec.length() > 0 && bootstrapBundle != nullptr) {
+    // The tables of alMod were read by the constructor above
+    this->readRecryptDataFrom(*bootstrapBundle);
+    assertTrue<IOError>(rcData.mvec == content.mvec &&
+                            rcData.build_cache == content.build_cache &&
+                            rcData.alsoThick == content.alsoThick,
+                        "The bootstrap bundle does not match the context");
+  } else if (content.mvec.length() > 0) {
     // VJS-FIXME: what about the build_cache and alsoThick params?
     this->enableBootStrapping(content.mvec,
                               content.build_cache,
@@ -709,6 +847,73 @@ Context::Context(const SerializableContent& content) :
   }
 }
 
+// Bumped whenever the layout of the bootstrap bundle changes
+static constexpr long BOOTSTRAP_BUNDLE_VERSION = 2;
+
+// The parameters that the recryption data depends on, written in front of the
+// bootstrap bundle so that it is not used with another context
+static std::vector<long> bootstrapFingerprint(const Context& context)
+{
+  std::vector<long> fingerprint = {context.getM(),
+                                   context.getP(),
+                                   context.getR(),
+                                   context.getE(),
+                                   context.getEPrime(),
+                                   context.getHwt()};
+  for (long i : range(context.numPrimes()))
+    fingerprint.push_back(context.ithPrime(i));
+  return fingerprint;
+}
+
+void Context::writeBootstrapBundleTo(std::ostream& str) const
+{
+  assertTrue(isBootstrappable(), "The context is not bootstrappable");
+
+  writeAlgebraRecord(str, alMod.getTables());
+  SerializeHeader<ThinRecryptData>().writeTo(str);
+  writeEyeCatcher(str, EyeCatcher::BOOT_BEGIN);
+  write_raw_int(str, BOOTSTRAP_BUNDLE_VERSION);
+  write_raw_vector(str, bootstrapFingerprint(*this));
+  rcData.writeTo(str);
+  writeEyeCatcher(str, EyeCatcher::BOOT_END);
+}
+
+void Context::enableBootStrappingFrom(std::istream& str)
+{
+  const PAlgebraTables tables = readAlgebraRecord(str);
+  assertTrue<IOError>(tables.m == getM() && tables.p == getP() &&
+                          tables.r == getR(),
+                      "The bootstrap bundle was written for other parameters");
+  readRecryptDataFrom(str);
+}
+
+void Context::readRecryptDataFrom(std::istream& str)
+{
+  assertTrue(e_param > 0,
+             "enableBootStrappingFrom invoked but willBeBootstrappable "
+             "not set in buildModChain");
+
+  const auto header = SerializeHeader<ThinRecryptData>::readFrom(str);
+  assertTrue<IOError>(header.version == Binio::VERSION_0_0_1_0 &&
+                          header.structId ==
+                              nameToStructId<ThinRecryptData>(),
+                      "Header: not a supported bootstrap bundle");
+  assertTrue<IOError>(readEyeCatcher(str, EyeCatcher::BOOT_BEGIN),
+                      "Could not find pre-bootstrap-bundle eye catcher");
+  assertEq<IOError>(read_raw_int(str),
+                    BOOTSTRAP_BUNDLE_VERSION,
+                    "Bootstrap bundle version not supported");
+  std::vector<long> fingerprint;
+  read_raw_vector<long>(str, fingerprint);
+  assertTrue<IOError>(fingerprint == bootstrapFingerprint(*this),
+                      "The bootstrap bundle was written for other parameters");
+
+  rcData.readFrom(*this, str);
+
+  assertTrue<IOError>(readEyeCatcher(str, EyeCatcher::BOOT_END),
+                      "Could not find post-bootstrap-bundle eye catcher");
+}
+
 static void CheckPrimes(const Context& context,
                         const IndexSet& s,
                         const char* name)
@@ -728,12 +933,12 @@ static void CheckPrimes(const Context& context,
 void Context::addSmallPrimes(long resolution, long cpSize)
 {
   // cpSize is the size of the ciphertext primes
-  // Sanity-checks, cpSize \in [0.9*HELIB_SP_NBITS, HELIB_SP_NBITS]
+  // Sanity-checks, cpSize \in [0.9*maxPrimeBits, maxPrimeBits]
   assertTrue(cpSize >= 30, "cpSize is too small (minimum is 30)");
   assertInRange(cpSize * 10,
-                9l * HELIB_SP_NBITS,
-                10l * HELIB_SP_NBITS,
-                "cpSize not in [0.9*HELIB_SP_NBITS, HELIB_SP_NBITS]",
+                9l * maxPrimeBits,
+                10l * maxPrimeBits,
+                "cpSize not in [0.9*maxPrimeBits, maxPrimeBits]",
                 true);
 
   long m = getM();
@@ -780,47 +985,64 @@ void Context::addSmallPrimes(long resolution, long cpSize)
 
   long last_sz = 0;
   std::unique_ptr<PrimeGenerator> gen;
+  std::vector<long> qs;
   for (long sz : sizes) {
     if (sz != last_sz)
       gen.reset(new PrimeGenerator(sz, m));
     long q = gen->next();
-    addSmallPrime(q);
+    assertFalse(inChain(q), "Small prime q is already in the prime chain");
+    qs.push_back(q);
     last_sz = sz;
   }
+  addPrimes(qs, smallPrimes);
 }
 
 void Context::addCtxtPrime(long q)
 {
   assertFalse(inChain(q), "Prime q is already in the prime chain");
-  long i = moduli.size(); // The index of the new prime in the list
-  moduli.push_back(Cmodulus(zMStar, q, 0));
-  ctxtPrimes.insert(i);
+  addPrimes({q}, ctxtPrimes);
 }
 
 void Context::addSpecialPrime(long q)
 {
   assertFalse(inChain(q), "Special prime q is already in the prime chain");
-  long i = moduli.size(); // The index of the new prime in the list
-  moduli.push_back(Cmodulus(zMStar, q, 0));
-  specialPrimes.insert(i);
+  addPrimes({q}, specialPrimes);
+}
+
+long Context::addModuli(const std::vector<long>& qs)
+{
+  long first = moduli.size();
+  moduli.resize(first + qs.size());
+  // The Bluestein and prime-factor tables of the primes are independent
+  HELIB_EXEC_INDEX(lsize(qs), i)
+  moduli[first + i] = Cmodulus(zMStar, qs[i], 0);
+  HELIB_EXEC_INDEX_END
+  return first;
+}
+
+void Context::addPrimes(const std::vector<long>& qs, IndexSet& primes)
+{
+  long first = addModuli(qs);
+  for (long i : range(lsize(qs)))
+    primes.insert(first + i);
 }
 
 // Determine the target size of the ctxtPrimes. The target size is
-// set at 2^n, where n is at most HELIB_SP_NBITS and at least
-// ceil(0.9*HELIB_SP_NBITS), so that we don't overshoot nBits by too
-// much.
-// The reason that we do not allow to go below 0.9*HELIB_SP_NBITS is
+// set at 2^n, where n is at most maxBits (HELIB_SP_NBITS unless a smaller
+// size is asked for) and at least ceil(0.9*maxBits), so that we don't
+// overshoot nBits by too much.
+// The reason that we do not allow to go below 0.9*maxBits is
 // that we need some of the smallPrimes to be sufficiently smaller
 // than the ctxtPrimes, and still we need these smallPrimes to have
 // m'th roots of unity.
-static long ctxtPrimeSize(long nBits)
+static long ctxtPrimeSize(long nBits, long maxBits)
 {
   double bit_loss =
       -std::log1p(-1.0 / double(1L << PrimeGenerator::B)) / std::log(2.0);
   // std::cerr << "*** bit_loss=" << bit_loss;
 
-  // How many primes of size HELIB_SP_NBITS it takes to get to nBits
-  double maxPsize = HELIB_SP_NBITS - bit_loss;
+  // How many primes of size maxBits it takes to get to nBits
+  double maxPsize = maxBits - bit_loss;
   // primes of length len are guaranteed to be at least (1-1/2^B)*2^len,
 
   long nPrimes = long(ceil(nBits / maxPsize));
@@ -831,8 +1053,8 @@ static long ctxtPrimeSize(long nBits)
   // nPrimes primes of length targetSize multiply out to
   // at least nBits bits.
 
-  long targetSize = HELIB_SP_NBITS;
-  while (10 * (targetSize - 1) >= 9 * HELIB_SP_NBITS &&
+  long targetSize = maxBits;
+  while (10 * (targetSize - 1) >= 9 * maxBits &&
          (targetSize - 1) >= 30 &&
          ((targetSize - 1) - bit_loss) * nPrimes >= nBits)
     targetSize--;
@@ -848,24 +1070,27 @@ void Context::addCtxtPrimes(long nBits, long targetSize)
   // We add enough primes of size targetSize until their product is
   // at least 2^{nBits}
 
-  // Sanity-checks, targetSize \in [0.9*HELIB_SP_NBITS, HELIB_SP_NBITS]
+  // Sanity-checks, targetSize \in [0.9*maxPrimeBits, maxPrimeBits]
   assertTrue(targetSize >= 30,
              "Target prime is too small (minimum size is 30)");
   assertInRange(targetSize * 10,
-                9l * HELIB_SP_NBITS,
-                10l * HELIB_SP_NBITS,
-                "targetSize not in [0.9*HELIB_SP_NBITS, HELIB_SP_NBITS]",
+                9l * maxPrimeBits,
+                10l * maxPrimeBits,
+                "targetSize not in [0.9*maxPrimeBits, maxPrimeBits]",
                 true);
   const PAlgebra& palg = getZMStar();
   long m = palg.getM();
 
   PrimeGenerator gen(targetSize, m);
   double bitlen = 0; // how many bits we already have
+  std::vector<long> qs;
   while (bitlen < nBits - 0.5) {
     long q = gen.next(); // generate the next prime
-    addCtxtPrime(q);     // add it to the list
+    assertFalse(inChain(q), "Prime q is already in the prime chain");
+    qs.push_back(q); // add it to the list
     bitlen += std::log2(q);
   }
+  addPrimes(qs, ctxtPrimes);
 
   // std::cerr << "*** ctxtPrimes excess: " << (bitlen - nBits) << "\n";
   HELIB_STATS_UPDATE("excess-ctxtPrimes", bitlen - nBits);
@@ -873,7 +1098,8 @@ void Context::addCtxtPrimes(long nBits, long targetSize)
 
 void Context::addSpecialPrimes(long nDgts,
                                bool willBeBootstrappable,
-                               long bitsInSpecialPrimes)
+                               long bitsInSpecialPrimes,
+                               bool polyfunction)
 {
   const PAlgebra& palg = getZMStar();
   long p = std::abs(palg.getP()); // for CKKS, palg.getP() == -1
@@ -885,7 +1111,7 @@ void Context::addSpecialPrimes(long nDgts,
   if (willBeBootstrappable && !isCKKS()) {
     // bigger p^e for bootstrapping
     long e, ePrime;
-    RecryptData::setAE(e, ePrime, *this);
+    RecryptData::setAE(e, ePrime, *this, polyfunction);
     p2e *= NTL::power_long(p, e - ePrime);
 
     // initialize e and ePrime parameters in the context
@@ -991,8 +1217,8 @@ void Context::addSpecialPrimes(long nDgts,
   double bit_loss =
       -std::log1p(-1.0 / double(1L << PrimeGenerator::B)) / std::log(2.0);
 
-  // How many primes of size HELIB_SP_NBITS it takes to get to nBits
-  double maxPsize = HELIB_SP_NBITS - bit_loss;
+  // How many primes of size maxPrimeBits it takes to get to nBits
+  double maxPsize = maxPrimeBits - bit_loss;
   // primes of length len are guaranteed to be at least (1-1/2^B)*2^len,
 
   long nPrimes = long(ceil(nBits / maxPsize));
@@ -1003,8 +1229,8 @@ void Context::addSpecialPrimes(long nDgts,
   // nPrimes primes of length targetSize multiply out to
   // at least nBits bits.
 
-  long targetSize = HELIB_SP_NBITS;
-  while ((targetSize - 1) >= 0.55 * HELIB_SP_NBITS && (targetSize - 1) >= 30 &&
+  long targetSize = maxPrimeBits;
+  while ((targetSize - 1) >= 0.55 * maxPrimeBits && (targetSize - 1) >= 30 &&
          ((targetSize - 1) - bit_loss) * nPrimes >= nBits)
     targetSize--;
 
@@ -1013,6 +1239,7 @@ void Context::addSpecialPrimes(long nDgts,
 
   PrimeGenerator gen(targetSize, m);
 
+  std::vector<long> qs;
   while (nPrimes > 0) {
     long q = gen.next();
 
@@ -1023,9 +1250,10 @@ void Context::addSpecialPrimes(long nDgts,
     // this is not the most efficient way to do this,
     // but it doesn't make sense to optimize this any further
 
-    addSpecialPrime(q);
+    qs.push_back(q);
     nPrimes--;
   }
+  addPrimes(qs, specialPrimes);
 
   // std::cerr << "*** specialPrimes excess: " <<
   // (logOfProduct(specialPrimes)/std::log(2.0) - nBits) <<
@@ -1039,7 +1267,9 @@ void Context::buildModChain(long nBits,
                             bool willBeBootstrappable,
                             long skHwt,
                             long resolution,
-                            long bitsInSpecialPrimes)
+                            long bitsInSpecialPrimes,
+                            bool polyfunction,
+                            long primeBits)
 {
   // Cannot build modulus chain with nBits < 0
   assertTrue<InvalidArgument>(nBits > 0,
@@ -1047,6 +1277,15 @@ void Context::buildModChain(long nBits,
 
   assertTrue(skHwt >= 0, "invalid skHwt parameter");
 
+  if (primeBits == 0)
+    primeBits = HELIB_SP_NBITS;
+  assertInRange<InvalidArgument>(primeBits,
+                                 30l,
+                                 long(HELIB_SP_NBITS),
+                                 "primeBits must be in [30, HELIB_SP_NBITS]",
+                                 true);
+  maxPrimeBits = primeBits;
+
   // ignore for CKKS
   if (isCKKS())
     willBeBootstrappable = false;
@@ -1060,10 +1299,13 @@ void Context::buildModChain(long nBits,
   // initialize hwt param in context
   hwt_param = skHwt;
 
-  long pSize = ctxtPrimeSize(nBits);
+  long pSize = ctxtPrimeSize(nBits, maxPrimeBits);
   addSmallPrimes(resolution, pSize);
   addCtxtPrimes(nBits, pSize);
-  addSpecialPrimes(nDgts, willBeBootstrappable, bitsInSpecialPrimes);
+  addSpecialPrimes(nDgts,
+                   willBeBootstrappable,
+                   bitsInSpecialPrimes,
+                   polyfunction);
 
   CheckPrimes(*this, smallPrimes, "smallPrimes");
   CheckPrimes(*this, ctxtPrimes, "ctxtPrimes");
@@ -1075,9 +1317,65 @@ void Context::buildModChain(long nBits,
 void Context::addSmallPrime(long q)
 {
   assertFalse(inChain(q), "Small prime q is already in the prime chain");
-  long i = moduli.size(); // The index of the new prime in the list
-  moduli.push_back(Cmodulus(zMStar, q, 0));
-  smallPrimes.insert(i);
+  addPrimes({q}, smallPrimes);
+}
+
+void Context::useFactoredFFT(const NTL::Vec<long>& mvec)
+{
+  std::vector<long> factors;
+  if (mvec.length() == 0)
+    factors = PrimeFactorFFT::chooseFactors(getM());
+  else
+    convert(factors, mvec);
+
+  for (Cmodulus& modulus : moduli)
+    modulus.setPrimeFactors(factors);
+}
+
+IndexSet Context::specialPrimesForLevel(const IndexSet& s) const
+{
+  // Only a ciphertext inside the first digit is switched with a single digit
+  if (digits.empty() || empty(s) || !(s <= digits[0]))
+    return specialPrimes;
+
+  // The special primes exceed the largest digit by the margin that keeps
+  // the key-switching noise small, keep the same margin over s
+  double maxDigitLog = 0.0;
+  for (const IndexSet& digit : digits)
+    maxDigitLog = std::max(maxDigitLog, logOfProduct(digit));
+  double needed =
+      logOfProduct(s) + logOfProduct(specialPrimes) - maxDigitLog;
+
+  IndexSet chosen;
+  for (long i : specialPrimes) {
+    if (logOfProduct(chosen) >= needed)
+      break;
+    chosen.insert(i);
+  }
+  return chosen;
+}
+
+double Context::scaleForFailureProbability(double prob, long phim)
+{
+  assertTrue<InvalidArgument>(prob > 0.0 && prob < 1.0,
+                              "Failure probability must be in (0, 1)");
+  assertTrue<InvalidArgument>(phim > 0, "phim must be positive");
+
+  // log(phim * erfc(s/sqrt(2))) is decreasing in s, bisect for log(prob).
+  // erfc underflows to 0 (log = -inf) well before s = 40.
+  double target = std::log(prob);
+  auto logFail = [phim](double s) {
+    return std::log(double(phim)) + std::log(std::erfc(s / std::sqrt(2.0)));
+  };
+  double lo = 0.0, hi = 40.0;
+  for (long i = 0; i < 100; i++) {
+    double mid = 0.5 * (lo + hi);
+    if (logFail(mid) <= target)
+      hi = mid;
+    else
+      lo = mid;
+  }
+  return hi;
 }
 
 void Context::endBuildModChain()
@@ -1089,6 +1387,14 @@ void Context::endBuildModChain()
   NTL::Vec<long> mmvec;
   convert(mmvec, mvec);
   pwfl_converter = std::make_shared<PowerfulDCRT>(*this, mmvec);
+
+  // A chain of 30- or 31-bit primes (ContextBuilder::primeBits) uses the
+  // narrow kernels, also when the context is read back
+  bool narrow = numPrimes() > 0;
+  for (long i : range(numPrimes()))
+    narrow = narrow && ithPrime(i) < (1L << NarrowResidueBackend::maxBits);
+  if (narrow && !residueBackend)
+    residueBackend = std::make_shared<NarrowResidueBackend>();
 }
 
 // Helper for the build and buildPtr methods
@@ -1097,6 +1403,10 @@ const std::pair<std::optional<Context::ModChainParams>,
                 std::optional<Context::BootStrapParams>>
 ContextBuilder<SCHEME>::makeParamsArgs() const
 {
+  double scale = scale_;
+  if (failureProb_ > 0)
+    scale = Context::scaleForFailureProbability(failureProb_, phi_N(m_));
+
   const auto mparams =
       buildModChainFlag_
           ? std::make_optional<Context::ModChainParams>({bits_,
@@ -1105,13 +1415,18 @@ ContextBuilder<SCHEME>::makeParamsArgs() const
                                                          skHwt_,
                                                          resolution_,
                                                          bitsInSpecialPrimes_,
+                                                         primeBits_,
                                                          stdev_,
-                                                         scale_})
+                                                         scale,
+                                                         polyfunctionFlag_})
           : std::nullopt;
 
   const auto bparams = bootstrappableFlag_
                            ? std::make_optional<Context::BootStrapParams>(
-                                 {mvec_, buildCacheFlag_, thickFlag_})
+                                 {mvec_,
+                                  buildCacheFlag_,
+                                  thickFlag_,
+                                  lazyRecryptDataFlag_})
                            : std::nullopt;
 
   return {mparams, bparams};
@@ -1147,10 +1462,13 @@ std::ostream& operator<<<BGV>(std::ostream& os, const ContextBuilder<BGV>& cb)
                   {"skHwt", cb.skHwt_},
                   {"resolution", cb.resolution_},
                   {"bitsInSpecialPrimes", cb.bitsInSpecialPrimes_},
+                  {"primeBits", cb.primeBits_},
                   {"bootstrappableFlag", cb.bootstrappableFlag_},
                   {"mvec", cb.mvec_},
                   {"buildCacheFlag", cb.buildCacheFlag_},
-                  {"thickFlag", cb.thickFlag_}};
+                  {"thickFlag", cb.thickFlag_},
+                  {"polyfunctionFlag", cb.polyfunctionFlag_},
+                  {"lazyRecryptDataFlag", cb.lazyRecryptDataFlag_}};
   os << toTypedJson<ContextBuilder<BGV>>(j);
   return os;
 }
@@ -1168,7 +1486,8 @@ std::ostream& operator<<<CKKS>(std::ostream& os, const ContextBuilder<CKKS>& cb)
                   {"bits", cb.bits_},
                   {"skHwt", cb.skHwt_},
                   {"resolution", cb.resolution_},
-                  {"bitsInSpecialPrimes", cb.bitsInSpecialPrimes_}};
+                  {"bitsInSpecialPrimes", cb.bitsInSpecialPrimes_},
+                  {"primeBits", cb.primeBits_}};
   os << toTypedJson<ContextBuilder<CKKS>>(j);
   return os;
 }
@@ -12,10 +12,13 @@
 // Notice: this file was modified from HElib
 #include <NTL/BasicThreadPool.h>
 #include <NTL/ZZ.h>
+#include <algorithm>
 
 #include "io.h"
 #include "binio.h"
+#include "jsonStream.h"
 #include "macro.h"
+#include "crtTable.h"
 
 #include <helib/timing.h>
 #include <helib/Context.h>
@@ -24,7 +27,9 @@
 #include <helib/CtPtrs.h>
 #include <helib/EncryptedArray.h>
 #include <helib/Ptxt.h>
+#include <helib/opCounters.h>
 #include <helib/polyEval.h>
+#include <helib/refreshPolicy.h>
 
 #include <helib/debugging.h>
 #include <helib/norms.h>
@@ -32,12 +37,12 @@
 #include <helib/powerful.h>
 #include <helib/log.h>
 #include <helib/keys.h>
+#include <helib/keySetOptimizer.h>
 #include <helib/sample.h>
 #include "internal_symbols.h"
 
 namespace helib {
 
-extern int fhe_watcher;
 static const double safety = 1 * log(2.0); // 1 bits of safety
 
 SKHandle SKHandle::readFrom(std::istream& str)
@@ -99,8 +104,21 @@ void SKHandle::readJSON(const JsonWrapper& jw)
 }
 
 // A hack for recording required automorphisms (see NumbTh.h)
-std::set<long>* FHEglobals::automorphVals = nullptr;
-std::set<long>* FHEglobals::automorphVals2 = nullptr;
+thread_local std::set<long>* FHEglobals::automorphVals = nullptr;
+thread_local std::set<long>* FHEglobals::automorphVals2 = nullptr;
+static HELIB_MUTEX_TYPE automorphValsMx;
+
+void recordAutomorphVal(long k)
+{
+  HELIB_MUTEX_GUARD(automorphValsMx);
+  FHEglobals::automorphVals->insert(k);
+}
+
+void recordAutomorphVal2(long k)
+{
+  HELIB_MUTEX_GUARD(automorphValsMx);
+  FHEglobals::automorphVals2->insert(k);
+}
 
 long Ctxt::effectiveR() const
 {
@@ -115,15 +133,20 @@ long Ctxt::effectiveR() const
   return 0; // just to keep the compiler happy
 }
 
+// The factor from the noise bound to the norm of the noise that decryption
+// sees
+static double decryptionNormBound(const Context& context)
+{
+  if (DECRYPT_ON_PWFL_BASIS && !context.getZMStar().getPow2())
+    return context.getZMStar().getNormBnd();
+  else
+    return context.getZMStar().getPolyNormBnd();
+}
+
 bool Ctxt::isCorrect() const
 {
   NTL::xdouble xQ = NTL::xexp(getContext().logOfProduct(getPrimeSet()));
-
-  double bnd;
-  if (DECRYPT_ON_PWFL_BASIS && !getContext().getZMStar().getPow2())
-    bnd = getContext().getZMStar().getNormBnd();
-  else
-    bnd = getContext().getZMStar().getPolyNormBnd();
+  double bnd = decryptionNormBound(getContext());
 
   return totalNoiseBound() * bnd <= 0.48 * xQ;
 }
@@ -187,49 +210,67 @@ bool Ctxt::verifyPrimeSet() const
   return s.isInterval();
 }
 
+// The kind of key switch that switches a part with the given handle to s
+static OpType keySwitchType(const PAlgebra& zMStar, const SKHandle& handle)
+{
+  if (handle.powerOfS != 1)
+    return OpType::RelinKeySwitch;
+  for (long j = 1; j < zMStar.getOrdP(); j++)
+    if (zMStar.frobeniusPow(j) == handle.powerOfX)
+      return OpType::FrobeniusKeySwitch;
+  return OpType::AutomorphKeySwitch;
+}
+
 // Multiply vector of digits by key-switching matrix and add to *this.
 // It is assumed that W has at least as many b[i]'s as there are digits.
-// The vector of digits is modified in place.
-void Ctxt::keySwitchDigits(const KeySwitch& W, std::vector<DoubleCRT>& digits)
-{ // An object to hold the pseudorandom ai's, note that it must be defined
-  // with the maximum number of levels, else the PRG will go out of sync.
-  // FIXME: This is a bug waiting to happen.
-
-  DoubleCRT ai(context, context.getCtxtPrimes() | context.getSpecialPrimes());
-
-  // Subsequent ai's use the evolving RNG state
-  RandomState state; // backup the NTL PRG seed
-  NTL::SetSeed(W.prgSeed);
-
-  // Add the columns in, one by one
-  DoubleCRT tmpDCRT(context, IndexSet::emptySet());
-  for (size_t i = 0; i < digits.size(); i++) {
-    HELIB_NTIMER_START(KS_loop);
-    ai.randomize();
-    tmpDCRT = digits[i];
+// The digits are only read, as BasicAutomorphPrecon reuses them for every
+// automorphism. All of them are in memory at once, and so are the
+// pseudorandom ai's expanded for them, for the inner products over the
+// grid; keySwitchPart streams the digits of a single key switch instead.
+void Ctxt::keySwitchDigits(const KeySwitch& W,
+                           const std::vector<DoubleCRT>& digits)
+{
+  if (digits.empty()) {
+    countOp(OpType::KeySwitch);
+    return;
+  }
+  long digitPrimes = digits[0].getIndexSet().card();
+  countOp(OpType::KeySwitch, 1, digitPrimes);
+  countOp(OpType::Digit, digits.size(), digitPrimes);
 
-    // The operations below all use the IndexSet of tmpDCRT
+  // The inner products with the digits run over a grid of primes times
+  // blocks of columns, each cell summing over all the digits
+  DoubleCRT sum(context, IndexSet::emptySet());
 
-    // add digit*a[i] with a handle pointing to base of W.toKeyID
-    {
-      HELIB_NTIMER_START(KS_loop_1);
-      tmpDCRT.Mul(ai, /*matchIndexSet=*/false);
-    }
-    {
-      HELIB_NTIMER_START(KS_loop_2);
-      this->addPart(tmpDCRT, SKHandle(1, 1, W.toKeyID), /*matchPrimeSet=*/true);
-    }
-    // add digit*b[i] with a handle pointing to one
-    {
-      HELIB_NTIMER_START(KS_loop_3);
-      digits[i].Mul(W.b[i], /*matchIndexSet=*/false);
-    }
+  // add sum_i digit[i]*a[i] with a handle pointing to base of W.toKeyID
+  if (W.aPrecon.size() >= digits.size()) {
+    sum.innerProduct(digits, W.a, W.aPrecon); // kept expanded by W
+  } else {
+    // The pseudorandom ai's are expanded first, over the primes of the
+    // digits for a keyed seed. The other seeds come from one sequential PRG
+    // stream, and must be expanded over the primes of the bi's, else the
+    // PRG would go out of sync (see KeySwitchASampler).
+    const IndexSet& aPrimes = KeySwitchASampler::isKeyed(W.prgSeed)
+                                  ? digits[0].getIndexSet()
+                                  : W.b[0].getIndexSet();
+    std::vector<DoubleCRT> a(digits.size(), DoubleCRT(context, aPrimes));
     {
-      HELIB_NTIMER_START(KS_loop_4);
-      this->addPart(digits[i], SKHandle(), /*matchPrimeSet=*/true);
+      HELIB_NTIMER_START(KS_randomize);
+      KeySwitchASampler sampler(W.prgSeed);
+      for (DoubleCRT& ai : a)
+        sampler.next(ai);
     }
+    sum.innerProduct(digits, a);
   }
-} // restore random state upon destruction of the RandomState, see NumbTh.h
+  this->addPart(sum, SKHandle(1, 1, W.toKeyID), /*matchPrimeSet=*/true);
+
+  // add sum_i digit[i]*b[i] with a handle pointing to one
+  if (W.bPrecon.size() >= digits.size())
+    sum.innerProduct(digits, W.b, W.bPrecon);
+  else
+    sum.innerProduct(digits, W.b);
+  this->addPart(sum, SKHandle(), /*matchPrimeSet=*/true);
+}
 
 bool CtxtPart::operator==(const CtxtPart& other) const
 {
@@ -319,13 +360,19 @@ Ctxt& Ctxt::privateAssign(const Ctxt& other)
     return *this; // both point to the same object
 
   parts = other.parts;
+  privateAssignScalars(other);
+  return *this;
+}
+
+void Ctxt::privateAssignScalars(const Ctxt& other)
+{
   primeSet = other.primeSet;
   ptxtSpace = other.ptxtSpace;
   noiseBound = other.noiseBound;
   intFactor = other.intFactor;
   ratFactor = other.ratFactor;
   ptxtMag = other.ptxtMag;
-  return *this;
+  partSeed = other.partSeed;
 }
 
 // explicitly multiply intFactor by e, which should be
@@ -404,6 +451,7 @@ void Ctxt::modDownToSet(const IndexSet& s)
   IndexSet setDiff = primeSet / intersection; // set-minus
   if (empty(setDiff))
     return; // nothing to do, removing no primes
+  countOp(OpType::ModSwitch, 1, primeSet.card());
 
   // Scale down all the parts: use either a simple "drop down" (just removing
   // primes, i.e., reducing the ctxt modulo the smaller modulus), or a "real
@@ -464,22 +512,18 @@ void Ctxt::modDownToSet(const IndexSet& s)
     Warning("Ctxt::modDownToSet: DEGENERATE DROP");
   } else { // do real mod switching
 #if 1
-    NTL::ZZX delta;
-    NTL::ZZ diff = context.productOfPrimes(setDiff);
-    NTL::xdouble xdiff = NTL::conv<NTL::xdouble>(diff);
-
     long nparts = parts.size();
 
-    std::vector<std::vector<double>> fdeltas(nparts);
-    for (long i : range(nparts)) {
-      CtxtPart& part = parts[i];
-      std::vector<double>& fdelta = fdeltas[i];
-      part.scaleDownToSet(intersection, ptxtSpace, delta);
-      fdelta.resize(delta.rep.length());
-      for (long j : range(delta.rep.length())) {
-        fdelta[j] =
-            NTL::conv<double>(NTL::conv<NTL::xdouble>(delta.rep[j]) / xdiff);
+    // All the parts are switched together, in one parallel pass
+    std::vector<DoubleCRT*> partPtrs(nparts);
+    for (long i : range(nparts))
+      partPtrs[i] = &parts[i];
+    std::vector<std::vector<double>> fdeltas;
+    DoubleCRT::scaleDownToSet(partPtrs, intersection, ptxtSpace, &fdeltas);
 
+    for (long i : range(nparts)) {
+      const std::vector<double>& fdelta = fdeltas[i];
+      for (long j : range(fdelta.size())) {
         // sanity check: |fdelta[j]| <= ptxtSpace/2
         if (std::fabs(fdelta[j]) > double(ptxtSpace) / 2.0 + 0.0001) {
           std::stringstream ss;
@@ -490,25 +534,12 @@ void Ctxt::modDownToSet(const IndexSet& s)
       }
     }
 
-    std::vector<double> norms(nparts);
+    std::vector<double> norms;
     HELIB_NTIMER_START(AAA_modDownEnbeddings);
-#if 1
-    for (long i : range(nparts / 2)) {
-      // compute two for the price of one!
-      embeddingLargestCoeff_x2(norms[2 * i],
-                               norms[2 * i + 1],
-                               fdeltas[2 * i],
-                               fdeltas[2 * i + 1],
-                               context.getZMStar());
-    }
-    if (nparts % 2) {
-      norms[nparts - 1] =
-          embeddingLargestCoeff(fdeltas[nparts - 1], context.getZMStar());
-    }
-#else
+    std::vector<const std::vector<double>*> fdeltaPtrs(nparts);
     for (long i : range(nparts))
-      norms[i] = embeddingLargestCoeff(fdeltas[i], context.zMStar);
-#endif
+      fdeltaPtrs[i] = &fdeltas[i];
+    embeddingLargestCoeffs(norms, fdeltaPtrs, context.getZMStar());
     HELIB_NTIMER_STOP(AAA_modDownEnbeddings);
 
     NTL::xdouble addedNoise(0.0);
@@ -747,34 +778,72 @@ void Ctxt::reLinearize(long keyID)
 
   relin_CKKS_adjust();
 
+  // Look for a key-switching matrix to re-linearize every part that is not
+  // relative to 1 or base
+  std::vector<const KeySwitch*> matrices(parts.size(), nullptr);
+  for (long i : range(parts.size())) {
+    const CtxtPart& part = parts[i];
+    if (part.skHandle.isOne() || part.skHandle.isBase(keyID))
+      continue;
+    const KeySwitch& W = (keyID >= 0)
+                             ? pubKey.getKeySWmatrix(part.skHandle, keyID)
+                             : pubKey.getAnyKeySWmatrix(part.skHandle);
+
+    // verify that a switching matrix exists
+    assertTrue(W.toKeyID >= 0, "No key-switching matrix exists");
+    matrices[i] = &W;
+  }
+
+  // At the low levels, switch with the level variants of the matrices if
+  // they all use the same (smaller) set of special primes
+  IndexSet special = context.getSpecialPrimes();
+  if (!pubKey.levelKeySWlist().empty()) {
+    std::vector<const KeySwitch*> variants(parts.size(), nullptr);
+    IndexSet variantSpecial;
+    bool found = false, usable = true;
+    for (long i : range(parts.size())) {
+      if (matrices[i] == nullptr)
+        continue;
+      variants[i] = pubKey.getLevelKeySWmatrix(matrices[i]->fromKey,
+                                               matrices[i]->toKeyID,
+                                               primeSet);
+      if (variants[i] == nullptr ||
+          (found && variants[i]->specialPrimes() != variantSpecial)) {
+        usable = false;
+        break;
+      }
+      variantSpecial = variants[i]->specialPrimes();
+      found = true;
+    }
+    if (found && usable) {
+      matrices = variants;
+      special = variantSpecial;
+    }
+  }
+
   long g = ptxtSpace;
-  double logProd = context.logOfProduct(context.getSpecialPrimes());
+  double logProd = context.logOfProduct(special);
 
   Ctxt tmp(pubKey, ptxtSpace); // an empty ciphertext, same plaintext space
   tmp.intFactor = intFactor;   // same intFactor, too
   tmp.ptxtMag = ptxtMag;       // same CKKS plaintext size
   tmp.noiseBound = noiseBound * NTL::xexp(logProd); // The noise after mod-up
 
-  tmp.primeSet = primeSet | context.getSpecialPrimes();
+  tmp.primeSet = primeSet | special;
   // VJS-NOTE: added this to make addPart work
 
   tmp.ratFactor = ratFactor * NTL::xexp(logProd); // CKKS factor after mod-up
   // std::cerr << "=== " << ratFactor << tmp.ratFactor << "\n";
 
-  for (CtxtPart& part : parts) {
+  for (long i : range(parts.size())) {
+    CtxtPart& part = parts[i];
     // For a part relative to 1 or base,  only scale and add
-    if (part.skHandle.isOne() || part.skHandle.isBase(keyID)) {
-      part.addPrimesAndScale(context.getSpecialPrimes());
+    if (matrices[i] == nullptr) {
+      part.addPrimesAndScale(special);
       tmp.addPart(part, /*matchPrimeSet=*/true);
       continue;
     }
-    // Look for a key-switching matrix to re-linearize this part
-    const KeySwitch& W = (keyID >= 0)
-                             ? pubKey.getKeySWmatrix(part.skHandle, keyID)
-                             : pubKey.getAnyKeySWmatrix(part.skHandle);
-
-    // verify that a switching matrix exists
-    assertTrue(W.toKeyID >= 0, "No key-switching matrix exists");
+    const KeySwitch& W = *matrices[i];
 
     if (g > 1) { // g==1 for CKKS, g>1 for BGV
       tmp.reducePtxtSpace(W.ptxtSpace);
@@ -782,12 +851,185 @@ void Ctxt::reLinearize(long keyID)
       // VJS-NOTE: fixes a bug where intFactor was not corrected
     }
     tmp.keySwitchPart(part, W); // switch this part & update noiseBound
-    helib::nb_relin++;
+    countOp(OpType::Relinearization, 1, part.getIndexSet().card());
   }
   *this = tmp;
+
+  // A ciphertext holds all the special primes or none of them, so the
+  // special primes of a level variant are dropped right away
+  if (special != context.getSpecialPrimes())
+    modDownToSet(primeSet / special);
   // std::cerr << "====== " << ratFactor << "\n";
 }
 
+// The ciphertexts of a batched relinearization that switch a part over
+// the same primes with the same matrix
+namespace {
+struct RelinGroup
+{
+  const KeySwitch* W;
+  IndexSet primes;
+  std::vector<std::pair<Ctxt*, long>> members; // ciphertext, part to switch
+};
+
+// Ciphertexts switched together. Their digits are all held at once, so
+// the chunks are bounded.
+constexpr long RELIN_BATCH_CHUNK = 8;
+} // namespace
+
+void reLinearize(const std::vector<Ctxt*>& ctxts, long keyID)
+{
+  HELIB_TIMER_START;
+
+  std::vector<RelinGroup> groups;
+  for (Ctxt* ctxt : ctxts) {
+    if (ctxt == nullptr || ctxt->isEmpty() || ctxt->inCanonicalForm(keyID))
+      continue;
+    const PubKey& pubKey = ctxt->pubKey;
+
+    // A single part to switch, to the full matrix (the level variants are
+    // chosen for all the parts of a ciphertext together)
+    long toSwitch = -1, count = 0;
+    for (long i : range(ctxt->parts.size())) {
+      const SKHandle& handle = ctxt->parts[i].skHandle;
+      if (!handle.isOne() && !handle.isBase(keyID)) {
+        toSwitch = i;
+        count++;
+      }
+    }
+    if (count != 1 || !pubKey.levelKeySWlist().empty()) {
+      ctxt->reLinearize(keyID);
+      continue;
+    }
+
+    ctxt->dropSmallAndSpecialPrimes();
+    ctxt->relin_CKKS_adjust();
+    const SKHandle& handle = ctxt->parts[toSwitch].skHandle;
+    const KeySwitch& W = (keyID >= 0) ? pubKey.getKeySWmatrix(handle, keyID)
+                                      : pubKey.getAnyKeySWmatrix(handle);
+    assertTrue(W.toKeyID >= 0, "No key-switching matrix exists");
+
+    const IndexSet& primes = ctxt->parts[toSwitch].getIndexSet();
+    auto group = std::find_if(groups.begin(), groups.end(), [&](auto& g) {
+      return g.W == &W && g.primes == primes;
+    });
+    if (group == groups.end())
+      group = groups.insert(groups.end(), RelinGroup{&W, primes, {}});
+    group->members.emplace_back(ctxt, toSwitch);
+  }
+
+  for (const RelinGroup& group : groups) {
+    const KeySwitch& W = *group.W;
+    const Context& context = group.members[0].first->context;
+    const IndexSet& special = context.getSpecialPrimes();
+    IndexSet allPrimes = group.primes | special;
+    double logProd = context.logOfProduct(special);
+
+    // In the COMPACT mode the ai's are expanded once for the group, over
+    // the same primes as in keySwitchDigits
+    bool expandA = W.aPrecon.size() < W.b.size();
+    std::vector<DoubleCRT> a;
+    std::vector<const DoubleCRT*> aPtrs, bPtrs;
+    for (const DoubleCRT& bi : W.b)
+      bPtrs.push_back(&bi);
+
+    for (long first = 0; first < lsize(group.members);
+         first += RELIN_BATCH_CHUNK) {
+      long last = std::min(first + RELIN_BATCH_CHUNK, lsize(group.members));
+      long n = last - first;
+
+      std::vector<std::vector<DoubleCRT>> digits(n);
+      std::vector<NTL::xdouble> addedNoise(n);
+      for (long c : range(n)) {
+        const auto& [ctxt, i] = group.members[first + c];
+        addedNoise[c] = ctxt->parts[i].breakIntoDigits(digits[c], special);
+        assertTrue(digits[c].size() <= W.b.size(),
+                   "Too few columns in W for the digits");
+      }
+      long nDigits = digits[0].size();
+
+      if (expandA && a.empty()) {
+        const IndexSet& aPrimes = KeySwitchASampler::isKeyed(W.prgSeed)
+                                      ? allPrimes
+                                      : W.b[0].getIndexSet();
+        a.assign(nDigits, DoubleCRT(context, aPrimes));
+        HELIB_NTIMER_START(KS_randomize);
+        KeySwitchASampler sampler(W.prgSeed);
+        for (DoubleCRT& ai : a)
+          sampler.next(ai);
+        HELIB_NTIMER_STOP(KS_randomize);
+        for (const DoubleCRT& ai : a)
+          aPtrs.push_back(&ai);
+      } else if (!expandA && aPtrs.empty()) {
+        for (const DoubleCRT& ai : W.a)
+          aPtrs.push_back(&ai);
+      }
+
+      std::vector<std::vector<const DoubleCRT*>> operands(n);
+      std::vector<DoubleCRT> sumA(n, DoubleCRT(context, IndexSet::emptySet()));
+      std::vector<DoubleCRT> sumB(sumA);
+      std::vector<DoubleCRT*> sumAPtrs, sumBPtrs;
+      for (long c : range(n)) {
+        for (const DoubleCRT& digit : digits[c])
+          operands[c].push_back(&digit);
+        sumAPtrs.push_back(&sumA[c]);
+        sumBPtrs.push_back(&sumB[c]);
+      }
+      DoubleCRT::innerProducts(sumAPtrs,
+                               operands,
+                               aPtrs,
+                               expandA ? nullptr : &W.aPrecon);
+      DoubleCRT::innerProducts(sumBPtrs,
+                               operands,
+                               bPtrs,
+                               lsize(W.bPrecon) >= nDigits ? &W.bPrecon
+                                                           : nullptr);
+      digits.clear();
+
+      // The rest of Ctxt::reLinearize and Ctxt::keySwitchPart
+      for (long c : range(n)) {
+        Ctxt& ctxt = *group.members[first + c].first;
+        long toSwitch = group.members[first + c].second;
+        const CtxtPart& part = ctxt.parts[toSwitch];
+
+        Ctxt tmp(ctxt.pubKey, ctxt.ptxtSpace);
+        tmp.intFactor = ctxt.intFactor;
+        tmp.ptxtMag = ctxt.ptxtMag;
+        tmp.noiseBound = ctxt.noiseBound * NTL::xexp(logProd);
+        tmp.primeSet = ctxt.primeSet | special;
+        tmp.ratFactor = ctxt.ratFactor * NTL::xexp(logProd);
+        for (long i : range(ctxt.parts.size())) {
+          if (i == toSwitch)
+            continue;
+          CtxtPart other = ctxt.parts[i];
+          other.addPrimesAndScale(special);
+          tmp.addPart(other, /*matchPrimeSet=*/true);
+        }
+        if (ctxt.ptxtSpace > 1) // BGV
+          tmp.reducePtxtSpace(W.ptxtSpace);
+
+        countOp(keySwitchType(context.getZMStar(), part.skHandle),
+                1,
+                part.getIndexSet().card());
+        countOp(OpType::KeySwitch, 1, allPrimes.card());
+        countOp(OpType::Digit, nDigits, allPrimes.card());
+        tmp.addPart(sumA[c], SKHandle(1, 1, W.toKeyID), /*matchPrimeSet=*/true);
+        tmp.addPart(sumB[c], SKHandle(), /*matchPrimeSet=*/true);
+
+        NTL::xdouble noise = addedNoise[c] * W.noiseBound;
+        double ratio = NTL::conv<double>(noise / tmp.noiseBound);
+        HELIB_STATS_UPDATE("KS-noise-ratio", ratio);
+        if (ratio > 1)
+          Warning("KS-noise-ratio=" + std::to_string(ratio));
+        tmp.noiseBound += noise;
+
+        countOp(OpType::Relinearization, 1, part.getIndexSet().card());
+        ctxt = tmp;
+      }
+    }
+  }
+}
+
 Ctxt& Ctxt::cleanUp()
 {
   reLinearize();
@@ -804,7 +1046,7 @@ Ctxt& Ctxt::cleanUp()
 // (1,s), and adds the and result to *this.
 // It is assumed that the part p does not include any of the special
 // primes, and that if *this is not an empty ciphertext then its
-// primeSet is p.getIndexSet() \union context.specialPrimes
+// primeSet is p.getIndexSet() \union W.specialPrimes()
 void Ctxt::keySwitchPart(const CtxtPart& p, const KeySwitch& W)
 {
   HELIB_TIMER_START;
@@ -814,10 +1056,14 @@ void Ctxt::keySwitchPart(const CtxtPart& p, const KeySwitch& W)
       context.getSpecialPrimes().disjointFrom(p.getIndexSet()),
       "Special primes and CtxtPart's index set have non-empty intersection");
 
+  // The special primes of W, fewer than all of them for a level variant
+  IndexSet special =
+      W.isDummy() ? context.getSpecialPrimes() : W.specialPrimes();
+
   // For parts p that point to 1 or s, only scale and add
   if (p.skHandle.isOne() || p.skHandle.isBase(W.toKeyID)) {
     CtxtPart pp = p;
-    pp.addPrimesAndScale(context.getSpecialPrimes());
+    pp.addPrimesAndScale(special);
     addPart(pp, /*matchPrimeSet=*/true);
     return;
   }
@@ -826,12 +1072,56 @@ void Ctxt::keySwitchPart(const CtxtPart& p, const KeySwitch& W)
   // the handles must match
   assertEq(W.fromKey, p.skHandle, "Secret key handles do not match");
 
-  std::vector<DoubleCRT> polyDigits;
-  NTL::xdouble addedNoise = p.breakIntoDigits(polyDigits);
+  countOp(keySwitchType(context.getZMStar(), p.skHandle),
+          1,
+          p.getIndexSet().card());
+
+  // The digits are decomposed, extended to the special primes, multiplied
+  // by the columns of W and accumulated one at a time, so that no more than
+  // one of them exists at any time. All of these steps run on all threads.
+  IndexSet allPrimes = p.getIndexSet() | special;
+  DoubleCRT sumA(context, allPrimes), sumB(context, allPrimes);
+  DoubleCRT product(context, IndexSet::emptySet());
+
+  // In the COMPACT mode the ai's come one after the other from
+  // W.prgSeed, over the primes of the digits for a keyed seed. The other
+  // seeds must be expanded over the primes of the bi's, else the PRG would
+  // go out of sync (see KeySwitchASampler).
+  bool expandA = W.aPrecon.size() < W.b.size();
+  IndexSet aPrimes;
+  if (expandA)
+    aPrimes = KeySwitchASampler::isKeyed(W.prgSeed) ? allPrimes
+                                                     : W.b[0].getIndexSet();
+  DoubleCRT ai(context, aPrimes);
+  KeySwitchASampler sampler(W.prgSeed);
+
+  long nDigits = 0;
+  NTL::xdouble addedNoise =
+      p.forEachDigit(special, [&](long i, DoubleCRT& digit) {
+        assertTrue(i < (long)W.b.size(), "Too few columns in W for the digits");
+        product = digit;
+        if (expandA) {
+          HELIB_NTIMER_START(KS_randomize);
+          sampler.next(ai);
+          HELIB_NTIMER_STOP(KS_randomize);
+          product.Mul(ai, /*matchIndexSets=*/false);
+        } else
+          product.Mul(W.a[i], W.aPrecon[i]);
+        sumA.Add(product, /*matchIndexSets=*/false);
+
+        if ((long)W.bPrecon.size() > i)
+          digit.Mul(W.b[i], W.bPrecon[i]);
+        else
+          digit.Mul(W.b[i], /*matchIndexSets=*/false);
+        sumB.Add(digit, /*matchIndexSets=*/false);
+        nDigits++;
+      });
   addedNoise *= W.noiseBound;
 
-  // Finally we multiply the vector of digits by the key-switching matrix
-  keySwitchDigits(W, polyDigits);
+  countOp(OpType::KeySwitch, 1, allPrimes.card());
+  countOp(OpType::Digit, nDigits, allPrimes.card());
+  this->addPart(sumA, SKHandle(1, 1, W.toKeyID), /*matchPrimeSet=*/true);
+  this->addPart(sumB, SKHandle(), /*matchPrimeSet=*/true);
 
   double ratio = NTL::conv<double>(addedNoise / noiseBound);
 
@@ -920,7 +1210,7 @@ void Ctxt::addConstant(const DoubleCRT& dcrt, double size)
     f = balRem(f, ptxtSpace);
   }
 
-  noiseBound += size * std::abs(f);
+  xdoubleAddTo(noiseBound, size * std::abs(f));
 
   // VJS-NOTE: addPart will raise an exception
   // if the prime set of dcrt does not contain
@@ -947,6 +1237,15 @@ void Ctxt::addConstant(const NTL::ZZX& poly, double size)
   addConstant(DoubleCRT(poly, context, primeSet), size);
 }
 
+void Ctxt::addConstant(const zzX& poly, double size)
+{
+  if (size < 0 && !isCKKS()) {
+    size = embeddingLargestCoeff(poly, getContext().getZMStar());
+  }
+
+  addConstant(DoubleCRT(poly, context, primeSet), size);
+}
+
 // Add a constant polynomial for CKKS encryption. The 'size' argument is
 // a bound on the size of the content of the slots. If the factor is not
 // specified, we the default PAlgebraModCx::encodeScalingFactor()/size
@@ -1405,6 +1704,62 @@ static NTL::xdouble NoiseNorm(NTL::xdouble noise1,
   return noise1 * std::abs(balRem(e1, p)) + noise2 * std::abs(balRem(e2, p));
 }
 
+// Harmonize the integer factors f1, f2 of two ciphertexts that are added up
+static void harmonizeIntFactors(long& e1,
+                                long& e2,
+                                long f1,
+                                long f2,
+                                NTL::xdouble noise1,
+                                NTL::xdouble noise2,
+                                long ptxtSpace,
+                                long p)
+{
+  // set e1, e2 so that e1*f1 == e2*f2 (mod ptxtSpace),
+  // minimizing the increase in noise.
+
+  // f2/f1 so equivalently, we want e1 = e2*ratio (mod ptxtSpace)
+  long ratio = NTL::MulMod(f2, NTL::InvMod(f1, ptxtSpace), ptxtSpace);
+
+  // now we run the extended Euclidean on (ptxtSpace, ratio)
+  // to generate pairs (r_i, t_i) such that r_i = t_i*ratio (mod ptxtSpace).
+
+  long r0 = ptxtSpace, t0 = 0;
+  long r1 = ratio, t1 = 1;
+
+  long e1_best = r1, e2_best = t1;
+  NTL::xdouble noise_best =
+      NoiseNorm(noise1, noise2, e1_best, e2_best, ptxtSpace);
+
+  while (r1 != 0) {
+    long q = r0 / r1;
+    long r2 = r0 % r1;
+    long t2 = t0 - t1 * q;
+    r0 = r1;
+    r1 = r2;
+    t0 = t1;
+    t1 = t2;
+
+    long e1_try = mcMod(r1, ptxtSpace), e2_try = mcMod(t1, ptxtSpace);
+    if (e1_try % p != 0) {
+      NTL::xdouble noise_try =
+          NoiseNorm(noise1, noise2, e1_try, e2_try, ptxtSpace);
+      if (noise_try < noise_best) {
+        e1_best = e1_try;
+        e2_best = e2_try;
+        noise_best = noise_try;
+      }
+    }
+  }
+  e1 = e1_best;
+  e2 = e2_best;
+
+  assertEq(NTL::MulMod(e1, f1, ptxtSpace),
+           NTL::MulMod(e2, f2, ptxtSpace),
+           "e1f1 not equivalent to e2f2 mod p");
+  assertEq(NTL::GCD(e1, ptxtSpace), 1l, "e1 and ptxtSpace not co-prime");
+  assertEq(NTL::GCD(e2, ptxtSpace), 1l, "e2 and ptxtSpace not co-prime");
+}
+
 // Add/subtract another ciphertext (depending on the negative flag)
 void Ctxt::addCtxt(const Ctxt& other, bool negative)
 {
@@ -1475,58 +1830,15 @@ void Ctxt::addCtxt(const Ctxt& other, bool negative)
     equalizeRationalFactors(*this, tmp);
   }
   long e1 = 1, e2 = 1;
-  if (!isCKKS() && intFactor != other_pt->intFactor) { // harmonize factors
-    long f1 = intFactor;
-    long f2 = other_pt->intFactor;
-    // set e1, e2 so that e1*f1 == e2*f2 (mod ptxtSpace),
-    // minimizing the increase in noise.
-
-    // f2/f1 so equivalently, we want e1 = e2*ratio (mod ptxtSpace)
-    long ratio = NTL::MulMod(f2, NTL::InvMod(f1, ptxtSpace), ptxtSpace);
-
-    NTL::xdouble noise1 = noiseBound;
-    NTL::xdouble noise2 = other_pt->noiseBound;
-
-    // now we run the extended Euclidean on (ptxtSpace, ratio)
-    // to generate pairs (r_i, t_i) such that r_i = t_i*ratio (mod ptxtSpace).
-
-    long r0 = ptxtSpace, t0 = 0;
-    long r1 = ratio, t1 = 1;
-
-    long e1_best = r1, e2_best = t1;
-    NTL::xdouble noise_best =
-        NoiseNorm(noise1, noise2, e1_best, e2_best, ptxtSpace);
-    long p = context.getP();
-
-    while (r1 != 0) {
-      long q = r0 / r1;
-      long r2 = r0 % r1;
-      long t2 = t0 - t1 * q;
-      r0 = r1;
-      r1 = r2;
-      t0 = t1;
-      t1 = t2;
-
-      long e1_try = mcMod(r1, ptxtSpace), e2_try = mcMod(t1, ptxtSpace);
-      if (e1_try % p != 0) {
-        NTL::xdouble noise_try =
-            NoiseNorm(noise1, noise2, e1_try, e2_try, ptxtSpace);
-        if (noise_try < noise_best) {
-          e1_best = e1_try;
-          e2_best = e2_try;
-          noise_best = noise_try;
-        }
-      }
-    }
-    e1 = e1_best;
-    e2 = e2_best;
-
-    assertEq(NTL::MulMod(e1, f1, ptxtSpace),
-             NTL::MulMod(e2, f2, ptxtSpace),
-             "e1f1 not equivalent to e2f2 mod p");
-    assertEq(NTL::GCD(e1, ptxtSpace), 1l, "e1 and ptxtSpace not co-prime");
-    assertEq(NTL::GCD(e2, ptxtSpace), 1l, "e2 and ptxtSpace not co-prime");
-  }
+  if (!isCKKS() && intFactor != other_pt->intFactor) // harmonize factors
+    harmonizeIntFactors(e1,
+                        e2,
+                        intFactor,
+                        other_pt->intFactor,
+                        noiseBound,
+                        other_pt->noiseBound,
+                        ptxtSpace,
+                        context.getP());
 
   if (e2 != 1) {
     if (other_pt != &tmp) {
@@ -1554,8 +1866,215 @@ void Ctxt::addCtxt(const Ctxt& other, bool negative)
         parts.back().Negate();
     }
   }
-  ptxtMag += other_pt->ptxtMag;
-  noiseBound += other_pt->noiseBound;
+  xdoubleAddTo(ptxtMag, other_pt->ptxtMag);
+  xdoubleAddTo(noiseBound, other_pt->noiseBound);
+}
+
+// Add c * other, same result as multByConstant on a copy of other followed
+// by addCtxt, but without the copy if the ciphertexts are compatible
+void Ctxt::addScaledCtxt(const Ctxt& other, const NTL::ZZ& c)
+{
+  HELIB_TIMER_START;
+
+  assertEq(&context, &other.context, "Context mismatch");
+  assertEq(&pubKey, &other.pubKey, "Public key mismatch");
+
+  if (other.isEmpty())
+    return;
+
+  // Anything that needs the ciphertexts to be matched first
+  // takes the general route
+  if (isCKKS() || this->isEmpty() || ptxtSpace != other.ptxtSpace ||
+      primeSet != other.primeSet) {
+    Ctxt tmp(other);
+    tmp.multByConstant(c);
+    addCtxt(tmp);
+    return;
+  }
+
+  long c0 = rem(c, ptxtSpace);
+  if (c0 == 0)
+    return;
+  addScaledParts(other, c0, 1);
+}
+
+void Ctxt::addScaledParts(const Ctxt& other, long c0, long divisor)
+{
+  // Write c0 = c1 * d with d | ptxtSpace, as multByConstant does: the c1
+  // part only changes the integer factor of other, the d part scales it
+  long d = NTL::GCD(c0, ptxtSpace);
+  long c1_inv = NTL::InvMod(c0 / d, ptxtSpace);
+  long f2 = NTL::MulMod(other.intFactor, c1_inv, ptxtSpace);
+  long bal_d = balRem(d, ptxtSpace);
+  NTL::xdouble noise2 = other.noiseBound * std::abs(bal_d);
+
+  long e1 = 1, e2 = 1;
+  if (intFactor != f2)
+    harmonizeIntFactors(e1,
+                        e2,
+                        intFactor,
+                        f2,
+                        noiseBound,
+                        noise2,
+                        ptxtSpace,
+                        context.getP());
+  long bal_e1 = balRem(e1, ptxtSpace);
+  long bal_e2 = balRem(e2, ptxtSpace);
+  long otherFactor = bal_e2 * bal_d; // |bal_e2|, |bal_d| <= ptxtSpace/2
+
+  // Scale and add the parts in one go, parts that have no counterpart
+  // are only scaled (by bal_e1 resp. otherFactor, divided by divisor)
+  auto scaled = [&](long factor) {
+    NTL::ZZ Q, result;
+    context.productOfPrimes(Q, primeSet);
+    NTL::InvMod(result, NTL::to_ZZ(divisor) % Q, Q);
+    NTL::MulMod(result, result, NTL::to_ZZ(factor) % Q, Q);
+    return result;
+  };
+  std::vector<bool> done(parts.size(), bal_e1 == 1 && divisor == 1);
+  for (const CtxtPart& part : other.parts) {
+    long j = getPartIndexByHandle(part.skHandle);
+    if (j >= 0) {
+      parts[j].addScaled(part, otherFactor, bal_e1, divisor);
+      done[j] = true;
+    } else {
+      parts.push_back(part);
+      parts.back() *= (divisor == 1) ? NTL::to_ZZ(otherFactor)
+                                     : scaled(otherFactor);
+      done.push_back(true);
+    }
+  }
+  for (long j : range(done.size()))
+    if (!done[j])
+      parts[j] *= scaled(bal_e1);
+
+  intFactor = NTL::MulMod(intFactor, e1, ptxtSpace);
+  noiseBound = (noiseBound * std::abs(bal_e1) + noise2 * std::abs(bal_e2)) /
+               divisor;
+  ptxtMag += other.ptxtMag;
+}
+
+void Ctxt::subtractAndDivideByP(const Ctxt& other)
+{
+  HELIB_TIMER_START;
+
+  assertEq(&context, &other.context, "Context mismatch");
+  assertEq(&pubKey, &other.pubKey, "Public key mismatch");
+
+  // Anything that needs the ciphertexts to be matched first
+  // takes the general route
+  if (isCKKS() || this->isEmpty() || other.isEmpty() ||
+      ptxtSpace != other.ptxtSpace || primeSet != other.primeSet) {
+    addCtxt(other, /*negative=*/true);
+    divideByP();
+    return;
+  }
+
+  long p = context.getP();
+  assertEq(ptxtSpace % p, 0l, "p must divide ptxtSpace");
+  assertTrue(ptxtSpace > p, "ptxtSpace must be strictly greater than p");
+
+  // Subtracting is adding -1 * other, the division by p is folded into
+  // the factors of the parts
+  addScaledParts(other, ptxtSpace - 1, p);
+  ptxtSpace /= p;         // the plaintext space is reduced by a p factor
+  intFactor %= ptxtSpace; // adjust intFactor
+}
+
+void subtractAndDivideByP(const std::vector<Ctxt*>& targets, const Ctxt& digit)
+{
+  HELIB_TIMER_START;
+
+  HELIB_EXEC_RANGE(long(targets.size()), first, last)
+  for (long i = first; i < last; i++)
+    targets[i]->subtractAndDivideByP(digit);
+  HELIB_EXEC_RANGE_END
+}
+
+void linearCombination(Ctxt& result,
+                       const Ctxt* ctxts,
+                       const NTL::ZZ* coeffs,
+                       long n)
+{
+  HELIB_TIMER_START;
+
+  bool first = true;
+  for (long i : range(n)) {
+    if (coeffs[i] == 0)
+      continue;
+    if (first) {
+      result = ctxts[i];
+      result.multByConstant(coeffs[i]);
+      first = false;
+    } else {
+      result.addScaledCtxt(ctxts[i], coeffs[i]);
+    }
+  }
+  if (first)
+    result.clear();
+}
+
+void linearCombination(Ctxt& result,
+                       const std::vector<const Ctxt*>& ctxts,
+                       const std::vector<const DoubleCRT*>& constants,
+                       const std::vector<double>& sizes)
+{
+  HELIB_TIMER_START;
+
+  long n = ctxts.size();
+  assertTrue(n > 0, "Empty linear combination");
+  assertEq(long(constants.size()), n, "Size mismatch in linearCombination");
+  assertEq(long(sizes.size()), n, "Size mismatch in linearCombination");
+
+  const Ctxt& first = *ctxts[0];
+  bool fused = !first.isCKKS();
+  for (long t : range(n)) {
+    const Ctxt& c = *ctxts[t];
+    assertTrue(&c != &result, "linearCombination: result is an operand");
+    fused = fused && !c.isEmpty() && c.primeSet == first.primeSet &&
+            c.ptxtSpace == first.ptxtSpace && c.intFactor == first.intFactor &&
+            c.parts.size() == first.parts.size() &&
+            first.primeSet <= constants[t]->getIndexSet();
+    for (long k = 0; fused && k < long(c.parts.size()); k++)
+      fused = c.parts[k].skHandle == first.parts[k].skHandle;
+  }
+
+  if (!fused) {
+    Ctxt sum(ZeroCtxtLike, first);
+    Ctxt tmp(ZeroCtxtLike, first);
+    for (long t : range(n)) {
+      tmp = *ctxts[t];
+      tmp.multByConstant(*constants[t], sizes[t]);
+      sum += tmp;
+    }
+    result = std::move(sum);
+    return;
+  }
+
+  // The noise of every term is scaled as in multByConstant, and the terms
+  // have the same integer factor so that their noise bounds just add up
+  const Context& context = first.getContext();
+  Ctxt sum(ZeroCtxtLike, first);
+  sum.primeSet = first.primeSet;
+  sum.intFactor = first.intFactor;
+  for (long t : range(n)) {
+    double size = sizes[t];
+    if (size < 0.0)
+      size = context.noiseBoundForMod(first.ptxtSpace, context.getPhiM());
+    NTL::xdouble term = ctxts[t]->noiseBound;
+    xdoubleMulBy(term, size);
+    xdoubleAddTo(sum.noiseBound, term);
+  }
+
+  std::vector<const DoubleCRT*> a(n);
+  for (long k : range(first.parts.size())) {
+    for (long t : range(n))
+      a[t] = &ctxts[t]->parts[k];
+    CtxtPart part(context, sum.primeSet, first.parts[k].skHandle);
+    part.innerProduct(a, constants);
+    sum.parts.push_back(std::move(part));
+  }
+  result = std::move(sum);
 }
 
 // long fhe_disable_intFactor = 0;
@@ -1565,6 +2084,7 @@ void Ctxt::addCtxt(const Ctxt& other, bool negative)
 // It is also assumed that *this DOES NOT alias neither c1 nor c2.
 void Ctxt::tensorProduct(const Ctxt& c1, const Ctxt& c2)
 {
+  countOp(OpType::TensorProduct, 1, c1.primeSet.card());
   clear();                // clear *this, before we start adding things to it
   primeSet = c1.primeSet; // set the correct prime-set before we begin
 
@@ -1576,6 +2096,11 @@ void Ctxt::tensorProduct(const Ctxt& c1, const Ctxt& c2)
     intFactor = NTL::MulMod(intFactor, q, ptxtSp);
   }
 
+  // The product of two canonical ciphertexts has parts for 1, s and s^2,
+  // make room for them at once rather than growing the vector part by part
+  if (!c1.parts.empty() && !c2.parts.empty())
+    parts.reserve(c1.parts.size() + c2.parts.size() - 1);
+
   // The actual tensoring
   CtxtPart tmpPart(context, IndexSet::emptySet()); // a scratch CtxtPart
   for (long i : range(c1.parts.size())) {
@@ -1680,8 +2205,84 @@ IndexSet Ctxt::naturalPrimeSet() const
   return context.getModSizeTable().getSet4Size(lo, hi, primeSet, isCKKS());
 }
 
+void Ctxt::dropToNaturalPrimeSet()
+{
+  // Right after a drop the noise is at most 1.5 times the added noise, and
+  // dropping again would only lose capacity
+  if (isEmpty() || noiseBound <= 2.0 * modSwitchAddedNoiseBound())
+    return;
+  IndexSet s = naturalPrimeSet();
+  if (!empty(s) && s <= primeSet && s != primeSet)
+    modDownToSet(s);
+}
+
+void Ctxt::dropToDecryptionPrimeSet()
+{
+  IndexSet candidates = primeSet / context.getSpecialPrimes();
+  if (isEmpty() || empty(candidates))
+    return;
+
+  // Switching from q to q' gives the noise N*q'/q + A, for the noise bound N
+  // and the added noise A. Decryption needs (N*q'/q + A)*bnd <= 0.48*q', which
+  // we ask for with one bit to spare, so q' must be at least A*bnd/c for
+  // c = 0.24 - N*bnd/q. Without a positive c not even q itself is safe.
+  double logQ = logOfPrimeSet();
+  double bnd = decryptionNormBound(context);
+  NTL::xdouble addedNoise = modSwitchAddedNoiseBound();
+  NTL::xdouble c = 0.24 - totalNoiseBound() * bnd / NTL::xexp(logQ);
+  if (c <= 0.0)
+    return;
+  double low = log(addedNoise * bnd) - log(c);
+
+  // For CKKS the scaled noise must also stay 3 bits above the added noise,
+  // which keeps the precision loss of the switch under a bit
+  if (isCKKS() && noiseBound > 0.0)
+    low = std::max(low,
+                   log(addedNoise) + 3 * log(2.0) + logQ - log(noiseBound));
+
+  // Drop the largest primes first, as long as the rest is large enough
+  std::vector<long> order;
+  for (long i : candidates)
+    order.push_back(i);
+  std::sort(order.begin(), order.end(), [this](long i, long j) {
+    return context.logOfPrime(i) > context.logOfPrime(j);
+  });
+  IndexSet target = candidates;
+  double logTarget = context.logOfProduct(target);
+  for (long i : order) {
+    if (target.card() > 1 && logTarget - context.logOfPrime(i) >= low) {
+      target.remove(i);
+      logTarget -= context.logOfPrime(i);
+    }
+  }
+
+  if (target != primeSet)
+    modDownToSet(target);
+}
+
 // Low-level multiply routine. It does not include re-linearization.
 void Ctxt::multLowLvl(const Ctxt& other_orig, bool destructive)
+{
+  multLowLvl(other_orig, destructive, /*relinearize=*/false);
+}
+
+// The matrix for a fused tensor product and relinearization of c1 and c2,
+// nullptr if reLinearize() would do anything beyond switching the s^2 part
+static const KeySwitch* fusedRelinMatrix(const Ctxt& c1, const Ctxt& c2)
+{
+  const Context& context = c1.getContext();
+  if (c1.isCKKS() || c1.getPrimeSet() != c2.getPrimeSet() ||
+      !(c1.getPrimeSet() <= context.getCtxtPrimes()))
+    return nullptr;
+  // Exactly (1, s) with the key of reLinearize()
+  for (const Ctxt* c : {&c1, &c2})
+    if (!c->inCanonicalForm(0) || c->getPowerOfS() != 1)
+      return nullptr;
+  const KeySwitch& W = c1.getPubKey().getKeySWmatrix(SKHandle(2, 1, 0), 0);
+  return (W.toKeyID >= 0) ? &W : nullptr;
+}
+
+void Ctxt::multLowLvl(const Ctxt& other_orig, bool destructive, bool relinearize)
 {
   HELIB_TIMER_START;
 
@@ -1748,78 +2349,194 @@ void Ctxt::multLowLvl(const Ctxt& other_orig, bool destructive)
     other_pt->bringToSet(commonPrimeSet);
   }
 
-  // Perform the actual tensor product
+  // Perform the actual tensor product, fused with the relinearization when
+  // the s^2 part is all there is to switch
+  if (relinearize) {
+    const KeySwitch* W = fusedRelinMatrix(*this, *other_pt);
+    if (W) {
+      tensorProductRelin(*other_pt, *W);
+      return;
+    }
+  }
   Ctxt tmpCtxt(pubKey, ptxtSpace);
   tmpCtxt.tensorProduct(*this, *other_pt);
   *this = tmpCtxt;
+  if (relinearize)
+    reLinearize();
+}
+
+void Ctxt::tensorProductRelin(const Ctxt& other, const KeySwitch& W)
+{
+  HELIB_TIMER_START;
+  countOp(OpType::TensorProduct, 1, primeSet.card());
+
+  // The bookkeeping of tensorProduct into a fresh ciphertext
+  if (ptxtSpace > 2) {
+    long q = rem(context.productOfPrimes(primeSet), ptxtSpace);
+    intFactor = NTL::MulMod(intFactor, other.intFactor, ptxtSpace);
+    intFactor = NTL::MulMod(intFactor, q, ptxtSpace);
+  } else
+    intFactor = 1;
+  noiseBound *= other.noiseBound;
+  ratFactor = ptxtMag = 1.0;
+
+  // (a0 + a1 s)(b0 + b1 s) = a0 b0 + (a0 b1 + a1 b0) s + a1 b1 s^2, the first
+  // two parts are computed in place
+  CtxtPart& a0 = parts[0];
+  CtxtPart& a1 = parts[1];
+  CtxtPart square(a1);
+  if (this == &other) {
+    square *= a1;
+    a1 *= a0;
+    a1 += a1;
+    a0 *= a0;
+  } else {
+    const CtxtPart& b0 = other.parts[0];
+    const CtxtPart& b1 = other.parts[1];
+    square *= b1;
+    CtxtPart cross(a0);
+    cross *= b1;
+    a0 *= b0;
+    a1 *= b0;
+    a1 += cross;
+  }
+  square.skHandle = W.fromKey;
+
+  // What reLinearize does for (1, s, s^2): mod up, then switch the s^2 part
+  const IndexSet& specialPrimes = context.getSpecialPrimes();
+  NTL::xdouble scale = NTL::xexp(context.logOfProduct(specialPrimes));
+  noiseBound *= scale;
+  ratFactor *= scale;
+  primeSet = primeSet | specialPrimes;
+  a0.addPrimesAndScale(specialPrimes);
+  a1.addPrimesAndScale(specialPrimes);
+  if (ptxtSpace > 1)
+    reducePtxtSpace(W.ptxtSpace);
+  keySwitchPart(square, W);
+  countOp(OpType::Relinearization, 1, square.getIndexSet().card());
 }
 
 // Higher-level multiply routines that include also modulus-switching
 // and re-linearization
 
-void Ctxt::multiplyBy(const Ctxt& other)
+// Bootstrap the operands of levels levels of products that the refresh
+// policy of the context asks for. An other that is not ctxt is bootstrapped
+// in copy, the operand to use in its place is returned.
+static const Ctxt& refreshOperand(Ctxt& ctxt,
+                                  const Ctxt& other,
+                                  long levels,
+                                  std::unique_ptr<Ctxt>& copy)
+{
+  const RefreshPolicy* policy = ctxt.getContext().getRefreshPolicy();
+  if (!policy || RefreshPolicy::suspended())
+    return other;
+  bool refreshOther = (&other != &ctxt) && policy->needsRefresh(other, levels);
+  if (policy->needsRefresh(ctxt, levels))
+    policy->refresh(ctxt);
+  if (!refreshOther)
+    return other;
+  copy.reset(new Ctxt(other));
+  policy->refresh(*copy);
+  return *copy;
+}
+
+void Ctxt::multiplyBy(const Ctxt& other_orig)
 {
   HELIB_TIMER_START;
   // Special case: if *this is empty then do nothing
   if (this->isEmpty())
     return;
 
-  if (other.isEmpty()) {
-    *this = other;
+  if (other_orig.isEmpty()) {
+    *this = other_orig;
     return;
   }
 
-  this->multLowLvl(other); // perform the multiplication
-  reLinearize();           // re-linearize
+  std::unique_ptr<Ctxt> refreshed;
+  const Ctxt& other = refreshOperand(*this, other_orig, 1, refreshed);
+
+  // perform the multiplication and re-linearize
+  this->multLowLvl(other,
+                   /*destructive=*/refreshed != nullptr,
+                   /*relinearize=*/true);
 #ifdef HELIB_DEBUG
   checkNoise(*this, *dbgKey, "reLinearize " + std::to_string(size_t(this)));
 #endif
 }
 
-void Ctxt::customMultiplyBy(Ctxt& other, bool lazy)
+// Can the product of a and b be relinearized with matrices up to s^maxPower?
+// Two canonical ciphertexts can always be multiplied
+static bool canRelinearizeProduct(const Ctxt& a, const Ctxt& b, long maxPower)
 {
-  if (lazy) {
-    HELIB_TIMER_START;
-
-    // Relinearize both (just in case)
-    this->reLinearize();
-    other.reLinearize();
+  long powerA = a.getPowerOfS(), powerB = b.getPowerOfS();
+  return powerA >= 0 && powerB >= 0 && powerA + powerB <= std::max(maxPower, 2L);
+}
 
-    // Special case: if *this is empty then do nothing
-    if (this->isEmpty())
-      return;
+void Ctxt::multiplyBy(const Ctxt& other_orig, RelinPolicy policy)
+{
+  HELIB_TIMER_START;
+  // Special case: if *this is empty then do nothing
+  if (this->isEmpty())
+    return;
 
-    if (other.isEmpty()) {
-      *this = other;
-      return;
-    }
+  if (other_orig.isEmpty()) {
+    *this = other_orig;
+    return;
+  }
 
-    this->multLowLvl(other); // perform the multiplication
-#ifdef HELIB_DEBUG
-    checkNoise(*this, *dbgKey, "reLinearize " + std::to_string(size_t(this)));
-#endif
+  std::unique_ptr<Ctxt> refreshed;
+  const Ctxt& other = refreshOperand(*this, other_orig, 1, refreshed);
+
+  // The operands stay extended as long as the public key can relinearize
+  // their product, e.g. (1,s,s^2) * (1,s) with an s^3 matrix
+  long maxPower = pubKey.maxRelinPower(getKeyID());
+  if (!canRelinearizeProduct(*this, other, maxPower))
+    reLinearize();
+  bool eager = (policy == RelinPolicy::Eager);
+  if (!canRelinearizeProduct(*this, other, maxPower)) {
+    Ctxt tmp(other);
+    tmp.reLinearize();
+    this->multLowLvl(tmp, /*destructive=*/true, eager);
   } else {
-    multiplyBy(other);
+    this->multLowLvl(other, /*destructive=*/false, eager);
   }
+#ifdef HELIB_DEBUG
+  checkNoise(*this, *dbgKey, "reLinearize " + std::to_string(size_t(this)));
+#endif
+}
+
+void Ctxt::customMultiplyBy(Ctxt& other, RelinPolicy policy)
+{
+  // Relinearize other in place if multiplyBy would do it in a copy
+  if (!canRelinearizeProduct(*this, other, pubKey.maxRelinPower(getKeyID())))
+    other.reLinearize();
+  multiplyBy(other, policy);
 }
 
-void Ctxt::multiplyBy2(const Ctxt& other1, const Ctxt& other2)
+void Ctxt::multiplyBy2(const Ctxt& other1_orig, const Ctxt& other2_orig)
 {
   HELIB_TIMER_START;
   // Special case: if *this is empty then do nothing
   if (this->isEmpty())
     return;
 
-  if (other1.isEmpty()) {
-    *this = other1;
+  if (other1_orig.isEmpty()) {
+    *this = other1_orig;
     return;
   }
 
-  if (other2.isEmpty()) {
-    *this = other2;
+  if (other2_orig.isEmpty()) {
+    *this = other2_orig;
     return;
   }
 
+  // Any operand may go through both products
+  std::unique_ptr<Ctxt> refreshed1, refreshed2;
+  const Ctxt& other1 = refreshOperand(*this, other1_orig, 2, refreshed1);
+  const Ctxt& other2 = (&other2_orig == &other1_orig)
+                           ? other1
+                           : refreshOperand(*this, other2_orig, 2, refreshed2);
+
   double cap = capacity();
   double cap1 = other1.capacity();
   double cap2 = other2.capacity();
@@ -1879,10 +2596,35 @@ void Ctxt::multByConstant(const DoubleCRT& dcrt, double size)
   }
 
   // multiply all the parts by this constant
+  countOp(OpType::ScalarMult, 1, primeSet.card());
   for (long i : range(parts.size()))
     parts[i].Mul(dcrt, /*matchIndexSets=*/false);
 
-  noiseBound *= size;
+  xdoubleMulBy(noiseBound, size);
+}
+
+void Ctxt::multByConstant(const DoubleCRT& dcrt,
+                          const DoubleCRTPrecon& dcrtPrecon,
+                          double size)
+{
+  HELIB_TIMER_START;
+  if (this->isEmpty())
+    return;
+
+  if (isCKKS()) {
+    multByConstantCKKS(dcrt, NTL::to_xdouble(size));
+    return;
+  }
+
+  if (size < 0.0) {
+    size = context.noiseBoundForMod(ptxtSpace, getContext().getPhiM());
+  }
+
+  countOp(OpType::ScalarMult, 1, primeSet.card());
+  for (long i : range(parts.size()))
+    parts[i].Mul(dcrt, dcrtPrecon);
+
+  xdoubleMulBy(noiseBound, size);
 }
 
 void Ctxt::multByConstant(const NTL::ZZX& poly, double size)
@@ -1911,6 +2653,80 @@ void Ctxt::multByConstant(const zzX& poly, double size)
   multByConstant(dcrt, size);
 }
 
+std::vector<DoubleCRTPrecon> Ctxt::partsPrecon() const
+{
+  std::vector<DoubleCRTPrecon> precon;
+  for (const CtxtPart& part : parts)
+    precon.emplace_back(part);
+  return precon;
+}
+
+void Ctxt::setToInnerProduct(const Ctxt& ekey,
+                             const std::vector<DoubleCRTPrecon>& ekeyPrecon,
+                             const zzX& a,
+                             const zzX& b)
+{
+  HELIB_TIMER_START;
+  assertEq(&pubKey, &ekey.pubKey, "Cannot assign Ctxts with different pubKey");
+  assertTrue(&ekey != this, "setToInnerProduct: *this is the key");
+  assertTrue(ekeyPrecon.empty() || ekeyPrecon.size() == ekey.parts.size(),
+             "setToInnerProduct: companions do not match the key");
+
+  // Everything but the parts is taken from ekey
+  privateAssignScalars(ekey);
+
+  if (ekey.isEmpty() || ekey.isCKKS()) {
+    parts = ekey.parts;
+    multByConstant(a);
+    addConstant(b);
+    return;
+  }
+
+  std::vector<double> aa, bb;
+  convert(aa, a);
+  convert(bb, b);
+  double aSize, bSize;
+  embeddingLargestCoeff_x2(aSize, bSize, aa, bb, context.getZMStar());
+
+  // The scaling of b, as in addConstant
+  long f = 1;
+  if (ptxtSpace > 2) {
+    f = rem(context.productOfPrimes(primeSet), ptxtSpace);
+    f = NTL::MulMod(intFactor, f, ptxtSpace);
+    f = balRem(f, ptxtSpace);
+  }
+  noiseBound = noiseBound * aSize + bSize * std::abs(f);
+
+  DoubleCRT aDcrt(context, IndexSet::emptySet());
+  DoubleCRT bDcrt(context, IndexSet::emptySet());
+  DoubleCRT::fromPolys({&aDcrt, &bDcrt}, {&a, &b}, primeSet);
+
+  // b goes only to the first part that points to one
+  long one = -1;
+  for (long k : range(ekey.parts.size()))
+    if (ekey.parts[k].skHandle.isOne()) {
+      one = k;
+      break;
+    }
+
+  static const DoubleCRTPrecon noPrecon;
+  parts.resize(ekey.parts.size(), CtxtPart(context, IndexSet::emptySet()));
+  for (long k : range(parts.size())) {
+    parts[k].skHandle = ekey.parts[k].skHandle;
+    parts[k].setMulAdd(ekey.parts[k],
+                       ekeyPrecon.empty() ? noPrecon : ekeyPrecon[k],
+                       aDcrt,
+                       bDcrt,
+                       (k == one) ? f : 0);
+  }
+
+  if (one < 0) {
+    if (f != 1)
+      bDcrt *= f;
+    addPart(bDcrt, SKHandle(0, 1, 0));
+  }
+}
+
 void Ctxt::multByConstantCKKS(const std::vector<std::complex<double>>& other)
 {
   // VJS-FIXME: this routine has a number of issues and should
@@ -1963,6 +2779,7 @@ void Ctxt::multByConstantCKKS(const DoubleCRT& dcrt,
   ratFactor *= factor;
 
   // multiply all the parts by this constant
+  countOp(OpType::ScalarMult, 1, primeSet.card());
   for (auto& part : parts)
     part.Mul(dcrt, /*matchIndexSets=*/false);
 }
@@ -1990,6 +2807,14 @@ void Ctxt::multByConstant(const EncodedPtxt& eptxt)
   multByConstant(feptxt);
 }
 
+void Ctxt::multByConstant(const PreparedPtxt& ptxt)
+{
+  // Special case: if *this is empty then do nothing
+  if (this->isEmpty())
+    return;
+  multByConstant(ptxt.expand(primeSet));
+}
+
 void Ctxt::multByConstant(const FatEncodedPtxt& feptxt)
 {
   if (feptxt.isBGV())
@@ -2022,10 +2847,11 @@ void Ctxt::multByConstant(const FatEncodedPtxt_BGV& ptxt)
   }
 
   // multiply all the parts by this constant
+  countOp(OpType::ScalarMult, 1, primeSet.card());
   for (long i : range(parts.size()))
     parts[i].Mul(dcrt, /*matchIndexSets=*/false);
 
-  noiseBound *= size;
+  xdoubleMulBy(noiseBound, size);
 }
 
 void Ctxt::multByConstant(const FatEncodedPtxt_CKKS& ptxt)
@@ -2055,10 +2881,36 @@ void Ctxt::multByConstant(const FatEncodedPtxt_CKKS& ptxt)
   ratFactor *= scale;
 
   // multiply all the parts by this constant
+  countOp(OpType::ScalarMult, 1, primeSet.card());
   for (auto& part : parts)
     part.Mul(dcrt, /*matchIndexSets=*/false);
 }
 
+// The residues of c modulo the primes in s, indexed by prime index. The ZZ
+// is reduced once per prime, and the result is shared by all the parts of a
+// ciphertext. The vector is reused between calls on the same thread.
+static const std::vector<long>& scalarResidues(const Context& context,
+                                               const NTL::ZZ& c,
+                                               const IndexSet& s)
+{
+  thread_local std::vector<long> residues;
+  residues.assign(empty(s) ? 0 : s.last() + 1, 0);
+  for (long i : s)
+    residues[i] = rem(c, context.ithPrime(i));
+  return residues;
+}
+
+// The product of the primes in s modulo q, without computing it as a ZZ
+static long productOfPrimesMod(const Context& context,
+                               const IndexSet& s,
+                               long q)
+{
+  long prod = 1 % q;
+  for (long i : s)
+    prod = NTL::MulMod(prod, context.ithPrime(i) % q, q);
+  return prod;
+}
+
 // Mul by a scalar constant
 void Ctxt::multByConstant(const NTL::ZZ& c)
 {
@@ -2089,12 +2941,17 @@ void Ctxt::multByConstant(const NTL::ZZ& c)
       return;
 
     long cc = balRem(d, ptxtSpace);
-    noiseBound *= std::abs(cc);
-
-    // multiply all the parts by this constant
-    NTL::ZZ c_copy(cc);
+    xdoubleMulBy(noiseBound, std::abs(cc));
+
+    // multiply all the parts by this constant, a plain scalar multiply of
+    // every row by the residue of cc modulo its prime
+    IndexSet s;
+    for (const auto& part : parts)
+      s.insert(part.getIndexSet());
+    const std::vector<long>& residues =
+        scalarResidues(context, NTL::ZZ(cc), s);
     for (auto& part : parts)
-      part *= c_copy;
+      part.mulScalar(residues);
   }
 }
 
@@ -2162,6 +3019,37 @@ void Ctxt::addConstant(const EncodedPtxt& eptxt, bool neg)
   }
 }
 
+// As addConstant(const EncodedPtxt_BGV&) for BGV, with the scaled constant
+// kept by ptxt
+void Ctxt::addConstant(const PreparedPtxt& ptxt, bool neg)
+{
+  HELIB_TIMER_START;
+  if (!ptxt.isBGV()) {
+    addConstant(ptxt.expand(primeSet), neg);
+    return;
+  }
+
+  const EncodedPtxt_BGV& eptxt = ptxt.getEncoded().getBGV();
+  assertTrue(&getContext() == &eptxt.getContext(),
+             "addConstant: inconsistent contexts");
+  assertTrue(!isCKKS(), "addConstant: inconsistent encoding");
+
+  if (ptxtSpace != eptxt.getPtxtSpace()) {
+    reducePtxtSpace(eptxt.getPtxtSpace());
+  }
+
+  long f = 1;
+  if (ptxtSpace > 2) {
+    f = rem(context.productOfPrimes(primeSet), ptxtSpace);
+    f = NTL::MulMod(intFactor, f, ptxtSpace);
+  }
+
+  const FatEncodedPtxt_BGV& scaled =
+      ptxt.expandScaled(primeSet, f, ptxtSpace).getBGV();
+  noiseBound += scaled.getSize();
+  addSignedPart(scaled.getDCRT(), SKHandle(0, 1, 0), neg);
+}
+
 void Ctxt::addConstant(const FatEncodedPtxt& feptxt, bool neg)
 {
   if (feptxt.isBGV())
@@ -2197,7 +3085,7 @@ void Ctxt::addConstant(const FatEncodedPtxt_BGV& ptxt, bool neg)
     f = balRem(f, ptxtSpace);
   }
 
-  noiseBound += size * std::abs(f);
+  xdoubleAddTo(noiseBound, size * std::abs(f));
 
   // VJS-NOTE: addPart will raise an exception
   // if the prime set of dcrt does not contain
@@ -2305,9 +3193,29 @@ void Ctxt::addConstant(const NTL::ZZ& c, bool neg)
 
     double size = NTL::to_double(cc);
 
-    addConstant(
-        FatEncodedPtxt_BGV(DoubleCRT(cc, context, primeSet), ptxtSpace, size),
-        neg);
+    // A scalar is the same value in every slot of every row, so rather than
+    // building a DoubleCRT for it we scale it as in
+    // addConstant(const FatEncodedPtxt_BGV&), and add its residues directly
+    // to the part that points to one
+    long f = 1;
+    if (ptxtSpace > 2) {
+      f = productOfPrimesMod(context, primeSet, ptxtSpace);
+      f = NTL::MulMod(intFactor, f, ptxtSpace);
+      f = balRem(f, ptxtSpace);
+    }
+
+    xdoubleAddTo(noiseBound, size * std::abs(f));
+
+    long j = getPartIndexByHandle(SKHandle(0, 1, 0));
+    if (j < 0) { // no such part yet, start from zero
+      parts.emplace_back(context, primeSet); // a part that points to one
+      j = parts.size() - 1;
+    }
+
+    NTL::ZZ scalar = NTL::ZZ(cc) * f;
+    if (neg)
+      NTL::negate(scalar, scalar);
+    parts[j].addScalar(scalarResidues(context, scalar, parts[j].getIndexSet()));
   }
 }
 
@@ -2474,6 +3382,7 @@ void Ctxt::automorph(long k) // Apply automorphism F(X)->F(X^k) (gcd(k,m)=1)
   // Sanity check: verify that k \in Zm*
   assertTrue(context.getZMStar().inZmStar(k), "k must be in Zm*");
   long m = context.getM();
+  countOp(OpType::Automorphism, 1, primeSet.card());
 
   // Apply this automorphism to all the parts
   for (auto& part : parts) {
@@ -2508,6 +3417,7 @@ void Ctxt::smartAutomorph(long k)
     return;
 
   assertTrue(context.getZMStar().inZmStar(k), "k must be in Zm*");
+  AutomorphismProfile::record(k, m);
 
   long keyID = getKeyID();
   // must have key-switching matrices for it
@@ -2577,6 +3487,19 @@ void Ctxt::frobeniusAutomorph(long j)
 /********************************************************************/
 // Utility methods
 
+long Ctxt::getPowerOfS() const
+{
+  long power = 0;
+  for (auto& part : parts) {
+    if (part.skHandle.isOne())
+      continue;
+    if (part.skHandle.getPowerOfX() != 1)
+      return -1;
+    power = std::max(power, part.skHandle.getPowerOfS());
+  }
+  return power;
+}
+
 long Ctxt::getKeyID() const
 {
   for (auto& part : parts)
@@ -2611,16 +3534,36 @@ NTL::xdouble Ctxt::modSwitchAddedNoiseBound() const
   return addedNoise * roundingNoise;
 }
 
+bool Ctxt::hasSeededPart() const
+{
+  if (NTL::IsZero(partSeed) || parts.size() != 2 ||
+      !parts[0].skHandle.isOne() || parts[1].skHandle.getPowerOfS() != 1 ||
+      parts[1].skHandle.getPowerOfX() != 1)
+    return false;
+
+  DoubleCRT a(context, parts[1].getIndexSet());
+  {
+    NTL::RandomStreamPush push;
+    a.randomize(&partSeed);
+  }
+  return a == parts[1];
+}
+
 void Ctxt::writeTo(std::ostream& str) const
 {
   SerializeHeader<Ctxt>().writeTo(str);
-  writeEyeCatcher(str, EyeCatcher::CTXT_BEGIN);
+  bool seeded = hasSeededPart();
+  writeEyeCatcher(str,
+                  seeded ? EyeCatcher::SCTXT_BEGIN : EyeCatcher::CTXT_BEGIN);
 
   /*  Writing out in binary:
     1.  long ptxtSpace
     2.  NTL::xdouble noiseBound
     3.  IndexSet primeSet;
     4.  std::vector<CtxtPart> parts;
+    or, for a seeded ciphertext,
+    4.  CtxtPart parts[0], then of parts[1] the SKHandle, the IndexSet and
+        the seed
   */
 
   write_raw_int(str, ptxtSpace);
@@ -2629,7 +3572,42 @@ void Ctxt::writeTo(std::ostream& str) const
   write_raw_xdouble(str, ratFactor);
   write_raw_xdouble(str, noiseBound);
   primeSet.writeTo(str);
-  write_raw_vector(str, parts);
+  if (seeded) {
+    parts[0].writeTo(str);
+    parts[1].skHandle.writeTo(str);
+    parts[1].getIndexSet().writeTo(str);
+    write_raw_ZZ(str, partSeed);
+  } else {
+    write_raw_vector(str, parts);
+  }
+
+  writeEyeCatcher(str, EyeCatcher::CTXT_END);
+}
+
+void Ctxt::writeCompactTo(std::ostream& str) const
+{
+  Ctxt compact(*this);
+  compact.dropToDecryptionPrimeSet();
+
+  SerializeHeader<Ctxt>().writeTo(str);
+  writeEyeCatcher(str, EyeCatcher::CCTXT_BEGIN);
+
+  /*  As in writeTo, except for the parts:
+    4.  long number of parts, then for each part the SKHandle and the
+        DoubleCRT with packed rows
+  */
+
+  write_raw_int(str, compact.ptxtSpace);
+  write_raw_int(str, compact.intFactor);
+  write_raw_xdouble(str, compact.ptxtMag);
+  write_raw_xdouble(str, compact.ratFactor);
+  write_raw_xdouble(str, compact.noiseBound);
+  compact.primeSet.writeTo(str);
+  write_raw_int(str, compact.parts.size());
+  for (const CtxtPart& part : compact.parts) {
+    part.skHandle.writeTo(str);
+    part.writePackedTo(str);
+  }
 
   writeEyeCatcher(str, EyeCatcher::CTXT_END);
 }
@@ -2650,8 +3628,11 @@ void Ctxt::read(std::istream& str)
                     "Header: version " + header.versionString() +
                         " not supported");
 
-  bool eyeCatcherFound = readEyeCatcher(str, EyeCatcher::CTXT_BEGIN);
-  assertTrue<IOError>(eyeCatcherFound,
+  std::array<char, EyeCatcher::SIZE> eye;
+  str.read(eye.data(), eye.size());
+  bool seeded = eye == EyeCatcher::SCTXT_BEGIN;
+  bool compact = eye == EyeCatcher::CCTXT_BEGIN;
+  assertTrue<IOError>(seeded || compact || eye == EyeCatcher::CTXT_BEGIN,
                       "Could not find pre-ciphertext eye catcher");
 
   ptxtSpace = read_raw_int(str);
@@ -2660,19 +3641,65 @@ void Ctxt::read(std::istream& str)
   ratFactor = read_raw_xdouble(str);
   noiseBound = read_raw_xdouble(str);
   primeSet = IndexSet::readFrom(str);
-  // Using inplace parts deserialization as read_raw_vector will do a resize,
-  // then reads the parts in-place, so may re-use memory.
-  CtxtPart blankCtxtPart(context, IndexSet::emptySet());
-  read_raw_vector(str, parts, blankCtxtPart);
+  if (seeded) {
+    // Expand the part relative to s from its seed
+    parts.resize(1, CtxtPart(context, IndexSet::emptySet()));
+    parts[0].read(str);
+    SKHandle handle = SKHandle::readFrom(str);
+    IndexSet s = IndexSet::readFrom(str);
+    read_raw_ZZ(str, partSeed);
+    assertTrue<IOError>(s <= context.fullPrimes(),
+                        "Seeded ciphertext part has unknown primes");
+    parts.emplace_back(context, s, handle);
+    NTL::RandomStreamPush push;
+    parts[1].randomize(&partSeed);
+  } else if (compact) {
+    long n = read_raw_int(str);
+    parts.assign(n, CtxtPart(context, IndexSet::emptySet()));
+    for (CtxtPart& part : parts) {
+      part.skHandle = SKHandle::readFrom(str);
+      part.readPacked(str);
+    }
+    clear(partSeed);
+  } else {
+    // Using inplace parts deserialization as read_raw_vector will do a
+    // resize, then reads the parts in-place, so may re-use memory.
+    CtxtPart blankCtxtPart(context, IndexSet::emptySet());
+    read_raw_vector(str, parts, blankCtxtPart);
+    clear(partSeed);
+  }
 
-  eyeCatcherFound = readEyeCatcher(str, EyeCatcher::CTXT_END);
+  bool eyeCatcherFound = readEyeCatcher(str, EyeCatcher::CTXT_END);
   assertTrue<IOError>(eyeCatcherFound,
                       "Could not find post-ciphertext eye catcher");
 }
 
 void Ctxt::writeToJSON(std::ostream& str) const
 {
-  executeRedirectJsonError<void>([&]() { str << writeToJSON(); });
+  executeRedirectJsonError<void>([&]() {
+    JsonStreamWriter w(str);
+    writeToJSON(w);
+  });
+}
+
+void Ctxt::writeToJSON(JsonStreamWriter& w) const
+{
+  w.beginTyped<Ctxt>();
+  w.beginObject();
+  w.member("ptxtSpace", ptxtSpace);
+  w.member("noiseBound", noiseBound);
+  w.key("primeSet");
+  w.value(unwrap(primeSet.writeToJSON()));
+  w.member("intFactor", intFactor);
+  w.member("ptxtMag", ptxtMag);
+  w.member("ratFactor", ratFactor);
+  w.key("parts");
+  w.beginArray();
+  for (const CtxtPart& part : parts)
+    part.writeToJSON(w);
+  w.endArray();
+  w.endObject();
+  w.endObject();
 }
 
 JsonWrapper Ctxt::writeToJSON() const
@@ -2693,11 +3720,9 @@ JsonWrapper Ctxt::writeToJSON() const
 
 Ctxt Ctxt::readFromJSON(std::istream& str, const PubKey& pubKey)
 {
-  return executeRedirectJsonError<Ctxt>([&]() {
-    json j;
-    str >> j;
-    return Ctxt::readFromJSON(wrap(j), pubKey);
-  });
+  Ctxt ret(pubKey);
+  ret.readJSON(str);
+  return ret;
 }
 
 Ctxt Ctxt::readFromJSON(const JsonWrapper& j, const PubKey& pubKey)
@@ -2710,10 +3735,68 @@ Ctxt Ctxt::readFromJSON(const JsonWrapper& j, const PubKey& pubKey)
 void Ctxt::readJSON(std::istream& str)
 {
   executeRedirectJsonError<void>([&]() {
-    json j;
-    str >> j;
-    this->readJSON(wrap(j));
+    JsonStreamReader r(str);
+    readJSON(r);
+  });
+}
+
+void Ctxt::readJSON(JsonStreamReader& r)
+{
+  r.readTyped<Ctxt>([&]() {
+    bool seen[7] = {false};
+    r.beginObject();
+    for (std::string k; r.nextKey(k);) {
+      if (k == "ptxtSpace") {
+        ptxtSpace = r.value().get<long>();
+        seen[0] = true;
+      } else if (k == "intFactor") {
+        intFactor = r.value().get<long>();
+        seen[1] = true;
+      } else if (k == "ptxtMag") {
+        ptxtMag = r.value().get<NTL::xdouble>();
+        seen[2] = true;
+      } else if (k == "ratFactor") {
+        ratFactor = r.value().get<NTL::xdouble>();
+        seen[3] = true;
+      } else if (k == "noiseBound") {
+        noiseBound = r.value().get<NTL::xdouble>();
+        seen[4] = true;
+      } else if (k == "primeSet") {
+        primeSet = IndexSet::readFromJSON(wrap(r.value()));
+        seen[5] = true;
+      } else if (k == "parts") {
+        // The parts are read in place, reusing the memory of the old ones
+        long n = 0;
+        r.beginArray();
+        while (r.nextElement()) {
+          if (n == long(parts.size()))
+            parts.emplace_back(context, IndexSet::emptySet());
+          parts[n++].readJSON(r);
+        }
+        parts.resize(n, CtxtPart(context, IndexSet::emptySet()));
+        seen[6] = true;
+      } else {
+        r.skip();
+      }
+    }
+    const char* keys[7] = {"ptxtSpace",
+                           "intFactor",
+                           "ptxtMag",
+                           "ratFactor",
+                           "noiseBound",
+                           "primeSet",
+                           "parts"};
+    for (long i : range(7))
+      JsonStreamReader::require(seen[i], keys[i]);
   });
+  clear(partSeed);
+
+  // sanity-check
+  for (const auto& part : this->parts) {
+    assertEq(part.getIndexSet(),
+             this->primeSet,
+             "Ciphertext part's index set does not match prime set");
+  }
 }
 
 void Ctxt::readJSON(const JsonWrapper& jw)
@@ -2763,7 +3846,20 @@ void CtxtPart::read(std::istream& str)
 
 void CtxtPart::writeToJSON(std::ostream& str) const
 {
-  str << this->writeToJSON();
+  executeRedirectJsonError<void>([&]() {
+    JsonStreamWriter w(str);
+    writeToJSON(w);
+  });
+}
+
+void CtxtPart::writeToJSON(JsonStreamWriter& w) const
+{
+  w.beginObject();
+  w.key("skHandle");
+  w.value(unwrap(skHandle.writeToJSON()));
+  w.key("DoubleCRT");
+  this->DoubleCRT::writeToJSON(w);
+  w.endObject();
 }
 
 JsonWrapper CtxtPart::writeToJSON() const
@@ -2775,9 +3871,9 @@ JsonWrapper CtxtPart::writeToJSON() const
 
 CtxtPart CtxtPart::readFromJSON(std::istream& str, const Context& context)
 {
-  json j;
-  str >> j;
-  return CtxtPart::readFromJSON(wrap(j), context);
+  CtxtPart ret(DoubleCRT(context, IndexSet::emptySet()));
+  ret.readJSON(str);
+  return ret;
 }
 
 CtxtPart CtxtPart::readFromJSON(const JsonWrapper& j, const Context& context)
@@ -2789,9 +3885,29 @@ CtxtPart CtxtPart::readFromJSON(const JsonWrapper& j, const Context& context)
 
 void CtxtPart::readJSON(std::istream& str)
 {
-  json j;
-  str >> j;
-  this->readJSON(wrap(j));
+  executeRedirectJsonError<void>([&]() {
+    JsonStreamReader r(str);
+    readJSON(r);
+  });
+}
+
+void CtxtPart::readJSON(JsonStreamReader& r)
+{
+  bool haveDCRT = false, haveHandle = false;
+  r.beginObject();
+  for (std::string k; r.nextKey(k);) {
+    if (k == "DoubleCRT") {
+      this->DoubleCRT::readJSON(r); // CtxtPart is a child.
+      haveDCRT = true;
+    } else if (k == "skHandle") {
+      this->skHandle = SKHandle::readFromJSON(wrap(r.value()));
+      haveHandle = true;
+    } else {
+      r.skip();
+    }
+  }
+  JsonStreamReader::require(haveDCRT, "DoubleCRT");
+  JsonStreamReader::require(haveHandle, "skHandle");
 }
 
 void CtxtPart::readJSON(const JsonWrapper& jw)
@@ -2832,93 +3948,150 @@ std::istream& operator>>(std::istream& str, Ctxt& ctxt)
   return str;
 }
 
-// The recursive incremental-product function that does the actual work
-static void recursiveIncrementalProduct(Ctxt array[], long n)
-{
-  if (n <= 1)
-    return; // nothing to do
-
-  // split the array in two, first part is the highest power of two smaller
-  // than n and second part is the rest
-
-  long ell = NTL::NumBits(n - 1); // 2^{l-1} <= n-1
-  long n1 = 1UL << (ell - 1);     // n/2 <= n1 = 2^l < n
-
-  // Call the recursive procedure separately on the first and second parts
-  recursiveIncrementalProduct(array, n1);
-  recursiveIncrementalProduct(&array[n1], n - n1);
-
-  // Multiply the last product in the 1st part into every product in the 2nd
-  if (n - n1 > 1) {
-    NTL_EXEC_RANGE(n - n1, first, last)
-    for (long i = n1 + first; i < n1 + last; i++)
-      array[i].multiplyBy(array[n1 - 1]);
-    NTL_EXEC_RANGE_END
-  } else
-    for (long i = n1; i < n; i++)
-      array[i].multiplyBy(array[n1 - 1]);
-}
+// Both products below run level by level, with the independent products of
+// a level in parallel. The products are left extended (RelinPolicy::Lazy)
+// and relinearized in place when they next enter a product, or at the end.
 
 // For i=n-1...0, set v[i]=prod_{j<=i} v[j]
-// This implementation uses depth log n and (nlog n)/2 products
+// This implementation uses depth log n and (nlog n)/2 products: at level k,
+// every v[i] with bit k of i set is multiplied by the last product of the
+// lower half of its block of 2^{k+1}, whose index has bit k clear, so it does
+// not change at that level
 void incrementalProduct(std::vector<Ctxt>& v)
 {
+  HELIB_TIMER_START;
   long n = v.size(); // how many ciphertexts do we have
-  if (n > 0)
-    recursiveIncrementalProduct(&v[0], n); // do the actual work
+  for (long half = 1; half < n; half *= 2) {
+    // The sources of this level are shared, relinearize them first
+    long blocks = (n - half + 2 * half - 1) / (2 * half);
+    HELIB_EXEC_INDEX(blocks, b)
+    v[b * 2 * half + half - 1].reLinearize();
+    HELIB_EXEC_INDEX_END
+
+    std::vector<long> targets;
+    for (long i = 0; i < n; i++)
+      if (i & half)
+        targets.push_back(i);
+    HELIB_EXEC_INDEX(lsize(targets), t)
+    long i = targets[t];
+    v[i].multiplyBy(v[(i & ~(2 * half - 1)) + half - 1], RelinPolicy::Lazy);
+    HELIB_EXEC_INDEX_END
+  }
+
+  HELIB_EXEC_INDEX(n, i)
+  v[i].reLinearize();
+  HELIB_EXEC_INDEX_END
 }
 
-static void recursiveTotalProduct(Ctxt& out, const Ctxt array[], long n)
+// set out=prod_{i=0}^{n-1} v[j], takes depth log n and n-1 products. The
+// products of adjacent pairs of v go into a buffer, which is then reduced in
+// place, so out may be any of the v[i].
+void totalProduct(Ctxt& out, const std::vector<Ctxt>& v)
 {
-  if (n <= 3) {
-    out = array[0];
-    if (n == 2)
-      out.multiplyBy(array[1]);
-    else if (n == 3)
-      out.multiplyBy2(array[1], array[2]);
-    return;
-  }
-
-  // split the array in two
+  std::vector<const Ctxt*> factors;
+  for (const Ctxt& c : v)
+    factors.push_back(&c);
+  levelOrderedProduct(out, factors);
+}
 
-  long ell = NTL::NumBits(n - 1); // 2^{l-1} <= n-1
-  long n1 = 1UL << (ell - 1);     // n/2 <= n1 = 2^l < n
+void levelOrderedProduct(Ctxt& out,
+                         const std::vector<const Ctxt*>& factors,
+                         RelinPolicy policy)
+{
+  HELIB_TIMER_START;
+  if (factors.empty())
+    return;
 
-  // Call the recursive procedure separately on the first and second parts
-  Ctxt out2(ZeroCtxtLike, out);
-  recursiveTotalProduct(out, array, n1);
-  recursiveTotalProduct(out2, &array[n1], n - n1);
+  std::vector<Ctxt> round;
+  round.reserve(factors.size());
+  for (const Ctxt* factor : factors) {
+    if (factor->isEmpty()) {
+      out = *factor;
+      return;
+    }
+    round.push_back(*factor);
+  }
 
-  // Multiply the beginning of the two halves
-  out.multiplyBy(out2);
-}
+  // The products within a round are independent, their operands are only
+  // relinearized if they come extended from the previous round
+  RelinPolicy inner =
+      (policy == RelinPolicy::Eager) ? RelinPolicy::Eager : RelinPolicy::Lazy;
+  while (round.size() > 1) {
+    std::stable_sort(round.begin(),
+                     round.end(),
+                     [](const Ctxt& a, const Ctxt& b) {
+                       return a.capacity() > b.capacity();
+                     });
+    long pairs = round.size() / 2;
+    HELIB_EXEC_INDEX(pairs, j)
+    round[2 * j].customMultiplyBy(round[2 * j + 1], inner);
+    HELIB_EXEC_INDEX_END
+
+    std::vector<Ctxt> next;
+    next.reserve(pairs + 1);
+    for (long j = 0; j < pairs; j++)
+      next.push_back(std::move(round[2 * j]));
+    if (round.size() % 2 != 0) // the lowest capacity waits for a partner
+      next.push_back(std::move(round.back()));
+    round = std::move(next);
+  }
 
-// set out=prod_{i=0}^{n-1} v[j], takes depth log n and n-1 products
-// out could point to v[0], but having it pointing to any other v[i]
-// will make the result unpredictable.
-void totalProduct(Ctxt& out, const std::vector<Ctxt>& v)
-{
-  long n = v.size(); // how many ciphertexts do we have
-  if (n > 0)
-    recursiveTotalProduct(out, &v[0], n); // do the actual work
+  out = std::move(round[0]);
+  if (policy != RelinPolicy::Deferred)
+    out.reLinearize();
 }
 
-// Compute the inner product of two vectors of ciphertexts, this routine uses
-// the lower-level *= operator and does only one re-linearization at the end.
+// Compute the inner product of two vectors of ciphertexts. The operands are
+// dropped to their lowest natural level, so that the tensor products, made
+// in parallel with multLowLvl, land on the same primes. They are added up as
+// a tree, and the sum is relinearized once at the end: one key switch for the
+// whole inner product rather than one per pair.
 void innerProduct(Ctxt& result, const CtPtrs& v1, const CtPtrs& v2)
 {
+  HELIB_TIMER_START;
+
   long n = std::min(v1.size(), v2.size());
-  if (n <= 0) {
+  const Ctxt* some = v1.ptr2nonNull();
+  if (n <= 0 || some == nullptr) {
     result.clear();
     return;
   }
-  result = *v1[0];
-  result.multLowLvl(*v2[0]);
-  for (long i = 1; i < n; i++) {
-    Ctxt tmp = *v1[i];
-    tmp.multLowLvl(*v2[i]);
-    result += tmp;
+
+  const Context& context = some->getContext();
+  IndexSet common;
+  bool found = false;
+  for (long i : range(n)) {
+    for (const Ctxt* c : {v1[i], v2[i]}) {
+      if (c == nullptr || c->isEmpty())
+        continue;
+      IndexSet s = c->naturalPrimeSet();
+      if (!found || context.logOfProduct(s) < context.logOfProduct(common))
+        common = s;
+      found = true;
+    }
+  }
+
+  std::vector<Ctxt> products(n, Ctxt(ZeroCtxtLike, *some));
+  HELIB_EXEC_INDEX(n, i)
+  if (v1[i] != nullptr && v2[i] != nullptr) {
+    Ctxt other(*v2[i]);
+    products[i] = *v1[i];
+    for (Ctxt* c : {&products[i], &other})
+      if (!c->isEmpty() && common <= c->getPrimeSet())
+        c->bringToSet(common);
+    products[i].multLowLvl(other, /*destructive=*/true);
+  }
+  HELIB_EXEC_INDEX_END
+
+  for (long half = 1; half < n; half *= 2) {
+    long pairs = (n - half + 2 * half - 1) / (2 * half);
+    HELIB_EXEC_INDEX(pairs, p)
+    long j = p * 2 * half;
+    products[j] += products[j + half];
+    HELIB_EXEC_INDEX_END
   }
+
+  result = std::move(products[0]);
   result.reLinearize();
 }
 
@@ -2976,8 +4149,103 @@ void innerProduct(Ctxt& result,
 // Returns an estimate for the scaled noise (not including the
 // additive mod switching noise)
 
+// Whether rawModSwitch can scale the parts directly from their residues: the
+// powerful basis must be the polynomial basis, and all the parts must be
+// defined over the prime set of the ciphertext
+static bool wordSizeModSwitch(const Context& context,
+                              const std::vector<CtxtPart>& parts,
+                              const IndexSet& primeSet)
+{
+  const auto& p2dConv = context.getRcData().p2dConv;
+  if (!p2dConv || !p2dConv->isTrivial())
+    return false;
+  for (const CtxtPart& part : parts)
+    if (part.getIndexSet() != primeSet)
+      return false;
+  return true;
+}
+
+double Ctxt::rawModSwitch(std::vector<zzX>& zzParts, long q) const
+{
+  if (!wordSizeModSwitch(context, parts, primeSet)) {
+    std::vector<NTL::ZZX> polys;
+    double scaledNoise = rawModSwitch(polys, q);
+    zzParts.resize(polys.size());
+    for (long i : range(polys.size()))
+      convert(zzParts[i], polys[i]);
+    return scaledNoise;
+  }
+
+  const long p2r = getPtxtSpace();
+  assertTrue<InvalidArgument>(q > 1, "q must be greater than 1");
+  assertTrue(p2r > 1,
+             "Plaintext space must be greater than 1 for mod switching");
+  assertEq(NTL::GCD(q, p2r),
+           1l,
+           "New modulus and current plaintext space must be co-prime");
+  countOp(OpType::ModSwitch, 1, primeSet.card());
+
+  NTL::xdouble ratio =
+      NTL::xexp(log((double)q) - context.logOfProduct(getPrimeSet()));
+
+  long Q_mod_p = productOfPrimesMod(context, getPrimeSet(), p2r);
+  long Q_inv_mod_p = NTL::InvMod(Q_mod_p, p2r);
+  assertTrue(NTL::GCD(productOfPrimesMod(context, getPrimeSet(), q), q) == 1,
+             "GCD(Q, q) != 1 in Ctxt::rawModSwitch");
+
+  // The same rounding as in the ZZX version below, where for every
+  // coefficient c*q/Q = X + Y/Q, but with X mod q and Y mod p^r computed
+  // from the residues of c by DoubleCRT::scaleToModulus
+  long phim = context.getPhiM();
+  zzParts.resize(parts.size());
+  zzX xs, ys;
+  std::vector<double> fracs;
+  for (long i : range(parts.size())) {
+    parts[i].scaleToModulus(xs, ys, fracs, q, p2r);
+    zzX& out = zzParts[i];
+    out.SetLength(phim);
+
+    for (long j : range(phim)) {
+      double frac = fracs[j]; // Y/Q
+      long delta = NTL::MulMod(ys[j], Q_inv_mod_p, p2r);
+      // delta = Y*Q^{-1} mod p^r
+
+      if (delta > p2r / 2 ||
+          (p2r % 2 == 0 && delta == p2r / 2 &&
+           (frac < 0 || (frac == 0 && NTL::RandomBnd(2)))))
+        delta -= p2r;
+
+      // sanity check: |c*q/Q - x| = |Y/Q - delta| <= p^r/2
+      double diff = std::fabs(frac - delta);
+      if (diff > p2r / 2.0 + 0.0001) {
+        std::stringstream ss;
+        ss << "\n***BAD rawModSwitch: diff=" << diff << ", p2r=" << p2r;
+        throw RuntimeError(ss.str());
+      }
+
+      // reduce symmetrically mod q, randomizing if necessary for even q
+      long x = NTL::AddMod(xs[j], mcMod(delta, q), q);
+      if (x > q / 2 || (q % 2 == 0 && x == q / 2 && NTL::RandomBnd(2)))
+        x -= q;
+      out[j] = x;
+    }
+    normalize(out);
+  }
+
+  return NTL::conv<double>(noiseBound * ratio);
+}
+
 double Ctxt::rawModSwitch(std::vector<NTL::ZZX>& zzParts, long q) const
 {
+  if (wordSizeModSwitch(context, parts, primeSet)) {
+    std::vector<zzX> polys;
+    double scaledNoise = rawModSwitch(polys, q);
+    zzParts.resize(polys.size());
+    for (long i : range(polys.size()))
+      convert(zzParts[i], polys[i]);
+    return scaledNoise;
+  }
+
   // Ensure that new modulus is co-prime with plaintext space
   const long p2r = getPtxtSpace();
   assertTrue<InvalidArgument>(q > 1, "q must be greater than 1");
@@ -2986,6 +4254,7 @@ double Ctxt::rawModSwitch(std::vector<NTL::ZZX>& zzParts, long q) const
   assertEq(NTL::GCD(q, p2r),
            1l,
            "New modulus and current plaintext space must be co-prime");
+  countOp(OpType::ModSwitch, 1, primeSet.card());
 
   // Compute the ratio between the current modulus and the new one.
   // NOTE: q is a long int, so a double for the logarithms and
@@ -2994,7 +4263,7 @@ double Ctxt::rawModSwitch(std::vector<NTL::ZZX>& zzParts, long q) const
       NTL::xexp(log((double)q) - context.logOfProduct(getPrimeSet()));
 
   // Compute also the ratio modulo ptxtSpace
-  NTL::ZZ Q = context.productOfPrimes(getPrimeSet());
+  const NTL::ZZ& Q = context.getCRTTable(getPrimeSet()).product;
   NTL::ZZ Q_half = Q / 2;
   long Q_inv_mod_p = NTL::InvMod(rem(Q, p2r), p2r);
 
@@ -3008,10 +4277,17 @@ double Ctxt::rawModSwitch(std::vector<NTL::ZZX>& zzParts, long q) const
   // Scale and round all the integers in all the parts
   zzParts.resize(parts.size());
   const PowerfulDCRT& p2d_conv = *context.getRcData().p2dConv;
+
+  // convert all the parts to powerful rep, with one batch of inverse FFTs
+  std::vector<const DoubleCRT*> partPtrs(parts.size());
+  for (long i : range(parts.size()))
+    partPtrs[i] = &parts[i];
+  std::vector<NTL::Vec<NTL::ZZ>> pwrfls;
+  p2d_conv.dcrtToPowerful(pwrfls, partPtrs);
+
   for (long i : range(parts.size())) {
 
-    NTL::Vec<NTL::ZZ> pwrfl;
-    p2d_conv.dcrtToPowerful(pwrfl, parts[i]); // convert to powerful rep
+    NTL::Vec<NTL::ZZ>& pwrfl = pwrfls[i];
 
     // vecRed(pwrfl, pwrfl, Q, false);
     // reduce to interval [-Q/2,+Q/2]
@@ -3067,10 +4343,14 @@ double Ctxt::rawModSwitch(std::vector<NTL::ZZX>& zzParts, long q) const
 
       pwrfl[j] = x; // store back in the powerful vector
     }
-
-    p2d_conv.powerfulToZZX(zzParts[i], pwrfl); // convert to ZZX
   }
 
+  // convert all the parts back to ZZX in one batch
+  std::vector<const NTL::Vec<NTL::ZZ>*> pwrflPtrs(parts.size());
+  for (long i : range(parts.size()))
+    pwrflPtrs[i] = &pwrfls[i];
+  p2d_conv.powerfulToZZX(zzParts, pwrflPtrs);
+
   // Return an estimate for the noise
   double scaledNoise = NTL::conv<double>(noiseBound * ratio);
 
@@ -0,0 +1,209 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <helib/CtxtExpr.h>
+
+#include <cmath>
+
+#include <NTL/ZZ.h>
+
+#include <helib/assertions.h>
+#include <helib/Context.h>
+#include <helib/NumbTh.h>
+#include <helib/timing.h>
+
+namespace helib {
+
+namespace {
+
+// The terms one by one, with the Ctxt operators
+void evalTermByTerm(Ctxt& out, const std::vector<CtxtExpr::Term>& terms)
+{
+  Ctxt sum(ZeroCtxtLike, *terms[0].ctxt);
+  for (const CtxtExpr::Term& t : terms) {
+    Ctxt tmp = *t.ctxt;
+    tmp.multByConstant(t.scalar);
+    if (t.ptxt != nullptr)
+      tmp.multByConstant(*t.ptxt);
+    sum += tmp;
+  }
+  out = std::move(sum);
+}
+
+} // namespace
+
+CtxtExpr& CtxtExpr::operator+=(const CtxtExpr& other)
+{
+  // other may be *this
+  std::vector<Term> more = other.terms;
+  terms.insert(terms.end(), more.begin(), more.end());
+  return *this;
+}
+
+CtxtExpr& CtxtExpr::operator-=(const CtxtExpr& other)
+{
+  std::vector<Term> more = other.terms;
+  for (Term& t : more)
+    NTL::negate(t.scalar, t.scalar);
+  terms.insert(terms.end(), more.begin(), more.end());
+  return *this;
+}
+
+CtxtExpr& CtxtExpr::operator*=(const NTL::ZZ& c)
+{
+  for (Term& t : terms)
+    t.scalar *= c;
+  return *this;
+}
+
+CtxtExpr& CtxtExpr::operator*=(const PreparedPtxt& ptxt)
+{
+  for (const Term& t : terms)
+    assertTrue<InvalidArgument>(t.ptxt == nullptr,
+                                "CtxtExpr: a term already has a constant");
+  for (Term& t : terms)
+    t.ptxt = &ptxt;
+  return *this;
+}
+
+void CtxtExpr::assignTo(Ctxt& out) const
+{
+  HELIB_TIMER_START;
+
+  std::vector<Term> live;
+  for (const Term& t : terms)
+    if (!t.ctxt->isEmpty() && t.scalar != 0)
+      live.push_back(t);
+  if (live.empty()) {
+    out.clear();
+    return;
+  }
+  long n = live.size();
+
+  // The lowest prime set, that every term is brought down to
+  const Ctxt& first = *live[0].ctxt;
+  const Context& context = first.getContext();
+  IndexSet target = first.primeSet;
+  for (const Term& t : live)
+    if (context.logOfProduct(t.ctxt->primeSet) < context.logOfProduct(target))
+      target = t.ctxt->primeSet;
+
+  bool fused = !first.isCKKS();
+  for (long t = 0; fused && t < n; t++) {
+    const Ctxt& c = *live[t].ctxt;
+    fused = &c.getContext() == &context && target <= c.primeSet &&
+            c.parts.size() == first.parts.size() &&
+            (live[t].ptxt == nullptr || live[t].ptxt->isBGV());
+    for (long k = 0; fused && k < long(c.parts.size()); k++)
+      fused = c.parts[k].skHandle == first.parts[k].skHandle;
+  }
+  if (!fused) {
+    evalTermByTerm(out, live);
+    return;
+  }
+
+  std::vector<Ctxt> lowered;
+  lowered.reserve(n);
+  std::vector<const Ctxt*> ops(n);
+  for (long t : range(n)) {
+    ops[t] = live[t].ctxt;
+    if (ops[t]->primeSet != target) {
+      lowered.emplace_back(*ops[t]);
+      lowered.back().bringToSet(target);
+      ops[t] = &lowered.back();
+    }
+  }
+
+  // The common plaintext space, and the integer factor of the result
+  long P = 0;
+  for (long t : range(n)) {
+    P = NTL::GCD(P, ops[t]->ptxtSpace);
+    if (live[t].ptxt != nullptr)
+      P = NTL::GCD(P, live[t].ptxt->getEncoded().getBGV().getPtxtSpace());
+  }
+  assertTrue(P > 1, "CtxtExpr: the plaintext spaces are coprime");
+  long F = ((ops[0]->intFactor % P) + P) % P;
+
+  // Every term gets the weight w = F*scalar/intFactor mod P, so that the
+  // terms have the same integer factor F and just add up
+  std::vector<const DoubleCRT*> scaledParts, prodParts, constants;
+  std::vector<long> weights;
+  std::vector<long> scaledTerms, prodTerms;
+  NTL::xdouble noise(0.0);
+  for (long t : range(n)) {
+    long f = ((ops[t]->intFactor % P) + P) % P;
+    long w = NTL::MulMod(NTL::MulMod(F, rem(live[t].scalar, P), P),
+                         NTL::InvMod(f, P),
+                         P);
+    w = balRem(w, P);
+    if (w == 0)
+      continue;
+    NTL::xdouble term = ops[t]->noiseBound;
+    if (live[t].ptxt == nullptr) {
+      xdoubleMulBy(term, std::abs(double(w)));
+      scaledTerms.push_back(t);
+      weights.push_back(w);
+    } else {
+      const FatEncodedPtxt_BGV& c =
+          live[t].ptxt->expandScaled(target, w, P).getBGV();
+      xdoubleMulBy(term, c.getSize());
+      prodTerms.push_back(t);
+      constants.push_back(&c.getDCRT());
+    }
+    xdoubleAddTo(noise, term);
+  }
+
+  Ctxt sum(ZeroCtxtLike, first);
+  sum.primeSet = target;
+  sum.ptxtSpace = P;
+  sum.intFactor = F;
+  sum.noiseBound = noise;
+  if (scaledTerms.empty() && prodTerms.empty()) {
+    out = std::move(sum);
+    return;
+  }
+
+  for (long k : range(first.parts.size())) {
+    CtxtPart part(context, target, first.parts[k].skHandle);
+    if (!scaledTerms.empty()) {
+      scaledParts.clear();
+      for (long t : scaledTerms)
+        scaledParts.push_back(&ops[t]->parts[k]);
+      part.scaledSum(scaledParts, weights);
+    }
+    if (!prodTerms.empty()) {
+      prodParts.clear();
+      for (long t : prodTerms)
+        prodParts.push_back(&ops[t]->parts[k]);
+      CtxtPart prod(context, target);
+      prod.innerProduct(prodParts, constants);
+      part += prod;
+    }
+    sum.parts.push_back(std::move(part));
+  }
+  out = std::move(sum);
+}
+
+Ctxt& Ctxt::operator=(const CtxtExpr& expr)
+{
+  expr.assignTo(*this);
+  return *this;
+}
+
+Ctxt& Ctxt::operator+=(const CtxtExpr& expr)
+{
+  CtxtExpr sum(*this);
+  sum += expr;
+  sum.assignTo(*this);
+  return *this;
+}
+
+} // namespace helib
@@ -32,12 +32,20 @@
  * in use. The list of primes is defined by the data member modChain, which is
  * a vector of Cmodulus objects.
  */
+#include <algorithm>
+#include <cmath>
+
 #include <NTL/ZZVec.h>
 #include <NTL/BasicThreadPool.h>
 
 #include "binio.h"
 #include "io.h"
+#include "jsonStream.h"
 #include "intelExt.h"
+#include "lazyMod.h"
+#include "crtTable.h"
+#include "modDown.h"
+#include "uint128.h"
 
 #include <helib/timing.h>
 #include <helib/sample.h>
@@ -46,6 +54,10 @@
 #include <helib/norms.h>
 #include <helib/fhe_stats.h>
 #include <helib/log.h>
+#include <helib/opCounters.h>
+#include <helib/residueBackend.h>
+#include <helib/ResidueArena.h>
+#include <helib/autotune.h>
 
 namespace helib {
 
@@ -71,17 +83,18 @@ void DoubleCRT::FFT(const NTL::ZZX& poly, const IndexSet& s)
 
   if (empty(s))
     return;
+  map.makeUnique(); // before the threads write their rows
 
   static thread_local NTL::Vec<long> tls_ivec;
   NTL::Vec<long>& ivec = tls_ivec;
 
   long icard = MakeIndexVector(s, ivec);
-  NTL_EXEC_RANGE(icard, first, last)
+  HELIB_EXEC_RANGE(icard, first, last)
   for (long j = first; j < last; j++) {
     long i = ivec[j];
-    context.ithModulus(i).FFT(map[i], poly);
+    context.ithModulus(i).FFT(map.uniqueRow(i), poly);
   }
-  NTL_EXEC_RANGE_END
+  HELIB_EXEC_RANGE_END
 }
 
 // FIXME: "code bloat": this just replicates the above with NTL::ZZX -> zzX
@@ -91,17 +104,83 @@ void DoubleCRT::FFT(const zzX& poly, const IndexSet& s)
 
   if (empty(s))
     return;
+  map.makeUnique(); // before the threads write their rows
 
   static thread_local NTL::Vec<long> tls_ivec;
   NTL::Vec<long>& ivec = tls_ivec;
 
   long icard = MakeIndexVector(s, ivec);
-  NTL_EXEC_RANGE(icard, first, last)
+  HELIB_EXEC_RANGE(icard, first, last)
   for (long j = first; j < last; j++) {
     long i = ivec[j];
-    context.ithModulus(i).FFT(map[i], poly);
+    context.ithModulus(i).FFT(map.uniqueRow(i), poly);
+  }
+  HELIB_EXEC_RANGE_END
+}
+
+template <typename RX>
+void DoubleCRT::fromPolysImpl(const std::vector<DoubleCRT*>& out,
+                              const std::vector<const RX*>& polys,
+                              const IndexSet& s)
+{
+  HELIB_TIMER_START;
+  assertEq(out.size(), polys.size(), "fromPolys: sizes do not match");
+  if (out.empty())
+    return;
+
+  const Context& context = out[0]->context;
+  assertTrue(empty(s) || s.last() < context.numPrimes(),
+             "s must end with a smaller element than context.numPrimes()");
+  for (DoubleCRT* d : out) {
+    if (&d->context != &context)
+      throw RuntimeError("DoubleCRT::fromPolys: incompatible objects");
+    d->map.setIndexSet(s);
+  }
+  if (isDryRun() || empty(s))
+    return;
+
+  long n = out.size();
+  NTL::Vec<long> ivec;
+  long icard = MakeIndexVector(s, ivec);
+
+  // The cells of the schedule are a prime and a block of consecutive
+  // polynomials, the blocks being split only when there are fewer primes
+  // than threads
+  long blocks = (availableThreads() + icard - 1) / icard;
+  blocks = std::max(1L, std::min(blocks, n));
+  long blockSize = (n + blocks - 1) / blocks;
+
+  HELIB_EXEC_RANGE(icard * blocks, first, last)
+  std::vector<long*> rows(blockSize);
+  std::vector<const RX*> x(blockSize);
+  for (long cell = first; cell < last; cell++) {
+    long i = ivec[cell / blocks];
+    long lo = (cell % blocks) * blockSize;
+    long len = std::min(n, lo + blockSize) - lo;
+    if (len <= 0)
+      continue;
+
+    for (long t : range(len)) {
+      rows[t] = out[lo + t]->map.uniqueRow(i);
+      x[t] = polys[lo + t];
+    }
+    context.ithModulus(i).FFT(rows.data(), x.data(), len);
   }
-  NTL_EXEC_RANGE_END
+  HELIB_EXEC_RANGE_END
+}
+
+void DoubleCRT::fromPolys(const std::vector<DoubleCRT*>& out,
+                          const std::vector<const zzX*>& polys,
+                          const IndexSet& s)
+{
+  fromPolysImpl(out, polys, s);
+}
+
+void DoubleCRT::fromPolys(const std::vector<DoubleCRT*>& out,
+                          const std::vector<const NTL::ZZX*>& polys,
+                          const IndexSet& s)
+{
+  fromPolysImpl(out, polys, s);
 }
 
 // a "sanity check" function, verifies consistency of matrix with current
@@ -117,13 +196,12 @@ void DoubleCRT::verify()
   const IndexSet& s = map.getIndexSet();
 
   long phim = context.getPhiM();
+  if (map.rowLength() != phim)
+    throw RuntimeError("DoubleCRT object has bad row length");
 
   // check that the content of i'th row is in [0,pi) for all i
   for (long i : s) {
-    NTL::vec_long& row = map[i];
-
-    if (row.length() != phim)
-      throw RuntimeError("DoubleCRT object has bad row length");
+    const long* row = map[i];
 
     long pi = context.ithPrime(i); // the i'th modulus
     for (long j : range(phim))
@@ -135,6 +213,8 @@ void DoubleCRT::verify()
 #ifdef USE_INTEL_HEXL
 struct AddFun
 {
+  static constexpr ResidueOp op = ResidueOp::Add;
+
   void apply(long* result,
              const long* a,
              const long* b,
@@ -156,6 +236,8 @@ struct AddFun
 
 struct SubFun
 {
+  static constexpr ResidueOp op = ResidueOp::Sub;
+
   void apply(long* result,
              const long* a,
              const long* b,
@@ -177,6 +259,8 @@ struct SubFun
 
 struct MulFun
 {
+  static constexpr ResidueOp op = ResidueOp::Mul;
+
   void apply(long* result,
              const long* a,
              const long* b,
@@ -198,20 +282,51 @@ struct MulFun
 #else
 struct AddFun
 {
+  static constexpr ResidueOp op = ResidueOp::Add;
+
   long apply(long a, long b, long n) const { return NTL::AddMod(a, b, n); }
 };
 
 struct SubFun
 {
+  static constexpr ResidueOp op = ResidueOp::Sub;
+
   long apply(long a, long b, long n) const { return NTL::SubMod(a, b, n); }
 };
 
 struct MulFun
 {
+  static constexpr ResidueOp op = ResidueOp::Mul;
+
   long apply(long a, long b, long n) const { return NTL::MulMod(a, b, n); }
 };
 #endif
 
+// The rows of a slab at the primes of s, and their moduli, as a
+// ResidueBackend takes them
+static void backendRows(std::vector<long*>& rows,
+                        std::vector<long>& moduli,
+                        ResidueSlab& map,
+                        const IndexSet& s,
+                        const Context& context)
+{
+  rows.clear();
+  moduli.clear();
+  for (long i : s) {
+    rows.push_back(map[i]);
+    moduli.push_back(context.ithPrime(i));
+  }
+}
+
+static std::vector<const long*> backendRows(const ResidueSlab& map,
+                                            const IndexSet& s)
+{
+  std::vector<const long*> rows;
+  for (long i : s)
+    rows.push_back(map[i]);
+  return rows;
+}
+
 // Generic operation, Fnc is AddMod, SubMod, or MulMod (from NTL's ZZ module)
 template <typename Fun>
 DoubleCRT& DoubleCRT::Op(const DoubleCRT& other, Fun fun, bool matchIndexSets)
@@ -236,7 +351,7 @@ DoubleCRT& DoubleCRT::Op(const DoubleCRT& other, Fun fun, bool matchIndexSets)
 
   // If you need to mod-up the other, do it on a temporary scratch copy
   DoubleCRT tmp(context, IndexSet());
-  const IndexMap<NTL::vec_long>* other_map = &other.map;
+  const ResidueSlab* other_map = &other.map;
 
   // VJS-FIXME: experiment to insist that
   // map.getIndexSet() <= other.map.getIndexSet()
@@ -256,14 +371,29 @@ DoubleCRT& DoubleCRT::Op(const DoubleCRT& other, Fun fun, bool matchIndexSets)
   const IndexSet& s = map.getIndexSet();
   long phim = context.getPhiM();
 
+  if (const ResidueBackend* backend = context.getResidueBackend()) {
+    std::vector<long*> rows;
+    std::vector<long> moduli;
+    backendRows(rows, moduli, map, s, context);
+    std::vector<const long*> other_rows = backendRows(*other_map, s);
+    backend->apply(Fun::op,
+                   rows.data(),
+                   rows.data(),
+                   other_rows.data(),
+                   moduli.data(),
+                   lsize(rows),
+                   phim);
+    return *this;
+  }
+
   // add/sub/mul the data, element by element, modulo the respective primes
   for (long i : s) {
     long pi = context.ithPrime(i);
-    NTL::vec_long& row = map[i];
-    const NTL::vec_long& other_row = (*other_map)[i];
+    long* row = map[i];
+    const long* other_row = (*other_map)[i];
 
 #ifdef USE_INTEL_HEXL
-    fun.apply(row.elts(), row.elts(), other_row.elts(), phim, pi);
+    fun.apply(row, row, other_row, phim, pi);
 #else
     for (long j : range(phim))
       row[j] = fun.apply(row[j], other_row[j], pi);
@@ -299,7 +429,7 @@ DoubleCRT& DoubleCRT::do_mul(const DoubleCRT& other, bool matchIndexSets)
 
   // If you need to mod-up the other, do it on a temporary scratch copy
   DoubleCRT tmp(context, IndexSet());
-  const IndexMap<NTL::vec_long>* other_map = &other.map;
+  const ResidueSlab* other_map = &other.map;
 
   // VJS-FIXME: experiment to insist that
   // map.getIndexSet() <= other.map.getIndexSet()
@@ -319,14 +449,29 @@ DoubleCRT& DoubleCRT::do_mul(const DoubleCRT& other, bool matchIndexSets)
   const IndexSet& s = map.getIndexSet();
   long phim = context.getPhiM();
 
+  if (const ResidueBackend* backend = context.getResidueBackend()) {
+    std::vector<long*> rows;
+    std::vector<long> moduli;
+    backendRows(rows, moduli, map, s, context);
+    std::vector<const long*> other_rows = backendRows(*other_map, s);
+    backend->apply(ResidueOp::Mul,
+                   rows.data(),
+                   rows.data(),
+                   other_rows.data(),
+                   moduli.data(),
+                   lsize(rows),
+                   phim);
+    return *this;
+  }
+
   // add/sub/mul the data, element by element, modulo the respective primes
   for (long i : s) {
     long pi = context.ithPrime(i);
-    NTL::vec_long& row = map[i];
-    const NTL::vec_long& other_row = (*other_map)[i];
+    long* row = map[i];
+    const long* other_row = (*other_map)[i];
 
 #ifdef USE_INTEL_HEXL
-    intel::EltwiseMultMod(row.elts(), row.elts(), other_row.elts(), phim, pi);
+    intel::EltwiseMultMod(row, row, other_row, phim, pi);
 #else
     NTL::mulmod_t pi_inv = context.ithModulus(i).getQInv();
     for (long j : range(phim))
@@ -345,13 +490,29 @@ DoubleCRT& DoubleCRT::Op(const NTL::ZZ& num, Fun fun)
   const IndexSet& s = map.getIndexSet();
   long phim = context.getPhiM();
 
+  if (const ResidueBackend* backend = context.getResidueBackend()) {
+    std::vector<long*> rows;
+    std::vector<long> moduli, scalars;
+    backendRows(rows, moduli, map, s, context);
+    for (long pi : moduli)
+      scalars.push_back(rem(num, pi));
+    backend->applyScalar(Fun::op,
+                         rows.data(),
+                         rows.data(),
+                         scalars.data(),
+                         moduli.data(),
+                         lsize(rows),
+                         phim);
+    return *this;
+  }
+
   for (long i : s) {
     long pi = context.ithPrime(i);
     long n = rem(num, pi); // n = num % pi
-    NTL::vec_long& row = map[i];
+    long* row = map[i];
 
 #ifdef USE_INTEL_HEXL
-    fun.apply(row.elts(), row.elts(), n, phim, pi);
+    fun.apply(row, row, n, phim, pi);
 #else
     for (long j : range(phim))
       row[j] = fun.apply(row[j], n, pi);
@@ -360,6 +521,93 @@ DoubleCRT& DoubleCRT::Op(const NTL::ZZ& num, Fun fun)
   return *this;
 }
 
+DoubleCRT& DoubleCRT::addScalar(const std::vector<long>& residues)
+{
+  if (isDryRun())
+    return *this;
+
+  const IndexSet& s = map.getIndexSet();
+  assertTrue(empty(s) || long(residues.size()) > s.last(),
+             "DoubleCRT::addScalar: missing residues");
+  long phim = context.getPhiM();
+
+  if (const ResidueBackend* backend = context.getResidueBackend()) {
+    std::vector<long*> rows;
+    std::vector<long> moduli, scalars;
+    backendRows(rows, moduli, map, s, context);
+    for (long i : s)
+      scalars.push_back(residues[i]);
+    backend->applyScalar(ResidueOp::Add,
+                         rows.data(),
+                         rows.data(),
+                         scalars.data(),
+                         moduli.data(),
+                         lsize(rows),
+                         phim);
+    return *this;
+  }
+
+  for (long i : s) {
+    long pi = context.ithPrime(i);
+    long n = residues[i];
+    if (n == 0)
+      continue;
+    long* row = map[i];
+
+#ifdef USE_INTEL_HEXL
+    intel::EltwiseAddMod(row, row, n, phim, pi);
+#else
+    for (long j : range(phim))
+      row[j] = NTL::AddMod(row[j], n, pi);
+#endif
+  }
+  return *this;
+}
+
+DoubleCRT& DoubleCRT::mulScalar(const std::vector<long>& residues)
+{
+  if (isDryRun())
+    return *this;
+
+  const IndexSet& s = map.getIndexSet();
+  assertTrue(empty(s) || long(residues.size()) > s.last(),
+             "DoubleCRT::mulScalar: missing residues");
+  long phim = context.getPhiM();
+
+  if (const ResidueBackend* backend = context.getResidueBackend()) {
+    std::vector<long*> rows;
+    std::vector<long> moduli, scalars;
+    backendRows(rows, moduli, map, s, context);
+    for (long i : s)
+      scalars.push_back(residues[i]);
+    backend->applyScalar(ResidueOp::Mul,
+                         rows.data(),
+                         rows.data(),
+                         scalars.data(),
+                         moduli.data(),
+                         lsize(rows),
+                         phim);
+    return *this;
+  }
+
+  for (long i : s) {
+    long pi = context.ithPrime(i);
+    long n = residues[i];
+    if (n == 1)
+      continue;
+    long* row = map[i];
+
+#ifdef USE_INTEL_HEXL
+    intel::EltwiseMultMod(row, row, n, phim, pi);
+#else
+    NTL::mulmod_precon_t nPrecon = NTL::PrepMulModPrecon(n, pi);
+    for (long j : range(phim))
+      row[j] = NTL::MulModPrecon(row[j], n, pi, nPrecon);
+#endif
+  }
+  return *this;
+}
+
 DoubleCRT& DoubleCRT::Negate(const DoubleCRT& other)
 {
   if (isDryRun())
@@ -375,8 +623,8 @@ DoubleCRT& DoubleCRT::Negate(const DoubleCRT& other)
   long phim = context.getPhiM();
   for (long i : s) {
     long pi = context.ithPrime(i);
-    NTL::vec_long& row = map[i];
-    const NTL::vec_long& other_row = other.map[i];
+    long* row = map[i];
+    const long* other_row = other.map[i];
     for (long j : range(phim))
       row[j] = NTL::NegateMod(other_row[j], pi);
   }
@@ -457,6 +705,61 @@ DoubleCRT& DoubleCRT::operator*=(long num)
   return Op(NTL::to_ZZ(num), MulFun());
 }
 
+DoubleCRT& DoubleCRT::addScaled(const DoubleCRT& other,
+                                long otherFactor,
+                                long thisFactor,
+                                long divisor)
+{
+  HELIB_TIMER_START;
+
+  if (isDryRun())
+    return *this;
+
+  if (&context != &other.context)
+    throw RuntimeError("DoubleCRT::addScaled: incompatible objects");
+
+  if (!(map.getIndexSet() <= other.map.getIndexSet()))
+    throw RuntimeError(
+        "DoubleCRT::addScaled: !(map.getIndexSet() <= other.map.getIndexSet())");
+
+  const IndexSet& s = map.getIndexSet();
+  long phim = context.getPhiM();
+
+  for (long i : s) {
+    long pi = context.ithPrime(i);
+    long a = mcMod(otherFactor, pi);
+    long b = mcMod(thisFactor, pi);
+    if (divisor != 1) { // fold the division into both factors
+      long inverse = NTL::InvMod(mcMod(divisor, pi), pi);
+      a = NTL::MulMod(a, inverse, pi);
+      b = NTL::MulMod(b, inverse, pi);
+    }
+    long* row = map[i];
+    const long* other_row = other.map[i];
+
+#ifdef USE_INTEL_HEXL
+    if (b != 1)
+      intel::EltwiseMultMod(row, row, b, phim, pi);
+    intel::EltwiseFMAMod(row, other_row, a, row, phim, pi);
+#else
+    NTL::mulmod_precon_t aPrecon = NTL::PrepMulModPrecon(a, pi);
+    if (b == 1) {
+      for (long j : range(phim))
+        row[j] = NTL::AddMod(row[j],
+                             NTL::MulModPrecon(other_row[j], a, pi, aPrecon),
+                             pi);
+    } else {
+      NTL::mulmod_precon_t bPrecon = NTL::PrepMulModPrecon(b, pi);
+      for (long j : range(phim))
+        row[j] = NTL::AddMod(NTL::MulModPrecon(row[j], b, pi, bPrecon),
+                             NTL::MulModPrecon(other_row[j], a, pi, aPrecon),
+                             pi);
+    }
+#endif // USE_INTEL_HEXL
+  }
+  return *this;
+}
+
 // Function versions
 void DoubleCRT::Add(const DoubleCRT& other, bool matchIndexSets)
 {
@@ -474,9 +777,515 @@ void DoubleCRT::Mul(const DoubleCRT& other, bool matchIndexSets)
   do_mul(other, matchIndexSets);
 }
 
+void DoubleCRT::Mul(const DoubleCRT& other, const DoubleCRTPrecon& otherPrecon)
+{
+  HELIB_TIMER_START;
+
+  if (isDryRun())
+    return;
+
+  if (&context != &other.context)
+    throw RuntimeError("DoubleCRT::Mul: incompatible objects");
+
+  if (!(map.getIndexSet() <= other.map.getIndexSet()) ||
+      !(map.getIndexSet() <= otherPrecon.getIndexSet()))
+    throw RuntimeError(
+        "DoubleCRT::Mul: !(map.getIndexSet() <= other.map.getIndexSet())");
+
+  const IndexSet& s = map.getIndexSet();
+  long phim = context.getPhiM();
+
+  for (long i : s) {
+    long pi = context.ithPrime(i);
+    long* row = map[i];
+    const long* other_row = other.map[i];
+
+#ifdef USE_INTEL_HEXL
+    // HEXL has its own vectorized reduction, the companions are not needed
+    intel::EltwiseMultMod(row, row, other_row, phim, pi);
+#else
+    const NTL::mulmod_precon_t* other_precon = otherPrecon[i];
+    for (long j : range(phim))
+      row[j] = NTL::MulModPrecon(row[j], other_row[j], pi, other_precon[j]);
+#endif // USE_INTEL_HEXL
+  }
+}
+
+// Pointers to the first n elements of v, or to all of them if v is shorter
+static std::vector<const DoubleCRT*> pointersTo(const std::vector<DoubleCRT>& v,
+                                                std::size_t n)
+{
+  std::vector<const DoubleCRT*> ptrs;
+  for (std::size_t t = 0; t < std::min(n, v.size()); t++)
+    ptrs.push_back(&v[t]);
+  return ptrs;
+}
+
+DoubleCRT& DoubleCRT::innerProduct(const std::vector<DoubleCRT>& a,
+                                   const std::vector<DoubleCRT>& b)
+{
+  return innerProductImpl(pointersTo(a, a.size()),
+                          pointersTo(b, a.size()),
+                          nullptr);
+}
+
+DoubleCRT& DoubleCRT::innerProduct(const std::vector<DoubleCRT>& a,
+                                   const std::vector<DoubleCRT>& b,
+                                   const std::vector<DoubleCRTPrecon>& bPrecon)
+{
+  return innerProductImpl(pointersTo(a, a.size()),
+                          pointersTo(b, a.size()),
+                          &bPrecon);
+}
+
+DoubleCRT& DoubleCRT::innerProduct(const std::vector<const DoubleCRT*>& a,
+                                   const std::vector<const DoubleCRT*>& b)
+{
+  return innerProductImpl(a, b, nullptr);
+}
+
+DoubleCRT& DoubleCRT::scaledSum(const std::vector<const DoubleCRT*>& a,
+                                const std::vector<long>& factors)
+{
+  HELIB_TIMER_START;
+
+  assertTrue(!a.empty(), "Scaled sum of no terms");
+  assertEq(a.size(), factors.size(), "Scaled sum: one factor per term");
+
+  const IndexSet s = a[0]->getIndexSet();
+  long n = a.size();
+  for (long t : range(n)) {
+    if (&a[t]->context != &context)
+      throw RuntimeError("DoubleCRT::scaledSum: incompatible objects");
+    if (a[t] == this)
+      throw RuntimeError("DoubleCRT::scaledSum: *this is an operand");
+    if (a[t]->getIndexSet() != s)
+      throw RuntimeError("DoubleCRT::scaledSum: index sets do not match");
+  }
+
+  map.setIndexSet(s);
+  if (isDryRun())
+    return *this;
+
+  long phim = context.getPhiM();
+  NTL::Vec<long> ivec;
+  long icard = MakeIndexVector(s, ivec);
+
+  // One prime per task, every output row is written once
+  HELIB_EXEC_RANGE(icard, first, last)
+  std::vector<long> f(n);
+  std::vector<NTL::mulmod_precon_t> fPrecon(n);
+  for (long k = first; k < last; k++) {
+    long i = ivec[k];
+    long pi = context.ithPrime(i);
+    for (long t : range(n)) {
+      f[t] = mcMod(factors[t], pi);
+      fPrecon[t] = NTL::PrepMulModPrecon(f[t], pi);
+    }
+    long* row = map.uniqueRow(i);
+    for (long j : range(phim)) {
+      long acc = NTL::MulModPrecon(a[0]->map[i][j], f[0], pi, fPrecon[0]);
+      for (long t : range(1, n))
+        acc = NTL::AddMod(
+            acc,
+            NTL::MulModPrecon(a[t]->map[i][j], f[t], pi, fPrecon[t]),
+            pi);
+      row[j] = acc;
+    }
+  }
+  HELIB_EXEC_RANGE_END
+  return *this;
+}
+
+// One cell of the grid of an inner product: row[j] = sum_t aRows[t][j] *
+// bRows[t][j] mod q for j < len, with the companions pRows of the bRows if
+// not null, and tmp a scratch row of len entries
+static void innerProductCell(long* row,
+                             const long* const* aRows,
+                             const long* const* bRows,
+                             const NTL::mulmod_precon_t* const* pRows,
+                             long n,
+                             long len,
+                             const Cmodulus& q,
+                             long* tmp)
+{
+  long pi = q.getQ();
+#ifdef USE_INTEL_HEXL
+  // HEXL has its own vectorized reduction, the companions are not needed
+  intel::EltwiseMultMod(row, aRows[0], bRows[0], len, pi);
+  for (long t : range(1, n)) {
+    intel::EltwiseMultMod(tmp, aRows[t], bRows[t], len, pi);
+    intel::EltwiseAddMod(row, row, tmp, len, pi);
+  }
+#else
+  (void)tmp;
+  if (n >= LAZY_REDUCTION_MIN_TERMS) {
+    // Long sums are reduced once per column rather than after every
+    // product, and do not need the companions
+    lazyInnerProduct(row, aRows, bRows, n, len, pi);
+    return;
+  }
+
+  if (pRows != nullptr) {
+    for (long j : range(len)) {
+      long acc = NTL::MulModPrecon(aRows[0][j], bRows[0][j], pi, pRows[0][j]);
+      for (long t : range(1, n))
+        acc = NTL::AddMod(
+            acc,
+            NTL::MulModPrecon(aRows[t][j], bRows[t][j], pi, pRows[t][j]),
+            pi);
+      row[j] = acc;
+    }
+    return;
+  }
+
+  NTL::mulmod_t pi_inv = q.getQInv();
+  for (long j : range(len)) {
+    long acc = NTL::MulMod(aRows[0][j], bRows[0][j], pi, pi_inv);
+    for (long t : range(1, n))
+      acc = NTL::AddMod(acc,
+                        NTL::MulMod(aRows[t][j], bRows[t][j], pi, pi_inv),
+                        pi);
+    row[j] = acc;
+  }
+#endif // USE_INTEL_HEXL
+}
+
+DoubleCRT& DoubleCRT::innerProductImpl(
+    const std::vector<const DoubleCRT*>& a,
+    const std::vector<const DoubleCRT*>& b,
+    const std::vector<DoubleCRTPrecon>* bPrecon)
+{
+  HELIB_TIMER_START;
+
+  assertTrue(!a.empty(), "Inner product of empty vectors");
+  assertTrue(b.size() >= a.size(), "Inner product: b is shorter than a");
+  assertTrue(bPrecon == nullptr || bPrecon->size() >= a.size(),
+             "Inner product: missing companions of b");
+
+  const IndexSet s = a[0]->getIndexSet();
+  long n = a.size();
+  for (long t : range(n)) {
+    if (&a[t]->context != &context || &b[t]->context != &context)
+      throw RuntimeError("DoubleCRT::innerProduct: incompatible objects");
+    if (a[t] == this || b[t] == this)
+      throw RuntimeError("DoubleCRT::innerProduct: *this is an operand");
+    if (a[t]->getIndexSet() != s || !(s <= b[t]->getIndexSet()))
+      throw RuntimeError("DoubleCRT::innerProduct: index sets do not match");
+    if (bPrecon != nullptr && !(s <= (*bPrecon)[t].getIndexSet()))
+      throw RuntimeError("DoubleCRT::innerProduct: companions do not match");
+  }
+
+  map.setIndexSet(s);
+  if (isDryRun())
+    return *this;
+
+  long phim = context.getPhiM();
+
+  if (const ResidueBackend* backend = context.getResidueBackend()) {
+    std::vector<long*> rows;
+    std::vector<long> moduli;
+    backendRows(rows, moduli, map, s, context);
+    std::vector<std::vector<const long*>> aRows(n), bRows(n);
+    std::vector<const long* const*> aTerms(n), bTerms(n);
+    for (long t : range(n)) {
+      aRows[t] = backendRows(a[t]->map, s);
+      bRows[t] = backendRows(b[t]->map, s);
+      aTerms[t] = aRows[t].data();
+      bTerms[t] = bRows[t].data();
+    }
+    backend->innerProduct(rows.data(),
+                          aTerms.data(),
+                          bTerms.data(),
+                          n,
+                          moduli.data(),
+                          lsize(rows),
+                          phim);
+    return *this;
+  }
+
+  NTL::Vec<long> ivec;
+  long icard = MakeIndexVector(s, ivec);
+
+  // Split the columns into as many blocks as needed to give every thread a
+  // cell of the grid, but do not make the blocks too small
+  const long minBlockSize = tuningProfile(context).innerProductMinBlock;
+  long blocks = (availableThreads() + icard - 1) / icard;
+  blocks = std::max(1L, std::min(blocks, phim / minBlockSize));
+  long blockSize = (phim + blocks - 1) / blocks;
+
+  HELIB_EXEC_RANGE(icard * blocks, first, last)
+  std::vector<const long*> aRows(n), bRows(n);
+  std::vector<const NTL::mulmod_precon_t*> pRows(n);
+  std::vector<long> tmp(blockSize);
+  for (long cell = first; cell < last; cell++) {
+    long i = ivec[cell / blocks];
+    long lo = (cell % blocks) * blockSize;
+    long len = std::min(phim, lo + blockSize) - lo;
+    if (len <= 0)
+      continue;
+
+    for (long t : range(n)) {
+      aRows[t] = a[t]->map[i] + lo;
+      bRows[t] = b[t]->map[i] + lo;
+      if (bPrecon != nullptr)
+        pRows[t] = (*bPrecon)[t][i] + lo;
+    }
+    innerProductCell(map.uniqueRow(i) + lo,
+                     aRows.data(),
+                     bRows.data(),
+                     bPrecon != nullptr ? pRows.data() : nullptr,
+                     n,
+                     len,
+                     context.ithModulus(i),
+                     tmp.data());
+  }
+  HELIB_EXEC_RANGE_END
+
+  return *this;
+}
+
+void DoubleCRT::innerProducts(
+    const std::vector<DoubleCRT*>& out,
+    const std::vector<std::vector<const DoubleCRT*>>& a,
+    const std::vector<const DoubleCRT*>& b,
+    const std::vector<DoubleCRTPrecon>* bPrecon)
+{
+  HELIB_TIMER_START;
+
+  assertEq(out.size(), a.size(), "Inner products: one output per operand");
+  if (out.empty())
+    return;
+  const Context& context = out[0]->context;
+
+  long n = a[0].size();
+  assertTrue(n > 0, "Inner products of empty vectors");
+  assertTrue(lsize(b) >= n, "Inner products: b is shorter than a");
+  assertTrue(bPrecon == nullptr || lsize(*bPrecon) >= n,
+             "Inner products: missing companions of b");
+  const IndexSet s = a[0][0]->getIndexSet();
+  for (long t : range(n)) {
+    if (&b[t]->context != &context)
+      throw RuntimeError("DoubleCRT::innerProducts: incompatible objects");
+    if (!(s <= b[t]->getIndexSet()))
+      throw RuntimeError("DoubleCRT::innerProducts: index sets do not match");
+    if (bPrecon != nullptr && !(s <= (*bPrecon)[t].getIndexSet()))
+      throw RuntimeError("DoubleCRT::innerProducts: companions do not match");
+  }
+  for (long c : range(lsize(out))) {
+    assertEq(lsize(a[c]), n, "Inner products: operands of different lengths");
+    if (&out[c]->context != &context)
+      throw RuntimeError("DoubleCRT::innerProducts: incompatible objects");
+    for (long t : range(n)) {
+      if (&a[c][t]->context != &context)
+        throw RuntimeError("DoubleCRT::innerProducts: incompatible objects");
+      if (a[c][t]->getIndexSet() != s)
+        throw RuntimeError("DoubleCRT::innerProducts: index sets do not match");
+      for (const DoubleCRT* d : out)
+        if (a[c][t] == d || b[t] == d)
+          throw RuntimeError("DoubleCRT::innerProducts: output is an operand");
+    }
+  }
+
+  if (context.getResidueBackend() != nullptr) {
+    for (long c : range(lsize(out)))
+      out[c]->innerProductImpl(a[c], b, bPrecon);
+    return;
+  }
+
+  for (DoubleCRT* d : out)
+    d->map.setIndexSet(s);
+  if (isDryRun())
+    return;
+
+  long phim = context.getPhiM();
+  NTL::Vec<long> ivec;
+  long icard = MakeIndexVector(s, ivec);
+
+  // A tile of the b[i] (and of their companions) fills about half of a
+  // 512KB second-level cache. Use more, smaller tiles if the threads need
+  // them, but not smaller than the blocks of innerProduct.
+  const long tileBytes = 1L << 18;
+  const long minBlockSize = tuningProfile(context).innerProductMinBlock;
+  long bytesPerColumn = n * sizeof(long) * (bPrecon != nullptr ? 2 : 1);
+  long blockSize = std::max(minBlockSize, tileBytes / bytesPerColumn);
+  long blocks = (phim + blockSize - 1) / blockSize;
+  long threadBlocks = (availableThreads() + icard - 1) / icard;
+  if (threadBlocks > blocks) {
+    blocks = std::max(1L, std::min(threadBlocks, phim / minBlockSize));
+    blockSize = (phim + blocks - 1) / blocks;
+  }
+
+  HELIB_EXEC_RANGE(icard * blocks, first, last)
+  std::vector<const long*> aRows(n), bRows(n);
+  std::vector<const NTL::mulmod_precon_t*> pRows(n);
+  std::vector<long> tmp(blockSize);
+  for (long cell = first; cell < last; cell++) {
+    long i = ivec[cell / blocks];
+    long lo = (cell % blocks) * blockSize;
+    long len = std::min(phim, lo + blockSize) - lo;
+    if (len <= 0)
+      continue;
+
+    for (long t : range(n)) {
+      bRows[t] = b[t]->map[i] + lo;
+      if (bPrecon != nullptr)
+        pRows[t] = (*bPrecon)[t][i] + lo;
+    }
+    for (long c : range(lsize(out))) {
+      for (long t : range(n))
+        aRows[t] = a[c][t]->map[i] + lo;
+      innerProductCell(out[c]->map.uniqueRow(i) + lo,
+                       aRows.data(),
+                       bRows.data(),
+                       bPrecon != nullptr ? pRows.data() : nullptr,
+                       n,
+                       len,
+                       context.ithModulus(i),
+                       tmp.data());
+    }
+  }
+  HELIB_EXEC_RANGE_END
+}
+
+DoubleCRT& DoubleCRT::setMulAdd(const DoubleCRT& x,
+                                 const DoubleCRTPrecon& xPrecon,
+                                 const DoubleCRT& a,
+                                 const DoubleCRT& b,
+                                 long f)
+{
+  HELIB_TIMER_START;
+
+  if (&x.context != &context || &a.context != &context ||
+      &b.context != &context)
+    throw RuntimeError("DoubleCRT::setMulAdd: incompatible objects");
+  if (&x == this || &a == this || &b == this)
+    throw RuntimeError("DoubleCRT::setMulAdd: *this is an operand");
+
+  const IndexSet s = x.getIndexSet();
+  bool usePrecon = !empty(xPrecon.getIndexSet());
+  if (!(s <= a.getIndexSet()) || (f != 0 && !(s <= b.getIndexSet())))
+    throw RuntimeError("DoubleCRT::setMulAdd: index sets do not match");
+  if (usePrecon && !(s <= xPrecon.getIndexSet()))
+    throw RuntimeError("DoubleCRT::setMulAdd: companions do not match");
+
+  map.setIndexSet(s);
+  if (isDryRun())
+    return *this;
+
+  long phim = context.getPhiM();
+  NTL::Vec<long> ivec;
+  long icard = MakeIndexVector(s, ivec);
+
+  // The same grid of primes times blocks of columns as innerProduct
+  const long minBlockSize = tuningProfile(context).innerProductMinBlock;
+  long blocks = (availableThreads() + icard - 1) / icard;
+  blocks = std::max(1L, std::min(blocks, phim / minBlockSize));
+  long blockSize = (phim + blocks - 1) / blocks;
+
+  HELIB_EXEC_RANGE(icard * blocks, first, last)
+  for (long cell = first; cell < last; cell++) {
+    long i = ivec[cell / blocks];
+    long lo = (cell % blocks) * blockSize;
+    long len = std::min(phim, lo + blockSize) - lo;
+    if (len <= 0)
+      continue;
+
+    long pi = context.ithPrime(i);
+    long fi = f % pi;
+    if (fi < 0)
+      fi += pi;
+    long* row = map.uniqueRow(i) + lo;
+    const long* xRow = x.map[i] + lo;
+    const long* aRow = a.map[i] + lo;
+    const long* bRow = (f != 0) ? b.map[i] + lo : nullptr;
+
+#ifdef USE_INTEL_HEXL
+    // HEXL has its own vectorized reduction, the companions are not needed
+    intel::EltwiseMultMod(row, xRow, aRow, len, pi);
+    if (bRow != nullptr)
+      intel::EltwiseFMAMod(row, bRow, fi, row, len, pi);
+#else
+    const NTL::mulmod_precon_t* xp = usePrecon ? xPrecon[i] + lo : nullptr;
+    NTL::mulmod_t pi_inv = context.ithModulus(i).getQInv();
+    NTL::mulmod_precon_t fPrecon = NTL::PrepMulModPrecon(fi, pi);
+    for (long j : range(len)) {
+      long acc = (xp != nullptr)
+                     ? NTL::MulModPrecon(aRow[j], xRow[j], pi, xp[j])
+                     : NTL::MulMod(aRow[j], xRow[j], pi, pi_inv);
+      if (bRow != nullptr)
+        acc = NTL::AddMod(acc, NTL::MulModPrecon(bRow[j], fi, pi, fPrecon), pi);
+      row[j] = acc;
+    }
+#endif // USE_INTEL_HEXL
+  }
+  HELIB_EXEC_RANGE_END
+
+  return *this;
+}
+
+void DoubleCRTPrecon::setOffsets()
+{
+  offsets.assign(empty(indexSet) ? 0 : indexSet.last() + 1, -1);
+  long pos = 0;
+  for (long i : indexSet) {
+    offsets[i] = pos;
+    pos += rowLen;
+  }
+}
+
+DoubleCRTPrecon::DoubleCRTPrecon(const DoubleCRT& dcrt) :
+    indexSet(dcrt.getIndexSet()), rowLen(dcrt.getContext().getPhiM())
+{
+  const Context& context = dcrt.getContext();
+  // From the same storage as the residues, see allocateResidueStorage
+  std::size_t bytes = indexSet.card() * rowLen * sizeof(NTL::mulmod_precon_t);
+  std::shared_ptr<NTL::mulmod_precon_t> rows(
+      static_cast<NTL::mulmod_precon_t*>(allocateResidueStorage(bytes)),
+      [bytes](NTL::mulmod_precon_t* p) { releaseResidueStorage(p, bytes); });
+  setOffsets();
+
+  for (long i : indexSet) {
+    long pi = context.ithPrime(i);
+    const long* row = dcrt.getMap()[i];
+    NTL::mulmod_precon_t* precon = rows.get() + offsets[i];
+    for (long j : range(rowLen))
+      precon[j] = NTL::PrepMulModPrecon(row[j], pi);
+  }
+  data = std::move(rows);
+}
+
+DoubleCRTPrecon::DoubleCRTPrecon(const IndexSet& s,
+                                 long rowLen,
+                                 const NTL::mulmod_precon_t* rows,
+                                 std::shared_ptr<const void> owner) :
+    indexSet(s), rowLen(rowLen), data(owner, rows)
+{
+  setOffsets();
+}
+
 // break *this into n digits,according to the primeSets in context.digits
 // returns the sum of the canonical embedding norms of the digits
 NTL::xdouble DoubleCRT::breakIntoDigits(std::vector<DoubleCRT>& digits) const
+{
+  return breakIntoDigits(digits, context.getSpecialPrimes());
+}
+
+NTL::xdouble DoubleCRT::breakIntoDigits(std::vector<DoubleCRT>& digits,
+                                        const IndexSet& specialPrimes) const
+{
+  digits.clear();
+  return forEachDigit(specialPrimes, [&digits](long, DoubleCRT& digit) {
+    digits.push_back(std::move(digit));
+  });
+}
+
+// Digit i is the remainder mod the primes of digit i, and the remainder is
+// then reduced by it and divided by the product of these primes, so only
+// the remainder and the current digit are kept
+NTL::xdouble DoubleCRT::forEachDigit(
+    const IndexSet& specialPrimes,
+    const std::function<void(long, DoubleCRT&)>& f) const
 {
   HELIB_TIMER_START;
 
@@ -492,7 +1301,7 @@ NTL::xdouble DoubleCRT::breakIntoDigits(std::vector<DoubleCRT>& digits) const
     remainingPrimes.remove(context.getDigits().at(n));
   }
 
-  IndexSet allPrimes = getIndexSet() | context.getSpecialPrimes();
+  IndexSet allPrimes = getIndexSet() | specialPrimes;
 
   assertTrue(getIndexSet() <= context.getCtxtPrimes(),
              "Index set must be a subset of ctxt primes");
@@ -502,41 +1311,45 @@ NTL::xdouble DoubleCRT::breakIntoDigits(std::vector<DoubleCRT>& digits) const
   assertTrue(n <= (long)context.getDigits().size(),
              "n cannot be larger than the size of context.digits");
 
-  digits.resize(n, DoubleCRT(context, IndexSet::emptySet()));
-  if (isDryRun())
+  if (isDryRun()) {
+    for (long i : range(n)) {
+      DoubleCRT digit(context, IndexSet::emptySet());
+      f(i, digit);
+    }
     return NTL::conv<NTL::xdouble>(0.0);
-
-  for (long i : range(n)) {
-    digits[i] = *this;
-    IndexSet notInDigit = digits[i].getIndexSet() / context.getDigit(i);
-    digits[i].removePrimes(notInDigit); // reduce modulo the digit primes
   }
 
   NTL::xdouble noise(0.0);
+  DoubleCRT remainder = *this;
+
+  for (long i : range(n)) {
+    DoubleCRT digit = remainder;
+    IndexSet notInDigit = digit.getIndexSet() / context.getDigit(i);
+    digit.removePrimes(notInDigit); // reduce modulo the digit primes
+    remainder.removePrimes(digit.getIndexSet());
 
-  for (long i : range(digits.size())) {
     HELIB_NTIMER_START(addPrimes_5);
-    IndexSet notInDigit = allPrimes / digits[i].getIndexSet();
+    notInDigit = allPrimes / digit.getIndexSet();
 
 #if 0
 // This version coumputes a high-probability bound
 
-    double digitSize = context.logOfProduct(digits[i].getIndexSet());
+    double digitSize = context.logOfProduct(digit.getIndexSet());
     NTL::xdouble norm_bnd =
       context.noiseBoundForUniform( NTL::xexp(digitSize)/2.0, phim );
     noise += norm_bnd;
 
-    digits[i].addPrimes(notInDigit); // add back all the primes
+    digit.addPrimes(notInDigit); // add back all the primes
 
 #else
     // This version computes an "exact" value
 
-    double digitSize = context.logOfProduct(digits[i].getIndexSet());
+    double digitSize = context.logOfProduct(digit.getIndexSet());
     NTL::xdouble norm_bnd =
         context.noiseBoundForUniform(NTL::xexp(digitSize) / 2.0, phim);
 
     NTL::ZZX poly;
-    digits[i].addPrimes(notInDigit, &poly); // add back all the primes
+    digit.addPrimes(notInDigit, &poly); // add back all the primes
 
     HELIB_NTIMER_START(NORM_VAL);
     NTL::xdouble norm_val = embeddingLargestCoeff(poly, context.getZMStar());
@@ -549,11 +1362,11 @@ NTL::xdouble DoubleCRT::breakIntoDigits(std::vector<DoubleCRT>& digits) const
 
 #endif
 
-    NTL::ZZ pi = context.productOfPrimes(context.getDigit(i));
-    for (long j : range(i + 1, digits.size())) {
-      digits[j].Sub(digits[i], /*matchIndexSets=*/false);
-      digits[j] /= pi;
+    if (i + 1 < n) {
+      remainder.Sub(digit, /*matchIndexSets=*/false);
+      remainder /= context.productOfPrimes(context.getDigit(i));
     }
+    f(i, digit);
   }
   HELIB_TIMER_STOP;
 
@@ -628,34 +1441,28 @@ double DoubleCRT::addPrimesAndScale(const IndexSet& s1)
   for (long i : iSet) {
     long qi = context.ithPrime(i);
     long f = rem(factor, qi); // f = factor % qi
-    NTL::vec_long& row = map[i];
+    long* row = map[i];
     // scale row by a factor of f modulo qi
+#ifdef USE_INTEL_HEXL
+    intel::EltwiseMultMod(row, row, f, phim, qi);
+#else
     NTL::mulmod_precon_t bninv = NTL::PrepMulModPrecon(f, qi);
     for (long j : range(phim))
       row[j] = NTL::MulModPrecon(row[j], f, qi, bninv);
+#endif
   }
 
-  // insert new rows and fill them with zeros
-  map.insert(s1); // add new rows to the map
-  for (long i : s1) {
-    NTL::vec_long& row = map[i];
-    for (long j : range(phim))
-      row[j] = 0;
-  }
+  // insert new rows, the slab fills them with zeros
+  map.insert(s1);
 
   return logFactor;
 }
 
 // *****************************************************
-DoubleCRTHelper::DoubleCRTHelper(const Context& context)
-{
-  val = context.getPhiM();
-}
-
 DoubleCRT::DoubleCRT(const NTL::ZZX& poly,
                      const Context& _context,
                      const IndexSet& s) :
-    context(_context), map(new DoubleCRTHelper(_context))
+    context(_context), map(_context.getPhiM())
 {
   HELIB_TIMER_START;
   assertTrue(s.last() < context.numPrimes(),
@@ -675,7 +1482,7 @@ DoubleCRT::DoubleCRT(const NTL::ZZX& poly,
 // FIXME-IndexSet
 #if 0
 DoubleCRT::DoubleCRT(const NTL::ZZX& poly, const Context &_context)
-: context(_context), map(new DoubleCRTHelper(_context))
+: context(_context), map(_context.getPhiM())
 {
   HELIB_TIMER_START;
   IndexSet s = IndexSet(0, context.numPrimes()-1);
@@ -692,7 +1499,7 @@ DoubleCRT::DoubleCRT(const NTL::ZZX& poly, const Context &_context)
 }
 
 DoubleCRT::DoubleCRT(const NTL::ZZX& poly)
-: context(*activeContext), map(new DoubleCRTHelper(*activeContext))
+: context(*activeContext), map(activeContext->getPhiM())
 {
   HELIB_TIMER_START;
   IndexSet s = IndexSet(0, context.numPrimes()-1);
@@ -715,7 +1522,7 @@ DoubleCRT::DoubleCRT(const NTL::ZZX& poly)
 DoubleCRT::DoubleCRT(const zzX& poly,
                      const Context& _context,
                      const IndexSet& s) :
-    context(_context), map(new DoubleCRTHelper(_context))
+    context(_context), map(_context.getPhiM())
 {
   HELIB_TIMER_START;
   assertTrue(s.last() < context.numPrimes(),
@@ -735,7 +1542,7 @@ DoubleCRT::DoubleCRT(const zzX& poly,
 // FIXME-IndexSet
 #if 0
 DoubleCRT::DoubleCRT(const zzX& poly, const Context &_context)
-: context(_context), map(new DoubleCRTHelper(_context))
+: context(_context), map(_context.getPhiM())
 {
   HELIB_TIMER_START;
   IndexSet s = IndexSet(0, context.numPrimes()-1);
@@ -753,7 +1560,7 @@ DoubleCRT::DoubleCRT(const zzX& poly, const Context &_context)
 }
 
 DoubleCRT::DoubleCRT(const zzX& poly)
-: context(*activeContext), map(new DoubleCRTHelper(*activeContext))
+: context(*activeContext), map(activeContext->getPhiM())
 {
   HELIB_TIMER_START;
   IndexSet s = IndexSet(0, context.numPrimes()-1);
@@ -772,22 +1579,12 @@ DoubleCRT::DoubleCRT(const zzX& poly)
 #endif
 
 DoubleCRT::DoubleCRT(const Context& _context, const IndexSet& s) :
-    context(_context), map(new DoubleCRTHelper(_context))
+    context(_context), map(_context.getPhiM())
 {
   assertTrue(s.last() < context.numPrimes(),
              "s must end with a smaller element than context.numPrimes()");
 
-  map.insert(s);
-  if (isDryRun())
-    return;
-
-  long phim = context.getPhiM();
-
-  for (long i : s) {
-    NTL::vec_long& row = map[i];
-    for (long j : range(phim))
-      row[j] = 0;
-  }
+  map.insert(s); // the new rows are all zero
 }
 
 // *****************************************************
@@ -795,7 +1592,7 @@ DoubleCRT::DoubleCRT(const Context& _context, const IndexSet& s) :
 // FIXME-IndexSet
 #if 0
 DoubleCRT::DoubleCRT(const Context &_context)
-: context(_context), map(new DoubleCRTHelper(_context))
+: context(_context), map(_context.getPhiM())
 {
   IndexSet s = IndexSet(0, context.numPrimes()-1);
   // FIXME: maybe the default index set should be determined by context?
@@ -806,7 +1603,7 @@ DoubleCRT::DoubleCRT(const Context &_context)
   long phim = context.getPhiM();
 
   for (long i = s.first(); i <= s.last(); i = s.next(i)) {
-    NTL::vec_long& row = map[i];
+    long* row = map[i];
     for (long j = 0; j < phim; j++) row[j] = 0;
   }
 }
@@ -821,18 +1618,19 @@ DoubleCRT& DoubleCRT::operator=(const DoubleCRT& other)
   if (&context != &other.context)
     throw RuntimeError("DoubleCRT assignment: incompatible contexts");
 
-  if (map.getIndexSet() != other.map.getIndexSet()) {
-    map = other.map; // copy the data
-  } else {
-    const IndexSet& s = map.getIndexSet();
-    long phim = context.getPhiM();
-    for (long i : s) {
-      NTL::vec_long& row = map[i];
-      const NTL::vec_long& other_row = other.map[i];
-      for (long j : range(phim))
-        row[j] = other_row[j];
-    }
-  }
+  map = other.map; // shares the slab until one of them is written
+  return *this;
+}
+
+DoubleCRT& DoubleCRT::operator=(DoubleCRT&& other)
+{
+  if (this == &other)
+    return *this;
+
+  if (&context != &other.context)
+    throw RuntimeError("DoubleCRT assignment: incompatible contexts");
+
+  map = std::move(other.map);
   return *this;
 }
 
@@ -872,7 +1670,7 @@ DoubleCRT& DoubleCRT::operator=(const NTL::ZZ& num)
   long phim = context.getPhiM();
 
   for (long i : s) {
-    NTL::vec_long& row = map[i];
+    long* row = map[i];
     long pi = context.ithPrime(i);
     long n = rem(num, pi);
 
@@ -923,14 +1721,33 @@ long DoubleCRT::getOneRow(NTL::Vec<long>& row, long idx, bool positive) const
 
 // A parallelizable implementation of toPoly
 void DoubleCRT::toPoly(NTL::ZZX& poly, const IndexSet& s, bool positive) const
+{
+  toPolys({&poly}, {this}, s, positive);
+}
+
+void DoubleCRT::toPolys(const std::vector<NTL::ZZX*>& polys,
+                        const std::vector<const DoubleCRT*>& dcrts,
+                        const IndexSet& s,
+                        bool positive)
 {
   HELIB_TIMER_START;
-  if (isDryRun())
+  assertEq(polys.size(), dcrts.size(), "toPolys: sizes do not match");
+  if (isDryRun() || dcrts.empty())
     return;
 
-  IndexSet s1 = map.getIndexSet() & s;
+  const Context& context = dcrts[0]->context;
+  long n = dcrts.size();
+  IndexSet s1 = dcrts[0]->map.getIndexSet() & s;
+  for (const DoubleCRT* d : dcrts) {
+    if (&d->context != &context)
+      throw RuntimeError("DoubleCRT::toPolys: incompatible objects");
+    if ((d->map.getIndexSet() & s) != s1)
+      throw RuntimeError("DoubleCRT::toPolys: index sets do not match");
+  }
+
   if (empty(s1)) { // nothing to do
-    clear(poly);
+    for (NTL::ZZX* poly : polys)
+      clear(*poly);
     return;
   }
 
@@ -940,135 +1757,107 @@ void DoubleCRT::toPoly(NTL::ZZX& poly, const IndexSet& s, bool positive) const
   static thread_local NTL::Vec<long> tls_ivec;
   static thread_local NTL::Vec<long> tls_pvec;
   static thread_local NTL::Vec<NTL::Vec<long>> tls_remtab;
-  static thread_local NTL::Vec<NTL::zz_pX> tls_tmpvec;
+  static thread_local NTL::Vec<NTL::Vec<NTL::zz_pX>> tls_tmpvec;
 
   // For readability, call them by names without the tls_
   NTL::Vec<long>& ivec = tls_ivec; // the indexes of the active primes
-  // remtab[*][i] = coeffs of tmpvec[i]
+  // remtab[t*phim + h][j] = coeff h of polynomial t mod the j'th prime
   NTL::Vec<NTL::Vec<long>>& remtab = tls_remtab;
-  // tmpvec[i] = current poly in i'th thread
-  NTL::Vec<NTL::zz_pX>& tmpvec = tls_tmpvec;
+  // tmpvec[i] = current polys in i'th thread
+  NTL::Vec<NTL::Vec<NTL::zz_pX>>& tmpvec = tls_tmpvec;
 
   // initialize the ivec vector, ivec[j] = index of j'th active prime
   long phim = context.getPhiM();
   long icard = MakeIndexVector(s1, ivec); // icard = how many active primes
 
-  // Which primes are handled by what thread
-  NTL::PartitionInfo pinfo(icard); // allocate threads to handle icard primes
+  // The n*icard inverse transforms are split into cells of one prime and a
+  // block of consecutive polynomials, the blocks being split only when there
+  // are fewer primes than threads. Every thread handles an interval of
+  // cells, setting up each of its moduli once for a whole block
+  long blocks = (availableThreads() + icard - 1) / icard;
+  blocks = std::max(1L, std::min(blocks, n));
+  long blockSize = (n + blocks - 1) / blocks;
+  NTL::PartitionInfo pinfo(icard * blocks, availableThreads());
   long cnt = pinfo.NumIntervals(); // how many threads are allocated
 
   // allocate space for all the coefficients modulo all the primes
-  remtab.SetLength(phim);
-  for (long h : range(phim))
+  remtab.SetLength(n * phim);
+  for (long h : range(n * phim))
     remtab[h].SetLength(icard);
 
   // allocate space for the polynomials modulo all the primes
   tmpvec.SetLength(cnt);
-  for (long i : range(cnt))
-    tmpvec[i].SetMaxLength(phim);
+  for (long i : range(cnt)) {
+    tmpvec[i].SetLength(blockSize);
+    for (long t : range(blockSize))
+      tmpvec[i][t].SetMaxLength(phim);
+  }
 
   // Run the inverse FFT modulo the different primes in parallel
   {
     HELIB_NTIMER_START(toPoly_FFT);
-    NTL_EXEC_INDEX(cnt, index)
+    HELIB_EXEC_INDEX(cnt, index)
     long first, last;
     pinfo.interval(first, last, index);
 
-    NTL::zz_pX& tmp = tmpvec[index];
+    NTL::zz_pX* tmp = tmpvec[index].elts();
+    std::vector<const long*> rows(blockSize);
 
-    for (long j : range(first, last)) {
+    for (long cell : range(first, last)) {
+      long j = cell / blocks;
       long i = ivec[j];
-      context.ithModulus(i).iFFT(tmp, map[i]); // inverse FFT
-
-      long d = deg(tmp); // copy the coefficients, pad by zeros if needed
-      for (long h = 0; h <= d; h++)
-        remtab[h][j] = rep(tmp.rep[h]);
-      for (long h = d + 1; h < phim; h++)
-        remtab[h][j] = 0;
+      long lo = (cell % blocks) * blockSize;
+      long len = std::min(n, lo + blockSize) - lo;
+      if (len <= 0)
+        continue;
+
+      for (long t : range(len))
+        rows[t] = dcrts[lo + t]->map[i];
+      context.ithModulus(i).iFFT(tmp, rows.data(), len); // inverse FFTs
+
+      for (long t : range(len)) {
+        NTL::Vec<long>* rem = remtab.elts() + (lo + t) * phim;
+        long d = deg(tmp[t]); // copy the coefficients, pad by zeros if needed
+        for (long h = 0; h <= d; h++)
+          rem[h][j] = rep(tmp[t].rep[h]);
+        for (long h = d + 1; h < phim; h++)
+          rem[h][j] = 0;
+      }
     }
-    NTL_EXEC_INDEX_END
+    HELIB_EXEC_INDEX_END
   } // release space of local variables
 
   // Run the integer CRT in parallel for the different coefficients
   {
     HELIB_NTIMER_START(toPoly_CRT);
-    NTL::PartitionInfo pinfo1(phim);
+    NTL::PartitionInfo pinfo1(n * phim, availableThreads());
     long cnt1 = pinfo1.NumIntervals();
 
-    // static thread-local variables to avoid re-allocation
-    static thread_local NTL::ZZ tls_prod;
-    static thread_local NTL::ZZ tls_prod_half;
-    static thread_local NTL::Vec<long> tls_qvec;
-    static thread_local NTL::Vec<double> tls_qrecipvec;
-    static thread_local NTL::Vec<long> tls_tvec;
-    static thread_local NTL::Vec<NTL::mulmod_precon_t> tls_tqinvvec;
+    // The constants of the prime set are computed once per context
+    const CRTTable& crt = context.getCRTTable(s1);
+    const NTL::ZZ& prod = crt.product;          // product of all the primes
+    const NTL::ZZ& prod_half = crt.productHalf; // = (prod+1)/2
+    long sz = prod.size();                      // size of the product
 
-    static thread_local NTL::ZZVec tls_prod1vec;
+    // static thread-local variable to avoid re-allocation
     static thread_local NTL::ZZVec tls_resvec;
-
-    NTL::ZZ& prod = tls_prod;            // product of all the primes
-    NTL::ZZ& prod_half = tls_prod_half;  // = (prod+1)/2
-    NTL::ZZVec& prod1vec = tls_prod1vec; // prod1vec[i] = prod / qi
-    NTL::Vec<long>& qvec = tls_qvec;     // vector of the primes themselves
-    NTL::Vec<double>& qrecipvec = tls_qrecipvec; // keeps 1/qi for each prime qi
-    NTL::Vec<long>& tvec = tls_tvec; // tvec[i] = (prod / qi)^{-1} mod qi
-    // tvec with extra tables
-    NTL::Vec<NTL::mulmod_precon_t>& tqinvvec = tls_tqinvvec;
     NTL::ZZVec& resvec = tls_resvec;
-
-    qvec.SetLength(icard);
-    qrecipvec.SetLength(icard);
-    tvec.SetLength(icard);
-    tqinvvec.SetLength(icard);
-
-    // store the primes and reciprocals, and compute their product
-    prod = 1;
-    for (long j : range(icard)) {
-      long i = ivec[j];
-      long q = context.ithModulus(i).getQ(); // the prime
-      qvec[j] = q;
-      qrecipvec[j] = 1 / double(q);
-      mul(prod, prod, q);
-    }
-    long sz = prod.size(); // size of the product
-
-    // reallocate space only if needed
-    if (prod1vec.length() != icard || prod1vec.BaseSize() != sz + 1) {
-      prod1vec.kill();
-      prod1vec.SetSize(icard, sz + 1); // icard integers of size<=sz+1 each
-    }
-
-    // compute (prod / qi)^{-1} mod qi
-    for (long j : range(icard)) {
-      long q = qvec[j];
-      div(prod1vec[j], prod, q);
-      long t = rem(prod1vec[j], q);
-      t = NTL::InvMod(t, q);
-      tvec[j] = t;
-      tqinvvec[j] = NTL::PrepMulModPrecon(t, q);
-    }
-
-    if (resvec.length() != phim || resvec.BaseSize() != sz + 1) {
+    if (resvec.length() != n * phim || resvec.BaseSize() != sz + 1) {
       resvec.kill();
-      resvec.SetSize(phim, sz + 1);
-    }
-
-    if (!positive) { // prod_half = (prod+1)/2
-      add(prod_half, prod, 1);
-      div(prod_half, prod_half, 2);
+      resvec.SetSize(n * phim, sz + 1);
     }
 
     // Compute the actual CRT reconstruction
-    NTL_EXEC_INDEX(cnt1, index)
+    HELIB_EXEC_INDEX(cnt1, index)
     NTL_IMPORT(icard)
     long first, last;
     pinfo1.interval(first, last, index);
 
-    long* qvecp = qvec.elts();
-    double* qrecipvecp = qrecipvec.elts();
-    long* tvecp = tvec.elts();
-    NTL::mulmod_precon_t* tqinvvecp = tqinvvec.elts();
-    NTL::ZZ* prod1vecp = prod1vec.elts();
+    const long* qvecp = crt.primes.data();
+    const double* qrecipvecp = crt.recip.data();
+    const long* tvecp = crt.hatInv.data();   // (prod / qi)^{-1} mod qi
+    const NTL::mulmod_precon_t* tqinvvecp = crt.hatInvPrecon.data();
+    const NTL::ZZ* prod1vecp = crt.hat.elts(); // prod / qi
 
     NTL::ZZ tmp;
     tmp.SetSize(sz + 4);
@@ -1099,12 +1888,15 @@ void DoubleCRT::toPoly(NTL::ZZX& poly, const IndexSet& s, bool positive) const
         tmp -= prod;
       resvec[h] = tmp;
     }
-    NTL_EXEC_INDEX_END
+    HELIB_EXEC_INDEX_END
 
-    poly.SetLength(phim);
-    for (long j : range(phim))
-      poly[j] = resvec[j];
-    poly.normalize();
+    for (long t : range(n)) {
+      NTL::ZZX& poly = *polys[t];
+      poly.SetLength(phim);
+      for (long j : range(phim))
+        poly[j] = resvec[t * phim + j];
+      poly.normalize();
+    }
 
     // NOTE: assigning to poly[j] within the parallel loop
     // leads to horrible performance, as there apparently is
@@ -1112,6 +1904,93 @@ void DoubleCRT::toPoly(NTL::ZZX& poly, const IndexSet& s, bool positive) const
   }
 }
 
+// With y_j = r_j*(Q/q_j)^{-1} mod q_j for the residues r_j of c, we have
+// c = sum_j y_j*(Q/q_j) - v*Q for some integer v, hence
+// c*q/Q = sum_j (a_j + b_j/q_j) - v*q with y_j*q = a_j*q_j + b_j. The
+// term v*q vanishes modulo q and cancels in Y, so X and Y are obtained from
+// the a_j's and the rounded sum of the fractions b_j/q_j alone, with no
+// multi-precision integer ever formed.
+void DoubleCRT::scaleToModulus(zzX& x,
+                               zzX& y,
+                               std::vector<double>& frac,
+                               long q,
+                               long t) const
+{
+  HELIB_TIMER_START;
+  assertTrue<InvalidArgument>(q > 1 && t > 1,
+                              "scaleToModulus: moduli must be larger than 1");
+
+  long phim = context.getPhiM();
+  x.SetLength(phim);
+  y.SetLength(phim);
+  frac.assign(phim, 0.0);
+  for (long h : range(phim))
+    x[h] = y[h] = 0;
+
+  const IndexSet& s = map.getIndexSet();
+  if (isDryRun() || empty(s))
+    return;
+
+  // The fast base conversion constants, only those mod t are per call
+  const CRTTable& crt = context.getCRTTable(s);
+  const std::vector<long>& ivec = crt.indexes;
+  const std::vector<long>& qvec = crt.primes;
+  const std::vector<double>& qrecip = crt.recip;
+  const std::vector<long>& hatInv = crt.hatInv;
+  const std::vector<NTL::mulmod_precon_t>& hatInvPrecon = crt.hatInvPrecon;
+  long icard = lsize(qvec);
+  long QmodT = rem(crt.product, t);
+  std::vector<long> hatModT(icard); // Q/q_j mod t
+  for (long j : range(icard))
+    hatModT[j] = rem(crt.hat[j], t);
+
+  // The residues of the coefficients, one row per prime
+  std::vector<long> residues(icard * phim);
+  HELIB_EXEC_RANGE(icard, first, last)
+  NTL::zz_pX tmp;
+  for (long j = first; j < last; j++) {
+    context.ithModulus(ivec[j]).iFFT(tmp, map[ivec[j]]);
+    long* row = residues.data() + j * phim;
+    long d = deg(tmp); // copy the coefficients, pad by zeros if needed
+    for (long h = 0; h <= d; h++)
+      row[h] = rep(tmp.rep[h]);
+    for (long h = d + 1; h < phim; h++)
+      row[h] = 0;
+  }
+  HELIB_EXEC_RANGE_END
+
+  long qModT = q % t;
+  HELIB_EXEC_RANGE(phim, first, last)
+  for (long h = first; h < last; h++) {
+    long AmodQ = 0; // sum of the a_j's mod q
+    long AmodT = 0; // sum of the a_j's mod t
+    long SmodT = 0; // sum of the y_j*(Q/q_j)'s mod t
+    double f = 0;   // sum of the b_j/q_j's
+    for (long j : range(icard)) {
+      long qj = qvec[j];
+      long yj = NTL::MulModPrecon(residues[j * phim + h],
+                                  hatInv[j],
+                                  qj,
+                                  hatInvPrecon[j]);
+      uint128 prod = uint128(yj) * (unsigned long)q;
+      long a = long(prod / (unsigned long)qj); // a < q, since yj < qj
+      long b = long(prod % (unsigned long)qj);
+      AmodQ = NTL::AddMod(AmodQ, a, q);
+      AmodT = NTL::AddMod(AmodT, a % t, t);
+      SmodT = NTL::AddMod(SmodT, NTL::MulMod(yj % t, hatModT[j], t), t);
+      f += b * qrecip[j];
+    }
+    long rf = long(std::floor(f + 0.5)); // in [0, icard]
+    long XmodT = NTL::AddMod(AmodT, rf % t, t);
+    x[h] = NTL::AddMod(AmodQ, rf % q, q);
+    y[h] = NTL::SubMod(NTL::MulMod(qModT, SmodT, t),
+                       NTL::MulMod(QmodT, XmodT, t),
+                       t);
+    frac[h] = f - rf;
+  }
+  HELIB_EXEC_RANGE_END
+}
+
 void DoubleCRT::toPoly(NTL::ZZX& p, bool positive) const
 {
   const IndexSet& s = map.getIndexSet();
@@ -1130,10 +2009,14 @@ DoubleCRT& DoubleCRT::operator/=(const NTL::ZZ& num)
   for (long i : s) {
     long pi = context.ithPrime(i);
     long n = NTL::InvMod(rem(num, pi), pi); // n = num^{-1} mod pi
-    NTL::vec_long& row = map[i];
+    long* row = map[i];
+#ifdef USE_INTEL_HEXL
+    intel::EltwiseMultMod(row, row, n, phim, pi);
+#else
     NTL::mulmod_precon_t precon = NTL::PrepMulModPrecon(n, pi);
     for (long j : range(phim))
       row[j] = NTL::MulModPrecon(row[j], n, pi, precon);
+#endif
   }
   return *this;
 }
@@ -1149,7 +2032,7 @@ void DoubleCRT::Exp(long e)
 
   for (long i : s) {
     long pi = context.ithPrime(i);
-    NTL::vec_long& row = map[i];
+    long* row = map[i];
     for (long j : range(phim))
       row[j] = NTL::PowerMod(row[j], e, pi);
   }
@@ -1166,38 +2049,35 @@ void DoubleCRT::automorph(long k)
   if (!zMStar.inZmStar(k))
     throw RuntimeError("DoubleCRT::automorph: k not in Zm*");
 
-  long m = zMStar.getM();
   long phim = context.getPhiM();
-  std::vector<long> tmp(m); // temporary array of size m
-  NTL::mulmod_precon_t precon = NTL::PrepMulModPrecon(k, m);
-
-  const IndexSet& s = map.getIndexSet();
 
-  // go over the rows, permute them one at a time
-  for (long i : s) {
-    NTL::vec_long& row = map[i];
+  // new[j] = old[perm[j]], with the same table for all the rows
+  const long* perm = context.getAutomorphPerm(k).data();
 
-    // Compute new[j] = old[j*k mod m]
+  static thread_local std::vector<long> tls_tmp;
+  std::vector<long>& tmp = tls_tmp;
+  tmp.resize(phim);
 
-    // for (long j=1; j<m; j++) { // 1st pass: copy to temporary array
-    //   long idx = zMStar.indexInZmstar_unchecked(j);
-    //   if (idx>=0) tmp[j] = row[idx];
-    // }
-    // for (long j=1; j<m; j++) { // 2nd pass: copy back from temporary array
-    //   long idx = zMStar.indexInZmstar_unchecked(j);
-    //   if (idx>=0) row[idx] = tmp[NTL::MulModPrecon(j,k,m,precon)];
-    //                                        // new[j] = old[j*k mod m]
-    // }
+  const IndexSet& s = map.getIndexSet();
 
-    // slightly faster...
+  if (const ResidueBackend* backend = context.getResidueBackend()) {
+    std::vector<long*> rows;
+    std::vector<long> moduli;
+    backendRows(rows, moduli, map, s, context);
+    backend->permute(rows.data(), perm, lsize(rows), phim);
+    return;
+  }
 
-    for (long j : range(phim)) { // 1st pass: copy to temporary array
-      tmp[zMStar.repInZmstar_unchecked(j)] = row[j];
-    }
-    for (long j : range(phim)) { // 2nd pass: copy back from temp array
-      row[j] =
-          tmp[NTL::MulModPrecon(zMStar.repInZmstar_unchecked(j), k, m, precon)];
-    }
+  // go over the rows, permute them one at a time
+  for (long i : s) {
+    long* row = map[i];
+#ifdef USE_INTEL_HEXL
+    intel::Permute(tmp.data(), row, perm, phim);
+#else
+    for (long j : range(phim))
+      tmp[j] = row[perm[j]];
+#endif // USE_INTEL_HEXL
+    std::copy(tmp.begin(), tmp.end(), row);
   }
 }
 
@@ -1221,7 +2101,7 @@ void DoubleCRT::automorph(long k)
   // go over the rows, permute them one at a time
   // new[j*k mod m] = old[j]
   for (long i = s.first(); i <= s.last(); i = s.next(i)) {
-    NTL::vec_long& row = map[i];
+    long* row = map[i];
 
     for (long j = 0; j < phim; j++)
       tmp[j] = row[j];
@@ -1247,7 +2127,7 @@ void DoubleCRT::complexConj()
 
   // go over the rows, permute them one at a time
   for (long i : s) {
-    NTL::vec_long& row = map[i];
+    long* row = map[i];
     for (long j : range(phim / 2)) { // swap i <-> phi(m)-i-1
       std::swap(row[j], row[phim - j - 1]);
     }
@@ -1282,7 +2162,7 @@ void DoubleCRT::randomize(const NTL::ZZ* seed)
     long nb = (k + 7) / 8;
     unsigned long mask = (1UL << k) - 1UL;
 
-    NTL::vec_long& row = map[i];
+    long* row = map[i];
     long j = 0;
 
     for (;;) {
@@ -1377,6 +2257,73 @@ void DoubleCRT::randomize(const NTL::ZZ* seed)
   }
 }
 
+// The little-endian bytes of x at data[0..7]
+static void putWord(unsigned char* data, unsigned long x)
+{
+  for (long b : range(8))
+    data[b] = (x >> (8 * b)) & 0xff;
+}
+
+void DoubleCRT::randomizeKeyed(const NTL::ZZ& seed, long stream)
+{
+  HELIB_TIMER_START;
+
+  if (isDryRun())
+    return;
+
+  assertTrue(seed >= 0, "randomizeKeyed: negative seed");
+
+  // The key of row i is derived from the bytes of seed, stream and pi
+  long seedBytes = NTL::NumBytes(seed);
+  std::vector<unsigned char> data(seedBytes + 16);
+  NTL::BytesFromZZ(data.data(), seed, seedBytes);
+  putWord(&data[seedBytes], stream);
+
+  NTL::Vec<long> ivec;
+  long icard = MakeIndexVector(map.getIndexSet(), ivec);
+  long phim = context.getPhiM();
+  map.makeUnique(); // before the threads write their rows
+
+  HELIB_EXEC_RANGE(icard, first, last)
+  std::vector<unsigned char> rowData(data);
+  unsigned char key[NTL_PRG_KEYLEN];
+  // Every candidate is read as 8 bytes, the last one up to 7 bytes past
+  // the stream output
+  const long bufsz = 2048;
+  std::vector<unsigned char> buf(bufsz + 8, 0);
+  for (long k = first; k < last; k++) {
+    long i = ivec[k];
+    long pi = context.ithPrime(i);
+    putWord(&rowData[seedBytes + 8], pi);
+    NTL::DeriveKey(key, NTL_PRG_KEYLEN, rowData.data(), rowData.size());
+    NTL::RandomStream rs(key);
+
+    long nbits = NTL::NumBits(pi - 1);
+    long nb = (nbits + 7) / 8;
+    unsigned long mask = (1UL << nbits) - 1UL;
+
+    long* row = map.uniqueRow(i);
+    long j = 0;
+    while (j < phim) {
+      {
+        HELIB_NTIMER_START(randomize_stream);
+        rs.get(buf.data(), bufsz);
+      }
+      // Rejection sampling without a branch on the candidate, it is always
+      // written and only kept if it is below pi
+      for (long pos = 0; pos <= bufsz - nb && j < phim; pos += nb) {
+        unsigned long word = 0;
+        for (long b : range(8))
+          word |= (unsigned long)(buf[pos + b]) << (8 * b);
+        word &= mask;
+        row[j] = word;
+        j += (word < (unsigned long)pi);
+      }
+    }
+  }
+  HELIB_EXEC_RANGE_END
+}
+
 // Coefficients are -1/0/1, Prob[0]=1/2
 double DoubleCRT::sampleSmall()
 {
@@ -1515,6 +2462,226 @@ void DoubleCRT::scaleDownToSet(const IndexSet& s,
                       // actually scales it down
 }
 
+CRTTable::CRTTable(const Context& context, const IndexSet& s)
+{
+  product = 1;
+  for (long i : s) {
+    long q = context.ithPrime(i);
+    indexes.push_back(i);
+    primes.push_back(q);
+    recip.push_back(1 / double(q));
+    mul(product, product, q);
+  }
+  add(productHalf, product, 1);
+  div(productHalf, productHalf, 2);
+
+  long k = primes.size();
+  hat.SetSize(k, product.size() + 1);
+  for (long j : range(k)) {
+    long q = primes[j];
+    div(hat[j], product, q);
+    hatInv.push_back(NTL::InvMod(rem(hat[j], q), q));
+    hatInvPrecon.push_back(NTL::PrepMulModPrecon(hatInv[j], q));
+  }
+}
+
+ModDownTable::ModDownTable(const Context& context,
+                           const IndexSet& droppedSet,
+                           const IndexSet& keptSet,
+                           long p) :
+    ptxtSpace(p)
+{
+  const CRTTable& crt = context.getCRTTable(droppedSet);
+  dropped = crt.indexes;
+  droppedPrimes = crt.primes;
+  droppedRecip = crt.recip;
+  hatInv = crt.hatInv;
+  hatInvPrecon = crt.hatInvPrecon;
+  if (p > 1)
+    for (long k : range(lsize(droppedPrimes)))
+      hatModP.push_back(rem(crt.hat[k], p));
+  for (long i : keptSet) {
+    long q = context.ithPrime(i);
+    kept.push_back(i);
+    hat.emplace_back();
+    for (long k : range(lsize(droppedPrimes)))
+      hat.back().push_back(rem(crt.hat[k], q));
+    dMod.push_back(rem(crt.product, q));
+    dInv.push_back(NTL::InvMod(dMod.back(), q));
+    dInvPrecon.push_back(NTL::PrepMulModPrecon(dInv.back(), q));
+  }
+  if (p > 1) {
+    dModP = rem(crt.product, p);
+    dInvModP = NTL::InvMod(dModP, p);
+  }
+}
+
+// The residues of the dropped primes go through one inverse transform
+// each, then every coefficient is handled in RNS form with the tables of
+// ModDownTable, and every kept prime needs one forward transform. Each of
+// the three steps runs over all the parts at once.
+void DoubleCRT::scaleDownToSet(const std::vector<DoubleCRT*>& parts,
+                               const IndexSet& s,
+                               long ptxtSpace,
+                               std::vector<std::vector<double>>* fdeltas)
+{
+  HELIB_TIMER_START;
+
+  assertTrue(ptxtSpace >= 1, "ptxtSpace must be at least 1");
+  if (fdeltas != nullptr)
+    fdeltas->assign(parts.size(), std::vector<double>());
+  if (parts.empty())
+    return;
+
+  const Context& context = parts[0]->context;
+  const IndexSet& from = parts[0]->getIndexSet();
+  IndexSet diff = from / s;
+  for (const DoubleCRT* part : parts)
+    if (&part->context != &context || part->getIndexSet() != from)
+      throw RuntimeError("DoubleCRT::scaleDownToSet: index sets do not match");
+  if (empty(diff))
+    return; // nothing to do
+
+  // cannot mod-down to the empty set
+  assertNeq(diff, from, "s and the index set must have some intersection");
+  if (isDryRun()) {
+    for (DoubleCRT* part : parts)
+      part->removePrimes(diff);
+    return;
+  }
+
+  const ModDownTable& table =
+      context.getModDownTable(diff, from & s, ptxtSpace);
+  long n = parts.size();
+  long phim = context.getPhiM();
+  long nDropped = table.dropped.size();
+  long nKept = table.kept.size();
+  // The rows of one part are written by several threads below
+  for (DoubleCRT* part : parts)
+    part->map.makeUnique();
+
+  // ys[t][k*phim + h] = y_k of coefficient h of part t
+  std::vector<std::vector<long>> ys(n, std::vector<long>(nDropped * phim));
+  {
+    HELIB_NTIMER_START(scaleDown_iFFT);
+    HELIB_EXEC_RANGE(n * nDropped, first, last)
+    NTL::zz_pX tmp;
+    for (long cell = first; cell < last; cell++) {
+      long t = cell / nDropped, k = cell % nDropped;
+      long i = table.dropped[k], d = table.droppedPrimes[k];
+      const DoubleCRT& part = *parts[t];
+      const long* row = part.map[i];
+      context.ithModulus(i).iFFT(&tmp, &row, 1);
+      long* y = ys[t].data() + k * phim;
+      long deg = NTL::deg(tmp);
+      for (long h = 0; h <= deg; h++)
+        y[h] = NTL::MulModPrecon(
+            rep(tmp.rep[h]), table.hatInv[k], d, table.hatInvPrecon[k]);
+      for (long h = deg + 1; h < phim; h++)
+        y[h] = 0;
+    }
+    HELIB_EXEC_RANGE_END
+  }
+
+  // ws[t][h] = v + c, the multiple of the product of the dropped primes to
+  // remove from the sum of the y_k * D_k
+  std::vector<std::vector<long>> ws(n, std::vector<long>(phim));
+  if (fdeltas != nullptr)
+    for (std::vector<double>& fdelta : *fdeltas)
+      fdelta.resize(phim);
+  {
+    long p = ptxtSpace;
+    HELIB_EXEC_RANGE(n * phim, first, last)
+    for (long cell = first; cell < last; cell++) {
+      long t = cell / phim, h = cell % phim;
+      const long* y = ys[t].data() + h;
+      double f = 0.0;
+      for (long k : range(nDropped))
+        f += double(y[k * phim]) * table.droppedRecip[k];
+      long v = std::lround(f);
+      double frac = f - double(v); // delta / D, in [-1/2, 1/2]
+      long c = 0;
+      if (p > 1) { // make delta divisible by p
+        long vModP = v % p;
+        if (vModP < 0)
+          vModP += p;
+        long deltaModP = NTL::NegateMod(NTL::MulMod(vModP, table.dModP, p), p);
+        for (long k : range(nDropped))
+          deltaModP = NTL::AddMod(
+              deltaModP, NTL::MulMod(y[k * phim] % p, table.hatModP[k], p), p);
+        if (deltaModP != 0) {
+          c = NTL::MulMod(deltaModP, table.dInvModP, p);
+          // NOTE: this makes sure we get a more truly balanced remainder
+          if (c > p / 2 || (p % 2 == 0 && c == p / 2 && frac < 0))
+            c -= p;
+        }
+      }
+      ws[t][h] = v + c;
+      if (fdeltas != nullptr)
+        (*fdeltas)[t][h] = frac - double(c);
+    }
+    HELIB_EXEC_RANGE_END
+  }
+
+  // For every kept prime, delta mod q_j in coefficient form, then its
+  // transform, subtracted from the row before the division by D
+  {
+    HELIB_NTIMER_START(scaleDown_FFT);
+    HELIB_EXEC_RANGE(n * nKept, first, last)
+    zzX coeffs;
+    coeffs.SetLength(phim);
+    std::vector<long> transformed(phim);
+    for (long cell = first; cell < last; cell++) {
+      long t = cell / nKept, j = cell % nKept;
+      long i = table.kept[j];
+      long q = context.ithPrime(i);
+      const std::vector<long>& hat = table.hat[j];
+      const long* y = ys[t].data();
+      const long* w = ws[t].data();
+      for (long h : range(phim)) {
+        // Every product is below 2^124, so 8 of them fit in 128 bits
+        uint128 acc = 0;
+        for (long k : range(nDropped)) {
+          acc += uint128((unsigned long)y[k * phim + h]) *
+                 (unsigned long)hat[k];
+          if ((k & 7) == 7)
+            acc %= (unsigned long)q;
+        }
+        long sum = long(acc % (unsigned long)q);
+        long wq = w[h] % q;
+        if (wq < 0)
+          wq += q;
+        coeffs[h] = NTL::SubMod(sum, NTL::MulMod(wq, table.dMod[j], q), q);
+      }
+      context.ithModulus(i).FFT(transformed.data(), coeffs);
+
+      long* row = parts[t]->map.uniqueRow(i);
+#ifdef USE_INTEL_HEXL
+      intel::EltwiseSubMod(row, row, transformed.data(), phim, q);
+      intel::EltwiseMultMod(row, row, table.dInv[j], phim, q);
+#else
+      for (long h : range(phim))
+        row[h] = NTL::MulModPrecon(NTL::SubMod(row[h], transformed[h], q),
+                                   table.dInv[j],
+                                   q,
+                                   table.dInvPrecon[j]);
+#endif
+    }
+    HELIB_EXEC_RANGE_END
+  }
+
+  for (DoubleCRT* part : parts)
+    part->removePrimes(diff);
+
+  if (fdeltas != nullptr)
+    for (std::vector<double>& fdelta : *fdeltas) {
+      long len = fdelta.size();
+      while (len > 0 && fdelta[len - 1] == 0.0)
+        len--;
+      fdelta.resize(len);
+    }
+}
+
 std::ostream& operator<<(std::ostream& str, const DoubleCRT& d)
 {
   str << d.writeToJSON();
@@ -1533,10 +2700,9 @@ void DoubleCRT::writeTo(std::ostream& str) const
   //  std::cerr << "[DCRT::write] set: " << set << std::endl;
   set.writeTo(str);
 
-  for (long i : set) {
-    write_ntl_vec_long(str, map[i]);
-    //   std::cerr << "[DCRT::write] map[i]: " << map[i] << std::endl;
-  }
+  long phim = context.getPhiM();
+  for (long i : set)
+    write_raw_longs(str, map[i], phim);
 }
 
 DoubleCRT DoubleCRT::readFrom(std::istream& str, const Context& context)
@@ -1550,19 +2716,66 @@ DoubleCRT DoubleCRT::readFrom(std::istream& str, const Context& context)
 void DoubleCRT::read(std::istream& str)
 {
   IndexSet set = IndexSet::readFrom(str); // read in the indexSet
-  map.clear();
-  map.insert(set); // fix the index set for the data
-                   //  std::cerr << "[DCRT::read] set: " << set << std::endl;
+  map.setIndexSet(set); // fix the index set for the data
+
+  // The rows are read straight into the slab, without a temporary vector
+  long phim = context.getPhiM();
+  for (long i : set)
+    read_raw_longs(str, map[i], phim);
+}
+
+void DoubleCRT::writePackedTo(std::ostream& str) const
+{
+  const IndexSet& set = map.getIndexSet();
+  set.writeTo(str);
+
+  long phim = context.getPhiM();
+  for (long i : set)
+    write_packed_longs(str, map[i], phim, NTL::NumBits(context.ithPrime(i)));
+}
+
+void DoubleCRT::readPacked(std::istream& str)
+{
+  IndexSet set = IndexSet::readFrom(str);
+  assertTrue<IOError>(set <= (context.getSmallPrimes() |
+                              context.getSpecialPrimes() |
+                              context.getCtxtPrimes()),
+                      "Stream does not contain subset of the context's primes");
+  map.setIndexSet(set);
 
+  long phim = context.getPhiM();
   for (long i : set) {
-    read_ntl_vec_long(str, map[i]);
-    //   std::cerr << "[DCRT::read] map[i]: " << map[i] << std::endl;
+    long q = context.ithPrime(i);
+    long* row = map[i];
+    read_packed_longs(str, row, phim, NTL::NumBits(q));
+    for (long j = 0; j < phim; j++)
+      assertTrue<IOError>(row[j] < q, "Data not valid: residue too large");
   }
 }
 
 void DoubleCRT::writeToJSON(std::ostream& str) const
 {
-  str << this->writeToJSON();
+  executeRedirectJsonError<void>([&]() {
+    JsonStreamWriter w(str);
+    writeToJSON(w);
+  });
+}
+
+void DoubleCRT::writeToJSON(JsonStreamWriter& w) const
+{
+  // The set goes first, so that a streaming reader can read the rows
+  // straight into place
+  const IndexSet& set = map.getIndexSet();
+  long phim = context.getPhiM();
+  w.beginObject();
+  w.key("set");
+  w.value(unwrap(set.writeToJSON()));
+  w.key("map");
+  w.beginArray();
+  for (long i : set)
+    w.longs(map[i], phim);
+  w.endArray();
+  w.endObject();
 }
 
 JsonWrapper DoubleCRT::writeToJSON() const
@@ -1571,8 +2784,12 @@ JsonWrapper DoubleCRT::writeToJSON() const
   std::vector<NTL::Vec<long>> map_cnt;
 
   // check that the content of i'th row is in [0,pi) for all i
-  for (long i : set)
-    map_cnt.emplace_back(this->map[i]);
+  long phim = context.getPhiM();
+  for (long i : set) {
+    map_cnt.emplace_back();
+    map_cnt.back().SetLength(phim);
+    std::copy_n(this->map[i], phim, map_cnt.back().elts());
+  }
 
   json j = {{"set", unwrap(set.writeToJSON())}, {"map", map_cnt}};
   return wrap(j);
@@ -1580,9 +2797,9 @@ JsonWrapper DoubleCRT::writeToJSON() const
 
 DoubleCRT DoubleCRT::readFromJSON(std::istream& str, const Context& context)
 {
-  json j;
-  str >> j;
-  return DoubleCRT::readFromJSON(wrap(j), context);
+  DoubleCRT ret{context, IndexSet::emptySet()};
+  ret.readJSON(str);
+  return ret;
 }
 
 DoubleCRT DoubleCRT::readFromJSON(const JsonWrapper& j, const Context& context)
@@ -1594,9 +2811,86 @@ DoubleCRT DoubleCRT::readFromJSON(const JsonWrapper& j, const Context& context)
 
 void DoubleCRT::readJSON(std::istream& str)
 {
-  json j;
-  str >> j;
-  return this->readJSON(wrap(j));
+  executeRedirectJsonError<void>([&]() {
+    JsonStreamReader r(str);
+    readJSON(r);
+  });
+}
+
+// Check that the rows of d are reduced modulo their primes
+static void checkRows(const DoubleCRT& d)
+{
+  const Context& context = d.getContext();
+  long phim = context.getPhiM();
+  for (long i : d.getIndexSet()) {
+    const long* row = d.getMap()[i];
+    for (long j : range(phim))
+      assertInRange(
+          row[j],
+          0l,
+          context.ithPrime(i),
+          "this->map[i][j] invalid: must be between 0 and context.ithPrime(i)");
+  }
+}
+
+void DoubleCRT::readJSON(JsonStreamReader& r)
+{
+  long phim = context.getPhiM();
+  bool haveSet = false, haveMap = false;
+  // Rows that come before the set are kept aside until it is known
+  std::vector<std::vector<long>> early;
+
+  r.beginObject();
+  for (std::string k; r.nextKey(k);) {
+    if (k == "set") {
+      IndexSet set = IndexSet::readFromJSON(wrap(r.value()));
+      assertTrue(set <= (context.getSmallPrimes() |
+                         context.getSpecialPrimes() | context.getCtxtPrimes()),
+                 "Stream does not contain subset of the context's primes");
+      map.setIndexSet(set); // fix the index set for the data
+      haveSet = true;
+    } else if (k == "map") {
+      r.beginArray();
+      if (haveSet) {
+        const IndexSet& set = map.getIndexSet();
+        long i = set.first();
+        while (r.nextElement()) {
+          assertTrue<IOError>(i <= set.last(),
+                              "Data not valid: more rows than primes");
+          r.longs(map[i], phim);
+          i = set.next(i);
+        }
+        assertTrue<IOError>(i > set.last(),
+                            "Data not valid: fewer rows than primes");
+      } else {
+        while (r.nextElement()) {
+          early.emplace_back();
+          r.longs(early.back());
+        }
+      }
+      haveMap = true;
+    } else {
+      r.skip();
+    }
+  }
+  JsonStreamReader::require(haveSet, "set");
+  JsonStreamReader::require(haveMap, "map");
+
+  if (!early.empty()) {
+    const IndexSet& set = map.getIndexSet();
+    assertEq<IOError>(long(early.size()),
+                      set.card(),
+                      "Data not valid: wrong number of rows");
+    std::size_t cnt = 0;
+    for (long i : set) {
+      const std::vector<long>& row = early[cnt++];
+      assertEq(long(row.size()),
+               phim,
+               "Data not valid: d.map[i].length() != phim");
+      std::copy_n(row.data(), phim, map[i]);
+    }
+  }
+  checkRows(*this);
 }
 
 void DoubleCRT::readJSON(const JsonWrapper& jw)
@@ -1610,26 +2904,27 @@ void DoubleCRT::readJSON(const JsonWrapper& jw)
   assertTrue(set <= (context.getSmallPrimes() | context.getSpecialPrimes() |
                      context.getCtxtPrimes()),
              "Stream does not contain subset of the context's primes");
-  this->map.clear();
-  this->map.insert(set); // fix the index set for the data
+  this->map.setIndexSet(set); // fix the index set for the data
 
-  std::vector<NTL::Vec<long>> map_cnt = j.at("map");
+  const json& rows = j.at("map");
+  assertEq<IOError>(long(rows.size()),
+                    set.card(),
+                    "Data not valid: wrong number of rows");
 
   std::size_t cnt = 0;
   for (long i : set) {
-    this->map[i] = map_cnt[cnt++]; // read the actual data
-
-    // verify that the data is valid
-    assertEq(this->map[i].length(),
+    const json& row = rows[cnt++];
+    // A row is an array of numbers, or a base64 string of the jsonStream
+    // writer
+    std::vector<long> data = row.is_string()
+                                 ? base64Longs(row.get<std::string>())
+                                 : row.get<std::vector<long>>();
+    assertEq(long(data.size()),
              phim,
              "Data not valid: d.map[i].length() != phim");
-    for (long j : range(phim))
-      assertInRange(
-          this->map[i][j],
-          0l,
-          context.ithPrime(i),
-          "this->map[i][j] invalid: must be between 0 and context.ithPrime(i)");
+    std::copy_n(data.data(), phim, this->map[i]); // the actual data
   }
+  checkRows(*this);
 }
 
 } // namespace helib
@@ -0,0 +1,142 @@
+/* Copyright (C) 2021 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <helib/DualDoubleCRT.h>
+
+#include <helib/Context.h>
+
+namespace helib {
+
+DualDoubleCRT::DualDoubleCRT(const Context& context, const IndexSet& s) :
+    evalForm(context, s),
+    evalValid(true),
+    coeffValid(true),
+    coeffReduced(true)
+{}
+
+DualDoubleCRT::DualDoubleCRT(const DoubleCRT& dcrt) :
+    evalForm(dcrt), evalValid(true), coeffValid(false), coeffReduced(true)
+{}
+
+DualDoubleCRT::DualDoubleCRT(DoubleCRT&& dcrt) :
+    evalForm(std::move(dcrt)),
+    evalValid(true),
+    coeffValid(false),
+    coeffReduced(true)
+{}
+
+DualDoubleCRT::DualDoubleCRT(const NTL::ZZX& poly,
+                             const Context& context,
+                             const IndexSet& s) :
+    evalForm(context, s),
+    coeffForm(poly),
+    evalValid(false),
+    coeffValid(true),
+    coeffReduced(false)
+{}
+
+const DoubleCRT& DualDoubleCRT::eval() const
+{
+  if (!evalValid) {
+    // The coefficient form includes the pending constants
+    evalForm.FFT(coeffForm, getIndexSet());
+    NTL::clear(pending);
+    evalValid = true;
+  } else if (!NTL::IsZero(pending)) {
+    // All the constants added since the last transform, at once
+    evalForm += pending;
+    NTL::clear(pending);
+  }
+  return evalForm;
+}
+
+const NTL::ZZX& DualDoubleCRT::coeffs() const
+{
+  if (!coeffValid) {
+    evalForm.toPoly(coeffForm);
+    coeffForm += pending;
+    coeffReduced = NTL::IsZero(pending);
+    coeffValid = true;
+  }
+  if (!coeffReduced) {
+    PolyRed(coeffForm, getContext().productOfPrimes(getIndexSet()));
+    coeffReduced = true;
+  }
+  return coeffForm;
+}
+
+DoubleCRT& DualDoubleCRT::evalForUpdate()
+{
+  eval();
+  invalidateCoeffs();
+  return evalForm;
+}
+
+DualDoubleCRT& DualDoubleCRT::operator+=(const NTL::ZZX& poly)
+{
+  if (evalValid)
+    pending += poly;
+  if (coeffValid) {
+    coeffForm += poly;
+    coeffReduced = false;
+  }
+  return *this;
+}
+
+DualDoubleCRT& DualDoubleCRT::operator-=(const NTL::ZZX& poly)
+{
+  if (evalValid)
+    pending -= poly;
+  if (coeffValid) {
+    coeffForm -= poly;
+    coeffReduced = false;
+  }
+  return *this;
+}
+
+DualDoubleCRT& DualDoubleCRT::operator+=(const DoubleCRT& other)
+{
+  evalForUpdate().Add(other, /*matchIndexSets=*/false);
+  return *this;
+}
+
+DualDoubleCRT& DualDoubleCRT::operator-=(const DoubleCRT& other)
+{
+  evalForUpdate().Sub(other, /*matchIndexSets=*/false);
+  return *this;
+}
+
+DualDoubleCRT& DualDoubleCRT::operator*=(const DoubleCRT& other)
+{
+  evalForUpdate().Mul(other, /*matchIndexSets=*/false);
+  return *this;
+}
+
+DualDoubleCRT& DualDoubleCRT::operator*=(const NTL::ZZX& poly)
+{
+  evalForUpdate() *= poly;
+  return *this;
+}
+
+DualDoubleCRT& DualDoubleCRT::operator*=(long num)
+{
+  if (evalValid) {
+    evalForm *= num;
+    pending *= num;
+  }
+  if (coeffValid) {
+    coeffForm *= num;
+    coeffReduced = false;
+  }
+  return *this;
+}
+
+} // namespace helib
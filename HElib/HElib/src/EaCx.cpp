@@ -24,6 +24,7 @@
 #include <helib/apiAttributes.h>
 #include <helib/log.h>
 #include <helib/fhe_stats.h>
+#include <helib/opCounters.h>
 
 namespace helib {
 
@@ -277,6 +278,34 @@ void EncryptedArrayCx::encode(EncodedPtxt& eptxt,
   HELIB_STATS_UPDATE("CKKS_encode_ratio", ratio);
 }
 
+// The arrays are independent. The FFT tables are shared and read-only, and
+// the transforms keep their buffers per thread.
+void EncryptedArrayCx::encodeBatch(
+    std::vector<EncodedPtxt>& eptxts,
+    const std::vector<std::vector<cx_double>>& arrays,
+    double mag,
+    OptLong prec) const
+{
+  HELIB_TIMER_START;
+  eptxts.resize(arrays.size());
+  HELIB_EXEC_RANGE(lsize(arrays), first, last)
+  for (long i : range(first, last))
+    encode(eptxts[i], arrays[i], mag, prec);
+  HELIB_EXEC_RANGE_END
+}
+
+void EncryptedArrayCx::decodeBatch(std::vector<std::vector<cx_double>>& arrays,
+                                   const std::vector<zzX>& ptxts,
+                                   double scaling) const
+{
+  HELIB_TIMER_START;
+  arrays.resize(ptxts.size());
+  HELIB_EXEC_RANGE(lsize(ptxts), first, last)
+  for (long i : range(first, last))
+    decode(arrays[i], ptxts[i], scaling);
+  HELIB_EXEC_RANGE_END
+}
+
 void EncryptedArrayCx::encode(EncodedPtxt& eptxt,
                               const PlaintextArray& array,
                               double mag,
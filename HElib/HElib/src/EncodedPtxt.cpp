@@ -0,0 +1,78 @@
+/* Copyright (C) 2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <helib/EncodedPtxt.h>
+#include <helib/Context.h>
+#include <helib/NumbTh.h>
+#include <helib/exceptions.h>
+#include <helib/timing.h>
+
+namespace helib {
+
+static std::vector<long> formKey(const IndexSet& s, long f, long ptxtSpace)
+{
+  std::vector<long> key = {f, ptxtSpace};
+  for (long i : s)
+    key.push_back(i);
+  return key;
+}
+
+const FatEncodedPtxt& PreparedPtxt::expand(const IndexSet& s) const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  std::unique_ptr<FatEncodedPtxt>& form = cache[formKey(s, 0, 0)];
+  if (!form) {
+    HELIB_NTIMER_START(PreparedPtxt_expand);
+    form = std::make_unique<FatEncodedPtxt>(eptxt, s);
+  }
+  return *form;
+}
+
+// As in Ctxt::addConstant(const EncodedPtxt_BGV&)
+const FatEncodedPtxt& PreparedPtxt::expandScaled(const IndexSet& s,
+                                                 long f,
+                                                 long ptxtSpace) const
+{
+  assertTrue<LogicError>(isBGV(), "Only BGV constants are scaled");
+  const EncodedPtxt_BGV& bgv = eptxt.getBGV();
+  if (f == 1 && ptxtSpace == bgv.getPtxtSpace())
+    return expand(s);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  std::unique_ptr<FatEncodedPtxt>& form = cache[formKey(s, f, ptxtSpace)];
+  if (!form) {
+    HELIB_NTIMER_START(PreparedPtxt_expand);
+    NTL::ZZX poly;
+    convert(poly, bgv.getPoly());
+    balanced_MulMod(poly, poly, f, ptxtSpace);
+    const Context& context = bgv.getContext();
+    zzX scaled;
+    convert(scaled, poly);
+    EncodedPtxt scaledPtxt;
+    scaledPtxt.resetBGV(scaled, ptxtSpace, context);
+    form = std::make_unique<FatEncodedPtxt>(scaledPtxt, s);
+  }
+  return *form;
+}
+
+long PreparedPtxt::forms() const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return cache.size();
+}
+
+void PreparedPtxt::clear()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  cache.clear();
+}
+
+} // namespace helib
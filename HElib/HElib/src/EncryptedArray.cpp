@@ -18,6 +18,9 @@
 #include <helib/ClonedPtr.h>
 #include <helib/norms.h>
 #include <helib/exceptions.h>
+#include <helib/automorphPrecon.h>
+#include <helib/opCounters.h>
+#include <helib/rotationPlanner.h>
 
 #include "io.h"
 
@@ -53,6 +56,32 @@ EncryptedArrayBase* buildEncryptedArray(const Context& context,
   }
 }
 
+// Coefficients need no decoding, the decryption itself is done modulo the
+// fewest primes that still decrypt ctxt
+void EncryptedArrayBase::decryptCoeffs(const Ctxt& ctxt,
+                                       const SecKey& sKey,
+                                       std::vector<long>& coeffs,
+                                       const std::vector<long>& indices) const
+{
+  assertEq(&getContext(),
+           &ctxt.getContext(),
+           "Cannot decrypt when ciphertext has different context than "
+           "EncryptedArray");
+  assertFalse<LogicError>(ctxt.isCKKS(), "decryptCoeffs is for BGV only");
+  long phim = getPAlgebra().getPhiM();
+  for (long i : indices)
+    assertInRange(i, 0l, phim, "Coefficient index out of range");
+
+  Ctxt dropped(ctxt);
+  dropped.dropToDecryptionPrimeSet();
+  NTL::ZZX pp;
+  sKey.Decrypt(pp, dropped);
+
+  coeffs.resize(indices.size());
+  for (long k = 0; k < lsize(indices); k++)
+    coeffs[k] = NTL::conv<long>(NTL::coeff(pp, indices[k]));
+}
+
 template <typename type>
 EncryptedArrayDerived<type>::EncryptedArrayDerived(const Context& _context,
                                                    const RX& _G,
@@ -434,6 +463,45 @@ void EncryptedArrayDerived<type>::encodeUnitSelector(zzX& ptxt, long i) const
   // which did not do properly balanced remainders in some cases
 }
 
+template <typename type>
+void EncryptedArrayDerived<type>::encodeBatch(
+    std::vector<zzX>& ptxts,
+    const std::vector<std::vector<long>>& arrays) const
+{
+  HELIB_TIMER_START;
+  ptxts.resize(arrays.size());
+  // Every worker needs the NTL modulus of the slots
+  HELIB_EXEC_RANGE(lsize(arrays), first, last)
+  RBak bak;
+  bak.save();
+  tab.restoreContext();
+  std::vector<RX> array1;
+  for (long i : range(first, last)) {
+    convert(array1, arrays[i]);
+    encode(ptxts[i], array1);
+  }
+  HELIB_EXEC_RANGE_END
+}
+
+template <typename type>
+void EncryptedArrayDerived<type>::decodeBatch(
+    std::vector<std::vector<long>>& arrays,
+    const std::vector<NTL::ZZX>& ptxts) const
+{
+  HELIB_TIMER_START;
+  arrays.resize(ptxts.size());
+  HELIB_EXEC_RANGE(lsize(ptxts), first, last)
+  RBak bak;
+  bak.save();
+  tab.restoreContext();
+  std::vector<RX> array1;
+  for (long i : range(first, last)) {
+    decode(array1, ptxts[i]);
+    convert(arrays[i], array1);
+  }
+  HELIB_EXEC_RANGE_END
+}
+
 template <typename type>
 void EncryptedArrayDerived<type>::encode(zzX& ptxt,
                                          const std::vector<RX>& array) const
@@ -690,16 +758,164 @@ std::ostream& operator<<(std::ostream& os, const PtxtArray& pa)
   return os;
 }
 
+void encrypt(std::vector<Ctxt>& ctxts,
+             const std::vector<PtxtArray>& ptxts,
+             double mag,
+             OptLong prec)
+{
+  assertEq<InvalidArgument>(ctxts.size(),
+                            ptxts.size(),
+                            "Batch encrypt: one ciphertext per plaintext");
+  long n = ptxts.size();
+  std::vector<NTL::ZZ> seeds(n);
+  for (long i = 0; i < n; i++)
+    NTL::RandomBits(seeds[i], 256);
+
+  HELIB_EXEC_RANGE(n, first, last)
+  NTL::RandomStreamPush push;
+  for (long i = first; i < last; i++) {
+    NTL::SetSeed(seeds[i]);
+    ptxts[i].encrypt(ctxts[i], mag, prec);
+  }
+  HELIB_EXEC_RANGE_END
+}
+
+void decrypt(std::vector<PtxtArray>& ptxts,
+             const std::vector<Ctxt>& ctxts,
+             const SecKey& sKey,
+             OptLong prec)
+{
+  assertEq<InvalidArgument>(ctxts.size(),
+                            ptxts.size(),
+                            "Batch decrypt: one plaintext per ciphertext");
+  long n = ctxts.size();
+  std::vector<NTL::ZZ> seeds(n);
+  for (long i = 0; i < n; i++)
+    NTL::RandomBits(seeds[i], 256);
+
+  HELIB_EXEC_RANGE(n, first, last)
+  NTL::RandomStreamPush push;
+  for (long i = first; i < last; i++) {
+    NTL::SetSeed(seeds[i]);
+    ptxts[i].decrypt(ctxts[i], sKey, prec);
+  }
+  HELIB_EXEC_RANGE_END
+}
+
 // Other functions...
 
+// The hoisted sums along a dimension of order D use the split of its
+// rotation amounts a = g*B + b into baby steps b < B and giant steps g*B,
+// with B = KSGiantStepSize(D) as in addSome1DMatrices, so that every
+// automorphism takes a single key switch with those matrices.
+static std::vector<long> babySteps(long D, long from, long to)
+{
+  std::vector<long> amounts;
+  for (long b = std::max(from, 1L); b < std::min(to, D); b++)
+    amounts.push_back(b);
+  return amounts;
+}
+
+static std::vector<long> giantSteps(long D, long B, long to)
+{
+  std::vector<long> amounts;
+  for (long a = B; a < std::min(to, D); a += B)
+    amounts.push_back(a);
+  return amounts;
+}
+
+static bool canHoistSums(const EncryptedArray& ea,
+                         const Ctxt& ctxt,
+                         bool zeroFill)
+{
+  const RotationPlanner& planner = ea.getRotationPlanner();
+  for (long i = 0; i < ea.dimension(); i++) {
+    long D = ea.sizeOfDimension(i);
+    long B = KSGiantStepSize(D);
+    if (!planner.canHoist1D(ctxt, i, babySteps(D, 1, B), zeroFill) ||
+        !planner.canHoist1D(ctxt, i, giantSteps(D, B, D), zeroFill))
+      return false;
+  }
+  return true;
+}
+
+// ctxt = sum_{a < D} rotate1D(ctxt, i, a), or shift1D if zeroFill is set
+static void hoistedSum1D(const EncryptedArray& ea,
+                         Ctxt& ctxt,
+                         long i,
+                         bool zeroFill)
+{
+  const RotationPlanner& planner = ea.getRotationPlanner();
+  long D = ea.sizeOfDimension(i);
+  if (D == 1)
+    return;
+  long B = KSGiantStepSize(D);
+  std::vector<long> giants = giantSteps(D, B, D);
+
+  if (zeroFill) {
+    // Shifts by D or more are zero, so the last block needs no trimming
+    Ctxt baby = ctxt;
+    baby += planner.rotationSums1D(ctxt, i, {babySteps(D, 1, B)}, true)[0];
+    ctxt = baby;
+    ctxt += planner.rotationSums1D(baby, i, {giants}, true)[0];
+    return;
+  }
+
+  // The last block, from giants.back(), only has r < B baby steps
+  long r = D - (giants.empty() ? 0 : giants.back());
+  std::vector<Ctxt> babies = planner.rotationSums1D(
+      ctxt,
+      i,
+      {babySteps(D, 1, r), babySteps(D, r, B)});
+  Ctxt last = ctxt;
+  last += babies[0];
+  Ctxt full = last;
+  full += babies[1];
+
+  if (r < B && !giants.empty()) {
+    long lastAmount = giants.back();
+    giants.pop_back();
+    ea.rotate1D(last, i, lastAmount);
+    ctxt = full;
+    ctxt += last;
+  } else {
+    ctxt = full;
+  }
+  ctxt += planner.rotationSums1D(full, i, {giants})[0];
+}
+
 void runningSums(const EncryptedArray& ea, Ctxt& ctxt)
 {
+  // The total sums over the dimensions but the first rotate with wrap
+  // around
+  bool zeroFill = ea.dimension() == 1;
+  if (ea.size() > 1 && canHoistSums(ea, ctxt, zeroFill)) {
+    // The slots are ordered by their coordinates, with the last dimension
+    // the least significant. The running sum of slot j is its prefix sum
+    // in the last dimension, plus, for every other dimension i, the sum of
+    // the slots before it in dimension i of the total sums over the
+    // dimensions after i.
+    long dims = ea.dimension();
+    Ctxt totals = ctxt;
+    hoistedSum1D(ea, ctxt, dims - 1, /*zeroFill=*/true);
+    for (long i = dims - 2; i >= 0; i--) {
+      hoistedSum1D(ea, totals, i + 1, /*zeroFill=*/false);
+      Ctxt before = totals;
+      hoistedSum1D(ea, before, i, /*zeroFill=*/true);
+      before -= totals;
+      ctxt += before;
+    }
+    return;
+  }
+
+  // Otherwise, the doubling over all the slots
   long n = ea.size();
+  const RotationPlanner& planner = ea.getRotationPlanner();
 
   long shamt = 1;
   while (shamt < n) {
     Ctxt tmp = ctxt;
-    ea.shift(tmp, shamt);
+    planner.shift(tmp, shamt);
     ctxt += tmp; // ctxt = ctxt + (ctxt >> shamt)
     shamt = 2 * shamt;
   }
@@ -712,29 +928,63 @@ void totalSums(const EncryptedArray& ea, Ctxt& ctxt)
   if (n == 1)
     return;
 
-  Ctxt orig = ctxt;
+  if (canHoistSums(ea, ctxt, /*zeroFill=*/false)) {
+    for (long i = 0; i < ea.dimension(); i++)
+      hoistedSum1D(ea, ctxt, i, /*zeroFill=*/false);
+    return;
+  }
 
+  // Otherwise, the doubling over all the slots. The rotations of the
+  // original ciphertext, one for every bit of n below the top one, are
+  // hoisted together
+  const RotationPlanner& planner = ea.getRotationPlanner();
   long k = NTL::NumBits(n);
-  long e = 1;
+  std::vector<long> origAmounts;
+  for (long i = k - 2, e = 1; i >= 0; i--) {
+    e = 2 * e;
+    if (NTL::bit(n, i)) {
+      origAmounts.push_back(e);
+      e += 1;
+    }
+  }
+  std::vector<Ctxt> origRotated = planner.rotations(ctxt, origAmounts);
 
+  long e = 1;
+  long next = 0;
   for (long i = k - 2; i >= 0; i--) {
     Ctxt tmp1 = ctxt;
-    ea.rotate(tmp1, e);
+    planner.rotate(tmp1, e);
     ctxt += tmp1; // ctxt = ctxt + (ctxt >>> e)
     e = 2 * e;
 
     if (NTL::bit(n, i)) {
-      Ctxt tmp2 = orig;
-      ea.rotate(tmp2, e);
-      ctxt += tmp2; // ctxt = ctxt + (orig >>> e)
-                    // NOTE: we could have also computed
-                    // ctxt =  (ctxt >>> e) + orig, however,
-                    // this would give us greater depth/noise
+      ctxt += origRotated[next++]; // ctxt = ctxt + (orig >>> e)
+      // NOTE: we could have also computed
+      // ctxt =  (ctxt >>> e) + orig, however,
+      // this would give us greater depth/noise
       e += 1;
     }
   }
 }
 
+void runningSums(const EncryptedArray& ea, std::vector<Ctxt>& ctxts)
+{
+  long n = ctxts.size();
+  HELIB_EXEC_RANGE(n, first, last)
+  for (long i = first; i < last; i++)
+    runningSums(ea, ctxts[i]);
+  HELIB_EXEC_RANGE_END
+}
+
+void totalSums(const EncryptedArray& ea, std::vector<Ctxt>& ctxts)
+{
+  long n = ctxts.size();
+  HELIB_EXEC_RANGE(n, first, last)
+  for (long i = first; i < last; i++)
+    totalSums(ea, ctxts[i]);
+  HELIB_EXEC_RANGE_END
+}
+
 // Linearized polynomials.
 // L describes a linear map M by describing its action on the standard
 // power basis: M(x^j mod G) = (L[j] mod G), for j = 0..d-1.
@@ -858,14 +1108,15 @@ void applyLinPolyLL(Ctxt& ctxt, const std::vector<P>& encodedC, long d)
 
   ctxt.cleanUp(); // not sure, but this may be a good idea
 
-  Ctxt tmp(ctxt);
+  std::shared_ptr<GeneralAutomorphPrecon> precon =
+      buildGeneralAutomorphPrecon(ctxt, -1, ctxt.getContext().getEA());
 
   ctxt.multByConstant(encodedC[0]);
   for (long j = 1; j < d; j++) {
-    Ctxt tmp1(tmp);
-    tmp1.frobeniusAutomorph(j);
-    tmp1.multByConstant(encodedC[j]);
-    ctxt += tmp1;
+    std::shared_ptr<Ctxt> tmp1 = precon->automorph(j);
+    tmp1->cleanUp(); // drop the special primes of the hoisted result
+    tmp1->multByConstant(encodedC[j]);
+    ctxt += *tmp1;
   }
 }
 template void applyLinPolyLL(Ctxt& ctxt,
@@ -9,8 +9,11 @@
  * See the License for the specific language governing permissions and
  * limitations under the License. See accompanying LICENSE file.
  */
+#include <NTL/BasicThreadPool.h>
 #include <helib/EvalMap.h>
 #include <helib/apiAttributes.h>
+#include <helib/opCounters.h>
+#include "binio.h"
 
 // needed to get NTL's TraceMap functions...needed for ThinEvalMap
 #include <NTL/lzz_pXFactoring.h>
@@ -44,7 +47,8 @@ EvalMap::EvalMap(const EncryptedArray& _ea,
                  const NTL::Vec<long>& mvec,
                  bool _invert,
                  bool build_cache,
-                 bool normal_basis) :
+                 bool normal_basis,
+                 bool doubleHoist) :
     ea(_ea), invert(_invert)
 {
   const PAlgebra& zMStar = ea.getPAlgebra();
@@ -132,34 +136,65 @@ EvalMap::EvalMap(const EncryptedArray& _ea,
     sig_sequence[dim] = std::make_shared<CubeSignature>(reduced_phivec);
   }
 
-  long dim = nfactors - 1;
+  // The step matrices are independent, so they are built in parallel. The
+  // executors then encode the diagonals of each one in parallel.
   std::unique_ptr<BlockMatMul1D> mat1_data;
-  mat1_data.reset(buildStep1Matrix(ea,
-                                   sig_sequence[dim],
-                                   local_reps[dim],
-                                   dim,
-                                   m / mvec[dim],
-                                   invert,
-                                   normal_basis));
+  std::vector<std::unique_ptr<MatMul1D>> mat_data(nfactors - 1);
+  HELIB_EXEC_RANGE(nfactors, first, last)
+  for (long dim = first; dim < last; dim++) {
+    if (dim == nfactors - 1)
+      mat1_data.reset(buildStep1Matrix(ea,
+                                       sig_sequence[dim],
+                                       local_reps[dim],
+                                       dim,
+                                       m / mvec[dim],
+                                       invert,
+                                       normal_basis));
+    else
+      mat_data[dim].reset(buildStep2Matrix(ea,
+                                           sig_sequence[dim],
+                                           local_reps[dim],
+                                           dim,
+                                           m / mvec[dim],
+                                           invert));
+  }
+  HELIB_EXEC_RANGE_END
+
   mat1.reset(new BlockMatMul1DExec(*mat1_data, minimal));
+  mat1_data.reset();
 
   matvec.SetLength(nfactors - 1);
-  for (dim = nfactors - 2; dim >= 0; --dim) {
-    std::unique_ptr<MatMul1D> mat_data;
-
-    mat_data.reset(buildStep2Matrix(ea,
-                                    sig_sequence[dim],
-                                    local_reps[dim],
-                                    dim,
-                                    m / mvec[dim],
-                                    invert));
-    matvec[dim].reset(new MatMul1DExec(*mat_data, minimal));
+  for (long dim = nfactors - 2; dim >= 0; --dim) {
+    matvec[dim].reset(new MatMul1DExec(*mat_data[dim], minimal, doubleHoist));
+    mat_data[dim].reset();
   }
 
   if (build_cache)
     upgrade();
 }
 
+EvalMap::EvalMap(const EncryptedArray& _ea, std::istream& str) : ea(_ea)
+{
+  invert = read_raw_int(str);
+  nfactors = read_raw_int(str);
+  mat1.reset(new BlockMatMul1DExec(ea, str));
+  long n = read_raw_int(str);
+  assertTrue<IOError>(n >= 0, "Negative number of matrices");
+  matvec.SetLength(n);
+  for (long i = 0; i < n; i++)
+    matvec[i].reset(new MatMul1DExec(ea, str));
+}
+
+void EvalMap::writeTo(std::ostream& str) const
+{
+  write_raw_int(str, invert);
+  write_raw_int(str, nfactors);
+  mat1->writeTo(str);
+  write_raw_int(str, matvec.length());
+  for (long i = 0; i < matvec.length(); i++)
+    matvec[i]->writeTo(str);
+}
+
 void EvalMap::upgrade()
 {
   mat1->upgrade();
@@ -167,6 +202,21 @@ void EvalMap::upgrade()
     matvec[i]->upgrade();
 }
 
+void EvalMap::upgradeWithin(long& budget, bool lazily)
+{
+  mat1->upgradeWithin(budget, lazily);
+  for (long i = 0; i < matvec.length(); i++)
+    matvec[i]->upgradeWithin(budget, lazily);
+}
+
+long EvalMap::cacheBytes() const
+{
+  long total = mat1->cacheBytes();
+  for (long i = 0; i < matvec.length(); i++)
+    total += matvec[i]->cacheBytes();
+  return total;
+}
+
 // Applying the evaluation (or its inverse) map to a ciphertext
 void EvalMap::apply(Ctxt& ctxt) const
 {
@@ -183,6 +233,13 @@ void EvalMap::apply(Ctxt& ctxt) const
   }
 }
 
+void EvalMap::automorphisms(std::map<long, std::set<long>>& autos) const
+{
+  mat1->automorphisms(autos);
+  for (long i = 0; i < matvec.length(); i++)
+    matvec[i]->automorphisms(autos);
+}
+
 static void init_representatives(NTL::Vec<long>& representatives,
                                  long dim,
                                  const NTL::Vec<long>& mvec,
@@ -504,14 +561,158 @@ static void init_representatives(NTL::Vec<long>& representatives,
                                  const NTL::Vec<long>& mvec,
                                  const PAlgebra& zMStar);
 
+//! \cond FALSE (make doxygen ignore these classes)
+
+// The step of a ThinEvalMap in a dimension in which only coordinate 0 is
+// used. Row 0 of the forward matrix is all ones, so the forward step just
+// replicates coordinate 0 along the dimension. The inverse step only needs
+// the coefficient of index 0, a linear form of the slots along the
+// dimension, which it leaves in all of them. Both are a product with a
+// constant (the mask of coordinate 0, or the linear form) followed by a sum
+// along the dimension, in O(log D) rotations instead of the D (or 2 sqrt(D))
+// of a matrix.
+class ThinSparseStep : public MatMulExecBase
+{
+public:
+  const EncryptedArray& ea;
+  long dim;
+  zzX constant;
+
+  ThinSparseStep(const EncryptedArray& _ea, long _dim, const zzX& _constant) :
+      ea(_ea), dim(_dim), constant(_constant)
+  {}
+
+  ThinSparseStep(const EncryptedArray& _ea, std::istream& str) : ea(_ea)
+  {
+    dim = read_raw_int(str);
+    assertInRange<IOError>(dim, 0l, ea.dimension(), "Invalid dimension");
+    read_ntl_vec_long(str, constant);
+  }
+
+  void writeTo(std::ostream& str) const
+  {
+    write_raw_int(str, dim);
+    write_ntl_vec_long(str, constant);
+  }
+
+  const EncryptedArray& getEA() const override { return ea; }
+
+  // A single constant, not worth a DoubleCRT
+  void upgrade() override {}
+
+  long cacheBytes() const override { return constant.length() * sizeof(long); }
+
+  // The sum is computed as in totalSums
+  void mul(Ctxt& ctxt) const override
+  {
+    ctxt.multByConstant(constant);
+    Ctxt orig = ctxt;
+    for (const auto& [amt, fromOrig] : rotations()) {
+      Ctxt tmp = fromOrig ? orig : ctxt;
+      ea.rotate1D(tmp, dim, amt);
+      ctxt += tmp;
+    }
+  }
+
+  void automorphisms(std::map<long, std::set<long>>& autos) const
+  {
+    const PAlgebra& zMStar = ea.getPAlgebra();
+    std::set<long>& vals = autos[dim];
+    for (const auto& rotation : rotations())
+      vals.insert(zMStar.genToPow(dim, rotation.first));
+    if (!ea.nativeDimension(dim))
+      vals.insert(zMStar.genToPow(dim, -ea.sizeOfDimension(dim)));
+  }
+
+private:
+  // The rotations of the sum, and whether each one rotates the ctxt
+  // before the sum rather than the partial sum
+  std::vector<std::pair<long, bool>> rotations() const
+  {
+    long D = ea.sizeOfDimension(dim);
+    std::vector<std::pair<long, bool>> rots;
+    long e = 1;
+    for (long i = NTL::NumBits(D) - 2; i >= 0; i--) {
+      rots.emplace_back(e, false);
+      e = 2 * e;
+      if (NTL::bit(D, i)) {
+        rots.emplace_back(e, true);
+        e += 1;
+      }
+    }
+    return rots;
+  }
+};
+
+template <typename type>
+struct ThinSparseFormImpl
+{
+  PA_INJECT(type)
+
+  static void apply(zzX& form,
+                    const EncryptedArray& base_ea,
+                    const MatMul1D& base_mat)
+  {
+    const EncryptedArrayDerived<type>& ea = base_ea.getDerived(type());
+    const MatMul1D_derived<type>& mat =
+        dynamic_cast<const MatMul1D_derived<type>&>(base_mat);
+    RBak bak;
+    bak.save();
+    base_ea.getAlMod().restoreContext();
+
+    long dim = mat.getDim();
+    std::vector<RX> slots(ea.size());
+    RX entry;
+    for (long i = 0; i < ea.size(); i++)
+      if (!mat.get(entry, ea.coordinate(dim, i), 0, 0))
+        slots[i] = entry;
+    ea.encode(form, slots);
+  }
+};
+//! \endcond
+
+// Column 0 of the matrix along its dimension, i.e. the coefficient of the
+// first input of every output, in all the slots
+static zzX thinSparseForm(const EncryptedArray& ea, const MatMul1D& mat)
+{
+  zzX form;
+  switch (ea.getTag()) {
+  case PA_GF2_tag:
+    ThinSparseFormImpl<PA_GF2>::apply(form, ea, mat);
+    break;
+
+  case PA_zz_p_tag:
+    ThinSparseFormImpl<PA_zz_p>::apply(form, ea, mat);
+    break;
+
+  default:
+    break;
+  }
+  return form;
+}
+
+// The mask of coordinate 0 in dimension dim
+static zzX thinSparseMask(const EncryptedArray& ea, long dim)
+{
+  std::vector<long> mask(ea.size(), 0);
+  for (long i = 0; i < ea.size(); i++)
+    if (ea.coordinate(dim, i) == 0)
+      mask[i] = 1;
+  zzX poly;
+  ea.encode(poly, mask);
+  return poly;
+}
+
 // Constructor: initializing tables for the evaluation-map transformations
 
 ThinEvalMap::ThinEvalMap(const EncryptedArray& _ea,
                          bool minimal,
                          const NTL::Vec<long>& mvec,
                          bool _invert,
-                         bool build_cache) :
-    ea(_ea), invert(_invert)
+                         bool build_cache,
+                         bool doubleHoist,
+                         long _sparseDims) :
+    ea(_ea), invert(_invert), sparseDims(_sparseDims)
 {
   const PAlgebra& zMStar = ea.getPAlgebra();
 
@@ -573,6 +774,12 @@ ThinEvalMap::ThinEvalMap(const EncryptedArray& _ea,
   if (inertPrefix != nfactors - 1)
     throw LogicError("ThinEvalMap: case not handled: bad inertPrefix");
 
+  // Only the dimensions of the inert factors have a matrix of their own
+  assertInRange<InvalidArgument>(sparseDims,
+                                 0l,
+                                 std::min(nfactors - 1, sz) + 1,
+                                 "Invalid argument: sparseDims out of range");
+
   NTL::Vec<NTL::Vec<long>> local_reps(NTL::INIT_SIZE, nfactors);
   for (long i = 0; i < nfactors; i++)
     init_representatives(local_reps[i], i, mvec, zMStar);
@@ -600,44 +807,112 @@ ThinEvalMap::ThinEvalMap(const EncryptedArray& _ea,
 
   matvec.SetLength(nfactors);
 
-  if (invert) {
-    long dim = nfactors - 1;
-    std::unique_ptr<MatMul1D> mat1_data;
-    mat1_data.reset(buildThinStep1Matrix(ea,
-                                         sig_sequence[dim],
-                                         local_reps[dim],
-                                         dim,
-                                         m / mvec[dim]));
-    matvec[dim].reset(new MatMul1DExec(*mat1_data, minimal));
-  } else if (sz == nfactors) {
-    long dim = nfactors - 1;
-    std::unique_ptr<MatMul1D> mat1_data;
-    mat1_data.reset(buildThinStep2Matrix(ea,
-                                         sig_sequence[dim],
-                                         local_reps[dim],
-                                         dim,
-                                         m / mvec[dim],
-                                         invert,
-                                         /*inflate=*/true));
-    matvec[dim].reset(new MatMul1DExec(*mat1_data, minimal));
+  // The step matrices are independent, so they are built in parallel. The
+  // executors then encode the diagonals of each one in parallel.
+  std::vector<std::unique_ptr<MatMul1D>> mat_data(nfactors);
+  std::vector<zzX> sparse_data(sparseDims);
+  HELIB_EXEC_RANGE(nfactors, first, last)
+  for (long dim = first; dim < last; dim++) {
+    if (dim < sparseDims) {
+      if (invert) {
+        std::unique_ptr<MatMul1D> mat(buildThinStep2Matrix(ea,
+                                                           sig_sequence[dim],
+                                                           local_reps[dim],
+                                                           dim,
+                                                           m / mvec[dim],
+                                                           invert));
+        sparse_data[dim] = thinSparseForm(ea, *mat);
+      } else {
+        sparse_data[dim] = thinSparseMask(ea, dim);
+      }
+    } else if (dim < nfactors - 1)
+      mat_data[dim].reset(buildThinStep2Matrix(ea,
+                                               sig_sequence[dim],
+                                               local_reps[dim],
+                                               dim,
+                                               m / mvec[dim],
+                                               invert));
+    else if (invert)
+      mat_data[dim].reset(buildThinStep1Matrix(ea,
+                                               sig_sequence[dim],
+                                               local_reps[dim],
+                                               dim,
+                                               m / mvec[dim]));
+    else if (sz == nfactors)
+      mat_data[dim].reset(buildThinStep2Matrix(ea,
+                                               sig_sequence[dim],
+                                               local_reps[dim],
+                                               dim,
+                                               m / mvec[dim],
+                                               invert,
+                                               /*inflate=*/true));
   }
+  HELIB_EXEC_RANGE_END
 
-  for (long dim = nfactors - 2; dim >= 0; --dim) {
-    std::unique_ptr<MatMul1D> mat_data;
+  for (long dim = 0; dim < sparseDims; dim++)
+    matvec[dim].reset(new ThinSparseStep(ea, dim, sparse_data[dim]));
 
-    mat_data.reset(buildThinStep2Matrix(ea,
-                                        sig_sequence[dim],
-                                        local_reps[dim],
-                                        dim,
-                                        m / mvec[dim],
-                                        invert));
-    matvec[dim].reset(new MatMul1DExec(*mat_data, minimal));
+  for (long dim = nfactors - 1; dim >= 0; --dim) {
+    if (!mat_data[dim])
+      continue;
+    matvec[dim].reset(new MatMul1DExec(*mat_data[dim], minimal, doubleHoist));
+    mat_data[dim].reset();
   }
 
   if (build_cache)
     upgrade();
 }
 
+// The kinds of step of a ThinEvalMap in its binary format
+enum ThinStepKind : long
+{
+  THIN_STEP_NONE = 0,
+  THIN_STEP_MATRIX = 1, // a MatMul1DExec
+  THIN_STEP_SPARSE = 2  // a ThinSparseStep
+};
+
+ThinEvalMap::ThinEvalMap(const EncryptedArray& _ea, std::istream& str) :
+    ea(_ea), sparseDims(0)
+{
+  invert = read_raw_int(str);
+  nfactors = read_raw_int(str);
+  long n = read_raw_int(str);
+  assertTrue<IOError>(n >= 0, "Negative number of matrices");
+  matvec.SetLength(n);
+  for (long i = 0; i < n; i++) {
+    long kind = read_raw_int(str);
+    if (kind == THIN_STEP_MATRIX) {
+      matvec[i].reset(new MatMul1DExec(ea, str));
+    } else if (kind == THIN_STEP_SPARSE) {
+      assertEq<IOError>(i, sparseDims, "Sparse steps must come first");
+      matvec[i].reset(new ThinSparseStep(ea, str));
+      sparseDims++;
+    } else {
+      assertEq<IOError>(kind, long(THIN_STEP_NONE), "Unknown kind of step");
+    }
+  }
+}
+
+// Only MatMul1DExec matrices and ThinSparseStep steps are built by the
+// constructor
+void ThinEvalMap::writeTo(std::ostream& str) const
+{
+  write_raw_int(str, invert);
+  write_raw_int(str, nfactors);
+  write_raw_int(str, matvec.length());
+  for (long i = 0; i < matvec.length(); i++) {
+    if (!matvec[i]) {
+      write_raw_int(str, THIN_STEP_NONE);
+    } else if (i < sparseDims) {
+      write_raw_int(str, THIN_STEP_SPARSE);
+      static_cast<const ThinSparseStep&>(*matvec[i]).writeTo(str);
+    } else {
+      write_raw_int(str, THIN_STEP_MATRIX);
+      static_cast<const MatMul1DExec&>(*matvec[i]).writeTo(str);
+    }
+  }
+}
+
 void ThinEvalMap::upgrade()
 {
   for (long i = 0; i < matvec.length(); i++)
@@ -645,6 +920,22 @@ void ThinEvalMap::upgrade()
       matvec[i]->upgrade();
 }
 
+void ThinEvalMap::upgradeWithin(long& budget, bool lazily)
+{
+  for (long i = 0; i < matvec.length(); i++)
+    if (matvec[i])
+      matvec[i]->upgradeWithin(budget, lazily);
+}
+
+long ThinEvalMap::cacheBytes() const
+{
+  long total = 0;
+  for (long i = 0; i < matvec.length(); i++)
+    if (matvec[i])
+      total += matvec[i]->cacheBytes();
+  return total;
+}
+
 // Applying the evaluation (or its inverse) map to a ciphertext
 void ThinEvalMap::apply(Ctxt& ctxt) const
 {
@@ -659,6 +950,20 @@ void ThinEvalMap::apply(Ctxt& ctxt) const
   }
 }
 
+void ThinEvalMap::automorphisms(std::map<long, std::set<long>>& autos) const
+{
+  for (long i = 0; i < matvec.length(); i++) {
+    if (!matvec[i])
+      continue;
+    if (i < sparseDims)
+      static_cast<const ThinSparseStep&>(*matvec[i]).automorphisms(autos);
+    else
+      static_cast<const MatMul1DExec&>(*matvec[i]).automorphisms(autos);
+  }
+  if (invert)
+    traceMapAutomorphisms(ea.getContext(), autos);
+}
+
 // The callback interface for the matrix-multiplication routines.
 
 //! \cond FALSE (make doxygen ignore these classes)
@@ -10,6 +10,8 @@
  * limitations under the License. See accompanying LICENSE file.
  */
 
+#include <algorithm>
+
 #include <helib/IndexSet.h>
 #include "binio.h"
 #include "io.h"
@@ -22,6 +24,45 @@ const IndexSet& IndexSet::emptySet()
   return empty;
 }
 
+IndexSet::IndexSet(IndexSet&& other) noexcept :
+    extraRep(std::move(other.extraRep)),
+    _first(other._first),
+    _last(other._last),
+    _card(other._card)
+{
+  std::copy(other.inlineRep, other.inlineRep + INLINE_WORDS, inlineRep);
+  other.clear();
+}
+
+IndexSet& IndexSet::operator=(IndexSet&& other) noexcept
+{
+  if (this == &other)
+    return *this;
+  std::copy(other.inlineRep, other.inlineRep + INLINE_WORDS, inlineRep);
+  extraRep = std::move(other.extraRep);
+  _first = other._first;
+  _last = other._last;
+  _card = other._card;
+  other.clear();
+  return *this;
+}
+
+void IndexSet::recount()
+{
+  _card = 0;
+  _first = 0;
+  _last = -1;
+  for (long w = 0; w < numWords(); w++) {
+    Word x = word(w);
+    if (x == 0)
+      continue;
+    if (_card == 0)
+      _first = w * WORD_BITS + __builtin_ctzll(x);
+    _last = w * WORD_BITS + WORD_BITS - 1 - __builtin_clzll(x);
+    _card += __builtin_popcountll(x);
+  }
+}
+
 // constructs an interval, low to high
 void IndexSet::intervalConstructor(long low, long high)
 {
@@ -34,11 +75,16 @@ void IndexSet::intervalConstructor(long low, long high)
     _last = -1;
     _card = 0;
   } else {
-    rep.resize(high + 1);
-    for (long i = 0; i < low; i++)
-      rep[i] = false;
-    for (long i = low; i <= high; i++)
-      rep[i] = true;
+    const long lowWord = low / WORD_BITS, highWord = high / WORD_BITS;
+    wordRef(highWord); // make room for all the words
+    for (long w = lowWord; w <= highWord; w++) {
+      Word x = ~Word(0);
+      if (w == lowWord)
+        x &= ~Word(0) << (low % WORD_BITS);
+      if (w == highWord)
+        x &= ~Word(0) >> (WORD_BITS - 1 - high % WORD_BITS);
+      wordRef(w) = x;
+    }
 
     _first = low;
     _last = high;
@@ -55,9 +101,12 @@ long IndexSet::next(long j) const
   if (j < _first)
     return _first;
   j++;
-  while (rep[j] == false)
-    j++;
-  return j;
+  // there is an element in [j, _last], look for it a word at a time
+  long w = j / WORD_BITS;
+  Word x = word(w) & (~Word(0) << (j % WORD_BITS));
+  while (x == 0)
+    x = word(++w);
+  return w * WORD_BITS + __builtin_ctzll(x);
 }
 
 long IndexSet::prev(long j) const
@@ -69,22 +118,30 @@ long IndexSet::prev(long j) const
   if (j <= _first)
     return j - 1;
   j--;
-  while (rep[j] == false)
-    j--;
-  return j;
+  // there is an element in [_first, j], look for it a word at a time
+  long w = j / WORD_BITS;
+  Word x = word(w) & (~Word(0) >> (WORD_BITS - 1 - j % WORD_BITS));
+  while (x == 0)
+    x = word(--w);
+  return w * WORD_BITS + WORD_BITS - 1 - __builtin_clzll(x);
 }
 
 bool IndexSet::contains(long j) const
 {
   if (j < _first || j > _last)
     return false;
-  return rep[j];
+  return (word(j / WORD_BITS) >> (j % WORD_BITS)) & 1;
 }
 
 bool IndexSet::contains(const IndexSet& s) const
 {
-  for (long i = s.first(); i <= s.last(); i = s.next(i))
-    if (!contains(i))
+  if (s.card() == 0)
+    return true;
+  if (s.card() > card() || s.first() < first() || s.last() > last())
+    return false;
+
+  for (long w = s.first() / WORD_BITS; w <= s.last() / WORD_BITS; w++)
+    if ((s.word(w) & ~word(w)) != 0)
       return false;
   return true;
 }
@@ -95,8 +152,10 @@ bool IndexSet::disjointFrom(const IndexSet& s) const
   if (card() == 0 || s.card() == 0 || last() < s.first() || s.last() < first())
     return true;
 
-  for (long i = s.first(); i <= s.last(); i = s.next(i))
-    if (contains(i))
+  const long lo = std::max(first(), s.first()) / WORD_BITS;
+  const long hi = std::min(last(), s.last()) / WORD_BITS;
+  for (long w = lo; w <= hi; w++)
+    if ((word(w) & s.word(w)) != 0)
       return false;
   return true;
 }
@@ -112,15 +171,16 @@ bool IndexSet::operator==(const IndexSet& s) const
   if (_last != s._last)
     return false;
 
-  return equal(rep.begin() + _first,
-               rep.begin() + _last + 1,
-               s.rep.begin() + _first);
-  // NOTE: maybe vector<bool> optimizes this???
+  for (long w = _first / WORD_BITS; w <= _last / WORD_BITS; w++)
+    if (word(w) != s.word(w))
+      return false;
+  return true;
 }
 
 void IndexSet::clear()
 {
-  rep.resize(0);
+  std::fill(inlineRep, inlineRep + INLINE_WORDS, Word(0));
+  extraRep.clear();
   _first = 0;
   _last = -1;
   _card = 0;
@@ -130,35 +190,28 @@ void IndexSet::insert(long j)
 {
   assertTrue<InvalidArgument>(j >= 0, "Cannot insert in negative index");
 
-  long oldSize = rep.size();
-  if (j >= oldSize) {
-    rep.resize(j + 1);
-    for (long i = oldSize; i <= j; i++)
-      rep[i] = false;
-  }
+  Word& x = wordRef(j / WORD_BITS);
+  const Word bit = Word(1) << (j % WORD_BITS);
+  if (x & bit)
+    return;
+  x |= bit;
 
   if (_card == 0) {
     _first = _last = j;
-    _card = 1;
   } else {
     if (j > _last)
       _last = j;
     if (j < _first)
       _first = j;
-    if (rep[j] == false)
-      _card++;
   }
-
-  rep[j] = true;
+  _card++;
 }
 
 void IndexSet::remove(long j)
 {
   assertTrue<InvalidArgument>(j >= 0, "Cannot remove from negative index");
 
-  if (j >= (long)rep.size())
-    return;
-  if (rep[j] == false)
+  if (!contains(j))
     return;
 
   long newFirst = _first, newLast = _last;
@@ -176,7 +229,7 @@ void IndexSet::remove(long j)
   _first = newFirst;
   _last = newLast;
   _card--;
-  rep[j] = false;
+  wordRef(j / WORD_BITS) &= ~(Word(1) << (j % WORD_BITS));
 }
 
 void IndexSet::insert(const IndexSet& s)
@@ -190,10 +243,10 @@ void IndexSet::insert(const IndexSet& s)
     return;
   }
 
-  for (long i = s.last(); i >= s.first(); i = s.prev(i))
-    insert(i);
-  // NOTE: traversal done from high to low so as to trigger at
-  // at most one resize
+  wordRef(s.last() / WORD_BITS); // at most one resize
+  for (long w = s.first() / WORD_BITS; w <= s.last() / WORD_BITS; w++)
+    wordRef(w) |= s.word(w);
+  recount();
 }
 
 void IndexSet::remove(const IndexSet& s)
@@ -202,14 +255,13 @@ void IndexSet::remove(const IndexSet& s)
     clear();
     return;
   }
-  if (s.card() == 0)
-    return;
-  if (card() == 0)
+  if (disjointFrom(s))
     return;
 
-  for (long i = s.first(); i <= s.last(); i = s.next(i))
-    remove(i);
-  // NOTE: traversal order should not matter here
+  const long hi = std::min(last(), s.last()) / WORD_BITS;
+  for (long w = std::max(first(), s.first()) / WORD_BITS; w <= hi; w++)
+    wordRef(w) &= ~s.word(w);
+  recount();
 }
 
 void IndexSet::retain(const IndexSet& s)
@@ -223,10 +275,9 @@ void IndexSet::retain(const IndexSet& s)
   if (card() == 0)
     return;
 
-  for (long i = first(); i <= last(); i = next(i)) {
-    if (!s.contains(i))
-      remove(i);
-  }
+  for (long w = first() / WORD_BITS; w <= last() / WORD_BITS; w++)
+    wordRef(w) &= s.word(w);
+  recount();
 }
 
 // union
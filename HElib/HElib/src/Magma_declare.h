@@ -1 +0,0 @@
-extern std::vector<NTL::ZZX> polynomial_vector[][4];
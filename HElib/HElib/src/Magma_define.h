@@ -1,5 +0,0 @@
-long nb_primes = 5;
-std::vector<long> primes_list {2, 3, 5, 17, 127};
-long nb_e_inner = 4;
-std::vector<long> e_inner_list {1, 5, 6, 16};
-std::vector<NTL::ZZX> polynomial_vector[5][4];
@@ -27,7 +27,7 @@ namespace helib {
 const long double PI =
     3.1415926535897932384626433832795028841971693993751058209749445923078164L;
 
-bool FHEglobals::dryRun = false;
+thread_local bool FHEglobals::dryRun = false;
 
 // Considering bits as a vector of bits, return the value it represents when
 // interpreted as a bitSize-bit 2's complement number.
@@ -1184,15 +1184,22 @@ void convert(NTL::Vec<long>& out, const NTL::ZZX& in)
 
 void convert(NTL::Vec<long>& out, const NTL::zz_pX& in, bool symmetric)
 {
-  out.SetLength(in.rep.length());
-  for (long i = 0; i < out.length(); i++)
-    out[i] = NTL::conv<long>(in[i]);
+  const long n = in.rep.length();
+  out.SetLength(n);
+  long* op = out.elts();
+  const NTL::zz_p* ip = in.rep.elts();
 
   if (symmetric) { // convert to representation symmetric around 0
-    long p = NTL::zz_p::modulus();
-    for (long i = 0; i < out.length(); i++)
-      if (out[i] > p / 2)
-        out[i] -= p;
+    const long p = NTL::zz_p::modulus();
+    const long half = p / 2;
+    // Branch-free, so that the loop vectorizes
+    for (long i = 0; i < n; i++) {
+      long c = rep(ip[i]);
+      op[i] = c - (p & -long(c > half));
+    }
+  } else {
+    for (long i = 0; i < n; i++)
+      op[i] = rep(ip[i]);
   }
 }
 
@@ -15,8 +15,11 @@
 #include <helib/PAlgebra.h>
 #include <helib/hypercube.h>
 #include <helib/timing.h>
+#include <helib/opCounters.h>
 #include <helib/range.h>
 
+#include "binio.h"
+
 #include <NTL/ZZXFactoring.h>
 #include <NTL/GF2EXFactoring.h>
 #include <NTL/lzz_pEXFactoring.h>
@@ -25,6 +28,7 @@
 #include <algorithm> // defines count(...), min(...)
 #include <cmath>
 #include <mutex> // std::mutex, std::unique_lock
+#include <unordered_map>
 
 namespace helib {
 
@@ -642,7 +646,39 @@ long PAlgebra::genToPow(long i, long j) const
 
 ************************************************************************/
 
-PAlgebraModBase* buildPAlgebraMod(const PAlgebra& zMStar, long r)
+void PAlgebraTables::writeTo(std::ostream& str) const
+{
+  write_raw_int(str, m);
+  write_raw_int(str, p);
+  write_raw_int(str, r);
+  write_raw_int(str, factors.size());
+  for (long i : range(lsize(factors))) {
+    write_ntl_vec_long(str, factors[i]);
+    write_ntl_vec_long(str, crtCoeffs[i]);
+  }
+}
+
+PAlgebraTables PAlgebraTables::readFrom(std::istream& str)
+{
+  PAlgebraTables tables;
+  tables.m = read_raw_int(str);
+  tables.p = read_raw_int(str);
+  tables.r = read_raw_int(str);
+  long n = read_raw_int(str);
+  assertTrue<IOError>(bool(str) && n >= 0, "Could not read PAlgebra tables");
+  tables.factors.resize(n);
+  tables.crtCoeffs.resize(n);
+  for (long i : range(n)) {
+    read_ntl_vec_long(str, tables.factors[i]);
+    read_ntl_vec_long(str, tables.crtCoeffs[i]);
+  }
+  assertTrue<IOError>(bool(str), "Could not read PAlgebra tables");
+  return tables;
+}
+
+PAlgebraModBase* buildPAlgebraMod(const PAlgebra& zMStar,
+                                  long r,
+                                  const PAlgebraTables* tables)
 {
   long p = zMStar.getP();
 
@@ -653,9 +689,9 @@ PAlgebraModBase* buildPAlgebraMod(const PAlgebra& zMStar, long r)
                               "Modulus p is less than 2 (nor -1 for CKKS)");
   assertTrue<InvalidArgument>(r > 0, "Hensel lifting r is less than 1");
   if (p == 2 && r == 1)
-    return new PAlgebraModDerived<PA_GF2>(zMStar, r);
+    return new PAlgebraModDerived<PA_GF2>(zMStar, r, tables);
   else
-    return new PAlgebraModDerived<PA_zz_p>(zMStar, r);
+    return new PAlgebraModDerived<PA_zz_p>(zMStar, r, tables);
 }
 
 template <typename T>
@@ -677,8 +713,23 @@ NTL::zz_pEX FrobeniusMap(const NTL::zz_pEXModulus& F)
   return PowerXMod(NTL::zz_pE::cardinality(), F);
 }
 
+// Polynomials mod p^r from the coefficients in PAlgebraTables
+static void fromCoeffs(NTL::GF2X& f, const zzX& coeffs)
+{
+  convert(f, coeffs);
+}
+
+static void fromCoeffs(NTL::zz_pX& f, const zzX& coeffs)
+{
+  NTL::ZZX g;
+  convert(g, coeffs);
+  conv(f, g);
+}
+
 template <typename type>
-PAlgebraModDerived<type>::PAlgebraModDerived(const PAlgebra& _zMStar, long _r) :
+PAlgebraModDerived<type>::PAlgebraModDerived(const PAlgebra& _zMStar,
+                                             long _r,
+                                             const PAlgebraTables* tables) :
     zMStar(_zMStar), r(_r)
 
 {
@@ -700,6 +751,49 @@ PAlgebraModDerived<type>::PAlgebraModDerived(const PAlgebra& _zMStar, long _r) :
 
   RBak bak;
   bak.save();
+
+  if (tables != nullptr && !isDryRun()) {
+    assertTrue<IOError>(tables->m == m && tables->p == p && tables->r == r &&
+                            lsize(tables->factors) == nSlots &&
+                            lsize(tables->crtCoeffs) == nSlots,
+                        "PAlgebra tables computed for other parameters");
+    SetModulus(pPowR);
+    RX phimxmod;
+    conv(phimxmod, zMStar.getPhimX());
+    build(PhimXMod, phimxmod);
+    pPowRContext.save();
+
+    resize(factors, nSlots);
+    resize(crtCoeffs, nSlots);
+    for (long i = 0; i < nSlots; i++) {
+      fromCoeffs(factors[i], tables->factors[i]);
+      fromCoeffs(crtCoeffs[i], tables->crtCoeffs[i]);
+    }
+  } else {
+    computeFactors();
+  }
+
+  // set factorsOverZZ
+  resize(factorsOverZZ, nSlots);
+  for (long i = 0; i < nSlots; i++)
+    conv(factorsOverZZ[i], factors[i]);
+
+  genCrtTable();
+  genMaskTable();
+  genChirpTables();
+}
+
+// Computes the factors of Phi_m(X) mod p^r and their CRT coefficients,
+// setting PhimXMod and pPowRContext
+template <typename type>
+void PAlgebraModDerived<type>::computeFactors()
+{
+  long p = zMStar.getP();
+  long m = zMStar.getM();
+  if (isDryRun())
+    m = (p == 3) ? 4 : 3;
+  long nSlots = zMStar.getNSlots();
+
   SetModulus(p);
 
   // Compute the factors Ft of Phi_m(X) mod p, for all t \in T
@@ -712,25 +806,32 @@ PAlgebraModDerived<type>::PAlgebraModDerived(const PAlgebra& _zMStar, long _r) :
 
   EDF(localFactors, phimxmod, zMStar.getOrdP()); // equal-degree factorization
 
-  RX* first = &localFactors[0];
-  RX* last = first + lsize(localFactors);
+  RX* firstFactor = &localFactors[0];
+  RX* lastFactor = firstFactor + lsize(localFactors);
   RX* smallest =
-      std::min_element(first,
-                       last,
+      std::min_element(firstFactor,
+                       lastFactor,
                        static_cast<bool (*)(const RX&, const RX&)>(less_than));
-  swap(*first, *smallest);
+  swap(*firstFactor, *smallest);
 
   // We make the lexicographically smallest factor have index 0.
   // The remaining factors are ordered according to their representatives.
 
+  // The other factors are independent of each other, and computed in
+  // parallel. The NTL modulus is per thread, so each worker restores it.
+  RContext pContext;
+  pContext.save();
   RXModulus F1(localFactors[0]);
-  for (long i = 1; i < nSlots; i++) {
+  HELIB_EXEC_RANGE(nSlots - 1, first, last)
+  pContext.restore();
+  for (long i = first + 1; i <= last; i++) {
     long t = zMStar.ith_rep(i);      // Ft is minimal poly of x^{1/t} mod F1
     long tInv = NTL::InvMod(t, m);   // tInv = t^{-1} mod m
     RX X2tInv = PowerXMod(tInv, F1); // X2tInv = X^{1/t} mod F1
     NTL::IrredPolyMod(localFactors[i], X2tInv, F1);
     // IrredPolyMod(X,P,Q) returns in X the minimal polynomial of P mod Q
   }
+  HELIB_EXEC_RANGE_END
   /* Debugging sanity-check #1: we should have Ft= GCD(F1(X^t),Phi_m(X))
   for (i=1; i<nSlots; i++) {
     long t = T[i];
@@ -749,11 +850,14 @@ PAlgebraModDerived<type>::PAlgebraModDerived(const PAlgebra& _zMStar, long _r) :
 
     // Compute the CRT coefficients for the Ft's
     resize(crtCoeffs, nSlots);
-    for (long i = 0; i < nSlots; i++) {
+    HELIB_EXEC_RANGE(nSlots, first, last)
+    pPowRContext.restore();
+    for (long i = first; i < last; i++) {
       RX te = phimxmod / factors[i];        // \prod_{j\ne i} Fj
       te %= factors[i];                     // \prod_{j\ne i} Fj mod Fi
       InvMod(crtCoeffs[i], te, factors[i]); // \prod_{j\ne i} Fj^{-1} mod Fi
     }
+    HELIB_EXEC_RANGE_END
   } else {
     PAlgebraLift(zMStar.getPhimX(), localFactors, factors, crtCoeffs, r);
     RX phimxmod1;
@@ -761,14 +865,23 @@ PAlgebraModDerived<type>::PAlgebraModDerived(const PAlgebra& _zMStar, long _r) :
     build(PhimXMod, phimxmod1);
     pPowRContext.save();
   }
+}
 
-  // set factorsOverZZ
-  resize(factorsOverZZ, nSlots);
-  for (long i = 0; i < nSlots; i++)
-    conv(factorsOverZZ[i], factors[i]);
-
-  genCrtTable();
-  genMaskTable();
+template <typename type>
+PAlgebraTables PAlgebraModDerived<type>::getTables() const
+{
+  PAlgebraTables tables;
+  tables.m = zMStar.getM();
+  tables.p = zMStar.getP();
+  tables.r = r;
+  long nSlots = lsize(factors);
+  tables.factors.resize(nSlots);
+  tables.crtCoeffs.resize(nSlots);
+  for (long i = 0; i < nSlots; i++) {
+    convert(tables.factors[i], factors[i]);
+    convert(tables.crtCoeffs[i], crtCoeffs[i]);
+  }
+  return tables;
 }
 
 // Assumes current zz_p modulus is p^r
@@ -870,14 +983,19 @@ void PAlgebraLift(const NTL::ZZX& phimx,
   for (long i = 0; i < nSlots; i++) // Convert from ZZX to zz_pX
     conv(factors[i], vzz[i]);
 
-  // Finally compute the CRT coefficients for the factors
+  // Finally compute the CRT coefficients for the factors, in parallel
   resize(crtc, nSlots);
-  for (long i = 0; i < nSlots; i++) {
+  NTL::zz_pContext context;
+  context.save();
+  HELIB_EXEC_RANGE(nSlots, first, last)
+  context.restore();
+  for (long i = first; i < last; i++) {
     NTL::zz_pX& fct = factors[i];
     NTL::zz_pX te = phimxmod / fct;   // \prod_{j\ne i} Fj
     te %= fct;                        // \prod_{j\ne i} Fj mod Fi
     InvModpr(crtc[i], te, fct, p, r); // \prod_{j\ne i} Fj^{-1} mod Fi
   }
+  HELIB_EXEC_RANGE_END
 }
 
 // Returns a vector crt[] such that crt[i] = p mod Ft (with t = T[i])
@@ -892,6 +1010,17 @@ void PAlgebraModDerived<type>::CRT_decompose(std::vector<RX>& crt,
     return;
   }
   resize(crt, nSlots);
+  if (hasLinearSlots()) {
+    // crt[i] = H(zeta^slotExps[i]), all powers of zeta evaluated at once
+    RX reduced;
+    if (deg(H) >= zMStar.getPhiM())
+      rem(reduced, H, PhimXMod);
+    vec_R values;
+    chirpTransform(values, deg(H) >= zMStar.getPhiM() ? reduced : H, false);
+    for (long i = 0; i < nSlots; i++)
+      conv(crt[i], values[slotExps[i]]);
+    return;
+  }
   for (long i = 0; i < nSlots; i++)
     rem(crt[i], H, factors[i]); // crt[i] = H % factors[i]
 }
@@ -1014,6 +1143,33 @@ void PAlgebraModDerived<type>::CRT_reconstruct(RX& H,
   HELIB_TIMER_START;
   long nslots = zMStar.getNSlots();
 
+  if (hasLinearSlots()) {
+    // Interpolate over all m'th roots of unity, with zeros at the roots
+    // that are not slots: G = m^{-1} sum_j V_j zeta^{-jk} X^k, then reduce
+    long m = zMStar.getM();
+    R mInv, value;
+    conv(mInv, NTL::InvMod(m % pPowR, pPowR));
+    RX values, tmp;
+    values.SetMaxLength(m);
+    for (long i = 0; i < nslots; i++) {
+      if (deg(crt[i]) > 0) {
+        rem(tmp, crt[i], factors[i]);
+        mul(value, ConstTerm(tmp), mInv);
+      } else
+        mul(value, ConstTerm(crt[i]), mInv);
+      SetCoeff(values, slotExps[i], value);
+    }
+    vec_R coeffs;
+    chirpTransform(coeffs, values, true);
+    RX G;
+    G.SetMaxLength(m);
+    for (long k = m - 1; k >= 0; k--)
+      SetCoeff(G, k, coeffs[k]);
+    rem(H, G, PhimXMod);
+    HELIB_TIMER_STOP;
+    return;
+  }
+
   const std::vector<RX>& ctab = crtTable;
 
   clear(H);
@@ -1277,6 +1433,51 @@ void PAlgebraModDerived<type>::decodePlaintext(
   }
 }
 
+template <typename type>
+void PAlgebraModDerived<type>::decodeSlots(
+    std::vector<RX>& alphas,
+    const RX& ptxt,
+    const MappingData<type>& mappingData,
+    const std::vector<long>& slots) const
+{
+  long nSlots = zMStar.getNSlots();
+  for (long i : slots)
+    assertInRange(i, 0l, nSlots, "Slot index out of range");
+  if (isDryRun()) {
+    alphas.assign(slots.size(), RX::zero());
+    return;
+  }
+
+  // The CRT components of the requested slots only
+  resize(alphas, slots.size());
+  for (long k = 0; k < lsize(slots); k++) {
+    long i = slots[k];
+    if (hasLinearSlots()) {
+      // zeta^slotExps[i] is a root of Phi_m, no need to reduce ptxt first
+      R value;
+      eval(value, ptxt, rootPows[slotExps[i]]);
+      conv(alphas[k], value);
+    } else {
+      rem(alphas[k], ptxt, factors[i]);
+    }
+  }
+
+  if (mappingData.degG == 1)
+    return;
+
+  REBak bak;
+  bak.save();
+  mappingData.contextForG.restore();
+
+  // As in decodePlaintext
+  for (long k = 0; k < lsize(slots); k++) {
+    REX te;
+    conv(te, alphas[k]);
+    te %= mappingData.rmaps[slots[k]];
+    alphas[k] = rep(ConstTerm(te));
+  }
+}
+
 template <typename type>
 void PAlgebraModDerived<type>::buildLinPolyCoeffs(
     std::vector<RX>& C,
@@ -1352,15 +1553,107 @@ void PAlgebraModDerived<type>::genCrtTable()
 
   long nslots = zMStar.getNSlots();
   resize(crtTable, nslots);
-  for (long i = 0; i < nslots; i++) {
+  HELIB_EXEC_RANGE(nslots, first, last)
+  pPowRContext.restore();
+  for (long i = first; i < last; i++) {
     RX allBut_i = PhimXMod / factors[i]; // = \prod_{j \ne i }Fj
     allBut_i *= crtCoeffs[i]; // = 1 mod Fi and = 0 mod Fj for j \ne i
     crtTable[i] = allBut_i;
   }
+  HELIB_EXEC_RANGE_END
 
   buildTree(crtTree, 0, nslots);
 }
 
+// Tables for the CRT maps when Phi_m(X) splits into linear factors mod p^r.
+// Then the roots of the factors are m'th roots of unity mod p^r, and using
+// jk = C(j+k,2) - C(j,2) - C(k,2) (with C(l,2) = l(l-1)/2), evaluating at
+// all of them becomes a correlation with the "chirp" zeta^{C(l,2)}.
+
+template <typename type>
+void PAlgebraModDerived<type>::genChirpTables()
+{
+  // This is only called by the constructor, which has already
+  // set the zz_p context and the factors
+  long m = zMStar.getM();
+  long nSlots = zMStar.getNSlots();
+  if (tag != PA_zz_p_tag || zMStar.getOrdP() != 1 || nSlots < 2 ||
+      isDryRun())
+    return;
+
+  R zeta;
+  negate(zeta, ConstTerm(factors[0])); // factors[0] = X - zeta
+
+  resize(rootPows, m);
+  std::unordered_map<long, long> expOf;
+  rootPows[0] = 1;
+  expOf[1] = 0;
+  for (long e = 1; e < m; e++) {
+    R pow;
+    mul(pow, rootPows[e - 1], zeta);
+    rootPows[e] = pow;
+    expOf[rep(pow)] = e;
+  }
+  assertEq<LogicError>((long)expOf.size(), m, "zeta is not a primitive m'th root");
+
+  std::vector<long> exps(nSlots);
+  for (long i = 0; i < nSlots; i++) {
+    assertEq<LogicError>(deg(factors[i]), 1l, "factor is not linear");
+    R root;
+    negate(root, ConstTerm(factors[i]));
+    auto it = expOf.find(rep(root));
+    assertTrue<LogicError>(it != expOf.end(), "factor root is not a power");
+    exps[i] = it->second;
+  }
+
+  long len = 2 * m - 1;
+  chirp.SetMaxLength(len);
+  invChirp.SetMaxLength(len);
+  long c = 0; // C(l,2) mod m
+  for (long l = 0; l < len; l++) {
+    SetCoeff(chirp, l, rootPows[c]);
+    SetCoeff(invChirp, l, rootPows[(m - c) % m]);
+    c = (c + l) % m;
+  }
+  slotExps = exps;
+}
+
+template <typename type>
+void PAlgebraModDerived<type>::chirpTransform(vec_R& out,
+                                              const RX& in,
+                                              bool inverse) const
+{
+  long m = zMStar.getM();
+  long n = deg(in) + 1;
+  assertTrue<LogicError>(n <= m, "chirpTransform: input has too many terms");
+
+  // With w = zeta^{+-1}: up[l] = w^{C(l,2)}, down[l] = w^{-C(l,2)}
+  const RX& up = inverse ? invChirp : chirp;
+  const RX& down = inverse ? chirp : invChirp;
+
+  out.SetLength(m);
+  if (n == 0) {
+    clear(out);
+    return;
+  }
+
+  // out[j] = down[j] sum_k (in[k] down[k]) up[j+k], a correlation which is
+  // read off the product with the reversed input
+  RX a, b, prod;
+  R t;
+  a.SetMaxLength(n);
+  for (long k = 0; k < n; k++) {
+    mul(t, coeff(in, k), coeff(down, k));
+    SetCoeff(a, n - 1 - k, t);
+  }
+  trunc(b, up, n + m - 1);
+  mul(prod, a, b);
+  for (long j = 0; j < m; j++) {
+    mul(t, coeff(prod, n - 1 + j), coeff(down, j));
+    out[j] = t;
+  }
+}
+
 template <typename type>
 void PAlgebraModDerived<type>::buildTree(std::shared_ptr<TNode<RX>>& res,
                                          long offset,
@@ -51,6 +51,16 @@ See below for more details.
 #define USE_PD4
 #endif
 
+#if defined(HAVE_AVX2) && defined(__AVX512F__)
+#define USE_PD8
+//#warning "USE_PD8"
+#endif
+
+#if !defined(USE_PD4) && defined(__aarch64__) && defined(__ARM_NEON)
+#define USE_NEON
+//#warning "USE_NEON"
+#endif
+
 #endif
 
 
@@ -65,6 +75,10 @@ See below for more details.
 #include <immintrin.h>
 #endif
 
+#ifdef USE_NEON
+#include <arm_neon.h>
+#endif
+
 namespace helib {
 
 using std::vector;
@@ -77,7 +91,7 @@ typedef complex<double> cmplx_t;
 typedef long double ldbl;
 //typedef double ldbl;
 
-#ifdef USE_PD4
+#if defined(USE_PD4) || defined(USE_NEON)
 bool PGFFT::simd_enabled() { return true; }
 #else
 bool PGFFT::simd_enabled() { return false; }
@@ -341,6 +355,68 @@ fmsubadd(PD4 a, PD4 b, PD4 c)
 #endif
 
 
+#endif
+
+//=================== PD8 implementation ===============
+
+// Only what the butterflies need: a PD8 holds 4 complex values, so the
+// loops that take two PD4's per 4 values take a single PD8.
+
+#if defined(USE_PD8)
+
+struct PD8 {
+   __m512d data;
+
+   PD8() = default;
+   PD8(__m512d _data) : data(_data) { }
+
+   // load from unaligned address
+   static PD8 loadu(const double *p) { return _mm512_loadu_pd(p); }
+};
+
+// store to unaligned address
+inline void
+storeu(double *p, PD8 a)
+{ _mm512_storeu_pd(p, a.data); }
+
+// swap even/odd slots
+// e.g., 01234567 -> 10325476
+inline PD8
+swap2(PD8 a)
+{ return _mm512_permute_pd(a.data, 0x55); }
+
+// 01234567 -> 00224466
+inline PD8
+dup2even(PD8 a)
+{ return _mm512_movedup_pd(a.data); }
+
+// 01234567 -> 11335577
+inline PD8
+dup2odd(PD8 a)
+{ return _mm512_permute_pd(a.data, 0xff); }
+
+inline PD8
+operator+(PD8 a, PD8 b)
+{ return _mm512_add_pd(a.data, b.data); }
+
+inline PD8
+operator-(PD8 a, PD8 b)
+{ return _mm512_sub_pd(a.data, b.data); }
+
+inline PD8
+operator*(PD8 a, PD8 b)
+{ return _mm512_mul_pd(a.data, b.data); }
+
+// a*b-c in the even slots, a*b+c in the odd ones
+inline PD8
+fmaddsub(PD8 a, PD8 b, PD8 c)
+{ return _mm512_fmaddsub_pd(a.data, b.data, c.data); }
+
+// a*b+c in the even slots, a*b-c in the odd ones
+inline PD8
+fmsubadd(PD8 a, PD8 b, PD8 c)
+{ return _mm512_fmsubadd_pd(a.data, b.data, c.data); }
+
 #endif
 
 }
@@ -534,6 +610,29 @@ complex_conj_mul(PD4 ab, PD4 cd)
    return fmsubadd(ab, cc, ba*dd);
 }
 
+#ifdef USE_PD8
+
+static inline PD8
+complex_mul(PD8 ab, PD8 cd)
+{
+   PD8 cc = dup2even(cd);
+   PD8 dd = dup2odd(cd);
+   PD8 ba = swap2(ab);
+   return fmaddsub(ab, cc, ba*dd);
+}
+
+static inline PD8
+complex_conj_mul(PD8 ab, PD8 cd)
+// (ac+bd,bc-ad)
+{
+   PD8 cc = dup2even(cd);
+   PD8 dd = dup2odd(cd);
+   PD8 ba = swap2(ab);
+   return fmsubadd(ab, cc, ba*dd);
+}
+
+#endif
+
 
 #define MUL2(x_0, x_1, a_0, a_1, b_0, b_1) \
 do { \
@@ -614,6 +713,49 @@ fwd_butterfly_loop_simd(
   }
 }
 
+#ifdef USE_PD8
+
+// The same loops with 4 complex values in a single PD8. The pointers are
+// those of the PD4 loops, which are not always 64-byte aligned.
+
+static inline void
+fwd_butterfly_loop_simd8(
+   long size,
+   double * RESTRICT xp0,
+   double * RESTRICT xp1,
+   const double * RESTRICT wtab)
+{
+  for (long j = 0; j < size; j += 4) {
+    PD8 x0 = PD8::loadu(xp0+2*j);
+    PD8 x1 = PD8::loadu(xp1+2*j);
+    PD8 w  = PD8::loadu(wtab+2*j);
+
+    storeu(xp0+2*j, x0 + x1);
+    storeu(xp1+2*j, complex_mul(x0 - x1, w));
+  }
+}
+
+static inline void
+inv_butterfly_loop_simd8(
+   long size,
+   double * RESTRICT xp0,
+   double * RESTRICT xp1,
+   const double * RESTRICT wtab)
+{
+  for (long j = 0; j < size; j += 4) {
+    PD8 x0 = PD8::loadu(xp0+2*j);
+    PD8 x1 = PD8::loadu(xp1+2*j);
+    PD8 w  = PD8::loadu(wtab+2*j);
+
+    PD8 t = complex_conj_mul(x1, w);
+
+    storeu(xp0+2*j, x0 + t);
+    storeu(xp1+2*j, x0 - t);
+  }
+}
+
+#endif
+
 static inline void
 fwd_butterfly_loop(
    long size,
@@ -622,7 +764,11 @@ fwd_butterfly_loop(
    const cmplx_t * RESTRICT wtab)
 {
    // NOTE: C++11 guarantees that these reinterpret_cast's work as expected
+#ifdef USE_PD8
+   fwd_butterfly_loop_simd8(
+#else
    fwd_butterfly_loop_simd(
+#endif
       size,
       reinterpret_cast<double*>(xp0),
       reinterpret_cast<double*>(xp1),
@@ -668,13 +814,90 @@ inv_butterfly_loop(
    const cmplx_t * RESTRICT wtab)
 {
    // NOTE: C++11 guarantees that these reinterpret_cast's work as expected
+#ifdef USE_PD8
+   inv_butterfly_loop_simd8(
+#else
    inv_butterfly_loop_simd(
+#endif
       size,
       reinterpret_cast<double*>(xp0),
       reinterpret_cast<double*>(xp1),
       reinterpret_cast<const double*>(wtab));
 }
 
+#elif defined(USE_NEON)
+
+// A float64x2_t holds a single complex value, so there is no need to
+// separate the real and imaginary parts
+
+static inline float64x2_t
+complex_mul(float64x2_t ab, float64x2_t cd)
+// (ac-bd,bc+ad)
+{
+   const float64x2_t sign = { -1.0, 1.0 };
+   float64x2_t cc = vdupq_laneq_f64(cd, 0);
+   float64x2_t dd = vdupq_laneq_f64(cd, 1);
+   float64x2_t ba = vextq_f64(ab, ab, 1);
+   return vfmaq_f64(vmulq_f64(ab, cc), vmulq_f64(ba, dd), sign);
+}
+
+static inline float64x2_t
+complex_conj_mul(float64x2_t ab, float64x2_t cd)
+// (ac+bd,bc-ad)
+{
+   const float64x2_t sign = { 1.0, -1.0 };
+   float64x2_t cc = vdupq_laneq_f64(cd, 0);
+   float64x2_t dd = vdupq_laneq_f64(cd, 1);
+   float64x2_t ba = vextq_f64(ab, ab, 1);
+   return vfmaq_f64(vmulq_f64(ab, cc), vmulq_f64(ba, dd), sign);
+}
+
+static inline void
+fwd_butterfly_loop(
+   long size,
+   cmplx_t * RESTRICT xp0,
+   cmplx_t * RESTRICT xp1,
+   const cmplx_t * RESTRICT wtab)
+{
+   // NOTE: C++11 guarantees that these reinterpret_cast's work as expected
+   double * RESTRICT dp0 = reinterpret_cast<double*>(xp0);
+   double * RESTRICT dp1 = reinterpret_cast<double*>(xp1);
+   const double * RESTRICT wp = reinterpret_cast<const double*>(wtab);
+
+   for (long j = 0; j < size; j++) {
+      float64x2_t x0 = vld1q_f64(dp0+2*j);
+      float64x2_t x1 = vld1q_f64(dp1+2*j);
+      float64x2_t w  = vld1q_f64(wp+2*j);
+
+      vst1q_f64(dp0+2*j, vaddq_f64(x0, x1));
+      vst1q_f64(dp1+2*j, complex_mul(vsubq_f64(x0, x1), w));
+   }
+}
+
+static inline void
+inv_butterfly_loop(
+   long size,
+   cmplx_t * RESTRICT xp0,
+   cmplx_t * RESTRICT xp1,
+   const cmplx_t * RESTRICT wtab)
+{
+   // NOTE: C++11 guarantees that these reinterpret_cast's work as expected
+   double * RESTRICT dp0 = reinterpret_cast<double*>(xp0);
+   double * RESTRICT dp1 = reinterpret_cast<double*>(xp1);
+   const double * RESTRICT wp = reinterpret_cast<const double*>(wtab);
+
+   for (long j = 0; j < size; j++) {
+      float64x2_t x0 = vld1q_f64(dp0+2*j);
+      float64x2_t x1 = vld1q_f64(dp1+2*j);
+      float64x2_t w  = vld1q_f64(wp+2*j);
+
+      float64x2_t t = complex_conj_mul(x1, w);
+
+      vst1q_f64(dp0+2*j, vaddq_f64(x0, t));
+      vst1q_f64(dp1+2*j, vsubq_f64(x0, t));
+   }
+}
+
 #else
 
 static inline void
@@ -742,6 +965,23 @@ mul_loop_simd(
   }
 }
 
+#ifdef USE_PD8
+
+static inline void
+mul_loop_simd8(
+   long size,
+   double * RESTRICT xp,
+   const double * yp)
+{
+  for (long j = 0; j < size; j += 4) {
+    PD8 x = PD8::loadu(xp+2*j);
+    PD8 y = PD8::loadu(yp+2*j);
+    storeu(xp+2*j, complex_mul(x, y));
+  }
+}
+
+#endif
+
 
 static inline void
 mul_loop(
@@ -750,13 +990,35 @@ mul_loop(
    const cmplx_t * yp)
 {
    // NOTE: C++11 guarantees that these reinterpret_cast's work as expected
+#ifdef USE_PD8
+   mul_loop_simd8(
+#else
    mul_loop_simd(
+#endif
       size,
       reinterpret_cast<double*>(xp),
       reinterpret_cast<const double*>(yp));
 }
 
 
+#elif defined(USE_NEON)
+
+
+static inline void
+mul_loop(
+   long size,
+   cmplx_t * xp,
+   const cmplx_t * yp)
+{
+   // NOTE: C++11 guarantees that these reinterpret_cast's work as expected
+   double * RESTRICT dp = reinterpret_cast<double*>(xp);
+   const double * yd = reinterpret_cast<const double*>(yp);
+
+   for (long j = 0; j < size; j++)
+      vst1q_f64(dp+2*j, complex_mul(vld1q_f64(dp+2*j), vld1q_f64(yd+2*j)));
+}
+
+
 #else
 
 
@@ -14,6 +14,12 @@
 #include <helib/Ctxt.h>
 #include <helib/permutations.h>
 #include <helib/EncryptedArray.h>
+#include <helib/automorphPrecon.h>
+#include <helib/norms.h>
+#include <helib/opCounters.h>
+#include <helib/timing.h>
+
+#include "binio.h"
 
 namespace helib {
 
@@ -258,4 +264,138 @@ void PermNetwork::applyToCtxt(Ctxt& c, const EncryptedArray& ea) const
   }
 }
 
+// The terms of every layer: the shift amounts, with the masks of makeMask
+// moved through their automorphisms
+CompiledPermutation::CompiledPermutation(const EncryptedArray& ea,
+                                         const PermNetwork& net) :
+    ea(ea)
+{
+  HELIB_TIMER_START;
+  assertFalse<LogicError>(ea.isCKKS(),
+                          "CompiledPermutation only supports BGV");
+  const PAlgebra& al = ea.getPAlgebra();
+  long m = al.getM();
+
+  for (long i = 0; i < net.depth(); i++) {
+    const PermNetLayer& lyr = net.getLayer(i);
+    if (lyr.isIdentity())
+      continue;
+
+    long g2e = NTL::PowerMod(al.ZmStarGen(lyr.getGenIdx()), lyr.getE(), m);
+    NTL::Vec<long> unused = lyr.getShifts();
+    std::vector<bool> mask(unused.length());
+    std::vector<Term>& terms = layers.emplace_back();
+    long shamt = 0;
+    while (true) {
+      std::pair<long, bool> ret = makeMask(mask, unused, shamt);
+      if (ret.second) {
+        Term& term = terms.emplace_back();
+        term.k = NTL::PowerMod(g2e, shamt, m);
+        std::vector<long> slots(mask.begin(), mask.end());
+        NTL::ZZX poly, moved;
+        ea.encode(poly, slots);
+        plaintextAutomorph(moved, poly, term.k, m, al.getPhimX());
+        PolyRed(moved, ea.getAlMod().getPPowR());
+        convert(term.mask, moved);
+      }
+      if (ret.first >= 0)
+        shamt = unused[ret.first];
+      else
+        break;
+    }
+  }
+  encodeMasks();
+}
+
+void CompiledPermutation::encodeMasks()
+{
+  const Context& context = ea.getContext();
+  const PAlgebra& al = ea.getPAlgebra();
+  IndexSet primes = context.getCtxtPrimes() | context.getSpecialPrimes();
+
+  std::vector<Term*> terms;
+  for (auto& layer : layers)
+    for (auto& term : layer)
+      terms.push_back(&term);
+
+  HELIB_EXEC_RANGE(lsize(terms), first, last)
+  for (long t = first; t < last; t++) {
+    Term& term = *terms[t];
+    term.size = embeddingLargestCoeff(term.mask, al);
+    term.dcrt = std::make_shared<DoubleCRT>(term.mask, context, primes);
+    term.precon = std::make_shared<DoubleCRTPrecon>(*term.dcrt);
+  }
+  HELIB_EXEC_RANGE_END
+}
+
+void CompiledPermutation::apply(Ctxt& ctxt) const
+{
+  HELIB_TIMER_START;
+  for (const auto& layer : layers) {
+    std::vector<long> ks;
+    for (const Term& term : layer)
+      ks.push_back(term.k);
+    std::vector<Ctxt> images = BasicAutomorphPrecon(ctxt).automorph(ks);
+
+    long n = layer.size();
+    HELIB_EXEC_RANGE(n, first, last)
+    for (long t = first; t < last; t++) {
+      images[t].cleanUp();
+      images[t].multByConstant(*layer[t].dcrt,
+                               *layer[t].precon,
+                               layer[t].size);
+    }
+    HELIB_EXEC_RANGE_END
+
+    ctxt = images[0];
+    for (long t = 1; t < n; t++)
+      ctxt += images[t];
+  }
+}
+
+std::set<long> CompiledPermutation::automorphisms() const
+{
+  std::set<long> ks;
+  for (const auto& layer : layers)
+    for (const Term& term : layer)
+      if (term.k != 1)
+        ks.insert(term.k);
+  return ks;
+}
+
+void CompiledPermutation::writeTo(std::ostream& str) const
+{
+  write_raw_int(str, ea.getPAlgebra().getM());
+  write_raw_int(str, layers.size());
+  for (const auto& layer : layers) {
+    write_raw_int(str, layer.size());
+    for (const Term& term : layer) {
+      write_raw_int(str, term.k);
+      write_ntl_vec_long(str, term.mask);
+    }
+  }
+}
+
+void CompiledPermutation::readFrom(std::istream& str)
+{
+  HELIB_TIMER_START;
+  long m = read_raw_int(str);
+  assertEq<IOError>(m,
+                    ea.getPAlgebra().getM(),
+                    "CompiledPermutation written for another context");
+  long depth = read_raw_int(str);
+  assertTrue<IOError>(depth >= 0, "Negative number of layers");
+  layers.assign(depth, {});
+  for (auto& layer : layers) {
+    long n = read_raw_int(str);
+    assertTrue<IOError>(n > 0, "Layer without terms");
+    layer.resize(n);
+    for (Term& term : layer) {
+      term.k = read_raw_int(str);
+      read_ntl_vec_long(str, term.mask);
+    }
+  }
+  encodeMasks();
+}
+
 } // namespace helib
@@ -23,12 +23,14 @@ namespace helib {
 
 PolyMod::PolyMod() : ringDescriptor(nullptr) {}
 PolyMod::PolyMod(const std::shared_ptr<PolyModRing>& ringDescriptor) :
-    PolyMod(NTL::ZZX(0), ringDescriptor)
+    ringDescriptor(ringDescriptor)
 {}
 PolyMod::PolyMod(long input,
                  const std::shared_ptr<PolyModRing>& ringDescriptor) :
-    PolyMod(NTL::ZZX(input), ringDescriptor)
-{}
+    PolyMod(ringDescriptor)
+{
+  *this = input;
+}
 PolyMod::PolyMod(const std::vector<long>& input,
                  const std::shared_ptr<PolyModRing>& ringDescriptor) :
     PolyMod(ringDescriptor)
@@ -45,8 +47,8 @@ PolyMod::PolyMod(const NTL::ZZX& input,
 PolyMod& PolyMod::operator=(long input)
 {
   assertValidity(*this);
-  this->data = NTL::ZZX(input);
-  this->modularReduce();
+  // A constant is already reduced mod G, so only p^r is left
+  this->data = NTL::ZZX(mcMod(input, ringDescriptor->p2r));
   return *this;
 }
 
@@ -30,6 +30,12 @@
 // where t is odd and k is as large as possible
 // and B is a small constant (typically, B in {2,3,4}).
 // If no such prime is found, then an error is raised.
+//
+// The sequence only depends on len and m. The primes found so far for every
+// (len, m) are cached in memory, and in the directory given by
+// setPrimeCacheDirectory() if any (see primeChain.h), so that building the
+// same moduli chain again does not search for them. The candidates are tested
+// in parallel blocks, and all the primes of a block go to the cache.
 
 #ifndef HELIB_PRIME_GENERATOR_H
 #define HELIB_PRIME_GENERATOR_H
@@ -45,6 +51,13 @@ private:
   long m;
   long k;
   long t;
+  long served = 0; // the number of primes returned so far
+
+  // The next candidate 2^k*t*m + 1 with odd t, 0 if there are none left
+  long nextCandidate();
+
+  // Continue the search after the prime q = 2^k*t*m + 1
+  void resumeAfter(long q);
 
 public:
   const static long B = 3;
@@ -73,56 +86,7 @@ public:
     // this ensures the fist call to next will trigger a new k-value
   }
 
-  long next()
-  {
-    // we consider all odd t in the interval
-    // [ (1-1/2^B)*2^len-1)/(2^k*m), (2^len-1)/(2^k*m) ).
-    // For k satisfying 2^{len-B} >= 2^k*m, this interval is
-    // contains at least one integer.
-    // It is equivalent to consider the interval of integers
-    // [t_lower_bound, t_upper_bound),
-    // where t_lower_bound = ceil(((1-1/2^B)*2^len-1)/(2^k*m))
-    // and t_upper_bound = ceil((2^len-1)/(2^k*m)).
-
-    long t_upper_bound = divc((1L << len) - 1, m << k);
-
-    for (;;) {
-
-      t++;
-
-      if (t >= t_upper_bound) {
-        // move to smaller value of k, reset t and t_upper_bound
-
-        k--;
-
-        long k_lower_bound = (m % 2 == 0) ? 0 : 1;
-
-        // we run k down to 0  if m is even, and down to 1
-        // if m is odd.
-
-        if (k < k_lower_bound)
-          throw RuntimeError("Prime generator ran out of primes");
-
-        t = divc((1L << len) - (1L << (len - B)) - 1, m << k);
-        t_upper_bound = divc((1L << len) - 1, m << k);
-      }
-
-      if (t % 2 == 0)
-        continue; // we only want to consider odd t
-
-      long cand = ((t * m) << k) + 1; // = 2^k*t*m + 1
-
-      // double check that cand is in the prescribed interval
-      assertInRange(cand,
-                    (1L << len) - (1L << (len - B)),
-                    1L << len,
-                    "Candidate cand is not in the prescribed interval");
-
-      if (NTL::ProbPrime(cand, 60))
-        return cand;
-      // iteration count == 60 implies 2^{-120} error probability
-    }
-  }
+  long next();
 };
 
 } // namespace helib
@@ -13,6 +13,7 @@
 #include <random>
 #include <helib/Ptxt.h>
 #include <helib/apiAttributes.h>
+#include <helib/opCounters.h>
 
 #include "io.h"
 
@@ -21,10 +22,50 @@ namespace helib {
 template <>
 PolyMod Ptxt<BGV>::convertToSlot(const Context& context, long slot)
 {
-  PolyMod data(NTL::ZZX(slot), context.getSlotRing());
+  PolyMod data(slot, context.getSlotRing());
   return data;
 }
 
+// For d = 1 the slots of a Ptxt<BGV> are integers mod p^r. The slot
+// arithmetic below then works on contiguous longs, instead of on a ZZX per
+// PolyMod reduced in a ZZ_p context of its own. For d > 1 the PolyMods are
+// independent and are processed in parallel.
+
+static bool packedSlots(const Context& context)
+{
+  return context.getOrdP() == 1;
+}
+
+static std::vector<long> packSlots(const std::vector<PolyMod>& slots, long p2r)
+{
+  std::vector<long> packed(slots.size());
+  for (std::size_t i = 0; i < slots.size(); i++)
+    packed[i] = mcMod(static_cast<long>(slots[i]), p2r);
+  return packed;
+}
+
+static void unpackSlots(std::vector<PolyMod>& slots,
+                        const std::vector<long>& packed)
+{
+  for (std::size_t i = 0; i < slots.size(); i++)
+    slots[i] = packed[i];
+}
+
+// Calls f(i) for every slot index i, in parallel for BGV
+template <typename Scheme, typename F>
+static void forEachSlot(long n, F f)
+{
+  if constexpr (std::is_same_v<Scheme, BGV>) {
+    HELIB_EXEC_RANGE(n, first, last)
+    for (long i : range(first, last))
+      f(i);
+    HELIB_EXEC_RANGE_END
+  } else {
+    for (long i : range(n))
+      f(i);
+  }
+}
+
 template <>
 std::complex<double> Ptxt<CKKS>::convertToSlot(const Context&, long slot)
 {
@@ -355,9 +396,20 @@ Ptxt<Scheme>& Ptxt<Scheme>::operator*=(const Ptxt<Scheme>& otherPtxt)
   assertEq<LogicError>(*context,
                        *(otherPtxt.context),
                        "Ptxts must have matching contexts");
-  for (unsigned i = 0; i < this->slots.size(); i++) {
-    this->slots[i] *= otherPtxt.slots[i];
+  if constexpr (std::is_same_v<Scheme, BGV>) {
+    if (packedSlots(*context)) {
+      long p2r = context->getSlotRing()->p2r;
+      NTL::mulmod_t p2rInv = NTL::PrepMulMod(p2r);
+      std::vector<long> a = packSlots(slots, p2r);
+      std::vector<long> b = packSlots(otherPtxt.slots, p2r);
+      for (std::size_t i = 0; i < a.size(); i++)
+        a[i] = NTL::MulMod(a[i], b[i], p2r, p2rInv);
+      unpackSlots(slots, a);
+      return *this;
+    }
   }
+  forEachSlot<Scheme>(lsize(),
+                      [&](long i) { slots[i] *= otherPtxt.slots[i]; });
   return *this;
 }
 
@@ -490,8 +542,23 @@ Ptxt<Scheme>& Ptxt<Scheme>::multiplyBy2(const Ptxt& otherPtxt1,
                          otherPtxt2.size(),
                          "Cannot multiply by plaintext of different size - "
                          "second argument has wrong size");
-  for (std::size_t i = 0; i < size(); ++i)
+  if constexpr (std::is_same_v<Scheme, BGV>) {
+    if (packedSlots(*context)) {
+      long p2r = context->getSlotRing()->p2r;
+      NTL::mulmod_t p2rInv = NTL::PrepMulMod(p2r);
+      std::vector<long> a = packSlots(slots, p2r);
+      std::vector<long> b = packSlots(otherPtxt1.slots, p2r);
+      std::vector<long> c = packSlots(otherPtxt2.slots, p2r);
+      for (std::size_t i = 0; i < a.size(); i++)
+        a[i] = NTL::MulMod(a[i], NTL::MulMod(b[i], c[i], p2r, p2rInv),
+                           p2r, p2rInv);
+      unpackSlots(slots, a);
+      return *this;
+    }
+  }
+  forEachSlot<Scheme>(lsize(), [&](long i) {
     slots[i] *= otherPtxt1.slots[i] * otherPtxt2.slots[i];
+  });
 
   return *this;
 }
@@ -521,6 +588,29 @@ Ptxt<Scheme>& Ptxt<Scheme>::power(long e)
     throw InvalidArgument("Cannot raise a Ptxt to a non positive "
                           "exponent");
   } else if (e > 1) {
+    if constexpr (std::is_same_v<Scheme, BGV>) {
+      if (packedSlots(*context)) {
+        long p2r = context->getSlotRing()->p2r;
+        std::vector<long> a = packSlots(slots, p2r);
+        for (long& x : a)
+          x = NTL::PowerMod(x, e, p2r);
+        unpackSlots(slots, a);
+        return *this;
+      }
+      // exponentiation through squaring, slot by slot
+      forEachSlot<Scheme>(lsize(), [&](long i) {
+        SlotType multiplier(slots[i]);
+        SlotType result = Ptxt<Scheme>::convertToSlot(*context, 1l);
+        for (long f = e; f; f >>= 1u) {
+          if (f & 1u)
+            result *= multiplier;
+          if (f > 1)
+            multiplier *= multiplier;
+        }
+        slots[i] = std::move(result);
+      });
+      return *this;
+    }
     // exponentiation through squaring.
     std::vector<SlotType> multiplier(slots);
     std::vector<SlotType> result(
@@ -549,7 +639,7 @@ Ptxt<Scheme>& Ptxt<Scheme>::rotate(long amount)
     return *this;
   std::vector<SlotType> rotated_slots(size());
   for (long i = 0; i < lsize(); ++i) {
-    rotated_slots[i] = slots[mcMod(i - amount, size())];
+    rotated_slots[i] = std::move(slots[mcMod(i - amount, size())]);
   }
   slots = std::move(rotated_slots);
   return *this;
@@ -592,7 +682,7 @@ Ptxt<Scheme>& Ptxt<Scheme>::rotate1D(long dim, long amount)
     // Convert the new coordinates post rotation into the correct index.
     long new_index = coordToIndex(coord);
     // Set the new index of the current slot.
-    new_slots[new_index] = slots[index];
+    new_slots[new_index] = std::move(slots[index]);
   }
   slots = std::move(new_slots);
   return *this;
@@ -827,9 +917,21 @@ Ptxt<Scheme>& Ptxt<Scheme>::mapTo01()
 {
   assertTrue<RuntimeError>(isValid(),
                            "Cannot call mapTo01 on default-constructed Ptxt");
-  for (auto& slot : slots)
-    if (slot != Ptxt<Scheme>::convertToSlot(*context, 0l))
-      slot = 1;
+  if constexpr (std::is_same_v<Scheme, BGV>) {
+    if (packedSlots(*context)) {
+      long p2r = context->getSlotRing()->p2r;
+      std::vector<long> a = packSlots(slots, p2r);
+      for (long& x : a)
+        x = (x != 0);
+      unpackSlots(slots, a);
+      return *this;
+    }
+  }
+  const SlotType zero = Ptxt<Scheme>::convertToSlot(*context, 0l);
+  forEachSlot<Scheme>(lsize(), [&](long i) {
+    if (slots[i] != zero)
+      slots[i] = 1;
+  });
   return *this;
 }
 
@@ -0,0 +1,246 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include <helib/ResidueArena.h>
+#include <helib/memoryStats.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#define HELIB_HUGE_PAGES
+#endif
+
+namespace helib {
+
+namespace {
+
+thread_local ResidueArena* currentArena = nullptr;
+
+// The cache of the calling thread in the arena with the given id. An arena
+// may be destroyed while threads still point to its cache, so the pointer is
+// valid only if the id matches
+struct ThreadCacheRef
+{
+  long id = -1;
+  void* cache = nullptr;
+};
+
+thread_local ThreadCacheRef threadCacheRef;
+
+HELIB_atomic_long nextArenaId(0);
+
+long* systemAllocate(long n)
+{
+  long* p = static_cast<long*>(allocateResidueStorage(n * sizeof(long)));
+  countResidueBytes(n * sizeof(long));
+  return p;
+}
+
+void systemRelease(long* p, long n)
+{
+  releaseResidueStorage(p, n * sizeof(long));
+  countResidueBytes(-long(n * sizeof(long)));
+}
+
+std::atomic<HugePageMode> hugePageMode(HugePageMode::NONE);
+
+#ifdef HELIB_HUGE_PAGES
+// How a block on huge pages was allocated, so that it is freed the same way
+// whatever the mode is by then
+enum class HugeBlock
+{
+  MAPPED,  // from the pool, by mmap
+  ADVISED, // by posix_memalign, with MADV_HUGEPAGE
+};
+
+std::mutex hugeBlocksMx;
+std::unordered_map<void*, HugeBlock> hugeBlocks;
+std::atomic<long> hugeBlockCount(0);
+
+std::size_t roundToHugePages(std::size_t bytes)
+{
+  return (bytes + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES * HUGE_PAGE_BYTES;
+}
+
+// A block of bytes on huge pages, nullptr if there is none to be had
+void* hugeAllocate(std::size_t bytes, HugePageMode mode)
+{
+  std::size_t rounded = roundToHugePages(bytes);
+  void* p = nullptr;
+  HugeBlock kind = HugeBlock::MAPPED;
+  if (mode == HugePageMode::EXPLICIT) {
+    p = mmap(nullptr,
+             rounded,
+             PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+             -1,
+             0);
+    if (p == MAP_FAILED)
+      p = nullptr;
+  }
+  if (p == nullptr) {
+    kind = HugeBlock::ADVISED;
+    if (posix_memalign(&p, HUGE_PAGE_BYTES, rounded) != 0)
+      return nullptr;
+    // Only a hint, the block is fine on small pages too
+    madvise(p, rounded, MADV_HUGEPAGE);
+  }
+  std::lock_guard<std::mutex> lock(hugeBlocksMx);
+  hugeBlocks.emplace(p, kind);
+  hugeBlockCount++;
+  return p;
+}
+
+// Free p if it is on huge pages
+bool hugeRelease(void* p, std::size_t bytes)
+{
+  if (hugeBlockCount.load() == 0)
+    return false;
+  HugeBlock kind;
+  {
+    std::lock_guard<std::mutex> lock(hugeBlocksMx);
+    auto it = hugeBlocks.find(p);
+    if (it == hugeBlocks.end())
+      return false;
+    kind = it->second;
+    hugeBlocks.erase(it);
+    hugeBlockCount--;
+  }
+  if (kind == HugeBlock::MAPPED)
+    munmap(p, roundToHugePages(bytes));
+  else
+    std::free(p);
+  return true;
+}
+#endif
+
+} // namespace
+
+bool setHugePageMode(HugePageMode mode)
+{
+#ifdef HELIB_HUGE_PAGES
+  hugePageMode = mode;
+  return true;
+#else
+  return mode == HugePageMode::NONE;
+#endif
+}
+
+HugePageMode getHugePageMode() { return hugePageMode; }
+
+void* allocateResidueStorage(std::size_t bytes)
+{
+#ifdef HELIB_HUGE_PAGES
+  HugePageMode mode = hugePageMode;
+  if (mode != HugePageMode::NONE && bytes >= HUGE_PAGE_BYTES)
+    if (void* p = hugeAllocate(bytes, mode))
+      return p;
+#endif
+  return ::operator new(bytes, std::align_val_t(ResidueArena::ALIGNMENT));
+}
+
+void releaseResidueStorage(void* p, std::size_t bytes)
+{
+  if (p == nullptr)
+    return;
+#ifdef HELIB_HUGE_PAGES
+  if (hugeRelease(p, bytes))
+    return;
+#else
+  (void)bytes;
+#endif
+  ::operator delete(p, std::align_val_t(ResidueArena::ALIGNMENT));
+}
+
+ResidueArena::ResidueArena(long maxCachedBytes) :
+    parent(currentArena),
+    id(nextArenaId++),
+    maxCachedBytes(maxCachedBytes),
+    allocated(0),
+    reused(0)
+{
+  currentArena = this;
+}
+
+ResidueArena::~ResidueArena()
+{
+  currentArena = parent;
+  for (const auto& cache : caches)
+    for (const auto& entry : cache->blocks)
+      for (long* p : entry.second)
+        systemRelease(p, entry.first);
+}
+
+ResidueArena* ResidueArena::current() { return currentArena; }
+
+ResidueArena::Adopt::Adopt(ResidueArena* arena) : previous(currentArena)
+{
+  currentArena = arena;
+}
+
+ResidueArena::Adopt::~Adopt() { currentArena = previous; }
+
+ResidueArena::Cache& ResidueArena::threadCache()
+{
+  ThreadCacheRef& ref = threadCacheRef;
+  if (ref.id != id) {
+    std::unique_ptr<Cache> cache(new Cache);
+    ref.cache = cache.get();
+    ref.id = id;
+    HELIB_MUTEX_GUARD(mx);
+    caches.push_back(std::move(cache));
+  }
+  return *static_cast<Cache*>(ref.cache);
+}
+
+long* ResidueArena::allocate(long n)
+{
+  if (n == 0)
+    return nullptr;
+
+  ResidueArena* arena = currentArena;
+  if (arena != nullptr) {
+    Cache& cache = arena->threadCache();
+    auto it = cache.blocks.find(n);
+    if (it != cache.blocks.end() && !it->second.empty()) {
+      long* p = it->second.back();
+      it->second.pop_back();
+      cache.bytes -= n * sizeof(long);
+      arena->reused++;
+      return p;
+    }
+    arena->allocated++;
+  }
+  return systemAllocate(n);
+}
+
+void ResidueArena::release(long* p, long n)
+{
+  if (p == nullptr)
+    return;
+
+  ResidueArena* arena = currentArena;
+  if (arena != nullptr) {
+    Cache& cache = arena->threadCache();
+    long bytes = n * sizeof(long);
+    if (cache.bytes + bytes <= arena->maxCachedBytes) {
+      cache.blocks[n].push_back(p);
+      cache.bytes += bytes;
+      return;
+    }
+  }
+  systemRelease(p, n);
+}
+
+} // namespace helib
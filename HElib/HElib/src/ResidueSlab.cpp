@@ -0,0 +1,205 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <utility>
+
+#include <helib/ResidueSlab.h>
+
+namespace helib {
+
+ResidueSlab::ResidueSlab(long rowLen) : rowLen(rowLen), data(nullptr)
+{
+  assertTrue<InvalidArgument>(rowLen >= 0, "Negative row length");
+  const long perLine = ALIGNMENT / sizeof(long);
+  stride = (rowLen + perLine - 1) / perLine * perLine;
+}
+
+static_assert(sizeof(std::atomic<long>) <= ResidueSlab::ALIGNMENT,
+              "The reference count does not fit in the block header");
+
+long* ResidueSlab::allocateBlock(long n)
+{
+  if (n == 0)
+    return nullptr;
+  long* block = ResidueArena::allocate(n + HEADER);
+  new (block) std::atomic<long>(1);
+  return block + HEADER;
+}
+
+void ResidueSlab::releaseBlock()
+{
+  if (data == nullptr)
+    return;
+  // The last owner frees the block, after all the others are done with it
+  if (refs().fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    ResidueArena::release(data - HEADER, indexSet.card() * stride + HEADER);
+  }
+  data = nullptr;
+}
+
+ResidueSlab::ResidueSlab(const ResidueSlab& other) :
+    indexSet(other.indexSet),
+    rowLen(other.rowLen),
+    stride(other.stride),
+    data(other.data),
+    offsets(other.offsets)
+{
+  if (data != nullptr)
+    refs().fetch_add(1, std::memory_order_relaxed);
+}
+
+ResidueSlab::ResidueSlab(ResidueSlab&& other) noexcept :
+    indexSet(std::move(other.indexSet)),
+    rowLen(other.rowLen),
+    stride(other.stride),
+    data(other.data),
+    offsets(std::move(other.offsets))
+{
+  other.data = nullptr;
+  other.indexSet.clear();
+  other.offsets.clear();
+}
+
+ResidueSlab& ResidueSlab::operator=(const ResidueSlab& other)
+{
+  if (this == &other)
+    return *this;
+  assertEq(rowLen,
+           other.rowLen,
+           "Cannot assign slabs of different row length");
+
+  if (other.data != nullptr)
+    other.refs().fetch_add(1, std::memory_order_relaxed);
+  releaseBlock();
+  indexSet = other.indexSet;
+  offsets = other.offsets;
+  data = other.data;
+  return *this;
+}
+
+ResidueSlab& ResidueSlab::operator=(ResidueSlab&& other) noexcept
+{
+  if (this == &other)
+    return *this;
+  releaseBlock();
+  indexSet = std::move(other.indexSet);
+  rowLen = other.rowLen;
+  stride = other.stride;
+  data = other.data;
+  offsets = std::move(other.offsets);
+  other.data = nullptr;
+  other.indexSet.clear();
+  other.offsets.clear();
+  return *this;
+}
+
+ResidueSlab::~ResidueSlab() { releaseBlock(); }
+
+// Allocate a slab for the index set s, copy into it the rows that are in
+// both s and the current index set, and zero the others. The old block is
+// only read, so it may be shared.
+void ResidueSlab::relayout(const IndexSet& s)
+{
+  long n = s.card() * stride;
+  long* newData = allocateBlock(n);
+  std::vector<long> newOffsets(empty(s) ? 0 : s.last() + 1, -1);
+
+  long pos = 0;
+  for (long j : s) {
+    newOffsets[j] = pos;
+    if (indexSet.contains(j))
+      std::memcpy(newData + pos, data + offsets[j], stride * sizeof(long));
+    else
+      std::memset(newData + pos, 0, stride * sizeof(long));
+    pos += stride;
+  }
+
+  releaseBlock();
+  data = newData;
+  indexSet = s;
+  offsets.swap(newOffsets);
+}
+
+void ResidueSlab::unshare()
+{
+  long n = indexSet.card() * stride;
+  long* newData = allocateBlock(n);
+  std::memcpy(newData, data, n * sizeof(long));
+  releaseBlock();
+  data = newData;
+}
+
+void ResidueSlab::insert(const IndexSet& s)
+{
+  if (s <= indexSet)
+    return;
+  relayout(indexSet | s);
+}
+
+void ResidueSlab::remove(const IndexSet& s)
+{
+  if (empty(s & indexSet))
+    return;
+  relayout(indexSet / s);
+}
+
+void ResidueSlab::setIndexSet(const IndexSet& s)
+{
+  if (s == indexSet)
+    makeUnique();
+  else
+    relayout(s);
+}
+
+void ResidueSlab::clear()
+{
+  releaseBlock();
+  indexSet.clear();
+  offsets.clear();
+}
+
+void ResidueSlab::attach(long* rows, const IndexSet& s)
+{
+  assertEq<InvalidArgument>(
+      long(reinterpret_cast<std::uintptr_t>(rows) % ALIGNMENT),
+      0l,
+      "The rows of a slab must be aligned");
+  assertTrue<InvalidArgument>(refs(rows).load() >= 1,
+                              "The owner does not hold the attached rows");
+
+  releaseBlock();
+  data = rows;
+  refs().fetch_add(1, std::memory_order_relaxed);
+  indexSet = s;
+  offsets.assign(empty(s) ? 0 : s.last() + 1, -1);
+  long pos = 0;
+  for (long j : s) {
+    offsets[j] = pos;
+    pos += stride;
+  }
+}
+
+bool ResidueSlab::operator==(const ResidueSlab& other) const
+{
+  if (rowLen != other.rowLen || indexSet != other.indexSet)
+    return false;
+  if (data == other.data)
+    return true;
+  for (long j : indexSet)
+    if (std::memcmp((*this)[j], other[j], rowLen * sizeof(long)) != 0)
+      return false;
+  return true;
+}
+
+} // namespace helib
@@ -0,0 +1,196 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+#include <helib/asyncEval.h>
+
+#include <algorithm>
+
+#ifdef HELIB_THREADS
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#endif
+
+#include <helib/assertions.h>
+#include <helib/keys.h>
+
+namespace helib {
+
+#ifdef HELIB_THREADS
+
+namespace {
+
+struct Entry
+{
+  long priority;
+  long sequence;
+  std::function<void()> run;
+  std::function<void()> cancel;
+  CancelToken token;
+};
+
+// The heap order: the highest priority, then the oldest, on top
+bool startsLater(const Entry& a, const Entry& b)
+{
+  if (a.priority != b.priority)
+    return a.priority < b.priority;
+  return a.sequence > b.sequence;
+}
+
+} // namespace
+
+struct AsyncEvaluator::State
+{
+  mutable std::mutex mx;
+  std::condition_variable changed;
+  std::vector<Entry> queue; // a heap ordered by startsLater
+  long sequence = 0;
+  long active = 0;
+  bool stopping = false;
+  std::vector<std::thread> runners;
+
+  void runLoop()
+  {
+    std::unique_lock<std::mutex> lock(mx);
+    for (;;) {
+      changed.wait(lock, [this]() { return stopping || !queue.empty(); });
+      if (queue.empty())
+        return;
+      std::pop_heap(queue.begin(), queue.end(), startsLater);
+      Entry entry = std::move(queue.back());
+      queue.pop_back();
+      bool cancelled = entry.token.cancelled();
+      if (!cancelled)
+        active++;
+      lock.unlock();
+      if (cancelled)
+        entry.cancel();
+      else
+        entry.run();
+      // Release what the evaluation captured before taking the lock again
+      entry = Entry();
+      lock.lock();
+      if (!cancelled)
+        active--;
+    }
+  }
+};
+
+AsyncEvaluator::AsyncEvaluator(long maxConcurrent) :
+    width(maxConcurrent), state(std::make_unique<State>())
+{
+  assertTrue<InvalidArgument>(maxConcurrent >= 1,
+                              "AsyncEvaluator: maxConcurrent must be positive");
+}
+
+AsyncEvaluator::~AsyncEvaluator()
+{
+  {
+    std::lock_guard<std::mutex> lock(state->mx);
+    state->stopping = true;
+  }
+  state->changed.notify_all();
+  for (std::thread& runner : state->runners)
+    runner.join();
+}
+
+void AsyncEvaluator::enqueue(std::function<void()> run,
+                             std::function<void()> cancel,
+                             long priority,
+                             const CancelToken& token)
+{
+  std::lock_guard<std::mutex> lock(state->mx);
+  state->queue.push_back(Entry{priority,
+                               state->sequence++,
+                               std::move(run),
+                               std::move(cancel),
+                               token});
+  std::push_heap(state->queue.begin(), state->queue.end(), startsLater);
+  // Runners start as the load grows, and then wait for more
+  long busy = state->active + long(state->queue.size());
+  if (long(state->runners.size()) < std::min(width, busy))
+    state->runners.emplace_back([this]() { state->runLoop(); });
+  state->changed.notify_one();
+}
+
+long AsyncEvaluator::pending() const
+{
+  std::lock_guard<std::mutex> lock(state->mx);
+  return state->queue.size();
+}
+
+long AsyncEvaluator::running() const
+{
+  std::lock_guard<std::mutex> lock(state->mx);
+  return state->active;
+}
+
+#else
+
+struct AsyncEvaluator::State
+{};
+
+AsyncEvaluator::AsyncEvaluator(long maxConcurrent) : width(maxConcurrent)
+{
+  assertTrue<InvalidArgument>(maxConcurrent >= 1,
+                              "AsyncEvaluator: maxConcurrent must be positive");
+}
+
+AsyncEvaluator::~AsyncEvaluator() = default;
+
+void AsyncEvaluator::enqueue(std::function<void()> run,
+                             std::function<void()> cancel,
+                             long,
+                             const CancelToken& token)
+{
+  if (token.cancelled())
+    cancel();
+  else
+    run();
+}
+
+long AsyncEvaluator::pending() const { return 0; }
+
+long AsyncEvaluator::running() const { return 0; }
+
+#endif // ifdef HELIB_THREADS
+
+std::future<Ctxt> AsyncEvaluator::thinReCryptAsync(const PubKey& key,
+                                                   Ctxt ctxt,
+                                                   long priority,
+                                                   CancelToken token)
+{
+  return submit(
+      [&key, ctxt]() mutable {
+        key.thinReCrypt(ctxt);
+        return ctxt;
+      },
+      priority,
+      token);
+}
+
+std::future<Ctxt> AsyncEvaluator::reCryptAsync(const PubKey& key,
+                                               Ctxt ctxt,
+                                               long priority,
+                                               CancelToken token)
+{
+  return submit(
+      [&key, ctxt]() mutable {
+        key.reCrypt(ctxt);
+        return ctxt;
+      },
+      priority,
+      token);
+}
+
+} // namespace helib
@@ -0,0 +1,353 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <NTL/BasicThreadPool.h>
+#include <helib/automorphPrecon.h>
+#include <helib/matmul.h>
+#include <helib/opCounters.h>
+#include <helib/fhe_stats.h>
+#include <helib/keySetOptimizer.h>
+#include <helib/log.h>
+
+namespace helib {
+
+BasicAutomorphPrecon::BasicAutomorphPrecon(const Ctxt& _ctxt) :
+    ctxt(_ctxt), noise(1.0)
+{
+  HELIB_TIMER_START;
+  if (ctxt.parts.size() >= 1)
+    assertTrue(
+        ctxt.parts[0].skHandle.isOne(),
+        "Invalid ciphertext (secret key handle for part 0 is not one)");
+  if (ctxt.parts.size() <= 1)
+    return; // nothing to do
+
+  ctxt.cleanUp();
+  const Context& context = ctxt.getContext();
+  const PubKey& pubKey = ctxt.getPubKey();
+  long keyID = ctxt.getKeyID();
+
+  // The call to cleanUp() should ensure that this assertion passes.
+  assertTrue(ctxt.inCanonicalForm(keyID),
+             "Ciphertext is not in canonical form");
+
+  ctxt.relin_CKKS_adjust();
+
+  // Compute the number of digits that we need and the estimated
+  // added noise from switching this ciphertext.
+
+  NTL::xdouble addedNoise = ctxt.parts[1].breakIntoDigits(polyDigits);
+  NTL::xdouble max_ks_noise(0.0);
+  for (const KeySwitch& ks : pubKey.keySWlist()) {
+    if (max_ks_noise < ks.noiseBound)
+      max_ks_noise = ks.noiseBound;
+  }
+  addedNoise *= max_ks_noise;
+
+  double logProd = context.logOfProduct(context.getSpecialPrimes());
+  noise = ctxt.getNoiseBound() * NTL::xexp(logProd);
+
+  double ratio = NTL::conv<double>(addedNoise / noise);
+
+  HELIB_STATS_UPDATE("KS-noise-ratio-hoist", ratio);
+  if (ratio > 1) {
+    Warning("KS-noise-ratio-hoist=" + std::to_string(ratio));
+  }
+  // std::stderr << "*** HOIST INIT\n";
+  // fprintf(stderr, "   KS-log-noise-ratio-hoist: %f\n",
+  // log(addedNoise/noise)/log(2.0));
+
+  noise += addedNoise;
+}
+
+std::shared_ptr<Ctxt> BasicAutomorphPrecon::automorph(long k) const
+{
+  HELIB_TIMER_START;
+
+  // A hack: record this automorphism rather than actually performing it
+  if (isSetAutomorphVals()) { // defined in NumbTh.h
+    recordAutomorphVal(k);
+    return std::make_shared<Ctxt>(ctxt);
+  }
+
+  if (k == 1 || ctxt.isEmpty())
+    return std::make_shared<Ctxt>(ctxt); // nothing to do
+  countOp(OpType::Automorphism, 1, ctxt.getPrimeSet().card());
+
+  const Context& context = ctxt.getContext();
+  AutomorphismProfile::record(k, context.getM());
+  const PubKey& pubKey = ctxt.getPubKey();
+
+  // empty ctxt
+  std::shared_ptr<Ctxt> result = std::make_shared<Ctxt>(ZeroCtxtLike, ctxt);
+  result->noiseBound = noise; // noise estimate
+  result->intFactor = ctxt.intFactor;
+
+  result->primeSet = ctxt.primeSet | context.getSpecialPrimes();
+  // VJS-NOTE: added this to make addPart work
+
+  if (ctxt.isCKKS()) {
+    result->ptxtMag = ctxt.ptxtMag;
+    double logProd = context.logOfProduct(context.getSpecialPrimes());
+    result->ratFactor = ctxt.ratFactor * NTL::xexp(logProd);
+  }
+
+  if (ctxt.parts.size() == 1) { // only constant part, no need to key-switch
+    CtxtPart tmpPart = ctxt.parts[0];
+    tmpPart.automorph(k);
+    tmpPart.addPrimesAndScale(context.getSpecialPrimes());
+    result->addPart(tmpPart, /*matchPrimeSet=*/true);
+    return result;
+  }
+
+  // Ensure that we have a key-switching matrices for this automorphism
+  long keyID = ctxt.getKeyID();
+  if (!pubKey.isReachable(k, keyID)) {
+    throw LogicError("no key-switching matrices for k=" + std::to_string(k) +
+                     ", keyID=" + std::to_string(keyID));
+  }
+
+  // Get the first key-switching matrix for this automorphism
+  const KeySwitch& W = pubKey.getNextKSWmatrix(k, keyID);
+  long amt = W.fromKey.getPowerOfX();
+
+  // Start by rotating the constant part, no need to key-switch it
+  CtxtPart tmpPart = ctxt.parts[0];
+  tmpPart.automorph(amt);
+  tmpPart.addPrimesAndScale(context.getSpecialPrimes());
+  result->addPart(tmpPart, /*matchPrimeSet=*/true);
+
+  // Then rotate the digits and key-switch them
+  std::vector<DoubleCRT> tmpDigits = polyDigits;
+  for (auto&& tmp : tmpDigits) // rotate each of the digits
+    tmp.automorph(amt);
+
+  result->keySwitchDigits(W, tmpDigits); // key-switch the digits
+
+  long m = context.getM();
+  if ((amt - k) % m != 0) { // amt != k (mod m), more automorphisms to do
+    k = NTL::MulMod(k, NTL::InvMod(amt, m), m); // k *= amt^{-1} mod m
+    AutomorphismProfile::Suspend suspend;       // k is already recorded
+    result->smartAutomorph(k);                  // call usual smartAutomorph
+  }
+  return result;
+}
+
+std::vector<Ctxt> BasicAutomorphPrecon::automorph(
+    const std::vector<long>& ks) const
+{
+  long n = ks.size();
+  std::vector<Ctxt> result(n, Ctxt(ZeroCtxtLike, ctxt));
+
+  // Recording the automorphisms (see NumbTh.h) is not thread-safe
+  if (isSetAutomorphVals()) {
+    for (long i : range(n))
+      result[i] = *automorph(ks[i]);
+    return result;
+  }
+
+  HELIB_EXEC_RANGE(n, first, last)
+  for (long i : range(first, last))
+    result[i] = *automorph(ks[i]);
+  HELIB_EXEC_RANGE_END
+  return result;
+}
+
+std::vector<Ctxt> GeneralAutomorphPrecon::automorphAll(long n,
+                                                       bool clean) const
+{
+  std::vector<Ctxt> result;
+  if (n <= 0)
+    return result;
+  std::shared_ptr<Ctxt> r0 = automorph(0);
+  if (clean)
+    r0->cleanUp();
+  result.resize(n, *r0);
+
+  if (isSetAutomorphVals()) {
+    for (long i : range(1, n)) {
+      result[i] = *automorph(i);
+      if (clean)
+        result[i].cleanUp();
+    }
+    return result;
+  }
+
+  HELIB_EXEC_RANGE(n - 1, first, last)
+  for (long i : range(first + 1, last + 1)) {
+    result[i] = *automorph(i);
+    if (clean)
+      result[i].cleanUp();
+  }
+  HELIB_EXEC_RANGE_END
+  return result;
+}
+
+class GeneralAutomorphPrecon_UNKNOWN : public GeneralAutomorphPrecon
+{
+private:
+  Ctxt ctxt;
+  long dim;
+  const PAlgebra& zMStar;
+
+public:
+  GeneralAutomorphPrecon_UNKNOWN(const Ctxt& _ctxt,
+                                 long _dim,
+                                 const EncryptedArray& ea) :
+      ctxt(_ctxt), dim(_dim), zMStar(ea.getPAlgebra())
+  {
+    ctxt.cleanUp();
+  }
+
+  std::shared_ptr<Ctxt> automorph(long i) const override
+  {
+    std::shared_ptr<Ctxt> result = std::make_shared<Ctxt>(ctxt);
+
+    // guard against i == 0, as dim may be #gens
+    if (i != 0)
+      result->smartAutomorph(zMStar.genToPow(dim, i));
+
+    return result;
+  }
+};
+
+class GeneralAutomorphPrecon_FULL : public GeneralAutomorphPrecon
+{
+private:
+  BasicAutomorphPrecon precon;
+  long dim;
+  const PAlgebra& zMStar;
+
+public:
+  GeneralAutomorphPrecon_FULL(const Ctxt& _ctxt,
+                              long _dim,
+                              const EncryptedArray& ea) :
+      precon(_ctxt), dim(_dim), zMStar(ea.getPAlgebra())
+  {}
+
+  std::shared_ptr<Ctxt> automorph(long i) const override
+  {
+    return precon.automorph(zMStar.genToPow(dim, i));
+  }
+};
+
+class GeneralAutomorphPrecon_BSGS : public GeneralAutomorphPrecon
+{
+private:
+  long dim;
+  const PAlgebra& zMStar;
+
+  long D;
+  long g;
+  long h;
+  std::vector<std::shared_ptr<BasicAutomorphPrecon>> precon;
+
+public:
+  GeneralAutomorphPrecon_BSGS(const Ctxt& _ctxt,
+                              long _dim,
+                              const EncryptedArray& ea) :
+      dim(_dim), zMStar(ea.getPAlgebra())
+  {
+    D = (dim == -1) ? zMStar.getOrdP() : zMStar.OrderOf(dim);
+    g = KSGiantStepSize(D);
+    h = divc(D, g);
+
+    BasicAutomorphPrecon precon0(_ctxt);
+    precon.resize(h);
+
+    // parallel for k in [0..h)
+    HELIB_EXEC_RANGE(h, first, last)
+    for (long k = first; k < last; k++) {
+      std::shared_ptr<Ctxt> p = precon0.automorph(zMStar.genToPow(dim, g * k));
+      precon[k] = std::make_shared<BasicAutomorphPrecon>(*p);
+    }
+    HELIB_EXEC_RANGE_END
+  }
+
+  std::shared_ptr<Ctxt> automorph(long i) const override
+  {
+    assertInRange(i, 0l, D, "Automorphism index i is not in [0, D)");
+    long j = i % g;
+    long k = i / g;
+    // i == j + g*k
+    return precon[k]->automorph(zMStar.genToPow(dim, j));
+  }
+};
+
+std::shared_ptr<GeneralAutomorphPrecon> buildGeneralAutomorphPrecon(
+    const Ctxt& ctxt,
+    long dim,
+    const EncryptedArray& ea)
+{
+  // allow dim == -1 (Frobenius)
+  // allow dim == #gens (the dummy generator of order 1)
+  assertInRange(dim,
+                -1l,
+                ea.dimension(),
+                "Dimension dim is not in [-1, ea.dimension()] (-1 Frobenius)",
+                true);
+
+  if (fhe_test_force_hoist >= 0) {
+    switch (ctxt.getPubKey().getKSStrategy(dim)) {
+    case HELIB_KSS_BSGS:
+      return std::make_shared<GeneralAutomorphPrecon_BSGS>(ctxt, dim, ea);
+
+    case HELIB_KSS_FULL:
+      return std::make_shared<GeneralAutomorphPrecon_FULL>(ctxt, dim, ea);
+
+    default:
+      return std::make_shared<GeneralAutomorphPrecon_UNKNOWN>(ctxt, dim, ea);
+    }
+  } else {
+    return std::make_shared<GeneralAutomorphPrecon_UNKNOWN>(ctxt, dim, ea);
+  }
+}
+
+std::vector<Ctxt> frobeniusImages(const Ctxt& ctxt, long d)
+{
+  return buildGeneralAutomorphPrecon(ctxt, -1, ctxt.getContext().getEA())
+      ->automorphAll(d, /*clean=*/true);
+}
+
+void frobeniusCombinations(const PtrVector<Ctxt>& out,
+                           const Ctxt& ctxt,
+                           const std::vector<const DoubleCRT*>& constants,
+                           const std::vector<double>& sizes)
+{
+  HELIB_TIMER_START;
+  long d = constants.size();
+  long n = out.size();
+  assertTrue<InvalidArgument>(n <= d, "More outputs than constants");
+  assertEq<InvalidArgument>(long(sizes.size()), d, "One size per constant");
+  if (n == 0)
+    return;
+
+  // NOTE: Why do we apply cleanup after the Frobenius?
+  std::vector<Ctxt> frob = frobeniusImages(ctxt, d);
+  std::vector<const Ctxt*> frobPtrs(d);
+  for (long j = 0; j < d; j++)
+    frobPtrs[j] = &frob[j];
+
+  // The combinations are independent of each other
+  HELIB_EXEC_RANGE(n, first, last)
+  std::vector<const DoubleCRT*> rotated(d);
+  std::vector<double> rotatedSizes(d);
+  for (long i = first; i < last; i++) {
+    for (long j = 0; j < d; j++) {
+      rotated[j] = constants[mcMod(i + j, d)];
+      rotatedSizes[j] = sizes[mcMod(i + j, d)];
+    }
+    linearCombination(*out[i], frobPtrs, rotated, rotatedSizes);
+  }
+  HELIB_EXEC_RANGE_END
+}
+
+} // namespace helib
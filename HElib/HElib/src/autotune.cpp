@@ -0,0 +1,283 @@
+/* Copyright (C) 2021 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <helib/autotune.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <limits>
+#include <vector>
+
+#include <unistd.h>
+
+#include <json.hpp>
+
+#include <helib/assertions.h>
+#include <helib/DoubleCRT.h>
+#include <helib/EncryptedArray.h>
+#include <helib/exceptions.h>
+#include <helib/keySwitching.h>
+#include <helib/keys.h>
+#include <helib/matmul.h>
+#include <helib/multicore.h>
+#include <helib/randomMatrices.h>
+#include <helib/log.h>
+#include <helib/timing.h>
+
+using json = ::nlohmann::json;
+
+namespace helib {
+
+static_assert(HELIB_KEYSWITCH_THRESH == 50,
+              "Update the default TuningProfile::bsgsThreshold");
+
+namespace {
+
+std::string hostName()
+{
+  char name[256] = {0};
+  if (gethostname(name, sizeof(name) - 1) != 0)
+    return "";
+  return name;
+}
+
+// The fastest of a few runs of f, in seconds
+template <typename F>
+double bestTime(F&& f, long runs = 3)
+{
+  double best = std::numeric_limits<double>::infinity();
+  for (long i = 0; i < runs; i++) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    best = std::min(best, elapsed.count());
+  }
+  return best;
+}
+
+// The smallest blocks of the inner products of key switching that are not
+// slower than larger ones
+long measureMinBlock(Context& context)
+{
+  long phim = context.getPhiM();
+  IndexSet primes = context.getCtxtPrimes() | context.getSpecialPrimes();
+  long n = std::max<long>(context.getDigits().size(), 1);
+  // Every operand has its own rows, rather than copies of one shared slab
+  std::vector<DoubleCRT> a, b;
+  a.reserve(n);
+  b.reserve(n);
+  for (long t = 0; t < n; t++) {
+    a.emplace_back(context, primes);
+    a[t].randomizeKeyed(NTL::ZZ(1), 2 * t);
+    b.emplace_back(context, primes);
+    b[t].randomizeKeyed(NTL::ZZ(1), 2 * t + 1);
+  }
+  DoubleCRT sum(context, primes);
+
+  TuningProfile profile = tuningProfile(context);
+  long best = profile.innerProductMinBlock;
+  double bestSeconds = std::numeric_limits<double>::infinity();
+  for (long block = 64; block <= 4096; block *= 2) {
+    profile.innerProductMinBlock = block;
+    context.setTuningProfile(std::make_shared<TuningProfile>(profile));
+    double seconds = bestTime([&] { sum.innerProduct(a, b); });
+    if (seconds < bestSeconds) {
+      best = block;
+      bestSeconds = seconds;
+    }
+    if (block >= phim)
+      break;
+  }
+  return best;
+}
+
+// The largest dimension where the plain strategy of MatMul1DExec is faster
+// than baby-step/giant-step, given the sizes D and whether BSGS was faster
+long bsgsThresholdFrom(const std::vector<std::pair<long, bool>>& runs,
+                       long fallback)
+{
+  long smallestWin = std::numeric_limits<long>::max();
+  long largestLoss = 0;
+  for (const std::pair<long, bool>& run : runs)
+    if (run.second)
+      smallestWin = std::min(smallestWin, run.first);
+    else
+      largestLoss = std::max(largestLoss, run.first);
+  if (smallestWin == std::numeric_limits<long>::max())
+    return std::max(fallback, largestLoss);
+  return std::max(smallestWin - 1, 1l);
+}
+
+} // namespace
+
+TuningProfile TuningProfile::defaults(const Context& context)
+{
+  TuningProfile profile;
+  profile.host = hostName();
+  profile.m = context.getM();
+  profile.p = context.getP();
+  profile.r = context.getR();
+  profile.bits = context.bitSizeOfQ();
+  profile.threads = availableThreads();
+  return profile;
+}
+
+bool TuningProfile::matches(const Context& context) const
+{
+  TuningProfile here = defaults(context);
+  return host == here.host && m == here.m && p == here.p && r == here.r &&
+         bits == here.bits && threads == here.threads;
+}
+
+void TuningProfile::writeTo(std::ostream& str) const
+{
+  const json j = {{"host", host},
+                  {"m", m},
+                  {"p", p},
+                  {"r", r},
+                  {"bits", bits},
+                  {"threads", threads},
+                  {"bsgsThreshold", bsgsThreshold},
+                  {"chenHanThreshold", chenHanThreshold},
+                  {"chenHanThresholdP2", chenHanThresholdP2},
+                  {"innerProductMinBlock", innerProductMinBlock}};
+  str << j.dump(2) << std::endl;
+}
+
+TuningProfile TuningProfile::readFrom(std::istream& str)
+{
+  TuningProfile profile;
+  try {
+    json j;
+    str >> j;
+    profile.host = j.at("host").get<std::string>();
+    profile.m = j.at("m").get<long>();
+    profile.p = j.at("p").get<long>();
+    profile.r = j.at("r").get<long>();
+    profile.bits = j.at("bits").get<long>();
+    profile.threads = j.at("threads").get<long>();
+    profile.bsgsThreshold = j.at("bsgsThreshold").get<long>();
+    profile.chenHanThreshold = j.at("chenHanThreshold").get<double>();
+    profile.chenHanThresholdP2 = j.at("chenHanThresholdP2").get<double>();
+    profile.innerProductMinBlock = j.at("innerProductMinBlock").get<long>();
+  } catch (const json::exception& e) {
+    throw IOError(std::string("Cannot read a tuning profile: ") + e.what());
+  }
+  assertTrue<IOError>(profile.bsgsThreshold > 0 &&
+                          profile.chenHanThreshold > 0 &&
+                          profile.chenHanThresholdP2 > 0 &&
+                          profile.innerProductMinBlock > 0,
+                      "Invalid tuning profile");
+  return profile;
+}
+
+const TuningProfile& tuningProfile(const Context& context)
+{
+  static const TuningProfile builtIn;
+  const TuningProfile* profile = context.getTuningProfile();
+  return profile != nullptr ? *profile : builtIn;
+}
+
+TuningProfile autotune(Context& context)
+{
+  HELIB_TIMER_START;
+
+  // The measurements run with the current profile, restored at the end
+  std::shared_ptr<const TuningProfile> previous;
+  if (const TuningProfile* current = context.getTuningProfile())
+    previous = std::make_shared<TuningProfile>(*current);
+
+  TuningProfile profile = TuningProfile::defaults(context);
+  profile.innerProductMinBlock = measureMinBlock(context);
+  context.setTuningProfile(std::make_shared<TuningProfile>(profile));
+
+  SecKey secretKey(context);
+  secretKey.GenSecKey();
+  addSome1DMatrices(secretKey);
+  const PubKey& publicKey = secretKey;
+  const EncryptedArray& ea = context.getEA();
+
+  Ctxt x(publicKey), y(publicKey);
+  PtxtArray zeros(context);
+  zeros.encrypt(x);
+  zeros.encrypt(y);
+
+  // Chen/Han against the basic digit extraction, that only squares for
+  // p = 2: the threshold grows with how much cheaper a square is
+  if (!context.isCKKS()) {
+    double product = bestTime([&] {
+      Ctxt z = x;
+      z.multiplyBy(y);
+    });
+    double square = bestTime([&] {
+      Ctxt z = x;
+      z.square();
+    });
+    double ratio = std::min(std::max(product / square, 1.0), 1.5);
+    profile.chenHanThresholdP2 = profile.chenHanThreshold * ratio;
+  }
+
+  // Both strategies of MatMul1DExec in every dimension
+  std::vector<std::pair<long, bool>> runs;
+  int savedForce = fhe_test_force_bsgs;
+  for (long dim = 0; dim < ea.dimension(); dim++) {
+    long D = ea.sizeOfDimension(dim);
+    if (D < 2)
+      continue;
+    std::unique_ptr<MatMul1D> matrix(buildRandomMatrix(ea, dim));
+    double seconds[2];
+    for (int bsgs = 0; bsgs < 2; bsgs++) {
+      fhe_test_force_bsgs = bsgs ? 1 : -1;
+      MatMul1DExec exec(*matrix);
+      exec.upgrade();
+      seconds[bsgs] = bestTime([&] {
+        Ctxt z = x;
+        exec.mul(z);
+      });
+    }
+    runs.emplace_back(D, seconds[1] < seconds[0]);
+  }
+  fhe_test_force_bsgs = savedForce;
+  profile.bsgsThreshold = bsgsThresholdFrom(runs, profile.bsgsThreshold);
+
+  context.setTuningProfile(previous);
+  return profile;
+}
+
+std::shared_ptr<const TuningProfile> useTuningProfile(Context& context,
+                                                      const std::string& path)
+{
+  std::shared_ptr<const TuningProfile> profile;
+  std::ifstream in(path);
+  if (in) {
+    try {
+      TuningProfile stored = TuningProfile::readFrom(in);
+      if (stored.matches(context))
+        profile = std::make_shared<TuningProfile>(stored);
+    } catch (const IOError&) {
+      // measured again below
+    }
+  }
+  if (!profile) {
+    profile = std::make_shared<TuningProfile>(autotune(context));
+    std::ofstream out(path);
+    if (out)
+      profile->writeTo(out);
+    else
+      Warning("useTuningProfile: cannot write the profile to " + path);
+  }
+  context.setTuningProfile(profile);
+  return profile;
+}
+
+} // namespace helib
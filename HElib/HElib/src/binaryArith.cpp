@@ -16,6 +16,7 @@
 #include <numeric>
 #include <climits>
 #include <map>
+#include <memory>
 #include <algorithm>
 #include <stdexcept>
 #include <atomic>
@@ -23,6 +24,9 @@
 
 #include <NTL/BasicThreadPool.h>
 #include <helib/binaryArith.h>
+#include <helib/polyEval.h>
+#include <helib/opCounters.h>
+#include <helib/ResidueArena.h>
 
 #ifdef HELIB_DEBUG
 #include <cstdio>
@@ -195,6 +199,17 @@ public:
 // of nodes with childrenLeft>0.
 // When initializing p[i,j] the default should be p[i,i+1-2^e]*p[i-2^e,j]
 // where e is the largest exponent with 2^e <= i-j.
+// The bits of the numbers are short-lived ciphertexts of the same prime set,
+// so the residues of a circuit are recycled through a ResidueArena, unless
+// the caller already has one
+static std::unique_ptr<ResidueArena> recycleResidues()
+{
+  std::unique_ptr<ResidueArena> arena;
+  if (!ResidueArena::current())
+    arena.reset(new ResidueArena);
+  return arena;
+}
+
 inline long defaultPmiddle(long delta)
 {
   return 1 << (NTL::NumBits(delta) - 1);
@@ -339,7 +354,7 @@ void AddDAG::apply(CtPtrs& sum,
     sum[i]->clear();
 
   // Allow multi-threading in this loop
-  NTL_EXEC_RANGE(sizeLimit, first, last)
+  HELIB_EXEC_RANGE(sizeLimit, first, last)
   for (long i = first; i < last; i++) { //  for (long i=0; i<sizeLimit; i++) {
     if (i < bSize)
       addCtxtFromNode(*(sum[i]), this->findP(i, i), a, b);
@@ -349,7 +364,7 @@ void AddDAG::apply(CtPtrs& sum,
         addCtxtFromNode(*(sum[i]), node, a, b);
     }
   }
-  NTL_EXEC_RANGE_END
+  HELIB_EXEC_RANGE_END
 }
 
 //! Get the ciphertext for a node, computing it as needed
@@ -648,6 +663,7 @@ void addTwoNumbers(CtPtrs& sum,
                    std::vector<zzX>* unpackSlotEncoding)
 {
   HELIB_TIMER_START;
+  auto arena = recycleResidues();
   if (lsize(lhs) < 1) {
     vecCopy(sum, rhs, sizeLimit);
     return;
@@ -680,6 +696,7 @@ void addTwoNumbers(CtPtrs& sum,
 void negateBinary(CtPtrs& negation, const CtPtrs& input)
 {
   assertEq(negation.size(), input.size(), "Arguments must have matching size.");
+  auto arena = recycleResidues();
   std::vector<Ctxt> bitFlippedInput;
   vecCopy(bitFlippedInput, input);
   // First flip all bits of the input.
@@ -706,6 +723,7 @@ void subtractBinary(CtPtrs& difference,
   assertEq(difference.size(),
            rhs.size(),
            "Size of output vector must equal the size of the input vectors.");
+  auto arena = recycleResidues();
   // Negate the rhs and then use the existing add function.
   std::vector<Ctxt> negated_rhs(rhs.size(), *rhs[0]);
   CtPtrs_vectorCt negated_wrapper(negated_rhs);
@@ -851,7 +869,7 @@ static void three4Two(CtPtrs& lsb,
   resize(tmpLsb, lsbSize, Ctxt(ZeroCtxtLike, *ctptr));
   resize(tmpMsb, msbSize, Ctxt(ZeroCtxtLike, *ctptr));
 
-  NTL_EXEC_RANGE(msbSize - 1, first, last)
+  HELIB_EXEC_RANGE(msbSize - 1, first, last)
   for (long i = first; i < last; i++) {
     if (i < lsize(*p1))
       three4Two(&tmpLsb[i], &tmpMsb[i + 1], (*p1)[i], (*p2)[i], (*p3)[i]);
@@ -860,7 +878,7 @@ static void three4Two(CtPtrs& lsb,
     } else if (p3->isSet(i))
       tmpLsb[i] = *((*p3)[i]);
   }
-  NTL_EXEC_RANGE_END
+  HELIB_EXEC_RANGE_END
 
   if (msbSize == lsbSize) { // we only computed upto lsbSize-1, do the last LSB
     if (p1->isSet(lsbSize - 1))
@@ -902,6 +920,7 @@ void addManyNumbers(CtPtrs& sum,
             << " numbers with size-limit=" << sizeLimit << std::endl;
 #endif
   HELIB_TIMER_START;
+  auto arena = recycleResidues();
   const Ctxt* ct_ptr = numbers.ptr2nonNull();
   if (lsize(numbers) < 1 || ct_ptr == nullptr) { // nothing to add
     setLengthZero(sum);
@@ -991,14 +1010,14 @@ static void multByNegative(CtPtrs& product,
       }
   long nPairs = lsize(pairs);
 
-  NTL_EXEC_RANGE(nPairs, first, last)
+  HELIB_EXEC_RANGE(nPairs, first, last)
   for (long idx = first; idx < last; idx++) {
     long i, j;
     std::tie(i, j) = pairs[idx];
     numbers[i][j] = *(b[j - i]);
     numbers[i][j].multiplyBy(*(a[i])); // multiply by the bit of a
   }
-  NTL_EXEC_RANGE_END
+  HELIB_EXEC_RANGE_END
 
   // sign extension
   for (long i = 0; i < nNums; i++)
@@ -1032,6 +1051,7 @@ void multTwoNumbers(CtPtrs& product,
                     std::vector<zzX>* unpackSlotEncoding)
 {
   HELIB_TIMER_START;
+  auto arena = recycleResidues();
   long lhsSize = lsize(lhs);
   long rhsSize = lsize(rhs);
   long resSize = lhsSize + rhsSize;
@@ -1096,14 +1116,14 @@ void multTwoNumbers(CtPtrs& product,
         pairs.push_back(std::pair<long, long>(i, j));
     }
   long nPairs = lsize(pairs);
-  NTL_EXEC_RANGE(nPairs, first, last)
+  HELIB_EXEC_RANGE(nPairs, first, last)
   for (long idx = first; idx < last; idx++) {
     long i, j;
     std::tie(i, j) = pairs[idx];
     numbers[i][j] = *(lhs[j - i]);
     numbers[i][j].multiplyBy(*(rhs[i])); // multiply by the bit of rhs
   }
-  NTL_EXEC_RANGE_END
+  HELIB_EXEC_RANGE_END
 
   CtPtrMat_VecCt nums(numbers); // A wrapper around numbers
 #ifdef HELIB_DEBUG
@@ -1236,8 +1256,8 @@ static void fifteen4Four(const CtPtrs& out, const CtPtrs& in, long sizeLimit)
   Ctxt& e3 = c2;
   Ctxt& e4 = f2;
 
-  long nThreads = std::min(NTL::AvailableThreads(), 3L);
-  NTL_EXEC_INDEX(nThreads, index) // run these three lines in parallel
+  long nThreads = std::min(availableThreads(), 3L);
+  HELIB_EXEC_INDEX(nThreads, index) // run these three lines in parallel
   switch (index) {
   case 0:
     three4Two(&b1, &b2, in[0], in[1], in[2]); // b2 b1 = 3for2(in[0..2])
@@ -1252,14 +1272,14 @@ static void fifteen4Four(const CtPtrs& out, const CtPtrs& in, long sizeLimit)
   default:
     three4Two(&b5, &b6, in[6], in[7], in[8]); // b6 b5 = 3for2(in[6..8])
   }
-  NTL_EXEC_INDEX_END
+  HELIB_EXEC_INDEX_END
 
   three4Two(c1, c2, b1, b3, b5); // c2 c1 = 3for2(b1,b3,b5)
 
   three4Two(c3, c4, b2, b4, b6); // c4 c3 = 3for2(b2,b4,b6)
 
-  nThreads = std::min(NTL::AvailableThreads(), 2L);
-  NTL_EXEC_INDEX(nThreads, index) // run these two lines in parallel
+  nThreads = std::min(availableThreads(), 2L);
+  HELIB_EXEC_INDEX(nThreads, index) // run these two lines in parallel
   switch (index) {
   case 0:
     three4Two(&b7, &b8, in[9], in[10], in[11]); // b8 b7 = 3for2(in[9..11])
@@ -1269,9 +1289,9 @@ static void fifteen4Four(const CtPtrs& out, const CtPtrs& in, long sizeLimit)
   default:
     three4Two(&b9, &b10, in[12], in[13], in[14]); // b10 b9 = 3for2(in[12..14])
   }
-  NTL_EXEC_INDEX_END
+  HELIB_EXEC_INDEX_END
 
-  NTL_EXEC_INDEX(nThreads, index) // run these two lines in parallel
+  HELIB_EXEC_INDEX(nThreads, index) // run these two lines in parallel
   switch (index) {
   case 0:
     three4Two(d1, d2, b7, b9, c1); // d2 d1 = 3for2(b7,b9,c1)
@@ -1282,11 +1302,11 @@ static void fifteen4Four(const CtPtrs& out, const CtPtrs& in, long sizeLimit)
     if (sizeLimit >= 2)
       three4Two(d3, d4, b8, b10, c2); // d4 d3 = 3for2(b8,b10,c2)
   }
-  NTL_EXEC_INDEX_END
+  HELIB_EXEC_INDEX_END
   if (sizeLimit < 2)
     return;
 
-  NTL_EXEC_INDEX(nThreads, index) // run these two blocks in parallel
+  HELIB_EXEC_INDEX(nThreads, index) // run these two blocks in parallel
   switch (index) {
   case 0:
     three4Two(e1, e2, c3, d2, d3); // e2 e1 = 3for2(c3,d2,d3)
@@ -1300,7 +1320,7 @@ static void fifteen4Four(const CtPtrs& out, const CtPtrs& in, long sizeLimit)
       e4.multiplyBy(c4); // e4 = c4 * d4 (e4 alias d4)
     }
   }
-  NTL_EXEC_INDEX_END
+  HELIB_EXEC_INDEX_END
   if (sizeLimit < 3)
     return;
 
@@ -1317,6 +1337,7 @@ static void fifteen4Four(const CtPtrs& out, const CtPtrs& in, long sizeLimit)
 long fifteenOrLess4Four(const CtPtrs& out, const CtPtrs& in, long sizeLimit)
 {
   HELIB_TIMER_START;
+  auto arena = recycleResidues();
   long numNonNull = in.numNonNull();
   if (numNonNull > 7) {
     fifteen4Four(out, in, sizeLimit);
@@ -1341,6 +1362,46 @@ long fifteenOrLess4Four(const CtPtrs& out, const CtPtrs& in, long sizeLimit)
   return numNonNull;
 }
 
+// The packed <-> binary conversions
+void packedToBinary(CtPtrs& bits, const Ctxt& packed, long nBits)
+{
+  HELIB_TIMER_START;
+  assertEq(packed.getContext().getP(), 2l, "Binary numbers need p = 2");
+
+  std::vector<Ctxt> digits;
+  extractDigitsPolyfunc(digits, packed, nBits);
+  for (Ctxt& digit : digits)
+    digit.reducePtxtSpace(2);
+  vecCopy(bits, digits);
+}
+
+void binaryToPacked(Ctxt& packed, const CtPtrs& bits, long r)
+{
+  HELIB_TIMER_START;
+  const Ctxt* bit = bits.ptr2nonNull();
+  assertNotNull(bit, "No bits to recompose");
+  assertEq(bit->getContext().getP(), 2l, "Binary numbers need p = 2");
+
+  // Bit j only matters mod 2^(r-j), the lifts are independent
+  long n = std::min(lsize(bits), r);
+  std::vector<Ctxt> terms(n, Ctxt(ZeroCtxtLike, *bit));
+  HELIB_EXEC_RANGE(n, first, last)
+  for (long j = first; j < last; j++) {
+    if (bits.isSet(j) && !bits[j]->isEmpty()) {
+      terms[j] = *bits[j];
+      terms[j].reducePtxtSpace(2);
+      liftDigit(terms[j], r - j);
+      terms[j].multByP(j);
+    }
+  }
+  HELIB_EXEC_RANGE_END
+
+  packed = Ctxt(ZeroCtxtLike, *bit);
+  packed.hackPtxtSpace(NTL::power_long(2, r));
+  for (const Ctxt& term : terms)
+    packed += term;
+}
+
 /********************************************************************/
 /***************** test/debugging functions *************************/
 
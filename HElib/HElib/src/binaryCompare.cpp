@@ -14,9 +14,12 @@
  * @brief Implementing integer comparison in binary representation.
  */
 #include <algorithm>
+#include <memory>
 
 #include <NTL/BasicThreadPool.h>
 #include <helib/binaryArith.h>
+#include <helib/opCounters.h>
+#include <helib/ResidueArena.h>
 
 #define BPL_ESTIMATE (30)
 // FIXME: this should really be dynamic
@@ -63,14 +66,14 @@ static void compProducts(const CtPtrs_slice& e, const CtPtrs_slice& g)
                CtPtrs_slice(g, n1, n - n1)); // second half
 
   // Multiply the first product in the 2nd part into every product in the 1st
-  NTL_EXEC_RANGE(1 + n1, first, last)
+  HELIB_EXEC_RANGE(1 + n1, first, last)
   for (long i = first; i < last; i++) {
     if (i == 0)
       e[0]->multiplyBy(*e[n1]);
     else if (i - 1 < g.size())
       g[i - 1]->multiplyBy(*e[n1]);
   }
-  NTL_EXEC_RANGE_END
+  HELIB_EXEC_RANGE_END
 #ifdef HELIB_DEBUG
   std::cout << " g[" << g.start << ".." << (g.start + g.sz - 1) << "], "
             << " e[" << e.start << ".." << (e.start + e.sz - 1)
@@ -113,7 +116,7 @@ static void compEqGt(CtPtrs& aeqb,
   // First compute the local bits e[i]=(a[i]==b[i]), gt[i]=(a[i]>b[i])
   HELIB_NTIMER_START(compEqGt1);
   long aSize = lsize(a);
-  NTL_EXEC_RANGE(aSize, first, last)
+  HELIB_EXEC_RANGE(aSize, first, last)
   for (long i = first; i < last; i++) {
     *aeqb[i] = *b[i];               // b
     aeqb[i]->addConstant(one, 1.0); // b+1
@@ -121,19 +124,19 @@ static void compEqGt(CtPtrs& aeqb,
     *aeqb[i] += *a[i];              // a+b+1
     agtb[i]->multiplyBy(*a[i]);     // a(b+1)
   }
-  NTL_EXEC_RANGE_END
+  HELIB_EXEC_RANGE_END
   HELIB_NTIMER_STOP(compEqGt1);
 
   // NOTE: Usually there isn't much gain in multi-threading the loop below,
   //    but computing b[i] can be expensive in some implementations of CtPtrs
   HELIB_NTIMER_START(compEqGt2);
   if (lsize(b) - aSize > 1) {
-    NTL_EXEC_RANGE(lsize(b) - aSize, first, last)
+    HELIB_EXEC_RANGE(lsize(b) - aSize, first, last)
     for (long i = first; i < last; i++) {
       *aeqb[i + aSize] = *b[i + aSize];       // b
       aeqb[i + aSize]->addConstant(one, 1.0); // b+1
     }
-    NTL_EXEC_RANGE_END
+    HELIB_EXEC_RANGE_END
   } else if (lsize(b) - aSize == 1) {
     *aeqb[aSize] = *b[aSize];           // b
     aeqb[aSize]->addConstant(one, 1.0); // b+1
@@ -177,6 +180,10 @@ void compareTwoNumbersImplementation(CtPtrs& max,
                                      bool cmp_only)
 {
   HELIB_TIMER_START;
+  // Recycle the residues of the temporaries, unless the caller already does
+  std::unique_ptr<ResidueArena> arena;
+  if (!ResidueArena::current())
+    arena.reset(new ResidueArena);
   // make sure that lsize(b) >= lsize(a)
   const CtPtrs& a = (lsize(bb) >= lsize(aa)) ? aa : bb;
   const CtPtrs& b = (lsize(bb) >= lsize(aa)) ? bb : aa;
@@ -236,7 +243,7 @@ void compareTwoNumbersImplementation(CtPtrs& max,
     return;
   }
 
-  NTL_EXEC_RANGE(aSize, first, last)
+  HELIB_EXEC_RANGE(aSize, first, last)
   for (long i = first; i < last; i++) {
     *max[i] = *a[i];
     *max[i] -= *b[i];
@@ -246,7 +253,7 @@ void compareTwoNumbersImplementation(CtPtrs& max,
     *max[i] += *b[i];
     *min[i] -= *a[i];
   }
-  NTL_EXEC_RANGE_END
+  HELIB_EXEC_RANGE_END
   for (long i = aSize; i < bSize; i++)
     *max[i] = *b[i];
   HELIB_NTIMER_STOP(compResults);
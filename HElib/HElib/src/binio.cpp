@@ -12,6 +12,9 @@
 #include "binio.h"
 #include <helib/assertions.h>
 #include <sys/types.h> // byte order macros in a platform-independent way.
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 
 namespace helib {
 
@@ -30,74 +33,116 @@ void writeEyeCatcher(std::ostream& str,
   str.write(eye.data(), eye.size());
 }
 
-// compile only 64-bit (-m64) therefore long must be at least 64-bit
-long read_raw_int(std::istream& str)
+namespace {
+
+// On big-endian machines the bytes are swapped through a buffer of this many
+// words, so that the stream still sees a few large writes and reads
+constexpr long SWAP_WORDS = 512;
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+uint64_t swapWord(uint64_t w) { return __builtin_bswap64(w); }
+uint32_t swapWord(uint32_t w) { return __builtin_bswap32(w); }
+#endif
+
+// The n 8-byte words at p (longs or doubles), stored little-endian
+void writeWords64(std::ostream& str, const void* p, long n)
 {
+  const char* bytes = static_cast<const char*>(p);
 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-  long result = 0;
-  str.read(reinterpret_cast<char*>(&result), Binio::BIT64);
-  return result;
+  str.write(bytes, n * Binio::BIT64);
 #else
-  long result = 0;
-  char byte;
-
-  for (long i = 0; i < Binio::BIT64; i++) {
-    str.read(&byte, 1); // read a byte
-    result |= (static_cast<long>(byte) & 0xff)
-              << i * 8; // must be in little endian
+  uint64_t buf[SWAP_WORDS];
+  for (long i = 0; i < n; i += SWAP_WORDS) {
+    long k = std::min(SWAP_WORDS, n - i);
+    std::memcpy(buf, bytes + i * Binio::BIT64, k * Binio::BIT64);
+    for (long j = 0; j < k; j++)
+      buf[j] = swapWord(buf[j]);
+    str.write(reinterpret_cast<const char*>(buf), k * Binio::BIT64);
   }
-
-  return result;
 #endif
 }
 
-int read_raw_int32(std::istream& str)
+void readWords64(std::istream& str, void* p, long n)
 {
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-  int result = 0;
-  str.read(reinterpret_cast<char*>(&result), Binio::BIT32);
-  return result;
-#else
-  int result = 0;
-  char byte;
+  char* bytes = static_cast<char*>(p);
+  str.read(bytes, n * Binio::BIT64);
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+  for (long i = 0; i < n; i++) {
+    uint64_t w;
+    std::memcpy(&w, bytes + i * Binio::BIT64, Binio::BIT64);
+    w = swapWord(w);
+    std::memcpy(bytes + i * Binio::BIT64, &w, Binio::BIT64);
+  }
+#endif
+}
 
-  for (long i = 0; i < Binio::BIT32; i++) {
-    str.read(&byte, 1); // read a byte
-    result |= (static_cast<long>(byte) & 0xff)
-              << i * 8; // must be in little endian
+// The n longs at p truncated to little-endian 32-bit words, and back with
+// sign extension
+void writeLongs32(std::ostream& str, const long* p, long n)
+{
+  uint32_t buf[SWAP_WORDS];
+  for (long i = 0; i < n; i += SWAP_WORDS) {
+    long k = std::min(SWAP_WORDS, n - i);
+    for (long j = 0; j < k; j++) {
+      buf[j] = static_cast<uint32_t>(p[i + j]);
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+      buf[j] = swapWord(buf[j]);
+#endif
+    }
+    str.write(reinterpret_cast<const char*>(buf), k * Binio::BIT32);
   }
+}
 
-  return result;
+void readLongs32(std::istream& str, long* p, long n)
+{
+  uint32_t buf[SWAP_WORDS];
+  for (long i = 0; i < n; i += SWAP_WORDS) {
+    long k = std::min(SWAP_WORDS, n - i);
+    str.read(reinterpret_cast<char*>(buf), k * Binio::BIT32);
+    for (long j = 0; j < k; j++) {
+      uint32_t w = buf[j];
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+      w = swapWord(w);
 #endif
+      p[i + j] = static_cast<int32_t>(w);
+    }
+  }
 }
 
+} // namespace
+
 // compile only 64-bit (-m64) therefore long must be at least 64-bit
-void write_raw_int(std::ostream& str, long num)
+long read_raw_int(std::istream& str)
 {
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-  str.write(reinterpret_cast<const char*>(&num), Binio::BIT64);
-#else
-  char byte;
+  long result = 0;
+  readWords64(str, &result, 1);
+  return result;
+}
 
-  for (long i = 0; i < Binio::BIT64; i++) {
-    byte = num >> 8 * i; // serializing in little endian
-    str.write(&byte, 1); // write byte out
-  }
-#endif
+int read_raw_int32(std::istream& str)
+{
+  long result = 0;
+  readLongs32(str, &result, 1);
+  return result;
 }
 
+// compile only 64-bit (-m64) therefore long must be at least 64-bit
+void write_raw_int(std::ostream& str, long num) { writeWords64(str, &num, 1); }
+
 void write_raw_int32(std::ostream& str, int num)
 {
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-  str.write(reinterpret_cast<const char*>(&num), Binio::BIT32);
-#else
-  char byte;
+  long n = num;
+  writeLongs32(str, &n, 1);
+}
 
-  for (long i = 0; i < Binio::BIT32; i++) {
-    byte = num >> 8 * i; // serializing in little endian
-    str.write(&byte, 1); // write byte out
-  }
-#endif
+void write_raw_words(std::ostream& str, const long* p, long n)
+{
+  writeWords64(str, p, n);
+}
+
+void read_raw_words(std::istream& str, long* p, long n)
+{
+  readWords64(str, p, n);
 }
 
 void write_ntl_vec_long(std::ostream& str,
@@ -110,15 +155,10 @@ void write_ntl_vec_long(std::ostream& str,
   write_raw_int32(str, vl.length());
   write_raw_int32(str, intSize);
 
-  if (intSize == Binio::BIT64) {
-    for (long i = 0; i < vl.length(); i++) {
-      write_raw_int(str, vl[i]);
-    }
-  } else {
-    for (long i = 0; i < vl.length(); i++) {
-      write_raw_int32(str, vl[i]);
-    }
-  }
+  if (intSize == Binio::BIT64)
+    writeWords64(str, vl.elts(), vl.length());
+  else
+    writeLongs32(str, vl.elts(), vl.length());
 }
 
 void read_ntl_vec_long(std::istream& str, NTL::vec_long& vl)
@@ -134,32 +174,95 @@ void read_ntl_vec_long(std::istream& str, NTL::vec_long& vl)
     vl.SetLength(sizeOfVL);
   }
 
-  if (intSize == Binio::BIT64) {
-    for (long i = 0; i < sizeOfVL; i++) {
-      vl[i] = read_raw_int(str);
+  if (intSize == Binio::BIT64)
+    readWords64(str, vl.elts(), sizeOfVL);
+  else
+    readLongs32(str, vl.elts(), sizeOfVL);
+}
+
+void write_raw_longs(std::ostream& str, const long* p, long n)
+{
+  write_raw_int32(str, n);
+  write_raw_int32(str, Binio::BIT64);
+  writeWords64(str, p, n);
+}
+
+void read_raw_longs(std::istream& str, long* p, long n)
+{
+  int sizeOfVL = read_raw_int32(str);
+  int intSize = read_raw_int32(str);
+  assertTrue<IOError>(intSize == Binio::BIT64 || intSize == Binio::BIT32,
+                      "intSize must be 32 or 64 bit for binary IO");
+  assertEq<IOError>(long(sizeOfVL), n, "Data not valid: wrong vector length");
+
+  if (intSize == Binio::BIT64)
+    readWords64(str, p, n);
+  else
+    readLongs32(str, p, n);
+}
+
+void write_packed_longs(std::ostream& str, const long* p, long n, long bits)
+{
+  assertInRange<InvalidArgument>(bits,
+                                 1l,
+                                 long(NTL_BITS_PER_LONG) - 1,
+                                 "Bit width out of range for packing");
+  write_raw_int32(str, n);
+  write_raw_int32(str, bits);
+
+  std::vector<unsigned char> buf((n * bits + 7) / 8, 0);
+  long pos = 0; // in bits
+  for (long i = 0; i < n; i++) {
+    unsigned long v = p[i];
+    for (long done = 0; done < bits;) {
+      long byte = pos / 8, shift = pos % 8;
+      long chunk = std::min(bits - done, 8 - shift);
+      buf[byte] |= ((v >> done) & ((1ul << chunk) - 1)) << shift;
+      done += chunk;
+      pos += chunk;
     }
-  } else {
-    for (long i = 0; i < sizeOfVL; i++) {
-      vl[i] = read_raw_int32(str);
+  }
+  str.write(reinterpret_cast<const char*>(buf.data()), buf.size());
+}
+
+void read_packed_longs(std::istream& str, long* p, long n, long bits)
+{
+  long sizeOfVL = read_raw_int32(str);
+  long width = read_raw_int32(str);
+  assertEq<IOError>(sizeOfVL, n, "Data not valid: wrong vector length");
+  assertEq<IOError>(width, bits, "Data not valid: wrong bit width");
+
+  std::vector<unsigned char> buf((n * bits + 7) / 8);
+  str.read(reinterpret_cast<char*>(buf.data()), buf.size());
+  assertTrue<IOError>(bool(str), "Could not read packed data");
+  long pos = 0;
+  for (long i = 0; i < n; i++) {
+    unsigned long v = 0;
+    for (long done = 0; done < bits;) {
+      long byte = pos / 8, shift = pos % 8;
+      long chunk = std::min(bits - done, 8 - shift);
+      v |= ((unsigned long)(buf[byte] >> shift) & ((1ul << chunk) - 1))
+           << done;
+      done += chunk;
+      pos += chunk;
     }
+    p[i] = v;
   }
 }
 
 void write_raw_double(std::ostream& str, const double d)
 {
-  // FIXME: this is not portable:
-  //  * we might have sizeof(long) < sizeof(double)
-  //  * we also don't know if the bit layout is really compatible
-  const long* pd = reinterpret_cast<const long*>(&d);
-  write_raw_int(str, *pd);
+  // FIXME: this is not portable: we don't know if the bit layout is really
+  // compatible
+  writeWords64(str, &d, 1);
 }
 
 double read_raw_double(std::istream& str)
 {
   // FIXME: see FIXME for write_raw_double
-  long d = read_raw_int(str);
-  double* pd = reinterpret_cast<double*>(&d);
-  return *pd;
+  double d = 0;
+  readWords64(str, &d, 1);
+  return d;
 }
 
 void write_raw_xdouble(std::ostream& str, const NTL::xdouble xd)
@@ -182,12 +285,11 @@ void write_raw_ZZ(std::ostream& str, const NTL::ZZ& zz)
   long noBytes = NumBytes(zz);
   assertTrue<InvalidArgument>(noBytes > 0,
                               "Number of bytes to write must be non-negative");
-  unsigned char* zzBytes = new unsigned char[noBytes];
-  BytesFromZZ(zzBytes, zz, noBytes); // From ZZ.h
+  std::vector<unsigned char> zzBytes(noBytes);
+  BytesFromZZ(zzBytes.data(), zz, noBytes); // From ZZ.h
   write_raw_int(str, noBytes);
   // TODO - ZZ appears to be endian agnostic
-  str.write(reinterpret_cast<char*>(zzBytes), noBytes);
-  delete[] zzBytes;
+  str.write(reinterpret_cast<const char*>(zzBytes.data()), noBytes);
 }
 
 void read_raw_ZZ(std::istream& str, NTL::ZZ& zz)
@@ -195,11 +297,10 @@ void read_raw_ZZ(std::istream& str, NTL::ZZ& zz)
   long noBytes = read_raw_int(str);
   assertTrue<InvalidArgument>(noBytes > 0,
                               "Number of bytes to write must be non-negative");
-  unsigned char* zzBytes = new unsigned char[noBytes];
+  std::vector<unsigned char> zzBytes(noBytes);
   // TODO - ZZ appears to be endian agnostic
-  str.read(reinterpret_cast<char*>(zzBytes), noBytes);
-  zz = NTL::ZZFromBytes(zzBytes, noBytes);
-  delete[] zzBytes;
+  str.read(reinterpret_cast<char*>(zzBytes.data()), noBytes);
+  zz = NTL::ZZFromBytes(zzBytes.data(), noBytes);
 }
 
 // FIXME: there is some repetitive code here.
@@ -209,43 +310,34 @@ void read_raw_ZZ(std::istream& str, NTL::ZZ& zz)
 template <>
 void read_raw_vector<long>(std::istream& str, std::vector<long>& v)
 {
-
   long sz = read_raw_int(str);
   v.resize(sz); // Make space in vector
-
-  for (long i = 0; i < sz; i++)
-    v[i] = read_raw_int(str);
+  readWords64(str, v.data(), sz);
 }
 
 template <>
 void write_raw_vector<long>(std::ostream& str, const std::vector<long>& v)
 {
-  long sz = v.size();
-  write_raw_int(str, sz);
-
-  for (long n : v)
-    write_raw_int(str, n);
+  write_raw_int(str, v.size());
+  writeWords64(str, v.data(), v.size());
 }
 
+static_assert(sizeof(double) == Binio::BIT64,
+              "binary IO stores doubles as 64-bit words");
+
 template <>
 void read_raw_vector<double>(std::istream& str, std::vector<double>& v)
 {
-
   long sz = read_raw_int(str);
   v.resize(sz); // Make space in vector
-
-  for (long i = 0; i < sz; i++)
-    v[i] = read_raw_double(str);
+  readWords64(str, v.data(), sz);
 }
 
 template <>
 void write_raw_vector<double>(std::ostream& str, const std::vector<double>& v)
 {
-  long sz = v.size();
-  write_raw_int(str, sz);
-
-  for (double n : v)
-    write_raw_double(str, n);
+  write_raw_int(str, v.size());
+  writeWords64(str, v.data(), v.size());
 }
 
 } // namespace helib
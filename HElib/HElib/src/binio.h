@@ -43,12 +43,20 @@ struct EyeCatcher
   static constexpr std::array<char, SIZE> CONTEXT_END   = {']','C','N','|'};
   static constexpr std::array<char, SIZE> CTXT_BEGIN    = {'|','C','X','['};
   static constexpr std::array<char, SIZE> CTXT_END      = {']','C','X','|'};
+  static constexpr std::array<char, SIZE> SCTXT_BEGIN   = {'|','C','S','['};
+  static constexpr std::array<char, SIZE> CCTXT_BEGIN   = {'|','C','C','['};
   static constexpr std::array<char, SIZE> PK_BEGIN      = {'|','P','K','['};
   static constexpr std::array<char, SIZE> PK_END        = {']','P','K','|'};
   static constexpr std::array<char, SIZE> SK_BEGIN      = {'|','S','K','['};
   static constexpr std::array<char, SIZE> SK_END        = {']','S','K','|'};
   static constexpr std::array<char, SIZE> SKM_BEGIN     = {'|','K','M','['};
   static constexpr std::array<char, SIZE> SKM_END       = {']','K','M','|'};
+  static constexpr std::array<char, SIZE> BOOT_BEGIN    = {'|','B','T','['};
+  static constexpr std::array<char, SIZE> BOOT_END      = {']','B','T','|'};
+  static constexpr std::array<char, SIZE> ALG_BEGIN     = {'|','A','L','['};
+  static constexpr std::array<char, SIZE> ALG_END       = {']','A','L','|'};
+  static constexpr std::array<char, SIZE> MPK_BEGIN     = {'|','M','P','['};
+  static constexpr std::array<char, SIZE> MPK_END       = {']','M','P','|'};
   // clang-format on
 };
 
@@ -63,6 +71,8 @@ class Context;
 class PubKey;
 class SecKey;
 class Ctxt;
+class ThinRecryptData;
+struct PAlgebraTables;
 
 template <>
 inline constexpr char nameToStructId<Context>()
@@ -84,6 +94,16 @@ inline constexpr char nameToStructId<Ctxt>()
 {
   return 20;
 }
+template <>
+inline constexpr char nameToStructId<ThinRecryptData>()
+{
+  return 25;
+}
+template <>
+inline constexpr char nameToStructId<PAlgebraTables>()
+{
+  return 30;
+}
 
 // Already broken into bytes, thus should be the same written and read in bog
 // or little endian.
@@ -156,6 +176,27 @@ void write_ntl_vec_long(std::ostream& str,
                         long intSize = Binio::BIT64);
 void read_ntl_vec_long(std::istream& str, NTL::vec_long& vl);
 
+// The n longs at p as little-endian 64-bit words, with no header. This is a
+// single write or read on little-endian machines; on others the bytes are
+// swapped through a small buffer. The vector and integer routines below are
+// all built on these.
+void write_raw_words(std::ostream& str, const long* p, long n);
+void read_raw_words(std::istream& str, long* p, long n);
+
+// The same format as write_ntl_vec_long with 64-bit integers, for the n longs
+// at p. On little-endian machines the longs are written and read in a
+// single block, straight from and into p. read_raw_longs throws IOError if
+// the stored vector does not have n entries.
+void write_raw_longs(std::ostream& str, const long* p, long n);
+void read_raw_longs(std::istream& str, long* p, long n);
+
+// The n longs at p, all in [0, 2^bits), packed into ceil(n*bits/8) bytes with
+// the lowest bits first, after the length and the bit width.
+// read_packed_longs throws IOError if the stored vector does not have n
+// entries of the given width.
+void write_packed_longs(std::ostream& str, const long* p, long n, long bits);
+void read_packed_longs(std::istream& str, long* p, long n, long bits);
+
 long read_raw_int(std::istream& str);
 int read_raw_int32(std::istream& str);
 void write_raw_int(std::ostream& str, long num);
@@ -0,0 +1,420 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <helib/bootstrapEstimate.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <map>
+#include <set>
+
+#include <helib/Context.h>
+#include <helib/Ctxt.h>
+#include <helib/DoubleCRT.h>
+#include <helib/EvalMap.h>
+#include <helib/keys.h>
+#include <helib/polyEval.h>
+#include <helib/recryption.h>
+
+namespace helib {
+
+namespace {
+
+// The operations of a bootstrapping, priced for a ciphertext with n primes
+class CostModel
+{
+public:
+  CostModel(const Context& context, const OperationCosts& costs) :
+      context(context),
+      costs(costs),
+      phim(context.getPhiM()),
+      skHwt(context.getRcData().skHwt),
+      nCtxtPrimes(context.getCtxtPrimes().card()),
+      nSpecialPrimes(context.getSpecialPrimes().card()),
+      ctxtBits(context.logOfProduct(context.getCtxtPrimes()) / std::log(2.0))
+  {
+    nDigits = 0;
+    for (const IndexSet& digit : context.getDigits())
+      if (!empty(digit))
+        nDigits++;
+  }
+
+  double getCtxtBits() const { return ctxtBits; }
+
+  // Noise added by a modulus switch, see Ctxt::modSwitchAddedNoiseBound
+  double modSwitchNoise(long ptxtSpace) const
+  {
+    return (1.0 + context.noiseBoundForHWt(skHwt, phim)) *
+           context.noiseBoundForUniform(ptxtSpace / 2.0, phim);
+  }
+
+  // Bits of capacity taken by a level of multiplications
+  double multiplicationBits(long ptxtSpace) const
+  {
+    return std::log2(modSwitchNoise(ptxtSpace));
+  }
+
+  // Bits of capacity taken by a level of products with constants
+  double constantBits(long ptxtSpace) const
+  {
+    return std::log2(context.noiseBoundForMod(ptxtSpace, phim));
+  }
+
+  // Primes of a ciphertext whose capacity goes from before to after
+  long primes(double before, double after, long ptxtSpace) const
+  {
+    double bits = (before + after) / 2 + multiplicationBits(ptxtSpace);
+    long n = std::ceil(bits * nCtxtPrimes / ctxtBits);
+    return std::min(std::max(n, 1L), nCtxtPrimes);
+  }
+
+  // count key switches, decompositions of them break their input into
+  // digits, the others reuse them
+  void keySwitches(BootstrapStageReport& stage,
+                   long n,
+                   long count,
+                   long decompositions) const
+  {
+    long extended = n + nSpecialPrimes;
+    long ntts = decompositions * (n + nDigits * extended) + count * 2 * extended;
+    stage.ops[OpType::KeySwitch] += count;
+    stage.ops[OpType::NTT] += ntts;
+    addTime(stage,
+            ntts * costs.ntt + count * nDigits * extended * costs.keySwitch);
+  }
+
+  void ntts(BootstrapStageReport& stage, long count) const
+  {
+    stage.ops[OpType::NTT] += count;
+    addTime(stage, count * costs.ntt);
+  }
+
+  void automorphisms(BootstrapStageReport& stage, long n, long count) const
+  {
+    stage.ops[OpType::Automorphism] += count;
+    addTime(stage, count * 2 * n * costs.automorphism);
+  }
+
+  void scalarMults(BootstrapStageReport& stage, long n, long count) const
+  {
+    addTime(stage, count * 2 * n * costs.scalarMult);
+  }
+
+  // Products of two ciphertexts with relinearization
+  void multiplications(BootstrapStageReport& stage, long n, long count) const
+  {
+    stage.ops[OpType::TensorProduct] += count;
+    stage.ops[OpType::Relinearization] += count;
+    stage.ops[OpType::ModSwitch] += count;
+    addTime(stage, count * 2 * n * costs.scalarMult); // 4 products of parts
+    keySwitches(stage, n, count, count);
+  }
+
+  // A linear map with the given automorphisms, hoisted in every dimension
+  void linearMap(BootstrapStageReport& stage,
+                 long n,
+                 const std::map<long, std::set<long>>& autos) const
+  {
+    for (const auto& [dim, values] : autos) {
+      long count = values.size();
+      if (count == 0)
+        continue;
+      keySwitches(stage, n, count, 1);
+      automorphisms(stage, n, count);
+      scalarMults(stage, n, count + 1);
+    }
+  }
+
+private:
+  void addTime(BootstrapStageReport& stage, double seconds) const
+  {
+    stage.wallSeconds += seconds;
+    stage.cpuSeconds += seconds;
+  }
+
+  const Context& context;
+  const OperationCosts& costs;
+  long phim;
+  long skHwt;
+  long nCtxtPrimes;
+  long nSpecialPrimes;
+  long nDigits;
+  double ctxtBits;
+};
+
+// Multiplications and depth of extracting botHigh digits, keeping r
+void extractionCost(long& multiplications,
+                    long& depth,
+                    const Context& context,
+                    long botHigh,
+                    long r,
+                    bool our_version,
+                    bool lazy)
+{
+  std::vector<std::vector<long>> plan;
+  if (our_version) {
+    plan = planDigitExtraction(context, botHigh, r, lazy);
+  } else {
+    // The built-in extraction lifts every row one digit at a time
+    for (long row = 0; row < botHigh; row++) {
+      std::vector<long> list;
+      for (long e = 1; e < botHigh + r - row; e++)
+        list.push_back(e);
+      plan.push_back(list);
+    }
+  }
+  digitExtractionCost(multiplications, depth, context, botHigh, r, lazy, plan);
+}
+
+void setCapacities(BootstrapStageReport& stage, double before, double after)
+{
+  stage.capacityBefore = std::floor(before);
+  stage.capacityAfter = std::floor(after);
+}
+
+// Capacity of the input of the boot key switch, which is mod-switched down
+// to about the bootstrapping modulus q = p^e + 1
+double keySwitchInputBits(const Context& context)
+{
+  return context.getRcData().e * std::log2(double(context.getP())) + 1;
+}
+
+// Capacity after the inner product with the encrypted secret key, whose
+// plaintext space is ptxtSpace, and the coefficients of the ciphertext mod q
+double keySwitchOutputBits(const Context& context,
+                           const CostModel& model,
+                           long ptxtSpace)
+{
+  long q = NTL::power_long(context.getP(), context.getRcData().e) + 1;
+  return model.getCtxtBits() -
+         std::log2(model.modSwitchNoise(ptxtSpace) *
+                   context.noiseBoundForMod(q, context.getPhiM()));
+}
+
+void estimateBootKeySwitch(BootstrapStageReport& stage,
+                           const Context& context,
+                           const CostModel& model,
+                           long ptxtSpace)
+{
+  double before = keySwitchInputBits(context);
+  double after = keySwitchOutputBits(context, model, ptxtSpace);
+  setCapacities(stage, before, after);
+
+  // The switch to the bootstrapping key at the input level, then the inner
+  // product at the top of the chain, with the NTTs of the two parts
+  model.keySwitches(stage, model.primes(before, before, ptxtSpace), 1, 1);
+  long n = context.getCtxtPrimes().card();
+  model.ntts(stage, 2 * n);
+  model.scalarMults(stage, n, 2);
+}
+
+void finishEstimate(BootstrapReport& report)
+{
+  for (const auto& stage : report.stages) {
+    report.wallSeconds += stage.wallSeconds;
+    report.cpuSeconds += stage.cpuSeconds;
+  }
+}
+
+} // namespace
+
+OperationCosts measureOperationCosts(const PubKey& publicKey, long repetitions)
+{
+  assertTrue<InvalidArgument>(repetitions > 0,
+                              "Must have positive repetitions");
+  const Context& context = publicKey.getContext();
+  Ctxt ctxt(publicKey);
+  publicKey.Encrypt(ctxt, NTL::ZZX(0));
+  const IndexSet& primes = ctxt.getPrimeSet();
+  long n = primes.card();
+  double total = double(n) * repetitions;
+
+  auto time = [repetitions](const std::function<void()>& f) {
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < repetitions; i++)
+      f();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+  };
+
+  OperationCosts costs;
+  NTL::ZZX poly;
+  for (long i = 0; i < context.getPhiM(); i++)
+    NTL::SetCoeff(poly, i, NTL::RandomBnd(context.getP()));
+  DoubleCRT dcrt(poly, context, primes);
+  costs.ntt = time([&]() { DoubleCRT fresh(poly, context, primes); }) / total;
+
+  long k = context.getZMStar().genToPow(-1, 1); // the Frobenius
+  DoubleCRT other(dcrt);
+  costs.automorphism = time([&]() { other.automorph(k); }) / total;
+  costs.scalarMult = time([&]() { other *= dcrt; }) / total;
+
+  // What a relinearization takes beyond its NTTs is the key switching
+  Ctxt product(ctxt);
+  product.multLowLvl(ctxt);
+  OpCounts ops;
+  double seconds;
+  {
+    OpCountScope scope;
+    seconds = time([&]() {
+      Ctxt tmp(product);
+      tmp.reLinearize();
+    });
+    ops = scope.counts();
+  }
+  long nDigits = 0;
+  for (const IndexSet& digit : context.getDigits())
+    if (!empty(digit))
+      nDigits++;
+  long products = std::max(1L, ops[OpType::KeySwitch]) *
+                  std::max(1L, nDigits) *
+                  (n + context.getSpecialPrimes().card());
+  costs.keySwitch =
+      std::max(0.0, seconds - ops[OpType::NTT] * costs.ntt) / products;
+  return costs;
+}
+
+BootstrapReport estimateThinReCrypt(const Context& context,
+                                    const OperationCosts& costs,
+                                    bool our_version,
+                                    bool lazy)
+{
+  assertTrue<LogicError>(context.isBootstrappable(),
+                         "Cannot estimate bootstrapping of a context that is "
+                         "not bootstrappable");
+  const ThinRecryptData& rcData = context.getRcData();
+  long p = context.getP();
+  long r = context.getAlMod().getR();
+  long botHigh = rcData.e - rcData.ePrime;
+  long p2r = context.getAlMod().getPPowR();
+  long bootSpace = NTL::power_long(p, botHigh + r);
+  long nDims = rcData.mvec.length();
+  CostModel model(context, costs);
+
+  BootstrapReport report;
+  report.digits = botHigh;
+
+  // slotToCoeff runs on the input, it must leave enough for the key switch
+  BootstrapStageReport& slotToCoeff = report.stage("slotToCoeff");
+  double after = keySwitchInputBits(context);
+  double before = after + nDims * model.constantBits(p2r);
+  setCapacities(slotToCoeff, before, after);
+  std::map<long, std::set<long>> autos;
+  rcData.slotToCoeff->automorphisms(autos);
+  model.linearMap(slotToCoeff, model.primes(before, after, p2r), autos);
+
+  estimateBootKeySwitch(report.stage("bootKeySwitch"),
+                        context,
+                        model,
+                        bootSpace);
+
+  BootstrapStageReport& coeffToSlot = report.stage("coeffToSlot");
+  before = report.stages.back().capacityAfter;
+  after = before - nDims * model.constantBits(bootSpace);
+  setCapacities(coeffToSlot, before, after);
+  autos.clear();
+  rcData.coeffToSlot->automorphisms(autos);
+  model.linearMap(coeffToSlot, model.primes(before, after, bootSpace), autos);
+
+  BootstrapStageReport& digitExtraction = report.stage("digitExtraction");
+  long multiplications, depth;
+  extractionCost(multiplications,
+                 depth,
+                 context,
+                 botHigh,
+                 r,
+                 our_version,
+                 lazy);
+  before = after;
+  after = before - depth * model.multiplicationBits(bootSpace);
+  setCapacities(digitExtraction, before, after);
+  model.multiplications(digitExtraction,
+                        model.primes(before, after, bootSpace),
+                        multiplications);
+
+  finishEstimate(report);
+  return report;
+}
+
+BootstrapReport estimateReCrypt(const Context& context,
+                                const OperationCosts& costs,
+                                bool our_version,
+                                bool lazy)
+{
+  const ThinRecryptData& rcData = context.getRcData();
+  assertTrue<LogicError>(context.isBootstrappable() && rcData.firstMap &&
+                             rcData.secondMap,
+                         "Cannot estimate thick bootstrapping of a context "
+                         "without its linear maps");
+  long p = context.getP();
+  long r = context.getAlMod().getR();
+  long d = context.getOrdP();
+  long botHigh = rcData.e - rcData.ePrime;
+  long p2r = context.getAlMod().getPPowR();
+  long bootSpace = NTL::power_long(p, botHigh + r);
+  long nDims = rcData.mvec.length();
+  CostModel model(context, costs);
+
+  BootstrapReport report;
+  report.digits = botHigh;
+
+  estimateBootKeySwitch(report.stage("bootKeySwitch"),
+                        context,
+                        model,
+                        bootSpace);
+
+  BootstrapStageReport& coeffToSlot = report.stage("coeffToSlot");
+  double before = report.stages.back().capacityAfter;
+  double after = before - nDims * model.constantBits(bootSpace);
+  setCapacities(coeffToSlot, before, after);
+  std::map<long, std::set<long>> autos;
+  rcData.firstMap->automorphisms(autos);
+  model.linearMap(coeffToSlot, model.primes(before, after, bootSpace), autos);
+
+  // The slots are unpacked with d - 1 hoisted Frobenius automorphisms and
+  // d^2 constants, the digits of the d unpacked ciphertexts are extracted
+  // and they are packed again with d constants
+  BootstrapStageReport& digitExtraction = report.stage("digitExtraction");
+  long multiplications, depth;
+  extractionCost(multiplications,
+                 depth,
+                 context,
+                 botHigh,
+                 r,
+                 our_version,
+                 lazy);
+  before = after;
+  after = before - model.constantBits(bootSpace) -
+          depth * model.multiplicationBits(bootSpace) -
+          model.constantBits(p2r);
+  setCapacities(digitExtraction, before, after);
+  long n = model.primes(before, after, bootSpace);
+  model.keySwitches(digitExtraction, n, d - 1, 1);
+  model.automorphisms(digitExtraction, n, d - 1);
+  model.scalarMults(digitExtraction, n, d * d + d);
+  model.multiplications(digitExtraction, n, d * multiplications);
+
+  BootstrapStageReport& slotToCoeff = report.stage("slotToCoeff");
+  before = after;
+  after = before - nDims * model.constantBits(p2r);
+  setCapacities(slotToCoeff, before, after);
+  autos.clear();
+  rcData.secondMap->automorphisms(autos);
+  model.linearMap(slotToCoeff, model.primes(before, after, p2r), autos);
+
+  finishEstimate(report);
+  return report;
+}
+
+} // namespace helib
@@ -0,0 +1,114 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <helib/bootstrapReport.h>
+
+#include <sys/resource.h>
+
+#include "io.h"
+
+namespace helib {
+
+BootstrapStageReport& BootstrapReport::stage(const std::string& name)
+{
+  for (auto& s : stages)
+    if (s.name == name)
+      return s;
+  stages.emplace_back();
+  stages.back().name = name;
+  return stages.back();
+}
+
+long BootstrapReport::initialCapacity() const
+{
+  return stages.empty() ? 0 : stages.front().capacityBefore;
+}
+
+long BootstrapReport::finalCapacity() const
+{
+  return stages.empty() ? 0 : stages.back().capacityAfter;
+}
+
+void BootstrapReport::writeToJSON(std::ostream& str) const
+{
+  executeRedirectJsonError<void>([&]() { str << writeToJSON(); });
+}
+
+JsonWrapper BootstrapReport::writeToJSON() const
+{
+  auto body = [this]() {
+    json jstages = json::array();
+    for (const auto& s : this->stages) {
+      json jops;
+      for (std::size_t i = 0; i < OP_TYPES; i++)
+        jops[opName(OpType(i))] = s.ops.counts[i];
+      jstages.push_back({{"name", s.name},
+                         {"wallSeconds", s.wallSeconds},
+                         {"cpuSeconds", s.cpuSeconds},
+                         {"capacityBefore", s.capacityBefore},
+                         {"capacityAfter", s.capacityAfter},
+                         {"capacityConsumed", s.capacityConsumed()},
+                         {"operations", jops},
+                         {"peakMemoryKB", s.peakMemoryKB},
+                         {"residuePeakBytes", s.residuePeakBytes},
+                         {"residueAllocatedBytes", s.residueAllocatedBytes}});
+    }
+
+    json j = {{"digits", this->digits},
+              {"wallSeconds", this->wallSeconds},
+              {"cpuSeconds", this->cpuSeconds},
+              {"initialCapacity", this->initialCapacity()},
+              {"finalCapacity", this->finalCapacity()},
+              {"peakMemoryKB", this->peakMemoryKB},
+              {"stages", jstages}};
+
+    return wrap(toTypedJson<BootstrapReport>(j));
+  };
+  return executeRedirectJsonError<JsonWrapper>(body);
+}
+
+std::ostream& operator<<(std::ostream& str, const BootstrapReport& report)
+{
+  str << "Number of digits to extract: " << report.digits << std::endl;
+  str << "Execution time (seconds, wall / cpu)" << std::endl;
+  for (const auto& s : report.stages)
+    str << "- " << s.name << ": " << s.wallSeconds << " / "
+        << s.cpuSeconds << std::endl;
+  str << "- Total: " << report.wallSeconds << " / "
+      << report.cpuSeconds << std::endl;
+  str << "Noise capacity (bits consumed)" << std::endl;
+  for (const auto& s : report.stages)
+    str << "- " << s.name << ": " << s.capacityConsumed() << std::endl;
+  str << "- Remaining: " << report.finalCapacity() << std::endl;
+  str << "Operations" << std::endl;
+  for (const auto& s : report.stages)
+    str << "- " << s.name << ": " << s.ops << std::endl;
+  str << "Residue memory (peak / allocated bytes)" << std::endl;
+  for (const auto& s : report.stages)
+    str << "- " << s.name << ": " << s.residuePeakBytes << " / "
+        << s.residueAllocatedBytes << std::endl;
+  str << "Peak memory: " << report.peakMemoryKB << " KB" << std::endl;
+  return str;
+}
+
+long peakMemoryKB()
+{
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024; // bytes on macOS
+#else
+  return usage.ru_maxrss;
+#endif
+}
+
+} // namespace helib
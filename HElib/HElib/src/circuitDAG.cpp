@@ -0,0 +1,220 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <helib/circuitDAG.h>
+
+#include <algorithm>
+#include <climits>
+#include <memory>
+
+#include <helib/assertions.h>
+#include <helib/Context.h>
+#include <helib/Ctxt.h>
+#include <helib/keys.h>
+#include <helib/opCounters.h>
+#include <helib/refreshPolicy.h>
+#include <helib/timing.h>
+
+namespace helib {
+
+CircuitDAG::Wire CircuitDAG::input(const Ctxt* ct)
+{
+  nodes.push_back({Op::INPUT, -1, -1, ct, 0, 0});
+  return size() - 1;
+}
+
+std::vector<CircuitDAG::Wire> CircuitDAG::inputs(const CtPtrs& v)
+{
+  std::vector<Wire> wires;
+  for (long i = 0; i < lsize(v); i++)
+    wires.push_back(input(v.isSet(i) ? v[i] : nullptr));
+  return wires;
+}
+
+CircuitDAG::Wire CircuitDAG::add(Wire a, Wire b)
+{
+  return addNode(Op::ADD, a, b);
+}
+
+CircuitDAG::Wire CircuitDAG::multiply(Wire a, Wire b)
+{
+  return addNode(Op::MULT, a, b);
+}
+
+CircuitDAG::Wire CircuitDAG::negate(Wire a) { return addNode(Op::NOT, a, a); }
+
+long CircuitDAG::multDepth(Wire w) const
+{
+  assertInRange<InvalidArgument>(w, 0l, size(), "Not a wire of the circuit");
+  return nodes[w].multDepth;
+}
+
+CircuitDAG::Wire CircuitDAG::addNode(Op op, Wire a, Wire b)
+{
+  assertInRange<InvalidArgument>(a, 0l, size(), "Not a wire of the circuit");
+  assertInRange<InvalidArgument>(b, 0l, size(), "Not a wire of the circuit");
+  const Node& x = nodes[a];
+  const Node& y = nodes[b];
+  long layer = std::max(x.layer, y.layer) + 1;
+  long depth = std::max(x.multDepth, y.multDepth) + (op == Op::MULT ? 1 : 0);
+  nodes.push_back({op, a, b, nullptr, layer, depth});
+  return size() - 1;
+}
+
+void CircuitDAG::apply(CtPtrs& out,
+                       const std::vector<Wire>& outputs,
+                       std::vector<zzX>* unpackSlotEncoding)
+{
+  HELIB_TIMER_START;
+  recrypts = 0;
+  long n = size();
+  for (Wire w : outputs)
+    assertInRange<InvalidArgument>(w, 0l, n, "Not a wire of the circuit");
+  if (outputs.empty()) {
+    setLengthZero(out);
+    return;
+  }
+
+  // Any input ciphertext, to build the others like it
+  const Ctxt* like = nullptr;
+  for (const Node& node : nodes)
+    if (node.op == Op::INPUT && node.source != nullptr) {
+      like = node.source;
+      break;
+    }
+  assertNotNull<InvalidArgument>(like, "The circuit has no input ciphertext");
+  const Context& context = like->getContext();
+  const long bpl = context.BPL();
+
+  // The products still ahead of every node on the way to the outputs (-1 if
+  // no output depends on it), and the last layer that reads its value
+  std::vector<long> ahead(n, -1);
+  std::vector<long> lastUse(n, -1);
+  for (Wire w : outputs) {
+    ahead[w] = 0;
+    lastUse[w] = LONG_MAX; // the outputs are kept to the end
+  }
+  long nLayers = 0;
+  for (long i = n - 1; i >= 0; --i) {
+    const Node& node = nodes[i];
+    if (ahead[i] < 0 || node.op == Op::INPUT)
+      continue;
+    nLayers = std::max(nLayers, node.layer + 1);
+    long cost = ahead[i] + (node.op == Op::MULT ? 1 : 0);
+    for (Wire w : {node.a, node.b}) {
+      ahead[w] = std::max(ahead[w], cost);
+      lastUse[w] = std::max(lastUse[w], node.layer);
+    }
+  }
+  std::vector<std::vector<Wire>> layers(nLayers);
+  for (long i = 0; i < n; i++)
+    if (ahead[i] >= 0 && nodes[i].op != Op::INPUT)
+      layers[nodes[i].layer].push_back(i);
+
+  // The computed values. An input only gets one if it is bootstrapped, and a
+  // null value is a zero.
+  std::vector<std::unique_ptr<Ctxt>> values(n);
+  auto valueOf = [&](Wire w) -> const Ctxt* {
+    if (values[w])
+      return values[w].get();
+    return (nodes[w].op == Op::INPUT) ? nodes[w].source : nullptr;
+  };
+  auto capacityOf = [&](Wire w) -> long {
+    const Ctxt* ct = valueOf(w);
+    return (ct == nullptr || ct->isEmpty()) ? LONG_MAX : ct->bitCapacity();
+  };
+  // Whether a product of the layer would leave less than one level
+  auto lacksCapacity = [&](const std::vector<Wire>& layer) {
+    for (Wire w : layer)
+      if (nodes[w].op == Op::MULT && (capacityOf(nodes[w].a) < 2 * bpl ||
+                                      capacityOf(nodes[w].b) < 2 * bpl))
+        return true;
+    return false;
+  };
+
+  // The circuit places its own bootstrapping
+  RefreshPolicy::Suspend suspend;
+
+  for (long l = 0; l < nLayers; l++) {
+    const std::vector<Wire>& layer = layers[l];
+
+    if (lacksCapacity(layer)) {
+      assertNotNull<InvalidArgument>(unpackSlotEncoding,
+                                     "unpackSlotEncoding must not be null");
+      assertTrue(like->getPubKey().isBootstrappable(),
+                 "public key must be bootstrappable for recryption");
+
+      // Every live value short of the capacity for the products ahead
+      std::vector<Ctxt*> batch;
+      for (long i = 0; i < n; i++) {
+        bool computed = nodes[i].op == Op::INPUT || nodes[i].layer < l;
+        if (!computed || lastUse[i] < l)
+          continue;
+        long capacity = capacityOf(i);
+        if (capacity == LONG_MAX || capacity >= (ahead[i] + 1) * bpl)
+          continue;
+        if (!values[i]) // bootstrap a copy of the input
+          values[i].reset(new Ctxt(*nodes[i].source));
+        batch.push_back(values[i].get());
+      }
+      packedRecrypt(CtPtrs_vectorPt(batch),
+                    *unpackSlotEncoding,
+                    context.getEA());
+      recrypts++;
+      if (lacksCapacity(layer))
+        throw LogicError("not enough levels for circuit DAG");
+    }
+
+    // The nodes of a layer only read the values of earlier layers
+    HELIB_EXEC_INDEX(lsize(layer), k)
+    Wire w = layer[k];
+    const Node& node = nodes[w];
+    const Ctxt* x = valueOf(node.a);
+    const Ctxt* y = valueOf(node.b);
+    std::unique_ptr<Ctxt> result(
+        (x == nullptr) ? new Ctxt(ZeroCtxtLike, *like) : new Ctxt(*x));
+    switch (node.op) {
+    case Op::ADD:
+      if (y != nullptr)
+        *result += *y;
+      break;
+    case Op::MULT:
+      if (result->isEmpty() || y == nullptr || y->isEmpty())
+        result->clear(); // the product is zero if any operand is
+      else
+        result->multiplyBy(*y);
+      break;
+    case Op::NOT:
+      result->addConstant(NTL::ZZX(1L));
+      break;
+    case Op::INPUT:
+      break;
+    }
+    values[w] = std::move(result);
+    HELIB_EXEC_INDEX_END
+
+    // Release the values that no later layer reads
+    for (long i = 0; i < n; i++)
+      if (lastUse[i] == l)
+        values[i].reset();
+  }
+
+  resize(out, lsize(outputs), *like);
+  for (long i = 0; i < lsize(outputs); i++) {
+    const Ctxt* ct = valueOf(outputs[i]);
+    if (ct == nullptr)
+      out[i]->clear();
+    else
+      *out[i] = *ct;
+  }
+}
+
+} // namespace helib
@@ -0,0 +1,58 @@
+/* Copyright (C) 2021 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+// The constants of CRT reconstruction and fast base conversion over a set
+// of primes q_j, see Context::getCRTTable.
+//
+// With Q the product of the q_j and Q_j = Q / q_j, the residues r_j of an
+// integer c mod Q give y_j = r_j * Q_j^{-1} mod q_j and
+//    c = sum_j y_j * Q_j - v * Q,   v = floor(sum_j y_j / q_j),
+// which DoubleCRT::toPolys evaluates with multi-precision integers, and
+// DoubleCRT::scaleToModulus and the ModDownTable in word-size arithmetic.
+
+#ifndef HELIB_CRT_TABLE_H
+#define HELIB_CRT_TABLE_H
+
+#include <vector>
+
+#include <NTL/ZZ.h>
+#include <NTL/ZZVec.h>
+
+#include <helib/IndexSet.h>
+
+namespace helib {
+
+class Context;
+
+struct CRTTable
+{
+  // The indexes and values of the primes q_j, and 1/q_j
+  std::vector<long> indexes;
+  std::vector<long> primes;
+  std::vector<double> recip;
+
+  // Q_j^{-1} mod q_j, with its companion
+  std::vector<long> hatInv;
+  std::vector<NTL::mulmod_precon_t> hatInvPrecon;
+
+  // Q, (Q+1)/2 and the Q_j (each with room for Q, as the reconstruction
+  // of toPolys multiplies them in place)
+  NTL::ZZ product;
+  NTL::ZZ productHalf;
+  NTL::ZZVec hat;
+
+  CRTTable(const Context& context, const IndexSet& s);
+};
+
+} // namespace helib
+
+#endif // HELIB_CRT_TABLE_H
@@ -17,6 +17,8 @@
 #include <helib/Ctxt.h>
 #include <helib/EncryptedArray.h>
 
+#include "crtTable.h"
+
 namespace helib {
 
 SecKey* dbgKey = nullptr;
@@ -185,8 +187,7 @@ void CheckCtxt(const Ctxt& c, const char* label)
     NTL::Vec<NTL::ZZ> powerful;
     rcData.p2dConv->ZZXtoPowerful(powerful, pp);
 
-    NTL::ZZ q;
-    q = context.productOfPrimes(c1.getPrimeSet());
+    const NTL::ZZ& q = context.getCRTTable(c1.getPrimeSet()).product;
     vecRed(powerful, powerful, q, false);
 
     NTL::ZZX pp_alt;
@@ -0,0 +1,86 @@
+/* Copyright (C) 2021 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <helib/digitCompare.h>
+
+#include <helib/polyEval.h>
+#include <helib/timing.h>
+
+namespace helib {
+
+// The 0/1 indicator of x < 0 mod p^e, from x in [-p^(e-1), p^(e-1)) mod p^e
+static void isNegativeLifted(Ctxt& ctxt, RelinPolicy policy)
+{
+  long e = ctxt.effectiveR();
+  homIsNegative(ctxt, policy);
+  liftDigit(ctxt, e);
+}
+
+void homIsNegative(Ctxt& ctxt, RelinPolicy policy)
+{
+  HELIB_TIMER_START;
+  long e = ctxt.effectiveR();
+  long top = NTL::power_long(ctxt.getContext().getP(), e - 1);
+
+  // floor((x + p^(e-1)) / p^(e-1)) is 1 for x >= 0 and 0 for x < 0
+  ctxt.addConstant(top);
+  homDivideByPk(ctxt, e - 1, policy);
+  ctxt.negate();
+  ctxt.addConstant(1l);
+}
+
+void homIsLessThan(Ctxt& result,
+                   const Ctxt& a,
+                   const Ctxt& b,
+                   RelinPolicy policy)
+{
+  result = a;
+  result -= b;
+  homIsNegative(result, policy);
+}
+
+void homSign(Ctxt& ctxt, RelinPolicy policy)
+{
+  HELIB_TIMER_START;
+  isNegativeLifted(ctxt, policy);
+  ctxt.multByConstant(-2l);
+  ctxt.addConstant(1l);
+}
+
+void homMax(Ctxt& result, const Ctxt& a, const Ctxt& b, RelinPolicy policy)
+{
+  HELIB_TIMER_START;
+
+  // max(a, b) = a - [a < b] * (a - b)
+  Ctxt diff(a);
+  diff -= b;
+  Ctxt less(diff);
+  isNegativeLifted(less, policy);
+  less.multiplyBy(diff);
+  result = a;
+  result -= less;
+}
+
+void homMin(Ctxt& result, const Ctxt& a, const Ctxt& b, RelinPolicy policy)
+{
+  HELIB_TIMER_START;
+
+  // min(a, b) = b + [a < b] * (a - b)
+  Ctxt diff(a);
+  diff -= b;
+  Ctxt less(diff);
+  isNegativeLifted(less, policy);
+  less.multiplyBy(diff);
+  result = b;
+  result += less;
+}
+
+} // namespace helib
@@ -0,0 +1,324 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <helib/digitProgram.h>
+#include <helib/digitSimulation.h>
+#include <helib/fixedProgram.h>
+#include <helib/Ctxt.h>
+#include <helib/assertions.h>
+#include <helib/exceptions.h>
+
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <sstream>
+
+namespace helib {
+
+DigitProgram DigitProgram::parse(std::istream& str)
+{
+  DigitProgram program;
+  std::string line;
+  while (std::getline(str, line)) {
+    std::istringstream tokens(line);
+    std::string op;
+    if (!(tokens >> op) || op[0] == '#')
+      continue;
+
+    std::vector<std::string> args;
+    for (std::string arg; tokens >> arg;)
+      args.push_back(arg);
+    try {
+      if (op == "square" && args.size() == 1) {
+        program.addSquare(std::stol(args[0]));
+      } else if (op == "mul" && args.size() == 2) {
+        program.addMultiply(std::stol(args[0]), std::stol(args[1]));
+      } else if (op == "lin" && !args.empty() && args.size() % 2 == 0) {
+        std::vector<std::pair<NTL::ZZ, long>> terms;
+        for (std::size_t i = 0; i < args.size(); i += 2)
+          terms.emplace_back(NTL::conv<NTL::ZZ>(args[i].c_str()),
+                             std::stol(args[i + 1]));
+        program.addCombine(terms);
+      } else if (op == "output" && args.size() == 2) {
+        program.addOutput(std::stol(args[0]), std::stol(args[1]));
+      } else {
+        throw InvalidArgument("Malformed digit program line: " + line);
+      }
+    } catch (const std::logic_error&) { // std::stol failures
+      throw InvalidArgument("Malformed digit program line: " + line);
+    }
+  }
+  return program;
+}
+
+DigitProgram DigitProgram::read(const std::string& fileName)
+{
+  std::ifstream str(fileName);
+  if (!str)
+    throw IOError("Could not open digit program " + fileName);
+  return parse(str);
+}
+
+DigitProgram DigitProgram::binary()
+{
+  // Same instructions as the compile-time version
+  DigitProgram program;
+  for (const FixedInstruction& instruction : BINARY_DIGIT_CHAIN.instructions) {
+    const long* args = instruction.args;
+    switch (instruction.op) {
+    case FixedInstruction::Square:
+      program.addSquare(args[0]);
+      break;
+    case FixedInstruction::Multiply:
+      program.addMultiply(args[0], args[1]);
+      break;
+    case FixedInstruction::Combine: {
+      std::vector<std::pair<NTL::ZZ, long>> terms;
+      for (std::size_t j = 0; j < FixedInstruction::MAX_TERMS && args[j] >= 0;
+           j++)
+        terms.emplace_back(NTL::to_ZZ(instruction.coeffs[j]), args[j]);
+      program.addCombine(terms);
+      break;
+    }
+    }
+  }
+  for (std::size_t k = 0; k < BINARY_DIGIT_CHAIN.outputCount(); k++)
+    program.addOutput(BINARY_DIGIT_CHAIN.outputs[k],
+                      BINARY_DIGIT_CHAIN.precisions[k]);
+  return program;
+}
+
+bool DigitProgram::operator==(const DigitProgram& other) const
+{
+  if (instructions.size() != other.instructions.size() ||
+      outputs != other.outputs)
+    return false;
+  for (std::size_t i = 0; i < instructions.size(); i++) {
+    const Instruction& a = instructions[i];
+    const Instruction& b = other.instructions[i];
+    if (a.op != b.op || a.args != b.args || a.coeffs != b.coeffs)
+      return false;
+  }
+  return true;
+}
+
+void DigitProgram::checkRegister(long reg) const
+{
+  assertInRange<InvalidArgument>(reg,
+                                 0l,
+                                 registers(),
+                                 "Digit program reads an undefined register");
+}
+
+long DigitProgram::addSquare(long a)
+{
+  checkRegister(a);
+  instructions.push_back({Op::Square, {a}, {}});
+  return instructions.size();
+}
+
+long DigitProgram::addMultiply(long a, long b)
+{
+  if (a == b)
+    return addSquare(a);
+  checkRegister(a);
+  checkRegister(b);
+  instructions.push_back({Op::Multiply, {a, b}, {}});
+  return instructions.size();
+}
+
+long DigitProgram::addCombine(
+    const std::vector<std::pair<NTL::ZZ, long>>& terms)
+{
+  // Merge repeated registers and drop zero coefficients, so that every
+  // argument is read once
+  Instruction instruction{Op::Combine, {}, {}};
+  for (const auto& term : terms) {
+    checkRegister(term.second);
+    auto it = std::find(instruction.args.begin(),
+                        instruction.args.end(),
+                        term.second);
+    if (it == instruction.args.end()) {
+      instruction.args.push_back(term.second);
+      instruction.coeffs.push_back(term.first);
+    } else {
+      instruction.coeffs[it - instruction.args.begin()] += term.first;
+    }
+  }
+  for (std::size_t i = instruction.args.size(); i-- > 0;)
+    if (instruction.coeffs[i] == 0) {
+      instruction.args.erase(instruction.args.begin() + i);
+      instruction.coeffs.erase(instruction.coeffs.begin() + i);
+    }
+  assertFalse<InvalidArgument>(instruction.args.empty(),
+                               "Linear combination without terms");
+  instructions.push_back(std::move(instruction));
+  return instructions.size();
+}
+
+void DigitProgram::addOutput(long reg, long precision)
+{
+  checkRegister(reg);
+  assertTrue<InvalidArgument>(precision > getMaxPrecision(),
+                              "Outputs must have increasing precision");
+  outputs.emplace_back(reg, precision);
+}
+
+long DigitProgram::outputsFor(long rowSize) const
+{
+  long count = 0;
+  for (long precision = 1; count < (long)outputs.size() && rowSize > precision;
+       count++)
+    precision = outputs[count].second;
+  return count;
+}
+
+std::vector<bool> DigitProgram::needed(long nOutputs) const
+{
+  std::vector<bool> live(registers(), false);
+  for (long k = 0; k < nOutputs; k++)
+    live[outputs[k].first] = true;
+  for (long i = instructions.size() - 1; i >= 0; i--)
+    if (live[i + 1])
+      for (long a : instructions[i].args)
+        live[a] = true;
+  return live;
+}
+
+void DigitProgram::cost(long& multiplications, long& depth, long rowSize) const
+{
+  long nOutputs = outputsFor(rowSize);
+  std::vector<bool> live = needed(nOutputs);
+  std::vector<long> levels(registers(), 0);
+  multiplications = 0;
+  for (long i = 0; i < (long)instructions.size(); i++) {
+    if (!live[i + 1])
+      continue;
+    const Instruction& instruction = instructions[i];
+    for (long a : instruction.args)
+      levels[i + 1] = std::max(levels[i + 1], levels[a]);
+    if (instruction.op != Op::Combine) {
+      levels[i + 1]++;
+      multiplications++;
+    }
+  }
+  depth = 0;
+  for (long k = 0; k < nOutputs; k++)
+    depth = std::max(depth, levels[outputs[k].first]);
+}
+
+void DigitProgram::evaluate(std::vector<std::pair<Ctxt, long>>& ctxtEval,
+                            const Ctxt& x,
+                            long rowSize) const
+{
+  long nOutputs = outputsFor(rowSize);
+  if (nOutputs == 0)
+    return;
+  std::vector<bool> live = needed(nOutputs);
+
+  // Last instruction reading each register, outputs are kept until the end
+  long end = instructions.size();
+  std::vector<long> lastUse(registers(), -1);
+  for (long i = 0; i < end; i++)
+    if (live[i + 1])
+      for (long a : instructions[i].args)
+        lastUse[a] = i;
+  for (long k = 0; k < nOutputs; k++)
+    lastUse[outputs[k].first] = end;
+
+  std::vector<std::shared_ptr<Ctxt>> reg(registers());
+  reg[0] = std::make_shared<Ctxt>(x);
+  for (long i = 0; i < end; i++) {
+    if (!live[i + 1])
+      continue;
+    const Instruction& instruction = instructions[i];
+
+    // The result is computed in the storage of the first argument if this
+    // is the last instruction reading it
+    long first = instruction.args[0];
+    std::shared_ptr<Ctxt> result = (lastUse[first] == i)
+                                       ? std::move(reg[first])
+                                       : std::make_shared<Ctxt>(*reg[first]);
+    switch (instruction.op) {
+    case Op::Square:
+      result->square();
+      break;
+    case Op::Multiply:
+      result->multiplyBy(*reg[instruction.args[1]]);
+      break;
+    case Op::Combine:
+      if (instruction.coeffs[0] != 1)
+        result->multByConstant(instruction.coeffs[0]);
+      for (std::size_t j = 1; j < instruction.args.size(); j++)
+        result->addScaledCtxt(*reg[instruction.args[j]], instruction.coeffs[j]);
+      break;
+    }
+    reg[i + 1] = std::move(result);
+
+    for (long a : instruction.args)
+      if (lastUse[a] == i)
+        reg[a].reset();
+  }
+
+  for (long k = 0; k < nOutputs; k++)
+    ctxtEval.emplace_back(*reg[outputs[k].first], outputs[k].second);
+}
+
+// Same instructions as evaluate, plaintext registers are cheap enough to
+// be kept until the end
+template <typename T>
+void DigitProgram::simulate(
+    std::vector<std::pair<SimulatedCtxt<T>, long>>& ctxtEval,
+    const SimulatedCtxt<T>& x,
+    long rowSize) const
+{
+  long nOutputs = outputsFor(rowSize);
+  if (nOutputs == 0)
+    return;
+  std::vector<bool> live = needed(nOutputs);
+
+  std::vector<SimulatedCtxt<T>> reg(registers(), x);
+  for (long i = 0; i < (long)instructions.size(); i++) {
+    if (!live[i + 1])
+      continue;
+    const Instruction& instruction = instructions[i];
+    SimulatedCtxt<T> result(reg[instruction.args[0]]);
+    switch (instruction.op) {
+    case Op::Square:
+      result.square();
+      break;
+    case Op::Multiply:
+      result.multiplyBy(reg[instruction.args[1]]);
+      break;
+    case Op::Combine:
+      if (instruction.coeffs[0] != 1)
+        result.multByConstant(instruction.coeffs[0]);
+      for (std::size_t j = 1; j < instruction.args.size(); j++)
+        result.addScaledCtxt(reg[instruction.args[j]], instruction.coeffs[j]);
+      break;
+    }
+    reg[i + 1] = std::move(result);
+  }
+
+  for (long k = 0; k < nOutputs; k++)
+    ctxtEval.emplace_back(reg[outputs[k].first], outputs[k].second);
+}
+
+template void DigitProgram::simulate(
+    std::vector<std::pair<SimulatedCtxt<long>, long>>& ctxtEval,
+    const SimulatedCtxt<long>& x,
+    long rowSize) const;
+template void DigitProgram::simulate(
+    std::vector<std::pair<SimulatedCtxt<NTL::ZZ>, long>>& ctxtEval,
+    const SimulatedCtxt<NTL::ZZ>& x,
+    long rowSize) const;
+
+} // namespace helib
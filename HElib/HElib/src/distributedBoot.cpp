@@ -0,0 +1,265 @@
+/* Copyright (C) 2021 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <helib/distributedBoot.h>
+
+#include <memory>
+#include <sstream>
+#include <string>
+
+#include <helib/Context.h>
+#include <helib/assertions.h>
+#include <helib/keys.h>
+#include <helib/range.h>
+
+#include "binio.h"
+
+namespace helib {
+
+namespace {
+
+// The frames of the protocol. The coordinator sends SETUP once, then SHARDs,
+// and CLOSE at the end; the worker answers every SHARD with DONE or FAILED.
+enum Frame : long
+{
+  CLOSE = 0,
+  SETUP = 1,
+  SHARD = 2,
+  DONE = 3,
+  FAILED = 4
+};
+
+// Bumped whenever the frames change
+constexpr long PROTOCOL_VERSION = 1;
+
+void checkStream(const std::ios& str, const char* what)
+{
+  assertTrue<IOError>(bool(str), std::string("Bootstrap connection: ") + what);
+}
+
+void writeString(std::ostream& str, const std::string& s)
+{
+  write_raw_int(str, s.size());
+  str.write(s.data(), s.size());
+}
+
+std::string readString(std::istream& str)
+{
+  long n = read_raw_int(str);
+  checkStream(str, "could not read a message");
+  std::string s(n, '\0');
+  str.read(&s[0], n);
+  return s;
+}
+
+// One shard: the positions of its ciphertexts in the stream
+struct Shard
+{
+  std::vector<long> positions;
+  bool empty() const { return positions.empty(); }
+};
+
+} // namespace
+
+BootstrapCoordinator::BootstrapCoordinator(
+    const PubKey& key,
+    const std::vector<BootChannel>& workers,
+    bool thin,
+    long shardSize) :
+    key(key), channels(workers), shardSize(shardSize)
+{
+  assertTrue<InvalidArgument>(!workers.empty(),
+                              "BootstrapCoordinator: no workers");
+  assertTrue<InvalidArgument>(shardSize > 0,
+                              "BootstrapCoordinator: empty shards");
+  const Context& context = key.getContext();
+  assertTrue(context.isBootstrappable(),
+             "BootstrapCoordinator: the context is not bootstrappable");
+
+  // Serialize the setup once and copy it to every worker
+  std::ostringstream setup;
+  write_raw_int(setup, SETUP);
+  write_raw_int(setup, PROTOCOL_VERSION);
+  write_raw_int(setup, thin);
+  context.writeTo(setup);
+  context.writeBootstrapBundleTo(setup);
+  key.writeTo(setup);
+  const std::string bytes = setup.str();
+
+  for (const BootChannel& channel : channels) {
+    channel.out->write(bytes.data(), bytes.size());
+    channel.out->flush();
+    checkStream(*channel.out, "could not ship the context");
+  }
+}
+
+BootstrapCoordinator::~BootstrapCoordinator()
+{
+  try {
+    close();
+  } catch (...) {
+  }
+}
+
+void BootstrapCoordinator::close()
+{
+  if (!open)
+    return;
+  open = false;
+  for (const BootChannel& channel : channels) {
+    write_raw_int(*channel.out, CLOSE);
+    channel.out->flush();
+  }
+}
+
+long BootstrapCoordinator::bootstrap(
+    const std::function<bool(Ctxt&)>& next,
+    const std::function<void(long, Ctxt&)>& done)
+{
+  assertTrue(open, "BootstrapCoordinator: the connection is closed");
+
+  long taken = 0;
+  bool exhausted = false;
+
+  // Take the next shard from the source and send it to worker w
+  auto send = [&](long w) {
+    Shard shard;
+    std::ostream& out = *channels[w].out;
+    std::ostringstream frame;
+    Ctxt ctxt(key);
+    while (!exhausted && lsize(shard.positions) < shardSize) {
+      if (!next(ctxt)) {
+        exhausted = true;
+        break;
+      }
+      shard.positions.push_back(taken++);
+      ctxt.writeTo(frame);
+    }
+    if (!shard.empty()) {
+      write_raw_int(out, SHARD);
+      write_raw_int(out, lsize(shard.positions));
+      const std::string bytes = frame.str();
+      out.write(bytes.data(), bytes.size());
+      out.flush();
+      checkStream(out, "could not send a shard");
+    }
+    return shard;
+  };
+
+  // Every worker has at most one shard in flight. The results are collected
+  // from the workers in turn, and a worker gets its next shard as soon as
+  // its results are in.
+  std::vector<Shard> inFlight(channels.size());
+  for (long w : range(lsize(channels)))
+    inFlight[w] = send(w);
+
+  bool busy = true;
+  while (busy) {
+    busy = false;
+    for (long w : range(lsize(channels))) {
+      if (inFlight[w].empty())
+        continue;
+      busy = true;
+
+      std::istream& in = *channels[w].in;
+      long frame = read_raw_int(in);
+      checkStream(in, "could not read the results of a shard");
+      if (frame == FAILED)
+        throw RuntimeError("Bootstrap worker " + std::to_string(w) +
+                           " failed: " + readString(in));
+      assertEq<IOError>(frame, long(DONE), "Bootstrap connection: bad frame");
+      assertEq<IOError>(read_raw_int(in),
+                        lsize(inFlight[w].positions),
+                        "Bootstrap connection: bad shard size");
+
+      Ctxt ctxt(key);
+      for (long position : inFlight[w].positions) {
+        ctxt.read(in);
+        checkStream(in, "could not read a ciphertext");
+        done(position, ctxt);
+      }
+      inFlight[w] = send(w);
+    }
+  }
+  return taken;
+}
+
+void BootstrapCoordinator::bootstrap(std::vector<Ctxt>& ctxts)
+{
+  long i = 0;
+  bootstrap(
+      [&](Ctxt& ctxt) {
+        if (i == lsize(ctxts))
+          return false;
+        ctxt = ctxts[i++];
+        return true;
+      },
+      [&](long position, Ctxt& ctxt) { ctxts[position] = ctxt; });
+}
+
+long serveBootstrapWorker(std::istream& in, std::ostream& out)
+{
+  long frame = read_raw_int(in);
+  checkStream(in, "could not read the setup");
+  if (frame == CLOSE)
+    return 0;
+  assertEq<IOError>(frame, long(SETUP), "Bootstrap connection: bad frame");
+  assertEq<IOError>(read_raw_int(in),
+                    PROTOCOL_VERSION,
+                    "Bootstrap connection: unsupported protocol version");
+  bool thin = read_raw_int(in);
+
+  // The recryption data follows the context in the same stream
+  std::unique_ptr<Context> context(Context::readPtrFrom(in, in));
+  PubKey key = PubKey::readFrom(in, *context);
+  checkStream(in, "could not read the context and key");
+
+  long count = 0;
+  while (true) {
+    frame = read_raw_int(in);
+    checkStream(in, "could not read a frame");
+    if (frame == CLOSE)
+      break;
+    assertEq<IOError>(frame, long(SHARD), "Bootstrap connection: bad frame");
+
+    long n = read_raw_int(in);
+    std::vector<Ctxt> shard(n, Ctxt(key));
+    for (Ctxt& ctxt : shard)
+      ctxt.read(in);
+    checkStream(in, "could not read a shard");
+
+    std::ostringstream results;
+    try {
+      if (thin)
+        key.thinReCrypt(shard);
+      else
+        for (Ctxt& ctxt : shard)
+          key.reCrypt(ctxt);
+      write_raw_int(results, DONE);
+      write_raw_int(results, n);
+      for (const Ctxt& ctxt : shard)
+        ctxt.writeTo(results);
+      count += n;
+    } catch (const std::exception& err) {
+      results.str("");
+      write_raw_int(results, FAILED);
+      writeString(results, err.what());
+    }
+
+    const std::string bytes = results.str();
+    out.write(bytes.data(), bytes.size());
+    out.flush();
+    checkStream(out, "could not send the results");
+  }
+  return count;
+}
+
+} // namespace helib
@@ -0,0 +1,122 @@
+/* Copyright (C) 2021 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <helib/encryptionPool.h>
+
+#include <NTL/BasicThreadPool.h>
+#include <NTL/ZZ.h>
+
+#include <helib/EncodedPtxt.h>
+#include <helib/keys.h>
+#include <helib/opCounters.h>
+#include <helib/timing.h>
+
+#include "binio.h"
+
+namespace helib {
+
+EncryptionPool::EncryptionPool(const PubKey& publicKey) :
+    publicKey(publicKey),
+    ptxtSpace(publicKey.isCKKS() ? 1 : publicKey.getPtxtSpace())
+{}
+
+void EncryptionPool::fill(long n)
+{
+  HELIB_TIMER_START;
+
+  if (n <= 0)
+    return;
+
+  // The seeds are drawn in turn, so that the pool does not depend on the
+  // number of threads
+  std::vector<NTL::ZZ> seeds(n);
+  for (long i = 0; i < n; i++)
+    RandomBits(seeds[i], 256);
+
+  std::vector<Ctxt> fresh(n, Ctxt(publicKey));
+  HELIB_EXEC_RANGE(n, first, last)
+  NTL::RandomStreamPush push;
+  for (long i = first; i < last; i++) {
+    SetSeed(seeds[i]);
+    publicKey.encryptZero(fresh[i], ptxtSpace);
+  }
+  HELIB_EXEC_RANGE_END
+
+  std::lock_guard<std::mutex> lock(mutex);
+  for (Ctxt& zero : fresh)
+    zeros.push_back(std::move(zero));
+}
+
+long EncryptionPool::size() const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return zeros.size();
+}
+
+bool EncryptionPool::Encrypt(Ctxt& ctxt, const EncodedPtxt& eptxt)
+{
+  assertEq(&publicKey,
+           &ctxt.getPubKey(),
+           "EncryptionPool::Encrypt: public key mismatch");
+
+  bool pooled = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!zeros.empty()) {
+      ctxt = std::move(zeros.back());
+      zeros.pop_back();
+      pooled = true;
+    }
+  }
+  if (!pooled)
+    publicKey.encryptZero(ctxt, ptxtSpace);
+
+  if (eptxt.isBGV())
+    publicKey.addEncoded(ctxt, eptxt.getBGV());
+  else if (eptxt.isCKKS())
+    publicKey.addEncoded(ctxt, eptxt.getCKKS());
+  else
+    throw LogicError("EncryptionPool::Encrypt: bad EncodedPtxt");
+
+  return pooled;
+}
+
+void EncryptionPool::writeTo(std::ostream& str) const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  write_raw_int(str, zeros.size());
+  for (const Ctxt& zero : zeros)
+    zero.writeTo(str);
+}
+
+void EncryptionPool::read(std::istream& str)
+{
+  long n = read_raw_int(str);
+  assertTrue<IOError>(n >= 0, "EncryptionPool: bad number of ciphertexts");
+
+  std::vector<Ctxt> read;
+  read.reserve(n);
+  for (long i = 0; i < n; i++) {
+    read.push_back(Ctxt::readFrom(str, publicKey));
+    assertEq<IOError>(read.back().getPtxtSpace(),
+                      ptxtSpace,
+                      "EncryptionPool: plaintext space mismatch");
+    assertTrue<IOError>(read.back().getPrimeSet() ==
+                            publicKey.getContext().getCtxtPrimes(),
+                        "EncryptionPool: prime set mismatch");
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  for (Ctxt& zero : read)
+    zeros.push_back(std::move(zero));
+}
+
+} // namespace helib
@@ -17,6 +17,7 @@
 #include <helib/timing.h>
 #include <helib/EncryptedArray.h>
 #include <helib/Ptxt.h>
+#include <helib/Ctxt.h>
 
 #include <cstdio>
 
@@ -26,11 +27,13 @@ namespace helib {
 // Assumes that r=1, and that all the slot contain elements from GF(p^d).
 //
 // We compute x^{p^d-1} = x^{(1+p+...+p^{d-1})*(p-1)} by setting y=x^{p-1}
-// and then outputting y * y^p * ... * y^{p^{d-1}}, with exponentiation to
-// powers of p done via Frobenius.
-
-// FIXME: the computation of the "norm" y * y^p * ... * y^{p^{d-1}}
-// can be done using O(log d) automorphisms, rather than O(d).
+// and then outputting the "norm" y * y^p * ... * y^{p^{d-1}}, with
+// exponentiation to powers of p done via Frobenius.
+//
+// The norm is computed by repeated doubling over the bits of d: with
+// z_k = y * y^p * ... * y^{p^{k-1}}, we have z_{2k} = z_k * frob^k(z_k) and
+// z_{k+1} = z_k * frob^k(y). This takes about log d + popcount(d)
+// automorphisms and products, rather than d-1 of each.
 
 void mapTo01(const EncryptedArray& ea, Ctxt& ctxt)
 {
@@ -42,11 +45,21 @@ void mapTo01(const EncryptedArray& ea, Ctxt& ctxt)
     ctxt.power(p - 1); // set y = x^{p-1}
 
   long d = ea.getDegree();
-  if (d > 1) { // compute the product of the d automorphisms
-    std::vector<Ctxt> v(d, ctxt);
-    for (long i = 1; i < d; i++)
-      v[i].frobeniusAutomorph(i);
-    totalProduct(ctxt, v);
+  if (d > 1) { // compute the norm, ctxt holds z_k
+    const Ctxt y = ctxt;
+    long k = 1;
+    for (long bit = NTL::NumBits(d) - 2; bit >= 0; --bit) {
+      Ctxt tmp = ctxt;
+      tmp.frobeniusAutomorph(k);
+      ctxt.multiplyBy(tmp); // z_{2k}
+      k *= 2;
+      if (NTL::bit(d, bit)) {
+        tmp = y;
+        tmp.frobeniusAutomorph(k);
+        ctxt.multiplyBy(tmp); // z_{k+1}
+        k++;
+      }
+    }
   }
 }
 
@@ -0,0 +1,169 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <helib/equalityLookup.h>
+
+#include <helib/assertions.h>
+#include <helib/automorphPrecon.h>
+#include <helib/multicore.h>
+#include <helib/rotationPlanner.h>
+#include <helib/timing.h>
+
+namespace helib {
+
+// The doubling of totalSums over windows of w slots: slot j of ctxt gets the
+// sum (or product) of the slots j - t, or j + t if backward, for t < w. The
+// rotations of the original ciphertext, one for every bit of w below the top
+// one, are all computed up front.
+static void windowFold(const EncryptedArray& ea,
+                       Ctxt& ctxt,
+                       long w,
+                       bool backward,
+                       bool multiply)
+{
+  long n = ea.size();
+  if (w <= 1)
+    return;
+
+  auto amount = [&](long e) { return backward ? (n - e) % n : e % n; };
+  auto combine = [&](const Ctxt& other) {
+    if (multiply)
+      ctxt.multiplyBy(other);
+    else
+      ctxt += other;
+  };
+
+  long k = NTL::NumBits(w);
+  std::vector<long> origAmounts;
+  for (long i = k - 2, e = 1; i >= 0; i--) {
+    e = 2 * e;
+    if (NTL::bit(w, i)) {
+      origAmounts.push_back(amount(e));
+      e += 1;
+    }
+  }
+  const RotationPlanner& planner = ea.getRotationPlanner();
+  std::vector<Ctxt> origRotated = planner.rotations(ctxt, origAmounts);
+
+  long e = 1;
+  long next = 0;
+  for (long i = k - 2; i >= 0; i--) {
+    Ctxt tmp = ctxt;
+    planner.rotate(tmp, amount(e));
+    combine(tmp); // ctxt = ctxt op (ctxt >>> e)
+    e = 2 * e;
+
+    if (NTL::bit(w, i)) {
+      combine(origRotated[next++]); // ctxt = ctxt op (orig >>> e)
+      e += 1;
+    }
+  }
+}
+
+// The block products, with blockEnds holding 1 in the last slot of every
+// block (only used for blocks shorter than ea.size())
+static void blockProducts(const EncryptedArray& ea,
+                          Ctxt& ctxt,
+                          long blockSize,
+                          const NTL::ZZX& blockEnds)
+{
+  HELIB_TIMER_START;
+  // The last slot of a block gets its product; with a single block, every
+  // slot does, since the windows wrap around
+  windowFold(ea, ctxt, blockSize, /*backward=*/false, /*multiply=*/true);
+  if (blockSize == ea.size())
+    return;
+
+  // Spread the last slot of every block over the block
+  ctxt.multByConstant(blockEnds);
+  windowFold(ea, ctxt, blockSize, /*backward=*/true, /*multiply=*/false);
+}
+
+static NTL::ZZX encodeBlockEnds(const EncryptedArray& ea, long blockSize)
+{
+  std::vector<long> ends(ea.size());
+  for (long j = 0; j < lsize(ends); j++)
+    ends[j] = (j % blockSize == blockSize - 1);
+  NTL::ZZX encoded;
+  ea.encode(encoded, ends);
+  return encoded;
+}
+
+static void assertBlockSize(const EncryptedArray& ea, long blockSize)
+{
+  assertInRange<InvalidArgument>(blockSize,
+                                 1l,
+                                 ea.size(),
+                                 "Block size must be in [1, ea.size()]",
+                                 /*right_inclusive=*/true);
+  assertEq<InvalidArgument>(ea.size() % blockSize,
+                            0l,
+                            "Block size must divide the number of slots");
+}
+
+void blockProducts(const EncryptedArray& ea, Ctxt& ctxt, long blockSize)
+{
+  assertBlockSize(ea, blockSize);
+  NTL::ZZX blockEnds;
+  if (blockSize < ea.size())
+    blockEnds = encodeBlockEnds(ea, blockSize);
+  blockProducts(ea, ctxt, blockSize, blockEnds);
+}
+
+EqualityLookup::EqualityLookup(const EncryptedArray& ea, long keySlots) :
+    ea(ea), blockSize(keySlots)
+{
+  assertBlockSize(ea, blockSize);
+  if (blockSize < ea.size())
+    blockEnds = encodeBlockEnds(ea, blockSize);
+}
+
+void EqualityLookup::matchMask(Ctxt& mask,
+                               const Ctxt& key,
+                               const Ctxt& query) const
+{
+  mask = key;
+  mask -= query;
+  mapTo01(ea, mask);             // 0 where the slots agree, 1 elsewhere
+  mask.negate();
+  mask.addConstant(NTL::ZZ(1L)); // 1 where the slots agree
+  blockProducts(ea, mask, blockSize, blockEnds);
+}
+
+void EqualityLookup::lookup(Ctxt& result,
+                            const std::vector<Ctxt>& keys,
+                            const std::vector<Ctxt>& values,
+                            const Ctxt& query) const
+{
+  HELIB_TIMER_START;
+  assertEq<InvalidArgument>(keys.size(),
+                            values.size(),
+                            "Keys and values must have matching size");
+  assertFalse<InvalidArgument>(keys.empty(), "The database is empty");
+
+  long nRows = lsize(keys);
+  std::vector<Ctxt> terms(nRows, Ctxt(ZeroCtxtLike, query));
+  HELIB_EXEC_INDEX(nRows, i)
+  matchMask(terms[i], keys[i], query);
+  terms[i].multiplyBy(values[i]);
+  HELIB_EXEC_INDEX_END
+
+  // Sum the terms with a tree, every level in parallel
+  for (long step = 1; step < nRows; step *= 2) {
+    long pairs = (nRows - step + 2 * step - 1) / (2 * step);
+    HELIB_EXEC_INDEX(pairs, i)
+    terms[2 * step * i] += terms[2 * step * i + step];
+    HELIB_EXEC_INDEX_END
+  }
+  result = std::move(terms[0]);
+}
+
+} // namespace helib
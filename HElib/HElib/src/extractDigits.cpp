@@ -15,6 +15,7 @@
 #include <NTL/ZZ_p.h>
 #include <helib/EncryptedArray.h>
 #include <helib/polyEval.h>
+#include <helib/opCounters.h>
 #include <helib/debugging.h>
 
 namespace helib {
@@ -55,6 +56,30 @@ static void buildDigitPolynomial(NTL::ZZX& result, long p, long e)
   HELIB_TIMER_STOP;
 }
 
+static void compute_magic_poly(NTL::ZZX& poly1, long p, long e);
+
+// The polynomials below only depend on p and e, so they are cached on the
+// context once bootstrapping is initialized
+static void liftingPolynomial(NTL::ZZX& result, const Context& context, long e)
+{
+  const std::shared_ptr<DigitPolynomialCache>& cache =
+      context.getRcData().digitPolynomials;
+  if (cache && e > 1)
+    result = cache->getLifting(context.getP(), e);
+  else
+    buildDigitPolynomial(result, context.getP(), e);
+}
+
+static void chenHanPolynomial(NTL::ZZX& result, const Context& context, long e)
+{
+  const std::shared_ptr<DigitPolynomialCache>& cache =
+      context.getRcData().digitPolynomials;
+  if (cache)
+    result = cache->getChenHan(context.getP(), e);
+  else
+    compute_magic_poly(result, context.getP(), e);
+}
+
 // extractDigits assumes that the slots of *this contains integers mod p^r
 // i.e., that only the free terms are nonzero. (If that assumptions does
 // not hold then the result will not be a valid ciphertext anymore.)
@@ -65,8 +90,6 @@ static void buildDigitPolynomial(NTL::ZZX& result, long p, long e)
 // i'th slot of the *this. The plaintext space of digits[j] is mod p^{r-j},
 // and all the digits are at the same level.
 
-int fhe_watcher = 0;
-
 void extractDigits(std::vector<Ctxt>& digits, const Ctxt& c, long r)
 {
   const Context& context = c.getContext();
@@ -78,7 +101,7 @@ void extractDigits(std::vector<Ctxt>& digits, const Ctxt& c, long r)
 
   NTL::ZZX x2p;
   if (p > 3) {
-    buildDigitPolynomial(x2p, p, r);
+    liftingPolynomial(x2p, context, r);
   }
 
   Ctxt tmp(c.getPubKey(), c.getPtxtSpace());
@@ -232,15 +255,14 @@ void extendExtractDigits(std::vector<Ctxt>& digits,
   long p = context.getP();
   NTL::ZZX x2p;
   if (p > 3) {
-    buildDigitPolynomial(x2p, p, r);
+    liftingPolynomial(x2p, context, r);
   }
 
-  // we should pre-compute this table
   // for i = 0..r-1, entry i is G_{e+r-i} in Chen and Han
   NTL::Vec<NTL::ZZX> G;
   G.SetLength(r);
   for (long i : range(r)) {
-    compute_magic_poly(G[i], p, e + r - i);
+    chenHanPolynomial(G[i], context, e + r - i);
   }
 
   std::vector<Ctxt> digits0;
@@ -250,61 +272,108 @@ void extendExtractDigits(std::vector<Ctxt>& digits,
   digits.resize(r, tmp); // allocate space
   digits0.resize(r, tmp);
 
+  auto lift = [&](long j) {
+    if (p == 2)
+      digits0[j].square();
+    else if (p == 3)
+      digits0[j].cube();
+    else
+      polyEval(digits0[j], x2p, digits0[j]); // "in spirit" digits0[j] = digits0[j]^p
+  };
+
+  // Round i evaluates G on row i-1 and lifts the digits0[j] that row i needs.
+  // Only the choice for j = i-1 depends on digits[i-1], so the other lifts
+  // are independent of G and of each other and run in parallel with it.
+  std::vector<bool> useDigit(r, false); // use digits[j] instead of digits0[j]
 #ifdef HELIB_DEBUG
   fprintf(stderr, "***\n");
 #endif
-  for (long i : range(r)) {
-    tmp = c;
-    for (long j : range(i)) {
-      if (digits[j].capacity() >= digits0[j].capacity()) {
-        // optimization: digits[j] is better than digits0[j],
-        // so just use it
+  for (long i : range(r + 1)) {
+    std::vector<long> tasks; // -1 for G on row i-1, j >= 0 to lift digits0[j]
+    if (i > 0)
+      tasks.push_back(-1);
+    if (i < r)
+      for (long j = 0; j < i - 1; j++) {
+        // optimization: if digits[j] is better than digits0[j], just use it
+        useDigit[j] = digits[j].capacity() >= digits0[j].capacity();
+        if (!useDigit[j])
+          tasks.push_back(j);
+      }
+    auto run = [&](long task) {
+      if (task < 0)
+        polyEval(digits[i - 1], G[i - 1], digits0[i - 1]);
+      else
+        lift(task);
+    };
+#ifdef HELIB_BOOT_THREADS
+    HELIB_EXEC_RANGE((long)tasks.size(), first, last)
+    for (long index = first; index < last; index++)
+      run(tasks[index]);
+    HELIB_EXEC_RANGE_END
+#else
+    for (long task : tasks)
+      run(task);
+#endif
 
-        tmp -= digits[j];
 #ifdef HELIB_DEBUG
-        fprintf(stderr, "%5ld*", digits[j].bitCapacity());
-#endif
+    if (i > 0) {
+      if (dbgKey) {
+        double ratio = log(embeddingLargestCoeff(digits[i - 1], *dbgKey) /
+                           digits[i - 1].getNoiseBound()) /
+                       log(2.0);
+        fprintf(stderr,
+                "%5ld  --- %5ld",
+                digits0[i - 1].bitCapacity(),
+                digits[i - 1].bitCapacity());
+        fprintf(stderr, " [%f]", ratio);
+        if (ratio > 0)
+          fprintf(stderr, " BAD-BOUND");
+        fprintf(stderr, "\n");
       } else {
-        if (p == 2)
-          digits0[j].square();
-        else if (p == 3)
-          digits0[j].cube();
-        else
-          polyEval(digits0[j],
-                   x2p,
-                   digits0[j]); // "in spirit" digits0[j] = digits0[j]^p
-
-        tmp -= digits0[j];
-#ifdef HELIB_DEBUG
-        fprintf(stderr, "%5ld ", digits0[j].bitCapacity());
-#endif
+        fprintf(stderr,
+                "%5ld  --- %5ld\n",
+                digits0[i - 1].bitCapacity(),
+                digits[i - 1].bitCapacity());
       }
-      tmp.divideByP();
     }
-    digits0[i] = tmp; // needed in the next round
-    polyEval(digits[i], G[i], tmp);
+#endif
+    if (i == r)
+      break;
+
+    if (i > 0) {
+      useDigit[i - 1] = digits[i - 1].capacity() >= digits0[i - 1].capacity();
+      if (!useDigit[i - 1])
+        lift(i - 1);
+    }
 
+    tmp = c;
+    for (long j : range(i)) {
+      tmp.subtractAndDivideByP(useDigit[j] ? digits[j] : digits0[j]);
 #ifdef HELIB_DEBUG
-    if (dbgKey) {
-      double ratio = log(embeddingLargestCoeff(digits[i], *dbgKey) /
-                         digits[i].getNoiseBound()) /
-                     log(2.0);
       fprintf(stderr,
-              "%5ld  --- %5ld",
-              digits0[i].bitCapacity(),
-              digits[i].bitCapacity());
-      fprintf(stderr, " [%f]", ratio);
-      if (ratio > 0)
-        fprintf(stderr, " BAD-BOUND");
-      fprintf(stderr, "\n");
-    } else {
-      fprintf(stderr,
-              "%5ld  --- %5ld\n",
-              digits0[i].bitCapacity(),
-              digits[i].bitCapacity());
-    }
+              useDigit[j] ? "%5ld*" : "%5ld ",
+              (useDigit[j] ? digits[j] : digits0[j]).bitCapacity());
 #endif
+    }
+    digits0[i] = tmp; // needed in the next round
   }
 }
 
+void buildLiftingPolynomial(NTL::ZZX& result, long p, long e)
+{
+  assertTrue<InvalidArgument>(p >= 2 && e >= 1,
+                              "Lifting polynomial needs p >= 2 and e >= 1");
+  if (p == 2 || e == 1) // x^p already works
+    result = NTL::ZZX(NTL::INIT_MONO, p);
+  else
+    buildDigitPolynomial(result, p, e);
+}
+
+void buildChenHanPolynomial(NTL::ZZX& result, long p, long e)
+{
+  assertTrue<InvalidArgument>(p >= 2 && e >= 1,
+                              "Chen/Han polynomial needs p >= 2 and e >= 1");
+  compute_magic_poly(result, p, e);
+}
+
 } // namespace helib
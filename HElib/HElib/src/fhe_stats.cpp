@@ -13,6 +13,8 @@
 #include <helib/fhe_stats.h>
 #include <helib/multicore.h>
 #include <algorithm>
+#include <cmath>
+#include <limits>
 #include <utility>
 #include <cstring>
 
@@ -23,21 +25,63 @@ bool fhe_stats = false;
 static std::vector<fhe_stats_record*> stats_map;
 static HELIB_MUTEX_TYPE stats_mutex;
 
-fhe_stats_record::fhe_stats_record(const char* _name) :
-    name(_name), count(0), sum(0), max(0)
-// FIXME: maybe max should be -infty?
+// Every thread keeps the shard it was given when it first updated a record
+static long threadShard()
 {
+  static std::atomic<long> next{0};
+  thread_local long shard = next++ % fhe_stats_record::SHARDS;
+  return shard;
+}
+
+static void atomicMax(std::atomic<double>& target, double val)
+{
+  double current = target.load(std::memory_order_relaxed);
+  while (val > current && !target.compare_exchange_weak(current, val))
+    ;
+}
+
+static void atomicMin(std::atomic<double>& target, double val)
+{
+  double current = target.load(std::memory_order_relaxed);
+  while (val < current && !target.compare_exchange_weak(current, val))
+    ;
+}
+
+fhe_stats_record::fhe_stats_record(const char* _name) : name(_name)
+{
+  for (Shard& shard : shards) {
+    shard.count = 0;
+    shard.sum = 0;
+    shard.max = -std::numeric_limits<double>::infinity();
+    shard.min = std::numeric_limits<double>::infinity();
+    for (auto& bucket : shard.buckets)
+      bucket = 0;
+  }
   HELIB_MUTEX_GUARD(stats_mutex);
   stats_map.push_back(this);
 }
 
+long fhe_stats_record::bucketOf(double val)
+{
+  if (!(val >= std::ldexp(1.0, MIN_EXP))) // also zero, negative and NaN
+    return 0;
+  int e;
+  double m = std::frexp(val, &e); // val = m * 2^e with 1/2 <= m < 1
+  long bucket = (e - 1 - MIN_EXP) * BUCKETS_PER_OCTAVE +
+                long((2 * m - 1) * BUCKETS_PER_OCTAVE) + 1;
+  return std::min(bucket, BUCKETS - 1);
+}
+
 void fhe_stats_record::update(double val)
 {
-  HELIB_MUTEX_GUARD(stats_mutex);
-  count++;
-  sum += val;
-  if (val > max)
-    max = val;
+  Shard& shard = shards[threadShard()];
+  shard.count.fetch_add(1, std::memory_order_relaxed);
+  double sum = shard.sum.load(std::memory_order_relaxed);
+  while (!shard.sum.compare_exchange_weak(sum, sum + val))
+    ;
+  atomicMax(shard.max, val);
+  atomicMin(shard.min, val);
+  shard.buckets[bucketOf(val)].fetch_add(1, std::memory_order_relaxed);
 }
 
 void fhe_stats_record::save(double val)
@@ -46,6 +90,69 @@ void fhe_stats_record::save(double val)
   saved_values.push_back(val);
 }
 
+long fhe_stats_record::getCount() const
+{
+  long count = 0;
+  for (const Shard& shard : shards)
+    count += shard.count;
+  return count;
+}
+
+double fhe_stats_record::getSum() const
+{
+  double sum = 0;
+  for (const Shard& shard : shards)
+    sum += shard.sum;
+  return sum;
+}
+
+double fhe_stats_record::getMax() const
+{
+  double max = -std::numeric_limits<double>::infinity();
+  for (const Shard& shard : shards)
+    max = std::max<double>(max, shard.max);
+  return std::isinf(max) ? 0 : max;
+}
+
+double fhe_stats_record::getMin() const
+{
+  double min = std::numeric_limits<double>::infinity();
+  for (const Shard& shard : shards)
+    min = std::min<double>(min, shard.min);
+  return std::isinf(min) ? 0 : min;
+}
+
+double fhe_stats_record::percentile(double q) const
+{
+  std::array<long, BUCKETS> counts{};
+  long total = 0;
+  for (const Shard& shard : shards)
+    for (long b = 0; b < BUCKETS; b++) {
+      long n = shard.buckets[b];
+      counts[b] += n;
+      total += n;
+    }
+  if (total == 0)
+    return 0;
+
+  double min = getMin(), max = getMax();
+  long rank = std::max(1L, long(std::ceil(q * total)));
+  long b = 0;
+  for (long seen = counts[0]; seen < rank && b < BUCKETS - 1; seen += counts[b])
+    b++;
+  if (b == 0)
+    return min;
+  if (b == BUCKETS - 1)
+    return max;
+  // Geometric middle of [2^e (1 + i/n), 2^e (1 + (i+1)/n)) with n buckets
+  // per octave
+  long e = (b - 1) / BUCKETS_PER_OCTAVE + MIN_EXP;
+  long i = (b - 1) % BUCKETS_PER_OCTAVE;
+  double lower = std::ldexp(1.0 + double(i) / BUCKETS_PER_OCTAVE, e);
+  double upper = std::ldexp(1.0 + double(i + 1) / BUCKETS_PER_OCTAVE, e);
+  return std::min(max, std::max(min, std::sqrt(lower * upper)));
+}
+
 static bool stats_compare(const fhe_stats_record* a, const fhe_stats_record* b)
 {
   return strcmp(a->name, b->name) < 0;
@@ -54,24 +161,32 @@ static bool stats_compare(const fhe_stats_record* a, const fhe_stats_record* b)
 void print_stats(std::ostream& s)
 {
   s << "||||| stats |||||\n";
+  HELIB_MUTEX_GUARD(stats_mutex);
   sort(stats_map.begin(), stats_map.end(), stats_compare);
   for (long i = 0; i < long(stats_map.size()); i++) {
-    const char* name = stats_map[i]->name;
-    long count = stats_map[i]->count;
-    double sum = stats_map[i]->sum;
-    double max = stats_map[i]->max;
+    const fhe_stats_record* record = stats_map[i];
+    long count = record->getCount();
 
     if (count > 0) {
-      s << name << " ave=" << (sum / count) << " max=" << max << "\n";
+      s << record->name << " ave=" << (record->getSum() / count)
+        << " max=" << record->getMax() << " p50=" << record->percentile(0.5)
+        << " p99=" << record->percentile(0.99) << "\n";
     }
   }
 }
 
 const std::vector<double>* fetch_saved_values(const char* name)
 {
+  const fhe_stats_record* record = fetch_stats_record(name);
+  return record ? &record->saved_values : 0;
+}
+
+const fhe_stats_record* fetch_stats_record(const char* name)
+{
+  HELIB_MUTEX_GUARD(stats_mutex);
   for (long i = 0; i < long(stats_map.size()); i++) {
     if (strcmp(name, stats_map[i]->name) == 0)
-      return &stats_map[i]->saved_values;
+      return stats_map[i];
   }
 
   return 0;
@@ -11,6 +11,10 @@
 
 #include <hexl/hexl.hpp>
 
+#ifdef __AVX512F__
+#include <immintrin.h>
+#endif
+
 #include <unordered_map>
 #include <functional>
 #include <shared_mutex>
@@ -174,6 +178,38 @@ void EltwiseMultMod(long* result,
                              /*input_mod_factor=*/1);
 }
 
+void EltwiseFMAMod(long* result,
+                   const long* operand1,
+                   long scalar,
+                   const long* operand3,
+                   long n,
+                   long modulus)
+{
+  intel::hexl::EltwiseFMAMod(reinterpret_cast<uint64_t*>(result),
+                             reinterpret_cast<const uint64_t*>(operand1),
+                             scalar,
+                             reinterpret_cast<const uint64_t*>(operand3),
+                             n,
+                             modulus,
+                             /*input_mod_factor=*/1);
+}
+
+// HEXL has no permutation primitive, so this is an AVX-512 gather of eight
+// entries at a time when the compiler targets AVX-512
+void Permute(long* result, const long* operand, const long* perm, long n)
+{
+  long j = 0;
+#ifdef __AVX512F__
+  for (; j + 8 <= n; j += 8) {
+    __m512i idx = _mm512_loadu_si512(perm + j);
+    __m512i val = _mm512_i64gather_epi64(idx, operand, sizeof(long));
+    _mm512_storeu_si512(result + j, val);
+  }
+#endif
+  for (; j < n; j++)
+    result[j] = operand[perm[j]];
+}
+
 } // namespace intel
 
 #endif // USE_INTEL_HEXL
@@ -56,6 +56,17 @@ void EltwiseMultMod(long* result,
                     long n,
                     long modulus);
 
+// result = operand1 * scalar + operand3 (mod modulus), operand3 may be null
+void EltwiseFMAMod(long* result,
+                   const long* operand1,
+                   long scalar,
+                   const long* operand3,
+                   long n,
+                   long modulus);
+
+// result[j] = operand[perm[j]] for j < n, result must not alias operand
+void Permute(long* result, const long* operand, const long* perm, long n);
+
 } // namespace intel
 
 #endif // HELIB_INTELEXT_H
@@ -14,9 +14,12 @@
  * The normal basis and its inverse are computed when on the 1st call
  * to either ea.getNormalBasisMatrixInverse() or ea.getNormalBasisMatrix().
  */
+#include <algorithm>
 #include <memory>
 #include <helib/replicate.h>
 #include <helib/intraSlot.h>
+#include <helib/automorphPrecon.h>
+#include <helib/opCounters.h>
 
 namespace helib {
 
@@ -69,6 +72,42 @@ void buildUnpackSlotEncoding(std::vector<zzX>& unpackSlotEncoding,
   ea.dispatch<buildUnpackSlotEncoding_pa_impl>(unpackSlotEncoding);
 }
 
+namespace {
+
+typedef std::vector<DoubleCRT> UnpackConstants;
+
+// Convert the unpack constants to DoubleCRTs at the primes of ctxt
+UnpackConstants unpackConstants(const Ctxt& ctxt,
+                                const std::vector<zzX>& unpackSlotEncoding,
+                                long d)
+{
+  UnpackConstants coeff_vector;
+  coeff_vector.reserve(d);
+  for (long i = 0; i < d; i++)
+    coeff_vector.emplace_back(unpackSlotEncoding[i],
+                              ctxt.getContext(),
+                              ctxt.getPrimeSet());
+  return coeff_vector;
+}
+
+// Unpack one ciphertext, with the constants already converted: the j'th
+// slot of unpacked[i] gets the i'th coefficient from the j'th slot of ctxt
+void unpackWith(const CtPtrs& unpacked,
+                const Ctxt& ctxt,
+                const UnpackConstants& coeff_vector)
+{
+  long d = coeff_vector.size();
+  std::vector<const DoubleCRT*> constants(d);
+  for (long i = 0; i < d; i++)
+    constants[i] = &coeff_vector[i];
+  frobeniusCombinations(unpacked,
+                        ctxt,
+                        constants,
+                        std::vector<double>(d, -1.0));
+}
+
+} // namespace
+
 template <typename type>
 class unpack_pa_impl
 {
@@ -80,40 +119,40 @@ public:
                     const Ctxt& ctxt,
                     const std::vector<zzX>& unpackSlotEncoding)
   {
-    long d = ea.getDegree(); // size of each slot
-
     // ctxt.cleanUp();
+    unpackWith(unpacked,
+               ctxt,
+               unpackConstants(ctxt, unpackSlotEncoding, ea.getDegree()));
+  }
 
-    // Convert the unpack constants to doubleCRT
-    std::vector<std::shared_ptr<DoubleCRT>> coeff_vector(d);
-    for (long i = 0; i < d; i++) {
-      coeff_vector[i] = std::make_shared<DoubleCRT>(unpackSlotEncoding[i],
-                                                    ctxt.getContext(),
-                                                    ctxt.getPrimeSet());
-    }
-    // Compute the d Frobenius automorphisms of ctxt (use multi-threading)
-    std::vector<Ctxt> frob(d, Ctxt(ZeroCtxtLike, ctxt));
-    NTL_EXEC_RANGE(d, first, last)
-    for (long j = first; j < last; j++) { // process jth Frobenius
-      frob[j] = ctxt;
-      frob[j].frobeniusAutomorph(j);
-      frob[j].cleanUp();
-      // NOTE: Why do we apply cleanup after the Frobenius?
-    }
-    NTL_EXEC_RANGE_END
-
-    // compute the unpacked ciphertexts: the j'th slot of unpacked[i]
-    // contains the i'th coefficient from the j'th clot of ctxt
-    Ctxt tmp1(ZeroCtxtLike, ctxt);
-    for (long i = 0; i < unpacked.size(); i++) {
-      *(unpacked[i]) = frob[0];
-      unpacked[i]->multByConstant(*coeff_vector[i]);
-      for (long j = 1; j < d; j++) {
-        tmp1 = frob[j];
-        tmp1.multByConstant(*coeff_vector[mcMod(i + j, d)]);
-        *(unpacked[i]) += tmp1;
-      }
-    } // NOTE: why aren't we using multi-threading here?
+  // Unpack the ciphertexts packed[0,...] into the slices of d consecutive
+  // ones of unpacked, in parallel. The ciphertexts usually share their
+  // primes (e.g. after packedRecrypt), so the constants are converted once.
+  static void apply(const EncryptedArrayDerived<type>& ea,
+                    const CtPtrs& unpacked,
+                    const CtPtrs& packed,
+                    const std::vector<zzX>& unpackSlotEncoding)
+  {
+    long d = ea.getDegree();
+    long nPacked = divc(unpacked.size(), d);
+    if (nPacked == 0)
+      return;
+    const UnpackConstants shared =
+        unpackConstants(*packed[0], unpackSlotEncoding, d);
+
+    HELIB_EXEC_INDEX(nPacked, idx)
+    const Ctxt& ctxt = *packed[idx];
+    long offset = idx * d;
+    const CtPtrs_slice nextSlice(unpacked,
+                                 offset,
+                                 std::min(d, unpacked.size() - offset));
+    if (ctxt.getPrimeSet() == packed[0]->getPrimeSet())
+      unpackWith(nextSlice, ctxt, shared);
+    else
+      unpackWith(nextSlice,
+                 ctxt,
+                 unpackConstants(ctxt, unpackSlotEncoding, d));
+    HELIB_EXEC_INDEX_END
   }
 };
 
@@ -144,33 +183,40 @@ long unpack(const CtPtrs& unpacked,
   // We must have enough ciphertexts
   assertTrue(packed.size() * d >= num2unpack,
              "Not enough ciphertexts. (Packed size * d < unpacked size)");
-  long offset = 0;
-  long idx = 0;
-  while (num2unpack > 0) {
-    if (num2unpack < d)
-      d = num2unpack;
-    const CtPtrs_slice nextSlice(unpacked, offset, d);
-    ea.dispatch<unpack_pa_impl>(nextSlice,
-                                *(packed[idx++]),
-                                unpackSlotEncoding);
-    num2unpack -= d;
-    offset += d;
-  }
-  return idx;
+  ea.dispatch<unpack_pa_impl>(unpacked, packed, unpackSlotEncoding);
+  return divc(num2unpack, d);
 }
 
 // An implementation classes for (re)packing.
 
 //! \cond FALSE (make doxygen ignore this code)
+namespace {
+
+// Pack unpacked[i] * powers[i] into ctxt
+void repackWith(Ctxt& ctxt,
+                const CtPtrs& unpacked,
+                const std::vector<zzX>& powers)
+{
+  ctxt.clear();
+  for (long i = 0; i < unpacked.size(); i++) {
+    Ctxt tmp(*(unpacked[i]));
+    tmp.multByConstant(powers[i]); // accumulate unpacked[i] * X^{p^i}
+    ctxt += tmp;
+  }
+}
+
+} // namespace
+
 template <typename type>
 class repack_pa_impl
 {
 public:
   PA_INJECT(type)
 
-  static void apply(const EncryptedArrayDerived<type>& ea,
-                    Ctxt& ctxt,
-                    const CtPtrs& unpacked)
+  // The constants with X^{p^i} in all slots, for i < n
+  static void encodePowers(const EncryptedArrayDerived<type>& ea,
+                           std::vector<zzX>& powers,
+                           long n)
   {
     RBak bak;
     bak.save();
@@ -181,19 +227,44 @@ public:
     // CB contains a description of the normal-basis transformation
 
     RX pow;
-    zzX powInSlots;
     std::vector<RX> powVec(nslots);
-    ctxt.clear();
-    for (long i = 0; i < unpacked.size(); i++) {
+    powers.resize(n);
+    for (long i = 0; i < n; i++) {
       conv(pow, CB[i]); // convert CB[i] from Vec<R> to RX
       for (long j = 0; j < nslots; j++)
         powVec[j] = pow;
-      ea.encode(powInSlots, powVec); // a constant with X^{p^i} in all slots
-      Ctxt tmp(*(unpacked[i]));
-      tmp.multByConstant(powInSlots); // accumulate unpacked[i] * X^{p^i}
-      ctxt += tmp;
+      ea.encode(powers[i], powVec);
     }
   }
+
+  static void apply(const EncryptedArrayDerived<type>& ea,
+                    Ctxt& ctxt,
+                    const CtPtrs& unpacked)
+  {
+    std::vector<zzX> powers;
+    encodePowers(ea, powers, unpacked.size());
+    repackWith(ctxt, unpacked, powers);
+  }
+
+  // Pack the slices of d consecutive ciphertexts of unpacked into
+  // packed[0,...], in parallel, encoding the constants once
+  static void apply(const EncryptedArrayDerived<type>& ea,
+                    const CtPtrs& packed,
+                    const CtPtrs& unpacked)
+  {
+    long d = ea.getDegree();
+    long nPacked = divc(unpacked.size(), d);
+    std::vector<zzX> powers;
+    encodePowers(ea, powers, std::min(d, unpacked.size()));
+
+    HELIB_EXEC_INDEX(nPacked, idx)
+    long offset = idx * d;
+    const CtPtrs_slice nextSlice(unpacked,
+                                 offset,
+                                 std::min(d, unpacked.size() - offset));
+    repackWith(*(packed[idx]), nextSlice, powers);
+    HELIB_EXEC_INDEX_END
+  }
 };
 
 HELIB_NO_CKKS_IMPL(repack_pa_impl)
@@ -216,17 +287,8 @@ long repack(const CtPtrs& packed,
   // We must have enough ciphertexts
   assertTrue(packed.size() * d >= num2pack,
              "Not enough ciphertexts. (Packed size * d < unpacked size)");
-  long offset = 0;
-  long idx = 0;
-  while (num2pack > 0) {
-    if (num2pack < d)
-      d = num2pack;
-    const CtPtrs_slice nextSlice(unpacked, offset, d);
-    ea.dispatch<repack_pa_impl>(*(packed[idx++]), nextSlice);
-    num2pack -= d;
-    offset += d;
-  }
-  return idx;
+  ea.dispatch<repack_pa_impl>(packed, unpacked);
+  return divc(num2pack, d);
 }
 
 //! \cond FALSE (make doxygen ignore this code)
@@ -0,0 +1,514 @@
+/* Copyright (C) 2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+#include <cctype>
+#include <charconv>
+#include <cstdlib>
+#include <sstream>
+
+#include <helib/JsonWrapper.h>
+#include "jsonStream.h"
+
+namespace helib {
+
+// The slot of the streams that holds the jsonBase64Residues flag
+static int base64Index()
+{
+  static const int index = std::ios_base::xalloc();
+  return index;
+}
+
+std::ostream& jsonBase64Residues(std::ostream& str)
+{
+  str.iword(base64Index()) = 1;
+  return str;
+}
+
+std::ostream& jsonNumericResidues(std::ostream& str)
+{
+  str.iword(base64Index()) = 0;
+  return str;
+}
+
+static const char BASE64_DIGITS[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// The value of a base64 digit, -1 for anything else
+static int base64Value(int c)
+{
+  if (c >= 'A' && c <= 'Z')
+    return c - 'A';
+  if (c >= 'a' && c <= 'z')
+    return c - 'a' + 26;
+  if (c >= '0' && c <= '9')
+    return c - '0' + 52;
+  if (c == '+')
+    return 62;
+  if (c == '/')
+    return 63;
+  return -1;
+}
+
+/******************** JsonStreamWriter ********************/
+
+JsonStreamWriter::JsonStreamWriter(std::ostream& str) :
+    str(str), base64(str.iword(base64Index()) != 0)
+{}
+
+void JsonStreamWriter::separate()
+{
+  if (afterKey) {
+    afterKey = false;
+    return;
+  }
+  if (!empty.empty()) {
+    if (!empty.back())
+      str.put(',');
+    empty.back() = false;
+  }
+}
+
+void JsonStreamWriter::beginObject()
+{
+  separate();
+  str.put('{');
+  empty.push_back(true);
+}
+
+void JsonStreamWriter::endObject()
+{
+  str.put('}');
+  empty.pop_back();
+}
+
+void JsonStreamWriter::beginArray()
+{
+  separate();
+  str.put('[');
+  empty.push_back(true);
+}
+
+void JsonStreamWriter::endArray()
+{
+  str.put(']');
+  empty.pop_back();
+}
+
+void JsonStreamWriter::key(const char* k)
+{
+  separate();
+  str << json(k).dump() << ':';
+  afterKey = true;
+}
+
+void JsonStreamWriter::value(const json& j)
+{
+  separate();
+  str << j.dump();
+}
+
+void JsonStreamWriter::longs(const long* p, long n)
+{
+  // The text goes out in chunks of about this many characters
+  constexpr long CHUNK = 4096;
+  std::string buf;
+  buf.reserve(CHUNK + 32);
+
+  if (base64) {
+    separate();
+    str.put('"');
+    unsigned long bits = 0;
+    long nbits = 0;
+    for (long i = 0; i < n; i++) {
+      unsigned long v = p[i];
+      for (long k = 0; k < 8; k++) {
+        bits = (bits << 8) | ((v >> (8 * k)) & 0xff);
+        nbits += 8;
+        while (nbits >= 6) {
+          nbits -= 6;
+          buf.push_back(BASE64_DIGITS[(bits >> nbits) & 0x3f]);
+        }
+      }
+      if (long(buf.size()) >= CHUNK) {
+        str.write(buf.data(), buf.size());
+        buf.clear();
+      }
+    }
+    if (nbits > 0) {
+      buf.push_back(BASE64_DIGITS[(bits << (6 - nbits)) & 0x3f]);
+      buf.append(nbits == 2 ? "==" : "=");
+    }
+    buf.push_back('"');
+    str.write(buf.data(), buf.size());
+    return;
+  }
+
+  beginArray();
+  char num[24];
+  for (long i = 0; i < n; i++) {
+    if (i > 0)
+      buf.push_back(',');
+    auto res = std::to_chars(num, num + sizeof(num), p[i]);
+    buf.append(num, res.ptr);
+    if (long(buf.size()) >= CHUNK) {
+      str.write(buf.data(), buf.size());
+      buf.clear();
+    }
+  }
+  str.write(buf.data(), buf.size());
+  endArray();
+}
+
+/******************** JsonStreamReader ********************/
+
+JsonStreamReader::JsonStreamReader(std::istream& str) : str(str) {}
+
+int JsonStreamReader::peek()
+{
+  int c = str.peek();
+  while (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+    str.get();
+    c = str.peek();
+  }
+  return c;
+}
+
+void JsonStreamReader::expect(char c)
+{
+  if (peek() != c)
+    throw IOError(std::string("Error with JSON IO. Expected '") + c + "'.");
+  str.get();
+}
+
+bool JsonStreamReader::more(char close)
+{
+  if (peek() == close) {
+    str.get();
+    empty.pop_back();
+    return false;
+  }
+  if (empty.back())
+    empty.back() = false;
+  else
+    expect(',');
+  return true;
+}
+
+void JsonStreamReader::beginObject()
+{
+  expect('{');
+  empty.push_back(true);
+}
+
+bool JsonStreamReader::nextKey(std::string& key)
+{
+  if (!more('}'))
+    return false;
+  key = string();
+  expect(':');
+  return true;
+}
+
+void JsonStreamReader::beginArray()
+{
+  expect('[');
+  empty.push_back(true);
+}
+
+bool JsonStreamReader::nextElement() { return more(']'); }
+
+bool JsonStreamReader::atString() { return peek() == '"'; }
+
+// Append the UTF-8 encoding of the code point cp to s
+static void appendUtf8(std::string& s, unsigned long cp)
+{
+  if (cp < 0x80) {
+    s.push_back(char(cp));
+  } else if (cp < 0x800) {
+    s.push_back(char(0xc0 | (cp >> 6)));
+    s.push_back(char(0x80 | (cp & 0x3f)));
+  } else if (cp < 0x10000) {
+    s.push_back(char(0xe0 | (cp >> 12)));
+    s.push_back(char(0x80 | ((cp >> 6) & 0x3f)));
+    s.push_back(char(0x80 | (cp & 0x3f)));
+  } else {
+    s.push_back(char(0xf0 | (cp >> 18)));
+    s.push_back(char(0x80 | ((cp >> 12) & 0x3f)));
+    s.push_back(char(0x80 | ((cp >> 6) & 0x3f)));
+    s.push_back(char(0x80 | (cp & 0x3f)));
+  }
+}
+
+std::string JsonStreamReader::string()
+{
+  expect('"');
+  std::string s;
+  auto hex4 = [this]() {
+    unsigned long v = 0;
+    for (long i = 0; i < 4; i++) {
+      int c = str.get();
+      if (!std::isxdigit(c))
+        throw IOError("Error with JSON IO. Bad \\u escape.");
+      v = 16 * v + (std::isdigit(c) ? c - '0' : std::tolower(c) - 'a' + 10);
+    }
+    return v;
+  };
+  for (;;) {
+    int c = str.get();
+    if (c == std::char_traits<char>::eof())
+      throw IOError("Error with JSON IO. Unterminated string.");
+    if (c == '"')
+      return s;
+    if (c != '\\') {
+      s.push_back(char(c));
+      continue;
+    }
+    c = str.get();
+    switch (c) {
+    case '"':
+    case '\\':
+    case '/':
+      s.push_back(char(c));
+      break;
+    case 'b':
+      s.push_back('\b');
+      break;
+    case 'f':
+      s.push_back('\f');
+      break;
+    case 'n':
+      s.push_back('\n');
+      break;
+    case 'r':
+      s.push_back('\r');
+      break;
+    case 't':
+      s.push_back('\t');
+      break;
+    case 'u': {
+      unsigned long cp = hex4();
+      if (cp >= 0xd800 && cp < 0xdc00) { // a surrogate pair
+        if (str.get() != '\\' || str.get() != 'u')
+          throw IOError("Error with JSON IO. Unpaired surrogate.");
+        cp = 0x10000 + ((cp - 0xd800) << 10) + (hex4() - 0xdc00);
+      }
+      appendUtf8(s, cp);
+      break;
+    }
+    default:
+      throw IOError("Error with JSON IO. Bad escape in string.");
+    }
+  }
+}
+
+std::string JsonStreamReader::numberToken()
+{
+  peek();
+  std::string tok;
+  for (int c = str.peek();
+       std::isdigit(c) || c == '-' || c == '+' || c == '.' || c == 'e' ||
+       c == 'E';
+       c = str.peek())
+    tok.push_back(char(str.get()));
+  if (tok.empty())
+    throw IOError("Error with JSON IO. Unexpected character.");
+  return tok;
+}
+
+json JsonStreamReader::number()
+{
+  std::string tok = numberToken();
+  const char* first = tok.data();
+  const char* last = first + tok.size();
+  if (tok.find_first_of(".eE") != std::string::npos) {
+    char* end;
+    double d = std::strtod(first, &end);
+    if (end != last)
+      throw IOError("Error with JSON IO. Bad number " + tok + ".");
+    return d;
+  }
+  if (tok[0] == '-') {
+    long long v;
+    auto res = std::from_chars(first, last, v);
+    if (res.ec != std::errc() || res.ptr != last)
+      throw IOError("Error with JSON IO. Bad number " + tok + ".");
+    return v;
+  }
+  unsigned long long v;
+  auto res = std::from_chars(first, last, v);
+  if (res.ec != std::errc() || res.ptr != last)
+    throw IOError("Error with JSON IO. Bad number " + tok + ".");
+  return v;
+}
+
+long JsonStreamReader::integer()
+{
+  std::string tok = numberToken();
+  long v;
+  auto res = std::from_chars(tok.data(), tok.data() + tok.size(), v);
+  if (res.ec != std::errc() || res.ptr != tok.data() + tok.size())
+    throw IOError("Error with JSON IO. Expected an integer, got " + tok + ".");
+  return v;
+}
+
+void JsonStreamReader::literal(const char* word)
+{
+  peek();
+  for (const char* c = word; *c != '\0'; c++)
+    if (str.get() != *c)
+      throw IOError(std::string("Error with JSON IO. Expected ") + word + ".");
+}
+
+json JsonStreamReader::value()
+{
+  switch (peek()) {
+  case '{': {
+    json j = json::object();
+    beginObject();
+    for (std::string k; nextKey(k);)
+      j[k] = value();
+    return j;
+  }
+  case '[': {
+    json j = json::array();
+    beginArray();
+    while (nextElement())
+      j.push_back(value());
+    return j;
+  }
+  case '"':
+    return string();
+  case 't':
+    literal("true");
+    return true;
+  case 'f':
+    literal("false");
+    return false;
+  case 'n':
+    literal("null");
+    return nullptr;
+  default:
+    return number();
+  }
+}
+
+template <typename Sink>
+void JsonStreamReader::base64(Sink sink)
+{
+  expect('"');
+  unsigned long bits = 0;
+  long nbits = 0;
+  for (;;) {
+    int c = str.get();
+    if (c == '"')
+      break;
+    if (c == '=')
+      continue;
+    int v = base64Value(c);
+    if (v < 0)
+      throw IOError("Error with JSON IO. Bad base64 data.");
+    bits = (bits << 6) | v;
+    nbits += 6;
+    if (nbits >= 8) {
+      nbits -= 8;
+      sink((unsigned char)(bits >> nbits));
+    }
+  }
+}
+
+void JsonStreamReader::longs(long* p, long n)
+{
+  if (atString()) {
+    long bytes = 0;
+    base64([&](unsigned char b) {
+      if (bytes >= n * 8)
+        throw IOError("Data not valid: wrong vector length");
+      long k = bytes % 8;
+      unsigned long& v = reinterpret_cast<unsigned long&>(p[bytes / 8]);
+      v = k == 0 ? b : v | ((unsigned long)b << (8 * k));
+      bytes++;
+    });
+    if (bytes != n * 8)
+      throw IOError("Data not valid: wrong vector length");
+    return;
+  }
+
+  beginArray();
+  long i = 0;
+  while (nextElement()) {
+    if (i >= n)
+      throw IOError("Data not valid: wrong vector length");
+    p[i++] = integer();
+  }
+  if (i != n)
+    throw IOError("Data not valid: wrong vector length");
+}
+
+void JsonStreamReader::longs(std::vector<long>& v)
+{
+  v.clear();
+  if (atString()) {
+    long bytes = 0;
+    base64([&](unsigned char b) {
+      long k = bytes % 8;
+      if (k == 0)
+        v.push_back(b);
+      else
+        reinterpret_cast<unsigned long&>(v.back()) |= (unsigned long)b
+                                                      << (8 * k);
+      bytes++;
+    });
+    if (bytes % 8 != 0)
+      throw IOError("Data not valid: truncated base64 words");
+    return;
+  }
+
+  beginArray();
+  while (nextElement())
+    v.push_back(integer());
+}
+
+std::vector<long> base64Longs(const std::string& s)
+{
+  std::istringstream str('"' + s + '"');
+  JsonStreamReader r(str);
+  std::vector<long> v;
+  r.longs(v);
+  return v;
+}
+
+void JsonStreamReader::require(bool seen, const char* k)
+{
+  if (!seen)
+    throw IOError(std::string("Error with JSON IO. Missing key '") + k + "'.");
+}
+
+void JsonStreamReader::checkHeader(const std::string& k,
+                                   std::string_view expected)
+{
+  std::string actual = value().get<std::string>();
+  if (actual == expected)
+    return;
+  std::stringstream sstr;
+  if (k == "serializationVersion")
+    sstr << "Serialization version mismatch.  Expected: " << expected
+         << " actual: " << actual;
+  else if (k == "HElibVersion")
+    sstr << "HElib version mismatch.  Expected: " << expected
+         << " actual: " << actual;
+  else
+    sstr << "Type mismatch deserializing json object."
+         << "  Expected: " << expected << " actual: " << actual;
+  throw IOError(sstr.str());
+}
+
+} // namespace helib
@@ -0,0 +1,182 @@
+/* Copyright (C) 2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+#ifndef HELIB_JSONSTREAM_H
+#define HELIB_JSONSTREAM_H
+/**
+ * @file jsonStream.h
+ * @brief - Internal header (not installed) with a JSON writer and reader that
+ * work straight on the streams, for the objects that hold many residues.
+ *
+ * The writer emits the tokens as they come, and the reader parses them one
+ * at a time, so the residues of a DoubleCRT go from their rows to the stream
+ * and back without a JSON tree in between. Only the small members (numbers,
+ * index sets, handles, the Context) go through a `json` value. The output is
+ * the same JSON as that of the `JsonWrapper` methods, up to the order of the
+ * keys, and both readers accept the output of either writer.
+ */
+
+#include <string>
+#include <vector>
+
+#include "io.h"
+
+namespace helib {
+
+class JsonStreamWriter
+{
+public:
+  explicit JsonStreamWriter(std::ostream& str);
+
+  void beginObject();
+  void endObject();
+  void beginArray();
+  void endArray();
+
+  // The key of the next member of the current object
+  void key(const char* k);
+
+  // A small value, written through its json representation
+  void value(const json& j);
+
+  template <typename T>
+  void member(const char* k, const T& v)
+  {
+    key(k);
+    value(json(v));
+  }
+
+  // The n longs at p, as an array of numbers, or as a base64 string of
+  // their little-endian 64-bit words if jsonBase64Residues was set on the
+  // stream
+  void longs(const long* p, long n);
+
+  // Open a typed object for T (see toTypedJson) and the key of its content.
+  // The caller writes the content, then closes the object with endObject.
+  template <typename T>
+  void beginTyped()
+  {
+    beginObject();
+    member("type", T::typeName);
+    member("HElibVersion", version::asString);
+    member("serializationVersion", jsonSerializationVersion);
+    key("content");
+  }
+
+private:
+  std::ostream& str;
+  // For every open object or array, whether it has no element yet
+  std::vector<bool> empty;
+  bool afterKey = false;
+  bool base64;
+
+  // Write the separator that goes before a key or a value
+  void separate();
+};
+
+class JsonStreamReader
+{
+public:
+  explicit JsonStreamReader(std::istream& str);
+
+  void beginObject();
+  // The key of the next member, false (after consuming the closing brace) at
+  // the end of the object
+  bool nextKey(std::string& key);
+
+  void beginArray();
+  // Whether the array has another element, false (after consuming the
+  // closing bracket) at its end
+  bool nextElement();
+
+  // Whether the next value is a string
+  bool atString();
+
+  // A small value, parsed into a json tree
+  json value();
+
+  // Skip the next value
+  void skip() { value(); }
+
+  // An array of n integers or a base64 string of n 64-bit words, read
+  // straight into p
+  void longs(long* p, long n);
+
+  // The same for any number of longs
+  void longs(std::vector<long>& v);
+
+  // Read a typed object for T (see fromTypedJson), calling content() to read
+  // its content. Every field of the header is checked when it is read, and
+  // the object must have all of them, in any order.
+  template <typename T, typename F>
+  void readTyped(F content)
+  {
+    bool haveType = false, haveVersion = false, haveSerVersion = false;
+    bool haveContent = false;
+    beginObject();
+    for (std::string k; nextKey(k);) {
+      if (k == "content") {
+        content();
+        haveContent = true;
+      } else if (k == "type") {
+        checkHeader(k, T::typeName);
+        haveType = true;
+      } else if (k == "HElibVersion") {
+        checkHeader(k, version::asString);
+        haveVersion = true;
+      } else if (k == "serializationVersion") {
+        checkHeader(k, jsonSerializationVersion);
+        haveSerVersion = true;
+      } else
+        skip();
+    }
+    require(haveSerVersion, "serializationVersion");
+    require(haveVersion, "HElibVersion");
+    require(haveType, "type");
+    require(haveContent, "content");
+  }
+
+  // Throw IOError if the key k was not read
+  static void require(bool seen, const char* k);
+
+private:
+  std::istream& str;
+  // For every open object or array, whether no element was read yet
+  std::vector<bool> empty;
+
+  // Skip whitespace and peek at the next character
+  int peek();
+  void expect(char c);
+  // The separator before the next member or element, false at the end
+  bool more(char close);
+
+  std::string string();
+  // The characters of a number
+  std::string numberToken();
+  json number();
+  long integer();
+  void literal(const char* word);
+  // Decode a base64 string, passing every byte to sink
+  template <typename Sink>
+  void base64(Sink sink);
+
+  // Read the value of the header field k and throw IOError if it is not
+  // the expected one
+  void checkHeader(const std::string& k, std::string_view expected);
+};
+
+// The longs of a base64 string written by JsonStreamWriter::longs
+std::vector<long> base64Longs(const std::string& s);
+
+} // namespace helib
+
+#endif // HELIB_JSONSTREAM_H
@@ -0,0 +1,272 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+#include <helib/keySetOptimizer.h>
+
+#include <atomic>
+#include <deque>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <NTL/ZZ.h>
+
+#include <helib/assertions.h>
+#include <helib/Context.h>
+#include <helib/exceptions.h>
+#include <helib/keySwitching.h>
+#include <helib/keys.h>
+#include <helib/NumbTh.h>
+
+namespace helib {
+
+namespace {
+
+// The profile that records, shared by all the threads
+std::atomic<AutomorphismProfile*> capturing{nullptr};
+
+thread_local bool suspended = false;
+
+// The number of key switches from s(X^k) to s for every k in Zm*, with the
+// matrices s(X^e) -> s for e in keys: the breadth-first search from 1 of
+// PubKey::setKeySwitchMap, with an edge x -> x*e. -1 when unreachable.
+std::vector<long> keySwitchDistances(long m, const std::set<long>& keys)
+{
+  std::vector<long> dist(m, -1);
+  std::deque<long> queue{1};
+  dist[1] = 0;
+  while (!queue.empty()) {
+    long x = queue.front();
+    queue.pop_front();
+    for (long e : keys) {
+      long y = NTL::MulMod(x, e, m);
+      if (dist[y] < 0) {
+        dist[y] = dist[x] + 1;
+        queue.push_back(y);
+      }
+    }
+  }
+  return dist;
+}
+
+// The key switches of the profile for the distances dist, an unreachable k
+// counting as phim
+double profileCost(const std::map<long, long>& uses,
+                   const std::vector<long>& dist,
+                   long phim,
+                   long* unreachable = nullptr)
+{
+  double cost = 0;
+  if (unreachable)
+    *unreachable = 0;
+  for (const auto& [k, n] : uses) {
+    if (dist[k] >= 0)
+      cost += double(n) * dist[k];
+    else {
+      cost += double(n) * phim;
+      if (unreachable)
+        *unreachable += n;
+    }
+  }
+  return cost;
+}
+
+} // namespace
+
+AutomorphismProfile::AutomorphismProfile(const AutomorphismProfile& other) :
+    uses(other.counts())
+{}
+
+AutomorphismProfile& AutomorphismProfile::operator=(
+    const AutomorphismProfile& other)
+{
+  if (this != &other) {
+    std::map<long, long> copy = other.counts();
+    std::lock_guard<std::mutex> lock(mutex);
+    uses = std::move(copy);
+  }
+  return *this;
+}
+
+void AutomorphismProfile::add(long k, long n)
+{
+  assertTrue<InvalidArgument>(k > 0 && n >= 0,
+                              "Automorphism exponents and counts must be "
+                              "positive");
+  std::lock_guard<std::mutex> lock(mutex);
+  uses[k] += n;
+}
+
+std::map<long, long> AutomorphismProfile::counts() const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return uses;
+}
+
+long AutomorphismProfile::total() const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  long sum = 0;
+  for (const auto& entry : uses)
+    sum += entry.second;
+  return sum;
+}
+
+void AutomorphismProfile::clear()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  uses.clear();
+}
+
+void AutomorphismProfile::writeTo(std::ostream& str) const
+{
+  for (const auto& [k, n] : counts())
+    str << k << " " << n << "\n";
+}
+
+AutomorphismProfile AutomorphismProfile::readFrom(std::istream& str)
+{
+  AutomorphismProfile profile;
+  std::string line;
+  while (std::getline(str, line)) {
+    if (line.find_first_not_of(" \t\r") == std::string::npos)
+      continue;
+    std::istringstream fields(line);
+    long k, n;
+    std::string rest;
+    if (!(fields >> k >> n) || (fields >> rest) || k <= 0 || n < 0)
+      throw IOError("Malformed automorphism profile line: " + line);
+    profile.uses[k] += n;
+  }
+  return profile;
+}
+
+AutomorphismProfile::Capture::Capture(AutomorphismProfile& profile) :
+    previous(capturing.exchange(&profile))
+{}
+
+AutomorphismProfile::Capture::~Capture() { capturing.store(previous); }
+
+AutomorphismProfile::Suspend::Suspend() : previous(suspended)
+{
+  suspended = true;
+}
+
+AutomorphismProfile::Suspend::~Suspend() { suspended = previous; }
+
+void AutomorphismProfile::record(long k, long m)
+{
+  AutomorphismProfile* profile = capturing.load(std::memory_order_relaxed);
+  if (profile == nullptr || suspended)
+    return;
+  profile->add(mcMod(k, m));
+}
+
+long keySwitchMatrixBytes(const Context& context)
+{
+  long primes =
+      context.getCtxtPrimes().card() + context.getSpecialPrimes().card();
+  long rows = getKSMemoryMode() == KSMemoryMode::COMPACT ? 1 : 2;
+  return long(sizeof(long)) * context.getDigits().size() * primes *
+         context.getPhiM() * rows;
+}
+
+KeySetPlan planKeySet(const Context& context,
+                      const AutomorphismProfile& profile,
+                      long budgetBytes,
+                      const std::set<long>& base)
+{
+  const PAlgebra& zMStar = context.getZMStar();
+  long m = context.getM();
+  long phim = context.getPhiM();
+  long matrixBytes = keySwitchMatrixBytes(context);
+  std::map<long, long> uses = profile.counts();
+  for (const auto& entry : uses)
+    assertTrue<InvalidArgument>(
+        entry.first < m && NTL::GCD(entry.first, m) == 1,
+        "Profiled automorphism not in Zm*");
+
+  // The automorphisms of the profile, and the generators (both ways, a
+  // rotation in a bad dimension uses both) and Frobenius to chain to them
+  std::set<long> candidates;
+  for (const auto& entry : uses)
+    candidates.insert(entry.first);
+  for (long i = 0; i < zMStar.numOfGens(); i++) {
+    candidates.insert(zMStar.genToPow(i, 1));
+    candidates.insert(zMStar.genToPow(i, -1));
+  }
+  candidates.insert(zMStar.getP() % m);
+  candidates.erase(1);
+  for (long e : base)
+    candidates.erase(e);
+
+  KeySetPlan plan;
+  std::set<long> keys = base;
+  std::vector<long> dist = keySwitchDistances(m, keys);
+  plan.baseKeySwitches = profileCost(uses, dist, phim);
+
+  // Greedy: the gain of a candidate s is estimated by reaching k through
+  // k/s and then s. The estimate never exceeds the true gain, the cost is
+  // recomputed exactly once s is added.
+  while (plan.bytes + matrixBytes <= budgetBytes && !candidates.empty()) {
+    double bestGain = 0;
+    long best = 0;
+    for (long s : candidates) {
+      long sInverse = NTL::InvMod(s, m);
+      double gain = 0;
+      for (const auto& [k, n] : uses) {
+        long through = dist[NTL::MulMod(k, sInverse, m)];
+        if (through < 0)
+          continue;
+        long now = dist[k] >= 0 ? dist[k] : phim;
+        if (through + 1 < now)
+          gain += double(n) * (now - through - 1);
+      }
+      if (gain > bestGain) {
+        bestGain = gain;
+        best = s;
+      }
+    }
+    if (best == 0)
+      break;
+
+    keys.insert(best);
+    candidates.erase(best);
+    plan.keys.insert(best);
+    plan.bytes += matrixBytes;
+    dist = keySwitchDistances(m, keys);
+  }
+
+  plan.expectedKeySwitches = profileCost(uses, dist, phim, &plan.unreachable);
+  return plan;
+}
+
+KeySetPlan addOptimizedMatrices(SecKey& sKey,
+                                const AutomorphismProfile& profile,
+                                long budgetBytes,
+                                long keyID)
+{
+  std::set<long> base;
+  for (const KeySwitch& matrix : sKey.keySWlist())
+    if (matrix.fromKey.getPowerOfS() == 1 &&
+        matrix.fromKey.getSecretKeyID() == keyID && matrix.toKeyID == keyID &&
+        matrix.fromKey.getPowerOfX() != 1)
+      base.insert(matrix.fromKey.getPowerOfX());
+
+  KeySetPlan plan = planKeySet(sKey.getContext(), profile, budgetBytes, base);
+  std::vector<long> vals(plan.keys.begin(), plan.keys.end());
+  sKey.GenKeySWmatrices(vals, keyID, keyID);
+  sKey.setKeySwitchMap(keyID); // re-compute the key-switching map
+  return plan;
+}
+
+} // namespace helib
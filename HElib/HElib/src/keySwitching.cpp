@@ -15,12 +15,16 @@
  *
  * Copyright IBM Corporation 2012 All rights reserved.
  */
+#include <atomic>
 #include <unordered_set>
 #include <NTL/ZZ.h>
 #include <helib/permutations.h>
+#include <helib/EvalMap.h>
+#include <helib/recryption.h>
 
 #include "binio.h"
 #include "io.h"
+#include "jsonStream.h"
 
 #include <helib/keySwitching.h>
 #include <helib/keys.h>
@@ -75,6 +79,96 @@ unsigned long KeySwitch::NumCols() const { return b.size(); }
 
 bool KeySwitch::isDummy() const { return (toKeyID == -1); }
 
+IndexSet KeySwitch::specialPrimes() const
+{
+  if (b.empty())
+    return IndexSet::emptySet();
+  return b[0].getIndexSet() & b[0].getContext().getSpecialPrimes();
+}
+
+// The keyed seeds have bit 256 set, above the 256 random bits of the seeds
+// of the earlier versions
+static const long keyedSeedBit = 256;
+
+KeySwitchASampler::KeySwitchASampler(const NTL::ZZ& seed) : seed(seed)
+{
+  if (!isKeyed(seed)) {
+    push.emplace();
+    NTL::SetSeed(seed);
+  }
+}
+
+void KeySwitchASampler::next(DoubleCRT& ai)
+{
+  if (push)
+    ai.randomize();
+  else
+    ai.randomizeKeyed(seed, column);
+  column++;
+}
+
+NTL::ZZ KeySwitchASampler::newSeed()
+{
+  NTL::ZZ seed;
+  NTL::RandomBits(seed, keyedSeedBit);
+  NTL::SetBit(seed, keyedSeedBit);
+  return seed;
+}
+
+bool KeySwitchASampler::isKeyed(const NTL::ZZ& seed)
+{
+  return NTL::NumBits(seed) == keyedSeedBit + 1;
+}
+
+static std::atomic<KSMemoryMode> ksMemoryMode(KSMemoryMode::COMPACT);
+
+void setKSMemoryMode(KSMemoryMode mode) { ksMemoryMode = mode; }
+
+KSMemoryMode getKSMemoryMode() { return ksMemoryMode; }
+
+void KeySwitch::prepare()
+{
+  bPrecon.clear();
+  bPrecon.reserve(b.size());
+  for (const DoubleCRT& bi : b)
+    bPrecon.emplace_back(bi);
+  prepareA();
+}
+
+void KeySwitch::prepareA()
+{
+  a.clear();
+  aPrecon.clear();
+  if (getKSMemoryMode() != KSMemoryMode::EXPANDED || b.empty())
+    return;
+
+  // The same expansion as in Ctxt::keySwitchDigits
+  const Context& context = b[0].getContext();
+  a.resize(b.size(), DoubleCRT(context, b[0].getIndexSet()));
+  {
+    KeySwitchASampler sampler(prgSeed);
+    for (DoubleCRT& ai : a)
+      sampler.next(ai);
+  }
+  aPrecon.reserve(a.size());
+  for (const DoubleCRT& ai : a)
+    aPrecon.emplace_back(ai);
+}
+
+KeySwitch KeySwitch::privateCopy() const
+{
+  KeySwitch copy(*this);
+  for (DoubleCRT& bi : copy.b)
+    bi.makeUnique();
+  for (DoubleCRT& ai : copy.a)
+    ai.makeUnique();
+  for (size_t i = 0; i < copy.bPrecon.size(); i++)
+    copy.bPrecon[i] = DoubleCRTPrecon(copy.b[i]);
+  for (size_t i = 0; i < copy.aPrecon.size(); i++)
+    copy.aPrecon[i] = DoubleCRTPrecon(copy.a[i]);
+  return copy;
+}
+
 void KeySwitch::verify(SecKey& sk)
 {
   long fromSPower = fromKey.getPowerOfS();
@@ -130,13 +224,10 @@ void KeySwitch::verify(SecKey& sk)
   a.resize(n, DoubleCRT(context, fullPrimes)); // defined modulo all primes
 
   {
-    RandomState state;
-
-    SetSeed(prgSeed);
+    KeySwitchASampler sampler(prgSeed);
     for (long i = 0; i < n; i++)
-      a[i].randomize();
-
-  } // the RandomState destructor "restores the state" (see NumbTh.h)
+      sampler.next(a[i]);
+  } // the sampler restores NTL's PRG, if it used it
 
   std::vector<NTL::ZZX> A, B;
 
@@ -231,6 +322,7 @@ KeySwitch KeySwitch::readFrom(std::istream& str, const Context& context)
   ret.b = read_raw_vector<DoubleCRT>(str, context);
   read_raw_ZZ(str, ret.prgSeed);
   ret.noiseBound = read_raw_xdouble(str);
+  ret.prepare();
 
   eyeCatcherFound = readEyeCatcher(str, EyeCatcher::SKM_END);
   assertTrue(eyeCatcherFound, "Could not find post-secret key eyecatcher");
@@ -238,7 +330,32 @@ KeySwitch KeySwitch::readFrom(std::istream& str, const Context& context)
   return ret;
 }
 
-void KeySwitch::writeToJSON(std::ostream& str) const { str << writeToJSON(); }
+void KeySwitch::writeToJSON(std::ostream& str) const
+{
+  executeRedirectJsonError<void>([&]() {
+    JsonStreamWriter w(str);
+    writeToJSON(w);
+  });
+}
+
+void KeySwitch::writeToJSON(JsonStreamWriter& w) const
+{
+  w.beginTyped<KeySwitch>();
+  w.beginObject();
+  w.key("fromKey");
+  w.value(unwrap(fromKey.writeToJSON()));
+  w.member("toKeyID", toKeyID);
+  w.member("ptxtSpace", ptxtSpace);
+  w.member("prgSeed", prgSeed);
+  w.member("noiseBound", noiseBound);
+  w.key("b");
+  w.beginArray();
+  for (const DoubleCRT& bi : b)
+    bi.writeToJSON(w);
+  w.endArray();
+  w.endObject();
+  w.endObject();
+}
 
 JsonWrapper KeySwitch::writeToJSON() const
 {
@@ -263,9 +380,9 @@ JsonWrapper KeySwitch::writeToJSON() const
 
 KeySwitch KeySwitch::readFromJSON(std::istream& str, const Context& context)
 {
-  json j;
-  str >> j;
-  return KeySwitch::readFromJSON(wrap(j), context);
+  KeySwitch res;
+  res.readJSON(str, context);
+  return res;
 }
 
 KeySwitch KeySwitch::readFromJSON(const JsonWrapper& jw, const Context& context)
@@ -277,9 +394,54 @@ KeySwitch KeySwitch::readFromJSON(const JsonWrapper& jw, const Context& context)
 
 void KeySwitch::readJSON(std::istream& str, const Context& context)
 {
-  json j;
-  str >> j;
-  this->readJSON(wrap(j), context);
+  executeRedirectJsonError<void>([&]() {
+    JsonStreamReader r(str);
+    readJSON(r, context);
+  });
+}
+
+void KeySwitch::readJSON(JsonStreamReader& r, const Context& context)
+{
+  r.readTyped<KeySwitch>([&]() {
+    bool haveFrom = false, haveTo = false, havePtxt = false, haveB = false;
+    bool haveSeed = false, haveNoise = false;
+    r.beginObject();
+    for (std::string k; r.nextKey(k);) {
+      if (k == "fromKey") {
+        this->fromKey = SKHandle::readFromJSON(wrap(r.value()));
+        haveFrom = true;
+      } else if (k == "toKeyID") {
+        this->toKeyID = r.value().get<long>();
+        haveTo = true;
+      } else if (k == "ptxtSpace") {
+        this->ptxtSpace = r.value().get<long>();
+        havePtxt = true;
+      } else if (k == "b") {
+        this->b.clear();
+        r.beginArray();
+        while (r.nextElement()) {
+          this->b.emplace_back(context, IndexSet::emptySet());
+          this->b.back().readJSON(r);
+        }
+        haveB = true;
+      } else if (k == "prgSeed") {
+        this->prgSeed = r.value().get<NTL::ZZ>();
+        haveSeed = true;
+      } else if (k == "noiseBound") {
+        this->noiseBound = r.value().get<NTL::xdouble>();
+        haveNoise = true;
+      } else {
+        r.skip();
+      }
+    }
+    JsonStreamReader::require(haveFrom, "fromKey");
+    JsonStreamReader::require(haveTo, "toKeyID");
+    JsonStreamReader::require(havePtxt, "ptxtSpace");
+    JsonStreamReader::require(haveB, "b");
+    JsonStreamReader::require(haveSeed, "prgSeed");
+    JsonStreamReader::require(haveNoise, "noiseBound");
+  });
+  this->prepare();
 }
 
 void KeySwitch::readJSON(const JsonWrapper& jw, const Context& context)
@@ -292,6 +454,7 @@ void KeySwitch::readJSON(const JsonWrapper& jw, const Context& context)
   this->b = readVectorFromJSON<DoubleCRT>(j.at("b"), context);
   this->prgSeed = j.at("prgSeed").get<NTL::ZZ>();
   this->noiseBound = j.at("noiseBound").get<NTL::xdouble>();
+  this->prepare();
 }
 
 long KSGiantStepSize(long D)
@@ -310,11 +473,13 @@ void addAllMatrices(SecKey& sKey, long keyID)
   long m = context.getM();
 
   // key-switching matrices for the automorphisms
+  std::vector<long> vals;
   for (long i = 0; i < m; i++) {
     if (!context.getZMStar().inZmStar(i))
       continue;
-    sKey.GenKeySWmatrix(1, i, keyID, keyID);
+    vals.push_back(i);
   }
+  sKey.GenKeySWmatrices(vals, keyID, keyID);
   sKey.setKeySwitchMap(); // re-compute the key-switching map
 }
 
@@ -393,12 +558,14 @@ static void add1Dmats4dim(SecKey& sKey, long i, long keyID)
     native = true;
   }
 
+  std::vector<long> vals;
   for (long j = 1; j < ord; j++)
-    sKey.GenKeySWmatrix(1, zMStar.genToPow(i, j), keyID, keyID);
+    vals.push_back(zMStar.genToPow(i, j));
 
   if (!native)
-    sKey.GenKeySWmatrix(1, zMStar.genToPow(i, -ord), keyID, keyID);
+    vals.push_back(zMStar.genToPow(i, -ord));
 
+  sKey.GenKeySWmatrices(vals, keyID, keyID);
   sKey.setKSStrategy(i, HELIB_KSS_FULL);
 }
 
@@ -545,17 +712,20 @@ static void addSome1Dmats4dim(SecKey& sKey,
 
   long g = KSGiantStepSize(ord);
 
+  std::vector<long> vals;
+
   // baby steps
   for (long j = 1; j < g; j++)
-    sKey.GenKeySWmatrix(1, zMStar.genToPow(i, j), keyID, keyID);
+    vals.push_back(zMStar.genToPow(i, j));
 
   // giant steps
   for (long j = g; j < ord; j += g)
-    sKey.GenKeySWmatrix(1, zMStar.genToPow(i, j), keyID, keyID);
+    vals.push_back(zMStar.genToPow(i, j));
 
   if (!native)
-    sKey.GenKeySWmatrix(1, zMStar.genToPow(i, -ord), keyID, keyID);
+    vals.push_back(zMStar.genToPow(i, -ord));
 
+  sKey.GenKeySWmatrices(vals, keyID, keyID);
   sKey.setKSStrategy(i, HELIB_KSS_BSGS);
 
   // NOTE: the old code also added matrices for ord-2^k for small k,
@@ -669,6 +839,7 @@ void addMatrices4Network(SecKey& sKey, const PermNetwork& net, long keyID)
   const Context& context = sKey.getContext();
   long m = context.getM();
 
+  std::vector<long> vals;
   for (long i = 0; i < net.depth(); i++) {
     long e = net.getLayer(i).getE();
     long gIdx = net.getLayer(i).getGenIdx();
@@ -678,19 +849,56 @@ void addMatrices4Network(SecKey& sKey, const PermNetwork& net, long keyID)
     for (long j = 0; j < shamts.length(); j++) {
       if (shamts[j] == 0)
         continue;
-      long val = NTL::PowerMod(g2e, shamts[j], m);
-      sKey.GenKeySWmatrix(1, val, keyID, keyID);
+      vals.push_back(NTL::PowerMod(g2e, shamts[j], m));
     }
   }
+  sKey.GenKeySWmatrices(vals, keyID, keyID);
   sKey.setKeySwitchMap(); // re-compute the key-switching map
 }
 
 void addTheseMatrices(SecKey& sKey, const std::set<long>& automVals, long keyID)
 {
-  std::set<long>::iterator it;
-  for (it = automVals.begin(); it != automVals.end(); ++it) {
-    long k = *it;
-    sKey.GenKeySWmatrix(1, k, keyID, keyID);
+  std::vector<long> vals(automVals.begin(), automVals.end());
+  sKey.GenKeySWmatrices(vals, keyID, keyID);
+  sKey.setKeySwitchMap(); // re-compute the key-switching map
+}
+
+void addRelinMatrices(SecKey& sKey, long maxPower, long keyID)
+{
+  for (long e = 2; e <= maxPower; e++)
+    sKey.GenKeySWmatrix(e, 1, keyID, keyID); // s^e -> s matrix
+  sKey.setKeySwitchMap(); // re-compute the key-switching map
+}
+
+void addBootstrappingMatrices(SecKey& sKey, long keyID)
+{
+  const Context& context = sKey.getContext();
+  assertTrue(context.isBootstrappable(),
+             "addBootstrappingMatrices: the context is not bootstrappable");
+  const ThinRecryptData& rcData = context.getRcData();
+
+  // The automorphisms of every dimension, -1 for the Frobenius
+  std::map<long, std::set<long>> autos;
+  if (rcData.coeffToSlot)
+    rcData.coeffToSlot->automorphisms(autos);
+  if (rcData.slotToCoeff)
+    rcData.slotToCoeff->automorphisms(autos);
+  if (rcData.firstMap) {
+    rcData.firstMap->automorphisms(autos);
+    // the Frobenius automorphisms that unpack the slots
+    const PAlgebra& zMStar = context.getZMStar();
+    for (long j : range(1, context.getOrdP()))
+      autos[-1].insert(zMStar.genToPow(-1, j));
+  }
+  if (rcData.secondMap)
+    rcData.secondMap->automorphisms(autos);
+
+  for (const auto& entry : autos) {
+    if (entry.second.empty())
+      continue;
+    std::vector<long> vals(entry.second.begin(), entry.second.end());
+    sKey.GenKeySWmatrices(vals, keyID, keyID);
+    sKey.setKSStrategy(entry.first, HELIB_KSS_FULL);
   }
   sKey.setKeySwitchMap(); // re-compute the key-switching map
 }
@@ -9,7 +9,20 @@
  * See the License for the specific language governing permissions and
  * limitations under the License. See accompanying LICENSE file.
  */
+#include <algorithm>
+#include <atomic>
+#include <memory>
 #include <queue>
+#include <sstream>
+#include <streambuf>
+#include <tuple>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <NTL/BasicThreadPool.h>
 
 #include <helib/keys.h>
 #include <helib/timing.h>
@@ -21,9 +34,12 @@
 #include <helib/apiAttributes.h>
 #include <helib/fhe_stats.h>
 #include <helib/log.h>
+#include <helib/opCounters.h>
 #include "internal_symbols.h" // DECRYPT_ON_PWFL_BASIS
+#include "crtTable.h"
 
 #include "io.h"
+#include "jsonStream.h"
 
 namespace helib {
 
@@ -82,7 +98,10 @@ double RLWE(DoubleCRT& c0,
 // Computes the keySwitchMap pointers, using breadth-first search (BFS)
 
 PubKey::PubKey(const Context& _context) :
-    context(_context), pubEncrKey(*this), recryptEkey(*this)
+    context(_context),
+    pubEncrKey(*this),
+    recryptEkey(*this),
+    slotToCoeffGrowthBits(-1)
 {
   recryptKeyID = -1;
 }
@@ -94,9 +113,14 @@ PubKey::PubKey(const PubKey& other) :
     skBounds(other.skBounds),
     keySwitching(other.keySwitching),
     keySwitchMap(other.keySwitchMap),
+    levelKeySwitching(other.levelKeySwitching),
     KS_strategy(other.KS_strategy),
     recryptKeyID(other.recryptKeyID),
-    recryptEkey(*this)
+    recryptEkey(*this),
+    recryptEkeyPrecon(other.recryptEkeyPrecon),
+    mappedStorage(other.mappedStorage),
+    slotToCoeffGrowthBits(other.slotToCoeffGrowthBits.load()),
+    keySwitchingReplicas()
 { // copy pubEncrKey,recryptEkey w/o checking the ref to the public key
   pubEncrKey.privateAssign(other.pubEncrKey);
   recryptEkey.privateAssign(other.recryptEkey);
@@ -108,8 +132,13 @@ void PubKey::clear()
   skBounds.clear();
   keySwitching.clear();
   keySwitchMap.clear();
+  levelKeySwitching.clear();
   recryptKeyID = -1;
   recryptEkey.clear();
+  recryptEkeyPrecon.clear();
+  mappedStorage.reset();
+  slotToCoeffGrowthBits = -1;
+  keySwitchingReplicas.clear();
 }
 
 void PubKey::setKeySwitchMap(long keyId)
@@ -173,14 +202,14 @@ const KeySwitch& PubKey::getKeySWmatrix(const SKHandle& from, long toIdx) const
     if (matIdx >= 0) {
       const KeySwitch& matrix = keySwitching.at(matIdx);
       if (matrix.fromKey == from)
-        return matrix;
+        return nodeLocal(matrix);
     }
   }
 
   // Otherwise resort to linear search
   for (size_t i = 0; i < keySwitching.size(); i++) {
     if (keySwitching[i].toKeyID == toIdx && keySwitching[i].fromKey == from)
-      return keySwitching[i];
+      return nodeLocal(keySwitching[i]);
   }
   return KeySwitch::dummy(); // return this if nothing is found
 }
@@ -194,14 +223,14 @@ const KeySwitch& PubKey::getAnyKeySWmatrix(const SKHandle& from) const
     if (matIdx >= 0) {
       const KeySwitch& matrix = keySwitching.at(matIdx);
       if (matrix.fromKey == from)
-        return matrix;
+        return nodeLocal(matrix);
     }
   }
 
   // Otherwise resort to linear search
   for (size_t i = 0; i < keySwitching.size(); i++) {
     if (keySwitching[i].fromKey == from)
-      return keySwitching[i];
+      return nodeLocal(keySwitching[i]);
   }
   return KeySwitch::dummy(); // return this if nothing is found
 }
@@ -300,10 +329,54 @@ bool PubKey::haveAnyKeySWmatrix(const SKHandle& from) const
   return getAnyKeySWmatrix(from).toKeyID >= 0;
 }
 
+const KeySwitch* PubKey::getLevelKeySWmatrix(const SKHandle& from,
+                                             long toIdx,
+                                             const IndexSet& s) const
+{
+  const KeySwitch* best = nullptr;
+  for (const KeySwitch& W : levelKeySwitching) {
+    if (W.toKeyID != toIdx || W.fromKey != from ||
+        !(s <= W.b[0].getIndexSet()))
+      continue;
+    if (best == nullptr ||
+        W.b[0].getIndexSet().card() < best->b[0].getIndexSet().card())
+      best = &W;
+  }
+  return best ? &nodeLocal(*best) : nullptr;
+}
+
+long PubKey::maxRelinPower(long keyID) const
+{
+  long e = 1;
+  while (haveKeySWmatrix(e + 1, 1, keyID, keyID))
+    e++;
+  return e;
+}
+
 const KeySwitch& PubKey::getNextKSWmatrix(long fromXPower, long fromID) const
 {
   long matIdx = keySwitchMap.at(fromID).at(fromXPower);
-  return (matIdx >= 0 ? keySwitching.at(matIdx) : KeySwitch::dummy());
+  return (matIdx >= 0 ? nodeLocal(keySwitching.at(matIdx))
+                      : KeySwitch::dummy());
+}
+
+const KeySwitch& PubKey::nodeLocal(const KeySwitch& matrix) const
+{
+  // The level matrices get the negative indices
+  long idx;
+  if (!keySwitching.empty() && &matrix >= &keySwitching.front() &&
+      &matrix <= &keySwitching.back())
+    idx = &matrix - &keySwitching.front();
+  else if (!levelKeySwitching.empty() &&
+           &matrix >= &levelKeySwitching.front() &&
+           &matrix <= &levelKeySwitching.back())
+    idx = -1 - (&matrix - &levelKeySwitching.front());
+  else
+    return matrix;
+  const KeySwitch* copy = keySwitchingReplicas.get(idx, [&matrix]() {
+    return matrix.privateCopy();
+  });
+  return copy ? *copy : matrix;
 }
 
 bool PubKey::isReachable(long k, long keyID) const
@@ -404,6 +477,12 @@ long PubKey::Encrypt(Ctxt& ctxt,
   if (context.getZMStar().getPow2() == 0) // not power of two
     stdev *= sqrt(context.getM());
 
+  // The Gaussian noise of all the parts, sampled in parallel
+  long skipped = highNoise ? 1 : 0;
+  std::vector<zzX> noise(ctxt.parts.size() - skipped);
+  std::vector<double> noiseBounds =
+      sampleGaussianBounded(noise, context, stdev);
+
   for (size_t i = 0; i < ctxt.parts.size(); i++) { // add noise to all the parts
     ctxt.parts[i] *= r;
     NTL::xdouble e_bound;
@@ -420,7 +499,8 @@ long PubKey::Encrypt(Ctxt& ctxt,
       // FIXME: should we use a bounded version of this?
       // We haven't implemented this yet
     } else {
-      e_bound = e.sampleGaussianBounded(stdev);
+      e = noise[i - skipped];
+      e_bound = noiseBounds[i - skipped];
     }
 
     e *= ptxtSpace;
@@ -542,13 +622,18 @@ void PubKey::CKKSencrypt(Ctxt& ctxt,
   if (context.getZMStar().getPow2() == 0) // not power of two
     stdev *= sqrt(m);
 
+  // zero-mean Gaussian noise, sigma=stdev, for all the parts in parallel
+  std::vector<zzX> noise(ctxt.parts.size());
+  std::vector<double> noiseBounds =
+      sampleGaussianBounded(noise, context, stdev);
+
   for (size_t i = 0; i < ctxt.parts.size(); i++) {
     // add noise to all the parts
 
     ctxt.parts[i] *= r;
 
-    double e_bound = e.sampleGaussianBounded(stdev);
-    // zero-mean Gaussian, sigma=stdev
+    e = noise[i];
+    double e_bound = noiseBounds[i];
 
     ctxt.parts[i] += e;
     if (i == 1) {
@@ -632,73 +717,85 @@ void PubKey::Encrypt(Ctxt& ctxt, const EncodedPtxt_BGV& eptxt) const
   assertEq(&context, &eptxt.getContext(), "Encrypt: context mismatch");
 
   long ptxtSpace = eptxt.getPtxtSpace();
-  NTL::ZZX ptxt;
-
-  convert(ptxt, eptxt.getPoly());
-
-  // The rest of the code is copy/pasted from the
-  // original Encrypt code, except that for now, highNoise
-  // is not implemented.  We can put it back if necessary.
-  // We may eventually want to completely deprecate the original
-  // Encrypt code, which is why it is copy/pasted for now.
-  // We could also just invoke
-  //    Encrypt(ctxt, ptxt, ptxtSpace, /*highNoise=*/false);
-  // at this point for the same effect.
-
-  // VJS-FIXME: I really should get rid of the unnecessary
-  // connversions from zzX to ZZX...I've added a zzX version
-  // of balanced_mulMod...but I also need zzX versions
-  // of DoubleCRT += and friends.
-
   if (ptxtSpace != pubEncrKey.ptxtSpace) { // plaintext-space mismatch
     ptxtSpace = NTL::GCD(ptxtSpace, pubEncrKey.ptxtSpace);
     if (ptxtSpace <= 1)
       throw RuntimeError("Plaintext-space mismatch on encryption");
   }
 
+  // For now, highNoise is not implemented here, as it is in the
+  // original Encrypt code.  We can put it back if necessary.
+  encryptZero(ctxt, ptxtSpace);
+  addEncoded(ctxt, eptxt);
+
+  // CheckCtxt(ctxt, "after encryption");
+}
+
+void PubKey::Encrypt(Ctxt& ctxt, const EncodedPtxt_CKKS& eptxt) const
+{
+  assertTrue(isCKKS(), "Encrypt: mismatched CKKS ptxt / BGV ctxt");
+  assertEq(this, &ctxt.pubKey, "Public key and context public key mismatch");
+  assertEq(&context, &eptxt.getContext(), "Encrypt: context mismatch");
+
+  encryptZero(ctxt, 1);
+  addEncoded(ctxt, eptxt);
+}
+
+void PubKey::encryptZero(Ctxt& ctxt, long ptxtSpace) const
+{
+  HELIB_TIMER_START;
+
+  assertEq(this, &ctxt.pubKey, "encryptZero: public key mismatch");
+  assertTrue(ptxtSpace == 1 || !isCKKS(),
+             "encryptZero: CKKS plaintext space must be 1");
+  assertTrue(ptxtSpace == 1 || pubEncrKey.ptxtSpace % ptxtSpace == 0,
+             "encryptZero: plaintext space does not divide that of the key");
+
   // generate a random encryption of zero from the public encryption key
   ctxt = pubEncrKey; // already an encryption of zero, just not a random one
                      // ctxt with two parts, each with all the ctxtPrimes
   ctxt.noiseBound = 0;
 
   // choose a random small scalar r and a small random error vector (e0,e1),
-  // then set ctxt = r*pk + p*(e0,e1) + (ptxt,0),
-  // where pk = pubEncrKey, and p = ptxtSpace.
+  // then set ctxt = r*pk + p*(e0,e1),
+  // where pk = pubEncrKey, and p = ptxtSpace (1 for CKKS).
 
   // The resulting ciphertext decrypts to
-  //   r*<sk,pk> + p*(e0 + sk1*e1) + ptxt,
+  //   r*<sk,pk> + p*(e0 + sk1*e1),
   // where sk = (1, sk1) is the secret key.
   // This leads to a noise bound of:
   //   r_bound*pubEncrKey.noiseBound
   //     + p*e0_bound + p*e1_bound*getSKeyBound()
-  //     + ptxt_bound
   //  Here, r_bound, e0_bound, and e1_bound are values
   //  returned by the corresponding sampling routines.
-  //  ptxt_bound is somewhat heuristically set assuming
-  //  that the coefficients of the ciphertext are uniformly
-  //  and independently chosen from the interval [-p/2, p/2].
 
   DoubleCRT e(context, context.getCtxtPrimes());
   DoubleCRT r(context, context.getCtxtPrimes());
-  double r_bound = r.sampleSmallBounded();
+  double r_bound = r.sampleSmallBounded(); // r is a {0,+-1} polynomial
 
   ctxt.noiseBound += r_bound * pubEncrKey.noiseBound;
 
-  // std::cerr << "*** r_bound*pubEncrKey.noiseBound " << r_bound *
-  // pubEncrKey.noiseBound << "\n";
-
   double stdev = to_double(context.getStdev());
+  // VJS-NOTE: this should never happen for CKKS
   if (context.getZMStar().getPow2() == 0) // not power of two
     stdev *= sqrt(context.getM());
 
+  // The noise of all the parts, sampled in parallel
+  std::vector<zzX> noise(ctxt.parts.size());
+  std::vector<double> noiseBounds =
+      sampleGaussianBounded(noise, context, stdev);
+
   for (size_t i = 0; i < ctxt.parts.size(); i++) { // add noise to all the parts
     ctxt.parts[i] *= r;
     NTL::xdouble e_bound;
 
-    e_bound = e.sampleGaussianBounded(stdev);
+    e = noise[i];
+    e_bound = noiseBounds[i];
 
-    e *= ptxtSpace;
-    e_bound *= ptxtSpace;
+    if (ptxtSpace > 1) {
+      e *= ptxtSpace;
+      e_bound *= ptxtSpace;
+    }
 
     if (i == 1) {
       e_bound *= getSKeyBound(ctxt.parts[i].skHandle.getSecretKeyID());
@@ -706,21 +803,46 @@ void PubKey::Encrypt(Ctxt& ctxt, const EncodedPtxt_BGV& eptxt) const
 
     ctxt.parts[i] += e;
     ctxt.noiseBound += e_bound;
-
-    // std::cerr << "*** e_bound " << e_bound << "\n";
   }
 
-  // add in the plaintext
+  // fill in the other ciphertext data members
+  ctxt.ptxtSpace = ptxtSpace;
+  ctxt.intFactor = 1;
+  ctxt.ratFactor = ctxt.ptxtMag = 1.0;
+}
+
+void PubKey::addEncoded(Ctxt& zero, const EncodedPtxt_BGV& eptxt) const
+{
+  assertTrue(!isCKKS(), "addEncoded: mismatched BGV ptxt / CKKS ctxt");
+  assertEq(this, &zero.pubKey, "addEncoded: public key mismatch");
+  assertEq(&context, &eptxt.getContext(), "addEncoded: context mismatch");
+
+  // The noise of zero is a multiple of zero.ptxtSpace, so of any divisor
+  long ptxtSpace = NTL::GCD(eptxt.getPtxtSpace(), zero.ptxtSpace);
+  if (ptxtSpace <= 1)
+    throw RuntimeError("Plaintext-space mismatch on encryption");
+
+  // VJS-FIXME: I really should get rid of the unnecessary
+  // connversions from zzX to ZZX...I've added a zzX version
+  // of balanced_mulMod...but I also need zzX versions
+  // of DoubleCRT += and friends.
+  NTL::ZZX ptxt;
+  convert(ptxt, eptxt.getPoly());
+
+  // add in the plaintext, ctxt = zero + (ptxt,0)
   // FIXME: we should really randomize ptxt, so that each coefficient
   //    has expected value 0
   // NOTE: This relies on the first part, ctxt[0], to have handle to 1
 
   // This code sequence could be optimized, but there is no point
-  long QmodP = rem(context.productOfPrimes(ctxt.primeSet), ptxtSpace);
+  long QmodP = rem(context.productOfPrimes(zero.primeSet), ptxtSpace);
   NTL::ZZX ptxt_fixed;
   balanced_MulMod(ptxt_fixed, ptxt, QmodP, ptxtSpace);
-  ctxt.parts[0] += ptxt_fixed;
+  zero.parts[0] += ptxt_fixed;
 
+  // ptxt_bound is somewhat heuristically set assuming
+  // that the coefficients of the ciphertext are uniformly
+  // and independently chosen from the interval [-p/2, p/2].
   // NOTE: this is a heuristic, as the ptxt is not really random.
   // although, when ptxtSpace == 2, the balanced_MulMod will
   // randomize it
@@ -739,25 +861,15 @@ void PubKey::Encrypt(Ctxt& ctxt, const EncodedPtxt_BGV& eptxt) const
   double ptxt_rat = ptxt_sz / ptxt_bound;
   HELIB_STATS_UPDATE("ptxt_rat", ptxt_rat);
 
-  ctxt.noiseBound += ptxt_bound;
-
-  // std::cerr << "*** ptxt_bound " << ptxt_bound << "\n";
-
-  // fill in the other ciphertext data members
-  ctxt.ptxtSpace = ptxtSpace;
-  ctxt.intFactor = 1;
-  ctxt.ratFactor = ctxt.ptxtMag = 1.0;
-
-  // std::cerr << "*** ctxt.noiseBound " << ctxt.noiseBound << "\n";
-
-  // CheckCtxt(ctxt, "after encryption");
+  zero.noiseBound += ptxt_bound;
+  zero.ptxtSpace = ptxtSpace;
 }
 
-void PubKey::Encrypt(Ctxt& ctxt, const EncodedPtxt_CKKS& eptxt) const
+void PubKey::addEncoded(Ctxt& zero, const EncodedPtxt_CKKS& eptxt) const
 {
-  assertTrue(isCKKS(), "Encrypt: mismatched CKKS ptxt / BGV ctxt");
-  assertEq(this, &ctxt.pubKey, "Public key and context public key mismatch");
-  assertEq(&context, &eptxt.getContext(), "Encrypt: context mismatch");
+  assertTrue(isCKKS(), "addEncoded: mismatched CKKS ptxt / BGV ctxt");
+  assertEq(this, &zero.pubKey, "addEncoded: public key mismatch");
+  assertEq(&context, &eptxt.getContext(), "addEncoded: context mismatch");
 
   NTL::ZZX ptxt;
   convert(ptxt, eptxt.getPoly());
@@ -769,23 +881,9 @@ void PubKey::Encrypt(Ctxt& ctxt, const EncodedPtxt_CKKS& eptxt) const
   assertTrue(scale > 0, "CKKS encryption: scale <= 0");
   assertTrue(err > 0, "CKKS encryption: err <= 0");
 
-  long m = context.getM();
-
-  // generate a random encryption of zero from the public encryption key
-  ctxt = pubEncrKey; // already an encryption of zero, just not a random one
-
-  // choose a random small scalar r and a small random error vector
-  // (e0,e1), then set ctxt = r*pk + (e0,e1) + (ef*ptxt,0), where
-  // pk = pubEncrKey, and ef (the "extra factor") is described below
-
-  // The resulting ciphertext decrypts to
-  //   r*<sk,pk> + e0 + sk1*e1 + ef*ptxt,
-  // where sk = (1,s) is the secret key.
-  // So the noise added to ptxt by the encryption process is
-  //    error_bound = r_bound*pubEncrKey.noiseBound
-  //                  + e0_bound + e1_bound*getSKeyBound()
-  // Here, r_bound, e0_bound, and e1_bound are values returned by the
-  // corresponding sampling routines.
+  // Set ctxt = zero + (ef*ptxt,0), where ef (the "extra factor") is
+  // described below. The noise added to ptxt by the encryption of zero is
+  // error_bound = zero.noiseBound (see encryptZero).
   //
   // The input ptxt is already scaled by a factor f=scale, and is being
   // further scaled by the extra factor ef, so ef*f is the new scaling
@@ -794,33 +892,7 @@ void PubKey::Encrypt(Ctxt& ctxt, const EncodedPtxt_CKKS& eptxt) const
   // the scaled noise added by encryption is less than the scaled
   // noise already present in the encoded ptxt.
 
-  DoubleCRT e(context, context.getCtxtPrimes());
-  DoubleCRT r(context, context.getCtxtPrimes());
-
-  double r_bound = r.sampleSmallBounded(); // r is a {0,+-1} polynomial
-
-  NTL::xdouble error_bound = r_bound * pubEncrKey.noiseBound;
-
-  double stdev = to_double(context.getStdev());
-
-  // VJS-NOTE: this should never happen for CKKS
-  if (context.getZMStar().getPow2() == 0) // not power of two
-    stdev *= sqrt(m);
-
-  for (size_t i = 0; i < ctxt.parts.size(); i++) {
-    // add noise to all the parts
-
-    ctxt.parts[i] *= r;
-
-    double e_bound = e.sampleGaussianBounded(stdev);
-    // zero-mean Gaussian, sigma=stdev
-
-    ctxt.parts[i] += e;
-    if (i == 1) {
-      e_bound *= getSKeyBound(ctxt.parts[i].skHandle.getSecretKeyID());
-    }
-    error_bound += e_bound;
-  }
+  NTL::xdouble error_bound = zero.noiseBound;
 
   // Compute the extra scaling factor, if needed
 
@@ -829,22 +901,49 @@ void PubKey::Encrypt(Ctxt& ctxt, const EncodedPtxt_CKKS& eptxt) const
   long ef = NTL::conv<long>(ceil(error_bound / err));
 
   if (ef > 1) { // scale up some more
-    ctxt.parts[0] += ptxt * ef;
+    zero.parts[0] += ptxt * ef;
     scale *= ef;
     err *= ef;
   } else { // no need for extra scaling
-    ctxt.parts[0] += ptxt;
+    zero.parts[0] += ptxt;
   }
 
   // VJS-NOTE: we no longer round to the next power of two:
   // Then encoding routine should take care of setting mag correctly.
-  ctxt.ptxtMag = mag;
-  ctxt.ratFactor = scale;
-  ctxt.noiseBound = error_bound + err;
-  ctxt.ptxtSpace = 1;
-  ctxt.intFactor = 1;
+  zero.ptxtMag = mag;
+  zero.ratFactor = scale;
+  zero.noiseBound = error_bound + err;
+  zero.ptxtSpace = 1;
+  zero.intFactor = 1;
+}
+
+template <typename Scheme>
+void PubKey::Encrypt(std::vector<Ctxt>& ciphertxts,
+                     const std::vector<Ptxt<Scheme>>& plaintxts) const
+{
+  long n = plaintxts.size();
+  ciphertxts.assign(n, Ctxt(*this));
+
+  // The seeds are drawn in turn, so that the noise of every ciphertext only
+  // depends on the stream of the caller
+  std::vector<NTL::ZZ> seeds(n);
+  for (long i = 0; i < n; i++)
+    RandomBits(seeds[i], 256);
+
+  HELIB_EXEC_RANGE(n, first, last)
+  NTL::RandomStreamPush push;
+  for (long i = first; i < last; i++) {
+    SetSeed(seeds[i]);
+    Encrypt(ciphertxts[i], plaintxts[i]);
+  }
+  HELIB_EXEC_RANGE_END
 }
 
+template void PubKey::Encrypt(std::vector<Ctxt>& ciphertxts,
+                              const std::vector<Ptxt<BGV>>& plaintxts) const;
+template void PubKey::Encrypt(std::vector<Ctxt>& ciphertxts,
+                              const std::vector<Ptxt<CKKS>>& plaintxts) const;
+
 void PubKey::Encrypt(Ctxt& ctxt, const EncodedPtxt& eptxt) const
 {
   if (eptxt.isBGV())
@@ -958,6 +1057,7 @@ PubKey PubKey::readFrom(std::istream& str, const Context& context)
   ret.recryptKeyID = read_raw_int(str);
   ret.recryptEkey.read(str); // Using in-place ctxt read function for
                              // performance
+  ret.recryptEkeyPrecon = ret.recryptEkey.partsPrecon();
 
   eyeCatcherFound = readEyeCatcher(str, EyeCatcher::PK_END);
   assertTrue<IOError>(eyeCatcherFound,
@@ -966,9 +1066,272 @@ PubKey PubKey::readFrom(std::istream& str, const Context& context)
   return ret;
 }
 
+namespace {
+
+// A file mapped privately into memory, readable and writable by this
+// process only, whose pages are shared with the other processes that map it
+// until they are written
+class MappedFile
+{
+public:
+  explicit MappedFile(const std::string& path)
+  {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    assertTrue<IOError>(fd >= 0, "Cannot open " + path);
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size == 0) {
+      ::close(fd);
+      throw IOError("Cannot map " + path);
+    }
+    len = st.st_size;
+    void* p = ::mmap(nullptr,
+                     len,
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE,
+                     fd,
+                     0);
+    ::close(fd);
+    assertTrue<IOError>(p != MAP_FAILED, "Cannot map " + path);
+    bytes = static_cast<char*>(p);
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  ~MappedFile() { ::munmap(bytes, len); }
+
+  char* begin() const { return bytes; }
+  long size() const { return len; }
+
+private:
+  char* bytes;
+  long len;
+};
+
+// A read-only stream buffer over bytes in memory, that knows how far it was
+// read
+class MemoryBuf : public std::streambuf
+{
+public:
+  MemoryBuf(char* bytes, long len) { setg(bytes, bytes, bytes + len); }
+
+  long consumed() const { return gptr() - eback(); }
+};
+
+// The version of the format of writeMappableTo
+constexpr long MAPPED_VERSION = 1;
+// Written as a long to check the byte order
+constexpr long MAPPED_BYTE_ORDER = 0x0102030405060708l;
+
+constexpr long MAPPED_ALIGNMENT = ResidueSlab::ALIGNMENT;
+
+static_assert(std::atomic<long>::is_always_lock_free,
+              "The reference count of a mapped slab must be a plain long");
+
+long alignUp(long n)
+{
+  return (n + MAPPED_ALIGNMENT - 1) / MAPPED_ALIGNMENT * MAPPED_ALIGNMENT;
+}
+
+// The bytes of the block of a column with card primes: the header, the rows
+// and the Shoup companions
+long mappedColumnBytes(long card, long stride, long phim)
+{
+  return ResidueSlab::headerBytes() + card * stride * long(sizeof(long)) +
+         alignUp(card * phim * long(sizeof(NTL::mulmod_precon_t)));
+}
+
+void writeZeros(std::ostream& str, long n)
+{
+  static const char zeros[MAPPED_ALIGNMENT] = {};
+  for (; n > 0; n -= MAPPED_ALIGNMENT)
+    str.write(zeros, std::min(n, MAPPED_ALIGNMENT));
+}
+
+} // namespace
+
+void PubKey::writeMappableTo(std::ostream& str) const
+{
+  // The key without the columns of its matrices, as by writeTo, followed by
+  // the index of the columns, both padded to a whole number of cache lines.
+  // The columns come next, every one in a block laid out as a ResidueSlab
+  // attaches it: a header with a reference count of one, held by the file,
+  // then the rows spaced by the stride of the slab, then their companions.
+  // The offsets of the index count from the end of the padding.
+  std::ostringstream meta;
+  writeEyeCatcher(meta, EyeCatcher::MPK_BEGIN);
+  write_raw_int(meta, MAPPED_VERSION);
+  write_raw_int(meta, MAPPED_BYTE_ORDER);
+  write_raw_int(meta, sizeof(long));
+  write_raw_int(meta, sizeof(NTL::mulmod_precon_t));
+  write_raw_int(meta, MAPPED_ALIGNMENT);
+
+  PubKey bare(*this);
+  for (KeySwitch& W : bare.keySwitching) {
+    W.b.clear();
+    W.bPrecon.clear();
+    W.a.clear();
+    W.aPrecon.clear();
+  }
+  bare.writeTo(meta);
+
+  const long phim = context.getPhiM();
+  write_raw_int(meta, keySwitching.size());
+  long offset = 0;
+  for (const KeySwitch& W : keySwitching) {
+    write_raw_int(meta, W.b.size());
+    for (const DoubleCRT& bi : W.b) {
+      bi.getIndexSet().writeTo(meta);
+      write_raw_int(meta, offset);
+      offset += mappedColumnBytes(
+          bi.getIndexSet().card(), bi.getMap().rowStride(), phim);
+    }
+  }
+  writeEyeCatcher(meta, EyeCatcher::MPK_END);
+
+  const std::string& metaBytes = meta.str();
+  str.write(metaBytes.data(), metaBytes.size());
+  writeZeros(str, alignUp(metaBytes.size()) - metaBytes.size());
+
+  for (const KeySwitch& W : keySwitching)
+    for (long j : range(W.b.size())) {
+      const DoubleCRT& bi = W.b[j];
+      const IndexSet& s = bi.getIndexSet();
+      const long stride = bi.getMap().rowStride();
+
+      long owner = 1;
+      str.write(reinterpret_cast<const char*>(&owner), sizeof(long));
+      writeZeros(str, ResidueSlab::headerBytes() - sizeof(long));
+      for (long i : s) {
+        str.write(reinterpret_cast<const char*>(bi.getMap()[i]),
+                  phim * sizeof(long));
+        writeZeros(str, (stride - phim) * sizeof(long));
+      }
+
+      // The companions may not be there if b was modified without prepare()
+      const DoubleCRTPrecon computed =
+          (j < long(W.bPrecon.size()) && W.bPrecon[j].getIndexSet() == s)
+              ? W.bPrecon[j]
+              : DoubleCRTPrecon(bi);
+      for (long i : s)
+        str.write(reinterpret_cast<const char*>(computed[i]),
+                  phim * sizeof(NTL::mulmod_precon_t));
+      long preconBytes = s.card() * phim * sizeof(NTL::mulmod_precon_t);
+      writeZeros(str, alignUp(preconBytes) - preconBytes);
+    }
+}
+
+PubKey PubKey::readMappedFrom(const std::string& path, const Context& context)
+{
+  auto file = std::make_shared<MappedFile>(path);
+  MemoryBuf buf(file->begin(), file->size());
+  std::istream str(&buf);
+  str.exceptions(std::ios::failbit | std::ios::badbit);
+
+  try {
+    bool eyeCatcherFound = readEyeCatcher(str, EyeCatcher::MPK_BEGIN);
+    assertTrue<IOError>(eyeCatcherFound,
+                        "Could not find pre-mapped key eyecatcher");
+    assertEq<IOError>(read_raw_int(str),
+                      MAPPED_VERSION,
+                      "Mapped key: version not supported");
+    bool sameLayout = read_raw_int(str) == MAPPED_BYTE_ORDER &&
+                      read_raw_int(str) == long(sizeof(long)) &&
+                      read_raw_int(str) == long(sizeof(NTL::mulmod_precon_t)) &&
+                      read_raw_int(str) == MAPPED_ALIGNMENT;
+    assertTrue<IOError>(sameLayout,
+                        "Mapped key was written on a machine with another "
+                        "layout");
+
+    PubKey ret = PubKey::readFrom(str, context);
+
+    const long phim = context.getPhiM();
+    assertEq<IOError>(read_raw_int(str),
+                      long(ret.keySwitching.size()),
+                      "Mapped key: index does not match the matrices");
+    std::vector<std::vector<std::pair<IndexSet, long>>> columns(
+        ret.keySwitching.size());
+    for (auto& cols : columns) {
+      cols.resize(read_raw_int(str));
+      for (auto& col : cols) {
+        col.first = IndexSet::readFrom(str);
+        col.second = read_raw_int(str);
+      }
+    }
+    eyeCatcherFound = readEyeCatcher(str, EyeCatcher::MPK_END);
+    assertTrue<IOError>(eyeCatcherFound,
+                        "Could not find post-mapped key eyecatcher");
+
+    const long dataStart = alignUp(buf.consumed());
+    std::shared_ptr<const void> owner = file;
+    for (long k : range(ret.keySwitching.size())) {
+      KeySwitch& W = ret.keySwitching[k];
+      W.b.clear();
+      W.bPrecon.clear();
+      for (const auto& col : columns[k]) {
+        const IndexSet& s = col.first;
+        assertTrue<IOError>(!empty(s) && s <= context.fullPrimes(),
+                            "Mapped key: bad primes of a column");
+        DoubleCRT bi(context, IndexSet());
+        const long stride = bi.getMap().rowStride();
+        const long start = dataStart + col.second;
+        bool inFile = col.second >= 0 && col.second % MAPPED_ALIGNMENT == 0 &&
+                      start + mappedColumnBytes(s.card(), stride, phim) <=
+                          file->size();
+        assertTrue<IOError>(inFile, "Mapped key: column out of the file");
+
+        long* rows = reinterpret_cast<long*>(file->begin() + start +
+                                             ResidueSlab::headerBytes());
+        bi.attachRows(rows, s);
+        W.b.push_back(std::move(bi));
+        W.bPrecon.emplace_back(
+            s,
+            phim,
+            reinterpret_cast<const NTL::mulmod_precon_t*>(rows +
+                                                          s.card() * stride),
+            owner);
+      }
+      W.prepareA();
+    }
+    ret.mappedStorage = owner;
+    return ret;
+  } catch (const std::ios::failure&) {
+    throw IOError("Mapped key: " + path + " is truncated");
+  }
+}
+
 void PubKey::writeToJSON(std::ostream& str) const
 {
-  executeRedirectJsonError<void>([&]() { str << writeToJSON(); });
+  executeRedirectJsonError<void>([&]() {
+    JsonStreamWriter w(str);
+    writeToJSON(w);
+  });
+}
+
+void PubKey::writeToJSON(JsonStreamWriter& w) const
+{
+  w.beginTyped<PubKey>();
+  w.beginObject();
+  w.key("context");
+  w.value(unwrap(this->getContext().writeToJSON()));
+  w.key("pubEncrKey");
+  this->pubEncrKey.writeToJSON(w);
+  w.member("skBounds", this->skBounds);
+  w.member("keySwitchMap", this->keySwitchMap);
+  w.member("KS_strategy", this->KS_strategy);
+  w.member("recryptKeyID", this->recryptKeyID);
+  w.key("keySwitching");
+  w.beginArray();
+  for (const KeySwitch& ks : keySwitching)
+    ks.writeToJSON(w);
+  w.endArray();
+  w.key("recryptEkey");
+  if (this->recryptKeyID >= 0)
+    this->recryptEkey.writeToJSON(w);
+  else
+    w.value("nullptr");
+  w.endObject();
+  w.endObject();
 }
 
 JsonWrapper PubKey::writeToJSON() const
@@ -991,11 +1354,9 @@ JsonWrapper PubKey::writeToJSON() const
 
 PubKey PubKey::readFromJSON(std::istream& str, const Context& context)
 {
-  return executeRedirectJsonError<PubKey>([&]() {
-    json j;
-    str >> j;
-    return readFromJSON(wrap(j), context);
-  });
+  PubKey pk{context};
+  pk.readJSON(str);
+  return pk;
 }
 
 PubKey PubKey::readFromJSON(const JsonWrapper& jw, const Context& context)
@@ -1008,9 +1369,80 @@ PubKey PubKey::readFromJSON(const JsonWrapper& jw, const Context& context)
 void PubKey::readJSON(std::istream& str)
 {
   executeRedirectJsonError<void>([&]() {
-    json j;
-    str >> j;
-    readJSON(wrap(j));
+    JsonStreamReader r(str);
+    readJSON(r);
+  });
+}
+
+void PubKey::readJSON(JsonStreamReader& r)
+{
+  r.readTyped<PubKey>([&]() {
+    // Only the members of PubKey: the secret keys of a SecKey may come first
+    PubKey::clear();
+    bool haveContext = false, haveEncrKey = false, haveBounds = false;
+    bool haveMatrices = false, haveMap = false, haveStrategy = false;
+    bool haveRecryptID = false, haveRecryptKey = false;
+
+    r.beginObject();
+    for (std::string k; r.nextKey(k);) {
+      if (k == "context") {
+        Context ser_context = Context::readFromJSON(wrap(r.value()));
+        assertEq(context, ser_context, "Context mismatch");
+        haveContext = true;
+      } else if (k == "pubEncrKey") {
+        // Get the public encryption key itself
+        this->pubEncrKey.readJSON(r);
+        haveEncrKey = true;
+      } else if (k == "skBounds") {
+        // Get the vector of secret-key Hamming-weights
+        r.value().get_to(this->skBounds);
+        haveBounds = true;
+      } else if (k == "keySwitching") {
+        r.beginArray();
+        while (r.nextElement()) {
+          keySwitching.emplace_back();
+          keySwitching.back().readJSON(r, context);
+        }
+        haveMatrices = true;
+      } else if (k == "keySwitchMap") {
+        this->keySwitchMap =
+            r.value().get<std::vector<std::vector<long>>>();
+        haveMap = true;
+      } else if (k == "KS_strategy") {
+        this->KS_strategy = r.value().get<NTL::Vec<long>>();
+        haveStrategy = true;
+      } else if (k == "recryptKeyID") {
+        this->recryptKeyID = r.value().get<long>();
+        haveRecryptID = true;
+      } else if (k == "recryptEkey") {
+        // The string "nullptr" if there is no bootstrapping key
+        if (r.atString()) {
+          r.skip();
+        } else {
+          this->recryptEkey.readJSON(r);
+          haveRecryptKey = true;
+        }
+      } else {
+        r.skip();
+      }
+    }
+    JsonStreamReader::require(haveContext, "context");
+    JsonStreamReader::require(haveEncrKey, "pubEncrKey");
+    JsonStreamReader::require(haveBounds, "skBounds");
+    JsonStreamReader::require(haveMatrices, "keySwitching");
+    JsonStreamReader::require(haveMap, "keySwitchMap");
+    JsonStreamReader::require(haveStrategy, "KS_strategy");
+    JsonStreamReader::require(haveRecryptID, "recryptKeyID");
+
+    // build the key-switching map for all keys
+    for (long i = this->skBounds.size() - 1; i >= 0; i--)
+      this->setKeySwitchMap(i);
+
+    // Get the bootstrapping key, if any
+    if (this->recryptKeyID >= 0) {
+      JsonStreamReader::require(haveRecryptKey, "recryptEkey");
+      this->recryptEkeyPrecon = this->recryptEkey.partsPrecon();
+    }
   });
 }
 
@@ -1047,6 +1479,7 @@ void PubKey::readJSON(const JsonWrapper& tjw)
     this->recryptKeyID = j.at("recryptKeyID");
     if (this->recryptKeyID >= 0) {
       this->recryptEkey.readJSON(wrap(j.at("recryptEkey")));
+      this->recryptEkeyPrecon = this->recryptEkey.partsPrecon();
     }
   };
 
@@ -1081,6 +1514,63 @@ void SecKey::clear()
 {
   PubKey::clear();
   sKeys.clear();
+  sparseKeys.clear();
+}
+
+// The nonzero coefficients of a secret-key polynomial
+static std::vector<std::pair<long, long>> sparseForm(const zzX& poly)
+{
+  std::vector<std::pair<long, long>> sparse;
+  for (long i = 0; i < poly.length(); i++)
+    if (poly[i] != 0)
+      sparse.emplace_back(i, poly[i]);
+  return sparse;
+}
+
+// Same for a key given modulo its primes, empty if a coefficient does not
+// fit in a long
+static std::vector<std::pair<long, long>> sparseForm(const DoubleCRT& sKey)
+{
+  NTL::ZZX poly;
+  sKey.toPoly(poly);
+  std::vector<std::pair<long, long>> sparse;
+  for (long i = 0; i <= deg(poly); i++) {
+    const NTL::ZZ& c = poly.rep[i];
+    if (IsZero(c))
+      continue;
+    if (NumBits(c) >= NTL_BITS_PER_LONG)
+      return {};
+    sparse.emplace_back(i, NTL::to_long(c));
+  }
+  return sparse;
+}
+
+void SecKey::setSparseKeys()
+{
+  sparseKeys.clear();
+  for (const DoubleCRT& sKey : sKeys)
+    sparseKeys.push_back(sparseForm(sKey));
+}
+
+// Adding primes to a copy of a key goes through its coefficients modulo the
+// product of all its primes. When s has primes that the key does not (e.g.
+// the small primes of a ciphertext), the key is instead rebuilt from its
+// nonzero coefficients, modulo the primes of s only.
+DoubleCRT SecKey::keyModulo(long skIdx, const IndexSet& s) const
+{
+  const DoubleCRT& sKey = sKeys.at(skIdx);
+  const std::vector<std::pair<long, long>>& sparse = sparseKeys.at(skIdx);
+  if (s <= sKey.getIndexSet() || sparse.empty()) {
+    DoubleCRT key = sKey; // copy object, not a reference
+    key.setPrimes(s);
+    return key;
+  }
+
+  zzX poly;
+  poly.SetLength(context.getPhiM(), 0);
+  for (const auto& [index, value] : sparse)
+    poly[index] = value;
+  return DoubleCRT(poly, context, s);
 }
 
 // We allow the calling application to choose a secret-key polynomial by
@@ -1093,6 +1583,15 @@ long SecKey::ImportSecKey(const DoubleCRT& sKey,
                           double bound,
                           long ptxtSpace,
                           long maxDegKswitch)
+{
+  return importSecKey(sKey, sparseForm(sKey), bound, ptxtSpace, maxDegKswitch);
+}
+
+long SecKey::importSecKey(const DoubleCRT& sKey,
+                          std::vector<std::pair<long, long>> sparseKey,
+                          double bound,
+                          long ptxtSpace,
+                          long maxDegKswitch)
 {
   if (sKeys.empty()) { // 1st secret-key, generate corresponding public key
     if (ptxtSpace < 2)
@@ -1120,6 +1619,7 @@ long SecKey::ImportSecKey(const DoubleCRT& sKey,
   }
   skBounds.push_back(bound); // record the size of the new secret-key
   sKeys.push_back(sKey);     // add to the list of secret keys
+  sparseKeys.push_back(std::move(sparseKey));
   long keyID =
       sKeys.size() - 1; // FIXME: not thread-safe, do we need to fix it?
 
@@ -1133,18 +1633,24 @@ long SecKey::GenSecKey(long ptxtSpace, long maxDegKswitch)
 {
   long hwt = context.getHwt();
 
-  DoubleCRT newSk(context,
-                  context.getCtxtPrimes() | context.getSpecialPrimes());
-
+  zzX keyPoly;
+  double bound;
   if (hwt > 0) {
     // sample a Hamming-weight-hwt polynomial
-    double bound = newSk.sampleHWtBounded(hwt);
-    return ImportSecKey(newSk, bound, ptxtSpace, maxDegKswitch);
+    bound = sampleHWtBounded(keyPoly, context, hwt);
   } else {
     // sample a 0/+-1 polynomial
-    double bound = newSk.sampleSmallBounded();
-    return ImportSecKey(newSk, bound, ptxtSpace, maxDegKswitch);
+    bound = sampleSmallBounded(keyPoly, context);
   }
+
+  DoubleCRT newSk(keyPoly,
+                  context,
+                  context.getCtxtPrimes() | context.getSpecialPrimes());
+  return importSecKey(newSk,
+                      sparseForm(keyPoly),
+                      bound,
+                      ptxtSpace,
+                      maxDegKswitch);
 }
 
 // Generate a key-switching matrix and store it in the public key.
@@ -1167,6 +1673,147 @@ void SecKey::GenKeySWmatrix(long fromSPower,
   if (haveKeySWmatrix(fromSPower, fromXPower, fromIdx, toIdx))
     return; // nothing to do here
 
+  // Push the new matrix onto our list
+  keySwitching.push_back(
+      buildKeySWmatrix(fromSPower, fromXPower, fromIdx, toIdx, p));
+}
+
+// Generate the matrices s(X^e)->s for all e in fromXPowers. Every matrix is
+// built by its own thread from a seed drawn here, in the order of the list,
+// so the result only depends on the PRG state and not on the thread count.
+void SecKey::GenKeySWmatrices(const std::vector<long>& fromXPowers,
+                              long fromIdx,
+                              long toIdx,
+                              long p)
+{
+  HELIB_TIMER_START;
+
+  // The matrices that are still missing, without repetitions
+  std::vector<long> todo;
+  for (long e : fromXPowers) {
+    if (e <= 0 || (e == 1 && fromIdx == toIdx))
+      continue;
+    if (haveKeySWmatrix(1, e, fromIdx, toIdx) ||
+        std::find(todo.begin(), todo.end(), e) != todo.end())
+      continue;
+    todo.push_back(e);
+  }
+
+  long n = todo.size();
+  std::vector<NTL::ZZ> seeds(n);
+  for (long k = 0; k < n; k++)
+    RandomBits(seeds[k], 256);
+
+  std::vector<KeySwitch> matrices(n);
+  HELIB_EXEC_RANGE(n, first, last)
+  NTL::RandomStreamPush push;
+  for (long k = first; k < last; k++) {
+    SetSeed(seeds[k]);
+    matrices[k] = buildKeySWmatrix(1, todo[k], fromIdx, toIdx, p);
+  }
+  HELIB_EXEC_RANGE_END
+
+  for (KeySwitch& W : matrices)
+    keySwitching.push_back(std::move(W));
+}
+
+// The variants are built in parallel like the matrices of GenKeySWmatrices,
+// one seed per variant drawn in order
+void SecKey::GenLevelKeySWmatrices(const std::vector<long>& levels)
+{
+  HELIB_TIMER_START;
+
+  // The (matrix, level primes, special primes) of every missing variant
+  std::vector<std::tuple<const KeySwitch*, IndexSet, IndexSet>> todo;
+  for (long k : levels) {
+    IndexSet primes;
+    for (long i : context.getCtxtPrimes()) {
+      if (primes.card() >= k)
+        break;
+      primes.insert(i);
+    }
+    if (empty(primes))
+      continue;
+    IndexSet special = context.specialPrimesForLevel(primes);
+    if (special == context.getSpecialPrimes())
+      continue; // nothing to gain over the full matrices
+    IndexSet all = primes | special;
+    for (const KeySwitch& W : keySwitching) {
+      bool have = false;
+      for (const KeySwitch& V : levelKeySwitching)
+        have = have || (V.fromKey == W.fromKey && V.toKeyID == W.toKeyID &&
+                        V.b[0].getIndexSet() == all);
+      for (const auto& entry : todo)
+        have = have || (std::get<0>(entry) == &W &&
+                        (std::get<1>(entry) | std::get<2>(entry)) == all);
+      if (!have)
+        todo.emplace_back(&W, primes, special);
+    }
+  }
+
+  long n = todo.size();
+  std::vector<NTL::ZZ> seeds(n);
+  for (long k = 0; k < n; k++)
+    RandomBits(seeds[k], 256);
+
+  std::vector<KeySwitch> matrices(n);
+  HELIB_EXEC_RANGE(n, first, last)
+  NTL::RandomStreamPush push;
+  for (long k = first; k < last; k++) {
+    SetSeed(seeds[k]);
+    matrices[k] = buildLevelKeySWmatrix(*std::get<0>(todo[k]),
+                                        std::get<1>(todo[k]),
+                                        std::get<2>(todo[k]));
+  }
+  HELIB_EXEC_RANGE_END
+
+  for (KeySwitch& W : matrices)
+    levelKeySwitching.push_back(std::move(W));
+}
+
+// A single column b = P'*s' + p*e - s*a over ctxtPrimes | special, where P'
+// is the product of the primes in special. One digit covers all of
+// ctxtPrimes, so there are no digit factors.
+KeySwitch SecKey::buildLevelKeySWmatrix(const KeySwitch& W,
+                                        const IndexSet& ctxtPrimes,
+                                        const IndexSet& special) const
+{
+  long fromSPower = W.fromKey.getPowerOfS();
+  long fromXPower = W.fromKey.getPowerOfX();
+  long fromIdx = W.fromKey.getSecretKeyID();
+
+  DoubleCRT fromKey = sKeys.at(fromIdx);
+  const DoubleCRT& toKey = sKeys.at(W.toKeyID);
+  if (fromXPower > 1)
+    fromKey.automorph(fromXPower);
+  if (fromSPower > 1)
+    fromKey.Exp(fromSPower);
+
+  KeySwitch ksMatrix(W.fromKey, fromIdx, W.toKeyID, W.ptxtSpace);
+  ksMatrix.prgSeed = KeySwitchASampler::newSeed();
+
+  IndexSet primes = ctxtPrimes | special;
+  ksMatrix.b.assign(1, DoubleCRT(context, primes));
+  DoubleCRT a(context, primes);
+  KeySwitchASampler(ksMatrix.prgSeed).next(a);
+  ksMatrix.noiseBound = RLWE1(ksMatrix.b[0], a, toKey, W.ptxtSpace);
+
+  fromKey *= context.productOfPrimes(special);
+  ksMatrix.b[0].Add(fromKey, /*matchIndexSets=*/false);
+  ksMatrix.prepare();
+  return ksMatrix;
+}
+
+// Build a key-switching matrix without storing it. It only reads the secret
+// keys, and all of its randomness comes from the current PRG stream: the
+// seed of the ai's and one seed for the noise of every digit, so that the
+// digits can be sampled in parallel.
+KeySwitch SecKey::buildKeySWmatrix(long fromSPower,
+                                   long fromXPower,
+                                   long fromIdx,
+                                   long toIdx,
+                                   long p) const
+{
   DoubleCRT fromKey = sKeys.at(fromIdx);    // copy object, not a reference
   const DoubleCRT& toKey = sKeys.at(toIdx); // this can be a reference
 
@@ -1179,10 +1826,14 @@ void SecKey::GenKeySWmatrix(long fromSPower,
   //   of the secret key as being mod p^r)
 
   KeySwitch ksMatrix(fromSPower, fromXPower, fromIdx, toIdx);
-  RandomBits(ksMatrix.prgSeed, 256); // a random 256-bit seed
+  ksMatrix.prgSeed = KeySwitchASampler::newSeed();
 
   long n = context.getDigits().size();
 
+  std::vector<NTL::ZZ> noiseSeeds(n);
+  for (long i = 0; i < n; i++)
+    RandomBits(noiseSeeds[i], 256);
+
   // size-n vector
   ksMatrix.b.resize(
       n,
@@ -1194,11 +1845,10 @@ void SecKey::GenKeySWmatrix(long fromSPower,
       DoubleCRT(context, context.getCtxtPrimes() | context.getSpecialPrimes()));
 
   {
-    RandomState state;
-    SetSeed(ksMatrix.prgSeed);
+    KeySwitchASampler sampler(ksMatrix.prgSeed);
     for (long i = 0; i < n; i++)
-      a[i].randomize();
-  } // restore state upon destruction of state
+      sampler.next(a[i]);
+  }
 
   // Record the plaintext space for this key-switching matrix
   if (isCKKS())
@@ -1223,19 +1873,24 @@ void SecKey::GenKeySWmatrix(long fromSPower,
   ksMatrix.ptxtSpace = p;
 
   // generate the RLWE instances with pseudorandom ai's
-
-  for (long i = 0; i < n; i++) {
-    ksMatrix.noiseBound = RLWE1(ksMatrix.b[i], a[i], toKey, p);
+  std::vector<double> bounds(n);
+  HELIB_EXEC_RANGE(n, first, last)
+  NTL::RandomStreamPush push;
+  for (long i = first; i < last; i++) {
+    SetSeed(noiseSeeds[i]);
+    bounds[i] = RLWE1(ksMatrix.b[i], a[i], toKey, p);
   }
+  HELIB_EXEC_RANGE_END
+  if (n > 0)
+    ksMatrix.noiseBound = bounds[n - 1];
+
   // Add in the multiples of the fromKey secret key
   fromKey *= context.productOfPrimes(context.getSpecialPrimes());
   for (long i = 0; i < n; i++) {
     ksMatrix.b[i] += fromKey;
     fromKey *= context.productOfPrimes(context.getDigit(i));
   }
-
-  // Push the new matrix onto our list
-  keySwitching.push_back(ksMatrix);
+  ksMatrix.prepare();
 
 #if 0
   // HERE
@@ -1245,6 +1900,8 @@ void SecKey::GenKeySWmatrix(long fromSPower,
     << toIdx << " " << p << " "
     << (log(ksMatrix.noiseBound)/log(2.0)) << "\n";
 #endif
+
+  return ksMatrix;
 }
 
 // Decryption
@@ -1281,6 +1938,35 @@ void SecKey::Decrypt<CKKS>(Ptxt<CKKS>& plaintxt,
   plaintxt.setData(ptxt);
 }
 
+template <typename Scheme>
+void SecKey::Decrypt(std::vector<Ptxt<Scheme>>& plaintxts,
+                     const std::vector<Ctxt>& ciphertxts,
+                     OptLong prec) const
+{
+  long n = ciphertxts.size();
+  plaintxts.assign(n, Ptxt<Scheme>(getContext()));
+
+  // CKKS decryption adds noise, drawn as in the batch Encrypt
+  std::vector<NTL::ZZ> seeds(n);
+  for (long i = 0; i < n; i++)
+    RandomBits(seeds[i], 256);
+
+  HELIB_EXEC_RANGE(n, first, last)
+  NTL::RandomStreamPush push;
+  for (long i = first; i < last; i++) {
+    SetSeed(seeds[i]);
+    Decrypt(plaintxts[i], ciphertxts[i], prec);
+  }
+  HELIB_EXEC_RANGE_END
+}
+
+template void SecKey::Decrypt(std::vector<Ptxt<BGV>>& plaintxts,
+                              const std::vector<Ctxt>& ciphertxts,
+                              OptLong prec) const;
+template void SecKey::Decrypt(std::vector<Ptxt<CKKS>>& plaintxts,
+                              const std::vector<Ctxt>& ciphertxts,
+                              OptLong prec) const;
+
 // VJS-NOTE: this is duplicated code...moreover, it does
 // not implement the mitigation against CKKS vulnerability.
 #if 0
@@ -1358,8 +2044,7 @@ void SecKey::Decrypt(NTL::ZZX& plaintxt,
     }
 
     long keyIdx = part.skHandle.getSecretKeyID();
-    DoubleCRT key = sKeys.at(keyIdx); // copy object, not a reference
-    key.setPrimes(ptxtPrimes);
+    DoubleCRT key = keyModulo(keyIdx, ptxtPrimes);
     // need to equalize the prime sets without changing prime set of ciphertext.
     // Note that ciphertext may contain small primes, which are not in key.
 
@@ -1402,7 +2087,7 @@ void SecKey::Decrypt(NTL::ZZX& plaintxt,
 
   // if p>2, multiply by (intFactor * Q)^{-1} mod p
   if (ciphertxt.getPtxtSpace() > 2) {
-    long factor = rem(context.productOfPrimes(ciphertxt.getPrimeSet()),
+    long factor = rem(context.getCRTTable(ciphertxt.getPrimeSet()).product,
                       ciphertxt.ptxtSpace);
     factor = NTL::MulMod(factor, ciphertxt.intFactor, ciphertxt.ptxtSpace);
     if (factor != 1) {
@@ -1414,6 +2099,24 @@ void SecKey::Decrypt(NTL::ZZX& plaintxt,
 
 // Encryption using the secret key, this is useful, e.g., to put an
 // encryption of the secret key into the public key.
+double SecKey::encryptRLWE(Ctxt& ctxt, long skIdx, long ptxtSpace) const
+{
+  const DoubleCRT& sKey = sKeys.at(skIdx);
+  if (!seededEncryption) {
+    clear(ctxt.partSeed);
+    return RLWE(ctxt.parts[0], ctxt.parts[1], sKey, ptxtSpace);
+  }
+
+  // Expand parts[1] on a stream of its own, so that the seed tells nothing
+  // about the noise, which is drawn from the stream of the caller
+  RandomBits(ctxt.partSeed, 256);
+  {
+    NTL::RandomStreamPush push;
+    ctxt.parts[1].randomize(&ctxt.partSeed);
+  }
+  return RLWE1(ctxt.parts[0], ctxt.parts[1], sKey, ptxtSpace);
+}
+
 long SecKey::skEncrypt(Ctxt& ctxt,
                        const NTL::ZZX& ptxt,
                        long ptxtSpace,
@@ -1458,9 +2161,8 @@ long SecKey::skEncrypt(Ctxt& ctxt,
   // I don't see the reason for the change, and the logic here is
   // very delicate
 
-  const DoubleCRT& sKey = sKeys.at(skIdx); // get key
   // Sample a new RLWE instance
-  ctxt.noiseBound = RLWE(ctxt.parts[0], ctxt.parts[1], sKey, ptxtSpace);
+  ctxt.noiseBound = encryptRLWE(ctxt, skIdx, ptxtSpace);
 
   if (isCKKS()) {
 
@@ -1579,8 +2281,7 @@ void SecKey::Encrypt(Ctxt& ctxt, const EncodedPtxt_BGV& eptxt) const
   ctxt.parts[1].skHandle.setBase(skIdx);
 
   // Sample a new RLWE instance
-  const DoubleCRT& sKey = sKeys.at(skIdx);
-  ctxt.noiseBound = RLWE(ctxt.parts[0], ctxt.parts[1], sKey, ptxtSpace);
+  ctxt.noiseBound = encryptRLWE(ctxt, skIdx, ptxtSpace);
 
   // The logic here has changed to be identical
   // to that used in public key encryption
@@ -1640,8 +2341,7 @@ void SecKey::Encrypt(Ctxt& ctxt, const EncodedPtxt_CKKS& eptxt) const
   ctxt.parts[1].skHandle.setBase(skIdx);
 
   // Sample a new RLWE instance
-  const DoubleCRT& sKey = sKeys.at(skIdx);
-  double error_bound = RLWE(ctxt.parts[0], ctxt.parts[1], sKey, 1);
+  double error_bound = encryptRLWE(ctxt, skIdx, 1);
 
   // This follows the same logic in PubKey::Encrypt(EncodedPtxt_CKKS).
   // See documentation there
@@ -1690,7 +2390,11 @@ long SecKey::genRecryptData()
                   context.getCtxtPrimes() | context.getSpecialPrimes());
   // defined relative to all primes
 
-  long keyID = ImportSecKey(newSk, bound, p2r, /*maxDegKswitch=*/1);
+  long keyID = importSecKey(newSk,
+                            sparseForm(keyPoly),
+                            bound,
+                            p2r,
+                            /*maxDegKswitch=*/1);
 
   // Generate a key-switching matrix from key 0 to this key
   GenKeySWmatrix(/*fromSPower=*/1,
@@ -1701,6 +2405,7 @@ long SecKey::genRecryptData()
 
   // Encrypt new key under key #0 and plaintext space p^{e+r}
   Encrypt(recryptEkey, keyPoly, p2ePr);
+  recryptEkeyPrecon = recryptEkey.partsPrecon();
 
   return (recryptKeyID = keyID); // return the new key-ID
 }
@@ -1759,6 +2464,7 @@ SecKey SecKey::readFrom(std::istream& str, const Context& context)
 
   // Set the secret part of the secret key.
   ret.sKeys = read_raw_vector<DoubleCRT>(str, context);
+  ret.setSparseKeys();
 
   eyeCatcherFound = readEyeCatcher(str, EyeCatcher::SK_END);
   assertTrue<IOError>(eyeCatcherFound,
@@ -1769,7 +2475,25 @@ SecKey SecKey::readFrom(std::istream& str, const Context& context)
 
 void SecKey::writeToJSON(std::ostream& str) const
 {
-  executeRedirectJsonError<void>([&]() { str << writeToJSON(); });
+  executeRedirectJsonError<void>([&]() {
+    JsonStreamWriter w(str);
+    writeToJSON(w);
+  });
+}
+
+void SecKey::writeToJSON(JsonStreamWriter& w) const
+{
+  w.beginTyped<SecKey>();
+  w.beginObject();
+  w.key("PubKey");
+  this->PubKey::writeToJSON(w);
+  w.key("sKeys");
+  w.beginArray();
+  for (const DoubleCRT& sKey : sKeys)
+    sKey.writeToJSON(w);
+  w.endArray();
+  w.endObject();
+  w.endObject();
 }
 
 JsonWrapper SecKey::writeToJSON() const
@@ -1785,13 +2509,9 @@ JsonWrapper SecKey::writeToJSON() const
 
 SecKey SecKey::readFromJSON(std::istream& str, const Context& context)
 {
-  auto body = [&]() {
-    json j;
-    str >> j;
-    return SecKey::readFromJSON(wrap(j), context);
-  };
-
-  return executeRedirectJsonError<SecKey>(body);
+  SecKey ret{context};
+  ret.readJSON(str);
+  return ret;
 }
 
 SecKey SecKey::readFromJSON(const JsonWrapper& jw, const Context& context)
@@ -1804,9 +2524,36 @@ SecKey SecKey::readFromJSON(const JsonWrapper& jw, const Context& context)
 void SecKey::readJSON(std::istream& str)
 {
   executeRedirectJsonError<void>([&]() {
-    json j;
-    str >> j;
-    this->readJSON(wrap(j));
+    JsonStreamReader r(str);
+    readJSON(r);
+  });
+}
+
+void SecKey::readJSON(JsonStreamReader& r)
+{
+  r.readTyped<SecKey>([&]() {
+    this->clear();
+    bool havePubKey = false, haveSKeys = false;
+    r.beginObject();
+    for (std::string k; r.nextKey(k);) {
+      if (k == "PubKey") {
+        this->PubKey::readJSON(r);
+        havePubKey = true;
+      } else if (k == "sKeys") {
+        sKeys.clear();
+        r.beginArray();
+        while (r.nextElement()) {
+          sKeys.emplace_back(context, IndexSet::emptySet());
+          sKeys.back().readJSON(r);
+        }
+        haveSKeys = true;
+      } else {
+        r.skip();
+      }
+    }
+    JsonStreamReader::require(havePubKey, "PubKey");
+    JsonStreamReader::require(haveSKeys, "sKeys");
+    this->setSparseKeys();
   });
 }
 
@@ -1819,6 +2566,7 @@ void SecKey::readJSON(const JsonWrapper& tjw)
     this->PubKey::readJSON(wrap(j.at("PubKey")));
 
     this->sKeys = readVectorFromJSON<DoubleCRT>(j.at("sKeys"), context);
+    this->setSparseKeys();
   });
 }
 
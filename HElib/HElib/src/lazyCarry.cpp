@@ -0,0 +1,125 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <helib/lazyCarry.h>
+
+#include <helib/assertions.h>
+#include <helib/Context.h>
+#include <helib/timing.h>
+
+namespace helib {
+
+LazyCarryInteger::LazyCarryInteger(const Ctxt& ctxt, long nBits) :
+    ctxt(ctxt), nBits(nBits)
+{
+  assertEq<InvalidArgument>(ctxt.getContext().getP(),
+                            2l,
+                            "Lazy carries need p = 2");
+  long ptxtSpace = ctxt.getPtxtSpace();
+  assertTrue<InvalidArgument>((ptxtSpace & (ptxtSpace - 1)) == 0,
+                              "The plaintext space must be a power of 2");
+  long r = NTL::NumBits(ptxtSpace) - 1;
+  assertInRange<InvalidArgument>(nBits,
+                                 1l,
+                                 r,
+                                 "nBits must be in [1, r]",
+                                 /*right_inclusive=*/true);
+}
+
+void LazyCarryInteger::assertMatches(const LazyCarryInteger& other) const
+{
+  assertEq<InvalidArgument>(nBits, other.nBits, "Bit counts do not match");
+  assertEq<InvalidArgument>(ctxt.getPtxtSpace(),
+                            other.ctxt.getPtxtSpace(),
+                            "Plaintext spaces do not match");
+}
+
+// The native operations are correct mod 2^r, hence mod 2^nBits, but leave
+// the carries above nBits (unless there is nothing above nBits)
+LazyCarryInteger& LazyCarryInteger::operator+=(const LazyCarryInteger& other)
+{
+  assertMatches(other);
+  ctxt += other.ctxt;
+  normalized = (ctxt.getPtxtSpace() == (1L << nBits));
+  return *this;
+}
+
+LazyCarryInteger& LazyCarryInteger::operator-=(const LazyCarryInteger& other)
+{
+  assertMatches(other);
+  ctxt -= other.ctxt;
+  normalized = (ctxt.getPtxtSpace() == (1L << nBits));
+  return *this;
+}
+
+LazyCarryInteger& LazyCarryInteger::operator*=(const LazyCarryInteger& other)
+{
+  assertMatches(other);
+  ctxt.multiplyBy(other.ctxt);
+  normalized = (ctxt.getPtxtSpace() == (1L << nBits));
+  return *this;
+}
+
+LazyCarryInteger& LazyCarryInteger::operator*=(long c)
+{
+  ctxt.multByConstant(NTL::ZZ(c));
+  normalized = (ctxt.getPtxtSpace() == (1L << nBits));
+  return *this;
+}
+
+void LazyCarryInteger::addConstant(long c)
+{
+  ctxt.addConstant(NTL::ZZ(c));
+  normalized = (ctxt.getPtxtSpace() == (1L << nBits));
+}
+
+void LazyCarryInteger::normalize()
+{
+  HELIB_TIMER_START;
+  if (normalized)
+    return;
+
+  // digits[j] is the j'th bit mod 2^{r-j}, so 2^j * digits[j] is defined
+  // mod 2^r
+  std::vector<Ctxt> digits;
+  extractDigits(digits, ctxt, nBits);
+  Ctxt value = digits[0];
+  for (long j = 1; j < nBits; j++) {
+    digits[j].multByP(j);
+    value += digits[j];
+  }
+  ctxt = std::move(value);
+  normalized = true;
+}
+
+void LazyCarryInteger::toBits(CtPtrs& bits) const
+{
+  HELIB_TIMER_START;
+  std::vector<Ctxt> digits;
+  extractDigits(digits, ctxt, nBits);
+  resize(bits, nBits, ctxt);
+  for (long j = 0; j < nBits; j++) {
+    digits[j].reducePtxtSpace(2);
+    *bits[j] = std::move(digits[j]);
+  }
+}
+
+LazyCarryInteger LazyCarryInteger::sum(
+    const std::vector<LazyCarryInteger>& numbers)
+{
+  assertFalse<InvalidArgument>(numbers.empty(), "Nothing to add up");
+  LazyCarryInteger result = numbers[0];
+  for (std::size_t i = 1; i < numbers.size(); i++)
+    result += numbers[i];
+  return result;
+}
+
+} // namespace helib
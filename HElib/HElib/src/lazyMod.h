@@ -0,0 +1,73 @@
+/* Copyright (C) 2021 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+// Sums of products of residues modulo a word-size prime q, with a single
+// reduction at the end instead of one after every product. The products
+// are added up in an unsigned 128-bit accumulator, which holds at least 15
+// of them for any prime below 2^62 (and 255 for the 60-bit primes of the
+// chain). Longer sums are folded back below q whenever the accumulator is
+// full, so any number of terms can be added.
+//
+// The final reduction of a 128-bit value costs more than one MulMod, so
+// the lazy kernels only pay off for sums of a few terms at least, see
+// LAZY_REDUCTION_MIN_TERMS.
+
+#ifndef HELIB_LAZY_MOD_H
+#define HELIB_LAZY_MOD_H
+
+#include "uint128.h"
+
+namespace helib {
+
+// The shortest sums for which the lazy kernels are used
+constexpr long LAZY_REDUCTION_MIN_TERMS = 4;
+
+// The number of products of residues mod q that can be added to a value
+// below q without overflowing 128 bits
+inline long lazyTermLimit(long q)
+{
+  const uint128 max = ~uint128(0);
+  const unsigned long q1 = q - 1;
+  const uint128 square = uint128(q1) * q1;
+  if (square == 0 || max / square > (1UL << 30))
+    return 1L << 30;
+  return long(max / square) - 1;
+}
+
+// row[j] = sum_{t < n} a[t][j] * b[t][j] mod q for j < len, where all the
+// entries of a and b are in [0, q)
+inline void lazyInnerProduct(long* row,
+                             const long* const* a,
+                             const long* const* b,
+                             long n,
+                             long len,
+                             long q)
+{
+  const long limit = lazyTermLimit(q);
+  const unsigned long uq = q;
+  for (long j = 0; j < len; j++) {
+    uint128 acc = 0;
+    long pending = 0;
+    for (long t = 0; t < n; t++) {
+      acc += uint128((unsigned long)a[t][j]) * (unsigned long)b[t][j];
+      if (++pending == limit) {
+        acc %= uq;
+        pending = 0;
+      }
+    }
+    row[j] = long(acc % uq);
+  }
+}
+
+} // namespace helib
+
+#endif // HELIB_LAZY_MOD_H
@@ -12,16 +12,22 @@
 #include <cstddef>
 #include <tuple>
 #include <algorithm>
+#include <mutex>
 #include <NTL/BasicThreadPool.h>
 #include <helib/matmul.h>
+#include <helib/multicore.h>
+#include <helib/automorphPrecon.h>
+#include <helib/opCounters.h>
 #include <helib/norms.h>
 #include <helib/fhe_stats.h>
 #include <helib/apiAttributes.h>
+#include <helib/autotune.h>
+#include "binio.h"
 
 namespace helib {
 
-int fhe_test_force_bsgs = 0;
-int fhe_test_force_hoist = 0;
+thread_local int fhe_test_force_bsgs = 0;
+thread_local int fhe_test_force_hoist = 0;
 
 static bool comp_bsgs(bool bsgs)
 {
@@ -42,305 +48,182 @@ static bool comp_hoist(bool hoist)
 #endif
 
 /********************************************************************/
-/****************** Auxiliary stuff: should go elsewhere   **********/
-
-/**
- * @class BasicAutomorphPrecon
- * @brief Pre-computation to speed many automorphism on the same ciphertext.
- *
- * The expensive part of homomorphic automorphism is breaking the ciphertext
- * parts into digits. The usual setting is we first rotate the ciphertext
- * parts, then break them into digits. But when we apply many automorphisms
- * it is faster to break the original ciphertext into digits, then rotate
- * the digits (as opposed to first rotate, then break).
- * An BasicAutomorphPrecon object breaks the original ciphertext and keeps
- * the digits, then when you call automorph is only needs to apply the
- * native automorphism and key switching to the digits, which is fast(er).
- **/
-class BasicAutomorphPrecon
-{
-  Ctxt ctxt;
-  NTL::xdouble noise;
-  std::vector<DoubleCRT> polyDigits;
+/****************** Linear transformation classes *******************/
 
-public:
-  BasicAutomorphPrecon(const Ctxt& _ctxt) : ctxt(_ctxt), noise(1.0)
-  {
-    HELIB_TIMER_START;
-    if (ctxt.parts.size() >= 1)
-      assertTrue(
-          ctxt.parts[0].skHandle.isOne(),
-          "Invalid ciphertext (secret key handle for part 0 is not one)");
-    if (ctxt.parts.size() <= 1)
-      return; // nothing to do
-
-    ctxt.cleanUp();
-    const Context& context = ctxt.getContext();
-    const PubKey& pubKey = ctxt.getPubKey();
-    long keyID = ctxt.getKeyID();
-
-    // The call to cleanUp() should ensure that this assertion passes.
-    assertTrue(ctxt.inCanonicalForm(keyID),
-               "Ciphertext is not in canonical form");
-
-    ctxt.relin_CKKS_adjust();
-
-    // Compute the number of digits that we need and the estimated
-    // added noise from switching this ciphertext.
-
-    NTL::xdouble addedNoise = ctxt.parts[1].breakIntoDigits(polyDigits);
-    NTL::xdouble max_ks_noise(0.0);
-    for (const KeySwitch& ks : pubKey.keySWlist()) {
-      if (max_ks_noise < ks.noiseBound)
-        max_ks_noise = ks.noiseBound;
-    }
-    addedNoise *= max_ks_noise;
+struct ConstMultiplier
+{ // stores a constant in either zzX or DoubleCRT format
 
-    double logProd = context.logOfProduct(context.getSpecialPrimes());
-    noise = ctxt.getNoiseBound() * NTL::xexp(logProd);
+  virtual ~ConstMultiplier() {}
 
-    double ratio = NTL::conv<double>(addedNoise / noise);
+  virtual void mul(Ctxt& ctxt) const = 0;
 
-    HELIB_STATS_UPDATE("KS-noise-ratio-hoist", ratio);
-    if (ratio > 1) {
-      Warning("KS-noise-ratio-hoist=" + std::to_string(ratio));
-    }
-    // std::stderr << "*** HOIST INIT\n";
-    // fprintf(stderr, "   KS-log-noise-ratio-hoist: %f\n",
-    // log(addedNoise/noise)/log(2.0));
+  virtual std::shared_ptr<ConstMultiplier> upgrade(
+      const Context& context) const = 0;
+  // Upgrade to DCRT. Returns null if no upgrade required
 
-    noise += addedNoise;
+  virtual std::shared_ptr<ConstMultiplier> upgradeLazily(
+      const Context& context) const
+  {
+    return upgrade(context);
   }
+  // Upgrade to DCRT encodings made on first use, over the prime set of the
+  // ciphertext. Upgrades at once if the constant cannot wait.
 
-  std::shared_ptr<Ctxt> automorph(long k) const
+  // The bytes held by the constant, and the bytes it would hold once
+  // upgraded
+  virtual long bytes() const = 0;
+  virtual long upgradedBytes(UNUSED const Context& context) const
   {
-    HELIB_TIMER_START;
-
-    // A hack: record this automorphism rather than actually performing it
-    if (isSetAutomorphVals()) { // defined in NumbTh.h
-      recordAutomorphVal(k);
-      return std::make_shared<Ctxt>(ctxt);
-    }
-
-    if (k == 1 || ctxt.isEmpty())
-      return std::make_shared<Ctxt>(ctxt); // nothing to do
-
-    const Context& context = ctxt.getContext();
-    const PubKey& pubKey = ctxt.getPubKey();
-
-    // empty ctxt
-    std::shared_ptr<Ctxt> result = std::make_shared<Ctxt>(ZeroCtxtLike, ctxt);
-    result->noiseBound = noise; // noise estimate
-    result->intFactor = ctxt.intFactor;
-
-    result->primeSet = ctxt.primeSet | context.getSpecialPrimes();
-    // VJS-NOTE: added this to make addPart work
-
-    if (ctxt.isCKKS()) {
-      result->ptxtMag = ctxt.ptxtMag;
-      double logProd = context.logOfProduct(context.getSpecialPrimes());
-      result->ratFactor = ctxt.ratFactor * NTL::xexp(logProd);
-    }
-
-    if (ctxt.parts.size() == 1) { // only constant part, no need to key-switch
-      CtxtPart tmpPart = ctxt.parts[0];
-      tmpPart.automorph(k);
-      tmpPart.addPrimesAndScale(context.getSpecialPrimes());
-      result->addPart(tmpPart, /*matchPrimeSet=*/true);
-      return result;
-    }
-
-    // Ensure that we have a key-switching matrices for this automorphism
-    long keyID = ctxt.getKeyID();
-    if (!pubKey.isReachable(k, keyID)) {
-      throw LogicError("no key-switching matrices for k=" + std::to_string(k) +
-                       ", keyID=" + std::to_string(keyID));
-    }
-
-    // Get the first key-switching matrix for this automorphism
-    const KeySwitch& W = pubKey.getNextKSWmatrix(k, keyID);
-    long amt = W.fromKey.getPowerOfX();
-
-    // Start by rotating the constant part, no need to key-switch it
-    CtxtPart tmpPart = ctxt.parts[0];
-    tmpPart.automorph(amt);
-    tmpPart.addPrimesAndScale(context.getSpecialPrimes());
-    result->addPart(tmpPart, /*matchPrimeSet=*/true);
-
-    // Then rotate the digits and key-switch them
-    std::vector<DoubleCRT> tmpDigits = polyDigits;
-    for (auto&& tmp : tmpDigits) // rotate each of the digits
-      tmp.automorph(amt);
-
-    result->keySwitchDigits(W, tmpDigits); // key-switch the digits
+    return bytes();
+  }
 
-    long m = context.getM();
-    if ((amt - k) % m != 0) { // amt != k (mod m), more automorphisms to do
-      k = NTL::MulMod(k, NTL::InvMod(amt, m), m); // k *= amt^{-1} mod m
-      result->smartAutomorph(k);                  // call usual smartAutomorph
-    }
-    return result;
+  // Binary IO, see ConstMultiplierCache::writeTo. Only the BGV constants
+  // can be written.
+  virtual void writeTo(UNUSED std::ostream& str) const
+  {
+    throw LogicError("Cannot write a CKKS matrix constant");
   }
 };
 
-class GeneralAutomorphPrecon
+// The tags of the constants in ConstMultiplierCache::writeTo
+enum ConstMultiplierTag : long
 {
-public:
-  virtual ~GeneralAutomorphPrecon() {}
-
-  virtual std::shared_ptr<Ctxt> automorph(long i) const = 0;
+  CONST_MULTIPLIER_NULL = 0,
+  CONST_MULTIPLIER_ZZX = 1,
+  CONST_MULTIPLIER_DCRT = 2,
+  CONST_MULTIPLIER_LAZY = 3
 };
 
-class GeneralAutomorphPrecon_UNKNOWN : public GeneralAutomorphPrecon
+// The bytes of the residues of a DoubleCRT over the primes in s
+static long dcrtBytes(const Context& context, const IndexSet& s)
 {
-private:
-  Ctxt ctxt;
-  long dim;
-  const PAlgebra& zMStar;
+  return s.card() * context.getPhiM() * sizeof(long);
+}
 
-public:
-  GeneralAutomorphPrecon_UNKNOWN(const Ctxt& _ctxt,
-                                 long _dim,
-                                 const EncryptedArray& ea) :
-      ctxt(_ctxt), dim(_dim), zMStar(ea.getPAlgebra())
-  {
-    ctxt.cleanUp();
-  }
+struct ConstMultiplier_DoubleCRT : ConstMultiplier
+{
+  DoubleCRT data;
+  DoubleCRTPrecon precon; // the matrix is applied many times
+  double sz;
 
-  std::shared_ptr<Ctxt> automorph(long i) const override
+  // The copies of data and precon for the NUMA nodes, see replicatePerNode()
+  struct Replica
   {
-    std::shared_ptr<Ctxt> result = std::make_shared<Ctxt>(ctxt);
+    DoubleCRT data;
+    DoubleCRTPrecon precon;
 
-    // guard against i == 0, as dim may be #gens
-    if (i != 0)
-      result->smartAutomorph(zMStar.genToPow(dim, i));
-
-    return result;
-  }
-};
-
-class GeneralAutomorphPrecon_FULL : public GeneralAutomorphPrecon
-{
-private:
-  BasicAutomorphPrecon precon;
-  long dim;
-  const PAlgebra& zMStar;
+    explicit Replica(const DoubleCRT& _data) : data(_data)
+    {
+      data.makeUnique();
+      precon = DoubleCRTPrecon(data);
+    }
+  };
+  NodeReplicas<Replica> replicas;
 
-public:
-  GeneralAutomorphPrecon_FULL(const Ctxt& _ctxt,
-                              long _dim,
-                              const EncryptedArray& ea) :
-      precon(_ctxt), dim(_dim), zMStar(ea.getPAlgebra())
+  ConstMultiplier_DoubleCRT(const DoubleCRT& _data, double _sz) :
+      data(_data), precon(_data), sz(_sz)
   {}
 
-  std::shared_ptr<Ctxt> automorph(long i) const override
+  void mul(Ctxt& ctxt) const override
   {
-    return precon.automorph(zMStar.genToPow(dim, i));
+    auto copy = [this]() { return Replica(data); };
+    if (const Replica* local = replicas.get(0, copy))
+      ctxt.multByConstant(local->data, local->precon, sz);
+    else
+      ctxt.multByConstant(data, precon, sz);
   }
-};
-
-class GeneralAutomorphPrecon_BSGS : public GeneralAutomorphPrecon
-{
-private:
-  long dim;
-  const PAlgebra& zMStar;
 
-  long D;
-  long g;
-  long h;
-  std::vector<std::shared_ptr<BasicAutomorphPrecon>> precon;
+  std::shared_ptr<ConstMultiplier> upgrade(
+      UNUSED const Context& context) const override
+  {
+    return nullptr;
+  }
 
-public:
-  GeneralAutomorphPrecon_BSGS(const Ctxt& _ctxt,
-                              long _dim,
-                              const EncryptedArray& ea) :
-      dim(_dim), zMStar(ea.getPAlgebra())
+  // The residues and their Shoup companions
+  long bytes() const override
   {
-    D = (dim == -1) ? zMStar.getOrdP() : zMStar.OrderOf(dim);
-    g = KSGiantStepSize(D);
-    h = divc(D, g);
-
-    BasicAutomorphPrecon precon0(_ctxt);
-    precon.resize(h);
-
-    // parallel for k in [0..h)
-    NTL_EXEC_RANGE(h, first, last)
-    for (long k = first; k < last; k++) {
-      std::shared_ptr<Ctxt> p = precon0.automorph(zMStar.genToPow(dim, g * k));
-      precon[k] = std::make_shared<BasicAutomorphPrecon>(*p);
-    }
-    NTL_EXEC_RANGE_END
+    return 2 * dcrtBytes(data.getContext(), data.getIndexSet());
   }
 
-  std::shared_ptr<Ctxt> automorph(long i) const override
+  // The constant is the DoubleCRT of a zzX, which is much smaller
+  void writeTo(std::ostream& str) const override
   {
-    assertInRange(i, 0l, D, "Automorphism index i is not in [0, D)");
-    long j = i % g;
-    long k = i / g;
-    // i == j + g*k
-    return precon[k]->automorph(zMStar.genToPow(dim, j));
+    write_raw_int(str, CONST_MULTIPLIER_DCRT);
+    NTL::ZZX poly;
+    data.toPoly(poly);
+    zzX coeffs;
+    convert(coeffs, poly);
+    write_ntl_vec_long(str, coeffs);
+    write_raw_double(str, sz);
   }
 };
 
-std::shared_ptr<GeneralAutomorphPrecon> buildGeneralAutomorphPrecon(
-    const Ctxt& ctxt,
-    long dim,
-    const EncryptedArray& ea)
+// A zzX constant that keeps its encoding over the prime set of the last
+// ciphertext it multiplied, and encodes it again for a ciphertext whose
+// prime set is not contained in it. The linear maps of bootstrapping run at
+// a few primes, so this holds much less than an encoding over all of them.
+struct ConstMultiplier_PrimeSet : ConstMultiplier
 {
-  // allow dim == -1 (Frobenius)
-  // allow dim == #gens (the dummy generator of order 1)
-  assertInRange(dim,
-                -1l,
-                ea.dimension(),
-                "Dimension dim is not in [-1, ea.dimension()] (-1 Frobenius)",
-                true);
-
-  if (fhe_test_force_hoist >= 0) {
-    switch (ctxt.getPubKey().getKSStrategy(dim)) {
-    case HELIB_KSS_BSGS:
-      return std::make_shared<GeneralAutomorphPrecon_BSGS>(ctxt, dim, ea);
-
-    case HELIB_KSS_FULL:
-      return std::make_shared<GeneralAutomorphPrecon_FULL>(ctxt, dim, ea);
-
-    default:
-      return std::make_shared<GeneralAutomorphPrecon_UNKNOWN>(ctxt, dim, ea);
-    }
-  } else {
-    return std::make_shared<GeneralAutomorphPrecon_UNKNOWN>(ctxt, dim, ea);
-  }
-}
+  struct Encoding
+  {
+    DoubleCRT data;
+    DoubleCRTPrecon precon;
 
-/********************************************************************/
-/****************** Linear transformation classes *******************/
+    Encoding(const zzX& poly, const Context& context, const IndexSet& s) :
+        data(poly, context, s), precon(data)
+    {}
+  };
 
-struct ConstMultiplier
-{ // stores a constant in either zzX or DoubleCRT format
+  const Context& context;
+  zzX data;
+  double sz;
 
-  virtual ~ConstMultiplier() {}
+  mutable std::mutex mutex;
+  mutable std::shared_ptr<const Encoding> encoding;
 
-  virtual void mul(Ctxt& ctxt) const = 0;
+  ConstMultiplier_PrimeSet(const Context& _context, const zzX& _data) :
+      context(_context),
+      data(_data),
+      sz(embeddingLargestCoeff(_data, _context.getZMStar()))
+  {}
 
-  virtual std::shared_ptr<ConstMultiplier> upgrade(
-      const Context& context) const = 0;
-  // Upgrade to DCRT. Returns null if no upgrade required
-};
+  void mul(Ctxt& ctxt) const override
+  {
+    if (ctxt.isEmpty())
+      return;
+    std::shared_ptr<const Encoding> enc = encodingFor(ctxt.getPrimeSet());
+    ctxt.multByConstant(enc->data, enc->precon, sz);
+  }
 
-struct ConstMultiplier_DoubleCRT : ConstMultiplier
-{
-  DoubleCRT data;
-  double sz;
+  std::shared_ptr<ConstMultiplier> upgrade(const Context&) const override
+  {
+    return nullptr;
+  }
 
-  ConstMultiplier_DoubleCRT(const DoubleCRT& _data, double _sz) :
-      data(_data), sz(_sz)
-  {}
+  long bytes() const override
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    long total = data.length() * sizeof(long);
+    if (encoding)
+      total += 2 * dcrtBytes(context, encoding->data.getIndexSet());
+    return total;
+  }
 
-  void mul(Ctxt& ctxt) const override { ctxt.multByConstant(data, sz); }
+  void writeTo(std::ostream& str) const override
+  {
+    write_raw_int(str, CONST_MULTIPLIER_LAZY);
+    write_ntl_vec_long(str, data);
+  }
 
-  std::shared_ptr<ConstMultiplier> upgrade(
-      UNUSED const Context& context) const override
+private:
+  std::shared_ptr<const Encoding> encodingFor(const IndexSet& s) const
   {
-    return nullptr;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!encoding || !(s <= encoding->data.getIndexSet())) {
+      HELIB_STATS_UPDATE("ConstMultiplier-reencode", s.card());
+      encoding = std::make_shared<const Encoding>(data, context, s);
+    }
+    return encoding;
   }
 };
 
@@ -361,6 +244,25 @@ struct ConstMultiplier_zzX : ConstMultiplier
         DoubleCRT(data, context, context.fullPrimes()),
         sz);
   }
+
+  std::shared_ptr<ConstMultiplier> upgradeLazily(
+      const Context& context) const override
+  {
+    return std::make_shared<ConstMultiplier_PrimeSet>(context, data);
+  }
+
+  long bytes() const override { return data.length() * sizeof(long); }
+
+  long upgradedBytes(const Context& context) const override
+  {
+    return 2 * dcrtBytes(context, context.fullPrimes());
+  }
+
+  void writeTo(std::ostream& str) const override
+  {
+    write_raw_int(str, CONST_MULTIPLIER_ZZX);
+    write_ntl_vec_long(str, data);
+  }
 };
 
 template <typename RX>
@@ -407,18 +309,132 @@ void DestMulAdd(Ctxt& x, const std::shared_ptr<ConstMultiplier>& a, Ctxt& b)
   }
 }
 
+// Add up v into v[0], the pairs of every level of the tree in parallel,
+// rather than one after another
+static void treeSum(std::vector<Ctxt>& v)
+{
+  long n = v.size();
+  for (long stride = 1; stride < n; stride *= 2) {
+    long pairs = (n + stride - 1) / (2 * stride);
+    HELIB_EXEC_INDEX(pairs, index)
+    long i = 2 * stride * index;
+    v[i] += v[i + stride];
+    HELIB_EXEC_INDEX_END
+  }
+}
+
 void ConstMultiplierCache::upgrade(const Context& context)
 {
   HELIB_TIMER_START;
 
   long n = multiplier.size();
-  NTL_EXEC_RANGE(n, first, last)
+  HELIB_EXEC_RANGE(n, first, last)
   for (long i : range(first, last)) {
     if (multiplier[i])
       if (auto newptr = multiplier[i]->upgrade(context))
         multiplier[i] = std::shared_ptr<ConstMultiplier>(newptr);
   }
-  NTL_EXEC_RANGE_END
+  HELIB_EXEC_RANGE_END
+}
+
+void ConstMultiplierCache::upgradeWithin(const Context& context,
+                                         long& budget,
+                                         bool lazily)
+{
+  if (budget < 0 && !lazily) {
+    upgrade(context);
+    return;
+  }
+
+  HELIB_TIMER_START;
+
+  // Choose the constants in order, then convert them in parallel. A lazy
+  // constant is charged for an encoding over all the primes, next to the
+  // zzX it keeps.
+  std::vector<long> chosen;
+  for (long i : range(multiplier.size())) {
+    if (!multiplier[i])
+      continue;
+    long upgraded = multiplier[i]->upgradedBytes(context);
+    long current = multiplier[i]->bytes();
+    if (upgraded == current)
+      continue;
+    long extra = lazily ? upgraded : upgraded - current;
+    if (budget < 0 || extra <= budget) {
+      if (budget >= 0)
+        budget -= extra;
+      chosen.push_back(i);
+    }
+  }
+
+  long n = chosen.size();
+  HELIB_EXEC_RANGE(n, first, last)
+  for (long j : range(first, last)) {
+    std::shared_ptr<ConstMultiplier>& ptr = multiplier[chosen[j]];
+    auto newptr = lazily ? ptr->upgradeLazily(context) : ptr->upgrade(context);
+    if (newptr)
+      ptr = newptr;
+  }
+  HELIB_EXEC_RANGE_END
+}
+
+long ConstMultiplierCache::bytes() const
+{
+  long total = 0;
+  for (const auto& ptr : multiplier)
+    if (ptr)
+      total += ptr->bytes();
+  return total;
+}
+
+void ConstMultiplierCache::writeTo(std::ostream& str) const
+{
+  write_raw_int(str, multiplier.size());
+  for (const auto& ptr : multiplier) {
+    if (ptr)
+      ptr->writeTo(str);
+    else
+      write_raw_int(str, CONST_MULTIPLIER_NULL);
+  }
+}
+
+void ConstMultiplierCache::readFrom(std::istream& str, const Context& context)
+{
+  HELIB_TIMER_START;
+
+  long n = read_raw_int(str);
+  assertTrue<IOError>(n >= 0, "Negative number of constants");
+  std::vector<long> tags(n);
+  std::vector<zzX> coeffs(n);
+  std::vector<double> sizes(n, 0.0);
+  for (long i : range(n)) {
+    tags[i] = read_raw_int(str);
+    if (tags[i] == CONST_MULTIPLIER_NULL)
+      continue;
+    assertTrue<IOError>(tags[i] == CONST_MULTIPLIER_ZZX ||
+                            tags[i] == CONST_MULTIPLIER_DCRT ||
+                            tags[i] == CONST_MULTIPLIER_LAZY,
+                        "Unknown type of constant");
+    read_ntl_vec_long(str, coeffs[i]);
+    if (tags[i] == CONST_MULTIPLIER_DCRT)
+      sizes[i] = read_raw_double(str);
+  }
+
+  // Going back to DoubleCRT is one FFT per constant, do them in parallel
+  multiplier.assign(n, nullptr);
+  HELIB_EXEC_RANGE(n, first, last)
+  for (long i : range(first, last)) {
+    if (tags[i] == CONST_MULTIPLIER_ZZX)
+      multiplier[i] = std::make_shared<ConstMultiplier_zzX>(coeffs[i]);
+    else if (tags[i] == CONST_MULTIPLIER_LAZY)
+      multiplier[i] =
+          std::make_shared<ConstMultiplier_PrimeSet>(context, coeffs[i]);
+    else if (tags[i] == CONST_MULTIPLIER_DCRT)
+      multiplier[i] = std::make_shared<ConstMultiplier_DoubleCRT>(
+          DoubleCRT(coeffs[i], context, context.fullPrimes()),
+          sizes[i]);
+  }
+  HELIB_EXEC_RANGE_END
 }
 
 static inline long dimSz(const EncryptedArray& ea, long dim)
@@ -606,86 +622,90 @@ struct MatMul1DExec_construct
 {
   PA_INJECT(type)
 
-  static void apply(const EncryptedArrayDerived<type>& ea,
-                    const MatMul1D& mat_basetype,
-                    std::vector<std::shared_ptr<ConstMultiplier>>& vec,
-                    std::vector<std::shared_ptr<ConstMultiplier>>& vec1,
-                    long g)
+  // Encode the constants of diagonal i, with the NTL modulus of the slots
+  // in place
+  static void encodeDiagonal(const EncryptedArrayDerived<type>& ea,
+                             const MatMul1D_partial<type>& mat,
+                             std::vector<std::shared_ptr<ConstMultiplier>>& vec,
+                             std::vector<std::shared_ptr<ConstMultiplier>>& vec1,
+                             long g,
+                             long i)
   {
-    const MatMul1D_partial<type>& mat =
-        dynamic_cast<const MatMul1D_partial<type>&>(mat_basetype);
-
     long dim = mat.getDim();
     long D = dimSz(ea, dim);
     bool native = dimNative(ea, dim);
 
-    RBak bak;
-    bak.save();
-    ea.getTab().restoreContext();
-
-    if (native) {
-
-      vec.resize(D);
-
-      for (long i : range(D)) {
-        // i == j + g * k (where j = (g != 0) ? i % g : i)
-        long k;
-
-        if (g) {
-          k = i / g;
-        } else {
-          k = 1;
-        }
+    // i == j + g * k (where j = (g != 0) ? i % g : i)
+    long k;
 
-        RX poly;
-        mat.processDiagonal(poly, i, ea);
-        vec[i] = build_ConstMultiplier(poly, dim, -g * k, ea);
-      }
+    if (g) {
+      k = i / g;
     } else {
-      vec.resize(D);
-      vec1.resize(D);
-
-      for (long i : range(D)) {
-        // i == j + g * k (where j = (g != 0) ? i % g : i)
-        long k;
+      k = 1;
+    }
 
-        if (g) {
-          k = i / g;
-        } else {
-          k = 1;
-        }
+    RX poly;
+    mat.processDiagonal(poly, i, ea);
 
-        RX poly;
-        mat.processDiagonal(poly, i, ea);
+    if (native) {
+      vec[i] = build_ConstMultiplier(poly, dim, -g * k, ea);
+      return;
+    }
 
-        if (IsZero(poly)) {
-          vec[i] = nullptr;
-          vec1[i] = nullptr;
-          continue;
-        }
+    if (IsZero(poly)) {
+      vec[i] = nullptr;
+      vec1[i] = nullptr;
+      return;
+    }
 
-        const RX& mask = ea.getTab().getMaskTable()[dim][i];
-        const RXModulus& PhimXMod = ea.getTab().getPhimXMod();
+    const RX& mask = ea.getTab().getMaskTable()[dim][i];
+    const RXModulus& PhimXMod = ea.getTab().getPhimXMod();
 
-        RX poly1, poly2;
-        MulMod(poly1, poly, mask, PhimXMod);
-        sub(poly2, poly, poly1);
+    RX poly1, poly2;
+    MulMod(poly1, poly, mask, PhimXMod);
+    sub(poly2, poly, poly1);
 
-        // poly1 = poly w/ first i slots zeroed out
-        // poly2 = poly w/ last D-i slots zeroed out
+    // poly1 = poly w/ first i slots zeroed out
+    // poly2 = poly w/ last D-i slots zeroed out
 
-        vec[i] = build_ConstMultiplier(poly1, dim, -g * k, ea);
+    vec[i] = build_ConstMultiplier(poly1, dim, -g * k, ea);
 
 #if (ALT_MATMUL)
-        long DD = D;
-        if (g)
-          DD = 0;
-        vec1[i] = build_ConstMultiplier(poly2, dim, DD - g * k, ea);
+    long DD = D;
+    if (g)
+      DD = 0;
+    vec1[i] = build_ConstMultiplier(poly2, dim, DD - g * k, ea);
 #else
-        vec1[i] = build_ConstMultiplier(poly2, dim, D - g * k, ea);
+    vec1[i] = build_ConstMultiplier(poly2, dim, D - g * k, ea);
 #endif
-      }
-    }
+  }
+
+  static void apply(const EncryptedArrayDerived<type>& ea,
+                    const MatMul1D& mat_basetype,
+                    std::vector<std::shared_ptr<ConstMultiplier>>& vec,
+                    std::vector<std::shared_ptr<ConstMultiplier>>& vec1,
+                    long g)
+  {
+    const MatMul1D_partial<type>& mat =
+        dynamic_cast<const MatMul1D_partial<type>&>(mat_basetype);
+
+    long dim = mat.getDim();
+    long D = dimSz(ea, dim);
+    bool native = dimNative(ea, dim);
+
+    vec.resize(D);
+    if (!native)
+      vec1.resize(D);
+
+    // The diagonals are independent, so they are encoded in parallel. Every
+    // worker needs the NTL modulus of the slots.
+    HELIB_EXEC_RANGE(D, first, last)
+    RBak bak;
+    bak.save();
+    ea.getTab().restoreContext();
+    for (long i : range(first, last))
+      encodeDiagonal(ea, mat, vec, vec1, g, i);
+    HELIB_EXEC_RANGE_END
   }
 };
 
@@ -757,6 +777,12 @@ struct ConstMultiplier_DoubleCRT_CKKS : ConstMultiplier
   {
     return nullptr;
   }
+
+  long bytes() const override
+  {
+    const DoubleCRT& dcrt = feptxt.getCKKS().getDCRT();
+    return dcrtBytes(dcrt.getContext(), dcrt.getIndexSet());
+  }
 };
 
 struct ConstMultiplier_zzX_CKKS : ConstMultiplier
@@ -778,6 +804,16 @@ struct ConstMultiplier_zzX_CKKS : ConstMultiplier
         eptxt,
         context.fullPrimes());
   }
+
+  long bytes() const override
+  {
+    return eptxt.getCKKS().getPoly().length() * sizeof(long);
+  }
+
+  long upgradedBytes(const Context& context) const override
+  {
+    return dcrtBytes(context, context.fullPrimes());
+  }
 };
 
 static std::shared_ptr<ConstMultiplier> build_ConstMultiplier_CKKS(
@@ -833,17 +869,32 @@ static void MatMul1DExec_construct_CKKS(
   }
 }
 
-#define HELIB_BSGS_MUL_THRESH HELIB_KEYSWITCH_THRESH
-// uses a BSGS multiplication strategy if sizeof(dim) > HELIB_BSGS_MUL_THRESH;
+// Uses a BSGS multiplication strategy if sizeof(dim) > bsgsThreshold of the
+// tuning profile (HELIB_KEYSWITCH_THRESH unless measured by autotune);
 // otherwise uses the old strategy (but potentially with hoisting)
 
-// For performance purposes, should not exceed HELIB_KEYSWITCH_THRESH
-// For testing purposes:
-//    set to 1 to always use BSGS
-//    set to infty to never use BSGS
+// For testing purposes, fhe_test_force_bsgs forces one or the other
 
-MatMul1DExec::MatMul1DExec(const MatMul1D& mat, bool _minimal) :
-    ea(mat.getEA()), minimal(_minimal)
+long DoubleHoistGiantStepSize(long D)
+{
+  assertTrue<InvalidArgument>(D > 0l, "Step size must be positive");
+  // g baby steps and divc(D, g) giant steps, the first ones of which are free
+  long best = D;
+  long bestCost = D - 1;
+  for (long g : range(1, D)) {
+    long cost = (g - 1) + HELIB_DOUBLE_HOIST_GIANT_COST * (divc(D, g) - 1);
+    if (cost < bestCost) {
+      best = g;
+      bestCost = cost;
+    }
+  }
+  return best;
+}
+
+MatMul1DExec::MatMul1DExec(const MatMul1D& mat,
+                           bool _minimal,
+                           bool _doubleHoist) :
+    ea(mat.getEA()), minimal(_minimal), doubleHoist(_doubleHoist)
 {
   HELIB_NTIMER_START(MatMul1DExec);
 
@@ -863,11 +914,22 @@ MatMul1DExec::MatMul1DExec(const MatMul1D& mat, bool _minimal) :
   D = dimSz(ea, dim);
   native = dimNative(ea, dim);
 
-  bool bsgs = comp_bsgs(D > HELIB_BSGS_MUL_THRESH ||
-                        (minimal && D > HELIB_KEYSWITCH_MIN_THRESH));
+  // The split of the key-switching matrices of addSome1DMatrices is
+  // KSGiantStepSize(D) in the large dimensions, any other one would need
+  // more key switches. In the small ones there are matrices for all the
+  // powers, and double hoisting makes BSGS worth it.
+  long split = 0;
+  if (doubleHoist && !minimal && D <= HELIB_KEYSWITCH_THRESH)
+    split = DoubleHoistGiantStepSize(D);
+
+  bool bsgs = comp_bsgs(D > tuningProfile(ea.getContext()).bsgsThreshold ||
+                        (minimal && D > HELIB_KEYSWITCH_MIN_THRESH) ||
+                        (split > 0 && split < D));
 
   if (!bsgs)
     g = 0; // do not use BSGS
+  else if (split > 0)
+    g = split; // use double-hoisted BSGS
   else
     g = KSGiantStepSize(D); // use BSGS
 
@@ -881,6 +943,39 @@ MatMul1DExec::MatMul1DExec(const MatMul1D& mat, bool _minimal) :
   }
 }
 
+MatMul1DExec::MatMul1DExec(const EncryptedArray& _ea, std::istream& str) :
+    ea(_ea)
+{
+  dim = read_raw_int(str);
+  assertInRange<IOError>(dim,
+                         0l,
+                         ea.dimension(),
+                         "Matrix dimension not in [0, ea.dimension()]",
+                         true);
+  D = read_raw_int(str);
+  assertEq<IOError>(D,
+                    dimSz(ea, dim),
+                    "Matrix does not match the EncryptedArray");
+  native = read_raw_int(str);
+  minimal = read_raw_int(str);
+  doubleHoist = read_raw_int(str);
+  g = read_raw_int(str);
+  cache.readFrom(str, ea.getContext());
+  cache1.readFrom(str, ea.getContext());
+}
+
+void MatMul1DExec::writeTo(std::ostream& str) const
+{
+  write_raw_int(str, dim);
+  write_raw_int(str, D);
+  write_raw_int(str, native);
+  write_raw_int(str, minimal);
+  write_raw_int(str, doubleHoist);
+  write_raw_int(str, g);
+  cache.writeTo(str);
+  cache1.writeTo(str);
+}
+
 /***************************************************************************
 
 BS/GS logic:
@@ -948,31 +1043,119 @@ void GenBabySteps(std::vector<std::shared_ptr<Ctxt>>& v,
       ctxt.getPubKey().getKSStrategy(dim) != HELIB_KSS_UNKNOWN) {
     BasicAutomorphPrecon precon(ctxt);
 
-    NTL_EXEC_RANGE(n, first, last)
+    HELIB_EXEC_RANGE(n, first, last)
     for (long j : range(first, last)) {
       v[j] = precon.automorph(zMStar.genToPow(dim, j));
       if (clean)
         v[j]->cleanUp();
     }
-    NTL_EXEC_RANGE_END
+    HELIB_EXEC_RANGE_END
   } else {
     Ctxt ctxt0(ctxt);
     ctxt0.cleanUp();
 
-    NTL_EXEC_RANGE(n, first, last)
+    HELIB_EXEC_RANGE(n, first, last)
     for (long j : range(first, last)) {
       v[j] = std::make_shared<Ctxt>(ctxt0);
       v[j]->smartAutomorph(zMStar.genToPow(dim, j));
       if (clean)
         v[j]->cleanUp();
     }
-    NTL_EXEC_RANGE_END
+    HELIB_EXEC_RANGE_END
+  }
+}
+
+// The giant steps of the hoisted BSGS strategy, into sums.size() sums:
+// for every k in [0, h), addTerms(inner, i, j) adds to the inner sums the
+// products of the baby steps j < g with the constants of index
+// i = j + g*k < D, and the inner sums are rotated by g*k and added up.
+// The giant steps run in parallel. When there are fewer of them than
+// threads, the products of every giant step are split into blocks of baby
+// steps too, whose sums are added up before the rotation, so that the
+// rotations are not made more than once. All the partial sums are added up
+// in a tree.
+template <typename F>
+static void sumGiantSteps(std::vector<Ctxt>& sums,
+                          long dim,
+                          long g,
+                          long D,
+                          const F& addTerms)
+{
+  long width = sums.size();
+  const PAlgebra& zMStar = sums[0].getContext().getZMStar();
+  const std::vector<Ctxt> zeros(width, Ctxt(ZeroCtxtLike, sums[0]));
+  long h = divc(D, g);
+  long threads = availableThreads();
+
+  // The partial sums of every one of the width sums
+  std::vector<std::vector<Ctxt>> acc;
+
+  if (h >= threads || g == 1) {
+    NTL::PartitionInfo pinfo(h, threads);
+    long cnt = pinfo.NumIntervals();
+    acc.assign(width, std::vector<Ctxt>(cnt, zeros[0]));
+
+    // parallel for loop: k in [0..h)
+    HELIB_EXEC_INDEX(cnt, index)
+    long first, last;
+    pinfo.interval(first, last, index);
+
+    for (long k : range(first, last)) {
+      std::vector<Ctxt> inner = zeros;
+      for (long j : range(g)) {
+        long i = j + g * k;
+        if (i >= D)
+          break;
+        addTerms(inner, i, j);
+      }
+      for (long w : range(width)) {
+        if (k > 0)
+          inner[w].smartAutomorph(zMStar.genToPow(dim, g * k));
+        acc[w][index] += inner[w];
+      }
+    }
+    HELIB_EXEC_INDEX_END
+  } else {
+    long blocks = std::min(g, threads / h);
+    std::vector<std::vector<Ctxt>> parts(h * blocks, zeros);
+
+    // parallel for loop: (k, block of j) in [0..h) x [0..blocks)
+    HELIB_EXEC_INDEX(h * blocks, index)
+    long k = index / blocks;
+    long b = index % blocks;
+    for (long j : range(b * g / blocks, (b + 1) * g / blocks)) {
+      long i = j + g * k;
+      if (i >= D)
+        break;
+      addTerms(parts[index], i, j);
+    }
+    HELIB_EXEC_INDEX_END
+
+    acc.assign(width, std::vector<Ctxt>(h, zeros[0]));
+
+    // parallel for loop: (k, w) in [0..h) x [0..width)
+    HELIB_EXEC_INDEX(h * width, index)
+    long k = index / width;
+    long w = index % width;
+    Ctxt& inner = acc[w][k];
+    for (long b : range(blocks))
+      inner += parts[k * blocks + b][w];
+    if (k > 0)
+      inner.smartAutomorph(zMStar.genToPow(dim, g * k));
+    HELIB_EXEC_INDEX_END
+  }
+
+  for (long w : range(width)) {
+    treeSum(acc[w]);
+    sums[w] = std::move(acc[w][0]);
   }
 }
 
 void MatMul1DExec::mul(Ctxt& ctxt) const
 {
   HELIB_NTIMER_START(mul_MatMul1DExec);
+  ExecutionPolicy::Scope policyScope(
+      ctxt.getContext().effectiveExecutionPolicy());
 
   assertEq(&ea.getContext(),
            &ctxt.getContext(),
@@ -1021,39 +1204,16 @@ void MatMul1DExec::mul(Ctxt& ctxt) const
 
       } else {
 
-        long h = divc(D, g);
         std::vector<std::shared_ptr<Ctxt>> baby_steps(g);
-        GenBabySteps(baby_steps, ctxt, dim, true);
-
-        NTL::PartitionInfo pinfo(h);
-        long cnt = pinfo.NumIntervals();
-
-        std::vector<Ctxt> acc(cnt, Ctxt(ZeroCtxtLike, ctxt));
-
-        // parallel for loop: k in [0..h)
-        NTL_EXEC_INDEX(cnt, index)
-        long first, last;
-        pinfo.interval(first, last, index);
-
-        for (long k : range(first, last)) {
-          Ctxt acc_inner(ZeroCtxtLike, ctxt);
-
-          for (long j : range(g)) {
-            long i = j + g * k;
-            if (i >= D)
-              break;
-            MulAdd(acc_inner, cache.multiplier[i], *baby_steps[j]);
-          }
-
-          if (k > 0)
-            acc_inner.smartAutomorph(zMStar.genToPow(dim, g * k));
-          acc[index] += acc_inner;
-        }
-        NTL_EXEC_INDEX_END
-
-        ctxt = acc[0];
-        for (long i : range(1, cnt))
-          ctxt += acc[i];
+        // With double hoisting the baby steps keep the special primes
+        GenBabySteps(baby_steps, ctxt, dim, /*clean=*/!doubleHoist);
+
+        std::vector<Ctxt> sums(1, Ctxt(ZeroCtxtLike, ctxt));
+        sumGiantSteps(
+            sums, dim, g, D, [&](std::vector<Ctxt>& inner, long i, long j) {
+              MulAdd(inner[0], cache.multiplier[i], *baby_steps[j]);
+            });
+        ctxt = sums[0];
       }
     } else {
 #if (ALT_MATMUL)
@@ -1095,7 +1255,6 @@ void MatMul1DExec::mul(Ctxt& ctxt) const
         }
         ctxt = sum;
       } else {
-        long h = divc(D, g);
         std::vector<std::shared_ptr<Ctxt>> baby_steps(g);
         std::vector<std::shared_ptr<Ctxt>> baby_steps1(g);
 
@@ -1105,40 +1264,13 @@ void MatMul1DExec::mul(Ctxt& ctxt) const
         ctxt1.smartAutomorph(zMStar.genToPow(dim, -D));
         GenBabySteps(baby_steps1, ctxt1, dim, false);
 
-        NTL::PartitionInfo pinfo(h);
-        long cnt = pinfo.NumIntervals();
-
-        std::vector<Ctxt> acc(cnt, Ctxt(ZeroCtxtLike, ctxt));
-
-        // parallel for loop: k in [0..h)
-        NTL_EXEC_INDEX(cnt, index)
-
-        long first, last;
-        pinfo.interval(first, last, index);
-
-        for (long k : range(first, last)) {
-          Ctxt acc_inner(ZeroCtxtLike, ctxt);
-
-          for (long j : range(g)) {
-            long i = j + g * k;
-            if (i >= D)
-              break;
-            MulAdd(acc_inner, cache.multiplier[i], *baby_steps[j]);
-            MulAdd(acc_inner, cache1.multiplier[i], *baby_steps1[j]);
-          }
-
-          if (k > 0) {
-            acc_inner.smartAutomorph(zMStar.genToPow(dim, g * k));
-          }
-
-          acc[index] += acc_inner;
-        }
-
-        NTL_EXEC_INDEX_END
-
-        for (long i : range(1, cnt))
-          acc[0] += acc[i];
-        ctxt = acc[0];
+        std::vector<Ctxt> sums(1, Ctxt(ZeroCtxtLike, ctxt));
+        sumGiantSteps(
+            sums, dim, g, D, [&](std::vector<Ctxt>& inner, long i, long j) {
+              MulAdd(inner[0], cache.multiplier[i], *baby_steps[j]);
+              MulAdd(inner[0], cache1.multiplier[i], *baby_steps1[j]);
+            });
+        ctxt = sums[0];
       }
 #else
       if (iterative) {
@@ -1174,52 +1306,19 @@ void MatMul1DExec::mul(Ctxt& ctxt) const
         sum += sum1;
         ctxt = sum;
       } else {
-        long h = divc(D, g);
         std::vector<std::shared_ptr<Ctxt>> baby_steps(g);
-        GenBabySteps(baby_steps, ctxt, dim, true);
-
-        NTL::PartitionInfo pinfo(h);
-        long cnt = pinfo.NumIntervals();
-
-        std::vector<Ctxt> acc(cnt, Ctxt(ZeroCtxtLike, ctxt));
-        std::vector<Ctxt> acc1(cnt, Ctxt(ZeroCtxtLike, ctxt));
-
-        // parallel for loop: k in [0..h)
-        NTL_EXEC_INDEX(cnt, index)
-
-        long first, last;
-        pinfo.interval(first, last, index);
-
-        for (long k : range(first, last)) {
-          Ctxt acc_inner(ZeroCtxtLike, ctxt);
-          Ctxt acc_inner1(ZeroCtxtLike, ctxt);
-
-          for (long j : range(g)) {
-            long i = j + g * k;
-            if (i >= D)
-              break;
-            MulAdd(acc_inner, cache.multiplier[i], *baby_steps[j]);
-            MulAdd(acc_inner1, cache1.multiplier[i], *baby_steps[j]);
-          }
-
-          if (k > 0) {
-            acc_inner.smartAutomorph(zMStar.genToPow(dim, g * k));
-            acc_inner1.smartAutomorph(zMStar.genToPow(dim, g * k));
-          }
-
-          acc[index] += acc_inner;
-          acc1[index] += acc_inner1;
-        }
-        NTL_EXEC_INDEX_END
-
-        for (long i : range(1, cnt))
-          acc[0] += acc[i];
-        for (long i : range(1, cnt))
-          acc1[0] += acc1[i];
-
-        acc1[0].smartAutomorph(zMStar.genToPow(dim, -D));
-        acc[0] += acc1[0];
-        ctxt = acc[0];
+        GenBabySteps(baby_steps, ctxt, dim, /*clean=*/!doubleHoist);
+
+        std::vector<Ctxt> sums(2, Ctxt(ZeroCtxtLike, ctxt));
+        sumGiantSteps(
+            sums, dim, g, D, [&](std::vector<Ctxt>& inner, long i, long j) {
+              MulAdd(inner[0], cache.multiplier[i], *baby_steps[j]);
+              MulAdd(inner[1], cache1.multiplier[i], *baby_steps[j]);
+            });
+
+        sums[1].smartAutomorph(zMStar.genToPow(dim, -D));
+        sums[0] += sums[1];
+        ctxt = sums[0];
       }
 #endif
     }
@@ -1228,13 +1327,13 @@ void MatMul1DExec::mul(Ctxt& ctxt) const
       std::shared_ptr<GeneralAutomorphPrecon> precon =
           buildGeneralAutomorphPrecon(ctxt, dim, ea);
 
-      NTL::PartitionInfo pinfo(D);
+      NTL::PartitionInfo pinfo(D, availableThreads());
       long cnt = pinfo.NumIntervals();
 
       std::vector<Ctxt> acc(cnt, Ctxt(ZeroCtxtLike, ctxt));
 
       // parallel for loop: i in [0..D)
-      NTL_EXEC_INDEX(cnt, index)
+      HELIB_EXEC_INDEX(cnt, index)
       long first, last;
       pinfo.interval(first, last, index);
 
@@ -1244,24 +1343,22 @@ void MatMul1DExec::mul(Ctxt& ctxt) const
           DestMulAdd(acc[index], cache.multiplier[i], *tmp);
         }
       }
-      NTL_EXEC_INDEX_END
+      HELIB_EXEC_INDEX_END
 
+      treeSum(acc);
       ctxt = acc[0];
-      for (long i : range(1, cnt)) {
-        ctxt += acc[i];
-      }
     } else {
       std::shared_ptr<GeneralAutomorphPrecon> precon =
           buildGeneralAutomorphPrecon(ctxt, dim, ea);
 
-      NTL::PartitionInfo pinfo(D);
+      NTL::PartitionInfo pinfo(D, availableThreads());
       long cnt = pinfo.NumIntervals();
 
       std::vector<Ctxt> acc(cnt, Ctxt(ZeroCtxtLike, ctxt));
       std::vector<Ctxt> acc1(cnt, Ctxt(ZeroCtxtLike, ctxt));
 
       // parallel for loop: i in [0..D)
-      NTL_EXEC_INDEX(cnt, index)
+      HELIB_EXEC_INDEX(cnt, index)
       long first, last;
       pinfo.interval(first, last, index);
 
@@ -1272,12 +1369,10 @@ void MatMul1DExec::mul(Ctxt& ctxt) const
           DestMulAdd(acc1[index], cache1.multiplier[i], *tmp);
         }
       }
-      NTL_EXEC_INDEX_END
+      HELIB_EXEC_INDEX_END
 
-      for (long i : range(1, cnt))
-        acc[0] += acc[i];
-      for (long i : range(1, cnt))
-        acc1[0] += acc1[i];
+      treeSum(acc);
+      treeSum(acc1);
 
       acc1[0].smartAutomorph(zMStar.genToPow(dim, -D));
       acc[0] += acc1[0];
@@ -1318,6 +1413,34 @@ void MatMul1DExec::mul(Ctxt& ctxt) const
   }
 }
 
+// The same cases as in mul, with the HELIB_KSS_FULL strategy: the baby and
+// giant steps for BSGS, otherwise one hoisted automorphism for every nonzero
+// diagonal. The bad dimensions also need the rotation by -D.
+void MatMul1DExec::automorphisms(std::map<long, std::set<long>>& autos) const
+{
+  const PAlgebra& zMStar = ea.getPAlgebra();
+  std::set<long>& vals = autos[dim];
+
+  if (g != 0) {
+    long h = divc(D, g);
+    for (long j : range(1, g))
+      vals.insert(zMStar.genToPow(dim, j));
+    for (long k : range(1, h))
+      vals.insert(zMStar.genToPow(dim, g * k));
+  } else {
+    for (long i : range(1, D)) {
+      bool nonzero = cache.multiplier[i] != nullptr;
+      if (!native && cache1.multiplier[i] != nullptr)
+        nonzero = true;
+      if (nonzero)
+        vals.insert(zMStar.genToPow(dim, i));
+    }
+  }
+
+  if (!native)
+    vals.insert(zMStar.genToPow(dim, -D));
+}
+
 // ========================== BlockMatMul1D stuff =====================
 
 template <typename type>
@@ -1534,6 +1657,78 @@ struct BlockMatMul1DExec_construct
   // strategy == +1 : factor \sigma
   // strategy == -1 : factor \rho
 
+  // Encode the constants of diagonal i, with the NTL modulus of the slots
+  // in place
+  static void encodeDiagonal(const EncryptedArrayDerived<type>& ea,
+                             const BlockMatMul1D_partial<type>& mat,
+                             std::vector<std::shared_ptr<ConstMultiplier>>& vec,
+                             std::vector<std::shared_ptr<ConstMultiplier>>& vec1,
+                             long strategy,
+                             long i)
+  {
+    long dim = mat.getDim();
+    long D = dimSz(ea, dim);
+    long d = ea.getDegree();
+    bool native = dimNative(ea, dim);
+
+    std::vector<RX> poly;
+    bool zero = mat.processDiagonal(poly, i, ea);
+    // The position of constant j of diagonal i
+    auto pos = [&](long j) { return (strategy == +1) ? i * d + j : i + j * D; };
+
+    if (zero) {
+      for (long j : range(d)) {
+        vec[pos(j)] = nullptr;
+        if (!native)
+          vec1[pos(j)] = nullptr;
+      }
+      return;
+    }
+
+    if (native) {
+      for (long j : range(d)) {
+        if (strategy == +1) // factor \sigma
+          vec[pos(j)] = build_ConstMultiplier(poly[j], -1, -j, ea);
+        else // factor \rho
+          vec[pos(j)] = build_ConstMultiplier(poly[j], dim, -i, ea);
+      }
+      return;
+    }
+
+    const RX& mask = ea.getTab().getMaskTable()[dim][i];
+    const RXModulus& F = ea.getTab().getPhimXMod();
+
+    for (long j : range(d)) {
+      if (strategy == +1) { // factor \sigma
+        plaintextAutomorph(poly[j], poly[j], -1, -j, ea);
+
+        RX poly1;
+        MulMod(poly1,
+               poly[j],
+               mask,
+               F); // poly[j] w/ first i slots zeroed out
+        vec[pos(j)] = build_ConstMultiplier(poly1);
+
+        sub(poly1,
+            poly[j],
+            poly1); // poly[j] w/ last D-i slots zeroed out
+        vec1[pos(j)] = build_ConstMultiplier(poly1, dim, D, ea);
+      } else { // factor \rho
+        RX poly1, poly2;
+        MulMod(poly1,
+               poly[j],
+               mask,
+               F); // poly[j] w/ first i slots zeroed out
+        sub(poly2,
+            poly[j],
+            poly1); // poly[j] w/ last D-i slots zeroed out
+
+        vec[pos(j)] = build_ConstMultiplier(poly1, dim, -i, ea);
+        vec1[pos(j)] = build_ConstMultiplier(poly2, dim, D - i, ea);
+      }
+    }
+  }
+
   static void apply(const EncryptedArrayDerived<type>& ea,
                     const BlockMatMul1D& mat_basetype,
                     std::vector<std::shared_ptr<ConstMultiplier>>& vec,
@@ -1548,113 +1743,22 @@ struct BlockMatMul1DExec_construct
     long d = ea.getDegree();
     bool native = dimNative(ea, dim);
 
+    if (strategy != +1 && strategy != -1)
+      throw InvalidArgument("Unknown strategy");
+
+    vec.resize(D * d);
+    if (!native)
+      vec1.resize(D * d);
+
+    // The diagonals are independent, so they are encoded in parallel. Every
+    // worker needs the NTL modulus of the slots.
+    HELIB_EXEC_RANGE(D, first, last)
     RBak bak;
     bak.save();
     ea.getTab().restoreContext();
-
-    std::vector<RX> poly;
-
-    switch (strategy) {
-    case +1: // factor \sigma
-
-      if (native) {
-        vec.resize(D * d);
-        for (long i : range(D)) {
-          bool zero = mat.processDiagonal(poly, i, ea);
-          if (zero) {
-            for (long j : range(d))
-              vec[i * d + j] = nullptr;
-          } else {
-            for (long j : range(d)) {
-              vec[i * d + j] = build_ConstMultiplier(poly[j], -1, -j, ea);
-            }
-          }
-        }
-      } else {
-        vec.resize(D * d);
-        vec1.resize(D * d);
-        for (long i : range(D)) {
-          bool zero = mat.processDiagonal(poly, i, ea);
-          if (zero) {
-            for (long j : range(d)) {
-              vec[i * d + j] = nullptr;
-              vec1[i * d + j] = nullptr;
-            }
-          } else {
-            const RX& mask = ea.getTab().getMaskTable()[dim][i];
-            const RXModulus& F = ea.getTab().getPhimXMod();
-
-            for (long j : range(d)) {
-              plaintextAutomorph(poly[j], poly[j], -1, -j, ea);
-
-              RX poly1;
-              MulMod(poly1,
-                     poly[j],
-                     mask,
-                     F); // poly[j] w/ first i slots zeroed out
-              vec[i * d + j] = build_ConstMultiplier(poly1);
-
-              sub(poly1,
-                  poly[j],
-                  poly1); // poly[j] w/ last D-i slots zeroed out
-              vec1[i * d + j] = build_ConstMultiplier(poly1, dim, D, ea);
-            }
-          }
-        }
-      }
-      break;
-
-    case -1: // factor \rho
-
-      if (native) {
-        vec.resize(D * d);
-        for (long i : range(D)) {
-          bool zero = mat.processDiagonal(poly, i, ea);
-          if (zero) {
-            for (long j : range(d))
-              vec[i + j * D] = nullptr;
-          } else {
-            for (long j : range(d)) {
-              vec[i + j * D] = build_ConstMultiplier(poly[j], dim, -i, ea);
-            }
-          }
-        }
-      } else {
-        vec.resize(D * d);
-        vec1.resize(D * d);
-        for (long i : range(D)) {
-          bool zero = mat.processDiagonal(poly, i, ea);
-          if (zero) {
-            for (long j : range(d)) {
-              vec[i + j * D] = nullptr;
-              vec1[i + j * D] = nullptr;
-            }
-          } else {
-            const RX& mask = ea.getTab().getMaskTable()[dim][i];
-            const RXModulus& F = ea.getTab().getPhimXMod();
-
-            for (long j : range(d)) {
-              RX poly1, poly2;
-              MulMod(poly1,
-                     poly[j],
-                     mask,
-                     F); // poly[j] w/ first i slots zeroed out
-              sub(poly2,
-                  poly[j],
-                  poly1); // poly[j] w/ last D-i slots zeroed out
-
-              vec[i + j * D] = build_ConstMultiplier(poly1, dim, -i, ea);
-              vec1[i + j * D] = build_ConstMultiplier(poly2, dim, D - i, ea);
-            }
-          }
-        }
-      }
-
-      break;
-
-    default:
-      throw InvalidArgument("Unknown strategy");
-    }
+    for (long i : range(first, last))
+      encodeDiagonal(ea, mat, vec, vec1, strategy, i);
+    HELIB_EXEC_RANGE_END
   }
 };
 
@@ -1694,9 +1798,42 @@ BlockMatMul1DExec::BlockMatMul1DExec(const BlockMatMul1D& mat,
                                            strategy);
 }
 
+BlockMatMul1DExec::BlockMatMul1DExec(const EncryptedArray& _ea,
+                                     std::istream& str) :
+    ea(_ea)
+{
+  dim = read_raw_int(str);
+  assertInRange<IOError>(dim,
+                         0l,
+                         ea.dimension(),
+                         "Matrix dimension not in [0, ea.dimension()]",
+                         true);
+  D = read_raw_int(str);
+  d = read_raw_int(str);
+  assertTrue<IOError>(D == dimSz(ea, dim) && d == ea.getDegree(),
+                      "Matrix does not match the EncryptedArray");
+  native = read_raw_int(str);
+  strategy = read_raw_int(str);
+  cache.readFrom(str, ea.getContext());
+  cache1.readFrom(str, ea.getContext());
+}
+
+void BlockMatMul1DExec::writeTo(std::ostream& str) const
+{
+  write_raw_int(str, dim);
+  write_raw_int(str, D);
+  write_raw_int(str, d);
+  write_raw_int(str, native);
+  write_raw_int(str, strategy);
+  cache.writeTo(str);
+  cache1.writeTo(str);
+}
+
 void BlockMatMul1DExec::mul(Ctxt& ctxt) const
 {
   HELIB_NTIMER_START(mul_BlockMatMul1DExec);
+  ExecutionPolicy::Scope policyScope(
+      ctxt.getContext().effectiveExecutionPolicy());
   assertEq(&ea.getContext(),
            &ctxt.getContext(),
            "Cannot multiply ciphertexts with context different to "
@@ -1708,45 +1845,56 @@ void BlockMatMul1DExec::mul(Ctxt& ctxt) const
   if (strategy == 0) {
     // assumes minimal KS matrices present
 
-    if (native) {
-      Ctxt acc(ZeroCtxtLike, ctxt);
-      Ctxt sh_ctxt(ctxt);
-
-      for (long i : range(D)) {
+    // The shifts along dim are made one after another, a batch of them at
+    // a time, and then the chains of Frobenius maps of the d blocks of the
+    // shifts of a batch run in parallel, each interval of them into sums of
+    // its own
+    long batch = std::min(D, availableThreads());
+    NTL::PartitionInfo pinfo(batch, batch);
+    long cnt = pinfo.NumIntervals();
+
+    std::vector<Ctxt> acc(cnt, Ctxt(ZeroCtxtLike, ctxt));
+    std::vector<Ctxt> acc1(native ? 0 : cnt, Ctxt(ZeroCtxtLike, ctxt));
+    std::vector<Ctxt> shifts;
+    Ctxt sh_ctxt(ctxt);
+
+    for (long first_i = 0; first_i < D; first_i += batch) {
+      long last_i = std::min(first_i + batch, D);
+      shifts.clear();
+      for (long i : range(first_i, last_i)) {
         if (i > 0)
           sh_ctxt.smartAutomorph(zMStar.genToPow(dim, 1));
-        Ctxt sh_ctxt1(sh_ctxt);
-
-        for (long j : range(d)) {
-          if (j > 0)
-            sh_ctxt1.smartAutomorph(zMStar.genToPow(-1, 1));
-          MulAdd(acc, cache.multiplier[i * d + j], sh_ctxt1);
-        }
+        shifts.push_back(sh_ctxt);
       }
 
-      ctxt = acc;
-    } else {
-      Ctxt acc(ZeroCtxtLike, ctxt);
-      Ctxt acc1(ZeroCtxtLike, ctxt);
-      Ctxt sh_ctxt(ctxt);
+      // parallel for loop: i in [first_i..last_i)
+      HELIB_EXEC_INDEX(cnt, index)
+      long first, last;
+      pinfo.interval(first, last, index);
+      last = std::min(last, last_i - first_i);
 
-      for (long i : range(D)) {
-        if (i > 0)
-          sh_ctxt.smartAutomorph(zMStar.genToPow(dim, 1));
-        Ctxt sh_ctxt1(sh_ctxt);
+      for (long idx = first; idx < last; idx++) {
+        long i = first_i + idx;
+        Ctxt& sh_ctxt1 = shifts[idx];
 
         for (long j : range(d)) {
           if (j > 0)
             sh_ctxt1.smartAutomorph(zMStar.genToPow(-1, 1));
-          MulAdd(acc, cache.multiplier[i * d + j], sh_ctxt1);
-          MulAdd(acc1, cache1.multiplier[i * d + j], sh_ctxt1);
+          MulAdd(acc[index], cache.multiplier[i * d + j], sh_ctxt1);
+          if (!native)
+            MulAdd(acc1[index], cache1.multiplier[i * d + j], sh_ctxt1);
         }
       }
+      HELIB_EXEC_INDEX_END
+    }
 
-      acc1.smartAutomorph(zMStar.genToPow(dim, -D));
-      acc += acc1;
-      ctxt = acc;
+    treeSum(acc);
+    if (!native) {
+      treeSum(acc1);
+      acc1[0].smartAutomorph(zMStar.genToPow(dim, -D));
+      acc[0] += acc1[0];
     }
+    ctxt = acc[0];
 
     return;
   }
@@ -1776,7 +1924,7 @@ void BlockMatMul1DExec::mul(Ctxt& ctxt) const
   if (ctxt.getPubKey().getKSStrategy(dim1) == HELIB_KSS_MIN)
     iterative1 = true;
   if (ctxt.getPubKey().getKSStrategy(dim1) != HELIB_KSS_FULL &&
-      NTL::AvailableThreads() == 1)
+      availableThreads() == 1)
     iterative1 = true;
 
   if (native) {
@@ -1791,9 +1939,11 @@ void BlockMatMul1DExec::mul(Ctxt& ctxt) const
           sh_ctxt.smartAutomorph(zMStar.genToPow(dim0, 1));
           sh_ctxt.cleanUp();
         }
-        for (long j : range(d1)) {
+        // the d1 blocks of the products in parallel
+        HELIB_EXEC_RANGE(d1, first, last)
+        for (long j : range(first, last))
           MulAdd(acc[j], cache.multiplier[i * d1 + j], sh_ctxt);
-        }
+        HELIB_EXEC_RANGE_END
       }
     } else {
 
@@ -1801,7 +1951,7 @@ void BlockMatMul1DExec::mul(Ctxt& ctxt) const
           buildGeneralAutomorphPrecon(ctxt, dim0, ea);
 
       long par_buf_sz = 1;
-      if (NTL::AvailableThreads() > 1)
+      if (availableThreads() > 1)
         par_buf_sz = std::min(d0, par_buf_max);
 
       std::vector<std::shared_ptr<Ctxt>> par_buf(par_buf_sz);
@@ -1812,16 +1962,16 @@ void BlockMatMul1DExec::mul(Ctxt& ctxt) const
         // for i in [first_i..last_i), generate automorphism i and store
         // in par_buf[i-first_i]
 
-        NTL_EXEC_RANGE(last_i - first_i, first, last)
+        HELIB_EXEC_RANGE(last_i - first_i, first, last)
 
         for (long idx : range(first, last)) {
           long i = idx + first_i;
           par_buf[idx] = precon->automorph(i);
         }
 
-        NTL_EXEC_RANGE_END
+        HELIB_EXEC_RANGE_END
 
-        NTL_EXEC_RANGE(d1, first, last)
+        HELIB_EXEC_RANGE(d1, first, last)
 
         for (long j : range(first, last)) {
           for (long i : range(first_i, last_i)) {
@@ -1829,7 +1979,7 @@ void BlockMatMul1DExec::mul(Ctxt& ctxt) const
           }
         }
 
-        NTL_EXEC_RANGE_END
+        HELIB_EXEC_RANGE_END
       }
     }
 
@@ -1846,13 +1996,13 @@ void BlockMatMul1DExec::mul(Ctxt& ctxt) const
 
     } else {
 
-      NTL::PartitionInfo pinfo(d1);
+      NTL::PartitionInfo pinfo(d1, availableThreads());
       long cnt = pinfo.NumIntervals();
 
       std::vector<Ctxt> sum(cnt, Ctxt(ZeroCtxtLike, ctxt));
 
       // for j in [0..d1)
-      NTL_EXEC_INDEX(cnt, index)
+      HELIB_EXEC_INDEX(cnt, index)
       long first, last;
       pinfo.interval(first, last, index);
       for (long j : range(first, last)) {
@@ -1860,11 +2010,10 @@ void BlockMatMul1DExec::mul(Ctxt& ctxt) const
           acc[j].smartAutomorph(zMStar.genToPow(dim1, j));
         sum[index] += acc[j];
       }
-      NTL_EXEC_INDEX_END
+      HELIB_EXEC_INDEX_END
 
+      treeSum(sum);
       ctxt = sum[0];
-      for (long i : range(1, cnt))
-        ctxt += sum[i];
     }
   } else {
 
@@ -1879,10 +2028,13 @@ void BlockMatMul1DExec::mul(Ctxt& ctxt) const
           sh_ctxt.smartAutomorph(zMStar.genToPow(dim0, 1));
           sh_ctxt.cleanUp();
         }
-        for (long j : range(d1)) {
+        // the d1 blocks of the products in parallel
+        HELIB_EXEC_RANGE(d1, first, last)
+        for (long j : range(first, last)) {
           MulAdd(acc[j], cache.multiplier[i * d1 + j], sh_ctxt);
           MulAdd(acc1[j], cache1.multiplier[i * d1 + j], sh_ctxt);
         }
+        HELIB_EXEC_RANGE_END
       }
     } else {
 
@@ -1890,7 +2042,7 @@ void BlockMatMul1DExec::mul(Ctxt& ctxt) const
           buildGeneralAutomorphPrecon(ctxt, dim0, ea);
 
       long par_buf_sz = 1;
-      if (NTL::AvailableThreads() > 1)
+      if (availableThreads() > 1)
         par_buf_sz = std::min(d0, par_buf_max);
 
       std::vector<std::shared_ptr<Ctxt>> par_buf(par_buf_sz);
@@ -1901,16 +2053,16 @@ void BlockMatMul1DExec::mul(Ctxt& ctxt) const
         // for i in [first_i..last_i), generate automorphism i and store
         // in par_buf[i-first_i]
 
-        NTL_EXEC_RANGE(last_i - first_i, first, last)
+        HELIB_EXEC_RANGE(last_i - first_i, first, last)
 
         for (long idx : range(first, last)) {
           long i = idx + first_i;
           par_buf[idx] = precon->automorph(i);
         }
 
-        NTL_EXEC_RANGE_END
+        HELIB_EXEC_RANGE_END
 
-        NTL_EXEC_RANGE(d1, first, last)
+        HELIB_EXEC_RANGE(d1, first, last)
 
         for (long j : range(first, last)) {
           for (long i : range(first_i, last_i)) {
@@ -1921,7 +2073,7 @@ void BlockMatMul1DExec::mul(Ctxt& ctxt) const
           }
         }
 
-        NTL_EXEC_RANGE_END
+        HELIB_EXEC_RANGE_END
       }
     }
 
@@ -1944,14 +2096,14 @@ void BlockMatMul1DExec::mul(Ctxt& ctxt) const
       ctxt += sum1;
     } else {
 
-      NTL::PartitionInfo pinfo(d1);
+      NTL::PartitionInfo pinfo(d1, availableThreads());
       long cnt = pinfo.NumIntervals();
 
       std::vector<Ctxt> sum(cnt, Ctxt(ZeroCtxtLike, ctxt));
       std::vector<Ctxt> sum1(cnt, Ctxt(ZeroCtxtLike, ctxt));
 
       // for j in [0..d1)
-      NTL_EXEC_INDEX(cnt, index)
+      HELIB_EXEC_INDEX(cnt, index)
       long first, last;
       pinfo.interval(first, last, index);
       for (long j : range(first, last)) {
@@ -1962,12 +2114,10 @@ void BlockMatMul1DExec::mul(Ctxt& ctxt) const
         sum[index] += acc[j];
         sum1[index] += acc1[j];
       }
-      NTL_EXEC_INDEX_END
+      HELIB_EXEC_INDEX_END
 
-      for (long i : range(1, cnt))
-        sum[0] += sum[i];
-      for (long i : range(1, cnt))
-        sum1[0] += sum1[i];
+      treeSum(sum);
+      treeSum(sum1);
       sum1[0].smartAutomorph(zMStar.genToPow(dim, -D));
       ctxt = sum[0];
       ctxt += sum1[0];
@@ -1975,6 +2125,35 @@ void BlockMatMul1DExec::mul(Ctxt& ctxt) const
   }
 }
 
+void BlockMatMul1DExec::automorphisms(
+    std::map<long, std::set<long>>& autos) const
+{
+  const PAlgebra& zMStar = ea.getPAlgebra();
+
+  if (strategy == 0) {
+    // the iterative procedure of mul
+    if (D > 1)
+      autos[dim].insert(zMStar.genToPow(dim, 1));
+    if (d > 1)
+      autos[-1].insert(zMStar.genToPow(-1, 1));
+  } else {
+    long d0 = (strategy == +1) ? D : d;
+    long dim0 = (strategy == +1) ? dim : -1;
+    long d1 = (strategy == +1) ? d : D;
+    long dim1 = (strategy == +1) ? -1 : dim;
+
+    // hoisted automorphisms of the input in dim0, then one automorphism of
+    // every partial sum in dim1
+    for (long i : range(1, d0))
+      autos[dim0].insert(zMStar.genToPow(dim0, i));
+    for (long j : range(1, d1))
+      autos[dim1].insert(zMStar.genToPow(dim1, j));
+  }
+
+  if (!native)
+    autos[dim].insert(zMStar.genToPow(dim, -D));
+}
+
 // ===================== MatMulFull stuff ==================
 
 template <typename type>
@@ -2254,6 +2433,8 @@ long MatMulFullExec::rec_mul(Ctxt& acc,
 void MatMulFullExec::mul(Ctxt& ctxt) const
 {
   HELIB_NTIMER_START(mul_MatMulFullExec);
+  ExecutionPolicy::Scope policyScope(
+      ctxt.getContext().effectiveExecutionPolicy());
   assertEq(&ea.getContext(),
            &ctxt.getContext(),
            "Cannot multiply ciphertexts with context different to "
@@ -2597,6 +2778,8 @@ long BlockMatMulFullExec::rec_mul(Ctxt& acc,
 void BlockMatMulFullExec::mul(Ctxt& ctxt) const
 {
   HELIB_NTIMER_START(mul_BlockMatMulFullExec);
+  ExecutionPolicy::Scope policyScope(
+      ctxt.getContext().effectiveExecutionPolicy());
   assertEq(&ea.getContext(),
            &ctxt.getContext(),
            "Cannot multiply ciphertexts with context different to "
@@ -2960,4 +3143,32 @@ void traceMap(Ctxt& ctxt)
   }
 }
 
+void traceMapAutomorphisms(const Context& context,
+                           std::map<long, std::set<long>>& autos)
+{
+  const PAlgebra& zMStar = context.getZMStar();
+  long d = context.getOrdP();
+
+  if (d == 1)
+    return;
+
+  std::set<long>& vals = autos[-1];
+  if (d <= HELIB_TRACE_THRESH) {
+    for (long i : range(1, d))
+      vals.insert(zMStar.genToPow(-1, i));
+  } else {
+    // the repeated doubling of traceMap
+    long k = NTL::NumBits(d);
+    long e = 1;
+    for (long i = k - 2; i >= 0; i--) {
+      vals.insert(zMStar.genToPow(-1, e));
+      e = 2 * e;
+      if (NTL::bit(d, i)) {
+        vals.insert(zMStar.genToPow(-1, 1));
+        e += 1;
+      }
+    }
+  }
+}
+
 } // namespace helib
@@ -0,0 +1,514 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <helib/matrixEngine.h>
+
+#include <cstring>
+#include <fstream>
+#include <map>
+
+#ifdef _WIN32
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include <sys/stat.h>
+
+#include <helib/assertions.h>
+#include <helib/automorphPrecon.h>
+#include <helib/EncodedPtxt.h>
+#include <helib/exceptions.h>
+#include <helib/multicore.h>
+#include <helib/NumbTh.h>
+#include <helib/refreshPolicy.h>
+#include <helib/timing.h>
+
+namespace helib {
+
+namespace {
+
+const char WEIGHTS_MAGIC[8] = {'H', 'E', 'M', 'A', 'T', 'W', '0', '1'};
+constexpr std::size_t WORD = 8;
+constexpr std::size_t HEADER = sizeof(WEIGHTS_MAGIC) + 2 * WORD; // n, kind
+
+unsigned long readWord(const unsigned char* ptr)
+{
+  unsigned long num = 0;
+  for (std::size_t i = 0; i < WORD; i++)
+    num |= static_cast<unsigned long>(ptr[i]) << (8 * i);
+  return num;
+}
+
+void writeWord(std::ostream& str, unsigned long num)
+{
+  for (std::size_t i = 0; i < WORD; i++) {
+    char byte = static_cast<char>(num >> (8 * i));
+    str.write(&byte, 1);
+  }
+}
+
+unsigned long bitsOf(double x)
+{
+  static_assert(sizeof(double) == WORD, "doubles must be 64-bit");
+  unsigned long bits;
+  std::memcpy(&bits, &x, WORD);
+  return bits;
+}
+
+double fromBits(unsigned long bits)
+{
+  double x;
+  std::memcpy(&x, &bits, WORD);
+  return x;
+}
+
+// Entry (i, j) of psi^k(tau(W)) is W[i+j+k, j], indices mod n
+template <typename T>
+void operandOf(std::vector<T>& out, const std::vector<T>& w, long n, long k)
+{
+  out.assign(n * n, T(0));
+  for (long i : range(n))
+    for (long j : range(n))
+      out[i * n + j] = w[((i + j + k) % n) * n + j];
+}
+
+template <typename T>
+void writeWeights(const std::string& path,
+                  long n,
+                  const std::vector<T>& w,
+                  bool real)
+{
+  assertTrue<InvalidArgument>(n > 0 && long(w.size()) == n * n,
+                              "The weights must be an n x n matrix");
+  std::ofstream out(path, std::ios::binary);
+  if (!out)
+    throw IOError("Could not write weight file " + path);
+  out.write(WEIGHTS_MAGIC, sizeof(WEIGHTS_MAGIC));
+  writeWord(out, n);
+  writeWord(out, real);
+  std::vector<T> op;
+  for (long k : range(n)) {
+    operandOf(op, w, n, k);
+    for (T x : op)
+      writeWord(out, real ? bitsOf(x) : static_cast<unsigned long>(long(x)));
+  }
+  if (!out)
+    throw IOError("Could not write weight file " + path);
+}
+
+// The rotations of x by shifts, hoisted when they are automorphisms along
+// a single native dimension, and cleaned up
+std::vector<Ctxt> rotations(const EncryptedArray& ea,
+                            const Ctxt& x,
+                            const std::vector<long>& shifts)
+{
+  long count = shifts.size();
+  std::vector<Ctxt> result;
+  if (!x.isCKKS() && ea.dimension() == 1 && ea.nativeDimension(0)) {
+    const PAlgebra& zMStar = ea.getPAlgebra();
+    std::vector<long> ks(count);
+    for (long i : range(count))
+      ks[i] = zMStar.genToPow(0, shifts[i]);
+    Ctxt clean(x);
+    clean.cleanUp();
+    BasicAutomorphPrecon precon(clean);
+    result = precon.automorph(ks);
+    HELIB_EXEC_RANGE(count, first, last)
+    for (long i : range(first, last))
+      result[i].cleanUp();
+    HELIB_EXEC_RANGE_END
+  } else {
+    result.assign(count, x);
+    HELIB_EXEC_RANGE(count, first, last)
+    for (long i : range(first, last)) {
+      ea.rotate(result[i], shifts[i]);
+      result[i].cleanUp();
+    }
+    HELIB_EXEC_RANGE_END
+  }
+  return result;
+}
+
+// Add up acc into acc[0]
+void sumInto(Ctxt& out, std::vector<Ctxt>& acc)
+{
+  for (long i : range(1, acc.size()))
+    acc[0] += acc[i];
+  out = std::move(acc[0]);
+}
+
+} // namespace
+
+//============== InMemoryWeights ==============
+
+InMemoryWeights::InMemoryWeights(long n, std::vector<long> w) :
+    n(n), integers(std::move(w))
+{
+  assertTrue<InvalidArgument>(n > 0 && long(integers.size()) == n * n,
+                              "The weights must be an n x n matrix");
+}
+
+InMemoryWeights::InMemoryWeights(long n, std::vector<double> w) :
+    n(n), reals(std::move(w))
+{
+  assertTrue<InvalidArgument>(n > 0 && long(reals.size()) == n * n,
+                              "The weights must be an n x n matrix");
+}
+
+void InMemoryWeights::operand(PtxtArray& out, long k) const
+{
+  assertInRange<OutOfRangeError>(k, 0l, n, "No such operand");
+  long nslots = out.ea.size();
+  if (reals.empty()) {
+    std::vector<long> op;
+    operandOf(op, integers, n, k);
+    op.resize(nslots, 0);
+    out.load(op);
+  } else {
+    std::vector<double> op;
+    operandOf(op, reals, n, k);
+    op.resize(nslots, 0.0);
+    out.load(op);
+  }
+}
+
+//============== MappedWeights ==============
+
+MappedWeights::MappedWeights(const std::string& path) : path(path)
+{
+#ifdef _WIN32
+  std::ifstream in(path, std::ios::binary);
+  if (!in)
+    throw IOError("Could not open weight file " + path);
+  buffer.assign(std::istreambuf_iterator<char>(in),
+                std::istreambuf_iterator<char>());
+  data = buffer.data();
+  length = buffer.size();
+#else
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw IOError("Could not open weight file " + path);
+  struct stat st;
+  if (::fstat(fd, &st) != 0 || st.st_size == 0) {
+    ::close(fd);
+    throw IOError("Could not stat weight file " + path);
+  }
+  length = st.st_size;
+  void* addr = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd); // the mapping keeps its own reference to the file
+  if (addr == MAP_FAILED) {
+    length = 0;
+    throw IOError("Could not map weight file " + path);
+  }
+  data = static_cast<const unsigned char*>(addr);
+#endif
+
+  if (length < HEADER ||
+      std::memcmp(data, WEIGHTS_MAGIC, sizeof(WEIGHTS_MAGIC)) != 0) {
+    release();
+    throw IOError(path + " is not a weight file");
+  }
+  n = long(readWord(data + sizeof(WEIGHTS_MAGIC)));
+  unsigned long kind = readWord(data + sizeof(WEIGHTS_MAGIC) + WORD);
+  if (n <= 0 || n > (1L << 20) || kind > 1 ||
+      (length - HEADER) / WORD / n / n < std::size_t(n)) {
+    release();
+    throw IOError("Truncated or corrupted weight file " + path);
+  }
+  real = kind == 1;
+}
+
+MappedWeights::~MappedWeights() { release(); }
+
+void MappedWeights::release()
+{
+#ifndef _WIN32
+  if (data != nullptr)
+    ::munmap(const_cast<unsigned char*>(data), length);
+#endif
+  data = nullptr;
+  length = 0;
+}
+
+void MappedWeights::write(const std::string& path,
+                          long n,
+                          const std::vector<long>& w)
+{
+  writeWeights(path, n, w, /*real=*/false);
+}
+
+void MappedWeights::write(const std::string& path,
+                          long n,
+                          const std::vector<double>& w)
+{
+  writeWeights(path, n, w, /*real=*/true);
+}
+
+void MappedWeights::operand(PtxtArray& out, long k) const
+{
+  assertInRange<OutOfRangeError>(k, 0l, n, "No such operand");
+  long nslots = out.ea.size();
+  const unsigned char* op = data + HEADER + std::size_t(k) * n * n * WORD;
+  if (real) {
+    std::vector<double> slots(nslots, 0.0);
+    for (long t : range(n * n))
+      slots[t] = fromBits(readWord(op + t * WORD));
+    out.load(slots);
+  } else {
+    std::vector<long> slots(nslots, 0);
+    for (long t : range(n * n))
+      slots[t] = long(readWord(op + t * WORD));
+    out.load(slots);
+  }
+}
+
+//============== MatrixEngine ==============
+
+// A map of the slots that moves every slot to at most one other: the sum
+// over the shifts of the rotation by the shift times the mask of the slots
+// that it moves to their place
+struct MatrixEngine::SlotMap
+{
+  std::vector<long> shifts;
+  std::vector<std::unique_ptr<PreparedPtxt>> masks;
+
+  // Slot t of the result is slot source[t] of the input, zero if that is
+  // negative
+  SlotMap(const EncryptedArray& ea, const std::vector<long>& source)
+  {
+    long nslots = ea.size();
+    std::map<long, std::vector<long>> slotsOf;
+    for (long t : range(nslots))
+      if (source[t] >= 0)
+        slotsOf[mcMod(t - source[t], nslots)].push_back(t);
+    for (const auto& shift : slotsOf) {
+      shifts.push_back(shift.first);
+      EncodedPtxt eptxt;
+      if (ea.isCKKS()) {
+        std::vector<double> mask(nslots, 0.0);
+        for (long t : shift.second)
+          mask[t] = 1.0;
+        PtxtArray(ea, mask).encode(eptxt, /*mag=*/1.0);
+      } else {
+        std::vector<long> mask(nslots, 0);
+        for (long t : shift.second)
+          mask[t] = 1;
+        PtxtArray(ea, mask).encode(eptxt);
+      }
+      masks.push_back(std::make_unique<PreparedPtxt>(eptxt));
+    }
+  }
+};
+
+MatrixEngine::MatrixEngine(const EncryptedArray& ea, long n) : ea(ea), n(n)
+{
+  assertTrue<InvalidArgument>(n > 0 && n * n <= ea.size(),
+                              "The n x n matrices must fit in the slots");
+  HELIB_TIMER_START;
+
+  long nslots = ea.size();
+  auto mapOf = [&](const std::function<long(long, long)>& source) {
+    std::vector<long> src(nslots, -1);
+    for (long i : range(n))
+      for (long j : range(n))
+        src[i * n + j] = source(i, j);
+    return std::make_unique<SlotMap>(ea, src);
+  };
+
+  sigma = mapOf([&](long i, long j) { return i * n + (i + j) % n; });
+  tau = mapOf([&](long i, long j) { return ((i + j) % n) * n + j; });
+  for (long k : range(1, n)) {
+    phi.push_back(mapOf([&](long i, long j) { return i * n + (j + k) % n; }));
+    psi.push_back(mapOf([&](long i, long j) { return ((i + k) % n) * n + j; }));
+  }
+}
+
+MatrixEngine::~MatrixEngine() = default;
+
+void MatrixEngine::pack(PtxtArray& out, const std::vector<long>& m) const
+{
+  assertEq<InvalidArgument>(long(m.size()), n * n, "Not an n x n matrix");
+  std::vector<long> slots(m);
+  slots.resize(ea.size(), 0);
+  out.load(slots);
+}
+
+void MatrixEngine::pack(PtxtArray& out, const std::vector<double>& m) const
+{
+  assertEq<InvalidArgument>(long(m.size()), n * n, "Not an n x n matrix");
+  std::vector<double> slots(m);
+  slots.resize(ea.size(), 0.0);
+  out.load(slots);
+}
+
+void MatrixEngine::unpack(std::vector<long>& m, const PtxtArray& in) const
+{
+  in.store(m);
+  m.resize(n * n);
+}
+
+void MatrixEngine::unpack(std::vector<double>& m, const PtxtArray& in) const
+{
+  in.store(m);
+  m.resize(n * n);
+}
+
+std::vector<Ctxt> MatrixEngine::apply(
+    const Ctxt& x,
+    const std::vector<const SlotMap*>& maps) const
+{
+  // The rotations of all the maps, each made once
+  std::map<long, long> indexOf;
+  std::vector<long> shifts;
+  for (const SlotMap* map : maps)
+    for (long shift : map->shifts)
+      if (indexOf.emplace(shift, shifts.size()).second)
+        shifts.push_back(shift);
+  std::vector<Ctxt> rotated = rotations(ea, x, shifts);
+
+  long count = maps.size();
+  std::vector<Ctxt> result(count, Ctxt(ZeroCtxtLike, x));
+  HELIB_EXEC_INDEX(count, index)
+  const SlotMap& map = *maps[index];
+  for (long s : range(map.shifts.size())) {
+    Ctxt term = rotated[indexOf.at(map.shifts[s])];
+    term.multByConstant(*map.masks[s]);
+    result[index] += term;
+  }
+  HELIB_EXEC_INDEX_END
+  return result;
+}
+
+void MatrixEngine::multiply(Ctxt& a, const WeightSource& w) const
+{
+  HELIB_TIMER_START;
+  assertEq<InvalidArgument>(w.dimension(), n, "The weights are not n x n");
+
+  Ctxt a0 = apply(a, {sigma.get()})[0];
+  std::vector<const SlotMap*> maps;
+  for (const auto& map : phi)
+    maps.push_back(map.get());
+  std::vector<Ctxt> shifted = apply(a0, maps);
+
+  // The operands are loaded one at a time by every thread
+  NTL::PartitionInfo pinfo(n, availableThreads());
+  long cnt = pinfo.NumIntervals();
+  std::vector<Ctxt> acc(cnt, Ctxt(ZeroCtxtLike, a));
+
+  // parallel for loop: k in [0..n)
+  HELIB_EXEC_INDEX(cnt, index)
+  long first, last;
+  pinfo.interval(first, last, index);
+  PtxtArray operand(ea);
+  for (long k : range(first, last)) {
+    w.operand(operand, k);
+    Ctxt term = k == 0 ? a0 : shifted[k - 1];
+    term.multByConstant(operand);
+    acc[index] += term;
+  }
+  HELIB_EXEC_INDEX_END
+
+  sumInto(a, acc);
+}
+
+void MatrixEngine::multiply(Ctxt& a, const Ctxt& b) const
+{
+  HELIB_TIMER_START;
+
+  // b may be a
+  Ctxt a0 = apply(a, {sigma.get()})[0];
+  Ctxt b0 = apply(b, {tau.get()})[0];
+  std::vector<const SlotMap*> phiMaps, psiMaps;
+  for (long k : range(n - 1)) {
+    phiMaps.push_back(phi[k].get());
+    psiMaps.push_back(psi[k].get());
+  }
+  std::vector<Ctxt> as = apply(a0, phiMaps);
+  std::vector<Ctxt> bs = apply(b0, psiMaps);
+
+  NTL::PartitionInfo pinfo(n, availableThreads());
+  long cnt = pinfo.NumIntervals();
+  std::vector<Ctxt> acc(cnt, Ctxt(ZeroCtxtLike, a));
+
+  // parallel for loop: k in [0..n)
+  HELIB_EXEC_INDEX(cnt, index)
+  long first, last;
+  pinfo.interval(first, last, index);
+  for (long k : range(first, last)) {
+    Ctxt term = k == 0 ? a0 : as[k - 1];
+    term.multiplyBy(k == 0 ? b0 : bs[k - 1]);
+    acc[index] += term;
+  }
+  HELIB_EXEC_INDEX_END
+
+  sumInto(a, acc);
+}
+
+//============== MatrixPipeline ==============
+
+MatrixPipeline::MatrixPipeline(const MatrixEngine& engine,
+                               const RefreshPolicy* policy) :
+    engine(engine), policy(policy)
+{}
+
+void MatrixPipeline::addLayer(std::shared_ptr<const WeightSource> weights,
+                              std::function<void(Ctxt&)> activation,
+                              long activationLevels)
+{
+  assertTrue<InvalidArgument>(weights != nullptr, "A layer needs weights");
+  assertEq<InvalidArgument>(weights->dimension(),
+                            engine.dimension(),
+                            "The weights are not n x n");
+  assertTrue<InvalidArgument>(activationLevels >= 0,
+                              "activationLevels must not be negative");
+  layers.push_back({std::move(weights), std::move(activation),
+                    MatrixEngine::levels + activationLevels});
+}
+
+long MatrixPipeline::run(const PtrVector<Ctxt>& batch) const
+{
+  HELIB_TIMER_START;
+  const RefreshPolicy* refresh =
+      policy ? policy : engine.getEA().getContext().getRefreshPolicy();
+  long count = batch.size();
+  long refreshes = 0;
+
+  for (const Layer& layer : layers) {
+    // The ciphertexts that the layer would leave with too little capacity
+    // are bootstrapped together
+    if (refresh != nullptr) {
+      std::vector<Ctxt*> low;
+      for (long i : range(count))
+        if (refresh->needsRefresh(*batch[i], layer.levels))
+          low.push_back(batch[i]);
+      if (!low.empty()) {
+        refresh->refresh(PtrVector_vectorPt<Ctxt>(low));
+        refreshes++;
+      }
+    }
+
+    HELIB_EXEC_INDEX(count, i)
+    engine.multiply(*batch[i], *layer.weights);
+    if (layer.activation)
+      layer.activation(*batch[i]);
+    HELIB_EXEC_INDEX_END
+  }
+  return refreshes;
+}
+
+long MatrixPipeline::run(std::vector<Ctxt>& batch) const
+{
+  return run(PtrVector_vectorT<Ctxt>(batch));
+}
+
+} // namespace helib
@@ -0,0 +1,150 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <helib/memoryStats.h>
+#include <helib/fhe_stats.h>
+#include <helib/multicore.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <vector>
+
+namespace helib {
+
+namespace {
+
+std::atomic<long> liveBytes{0};
+std::atomic<long> totalAllocated{0};
+// The high-water mark of liveBytes since the innermost scope started
+std::atomic<long> runningPeak{0};
+
+void raisePeak(long bytes)
+{
+  long peak = runningPeak.load(std::memory_order_relaxed);
+  while (bytes > peak && !runningPeak.compare_exchange_weak(peak, bytes))
+    ;
+}
+
+// The running scopes, innermost last. Never destroyed, since residues may
+// be freed after static destruction.
+struct ScopeStack
+{
+  HELIB_MUTEX_TYPE mx;
+  std::vector<MemoryScope*> scopes;
+};
+
+ScopeStack& scopeStack()
+{
+  static ScopeStack* s = new ScopeStack;
+  return *s;
+}
+
+} // namespace
+
+long residueBytes() { return liveBytes; }
+
+long residueBytesAllocated() { return totalAllocated; }
+
+void countResidueBytes(long bytes)
+{
+  long live = liveBytes += bytes;
+  if (bytes > 0) {
+    totalAllocated += bytes;
+    raisePeak(live);
+  }
+}
+
+MemoryScope::MemoryScope(const char* name) :
+    name(name), running(true), peak(0), allocated(0)
+{
+  ScopeStack& s = scopeStack();
+  HELIB_MUTEX_GUARD(s.mx);
+  startAllocated = totalAllocated;
+  enclosingPeak = runningPeak.exchange(liveBytes);
+  s.scopes.push_back(this);
+}
+
+MemoryScope::~MemoryScope() { stop(); }
+
+// The high-water mark of the running scope at index: the ones of the scopes
+// started after it before they started, and the running one. Called with the
+// stack locked.
+long MemoryScope::runningPeakOf(const std::vector<MemoryScope*>& scopes,
+                                std::size_t index)
+{
+  long peak = runningPeak;
+  for (std::size_t i = index + 1; i < scopes.size(); i++)
+    peak = std::max(peak, scopes[i]->enclosingPeak);
+  return peak;
+}
+
+void MemoryScope::stop()
+{
+  if (!running)
+    return;
+  {
+    ScopeStack& s = scopeStack();
+    HELIB_MUTEX_GUARD(s.mx);
+    auto it = std::find(s.scopes.begin(), s.scopes.end(), this);
+    std::size_t index = it - s.scopes.begin();
+    peak = runningPeakOf(s.scopes, index);
+    allocated = totalAllocated - startAllocated;
+    // The enclosing scope keeps what it saw before and during this one
+    if (index + 1 < s.scopes.size())
+      s.scopes[index + 1]->enclosingPeak =
+          std::max(s.scopes[index + 1]->enclosingPeak, enclosingPeak);
+    else
+      raisePeak(enclosingPeak);
+    s.scopes.erase(it);
+    running = false;
+  }
+  if (name)
+    updateMemoryStats(name, *this);
+}
+
+long MemoryScope::peakBytes() const
+{
+  if (!running)
+    return peak;
+  ScopeStack& s = scopeStack();
+  HELIB_MUTEX_GUARD(s.mx);
+  std::size_t index =
+      std::find(s.scopes.begin(), s.scopes.end(), this) - s.scopes.begin();
+  return runningPeakOf(s.scopes, index);
+}
+
+long MemoryScope::allocatedBytes() const
+{
+  return running ? totalAllocated - startAllocated : allocated;
+}
+
+void updateMemoryStats(const std::string& prefix, const MemoryScope& scope)
+{
+  if (!fhe_stats)
+    return;
+
+  // fhe_stats_record keeps the name and registers itself, so both live
+  // forever
+  static HELIB_MUTEX_TYPE mx;
+  static std::map<std::string, fhe_stats_record*> records;
+  HELIB_MUTEX_GUARD(mx);
+  auto update = [](const std::string& name, double value) {
+    fhe_stats_record*& record = records[name];
+    if (!record)
+      record = new fhe_stats_record((new std::string(name))->c_str());
+    record->update(value);
+  };
+  update(prefix + "-residuePeakBytes", scope.peakBytes());
+  update(prefix + "-residueAllocatedBytes", scope.allocatedBytes());
+}
+
+} // namespace helib
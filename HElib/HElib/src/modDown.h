@@ -0,0 +1,68 @@
+/* Copyright (C) 2021 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+// The constants of modulus switching in RNS form, from the primes of
+// dropped | kept down to the primes of kept, see DoubleCRT::scaleDownToSet.
+//
+// With D the product of the dropped primes d_k and D_k = D / d_k, the
+// residues x_k of a coefficient give y_k = x_k * D_k^{-1} mod d_k and
+//    delta = sum_k y_k * D_k - v * D,   v = round(sum_k y_k / d_k),
+// the balanced remainder of the coefficient mod D. For a plaintext space
+// p > 1 the remainder is then moved by c * D, with c the balanced value of
+// delta * D^{-1} mod p, to make it divisible by p. The residue of the
+// result for a kept prime q_j is (x - delta) * D^{-1} mod q_j, where delta
+// mod q_j only needs the y_k, the integer w = v + c and the tables below.
+
+#ifndef HELIB_MOD_DOWN_H
+#define HELIB_MOD_DOWN_H
+
+#include <vector>
+
+#include <NTL/ZZ.h>
+
+#include <helib/IndexSet.h>
+
+namespace helib {
+
+class Context;
+
+struct ModDownTable
+{
+  // The dropped primes d_k, 1/d_k and D_k^{-1} mod d_k
+  std::vector<long> dropped;
+  std::vector<long> droppedPrimes;
+  std::vector<double> droppedRecip;
+  std::vector<long> hatInv;
+  std::vector<NTL::mulmod_precon_t> hatInvPrecon;
+
+  // The kept primes q_j, D_k mod q_j (hat[j][k]), D mod q_j and D^{-1} mod q_j
+  std::vector<long> kept;
+  std::vector<std::vector<long>> hat;
+  std::vector<long> dMod;
+  std::vector<long> dInv;
+  std::vector<NTL::mulmod_precon_t> dInvPrecon;
+
+  // The same for the plaintext space p, if p > 1
+  long ptxtSpace;
+  std::vector<long> hatModP;
+  long dModP = 0;
+  long dInvModP = 0;
+
+  ModDownTable(const Context& context,
+               const IndexSet& droppedSet,
+               const IndexSet& keptSet,
+               long p);
+};
+
+} // namespace helib
+
+#endif // HELIB_MOD_DOWN_H
@@ -0,0 +1,591 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <helib/multicore.h>
+
+#include <NTL/BasicThreadPool.h>
+
+#ifdef HELIB_THREADS
+#include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <thread>
+#endif
+
+#if defined(HELIB_THREADS) && defined(__linux__)
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <pthread.h>
+#include <sched.h>
+#define HELIB_PIN_WORKERS
+#endif
+
+namespace helib {
+
+namespace {
+
+thread_local ExecutionPolicy currentPolicy;
+
+} // namespace
+
+ExecutionPolicy ExecutionPolicy::current() { return currentPolicy; }
+
+ExecutionPolicy::Scope::Scope(const ExecutionPolicy* policy) :
+    previous(currentPolicy), installed(policy != nullptr)
+{
+  if (installed)
+    currentPolicy = *policy;
+}
+
+ExecutionPolicy::Scope::~Scope()
+{
+  if (installed)
+    currentPolicy = previous;
+}
+
+#ifdef HELIB_THREADS
+
+namespace {
+
+// A parallel loop, split into chunks that are claimed one at a time
+struct Job
+{
+  const std::function<void(long, long)>& body;
+  const long n;
+  const long chunks;
+  const bool urgent;
+  std::atomic<long> next{0};     // the first chunk not claimed yet
+  std::atomic<long> pending;     // the chunks not finished yet
+  std::atomic<long> visitors{0}; // the thieves that may still use the job
+  std::mutex mx;
+  std::condition_variable changed;
+  std::exception_ptr error;
+
+  Job(const std::function<void(long, long)>& body,
+      long n,
+      long chunks,
+      bool urgent = false) :
+      body(body), n(n), chunks(chunks), urgent(urgent), pending(chunks)
+  {}
+
+  bool claimable() const { return next.load() < chunks; }
+  bool done() const { return pending.load() == 0 && visitors.load() == 0; }
+
+  // Run chunks until none is left to claim
+  void run()
+  {
+    for (long c = next++; c < chunks; c = next++) {
+      try {
+        body(c * n / chunks, (c + 1) * n / chunks);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mx);
+        if (!error)
+          error = std::current_exception();
+      }
+      pending--;
+    }
+  }
+
+  // Run chunks as a thief, which registered itself in visitors when it
+  // found the job. The job may be destroyed as soon as the lock is released.
+  void visit()
+  {
+    run();
+    std::lock_guard<std::mutex> lock(mx);
+    visitors--;
+    changed.notify_all();
+  }
+};
+
+// The loops started by one thread that idle workers can steal from. A job
+// stays in its deque while it has chunks to claim.
+struct JobDeque
+{
+  std::mutex mx;
+  std::deque<Job*> jobs;
+
+  void push(Job* job)
+  {
+    std::lock_guard<std::mutex> lock(mx);
+    jobs.push_back(job);
+  }
+
+  void remove(Job* job)
+  {
+    std::lock_guard<std::mutex> lock(mx);
+    auto it = std::find(jobs.begin(), jobs.end(), job);
+    if (it != jobs.end())
+      jobs.erase(it);
+  }
+
+  // The oldest job with chunks to claim, only among the urgent ones if
+  // urgentOnly, registered as visited
+  Job* steal(bool urgentOnly = false)
+  {
+    std::lock_guard<std::mutex> lock(mx);
+    while (!jobs.empty() && !jobs.front()->claimable())
+      jobs.pop_front();
+    for (Job* job : jobs)
+      if (job->claimable() && (job->urgent || !urgentOnly)) {
+        job->visitors++;
+        return job;
+      }
+    return nullptr;
+  }
+};
+
+// Wait until job is done. Once it is out of its deque no thief can find it,
+// and those that did are counted in visitors.
+void join(Job& job, JobDeque& deque)
+{
+  std::unique_lock<std::mutex> lock(job.mx);
+  job.changed.wait(lock, [&]() { return !job.claimable(); });
+  lock.unlock();
+  deque.remove(&job);
+  lock.lock();
+  job.changed.wait(lock, [&]() { return job.done(); });
+}
+
+struct Worker
+{
+  JobDeque deque;
+  long index;
+  std::thread::native_handle_type handle;
+};
+
+thread_local Worker* currentWorker = nullptr;
+
+#ifdef HELIB_PIN_WORKERS
+// The NUMA node of every CPU, -1 for the CPUs of no node that the kernel
+// lists
+const std::vector<long>& nodeOfCpu()
+{
+  static const std::vector<long> nodes = []() {
+    std::vector<long> result(CPU_SETSIZE, -1);
+    for (long node = 0;; node++) {
+      std::ifstream file("/sys/devices/system/node/node" +
+                         std::to_string(node) + "/cpulist");
+      if (!file)
+        break;
+      // A list of ranges such as 0-3,8-11
+      std::string range;
+      while (std::getline(file, range, ',')) {
+        std::istringstream in(range);
+        long lo, hi;
+        char dash;
+        if (!(in >> lo))
+          continue;
+        if (!(in >> dash >> hi))
+          hi = lo;
+        for (long cpu = std::max(lo, 0L); cpu <= hi && cpu < CPU_SETSIZE;
+             cpu++)
+          result[cpu] = node;
+      }
+    }
+    return result;
+  }();
+  return nodes;
+}
+
+// The CPUs of the process, node by node for the NUMA nodes that the kernel
+// lists, then the others
+std::vector<int> cpusByNode(const cpu_set_t& mask)
+{
+  const std::vector<long>& nodes = nodeOfCpu();
+  std::vector<int> result;
+  for (long node = 0; node < nodeCount(); node++)
+    for (long cpu = 0; cpu < CPU_SETSIZE; cpu++)
+      if (nodes[cpu] == node && CPU_ISSET(cpu, &mask))
+        result.push_back(cpu);
+  for (long cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    if (nodes[cpu] < 0 && CPU_ISSET(cpu, &mask))
+      result.push_back(cpu);
+  return result;
+}
+#endif
+
+std::atomic<bool> replicating{false};
+
+// Never destroyed, since the parallel loops of static destructors may still
+// need the workers
+class Scheduler
+{
+public:
+  static Scheduler& instance()
+  {
+    static Scheduler* s = new Scheduler;
+    return *s;
+  }
+
+  long size() const { return started.load(); }
+
+  // Start workers until there are at least count of them
+  void reserve(long count)
+  {
+    count = std::min(count, maxWorkers);
+    if (started.load() >= count)
+      return;
+    std::lock_guard<std::mutex> lock(growMx);
+    for (long i = started.load(); i < count; i++) {
+      workers[i] = std::make_unique<Worker>();
+      workers[i]->index = i;
+      std::thread thread([this, i]() { work(workers[i].get()); });
+      workers[i]->handle = thread.native_handle();
+      thread.detach();
+      pin(*workers[i]);
+      started.store(i + 1);
+    }
+  }
+
+  bool setPinned(bool pin)
+  {
+#ifdef HELIB_PIN_WORKERS
+    std::lock_guard<std::mutex> lock(growMx);
+    if (cpus.empty()) {
+      if (sched_getaffinity(0, sizeof(processMask), &processMask) != 0)
+        return false;
+      cpus = cpusByNode(processMask);
+    }
+    pinned = pin;
+    for (long i = 0; i < started.load(); i++)
+      this->pin(*workers[i]);
+    return true;
+#else
+    (void)pin;
+    return false;
+#endif
+  }
+
+  // The deque of the jobs started by the calling thread
+  JobDeque& dequeOf(Worker* self) { return self ? self->deque : external; }
+
+  // Make the jobs pushed so far visible to the sleeping workers
+  void notify()
+  {
+    {
+      std::lock_guard<std::mutex> lock(sleepMx);
+      epoch++;
+    }
+    wake.notify_all();
+  }
+
+  // Count the urgent jobs in the deques, so that find() only looks for
+  // them while there are some
+  void beginUrgent() { urgentJobs++; }
+  void endUrgent() { urgentJobs--; }
+
+  // A job to help with: the urgent ones first, then preferring the loops
+  // started by workers, which are nested in other loops whose owners wait
+  // for them
+  Job* find(const Worker* self)
+  {
+    if (urgentJobs.load() > 0)
+      if (Job* job = find(self, /*urgentOnly=*/true))
+        return job;
+    return find(self, /*urgentOnly=*/false);
+  }
+
+private:
+  static constexpr long maxWorkers = 256;
+
+  std::array<std::unique_ptr<Worker>, maxWorkers> workers;
+  std::atomic<long> started{0};
+  std::atomic<long> urgentJobs{0};
+  std::mutex growMx;
+  JobDeque external; // the loops started by other threads
+
+  std::mutex sleepMx;
+  std::condition_variable wake;
+  long epoch = 0;
+
+  // Whether the workers are pinned, to which CPUs, and the CPUs of the
+  // process to undo it, all guarded by growMx
+  bool pinned = false;
+#ifdef HELIB_PIN_WORKERS
+  std::vector<int> cpus;
+  cpu_set_t processMask;
+#endif
+
+  // Called with growMx locked
+  void pin(Worker& worker)
+  {
+#ifdef HELIB_PIN_WORKERS
+    if (cpus.empty())
+      return;
+    cpu_set_t mask = processMask;
+    if (pinned) {
+      CPU_ZERO(&mask);
+      CPU_SET(cpus[worker.index % cpus.size()], &mask);
+    }
+    pthread_setaffinity_np(worker.handle, sizeof(mask), &mask);
+#else
+    (void)worker;
+#endif
+  }
+
+  Job* find(const Worker* self, bool urgentOnly)
+  {
+    long count = started.load();
+    long start = self ? self->index + 1 : 0;
+    for (long k = 0; k < count; k++) {
+      Worker* victim = workers[(start + k) % count].get();
+      if (victim == self)
+        continue;
+      if (Job* job = victim->deque.steal(urgentOnly))
+        return job;
+    }
+    return external.steal(urgentOnly);
+  }
+
+  void work(Worker* self)
+  {
+    currentWorker = self;
+    for (;;) {
+      long seen;
+      {
+        std::lock_guard<std::mutex> lock(sleepMx);
+        seen = epoch;
+      }
+      if (Job* job = find(self)) {
+        job->visit();
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(sleepMx);
+      wake.wait(lock, [&]() { return epoch != seen; });
+    }
+  }
+};
+
+} // namespace
+
+void parallelFor(long n,
+                 long grain,
+                 const std::function<void(long, long)>& body)
+{
+  if (n <= 0)
+    return;
+  Worker* self = currentWorker;
+  Scheduler& scheduler = Scheduler::instance();
+  long width = availableThreads();
+  // Every chunk has at least grain indices
+  long chunks = std::min(n / std::max(grain, 1L), width);
+  if (chunks <= 1) {
+    body(0, n);
+    return;
+  }
+  // The policy may ask a worker for more threads than there are
+  if (!self || width > scheduler.size())
+    scheduler.reserve(width);
+
+  Job job(body, n, chunks, currentPolicy.urgent);
+  JobDeque& deque = scheduler.dequeOf(self);
+  if (job.urgent)
+    scheduler.beginUrgent();
+  deque.push(&job);
+  scheduler.notify();
+
+  // A worker runs its own loop too. Other threads only wait, so that the
+  // loops nested in the chunks never run on the NTL pool of the caller.
+  // A waiting worker does not help with other loops: a chunk that blocks
+  // (e.g. on the progress of other chunks of its loop) could otherwise end
+  // up waiting for a chunk below it on the same stack.
+  if (self)
+    job.run();
+  join(job, deque);
+  if (job.urgent)
+    scheduler.endUrgent();
+
+  if (job.error)
+    std::rethrow_exception(job.error);
+}
+
+void parallelFor(long n, const std::function<void(long, long)>& body)
+{
+  parallelFor(n, 1, body);
+}
+
+// A task is a job of one chunk, which owns its function
+struct TaskGroup::Task
+{
+  std::function<void()> task;
+  std::function<void(long, long)> body;
+  Job job;
+  bool queued = false; // pushed in a deque rather than run by run()
+
+  Task(std::function<void()> f, bool urgent) :
+      task(std::move(f)),
+      body([this](long, long) { task(); }),
+      job(body, 1, 1, urgent)
+  {}
+};
+
+TaskGroup::TaskGroup() = default;
+
+TaskGroup::~TaskGroup()
+{
+  try {
+    wait();
+  } catch (...) {
+  }
+}
+
+void TaskGroup::run(std::function<void()> task)
+{
+  tasks.push_back(
+      std::make_unique<Task>(std::move(task), currentPolicy.urgent));
+  Job& job = tasks.back()->job;
+  Worker* self = currentWorker;
+  Scheduler& scheduler = Scheduler::instance();
+  long width = availableThreads();
+  if (!self && width <= 1) {
+    job.run();
+    return;
+  }
+  if (!self || width > scheduler.size())
+    scheduler.reserve(width);
+  tasks.back()->queued = true;
+  if (job.urgent)
+    scheduler.beginUrgent();
+  scheduler.dequeOf(self).push(&job);
+  scheduler.notify();
+}
+
+void TaskGroup::wait()
+{
+  Worker* self = currentWorker;
+  Scheduler& scheduler = Scheduler::instance();
+  JobDeque& deque = scheduler.dequeOf(self);
+  std::exception_ptr error;
+  // The newest first, as they are the least likely to be taken
+  for (auto it = tasks.rbegin(); it != tasks.rend(); ++it) {
+    Job& job = (*it)->job;
+    if (self)
+      job.run();
+    join(job, deque);
+    if ((*it)->queued && job.urgent)
+      scheduler.endUrgent();
+    if (job.error)
+      error = job.error;
+  }
+  tasks.clear();
+  if (error)
+    std::rethrow_exception(error);
+}
+
+bool pinWorkers(bool pin) { return Scheduler::instance().setPinned(pin); }
+
+long availableThreads()
+{
+  if (currentPolicy.threads > 0)
+    return currentPolicy.threads;
+  return currentWorker ? Scheduler::instance().size()
+                       : NTL::AvailableThreads();
+}
+
+long currentNode()
+{
+#ifdef HELIB_PIN_WORKERS
+  int cpu = sched_getcpu();
+  if (cpu >= 0 && cpu < CPU_SETSIZE)
+    return std::max(nodeOfCpu()[cpu], 0L);
+#endif
+  return 0;
+}
+
+long nodeCount()
+{
+#ifdef HELIB_PIN_WORKERS
+  static const long count = []() {
+    const std::vector<long>& nodes = nodeOfCpu();
+    return std::max(*std::max_element(nodes.begin(), nodes.end()) + 1, 1L);
+  }();
+  return count;
+#else
+  return 1;
+#endif
+}
+
+void replicatePerNode(bool replicate) { replicating.store(replicate); }
+
+bool replicatingPerNode() { return replicating.load(); }
+
+#else
+
+void parallelFor(long n, const std::function<void(long, long)>& body)
+{
+  if (n > 0)
+    body(0, n);
+}
+
+void parallelFor(long n,
+                 long grain,
+                 const std::function<void(long, long)>& body)
+{
+  (void)grain;
+  parallelFor(n, body);
+}
+
+long availableThreads() { return 1; }
+
+// Tasks run right away, a task only records the first exception
+struct TaskGroup::Task
+{
+  std::exception_ptr error;
+};
+
+TaskGroup::TaskGroup() = default;
+
+TaskGroup::~TaskGroup() = default;
+
+void TaskGroup::run(std::function<void()> task)
+{
+  try {
+    task();
+  } catch (...) {
+    if (tasks.empty())
+      tasks.push_back(std::make_unique<Task>(Task{std::current_exception()}));
+  }
+}
+
+void TaskGroup::wait()
+{
+  if (tasks.empty())
+    return;
+  std::exception_ptr error = tasks.front()->error;
+  tasks.clear();
+  std::rethrow_exception(error);
+}
+
+bool pinWorkers(bool) { return false; }
+
+long currentNode() { return 0; }
+
+long nodeCount() { return 1; }
+
+void replicatePerNode(bool) {}
+
+bool replicatingPerNode() { return false; }
+
+#endif // ifdef HELIB_THREADS
+
+void parallelForEach(long n, const std::function<void(long)>& body)
+{
+  parallelFor(n, [&body](long first, long last) {
+    for (long index = first; index < last; index++)
+      body(index);
+  });
+}
+
+} // namespace helib
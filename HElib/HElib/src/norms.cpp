@@ -21,6 +21,7 @@
 #include <helib/norms.h>
 #include <helib/PAlgebra.h>
 #include <helib/fhe_stats.h>
+#include <helib/opCounters.h>
 #include <helib/range.h>
 
 namespace helib {
@@ -126,6 +127,17 @@ static inline cx_double MUL(cx_double a, cx_double b)
   return cx_double(x * u - y * v, x * v + y * u);
 }
 
+// The FFT buffer of the calling thread: the norms are computed on every
+// modulus switch, and this way they do not allocate once the buffer has grown
+// to the size of the transform
+static cx_double* embeddingBuffer(long n)
+{
+  NTL_THREAD_LOCAL static std::vector<cx_double> buf;
+  if (lsize(buf) < n)
+    buf.resize(n);
+  return buf.data();
+}
+
 static double basic_embeddingLargestCoeff(const std::vector<double>& f,
                                           const PAlgebra& palg)
 {
@@ -136,7 +148,7 @@ static double basic_embeddingLargestCoeff(const std::vector<double>& f,
   if (sz > m)
     throw LogicError("vector too big f canonicalEmbedding");
 
-  std::vector<cx_double> buf(m);
+  cx_double* buf = embeddingBuffer(m);
   for (long i : range(0, sz))
     buf[i] = f[i];
   for (long i : range(sz, m))
@@ -177,7 +189,7 @@ static double half_embeddingLargestCoeff(const std::vector<double>& f,
   const half_FFT& hfft = palg.getHalfFFTInfo();
   const cx_double* pow = &hfft.pow[0];
 
-  std::vector<cx_double> buf(m / 2);
+  cx_double* buf = embeddingBuffer(m / 2);
   for (long i : range(0, sz))
     buf[i] = f[i] * pow[i];
   for (long i : range(sz, m / 2))
@@ -215,7 +227,7 @@ static double quarter_embeddingLargestCoeff(const std::vector<double>& f,
   const cx_double* pow1 = &qfft.pow1[0];
   const cx_double* pow2 = &qfft.pow2[0];
 
-  std::vector<cx_double> buf(m / 4);
+  cx_double* buf = embeddingBuffer(m / 4);
   for (long i : range(0, sz / 2))
     buf[i] = MUL(cx_double(f[2 * i], f[2 * i + 1]), pow2[i]);
   for (long i : range(sz / 2, m / 4))
@@ -280,7 +292,7 @@ static void basic_embeddingLargestCoeff_x2(double& norm1,
   long sz_max = std::max(sz1, sz2);
   long sz_min = std::min(sz1, sz2);
 
-  std::vector<cx_double> buf(m);
+  cx_double* buf = embeddingBuffer(m);
   for (long i : range(0, sz_min))
     buf[i] = cx_double(f1[i], f2[i]);
   for (long i : range(sz_min, sz1))
@@ -358,7 +370,7 @@ static void half_embeddingLargestCoeff_x2(double& norm1,
 
   // Odd-Power Trick.  See above.
 
-  std::vector<cx_double> buf(m / 2);
+  cx_double* buf = embeddingBuffer(m / 2);
   for (long i : range(0, sz_min))
     buf[i] = MUL(cx_double(f1[i], f2[i]), pow[i]);
   for (long i : range(sz_min, sz1))
@@ -433,6 +445,28 @@ void embeddingLargestCoeff_x2(double& norm1,
     basic_embeddingLargestCoeff_x2(norm1, norm2, f1, f2, palg);
 }
 
+void embeddingLargestCoeffs(std::vector<double>& norms,
+                            const std::vector<const std::vector<double>*>& fs,
+                            const PAlgebra& palg)
+{
+  HELIB_NTIMER_START(AAA_embeddingLargestBatch);
+
+  long n = lsize(fs);
+  norms.resize(n);
+
+  // Two inputs for the price of one, the pairs in parallel
+  HELIB_EXEC_INDEX((n + 1) / 2, i)
+  if (2 * i + 1 < n)
+    embeddingLargestCoeff_x2(norms[2 * i],
+                             norms[2 * i + 1],
+                             *fs[2 * i],
+                             *fs[2 * i + 1],
+                             palg);
+  else
+    norms[2 * i] = embeddingLargestCoeff(*fs[2 * i], palg);
+  HELIB_EXEC_INDEX_END
+}
+
 double embeddingLargestCoeff(const zzX& f, const PAlgebra& palg)
 {
   std::vector<double> ff;
@@ -484,6 +518,26 @@ NTL::xdouble embeddingLargestCoeff(const NTL::ZZX& f, const PAlgebra& palg)
   return embeddingLargestCoeff(ff, palg) * factor;
 }
 
+void embeddingLargestCoeffs(std::vector<NTL::xdouble>& norms,
+                            const std::vector<const NTL::ZZX*>& fs,
+                            const PAlgebra& palg)
+{
+  long n = lsize(fs);
+  std::vector<std::vector<double>> ffs(n);
+  std::vector<NTL::xdouble> factors(n);
+  std::vector<const std::vector<double>*> ffPtrs(n);
+  for (long i : range(n)) {
+    factors[i] = scale(ffs[i], *fs[i]);
+    ffPtrs[i] = &ffs[i];
+  }
+
+  std::vector<double> scaled;
+  embeddingLargestCoeffs(scaled, ffPtrs, palg);
+  norms.resize(n);
+  for (long i : range(n))
+    norms[i] = scaled[i] * factors[i];
+}
+
 // === Computing the canonical embedding and inverse ===
 
 // Odd-Power Trick. See above.
@@ -507,7 +561,9 @@ void CKKS_canonicalEmbedding(std::vector<cx_double>& v,
   const half_FFT& hfft = palg.getHalfFFTInfo();
   const cx_double* pow = &hfft.pow[0];
 
-  std::vector<cx_double> buf(m / 2);
+  // Reused across calls, so batches of encodings do not reallocate
+  static thread_local std::vector<cx_double> buf;
+  buf.resize(m / 2);
   for (long i : range(0, sz))
     buf[i] = in[i] * pow[i];
   for (long i : range(sz, m / 2))
@@ -525,7 +581,7 @@ void CKKS_canonicalEmbedding(std::vector<cx_double>& v,
 {
   HELIB_TIMER_START;
 
-  std::vector<double> x;
+  static thread_local std::vector<double> x;
   convert(x, f);
 
   CKKS_canonicalEmbedding(v, x, palg);
@@ -585,7 +641,8 @@ void CKKS_embedInSlots(zzX& f,
   if (!(palg.getP() == -1 && palg.getPow2() >= 2))
     throw LogicError("bad args to CKKS_canonicalEmbedding");
 
-  std::vector<cx_double> buf(m / 2, cx_double(0));
+  static thread_local std::vector<cx_double> buf;
+  buf.assign(m / 2, cx_double(0));
   for (long i : range(m / 4)) {
     long j = palg.ith_rep(i);
     long ii = m / 4 - i - 1;
@@ -0,0 +1,195 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <helib/opCounters.h>
+#include <helib/fhe_stats.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+namespace helib {
+
+namespace {
+
+// The counts, then the sums of the prime set sizes
+using CounterBlock = std::array<HELIB_atomic_long, 2 * OP_TYPES>;
+
+// The blocks of the running threads, and what the finished ones counted.
+// Never destroyed, since threads may finish after static destruction.
+struct Registry
+{
+  HELIB_MUTEX_TYPE mx;
+  std::vector<const CounterBlock*> running;
+  OpCounts finished;
+};
+
+Registry& registry()
+{
+  static Registry* r = new Registry;
+  return *r;
+}
+
+OpCounts load(const CounterBlock& block)
+{
+  OpCounts result;
+  for (std::size_t i = 0; i < OP_TYPES; i++) {
+    result.counts[i] = block[i];
+    result.primes[i] = block[OP_TYPES + i];
+  }
+  return result;
+}
+
+// Only the owning thread writes to its block
+struct ThreadCounters
+{
+  CounterBlock block;
+
+  ThreadCounters()
+  {
+    for (auto& counter : block)
+      counter = 0;
+    Registry& r = registry();
+    HELIB_MUTEX_GUARD(r.mx);
+    r.running.push_back(&block);
+  }
+
+  ~ThreadCounters()
+  {
+    Registry& r = registry();
+    HELIB_MUTEX_GUARD(r.mx);
+    r.finished += load(block);
+    r.running.erase(std::find(r.running.begin(), r.running.end(), &block));
+  }
+};
+
+thread_local ThreadCounters threadCounters;
+thread_local OpCountScope* currentScope = nullptr;
+
+const char* const OP_NAMES[OP_TYPES] = {"relinearizations",
+                                        "keySwitches",
+                                        "automorphisms",
+                                        "tensorProducts",
+                                        "ntts",
+                                        "modSwitches",
+                                        "relinKeySwitches",
+                                        "frobeniusKeySwitches",
+                                        "automorphKeySwitches",
+                                        "digits",
+                                        "scalarMults"};
+
+} // namespace
+
+const char* opName(OpType op) { return OP_NAMES[std::size_t(op)]; }
+
+OpCounts& OpCounts::operator+=(const OpCounts& other)
+{
+  for (std::size_t i = 0; i < OP_TYPES; i++) {
+    counts[i] += other.counts[i];
+    primes[i] += other.primes[i];
+  }
+  return *this;
+}
+
+OpCounts& OpCounts::operator-=(const OpCounts& other)
+{
+  for (std::size_t i = 0; i < OP_TYPES; i++) {
+    counts[i] -= other.counts[i];
+    primes[i] -= other.primes[i];
+  }
+  return *this;
+}
+
+std::ostream& operator<<(std::ostream& str, const OpCounts& counts)
+{
+  for (std::size_t i = 0; i < OP_TYPES; i++) {
+    str << (i ? " " : "") << OP_NAMES[i] << "=" << counts.counts[i];
+    if (counts.primes[i] != 0)
+      str << "(" << counts.averagePrimes(OpType(i)) << " primes)";
+  }
+  return str;
+}
+
+#ifndef HELIB_NO_OP_COUNTERS
+void countOp(OpType op, long n, long primes)
+{
+  std::size_t i = std::size_t(op);
+  threadCounters.block[i] += n;
+  if (primes != 0)
+    threadCounters.block[OP_TYPES + i] += n * primes;
+  for (OpCountScope* scope = currentScope; scope; scope = scope->parent) {
+    scope->totals[i] += n;
+    if (primes != 0)
+      scope->totals[OP_TYPES + i] += n * primes;
+  }
+}
+#endif
+
+OpCounts threadOpCounts() { return load(threadCounters.block); }
+
+OpCounts totalOpCounts()
+{
+  Registry& r = registry();
+  HELIB_MUTEX_GUARD(r.mx);
+  OpCounts result = r.finished;
+  for (const CounterBlock* block : r.running)
+    result += load(*block);
+  return result;
+}
+
+OpCountScope::OpCountScope() : parent(currentScope)
+{
+  for (auto& total : totals)
+    total = 0;
+  currentScope = this;
+}
+
+OpCountScope::~OpCountScope() { currentScope = parent; }
+
+OpCounts OpCountScope::counts() const
+{
+  OpCounts result;
+  for (std::size_t i = 0; i < OP_TYPES; i++) {
+    result.counts[i] = totals[i];
+    result.primes[i] = totals[OP_TYPES + i];
+  }
+  return result;
+}
+
+OpCountScope* OpCountScope::current() { return currentScope; }
+
+OpCountScope::Adopt::Adopt(OpCountScope* scope) : previous(currentScope)
+{
+  currentScope = scope;
+}
+
+OpCountScope::Adopt::~Adopt() { currentScope = previous; }
+
+void updateOpCountStats(const std::string& prefix, const OpCounts& counts)
+{
+  if (!fhe_stats)
+    return;
+
+  // fhe_stats_record keeps the name and registers itself, so both live
+  // forever
+  static HELIB_MUTEX_TYPE mx;
+  static std::map<std::string, fhe_stats_record*> records;
+  HELIB_MUTEX_GUARD(mx);
+  for (std::size_t i = 0; i < OP_TYPES; i++) {
+    std::string name = prefix + "-" + OP_NAMES[i];
+    fhe_stats_record*& record = records[name];
+    if (!record)
+      record = new fhe_stats_record((new std::string(name))->c_str());
+    record->update(counts.counts[i]);
+  }
+}
+
+} // namespace helib
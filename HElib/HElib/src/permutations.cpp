@@ -10,6 +10,10 @@
  * limitations under the License. See accompanying LICENSE file.
  */
 
+#include <map>
+#include <mutex>
+#include <tuple>
+
 #include <helib/permutations.h>
 #include <helib/EncryptedArray.h>
 
@@ -532,16 +536,36 @@ PermIndepPrecomp::PermIndepPrecomp(const Context& context, long depthBound) :
     PermIndepPrecomp(context.getView(), depthBound)
 {}
 
+// The search of buildOptimalTrees (and optimalBenes under it) only depends
+// on the dimensions and the depth bound, so its results are kept for all
+// the precomputations of the process
 PermIndepPrecomp::PermIndepPrecomp(const EncryptedArray& _ea, long depthBound) :
     ea(_ea)
 {
+  static std::mutex mutex;
+  static std::map<std::vector<long>, std::pair<GeneratorTrees, long>> cache;
+
+  std::vector<long> key = {depthBound};
   NTL::Vec<GenDescriptor> vec(NTL::INIT_SIZE, ea.dimension());
-  for (long i : range(ea.dimension()))
+  for (long i : range(ea.dimension())) {
     vec[i] = GenDescriptor(/*order=*/ea.sizeOfDimension(i),
                            /*good=*/ea.nativeDimension(i),
                            /*genIdx=*/i);
+    key.push_back(ea.sizeOfDimension(i));
+    key.push_back(ea.nativeDimension(i));
+  }
 
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = cache.find(key);
+    if (it != cache.end()) {
+      std::tie(trees, cost) = it->second;
+      return;
+    }
+  }
   cost = trees.buildOptimalTrees(vec, depthBound);
+  std::lock_guard<std::mutex> lock(mutex);
+  cache.emplace(key, std::make_pair(trees, cost));
 }
 
 PermPrecomp::PermPrecomp(const PermIndepPrecomp& pip, const Permut& _pi) :
@@ -0,0 +1,773 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <helib/polyBundle.h>
+#include <helib/digitProgram.h>
+#include <helib/assertions.h>
+#include <helib/exceptions.h>
+#include <helib/multicore.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <tuple>
+
+#ifdef _WIN32
+#include <iterator>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include <sys/stat.h>
+
+namespace helib {
+
+static const char BUNDLE_MAGIC[8] = {'H', 'E', 'P', 'O', 'L', 'Y', 'B', '1'};
+static constexpr std::size_t WORD = 8;
+static constexpr std::size_t RECORD = 5 * WORD; // p, e_inner, e, offset, n
+
+static long readWord(const unsigned char* ptr)
+{
+  unsigned long num = 0;
+  for (std::size_t i = 0; i < WORD; i++)
+    num |= static_cast<unsigned long>(ptr[i]) << (8 * i);
+  return static_cast<long>(num);
+}
+
+static void writeWord(std::ostream& str, long num)
+{
+  unsigned long unum = static_cast<unsigned long>(num);
+  for (std::size_t i = 0; i < WORD; i++) {
+    char byte = static_cast<char>(unum >> (8 * i));
+    str.write(&byte, 1);
+  }
+}
+
+static bool keyLess(long p1, long ei1, long e1, long p2, long ei2, long e2)
+{
+  return std::tie(p1, ei1, e1) < std::tie(p2, ei2, e2);
+}
+
+PolynomialBundle::PolynomialBundle(const std::string& path) : path(path)
+{
+#ifdef _WIN32
+  std::ifstream in(path, std::ios::binary);
+  if (!in)
+    throw IOError("Could not open polynomial bundle " + path);
+  buffer.assign(std::istreambuf_iterator<char>(in),
+                std::istreambuf_iterator<char>());
+  data = buffer.data();
+  length = buffer.size();
+#else
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw IOError("Could not open polynomial bundle " + path);
+  struct stat st;
+  if (::fstat(fd, &st) != 0 || st.st_size == 0) {
+    ::close(fd);
+    throw IOError("Could not stat polynomial bundle " + path);
+  }
+  length = st.st_size;
+  void* addr = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd); // the mapping keeps its own reference to the file
+  if (addr == MAP_FAILED) {
+    length = 0;
+    throw IOError("Could not map polynomial bundle " + path);
+  }
+  data = static_cast<const unsigned char*>(addr);
+#endif
+
+  // Only the header and the index are read here, the coefficients are
+  // decoded on demand
+  if (length < sizeof(BUNDLE_MAGIC) + WORD ||
+      std::memcmp(data, BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC)) != 0) {
+    release();
+    throw IOError(path + " is not a polynomial bundle");
+  }
+  long nEntries = readWord(data + sizeof(BUNDLE_MAGIC));
+  std::size_t indexBegin = sizeof(BUNDLE_MAGIC) + WORD;
+  if (nEntries < 0 || (length - indexBegin) / RECORD < std::size_t(nEntries)) {
+    release();
+    throw IOError("Truncated index in polynomial bundle " + path);
+  }
+
+  index.resize(nEntries);
+  for (long i = 0; i < nEntries; i++) {
+    const unsigned char* rec = data + indexBegin + i * RECORD;
+    index[i].p = readWord(rec);
+    index[i].e_inner = readWord(rec + WORD);
+    index[i].e = readWord(rec + 2 * WORD);
+    index[i].offset = readWord(rec + 3 * WORD);
+    index[i].nCoeffs = readWord(rec + 4 * WORD);
+    if (index[i].offset > length || index[i].nCoeffs < 0) {
+      release();
+      throw IOError("Corrupted index in polynomial bundle " + path);
+    }
+  }
+}
+
+PolynomialBundle::~PolynomialBundle() { release(); }
+
+bool PolynomialBundle::isBundle(const std::string& path)
+{
+  char magic[sizeof(BUNDLE_MAGIC)];
+  std::ifstream in(path, std::ios::binary);
+  return in.read(magic, sizeof(magic)) &&
+         std::memcmp(magic, BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC)) == 0;
+}
+
+void PolynomialBundle::release()
+{
+#ifndef _WIN32
+  if (data != nullptr && length > 0)
+    ::munmap(const_cast<unsigned char*>(data), length);
+#endif
+  data = nullptr;
+  length = 0;
+}
+
+const PolynomialBundle::IndexEntry* PolynomialBundle::find(long p,
+                                                           long e_inner,
+                                                           long e) const
+{
+  auto it = std::lower_bound(
+      index.begin(),
+      index.end(),
+      std::make_tuple(p, e_inner, e),
+      [](const IndexEntry& a, const std::tuple<long, long, long>& b) {
+        return keyLess(a.p,
+                       a.e_inner,
+                       a.e,
+                       std::get<0>(b),
+                       std::get<1>(b),
+                       std::get<2>(b));
+      });
+  if (it == index.end() || it->p != p || it->e_inner != e_inner || it->e != e)
+    return nullptr;
+  return &*it;
+}
+
+bool PolynomialBundle::contains(long p, long e_inner, long e) const
+{
+  return find(p, e_inner, e) != nullptr;
+}
+
+long PolynomialBundle::maxPrecision(long p, long e_inner) const
+{
+  long result = 0;
+  for (const IndexEntry& entry : index)
+    if (entry.p == p && entry.e_inner == e_inner)
+      result = std::max(result, entry.e);
+  return result;
+}
+
+void PolynomialBundle::decode(NTL::ZZX& poly,
+                              long p,
+                              long e_inner,
+                              long e) const
+{
+  const IndexEntry* entry = find(p, e_inner, e);
+  if (entry == nullptr)
+    throw OutOfRangeError("No polynomial for p=" + std::to_string(p) +
+                          ", e_inner=" + std::to_string(e_inner) +
+                          ", e=" + std::to_string(e) + " in " + path);
+
+  poly = NTL::ZZX();
+  poly.SetMaxLength(entry->nCoeffs);
+  std::size_t pos = entry->offset;
+  for (long i = 0; i < entry->nCoeffs; i++) {
+    assertTrue<IOError>(pos + WORD <= length,
+                        "Truncated polynomial bundle " + path);
+    long nBytes = readWord(data + pos);
+    pos += WORD;
+    if (nBytes == 0)
+      continue;
+    std::size_t absBytes = std::abs(nBytes);
+    assertTrue<IOError>(pos + absBytes <= length,
+                        "Truncated polynomial bundle " + path);
+    NTL::ZZ c = NTL::ZZFromBytes(data + pos, absBytes);
+    pos += absBytes;
+    if (nBytes < 0)
+      NTL::negate(c, c);
+    SetCoeff(poly, i, c);
+  }
+}
+
+std::vector<PolynomialBundle::Entry> PolynomialBundle::entries(long p) const
+{
+  std::vector<Entry> result;
+  for (const IndexEntry& entry : index)
+    if (entry.p == p) {
+      result.push_back({entry.p, entry.e_inner, entry.e, NTL::ZZX()});
+      decode(result.back().poly, entry.p, entry.e_inner, entry.e);
+    }
+  return result;
+}
+
+std::size_t PolynomialBundle::byteSize() const
+{
+  std::size_t end = sizeof(BUNDLE_MAGIC) + WORD + index.size() * RECORD;
+  // The coefficients follow the index in the order of their offsets, so the
+  // bundle ends with those of the entry with the largest offset
+  auto last = std::max_element(
+      index.begin(),
+      index.end(),
+      [](const IndexEntry& a, const IndexEntry& b) {
+        return a.offset < b.offset;
+      });
+  if (last == index.end())
+    return end;
+  std::size_t pos = last->offset;
+  for (long i = 0; i < last->nCoeffs; i++) {
+    assertTrue<IOError>(pos + WORD <= length,
+                        "Truncated polynomial bundle " + path);
+    pos += WORD + std::abs(readWord(data + pos));
+  }
+  return std::max(end, pos);
+}
+
+void PolynomialBundle::write(const std::string& path,
+                             std::vector<Entry> entries)
+{
+  std::ofstream out(path, std::ios::binary);
+  if (!out)
+    throw IOError("Could not write polynomial bundle " + path);
+  write(out, std::move(entries));
+}
+
+void PolynomialBundle::write(std::ostream& out, std::vector<Entry> entries)
+{
+  std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+    return keyLess(a.p, a.e_inner, a.e, b.p, b.e_inner, b.e);
+  });
+
+  // Offsets are absolute, so lay out the index before writing it
+  std::size_t offset =
+      sizeof(BUNDLE_MAGIC) + WORD + entries.size() * RECORD;
+  std::vector<std::size_t> offsets;
+  for (const Entry& entry : entries) {
+    offsets.push_back(offset);
+    for (long i = 0; i <= deg(entry.poly); i++)
+      offset += WORD + NTL::NumBytes(coeff(entry.poly, i));
+  }
+
+  out.write(BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC));
+  writeWord(out, entries.size());
+  for (std::size_t i = 0; i < entries.size(); i++) {
+    writeWord(out, entries[i].p);
+    writeWord(out, entries[i].e_inner);
+    writeWord(out, entries[i].e);
+    writeWord(out, offsets[i]);
+    writeWord(out, deg(entries[i].poly) + 1);
+  }
+
+  std::vector<unsigned char> bytes;
+  for (const Entry& entry : entries) {
+    for (long i = 0; i <= deg(entry.poly); i++) {
+      const NTL::ZZ& c = coeff(entry.poly, i);
+      long nBytes = NTL::NumBytes(c);
+      writeWord(out, NTL::sign(c) < 0 ? -nBytes : nBytes);
+      if (nBytes == 0)
+        continue;
+      bytes.resize(nBytes);
+      NTL::BytesFromZZ(bytes.data(), c, nBytes); // writes the magnitude
+      out.write(reinterpret_cast<const char*>(bytes.data()), nBytes);
+    }
+  }
+
+  if (!out)
+    throw IOError("Could not write polynomial bundle");
+}
+
+// Read polynomial from file and store it in the given variable
+void parsePolynomial(NTL::ZZX& poly_result, const char* fileName)
+{
+  std::ifstream indata(fileName);
+  assertTrue((bool)indata, "Polynomial file does not exist.");
+
+  poly_result = NTL::ZZX();
+  int index = 0;
+  while (indata) {
+    std::string tmp;
+    indata >> tmp;
+    if (!tmp.empty())
+      SetCoeff(poly_result, index++, NTL::to_ZZ(tmp.c_str()));
+  }
+}
+
+std::vector<PolynomialBundle::Entry> readPolynomialDirectory(
+    const std::string& dir)
+{
+  std::vector<PolynomialBundle::Entry> entries;
+#ifdef _WIN32
+  throw LogicError("readPolynomialDirectory is not supported on Windows");
+#else
+  DIR* handle = ::opendir(dir.c_str());
+  if (handle == nullptr)
+    throw IOError("Could not open polynomial directory " + dir);
+  while (struct dirent* file = ::readdir(handle)) {
+    PolynomialBundle::Entry entry;
+    int used = 0;
+    if (std::sscanf(file->d_name,
+                    "poly%ld_%ld_%ld%n",
+                    &entry.p,
+                    &entry.e_inner,
+                    &entry.e,
+                    &used) != 3 ||
+        std::strcmp(file->d_name + used, ".txt") != 0)
+      continue;
+    parsePolynomial(entry.poly, (dir + "/" + file->d_name).c_str());
+    entries.push_back(std::move(entry));
+  }
+  ::closedir(handle);
+#endif
+  return entries;
+}
+
+std::vector<PolynomialBundle::Entry> readPolynomialSource(
+    const std::string& path,
+    long p)
+{
+  struct stat info;
+  if (::stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode)) {
+    std::vector<PolynomialBundle::Entry> entries =
+        readPolynomialDirectory(path);
+    entries.erase(std::remove_if(entries.begin(),
+                                 entries.end(),
+                                 [p](const PolynomialBundle::Entry& entry) {
+                                   return entry.p != p;
+                                 }),
+                  entries.end());
+    return entries;
+  }
+  return PolynomialBundle(path).entries(p);
+}
+
+// Exponent of p in j!
+static long factorialValuation(long p, long j)
+{
+  long result = 0;
+  for (long power = p; power <= j; power *= p)
+    result += j / power;
+  return result;
+}
+
+// Reduce the coefficients of poly to [0, q)
+static void reduceCoeffs(NTL::ZZX& poly, const NTL::ZZ& q)
+{
+  for (long i = 0; i <= deg(poly); i++)
+    SetCoeff(poly, i, coeff(poly, i) % q);
+  poly.normalize();
+}
+
+// Reduce the coefficients of poly to (-q/2, q/2]
+static void balanceCoeffs(NTL::ZZX& poly, const NTL::ZZ& q)
+{
+  NTL::ZZ half = q / 2;
+  for (long i = 0; i <= deg(poly); i++) {
+    NTL::ZZ c = coeff(poly, i) % q;
+    if (c > half)
+      c -= q;
+    SetCoeff(poly, i, c);
+  }
+  poly.normalize();
+}
+
+static NTL::ZZ coeffsL1Norm(const NTL::ZZX& poly)
+{
+  NTL::ZZ sum(0);
+  for (long i = 0; i <= deg(poly); i++)
+    sum += abs(coeff(poly, i));
+  return sum;
+}
+
+// The digits of the inputs, [-(p-1)/2, p/2]
+static std::vector<long> digitsOf(long p)
+{
+  std::vector<long> digits;
+  for (long d = -((p - 1) / 2); d <= p / 2; d++)
+    digits.push_back(d);
+  return digits;
+}
+
+// The nodes x_{p*j+r} = d_r + p^e_inner * j below, with the valuations
+// e_inner * j + v_p(j!) of N_i(x_i), while they are below precision
+static void digitNodes(std::vector<NTL::ZZ>& nodes,
+                       std::vector<long>& valuations,
+                       long p,
+                       long e_inner,
+                       long precision)
+{
+  NTL::ZZ step = NTL::power_ZZ(p, e_inner);
+  std::vector<long> digits = digitsOf(p);
+  nodes.clear();
+  valuations.clear();
+  for (long j = 0;; j++) {
+    long valuation = e_inner * j + factorialValuation(p, j);
+    if (valuation >= precision)
+      break;
+    for (long d : digits) {
+      nodes.push_back(d + step * j);
+      valuations.push_back(valuation);
+    }
+  }
+}
+
+// For p = 2 the even part of the polynomial is kept, (f(x) + f(-x)) / 2,
+// which needs one more bit of precision
+static bool keepsEvenPart(long p, long e_inner) { return p == 2 && e_inner == 1; }
+
+// The inputs x = d + p^e_inner * j are interpolated in the Newton basis
+// N_i(x) = (x - x_0) ... (x - x_{i-1}) on the nodes x_{p*j+r} = d_r +
+// p^e_inner * j. These nodes are a p-ordering of the inputs, so N_i(x_i) has
+// valuation e_inner * j + v_p(j!) and p^(e - that valuation) * N_i spans the
+// polynomials that vanish on the inputs mod p^e. The Newton coefficients are
+// thus only defined modulo p^(e - valuation), and the nodes stop once the
+// valuation reaches e, which gives the lowest degree.
+void generateDigitPolynomial(NTL::ZZX& poly, long p, long e_inner, long e)
+{
+  assertTrue<InvalidArgument>(p >= 2 && e_inner >= 1 && e >= 1,
+                              "Digit polynomial needs p >= 2, e_inner >= 1 "
+                              "and e >= 1");
+
+  bool even = keepsEvenPart(p, e_inner);
+  long precision = even ? e + 1 : e;
+  NTL::ZZ q = NTL::power_ZZ(p, precision);
+  std::vector<long> digits = digitsOf(p);
+
+  std::vector<NTL::ZZ> nodes;
+  std::vector<long> valuations;
+  digitNodes(nodes, valuations, p, e_inner, precision);
+
+  long n = nodes.size();
+  std::vector<NTL::ZZ> newton(n);
+  for (long i = 0; i < n; i++) {
+    // sum = f_{i-1}(x_i) and basis = N_i(x_i), both mod q
+    NTL::ZZ sum(0), basis(1);
+    for (long l = 0; l < i; l++) {
+      sum = (sum + newton[l] * basis) % q;
+      basis = (basis * (nodes[i] - nodes[l])) % q;
+    }
+    NTL::ZZ scale = NTL::power_ZZ(p, valuations[i]);
+    NTL::ZZ modulus = q / scale;
+    NTL::ZZ residual = (digits[i % p] - sum) % q;
+    NTL::ZZ quotient;
+    assertTrue(divide(quotient, residual, scale),
+               "Digit extraction is not a polynomial function");
+    NTL::ZZ unit = (basis / scale) % modulus;
+    newton[i] = (quotient * NTL::InvMod(unit, modulus)) % modulus;
+  }
+
+  // Horner's rule in the Newton basis
+  poly = NTL::ZZX::zero();
+  for (long i = n - 1; i >= 0; i--) {
+    NTL::ZZX factor(NTL::INIT_MONO, 1);
+    SetCoeff(factor, 0, -nodes[i]);
+    poly *= factor;
+    poly += newton[i];
+    reduceCoeffs(poly, q);
+  }
+
+  // Only keep the odd part for odd p, (f(x) - f(-x)) / 2, which is valid as
+  // the inputs and the digits are symmetric, or the even part for p = 2
+  for (long i = even ? 1 : 0; i <= deg(poly); i += 2)
+    SetCoeff(poly, i, 0);
+  poly.normalize();
+
+  minimizeDigitPolynomial(poly, p, e_inner, e);
+}
+
+// The polynomials p^(precision - v_i) * N_i vanish on the inputs mod
+// p^precision and N_i is monic of degree i, so going down from the top
+// degree, subtracting the multiple of the i-th one that brings coefficient i
+// to (-c/2, c/2] with c = p^(precision - v_i) does not change the function,
+// nor the coefficients above i. With a parity, only the part of the same
+// parity of those polynomials is subtracted: for odd p it still vanishes on
+// the symmetric inputs, and for p = 2 the precision has the extra bit that
+// the even part needs.
+void minimizeDigitPolynomial(NTL::ZZX& poly, long p, long e_inner, long e)
+{
+  assertTrue<InvalidArgument>(p >= 2 && e_inner >= 1 && e >= 1,
+                              "Digit polynomial needs p >= 2, e_inner >= 1 "
+                              "and e >= 1");
+
+  bool odd = true, even = true;
+  for (long i = 0; i <= deg(poly); i++)
+    if (!IsZero(coeff(poly, i)))
+      (i % 2 ? even : odd) = false;
+  long parity = -1; // the degrees kept, -1 for all of them
+  if (deg(poly) > 0 && (odd || even)) {
+    // The even part needs the extra bit of precision of keepsEvenPart, and
+    // for p = 2 the inputs are not symmetric otherwise
+    if (p == 2 && !(even && keepsEvenPart(p, e_inner)))
+      return;
+    parity = odd ? 1 : 0;
+  }
+  long precision = (p == 2 && parity == 0) ? e + 1 : e;
+  NTL::ZZ qe = NTL::power_ZZ(p, e);
+  NTL::ZZX original = poly;
+  balanceCoeffs(original, qe);
+
+  std::vector<NTL::ZZ> nodes;
+  std::vector<long> valuations;
+  digitNodes(nodes, valuations, p, e_inner, precision);
+
+  // The i-th linear factor of the Newton basis. Past the nodes, multiples
+  // of N_n also vanish, so the factors are x from there on
+  auto factor = [&nodes](long l) {
+    NTL::ZZX f(NTL::INIT_MONO, 1);
+    if (l < long(nodes.size()))
+      SetCoeff(f, 0, -nodes[l]);
+    return f;
+  };
+  // N_i for the current i, built once at the top degree and divided by one
+  // factor per step down
+  NTL::ZZX basis(NTL::INIT_MONO, 0);
+  for (long l = 0; l < deg(poly); l++)
+    basis *= factor(l);
+
+  for (long i = deg(poly); i >= 1; i--) {
+    if (i < deg(basis))
+      basis /= factor(i);
+    if (parity >= 0 && i % 2 != parity)
+      continue;
+    // Past the nodes, N_i vanishes on all the inputs
+    long valuation = (i < long(valuations.size())) ? valuations[i] : precision;
+    NTL::ZZ c = NTL::power_ZZ(p, std::max(precision - valuation, 0L));
+    NTL::ZZ quotient = coeff(poly, i) / c; // rounded to the nearest
+    NTL::ZZ rest = coeff(poly, i) - quotient * c;
+    if (2 * rest > c)
+      quotient += 1;
+    if (IsZero(quotient))
+      continue;
+
+    for (long l = 0; l <= i; l++)
+      if (parity < 0 || l % 2 == parity)
+        SetCoeff(poly, l, coeff(poly, l) - quotient * c * coeff(basis, l));
+  }
+
+  // The lower coefficients are only balanced, and they can grow while the
+  // top ones shrink, so keep the result only if it is smaller overall
+  balanceCoeffs(poly, qe);
+  if (coeffsL1Norm(original) < coeffsL1Norm(poly))
+    poly = original;
+}
+
+// The registry of decoded digit extraction polynomials. Lookups of entries
+// that are already there only take the shared lock, so they can run
+// concurrently from all the bootstrapping threads.
+namespace {
+
+using PolynomialKey = std::tuple<long, long, long>; // p, e_inner, e
+
+struct PolynomialRegistry
+{
+  HELIB_SHARED_MUTEX_TYPE mx;
+  std::map<PolynomialKey, NTL::ZZX> polynomials;
+  std::map<long, std::unique_ptr<const DigitProgram>> programs; // null: none
+  std::string source; // set by setPolynomialSource, empty for the default
+  int generate = -1;  // set by setGenerateDigitPolynomials, -1 for default
+  std::unique_ptr<PolynomialBundle> bundle;
+  std::map<long, long> uses; // the DigitPolynomialUse's of every p
+  bool opened = false; // source and bundle are resolved on first use
+};
+
+PolynomialRegistry& registry()
+{
+  static PolynomialRegistry instance;
+  return instance;
+}
+
+} // namespace
+
+void setPolynomialSource(const std::string& path)
+{
+  PolynomialRegistry& reg = registry();
+  HELIB_EXCLUSIVE_GUARD(reg.mx);
+  assertTrue(reg.uses.empty(),
+             "Cannot change the polynomial source while it is in use");
+  reg.source = path;
+  reg.polynomials.clear();
+  reg.programs.clear();
+  reg.bundle.reset();
+  reg.opened = false;
+}
+
+void setGenerateDigitPolynomials(bool generate)
+{
+  PolynomialRegistry& reg = registry();
+  HELIB_EXCLUSIVE_GUARD(reg.mx);
+  reg.generate = generate;
+}
+
+bool getGenerateDigitPolynomials()
+{
+  PolynomialRegistry& reg = registry();
+  {
+    HELIB_SHARED_GUARD(reg.mx);
+    if (reg.generate >= 0)
+      return reg.generate;
+  }
+  const char* env = std::getenv("HELIB_GENERATE_POLYNOMIALS");
+  return env != nullptr && std::strcmp(env, "1") == 0;
+}
+
+std::string getPolynomialSource()
+{
+  PolynomialRegistry& reg = registry();
+  HELIB_SHARED_GUARD(reg.mx);
+  if (!reg.source.empty())
+    return reg.source;
+  const char* env = std::getenv("HELIB_POLYNOMIALS");
+  if (env != nullptr && *env != '\0')
+    return env;
+  return "polynomials";
+}
+
+// Decode (p, e_inner, e) from the source without touching the registry,
+// returns false if the source has no such polynomial
+static bool loadDigitPolynomial(NTL::ZZX& poly,
+                                const PolynomialRegistry& reg,
+                                const std::string& source,
+                                long p,
+                                long e_inner,
+                                long e)
+{
+  if (reg.bundle) {
+    if (!reg.bundle->contains(p, e_inner, e))
+      return false;
+    reg.bundle->decode(poly, p, e_inner, e);
+  } else {
+    std::string fileName = source + "/poly" + std::to_string(p) + "_" +
+                           std::to_string(e_inner) + "_" + std::to_string(e) +
+                           ".txt";
+    if (!std::ifstream(fileName))
+      return false;
+    parsePolynomial(poly, fileName.c_str());
+  }
+
+  // The polynomial is only meaningful mod p^e, so keep the smallest
+  // representatives of its coefficients
+  minimizeDigitPolynomial(poly, p, e_inner, e);
+  return true;
+}
+
+const NTL::ZZX& getDigitPolynomial(long p, long e_inner, long e)
+{
+  PolynomialRegistry& reg = registry();
+  PolynomialKey key(p, e_inner, e);
+  {
+    HELIB_SHARED_GUARD(reg.mx);
+    auto it = reg.polynomials.find(key);
+    if (it != reg.polynomials.end())
+      return it->second;
+  }
+
+  std::string source = getPolynomialSource();
+  bool generate = getGenerateDigitPolynomials();
+  {
+    HELIB_EXCLUSIVE_GUARD(reg.mx);
+    if (!reg.opened) {
+      // When polynomials are generated, the source does not need to exist
+      struct stat info;
+      bool exists = ::stat(source.c_str(), &info) == 0;
+      if (!(exists && S_ISDIR(info.st_mode)) && (exists || !generate))
+        reg.bundle = std::make_unique<PolynomialBundle>(source);
+      reg.opened = true;
+    }
+  }
+
+  // Decoding and generating happen outside of the lock, the bundle is
+  // read-only
+  NTL::ZZX poly;
+  if (!loadDigitPolynomial(poly, reg, source, p, e_inner, e)) {
+    if (!generate)
+      throw OutOfRangeError("No digit extraction polynomial generated for p=" +
+                            std::to_string(p) +
+                            ", e_inner=" + std::to_string(e_inner) +
+                            ", e=" + std::to_string(e) + " in " + source);
+    generateDigitPolynomial(poly, p, e_inner, e);
+  }
+
+  HELIB_EXCLUSIVE_GUARD(reg.mx);
+  // If another thread got there first, keep its copy
+  return reg.polynomials.emplace(key, std::move(poly)).first->second;
+}
+
+const DigitProgram* getDigitProgram(long p)
+{
+  PolynomialRegistry& reg = registry();
+  {
+    HELIB_SHARED_GUARD(reg.mx);
+    auto it = reg.programs.find(p);
+    if (it != reg.programs.end())
+      return it->second.get();
+  }
+
+  // slp{p}.txt lives in the polynomial directory, or next to the bundle
+  std::string source = getPolynomialSource();
+  struct stat info;
+  std::string dir = source;
+  if (!(::stat(source.c_str(), &info) == 0 && S_ISDIR(info.st_mode))) {
+    std::size_t slash = source.find_last_of('/');
+    dir = (slash == std::string::npos) ? "." : source.substr(0, slash);
+  }
+  std::string fileName = dir + "/slp" + std::to_string(p) + ".txt";
+
+  std::unique_ptr<const DigitProgram> program;
+  if (std::ifstream(fileName))
+    program = std::make_unique<const DigitProgram>(DigitProgram::read(fileName));
+  else if (p == 2)
+    program = std::make_unique<const DigitProgram>(DigitProgram::binary());
+
+  HELIB_EXCLUSIVE_GUARD(reg.mx);
+  // If another thread got there first, keep its copy
+  return reg.programs.emplace(p, std::move(program)).first->second.get();
+}
+
+DigitPolynomialUse::DigitPolynomialUse(long p) : p(p)
+{
+  PolynomialRegistry& reg = registry();
+  HELIB_EXCLUSIVE_GUARD(reg.mx);
+  reg.uses[p]++;
+}
+
+DigitPolynomialUse::~DigitPolynomialUse()
+{
+  PolynomialRegistry& reg = registry();
+  HELIB_EXCLUSIVE_GUARD(reg.mx);
+  if (--reg.uses[p] == 0)
+    reg.uses.erase(p);
+}
+
+void releaseDigitPolynomials(long p)
+{
+  PolynomialRegistry& reg = registry();
+  HELIB_EXCLUSIVE_GUARD(reg.mx);
+  assertTrue(reg.uses.count(p) == 0,
+             "Cannot release the digit extraction polynomials of p=" +
+                 std::to_string(p) + " while they are in use");
+  reg.programs.erase(p);
+  for (auto it = reg.polynomials.begin(); it != reg.polynomials.end();) {
+    if (std::get<0>(it->first) == p)
+      it = reg.polynomials.erase(it);
+    else
+      ++it;
+  }
+}
+
+} // namespace helib
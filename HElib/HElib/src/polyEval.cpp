@@ -12,7 +12,11 @@
 // Notice: this file was modified from HElib
 #include <helib/Context.h>
 #include <helib/polyEval.h>
+#include <helib/digitSimulation.h>
+#include <helib/keys.h>
+#include <helib/opCounters.h>
 
+#include <map>
 #include <sstream>
 #include <algorithm>
 #include <math.h>
@@ -20,11 +24,10 @@
 
 #include <NTL/ZZ.h>
 #include <NTL/ZZX.h>
+#include <NTL/BasicThreadPool.h>
 
 namespace helib {
 
-#include "Magma_declare.h"
-
 // Returns the e'th power of X, computing it as needed
 Ctxt& DynamicCtxtPowers::getPower(long e)
 {
@@ -69,6 +72,13 @@ static void recursivePolyEval(Ctxt& ret,
 // Main entry point: Evaluate an encrypted polynomial on an encrypted input
 // return in ret = sum_i poly[i] * x^i
 void polyEval(Ctxt& ret, const NTL::Vec<Ctxt>& poly, const Ctxt& x)
+{
+  polyEval(ret, poly, x, RelinPolicy::Lazy, /*parallel=*/true);
+}
+
+// Binary splitting p0(X) + (p1(X) + p2(X)*X^d)*X^d, for CKKS where the
+// engine of customPolyEval does not apply
+static void binaryPolyEval(Ctxt& ret, const NTL::Vec<Ctxt>& poly, const Ctxt& x)
 {
   if (poly.length() <= 1) { // Some special cases
     if (poly.length() == 0)
@@ -140,6 +150,15 @@ static void recursivePolyEval(Ctxt& ret,
 void polyEval(Ctxt& ret, NTL::ZZX poly, const Ctxt& x, long k)
 // Note: poly is passed by value, so caller keeps the original
 {
+  // Without a choice of k, the engine of customPolyEval picks the
+  // parameters (it needs an integer plaintext space)
+  if (k <= 0 && deg(poly) >= 1 && !x.isCKKS()) {
+    std::vector<Ctxt> result;
+    polyEval(result, std::vector<NTL::ZZX>{poly}, x);
+    ret = std::move(result[0]);
+    return;
+  }
+
   if (deg(poly) <= 2) {  // nothing to optimize here
     if (deg(poly) < 1) { // A constant
       ret.clear();
@@ -399,6 +418,112 @@ static void recursivePolyEval(Ctxt& ret,
   ret += tmp;
 }
 
+namespace {
+
+// An addition chain for an exponent: value[0] = 1, and step k >= 1 computes
+// X^{value[k]} as the product of the powers of steps arg[k].first and
+// arg[k].second, at multiplicative depth depth[k]
+struct PowerChain
+{
+  std::vector<long> value, depth;
+  std::vector<std::pair<long, long>> arg;
+
+  void push(long v, long d, long i, long j)
+  {
+    value.push_back(v);
+    depth.push_back(d);
+    arg.emplace_back(i, j);
+  }
+  void pop()
+  {
+    value.pop_back();
+    depth.pop_back();
+    arg.pop_back();
+  }
+};
+
+// The search for a short chain is exhaustive, so it is bounded in the
+// exponent and in the number of steps tried
+constexpr long POWER_CHAIN_MAX_EXPONENT = 256;
+constexpr long POWER_CHAIN_MAX_NODES = 100000;
+
+// Depth-first search for an ascending chain that reaches e in at most
+// length steps, none of them deeper than maxDepth
+bool searchPowerChain(PowerChain& chain,
+                      long e,
+                      long length,
+                      long maxDepth,
+                      long& budget)
+{
+  long k = chain.value.size(); // the step to choose
+  long last = chain.value.back();
+  if (last == e)
+    return true;
+  if (k > length || --budget < 0)
+    return false;
+  if ((last << (length - k + 1)) < e) // even doubling falls short
+    return false;
+
+  // Larger values first, they tend to reach e sooner
+  for (long i = k - 1; i >= 0; --i)
+    for (long j = i; j >= 0; --j) {
+      long v = chain.value[i] + chain.value[j];
+      if (v <= last)
+        break; // the chain is ascending, smaller j only gives less
+      long d = std::max(chain.depth[i], chain.depth[j]) + 1;
+      if (v > e || d > maxDepth)
+        continue;
+      chain.push(v, d, i, j);
+      if (searchPowerChain(chain, e, length, maxDepth, budget))
+        return true;
+      chain.pop();
+    }
+  return false;
+}
+
+// The shortest addition chain for e of the least depth ceil(log2(e)), if it
+// is shorter than the binary method (squarings, then a product per extra
+// bit) and is found within the bounds of the search
+bool shortPowerChain(PowerChain& chain, long e)
+{
+  if (e > POWER_CHAIN_MAX_EXPONENT)
+    return false;
+  long maxDepth = NTL::NumBits(e - 1);
+  long binary = NTL::NumBits(e) - 1 + NTL::weight(e) - 1;
+  long budget = POWER_CHAIN_MAX_NODES;
+  for (long length = maxDepth; length < binary; length++) {
+    chain = PowerChain();
+    chain.push(1, 0, 0, 0);
+    if (searchPowerChain(chain, e, length, maxDepth, budget))
+      return true;
+  }
+  return false;
+}
+
+// shortPowerChain(e), searched once per exponent. An empty chain means that
+// there is nothing better than the binary method.
+const PowerChain& cachedPowerChain(long e)
+{
+  static HELIB_SHARED_MUTEX_TYPE mx;
+  static std::map<long, PowerChain> chains;
+  {
+    HELIB_SHARED_GUARD(mx);
+    auto it = chains.find(e);
+    if (it != chains.end())
+      return it->second;
+  }
+
+  // Search outside of the lock, entries are never erased so references stay
+  // valid
+  PowerChain chain;
+  if (!shortPowerChain(chain, e))
+    chain = PowerChain();
+  HELIB_EXCLUSIVE_GUARD(mx);
+  return chains.emplace(e, std::move(chain)).first->second;
+}
+
+} // namespace
+
 // raise ciphertext to some power
 void Ctxt::power(long e)
 {
@@ -408,6 +533,25 @@ void Ctxt::power(long e)
   if (e == 1)
     return; // nothing to do
 
+  // When the plaintext space is p, x^{p^k m} = frob^k(x^m): the factors p
+  // cost an automorphism rather than products, and no depth. This needs
+  // the key-switching matrices for the automorphism.
+  long p = context.getP();
+  if (!isCKKS() && ptxtSpace == p && e % p == 0) {
+    long k = 0;
+    for (long f = e; f % p == 0; f /= p)
+      k++;
+    long m = context.getM();
+    long val = NTL::PowerMod(p % m, mcMod(k, context.getOrdP()), m);
+    if (val == 1 || pubKey.isReachable(val)) {
+      frobeniusAutomorph(k);
+      for (long i = 0; i < k; i++)
+        e /= p;
+      power(e);
+      return;
+    }
+  }
+
   long ell = NTL::NumBits(e); // e < 2^l <= 2e
 
   if (static_cast<unsigned long>(e) ==
@@ -417,6 +561,20 @@ void Ctxt::power(long e)
     return;
   }
 
+  // An addition chain with fewer products than the binary method, and the
+  // same least depth (e.g. 1,2,4,5,8,13,26,39: 7 products rather than 8)
+  const PowerChain& chain = cachedPowerChain(e);
+  if (!chain.value.empty()) {
+    std::vector<Ctxt> powers(chain.value.size(), Ctxt(ZeroCtxtLike, *this));
+    powers[0] = *this;
+    for (long k = 1; k < lsize(powers); k++) {
+      powers[k] = powers[chain.arg[k].first];
+      powers[k].multiplyBy(powers[chain.arg[k].second]);
+    }
+    *this = powers.back();
+    return;
+  }
+
   // Otherwise use the "DynamicCtxtPowers" from polyEval, it uses e Ctxt
   // objects as temporary space but keeps the level as low as possible
   DynamicCtxtPowers pwrs(*this, e);
@@ -466,9 +624,50 @@ bool areOddPolynomials(const std::vector<NTL::ZZX>& poly_list) {
     return true;
 }
 
-// Return the parameters that lead to the smallest number of non-constant multiplications
+// Power of s of the result of customPolyEvalRecursive on nb_coeff coefficients, adding its key switches
+// A relinearization of a ciphertext up to s^e takes e - 1 key switches, the giant steps are canonical
+static long giantStepPower(long& keySwitches, long nb_coeff, int m, int k, bool lazy, long maxPower) {
+    if (nb_coeff == 0)
+        return 0;
+    if (m == 0)     // Lazy baby steps above x^((k + 1) / 2) are left extended
+        return (lazy && (nb_coeff > (k + 1) / 2)) ? 2 : 1;
+
+    long index = std::min<long>(k * (1L << (m - 1)), nb_coeff);
+    long lower = giantStepPower(keySwitches, index, m - 1, k, lazy, maxPower);
+    long upper = giantStepPower(keySwitches, nb_coeff - index, m - 1, k, lazy, maxPower);
+    if (upper == 0)
+        return lower;
+    if (upper + 1 > std::max(maxPower, 2L)) {   // Relinearize the upper half before the product
+        keySwitches += upper - 1;
+        upper = 1;
+    }
+    long product = upper + 1;
+    if (!lazy) {
+        keySwitches += product - 1;
+        product = 1;
+    }
+    return std::max(lower, product);
+}
+
+// log2 of the largest sum of |coefficients| over the baby steps, which are the blocks of k coefficients
+// above the constant term: the noise a baby step adds scales with it
+static double scalarNoiseBits(const std::vector<NTL::ZZX>& polynomials, long k) {
+    double largest = 1.0;
+    for (const NTL::ZZX& polynomial : polynomials) {
+        for (long first = 1; first <= deg(polynomial); first += k) {
+            double sum = 0.0;
+            for (long index = first; index < first + k && index <= deg(polynomial); index++)
+                sum += NTL::conv<double>(abs(coeff(polynomial, index)));
+            largest = std::max(largest, sum);
+        }
+    }
+    return std::log2(largest);
+}
+
+// Return the parameters that lead to the smallest number of non-constant multiplications,
+// and among those the smallest (estimated) number of key switches and then scalar noise
 // Degree of the polynomials is at least k * (2 ^ m)
-PS_parameters getBestParameters(const std::vector<NTL::ZZX>& polynomials, bool lazy) {
+PS_parameters getBestParameters(const std::vector<NTL::ZZX>& polynomials, bool lazy, long maxPower) {
     for (NTL::ZZX polynomial : polynomials) {
         assertNeq(deg(polynomial), (long)-1, "Degree should be positive.");
         assertNeq(deg(polynomial), (long)0, "Degree should be positive.");
@@ -486,7 +685,9 @@ PS_parameters getBestParameters(const std::vector<NTL::ZZX>& polynomials, bool l
     int bestM = 0;
     int bestK = 0;
     int bestMultiplications = -1;
+    int bestKeySwitches = 0;
     bool bestOdd = false;
+    double bestScalarNoise = 0.0;
     for (int m = 0; m <= ceiling(log(d) / log(2)); m++) {
         // Compute corresponding k parameter and number of multiplications (start with baby step only)
         // Note that we cannot combine lazy rescaling with odd polynomials (different computation in the baby step)
@@ -538,8 +739,13 @@ PS_parameters getBestParameters(const std::vector<NTL::ZZX>& polynomials, bool l
             }
         }
 
+        // Every baby step and giant step power is relinearized once (eagerly or as a factor)
+        long keySwitches = nbMultiplications;
+
         // Add extra number for giant step
         for (NTL::ZZX polynomial : polynomials) {
+            long power = giantStepPower(keySwitches, deg(polynomial), m, k, lazy, maxPower);
+            keySwitches += std::max(power - 1, 0L);    // Final relinearization of the result
             nbMultiplications += (ceiling(deg(polynomial) / k) - 1);
             if (lazy) {    // One extra non-scalar multiplication in giant step
                 nbMultiplications += 1;
@@ -550,632 +756,591 @@ PS_parameters getBestParameters(const std::vector<NTL::ZZX>& polynomials, bool l
         }
 
         // Check whether the parameters are better than the current best ones
-        if ((bestMultiplications == -1) || (nbMultiplications < bestMultiplications)) {
+        double scalarNoise = scalarNoiseBits(polynomials, k);
+        if ((bestMultiplications == -1) || (nbMultiplications < bestMultiplications) ||
+            ((nbMultiplications == bestMultiplications) && (keySwitches < bestKeySwitches)) ||
+            ((nbMultiplications == bestMultiplications) && (keySwitches == bestKeySwitches) && (scalarNoise < bestScalarNoise))) {
             bestM = m;
             bestK = k;
             bestMultiplications = nbMultiplications;
+            bestKeySwitches = keySwitches;
             bestOdd = currentOdd;
+            bestScalarNoise = scalarNoise;
         }
     }
     PS_parameters result;
     result.m = bestM; result.k = bestK; result.multiplications = bestMultiplications; result.odd = bestOdd;
+    result.keySwitches = bestKeySwitches;
+    result.scalarNoise = bestScalarNoise;
     return result;
 }
 
 // Preprocessing for polynomial evaluation
-// Evaluate x^spacing and compute updated polynomials accordingly
-void customPolyEvalPreprocessing(Ctxt& element, const std::vector<NTL::ZZX>& input, std::vector<NTL::ZZX>& output) {
-    long spacing = getSpacing(input);
-    element.power(spacing);
-    for (NTL::ZZX poly : input) {
+// Compute the polynomials f such that poly = f(x^spacing), the caller evaluates x^spacing
+static void spacedPolynomials(long spacing, const std::vector<NTL::ZZX>& input, std::vector<NTL::ZZX>& output) {
+    for (const NTL::ZZX& poly : input) {
         output.push_back(NTL::ZZX());
         for (long index = 0; index <= deg(poly) / spacing; index++)
             SetCoeff(output.back(), index, coeff(poly, index * spacing));
     }
 }
 
-// Recursive part of Paterson-Stockmeyer algorithm
-void customPolyEvalRecursive(Ctxt& result, const std::vector<NTL::ZZ>& coeff, std::vector<Ctxt>& xExp1, std::vector<Ctxt>& xExp2, int m, int k, bool lazy) {
+// Recursive part of Paterson-Stockmeyer algorithm, on the coefficients first, ..., first + nb_coeff - 1
+// (above the constant term): babyStep(result, first, count) sets result to the sum of the coefficients
+// first, ..., first + count - 1 times x, ..., x^count
+// scratch holds m ciphertexts that are reused as temporaries: scratch[level - 1] holds the upper half at that level
+// If the parallel flag is set, the two halves are evaluated as independent tasks
+template <typename BabyStepSum>
+static void polyEvalRecursive(Ctxt& result, long first, long nb_coeff, const BabyStepSum& babyStep, const std::vector<Ctxt>& xExp2, int m, int k, RelinPolicy policy, bool parallel, std::vector<Ctxt>& scratch) {
     // Base cases
-    result = Ctxt(ZeroCtxtLike, xExp1[0]);
-    if (coeff.size() == 0) {
+    if (nb_coeff == 0) {
+        result.clear();
         return;
     } else if (m == 0) {
-        for (std::vector<NTL::ZZ>::size_type index = 0; index < coeff.size(); index++) {  // Inner loop: baby step
-            if (coeff[index] != 0) {
-                Ctxt tmp(xExp1[index]);
-                if (coeff[index] == -1)
-                    tmp.negate();
-                else if (coeff[index] != 1)
-                    tmp.multByConstant(coeff[index]);
-                result.addCtxt(tmp);
-            }
-        }
+        babyStep(result, first, nb_coeff);  // Inner loop: baby step
         return;
     }
 
     // Recursive case
-    Ctxt tmp(ZeroCtxtLike, xExp1[0]);
-    long index = std::min<long>(k * pow(2, m - 1), coeff.size());
-    customPolyEvalRecursive(result, std::vector<NTL::ZZ>(coeff.begin(), coeff.begin() + index), xExp1, xExp2, m - 1, k, lazy);
-    customPolyEvalRecursive(tmp, std::vector<NTL::ZZ>(coeff.begin() + index, coeff.end()), xExp1, xExp2, m - 1, k, lazy);
-    tmp.customMultiplyBy(xExp2[m - 1], lazy);
+    Ctxt& tmp = scratch[m - 1];
+    long index = std::min<long>(k * (1L << (m - 1)), nb_coeff);
+    if (parallel) {
+        // The upper half needs its own scratch space, the lower half keeps using ours
+        // Nested calls are executed serially by the NTL thread pool
+        std::vector<Ctxt> scratch_upper(m - 1, Ctxt(ZeroCtxtLike, xExp2[0]));
+        HELIB_EXEC_RANGE(2, first_half, last_half)
+        for (long half = first_half; half < last_half; half++) {
+            if (half == 0)
+                polyEvalRecursive(result, first, index, babyStep, xExp2, m - 1, k, policy, parallel, scratch);
+            else
+                polyEvalRecursive(tmp, first + index, nb_coeff - index, babyStep, xExp2, m - 1, k, policy, parallel, scratch_upper);
+        }
+        HELIB_EXEC_RANGE_END
+    } else {
+        polyEvalRecursive(result, first, index, babyStep, xExp2, m - 1, k, policy, parallel, scratch);
+        polyEvalRecursive(tmp, first + index, nb_coeff - index, babyStep, xExp2, m - 1, k, policy, parallel, scratch);
+    }
+    if (tmp.isEmpty())  // All coefficients of the upper half are zero
+        return;
+    tmp.multiplyBy(xExp2[m - 1], policy);   // The giant steps are canonical, so this does not copy
     result.addCtxt(tmp);
 }
 
+// Paterson-Stockmeyer on the span coeff of scalar coefficients
+void customPolyEvalRecursive(Ctxt& result, const NTL::ZZ* coeff, long nb_coeff, const std::vector<Ctxt>& xExp1, const std::vector<Ctxt>& xExp2, int m, int k, RelinPolicy policy, bool parallel, std::vector<Ctxt>& scratch) {
+    auto babyStep = [&](Ctxt& sum, long first, long count) {
+        linearCombination(sum, xExp1.data(), coeff + first, count);
+    };
+    polyEvalRecursive(result, 0, nb_coeff, babyStep, xExp2, m, k, policy, parallel, scratch);
+}
+
 // Evaluate the given polynomials in the given element: the algorithm is optimized for lowest number of
 // multiplications since the depth is already optimal (counting only non-scalar multiplications)
-// This function can also execute the lazy baby-step/giant-step algorithm if the lazy flag is set to true
-void customPolyEval(std::vector<Ctxt>& result, const std::vector<NTL::ZZX>& polynomials, const Ctxt& element, bool lazy) {
-    for (NTL::ZZX polynomial : polynomials) {
+// This function can also execute the lazy baby-step/giant-step algorithm if the policy is not eager
+// If the parallel flag is set, the giant steps of the different polynomials are spread over the NTL thread pool
+void customPolyEval(std::vector<Ctxt>& result, const std::vector<NTL::ZZX>& polynomials, const Ctxt& element, RelinPolicy policy, bool parallel) {
+    long maxPower = element.getPubKey().maxRelinPower(element.getKeyID());
+    PolyEvalPlan(element.getContext(), polynomials, policy, element.getPtxtSpace(), maxPower).evaluate(result, element, parallel);
+}
+
+void customPolyEval(std::vector<Ctxt>& result, const std::vector<NTL::ZZX>& polynomials, const Ctxt& element, bool lazy, bool parallel) {
+    customPolyEval(result, polynomials, element, lazy ? RelinPolicy::Lazy : RelinPolicy::Eager, parallel);
+}
+
+void polyEval(std::vector<Ctxt>& ret, const std::vector<NTL::ZZX>& polys, const Ctxt& x, RelinPolicy policy, bool parallel) {
+    // Only the non-constant polynomials go through the engine, x may alias an element of ret
+    std::vector<NTL::ZZX> polynomials;
+    std::vector<long> positions;
+    for (long i = 0; i < long(polys.size()); i++) {
+        if (deg(polys[i]) >= 1) {
+            polynomials.push_back(polys[i]);
+            positions.push_back(i);
+        }
+    }
+    std::vector<Ctxt> evaluated;
+    if (!polynomials.empty()) {
+        if (x.isCKKS()) {   // Classic evaluation, one polynomial at a time
+            evaluated.assign(polynomials.size(), Ctxt(ZeroCtxtLike, x));
+            for (long i = 0; i < long(polynomials.size()); i++)
+                polyEval(evaluated[i], polynomials[i], x);
+        } else {
+            customPolyEval(evaluated, polynomials, x, policy, parallel);
+        }
+    }
+
+    std::vector<Ctxt> result(polys.size(), Ctxt(ZeroCtxtLike, x));
+    for (long i = 0; i < long(polys.size()); i++)
+        if (deg(polys[i]) < 1)
+            result[i].addConstant(coeff(polys[i], 0));
+    for (long i = 0; i < long(positions.size()); i++)
+        result[positions[i]] = std::move(evaluated[i]);
+    ret = std::move(result);
+}
+
+PolyEvalPlan::PolyEvalPlan(const Context& context, const std::vector<NTL::ZZX>& polynomials, RelinPolicy policy, long ptxtSpace, long maxPower) :
+    context(context), policy(policy), ptxtSpace(ptxtSpace) {
+    for (const NTL::ZZX& polynomial : polynomials) {
         assertNeq(deg(polynomial), (long)-1, "Degree should be positive.");
         assertNeq(deg(polynomial), (long)0, "Degree should be positive.");
     }
+    assertTrue<InvalidArgument>(ptxtSpace > 1, "Plaintext space must be larger than 1");
 
-    // Evaluate x^spacing and update polynomials accordingly
-    // Also determine the optimal parameters for the remaining polynomials
-    Ctxt new_element(element);
+    // Polynomials in x^spacing and the optimal parameters for them
+    spacing = getSpacing(polynomials);
     std::vector<NTL::ZZX> new_polynomials;
-    customPolyEvalPreprocessing(new_element, polynomials, new_polynomials);
-    PS_parameters parameters = getBestParameters(new_polynomials, lazy);
+    spacedPolynomials(spacing, polynomials, new_polynomials);
+    parameters = getBestParameters(new_polynomials, isLazy(), maxPower);
 
-    // Precompute x ^ exp with exp = 1, ..., k
-    std::vector<Ctxt> xExp1{new_element};
+    // Schedule for x ^ exp with exp = 2, ..., k
     for (int exp = 2; exp <= parameters.k; exp++) {
-        int ind1, ind2;
+        BabyStep step{0, 0};
         if (parameters.odd) {   // For odd polynomials, we use the algorithm that only adapts the baby step (not the one that rewrites to x*f(x^2) because of depth increase)
             if ((exp % 2) == 0) {
                 if (isPowerOfTwo(exp) || (exp == parameters.k)) {
-                    ind1 = (((exp % 4) == 0) ? floorPowerOfTwo(exp - 1) : (exp / 2));
-                    ind2 = exp - ind1;
-                    Ctxt tmp(xExp1[ind1 - 1]);
-                    tmp.customMultiplyBy(xExp1[ind2 - 1], lazy);
-                    xExp1.push_back(tmp);
-                } else {
-                    xExp1.push_back(Ctxt(ZeroCtxtLike, element));   // Just append garbage
-                }
+                    step.ind1 = (((exp % 4) == 0) ? floorPowerOfTwo(exp - 1) : (exp / 2));
+                    step.ind2 = exp - step.ind1;
+                }                                                   // Otherwise x^exp is never used
             } else {
-                ind1 = floorPowerOfTwo(exp);
-                ind2 = exp - ind1;
-                Ctxt tmp(xExp1[ind1 - 1]);
-                tmp.customMultiplyBy(xExp1[ind2 - 1], lazy);
-                xExp1.push_back(tmp);
+                step.ind1 = floorPowerOfTwo(exp);
+                step.ind2 = exp - step.ind1;
             }
         } else {
             // Choose indices such that the depth is as low as possible
-            ind1 = exp / 2;
-            ind2 = exp - ind1;
-
-            xExp1[ind1 - 1].reLinearize();
-            xExp1[ind2 - 1].reLinearize();
-            Ctxt tmp(xExp1[ind1 - 1]);
-            tmp.customMultiplyBy(xExp1[ind2 - 1], lazy);
-            xExp1.push_back(tmp);
+            step.ind1 = exp / 2;
+            step.ind2 = exp - step.ind1;
+        }
+        babySteps.push_back(step);
+    }
+
+    // Coefficients as lists, reduced to balanced representatives mod ptxtSpace
+    // (this turns e.g. ptxtSpace - 1 into -1, which is a negation instead of a scalar multiplication)
+    NTL::ZZ modulus(ptxtSpace);
+    for (const NTL::ZZX& polynomial : new_polynomials) {
+        std::vector<NTL::ZZ> coeff_list;
+        for (int exp = 0; exp <= deg(polynomial); exp++) {
+            NTL::ZZ c = coeff(polynomial, exp) % modulus;
+            if (2 * c > modulus)
+                c -= modulus;
+            coeff_list.push_back(c);
         }
+        constants.push_back(coeff_list[0]);
+        coefficients.push_back(std::vector<NTL::ZZ>(coeff_list.begin() + 1, coeff_list.end()));
+    }
+}
+
+void PolyEvalPlan::powers(std::vector<Ctxt>& xExp1, std::vector<Ctxt>& xExp2, const Ctxt& element) const {
+    assertEq(&element.getContext(), &context, "Plan was built for a different context");
+    assertEq(ptxtSpace % element.getPtxtSpace(), 0l, "Plan was built for an incompatible plaintext space");
+
+    // Evaluate x^spacing, a deferred input is relinearized here in our own copy
+    Ctxt new_element(element);
+    new_element.dropToNaturalPrimeSet();    // x itself is used in the baby steps, with no multiplication to drop it
+    new_element.reLinearize();
+    new_element.power(spacing);
+
+    // Precompute x ^ exp with exp = 1, ..., k
+    xExp1.assign(1, new_element);
+    for (const BabyStep& step : babySteps) {
+        if (step.ind1 == 0) {
+            xExp1.push_back(Ctxt(ZeroCtxtLike, element));   // Just append garbage
+            continue;
+        }
+        // Both factors are relinearized in place, so every power is relinearized at most once
+        // (and not once per copy of it)
+        xExp1[step.ind1 - 1].reLinearize();
+        xExp1[step.ind2 - 1].reLinearize();
+        Ctxt tmp(xExp1[step.ind1 - 1]);
+        tmp.multiplyBy(xExp1[step.ind2 - 1], policy);
+        xExp1.push_back(std::move(tmp));
     }
 
     // Sanitize result for giant step
     if (parameters.m != 0)
         xExp1.back().reLinearize();
 
+    // The products are left on the primes of their multiplication, drop them to what their noise needs
+    // before the scalar multiplications of the baby steps
+    for (Ctxt& power : xExp1)
+        power.dropToNaturalPrimeSet();
+
     // Precompute x ^ exp with exp = k, 2 * k, ..., (2 ^ (m - 1)) * k
-    std::vector<Ctxt> xExp2{xExp1.back()};
+    xExp2.assign(1, xExp1.back());
     for (int exp = 1; exp < parameters.m; exp++) {
         Ctxt tmp(xExp2.back());
         tmp.multiplyBy(tmp);
-        xExp2.push_back(tmp);
+        xExp2.push_back(std::move(tmp));
     }
+}
 
-    // Compute evaluation for each of the polynomials
-    result.clear();
-    for (NTL::ZZX polynomial : new_polynomials) {
-        // Compute coefficients as a list
-        std::vector<NTL::ZZ> coeff_list;
-        for (int exp = 0; exp <= deg(polynomial); exp++) {
-            coeff_list.push_back(coeff(polynomial, exp));
-        }
+void PolyEvalPlan::evaluate(std::vector<Ctxt>& result, const Ctxt& element, bool parallel) const {
+    std::vector<Ctxt> xExp1, xExp2;
+    powers(xExp1, xExp2, element);
+    const Ctxt& new_element = xExp1[0];
 
+    // Compute evaluation for each of the polynomials
+    // Note that the giant steps are all relinearized at this point, so concurrent reads are safe
+    long nb_polynomials = size();
+    result.assign(nb_polynomials, Ctxt(ZeroCtxtLike, new_element));
+    auto evaluate_one = [&](long index, bool parallel_halves, std::vector<Ctxt>& scratch) {
         // Return result via sequence of recursive calls
-        result.push_back(Ctxt(ZeroCtxtLike, new_element));
-        customPolyEvalRecursive(result.back(), std::vector<NTL::ZZ>(coeff_list.begin() + 1, coeff_list.end()), xExp1, xExp2, parameters.m, parameters.k, lazy);
-        if (coeff_list[0] != 0)
-            result.back().addConstant(coeff_list[0]);
-        result.back().reLinearize();
+        const std::vector<NTL::ZZ>& coeff_list = coefficients[index];
+        customPolyEvalRecursive(result[index], coeff_list.data(), coeff_list.size(), xExp1, xExp2, parameters.m, parameters.k, policy, parallel_halves, scratch);
+        if (constants[index] != 0)
+            result[index].addConstant(constants[index]);
+        if (policy != RelinPolicy::Deferred)
+            result[index].reLinearize();
+    };
+
+    // Scratch ciphertexts are allocated once per thread and reused for all polynomials
+    if (parallel && nb_polynomials > 1) {
+        HELIB_EXEC_RANGE(nb_polynomials, first, last)
+        std::vector<Ctxt> scratch(parameters.m, Ctxt(ZeroCtxtLike, new_element));
+        for (long index = first; index < last; index++)
+            evaluate_one(index, /*parallel_halves*/ false, scratch);
+        HELIB_EXEC_RANGE_END
+    } else {
+        std::vector<Ctxt> scratch(parameters.m, Ctxt(ZeroCtxtLike, new_element));
+        for (long index = 0; index < nb_polynomials; index++)
+            evaluate_one(index, parallel, scratch);
     }
 }
 
-#if 0
-/**********************************************************************/
-/*     FOR DEBUGGING PURPOSES, the same procedure for plaintext x     */
-/**********************************************************************/
-
-static long verbose = 0;
-class DynamicPtxtPowers {
-private:
-  long p;  // the modulus
-  vec_long v;    // A vector storing the powers themselves
-  vec_long dpth; // keeping track of depth for debugging purposes
-
-public:
-  DynamicPtxtPowers(long _x, long _p, long nPowers, long _d=1) : p(_p)
-  {
-    // Sanity check
-    assertTrue<InvalidArgument>(_x >= 0l, "_x must be greater equal than 0");
-    assertTrue<InvalidArgument>(_p > 1l, "_p must be greater than 1"); // Sanity check
-    assertTrue<InvalidArgument>(nPowers > 0l, "nPowers must be greater than 0"); // Sanity check
-    v.SetLength(nPowers);
-    dpth.SetLength(nPowers);
-    for (long i=1; i<nPowers; i++) // Initializes nPowers empty slots
-      dpth[i]=v[i]=-1;
-
-    v[0] = _x % p;         // store X itself in v[0]
-    dpth[0] = _d;
-    //    std::cerr << " initial power="<<v[0]<<", initial depth="<<dpth[0];
-  }
-
-  // Returns the e'th power, computing it as needed
-  long getPower(long e); // must use e >= 1, else throws an exception
-
-  // dp.at(i) and dp[i] both return the i+1st power
-  long at(long i) { return getPower(i+1); }
-  long operator[](long i) { return getPower(i+1); }
-
-  const vec_long& getVector() const { return v; }
-  long size() const { return v.length(); }
-  bool wasComputed(long i) { return (i>=0 && i<v.length() && v[i]>=0); }
-  long getDepth(long e) { return (e>0)? dpth.at(e-1) : 0; }
-};
-
-// Returns the e'th power, computing it as needed
-long DynamicPtxtPowers::getPower(long e)
-{
-  // FIXME: Do we want to allow the vector to grow? If so then begin by
-  // checking e<v.length() and resizing if not. Currently throws an exception.
-
-  if (v.at(e-1)<0) { // Not computed yet, compute it now
-
-    long k = 1L<<(NTL::NextPowerOfTwo(e)-1); // largest power of two smaller than e
-
-    v[e-1] = getPower(e-k);             // compute X^e = X^{e-k} * X^k
-    v[e-1] = MulMod(v[e-1], getPower(k), p);
-    dpth[e-1] = max(getDepth(k),getDepth(e-k)) +1;
-    nMults++;
-  }
-  return v[e-1];
+// The polynomial with a coefficient 1 where coefficients is not null
+template <typename T>
+static NTL::ZZX polynomialShape(const std::vector<const T*>& coefficients) {
+    NTL::ZZX shape;
+    for (long exp = 0; exp < long(coefficients.size()); exp++)
+        if (coefficients[exp])
+            SetCoeff(shape, exp);
+    return shape;
 }
 
-std::ostream& operator<< (std::ostream &s, const DynamicPtxtPowers &d)
-{
-  return s << d.getVector();
+// Coefficient exp of the input is coefficient exp / spacing of the polynomial in x^spacing,
+// the shape of the plan tells which baby steps it has
+template <typename T>
+static std::vector<const T*> spacedCoefficients(const std::vector<const T*>& input, const std::vector<NTL::ZZ>& shape, long spacing) {
+    std::vector<const T*> spaced(shape.size() + 1, nullptr);
+    for (long exp = 0; exp < long(input.size()); exp++) {
+        if (!input[exp])
+            continue;
+        long index = exp / spacing;
+        assertTrue<InvalidArgument>(exp % spacing == 0 && index < long(spaced.size()) && (index == 0 || shape[index - 1] != 0),
+                                    "Coefficients do not have the shape of the plan");
+        spaced[index] = input[exp];
+    }
+    return spaced;
 }
 
-static long
-recursivePolyEval(const NTL::ZZX& poly, long k, DynamicPtxtPowers& babyStep,
-		  DynamicPtxtPowers& giantStep, long mod,
-		  long& recursiveDepth);
-static long
-PatersonStockmeyer(const NTL::ZZX& poly, long k, long t, long delta,
-		   DynamicPtxtPowers& babyStep, DynamicPtxtPowers& giantStep,
-		   long mod, long& recursiveDepth);
+void PolyEvalPlan::evaluate(Ctxt& result, const std::vector<const PreparedPtxt*>& slotCoefficients, const Ctxt& element, bool parallel) const {
+    assertEq(size(), 1l, "Slot-wise evaluation takes the plan of a single polynomial");
+    assertFalse<InvalidArgument>(element.isCKKS(), "Slot-wise evaluation is only for BGV");
+
+    const std::vector<NTL::ZZ>& shape = coefficients[0];
+    std::vector<const PreparedPtxt*> spaced = spacedCoefficients(slotCoefficients, shape, spacing);
+    long ptxtSpaceOut = element.getPtxtSpace();
+    for (const PreparedPtxt* c : spaced) {
+        if (!c)
+            continue;
+        assertTrue<InvalidArgument>(c->isBGV(), "Slot coefficients must be BGV encodings");
+        ptxtSpaceOut = NTL::GCD(ptxtSpaceOut, c->getEncoded().getBGV().getPtxtSpace());
+    }
 
-long simplePolyEval(const NTL::ZZX& poly, DynamicPtxtPowers& babyStep, long mod)
-{
-  // ensure that we have enough powers
-  assertTrue(deg(poly)<=(long)babyStep.size(), "BabyStep has not enough powers (required more than deg(poly))");
-
-  long ret = rem(ConstTerm(poly), mod);
-  for (long i=0; i<deg(poly); i++) {
-    long coeff = rem(poly[i+1], mod); // f_{i+1}
-    long tmp = babyStep[i];           // X^{i+1}
-    tmp = MulMod(tmp, coeff, mod);    // f_{i+1} X^{i+1}
-    ret = AddMod(ret, tmp, mod);
-  }
-  return ret;
+    std::vector<Ctxt> xExp1, xExp2;
+    powers(xExp1, xExp2, element);
+
+    // A baby step is a single multiply-add over the powers, fused if they share their primes
+    auto babyStep = [&](Ctxt& sum, long first, long count) {
+        std::vector<const Ctxt*> ctxts;
+        std::vector<const DoubleCRT*> constants;
+        std::vector<double> sizes;
+        for (long j = 0; j < count; j++) {
+            const PreparedPtxt* c = spaced[first + j + 1];
+            if (!c)
+                continue;
+            const FatEncodedPtxt_BGV& fat = c->expand(xExp1[j].getPrimeSet()).getBGV();
+            ctxts.push_back(&xExp1[j]);
+            constants.push_back(&fat.getDCRT());
+            sizes.push_back(fat.getSize());
+        }
+        if (ctxts.empty())
+            sum.clear();
+        else
+            linearCombination(sum, ctxts, constants, sizes);
+    };
+
+    std::vector<Ctxt> scratch(parameters.m, Ctxt(ZeroCtxtLike, xExp1[0]));
+    Ctxt sum(ZeroCtxtLike, xExp1[0]);
+    polyEvalRecursive(sum, 0, shape.size(), babyStep, xExp2, parameters.m, parameters.k, policy, parallel, scratch);
+    if (spaced[0])
+        sum.addConstant(*spaced[0]);
+    if (ptxtSpaceOut != sum.getPtxtSpace())
+        sum.reducePtxtSpace(ptxtSpaceOut);
+    if (policy != RelinPolicy::Deferred)
+        sum.reLinearize();
+    result = std::move(sum);
 }
 
-// This procedure assumes that k*(2^e +1) > deg(poly) > k*(2^e -1),
-// and that babyStep contains k+ (deg(poly) mod k) powers
-static long degPowerOfTwo(const NTL::ZZX& poly, long k, DynamicPtxtPowers& babyStep,
-			  DynamicPtxtPowers& giantStep, long mod,
-			  long& recursiveDepth)
-{
-  if (deg(poly)<=babyStep.size()) { // Edge condition, use simple eval
-    long ret = simplePolyEval(poly, babyStep, mod);
-    recursiveDepth = babyStep.getDepth(deg(poly));
-    return ret;
-  }
-  long subDepth1 =0, subDepth2=0;
-  long n = deg(poly)/k;        // We assume n=2^e or n=2^e -1
-  n = 1L << NTL::NextPowerOfTwo(n); // round up to n=2^e
-  NTL::ZZX r = trunc(poly, (n-1)*k);      // degree <= k(2^e-1)-1
-  NTL::ZZX q = RightShift(poly, (n-1)*k); // 0 < degree < 2k
-  SetCoeff(r, (n-1)*k);              // monic, degree == k(2^e-1)
-  q -= 1;
-  if (verbose) std::cerr << ", recursing on "<<r<<" + X^"<<(n-1)*k<<"*"<<q<<std::endl;
-
-  long ret = PatersonStockmeyer(r, k, n/2, 0,
-				babyStep, giantStep, mod, subDepth2);
-  if (verbose)
-    std::cerr << "  PatersonStockmeyer("<<r<<") returns "<<ret
-	 << ", depth="<<subDepth2<<std::endl;
-
-  long tmp = simplePolyEval(q, babyStep, mod); // evaluate q
-  subDepth1 = babyStep.getDepth(deg(q));
-  if (verbose)
-    std::cerr << "  simplePolyEval("<<q<<") returns "<<tmp
-	 << ", depth="<<subDepth1<<std::endl;
-
-  // multiply by X^{k(n-1)} with minimum depth
-  for (long i=1; i<n; i*=2) {
-    tmp = MulMod(tmp, giantStep.getPower(i), mod);
-    nMults++;
-    subDepth1 = max(subDepth1, giantStep.getDepth(i)) +1;
-    if (verbose)
-      std::cerr << "    after mult by giantStep.getPower("<<i<< ")="
-	   << giantStep.getPower(i)<<" of depth="<< giantStep.getDepth(i)
-	   << ",  ret="<<tmp<<" and depth is "<<subDepth1<<std::endl;
-  }
-  totalDepth = max(subDepth1, subDepth2);
-  return AddMod(ret, tmp, mod); // return q * X^{k(n-1)} + r
+void PolyEvalPlan::evaluate(Ctxt& result, const std::vector<const Ctxt*>& ctxtCoefficients, const Ctxt& element, bool parallel) const {
+    assertEq(size(), 1l, "Evaluation with encrypted coefficients takes the plan of a single polynomial");
+
+    const std::vector<NTL::ZZ>& shape = coefficients[0];
+    std::vector<const Ctxt*> spaced = spacedCoefficients(ctxtCoefficients, shape, spacing);
+
+    // The powers are shared by all the products, so they are all relinearized once here
+    std::vector<Ctxt> xExp1, xExp2;
+    powers(xExp1, xExp2, element);
+    for (Ctxt& power : xExp1)
+        power.reLinearize();
+
+    // A baby step sums the products of the coefficients with the powers, which stay extended
+    // unless the policy is eager, so the sum is relinearized once
+    auto babyStep = [&](Ctxt& sum, long first, long count) {
+        bool empty = true;
+        for (long j = 0; j < count; j++) {
+            const Ctxt* c = spaced[first + j + 1];
+            if (!c)
+                continue;
+            Ctxt product(*c);
+            product.multiplyBy(xExp1[j], policy);
+            if (empty)
+                sum = std::move(product);
+            else
+                sum += product;
+            empty = false;
+        }
+        if (empty)
+            sum.clear();
+    };
+
+    std::vector<Ctxt> scratch(parameters.m, Ctxt(ZeroCtxtLike, xExp1[0]));
+    Ctxt sum(ZeroCtxtLike, xExp1[0]);
+    polyEvalRecursive(sum, 0, shape.size(), babyStep, xExp2, parameters.m, parameters.k, policy, parallel, scratch);
+    if (spaced[0])
+        sum += *spaced[0];
+    if (policy != RelinPolicy::Deferred)
+        sum.reLinearize();
+    result = std::move(sum);
 }
 
-// This procedure assumes that poly is monic, deg(poly)=k*(2t-1)+delta
-// with t=2^e, and that babyStep contains k+delta powers
-static long
-PatersonStockmeyer(const NTL::ZZX& poly, long k, long t, long delta,
-		   DynamicPtxtPowers& babyStep, DynamicPtxtPowers& giantStep,
-		   long mod, long& recursiveDepth)
-{
-  if (verbose) std::cerr << "PatersonStockmeyer("<<poly<<"), k="<<k<<", t="<<t<<std::endl;
-
-  if (deg(poly)<=babyStep.size()) { // Edge condition, use simple eval
-    long ret = simplePolyEval(poly, babyStep, mod);
-    recursiveDepth = babyStep.getDepth(deg(poly));
-    return ret;
-  }
-  long subDepth1=0, subDepth2=0;
-  long ret, tmp;
-
-  NTL::ZZX r = trunc(poly, k*t);      // degree <= k*2^e-1
-  NTL::ZZX q = RightShift(poly, k*t); // degree == k(2^e-1) +delta
-
-  if (verbose) std::cerr << "  r ="<<r<< ", q="<<q;
-
-  const NTL::ZZ& coef = coeff(r,deg(q));
-  SetCoeff(r, deg(q), coef-1);  // r' = r - X^{deg(q)}
-
-  if (verbose) std::cerr << ", r'="<<r;
-
-  NTL::ZZX c,s;
-  DivRem(c,s,r,q); // r' = c*q + s
-  // deg(s)<deg(q), and if c!= 0 then deg(c)<k-delta
-
-  if (verbose) std::cerr << ", c="<<c<< ", s ="<<s<<std::endl;
-
-  assertTrue(deg(s)<deg(q), "Degree of s is not less than degree of q");
-  assertTrue(IsZero(c) || deg(c)<k - delta, "Nonzero c has not degree smaller than k - delta");
-
-  SetCoeff(s,deg(q)); // s' = s + X^{deg(q)}, deg(s)==deg(q)
-
-  // reduce the coefficients modulo mod
-  for (long i=0; i<=deg(c); i++) rem(c[i],c[i], NTL::to_ZZ(mod));
-  c.normalize();
-  for (long i=0; i<=deg(s); i++) rem(s[i],s[i], NTL::to_ZZ(mod));
-  s.normalize();
+NTL::ZZX slotPolynomialShape(const std::vector<const PreparedPtxt*>& coefficients) {
+    return polynomialShape(coefficients);
+}
 
-  if (verbose) std::cerr << " {t==n+1} recursing on "<<s<<" + (X^"<<t*k<<"+"<<c<<")*"<<q<<std::endl;
+NTL::ZZX encryptedPolynomialShape(const std::vector<const Ctxt*>& coefficients) {
+    return polynomialShape(coefficients);
+}
 
-  // Evaluate recursively poly = (c+X^{kt})*q + s'
-  tmp = simplePolyEval(c, babyStep, mod);
-  tmp = AddMod(tmp, giantStep.getPower(t), mod);
-  subDepth1 = max(babyStep.getDepth(deg(c)), giantStep.getDepth(t));
-
-  ret = PatersonStockmeyer(q, k, t/2, delta,
-			   babyStep, giantStep, mod, subDepth2);
-
-  if (verbose) {
-    std::cerr << "  PatersonStockmeyer("<<q<<") returns "<<ret
-	 << ", depth="<<subDepth2<<std::endl;
-    if (ret != polyEvalMod(q,babyStep[0], mod)) {
-      std::stringstream ss;
-      ss << "  **1st recursive call failed, q="<<q;
-      throw RuntimeError(ss.get());
-    }
-  }
-  ret = MulMod(ret, tmp, mod);
-  nMults++;
-  subDepth1 = max(subDepth1, subDepth2)+1;
-
-  tmp = PatersonStockmeyer(s, k, t/2, delta,
-			   babyStep, giantStep, mod, subDepth2);
-  if (verbose) {
-    std::cerr << "  PatersonStockmeyer("<<s<<") returns "<<tmp
-	 << ", depth="<<subDepth2<<std::endl;
-    if (tmp != polyEvalMod(s,babyStep[0], mod)) {
-      std::stringstream ss;
-      ss << "  **2nd recursive call failed, s="<<s;
-      throw RuntimeError(ss.get());
+void customPolyEval(Ctxt& result, const std::vector<const PreparedPtxt*>& coefficients, const Ctxt& element, RelinPolicy policy, bool parallel) {
+    assertFalse<InvalidArgument>(element.isCKKS(), "Slot-wise evaluation is only for BGV");
+    NTL::ZZX shape = slotPolynomialShape(coefficients);
+    if (deg(shape) < 1) {   // A constant, or zero
+        Ctxt constant(ZeroCtxtLike, element);
+        if (deg(shape) == 0)
+            constant.addConstant(*coefficients[0]);
+        result = std::move(constant);
+        return;
     }
-  }
-  ret = AddMod(ret,tmp,mod);
-  recursiveDepth = max(subDepth1, subDepth2);
-  return ret;
+    long maxPower = element.getPubKey().maxRelinPower(element.getKeyID());
+    PolyEvalPlan(element.getContext(), {shape}, policy, element.getPtxtSpace(), maxPower).evaluate(result, coefficients, element, parallel);
 }
 
-
-// This procedure assumes that poly is monic and that babyStep contains
-// at least k+delta powers, where delta = deg(poly) mod k
-static long
-recursivePolyEval(const NTL::ZZX& poly, long k, DynamicPtxtPowers& babyStep,
-		  DynamicPtxtPowers& giantStep, long mod,
-		  long& recursiveDepth)
-{
-  if (deg(poly)<=babyStep.size()) { // Edge condition, use simple eval
-    long ret = simplePolyEval(poly, babyStep, mod);
-    recursiveDepth = babyStep.getDepth(deg(poly));
-    return ret;
-  }
-
-  if (verbose) std::cerr << "recursivePolyEval("<<poly<<")\n";
-
-  long delta = deg(poly) % k; // deg(poly) mod k
-  long n = divc(deg(poly),k); // ceil( deg(poly)/k )
-  long t = 1L<<(NTL::NextPowerOfTwo(n)); // t >= n, so t*k >= deg(poly)
-
-  // Special case for deg(poly) = k * 2^e +delta
-  if (n==t)
-    return degPowerOfTwo(poly, k, babyStep, giantStep, mod, recursiveDepth);
-
-  // When deg(poly) = k*(2^e -1) we use the Paterson-Stockmeyer recursion
-  if (n == t-1 && delta==0)
-    return PatersonStockmeyer(poly, k, t/2, delta,
-			      babyStep, giantStep, mod, recursiveDepth);
-
-  t = t/2;
-
-  // In any other case we have kt < deg(poly) < k(2t-1). We then set
-  // u = deg(poly) - k*(t-1) and poly = q*X^u + r with deg(r)<u
-  // and recurse on poly = (q-1)*X^u + (X^u+r)
-
-  long u = deg(poly) - k*(t-1);
-  NTL::ZZX r = trunc(poly, u);      // degree <= u-1
-  NTL::ZZX q = RightShift(poly, u); // degree == k*(t-1)
-  q -= 1;
-  SetCoeff(r, u);              // degree == u
-
-  long ret, tmp;
-  long subDepth1=0, subDepth2=0;
-  if (verbose)
-    std::cerr << " {deg(poly)="<<deg(poly)<<"<k*(2t-1)="<<k*(2*t-1)
-	 << "} recursing on "<<r<<" + X^"<<u<<"*"<<q<<std::endl;
-  ret = PatersonStockmeyer(q, k, t/2, 0,
-			   babyStep, giantStep, mod, subDepth1);
-
-  if (verbose) {
-    std::cerr << "  PatersonStockmeyer("<<q<<") returns "<<ret<<", depth="<<subDepth1<<std::endl;
-    if (ret != polyEvalMod(q,babyStep[0], mod)) {
-      std::stringstream ss;
-      ss << "  @@1st recursive call failed, q="<<q
-     	   << ", ret="<<ret<<"!=" << polyEvalMod(q,babyStep[0], mod);
-      throw RuntimeError(ss.get());
+void customPolyEval(Ctxt& result, const std::vector<EncodedPtxt>& coefficients, const Ctxt& element, RelinPolicy policy, bool parallel) {
+    std::vector<std::unique_ptr<PreparedPtxt>> prepared;
+    std::vector<const PreparedPtxt*> pointers;
+    for (const EncodedPtxt& coefficient : coefficients) {
+        prepared.emplace_back(new PreparedPtxt(coefficient));
+        pointers.push_back(prepared.back().get());
     }
-  }
-
-  tmp = giantStep.getPower(u/k);
-  subDepth2 = giantStep.getDepth(u/k);
-  if (delta!=0) { // if u is not divisible by k then compute it
-    if (verbose)
-      std::cerr <<"  multiplying by X^"<<u
-	   <<"=giantStep.getPower("<<(u/k)<<")*babyStep.getPower("<<delta<<")="
-	   << giantStep.getPower(u/k)<<"*"<<babyStep.getPower(delta)
-	   << "="<<tmp<<std::endl;
-    tmp = MulMod(tmp, babyStep.getPower(delta), mod);
-    nMults++;
-    subDepth2++;
-  }
-  ret = MulMod(ret, tmp, mod);
-  nMults ++;
-  subDepth1 = max(subDepth1, subDepth2)+1;
-
-  if (verbose) std::cerr << "  after mult by X^{k*"<<u<<"+"<<delta<<"}, depth="<< subDepth1<<std::endl;
-
-  tmp = recursivePolyEval(r, k, babyStep, giantStep, mod, subDepth2);
-  if (verbose)
-    std::cerr << "  recursivePolyEval("<<r<<") returns "<<tmp<<", depth="<<subDepth2<<std::endl;
-  if (tmp != polyEvalMod(r,babyStep[0], mod)) {
-    std::stringstream ss;
-    ss << "  @@2nd recursive call failed, r="<<r
-      << ", ret="<<tmp<<"!=" << polyEvalMod(r,babyStep[0], mod);
-    throw RuntimeError(ss.get());
-  }
-  recursiveDepth = max(subDepth1, subDepth2);
-  return AddMod(ret, tmp, mod);
+    customPolyEval(result, pointers, element, policy, parallel);
 }
 
-// Note: poly is passed by value, not by reference, so the calling routine
-// keeps its original polynomial
-long evalPolyTopLevel(NTL::ZZX poly, long x, long p, long k=0)
-{
-  if (verbose)
-  std::cerr << "\n* evalPolyTopLevel: p="<<p<<", x="<<x<<", poly="<<poly;
-
-  if (deg(poly)<=2) { // nothing to optimize here
-    if (deg(poly)<1) return to_long(coeff(poly, 0));
-    DynamicPtxtPowers babyStep(x, p, deg(poly));
-    long ret = simplePolyEval(poly, babyStep, p);
-    totalDepth = babyStep.getDepth(deg(poly));
-    return ret;
-  }
-
-  // How many baby steps: set k~sqrt(n/2), rounded up/down to a power of two
-
-  // FIXME: There may be some room for optimization here: it may be possible
-  // to choose k as something other than a power of two and still maintain
-  // optimal depth, in principle we can try all possible values of k between
-  // the two powers of two and choose the one that goves the least number
-  // of multiplies, conditioned on minimum depth.
-
-  if (k<=0) {
-    long kk = (long) sqrt(deg(poly)/2.0);
-    k = 1L << NTL::NextPowerOfTwo(kk);
-
-    // heuristic: if k>>kk then use a smaler power of two
-    if ((k==16 && deg(poly)>167) || (k>16 && k>(1.44*kk)))
-      k /= 2;
-  }
-  std::cerr << ", k="<<k;
+void polyEval(Ctxt& ret, const NTL::Vec<Ctxt>& poly, const Ctxt& x, RelinPolicy policy, bool parallel) {
+    if (x.isCKKS()) {
+        binaryPolyEval(ret, poly, x);
+        return;
+    }
 
-  long n = divc(deg(poly),k);          // deg(p) = k*n +delta
-  if (verbose) std::cerr << ", n="<<n<<std::endl;
+    // Empty coefficients are zero
+    std::vector<const Ctxt*> coefficients;
+    for (long i = 0; i < poly.length(); i++)
+        coefficients.push_back(poly[i].isEmpty() ? nullptr : &poly[i]);
+    NTL::ZZX shape = encryptedPolynomialShape(coefficients);
+    if (deg(shape) < 1) {   // A constant, or zero
+        if (deg(shape) == 0)
+            ret = poly[0];
+        else
+            ret.clear();
+        return;
+    }
+    long maxPower = x.getPubKey().maxRelinPower(x.getKeyID());
+    PolyEvalPlan(x.getContext(), {shape}, policy, x.getPtxtSpace(), maxPower).evaluate(ret, coefficients, x, parallel);
+}
 
-  DynamicPtxtPowers babyStep(x, p, k);
-  long x2k = babyStep.getPower(k);
+std::vector<std::vector<long>> interpolateSlotTables(const Context& context, const std::vector<std::vector<long>>& tables) {
+    long p = context.getP();
+    long q = context.getAlMod().getPPowR();
+    long n = tables.empty() ? 0 : tables[0].size();
+    assertInRange<InvalidArgument>(n, 1l, p, "Interpolated tables must have between 1 and p entries", /*right_inclusive=*/true);
+
+    std::vector<std::vector<long>> result(n, std::vector<long>(tables.size(), 0));
+    std::vector<long> a(n), poly(n);
+    for (long s = 0; s < long(tables.size()); s++) {
+        assertEq<InvalidArgument>(long(tables[s].size()), n, "Interpolated tables must have the same size");
+
+        // Newton divided differences on the points 0, ..., n-1: x_i - x_{i-j} = j is invertible since n <= p
+        for (long i = 0; i < n; i++)
+            a[i] = ((tables[s][i] % q) + q) % q;
+        for (long j = 1; j < n; j++) {
+            long jInv = NTL::InvMod(j % q, q);
+            for (long i = n - 1; i >= j; i--)
+                a[i] = NTL::MulMod(NTL::SubMod(a[i], a[i - 1], q), jInv, q);
+        }
 
-  // Special case when deg(p)>k*(2^e -1)
-  if (n==(1L << NTL::NextPowerOfTwo(n))) { // n is a power of two
-    DynamicPtxtPowers giantStep(x2k, p, n/2, babyStep.getDepth(k));
-    if (verbose)
-      std::cerr << "babyStep="<<babyStep<<", giantStep="<<giantStep<<std::endl;
-    long ret = degPowerOfTwo(poly, k, babyStep, giantStep, p, totalDepth);
-
-    if (verbose) {
-      std::cerr << "  degPowerOfTwo("<<poly<<") returns "<<ret<<", depth="<<totalDepth<<std::endl;
-      if (ret != polyEvalMod(poly,babyStep[0], p)) {
-        std::stringstream ss;
-        ss << "  ## recursive call failed, ret="<<ret<<"!="
-          << polyEvalMod(poly,babyStep[0], p);
-        throw RuntimeError(ss.get());
-      }
-      // std::cerr << "  babyStep depth=[";
-      // for (long i=0; i<babyStep.size(); i++)
-      // 	std::cerr << babyStep.getDepth(i+1)<<" ";
-      // std::cerr << "]\n";
-      // std::cerr << "  giantStep depth=[";
-      // for (long i=0; i<giantStep.size(); i++)
-      // 	std::cerr<<giantStep.getDepth(i+1)<<" ";
-      // std::cerr << "]\n";
+        // Horner on the Newton basis: poly = a[n-1], then poly = poly * (x - i) + a[i]
+        std::fill(poly.begin(), poly.end(), 0);
+        poly[0] = a[n - 1];
+        for (long i = n - 2; i >= 0; i--) {
+            for (long e = n - 1; e > 0; e--)
+                poly[e] = NTL::SubMod(poly[e - 1], NTL::MulMod(poly[e], i, q), q);
+            poly[0] = NTL::AddMod(NTL::SubMod(0, NTL::MulMod(poly[0], i, q), q), a[i], q);
+        }
+        for (long e = 0; e < n; e++)
+            result[e][s] = poly[e];
     }
-    return ret;
-  }
-
-  // If n is not a power of two, ensure that poly is monic and that
-  // its degree is divisible by k, then call the recursive procedure
+    return result;
+}
 
-  NTL::ZZ topInv; // the inverse mod p of the top coefficient of poly (if any)
-  bool divisible = (n*k == deg(poly)); // is the degree divisible by k?
-  long nonInvertibe = InvModStatus(topInv, LeadCoeff(poly), NTL::to_ZZ(p));
-       // 0 if invertible, 1 if not
+SlotLookupMethod chooseSlotLookup(const Context& context, long tableSize, bool indexBits, RelinPolicy policy) {
+    long p = context.getP();
+    if (tableSize > p)
+        return SlotLookupMethod::TableLookup;
+    if (tableSize <= 2)
+        return SlotLookupMethod::Interpolation;   // At most a scalar-times-x sum
+
+    // Paterson-Stockmeyer on a dense polynomial of degree tableSize - 1
+    NTL::ZZX dense;
+    for (long exp = 0; exp < tableSize; exp++)
+        SetCoeff(dense, exp);
+    long interpolation = getBestParameters({dense}, policy != RelinPolicy::Eager).multiplications;
+
+    // tableLookup: the products of the two halves of the n index bits, then one product per high product
+    long nBits = NTL::NumBits(tableSize - 1);
+    long nLow = (nBits + 1) / 2;
+    long lookup = (1L << nLow) + 2 * (1L << (nBits - nLow));
+    if (!indexBits) {
+        if (p != 2)
+            return SlotLookupMethod::Interpolation;
+        lookup += nBits * (nBits - 1) / 2;   // Digit extraction of the bits, about one squaring per digit and lower digit
+    }
+    return (lookup < interpolation) ? SlotLookupMethod::TableLookup : SlotLookupMethod::Interpolation;
+}
 
-  // FIXME: There may be some room for optimization below: instead of
-  // adding a term X^{n*k} we can add X^{n'*k} for some n'>n, so long
-  // as n' is smaller than the next power of two. We could save a few
-  // multiplications since giantStep[n'] may be easier to compute than
-  // giantStep[n] when n' has fewer 1's than n in its binary expansion.
+std::shared_ptr<const PolyEvalPlan> PolyEvalPlanCache::get(const std::vector<long>& key, const std::function<std::shared_ptr<const PolyEvalPlan>()>& build) {
+    {
+        HELIB_SHARED_GUARD(mx);
+        auto it = plans.find(key);
+        if (it != plans.end())
+            return it->second;
+    }
 
-  long extra = 0;        // extra!=0 denotes an added term extra*X^{n*k}
-  if (!divisible || nonInvertibe) {  // need to add a term
-    // set extra = 1 - current-coeff-of-X^{n*k}
-    extra = SubMod(1, to_long(coeff(poly,n*k)), p);
-    SetCoeff(poly, n*k); // set the top coefficient of X^{n*k} to one
-    topInv = NTL::to_ZZ(1);   // inverse of new top coefficient is one
-  }
+    // Build outside of the lock, if another thread got there first we keep its plan
+    std::shared_ptr<const PolyEvalPlan> plan = build();
+    HELIB_EXCLUSIVE_GUARD(mx);
+    return plans.emplace(key, plan).first->second;
+}
 
-  long t = (extra==0)? divc(n,2) : n;
-  DynamicPtxtPowers giantStep(x2k, p, t, babyStep.getDepth(k));
+const NTL::ZZX& DigitPolynomialCache::getLifting(long p, long e) {
+    return get(0, p, e);
+}
 
-  if (verbose)
-    std::cerr << "babyStep="<<babyStep<<", giantStep="<<giantStep<<std::endl;
+const NTL::ZZX& DigitPolynomialCache::getChenHan(long p, long e) {
+    return get(1, p, e);
+}
 
-  long y; // the value to return
-  long subDepth1 =0;
-  if (!IsOne(topInv)) {
-    long top = to_long(poly[n*k]); // record the current top coefficient
-    //    std::cerr << ", top-coeff="<<top;
+const NTL::ZZX& DigitPolynomialCache::get(long kind, long p, long e) {
+    std::vector<long> key{kind, p, e};
+    {
+        HELIB_SHARED_GUARD(mx);
+        auto it = polynomials.find(key);
+        if (it != polynomials.end())
+            return it->second;
+    }
 
-    // Multiply by topInv modulo p to make into a monic polynomial
-    poly *= topInv;
-    for (long i=0; i<=n*k; i++) rem(poly[i], poly[i], NTL::to_ZZ(p));
-    poly.normalize();
+    // Build outside of the lock, entries are never erased so references stay valid
+    NTL::ZZX polynomial;
+    if (kind == 0)
+        buildLiftingPolynomial(polynomial, p, e);
+    else
+        buildChenHanPolynomial(polynomial, p, e);
+    HELIB_EXCLUSIVE_GUARD(mx);
+    return polynomials.emplace(key, polynomial).first->second;
+}
 
-    y = recursivePolyEval(poly, k, babyStep, giantStep, p, subDepth1);
-    if (verbose) {
-      std::cerr << "  recursivePolyEval("<<poly<<") returns "<<y<<", depth="<<subDepth1<<std::endl;
-      if (y != polyEvalMod(poly,babyStep[0], p)) {
-        std::stringstream ss;
-        ss << "## recursive call failed, ret="<<y<<"!="
-          << polyEvalMod(poly,babyStep[0], p);
-        throw RuntimeError(ss.get());
-      }
-    }
-    y = MulMod(y, top, p); // multiply by the original top coefficient
-  }
-  else {
-    y = recursivePolyEval(poly, k, babyStep, giantStep, p, subDepth1);
-    if (verbose) {
-      std::cerr << "  recursivePolyEval("<<poly<<") returns "<<y<<", depth="<<subDepth1<<std::endl;
-      if (y != polyEvalMod(poly,babyStep[0], p)) {
-        std::stringstream ss;
-        ss << "## recursive call failed, ret="<<y<<"!="
-          << polyEvalMod(poly,babyStep[0], p);
-        throw RuntimeError(ss.get());
-      }
+// Same as customPolyEvalRecursive on simulated ciphertexts
+template <typename T>
+static void simulatePolyEvalRecursive(SimulatedCtxt<T>& result, const NTL::ZZ* coeff, long nb_coeff, const std::vector<SimulatedCtxt<T>>& xExp1, const std::vector<SimulatedCtxt<T>>& xExp2, int m, int k, RelinPolicy policy) {
+    if (nb_coeff == 0) {
+        result.clear();
+        return;
+    } else if (m == 0) {
+        linearCombination(result, xExp1.data(), coeff, nb_coeff);
+        return;
     }
-  }
 
-  if (extra != 0) { // if we added a term, now is the time to subtract back
-    if (verbose) std::cerr << ", subtracting "<<extra<<"*X^"<<k*n;
-    extra = MulMod(extra, giantStep.getPower(n), p);
-    totalDepth = max(subDepth1, giantStep.getDepth(n));
-    y = SubMod(y, extra, p);
-  }
-  else totalDepth = subDepth1;
-  if (verbose) std::cerr << std::endl;
-  return y;
+    SimulatedCtxt<T> tmp(result);
+    long index = std::min<long>(k * (1L << (m - 1)), nb_coeff);
+    simulatePolyEvalRecursive(result, coeff, index, xExp1, xExp2, m - 1, k, policy);
+    simulatePolyEvalRecursive(tmp, coeff + index, nb_coeff - index, xExp1, xExp2, m - 1, k, policy);
+    if (tmp.isEmpty())
+        return;
+    tmp.multiplyBy(xExp2[m - 1], policy);
+    result.addCtxt(tmp);
 }
-#endif
 
-// Read polynomial from file and store it in the given variable
-void parsePolynomial(NTL::ZZX& poly_result, const char* fileName) {
-  std::ifstream indata(fileName);
-  assertTrue((bool)indata, "Polynomial file does not exist.");
-
-  poly_result = NTL::ZZX();
-  int index = 0;
-  while (indata) {
-    std::string tmp;
-    indata >> tmp;
-    if (!tmp.empty())
-      SetCoeff(poly_result, index++, NTL::to_ZZ(tmp.c_str()));
-  }
-}
+// Same schedule and relinearizations as evaluate, without the prime dropping that plaintexts do not need
+template <typename T>
+void PolyEvalPlan::simulate(std::vector<SimulatedCtxt<T>>& result, const SimulatedCtxt<T>& element) const {
+    assertEq(ptxtSpace % element.getPtxtSpace(), 0l, "Plan was built for an incompatible plaintext space");
+
+    SimulatedCtxt<T> new_element(element);
+    new_element.reLinearize();
+    new_element.power(spacing);
+
+    std::vector<SimulatedCtxt<T>> xExp1{new_element};
+    for (const BabyStep& step : babySteps) {
+        xExp1.push_back(new_element);
+        if (step.ind1 == 0) {
+            xExp1.back().clear();   // Never used
+            continue;
+        }
+        xExp1[step.ind1 - 1].reLinearize();
+        xExp1[step.ind2 - 1].reLinearize();
+        xExp1.back() = xExp1[step.ind1 - 1];
+        xExp1.back().multiplyBy(xExp1[step.ind2 - 1], policy);
+    }
+    if (parameters.m != 0)
+        xExp1.back().reLinearize();
 
-// Note that we store the polynomials in a global variable, which is bad practice
-int init_polynomials() {
-  for (long index = 0; index < nb_primes; index++) {
-    for (long inner_index = 0; inner_index < nb_e_inner; inner_index++) {
-      for (long e = e_inner_list[inner_index] + 1;; e++) {  // Load polynomials starting from precision = e_inner + 1
-        std::stringstream stream1, stream2, stream3;
-        stream1 << primes_list[index]; stream2 << e_inner_list[inner_index]; stream3 << e;
-        std::string str1(stream1.str()), str2(stream2.str()), str3(stream3.str());
-
-        std::string fileName((std::string("polynomials/poly") + str1 + std::string("_") + str2 + std::string("_") + str3 + std::string(".txt")).c_str());
-        std::ifstream indata(fileName.c_str());
-        if (!indata)
-          break;
-
-        NTL::ZZX result;
-        parsePolynomial(result, fileName.c_str());
-        polynomial_vector[index][inner_index].push_back(result);
-      }
+    std::vector<SimulatedCtxt<T>> xExp2{xExp1.back()};
+    for (int exp = 1; exp < parameters.m; exp++) {
+        SimulatedCtxt<T> tmp(xExp2.back());
+        tmp.square();
+        xExp2.push_back(std::move(tmp));
     }
-  }
-  return 0;
-}
 
-int nb_relin = 0;
+    result.assign(size(), new_element);
+    for (long index = 0; index < size(); index++) {
+        const std::vector<NTL::ZZ>& coeff_list = coefficients[index];
+        simulatePolyEvalRecursive(result[index], coeff_list.data(), coeff_list.size(), xExp1, xExp2, parameters.m, parameters.k, policy);
+        if (constants[index] != 0)
+            result[index].addConstant(constants[index]);
+        if (policy != RelinPolicy::Deferred)
+            result[index].reLinearize();
+    }
+}
 
-#include "Magma_define.h"
+template void PolyEvalPlan::simulate(std::vector<SimulatedCtxt<long>>& result, const SimulatedCtxt<long>& element) const;
+template void PolyEvalPlan::simulate(std::vector<SimulatedCtxt<NTL::ZZ>>& result, const SimulatedCtxt<NTL::ZZ>& element) const;
 
-static int ignore_this_var = init_polynomials();
 
 } // namespace helib
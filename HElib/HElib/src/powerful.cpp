@@ -14,6 +14,9 @@
  */
 
 #include <helib/powerful.h>
+#include <helib/opCounters.h>
+
+#include "crtTable.h"
 
 namespace helib {
 
@@ -145,8 +148,24 @@ static void recursiveReduce(const CubeSlice<NTL::zz_p>& s,
   if (numDims == 1)
     return;
 
-  for (long i = 0; i < deg0; i++)
-    recursiveReduce(CubeSlice<NTL::zz_p>(s, i), cycVec, d + 1, tmp1, tmp2);
+  if (d > 0) {
+    for (long i = 0; i < deg0; i++)
+      recursiveReduce(CubeSlice<NTL::zz_p>(s, i), cycVec, d + 1, tmp1, tmp2);
+    return;
+  }
+
+  // The slices of the first dimension are reduced in parallel
+  NTL::zz_pContext context;
+  context.save();
+  HELIB_EXEC_INDEX(deg0, i)
+  NTL::zz_pPush push(context);
+  NTL::zz_pX sliceTmp1, sliceTmp2;
+  recursiveReduce(CubeSlice<NTL::zz_p>(s, i),
+                  cycVec,
+                  d + 1,
+                  sliceTmp1,
+                  sliceTmp2);
+  HELIB_EXEC_INDEX_END
 }
 
 PowerfulTranslationIndexes::PowerfulTranslationIndexes(
@@ -306,49 +325,81 @@ PowerfulDCRT::PowerfulDCRT(const Context& _context,
   }
 }
 
+// The number of primes of pConvVec whose product has target_bits bits
+long PowerfulDCRT::numPrimesFor(long target_bits) const
+{
+  long n = product_bits.length();
+  long m = 1;
+  while (m <= n && product_bits[m - 1] < target_bits)
+    m++;
+  return m;
+}
+
 void PowerfulDCRT::ZZXtoPowerful(NTL::Vec<NTL::ZZ>& out,
                                  const NTL::ZZX& poly) const
+{
+  if (triv) {
+    NTL::VectorCopy(out, poly, context.getPhiM());
+    return;
+  }
+
+  std::vector<NTL::Vec<NTL::ZZ>> outs;
+  ZZXtoPowerful(outs, std::vector<const NTL::ZZX*>{&poly});
+  out = std::move(outs[0]);
+}
+
+void PowerfulDCRT::ZZXtoPowerful(
+    std::vector<NTL::Vec<NTL::ZZ>>& outs,
+    const std::vector<const NTL::ZZX*>& polys) const
 {
   long phim = context.getPhiM();
+  long nPolys = polys.size();
+  outs.resize(nPolys);
 
   if (triv) {
-    NTL::VectorCopy(out, poly, phim);
+    for (long t : range(nPolys))
+      NTL::VectorCopy(outs[t], *polys[t], phim);
     return;
   }
 
   long max_sz = 0;
-  for (const NTL::ZZ& coeff : poly.rep) {
-    long sz = coeff.size();
-    if (max_sz < sz)
-      max_sz = sz;
-  }
-
-  long target_bits = max_sz * NTL_ZZ_NBITS + to_pwfl_excess_bits;
-
-  long n = product_bits.length();
-  long m = 1;
-  while (m <= n && product_bits[m - 1] < target_bits)
-    m++;
+  for (const NTL::ZZX* poly : polys)
+    for (const NTL::ZZ& coeff : poly->rep) {
+      long sz = coeff.size();
+      if (max_sz < sz)
+        max_sz = sz;
+    }
 
-  if (m > n)
+  long m = numPrimesFor(max_sz * NTL_ZZ_NBITS + to_pwfl_excess_bits);
+  if (m > product_bits.length())
     throw LogicError("ZZXtoPowerful: not enough primes");
 
+  // The conversions mod every prime of every polynomial, in parallel
+  std::vector<NTL::Vec<NTL::zz_p>> residues(m * nPolys);
+  HELIB_EXEC_INDEX(m * nPolys, it)
+  long i = it / nPolys;
+  long t = it % nPolys;
+  NTL::zz_pPush push; // backup NTL's current modulus
+  pConvVec[i].restoreModulus();
+  NTL::zz_pX oneRowPoly;
+  NTL::conv(oneRowPoly, *polys[t]);
+  HyperCube<NTL::zz_p> oneRowPwrfl(indexes.shortSig);
+  pConvVec[i].polyToPowerful(oneRowPwrfl, oneRowPoly);
+  residues[it] = oneRowPwrfl.getData();
+  HELIB_EXEC_INDEX_END
+
+  // The CRT of every polynomial, in parallel
+  HELIB_EXEC_INDEX(nPolys, t)
   NTL::zz_pPush push; // backup NTL's current modulus
   NTL::ZZ product{1};
-
   NTL::Vec<NTL::ZZ> res;
   res.SetLength(phim);
-
   for (long i : range(m)) {
     pConvVec[i].restoreModulus();
-    NTL::zz_pX oneRowPoly;
-    NTL::conv(oneRowPoly, poly);
-    HyperCube<NTL::zz_p> oneRowPwrfl(indexes.shortSig);
-    pConvVec[i].polyToPowerful(oneRowPwrfl, oneRowPoly);
-    NTL::CRT(res, product, oneRowPwrfl.getData());
+    NTL::CRT(res, product, residues[i * nPolys + t]);
   }
-
-  out = res;
+  outs[t] = std::move(res);
+  HELIB_EXEC_INDEX_END
 }
 
 void PowerfulDCRT::powerfulToZZX(NTL::ZZX& poly,
@@ -359,35 +410,58 @@ void PowerfulDCRT::powerfulToZZX(NTL::ZZX& poly,
     return;
   }
 
-  long max_sz = 0;
-  for (const NTL::ZZ& coeff : powerful) {
-    long sz = coeff.size();
-    if (max_sz < sz)
-      max_sz = sz;
-  }
+  std::vector<NTL::ZZX> polys;
+  powerfulToZZX(polys, std::vector<const NTL::Vec<NTL::ZZ>*>{&powerful});
+  poly = std::move(polys[0]);
+}
 
-  long target_bits = max_sz * NTL_ZZ_NBITS + to_poly_excess_bits;
+void PowerfulDCRT::powerfulToZZX(
+    std::vector<NTL::ZZX>& polys,
+    const std::vector<const NTL::Vec<NTL::ZZ>*>& powerful) const
+{
+  long nPolys = powerful.size();
+  polys.resize(nPolys);
 
-  long n = product_bits.length();
-  long m = 1;
-  while (m <= n && product_bits[m - 1] < target_bits)
-    m++;
+  if (triv) {
+    for (long t : range(nPolys))
+      NTL::conv(polys[t], *powerful[t]);
+    return;
+  }
 
-  if (m > n)
+  long max_sz = 0;
+  for (const NTL::Vec<NTL::ZZ>* pwfl : powerful)
+    for (const NTL::ZZ& coeff : *pwfl) {
+      long sz = coeff.size();
+      if (max_sz < sz)
+        max_sz = sz;
+    }
+
+  long m = numPrimesFor(max_sz * NTL_ZZ_NBITS + to_poly_excess_bits);
+  if (m > product_bits.length())
     throw LogicError("powerfulToZZX: not enough primes");
 
+  // The conversions mod every prime of every vector, in parallel
+  std::vector<NTL::zz_pX> residues(m * nPolys);
+  HELIB_EXEC_INDEX(m * nPolys, it)
+  long i = it / nPolys;
+  long t = it % nPolys;
+  NTL::zz_pPush push; // backup NTL's current modulus
+  pConvVec[i].restoreModulus();
+  HyperCube<NTL::zz_p> oneRowPwrfl(indexes.shortSig);
+  NTL::conv(oneRowPwrfl.getData(), *powerful[t]);
+  pConvVec[i].powerfulToPoly(residues[it], oneRowPwrfl);
+  HELIB_EXEC_INDEX_END
+
+  // The CRT of every polynomial, in parallel
+  HELIB_EXEC_INDEX(nPolys, t)
   NTL::zz_pPush push; // backup NTL's current modulus
-  clear(poly);
   NTL::ZZ product{1};
-
+  clear(polys[t]);
   for (long i : range(m)) {
     pConvVec[i].restoreModulus();
-    HyperCube<NTL::zz_p> oneRowPwrfl(indexes.shortSig);
-    NTL::conv(oneRowPwrfl.getData(), powerful);
-    NTL::zz_pX oneRowPoly;
-    pConvVec[i].powerfulToPoly(oneRowPoly, oneRowPwrfl);
-    NTL::CRT(poly, product, oneRowPoly);
+    NTL::CRT(polys[t], product, residues[i * nPolys + t]);
   }
+  HELIB_EXEC_INDEX_END
 }
 
 void PowerfulDCRT::dcrtToPowerful(NTL::Vec<NTL::ZZ>& powerful,
@@ -404,11 +478,49 @@ void PowerfulDCRT::dcrtToPowerful(NTL::Vec<NTL::ZZ>& powerful,
 
   NTL::Vec<NTL::ZZ> pwfl;
   this->ZZXtoPowerful(pwfl, poly);
-  NTL::ZZ Q = context.productOfPrimes(dcrt.getIndexSet());
+  const NTL::ZZ& Q = context.getCRTTable(dcrt.getIndexSet()).product;
   vecRed(powerful, pwfl, Q, /*abs=*/false);
   // reduce to interval [-Q/2,+Q/2]
 }
 
+void PowerfulDCRT::dcrtToPowerful(
+    std::vector<NTL::Vec<NTL::ZZ>>& powerful,
+    const std::vector<const DoubleCRT*>& dcrts) const
+{
+  long n = dcrts.size();
+  powerful.resize(n);
+  if (n == 0)
+    return;
+
+  const IndexSet& s = dcrts[0]->getIndexSet();
+  for (const DoubleCRT* dcrt : dcrts)
+    if (dcrt->getIndexSet() != s) { // cannot batch, convert one by one
+      for (long i : range(n))
+        dcrtToPowerful(powerful[i], *dcrts[i]);
+      return;
+    }
+
+  std::vector<NTL::ZZX> polys(n);
+  std::vector<NTL::ZZX*> polyPtrs(n);
+  for (long i : range(n))
+    polyPtrs[i] = &polys[i];
+  DoubleCRT::toPolys(polyPtrs, dcrts, s);
+
+  if (triv) {
+    long phim = context.getPhiM();
+    for (long i : range(n))
+      NTL::VectorCopy(powerful[i], polys[i], phim);
+    return;
+  }
+
+  std::vector<NTL::Vec<NTL::ZZ>> pwfls;
+  std::vector<const NTL::ZZX*> constPolyPtrs(polyPtrs.begin(), polyPtrs.end());
+  this->ZZXtoPowerful(pwfls, constPolyPtrs);
+  const NTL::ZZ& Q = context.getCRTTable(s).product;
+  for (long i : range(n))
+    vecRed(powerful[i], pwfls[i], Q, /*abs=*/false);
+}
+
 /********************************************************************/
 /****************    UNUSED CODE - COMMENTED OUT   ******************/
 /********************************************************************/
@@ -15,15 +15,24 @@
  */
 #include <climits>
 #include <cmath>
+#include <cstdio>
+#include <cstdlib>
 #include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <thread>
 #include <helib/primeChain.h>
 #include <helib/Context.h>
 #include <helib/sample.h>
 #include "binio.h"
 #include <helib/fhe_stats.h>
 #include <helib/log.h>
+#include <helib/opCounters.h>
 
 #include "io.h"
+#include "PrimeGenerator.h"
 
 namespace helib {
 
@@ -366,4 +375,234 @@ void ModuliSizes::read(std::istream& str)
     ::helib::read(str, sizes[i]);
 }
 
+
+namespace {
+
+using PrimeKey = std::pair<long, long>; // m, len
+
+struct PrimeRegistry
+{
+  std::mutex mx;
+  // The primes of PrimeGenerator(len, m), in the order next() returns them
+  std::map<PrimeKey, std::vector<long>> primes;
+  std::string directory; // set by setPrimeCacheDirectory
+  bool directorySet = false;
+};
+
+PrimeRegistry& primeRegistry()
+{
+  static PrimeRegistry instance;
+  return instance;
+}
+
+std::string primeDirectory(const PrimeRegistry& reg)
+{
+  if (reg.directorySet)
+    return reg.directory;
+  const char* env = std::getenv("HELIB_PRIME_CACHE");
+  return env != nullptr ? env : "";
+}
+
+std::string primeFileName(const std::string& dir, const PrimeKey& key)
+{
+  return dir + "/primes_" + std::to_string(key.first) + "_" +
+         std::to_string(key.second) + ".txt";
+}
+
+// Whether q has the form of the primes of PrimeGenerator(len, m)
+bool fitsGenerator(long q, const PrimeKey& key)
+{
+  long m = key.first;
+  long len = key.second;
+  return q >= (1L << len) - (1L << (len - PrimeGenerator::B)) &&
+         q < (1L << len) && (q - 1) % m == 0;
+}
+
+// The cached primes of key, read from the directory on first use. A file
+// that does not fit the key is ignored from the first entry that does not.
+std::vector<long>& cachedPrimes(PrimeRegistry& reg, const PrimeKey& key)
+{
+  auto it = reg.primes.find(key);
+  if (it != reg.primes.end())
+    return it->second;
+
+  std::vector<long>& primes = reg.primes[key];
+  std::string dir = primeDirectory(reg);
+  if (!dir.empty()) {
+    std::ifstream file(primeFileName(dir, key));
+    long q;
+    while (file >> q && fitsGenerator(q, key))
+      primes.push_back(q);
+  }
+  return primes;
+}
+
+// Write the primes of key through a temporary file, so that concurrent
+// processes never read a partial one
+void savePrimes(const PrimeRegistry& reg,
+                const PrimeKey& key,
+                const std::vector<long>& primes)
+{
+  std::string dir = primeDirectory(reg);
+  if (dir.empty())
+    return;
+  std::string name = primeFileName(dir, key);
+  std::string tmp =
+      name + "." +
+      std::to_string(
+          std::chrono::steady_clock::now().time_since_epoch().count()) +
+      "." +
+      std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+  {
+    std::ofstream file(tmp);
+    for (long q : primes)
+      file << q << "\n";
+    if (!file) {
+      Warning("could not write the prime cache " + name);
+      return;
+    }
+  }
+  std::rename(tmp.c_str(), name.c_str());
+}
+
+} // namespace
+
+void setPrimeCacheDirectory(const std::string& dir)
+{
+  PrimeRegistry& reg = primeRegistry();
+  std::lock_guard<std::mutex> lock(reg.mx);
+  reg.directory = dir;
+  reg.directorySet = true;
+  reg.primes.clear();
+}
+
+std::string getPrimeCacheDirectory()
+{
+  PrimeRegistry& reg = primeRegistry();
+  std::lock_guard<std::mutex> lock(reg.mx);
+  return primeDirectory(reg);
+}
+
+void clearPrimeCache()
+{
+  PrimeRegistry& reg = primeRegistry();
+  std::lock_guard<std::mutex> lock(reg.mx);
+  reg.primes.clear();
+}
+
+long PrimeGenerator::nextCandidate()
+{
+  // we consider all odd t in the interval
+  // [ (1-1/2^B)*2^len-1)/(2^k*m), (2^len-1)/(2^k*m) ).
+  // For k satisfying 2^{len-B} >= 2^k*m, this interval is
+  // contains at least one integer.
+  // It is equivalent to consider the interval of integers
+  // [t_lower_bound, t_upper_bound),
+  // where t_lower_bound = ceil(((1-1/2^B)*2^len-1)/(2^k*m))
+  // and t_upper_bound = ceil((2^len-1)/(2^k*m)).
+
+  long t_upper_bound = divc((1L << len) - 1, m << k);
+
+  for (;;) {
+
+    t++;
+
+    if (t >= t_upper_bound) {
+      // move to smaller value of k, reset t and t_upper_bound
+
+      // we run k down to 0  if m is even, and down to 1
+      // if m is odd.
+      long k_lower_bound = (m % 2 == 0) ? 0 : 1;
+      if (k - 1 < k_lower_bound)
+        return 0;
+
+      k--;
+      t = divc((1L << len) - (1L << (len - B)) - 1, m << k);
+      t_upper_bound = divc((1L << len) - 1, m << k);
+    }
+
+    if (t % 2 == 0)
+      continue; // we only want to consider odd t
+
+    long cand = ((t * m) << k) + 1; // = 2^k*t*m + 1
+
+    // double check that cand is in the prescribed interval
+    assertInRange(cand,
+                  (1L << len) - (1L << (len - B)),
+                  1L << len,
+                  "Candidate cand is not in the prescribed interval");
+    return cand;
+  }
+}
+
+void PrimeGenerator::resumeAfter(long q)
+{
+  // (q-1)/m = 2^k*t with t odd
+  long u = (q - 1) / m;
+  k = 0;
+  while (u % 2 == 0) {
+    u /= 2;
+    k++;
+  }
+  t = u;
+}
+
+long PrimeGenerator::next()
+{
+  PrimeRegistry& reg = primeRegistry();
+  PrimeKey key(m, len);
+  long q = 0;
+  {
+    std::lock_guard<std::mutex> lock(reg.mx);
+    const std::vector<long>& primes = cachedPrimes(reg, key);
+    if (served < lsize(primes))
+      q = primes[served];
+  }
+
+  if (q == 0) {
+    // Test blocks of the next candidates in parallel until one of them has
+    // a prime
+    const long blockSize = std::max(64L, 16 * availableThreads());
+    std::vector<long> found;
+    bool exhausted = false;
+    while (found.empty()) {
+      if (exhausted)
+        throw RuntimeError("Prime generator ran out of primes");
+      std::vector<long> cands;
+      while (lsize(cands) < blockSize) {
+        long cand = nextCandidate();
+        if (cand == 0) {
+          exhausted = true;
+          break;
+        }
+        cands.push_back(cand);
+      }
+
+      std::vector<char> isPrime(cands.size());
+      HELIB_EXEC_RANGE(lsize(cands), first, last)
+      for (long i : range(first, last))
+        isPrime[i] = NTL::ProbPrime(cands[i], 60);
+      // iteration count == 60 implies 2^{-120} error probability
+      HELIB_EXEC_RANGE_END
+
+      for (long i : range(lsize(cands)))
+        if (isPrime[i])
+          found.push_back(cands[i]);
+    }
+    q = found[0];
+
+    // Another generator may have cached the same primes in the meantime
+    std::lock_guard<std::mutex> lock(reg.mx);
+    std::vector<long>& primes = cachedPrimes(reg, key);
+    if (lsize(primes) == served) {
+      primes.insert(primes.end(), found.begin(), found.end());
+      savePrimes(reg, key, primes);
+    }
+  }
+
+  served++;
+  resumeAfter(q);
+  return q;
+}
+
 } // namespace helib
@@ -0,0 +1,233 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <helib/primeFactorFFT.h>
+
+#include <helib/assertions.h>
+#include <helib/bluestein.h>
+#include <helib/opCounters.h>
+#include <helib/timing.h>
+
+namespace helib {
+
+// The estimated number of mulmods of BluesteinFFT of length n: a forward and
+// an inverse truncated FFT of length 2^k, the pointwise product and the
+// multiplications by the powers before and after
+static double bluesteinCost(long n)
+{
+  long k = NTL::NextPowerOfTwo(2 * n - 1);
+  return double(k + 1) * double(1L << k) + 2.0 * n;
+}
+
+// A direct product by the DFT matrix for tiny n, BluesteinFFT otherwise (with
+// the copies into and out of a zz_pX)
+static bool useDirect(long n) { return n * n <= bluesteinCost(n) + 2 * n; }
+
+static double dimensionCost(long n)
+{
+  return useDirect(n) ? double(n * n) : bluesteinCost(n) + 2.0 * n;
+}
+
+static double primeFactorCost(long m, const std::vector<long>& factors)
+{
+  double cost = 2.0 * m; // the input and output permutations
+  for (long n : factors)
+    cost += double(m / n) * dimensionCost(n);
+  return cost;
+}
+
+// Every grouping of pps[i..] into the groups, which hold the products of the
+// prime powers assigned to them so far
+static void bestGrouping(long m,
+                         const std::vector<long>& pps,
+                         long i,
+                         std::vector<long>& groups,
+                         std::vector<long>& best,
+                         double& bestCost)
+{
+  if (i == lsize(pps)) {
+    double cost = primeFactorCost(m, groups);
+    if (cost < bestCost) {
+      bestCost = cost;
+      best = groups;
+    }
+    return;
+  }
+
+  for (long g = 0; g < lsize(groups); g++) {
+    groups[g] *= pps[i];
+    bestGrouping(m, pps, i + 1, groups, best, bestCost);
+    groups[g] /= pps[i];
+  }
+  groups.push_back(pps[i]);
+  bestGrouping(m, pps, i + 1, groups, best, bestCost);
+  groups.pop_back();
+}
+
+std::vector<long> PrimeFactorFFT::chooseFactors(long m)
+{
+  std::vector<long> best;
+  if (m % 2 == 0)
+    return best;
+
+  std::vector<long> pps;
+  pp_factorize(pps, m);
+  if (pps.size() < 2)
+    return best;
+
+  // Only take a grouping that is clearly faster, the estimates ignore the
+  // overheads of the transforms of the rows
+  double bestCost = 0.8 * bluesteinCost(m);
+  std::vector<long> groups;
+  bestGrouping(m, pps, 0, groups, best, bestCost);
+  if (best.size() < 2)
+    best.clear();
+  return best;
+}
+
+PrimeFactorFFT::PrimeFactorFFT(const std::vector<long>& factors,
+                               const NTL::zz_p& root)
+{
+  assertFalse<InvalidArgument>(factors.empty(), "No factors given");
+  m = 1;
+  for (long n : factors) {
+    assertTrue<InvalidArgument>(n > 1 && n % 2 == 1,
+                                "The factors must be odd and above 1");
+    assertEq<InvalidArgument>(NTL::GCD(m, n),
+                              1l,
+                              "The factors must be pairwise coprime");
+    m *= n;
+  }
+
+  long p = NTL::zz_p::modulus();
+  long r = lsize(factors);
+  dims.resize(r);
+  for (long d = r - 1; d >= 0; d--) {
+    Dimension& dim = dims[d];
+    dim.n = factors[d];
+    dim.stride = (d == r - 1) ? 1 : dims[d + 1].stride * dims[d + 1].n;
+
+    long cofactor = m / dim.n;
+    if (useDirect(dim.n)) {
+      NTL::zz_p w = power(root, 2 * cofactor); // of order n
+      dim.w.resize(dim.n);
+      dim.wPrecon.resize(dim.n);
+      NTL::zz_p wt(1);
+      for (long t = 0; t < dim.n; t++) {
+        dim.w[t] = rep(wt);
+        dim.wPrecon[t] = NTL::PrepMulModPrecon(dim.w[t], p);
+        wt *= w;
+      }
+    } else {
+      // BluesteinFFT takes the DFT with the square of its root
+      dim.blueRoot = power(root, cofactor);
+      dim.Rb.reset(new NTL::fftRep);
+      BluesteinInit(dim.n, dim.blueRoot, dim.powers, dim.powers_aux, *dim.Rb);
+    }
+  }
+
+  // Position i of the row-major layout has the digits t_d = (i/stride_d) % n_d:
+  // it takes the input of exponent j with j = t_d mod n_d for all d, and its
+  // output is the one of exponent sum_d t_d m/n_d mod m
+  std::vector<long> idempotents(r);
+  for (long d = 0; d < r; d++) {
+    long cofactor = m / dims[d].n;
+    idempotents[d] =
+        NTL::MulMod(cofactor, NTL::InvMod(cofactor % dims[d].n, dims[d].n), m);
+  }
+  inMap.resize(m);
+  outMap.resize(m);
+  for (long i = 0; i < m; i++) {
+    long in = 0;
+    long out = 0;
+    for (long d = 0; d < r; d++) {
+      long t = (i / dims[d].stride) % dims[d].n;
+      in = NTL::AddMod(in, NTL::MulMod(t, idempotents[d], m), m);
+      out = NTL::AddMod(out, t * (m / dims[d].n), m);
+    }
+    inMap[i] = in;
+    outMap[i] = out;
+  }
+}
+
+void PrimeFactorFFT::transform(long* a, const Dimension& dim) const
+{
+  long p = NTL::zz_p::modulus();
+  long n = dim.n;
+  long stride = dim.stride;
+  long block = n * stride;
+
+  // The lines along the dimension are the slices of the hypercube, and are
+  // transformed in parallel. The workers need the zz_p modulus for
+  // BluesteinFFT.
+  NTL::zz_pContext context;
+  context.save();
+  HELIB_EXEC_RANGE(m / n, first, last)
+  NTL::zz_pPush push(context);
+  NTL_THREAD_LOCAL static std::vector<long> line;
+  NTL_THREAD_LOCAL static NTL::zz_pX poly;
+  line.resize(n);
+
+  for (long l = first; l < last; l++) {
+    long* ap = a + (l / stride) * block + (l % stride);
+
+    if (!dim.w.empty()) {
+      for (long j = 0; j < n; j++)
+        line[j] = ap[j * stride];
+      for (long k = 0; k < n; k++) {
+        long acc = 0;
+        for (long j = 0, e = 0; j < n; j++) { // e = j*k mod n
+          acc = NTL::AddMod(
+              acc,
+              NTL::MulModPrecon(line[j], dim.w[e], p, dim.wPrecon[e]),
+              p);
+          e += k;
+          if (e >= n)
+            e -= n;
+        }
+        ap[k * stride] = acc;
+      }
+      continue;
+    }
+
+    poly.rep.SetLength(n);
+    for (long j = 0; j < n; j++)
+      poly.rep[j].LoopHole() = ap[j * stride];
+    poly.normalize();
+    BluesteinFFT(poly, n, dim.blueRoot, dim.powers, dim.powers_aux, *dim.Rb);
+    for (long j = 0; j < n; j++)
+      ap[j * stride] = rep(coeff(poly, j));
+  }
+  HELIB_EXEC_RANGE_END
+}
+
+void PrimeFactorFFT::apply(long* y, const NTL::zz_pX& x) const
+{
+  HELIB_TIMER_START;
+  NTL_THREAD_LOCAL static std::vector<long> scratch;
+  scratch.resize(m);
+  long* a = scratch.data();
+
+  long dx = deg(x);
+  const NTL::zz_p* xp = x.rep.elts();
+  for (long i = 0; i < m; i++) {
+    long e = inMap[i];
+    a[i] = (e <= dx) ? rep(xp[e]) : 0;
+  }
+
+  for (const Dimension& dim : dims)
+    transform(a, dim);
+
+  for (long i = 0; i < m; i++)
+    y[outMap[i]] = a[i];
+}
+
+} // namespace helib
@@ -23,12 +23,27 @@
 #include <helib/debugging.h>
 #include <helib/fhe_stats.h>
 #include <helib/log.h>
+#include <helib/memoryStats.h>
+#include <helib/opCounters.h>
 #include <helib/polyEval.h>
+#include <helib/polyBundle.h>
+#include <helib/digitProgram.h>
+#include <helib/autotune.h>
+#include <helib/digitSimulation.h>
+#include <helib/fixedProgram.h>
+#include <helib/automorphPrecon.h>
+#include <helib/ResidueArena.h>
+#include "binio.h"
 
 #include <algorithm>
+#include <map>
 #include <math.h>
 #include <cmath>
 #include <chrono>
+#include <ctime>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
 
 #ifdef HELIB_DEBUG
 
@@ -54,13 +69,24 @@ static void checkRecryptBounds_v(const std::vector<NTL::ZZX>& v,
                                  const DoubleCRT& sKey,
                                  const Context& context,
                                  long q);
+
+// The zzX parts of the bootstrapping code, multiplied by factor, as ZZX's
+static std::vector<NTL::ZZX> toZZXParts(const std::vector<zzX>& parts,
+                                        long factor = 1)
+{
+  std::vector<NTL::ZZX> res(parts.size());
+  for (std::size_t i = 0; i < parts.size(); i++) {
+    convert(res[i], parts[i]);
+    res[i] *= factor;
+  }
+  return res;
+}
 } // namespace helib
 
 #endif // HELIB_DEBUG
 
 namespace helib {
 
-#include "Magma_declare.h"
 
 // Return in poly a polynomial with X^i encoded in all the slots
 static void x2iInSlots(NTL::ZZX& poly,
@@ -144,6 +170,63 @@ static void newMakeDivisible(NTL::ZZX& poly,
 #endif
 }
 
+// The same for the zzX parts returned by rawModSwitch, followed by the
+// division by p2e. When the powerful basis is the polynomial basis and
+// z + v*q fits in a long, this is a plain loop over the coefficients with no
+// ZZ, otherwise it goes through the ZZX version above.
+static void newMakeDivisibleAndDivide(zzX& poly,
+                                      long p2e,
+                                      long q,
+                                      const Context& context,
+                                      zzX& vpoly)
+{
+  assertTrue<InvalidArgument>(q > 0l, "q must be positive");
+  assertTrue<InvalidArgument>(p2e > 0l, "p2e must be positive");
+
+  const PowerfulDCRT& p2d_conv = *context.getRcData().p2dConv;
+  if (!p2d_conv.isTrivial() || double(q) * (p2e + 1) >= double(1L << 62)) {
+    NTL::ZZX zzPoly, zzV;
+    convert(zzPoly, poly);
+    newMakeDivisible(zzPoly, p2e, q, context, zzV);
+    zzPoly /= p2e;
+    convert(poly, zzPoly);
+    convert(vpoly, zzV);
+    return;
+  }
+
+  vpoly.SetLength(0);
+  if (p2e == 1)
+    return;
+
+  assertEq<InvalidArgument>(q % p2e, 1l, "q must equal 1 modulo p2e");
+
+  long p = context.getP();
+#ifdef HELIB_DEBUG
+  vpoly.SetLength(poly.length());
+#endif
+
+  for (long i : range(poly.length())) {
+    long z = poly[i];
+
+    // What to add to z to make it divisible by p2e? The same balanced
+    // choice as in the ZZX version
+    long zMod = mcMod(z, p2e); // zMod is in [0,p2e-1]
+    if (zMod > p2e / 2 || (p == 2 && zMod == p2e / 2 && NTL::RandomBnd(2)))
+      zMod = p2e - zMod;
+    else
+      zMod = -zMod;
+    long v = zMod;
+    z += q * v; // z is now divisible by p2e
+
+    assertEq(z % p2e, 0l, "newMakeDivisibleAndDivide: z not divisible");
+    poly[i] = z / p2e;
+
+#ifdef HELIB_DEBUG
+    vpoly[i] = v;
+#endif
+  }
+}
+
 /*********************************************************************/
 /*********************************************************************/
 
@@ -206,6 +289,18 @@ static double compute_fudge(long p2ePrime, long p2e)
   return 1 + eps;
 }
 
+// The largest e such that p^e+1 < 2^30
+static long largestRecryptionE(long p)
+{
+  long e_bnd = 0;
+  long p2e_bnd = 1;
+  while (p2e_bnd <= ((1L << 30) - 2) / p) { // NOTE: this avoids overflow
+    e_bnd++;
+    p2e_bnd *= p;
+  }
+  return e_bnd;
+}
+
 void RecryptData::setAE(long& e, long& ePrime, const Context& context)
 {
   double coeff_bound = context.boundForRecryption();
@@ -217,13 +312,7 @@ void RecryptData::setAE(long& e, long& ePrime, const Context& context)
   long r = context.getAlMod().getR();
   long frstTerm = 2 * p2r + 2;
 
-  long e_bnd = 0;
-  long p2e_bnd = 1;
-  while (p2e_bnd <= ((1L << 30) - 2) / p) { // NOTE: this avoids overflow
-    e_bnd++;
-    p2e_bnd *= p;
-  }
-  // e_bnd is largest e such that p^e+1 < 2^30
+  long e_bnd = largestRecryptionE(p);
 
   // Start with the smallest e s.t. p^e/2 >= frstTerm*coeff_bound
   ePrime = 0;
@@ -264,6 +353,82 @@ void RecryptData::setAE(long& e, long& ePrime, const Context& context)
 #endif
 }
 
+void RecryptData::setAE(long& e,
+                        long& ePrime,
+                        const Context& context,
+                        bool our_version,
+                        bool lazy)
+{
+  if (!our_version) {
+    setAE(e, ePrime, context);
+    return;
+  }
+
+  double coeff_bound = context.boundForRecryption();
+  long p = context.getP();
+  long p2r = context.getAlMod().getPPowR();
+  long r = context.getAlMod().getR();
+  long frstTerm = 2 * p2r + 2;
+  long e_bnd = largestRecryptionE(p);
+
+  // The cost of customExtractDigitsThin only depends on botHigh = e - e',
+  // so for every botHigh we keep the smallest e that satisfies the same
+  // bound as above. Once p^e is large enough for some e', every larger e is.
+  std::map<long, long> smallestE; // botHigh -> e
+  for (long ePrimeTry = 0; ePrimeTry < e_bnd; ePrimeTry++) {
+    long p2ePrimeTry = NTL::power_long(p, ePrimeTry);
+    long eTry = std::max(r + 1, ePrimeTry + 1);
+    for (; eTry <= e_bnd; eTry++) {
+      long p2eTry = NTL::power_long(p, eTry);
+      double noise = (ePrimeTry == 0)
+                         ? frstTerm
+                         : p2ePrimeTry * compute_fudge(p2ePrimeTry, p2eTry) +
+                               frstTerm;
+      if (p2eTry >= noise * coeff_bound * 2)
+        break;
+    }
+    // e' only grows, so emplace keeps the smallest e for every botHigh
+    for (; eTry <= e_bnd; eTry++)
+      smallestE.emplace(eTry - ePrimeTry, eTry);
+  }
+
+  assertFalse<RuntimeError>(smallestE.empty(),
+                            "setAE: cannot find suitable e");
+
+  // The trapezoid grows with botHigh, so the search stops at the first
+  // botHigh that is not cheaper than the best one in any respect
+  long bestMultiplications = 0;
+  long bestDepth = 0;
+  e = -1;
+  for (const auto& [botHigh, eTry] : smallestE) {
+    long multiplications, depth;
+    digitExtractionCost(multiplications,
+                        depth,
+                        context,
+                        botHigh,
+                        r,
+                        lazy,
+                        planDigitExtraction(context, botHigh, r, lazy));
+    if (e >= 0 && multiplications >= bestMultiplications &&
+        depth >= bestDepth)
+      break;
+
+    if (e < 0 || multiplications < bestMultiplications ||
+        (multiplications == bestMultiplications && depth < bestDepth)) {
+      bestMultiplications = multiplications;
+      bestDepth = depth;
+      e = eTry;
+      ePrime = eTry - botHigh;
+    }
+  }
+
+#ifdef HELIB_DEBUG
+  std::cerr << "RecryptData::setAE(): e=" << e << ", e'=" << ePrime
+            << " (" << bestMultiplications << " multiplications, depth "
+            << bestDepth << ")" << std::endl;
+#endif
+}
+
 bool RecryptData::operator==(const RecryptData& other) const
 {
   if (mvec != other.mvec)
@@ -280,13 +445,97 @@ void RecryptData::init(const Context& context,
                        const NTL::Vec<long>& mvec_,
                        bool enableThick,
                        bool build_cache_,
-                       bool minimal)
+                       bool minimal,
+                       long cacheBudget_,
+                       bool lazy_)
 {
   if (alMod != nullptr) { // were we called for a second time?
     std::cerr << "@Warning: multiple calls to RecryptData::init\n";
     return;
   }
 
+  lazy = lazy_;
+  initCommon(context, mvec_, enableThick, build_cache_);
+  cacheBudget = cacheBudget_;
+  budgetLeft = cacheBudget;
+  if (enableThick)
+    initThick(context, minimal);
+}
+
+void RecryptData::initThick(const Context& context,
+                            bool minimal,
+                            const LazyComponent<ThinEvalMap>* previous)
+{
+  // Initialize the linear polynomial for unpacking the slots
+  auto unpack = [this]() {
+    NTL::zz_pBak bak;
+    bak.save();
+    ea->getAlMod().restoreContext();
+    long nslots = ea->size();
+    long d = ea->getDegree();
+
+    const NTL::Mat<NTL::zz_p>& CBi =
+        ea->getDerived(PA_zz_p()).getNormalBasisMatrixInverse();
+
+    std::vector<NTL::ZZX> LM;
+    LM.resize(d);
+    for (long i = 0; i < d; i++) // prepare the linear polynomial
+      LM[i] = rep(CBi[i][0]);
+
+    std::vector<NTL::ZZX> C;
+    ea->buildLinPolyCoeffs(C, LM); // "build" the linear polynomial
+
+    auto encoding = std::make_shared<std::vector<NTL::ZZX>>(d);
+    for (long j = 0; j < d; j++) { // encode the coefficients
+      std::vector<NTL::ZZX> v(nslots);
+      for (long k = 0; k < nslots; k++)
+        v[k] = C[j];
+      ea->encode((*encoding)[j], v);
+    }
+    return std::shared_ptr<const std::vector<NTL::ZZX>>(encoding);
+  };
+
+  // With a budget, the maps take their share of it in a fixed order
+  bool inOrder = build_cache && cacheBudget >= 0;
+  auto first = [this, minimal, previous, inOrder]() {
+    if (inOrder && previous)
+      previous->get();
+    NTL::zz_pBak bak;
+    bak.save();
+    auto map = std::make_shared<EvalMap>(*ea, minimal, mvec, true, false);
+    if (build_cache)
+      map->upgradeWithin(budgetLeft);
+    return std::shared_ptr<const EvalMap>(map);
+  };
+  auto second = [this, &context, minimal, inOrder]() {
+    if (inOrder)
+      firstMap.get();
+    NTL::zz_pBak bak;
+    bak.save();
+    auto map =
+        std::make_shared<EvalMap>(context.getEA(), minimal, mvec, false, false);
+    if (build_cache)
+      map->upgradeWithin(budgetLeft);
+    return std::shared_ptr<const EvalMap>(map);
+  };
+
+  if (lazy) {
+    unpackSlotEncoding.defer(unpack);
+    firstMap.defer(first);
+    secondMap.defer(second);
+  } else {
+    unpackSlotEncoding = unpack();
+    firstMap = first();
+    secondMap = second();
+  }
+}
+
+void RecryptData::initCommon(const Context& context,
+                             const NTL::Vec<long>& mvec_,
+                             bool enableThick,
+                             bool build_cache_,
+                             const PAlgebraTables* tables)
+{
   // sanity check
   assertEq(computeProd(mvec_),
            context.getM(),
@@ -316,47 +565,70 @@ void RecryptData::init(const Context& context,
   long r = context.getAlMod().getR();
 
   // First part of Bootstrapping works wrt plaintext space p^{r'}
-  alMod = std::make_shared<PAlgebraMod>(context.getZMStar(), e - ePrime + r);
+  alMod = std::make_shared<PAlgebraMod>(context.getZMStar(),
+                                        e - ePrime + r,
+                                        tables);
   ea = std::make_shared<EncryptedArray>(context, *alMod);
   // Polynomial defaults to F0, PAlgebraMod explicitly given
 
-  p2dConv = std::make_shared<PowerfulDCRT>(context, mvec);
+  if (lazy)
+    p2dConv.defer([this, &context]() {
+      return std::make_shared<const PowerfulDCRT>(context, mvec);
+    });
+  else
+    p2dConv = std::make_shared<PowerfulDCRT>(context, mvec);
 
-  if (!enableThick)
-    return;
+  polyEvalPlans = std::make_shared<PolyEvalPlanCache>();
+  digitPolynomials = std::make_shared<DigitPolynomialCache>();
+  unpackConstants = std::make_shared<UnpackConstantCache>();
+}
 
-  // Initialize the linear polynomial for unpacking the slots
-  NTL::zz_pBak bak;
-  bak.save();
-  ea->getAlMod().restoreContext();
-  long nslots = ea->size();
-  long d = ea->getDegree();
+void RecryptData::writeTo(std::ostream& str) const
+{
+  write_ntl_vec_long(str, mvec);
+  write_raw_int(str, build_cache);
+  write_raw_int(str, alsoThick);
+  alMod->getTables().writeTo(str);
+  if (!alsoThick)
+    return;
 
-  const NTL::Mat<NTL::zz_p>& CBi =
-      ea->getDerived(PA_zz_p()).getNormalBasisMatrixInverse();
+  write_raw_int(str, unpackSlotEncoding->size());
+  for (const NTL::ZZX& poly : *unpackSlotEncoding) {
+    zzX coeffs;
+    convert(coeffs, poly);
+    write_ntl_vec_long(str, coeffs);
+  }
+  firstMap->writeTo(str);
+  secondMap->writeTo(str);
+}
 
-  std::vector<NTL::ZZX> LM;
-  LM.resize(d);
-  for (long i = 0; i < d; i++) // prepare the linear polynomial
-    LM[i] = rep(CBi[i][0]);
+void RecryptData::readFrom(const Context& context, std::istream& str)
+{
+  assertTrue(alMod == nullptr, "The recryption data is already initialized");
 
-  std::vector<NTL::ZZX> C;
-  ea->buildLinPolyCoeffs(C, LM); // "build" the linear polynomial
+  NTL::Vec<long> mvec_;
+  read_ntl_vec_long(str, mvec_);
+  bool build_cache_ = read_raw_int(str);
+  bool enableThick = read_raw_int(str);
+  PAlgebraTables tables = PAlgebraTables::readFrom(str);
 
-  unpackSlotEncoding.resize(d); // encode the coefficients
+  initCommon(context, mvec_, enableThick, build_cache_, &tables);
+  if (!enableThick)
+    return;
 
+  long d = read_raw_int(str);
+  assertEq<IOError>(d,
+                    ea->getDegree(),
+                    "Wrong number of slot-unpacking constants");
+  auto encoding = std::make_shared<std::vector<NTL::ZZX>>(d);
   for (long j = 0; j < d; j++) {
-    std::vector<NTL::ZZX> v(nslots);
-    for (long k = 0; k < nslots; k++)
-      v[k] = C[j];
-    ea->encode(unpackSlotEncoding[j], v);
+    zzX coeffs;
+    read_ntl_vec_long(str, coeffs);
+    convert((*encoding)[j], coeffs);
   }
-  firstMap = std::make_shared<EvalMap>(*ea, minimal, mvec, true, build_cache);
-  secondMap = std::make_shared<EvalMap>(context.getEA(),
-                                        minimal,
-                                        mvec,
-                                        false,
-                                        build_cache);
+  unpackSlotEncoding = encoding;
+  firstMap = std::make_shared<EvalMap>(*ea, str);
+  secondMap = std::make_shared<EvalMap>(context.getEA(), str);
 }
 
 /********************************************************************/
@@ -367,52 +639,117 @@ void extractDigitsPacked(Ctxt& ctxt,
                          long botHigh,
                          long r,
                          long ePrime,
-                         const std::vector<NTL::ZZX>& unpackSlotEncoding, bool our_version = false, bool lazy = false);
-
-// Extract digits from unpacked slots
-void extractDigitsThin(Ctxt& ctxt, long botHigh, long r, long ePrime, bool our_version = false, bool lazy = false, std::vector<std::vector<long>> e_inner_compose_list = {{1}});
+                         const RecryptData& rcData, bool our_version = false, bool lazy = false);
 
 // Wrapper to make the above function part of the public libarary
-void wrapExtractDigitsThin(Ctxt& ctxt, long botHigh, long r, bool our_version, bool lazy, std::vector<std::vector<long>> e_inner_compose_list, int nb_iterations) {
-  Ctxt tmp(ctxt);
-  long cap_before = ctxt.bitCapacity();
-  int nb_relin_digit_extract;
-  auto start = std::chrono::high_resolution_clock::now();
-  auto duration_extract = start - start;
-
-  /******************************
-   ******** START LOOP **********
-   ******************************/
-  for (int iii = 0; iii < nb_iterations; iii++) {   // Average out multiple times
-    ctxt = tmp;
-    nb_relin_digit_extract = helib::nb_relin;
-    start = std::chrono::high_resolution_clock::now();
-    extractDigitsThin(ctxt, botHigh, r, /*ePrime*/ r, our_version, lazy, e_inner_compose_list);
-    duration_extract += (std::chrono::high_resolution_clock::now() - start);
-    nb_relin_digit_extract = helib::nb_relin - nb_relin_digit_extract;
+// Run the stage f on ctxt and, if report is not null, record what it cost.
+// With fhe_stats, the operation counts and the residue memory of the stage
+// also go to the records "<name>-<operation>" and "<name>-residue...".
+template <typename F>
+static bool measureStage(BootstrapReport* report, const char* name, const Ctxt& ctxt, F&& f)
+{
+  if (!report && !fhe_stats)
+    return f();
+
+  OpCountScope ops;
+  MemoryScope memory(name);
+  long capacityBefore = ctxt.bitCapacity();
+  auto wallStart = std::chrono::steady_clock::now();
+  std::clock_t cpuStart = std::clock();
+
+  bool result = f();
+
+  memory.stop();
+  updateOpCountStats(name, ops.counts());
+  if (report) {
+    BootstrapStageReport& entry = report->stage(name);
+    entry.cpuSeconds = double(std::clock() - cpuStart) / CLOCKS_PER_SEC;
+    entry.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+    entry.capacityBefore = capacityBefore;
+    entry.capacityAfter = ctxt.bitCapacity();
+    entry.ops = ops.counts();
+    entry.peakMemoryKB = peakMemoryKB();
+    entry.residuePeakBytes = memory.peakBytes();
+    entry.residueAllocatedBytes = memory.allocatedBytes();
   }
-  /******************************
-   ********* END LOOP ***********
-   ******************************/
+  return result;
+}
+
+static void finishReport(BootstrapReport* report, long digits, std::chrono::steady_clock::time_point wallStart, std::clock_t cpuStart)
+{
+  if (!report)
+    return;
+  report->digits = digits;
+  report->cpuSeconds = double(std::clock() - cpuStart) / CLOCKS_PER_SEC;
+  report->wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+  report->peakMemoryKB = peakMemoryKB();
+}
+
+void wrapExtractDigitsThin(Ctxt& ctxt, long botHigh, long r, bool our_version, bool lazy, std::vector<std::vector<long>> e_inner_compose_list, BootstrapReport* report) {
+  if (report)
+    report->clear();
+  auto wallStart = std::chrono::steady_clock::now();
+  std::clock_t cpuStart = std::clock();
+
+  measureStage(report, "digitExtraction", ctxt, [&]() {
+    extractDigitsThin(ctxt, botHigh, r, /*ePrime*/ r, our_version, lazy, e_inner_compose_list);
+    return true;
+  });
 
   // Make sure result is correct by taking negation (because homomorphic inner product is defined slightly differently in HElib)
   // Note that the correction for p equal to 2 is already done in the function extractDigitsThin
   ctxt.negate();
+  finishReport(report, botHigh, wallStart, cpuStart);
+}
 
-  //std::cout << "Number of relinearizations during digit extraction: " << nb_relin_digit_extract << std::endl;
-  std::cout << "Number of digits to extract: " << botHigh << std::endl;
-  std::cout << "Execution time" << std::endl;
-  std::cout << "- Digit extraction: " << std::chrono::duration_cast<std::chrono::seconds>(duration_extract).count() / nb_iterations << " seconds." << std::endl;
+// The noise of ctxt after mod-switching to a prefix s of its primes is the
+// scaled noise plus the rounding term. Switching to the bootstrapping key adds
+// the digits of the s-part times the noise of the matrix, over the special
+// primes P, and the raw mod-switch scales everything by q/(Q_s*P). So the
+// scaled noise decreases as s grows, and we keep the first prefix that fits.
+IndexSet PubKey::recryptPrimeSet(const Ctxt& ctxt, long q, double growth) const
+{
+  IndexSet cur = ctxt.getPrimeSet() / context.getSpecialPrimes();
+  if (empty(cur))
+    return cur;
 
-  std::cout << "Noise capacity" << std::endl
-            << "- Initial: " << cap_before << std::endl
-            << "- Digit extract: " << cap_before - ctxt.bitCapacity() << std::endl;
+  long phim = context.getPhiM();
+  long p2r = context.getAlMod().getPPowR();
+  double bound = HELIB_MIN_CAP_FRAC * p2r * context.boundForRecryption() / context.getZMStar().getNormBnd();
+  double logQ = context.logOfProduct(cur);
+  double logP = context.logOfProduct(context.getSpecialPrimes());
+  NTL::xdouble switchNoise = ctxt.modSwitchAddedNoiseBound();
+  const KeySwitch& W = getKeySWmatrix(SKHandle(1, 1, 0), recryptKeyID);
+
+  IndexSet s;
+  for (long i : cur) {
+    s.insert(i);
+    double logQs = context.logOfProduct(s);
+    NTL::xdouble noise = ctxt.getNoiseBound() * NTL::xexp(logQs - logQ);
+    if (s != cur)
+      noise += switchNoise;
+    noise *= growth;
+
+    if (!W.isDummy()) {
+      NTL::xdouble digitNoise(0.0);
+      for (const IndexSet& digit : context.getDigits()) {
+        IndexSet inDigit = digit & s;
+        if (!empty(inDigit))
+          digitNoise += context.noiseBoundForUniform(NTL::xexp(context.logOfProduct(inDigit)) / 2.0, phim);
+      }
+      noise += digitNoise * W.noiseBound / NTL::xexp(logP);
+    }
+
+    if (noise * NTL::xexp(std::log(double(q)) - logQs) <= bound)
+      break;
+  }
+  return s;
 }
 
 // bootstrap a ciphertext to reduce noise
 void PubKey::reCrypt(Ctxt& ctxt, bool our_version, bool lazy) const
 {
-  int nb_relin_digit_extract;
+  ExecutionPolicy::Scope policyScope(context.effectiveExecutionPolicy());
   long cap_first_map, cap_second_map, cap_digit_extract, cap_in_prod;
   auto start_time_bootstrapping = std::chrono::high_resolution_clock::now();
   auto total_time_digit_extract = start_time_bootstrapping - start_time_bootstrapping;
@@ -436,6 +773,11 @@ void PubKey::reCrypt(Ctxt& ctxt, bool our_version, bool lazy) const
   // check that we have bootstrapping data
   assertTrue(recryptKeyID >= 0l, "No bootstrapping data");
 
+  // Recycle the residues of the temporaries, unless the caller already does
+  std::unique_ptr<ResidueArena> arena;
+  if (!ResidueArena::current())
+    arena.reset(new ResidueArena);
+
   long p = getContext().getP();
   long r = getContext().getAlMod().getR();
   long p2r = getContext().getAlMod().getPPowR();
@@ -466,20 +808,16 @@ void PubKey::reCrypt(Ctxt& ctxt, bool our_version, bool lazy) const
 #endif
 
   HELIB_NTIMER_START(AAA_preProcess);
+  HELIB_NMEMORY_START(AAA_preProcess);
 
   // Make sure that this ciphertext is in canonical form
   if (!ctxt.inCanonicalForm())
     ctxt.reLinearize();
 
-  // Mod-switch down if needed
+  // Mod-switch down to the fewest primes that the noise allows
   IndexSet s = ctxt.getPrimeSet() / context.getSpecialPrimes();
   assertTrue(s <= context.getCtxtPrimes(), "prime set is messed up");
-  if (s.card() > 3) { // leave only first three ciphertext primes
-    long first = s.first();
-    IndexSet s3(first, first + 2);
-    s.retain(s3);
-  }
-  ctxt.modDownToSet(s);
+  ctxt.modDownToSet(recryptPrimeSet(ctxt, q));
 
   // key-switch to the bootstrapping key
   ctxt.reLinearize(recryptKeyID);
@@ -489,7 +827,7 @@ void PubKey::reCrypt(Ctxt& ctxt, bool our_version, bool lazy) const
 #endif
 
   // "raw mod-switch" to the bootstrapping modulus q=p^e+1.
-  std::vector<NTL::ZZX> zzParts; // the mod-switched parts, in ZZX format
+  std::vector<zzX> zzParts; // the mod-switched parts, in zzX format
 
   double mfac = ctxt.getContext().getZMStar().getNormBnd();
   double noise_est = ctxt.rawModSwitch(zzParts, q) * mfac;
@@ -519,50 +857,51 @@ void PubKey::reCrypt(Ctxt& ctxt, bool our_version, bool lazy) const
 
 #ifdef HELIB_DEBUG
   if (dbgKey) {
-    checkRecryptBounds(zzParts, dbgKey->getRecryptKey(), ctxt.getContext(), q);
+    checkRecryptBounds(toZZXParts(zzParts),
+                       dbgKey->getRecryptKey(),
+                       ctxt.getContext(),
+                       q);
   }
 #endif
 
-  std::vector<NTL::ZZX> v;
+  std::vector<zzX> v;
   v.resize(2);
 
-  // Add multiples of q to make the zzParts divisible by p^{e'}
+  // Add multiples of q to make the zzParts divisible by p^{e'}, and divide
+  // by p^{e'}, all in word-size arithmetic
   for (long i : range(2)) {
-    // make divisible by p^{e'}
-
-    newMakeDivisible(zzParts[i], p2ePrime, q, ctxt.getContext(), v[i]);
+    newMakeDivisibleAndDivide(zzParts[i], p2ePrime, q, ctxt.getContext(), v[i]);
   }
 
 #ifdef HELIB_DEBUG
   if (dbgKey) {
-    checkRecryptBounds_v(v, dbgKey->getRecryptKey(), ctxt.getContext(), q);
-    checkCriticalValue(zzParts,
+    checkRecryptBounds_v(toZZXParts(v),
+                         dbgKey->getRecryptKey(),
+                         ctxt.getContext(),
+                         q);
+    checkCriticalValue(toZZXParts(zzParts, p2ePrime),
                        dbgKey->getRecryptKey(),
                        ctxt.getContext().getRcData(),
                        q);
   }
 #endif
 
-  for (long i : range(zzParts.size())) {
-    zzParts[i] /= p2ePrime; // divide by p^{e'}
-  }
-
   // NOTE: here we lose the intFactor associated with ctxt.
   // We will restore it below.
-  ctxt = recryptEkey;
-
-  ctxt.multByConstant(zzParts[1]);
-  ctxt.addConstant(zzParts[0]);
+  ctxt.setToInnerProduct(recryptEkey, recryptEkeyPrecon, zzParts[1], zzParts[0]);
   cap_in_prod = ctxt.bitCapacity();
 
 #ifdef HELIB_DEBUG
   CheckCtxt(ctxt, "after preProcess");
 #endif
+  HELIB_NMEMORY_STOP(AAA_preProcess);
   HELIB_NTIMER_STOP(AAA_preProcess);
 
   // Move the powerful-basis coefficients to the plaintext slots
   HELIB_NTIMER_START(AAA_LinearTransform1);
+  HELIB_NMEMORY_START(AAA_LinearTransform1);
   ctxt.getContext().getRcData().firstMap->apply(ctxt);
+  HELIB_NMEMORY_STOP(AAA_LinearTransform1);
   HELIB_NTIMER_STOP(AAA_LinearTransform1);
   cap_first_map = ctxt.bitCapacity();
 
@@ -571,17 +910,17 @@ void PubKey::reCrypt(Ctxt& ctxt, bool our_version, bool lazy) const
 #endif
 
   // Extract the digits e-e'+r-1,...,e-e' (from fully packed slots)
-  nb_relin_digit_extract = helib::nb_relin;
   auto start = std::chrono::high_resolution_clock::now();
   HELIB_NTIMER_START(AAA_extractDigitsPacked);
+  HELIB_NMEMORY_START(AAA_extractDigitsPacked);
   extractDigitsPacked(ctxt,
                       e - ePrime,
                       r,
                       ePrime,
-                      context.getRcData().unpackSlotEncoding, our_version, lazy);
+                      context.getRcData(), our_version, lazy);
+  HELIB_NMEMORY_STOP(AAA_extractDigitsPacked);
   HELIB_NTIMER_STOP(AAA_extractDigitsPacked);
   total_time_digit_extract = std::chrono::high_resolution_clock::now() - start;
-  nb_relin_digit_extract = helib::nb_relin - nb_relin_digit_extract;
   cap_digit_extract = ctxt.bitCapacity();
 
 #ifdef HELIB_DEBUG
@@ -590,7 +929,9 @@ void PubKey::reCrypt(Ctxt& ctxt, bool our_version, bool lazy) const
 
   // Move the slots back to powerful-basis coefficients
   HELIB_NTIMER_START(AAA_LinearTransform2);
+  HELIB_NMEMORY_START(AAA_LinearTransform2);
   ctxt.getContext().getRcData().secondMap->apply(ctxt);
+  HELIB_NMEMORY_STOP(AAA_LinearTransform2);
   HELIB_NTIMER_STOP(AAA_LinearTransform2);
   cap_second_map = ctxt.bitCapacity();
 
@@ -602,7 +943,6 @@ void PubKey::reCrypt(Ctxt& ctxt, bool our_version, bool lazy) const
   if (intFactor != 1)
     ctxt.intFactor = NTL::MulMod(ctxt.intFactor, intFactor, ptxtSpace);
 
-  //std::cout << "Number of relinearizations during digit extraction: " << nb_relin_digit_extract << std::endl;
   std::cout << "Number of digits to extract: " << e - ePrime << std::endl;
   std::cout << "Execution time" << std::endl;
   std::cout << "- Digit extraction: " << std::chrono::duration_cast<std::chrono::seconds>(total_time_digit_extract).count() << " seconds." << std::endl;
@@ -616,6 +956,40 @@ void PubKey::reCrypt(Ctxt& ctxt, bool our_version, bool lazy) const
             << "- Remaining: " << cap_second_map << std::endl;
 }
 
+// Pointers to the cached constants, as frobeniusCombinations takes them
+static std::vector<const DoubleCRT*> constantPtrs(
+    const std::vector<DoubleCRT>& constants)
+{
+  std::vector<const DoubleCRT*> ptrs(constants.size());
+  for (std::size_t i = 0; i < constants.size(); i++)
+    ptrs[i] = &constants[i];
+  return ptrs;
+}
+
+// Set ctxt = sum_i unpacked[i] * (x^i in all slots), with the constants
+// encoded once per prime set by rcData.unpackConstants
+static void repackSlots(Ctxt& ctxt,
+                        const std::vector<Ctxt>& unpacked,
+                        const RecryptData& rcData)
+{
+  long d = unpacked.size();
+  IndexSet primes = unpacked[0].getPrimeSet();
+  for (long i = 1; i < d; i++)
+    primes = primes | unpacked[i].getPrimeSet();
+
+  const std::vector<DoubleCRT>& xConstants =
+      rcData.unpackConstants->getRepackConstants(ctxt.getContext(), primes);
+  const std::vector<double>& xSizes =
+      rcData.unpackConstants->getRepackSizes(ctxt.getContext());
+  std::vector<const Ctxt*> terms(d);
+  std::vector<const DoubleCRT*> constants(d);
+  for (long i = 0; i < d; i++) {
+    terms[i] = &unpacked[i];
+    constants[i] = &xConstants[i];
+  }
+  linearCombination(ctxt, terms, constants, xSizes);
+}
+
 #ifdef HELIB_BOOT_THREADS
 
 // Extract digits from fully packed slots, multithreaded version
@@ -623,7 +997,7 @@ void extractDigitsPacked(Ctxt& ctxt,
                          long botHigh,
                          long r,
                          long ePrime,
-                         const std::vector<NTL::ZZX>& unpackSlotEncoding, bool our_version, bool lazy)
+                         const RecryptData& rcData, bool our_version, bool lazy)
 {
   HELIB_TIMER_START;
 
@@ -636,48 +1010,29 @@ void extractDigitsPacked(Ctxt& ctxt,
 
   std::vector<Ctxt> unpacked(d, Ctxt(ZeroCtxtLike, ctxt));
   { // explicit scope to force all temporaries to be released
-    std::vector<std::shared_ptr<DoubleCRT>> coeff_vector;
-    std::vector<double> coeff_vector_sz;
-    coeff_vector.resize(d);
-    coeff_vector_sz.resize(d);
-
     HELIB_NTIMER_START(unpack1);
-    for (long i = 0; i < d; i++) {
-      coeff_vector[i] = std::make_shared<DoubleCRT>(unpackSlotEncoding[i],
-                                                    ctxt.getContext(),
-                                                    ctxt.getPrimeSet());
-      coeff_vector_sz[i] = NTL::conv<double>(
-          embeddingLargestCoeff(unpackSlotEncoding[i],
-                                ctxt.getContext().getZMStar()));
-    }
+    const std::vector<DoubleCRT>& coeff_vector =
+        rcData.unpackConstants->getConstants(ctxt.getContext(),
+                                             *rcData.unpackSlotEncoding,
+                                             ctxt.getPrimeSet());
+    const std::vector<double>& coeff_vector_sz =
+        rcData.unpackConstants->getSizes(ctxt.getContext(),
+                                         *rcData.unpackSlotEncoding);
     HELIB_NTIMER_STOP(unpack1);
 
     HELIB_NTIMER_START(unpack2);
-    std::vector<Ctxt> frob(d, Ctxt(ZeroCtxtLike, ctxt));
-
-    NTL_EXEC_RANGE(d, first, last)
-    // FIXME: implement using hoisting!
-    for (long j = first; j < last; j++) { // process jth Frobenius
-      frob[j] = ctxt;
-      frob[j].frobeniusAutomorph(j);
-      frob[j].cleanUp();
-      // FIXME: not clear if we should call cleanUp here
-    }
-    NTL_EXEC_RANGE_END
-
+    // unpacked[i] = sum_j frob[j] * coeff_vector[i + j mod d]. The d
+    // Frobenius automorphisms share one digit decomposition of ctxt. Every
+    // unpacked[i] needs all of them, so a baby-step/giant-step split would
+    // only trade the d - 1 key switches for about d*sqrt(d); it is used
+    // below this call only when the keys are generated that way, as then
+    // the precon needs fewer matrices (see addBSGSFrbMatrices).
+    // FIXME: not clear if we should call cleanUp here
+    frobeniusCombinations(CtPtrs_vectorCt(unpacked),
+                          ctxt,
+                          constantPtrs(coeff_vector),
+                          coeff_vector_sz);
     HELIB_NTIMER_STOP(unpack2);
-
-    HELIB_NTIMER_START(unpack3);
-    Ctxt tmp1(ZeroCtxtLike, ctxt);
-    for (long i = 0; i < d; i++) {
-      for (long j = 0; j < d; j++) {
-        tmp1 = frob[j];
-        tmp1.multByConstant(*coeff_vector[mcMod(i + j, d)],
-                            coeff_vector_sz[mcMod(i + j, d)]);
-        unpacked[i] += tmp1;
-      }
-    }
-    HELIB_NTIMER_STOP(unpack3);
   }
   HELIB_NTIMER_STOP(unpack);
 
@@ -685,11 +1040,11 @@ void extractDigitsPacked(Ctxt& ctxt,
   //  CheckCtxt(unpacked[0], "after unpack");
   //#endif
 
-  NTL_EXEC_RANGE(d, first, last)
+  HELIB_EXEC_RANGE(d, first, last)
   for (long i = first; i < last; i++) {
     extractDigitsThin(unpacked[i], botHigh, r, ePrime, our_version, lazy);
   }
-  NTL_EXEC_RANGE_END
+  HELIB_EXEC_RANGE_END
 
   //#ifdef HELIB_DEBUG
   // CheckCtxt(unpacked[0], "before repack");
@@ -697,15 +1052,7 @@ void extractDigitsPacked(Ctxt& ctxt,
 
   // Step 3: re-pack the slots
   HELIB_NTIMER_START(repack);
-  const EncryptedArray& ea2 = ctxt.getContext().getEA();
-  NTL::ZZX xInSlots;
-  std::vector<NTL::ZZX> xVec(ea2.size());
-  ctxt = unpacked[0];
-  for (long i = 1; i < d; i++) {
-    x2iInSlots(xInSlots, i, xVec, ea2);
-    unpacked[i].multByConstant(xInSlots);
-    ctxt += unpacked[i];
-  }
+  repackSlots(ctxt, unpacked, rcData);
   HELIB_NTIMER_STOP(repack);
   //#ifdef HELIB_DEBUG
   // CheckCtxt(ctxt, "after repack");
@@ -719,7 +1066,7 @@ void extractDigitsPacked(Ctxt& ctxt,
                          long botHigh,
                          long r,
                          long ePrime,
-                         const std::vector<NTL::ZZX>& unpackSlotEncoding, bool our_version, bool lazy)
+                         const RecryptData& rcData, bool our_version, bool lazy)
 {
   HELIB_TIMER_START;
 
@@ -732,36 +1079,20 @@ void extractDigitsPacked(Ctxt& ctxt,
 
   std::vector<Ctxt> unpacked(d, Ctxt(ZeroCtxtLike, ctxt));
   { // explicit scope to force all temporaries to be released
-    std::vector<std::shared_ptr<DoubleCRT>> coeff_vector;
-    std::vector<double> coeff_vector_sz;
-    coeff_vector.resize(d);
-    coeff_vector_sz.resize(d);
-    for (long i = 0; i < d; i++) {
-      coeff_vector[i] = std::make_shared<DoubleCRT>(unpackSlotEncoding[i],
-                                                    ctxt.getContext(),
-                                                    ctxt.getPrimeSet());
-      coeff_vector_sz[i] = NTL::conv<double>(
-          embeddingLargestCoeff(unpackSlotEncoding[i],
-                                ctxt.getContext().getZMStar()));
-    }
-
-    Ctxt tmp1(ZeroCtxtLike, ctxt);
-    Ctxt tmp2(ZeroCtxtLike, ctxt);
-
-    // FIXME: implement using hoisting!
-    for (long j = 0; j < d; j++) { // process jth Frobenius
-      tmp1 = ctxt;
-      tmp1.frobeniusAutomorph(j);
-      tmp1.cleanUp();
-      // FIXME: not clear if we should call cleanUp here
-
-      for (long i = 0; i < d; i++) {
-        tmp2 = tmp1;
-        tmp2.multByConstant(*coeff_vector[mcMod(i + j, d)],
-                            coeff_vector_sz[mcMod(i + j, d)]);
-        unpacked[i] += tmp2;
-      }
-    }
+    const std::vector<DoubleCRT>& coeff_vector =
+        rcData.unpackConstants->getConstants(ctxt.getContext(),
+                                             *rcData.unpackSlotEncoding,
+                                             ctxt.getPrimeSet());
+    const std::vector<double>& coeff_vector_sz =
+        rcData.unpackConstants->getSizes(ctxt.getContext(),
+                                         *rcData.unpackSlotEncoding);
+
+    // unpacked[i] = sum_j frob[j] * coeff_vector[i + j mod d]
+    // FIXME: not clear if we should call cleanUp here
+    frobeniusCombinations(CtPtrs_vectorCt(unpacked),
+                          ctxt,
+                          constantPtrs(coeff_vector),
+                          coeff_vector_sz);
   }
   HELIB_NTIMER_STOP(unpack);
 
@@ -779,15 +1110,7 @@ void extractDigitsPacked(Ctxt& ctxt,
 
   // Step 3: re-pack the slots
   HELIB_NTIMER_START(repack);
-  const EncryptedArray& ea2 = ctxt.getContext().getEA();
-  NTL::ZZX xInSlots;
-  std::vector<NTL::ZZX> xVec(ea2.size());
-  ctxt = unpacked[0];
-  for (long i = 1; i < d; i++) {
-    x2iInSlots(xInSlots, i, xVec, ea2);
-    unpacked[i].multByConstant(xInSlots);
-    ctxt += unpacked[i];
-  }
+  repackSlots(ctxt, unpacked, rcData);
   HELIB_NTIMER_STOP(repack);
 }
 
@@ -798,18 +1121,29 @@ void packedRecrypt(const CtPtrs& cPtrs,
                    const std::vector<zzX>& unpackConsts,
                    const EncryptedArray& ea)
 {
+  if (cPtrs.size() == 0)
+    return; // nothing to recrypt
   PubKey& pKey = (PubKey&)cPtrs[0]->getPubKey();
 
   // Allocate temporary ciphertexts for the recryption
   int nPacked = divc(cPtrs.size(), ea.getDegree()); // ceil(totalNum/d)
   std::vector<Ctxt> cts(nPacked, Ctxt(pKey));
 
+  // repack and unpack work on the ciphertexts in parallel, building their
+  // constants once for all of them
   repack(CtPtrs_vectorCt(cts), cPtrs, ea); // pack ciphertexts
   //  cout << "@"<< lsize(cts)<<std::flush;
+#ifdef HELIB_BOOT_THREADS
+  HELIB_EXEC_INDEX(nPacked, i) // then recrypt them
+  cts[i].reducePtxtSpace(2); // we only have recryption data for binary ctxt
+  pKey.reCrypt(cts[i]);
+  HELIB_EXEC_INDEX_END
+#else
   for (Ctxt& c : cts) {   // then recrypt them
     c.reducePtxtSpace(2); // we only have recryption data for binary ctxt
     pKey.reCrypt(c);
   }
+#endif
   unpack(cPtrs, CtPtrs_vectorCt(cts), ea, unpackConsts);
 }
 
@@ -846,115 +1180,140 @@ void ThinRecryptData::init(const Context& context,
                            const NTL::Vec<long>& mvec_,
                            bool alsoThick,
                            bool build_cache_,
-                           bool minimal)
+                           bool minimal,
+                           long usedSlots_,
+                           long cacheBudget_,
+                           bool lazy_)
 {
-  RecryptData::init(context, mvec_, alsoThick, build_cache_, minimal);
-  coeffToSlot =
-      std::make_shared<ThinEvalMap>(*ea, minimal, mvec, true, build_cache);
-  slotToCoeff = std::make_shared<ThinEvalMap>(context.getEA(),
-                                              minimal,
-                                              mvec,
-                                              false,
-                                              build_cache);
-}
-
-// Extract digits from thinly packed slots
-
-long fhe_force_chen_han = 0;
-
-// Evaluate the optimized bit extraction polynomials using the multivariate strategy (only for p = 2 and e <= 16)
-// We always use the same set of polynomials, regardless of e and how many results are actually required
-// Parameters:
-// - Ciphertext in which to evaluate the polynomials
-// - Result vector that will include ciphertexts and precisions
-// - Size of the row: distance between leftmost and rightmost digit (counting is done from input to output)
-void rowComputationMultivariate(const Ctxt& ctxt, std::vector<std::pair<Ctxt, long>>& ctxtEval, long rowSize) {
-    // List of polynomials:
-    // * f2 = x^2
-    // * f4 = (f2)^2
-    // * f8 = 112*f2 + (94*f2 + 121*f4)^2
-    // * f16 = 11136*f4 - (15364*f4 - 14115*f8) * (28504*f2 + 8968*f4 - f8)
-
-    // Evaluate the above polynomials
-    Ctxt tmp1(ZeroCtxtLike, ctxt);
-    Ctxt tmp2(ZeroCtxtLike, ctxt);
-    Ctxt tmp3(ZeroCtxtLike, ctxt);
-    long init_length = ctxtEval.size();
-    if (rowSize >= 2) {
-        ctxtEval.push_back(std::pair<Ctxt, long>(ctxt, 2));
-        std::get<0>(ctxtEval[init_length + 0]).square();
-    }
-    if (rowSize >= 3) {
-        ctxtEval.push_back(std::pair<Ctxt, long>(std::get<0>(ctxtEval[init_length + 0]), 4));
-        std::get<0>(ctxtEval[init_length + 1]).square();
-    }
-    if (rowSize >= 5) {
-        ctxtEval.push_back(std::pair<Ctxt, long>(std::get<0>(ctxtEval[init_length + 0]), 8));
-        std::get<0>(ctxtEval[init_length + 2]).multByConstant((long) 112);
-
-        tmp1 = std::get<0>(ctxtEval[init_length + 0]);
-        tmp1.multByConstant((long) 94);
-
-        tmp2 = std::get<0>(ctxtEval[init_length + 1]);
-        tmp2.multByConstant((long) 121);
-        tmp1.addCtxt(tmp2);
-
-        tmp1.square();
-
-        std::get<0>(ctxtEval[init_length + 2]).addCtxt(tmp1);
-    }
-    if (rowSize >= 9) {
-        ctxtEval.push_back(std::pair<Ctxt, long>(std::get<0>(ctxtEval[init_length + 1]), 16));
-        std::get<0>(ctxtEval[init_length + 3]).multByConstant((long) 11136);
+  if (alMod != nullptr) { // were we called for a second time?
+    std::cerr << "@Warning: multiple calls to ThinRecryptData::init\n";
+    return;
+  }
 
-        tmp1 = std::get<0>(ctxtEval[init_length + 1]);
-        tmp1.multByConstant((long) 15364);
+  auto wallStart = std::chrono::steady_clock::now();
+  lazy = lazy_;
+  initCommon(context, mvec_, alsoThick, build_cache_);
+  cacheBudget = cacheBudget_;
+
+  // The leading dimensions in which all the used slots have coordinate 0
+  const PAlgebra& zMStar = context.getZMStar();
+  long nslots = zMStar.getNSlots();
+  assertInRange<InvalidArgument>(usedSlots_,
+                                 0l,
+                                 nslots + 1,
+                                 "usedSlots must be in [0, nslots]");
+  long sparseDims = 0;
+  usedSlots = nslots;
+  if (usedSlots_ > 0) {
+    long maxSparseDims = std::min(mvec.length() - 1, zMStar.numOfGens());
+    while (sparseDims < maxSparseDims &&
+           usedSlots / zMStar.OrderOf(sparseDims) >= usedSlots_)
+      usedSlots /= zMStar.OrderOf(sparseDims++);
+  }
 
-        tmp2 = std::get<0>(ctxtEval[init_length + 2]);
-        tmp2.multByConstant((long) 14115);
-        tmp1.addCtxt(tmp2, true);
+  // The thin maps come first in the budget, the thick ones get what is left.
+  // slotToCoeff runs at the few primes kept by thinReCrypt and coeffToSlot at
+  // the level of the bootstrapping key, so their constants are encoded over
+  // these prime sets when they are first used.
+  bool inOrder = build_cache && cacheBudget >= 0;
+  auto s2c = [this, &context, minimal, sparseDims]() {
+    NTL::zz_pBak bak;
+    bak.save();
+    auto map = std::make_shared<ThinEvalMap>(context.getEA(),
+                                             minimal,
+                                             mvec,
+                                             false,
+                                             /*build_cache=*/false,
+                                             /*doubleHoist=*/false,
+                                             sparseDims);
+    if (build_cache)
+      map->upgradeWithin(budgetLeft, /*lazily=*/true);
+    return std::shared_ptr<const ThinEvalMap>(map);
+  };
+  auto c2s = [this, minimal, sparseDims, inOrder]() {
+    if (inOrder)
+      slotToCoeff.get();
+    NTL::zz_pBak bak;
+    bak.save();
+    auto map = std::make_shared<ThinEvalMap>(*ea,
+                                             minimal,
+                                             mvec,
+                                             true,
+                                             /*build_cache=*/false,
+                                             /*doubleHoist=*/false,
+                                             sparseDims);
+    if (build_cache)
+      map->upgradeWithin(budgetLeft, /*lazily=*/true);
+    return std::shared_ptr<const ThinEvalMap>(map);
+  };
+
+  budgetLeft = cacheBudget;
+  if (lazy) {
+    slotToCoeff.defer(s2c);
+    coeffToSlot.defer(c2s);
+  } else {
+    slotToCoeff = s2c();
+    coeffToSlot = c2s();
+  }
+  if (alsoThick)
+    initThick(context, minimal, &coeffToSlot);
+  digitExtractionPlans = std::make_shared<DigitExtractionPlanCache>();
+
+  // The linear maps dominate the cost of a bootstrappable context
+  HELIB_STATS_UPDATE("recryptData-init-seconds",
+                     std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - wallStart)
+                         .count());
+  HELIB_STATS_UPDATE("recryptData-init-peakMemoryKB", peakMemoryKB());
+}
 
-        tmp2 = std::get<0>(ctxtEval[init_length + 0]);
-        tmp2.multByConstant((long) 28504);
+void ThinRecryptData::writeTo(std::ostream& str) const
+{
+  RecryptData::writeTo(str);
+  coeffToSlot->writeTo(str);
+  slotToCoeff->writeTo(str);
+}
 
-        tmp3 = std::get<0>(ctxtEval[init_length + 1]);
-        tmp3.multByConstant((long) 8968);
-        tmp2.addCtxt(tmp3);
+void ThinRecryptData::readFrom(const Context& context, std::istream& str)
+{
+  RecryptData::readFrom(context, str);
+  coeffToSlot = std::make_shared<ThinEvalMap>(*ea, str);
+  slotToCoeff = std::make_shared<ThinEvalMap>(context.getEA(), str);
+  assertEq<IOError>(coeffToSlot->getSparseDims(),
+                    slotToCoeff->getSparseDims(),
+                    "The linear maps use different slots");
+  digitExtractionPlans = std::make_shared<DigitExtractionPlanCache>();
+
+  const PAlgebra& zMStar = context.getZMStar();
+  usedSlots = zMStar.getNSlots();
+  for (long i = 0; i < slotToCoeff->getSparseDims(); i++)
+    usedSlots /= zMStar.OrderOf(i);
+}
 
-        tmp2.addCtxt(std::get<0>(ctxtEval[init_length + 2]), true);
+// Extract digits from thinly packed slots
 
-        tmp1.multiplyBy(tmp2);
+thread_local long fhe_force_chen_han = 0;
 
-        std::get<0>(ctxtEval[init_length + 3]).addCtxt(tmp1, true);
-    }
-}
-
-// Evaluate the optimized digit extraction polynomials using the even/odd strategy (this optimization is not
-// done when p = 2 and e_inner > 1) and the function composition approach
+// Evaluate the optimized digit extraction polynomials using the multivariate strategy (only for input precision 1 and
+// e <= program.getMaxPrecision()), see DigitProgram::binary() for the chain used for p = 2
+// We always use the same set of polynomials, regardless of e, but only the ones that are actually required
 // Parameters:
+// - Straight-line program of the multivariate polynomials
 // - Ciphertext in which to evaluate the polynomials
 // - Result vector that will include ciphertexts and precisions
-// - Size of the inner part of the trapezoid (the v x v triangle): only the current row is considered
 // - Size of the row: distance between leftmost and rightmost digit (counting is done from input to output)
-// - Flag for lazy relinearization or default strategy
-// - Precision exponent of the input ciphertext (relevant for function composition approach)
-void rowComputationComposition(const Ctxt& ctxt, std::vector<std::pair<Ctxt, long>>& ctxtEval, long triangleSize, long rowSize, bool lazy, long e_inner) {
-    // Find index of primes in list
-    long index = nb_primes;
-    for (long iii = 0; iii < nb_primes; iii++)
-        if (primes_list[iii] == ctxt.getContext().getP())
-            index = iii;
-    assertTrue(index < nb_primes, "No polynomials generated for given prime.");
-
-    // Find index of e_inner in list
-    long inner_index = nb_e_inner;
-    for (long iii = 0; iii < nb_e_inner; iii++)
-        if (e_inner_list[iii] == e_inner)
-            inner_index = iii;
-    assertTrue(inner_index < nb_e_inner, "No polynomials generated for given e_inner.");
+void rowComputationMultivariate(const DigitProgram& program, const Ctxt& ctxt, std::vector<std::pair<Ctxt, long>>& ctxtEval, long rowSize) {
+    // The built-in chain for p = 2 has evaluators that are specialized at compile time
+    static const DigitProgram binary = DigitProgram::binary();
+    if (program == binary)
+        evaluateFixedProgram<BINARY_DIGIT_CHAIN>(ctxtEval, ctxt, rowSize);
+    else
+        program.evaluate(ctxtEval, ctxt, rowSize);
+}
 
+// Precisions of the polynomials evaluated by rowComputationComposition
+static std::vector<long> compositionPrecisions(long triangleSize, long rowSize, long e_inner) {
     // Always minimize the multiplicative depth as a rule of thumb (see paper for description of heuristic)
-    std::vector<NTL::ZZX> polynomials;  // Polynomials to evaluate
     std::vector<long> precisions;       // Precisions of the polynomials
     for (long exponent = 1; e_inner * pow(2, exponent - 1) < triangleSize; exponent++) {  // As long as previous iteration did not reach triangle size
         long precision = e_inner * pow(2, exponent);
@@ -964,32 +1323,144 @@ void rowComputationComposition(const Ctxt& ctxt, std::vector<std::pair<Ctxt, lon
             else
                 precision = rowSize;
         }
-        assertTrue(precision - e_inner - 1 < (long)polynomial_vector[index][inner_index].size(), "Not sufficiently many polynomials generated for the given prime.");
-        polynomials.push_back(polynomial_vector[index][inner_index][precision - e_inner - 1]);  // Polynomials are loaded from precision = e_inner + 1
         precisions.push_back(precision);
     }
 
     // Possibly add one more polynomial
-    if (precisions.empty() || precisions.back() < rowSize) {
-        assertTrue(rowSize - e_inner - 1 < (long)polynomial_vector[index][inner_index].size(), "Not sufficiently many polynomials generated for the given prime.");
-        polynomials.push_back(polynomial_vector[index][inner_index][rowSize - e_inner - 1]);
+    if (precisions.empty() || precisions.back() < rowSize)
         precisions.push_back(rowSize);
+    return precisions;
+}
+
+// Cost of evaluating the polynomials with the plan that rowComputationComposition builds, plus the cost of x^spacing
+static void planCost(long& multiplications, long& depth, const Context& context, const std::vector<NTL::ZZX>& polynomials, bool lazy, long ptxtSpace) {
+    PolyEvalPlan plan(context, polynomials, lazy, ptxtSpace);
+    const PS_parameters& parameters = plan.getParameters();
+    long spacing = plan.getSpacing();
+    multiplications = parameters.multiplications + (NTL::NumBits(spacing) - 1) + (NTL::weight(spacing) - 1);
+    depth = NTL::NumBits(spacing - 1) + NTL::NumBits(parameters.k - 1) + parameters.m;
+}
+
+// Whether the polynomials of the composition step from precision 1 take strictly fewer multiplications than the
+// program (or as many at a lower depth), false if they are not available
+// The straight-line programs of odd p evaluate these same polynomials, so they only win where they share more
+static bool compositionIsCheaper(const DigitProgram& program, const Context& context, long triangleSize, long rowSize, long e_inner) {
+    long p = context.getP();
+    long precision = std::min(rowSize, e_inner);
+    std::vector<NTL::ZZX> polynomials;
+    try {
+        for (long e : compositionPrecisions(std::min(triangleSize, e_inner), precision, 1))
+            polynomials.push_back(getDigitPolynomial(p, 1, e));
+    } catch (const OutOfRangeError&) {
+        return false;
+    } catch (const IOError&) {  // No polynomial source, e.g. for the built-in chain of p = 2
+        return false;
     }
 
+    long multiplications, depth, programMultiplications, programDepth;
+    planCost(multiplications, depth, context, polynomials, /*lazy*/ false, NTL::power_long(p, precision));
+    program.cost(programMultiplications, programDepth, precision);
+    return (multiplications < programMultiplications) || ((multiplications == programMultiplications) && (depth < programDepth));
+}
+
+// Method for one step of rowComputationGeneral and the precisions of the polynomials it evaluates
+// (not set for the multivariate strategy)
+static DigitStepMethod stepMethod(std::vector<long>& precisions, const Context& context, long triangleSize, long rowSize, long e_inner_previous, long e_inner) {
+    long p = context.getP();
+    const DigitProgram* program = getDigitProgram(p);
+    if (program && (e_inner_previous == 1) && (e_inner <= program->getMaxPrecision()) &&
+        !compositionIsCheaper(*program, context, triangleSize, rowSize, e_inner))
+        return DigitStepMethod::Multivariate;
+
+    long precision = std::min(rowSize, e_inner);
+    precisions = compositionPrecisions(std::min(triangleSize, e_inner), precision, e_inner_previous);
+    try {
+        for (long e : precisions)
+            getDigitPolynomial(p, e_inner_previous, e);
+        return DigitStepMethod::Composition;
+    } catch (const OutOfRangeError&) {
+    }
+
+    // Not in the table: the lifting polynomial gains one digit and Chen/Han's polynomial reaches any precision,
+    // both only depend on the lowest digit so they accept any input precision
+    precisions.assign(1, precision);
+    return (precision <= e_inner_previous + 1) ? DigitStepMethod::Lifting : DigitStepMethod::ChenHan;
+}
+
+DigitStepMethod digitStepMethod(const Context& context, long triangleSize, long rowSize, long e_inner_previous, long e_inner) {
+    DigitPolynomialUse use(context.getP());
+    std::vector<long> precisions;
+    return stepMethod(precisions, context, triangleSize, rowSize, e_inner_previous, e_inner);
+}
+
+// Polynomials evaluated by a step that does not use the multivariate strategy
+// (the built-in ones are cached on the context if bootstrapping is initialized)
+static std::vector<NTL::ZZX> stepPolynomials(DigitStepMethod method, const Context& context, long e_inner, const std::vector<long>& precisions) {
+    long p = context.getP();
+    const std::shared_ptr<DigitPolynomialCache>& cache = context.getRcData().digitPolynomials;
+    std::vector<NTL::ZZX> polynomials(precisions.size());
+    for (long index = 0; index < (long)precisions.size(); index++) {
+        if (method == DigitStepMethod::Composition)
+            polynomials[index] = getDigitPolynomial(p, e_inner, precisions[index]);
+        else if (cache)
+            polynomials[index] = (method == DigitStepMethod::Lifting) ? cache->getLifting(p, precisions[index]) : cache->getChenHan(p, precisions[index]);
+        else if (method == DigitStepMethod::Lifting)
+            buildLiftingPolynomial(polynomials[index], p, precisions[index]);
+        else
+            buildChenHanPolynomial(polynomials[index], p, precisions[index]);
+    }
+    return polynomials;
+}
+
+// The plan of a step that does not use the multivariate strategy
+// The plan only depends on the polynomial set, so it is shared by all ciphertexts with the same context
+static std::shared_ptr<const PolyEvalPlan> stepPlan(const Context& context, DigitStepMethod method, const std::vector<long>& precisions, RelinPolicy policy, long ptxtSpace, long e_inner, long maxPower) {
+    auto build = [&]() {
+        return std::make_shared<const PolyEvalPlan>(context, stepPolynomials(method, context, e_inner, precisions), policy, ptxtSpace, maxPower);
+    };
+    const std::shared_ptr<PolyEvalPlanCache>& cache = context.getRcData().polyEvalPlans;
+    if (!cache)
+        return build();
+    std::vector<long> key{(long)method, (long)policy, ptxtSpace, e_inner, maxPower};
+    key.insert(key.end(), precisions.begin(), precisions.end());
+    return cache->get(key, build);
+}
+
+// Evaluate the optimized digit extraction polynomials using the even/odd strategy (this optimization is not
+// done when p = 2 and e_inner > 1) and the function composition approach, or the polynomial of the built-in
+// digit extraction that replaces them
+// Parameters:
+// - Ciphertext in which to evaluate the polynomials
+// - Result vector that will include ciphertexts and precisions
+// - Method of the step (anything but multivariate)
+// - Precisions of the polynomials, see stepMethod
+// - Relinearization policy of the evaluation
+// - Precision exponent of the input ciphertext (relevant for function composition approach)
+void rowComputationComposition(const Ctxt& ctxt, std::vector<std::pair<Ctxt, long>>& ctxtEval, DigitStepMethod method, const std::vector<long>& precisions, RelinPolicy policy, long e_inner) {
     // Evaluate polynomials using Paterson-Stockmeyer
+    long maxPower = ctxt.getPubKey().maxRelinPower(ctxt.getKeyID());
+    std::shared_ptr<const PolyEvalPlan> plan = stepPlan(ctxt.getContext(), method, precisions, policy, ctxt.getPtxtSpace(), e_inner, maxPower);
+
     std::vector<Ctxt> result;
-    customPolyEval(result, polynomials, ctxt, lazy);
+#ifdef HELIB_BOOT_THREADS
+    plan->evaluate(result, ctxt, /*parallel*/ true);
+#else
+    plan->evaluate(result, ctxt);
+#endif
 
     // Put result in return argument
     for (long index = 0; index < (long)result.size(); index++) {
-        ctxtEval.push_back(std::pair<Ctxt, long>(result[index], precisions[index]));
+        ctxtEval.emplace_back(std::move(result[index]), precisions[index]);
     }
 }
 
 // Evaluate the optimized digit extraction polynomials
 // Same functionality as two functions above, except that we pass a list of values for e_inner: this gives the different splitting
 // values, where the first one indicates the precision of the input ciphertext (should normally be 1)
-void rowComputationGeneral(const Ctxt& ctxt, std::vector<std::pair<Ctxt, long>>& ctxtEval, long triangleSize, long rowSize, bool lazy, std::vector<long> e_inner_compose_list) {
+// Every step uses the method of digitStepMethod(), so any list can be evaluated
+// With a deferred policy, the results of the last step may be in extended form
+void rowComputationGeneral(const Ctxt& ctxt, std::vector<std::pair<Ctxt, long>>& ctxtEval, long triangleSize, long rowSize, RelinPolicy policy, std::vector<long> e_inner_compose_list) {
+    DigitPolynomialUse use(ctxt.getContext().getP());
     e_inner_compose_list.push_back(rowSize);
     ctxtEval.push_back(std::pair<Ctxt, long>(ctxt, e_inner_compose_list.front()));
 
@@ -997,79 +1468,439 @@ void rowComputationGeneral(const Ctxt& ctxt, std::vector<std::pair<Ctxt, long>>&
     for (long index = 1; index < (long)e_inner_compose_list.size(); index++) {
         long e_inner_previous = e_inner_compose_list[index - 1];
         long e_inner = e_inner_compose_list[index];
-        if ((ctxt.getContext().getP() == 2) && (e_inner_previous == 1) && (e_inner <= 16))
-            rowComputationMultivariate(std::get<0>(ctxtEval.back()), ctxtEval, std::min(rowSize, e_inner));
+        std::vector<long> precisions;
+        DigitStepMethod method = stepMethod(precisions, ctxt.getContext(), triangleSize, rowSize, e_inner_previous, e_inner);
+        Ctxt& input = std::get<0>(ctxtEval.back());
+        input.dropToNaturalPrimeSet();  // The step and the rows that read the input need no more primes than its noise
+        input.reLinearize();            // The input of a step is multiplied, relinearize the stored copy once
+        if (method == DigitStepMethod::Multivariate)
+            rowComputationMultivariate(*getDigitProgram(ctxt.getContext().getP()), std::get<0>(ctxtEval.back()), ctxtEval, std::min(rowSize, e_inner));
         else
-            rowComputationComposition(std::get<0>(ctxtEval.back()), ctxtEval, std::min(triangleSize, e_inner), std::min(rowSize, e_inner), lazy, e_inner_previous);
+            rowComputationComposition(std::get<0>(ctxtEval.back()), ctxtEval, method, precisions, policy, e_inner_previous);
+    }
+}
+
+// Same as rowComputationGeneral on a simulated ciphertext
+template <typename T>
+static void simulateRow(const SimulatedCtxt<T>& ctxt, std::vector<std::pair<SimulatedCtxt<T>, long>>& ctxtEval, const Context& context, long triangleSize, long rowSize, RelinPolicy policy, std::vector<long> e_inner_compose_list) {
+    e_inner_compose_list.push_back(rowSize);
+    ctxtEval.emplace_back(ctxt, e_inner_compose_list.front());
+
+    for (long index = 1; index < (long)e_inner_compose_list.size(); index++) {
+        long e_inner_previous = e_inner_compose_list[index - 1];
+        long e_inner = e_inner_compose_list[index];
+        std::vector<long> precisions;
+        DigitStepMethod method = stepMethod(precisions, context, triangleSize, rowSize, e_inner_previous, e_inner);
+        SimulatedCtxt<T>& stored = std::get<0>(ctxtEval.back());
+        stored.reLinearize();
+        SimulatedCtxt<T> input = stored;  // ctxtEval grows below
+        if (method == DigitStepMethod::Multivariate) {
+            getDigitProgram(context.getP())->simulate(ctxtEval, input, std::min(rowSize, e_inner));
+            continue;
+        }
+        std::vector<SimulatedCtxt<T>> result;
+        stepPlan(context, method, precisions, policy, input.getPtxtSpace(), e_inner_previous, input.getMaxRelinPower())->simulate(result, input);
+        for (long i = 0; i < (long)result.size(); i++)
+            ctxtEval.emplace_back(std::move(result[i]), precisions[i]);
+    }
+}
+
+// Cost of one step of rowComputationGeneral, going from precision e_inner_previous to e_inner
+static void stepCost(long& multiplications, long& depth, const Context& context, long triangleSize, long rowSize, bool lazy, long e_inner_previous, long e_inner) {
+    long p = context.getP();
+    std::vector<long> precisions;
+    DigitStepMethod method = stepMethod(precisions, context, triangleSize, rowSize, e_inner_previous, e_inner);
+    if (method == DigitStepMethod::Multivariate) {
+        getDigitProgram(p)->cost(multiplications, depth, std::min(rowSize, e_inner));
+        return;
+    }
+
+    // Same parameters as the plan that will evaluate them
+    planCost(multiplications, depth, context, stepPolynomials(method, context, e_inner_previous, precisions), lazy, NTL::power_long(p, std::min(rowSize, e_inner)));
+}
+
+std::vector<std::vector<long>> planDigitExtraction(const Context& context, long botHigh, long r, bool lazy) {
+    DigitPolynomialUse use(context.getP());
+    std::vector<std::vector<long>> e_inner_compose_list;
+    std::map<std::vector<long>, std::pair<long, long>> steps;    // Memoized step costs
+    for (long row = 0; row < botHigh; row++) {
+        long triangleSize = botHigh - row;
+        long rowSize = botHigh + r - row;
+        auto cost = [&](long from, long to) {
+            // Only min(triangleSize, to) and min(rowSize, to) matter for the step
+            std::vector<long> key{from, to, std::min(triangleSize, to), std::min(rowSize, to)};
+            auto it = steps.find(key);
+            if (it == steps.end()) {
+                long multiplications, depth;
+                stepCost(multiplications, depth, context, triangleSize, rowSize, lazy, from, to);
+                it = steps.emplace(key, std::make_pair(multiplications, depth)).first;
+            }
+            return it->second;
+        };
+
+        // The list {1} evaluates the whole row at once and sets the depth budget
+        long maxDepth = cost(1, rowSize).second;
+
+        // best[e][d]: fewest multiplications to reach precision e with depth d, -1 if not reachable
+        std::vector<std::vector<long>> best(rowSize + 1, std::vector<long>(maxDepth + 1, -1));
+        std::vector<std::vector<long>> previous(rowSize + 1, std::vector<long>(maxDepth + 1, 0));
+        best[1][0] = 0;
+        for (long from = 1; from < rowSize; from++) {
+            for (long d = 0; d <= maxDepth; d++) {
+                if (best[from][d] < 0)
+                    continue;
+                for (long to = from + 1; to <= rowSize; to++) {
+                    std::pair<long, long> step = cost(from, to);
+                    if (d + step.second > maxDepth)
+                        continue;
+                    long& current = best[to][d + step.second];
+                    if ((current < 0) || (best[from][d] + step.first < current)) {
+                        current = best[from][d] + step.first;
+                        previous[to][d + step.second] = from;
+                    }
+                }
+            }
+        }
+
+        // Cheapest way to reach the full row, taking the smallest depth among equal costs
+        // (the list {1} itself is always within the budget)
+        long bestDepth = -1;
+        for (long d = 0; d <= maxDepth; d++)
+            if ((best[rowSize][d] >= 0) && ((bestDepth < 0) || (best[rowSize][d] < best[rowSize][bestDepth])))
+                bestDepth = d;
+
+        // Walk back to precision 1, rowComputationGeneral appends rowSize itself
+        std::vector<long> list;
+        for (long e = rowSize, d = bestDepth; e != 1;) {
+            long from = previous[e][d];
+            d -= cost(from, e).second;
+            e = from;
+            list.push_back(e);
+        }
+        std::reverse(list.begin(), list.end());
+        e_inner_compose_list.push_back(list);
+    }
+    return e_inner_compose_list;
+}
+
+void digitExtractionCost(long& multiplications, long& depth, const Context& context, long botHigh, long r, bool lazy, const std::vector<std::vector<long>>& e_inner_compose_list) {
+    DigitPolynomialUse use(context.getP());
+    multiplications = depth = 0;
+    for (long row = 0; row < botHigh; row++) {
+        long triangleSize = botHigh - row;
+        long rowSize = botHigh + r - row;
+        std::vector<long> list = e_inner_compose_list[std::min(row, (long)e_inner_compose_list.size() - 1)];
+        list.push_back(rowSize);    // As in rowComputationGeneral
+        for (std::size_t i = 0; i + 1 < list.size(); i++) {
+            long stepMultiplications, stepDepth;
+            stepCost(stepMultiplications, stepDepth, context, triangleSize, rowSize, lazy, list[i], list[i + 1]);
+            multiplications += stepMultiplications;
+            depth += stepDepth;
+        }
+    }
+}
+
+const std::vector<std::vector<long>>& DigitExtractionPlanCache::get(const Context& context, long botHigh, long r, bool lazy) {
+    std::vector<long> key{botHigh, r, lazy};
+    {
+        HELIB_SHARED_GUARD(mx);
+        auto it = plans.find(key);
+        if (it != plans.end())
+            return it->second;
+    }
+
+    // Plan outside of the lock, if another thread got there first we keep its plan
+    std::vector<std::vector<long>> plan = planDigitExtraction(context, botHigh, r, lazy);
+    HELIB_EXCLUSIVE_GUARD(mx);
+    return plans.emplace(key, plan).first->second;
+}
+
+void DigitExtractionPlanCache::set(long botHigh, long r, bool lazy, std::vector<std::vector<long>> plan) {
+    HELIB_EXCLUSIVE_GUARD(mx);
+    plans.emplace(std::vector<long>{botHigh, r, lazy}, std::move(plan));
+}
+
+void DigitExtractionPlanCache::writeTo(std::ostream& str) const {
+    HELIB_SHARED_GUARD(mx);
+    write_raw_int(str, plans.size());
+    for (const auto& [key, plan] : plans) {
+        write_raw_vector(str, key);
+        write_raw_int(str, plan.size());
+        for (const std::vector<long>& row : plan)
+            write_raw_vector(str, row);
+    }
+}
+
+void DigitExtractionPlanCache::readFrom(std::istream& str) {
+    long nPlans = read_raw_int(str);
+    assertTrue<IOError>(nPlans >= 0, "Corrupted digit extraction plans");
+    for (long i = 0; i < nPlans; i++) {
+        std::vector<long> key;
+        read_raw_vector(str, key);
+        assertTrue<IOError>(key.size() == 3, "Corrupted digit extraction plans");
+        long nRows = read_raw_int(str);
+        assertTrue<IOError>(nRows >= 0, "Corrupted digit extraction plans");
+        std::vector<std::vector<long>> plan(nRows);
+        for (std::vector<long>& row : plan)
+            read_raw_vector(str, row);
+        set(key[0], key[1], key[2], std::move(plan));
+    }
+}
+
+const std::vector<DoubleCRT>& UnpackConstantCache::getConstants(const Context& context, const std::vector<NTL::ZZX>& encoding, const IndexSet& primes) {
+    return encode(constants, context, encoding, primes);
+}
+
+const std::vector<double>& UnpackConstantCache::getSizes(const Context& context, const std::vector<NTL::ZZX>& encoding) {
+    return bound(sizes, context, encoding);
+}
+
+const std::vector<DoubleCRT>& UnpackConstantCache::getRepackConstants(const Context& context, const IndexSet& primes) {
+    return encode(repackConstants, context, repackEncoding(context), primes);
+}
+
+const std::vector<double>& UnpackConstantCache::getRepackSizes(const Context& context) {
+    return bound(repackSizes, context, repackEncoding(context));
+}
+
+const std::vector<NTL::ZZX>& UnpackConstantCache::repackEncoding(const Context& context) {
+    {
+        HELIB_SHARED_GUARD(mx);
+        if (!repackPolys.empty())
+            return repackPolys;
+    }
+
+    const EncryptedArray& ea = context.getEA();
+    std::vector<NTL::ZZX> polys(ea.getDegree());
+    HELIB_EXEC_RANGE(long(polys.size()), first, last)
+    std::vector<NTL::ZZX> xVec;
+    for (long i = first; i < last; i++)
+        x2iInSlots(polys[i], i, xVec, ea);
+    HELIB_EXEC_RANGE_END
+    HELIB_EXCLUSIVE_GUARD(mx);
+    if (repackPolys.empty())
+        repackPolys = std::move(polys);
+    return repackPolys;
+}
+
+const std::vector<DoubleCRT>& UnpackConstantCache::encode(std::map<IndexSet, std::vector<DoubleCRT>>& cache, const Context& context, const std::vector<NTL::ZZX>& encoding, const IndexSet& primes) {
+    {
+        HELIB_SHARED_GUARD(mx);
+        auto it = cache.find(primes);
+        if (it != cache.end())
+            return it->second;
+    }
+
+    // Encode outside of the lock, entries are never erased so references stay valid
+    std::vector<DoubleCRT> dcrts(encoding.size(), DoubleCRT(context, primes));
+    HELIB_EXEC_RANGE(long(encoding.size()), first, last)
+    for (long i = first; i < last; i++)
+        dcrts[i] = DoubleCRT(encoding[i], context, primes);
+    HELIB_EXEC_RANGE_END
+    HELIB_EXCLUSIVE_GUARD(mx);
+    return cache.emplace(primes, std::move(dcrts)).first->second;
+}
+
+const std::vector<double>& UnpackConstantCache::bound(std::vector<double>& cache, const Context& context, const std::vector<NTL::ZZX>& encoding) {
+    {
+        HELIB_SHARED_GUARD(mx);
+        if (!cache.empty() || encoding.empty())
+            return cache;
     }
+
+    std::vector<const NTL::ZZX*> encodingPtrs;
+    for (const NTL::ZZX& poly : encoding)
+        encodingPtrs.push_back(&poly);
+    std::vector<NTL::xdouble> norms;
+    embeddingLargestCoeffs(norms, encodingPtrs, context.getZMStar());
+    std::vector<double> bounds(encoding.size());
+    for (long i = 0; i < long(encoding.size()); i++)
+        bounds[i] = NTL::conv<double>(norms[i]);
+    HELIB_EXCLUSIVE_GUARD(mx);
+    if (cache.empty())
+        cache = std::move(bounds);
+    return cache;
+}
+
+// The bookkeeping of the trapezoid of customExtractDigitsThin, which does not depend on the values
+// Format of the precisions: for number e, the corresponding row is defined mod p^e (so the e lower digits are
+// correct and the other ones are garbage), the precisions of the evaluations of a row are in increasing order
+// After row has been evaluated, decide for every next row whether it is a copy of the row above it (-1), which
+// evaluation it is updated with, or that it is not updated (evalPrecisions.size()), and update the precisions of
+// the rows accordingly. Returns whether the result is a copy of the last row rather than updated with the last
+// evaluation.
+static bool trapezoidSources(std::vector<long>& source, std::vector<long>& rowPrecisions, const std::vector<long>& evalPrecisions, long row, long botHigh, long r) {
+    source.assign(botHigh, evalPrecisions.size());
+    for (long nextRow = row + 1; nextRow < botHigh; nextRow++) {   // Update next rows with the result from above
+        // Check if we already have result with required precision (not possible for row + 1)
+        if ((nextRow > row + 1) && (rowPrecisions[nextRow - 1] + row + 1 >= nextRow + 1)) { // Compare precisions (interpret them wrt highest exponent botHigh + r)
+            source[nextRow] = -1;
+            rowPrecisions[nextRow] = rowPrecisions[nextRow - 1];
+        } else {
+            // Loop over the result from polynomial evaluation
+            for (long index = 0; index < (long)evalPrecisions.size(); index++) {
+                if (evalPrecisions[index] + row >= nextRow + 1) {    // Compare precisions (interpret them wrt highest exponent botHigh + r)
+                    source[nextRow] = index;
+                    rowPrecisions[nextRow] = std::min(rowPrecisions[nextRow], evalPrecisions[index]) - 1;  // Update stored precision
+                    break;
+                }
+            }
+        }
+    }
+
+    // Finally compute the result in a similar way as above
+    // Check if we already have result with required precision (not possible for last row)
+    return (botHigh > row + 1) && (rowPrecisions.back() + row + 1 >= botHigh + r); // Compare precisions (interpret them wrt highest exponent botHigh + r)
 }
 
 // Our improved digit extraction algorithm
-void customExtractDigitsThin(Ctxt& ctxt, long botHigh, long r, bool lazy, std::vector<std::vector<long>> e_inner_compose_list) {
+void customExtractDigitsThin(Ctxt& ctxt, long botHigh, long r, RelinPolicy policy, std::vector<std::vector<long>> e_inner_compose_list) {
+    // The polynomials and the program of p stay in the registry until the extraction is done
+    DigitPolynomialUse use(ctxt.getContext().getP());
+
     // Apply correction for p = 2, because balanced digit representation does not exist
     if (ctxt.getContext().getP() == 2)
         ctxt.addConstant(lround(pow(ctxt.getContext().getP(), botHigh) / 2));
 
-    // Format of the vectors below: keep pair of ciphertext and number, where
-    // the number indicates the exponent to which the ciphertext is defined
-    // - For number e, the corresponding ciphertext is defined mod p^e (so
-    //   the e lower digits are correct and the other ones are garbage)
-    // - The numbers are guaranteed to be in increasing order
-    std::vector<std::pair<Ctxt, long>> ctxtRows(botHigh, std::make_pair(ctxt, botHigh + r));  // Represent each row of the trapezoid (not including result)
+    // Represent each row of the trapezoid (not including result) with its precision, see trapezoidSources
+    // Rows with the same ciphertext share it, a row gets its own copy only when it is first updated
+    // (this keeps the peak memory down to the rows that actually differ)
+    std::vector<std::shared_ptr<Ctxt>> ctxtRows(botHigh, std::make_shared<Ctxt>(ctxt));
+    std::vector<long> rowPrecisions(botHigh, botHigh + r);
     for (int row = 0; row < botHigh; row++) {
         // Evaluate necessary polynomials only
         std::vector<std::pair<Ctxt, long>> ctxtEval;                                          // Store evaluation of digit extraction polynomials
-        rowComputationGeneral(std::get<0>(ctxtRows[row]), ctxtEval, botHigh - row, botHigh + r - row, lazy, e_inner_compose_list[std::min(row, (int)e_inner_compose_list.size() - 1)]);
-
-        // Determine starting values for next rows based on the necessary precision
-        for (int nextRow = row + 1; nextRow < botHigh; nextRow++) {   // Update next rows with the result from above
-            // Check if we already have result with required precision (not possible for row + 1)
-            if ((nextRow > row + 1) && (std::get<1>(ctxtRows[nextRow - 1]) + row + 1 >= nextRow + 1)) { // Compare precisions (interpret them wrt highest exponent botHigh + r)
-                ctxtRows[nextRow] = ctxtRows[nextRow - 1];
-            } else {
-                // Loop over the result from polynomial evaluation
-                for (std::pair<Ctxt, long> tup : ctxtEval) {
-                    if (std::get<1>(tup) + row >= nextRow + 1) {                        // Compare precisions (interpret them wrt highest exponent botHigh + r)
-                        std::get<0>(ctxtRows[nextRow]).addCtxt(std::get<0>(tup), true); // Subtract extracted digit
-                        std::get<0>(ctxtRows[nextRow]).divideByP();                     // Divide by p
-                        std::get<1>(ctxtRows[nextRow]) = std::min(std::get<1>(ctxtRows[nextRow]), std::get<1>(tup)) - 1;  // Update stored precision
-                        break;
-                    }
-                }
-            }
+        rowComputationGeneral(*ctxtRows[row], ctxtEval, botHigh - row, botHigh + r - row, policy, e_inner_compose_list[std::min(row, (int)e_inner_compose_list.size() - 1)]);
+        ctxtRows[row].reset();    // No later row reads this one
+
+        // The precisions are known in advance, so first decide for every next row whether it is a copy of
+        // the row above it or which evaluation result it needs
+        std::vector<long> evalPrecisions;
+        for (const auto& evaluation : ctxtEval)
+            evalPrecisions.push_back(std::get<1>(evaluation));
+        std::vector<long> source;
+        bool copyResult = trapezoidSources(source, rowPrecisions, evalPrecisions, row, botHigh, r);
+
+        // Free the evaluation results that no row consumes before new row copies are made
+        std::vector<bool> consumed(ctxtEval.size(), false);
+        for (long nextRow = row + 1; nextRow < botHigh; nextRow++)
+            if ((source[nextRow] >= 0) && (source[nextRow] < (long)ctxtEval.size()))
+                consumed[source[nextRow]] = true;
+        if (!copyResult)
+            consumed.back() = true;
+        for (long index = 0; index < (long)ctxtEval.size(); index++)
+            if (!consumed[index])
+                std::get<0>(ctxtEval[index]) = Ctxt(ZeroCtxtLike, ctxt);
+
+        // The updates that are not copies only read ctxtEval, so they are independent (the last index is the result)
+        auto update = [&](long nextRow) {
+            Ctxt& target = (nextRow == botHigh) ? ctxt : *ctxtRows[nextRow];
+            const Ctxt& digit = std::get<0>((nextRow == botHigh) ? ctxtEval.back() : ctxtEval[source[nextRow]]);
+            target.subtractAndDivideByP(digit); // Subtract extracted digit and divide by p
+        };
+        std::vector<long> updates;
+        for (long nextRow = row + 1; nextRow < botHigh; nextRow++)
+            if ((source[nextRow] >= 0) && (source[nextRow] < (long)ctxtEval.size()))
+                updates.push_back(nextRow);
+        if (!copyResult)
+            updates.push_back(botHigh);
+
+        // Give every updated row its own copy before the updates run, so that no update writes a ciphertext that
+        // another one still reads. Rows only share with their neighbours (the copies below), so a row is shared
+        // exactly when a neighbour still holds the same ciphertext.
+        for (long nextRow : updates) {
+            if (nextRow == botHigh)
+                continue;
+            bool shared = (nextRow > row + 1 && ctxtRows[nextRow - 1] == ctxtRows[nextRow]) ||
+                          (nextRow + 1 < botHigh && ctxtRows[nextRow + 1] == ctxtRows[nextRow]);
+            if (shared)
+                ctxtRows[nextRow] = std::make_shared<Ctxt>(*ctxtRows[nextRow]);
         }
+#ifdef HELIB_BOOT_THREADS
+        HELIB_EXEC_RANGE((long)updates.size(), first, last)
+        for (long index = first; index < last; index++)
+            update(updates[index]);
+        HELIB_EXEC_RANGE_END
+#else
+        for (long nextRow : updates)
+            update(nextRow);
+#endif
 
-        // Finally compute the result in a similar way as above
-        // Check if we already have result with required precision (not possible for last row)
-        if ((botHigh > row + 1) && (std::get<1>(ctxtRows.back()) + row + 1 >= botHigh + r)) { // Compare precisions (interpret them wrt highest exponent botHigh + r)
-            ctxt = std::get<0>(ctxtRows.back());
-        } else {
-            ctxt.addCtxt(std::get<0>(ctxtEval.back()), true); // Subtract extracted digit
-            ctxt.divideByP();                                 // Divide by p
-        }
+        // The copies depend on the updated row above them, so they are done in order afterwards
+        for (long nextRow = row + 2; nextRow < botHigh; nextRow++)
+            if (source[nextRow] < 0)
+                ctxtRows[nextRow] = ctxtRows[nextRow - 1];
+        if (copyResult)
+            ctxt = *ctxtRows.back();
     }
 
     // Necessary due to different version of homomorphic inner product in HElib
     ctxt.negate();
+    ctxt.reLinearize(); // Deferred digits end up in the result
+}
+
+// Same trapezoid as customExtractDigitsThin, every row is a plain copy
+template <typename T>
+void simulateExtractDigitsThin(SimulatedCtxt<T>& ctxt, const Context& context, long botHigh, long r, RelinPolicy policy, const std::vector<std::vector<long>>& e_inner_compose_list) {
+    long p = context.getP();
+    DigitPolynomialUse use(p);
+    assertEq(ctxt.getPtxtSpace(), NTL::power_long(p, botHigh + r), "Plaintext space must be p^(botHigh + r)");
+    if (p == 2)
+        ctxt.addConstant(NTL::ZZ(lround(pow(p, botHigh) / 2)));
+
+    std::vector<SimulatedCtxt<T>> rows(botHigh, ctxt);
+    std::vector<long> rowPrecisions(botHigh, botHigh + r);
+    for (long row = 0; row < botHigh; row++) {
+        std::vector<std::pair<SimulatedCtxt<T>, long>> ctxtEval;
+        simulateRow(rows[row], ctxtEval, context, botHigh - row, botHigh + r - row, policy, e_inner_compose_list[std::min(row, (long)e_inner_compose_list.size() - 1)]);
+
+        std::vector<long> evalPrecisions;
+        for (const auto& evaluation : ctxtEval)
+            evalPrecisions.push_back(std::get<1>(evaluation));
+        std::vector<long> source;
+        bool copyResult = trapezoidSources(source, rowPrecisions, evalPrecisions, row, botHigh, r);
+
+        for (long nextRow = row + 1; nextRow < botHigh; nextRow++)
+            if ((source[nextRow] >= 0) && (source[nextRow] < (long)ctxtEval.size()))
+                rows[nextRow].subtractAndDivideByP(std::get<0>(ctxtEval[source[nextRow]]));
+        if (!copyResult)
+            ctxt.subtractAndDivideByP(std::get<0>(ctxtEval.back()));
+        for (long nextRow = row + 2; nextRow < botHigh; nextRow++)
+            if (source[nextRow] < 0)
+                rows[nextRow] = rows[nextRow - 1];
+        if (copyResult)
+            ctxt = rows.back();
+    }
+    ctxt.negate();
+    ctxt.reLinearize();
 }
 
+template void simulateExtractDigitsThin(SimulatedCtxt<long>& ctxt, const Context& context, long botHigh, long r, RelinPolicy policy, const std::vector<std::vector<long>>& e_inner_compose_list);
+template void simulateExtractDigitsThin(SimulatedCtxt<NTL::ZZ>& ctxt, const Context& context, long botHigh, long r, RelinPolicy policy, const std::vector<std::vector<long>>& e_inner_compose_list);
+
 // Built-in digit extraction algorithm (we just call our own function inside)
 void extractDigitsThin(Ctxt& ctxt, long botHigh, long r, long ePrime, bool our_version, bool lazy, std::vector<std::vector<long>> e_inner_compose_list)
 {
   HELIB_TIMER_START;
 
-  if (ePrime < r) {     // For HElib version of homomorphic inner product, this is not allowed if we want to extract upper digits only
-    std::cout << "Warning: unfortunate choice of parameters (complexity of digit extraction is unnecessarily high because e' < r).\nPatermeters: e' = "
-              << ePrime << " and r = " << r << std::endl;
-    if (our_version)
-        throw RuntimeError("Bad parameter choice. See warning above.");
-  }
-
   // Call our own digit extraction function
   if (our_version) {
+    // With e' < r, the digits of z below p^(r-e') are also part of the result, times p^e'. Mod p^r
+    // they add up to p^e' * z, which is taken from the input rather than from extracted digits.
+    Ctxt low(ZeroCtxtLike, ctxt);
+    if (ePrime < r) {
+      long p = ctxt.getContext().getP();
+      low = ctxt;
+      low.multByConstant(NTL::power_long(p, ePrime));
+      low.reducePtxtSpace(NTL::power_long(p, r));
+    }
     customExtractDigitsThin(ctxt, botHigh, r, lazy, e_inner_compose_list);
+    ctxt += low;
   } else {
-    std::cout << "Starting built-in digit extraction." << std::endl;
+    if (ePrime < r)
+      Warning("unfortunate choice of parameters (complexity of digit extraction is unnecessarily high because e' < r), e' = "
+              + std::to_string(ePrime) + " and r = " + std::to_string(r));
+
     Ctxt unpacked(ctxt);
     unpacked.cleanUp();
 
@@ -1095,12 +1926,14 @@ void extractDigitsThin(Ctxt& ctxt, long botHigh, long r, long ePrime, bool our_v
       // std::cerr << "*** basic: " << basic_cost << "\n";
       // std::cerr << "*** chen/han: " << chen_han_cost << "\n";
 
-      double thresh = 1.5;
+      const TuningProfile& profile = tuningProfile(ctxt.getContext());
+      double thresh = profile.chenHanThreshold;
       if (p == 2)
-        thresh = 1.75;
+        thresh = profile.chenHanThresholdP2;
       // increasing thresh makes chen_han less likely to be chosen.
       // For p == 2, the basic algorithm is just squaring,
-      // and so is a bit cheaper, so we raise thresh a bit.
+      // and so is a bit cheaper, so we raise thresh a bit
+      // (by how much cheaper squaring is, if measured by autotune).
       // This is all a bit heuristic.
 
       if (basic_cost > thresh * chen_han_cost)
@@ -1112,9 +1945,6 @@ void extractDigitsThin(Ctxt& ctxt, long botHigh, long r, long ePrime, bool our_v
     else if (fhe_force_chen_han < 0)
       use_chen_han = false;
 
-    if (!use_chen_han)
-      std::cout << "Warning: Chen/Han digit extraction is not being used." << std::endl;
-
     if (use_chen_han) {
       // use Chen and Han technique
 
@@ -1126,10 +1956,8 @@ void extractDigitsThin(Ctxt& ctxt, long botHigh, long r, long ePrime, bool our_v
       }
 #endif
 
-      for (long j = 0; j < botHigh; j++) {
-        unpacked -= scratch[j];
-        unpacked.divideByP();
-      }
+      for (long j = 0; j < botHigh; j++)
+        unpacked.subtractAndDivideByP(scratch[j]);
 
       if (p == 2 && botHigh > 0) // For p==2, subtract also the previous bit
         unpacked += scratch[botHigh - 1];
@@ -1188,6 +2016,96 @@ void extractDigitsThin(Ctxt& ctxt, long botHigh, long r, long ePrime, bool our_v
   }
 }
 
+// The e_inner_compose_list of the thin bootstrapping data if the context has one, else planned on the spot
+static std::vector<std::vector<long>> digitExtractionPlan(const Context& context, long botHigh, long r, RelinPolicy policy) {
+    bool lazy = policy != RelinPolicy::Eager;
+    const std::shared_ptr<DigitExtractionPlanCache>& plans = context.getRcData().digitExtractionPlans;
+    if (plans)
+        return plans->get(context, botHigh, r, lazy);
+    return planDigitExtraction(context, botHigh, r, lazy);
+}
+
+// The exponent e of the plaintext space p^e of ctxt, which must have more than k digits
+static long ptxtDigits(const Ctxt& ctxt, long k) {
+    long p = ctxt.getContext().getP();
+    long e = 0;
+    for (long q = ctxt.getPtxtSpace(); q > 1 && q % p == 0; q /= p)
+        e++;
+    assertEq<InvalidArgument>(NTL::power_long(p, e), ctxt.getPtxtSpace(), "Plaintext space must be a power of p");
+    assertTrue<InvalidArgument>(k >= 0 && k < e, "Number of digits to remove must be in [0, e)");
+    return e;
+}
+
+void homDivideByPk(Ctxt& ctxt, long k, RelinPolicy policy) {
+    HELIB_TIMER_START;
+    long e = ptxtDigits(ctxt, k);
+    if (k == 0)
+        return;
+
+    // The trapezoid rounds to the nearest multiple of p^k (half up for p = 2), shifting down by
+    // floor(p^k / 2) makes it round down
+    long pk = NTL::power_long(ctxt.getContext().getP(), k);
+    ctxt.addConstant(-(pk / 2));
+    customExtractDigitsThin(ctxt, k, e - k, policy, digitExtractionPlan(ctxt.getContext(), k, e - k, policy));
+    ctxt.negate();
+}
+
+void homRound(Ctxt& ctxt, long k, RelinPolicy policy) {
+    HELIB_TIMER_START;
+    long e = ptxtDigits(ctxt, k);
+    if (k == 0)
+        return;
+
+    customExtractDigitsThin(ctxt, k, e - k, policy, digitExtractionPlan(ctxt.getContext(), k, e - k, policy));
+    ctxt.negate();
+    ctxt.multByP(k);
+}
+
+void liftDigit(Ctxt& ctxt, long e) {
+    HELIB_TIMER_START;
+    const Context& context = ctxt.getContext();
+    long p = context.getP();
+    assertEq<InvalidArgument>(ctxt.getPtxtSpace(), p, "The digit must have plaintext space p");
+    if (e <= 1)
+        return;
+
+    NTL::ZZX lifting;
+    const std::shared_ptr<DigitPolynomialCache>& cache = context.getRcData().digitPolynomials;
+    if (cache)
+        lifting = cache->getLifting(p, e);
+    else
+        buildLiftingPolynomial(lifting, p, e);
+
+    // Above the digit the plaintext is garbage, after t evaluations the t + 1 lowest digits are correct
+    ctxt.hackPtxtSpace(NTL::power_long(p, e));
+    for (long t = 1; t < e; t++) {
+        Ctxt lifted(ZeroCtxtLike, ctxt);
+        polyEval(lifted, lifting, ctxt);
+        ctxt = lifted;
+    }
+}
+
+void extractDigitsPolyfunc(std::vector<Ctxt>& digits, const Ctxt& ctxt, long nDigits, RelinPolicy policy) {
+    HELIB_TIMER_START;
+    long e = ptxtDigits(ctxt, 0);
+    if (nDigits <= 0)
+        nDigits = e;
+    assertTrue<InvalidArgument>(nDigits <= e, "Cannot extract more digits than the plaintext space has");
+
+    // With q_j = floor(x / p^j) mod p^(e-j), digit j is q_j - p * q_(j+1), and the last digit of x is q_(e-1)
+    digits.assign(nDigits, Ctxt(ZeroCtxtLike, ctxt));
+    Ctxt quotient(ctxt);
+    for (long j = 0; j < nDigits; j++) {
+        digits[j] = quotient;
+        if (j + 1 == e)
+            break;
+        homDivideByPk(quotient, 1, policy);
+        Ctxt shifted(quotient);
+        shifted.multByP();
+        digits[j] -= shifted;
+    }
+}
+
 // Hack to get at private fields of public key
 struct PubKeyHack
 {                         // The public key
@@ -1216,233 +2134,428 @@ struct PubKeyHack
   Ctxt recryptEkey;  // the key itself, encrypted under key #0
 };
 
-// bootstrap a ciphertext to reduce noise
-void PubKey::thinReCrypt(Ctxt& ctxt, bool our_version, bool lazy, int nb_iterations) const
+// One stage of thin bootstrapping: 0 = slotToCoeff, 1 = boot key switch, 2 = coeffToSlot, 3 = digit extraction
+// Returns false if there is nothing more to do (empty ciphertexts and dummy encryptions stop after stage 0)
+// plan is the e_inner_compose_list for our version (nullptr for the default one)
+bool PubKey::thinReCryptStage(Ctxt& ctxt, long stage, bool our_version, bool lazy, const std::vector<std::vector<long>>* plan, ThinReCryptState& state) const
 {
-  int nb_relin_digit_extract = 0;
-  long cap_first_map = 0, cap_second_map = 0, cap_digit_extract = 0, cap_in_prod = 0, cap_start = 0;
-  auto start_time_bootstrapping = std::chrono::high_resolution_clock::now();
-  auto total_time_digit_extract = start_time_bootstrapping - start_time_bootstrapping;
-  cap_start = ctxt.bitCapacity();
-
-  // Declare variables outside loop already so that we can print them at the end
-  long e = 0, ePrime = 0;
-
-  /******************************
-   ******** START LOOP **********
-   ******************************/
-  for (int iii = 0; iii < nb_iterations; iii++) {  // Average out multiple times
   HELIB_TIMER_START;
 
-  // Some sanity checks for dummy ciphertext
-  long ptxtSpace = ctxt.getPtxtSpace();
-  if (ctxt.isEmpty())
-    return;
-
-  if (ctxt.parts.size() == 1 && ctxt.parts[0].skHandle.isOne()) {
-    // Dummy encryption, just ensure that it is reduced mod p
-    NTL::ZZX poly = to_ZZX(ctxt.parts[0]);
-    for (long i = 0; i < poly.rep.length(); i++)
-      poly[i] = NTL::to_ZZ(rem(poly[i], ptxtSpace));
-    poly.normalize();
-    ctxt.DummyEncrypt(poly);
-    return;
-  }
-
-  // check that we have bootstrapping data
-  assertTrue(recryptKeyID >= 0l, "Bootstrapping data not present");
-
   long p = ctxt.getContext().getP();
   long r = ctxt.getContext().getAlMod().getR();
   long p2r = ctxt.getContext().getAlMod().getPPowR();
 
-  long intFactor = ctxt.intFactor;
-
   const ThinRecryptData& trcData = ctxt.getContext().getRcData();
 
   // the bootstrapping key is encrypted relative to plaintext space p^{e-e'+r}.
-  e = trcData.e;
-  ePrime = trcData.ePrime;
+  long e = trcData.e;
+  long ePrime = trcData.ePrime;
   long p2ePrime = NTL::power_long(p, ePrime);
   long q = NTL::power_long(p, e) + 1;
-  assertTrue(e >= r, "trcData.e must be at least alMod.r");
 
-  // can only bootstrap ciphertext with plaintext-space dividing p^r
-  assertEq(p2r % ptxtSpace,
-           0l,
-           "ptxtSpace must divide p^r when thin bootstrapping");
+  switch (stage) {
+  case 0: {
+    // Some sanity checks for dummy ciphertext
+    long ptxtSpace = ctxt.getPtxtSpace();
+    if (ctxt.isEmpty())
+      return false;
+
+    if (ctxt.parts.size() == 1 && ctxt.parts[0].skHandle.isOne()) {
+      // Dummy encryption, just ensure that it is reduced mod p
+      NTL::ZZX poly = to_ZZX(ctxt.parts[0]);
+      for (long i = 0; i < poly.rep.length(); i++)
+        poly[i] = NTL::to_ZZ(rem(poly[i], ptxtSpace));
+      poly.normalize();
+      ctxt.DummyEncrypt(poly);
+      return false;
+    }
+
+    // check that we have bootstrapping data
+    assertTrue(recryptKeyID >= 0l, "Bootstrapping data not present");
+
+    state.ptxtSpace = ptxtSpace;
+    state.intFactor = ctxt.intFactor;
+    assertTrue(e >= r, "trcData.e must be at least alMod.r");
+
+    // can only bootstrap ciphertext with plaintext-space dividing p^r
+    assertEq(p2r % ptxtSpace,
+             0l,
+             "ptxtSpace must divide p^r when thin bootstrapping");
 
 #ifdef HELIB_DEBUG
-  CheckCtxt(ctxt, "init");
+    CheckCtxt(ctxt, "init");
 #endif
 
-  ctxt.dropSmallAndSpecialPrimes();
+    ctxt.dropSmallAndSpecialPrimes();
 
 #define DROP_BEFORE_THIN_RECRYPT
 #define THIN_RECRYPT_NLEVELS (3)
 #ifdef DROP_BEFORE_THIN_RECRYPT
-  // experimental code...we should drop down to a reasonably low level
-  // before doing the first linear map.
-  long first = context.getCtxtPrimes().first();
-  long last = std::min(context.getCtxtPrimes().last(),
-                       first + THIN_RECRYPT_NLEVELS - 1);
-  ctxt.bringToSet(IndexSet(first, last));
+    // Drop down before the first linear map to the primes that the key
+    // switch will need after it, allowing one more bit than the largest
+    // growth of slotToCoeff seen so far. Until that growth is known, keep
+    // THIN_RECRYPT_NLEVELS primes.
+    long growthBits = slotToCoeffGrowthBits;
+    if (growthBits >= 0) {
+      ctxt.bringToSet(recryptPrimeSet(ctxt, q, std::ldexp(1.0, growthBits + 1)));
+    } else {
+      long first = context.getCtxtPrimes().first();
+      long last = std::min(context.getCtxtPrimes().last(),
+                           first + THIN_RECRYPT_NLEVELS - 1);
+      ctxt.bringToSet(IndexSet(first, last));
+    }
 #endif
 
 #ifdef HELIB_DEBUG
-  CheckCtxt(ctxt, "after mod down");
+    CheckCtxt(ctxt, "after mod down");
 #endif
 
-  // Move the slots to powerful-basis coefficients
-  HELIB_NTIMER_START(AAA_slotToCoeff);
-  trcData.slotToCoeff->apply(ctxt);
-  HELIB_NTIMER_STOP(AAA_slotToCoeff);
-  cap_first_map = ctxt.bitCapacity();
+    // Move the slots to powerful-basis coefficients
+    HELIB_NTIMER_START(AAA_slotToCoeff);
+    HELIB_NMEMORY_START(AAA_slotToCoeff);
+    double capBefore = ctxt.capacity();
+    trcData.slotToCoeff->apply(ctxt);
+    // The growth relative to the modulus, which is what the key switch sees
+    long bits = std::max(0L, long(std::ceil(capBefore - ctxt.capacity())));
+    long seen = slotToCoeffGrowthBits.load(std::memory_order_relaxed);
+    while (bits > seen && !slotToCoeffGrowthBits.compare_exchange_weak(seen, bits))
+      ;
+    HELIB_NMEMORY_STOP(AAA_slotToCoeff);
+    HELIB_NTIMER_STOP(AAA_slotToCoeff);
 
 #ifdef HELIB_DEBUG
-  CheckCtxt(ctxt, "after slotToCoeff");
+    CheckCtxt(ctxt, "after slotToCoeff");
 #endif
+    return true;
+  }
 
-  HELIB_NTIMER_START(AAA_bootKeySwitch);
+  case 1: {
+    HELIB_NTIMER_START(AAA_bootKeySwitch);
+    HELIB_NMEMORY_START(AAA_bootKeySwitch);
 
-  // Make sure that this ciphertext is in canonical form
-  if (!ctxt.inCanonicalForm())
-    ctxt.reLinearize();
+    // Make sure that this ciphertext is in canonical form
+    if (!ctxt.inCanonicalForm())
+      ctxt.reLinearize();
 
-  // Mod-switch down if needed
-  IndexSet s = ctxt.getPrimeSet() / context.getSpecialPrimes();
-  assertTrue(s <= context.getCtxtPrimes(), "prime set is messed up");
-  if (s.card() > 3) { // leave only first three ciphertext primes
-    long first = s.first();
-    IndexSet s3(first, first + 2);
-    s.retain(s3);
-  }
-  ctxt.modDownToSet(s);
+    // Mod-switch down to the fewest primes that the noise allows
+    IndexSet s = ctxt.getPrimeSet() / context.getSpecialPrimes();
+    assertTrue(s <= context.getCtxtPrimes(), "prime set is messed up");
+    ctxt.modDownToSet(recryptPrimeSet(ctxt, q));
 
-  // key-switch to the bootstrapping key
-  ctxt.reLinearize(recryptKeyID);
+    // key-switch to the bootstrapping key
+    ctxt.reLinearize(recryptKeyID);
 
 #ifdef HELIB_DEBUG
-  CheckCtxt(ctxt, "after key switching");
+    CheckCtxt(ctxt, "after key switching");
 #endif
 
-  // "raw mod-switch" to the bootstrapping mosulus q=p^e+1.
-  std::vector<NTL::ZZX> zzParts; // the mod-switched parts, in ZZX format
+    // "raw mod-switch" to the bootstrapping mosulus q=p^e+1.
+    std::vector<zzX> zzParts; // the mod-switched parts, in zzX format
 
-  double mfac = ctxt.getContext().getZMStar().getNormBnd();
-  double noise_est = ctxt.rawModSwitch(zzParts, q) * mfac;
-  // noise_est is an upper bound on the L-infty norm of the scaled noise
-  // in the pwrfl basis
-  double noise_bnd =
-      HELIB_MIN_CAP_FRAC * p2r * ctxt.getContext().boundForRecryption();
-  // noise_bnd is the bound assumed in selecting the parameters
-  double noise_rat = noise_est / noise_bnd;
+    double mfac = ctxt.getContext().getZMStar().getNormBnd();
+    double noise_est = ctxt.rawModSwitch(zzParts, q) * mfac;
+    // noise_est is an upper bound on the L-infty norm of the scaled noise
+    // in the pwrfl basis
+    double noise_bnd =
+        HELIB_MIN_CAP_FRAC * p2r * ctxt.getContext().boundForRecryption();
+    // noise_bnd is the bound assumed in selecting the parameters
+    double noise_rat = noise_est / noise_bnd;
 
-  HELIB_STATS_UPDATE("raw-mod-switch-noise", noise_rat);
+    HELIB_STATS_UPDATE("raw-mod-switch-noise", noise_rat);
 
-  if (noise_rat > 1) {
-    // TODO: Turn the following preprocessor logics into a warnOrThrow function
-    std::string message =
-        "rawModSwitch scaled noise exceeds bound: " + std::to_string(noise_rat);
+    if (noise_rat > 1) {
+      // TODO: Turn the following preprocessor logics into a warnOrThrow function
+      std::string message =
+          "rawModSwitch scaled noise exceeds bound: " + std::to_string(noise_rat);
 #ifdef HELIB_DEBUG
-    Warning(message);
+      Warning(message);
 #else
-    throw LogicError(message);
+      throw LogicError(message);
 #endif
-  }
+    }
 
-  assertEq(zzParts.size(),
-           (std::size_t)2,
-           "Exactly 2 parts required for mod-switching in thin bootstrapping");
+    assertEq(zzParts.size(),
+             (std::size_t)2,
+             "Exactly 2 parts required for mod-switching in thin bootstrapping");
 
 #ifdef HELIB_DEBUG
-  if (dbgKey) {
-    checkRecryptBounds(zzParts, dbgKey->getRecryptKey(), ctxt.getContext(), q);
-  }
+    if (dbgKey) {
+      checkRecryptBounds(toZZXParts(zzParts),
+                         dbgKey->getRecryptKey(),
+                         ctxt.getContext(),
+                         q);
+    }
 #endif
 
-  std::vector<NTL::ZZX> v;
-  v.resize(2);
+    std::vector<zzX> v;
+    v.resize(2);
 
-  // Add multiples of q to make the zzParts divisible by p^{e'}
-  for (long i : range(2)) {
-    // make divisible by p^{e'}
-
-    newMakeDivisible(zzParts[i], p2ePrime, q, ctxt.getContext(), v[i]);
-  }
+    // Add multiples of q to make the zzParts divisible by p^{e'}, and divide
+    // by p^{e'}, all in word-size arithmetic
+    for (long i : range(2)) {
+      newMakeDivisibleAndDivide(zzParts[i], p2ePrime, q, ctxt.getContext(), v[i]);
+    }
 
 #ifdef HELIB_DEBUG
-  if (dbgKey) {
-    checkRecryptBounds_v(v, dbgKey->getRecryptKey(), ctxt.getContext(), q);
-    checkCriticalValue(zzParts,
-                       dbgKey->getRecryptKey(),
-                       ctxt.getContext().getRcData(),
-                       q);
-  }
+    if (dbgKey) {
+      checkRecryptBounds_v(toZZXParts(v),
+                           dbgKey->getRecryptKey(),
+                           ctxt.getContext(),
+                           q);
+      checkCriticalValue(toZZXParts(zzParts, p2ePrime),
+                         dbgKey->getRecryptKey(),
+                         ctxt.getContext().getRcData(),
+                         q);
+    }
 #endif
 
-  for (long i : range(zzParts.size())) {
-    zzParts[i] /= p2ePrime; // divide by p^{e'}
-  }
-
-  // NOTE: here we lose the intFactor associated with ctxt.
-  // We will restore it below.
-  ctxt = recryptEkey;
-
-  ctxt.multByConstant(zzParts[1]);
-  ctxt.addConstant(zzParts[0]);
-  cap_in_prod = ctxt.bitCapacity();
+    // NOTE: here we lose the intFactor associated with ctxt.
+    // We will restore it below.
+    ctxt.setToInnerProduct(recryptEkey, recryptEkeyPrecon, zzParts[1], zzParts[0]);
 
 #ifdef HELIB_DEBUG
-  CheckCtxt(ctxt, "after bootKeySwitch");
+    CheckCtxt(ctxt, "after bootKeySwitch");
 #endif
 
-  HELIB_NTIMER_STOP(AAA_bootKeySwitch);
+    HELIB_NMEMORY_STOP(AAA_bootKeySwitch);
+    HELIB_NTIMER_STOP(AAA_bootKeySwitch);
+    return true;
+  }
 
-  // Move the powerful-basis coefficients to the plaintext slots
-  HELIB_NTIMER_START(AAA_coeffToSlot);
-  trcData.coeffToSlot->apply(ctxt);
-  HELIB_NTIMER_STOP(AAA_coeffToSlot);
-  cap_second_map = ctxt.bitCapacity();
+  case 2: {
+    // Move the powerful-basis coefficients to the plaintext slots
+    HELIB_NTIMER_START(AAA_coeffToSlot);
+    HELIB_NMEMORY_START(AAA_coeffToSlot);
+    trcData.coeffToSlot->apply(ctxt);
+    HELIB_NMEMORY_STOP(AAA_coeffToSlot);
+    HELIB_NTIMER_STOP(AAA_coeffToSlot);
 
 #ifdef HELIB_DEBUG
-  CheckCtxt(ctxt, "after coeffToSlot");
+    CheckCtxt(ctxt, "after coeffToSlot");
 #endif
+    return true;
+  }
 
-  // Extract the digits e-e'+r-1,...,e-e' (from fully packed slots)
-  nb_relin_digit_extract = helib::nb_relin;
-  auto start = std::chrono::high_resolution_clock::now();
-  HELIB_NTIMER_START(AAA_extractDigitsThin);
-  extractDigitsThin(ctxt, e - ePrime, r, ePrime, our_version, lazy);
-  HELIB_NTIMER_STOP(AAA_extractDigitsThin);
-  total_time_digit_extract += (std::chrono::high_resolution_clock::now() - start);
-  nb_relin_digit_extract = helib::nb_relin - nb_relin_digit_extract;
-  cap_digit_extract = ctxt.bitCapacity();
+  default: {
+    // Extract the digits e-e'+r-1,...,e-e' (from fully packed slots). For a
+    // result with fewer digits, the plaintext space drops to p^{e-e'+targetR}
+    // first: the digits above do not contribute to the result mod p^targetR.
+    long targetR = state.targetR > 0 ? state.targetR : r;
+    if (targetR < r)
+      ctxt.reducePtxtSpace(NTL::power_long(p, e - ePrime + targetR));
+    HELIB_NTIMER_START(AAA_extractDigitsThin);
+    HELIB_NMEMORY_START(AAA_extractDigitsThin);
+    if (plan)
+      extractDigitsThin(ctxt, e - ePrime, targetR, ePrime, our_version, lazy, *plan);
+    else
+      extractDigitsThin(ctxt, e - ePrime, targetR, ePrime, our_version, lazy);
+    HELIB_NMEMORY_STOP(AAA_extractDigitsThin);
+    HELIB_NTIMER_STOP(AAA_extractDigitsThin);
 
 #ifdef HELIB_DEBUG
-  CheckCtxt(ctxt, "after extractDigitsThin");
+    CheckCtxt(ctxt, "after extractDigitsThin");
 #endif
 
-  // restore intFactor
-  if (intFactor != 1)
-    ctxt.intFactor = NTL::MulMod(ctxt.intFactor, intFactor, ptxtSpace);
+    // restore intFactor
+    if (state.intFactor != 1)
+      ctxt.intFactor = NTL::MulMod(ctxt.intFactor,
+                                   state.intFactor,
+                                   std::min(state.ptxtSpace, ctxt.getPtxtSpace()));
+    return false;
+  }
   }
-  /******************************
-   ********* END LOOP ***********
-   ******************************/
+}
 
-  //std::cout << "Number of relinearizations during digit extraction: " << nb_relin_digit_extract << std::endl;
-  std::cout << "Number of digits to extract: " << e - ePrime << std::endl;
-  std::cout << "Execution time" << std::endl;
-  std::cout << "- Digit extraction: " << std::chrono::duration_cast<std::chrono::seconds>(total_time_digit_extract).count() / nb_iterations << " seconds." << std::endl;
-  std::cout << "- Total bootstrapping: " << std::chrono::duration_cast<std::chrono::seconds>(std::chrono::high_resolution_clock::now() - start_time_bootstrapping).count() / nb_iterations
-            << " seconds." << std::endl;
+static const char* const THIN_RECRYPT_STAGE_NAMES[] = {"slotToCoeff", "bootKeySwitch", "coeffToSlot", "digitExtraction"};
 
-  std::cout << "Noise capacity" << std::endl
-            << "- Initial: " << cap_in_prod << std::endl
-            << "- Linear transformations: " << (cap_start - cap_first_map) + (cap_in_prod - cap_second_map) << std::endl
-            << "- Digit extract: " << cap_second_map - cap_digit_extract << std::endl
-            << "- Remaining: " << cap_digit_extract - (cap_start - cap_first_map) << std::endl;
+// One thin bootstrapping of ctxt, returns false if there was nothing to do.
+// With fhe_stats, its operation counts go to the records "thinReCrypt-<operation>".
+bool PubKey::thinReCryptOnce(Ctxt& ctxt, bool our_version, bool lazy, const std::vector<std::vector<long>>* plan, BootstrapReport* report, long targetR) const
+{
+  OpCountScope ops;
+  // Recycle the residues of the temporaries, unless the caller already does
+  std::unique_ptr<ResidueArena> arena;
+  if (!ResidueArena::current())
+    arena.reset(new ResidueArena);
+  ThinReCryptState state;
+  state.targetR = targetR;
+  for (long stage = 0; stage < THIN_RECRYPT_STAGES; stage++) {
+    bool more = measureStage(report, THIN_RECRYPT_STAGE_NAMES[stage], ctxt, [&]() {
+      return thinReCryptStage(ctxt, stage, our_version, lazy, plan, state);
+    });
+    if (!more) {
+      if (stage < THIN_RECRYPT_STAGES - 1)
+        return false;
+      break;
+    }
+  }
+  updateOpCountStats("thinReCrypt", ops.counts());
+  return true;
+}
+
+// bootstrap a ciphertext to reduce noise
+void PubKey::thinReCrypt(Ctxt& ctxt, bool our_version, bool lazy, BootstrapReport* report) const
+{
+  thinReCryptTo(ctxt, context.getAlMod().getR(), our_version, lazy, report);
+}
+
+void PubKey::thinReCryptTo(Ctxt& ctxt, long targetR, bool our_version, bool lazy, BootstrapReport* report) const
+{
+  assertInRange<InvalidArgument>(targetR,
+                                 1l,
+                                 context.getAlMod().getR(),
+                                 "targetR must be in [1, r]",
+                                 /*right_inclusive=*/true);
+  ExecutionPolicy::Scope policyScope(context.effectiveExecutionPolicy());
+  if (report)
+    report->clear();
+  auto wallStart = std::chrono::steady_clock::now();
+  std::clock_t cpuStart = std::clock();
+
+  // The digit extraction plan is made for the digits of the result
+  const ThinRecryptData& trcData = context.getRcData();
+  long e = trcData.e, ePrime = trcData.ePrime;
+  const std::vector<std::vector<long>>* plan = nullptr;
+  if (our_version && trcData.digitExtractionPlans)
+    plan = &trcData.digitExtractionPlans->get(context, e - ePrime, targetR, lazy);
+
+  thinReCryptOnce(ctxt, our_version, lazy, plan, report, targetR);
+  finishReport(report, e - ePrime, wallStart, cpuStart);
+}
+
+void PubKey::thinReCrypt(const PtrVector<Ctxt>& ctxts, bool our_version, bool lazy) const
+{
+  long n = ctxts.size();
+  if (n == 0)
+    return;
+  ExecutionPolicy::Scope policyScope(context.effectiveExecutionPolicy());
+
+  // Everything that does not depend on the ciphertext is shared: the plan,
+  // and the polynomial and evaluation plan caches of the context
+  const ThinRecryptData& trcData = context.getRcData();
+  const std::vector<std::vector<long>>* plan = nullptr;
+  if (our_version && trcData.digitExtractionPlans)
+    plan = &trcData.digitExtractionPlans->get(context, trcData.e - trcData.ePrime, context.getAlMod().getR(), lazy);
+
+  // A single ciphertext keeps the parallelism inside the stages
+  if (n == 1) {
+    thinReCryptOnce(*ctxts[0], our_version, lazy, plan, nullptr);
+    return;
+  }
+
+#ifdef HELIB_BOOT_THREADS
+  HELIB_EXEC_RANGE(n, first, last)
+  for (long i = first; i < last; i++)
+    thinReCryptOnce(*ctxts[i], our_version, lazy, plan, nullptr);
+  HELIB_EXEC_RANGE_END
+#else
+  for (long i = 0; i < n; i++)
+    thinReCryptOnce(*ctxts[i], our_version, lazy, plan, nullptr);
+#endif
+}
+
+void PubKey::thinReCrypt(std::vector<Ctxt>& ctxts, bool our_version, bool lazy) const
+{
+  CtPtrs_vectorCt ptrs(ctxts);
+  thinReCrypt(ptrs, our_version, lazy);
+}
+
+void PubKey::thinReCrypt(Ctxt& ctxt, const ExecutionPolicy& policy, bool our_version, bool lazy, BootstrapReport* report) const
+{
+  ExecutionPolicy::Scope policyScope(policy);
+  thinReCrypt(ctxt, our_version, lazy, report);
+}
+
+void PubKey::thinReCrypt(const PtrVector<Ctxt>& ctxts, const ExecutionPolicy& policy, bool our_version, bool lazy) const
+{
+  ExecutionPolicy::Scope policyScope(policy);
+  thinReCrypt(ctxts, our_version, lazy);
+}
+
+void PubKey::thinReCrypt(std::vector<Ctxt>& ctxts, const ExecutionPolicy& policy, bool our_version, bool lazy) const
+{
+  ExecutionPolicy::Scope policyScope(policy);
+  thinReCrypt(ctxts, our_version, lazy);
+}
+
+void PubKey::thinReCryptPipelined(const PtrVector<Ctxt>& ctxts, long maxInFlight, bool our_version, bool lazy) const
+{
+  assertTrue<InvalidArgument>(maxInFlight > 0, "maxInFlight must be positive");
+  long n = ctxts.size();
+  if (n == 0)
+    return;
+  ExecutionPolicy::Scope policyScope(context.effectiveExecutionPolicy());
+
+  const ThinRecryptData& trcData = context.getRcData();
+  const std::vector<std::vector<long>>* plan = nullptr;
+  if (our_version && trcData.digitExtractionPlans)
+    plan = &trcData.digitExtractionPlans->get(context, trcData.e - trcData.ePrime, context.getAlMod().getR(), lazy);
+
+  // Scheduler state, protected by mx: the next stage of every admitted
+  // ciphertext (THIN_RECRYPT_STAGES once it is done) and whether a worker is on it
+  std::mutex mx;
+  std::condition_variable changed;
+  std::vector<long> stage(n, 0);
+  std::vector<bool> busy(n, false);
+  std::vector<ThinReCryptState> states(n);
+  long admitted = 0, finished = 0;
+  std::exception_ptr error;
+
+  // The ready ciphertext in the latest stage (it frees its memory soonest),
+  // else a new one if there is room, else -1
+  auto pick = [&]() {
+    long best = -1;
+    for (long i = 0; i < admitted; i++)
+      if (!busy[i] && (stage[i] < THIN_RECRYPT_STAGES) && ((best < 0) || (stage[i] > stage[best])))
+        best = i;
+    if ((best < 0) && (admitted < n) && (admitted - finished < maxInFlight))
+      best = admitted++;
+    return best;
+  };
+
+  auto work = [&]() {
+    ResidueArena arena; // every worker recycles its own temporaries
+    std::unique_lock<std::mutex> lock(mx);
+    while ((finished < n) && !error) {
+      long i = pick();
+      if (i < 0) {    // everything in flight is being worked on
+        changed.wait(lock);
+        continue;
+      }
+      busy[i] = true;
+      long current = stage[i];
+      lock.unlock();
+      bool more = false;
+      std::exception_ptr failure;
+      try {
+        more = thinReCryptStage(*ctxts[i], current, our_version, lazy, plan, states[i]);
+      } catch (...) {
+        failure = std::current_exception();
+      }
+      lock.lock();
+      busy[i] = false;
+      stage[i] = more ? current + 1 : THIN_RECRYPT_STAGES;
+      if (stage[i] == THIN_RECRYPT_STAGES)
+        finished++;
+      if (failure && !error)
+        error = failure;
+      changed.notify_all();
+    }
+  };
+
+  // Every worker runs the scheduler loop, so the stages of different ciphertexts overlap
+  // (the parallel loops inside the stages are shared by the idle workers, see multicore.h)
+#ifdef HELIB_BOOT_THREADS
+  long workers = std::min(maxInFlight, availableThreads());
+#else
+  long workers = 1;
+#endif
+  HELIB_EXEC_INDEX(workers, index)
+  work();
+  HELIB_EXEC_INDEX_END
+
+  if (error)
+    std::rethrow_exception(error);
 }
 
 #ifdef HELIB_DEBUG
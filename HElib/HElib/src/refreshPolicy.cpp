@@ -0,0 +1,90 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <helib/refreshPolicy.h>
+
+#include <cmath>
+
+#include <helib/bootstrapEstimate.h>
+#include <helib/Context.h>
+#include <helib/Ctxt.h>
+#include <helib/keys.h>
+#include <helib/PtrVector.h>
+
+namespace helib {
+
+namespace {
+
+thread_local bool refreshSuspended = false;
+
+} // namespace
+
+RefreshPolicy::RefreshPolicy(const PubKey& publicKey,
+                             bool thick,
+                             bool our_version,
+                             bool lazy,
+                             double marginBits) :
+    publicKey(publicKey), thick(thick), our_version(our_version), lazy(lazy)
+{
+  // Only the capacities of the estimate are used, they do not depend on
+  // the costs of the operations
+  const Context& context = publicKey.getContext();
+  BootstrapReport estimate =
+      thick ? estimateReCrypt(context, OperationCosts(), our_version, lazy)
+            : estimateThinReCrypt(context, OperationCosts(), our_version, lazy);
+  minCapacity = estimate.stages.front().capacityBefore + marginBits;
+  maxCapacity = estimate.stages.back().capacityAfter;
+}
+
+bool RefreshPolicy::needsRefresh(const Ctxt& ctxt, long levels) const
+{
+  if (ctxt.isEmpty() || ctxt.isCKKS())
+    return false;
+  long p2r = ctxt.getContext().getAlMod().getPPowR();
+  if (p2r % ctxt.getPtxtSpace() != 0)
+    return false;
+
+  // One more bit for the noise of the relinearizations
+  double levelBits =
+      NTL::log(ctxt.modSwitchAddedNoiseBound()) / std::log(2.0) + 1;
+  double capacity = ctxt.capacity();
+  return capacity - levels * levelBits < minCapacity && capacity < maxCapacity;
+}
+
+void RefreshPolicy::refresh(Ctxt& ctxt) const
+{
+  Suspend suspend;
+  if (thick)
+    publicKey.reCrypt(ctxt, our_version, lazy);
+  else
+    publicKey.thinReCrypt(ctxt, our_version, lazy);
+}
+
+void RefreshPolicy::refresh(const PtrVector<Ctxt>& ctxts) const
+{
+  Suspend suspend;
+  if (thick) {
+    for (long i : range(ctxts.size()))
+      publicKey.reCrypt(*ctxts[i], our_version, lazy);
+  } else
+    publicKey.thinReCrypt(ctxts, our_version, lazy);
+}
+
+bool RefreshPolicy::suspended() { return refreshSuspended; }
+
+RefreshPolicy::Suspend::Suspend(bool suspend) : previous(refreshSuspended)
+{
+  refreshSuspended = suspend;
+}
+
+RefreshPolicy::Suspend::~Suspend() { refreshSuspended = previous; }
+
+} // namespace helib
@@ -11,6 +11,13 @@
  */
 
 #include <helib/replicate.h>
+
+#include <algorithm>
+#include <functional>
+
+#include <helib/automorphPrecon.h>
+#include <helib/multicore.h>
+#include <helib/opCounters.h>
 #include <helib/timing.h>
 #include <helib/ClonedPtr.h>
 
@@ -349,6 +356,70 @@ static void replicateOneBlock(const EncryptedArray& ea,
   }
 }
 
+// The mask of the coordinates c in dimension d with inRange(c), stored in
+// entry if it is not there yet
+static const FatEncodedPtxt& dimMask(const EncryptedArray& ea,
+                                     CopiedPtr<FatEncodedPtxt>& entry,
+                                     long d,
+                                     const std::function<bool(long)>& inRange)
+{
+  if (!entry) { // generate mask if not there already
+    long nSlots = ea.size();
+    std::vector<bool> maskArray(nSlots, false);
+    for (long i = 0; i < nSlots; i++)
+      maskArray[i] = inRange(ea.coordinate(d, i));
+    EncodedPtxt mask;
+    ea.encode(mask, maskArray);
+    entry.reset(new FatEncodedPtxt(mask, ea.getContext().fullPrimes()));
+  }
+  return *entry;
+}
+
+// The masks of a node of recursiveReplicateDim at level k (after k--): the
+// positions of the left half [0..extent) with bit k == 0, that mask rotated
+// by 2^k, and the positions with bit k == 1 rotated by -2^k. A rotation
+// moves a 0/1 mask as it moves the slots, even around the end of a bad
+// dimension, so the rotated masks are encoded directly.
+static const FatEncodedPtxt& nodeMask(const EncryptedArray& ea,
+                                      RepAuxDim& repAux,
+                                      long d,
+                                      long extent,
+                                      long k)
+{
+  return dimMask(ea, repAux.tab(d, k + 1), d, [extent, k](long c) {
+    return c < extent && NTL::bit(c, k) == 0;
+  });
+}
+
+static const FatEncodedPtxt& nodeMaskLeft(const EncryptedArray& ea,
+                                          RepAuxDim& repAux,
+                                          long d,
+                                          long extent,
+                                          long k)
+{
+  long dSize = ea.sizeOfDimension(d);
+  return dimMask(ea, repAux.tabLeft(d, k + 1), d, [=](long c) {
+    long c0 = (c - (1L << k) + dSize) % dSize;
+    return c0 < extent && NTL::bit(c0, k) == 0;
+  });
+}
+
+static const FatEncodedPtxt& nodeMaskRight(const EncryptedArray& ea,
+                                           RepAuxDim& repAux,
+                                           long d,
+                                           long extent,
+                                           long k)
+{
+  long dSize = ea.sizeOfDimension(d);
+  return dimMask(ea, repAux.tabRight(d, k + 1), d, [=](long c) {
+    long c0 = (c + (1L << k)) % dSize;
+    return c0 < extent && NTL::bit(c0, k) == 1;
+  });
+}
+
+// The number of levels of binary forking of a parallel loop over n tasks
+static long forkLevels(long n) { return NTL::NumBits(n - 1); }
+
 // forward declaration...mutual recursion
 static void replicateAllNextDim(const EncryptedArray& ea,
                                 const Ctxt& ctxt,
@@ -356,7 +427,9 @@ static void replicateAllNextDim(const EncryptedArray& ea,
                                 long dimProd,
                                 long recBound,
                                 RepAuxDim& repAux,
-                                ReplicateHandler* handler);
+                                ReplicateHandler* handler,
+                                long slot,
+                                long forks);
 
 // recursiveReplicateDim:
 //   d = dimension
@@ -367,6 +440,10 @@ static void replicateAllNextDim(const EncryptedArray& ea,
 //   0 <= limit < ea.sizeOfDimension(): max # of positions to process
 //   dimProd: product of dimensions 0..d
 //   recBound: recursion bound (controls noise)
+//   slot: the slot with the coordinates of dimensions 0..d-1 of the
+//     replicated ones, and coordinate 0 in dimensions d,...
+//   base: the coordinate in dimension d of relative position 0
+//   forks: the levels of binary forking still allowed (0 when serial)
 //
 // SHAI: limit and extent are always the same, it seems
 static void recursiveReplicateDim(const EncryptedArray& ea,
@@ -379,7 +456,10 @@ static void recursiveReplicateDim(const EncryptedArray& ea,
                                   long dimProd,
                                   long recBound,
                                   RepAuxDim& repAux,
-                                  ReplicateHandler* handler)
+                                  ReplicateHandler* handler,
+                                  long slot,
+                                  long base,
+                                  long forks)
 {
   if (pos >= limit)
     return;
@@ -390,26 +470,29 @@ static void recursiveReplicateDim(const EncryptedArray& ea,
   }
 
   long dSize = ea.sizeOfDimension(d);
-  long nSlots = ea.size();
 
   if (k == 0) { // last level in this dimension: blocks of size 2^k=1
+    long nextSlot = ea.addCoord(d, slot, base + pos);
 
     if (extent >= dSize) { // nothing to do in this dimension
-      replicateAllNextDim(ea, ctxt, d + 1, dimProd, recBound, repAux, handler);
+      replicateAllNextDim(ea,
+                          ctxt,
+                          d + 1,
+                          dimProd,
+                          recBound,
+                          repAux,
+                          handler,
+                          nextSlot,
+                          forks);
       return;
     } // SHAI: Will we ever have extent > dSize??
 
     // need to replicate to fill positions [ (1L << n) .. dSize-1 ]
 
-    if (!repAux.tab(d, 0)) { // generate mask if not there already
-      EncodedPtxt mask;
-      SelectRangeDim(ea, mask, 0, dSize - extent, d);
-      repAux.tab(d, 0).reset(
-          new FatEncodedPtxt(mask, ea.getContext().fullPrimes()));
-    }
-
     Ctxt ctxt_tmp = ctxt;
-    ctxt_tmp.multByConstant(*repAux.tab(d, 0));
+    ctxt_tmp.multByConstant(dimMask(ea, repAux.tab(d, 0), d, [=](long c) {
+      return c < dSize - extent;
+    }));
 
     ea.rotate1D(ctxt_tmp, d, extent, /*don't-care-flag=*/true);
     ctxt_tmp += ctxt;
@@ -419,46 +502,27 @@ static void recursiveReplicateDim(const EncryptedArray& ea,
                         dimProd,
                         recBound,
                         repAux,
-                        handler);
+                        handler,
+                        nextSlot,
+                        forks);
     return;
   }
 
   // If we need to stop early, call the handler
   if (handler->earlyStop(d, k, dimProd)) {
-    handler->handle(ctxt);
+    handler->handleAt(ctxt, ea.addCoord(d, slot, base + pos));
     return;
   }
 
   k--;
-  Ctxt ctxt_masked = ctxt;
-
-  {   // artificial scope to minimize storage in the recursion
-    { // another artificial scope (SHAI: this seems redundant)
+  long posRight = pos + (1L << k);
 
-      // generate mask at index k+1, if not there yet
-
-      if (!repAux.tab(d, k + 1)) { // need to generate
-        std::vector<bool> maskArray(nSlots, false);
-        for (long i = 0; i < nSlots; i++) {
-          long c = ea.coordinate(d, i);
-          if (c < extent && NTL::bit(c, k) == 0)
-            maskArray[i] = true;
-        }
-        // store this mask in the repAux table
-        EncodedPtxt mask;
-        ea.encode(mask, maskArray);
-        repAux.tab(d, k + 1).reset(
-            new FatEncodedPtxt(mask, ea.getContext().fullPrimes()));
-      }
-
-      // Apply mask to zero out slots in ctxt
-      ctxt_masked.multByConstant(*repAux.tab(d, k + 1));
-    }
-
-    Ctxt ctxt_left = ctxt_masked;
+  if (posRight >= limit) { // only the left half is needed
+    Ctxt ctxt_left = ctxt;
+    ctxt_left.multByConstant(nodeMask(ea, repAux, d, extent, k));
+    Ctxt ctxt_masked = ctxt_left;
     ea.rotate1D(ctxt_left, d, 1L << k, /*don't-care-flag=*/true);
     ctxt_left += ctxt_masked;
-
     recursiveReplicateDim(ea,
                           ctxt_left,
                           d,
@@ -469,30 +533,99 @@ static void recursiveReplicateDim(const EncryptedArray& ea,
                           dimProd,
                           recBound,
                           repAux,
-                          handler);
+                          handler,
+                          slot,
+                          base,
+                          forks);
+    return;
   }
 
-  pos += (1L << k);
-  if (pos >= limit)
-    return;
+  // With M the mask of the left half and M' that of the right half, the
+  // halves are M*c + rot(M*c, 2^k) and M'*c + rot(M'*c, -2^k). Since
+  // rot(M*c, s) = rot(M, s)*rot(c, s), both rotations are applied to c and
+  // are hoisted.
+  std::vector<Ctxt> rotated;
+  {
+    const PAlgebra& zMStar = ea.getPAlgebra();
+    BasicAutomorphPrecon precon(ctxt);
+    rotated = precon.automorph({zMStar.genToPow(d, 1L << k),
+                                zMStar.genToPow(d, dSize - (1L << k))});
+  }
 
-  Ctxt ctxt_right = ctxt;
-  ctxt_right -= ctxt_masked;
-  ctxt_masked = ctxt_right; // reuse ctxt_masked as a temp
-  ea.rotate1D(ctxt_masked, d, -(1L << k), /*don't-care-flag=*/true);
-  ctxt_right += ctxt_masked;
+  // The two halves are independent
+  auto half = [&](long right, long forksLeft) {
+    Ctxt ctxt_half = ctxt;
+    ctxt_half.multByConstant(nodeMask(ea, repAux, d, extent, k));
+    Ctxt& ctxt_rot = rotated[right];
+    ctxt_rot.cleanUp();
+    if (right) {
+      ctxt_half.negate();
+      ctxt_half += ctxt; // M'*c = c - M*c, as c is zero past extent
+      ctxt_rot.multByConstant(nodeMaskRight(ea, repAux, d, extent, k));
+    } else {
+      ctxt_rot.multByConstant(nodeMaskLeft(ea, repAux, d, extent, k));
+    }
+    ctxt_half += ctxt_rot;
+    ctxt_rot.clear();
+    recursiveReplicateDim(ea,
+                          ctxt_half,
+                          d,
+                          extent,
+                          k,
+                          right ? posRight : pos,
+                          limit,
+                          dimProd,
+                          recBound,
+                          repAux,
+                          handler,
+                          slot,
+                          base,
+                          forksLeft);
+  };
+  if (forks > 0) {
+    HELIB_EXEC_INDEX(2, right)
+    half(right, forks - 1);
+    HELIB_EXEC_INDEX_END
+  } else {
+    half(0, 0);
+    half(1, 0);
+  }
+}
 
-  recursiveReplicateDim(ea,
-                        ctxt_right,
-                        d,
-                        extent,
-                        k,
-                        pos,
-                        limit,
-                        dimProd,
-                        recBound,
-                        repAux,
-                        handler);
+// The bits k of the blocks of size 2^k that replicateAllNextDim starts
+// from in dimension d, dimProd being the product of dimensions 0..d
+static long initialBlockBits(const EncryptedArray& ea,
+                             long d,
+                             long dimProd,
+                             long recBound)
+{
+  long dSize = ea.sizeOfDimension(d);
+  long n = GreatestPowerOfTwo(dSize); // 2^n <= dSize
+  long k = n;
+
+  // The logic below cut the recursion depth by starting from smaller
+  // blocks (by default size approx n rather than 2^n).
+  // The initial block size is controlled by the recBound parameter:
+  //   + recBound>0: blocks of size min(~n, 2^recBound). this ensures
+  //     recursion depth <= recBound, and typically much smaller (~log n)
+  //   + recBound=0: blocks of size 1 (no recursion)
+  //   + recBound<0: blocks of size 2^n (full recursion)
+
+  if (recBound >= 0) { // use heuristic recursion bound
+    k = 0;
+    if (dSize > 2 && dimProd * NTL::NumBits(dSize) > ea.size() / 8) {
+      k = NTL::NumBits(NTL::NumBits(dSize)) - 1;
+      if (k > n)
+        k = n;
+      if (k > recBound)
+        k = recBound;
+    }
+  } else { // SHAI: I don't understand this else case
+    k = -recBound;
+    if (k > n)
+      k = n;
+  }
+  return k;
 }
 
 void replicateAllNextDim(const EncryptedArray& ea,
@@ -501,23 +634,22 @@ void replicateAllNextDim(const EncryptedArray& ea,
                          long dimProd,
                          long recBound,
                          RepAuxDim& repAux,
-                         ReplicateHandler* handler)
+                         ReplicateHandler* handler,
+                         long slot,
+                         long forks)
 
 {
   assertTrue<InvalidArgument>(d >= 0l, "dimension must be non-negative");
 
   // If already fully replicated (or we need to stop early), call the handler
   if (d >= ea.dimension() || handler->earlyStop(d, /*k=*/-1, dimProd)) {
-    handler->handle(ctxt);
+    handler->handleAt(ctxt, slot);
     return;
   }
 
   long dSize = ea.sizeOfDimension(d);
   dimProd *= dSize; // product of all dimensions including this one
 
-  long n = GreatestPowerOfTwo(dSize); // 2^n <= dSize
-  long k = n;
-
   // We replicate 2^k-size blocks along this dimension, then call the
   // recursive procedure to handle the smaller subblocks. Consider for
   // example a 2D 5x2 cube, so the original slots are
@@ -543,29 +675,7 @@ void replicateAllNextDim(const EncryptedArray& ea,
   // replication of these entries, and a final step will deal with the
   // "leftover" positions s8 s9
 
-  // The logic below cut the recursion depth by starting from smaller
-  // blocks (by default size approx n rather than 2^n).
-  // The initial block size is controlled by the recBound parameter:
-  //   + recBound>0: blocks of size min(~n, 2^recBound). this ensures
-  //     recursion depth <= recBound, and typically much smaller (~log n)
-  //   + recBound=0: blocks of size 1 (no recursion)
-  //   + recBound<0: blocks of size 2^n (full recursion)
-
-  if (recBound >= 0) { // use heuristic recursion bound
-    k = 0;
-    if (dSize > 2 && dimProd * NTL::NumBits(dSize) > ea.size() / 8) {
-      k = NTL::NumBits(NTL::NumBits(dSize)) - 1;
-      if (k > n)
-        k = n;
-      if (k > recBound)
-        k = recBound;
-    }
-  } else { // SHAI: I don't understand this else case
-    k = -recBound;
-    if (k > n)
-      k = n;
-  }
-
+  long k = initialBlockBits(ea, d, dimProd, recBound);
   long blockSize = 1L << k; // blocks of size 2^k
   long numBlocks = dSize / blockSize;
   long extent = numBlocks * blockSize;
@@ -576,31 +686,63 @@ void replicateAllNextDim(const EncryptedArray& ea,
 
   Ctxt ctxt1 = ctxt;
 
-  if (extent < dSize) { // select only the slots 0..extent-1 in this dimension
-    if (!repAux.tab1(d, 0)) { // generate mask if not already there
-      EncodedPtxt mask;
-      SelectRangeDim(ea, mask, 0, extent, d);
-      repAux.tab1(d, 0).reset(
-          new FatEncodedPtxt(mask, ea.getContext().fullPrimes()));
-      // store mask in 2nd table (tab1)
-    }
-    ctxt1.multByConstant(*repAux.tab1(d, 0)); // mult by mask to zero out slots
-  }
+  if (extent < dSize) // select only the slots 0..extent-1 in this dimension
+    ctxt1.multByConstant(dimMask(ea, repAux.tab1(d, 0), d, [=](long c) {
+      return c < extent;
+    })); // mult by mask to zero out slots
+
+  // The blocks, and the leftover slots if dSize is not an integral number
+  // of blocks, are independent
+  long nTasks = numBlocks + (extent < dSize ? 1 : 0);
+  bool parallel = forks > 0 && nTasks > 1;
+  long forksLeft = parallel ? std::max(forks - forkLevels(nTasks), 0L) : forks;
+  auto task = [&](long pos) {
+    if (pos == numBlocks) { // the leftover slots
+      // zero-out the slots from before, leaving only the leftover slots
+      Ctxt ctxt2 = ctxt;
+      ctxt2.multByConstant(dimMask(ea, repAux.tab1(d, 1), d, [=](long c) {
+        return c >= extent;
+      })); // mult by mask to zero out slots
+
+      // move relevant slots to the beginning
+      ea.rotate1D(ctxt2, d, -extent, /*don't-care-flag=*/true);
+
+      // replicate the leftover block across this dimension using a simple
+      // shift-and-add procedure.
+      replicateOneBlock(ea, ctxt2, 0, blockSize, d);
 
-  if (numBlocks == 1) { // just one block, call the recursive replication
-    recursiveReplicateDim(ea,
-                          ctxt1,
-                          d,
-                          extent,
-                          k,
-                          0,
-                          extent,
-                          dimProd,
-                          recBound,
-                          repAux,
-                          handler);
-  } else { // replicate the slots in each block separately
-    for (long pos = 0; pos < numBlocks; pos++) {
+      // now call the recursive replication to do the rest of the work
+      recursiveReplicateDim(ea,
+                            ctxt2,
+                            d,
+                            extent,
+                            k,
+                            extent,
+                            dSize,
+                            dimProd,
+                            recBound,
+                            repAux,
+                            handler,
+                            slot,
+                            0,
+                            forksLeft);
+    } else if (numBlocks == 1) { // just one block, call the recursive
+                                 // replication
+      recursiveReplicateDim(ea,
+                            ctxt1,
+                            d,
+                            extent,
+                            k,
+                            0,
+                            extent,
+                            dimProd,
+                            recBound,
+                            repAux,
+                            handler,
+                            slot,
+                            0,
+                            forksLeft);
+    } else { // replicate the slots in each block separately
       Ctxt ctxt2 = ctxt1;
       // zero-out all the slots outside the current block
       SelectRangeDim(ea, ctxt2, pos * blockSize, (pos + 1) * blockSize, d);
@@ -620,42 +762,46 @@ void replicateAllNextDim(const EncryptedArray& ea,
                             dimProd,
                             recBound,
                             repAux,
-                            handler);
+                            handler,
+                            slot,
+                            pos * blockSize,
+                            forksLeft);
     }
+  };
+  if (parallel) {
+    HELIB_EXEC_INDEX(nTasks, pos)
+    task(pos);
+    HELIB_EXEC_INDEX_END
+  } else {
+    for (long pos = 0; pos < nTasks; pos++)
+      task(pos);
   }
+}
 
-  // If dSize is not an integral number of blocks, then we still need
-  // to deal with the leftover slots.
-  if (extent < dSize) {
-    // zero-out the slots from before, leaving only the leftover slots
-    ctxt1 = ctxt;
-    if (!repAux.tab1(d, 1)) { // generate mask if not already there
-      EncodedPtxt mask;
-      SelectRangeDim(ea, mask, extent, dSize, d);
-      repAux.tab1(d, 1).reset(
-          new FatEncodedPtxt(mask, ea.getContext().fullPrimes()));
+// Generate all the masks that replicateAll may use, so that the parallel
+// tasks only read repAux
+static void prepareRepAux(const EncryptedArray& ea,
+                          long recBound,
+                          RepAuxDim& repAux)
+{
+  long dimProd = 1;
+  for (long d = 0; d < ea.dimension(); d++) {
+    long dSize = ea.sizeOfDimension(d);
+    dimProd *= dSize;
+    long k = initialBlockBits(ea, d, dimProd, recBound);
+    long extent = (dSize >> k) << k;
+    if (extent < dSize) {
+      dimMask(ea, repAux.tab(d, 0), d, [=](long c) {
+        return c < dSize - extent;
+      });
+      dimMask(ea, repAux.tab1(d, 0), d, [=](long c) { return c < extent; });
+      dimMask(ea, repAux.tab1(d, 1), d, [=](long c) { return c >= extent; });
+    }
+    for (long j = 0; j < k; j++) {
+      nodeMask(ea, repAux, d, extent, j);
+      nodeMaskLeft(ea, repAux, d, extent, j);
+      nodeMaskRight(ea, repAux, d, extent, j);
     }
-    ctxt1.multByConstant(*repAux.tab1(d, 1)); // mult by mask to zero out slots
-
-    // move relevant slots to the beginning
-    ea.rotate1D(ctxt1, d, -extent, /*don't-care-flag=*/true);
-
-    // replicate the leftover block across this dimension using a simple
-    // shift-and-add procedure.
-    replicateOneBlock(ea, ctxt1, 0, blockSize, d);
-
-    // now call the recursive replication to do the rest of the work
-    recursiveReplicateDim(ea,
-                          ctxt1,
-                          d,
-                          extent,
-                          k,
-                          extent,
-                          dSize,
-                          dimProd,
-                          recBound,
-                          repAux,
-                          handler);
   }
 }
 
@@ -679,7 +825,15 @@ void replicateAll(const EncryptedArray& ea,
   RepAuxDim repAux;
   if (repAuxPtr == nullptr)
     repAuxPtr = &repAux;
-  replicateAllNextDim(ea, ctxt, 0, 1, recBound, *repAuxPtr, handler);
+
+  // A concurrent handler gets about twice as many parallel tasks as there
+  // are threads
+  long forks = 0;
+  if (handler->concurrent() && availableThreads() > 1) {
+    forks = NTL::NumBits(availableThreads());
+    prepareRepAux(ea, recBound, *repAuxPtr);
+  }
+  replicateAllNextDim(ea, ctxt, 0, 1, recBound, *repAuxPtr, handler, 0, forks);
 }
 
 //! @brief An implementation of ReplicateHandler that explicitly returns
@@ -690,12 +844,16 @@ void replicateAll(const EncryptedArray& ea,
 class ExplicitReplicator : public ReplicateHandler
 {
   std::vector<Ctxt>& v; // space to store all ciphertexts
-  long slot;
 
 public:
   // _v must already be of the right size (=number-of-slots)
-  ExplicitReplicator(std::vector<Ctxt>& _v) : v(_v), slot(0) {}
-  virtual void handle(const Ctxt& ctxt) { v[slot++] = ctxt; }
+  ExplicitReplicator(std::vector<Ctxt>& _v) : v(_v) {}
+  virtual void handle(const Ctxt&) override {}
+  virtual bool concurrent() const override { return true; }
+  virtual void handleAt(const Ctxt& ctxt, long slot) override
+  {
+    v[slot] = ctxt;
+  }
 };
 
 // Returns the result as a vector of ciphertexts
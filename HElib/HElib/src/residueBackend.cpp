@@ -0,0 +1,268 @@
+/* Copyright (C) 2021 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+#include <NTL/ZZ.h>
+
+#include <helib/residueBackend.h>
+#include <helib/multicore.h>
+#include <helib/opCounters.h>
+#include <helib/range.h>
+
+namespace helib {
+
+static long applyOp(ResidueOp op, long a, long b, long q, NTL::mulmod_t qInv)
+{
+  switch (op) {
+  case ResidueOp::Add:
+    return NTL::AddMod(a, b, q);
+  case ResidueOp::Sub:
+    return NTL::SubMod(a, b, q);
+  default:
+    return NTL::MulMod(a, b, q, qInv);
+  }
+}
+
+// One row of the element-wise op, b[j] if bStep is 1 or b[0] if it is 0
+static void hostApplyRow(ResidueOp op,
+                         long* result,
+                         const long* a,
+                         const long* b,
+                         long bStep,
+                         long q,
+                         long n)
+{
+  NTL::mulmod_t qInv = NTL::PrepMulMod(q);
+  for (long j : range(n))
+    result[j] = applyOp(op, a[j], b[j * bStep], q, qInv);
+}
+
+// One row i of the inner product
+static void hostInnerProductRow(long* result,
+                                const long* const* const* a,
+                                const long* const* const* b,
+                                long terms,
+                                long i,
+                                long q,
+                                long n)
+{
+  NTL::mulmod_t qInv = NTL::PrepMulMod(q);
+  for (long j : range(n)) {
+    long acc = 0;
+    for (long t : range(terms))
+      acc = NTL::AddMod(acc, NTL::MulMod(a[t][i][j], b[t][i][j], q, qInv), q);
+    result[j] = acc;
+  }
+}
+
+void HostResidueBackend::apply(ResidueOp op,
+                               long* const* result,
+                               const long* const* a,
+                               const long* const* b,
+                               const long* q,
+                               long rows,
+                               long n) const
+{
+  HELIB_EXEC_RANGE(rows, first, last)
+  for (long i = first; i < last; i++)
+    hostApplyRow(op, result[i], a[i], b[i], 1, q[i], n);
+  HELIB_EXEC_RANGE_END
+}
+
+void HostResidueBackend::applyScalar(ResidueOp op,
+                                     long* const* result,
+                                     const long* const* a,
+                                     const long* s,
+                                     const long* q,
+                                     long rows,
+                                     long n) const
+{
+  HELIB_EXEC_RANGE(rows, first, last)
+  for (long i = first; i < last; i++)
+    hostApplyRow(op, result[i], a[i], s + i, 0, q[i], n);
+  HELIB_EXEC_RANGE_END
+}
+
+void HostResidueBackend::innerProduct(long* const* result,
+                                      const long* const* const* a,
+                                      const long* const* const* b,
+                                      long terms,
+                                      const long* q,
+                                      long rows,
+                                      long n) const
+{
+  HELIB_EXEC_RANGE(rows, first, last)
+  for (long i = first; i < last; i++)
+    hostInnerProductRow(result[i], a, b, terms, i, q[i], n);
+  HELIB_EXEC_RANGE_END
+}
+
+void HostResidueBackend::permute(long* const* rows,
+                                 const long* perm,
+                                 long count,
+                                 long n) const
+{
+  HELIB_EXEC_RANGE(count, first, last)
+  std::vector<long> tmp(n);
+  for (long i = first; i < last; i++) {
+    for (long j : range(n))
+      tmp[j] = rows[i][perm[j]];
+    std::copy(tmp.begin(), tmp.end(), rows[i]);
+  }
+  HELIB_EXEC_RANGE_END
+}
+
+namespace {
+
+// The arithmetic mod a prime q below 2^31 on Word residues, with the
+// products in Wide. The quotient of a reduction is computed in floating
+// point, for q > 2^13 it is off by at most one either way and the remainder
+// is corrected with two selects.
+template <typename Word, typename Wide>
+struct NarrowMod
+{
+  using Signed = typename std::make_signed<Wide>::type;
+
+  Word q;
+  double qInv;
+
+  explicit NarrowMod(long q) : q(Word(q)), qInv(1.0 / double(q)) {}
+
+  Word add(Word a, Word b) const
+  {
+    Word sum = a + b; // no overflow, as a, b < 2^31
+    return sum >= q ? sum - q : sum;
+  }
+
+  Word sub(Word a, Word b) const
+  {
+    Word diff = a - b;
+    return a < b ? diff + q : diff;
+  }
+
+  Word reduce(Wide x) const
+  {
+    Wide quo = Wide(double(x) * qInv);
+    Signed r = Signed(x - quo * q);
+    r += r < 0 ? Signed(q) : 0;
+    r -= r >= Signed(q) ? Signed(q) : 0;
+    return Word(r);
+  }
+
+  Word mul(Word a, Word b) const { return reduce(Wide(a) * b); }
+};
+
+using Narrow = NarrowMod<std::uint32_t, std::uint64_t>;
+
+bool isNarrow(long q) { return q < (1L << NarrowResidueBackend::maxBits); }
+
+// One row of the element-wise op, b[j] if bStep is 1 or b[0] if it is 0
+template <typename Mod>
+void applyRow(ResidueOp op,
+              long* result,
+              const long* a,
+              const long* b,
+              long bStep,
+              const Mod& mod,
+              long n)
+{
+  switch (op) {
+  case ResidueOp::Add:
+    for (long j = 0; j < n; j++)
+      result[j] = mod.add(a[j], b[j * bStep]);
+    break;
+  case ResidueOp::Sub:
+    for (long j = 0; j < n; j++)
+      result[j] = mod.sub(a[j], b[j * bStep]);
+    break;
+  default:
+    for (long j = 0; j < n; j++)
+      result[j] = mod.mul(a[j], b[j * bStep]);
+  }
+}
+
+} // namespace
+
+void NarrowResidueBackend::apply(ResidueOp op,
+                                 long* const* result,
+                                 const long* const* a,
+                                 const long* const* b,
+                                 const long* q,
+                                 long rows,
+                                 long n) const
+{
+  HELIB_EXEC_RANGE(rows, first, last)
+  for (long i = first; i < last; i++)
+    if (isNarrow(q[i]))
+      applyRow(op, result[i], a[i], b[i], 1, Narrow(q[i]), n);
+    else
+      hostApplyRow(op, result[i], a[i], b[i], 1, q[i], n);
+  HELIB_EXEC_RANGE_END
+}
+
+void NarrowResidueBackend::applyScalar(ResidueOp op,
+                                       long* const* result,
+                                       const long* const* a,
+                                       const long* s,
+                                       const long* q,
+                                       long rows,
+                                       long n) const
+{
+  HELIB_EXEC_RANGE(rows, first, last)
+  for (long i = first; i < last; i++)
+    if (isNarrow(q[i]))
+      applyRow(op, result[i], a[i], s + i, 0, Narrow(q[i]), n);
+    else
+      hostApplyRow(op, result[i], a[i], s + i, 0, q[i], n);
+  HELIB_EXEC_RANGE_END
+}
+
+void NarrowResidueBackend::innerProduct(long* const* result,
+                                        const long* const* const* a,
+                                        const long* const* const* b,
+                                        long terms,
+                                        const long* q,
+                                        long rows,
+                                        long n) const
+{
+  // A product is below 2^62, so three of them and a reduced sum stay below
+  // 2^64 and only every third term is reduced
+  constexpr long lazyTerms = 3;
+
+  HELIB_EXEC_RANGE(rows, first, last)
+  std::vector<std::uint64_t> acc(n);
+  for (long i = first; i < last; i++) {
+    if (!isNarrow(q[i])) {
+      hostInnerProductRow(result[i], a, b, terms, i, q[i], n);
+      continue;
+    }
+    Narrow mod(q[i]);
+    std::fill(acc.begin(), acc.end(), 0);
+    for (long t = 0; t < terms; t++) {
+      const long* at = a[t][i];
+      const long* bt = b[t][i];
+      for (long j = 0; j < n; j++)
+        acc[j] += std::uint64_t(at[j]) * std::uint64_t(bt[j]);
+      if ((t + 1) % lazyTerms == 0 && t + 1 < terms)
+        for (long j = 0; j < n; j++)
+          acc[j] = mod.reduce(acc[j]);
+    }
+    for (long j = 0; j < n; j++)
+      result[i][j] = mod.reduce(acc[j]);
+  }
+  HELIB_EXEC_RANGE_END
+}
+
+} // namespace helib
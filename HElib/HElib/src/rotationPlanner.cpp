@@ -0,0 +1,457 @@
+/* Copyright (C) 2021 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <NTL/BasicThreadPool.h>
+#include <helib/rotationPlanner.h>
+#include <helib/automorphPrecon.h>
+#include <helib/exceptions.h>
+#include <helib/keys.h>
+#include <helib/norms.h>
+#include <helib/timing.h>
+
+namespace helib {
+
+// The key switches of smartAutomorph(k), following the keySwitchMap of the
+// key, or -1 if k is not reachable
+static long keySwitchHops(const PubKey& key, long k, long keyID)
+{
+  long m = key.getContext().getM();
+  k = mcMod(k, m);
+  if (k == 1)
+    return 0;
+  if (!key.isReachable(k, keyID))
+    return -1;
+  long hops = 0;
+  while (k != 1) {
+    long amt = key.getNextKSWmatrix(k, keyID).fromKey.getPowerOfX();
+    k = NTL::MulMod(k, NTL::InvMod(amt, m), m);
+    hops++;
+  }
+  return hops;
+}
+
+// Sums key switches, any unreachable one makes the total unreachable
+static void addHops(long& total, long hops)
+{
+  if (total >= 0)
+    total = hops < 0 ? -1 : total + hops;
+}
+
+const RotationPlan& RotationPlanner::plan(long amount, bool zeroFill) const
+{
+  long nSlots = ea.size();
+  if (!zeroFill)
+    amount = mcMod(amount, nSlots);
+  else if (amount <= -nSlots || amount >= nSlots)
+    amount = nSlots; // all the shifts out of range give zero
+
+  std::lock_guard<std::mutex> lock(mutex);
+  std::unique_ptr<RotationPlan>& entry = plans[{amount, zeroFill}];
+  if (!entry)
+    entry.reset(buildPlan(amount, zeroFill));
+  return *entry;
+}
+
+// Slot j goes to slot j + amount. Its coordinates move by e' - e in every
+// dimension, which is reduced mod the order of the native dimensions, where
+// a full turn of the generator is the identity on the slots. The slots
+// that move by the same vector form a term, with their destinations as the
+// mask.
+RotationPlan* RotationPlanner::buildPlan(long amount, bool zeroFill) const
+{
+  HELIB_TIMER_START;
+  const PAlgebra& zMStar = ea.getPAlgebra();
+  long nSlots = ea.size();
+  long dims = ea.dimension();
+
+  auto plan = new RotationPlan;
+  plan->amount = amount;
+  plan->zeroFill = zeroFill;
+  if (!zeroFill && amount == 0) {
+    plan->automorphisms.push_back(1);
+    return plan;
+  }
+
+  std::map<std::vector<long>, std::vector<long>> terms;
+  for (long j = 0; j < nSlots; j++) {
+    long dest = j + amount;
+    if (zeroFill && (dest < 0 || dest >= nSlots))
+      continue;
+    dest = mcMod(dest, nSlots);
+    std::vector<long> moves(dims);
+    for (long i = 0; i < dims; i++) {
+      moves[i] = ea.coordinate(i, dest) - ea.coordinate(i, j);
+      if (ea.nativeDimension(i))
+        moves[i] = mcMod(moves[i], ea.sizeOfDimension(i));
+    }
+    terms[moves].push_back(dest);
+  }
+
+  bool allSlots = terms.size() == 1 && lsize(terms.begin()->second) == nSlots;
+  for (const auto& [moves, slots] : terms) {
+    long k = 1;
+    for (long i = 0; i < dims; i++)
+      k = NTL::MulMod(k, zMStar.genToPow(i, moves[i]), zMStar.getM());
+    plan->automorphisms.push_back(k);
+    if (allSlots)
+      break;
+
+    std::vector<long> selector(nSlots, 0);
+    for (long dest : slots)
+      selector[dest] = 1;
+    zzX mask;
+    ea.encode(mask, selector);
+    plan->sizes.push_back(embeddingLargestCoeff(mask, zMStar));
+    plan->masks.push_back(std::move(mask));
+  }
+  return plan;
+}
+
+long RotationPlanner::plannedKeySwitches(const RotationPlan& plan,
+                                         const PubKey& key,
+                                         long keyID) const
+{
+  long total = 0;
+  for (long k : plan.automorphisms)
+    addHops(total, keySwitchHops(key, k, keyID));
+  return total;
+}
+
+// Mirrors EncryptedArrayDerived::rotate and shift, automorphism by
+// automorphism
+long RotationPlanner::sequentialKeySwitches(const RotationPlan& plan,
+                                            const PubKey& key,
+                                            long keyID) const
+{
+  const PAlgebra& zMStar = ea.getPAlgebra();
+  long nSlots = ea.size();
+  long dims = ea.dimension();
+  long amount = plan.amount;
+  long total = 0;
+
+  auto hops = [&](long i, long e) {
+    addHops(total, keySwitchHops(key, zMStar.genToPow(i, e), keyID));
+  };
+  auto rotate1D = [&](long i, long amt) {
+    long ord = ea.sizeOfDimension(i);
+    amt = mcMod(amt, ord);
+    if (amt == 0)
+      return;
+    hops(i, amt);
+    if (!ea.nativeDimension(i))
+      hops(i, -ord);
+  };
+  auto shift1D = [&](long i, long k) {
+    long ord = ea.sizeOfDimension(i);
+    if (k <= -ord || k >= ord || k % ord == 0)
+      return;
+    long amt = mcMod(k, ord);
+    hops(i, k < 0 ? amt - ord : amt);
+  };
+
+  if (plan.zeroFill) {
+    if (dims == 1) {
+      shift1D(0, amount);
+      return total;
+    }
+    if (amount >= nSlots || amount == 0)
+      return total;
+    long amt = mcMod(amount, nSlots);
+    long i = dims - 1;
+    rotate1D(i, ea.coordinate(i, amt));
+    for (i--; i >= 0; i--) {
+      long v = ea.coordinate(i, amt);
+      if (i > 0) {
+        rotate1D(i, v + 1);
+        rotate1D(i, v);
+      } else {
+        if (amount < 0)
+          v -= ea.sizeOfDimension(0);
+        shift1D(0, v);
+        shift1D(0, v + 1);
+      }
+    }
+    return total;
+  }
+
+  if (dims == 1) {
+    rotate1D(0, amount);
+    return total;
+  }
+  if (amount == 0)
+    return total;
+  long i = dims - 1;
+  long v = ea.coordinate(i, amount);
+  if (ea.nativeDimension(i) || v == 0) {
+    rotate1D(i, v);
+  } else {
+    hops(i, v);
+    hops(i, -ea.sizeOfDimension(i));
+    i--;
+    v = ea.coordinate(i, amount);
+    rotate1D(i, v);
+    rotate1D(i, v + 1);
+    if (i <= 0)
+      return total;
+  }
+  for (i--; i >= 0; i--) {
+    v = ea.coordinate(i, amount);
+    rotate1D(i, v);
+    rotate1D(i, v + 1);
+  }
+  return total;
+}
+
+bool RotationPlanner::usePlan(const RotationPlan& plan, const Ctxt& ctxt) const
+{
+  // Recording the automorphisms of EncryptedArray::rotate (see NumbTh.h)
+  // must see them
+  if (ea.isCKKS() || isSetAutomorphVals() || isSetAutomorphVals2())
+    return false;
+  long keyID = ctxt.getKeyID();
+  long planned = plannedKeySwitches(plan, ctxt.getPubKey(), keyID);
+  long sequential = sequentialKeySwitches(plan, ctxt.getPubKey(), keyID);
+  return planned >= 0 && (sequential < 0 || planned <= sequential);
+}
+
+// The images are cleaned up before they are masked, as in the sequential
+// rotation
+static void combine(Ctxt& ctxt,
+                    const RotationPlan& plan,
+                    std::vector<Ctxt>& images)
+{
+  long n = images.size();
+  HELIB_EXEC_RANGE(n, first, last)
+  for (long t = first; t < last; t++) {
+    images[t].cleanUp();
+    if (!plan.masks.empty())
+      images[t].multByConstant(plan.masks[t], plan.sizes[t]);
+  }
+  HELIB_EXEC_RANGE_END
+
+  ctxt = images[0];
+  for (long t = 1; t < n; t++)
+    ctxt += images[t];
+}
+
+void RotationPlanner::apply(Ctxt& ctxt, const RotationPlan& plan) const
+{
+  if (plan.automorphisms.empty()) { // a shift out of range
+    ctxt.multByConstant(NTL::to_ZZ(0));
+    return;
+  }
+  if (plan.automorphisms.size() == 1 && plan.automorphisms[0] == 1)
+    return;
+  std::vector<Ctxt> images =
+      BasicAutomorphPrecon(ctxt).automorph(plan.automorphisms);
+  combine(ctxt, plan, images);
+}
+
+void RotationPlanner::rotate(Ctxt& ctxt, long amount) const
+{
+  HELIB_TIMER_START;
+  if (ea.isCKKS()) {
+    ea.rotate(ctxt, amount);
+    return;
+  }
+  const RotationPlan& p = plan(amount);
+  if (usePlan(p, ctxt))
+    apply(ctxt, p);
+  else
+    ea.rotate(ctxt, amount);
+}
+
+void RotationPlanner::shift(Ctxt& ctxt, long amount) const
+{
+  HELIB_TIMER_START;
+  if (ea.isCKKS()) {
+    ea.shift(ctxt, amount);
+    return;
+  }
+  const RotationPlan& p = plan(amount, /*zeroFill=*/true);
+  if (usePlan(p, ctxt))
+    apply(ctxt, p);
+  else
+    ea.shift(ctxt, amount);
+}
+
+std::vector<Ctxt> RotationPlanner::rotations(
+    const Ctxt& ctxt,
+    const std::vector<long>& amounts) const
+{
+  HELIB_TIMER_START;
+  long n = amounts.size();
+  std::vector<Ctxt> out(n, ctxt);
+  if (n == 0 || ctxt.isEmpty())
+    return out;
+
+  // The automorphisms of the planned rotations, without repetitions. The
+  // others are left to EncryptedArray::rotate.
+  std::vector<const RotationPlan*> planned(n, nullptr);
+  std::vector<long> ks;
+  std::map<long, long> position;
+  for (long i = 0; i < n && !ea.isCKKS(); i++) {
+    const RotationPlan& p = plan(amounts[i]);
+    if (!usePlan(p, ctxt))
+      continue;
+    planned[i] = &p;
+    for (long k : p.automorphisms)
+      if (position.emplace(k, ks.size()).second)
+        ks.push_back(k);
+  }
+
+  std::vector<Ctxt> images;
+  if (!ks.empty())
+    images = BasicAutomorphPrecon(ctxt).automorph(ks);
+
+  HELIB_EXEC_RANGE(n, first, last)
+  for (long i = first; i < last; i++) {
+    if (!planned[i]) {
+      ea.rotate(out[i], amounts[i]);
+      continue;
+    }
+    const RotationPlan& p = *planned[i];
+    if (p.automorphisms.size() == 1 && p.automorphisms[0] == 1)
+      continue;
+    std::vector<Ctxt> terms;
+    for (long k : p.automorphisms)
+      terms.push_back(images[position.at(k)]);
+    combine(out[i], p, terms);
+  }
+  HELIB_EXEC_RANGE_END
+  return out;
+}
+
+const RotationPlanner::Masks1D& RotationPlanner::getMasks1D(long i,
+                                                             long amt) const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  std::unique_ptr<Masks1D>& entry = masks1D[{i, amt}];
+  if (!entry)
+    entry.reset(buildMasks1D(i, amt));
+  return *entry;
+}
+
+// The mask of EncryptedArray::rotate1D, with the wrap of its complement in
+// a non-native dimension
+RotationPlanner::Masks1D* RotationPlanner::buildMasks1D(long i, long amt) const
+{
+  const PAlgebra& zMStar = ea.getPAlgebra();
+  auto masks = new Masks1D;
+  masks->mask = ea.getAlMod().getMask_zzX(i, amt);
+  masks->size = embeddingLargestCoeff(masks->mask, zMStar);
+  if (ea.nativeDimension(i))
+    return masks;
+
+  NTL::ZZX complement, wrap;
+  convert(complement, masks->mask);
+  complement = 1 - complement;
+  long m = zMStar.getM();
+  long k = NTL::InvMod(zMStar.genToPow(i, -ea.sizeOfDimension(i)), m);
+  plaintextAutomorph(wrap, complement, k, m, zMStar.getPhimX());
+  PolyRed(wrap, ea.getAlMod().getPPowR());
+  convert(masks->wrap, wrap);
+  masks->wrapSize = embeddingLargestCoeff(masks->wrap, zMStar);
+  return masks;
+}
+
+bool RotationPlanner::canHoist1D(const Ctxt& ctxt,
+                                 long i,
+                                 const std::vector<long>& amounts,
+                                 bool zeroFill) const
+{
+  if (ea.isCKKS() || isSetAutomorphVals() || isSetAutomorphVals2())
+    return false;
+  const PAlgebra& zMStar = ea.getPAlgebra();
+  const PubKey& key = ctxt.getPubKey();
+  long keyID = ctxt.getKeyID();
+  auto have = [&](long e) {
+    return key.haveKeySWmatrix(1, zMStar.genToPow(i, e), keyID, keyID);
+  };
+  for (long amt : amounts)
+    if (!have(amt))
+      return false;
+  return zeroFill || ea.nativeDimension(i) || amounts.empty() ||
+         have(-ea.sizeOfDimension(i));
+}
+
+std::vector<Ctxt> RotationPlanner::rotationSums1D(
+    const Ctxt& ctxt,
+    long i,
+    const std::vector<std::vector<long>>& groups,
+    bool zeroFill) const
+{
+  HELIB_TIMER_START;
+  const PAlgebra& zMStar = ea.getPAlgebra();
+  bool masked = zeroFill || !ea.nativeDimension(i);
+  bool wrapped = !zeroFill && !ea.nativeDimension(i);
+
+  std::vector<long> amounts, ks;
+  for (const auto& group : groups)
+    for (long amt : group) {
+      assertInRange<InvalidArgument>(amt,
+                                     1l,
+                                     ea.sizeOfDimension(i),
+                                     "Amount out of the dimension");
+      amounts.push_back(amt);
+      ks.push_back(zMStar.genToPow(i, amt));
+    }
+  long n = amounts.size();
+
+  std::vector<const Masks1D*> masks(n, nullptr);
+  if (masked)
+    for (long t = 0; t < n; t++)
+      masks[t] = &getMasks1D(i, amounts[t]);
+
+  std::vector<Ctxt> images;
+  if (n > 0)
+    images = BasicAutomorphPrecon(ctxt).automorph(ks);
+  std::vector<Ctxt> wraps(wrapped ? n : 0, Ctxt(ZeroCtxtLike, ctxt));
+
+  HELIB_EXEC_RANGE(n, first, last)
+  for (long t = first; t < last; t++) {
+    images[t].cleanUp();
+    if (wrapped) {
+      wraps[t] = images[t];
+      wraps[t].multByConstant(masks[t]->wrap, masks[t]->wrapSize);
+    }
+    if (masked)
+      images[t].multByConstant(masks[t]->mask, masks[t]->size);
+  }
+  HELIB_EXEC_RANGE_END
+
+  std::vector<Ctxt> sums(groups.size(), Ctxt(ZeroCtxtLike, ctxt));
+  long t = 0;
+  for (std::size_t g = 0; g < groups.size(); g++) {
+    Ctxt wrap(ZeroCtxtLike, ctxt);
+    for (std::size_t j = 0; j < groups[g].size(); j++, t++) {
+      sums[g] += images[t];
+      if (wrapped)
+        wrap += wraps[t];
+    }
+    if (wrapped && !groups[g].empty()) {
+      wrap.smartAutomorph(zMStar.genToPow(i, -ea.sizeOfDimension(i)));
+      sums[g] += wrap;
+    }
+  }
+  return sums;
+}
+
+const RotationPlanner& EncryptedArray::getRotationPlanner() const
+{
+  static std::mutex mutex;
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!rotationPlanner)
+    rotationPlanner = std::make_shared<RotationPlanner>(*this);
+  return *rotationPlanner;
+}
+
+} // namespace helib
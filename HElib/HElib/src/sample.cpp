@@ -19,12 +19,50 @@
 #include <helib/sample.h>
 #include <helib/norms.h>
 #include <helib/apiAttributes.h>
+#include <helib/opCounters.h>
 
 #include <helib/powerful.h>
 // only used in experimental Hwt sampler
 
 namespace helib {
 
+// Fill words with random 64-bit words, drawn from the current NTL stream in
+// a single call rather than one NTL::ZZ at a time
+static void randomWords(std::vector<unsigned long long>& words, long n)
+{
+  words.resize(n);
+  NTL::GetCurrentRandomStream().get(
+      reinterpret_cast<unsigned char*>(words.data()),
+      n * sizeof(unsigned long long));
+}
+
+// n Normal(0,1) variables, by the Box-Muller method on bulk random words.
+// Every pair of words gives a uniform r1 in [0,1) and r2 in (0,1], so that
+// log(r2) needs no retry, and two Gaussians
+static void unitGaussians(std::vector<double>& dvec, long n)
+{
+  std::vector<unsigned long long> words;
+  randomWords(words, 2 * ((n + 1) / 2));
+  dvec.resize(n);
+
+  const double scale = std::ldexp(1.0, -NTL_DOUBLE_PRECISION);
+  for (long i = 0; i < n; i += 2) {
+    double r1 = (words[i] >> (64 - NTL_DOUBLE_PRECISION)) * scale;
+    double r2 = ((words[i + 1] >> (64 - NTL_DOUBLE_PRECISION)) + 1) * scale;
+    double theta = 2.0 * PI * r1;
+    double rr = std::sqrt(-2.0 * log(r2));
+    if (rr > HELIB_GAUSS_TRUNC) {
+      // sanity-check, truncate at HELIB_GAUSS_TRUNC standard deviations
+      rr = HELIB_GAUSS_TRUNC;
+    }
+
+    // Generate two Gaussians RV's
+    dvec[i] = rr * std::cos(theta);
+    if (i + 1 < n)
+      dvec[i + 1] = rr * std::sin(theta);
+  }
+}
+
 // Sample a degree-(n-1) poly, with only Hwt nonzero coefficients
 void sampleHWt(zzX& poly, long n, long Hwt)
 {
@@ -85,11 +123,14 @@ void sampleSmall(zzX& poly, long n, double prob)
 
   long threshold = round(hiMask * prob); // threshold/2^15 = Pr[nonzero]
 
-  NTL_EXEC_RANGE(n, first, last)
-  for (long i = first; i < last; i++) {
-    long u = NTL::RandomBits_long(bitSize); // a random 16-bit number
-    long uLo = u & loMask;                  // bottom 15 bits
-    long uHi = u & hiMask;                  // top bit
+  // Four 16-bit numbers from every random word. The words all come from the
+  // stream of the calling thread, so the result only depends on its state
+  std::vector<unsigned long long> words;
+  randomWords(words, (n + 3) / 4);
+  for (long i = 0; i < n; i++) {
+    long u = (words[i / 4] >> (bitSize * (i % 4))) & 0xffff; // 16 bits
+    long uLo = u & loMask;                                   // bottom 15 bits
+    long uHi = u & hiMask;                                   // top bit
 
     // with probability threshold/2^15, choose between +-1
     if (uLo < threshold) {                  // compare low 15 bits to threshold
@@ -100,7 +141,6 @@ void sampleSmall(zzX& poly, long n, double prob)
     else
       poly[i] = 0;
   }
-  NTL_EXEC_RANGE_END
 }
 void sampleSmall(NTL::ZZX& poly, long n, double prob)
 {
@@ -118,27 +158,9 @@ void sampleGaussian(std::vector<double>& dvec, long n, double stdev)
   if (n <= 0)
     return;
 
-  dvec.resize(n); // allocate space for n variables
-
-  // Uses the Box-Muller method to get two Normal(0,stdev^2) variables
-  for (long i = 0; i < n; i += 2) {
-    // r1, r2 are "uniform in (0,1)"
-    double r1 = RandomReal();
-    double r2 = RandomReal();
-    while (r2 == 0)
-      r2 = RandomReal();
-    double theta = 2.0 * PI * r1;
-    double rr = std::sqrt(-2.0 * log(r2));
-    if (rr > HELIB_GAUSS_TRUNC) {
-      // sanity-check, truncate at HELIB_GAUSS_TRUNC standard deviations
-      rr = HELIB_GAUSS_TRUNC;
-    }
-
-    // Generate two Gaussians RV's
-    dvec[i] = stdev * rr * std::cos(theta);
-    if (i + 1 < n)
-      dvec[i + 1] = stdev * rr * std::sin(theta);
-  }
+  unitGaussians(dvec, n);
+  for (double& d : dvec)
+    d *= stdev;
 }
 
 void sampleGaussian(std::vector<NTL::xdouble>& dvec, long n, NTL::xdouble stdev)
@@ -148,27 +170,11 @@ void sampleGaussian(std::vector<NTL::xdouble>& dvec, long n, NTL::xdouble stdev)
   if (n <= 0)
     return;
 
+  std::vector<double> unit;
+  unitGaussians(unit, n);
   dvec.resize(n); // allocate space for n variables
-
-  // Uses the Box-Muller method to get two Normal(0,stdev^2) variables
-  for (long i = 0; i < n; i += 2) {
-    // r1, r2 are "uniform in (0,1)"
-    double r1 = RandomReal();
-    double r2 = RandomReal();
-    while (r2 == 0)
-      r2 = RandomReal();
-    double theta = 2.0 * PI * r1;
-    double rr = std::sqrt(-2.0 * log(r2));
-    if (rr > HELIB_GAUSS_TRUNC) {
-      // sanity-check, truncate at HELIB_GAUSS_TRUNC standard deviations
-      rr = HELIB_GAUSS_TRUNC;
-    }
-
-    // Generate two Gaussians RV's
-    dvec[i] = stdev * rr * std::cos(theta);
-    if (i + 1 < n)
-      dvec[i + 1] = stdev * rr * std::sin(theta);
-  }
+  for (long i = 0; i < n; i++)
+    dvec[i] = stdev * unit[i];
 }
 
 // Sample a degree-(n-1) NTL::ZZX, with rounded Gaussian coefficients
@@ -532,6 +538,58 @@ NTL::xdouble sampleGaussianBounded(NTL::ZZX& poly,
   return bound;
 }
 
+/********************************************************************
+ * Batch versions of the bounded samplers: they fill several polynomials
+ * at once, in parallel. Every polynomial is sampled from a PRG stream of
+ * its own, seeded in turn from the stream of the caller, so the results
+ * only depend on the state of that stream and not on the number of threads.
+ ********************************************************************/
+template <typename Sampler>
+static std::vector<double> sampleBatch(std::vector<zzX>& polys,
+                                       const Sampler& sample)
+{
+  long n = polys.size();
+  std::vector<NTL::ZZ> seeds(n);
+  for (long i = 0; i < n; i++)
+    NTL::RandomBits(seeds[i], 256);
+
+  std::vector<double> bounds(n);
+  HELIB_EXEC_RANGE(n, first, last)
+  NTL::RandomStreamPush push;
+  for (long i = first; i < last; i++) {
+    NTL::SetSeed(seeds[i]);
+    bounds[i] = sample(polys[i]);
+  }
+  HELIB_EXEC_RANGE_END
+  return bounds;
+}
+
+std::vector<double> sampleSmallBounded(std::vector<zzX>& polys,
+                                       const Context& context)
+{
+  return sampleBatch(polys, [&](zzX& poly) {
+    return sampleSmallBounded(poly, context);
+  });
+}
+
+std::vector<double> sampleHWtBounded(std::vector<zzX>& polys,
+                                     const Context& context,
+                                     long Hwt)
+{
+  return sampleBatch(polys, [&](zzX& poly) {
+    return sampleHWtBounded(poly, context, Hwt);
+  });
+}
+
+std::vector<double> sampleGaussianBounded(std::vector<zzX>& polys,
+                                          const Context& context,
+                                          double stdev)
+{
+  return sampleBatch(polys, [&](zzX& poly) {
+    return sampleGaussianBounded(poly, context, stdev);
+  });
+}
+
 double sampleUniform(zzX& poly, const Context& context, long B)
 {
   const PAlgebra& palg = context.getZMStar();
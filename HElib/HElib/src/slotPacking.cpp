@@ -0,0 +1,203 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <helib/slotPacking.h>
+
+#include <algorithm>
+#include <numeric>
+
+#include <helib/assertions.h>
+#include <helib/Context.h>
+#include <helib/Ctxt.h>
+#include <helib/EncryptedArray.h>
+#include <helib/keys.h>
+#include <helib/opCounters.h>
+#include <helib/replicate.h>
+#include <helib/timing.h>
+
+namespace helib {
+
+namespace {
+
+// Whether the slots, moved by shift, are all free in used
+bool fits(const std::vector<bool>& used,
+          const std::vector<long>& slots,
+          long shift)
+{
+  long nslots = used.size();
+  for (long j : slots)
+    if (used[(j + shift) % nslots])
+      return false;
+  return true;
+}
+
+// The plaintext with ones in the given slots and zeros elsewhere
+NTL::ZZX slotMask(const EncryptedArray& ea, const std::vector<long>& slots)
+{
+  std::vector<long> mask(ea.size(), 0);
+  for (long j : slots)
+    mask[j] = 1;
+  NTL::ZZX poly;
+  ea.encode(poly, mask);
+  return poly;
+}
+
+} // namespace
+
+SlotPackingPlan planSlotPacking(const EncryptedArray& ea,
+                                const std::vector<std::vector<long>>& occupancy)
+{
+  long nslots = ea.size();
+  long n = occupancy.size();
+
+  // The distinct used slots of every ciphertext
+  std::vector<std::vector<long>> slots(n);
+  for (long i = 0; i < n; i++) {
+    std::vector<bool> seen(nslots, false);
+    for (long j : occupancy[i]) {
+      assertInRange<InvalidArgument>(j, 0l, nslots, "Slot index out of range");
+      if (!seen[j])
+        slots[i].push_back(j);
+      seen[j] = true;
+    }
+  }
+
+  // First fit, the ciphertexts that use the most slots first
+  std::vector<long> order(n);
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](long a, long b) {
+    return slots[a].size() > slots[b].size();
+  });
+
+  SlotPackingPlan plan;
+  std::vector<std::vector<bool>> used; // the used slots of every packed one
+  for (long i : order) {
+    bool placed = false;
+    for (std::size_t b = 0; b < used.size() && !placed; b++)
+      for (long shift = 0; shift < nslots && !placed; shift++)
+        if (fits(used[b], slots[i], shift)) {
+          for (long j : slots[i])
+            used[b][(j + shift) % nslots] = true;
+          plan.packed[b].push_back({i, shift});
+          placed = true;
+        }
+    if (!placed) {
+      used.emplace_back(nslots, false);
+      for (long j : slots[i])
+        used.back()[j] = true;
+      plan.packed.push_back({{i, 0}});
+    }
+  }
+  return plan;
+}
+
+CoalescedRequests::CoalescedRequests(
+    const EncryptedArray& ea,
+    const PtrVector<Ctxt>& requests,
+    const std::vector<std::vector<long>>& occupancy) :
+    ea(ea),
+    plan(planSlotPacking(ea, occupancy)),
+    occupancy(occupancy),
+    where(occupancy.size()),
+    masks(occupancy.size())
+{
+  HELIB_TIMER_START;
+  long n = requests.size();
+  assertEq<InvalidArgument>(long(occupancy.size()),
+                            n,
+                            "One occupancy per request is needed");
+  if (n == 0)
+    return;
+
+  long nPacked = plan.packed.size();
+  for (long b = 0; b < nPacked; b++)
+    for (const SlotPackingPlan::Piece& piece : plan.packed[b])
+      where[piece.source] = {b, piece.shift};
+
+  // The masks of the requests that share a packed one
+  HELIB_EXEC_RANGE(nPacked, first, last)
+  for (long b = first; b < last; b++)
+    if (plan.packed[b].size() > 1)
+      for (const SlotPackingPlan::Piece& piece : plan.packed[b])
+        masks[piece.source] = slotMask(ea, occupancy[piece.source]);
+  HELIB_EXEC_RANGE_END
+
+  shared.assign(nPacked, Ctxt(ZeroCtxtLike, *requests[0]));
+  HELIB_EXEC_RANGE(nPacked, first, last)
+  for (long b = first; b < last; b++) {
+    const std::vector<SlotPackingPlan::Piece>& pieces = plan.packed[b];
+    if (pieces.size() == 1) {
+      shared[b] = *requests[pieces[0].source];
+      continue;
+    }
+    for (const SlotPackingPlan::Piece& piece : pieces) {
+      Ctxt term = *requests[piece.source];
+      term.multByConstant(masks[piece.source]);
+      if (piece.shift != 0)
+        ea.rotate(term, piece.shift);
+      shared[b] += term;
+    }
+  }
+  HELIB_EXEC_RANGE_END
+}
+
+void CoalescedRequests::extract(Ctxt& out, long i, long replicateSlot) const
+{
+  assertInRange<InvalidArgument>(i, 0l, size(), "Request index out of range");
+  const Lane& lane = where[i];
+  out = shared[lane.packed];
+  if (replicateSlot >= 0) {
+    // replicate() masks the slot itself, wherever the lane is
+    assertInRange<InvalidArgument>(replicateSlot,
+                                   0l,
+                                   ea.size(),
+                                   "Slot index out of range");
+    replicate(ea, out, (replicateSlot + lane.shift) % ea.size());
+    return;
+  }
+  if (plan.packed[lane.packed].size() == 1)
+    return;
+  if (lane.shift != 0)
+    ea.rotate(out, -lane.shift);
+  out.multByConstant(masks[i]);
+}
+
+void CoalescedRequests::extractAll(const PtrVector<Ctxt>& out) const
+{
+  HELIB_TIMER_START;
+  assertEq<InvalidArgument>(long(out.size()),
+                            size(),
+                            "One output per request is needed");
+  HELIB_EXEC_RANGE(size(), first, last)
+  for (long i = first; i < last; i++)
+    extract(*out[i], i);
+  HELIB_EXEC_RANGE_END
+}
+
+void thinReCryptPacked(const PubKey& publicKey,
+                       const PtrVector<Ctxt>& ctxts,
+                       const std::vector<std::vector<long>>& occupancy,
+                       bool our_version,
+                       bool lazy)
+{
+  HELIB_TIMER_START;
+  assertEq<InvalidArgument>(long(occupancy.size()),
+                            long(ctxts.size()),
+                            "One occupancy per ciphertext is needed");
+  if (ctxts.size() == 0)
+    return;
+
+  CoalescedRequests batch(publicKey.getContext().getEA(), ctxts, occupancy);
+  publicKey.thinReCrypt(batch.getShared(), our_version, lazy);
+  batch.extractAll(ctxts);
+}
+
+} // namespace helib
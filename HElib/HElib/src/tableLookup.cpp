@@ -13,13 +13,18 @@
  * @file tableLookup.cpp
  * @brief Code for homomorphic table lookup and fixed-point functions
  */
+#include <algorithm>
 #include <limits>
+#include <map>
+#include <memory>
 #include <cmath>
 #include <cstdlib>
 #include <stdexcept>
 #include <NTL/BasicThreadPool.h>
 #include <helib/intraSlot.h>
 #include <helib/tableLookup.h>
+#include <helib/opCounters.h>
+#include <helib/norms.h>
 
 #ifdef HELIB_DEBUG
 #include <helib/debugging.h>
@@ -31,31 +36,24 @@ static void recursiveProducts(const CtPtrs& products,
                               const CtPtrs_slice& array);
 static double pow2_double(long n); // compute 2^n as double
 
-// For an n-size array, compute the 2^n products
-//     products[j] = \prod_{i s.t. j_i=1} array[i]
-//                   \times \prod_{i s.t. j_i=0}(a-array[i])
-void computeAllProducts(/*Output*/ CtPtrs& products,
-                        /*Index*/ const CtPtrs& array,
-                        std::vector<zzX>* unpackSlotEncoding)
+// The number of bits of array that index a table of the given size
+static long indexBits(long size, const CtPtrs& array)
 {
-  HELIB_TIMER_START;
   long nBits = array.size();
-  if (lsize(products) > 0) {
-    long nBits2 = NTL::NumBits(lsize(products) - 1); // ceil(log_2(size))
+  if (size > 0) {
+    long nBits2 = NTL::NumBits(size - 1); // ceil(log_2(size))
     if (nBits > nBits2)
       nBits = nBits2; // ignore extra bits in 'array'
   }
-  if (nBits < 1)
-    return; // do nothing
-  // Output cannot be bigger than 2^16
-  assertTrue(nBits <= 16, "Output cannot be bigger than 2^16");
-
-  if (lsize(products) == 0) // try to set the output size
-    products.resize(1L << nBits, &array);
-  for (long i = 0; i < lsize(products); i++)
-    products[i]->clear();
+  return nBits;
+}
 
-  // Check that we have enough levels, try to bootstrap otherwise
+// Check that we have enough levels for the products of nBits bits of array,
+// try to bootstrap otherwise
+static void ensureProductLevels(const CtPtrs& array,
+                                long nBits,
+                                std::vector<zzX>* unpackSlotEncoding)
+{
   assertNotNull(array.ptr2nonNull(),
                 "Invalid array (could not find non-null Ctxt)");
   long bpl = array.ptr2nonNull()->getContext().BPL();
@@ -72,11 +70,175 @@ void computeAllProducts(/*Output*/ CtPtrs& products,
   }
   if (findMinBitCapacity(array) < (NTL::NumBits(nBits) + 1) * bpl)
     throw LogicError("not enough levels for table lookup");
+}
+
+// For an n-size array, compute the 2^n products
+//     products[j] = \prod_{i s.t. j_i=1} array[i]
+//                   \times \prod_{i s.t. j_i=0}(a-array[i])
+void computeAllProducts(/*Output*/ CtPtrs& products,
+                        /*Index*/ const CtPtrs& array,
+                        std::vector<zzX>* unpackSlotEncoding)
+{
+  HELIB_TIMER_START;
+  long nBits = indexBits(lsize(products), array);
+  if (nBits < 1)
+    return; // do nothing
+  // Output cannot be bigger than 2^16
+  assertTrue(nBits <= 16, "Output cannot be bigger than 2^16");
+
+  if (lsize(products) == 0) // try to set the output size
+    products.resize(1L << nBits, &array);
+  for (long i = 0; i < lsize(products); i++)
+    products[i]->clear();
+
+  ensureProductLevels(array, nBits, unpackSlotEncoding);
 
   // Call the recursive function that computes the products
   recursiveProducts(products, CtPtrs_slice(array, 0, nBits));
 }
 
+const std::vector<DoubleCRT>& LookupTable::getEncoding(
+    const Context& context,
+    const IndexSet& primes) const
+{
+  {
+    HELIB_SHARED_GUARD(mx);
+    auto it = encodings.find(primes);
+    if (it != encodings.end())
+      return it->second;
+  }
+
+  // Encode outside of the lock, entries are never erased so references stay
+  // valid
+  std::vector<DoubleCRT> dcrts(entries.size(), DoubleCRT(context, primes));
+  HELIB_EXEC_RANGE(size(), first, last)
+  for (long i = first; i < last; i++)
+    dcrts[i] = DoubleCRT(entries[i], context, primes);
+  HELIB_EXEC_RANGE_END
+  HELIB_EXCLUSIVE_GUARD(mx);
+  return encodings.emplace(primes, std::move(dcrts)).first->second;
+}
+
+const std::vector<double>& LookupTable::getSizes(const Context& context) const
+{
+  {
+    HELIB_SHARED_GUARD(mx);
+    if (!sizes.empty() || entries.empty())
+      return sizes;
+  }
+
+  std::vector<std::vector<double>> converted(entries.size());
+  std::vector<const std::vector<double>*> entryPtrs(entries.size());
+  for (long i = 0; i < size(); i++) {
+    convert(converted[i], entries[i]);
+    entryPtrs[i] = &converted[i];
+  }
+  std::vector<double> bounds;
+  embeddingLargestCoeffs(bounds, entryPtrs, context.getZMStar());
+  HELIB_EXCLUSIVE_GUARD(mx);
+  if (sizes.empty())
+    sizes = std::move(bounds);
+  return sizes;
+}
+
+IndexProducts::IndexProducts(const CtPtrs& idx,
+                             long tableSize,
+                             std::vector<zzX>* unpackSlotEncoding) :
+    idxBits(lsize(idx)), nBits(indexBits(tableSize, idx)), nLow(0)
+{
+  HELIB_TIMER_START;
+  if (nBits < 1)
+    return;
+  assertTrue(nBits <= 16, "tables of size > 2^{16} are not supported");
+  ensureProductLevels(idx, nBits, unpackSlotEncoding);
+
+  // The products of the two halves are independent
+  nLow = (nBits + 1) / 2;
+  const Ctxt* ct = idx.ptr2nonNull();
+  low.assign(1L << nLow, Ctxt(ZeroCtxtLike, *ct));
+  high.assign(1L << (nBits - nLow), Ctxt(ZeroCtxtLike, *ct));
+  HELIB_EXEC_INDEX(2, half)
+  if (half == 0)
+    recursiveProducts(CtPtrs_vectorCt(low), CtPtrs_slice(idx, 0, nLow));
+  else if (nBits > nLow)
+    recursiveProducts(CtPtrs_vectorCt(high),
+                      CtPtrs_slice(idx, nLow, nBits - nLow));
+  HELIB_EXEC_INDEX_END
+}
+
+bool IndexProducts::fits(long tableSize) const
+{
+  long nBits2 = (tableSize > 0) ? NTL::NumBits(tableSize - 1) : 0;
+  return std::min(idxBits, nBits2) == nBits;
+}
+
+// The sum of table[j] * products[j] over j, without the 2^n products: with
+// j = h*k + i for k = 2^{nLow}, products[j] = low[i] * high[h] where low[]
+// are the products of the nLow low bits of idx and high[] those of the other
+// bits, so the sum is
+//     \sum_h high[h] * (\sum_i table[h*k+i] * low[i]).
+// The inner sums only take constants, so there are l = size/k products
+// instead of 2^n. The constants are taken from cached if it is not null, else
+// every worker encodes the k entries of its partial sum.
+static void lookupByHalves(Ctxt& out,
+                           const std::vector<zzX>& table,
+                           const LookupTable* cached,
+                           const IndexProducts& products)
+{
+  assertTrue<InvalidArgument>(products.fits(lsize(table)),
+                              "The index products are for another table size");
+  out.clear();
+  long size = lsize(table);
+  if (products.bitCount() < 1 || size == 0)
+    return;
+
+  const std::vector<Ctxt>& low = products.lowProducts();
+  const std::vector<Ctxt>& high = products.highProducts();
+  long k = std::min(lsize(low), size);
+  long l = (size + k - 1) / k;
+  bool split = (products.bitCount() > products.lowBitCount());
+
+  const Context& context = low[0].getContext();
+  IndexSet primes;
+  std::vector<const Ctxt*> lowPtrs(k);
+  for (long i = 0; i < k; i++) {
+    primes.insert(low[i].getPrimeSet());
+    lowPtrs[i] = &low[i];
+  }
+  const std::vector<DoubleCRT>* encoding =
+      cached ? &cached->getEncoding(context, primes) : nullptr;
+  const std::vector<double>* sizes =
+      cached ? &cached->getSizes(context) : nullptr;
+
+  std::vector<Ctxt> partial(l, Ctxt(ZeroCtxtLike, low[0]));
+  HELIB_EXEC_INDEX(l, h)
+  long first = h * k;
+  long count = std::min(k, size - first);
+  std::vector<DoubleCRT> encoded;
+  std::vector<const DoubleCRT*> constants(count);
+  std::vector<double> bounds(count);
+  if (encoding == nullptr)
+    encoded.reserve(count);
+  for (long i = 0; i < count; i++) {
+    if (encoding != nullptr) {
+      constants[i] = &(*encoding)[first + i];
+      bounds[i] = (*sizes)[first + i];
+    } else {
+      encoded.emplace_back(table[first + i], context, primes);
+      constants[i] = &encoded.back();
+      bounds[i] = embeddingLargestCoeff(table[first + i], context.getZMStar());
+    }
+  }
+  std::vector<const Ctxt*> terms(lowPtrs.begin(), lowPtrs.begin() + count);
+  linearCombination(partial[h], terms, constants, bounds);
+  if (split)
+    partial[h].multiplyBy(high[h]);
+  HELIB_EXEC_INDEX_END
+
+  for (long h = 0; h < l; h++)
+    out += partial[h];
+}
+
 // The input is a plaintext table T[] and an array of encrypted bits
 // I[], holding the binary representation of an index i into T.
 // The output is the encrypted value T[i].
@@ -86,21 +248,66 @@ void tableLookup(Ctxt& out,
                  std::vector<zzX>* unpackSlotEncoding)
 {
   HELIB_TIMER_START;
-  out.clear();
-  std::vector<Ctxt> products(lsize(table),
-                             out); // to hold subset products of idx
-  CtPtrs_vectorCt pWrap(products); // A wrapper
+  IndexProducts products(idx, lsize(table), unpackSlotEncoding);
+  lookupByHalves(out, table, nullptr, products);
+}
 
-  // Compute all products of encrypted bits =: b_i
-  computeAllProducts(pWrap, idx, unpackSlotEncoding);
+void tableLookup(Ctxt& out,
+                 const LookupTable& table,
+                 const CtPtrs& idx,
+                 std::vector<zzX>* unpackSlotEncoding)
+{
+  HELIB_TIMER_START;
+  IndexProducts products(idx, table.size(), unpackSlotEncoding);
+  lookupByHalves(out, table.getEntries(), &table, products);
+}
 
-  // Compute the sum b_i * T[i]
-  NTL_EXEC_RANGE(lsize(table), first, last)
-  for (long i = first; i < last; i++)
-    products[i].multByConstant(table[i]); // p[i] = p[i]*T[i]
-  NTL_EXEC_RANGE_END
-  for (long i = 0; i < lsize(table); i++)
-    out += products[i];
+void tableLookup(Ctxt& out,
+                 const std::vector<zzX>& table,
+                 const IndexProducts& products)
+{
+  HELIB_TIMER_START;
+  lookupByHalves(out, table, nullptr, products);
+}
+
+void tableLookup(Ctxt& out,
+                 const LookupTable& table,
+                 const IndexProducts& products)
+{
+  HELIB_TIMER_START;
+  lookupByHalves(out, table.getEntries(), &table, products);
+}
+
+void tableLookups(CtPtrs& out,
+                  const std::vector<std::vector<zzX>>& tables,
+                  const CtPtrs& idx,
+                  std::vector<zzX>* unpackSlotEncoding)
+{
+  HELIB_TIMER_START;
+  long n = tables.size();
+  if (n == 0) {
+    setLengthZero(out);
+    return;
+  }
+  const Ctxt* ct = idx.ptr2nonNull();
+  assertNotNull(ct, "Invalid index (could not find non-null Ctxt)");
+  resize(out, n, *ct);
+
+  // One set of products for every number of index bits, the tables of the
+  // same size class share it
+  std::map<long, std::unique_ptr<IndexProducts>> products;
+  std::vector<const IndexProducts*> productsOf(n);
+  for (long t = 0; t < n; t++) {
+    long nBits = indexBits(lsize(tables[t]), idx);
+    std::unique_ptr<IndexProducts>& p = products[nBits];
+    if (!p)
+      p.reset(new IndexProducts(idx, lsize(tables[t]), unpackSlotEncoding));
+    productsOf[t] = p.get();
+  }
+
+  HELIB_EXEC_INDEX(n, t)
+  lookupByHalves(*out[t], tables[t], nullptr, *productsOf[t]);
+  HELIB_EXEC_INDEX_END
 }
 
 // A counterpart of tableLookup. The input is an encrypted table T[]
@@ -122,10 +329,10 @@ void tableWriteIn(const CtPtrs& table,
   computeAllProducts(pWrap, idx, unpackSlotEncoding);
 
   // increment each entry of T[i] by products[i]
-  NTL_EXEC_RANGE(lsize(table), first, last)
+  HELIB_EXEC_RANGE(lsize(table), first, last)
   for (long i = first; i < last; i++)
     *table[i] += products[i];
-  NTL_EXEC_RANGE_END
+  HELIB_EXEC_RANGE_END
 }
 
 // The function buildLookupTable is documented in tableLookup.h.
@@ -250,22 +457,25 @@ static void recursiveProducts(const CtPtrs& products, const CtPtrs_slice& array)
     std::vector<Ctxt> products1(k, Ctxt(ZeroCtxtLike, *ct));
     std::vector<Ctxt> products2(l, Ctxt(ZeroCtxtLike, *ct));
 
-    // compute first part of the array
-    recursiveProducts(CtPtrs_vectorCt(products1), CtPtrs_slice(array, 0, n1));
-
-    // recursive call on second part of array
-    recursiveProducts(CtPtrs_vectorCt(products2),
-                      CtPtrs_slice(array, n1, nBits - n1));
+    // the two parts are independent, compute them concurrently
+    HELIB_EXEC_INDEX(2, part)
+    if (part == 0) // compute first part of the array
+      recursiveProducts(CtPtrs_vectorCt(products1),
+                        CtPtrs_slice(array, 0, n1));
+    else // recursive call on second part of array
+      recursiveProducts(CtPtrs_vectorCt(products2),
+                        CtPtrs_slice(array, n1, nBits - n1));
+    HELIB_EXEC_INDEX_END
 
     // multiplication to get all subset products
-    NTL_EXEC_RANGE(lsize(products), first, last)
+    HELIB_EXEC_RANGE(lsize(products), first, last)
     for (long ii = first; ii < last; ii++) {
       long j = ii / k;
       long i = ii - j * k;
       *products[ii] = products1[i];
       products[ii]->multiplyBy(products2[j]);
     }
-    NTL_EXEC_RANGE_END
+    HELIB_EXEC_RANGE_END
   }
 }
 
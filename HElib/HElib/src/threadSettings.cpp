@@ -0,0 +1,50 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <helib/threadSettings.h>
+#include <helib/NumbTh.h>
+#include <helib/matmul.h>
+#include <helib/recryption.h>
+
+namespace helib {
+
+ThreadSettings ThreadSettings::current()
+{
+  ThreadSettings settings;
+  settings.dryRun = FHEglobals::dryRun;
+  settings.automorphVals = FHEglobals::automorphVals;
+  settings.automorphVals2 = FHEglobals::automorphVals2;
+  settings.forceChenHan = fhe_force_chen_han;
+  settings.forceBsgs = fhe_test_force_bsgs;
+  settings.forceHoist = fhe_test_force_hoist;
+  settings.execution = ExecutionPolicy::current();
+  return settings;
+}
+
+void ThreadSettings::install() const
+{
+  FHEglobals::dryRun = dryRun;
+  FHEglobals::automorphVals = automorphVals;
+  FHEglobals::automorphVals2 = automorphVals2;
+  fhe_force_chen_han = forceChenHan;
+  fhe_test_force_bsgs = forceBsgs;
+  fhe_test_force_hoist = forceHoist;
+}
+
+ThreadSettings::Adopt::Adopt(const ThreadSettings& settings) :
+    previous(current()), executionScope(&settings.execution)
+{
+  settings.install();
+}
+
+ThreadSettings::Adopt::~Adopt() { previous.install(); }
+
+} // namespace helib
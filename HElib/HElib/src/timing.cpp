@@ -10,6 +10,8 @@
  * limitations under the License. See accompanying LICENSE file.
  */
 #include <algorithm>
+#include <memory>
+#include <set>
 #include <utility>
 #include <cstring>
 #include <ctime>
@@ -74,16 +76,183 @@ double FHEtimer::getTime() const // returns time in seconds
 // Returns number of calls for that timer
 long FHEtimer::getNumCalls() const { return numCalls; }
 
+// A node of the timer tree of a thread. Only the owning thread adds
+// children, under the mutex of the thread since other threads read the tree.
+struct TimerNode
+{
+  const FHEtimer* timer;
+  HELIB_atomic_ulong time;
+  HELIB_atomic_long numCalls;
+  std::vector<std::unique_ptr<TimerNode>> children;
+
+  explicit TimerNode(const FHEtimer* _timer) :
+      timer(_timer), time(0), numCalls(0)
+  {}
+};
+
+namespace {
+
+struct TraceEvent
+{
+  const FHEtimer* timer;
+  long thread;
+  unsigned long start;
+  unsigned long duration;
+};
+
+struct ThreadTimers;
+
+// The trees of the running threads, and what the finished ones timed.
+// Never destroyed, since threads may finish after static destruction.
+// Lock order: the registry, then the threads.
+struct TimerRegistry
+{
+  HELIB_MUTEX_TYPE mx;
+  std::vector<ThreadTimers*> running;
+  TimerTreeNode finished;
+  std::vector<TraceEvent> finishedEvents;
+  long nextThread = 0;
+};
+
+TimerRegistry& timerRegistry()
+{
+  static TimerRegistry* r = new TimerRegistry;
+  return *r;
+}
+
+HELIB_atomic_long tracing(0);
+
+TimerTreeNode& childFor(TimerTreeNode& node, const FHEtimer* timer)
+{
+  for (TimerTreeNode& child : node.children)
+    if (child.timer == timer)
+      return child;
+  node.children.emplace_back();
+  node.children.back().timer = timer;
+  return node.children.back();
+}
+
+void mergeTree(TimerTreeNode& into, const TimerNode& node)
+{
+  into.time += double(node.time) / CLOCK_SCALE;
+  into.numCalls += node.numCalls;
+  for (const auto& child : node.children)
+    mergeTree(childFor(into, child->timer), *child);
+}
+
+void mergeTree(TimerTreeNode& into, const TimerTreeNode& node)
+{
+  into.time += node.time;
+  into.numCalls += node.numCalls;
+  for (const TimerTreeNode& child : node.children)
+    mergeTree(childFor(into, child.timer), child);
+}
+
+void resetTree(TimerNode& node)
+{
+  node.time = 0;
+  node.numCalls = 0;
+  for (const auto& child : node.children)
+    resetTree(*child);
+}
+
+struct ThreadTimers
+{
+  HELIB_MUTEX_TYPE mx;
+  TimerNode root{nullptr};
+  auto_timer* current = nullptr; // innermost timer of the thread
+  long thread;
+  std::vector<TraceEvent> events;
+
+  ThreadTimers()
+  {
+    TimerRegistry& r = timerRegistry();
+    HELIB_MUTEX_GUARD(r.mx);
+    thread = r.nextThread++;
+    r.running.push_back(this);
+  }
+
+  ~ThreadTimers()
+  {
+    TimerRegistry& r = timerRegistry();
+    HELIB_MUTEX_GUARD(r.mx);
+    mergeTree(r.finished, root);
+    r.finishedEvents.insert(r.finishedEvents.end(),
+                            events.begin(),
+                            events.end());
+    r.running.erase(std::find(r.running.begin(), r.running.end(), this));
+  }
+};
+
+thread_local ThreadTimers threadTimers;
+
+} // namespace
+
+void auto_timer::start()
+{
+  ThreadTimers& t = threadTimers;
+  parent = t.current;
+  TimerNode* under = parent ? parent->node : &t.root;
+  node = nullptr;
+  for (const auto& child : under->children)
+    if (child->timer == timer) {
+      node = child.get();
+      break;
+    }
+  if (!node) {
+    HELIB_MUTEX_GUARD(t.mx);
+    under->children.push_back(std::make_unique<TimerNode>(timer));
+    node = under->children.back().get();
+  }
+  t.current = this;
+  amt = GetTimerClock();
+}
+
+void auto_timer::stop()
+{
+  unsigned long start = amt;
+  amt = GetTimerClock() - start;
+  timer->counter += amt;
+  timer->numCalls++;
+  node->time += amt;
+  node->numCalls++;
+  running = false;
+
+  ThreadTimers& t = threadTimers;
+  if (tracing) {
+    HELIB_MUTEX_GUARD(t.mx);
+    t.events.push_back({timer, t.thread, start, amt});
+  }
+  // A timer stopped before an inner one stays in the stack until the inner
+  // one stops, so the timers started meanwhile keep their parent
+  if (t.current == this)
+    while (t.current && !t.current->running)
+      t.current = t.current->parent;
+}
+
 void resetAllTimers()
 {
-  for (long i = 0; i < long(timerMap.size()); i++)
-    timerMap[i]->reset();
+  {
+    HELIB_MUTEX_GUARD(timerMapMx);
+    for (long i = 0; i < long(timerMap.size()); i++)
+      timerMap[i]->reset();
+  }
+
+  TimerRegistry& r = timerRegistry();
+  HELIB_MUTEX_GUARD(r.mx);
+  r.finished = TimerTreeNode();
+  r.finishedEvents.clear();
+  for (ThreadTimers* t : r.running) {
+    HELIB_MUTEX_GUARD(t->mx);
+    resetTree(t->root);
+    t->events.clear();
+  }
 }
 
 // Print the value of all timers to stream
 void printAllTimers(std::ostream& str)
 {
-
+  HELIB_MUTEX_GUARD(timerMapMx);
   sort(timerMap.begin(), timerMap.end(), timer_compare);
 
   for (long i = 0; i < long(timerMap.size()); i++) {
@@ -105,6 +274,7 @@ void printAllTimers(std::ostream& str)
 
 const FHEtimer* getTimerByName(const char* name)
 {
+  HELIB_MUTEX_GUARD(timerMapMx);
   for (long i = 0; i < long(timerMap.size()); i++) {
     if (strcmp(name, timerMap[i]->name) == 0)
       return timerMap[i];
@@ -115,6 +285,7 @@ const FHEtimer* getTimerByName(const char* name)
 
 bool printNamedTimer(std::ostream& str, const char* name)
 {
+  HELIB_MUTEX_GUARD(timerMapMx);
   for (long i = 0; i < long(timerMap.size()); i++) {
     if (strcmp(name, timerMap[i]->name) == 0) {
 
@@ -134,4 +305,114 @@ bool printNamedTimer(std::ostream& str, const char* name)
   return false;
 }
 
+TimerTreeNode getThreadTimerTree()
+{
+  ThreadTimers& t = threadTimers;
+  TimerTreeNode result;
+  HELIB_MUTEX_GUARD(t.mx);
+  mergeTree(result, t.root);
+  return result;
+}
+
+TimerTreeNode getTimerTree()
+{
+  TimerRegistry& r = timerRegistry();
+  HELIB_MUTEX_GUARD(r.mx);
+  TimerTreeNode result = r.finished;
+  for (ThreadTimers* t : r.running) {
+    HELIB_MUTEX_GUARD(t->mx);
+    mergeTree(result, t->root);
+  }
+  return result;
+}
+
+static void printTimerTree(std::ostream& str,
+                           std::vector<TimerTreeNode> nodes,
+                           long depth)
+{
+  std::sort(nodes.begin(),
+            nodes.end(),
+            [](const TimerTreeNode& a, const TimerTreeNode& b) {
+              return a.time > b.time;
+            });
+  for (const TimerTreeNode& node : nodes) {
+    if (node.numCalls == 0)
+      continue;
+    str << std::string(2 * depth, ' ') << node.timer->name << ": "
+        << node.time << " / " << node.numCalls << " = "
+        << node.time / node.numCalls << "   [" << node.timer->loc << "]\n";
+    printTimerTree(str, node.children, depth + 1);
+  }
+}
+
+void printTimerTree(std::ostream& str)
+{
+  printTimerTree(str, getTimerTree().children, 1);
+}
+
+void startTimerTrace()
+{
+  TimerRegistry& r = timerRegistry();
+  HELIB_MUTEX_GUARD(r.mx);
+  r.finishedEvents.clear();
+  for (ThreadTimers* t : r.running) {
+    HELIB_MUTEX_GUARD(t->mx);
+    t->events.clear();
+  }
+  tracing = 1;
+}
+
+void stopTimerTrace() { tracing = 0; }
+
+// Names and locations are identifiers and paths, only quotes and
+// backslashes need escaping
+static void writeJSONString(std::ostream& str, const char* s)
+{
+  str << '"';
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      str << '\\';
+    str << *s;
+  }
+  str << '"';
+}
+
+void writeTimerTrace(std::ostream& str)
+{
+  std::vector<TraceEvent> events;
+  {
+    TimerRegistry& r = timerRegistry();
+    HELIB_MUTEX_GUARD(r.mx);
+    events = r.finishedEvents;
+    for (ThreadTimers* t : r.running) {
+      HELIB_MUTEX_GUARD(t->mx);
+      events.insert(events.end(), t->events.begin(), t->events.end());
+    }
+  }
+
+  // Timestamps and durations are in microseconds
+  const double scale = 1e6 / CLOCK_SCALE;
+  std::set<long> threads;
+  str << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  const char* sep = "\n";
+  for (const TraceEvent& event : events) {
+    threads.insert(event.thread);
+    str << sep << "{\"name\":";
+    writeJSONString(str, event.timer->name);
+    str << ",\"cat\":\"helib\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.thread
+        << ",\"ts\":" << static_cast<unsigned long>(event.start * scale)
+        << ",\"dur\":" << static_cast<unsigned long>(event.duration * scale)
+        << ",\"args\":{\"loc\":";
+    writeJSONString(str, event.timer->loc);
+    str << "}}";
+    sep = ",\n";
+  }
+  for (long thread : threads) {
+    str << sep << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+        << thread << ",\"args\":{\"name\":\"thread " << thread << "\"}}";
+    sep = ",\n";
+  }
+  str << "\n]}\n";
+}
+
 } // namespace helib
@@ -0,0 +1,26 @@
+/* Copyright (C) 2021 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+// The unsigned 128-bit integers of GCC and Clang, for the products of two
+// residues. __extension__ keeps -Wpedantic from rejecting the type, so it
+// is only named here.
+
+#ifndef HELIB_UINT128_H
+#define HELIB_UINT128_H
+
+namespace helib {
+
+__extension__ typedef unsigned __int128 uint128;
+
+} // namespace helib
+
+#endif // HELIB_UINT128_H
@@ -7,4 +7,13 @@ static constexpr char versionInLib[] = "v@PROJECT_VERSION@";
 
 const char* version::libString() { return versionInLib; }
 
+bool version::usesHexl()
+{
+#ifdef USE_INTEL_HEXL
+  return true;
+#else
+  return false;
+#endif
+}
+
 } // namespace helib
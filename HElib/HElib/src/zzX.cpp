@@ -13,10 +13,13 @@
  * @file zzX.cpp - manipulating polynomials with single-precision coefficient
  *               It is assumed that the result is also single-precision
  **/
+#include <algorithm>
 #include <mutex>
 #include <map>
 
 #include <helib/PAlgebra.h>
+#include <helib/multicore.h>
+#include <helib/NumbTh.h>
 #include <helib/timing.h>
 #include <helib/zzX.h>
 #include <helib/range.h>
@@ -36,30 +39,70 @@ void MulMod(zzX& res, const zzX& a, const zzX& b, const PAlgebra& palg)
   convert(res, aa, /*symmetric=*/true); // HERE
 }
 
+// The loops below run over raw pointers, taken after SetLength (which may
+// move res, and a or b with it when they alias it), so that they vectorize
+
+void convert(NTL::zz_pX& x, const zzX& a)
+{
+  const long p = NTL::zz_p::modulus();
+  const long n = a.length();
+  x.rep.SetLength(n);
+  const long* ap = a.elts();
+  NTL::zz_p* xp = x.rep.elts();
+
+  // One pass to see whether any coefficient needs a division
+  bool large = false;
+  for (long i = 0; i < n; i++)
+    large |= (ap[i] >= p) | (ap[i] <= -p);
+
+  if (large) {
+    for (long i = 0; i < n; i++)
+      xp[i].LoopHole() = mcMod(ap[i], p);
+  } else {
+    // The sign bit adds p to the negative coefficients
+    for (long i = 0; i < n; i++)
+      xp[i].LoopHole() = ap[i] + ((ap[i] >> (NTL_BITS_PER_LONG - 1)) & p);
+  }
+  x.normalize();
+}
+
 void add(zzX& res, const zzX& a, const zzX& b)
 {
   HELIB_TIMER_START;
   // The shorter one is aa, the longer is bb
   const zzX& aa = (lsize(a) < lsize(b)) ? a : b;
   const zzX& bb = (lsize(a) < lsize(b)) ? b : a;
-  res.SetLength(lsize(bb));
-  for (long i = 0; i < lsize(aa); i++)
-    res[i] = aa[i] + bb[i];
-  for (long i = lsize(aa); i < lsize(bb); i++)
-    res[i] = bb[i];
+  const long na = lsize(aa);
+  const long nb = lsize(bb);
+  res.SetLength(nb);
+  long* rp = res.elts();
+  const long* ap = aa.elts();
+  const long* bp = bb.elts();
+  for (long i = 0; i < na; i++)
+    rp[i] = ap[i] + bp[i];
+  if (rp != bp)
+    for (long i = na; i < nb; i++)
+      rp[i] = bp[i];
 }
+
 void mul(zzX& res, const zzX& a, long b)
 {
-  res.SetLength(lsize(a));
-  for (long i = 0; i < lsize(a); i++)
-    res[i] *= a[i] * b;
+  const long n = lsize(a);
+  res.SetLength(n);
+  long* rp = res.elts();
+  const long* ap = a.elts();
+  for (long i = 0; i < n; i++)
+    rp[i] = ap[i] * b;
 }
 
 void div(zzX& res, const zzX& a, long b)
 {
-  res.SetLength(lsize(a));
-  for (long i = 0; i < lsize(a); i++)
-    res[i] = a[i] / b;
+  const long n = lsize(a);
+  res.SetLength(n);
+  long* rp = res.elts();
+  const long* ap = a.elts();
+  for (long i = 0; i < n; i++)
+    rp[i] = ap[i] / b;
 }
 
 void normalize(zzX& f)
@@ -79,37 +122,65 @@ void normalize(zzX& f)
 const NTL::zz_pXModulus& getPhimXMod(const PAlgebra& palg)
 {
   static std::map<long, NTL::zz_pXModulus*> moduli; // pointer per value of m
-  static std::mutex pt_mtx; // control access to modifying the map
+  static HELIB_SHARED_MUTEX_TYPE mx; // lookups share it, insertions not
 
   NTL::zz_p::FFTInit(0); // set "the best FFT prime" as NTL's current modulus
 
   long m = palg.getM();
-  auto it = moduli.find(m); // check if we already have zz_pXModulus for m
-
-  if (it == moduli.end()) { // init a new zz_pXModulus for this value of m
-    std::unique_lock<std::mutex> lck(pt_mtx); // try to get a lock
+  { // check if we already have zz_pXModulus for m
+    HELIB_SHARED_GUARD(mx);
+    auto it = moduli.find(m);
+    if (it != moduli.end())
+      return *(it->second);
+  }
 
-    // Got the lock, insert a new entry for this value of m into the map
-    NTL::zz_pX phimX = NTL::conv<NTL::zz_pX>(palg.getPhimX());
-    NTL::zz_pXModulus* ptr =
-        new NTL::zz_pXModulus(phimX); // will "never" be deleted
+  // init a new zz_pXModulus for this value of m outside of the lock
+  NTL::zz_pX phimX = NTL::conv<NTL::zz_pX>(palg.getPhimX());
+  NTL::zz_pXModulus* ptr =
+      new NTL::zz_pXModulus(phimX); // will "never" be deleted
 
-    // insert returns a pair (iterator, bool)
-    auto ret = moduli.insert(std::pair<long, NTL::zz_pXModulus*>(m, ptr));
-    if (ret.second == false) // Another thread inserted it, delete your copy
-      delete ptr;
-    // FIXME: Could leak memory if insert throws an exception
-    //        without inserting the element (but who cares)
+  HELIB_EXCLUSIVE_GUARD(mx);
+  // insert returns a pair (iterator, bool)
+  auto ret = moduli.insert(std::pair<long, NTL::zz_pXModulus*>(m, ptr));
+  if (ret.second == false) // Another thread inserted it, delete your copy
+    delete ptr;
+  // FIXME: Could leak memory if insert throws an exception
+  //        without inserting the element (but who cares)
 
-    it = ret.first; // point to the entry in the map
-  }
-  return *(it->second);
+  return *(ret.first->second);
 }
 
 // DIRT: We use modular arithmetic mod p \approx 2^{60} as a
 //       substitute for computing on rational numbers
 void reduceModPhimX(zzX& poly, const PAlgebra& palg)
 {
+  HELIB_TIMER_START;
+  const long phim = palg.getPhiM();
+  const long n = poly.length();
+  if (n <= phim) {
+    normalize(poly);
+    return;
+  }
+
+  if (palg.getPow2() != 0) {
+    // X^{phim} = -1: coefficient i goes to i mod phim, negated when
+    // floor(i/phim) is odd
+    long* pp = poly.elts();
+    for (long block = 1; block * phim < n; block++) {
+      const long* src = pp + block * phim;
+      const long len = std::min(phim, n - block * phim);
+      if (block % 2 == 1)
+        for (long i = 0; i < len; i++)
+          pp[i] -= src[i];
+      else
+        for (long i = 0; i < len; i++)
+          pp[i] += src[i];
+    }
+    poly.SetLength(phim);
+    normalize(poly);
+    return;
+  }
+
   NTL::zz_pPush push; // backup the NTL current modulus
   const NTL::zz_pXModulus& phimX = getPhimXMod(palg);
 
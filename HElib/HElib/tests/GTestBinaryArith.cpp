@@ -22,6 +22,8 @@
 
 #include <helib/intraSlot.h>
 #include <helib/binaryArith.h>
+#include <helib/circuitDAG.h>
+#include <helib/lazyCarry.h>
 
 #include "gtest/gtest.h"
 #include "test_common.h"
@@ -1235,6 +1237,163 @@ TEST_P(GTestBinaryArith, bitwiseNotNotsCorrectly)
   EXPECT_THROW(do_not(), helib::LogicError);
 }
 
+TEST_P(GTestBinaryArith, circuitDAGMatchesThePlaintextCircuit)
+{
+  const helib::EncryptedArray& ea = context.getEA();
+  long a = NTL::RandomBits_long(bitSize);
+  long b = NTL::RandomBits_long(bitSize);
+
+  std::vector<helib::Ctxt> eA(bitSize, helib::Ctxt(secKey));
+  std::vector<helib::Ctxt> eB(bitSize, helib::Ctxt(secKey));
+  for (long i = 0; i < bitSize; ++i) {
+    secKey.Encrypt(eA[i], NTL::ZZX((a >> i) & 1));
+    secKey.Encrypt(eB[i], NTL::ZZX((b >> i) & 1));
+  }
+
+  helib::CircuitDAG circuit;
+  std::vector<helib::CircuitDAG::Wire> wA =
+      circuit.inputs(helib::CtPtrs_vectorCt(eA));
+  std::vector<helib::CircuitDAG::Wire> wB =
+      circuit.inputs(helib::CtPtrs_vectorCt(eB));
+
+  // The AND of all the bits of a, as a balanced tree
+  std::vector<helib::CircuitDAG::Wire> terms = wA;
+  while (terms.size() > 1) {
+    std::vector<helib::CircuitDAG::Wire> next;
+    for (std::size_t i = 0; i + 1 < terms.size(); i += 2)
+      next.push_back(circuit.multiply(terms[i], terms[i + 1]));
+    if (terms.size() % 2 == 1)
+      next.push_back(terms.back());
+    terms = next;
+  }
+  helib::CircuitDAG::Wire allOnes = terms[0];
+  // The inner product of a and b mod 2
+  helib::CircuitDAG::Wire inner = circuit.multiply(wA[0], wB[0]);
+  for (long i = 1; i < bitSize; ++i)
+    inner = circuit.add(inner, circuit.multiply(wA[i], wB[i]));
+  helib::CircuitDAG::Wire notA0 = circuit.negate(wA[0]);
+  // Not an output, so it is not computed
+  circuit.multiply(allOnes, inner);
+
+  EXPECT_EQ(circuit.multDepth(allOnes), NTL::NumBits(bitSize - 1));
+  EXPECT_EQ(circuit.multDepth(inner), 1);
+  EXPECT_EQ(circuit.multDepth(notA0), 0);
+
+  std::vector<helib::Ctxt> output;
+  helib::CtPtrs_vectorCt output_wrapper(output);
+  circuit.apply(output_wrapper, {allOnes, inner, notA0}, &unpackSlotEncoding);
+  EXPECT_EQ(circuit.recryptCount(), 0);
+
+  long mask = (1L << bitSize) - 1;
+  long expected = ((a == mask) ? 1 : 0) |
+                  ((NTL::weight(NTL::ZZ(a & b)) % 2) << 1) |
+                  ((~a & 1) << 2);
+  std::vector<long> decrypted_result;
+  helib::decryptBinaryNums(decrypted_result, output_wrapper, secKey, ea);
+  for (std::size_t i = 0; i < decrypted_result.size(); ++i)
+    EXPECT_EQ(decrypted_result[i], expected) << "i = " << i << std::endl;
+
+  EXPECT_THROW(circuit.multiply(allOnes, circuit.size()),
+               helib::InvalidArgument);
+}
+
+TEST(GTestLazyCarry, lazyCarriesMatchTheIntegerSums)
+{
+  const long r = 6, nBits = 4, nNumbers = 5;
+  helib::Context context =
+      helib::ContextBuilder<helib::BGV>().m(45).p(2).r(r).bits(400).build();
+  helib::SecKey secKey(context);
+  secKey.GenSecKey();
+  helib::addSome1DMatrices(secKey);
+  const helib::EncryptedArray& ea = context.getEA();
+  const long mask = (1L << nBits) - 1;
+
+  std::vector<long> expected(ea.size(), 0);
+  std::vector<helib::LazyCarryInteger> numbers;
+  for (long i = 0; i < nNumbers; i++) {
+    std::vector<long> v(ea.size());
+    for (long& x : v)
+      x = NTL::RandomBits_long(nBits);
+    for (long j = 0; j < ea.size(); j++)
+      expected[j] += v[j];
+    helib::Ctxt c(secKey);
+    ea.encrypt(c, secKey, v);
+    numbers.emplace_back(c, nBits);
+  }
+  helib::LazyCarryInteger sum = helib::LazyCarryInteger::sum(numbers);
+  sum *= 3;
+  sum -= numbers[0];
+  for (long j = 0; j < ea.size(); j++)
+    expected[j] = 3 * expected[j];
+  EXPECT_FALSE(sum.isNormalized());
+
+  // The carries are still above nBits
+  std::vector<long> decrypted;
+  ea.decrypt(sum.getCtxt(), secKey, decrypted);
+  std::vector<long> first;
+  ea.decrypt(numbers[0].getCtxt(), secKey, first);
+  for (long j = 0; j < ea.size(); j++) {
+    expected[j] = (expected[j] - first[j]) & mask;
+    EXPECT_EQ(decrypted[j] & mask, expected[j]) << "slot " << j;
+  }
+
+  std::vector<helib::Ctxt> bits;
+  helib::CtPtrs_vectorCt bitsWrapper(bits);
+  sum.toBits(bitsWrapper);
+  ASSERT_EQ(helib::lsize(bits), nBits);
+  std::vector<long> fromBits(ea.size(), 0);
+  for (long i = 0; i < nBits; i++) {
+    EXPECT_EQ(bits[i].getPtxtSpace(), 2);
+    std::vector<long> bit;
+    ea.decrypt(bits[i], secKey, bit);
+    for (long j = 0; j < ea.size(); j++)
+      fromBits[j] |= bit[j] << i;
+  }
+  EXPECT_EQ(fromBits, expected);
+
+  sum.normalize();
+  EXPECT_TRUE(sum.isNormalized());
+  ea.decrypt(sum.getCtxt(), secKey, decrypted);
+  EXPECT_EQ(decrypted, expected);
+}
+
+TEST(GTestPackedBinary, packedIntegersConvertToBitsAndBack)
+{
+  const long r = 4;
+  helib::Context context =
+      helib::ContextBuilder<helib::BGV>().m(45).p(2).r(r).bits(500).build();
+  helib::SecKey secKey(context);
+  secKey.GenSecKey();
+  const helib::EncryptedArray& ea = context.getEA();
+
+  std::vector<long> v(ea.size());
+  for (long& x : v)
+    x = NTL::RandomBits_long(r);
+  helib::Ctxt packed(secKey);
+  ea.encrypt(packed, secKey, v);
+
+  std::vector<helib::Ctxt> bits;
+  helib::CtPtrs_vectorCt bitsWrapper(bits);
+  helib::packedToBinary(bitsWrapper, packed);
+  ASSERT_EQ(long(bits.size()), r);
+  std::vector<long> decrypted;
+  helib::decryptBinaryNums(decrypted, bitsWrapper, secKey, ea);
+  EXPECT_EQ(decrypted, v);
+
+  helib::Ctxt recomposed(secKey);
+  helib::binaryToPacked(recomposed, bitsWrapper, r);
+  EXPECT_EQ(recomposed.getPtxtSpace(), 1L << r);
+  ea.decrypt(recomposed, secKey, decrypted);
+  EXPECT_EQ(decrypted, v);
+
+  // Only the lowest bits
+  helib::packedToBinary(bitsWrapper, packed, 2);
+  ASSERT_EQ(bits.size(), 2u);
+  helib::decryptBinaryNums(decrypted, bitsWrapper, secKey, ea);
+  for (long j = 0; j < ea.size(); j++)
+    EXPECT_EQ(decrypted[j], v[j] & 3);
+}
+
 INSTANTIATE_TEST_SUITE_P(
     smallParameterSizesRepeated,
     GTestBinaryArith,
@@ -175,6 +175,42 @@ TEST_P(GTestExtractDigits, correctlyExtractsDigits)
   }
 }
 
+TEST_P(GTestExtractDigits, chenHanExtractsTheSameDigits)
+{
+  helib::EncryptedArray ea(context);
+  std::vector<long> v;
+  ea.random(v);
+
+  helib::Ctxt c(secretKey);
+  ea.encrypt(c, secretKey, v);
+
+  // Same digits as extractDigits, digits[i] is mod p^{r-i}
+  std::vector<helib::Ctxt> digits;
+  helib::extendExtractDigits(digits, c, r, /*e=*/0);
+  ASSERT_EQ((long)digits.size(), r);
+
+  std::vector<long> tmp = v;
+  long pp = p2r;
+  for (long i = 0; i < r; i++) {
+    std::vector<long> pDigits;
+    ea.decrypt(digits[i], secretKey, pDigits);
+    for (long j = 0; j < (long)v.size(); j++) {
+      long digit = tmp[j] % p;
+      if (digit > p / 2)
+        digit -= p;
+      else if (digit < -p / 2)
+        digit += p;
+
+      EXPECT_EQ((pDigits[j] - digit) % pp, 0)
+          << " error: v[" << j << "]=" << v[j] << " but " << i
+          << "th digit comes " << pDigits[j] << " rather than " << digit;
+      tmp[j] -= digit;
+      tmp[j] /= p;
+    }
+    pp /= p;
+  }
+}
+
 INSTANTIATE_TEST_SUITE_P(variousPlaintextBases,
                          GTestExtractDigits,
                          ::testing::Values(
@@ -350,4 +350,29 @@ TYPED_TEST(GTestMatmul, multipliesWithoutErrors)
   EXPECT_TRUE(equals(this->ea, v, v1)); // check that we've got the right answer
 }
 
+TYPED_TEST(GTestMatmul, parallelGiantStepsGiveTheSameProduct)
+{
+  const typename TypeParam::MatrixType& mat = *(this->matrixPtr);
+  typename TypeParam::MatrixType::ExecType mat_exec(mat, (this->minimal));
+
+  helib::PlaintextArray v(this->ea);
+  random(this->ea, v);
+  helib::Ctxt ctxt(this->secretKey);
+  this->ea.encrypt(ctxt, this->secretKey, v);
+  mul(v, mat);
+
+  // More threads than giant steps, so that these are split into blocks of
+  // baby steps too
+  for (long threads : {3, 16}) {
+    helib::ExecutionPolicy policy;
+    policy.threads = threads;
+    helib::Ctxt product = ctxt;
+    mat_exec.mul(product, policy);
+
+    helib::PlaintextArray v1(this->ea);
+    this->ea.decrypt(product, this->secretKey, v1);
+    EXPECT_TRUE(equals(this->ea, v, v1)) << "threads = " << threads;
+  }
+}
+
 } // namespace
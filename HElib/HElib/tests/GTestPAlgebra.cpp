@@ -10,11 +10,13 @@
  * limitations under the License. See accompanying LICENSE file.
  */
 #include <cassert>
+#include <cstdlib>
 #include <string>
 #include <sstream>
 #include <NTL/ZZ.h>
 #include <helib/NumbTh.h>
 #include <helib/Context.h>
+#include <helib/EncryptedArray.h>
 #include <helib/debugging.h>
 
 #include "gtest/gtest.h"
@@ -122,11 +124,134 @@ TEST_P(GTestPAlgebra, readsAndWritesContextsAsStrings)
   EXPECT_EQ(context, c1);
 }
 
+TEST_P(GTestPAlgebra, encodingsAreSumsOfUnitSelectors)
+{
+  const helib::EncryptedArray& ea = context.getEA();
+  const long p2r = ea.getP2R();
+  std::vector<long> v;
+  ea.random(v);
+
+  helib::zzX poly;
+  ea.encode(poly, v);
+  NTL::ZZX encoded;
+  helib::convert(encoded, poly);
+  std::vector<long> decoded;
+  ea.decode(decoded, encoded);
+  EXPECT_EQ(decoded, v);
+
+  NTL::ZZX expected;
+  for (long i = 0; i < ea.size(); i++) {
+    helib::zzX selector;
+    ea.encodeUnitSelector(selector, i);
+    NTL::ZZX tmp;
+    helib::convert(tmp, selector);
+    expected += tmp * v[i];
+  }
+  NTL::ZZX diff = expected - encoded;
+  for (long j = 0; j <= NTL::deg(diff); j++)
+    EXPECT_EQ(NTL::rem(NTL::coeff(diff, j), p2r), 0) << "coefficient " << j;
+}
+
+TEST_P(GTestPAlgebra, batchEncodingsMatchTheSingleOnes)
+{
+  const helib::EncryptedArray& ea = context.getEA();
+  std::vector<std::vector<long>> arrays(3);
+  for (auto& array : arrays)
+    ea.random(array);
+
+  std::vector<helib::zzX> polys;
+  ea.encodeBatch(polys, arrays);
+  ASSERT_EQ(polys.size(), arrays.size());
+  std::vector<NTL::ZZX> encoded(polys.size());
+  for (std::size_t i = 0; i < arrays.size(); i++) {
+    helib::zzX single;
+    ea.encode(single, arrays[i]);
+    EXPECT_EQ(polys[i], single);
+    helib::convert(encoded[i], polys[i]);
+  }
+
+  std::vector<std::vector<long>> decoded;
+  ea.decodeBatch(decoded, encoded);
+  EXPECT_EQ(decoded, arrays);
+}
+
+TEST_P(GTestPAlgebra, zzXKernelsMatchTheirZZXCounterparts)
+{
+  const helib::PAlgebra& zMStar = context.getZMStar();
+  const long phim = zMStar.getPhiM();
+
+  // Degree up to 3 phi(m), so that power-of-two folds go both ways
+  helib::zzX poly;
+  poly.SetLength(3 * phim);
+  for (long i = 0; i < poly.length(); i++)
+    poly[i] = NTL::RandomBnd(2001) - 1000;
+  NTL::ZZX expected;
+  helib::convert(expected, poly);
+  NTL::rem(expected, expected, NTL::conv<NTL::ZZX>(zMStar.getPhimX()));
+
+  helib::zzX reduced(poly);
+  helib::reduceModPhimX(reduced, zMStar);
+  NTL::ZZX actual;
+  helib::convert(actual, reduced);
+  EXPECT_EQ(actual, expected);
+
+  // Reduction of small and large coefficients mod an FFT prime
+  NTL::zz_pPush push;
+  NTL::zz_p::FFTInit(0);
+  const long q = NTL::zz_p::modulus();
+  poly[0] = q + 5;
+  poly[1] = -q - 7;
+  poly[2] = -1;
+  poly[3] = NTL_SP_BOUND - 1;
+  NTL::zz_pX fast, slow;
+  helib::convert(fast, poly);
+  NTL::conv(slow.rep, poly);
+  slow.normalize();
+  EXPECT_EQ(fast, slow);
+
+  helib::zzX back;
+  helib::convert(back, fast, /*symmetric=*/true);
+  for (long i = 0; i < back.length(); i++) {
+    EXPECT_LE(std::abs(back[i]), q / 2);
+    EXPECT_EQ(helib::mcMod(back[i] - poly[i], q), 0) << "coefficient " << i;
+  }
+
+  helib::zzX sum = poly + reduced;
+  helib::zzX scaled = reduced * 3;
+  for (long i = 0; i < reduced.length(); i++) {
+    EXPECT_EQ(sum[i], poly[i] + reduced[i]);
+    EXPECT_EQ(scaled[i], 3 * reduced[i]);
+  }
+}
+
+TEST_P(GTestPAlgebra, tablesRebuildTheSamePAlgebraMod)
+{
+  const helib::PAlgebraMod& alMod = context.getAlMod();
+  std::stringstream str;
+  alMod.getTables().writeTo(str);
+  const helib::PAlgebraTables tables = helib::PAlgebraTables::readFrom(str);
+
+  helib::PAlgebraMod rebuilt(context.getZMStar(), r, &tables);
+  EXPECT_EQ(rebuilt.getFactorsOverZZ(), alMod.getFactorsOverZZ());
+  EXPECT_EQ(rebuilt.getTables().crtCoeffs, tables.crtCoeffs);
+  for (long i = 0; i < long(context.getZMStar().numOfGens()); i++)
+    for (long j = 0; j <= context.getZMStar().OrderOf(i); j++)
+      EXPECT_EQ(rebuilt.getMask_zzX(i, j), alMod.getMask_zzX(i, j));
+
+  EXPECT_THROW(helib::PAlgebraMod(context.getZMStar(), r + 1, &tables),
+               helib::IOError);
+}
+
 INSTANTIATE_TEST_SUITE_P(
     smallParameters,
     GTestPAlgebra,
     ::testing::Values(
         // FAST
-        Parameters(91, 2, 1, std::vector<long>{}, std::vector<long>{})));
+        Parameters(91, 2, 1, std::vector<long>{}, std::vector<long>{}),
+        // p = 1 mod m, so the slots are the values at the roots of unity
+        Parameters(31, 311, 1, std::vector<long>{}, std::vector<long>{}),
+        Parameters(31, 311, 2, std::vector<long>{}, std::vector<long>{}),
+        // m a power of two, Phi_m(X) = X^32 + 1
+        Parameters(64, 17, 1, std::vector<long>{}, std::vector<long>{})));
 
 } // namespace
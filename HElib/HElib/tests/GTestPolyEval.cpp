@@ -10,10 +10,20 @@
  * limitations under the License. See accompanying LICENSE file.
  */
 
+#include <cmath>
+#include <cstdio>
+#include <sstream>
+#include <memory>
+
 #include <NTL/ZZ.h>
 #include <helib/polyEval.h>
+#include <helib/recryption.h>
+#include <helib/polyBundle.h>
+#include <helib/digitCompare.h>
+#include <helib/digitSimulation.h>
 #include <helib/EncryptedArray.h>
 #include <helib/debugging.h>
+#include <helib/opCounters.h>
 
 #include "gtest/gtest.h"
 #include "test_common.h"
@@ -147,6 +157,41 @@ TEST_P(GTestPolyEval, encryptedPolynomialsEvaluateAtEncryptedPointCorrectly)
   EXPECT_EQ(cres, pres) << "encrypted poly MISMATCH";
 }
 
+TEST_P(GTestPolyEval, encryptedCoefficientsGiveTheSameResultsInParallel)
+{
+  std::vector<long> x;
+  ea->random(x);
+  helib::Ctxt cX(publicKey);
+  ea->encrypt(cX, publicKey, x);
+
+  // Every third coefficient is empty, hence zero
+  std::vector<std::vector<long>> coefficients(d + 1);
+  NTL::Vec<helib::Ctxt> cpoly(NTL::INIT_SIZE, d + 1, helib::Ctxt(publicKey));
+  for (long i = 0; i <= d; i++) {
+    coefficients[i].assign(ea->size(), 0);
+    if (i % 3 != 2) {
+      ea->random(coefficients[i]);
+      ea->encrypt(cpoly[i], publicKey, coefficients[i]);
+    }
+  }
+
+  helib::Ctxt eager(publicKey), lazy(publicKey);
+  helib::polyEval(eager, cpoly, cX, helib::RelinPolicy::Eager);
+  helib::polyEval(lazy, cpoly, cX, helib::RelinPolicy::Lazy, true);
+  EXPECT_FALSE(lazy.inExtendedForm());
+
+  std::vector<long> y, z;
+  ea->decrypt(eager, secretKey, y);
+  ea->decrypt(lazy, secretKey, z);
+  for (long s = 0; s < ea->size(); s++) {
+    long expected = 0;
+    for (long i = d; i >= 0; i--)
+      expected = (NTL::MulMod(expected, x[s], p2r) + coefficients[i][s]) % p2r;
+    EXPECT_EQ(y[s], expected) << "slot " << s;
+    EXPECT_EQ(z[s], expected) << "slot " << s;
+  }
+}
+
 TEST_P(GTestPolyEval, evaluatePolynomialOnCiphertext)
 {
   // evaluate at random points (at least one co-prime with p)
@@ -176,6 +221,530 @@ TEST_P(GTestPolyEval, evaluatePolynomialOnCiphertext)
   }
 }
 
+TEST_P(GTestPolyEval, customPolyEvalEvaluatesSeveralPolynomialsInParallel)
+{
+  std::vector<long> x;
+  ea->random(x);
+  helib::Ctxt inCtxt(publicKey);
+  ea->encrypt(inCtxt, publicKey, x);
+
+  // Random polynomials of degree exactly d, sharing the same baby steps
+  std::vector<NTL::ZZX> polys(3);
+  for (NTL::ZZX& poly : polys) {
+    for (long i = d; i >= 0; i--)
+      SetCoeff(poly, i, NTL::RandomBnd(p2r));
+    SetCoeff(poly, d);
+  }
+
+  std::vector<helib::Ctxt> serial, parallel;
+  helib::customPolyEval(serial, polys, inCtxt, /*lazy=*/false);
+  helib::customPolyEval(parallel,
+                        polys,
+                        inCtxt,
+                        /*lazy=*/false,
+                        /*parallel=*/true);
+  ASSERT_EQ(serial.size(), polys.size());
+  ASSERT_EQ(parallel.size(), polys.size());
+
+  for (std::size_t j = 0; j < polys.size(); j++) {
+    std::vector<long> y, z;
+    ea->decrypt(serial[j], secretKey, y);
+    ea->decrypt(parallel[j], secretKey, z);
+    for (long i = 0; i < ea->size(); i++) {
+      EXPECT_EQ(helib::polyEvalMod(polys[j], x[i], p2r), y[i])
+          << "serial customPolyEval MISMATCH\n";
+      EXPECT_EQ(y[i], z[i]) << "parallel customPolyEval MISMATCH\n";
+    }
+  }
+}
+
+TEST_P(GTestPolyEval, polyEvalSharesTheEngineBetweenPolynomials)
+{
+  std::vector<long> x;
+  ea->random(x);
+  helib::Ctxt inCtxt(publicKey);
+  ea->encrypt(inCtxt, publicKey, x);
+
+  // A constant, an even, an odd and a general polynomial of degree d
+  std::vector<NTL::ZZX> polys(4);
+  SetCoeff(polys[0], 0, NTL::RandomBnd(p2r));
+  for (long i = 0; i <= d; i++) {
+    NTL::ZZ c = NTL::RandomBnd(p2r);
+    SetCoeff(polys[1 + (i % 2)], i, c);
+    SetCoeff(polys[3], i, c);
+  }
+
+  std::vector<helib::Ctxt> lazy, eager;
+  helib::polyEval(lazy, polys, inCtxt, helib::RelinPolicy::Lazy);
+  helib::polyEval(eager, polys, inCtxt, helib::RelinPolicy::Eager, true);
+  ASSERT_EQ(lazy.size(), polys.size());
+  ASSERT_EQ(eager.size(), polys.size());
+
+  for (std::size_t j = 0; j < polys.size(); j++) {
+    // The single-polynomial polyEval goes through the same engine
+    helib::Ctxt single(publicKey);
+    helib::polyEval(single, polys[j], inCtxt);
+    std::vector<long> y, z, w;
+    ea->decrypt(lazy[j], secretKey, y);
+    ea->decrypt(eager[j], secretKey, z);
+    ea->decrypt(single, secretKey, w);
+    for (long i = 0; i < ea->size(); i++) {
+      EXPECT_EQ(helib::polyEvalMod(polys[j], x[i], p2r), y[i])
+          << "polyEval MISMATCH for polynomial " << j << "\n";
+      EXPECT_EQ(y[i], z[i]);
+      EXPECT_EQ(y[i], w[i]);
+    }
+  }
+}
+
+TEST_P(GTestPolyEval, slotPolynomialsLookUpInterpolatedTables)
+{
+  // A different table in every slot, indexed by values below n <= p
+  const long n = std::min(p, 5l);
+  std::vector<std::vector<long>> tables(ea->size(), std::vector<long>(n));
+  std::vector<long> x(ea->size());
+  for (long s = 0; s < ea->size(); s++) {
+    for (long& entry : tables[s])
+      entry = NTL::RandomBnd(p2r);
+    x[s] = NTL::RandomBnd(n);
+  }
+  helib::Ctxt inCtxt(publicKey);
+  ea->encrypt(inCtxt, publicKey, x);
+
+  std::vector<std::vector<long>> coefficients =
+      helib::interpolateSlotTables(context, tables);
+  ASSERT_EQ(long(coefficients.size()), n);
+  std::vector<std::unique_ptr<helib::PreparedPtxt>> prepared;
+  std::vector<const helib::PreparedPtxt*> pointers;
+  for (const std::vector<long>& coefficient : coefficients) {
+    helib::EncodedPtxt encoded;
+    ea->encode(encoded, coefficient);
+    prepared.emplace_back(new helib::PreparedPtxt(encoded));
+    pointers.push_back(prepared.back().get());
+  }
+  // A missing coefficient is zero
+  pointers.push_back(nullptr);
+
+  helib::Ctxt outCtxt(publicKey);
+  helib::customPolyEval(outCtxt, pointers, inCtxt, helib::RelinPolicy::Lazy);
+  std::vector<long> y;
+  ea->decrypt(outCtxt, secretKey, y);
+  for (long s = 0; s < ea->size(); s++)
+    EXPECT_EQ(y[s], tables[s][x[s]]) << "slot " << s;
+
+  EXPECT_THROW(helib::interpolateSlotTables(
+                   context,
+                   std::vector<std::vector<long>>(1, std::vector<long>(p + 1))),
+               helib::InvalidArgument);
+  // Small tables are interpolated, large ones need the index bits
+  EXPECT_EQ(helib::chooseSlotLookup(context, 2, true),
+            helib::SlotLookupMethod::Interpolation);
+  EXPECT_EQ(helib::chooseSlotLookup(context, 2 * p, true),
+            helib::SlotLookupMethod::TableLookup);
+}
+
+TEST_P(GTestPolyEval, relinearizationPoliciesGiveTheSameResults)
+{
+  std::vector<long> x;
+  ea->random(x);
+  helib::Ctxt inCtxt(publicKey);
+  ea->encrypt(inCtxt, publicKey, x);
+
+  std::vector<NTL::ZZX> polys(2);
+  for (NTL::ZZX& poly : polys) {
+    for (long i = d; i >= 0; i--)
+      SetCoeff(poly, i, NTL::RandomBnd(p2r));
+    SetCoeff(poly, d);
+  }
+
+  long relinearizations[3];
+  const helib::RelinPolicy policies[3] = {helib::RelinPolicy::Eager,
+                                          helib::RelinPolicy::Lazy,
+                                          helib::RelinPolicy::Deferred};
+  for (long n = 0; n < 3; n++) {
+    std::vector<helib::Ctxt> result;
+    helib::OpCountScope scope;
+    helib::customPolyEval(result, polys, inCtxt, policies[n]);
+    relinearizations[n] = scope.counts()[helib::OpType::Relinearization];
+    ASSERT_EQ(result.size(), polys.size());
+
+    for (std::size_t j = 0; j < polys.size(); j++) {
+      if (policies[n] != helib::RelinPolicy::Deferred)
+        EXPECT_FALSE(result[j].inExtendedForm());
+      std::vector<long> y;
+      ea->decrypt(result[j], secretKey, y);
+      for (long i = 0; i < ea->size(); i++)
+        EXPECT_EQ(helib::polyEvalMod(polys[j], x[i], p2r), y[i])
+            << "customPolyEval MISMATCH for policy " << n << "\n";
+    }
+  }
+  // Deferring only skips the relinearizations of the results
+  EXPECT_LE(relinearizations[2], relinearizations[1]);
+}
+
+TEST_P(GTestPolyEval, polyEvalPlanCanBeReplayedOnSeveralCiphertexts)
+{
+  // Polynomials in x^3 that are odd in x^3, so that the spacing and the odd
+  // baby steps of the plan are exercised. The nonzero coefficients lie
+  // outside [0, p^r) and are only reduced by the plan.
+  std::vector<NTL::ZZX> polys(2);
+  for (long i = 1; i <= d; i += 2) {
+    SetCoeff(polys[0], 3 * i, NTL::RandomBnd(p2r - 1) + 1 + p2r);
+    SetCoeff(polys[1], 3 * i, -NTL::RandomBnd(p2r - 1) - 1);
+  }
+
+  const helib::PolyEvalPlan plan(context, polys, /*lazy=*/false, p2r);
+  EXPECT_EQ(plan.getSpacing(), 3);
+  EXPECT_EQ(plan.size(), 2);
+
+  for (long trial = 0; trial < 2; trial++) {
+    std::vector<long> x;
+    ea->random(x);
+    helib::Ctxt inCtxt(publicKey);
+    ea->encrypt(inCtxt, publicKey, x);
+
+    std::vector<helib::Ctxt> result;
+    plan.evaluate(result, inCtxt);
+    ASSERT_EQ(result.size(), polys.size());
+    for (std::size_t j = 0; j < polys.size(); j++) {
+      std::vector<long> y;
+      ea->decrypt(result[j], secretKey, y);
+      for (long i = 0; i < ea->size(); i++)
+        EXPECT_EQ(helib::polyEvalMod(polys[j], x[i], p2r), y[i])
+            << "PolyEvalPlan MISMATCH\n";
+    }
+  }
+}
+
+TEST_P(GTestPolyEval, digitExtractionPlannerPrefersCheaperSplittings)
+{
+  // Dense polynomials of the given degrees for p = 7: going 1 -> 2 -> 4 is
+  // much cheaper than 1 -> 4 at the same depth, while 1 -> 2 -> 3 is deeper
+  // than 1 -> 3
+  if (p != 7)
+    GTEST_SKIP() << "Polynomial table below is for p = 7";
+  const std::string path = "GTestPolyEvalPlanner.bin";
+  std::vector<helib::PolynomialBundle::Entry> entries;
+  for (const auto& entry : std::vector<std::vector<long>>{{1, 2, 13},
+                                                          {1, 3, 19},
+                                                          {1, 4, 120},
+                                                          {2, 3, 7},
+                                                          {2, 4, 7}}) {
+    long modulus = NTL::power_long(p, entry[1]);
+    NTL::ZZX poly;
+    for (long i = 0; i <= entry[2]; i++)
+      SetCoeff(poly, i, NTL::RandomBnd(modulus - 1) + 1);
+    entries.push_back({p, entry[0], entry[1], poly});
+  }
+  helib::PolynomialBundle::write(path, entries);
+  helib::setPolynomialSource(path);
+
+  std::vector<std::vector<long>> expected{{1, 2}, {1}};
+  EXPECT_EQ(helib::planDigitExtraction(context, /*botHigh=*/2, /*r=*/2),
+            expected);
+
+  helib::DigitExtractionPlanCache cache;
+  const auto& plan = cache.get(context, 2, 2, /*lazy=*/false);
+  EXPECT_EQ(plan, expected);
+  EXPECT_EQ(&cache.get(context, 2, 2, false), &plan);
+
+  // The plan is never more expensive than evaluating every row directly
+  long multiplications, depth, directMultiplications, directDepth;
+  helib::digitExtractionCost(multiplications, depth, context, 2, 2, false,
+                             expected);
+  helib::digitExtractionCost(directMultiplications, directDepth, context,
+                             2, 2, false, {{1}, {1}});
+  EXPECT_GT(multiplications, 0);
+  EXPECT_LE(multiplications, directMultiplications);
+
+  // Steps that are not in the table use the built-in polynomials
+  EXPECT_EQ(helib::digitStepMethod(context, 2, 4, 1, 2),
+            helib::DigitStepMethod::Composition);
+  EXPECT_EQ(helib::digitStepMethod(context, 2, 4, 3, 4),
+            helib::DigitStepMethod::Lifting);
+
+  // Without any polynomials every step falls back, and there is still a plan
+  helib::PolynomialBundle::write(path, {});
+  helib::setPolynomialSource(path);
+  EXPECT_EQ(helib::digitStepMethod(context, 2, 4, 1, 2),
+            helib::DigitStepMethod::Lifting);
+  EXPECT_EQ(helib::digitStepMethod(context, 2, 4, 1, 4),
+            helib::DigitStepMethod::ChenHan);
+  std::vector<std::vector<long>> fallback =
+      helib::planDigitExtraction(context, 2, 2);
+  ASSERT_EQ(fallback.size(), 2u);
+  for (const auto& list : fallback)
+    EXPECT_EQ(list.front(), 1);
+
+  // A stored plan is used as is, whatever polynomials are available now
+  std::stringstream stored;
+  cache.writeTo(stored);
+  helib::DigitExtractionPlanCache restored;
+  restored.readFrom(stored);
+  EXPECT_EQ(restored.get(context, 2, 2, false), expected);
+
+  helib::setPolynomialSource("");
+  std::remove(path.c_str());
+}
+
+TEST_P(GTestPolyEval, builtInDigitPolynomialsAreCached)
+{
+  helib::DigitPolynomialCache cache;
+  for (long e : {1l, 2l, 3l}) {
+    NTL::ZZX lifting, chenHan;
+    helib::buildLiftingPolynomial(lifting, p, e);
+    helib::buildChenHanPolynomial(chenHan, p, e);
+    const NTL::ZZX& cachedLifting = cache.getLifting(p, e);
+    EXPECT_EQ(cachedLifting, lifting);
+    EXPECT_EQ(cache.getChenHan(p, e), chenHan);
+    EXPECT_EQ(&cache.getLifting(p, e), &cachedLifting);
+  }
+}
+
+TEST_P(GTestPolyEval, digitExtractionWorksWithoutPolynomialTable)
+{
+  if (p != 7)
+    GTEST_SKIP() << "Digits below are for p = 7";
+  const std::string path = "GTestPolyEvalHybrid.bin";
+  helib::PolynomialBundle::write(path, {});
+  helib::setPolynomialSource(path);
+
+  // One digit to remove and one to keep: the only step is the lifting
+  // polynomial of degree 7, from precision 1 to 2
+  for (long z : {0l, 3l, 4l, 25l, 48l}) {
+    helib::Ctxt ctxt(secretKey);
+    secretKey.Encrypt(ctxt, NTL::ZZX(z), p2r);
+    helib::customExtractDigitsThin(ctxt,
+                                   /*botHigh=*/1,
+                                   /*r=*/1,
+                                   /*lazy=*/false,
+                                   helib::planDigitExtraction(context, 1, 1));
+    long low = ((z + p / 2) % p) - p / 2; // balanced lowest digit
+    NTL::ZZX result;
+    secretKey.Decrypt(result, ctxt);
+    EXPECT_EQ(result, NTL::ZZX(((-(z - low) / p) % p + p) % p)) << "z = " << z;
+  }
+
+  helib::setPolynomialSource("");
+  std::remove(path.c_str());
+}
+
+TEST_P(GTestPolyEval, digitOperationsWorkWithoutBootstrapping)
+{
+  if (r < 2)
+    GTEST_SKIP() << "Needs at least two digits";
+  long pk = p;
+  for (long z : {0l, 3l, 4l, 25l, p2r - 1}) {
+    helib::Ctxt ctxt(secretKey);
+    secretKey.Encrypt(ctxt, NTL::ZZX(z), p2r);
+    NTL::ZZX result;
+
+    helib::Ctxt quotient(ctxt);
+    helib::homDivideByPk(quotient, 1);
+    EXPECT_EQ(quotient.getPtxtSpace(), p2r / pk);
+    secretKey.Decrypt(result, quotient);
+    EXPECT_EQ(result, NTL::ZZX((z / pk) % (p2r / pk))) << "z = " << z;
+
+    helib::Ctxt rounded(ctxt);
+    helib::homRound(rounded, 1);
+    EXPECT_EQ(rounded.getPtxtSpace(), p2r);
+    secretKey.Decrypt(result, rounded);
+    EXPECT_EQ(result, NTL::ZZX((pk * ((z + pk / 2) / pk)) % p2r))
+        << "z = " << z;
+
+    std::vector<helib::Ctxt> digits;
+    helib::extractDigitsPolyfunc(digits, ctxt);
+    ASSERT_EQ(long(digits.size()), r);
+    long rest = z;
+    for (long j = 0; j < r; j++, rest /= p) {
+      secretKey.Decrypt(result, digits[j]);
+      EXPECT_EQ(result, NTL::ZZX(rest % p)) << "z = " << z << ", j = " << j;
+    }
+  }
+}
+
+TEST_P(GTestPolyEval, packedIntegersAreComparedWithTheirTopDigit)
+{
+  long top = p2r / p;
+  auto encrypt = [&](long z) {
+    helib::Ctxt ctxt(secretKey);
+    secretKey.Encrypt(ctxt, NTL::ZZX(((z % p2r) + p2r) % p2r), p2r);
+    return ctxt;
+  };
+  auto decrypt = [&](const helib::Ctxt& ctxt) {
+    NTL::ZZX result;
+    secretKey.Decrypt(result, ctxt);
+    return result;
+  };
+  auto mod = [&](long z, long q) { return NTL::ZZX(((z % q) + q) % q); };
+
+  for (long a : {-top, -3l, 0l, 2l, top - 1}) {
+    helib::Ctxt negative = encrypt(a);
+    helib::homIsNegative(negative);
+    EXPECT_EQ(negative.getPtxtSpace(), p);
+    EXPECT_EQ(decrypt(negative), NTL::ZZX(a < 0)) << "a = " << a;
+
+    helib::Ctxt sign = encrypt(a);
+    helib::homSign(sign);
+    EXPECT_EQ(decrypt(sign), mod(a < 0 ? -1 : 1, p2r)) << "a = " << a;
+  }
+
+  for (long a : {0l, 3l, top - 1})
+    for (long b : {0l, 4l, top - 1}) {
+      helib::Ctxt ca = encrypt(a), cb = encrypt(b), result(secretKey);
+      helib::homIsLessThan(result, ca, cb);
+      EXPECT_EQ(decrypt(result), NTL::ZZX(a < b)) << a << " < " << b;
+      helib::homMax(result, ca, cb);
+      EXPECT_EQ(decrypt(result), mod(std::max(a, b), p2r));
+      helib::homMin(result, ca, cb);
+      EXPECT_EQ(decrypt(result), mod(std::min(a, b), p2r));
+    }
+}
+
+TEST_P(GTestPolyEval, thinDigitExtractionSupportsSmallEPrime)
+{
+  // Remove one digit and keep one, with e' = 0 < r = 1: both versions give
+  // minus the rounded top digit plus z, mod p
+  for (long z : {0l, 3l, 4l, 25l, p2r - 1}) {
+    std::vector<NTL::ZZX> results;
+    for (bool our_version : {true, false}) {
+      helib::Ctxt ctxt(secretKey);
+      secretKey.Encrypt(ctxt, NTL::ZZX(z), p2r);
+      helib::extractDigitsThin(ctxt,
+                               /*botHigh=*/1,
+                               /*r=*/1,
+                               /*ePrime=*/0,
+                               our_version,
+                               /*lazy=*/false,
+                               helib::planDigitExtraction(context, 1, 1));
+      EXPECT_EQ(ctxt.getPtxtSpace(), p);
+      NTL::ZZX result;
+      secretKey.Decrypt(result, ctxt);
+      results.push_back(result);
+    }
+    long rounded = (z + p / 2) / p;
+    EXPECT_EQ(results[0], NTL::ZZX((((z - rounded) % p) + p) % p))
+        << "z = " << z;
+    EXPECT_EQ(results[0], results[1]) << "z = " << z;
+  }
+}
+
+TEST_P(GTestPolyEval, polyfunctionRecryptionParametersAreNoMoreExpensive)
+{
+  long e, ePrime, polyE, polyEPrime;
+  helib::RecryptData::setAE(e, ePrime, context);
+  helib::RecryptData::setAE(polyE, polyEPrime, context, /*our_version=*/true);
+
+  // The built-in extraction keeps the heuristic
+  long builtInE, builtInEPrime;
+  helib::RecryptData::setAE(builtInE, builtInEPrime, context, false);
+  EXPECT_EQ(builtInE, e);
+  EXPECT_EQ(builtInEPrime, ePrime);
+
+  // The pair satisfies the noise bound
+  EXPECT_GE(polyE, r + 1);
+  EXPECT_GE(polyEPrime, 0);
+  EXPECT_LT(polyEPrime, polyE);
+  double noise = 2 * p2r + 2 + (polyEPrime > 0 ? std::pow(p, polyEPrime) : 0);
+  EXPECT_GE(std::pow(p, polyE), noise * context.boundForRecryption() * 2);
+
+  // and the extraction is not more expensive than with the heuristic
+  long multiplications, depth, heuristicMultiplications, heuristicDepth;
+  helib::digitExtractionCost(
+      multiplications,
+      depth,
+      context,
+      polyE - polyEPrime,
+      r,
+      false,
+      helib::planDigitExtraction(context, polyE - polyEPrime, r));
+  helib::digitExtractionCost(heuristicMultiplications,
+                             heuristicDepth,
+                             context,
+                             e - ePrime,
+                             r,
+                             false,
+                             helib::planDigitExtraction(context, e - ePrime, r));
+  EXPECT_LE(multiplications, heuristicMultiplications);
+}
+
+TEST_P(GTestPolyEval, digitExtractionCanBeSimulatedOnPlaintexts)
+{
+  const long botHigh = 2, r = 2;
+  long q = NTL::power_long(p, botHigh + r);
+  long low = NTL::power_long(p, botHigh);
+  long high = NTL::power_long(p, r);
+  for (bool lazy : {false, true}) {
+    // The plan of the planner, and every row evaluated at once
+    for (const auto& plan :
+         {helib::planDigitExtraction(context, botHigh, r, lazy),
+          std::vector<std::vector<long>>{{1}}}) {
+      long multiplications, depth;
+      helib::digitExtractionCost(multiplications, depth, context, botHigh, r,
+                                 lazy, plan);
+      for (long z = 0; z < q; z += 1 + q / 50) {
+        helib::SimulationCounts counts;
+        helib::SimulatedCtxt<long> ctxt(p, z, q, &counts);
+        helib::simulateExtractDigitsThin(ctxt, context, botHigh, r, lazy, plan);
+        // The negation of the digits left after removing the balanced
+        // lowest ones
+        long expected = (high - ((z + low / 2) / low) % high) % high;
+        EXPECT_EQ(ctxt.getPtxtSpace(), high);
+        EXPECT_EQ(ctxt.getValue(), expected) << "z = " << z;
+        EXPECT_GT(counts.multiplications, 0);
+        EXPECT_LE(ctxt.getDepth(), depth);
+
+        helib::SimulatedCtxt<NTL::ZZ> big(p, NTL::ZZ(z), q);
+        helib::simulateExtractDigitsThin(big, context, botHigh, r, lazy, plan);
+        EXPECT_EQ(big.getValue(), NTL::ZZ(expected)) << "z = " << z;
+      }
+    }
+  }
+}
+
+TEST_P(GTestPolyEval, simulatedKeySwitchesMatchTheCiphertextCounts)
+{
+  std::vector<long> x;
+  ea->random(x);
+  helib::Ctxt inCtxt(publicKey);
+  ea->encrypt(inCtxt, publicKey, x);
+  long maxPower = publicKey.maxRelinPower(inCtxt.getKeyID());
+
+  std::vector<NTL::ZZX> polys(2);
+  for (NTL::ZZX& poly : polys) {
+    for (long i = d; i >= 0; i--)
+      SetCoeff(poly, i, NTL::RandomBnd(p2r));
+    SetCoeff(poly, d);
+  }
+
+  for (helib::RelinPolicy policy : {helib::RelinPolicy::Eager,
+                                    helib::RelinPolicy::Lazy,
+                                    helib::RelinPolicy::Deferred}) {
+    std::vector<helib::Ctxt> result;
+    helib::OpCountScope scope;
+    helib::customPolyEval(result, polys, inCtxt, policy);
+    long keySwitches = scope.counts()[helib::OpType::Relinearization];
+
+    helib::SimulationCounts counts;
+    std::vector<helib::SimulatedOperation> trace;
+    counts.trace = &trace;
+    std::vector<helib::SimulatedCtxt<long>> simulated;
+    helib::PolyEvalPlan(context, polys, policy, p2r, maxPower)
+        .simulate(simulated,
+                  helib::SimulatedCtxt<long>(p, x[0], p2r, &counts, maxPower));
+    EXPECT_EQ(counts.keySwitches, keySwitches);
+    ASSERT_EQ(simulated.size(), result.size());
+    for (std::size_t j = 0; j < polys.size(); j++) {
+      EXPECT_EQ(simulated[j].inExtendedForm(), result[j].inExtendedForm());
+      EXPECT_EQ(simulated[j].getValue(),
+                helib::polyEvalMod(polys[j], x[0], p2r));
+    }
+    EXPECT_EQ(static_cast<long>(trace.size()),
+              counts.multiplications + counts.relinearizations +
+                  counts.scalarMultiplications + counts.additions);
+  }
+}
+
 std::vector<Parameters> getParameters()
 {
   std::vector<Parameters> allParams;
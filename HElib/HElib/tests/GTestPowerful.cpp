@@ -114,6 +114,34 @@ TEST_P(GTestPowerful, highLevelConversionWorks)
   EXPECT_EQ(poly1, poly2);
 }
 
+TEST_P(GTestPowerful, batchConversionsMatchTheSingleOnes)
+{
+  helib::PowerfulDCRT p2d(context, mvec);
+  std::vector<NTL::ZZX> polys(3);
+  std::vector<const NTL::ZZX*> polyPtrs;
+  for (NTL::ZZX& poly : polys) {
+    helib::DoubleCRT dcrt(context, context.fullPrimes());
+    dcrt.randomize();
+    dcrt.toPoly(poly);
+    polyPtrs.push_back(&poly);
+  }
+
+  std::vector<NTL::Vec<NTL::ZZ>> pwfls;
+  p2d.ZZXtoPowerful(pwfls, polyPtrs);
+  ASSERT_EQ(pwfls.size(), polys.size());
+  std::vector<const NTL::Vec<NTL::ZZ>*> pwflPtrs;
+  for (long i = 0; i < helib::lsize(polys); i++) {
+    NTL::Vec<NTL::ZZ> pwfl;
+    p2d.ZZXtoPowerful(pwfl, polys[i]);
+    EXPECT_EQ(pwfls[i], pwfl);
+    pwflPtrs.push_back(&pwfls[i]);
+  }
+
+  std::vector<NTL::ZZX> back;
+  p2d.powerfulToZZX(back, pwflPtrs);
+  EXPECT_EQ(back, polys);
+}
+
 INSTANTIATE_TEST_SUITE_P(standardParameters,
                          GTestPowerful,
                          ::testing::Values(
@@ -259,6 +259,20 @@ TEST_P(GTestReplicate, replicateAllReplicatesAccurately)
   }
 }
 
+TEST_P(GTestReplicate, concurrentReplicateAllReplicatesEverySlot)
+{
+  std::vector<helib::Ctxt> v;
+  helib::replicateAll(v, ea, xc0, bnd);
+  ASSERT_EQ(helib::lsize(v), ea.size());
+  for (long i = 0; i < ea.size(); i++) {
+    helib::PlaintextArray expected = xp0;
+    helib::replicate(ea, expected, i);
+    helib::PlaintextArray decrypted(ea);
+    ea.decrypt(v[i], secretKey, decrypted);
+    EXPECT_TRUE(equals(ea, expected, decrypted)) << "slot " << i;
+  }
+}
+
 INSTANTIATE_TEST_SUITE_P(typicalParameters,
                          GTestReplicate,
                          ::testing::Values(
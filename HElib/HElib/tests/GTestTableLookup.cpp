@@ -321,6 +321,77 @@ TEST_P(GTestTableLookup, lookupFunctionsCorrectly)
   }
 }
 
+TEST_P(GTestTableLookup, cachedLookupOfAPartialTableFunctionsCorrectly)
+{
+  // A table of 2^{bitSize-1}+1 entries, so the high half of the index has
+  // fewer products than entries per partial sum
+  std::vector<helib::zzX> T;
+  helib::buildLookupTable(
+      T,
+      [](double x) { return x; },
+      bitSize,
+      /*scale_in=*/0,
+      /*sign_in=*/0,
+      /*nbits_out=*/bitSize,
+      /*scale_out=*/0,
+      /*sign_out=*/0,
+      secretKey.getContext().getEA());
+  T.resize((1L << (bitSize - 1)) + 1);
+  helib::LookupTable table(T);
+
+  for (long count = 0; count < nTests; count++) {
+    long i = NTL::RandomBnd(helib::lsize(T));
+    helib::Ctxt c(secretKey);
+    std::vector<helib::Ctxt> ei(bitSize, c);
+    encryptIndex(ei, i, secretKey);
+    helib::tableLookup(c, table, helib::CtPtrs_vectorCt(ei));
+    NTL::ZZX poly;
+    secretKey.Decrypt(poly, c);
+    helib::zzX poly2;
+    helib::convert(poly2, poly);
+    EXPECT_EQ(poly2, T[i]) << "cached lookup error: decrypted T[" << i
+                           << "]\n";
+  }
+}
+
+TEST_P(GTestTableLookup, batchedLookupsShareTheIndexProducts)
+{
+  // Two tables of the full size and one of half the size
+  std::vector<std::vector<helib::zzX>> tables(3);
+  long sizes[] = {1L << bitSize, 1L << bitSize, 1L << (bitSize - 1)};
+  for (long t = 0; t < 3; t++) {
+    helib::buildLookupTable(
+        tables[t],
+        [t](double x) { return x + t; },
+        bitSize,
+        /*scale_in=*/0,
+        /*sign_in=*/0,
+        /*nbits_out=*/bitSize,
+        /*scale_out=*/0,
+        /*sign_out=*/0,
+        secretKey.getContext().getEA());
+    tables[t].resize(sizes[t]);
+  }
+
+  long i = NTL::RandomBnd(1L << (bitSize - 1)); // in every table
+  helib::Ctxt c(secretKey);
+  std::vector<helib::Ctxt> ei(bitSize, c);
+  encryptIndex(ei, i, secretKey);
+  std::vector<helib::Ctxt> out;
+  helib::CtPtrs_vectorCt outWrap(out);
+  helib::tableLookups(outWrap, tables, helib::CtPtrs_vectorCt(ei));
+
+  ASSERT_EQ(helib::lsize(out), 3);
+  for (long t = 0; t < 3; t++) {
+    NTL::ZZX poly;
+    secretKey.Decrypt(poly, out[t]);
+    helib::zzX poly2;
+    helib::convert(poly2, poly);
+    EXPECT_EQ(poly2, tables[t][i])
+        << "batched lookup error: decrypted T" << t << "[" << i << "]\n";
+  }
+}
+
 TEST_P(GTestTableLookup, writeinFunctionsCorrectly)
 {
   long tSize = 1L << bitSize; // table size
@@ -10,9 +10,28 @@
  * limitations under the License. See accompanying LICENSE file.
  */
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
+
 #include <NTL/BasicThreadPool.h>
 #include <helib/helib.h>
+#include <helib/bootstrapEstimate.h>
+#include <helib/CtPtrs.h>
+#include <helib/distributedBoot.h>
+#include <helib/EvalMap.h>
+#include <helib/fhe_stats.h>
 #include <helib/matmul.h>
+#include <helib/multicore.h>
+#include <helib/opCounters.h>
+#include <helib/recryption.h>
+#include <helib/refreshPolicy.h>
+#include <helib/slotPacking.h>
 #include <helib/debugging.h>
 
 #include "gtest/gtest.h"
@@ -28,6 +47,46 @@ namespace {
 
 static int scale = 0;
 
+// A one-way in-memory pipe whose reads wait for the writes, to run
+// bootstrap workers on threads of the test
+class BlockingPipe : public std::streambuf
+{
+protected:
+  int_type overflow(int_type c) override
+  {
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      char ch = traits_type::to_char_type(c);
+      xsputn(&ch, 1);
+    }
+    return c;
+  }
+
+  std::streamsize xsputn(const char* s, std::streamsize n) override
+  {
+    std::lock_guard<std::mutex> lock(mx);
+    data.insert(data.end(), s, s + n);
+    cv.notify_all();
+    return n;
+  }
+
+  int_type underflow() override
+  {
+    std::unique_lock<std::mutex> lock(mx);
+    cv.wait(lock, [this] { return !data.empty(); });
+    long n = std::min<long>(data.size(), sizeof(buffer));
+    std::copy(data.begin(), data.begin() + n, buffer);
+    data.erase(data.begin(), data.begin() + n);
+    setg(buffer, buffer, buffer + n);
+    return traits_type::to_int_type(buffer[0]);
+  }
+
+private:
+  std::mutex mx;
+  std::condition_variable cv;
+  std::deque<char> data;
+  char buffer[1 << 16];
+};
+
 struct Parameters
 {
 
@@ -431,6 +490,363 @@ TEST_P(GTestThinBootstrapping, correctlyPerformsThinBootstrapping)
   EXPECT_EQ(val1, val2);
 }
 
+TEST_P(GTestThinBootstrapping, reportsEveryStageOfThinBootstrapping)
+{
+  NTL::ZZX GG;
+  GG = context.getAlMod().getFactorsOverZZ()[0];
+  std::shared_ptr<helib::EncryptedArray> ea(
+      std::make_shared<helib::EncryptedArray>(context, GG));
+
+  NTL::zz_p::init(p2r);
+  std::vector<NTL::ZZX> values(nslots);
+  for (auto& value : values)
+    value = NTL::conv<NTL::ZZX>(NTL::conv<NTL::ZZ>(rep(NTL::random_zz_p())));
+  helib::Ctxt ctxt(publicKey);
+  ea->encrypt(ctxt, publicKey, values);
+
+  helib::BootstrapReport report;
+  publicKey.thinReCrypt(ctxt, false, false, &report);
+  std::vector<NTL::ZZX> decrypted;
+  ea->decrypt(ctxt, secretKey, decrypted);
+  EXPECT_EQ(decrypted, values);
+
+  EXPECT_EQ(report.digits, context.getRcData().e - context.getRcData().ePrime);
+  ASSERT_EQ(report.stages.size(), 4u);
+  EXPECT_EQ(report.stages[0].name, "slotToCoeff");
+  EXPECT_EQ(report.stages[3].name, "digitExtraction");
+  EXPECT_EQ(report.finalCapacity(), ctxt.bitCapacity());
+  // The boot key switch starts from the fresh bootstrapping key, the other
+  // stages use up capacity
+  EXPECT_LT(report.stages[1].capacityConsumed(), 0);
+  EXPECT_GT(report.stages[3].capacityConsumed(), 0);
+  EXPECT_GT(report.stages[0].ops[helib::OpType::Automorphism] +
+                report.stages[2].ops[helib::OpType::Automorphism],
+            0);
+  EXPECT_GE(report.stages[1].ops[helib::OpType::KeySwitch], 1);
+  EXPECT_GT(report.stages[3].ops[helib::OpType::Relinearization], 0);
+  EXPECT_GT(report.peakMemoryKB, 0);
+
+  std::stringstream str;
+  report.writeToJSON(str);
+  std::string json = str.str();
+  for (const char* key : {"\"BootstrapReport\"",
+                          "\"stages\"",
+                          "\"wallSeconds\"",
+                          "\"cpuSeconds\"",
+                          "\"capacityConsumed\"",
+                          "\"operations\"",
+                          "\"keySwitches\"",
+                          "\"automorphisms\"",
+                          "\"peakMemoryKB\""})
+    EXPECT_NE(json.find(key), std::string::npos) << key;
+}
+
+TEST_P(GTestThinBootstrapping, recordsTheOperationsOfThinBootstrapping)
+{
+  helib::Ctxt ctxt(publicKey);
+  publicKey.Encrypt(ctxt, NTL::ZZX(1), p2r);
+
+  bool saved = helib::fhe_stats;
+  helib::fhe_stats = true;
+  const helib::fhe_stats_record* before =
+      helib::fetch_stats_record("thinReCrypt-relinearizations");
+  long countBefore = before ? before->getCount() : 0;
+  publicKey.thinReCrypt(ctxt);
+  helib::fhe_stats = saved;
+
+  for (std::size_t i = 0; i < helib::OP_TYPES; i++) {
+    std::string name =
+        std::string("thinReCrypt-") + helib::opName(helib::OpType(i));
+    EXPECT_NE(helib::fetch_stats_record(name.c_str()), nullptr) << name;
+  }
+  const helib::fhe_stats_record* record =
+      helib::fetch_stats_record("thinReCrypt-relinearizations");
+  ASSERT_NE(record, nullptr);
+  EXPECT_EQ(record->getCount(), countBefore + 1);
+  EXPECT_GT(record->getMax(), 0);
+}
+
+TEST_P(GTestThinBootstrapping, bootstrapsToFewerDigits)
+{
+  NTL::ZZX GG;
+  GG = context.getAlMod().getFactorsOverZZ()[0];
+  std::shared_ptr<helib::EncryptedArray> ea(
+      std::make_shared<helib::EncryptedArray>(context, GG));
+
+  helib::Ctxt empty(publicKey);
+  EXPECT_THROW(publicKey.thinReCryptTo(empty, 0), helib::InvalidArgument);
+  EXPECT_THROW(publicKey.thinReCryptTo(empty, r + 1), helib::InvalidArgument);
+
+  for (long targetR = 1; targetR <= r; targetR++) {
+    NTL::zz_p::init(p2r);
+    std::vector<NTL::ZZX> values(nslots);
+    for (auto& value : values)
+      value = NTL::conv<NTL::ZZX>(NTL::conv<NTL::ZZ>(rep(NTL::random_zz_p())));
+    helib::Ctxt ctxt(publicKey);
+    ea->encrypt(ctxt, publicKey, values);
+
+    publicKey.thinReCryptTo(ctxt, targetR, /*our_version=*/true);
+    long p2targetR = NTL::power_long(p, targetR);
+    EXPECT_EQ(ctxt.getPtxtSpace(), p2targetR);
+
+    std::vector<NTL::ZZX> decrypted;
+    ea->decrypt(ctxt, secretKey, decrypted);
+    ASSERT_EQ(decrypted.size(), values.size());
+    // The values are constants, the result keeps their low targetR digits
+    for (long i = 0; i < nslots; i++)
+      EXPECT_EQ(decrypted[i],
+                NTL::conv<NTL::ZZX>(NTL::ConstTerm(values[i]) % p2targetR))
+          << i;
+  }
+}
+
+TEST_P(GTestThinBootstrapping, estimatesEveryStageOfThinBootstrapping)
+{
+  helib::OperationCosts costs = helib::measureOperationCosts(publicKey, 2);
+  EXPECT_GT(costs.ntt, 0);
+  EXPECT_GT(costs.automorphism, 0);
+  EXPECT_GT(costs.scalarMult, 0);
+
+  helib::BootstrapReport estimate =
+      helib::estimateThinReCrypt(context, costs, false, false);
+  EXPECT_EQ(estimate.digits,
+            context.getRcData().e - context.getRcData().ePrime);
+  ASSERT_EQ(estimate.stages.size(), 4u);
+  EXPECT_EQ(estimate.stages[0].name, "slotToCoeff");
+  EXPECT_EQ(estimate.stages[1].name, "bootKeySwitch");
+  EXPECT_EQ(estimate.stages[2].name, "coeffToSlot");
+  EXPECT_EQ(estimate.stages[3].name, "digitExtraction");
+  // The same signs as in the report of a real bootstrapping
+  EXPECT_LT(estimate.stages[1].capacityConsumed(), 0);
+  EXPECT_GT(estimate.stages[3].capacityConsumed(), 0);
+  EXPECT_GT(estimate.stages[0].ops[helib::OpType::Automorphism] +
+                estimate.stages[2].ops[helib::OpType::Automorphism],
+            0);
+  EXPECT_GT(estimate.stages[3].ops[helib::OpType::Relinearization], 0);
+  EXPECT_GT(estimate.wallSeconds, 0);
+
+  // The times are linear in the costs, the counts do not depend on them
+  helib::OperationCosts doubled{2 * costs.ntt,
+                                2 * costs.keySwitch,
+                                2 * costs.automorphism,
+                                2 * costs.scalarMult};
+  helib::BootstrapReport slower =
+      helib::estimateThinReCrypt(context, doubled, false, false);
+  EXPECT_NEAR(slower.wallSeconds, 2 * estimate.wallSeconds,
+              1e-9 * estimate.wallSeconds);
+  for (std::size_t i = 0; i < estimate.stages.size(); i++)
+    EXPECT_EQ(slower.stages[i].ops, estimate.stages[i].ops);
+}
+
+TEST_P(GTestThinBootstrapping, correctlyPerformsBatchThinBootstrapping)
+{
+  NTL::ZZX GG;
+  GG = context.getAlMod().getFactorsOverZZ()[0];
+  std::shared_ptr<helib::EncryptedArray> ea(
+      std::make_shared<helib::EncryptedArray>(context, GG));
+
+  helib::setupDebugGlobals(&secretKey, ea);
+
+  NTL::zz_p::init(p2r);
+  std::vector<std::vector<NTL::ZZX>> values(3);
+  std::vector<helib::Ctxt> ctxts(values.size(), helib::Ctxt(publicKey));
+  for (std::size_t j = 0; j < values.size(); j++) {
+    values[j].resize(nslots);
+    for (long i = 0; i < nslots; i++)
+      values[j][i] = NTL::conv<NTL::ZZX>(NTL::conv<NTL::ZZ>(rep(NTL::random_zz_p())));
+    ea->encrypt(ctxts[j], publicKey, values[j]);
+  }
+
+  publicKey.thinReCrypt(ctxts);
+
+  for (std::size_t j = 0; j < values.size(); j++) {
+    std::vector<NTL::ZZX> decrypted;
+    ea->decrypt(ctxts[j], secretKey, decrypted);
+    EXPECT_EQ(decrypted, values[j]) << "ciphertext " << j;
+  }
+
+  // Same through the pipeline, with fewer slots than ciphertexts
+  for (std::size_t j = 0; j < values.size(); j++)
+    ea->encrypt(ctxts[j], publicKey, values[j]);
+  helib::CtPtrs_vectorCt ptrs(ctxts);
+  publicKey.thinReCryptPipelined(ptrs, /*maxInFlight=*/2);
+
+  for (std::size_t j = 0; j < values.size(); j++) {
+    std::vector<NTL::ZZX> decrypted;
+    ea->decrypt(ctxts[j], secretKey, decrypted);
+    EXPECT_EQ(decrypted, values[j]) << "pipelined ciphertext " << j;
+  }
+}
+
+TEST_P(GTestThinBootstrapping, coordinatorShardsBootstrappingOverWorkers)
+{
+  const helib::EncryptedArray& ea = context.getEA();
+  const long numWorkers = 2;
+  std::vector<BlockingPipe> toWorkers(numWorkers), fromWorkers(numWorkers);
+  std::vector<std::unique_ptr<std::istream>> ins;
+  std::vector<std::unique_ptr<std::ostream>> outs;
+  std::vector<helib::BootChannel> channels;
+  std::vector<std::thread> workers;
+  std::vector<long> served(numWorkers, 0);
+  for (long w = 0; w < numWorkers; w++) {
+    ins.push_back(std::make_unique<std::istream>(&fromWorkers[w]));
+    outs.push_back(std::make_unique<std::ostream>(&toWorkers[w]));
+    channels.push_back({ins.back().get(), outs.back().get()});
+    workers.emplace_back([&, w]() {
+      std::istream in(&toWorkers[w]);
+      std::ostream out(&fromWorkers[w]);
+      served[w] = helib::serveBootstrapWorker(in, out);
+    });
+  }
+
+  NTL::zz_p::init(p2r);
+  std::vector<std::vector<long>> values(5);
+  std::vector<helib::Ctxt> ctxts(values.size(), helib::Ctxt(publicKey));
+  for (std::size_t j = 0; j < values.size(); j++) {
+    values[j].resize(nslots);
+    for (long& v : values[j])
+      v = rep(NTL::random_zz_p());
+    ea.encrypt(ctxts[j], publicKey, values[j]);
+  }
+
+  {
+    helib::BootstrapCoordinator coordinator(publicKey,
+                                            channels,
+                                            /*thin=*/true,
+                                            /*shardSize=*/2);
+    coordinator.bootstrap(ctxts);
+  }
+  for (std::thread& worker : workers)
+    worker.join();
+
+  EXPECT_EQ(served[0] + served[1], long(values.size()));
+  EXPECT_GT(served[0], 0);
+  EXPECT_GT(served[1], 0);
+  for (std::size_t j = 0; j < values.size(); j++) {
+    std::vector<long> decrypted;
+    ea.decrypt(ctxts[j], secretKey, decrypted);
+    EXPECT_EQ(decrypted, values[j]) << "ciphertext " << j;
+  }
+}
+
+TEST_P(GTestThinBootstrapping, packsSparseCiphertextsBeforeBootstrapping)
+{
+  const helib::EncryptedArray& ea = context.getEA();
+  helib::setupDebugGlobals(&secretKey, context.shareEA());
+  if (nslots < 3)
+    GTEST_SKIP() << "Too few slots to pack";
+
+  std::vector<std::vector<long>> occupancy = {{0, 1}, {0}, {nslots - 1}};
+  helib::SlotPackingPlan plan = helib::planSlotPacking(ea, occupancy);
+  EXPECT_LT(plan.packed.size(), occupancy.size());
+
+  NTL::zz_p::init(p2r);
+  std::vector<std::vector<long>> values(occupancy.size());
+  std::vector<helib::Ctxt> ctxts(values.size(), helib::Ctxt(publicKey));
+  for (std::size_t j = 0; j < values.size(); j++) {
+    values[j].assign(nslots, 0);
+    for (long i : occupancy[j])
+      values[j][i] = rep(NTL::random_zz_p());
+    ea.encrypt(ctxts[j], publicKey, values[j]);
+  }
+
+  helib::CtPtrs_vectorCt ptrs(ctxts);
+  helib::thinReCryptPacked(publicKey, ptrs, occupancy);
+
+  for (std::size_t j = 0; j < values.size(); j++) {
+    std::vector<long> decrypted;
+    ea.decrypt(ctxts[j], secretKey, decrypted);
+    EXPECT_EQ(decrypted, values[j]) << "ciphertext " << j;
+  }
+}
+
+TEST_P(GTestThinBootstrapping, refreshPolicyBootstrapsBeforeTheCapacityRunsOut)
+{
+  const helib::EncryptedArray& ea = context.getEA();
+  auto policy = std::make_shared<helib::RefreshPolicy>(publicKey);
+  EXPECT_GT(policy->outputCapacity(), policy->inputCapacity());
+  context.setRefreshPolicy(policy);
+
+  NTL::zz_p::init(p2r);
+  std::vector<long> values(nslots);
+  for (long& v : values)
+    v = rep(NTL::random_zz_p());
+  helib::Ctxt ctxt(publicKey);
+  ea.encrypt(ctxt, publicKey, values);
+
+  // Enough squares to need a few bootstrappings
+  long refreshes = 0;
+  for (long i = 0; i < 20 && refreshes < 2; i++) {
+    double before = ctxt.capacity();
+    ctxt.square();
+    if (ctxt.capacity() > before)
+      refreshes++;
+    for (long& v : values)
+      v = NTL::MulMod(v, v, p2r);
+
+    std::vector<long> decrypted;
+    ea.decrypt(ctxt, secretKey, decrypted);
+    ASSERT_EQ(decrypted, values) << "square " << i;
+  }
+  EXPECT_GT(refreshes, 0);
+
+  // No bootstrapping while the policy is suspended
+  helib::RefreshPolicy::Suspend suspend;
+  EXPECT_TRUE(helib::RefreshPolicy::suspended());
+  helib::Ctxt copy(ctxt);
+  while (!policy->needsRefresh(copy))
+    copy.square();
+  double before = copy.capacity();
+  copy.square();
+  EXPECT_LT(copy.capacity(), before);
+  context.setRefreshPolicy(nullptr);
+}
+
+TEST_P(GTestThinBootstrapping, lazyRecryptDataIsBuiltOnFirstUse)
+{
+  helib::Context lazyContext = helib::ContextBuilder<helib::BGV>()
+                                   .m(m)
+                                   .p(p)
+                                   .r(r)
+                                   .gens(gens)
+                                   .ords(ords)
+                                   .bits(L)
+                                   .c(c)
+                                   .skHwt(skHwt)
+                                   .bootstrappable()
+                                   .mvec(mvec)
+                                   .buildCache(useCache)
+                                   .thinboot()
+                                   .lazyRecryptData()
+                                   .build();
+  const helib::ThinRecryptData& rcData = lazyContext.getRcData();
+  ASSERT_TRUE(lazyContext.isBootstrappable());
+  EXPECT_TRUE(rcData.lazy);
+
+  // The components are there, but none is built yet
+  EXPECT_TRUE(rcData.slotToCoeff && rcData.coeffToSlot && rcData.p2dConv);
+  EXPECT_FALSE(rcData.firstMap || rcData.secondMap);
+  EXPECT_FALSE(rcData.slotToCoeff.isBuilt());
+  EXPECT_FALSE(rcData.coeffToSlot.isBuilt());
+  EXPECT_FALSE(rcData.p2dConv.isBuilt());
+
+  // Concurrent first uses build the map once
+  std::vector<const helib::ThinEvalMap*> maps(4, nullptr);
+  helib::parallelForEach(4,
+                         [&](long i) { maps[i] = rcData.slotToCoeff.get(); });
+  ASSERT_NE(maps[0], nullptr);
+  for (const helib::ThinEvalMap* map : maps)
+    EXPECT_EQ(map, maps[0]);
+  EXPECT_TRUE(rcData.slotToCoeff.isBuilt());
+  EXPECT_FALSE(rcData.coeffToSlot.isBuilt());
+
+  // It is the map the context built at once
+  std::map<long, std::set<long>> lazyAutos, eagerAutos;
+  rcData.slotToCoeff->automorphisms(lazyAutos);
+  context.getRcData().slotToCoeff->automorphisms(eagerAutos);
+  EXPECT_EQ(lazyAutos, eagerAutos);
+}
+
 INSTANTIATE_TEST_SUITE_P(typicalParameters,
                          GTestThinBootstrapping,
                          ::testing::Values(
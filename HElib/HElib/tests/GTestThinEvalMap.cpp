@@ -12,8 +12,11 @@
 
 /* Test_ThinEvalMap.cpp - Testing the evaluation map for thin bootstrapping
  */
+#include <sstream>
+
 #include <helib/helib.h>
 #include <helib/EvalMap.h>
+#include <helib/matmul.h>
 #include <NTL/BasicThreadPool.h>
 #include <helib/debugging.h>
 
@@ -325,6 +328,231 @@ TEST_P(GTestThinEvalMap, thinEvalMapIsCorrect)
   HELIB_NTIMER_STOP(ALL);
 }
 
+TEST_P(GTestThinEvalMap, doubleHoistedThinEvalMapIsCorrect)
+{
+  NTL::ZZX GG;
+  GG = context.getAlMod().getFactorsOverZZ()[0];
+  helib::EncryptedArray ea(context, GG);
+
+  NTL::zz_p::init(context.getAlMod().getPPowR());
+
+  const long p2r = context.getAlMod().getPPowR();
+  std::vector<NTL::ZZX> val1(nslots);
+  for (long i = 0; i < nslots; i++)
+    val1[i] = NTL::conv<NTL::ZZX>(NTL::RandomBnd(p2r));
+
+  // The dimensions here are too small for double-hoisted BSGS to pay off, so
+  // also force BSGS to have baby steps in the extended domain
+  const int old_fhe_test_force_bsgs = helib::fhe_test_force_bsgs;
+  for (int force_bsgs : {0, 1}) {
+    helib::fhe_test_force_bsgs = force_bsgs;
+    helib::ThinEvalMap forced(ea,
+                              /*minimal=*/false,
+                              mvec,
+                              /*invert=*/false,
+                              /*build_cache=*/useCache,
+                              /*doubleHoist=*/true);
+    helib::ThinEvalMap iforced(ea,
+                               /*minimal=*/false,
+                               mvec,
+                               /*invert=*/true,
+                               /*build_cache=*/useCache,
+                               /*doubleHoist=*/true);
+    helib::Ctxt ctxt(publicKey);
+    ea.encrypt(ctxt, publicKey, val1);
+    forced.apply(ctxt);
+    iforced.apply(ctxt);
+
+    std::vector<NTL::ZZX> val2;
+    ea.decrypt(ctxt, secretKey, val2);
+    EXPECT_EQ(val1, val2) << "force_bsgs=" << force_bsgs;
+  }
+  helib::fhe_test_force_bsgs = old_fhe_test_force_bsgs;
+}
+
+TEST_P(GTestThinEvalMap, sparseThinEvalMapKeepsTheUsedSlots)
+{
+  NTL::ZZX GG;
+  GG = context.getAlMod().getFactorsOverZZ()[0];
+  helib::EncryptedArray ea(context, GG);
+
+  // The slots with coordinate 0 in the first dimension
+  const long usedSlots = nslots / ea.sizeOfDimension(0);
+  const long p2r = context.getAlMod().getPPowR();
+  std::vector<NTL::ZZX> val1(nslots);
+  for (long i = 0; i < usedSlots; i++)
+    val1[i] = NTL::conv<NTL::ZZX>(NTL::RandomBnd(p2r));
+
+  helib::ThinEvalMap map(ea,
+                         /*minimal=*/false,
+                         mvec,
+                         /*invert=*/false,
+                         /*build_cache=*/useCache,
+                         /*doubleHoist=*/false,
+                         /*sparseDims=*/1);
+  helib::ThinEvalMap imap(ea,
+                          /*minimal=*/false,
+                          mvec,
+                          /*invert=*/true,
+                          /*build_cache=*/useCache,
+                          /*doubleHoist=*/false,
+                          /*sparseDims=*/1);
+  EXPECT_EQ(map.getSparseDims(), 1);
+
+  // The unused slots are ignored
+  std::vector<NTL::ZZX> dirty = val1;
+  for (long i = usedSlots; i < nslots; i++)
+    dirty[i] = NTL::conv<NTL::ZZX>(NTL::RandomBnd(p2r));
+  helib::Ctxt ctxt(publicKey);
+  ea.encrypt(ctxt, publicKey, dirty);
+  map.apply(ctxt);
+  imap.apply(ctxt);
+
+  std::vector<NTL::ZZX> val2;
+  ea.decrypt(ctxt, secretKey, val2);
+  for (long i = 0; i < nslots; i++)
+    EXPECT_EQ(val2[i], val1[i % usedSlots]) << "slot " << i;
+
+  // The sparse steps survive a round trip through the binary format
+  std::stringstream str;
+  imap.writeTo(str);
+  helib::ThinEvalMap imap2(ea, str);
+  EXPECT_EQ(imap2.getSparseDims(), 1);
+}
+
+TEST_P(GTestThinEvalMap, cacheBudgetBoundsTheUpgradedConstants)
+{
+  NTL::ZZX GG;
+  GG = context.getAlMod().getFactorsOverZZ()[0];
+  helib::EncryptedArray ea(context, GG);
+
+  const long p2r = context.getAlMod().getPPowR();
+  std::vector<NTL::ZZX> val1(nslots);
+  for (long i = 0; i < nslots; i++)
+    val1[i] = NTL::conv<NTL::ZZX>(NTL::RandomBnd(p2r));
+
+  helib::ThinEvalMap map(ea,
+                         /*minimal=*/false,
+                         mvec,
+                         /*invert=*/false,
+                         /*build_cache=*/false);
+  helib::ThinEvalMap imap(ea,
+                          /*minimal=*/false,
+                          mvec,
+                          /*invert=*/true,
+                          /*build_cache=*/false);
+  const long compact = map.cacheBytes();
+  EXPECT_GT(compact, 0);
+
+  // Nothing fits in an empty budget
+  long budget = 0;
+  map.upgradeWithin(budget);
+  EXPECT_EQ(map.cacheBytes(), compact);
+
+  // Some of the constants fit in half of what all of them take
+  helib::ThinEvalMap full(ea,
+                          /*minimal=*/false,
+                          mvec,
+                          /*invert=*/false,
+                          /*build_cache=*/true);
+  const long extra = full.cacheBytes() - compact;
+  EXPECT_GT(extra, 0);
+  budget = extra / 2;
+  map.upgradeWithin(budget);
+  EXPECT_GT(map.cacheBytes(), compact);
+  EXPECT_EQ(map.cacheBytes(), compact + extra / 2 - budget);
+  EXPECT_LT(map.cacheBytes(), full.cacheBytes());
+
+  // A negative budget upgrades the others
+  budget = -1;
+  imap.upgradeWithin(budget);
+  EXPECT_EQ(budget, -1);
+
+  // The mixed formats compute the same map
+  helib::Ctxt ctxt(publicKey);
+  ea.encrypt(ctxt, publicKey, val1);
+  map.apply(ctxt);
+  imap.apply(ctxt);
+  std::vector<NTL::ZZX> val2;
+  ea.decrypt(ctxt, secretKey, val2);
+  EXPECT_EQ(val1, val2);
+}
+
+TEST_P(GTestThinEvalMap, lazyConstantsAreEncodedAtTheirPrimeSets)
+{
+  NTL::ZZX GG;
+  GG = context.getAlMod().getFactorsOverZZ()[0];
+  helib::EncryptedArray ea(context, GG);
+
+  const long p2r = context.getAlMod().getPPowR();
+  std::vector<NTL::ZZX> val1(nslots);
+  for (long i = 0; i < nslots; i++)
+    val1[i] = NTL::conv<NTL::ZZX>(NTL::RandomBnd(p2r));
+
+  helib::ThinEvalMap map(ea,
+                         /*minimal=*/false,
+                         mvec,
+                         /*invert=*/false,
+                         /*build_cache=*/false);
+  helib::ThinEvalMap full(ea,
+                          /*minimal=*/false,
+                          mvec,
+                          /*invert=*/false,
+                          /*build_cache=*/true);
+  helib::ThinEvalMap imap(ea,
+                          /*minimal=*/false,
+                          mvec,
+                          /*invert=*/true,
+                          /*build_cache=*/true);
+  const long compact = map.cacheBytes();
+
+  // Nothing is encoded before the first use
+  long budget = -1;
+  map.upgradeWithin(budget, /*lazily=*/true);
+  EXPECT_EQ(map.cacheBytes(), compact);
+
+  // The ciphertext primes are fewer than all the primes, which include the
+  // special ones
+  helib::Ctxt ctxt(publicKey);
+  ea.encrypt(ctxt, publicKey, val1);
+  helib::Ctxt again(ctxt);
+  map.apply(ctxt);
+  const long used = map.cacheBytes();
+  EXPECT_GT(used, compact);
+  EXPECT_LT(used, full.cacheBytes());
+
+  // The same prime sets need no new encodings
+  map.apply(again);
+  EXPECT_EQ(map.cacheBytes(), used);
+
+  imap.apply(ctxt);
+  std::vector<NTL::ZZX> val2;
+  ea.decrypt(ctxt, secretKey, val2);
+  EXPECT_EQ(val1, val2);
+
+  // The lazy constants survive a round trip through the binary format
+  std::stringstream str;
+  map.writeTo(str);
+  helib::ThinEvalMap map2(ea, str);
+  EXPECT_EQ(map2.cacheBytes(), compact);
+}
+
+TEST(TestDoubleHoistGiantStepSize, balancesBabyAndGiantSteps)
+{
+  // A single giant step is plain hoisting, iff BSGS does not pay off
+  EXPECT_EQ(helib::DoubleHoistGiantStepSize(1), 1);
+  EXPECT_EQ(helib::DoubleHoistGiantStepSize(4), 4);
+  // 12 baby steps and 3 giant steps: 12 + 4 * 3 < 49 baby steps
+  EXPECT_EQ(helib::DoubleHoistGiantStepSize(50), 13);
+  for (long D = 1; D <= 100; D++) {
+    long g = helib::DoubleHoistGiantStepSize(D);
+    EXPECT_GE(g, 1);
+    EXPECT_LE(g, D);
+    // Never more giant than baby steps
+    EXPECT_LE(helib::divc(D, g), g);
+  }
+}
+
 // clang-format off
 INSTANTIATE_TEST_SUITE_P(variousParameters, GTestThinEvalMap, ::testing::Values(
     //SLOW
@@ -528,6 +528,45 @@ TEST_P(GTestThinboot, correctlyPerformsThinboot)
   }
 }
 
+TEST_P(GTestThinboot, bootstrapsWithOnlyThePlannedMatrices)
+{
+  context.buildModChain(bits,
+                        c,
+                        /*willBeBootstrappable=*/true,
+                        /*skHwt=*/skHwt,
+                        /*resolution=*/3,
+                        /*bitsInSpecialPrimes=*/helib_test::special_bits);
+  context.enableBootStrapping(mvec, useCache, /*alsoThick=*/false);
+
+  helib::SecKey fullKey(context);
+  fullKey.GenSecKey();
+  helib::addSome1DMatrices(fullKey);
+  helib::addFrbMatrices(fullKey);
+
+  helib::SecKey secretKey(context);
+  secretKey.GenSecKey();
+  std::size_t relinMatrices = secretKey.keySWlist().size();
+  helib::addBootstrappingMatrices(secretKey);
+  EXPECT_LE(secretKey.keySWlist().size(), fullKey.keySWlist().size());
+  EXPECT_GT(secretKey.keySWlist().size(), relinMatrices);
+  secretKey.genRecryptData();
+  const helib::PubKey publicKey = secretKey;
+
+  const helib::EncryptedArray& ea = context.getEA();
+  long p2r = context.getAlMod().getPPowR();
+  std::vector<NTL::ZZX> val1(ea.size());
+  for (auto& x : val1)
+    x = NTL::conv<NTL::ZZX>(NTL::RandomBnd(p2r));
+
+  helib::Ctxt c1(publicKey);
+  ea.encrypt(c1, publicKey, val1);
+  publicKey.thinReCrypt(c1);
+
+  std::vector<NTL::ZZX> val2;
+  ea.decrypt(c1, secretKey, val2);
+  EXPECT_EQ(val1, val2);
+}
+
 // LEGACY TEST DEFAULT PARAMETERS:
 // long p=2;
 // long r=1;
@@ -10,7 +10,9 @@
  * limitations under the License. See accompanying LICENSE file.
  */
 #include <cmath> // isinf
+#include <cstdio>
 #include <cstring>
+#include <fstream>
 #include <sstream>
 #include <helib/helib.h>
 #include <helib/debugging.h>
@@ -198,6 +200,75 @@ TEST(TestBinIO, headerSerializationDeserialization)
   EXPECT_TRUE(!memcmp(&header, &DeserialisedHeader, sizeof(header)));
 }
 
+TEST(TestBinIO, rawLongsUseTheFormatOfNTLVectors)
+{
+  NTL::vec_long vl;
+  vl.SetLength(5);
+  for (long i = 0; i < vl.length(); i++)
+    vl[i] = (i - 2) * 1000000007L;
+
+  std::stringstream expected;
+  helib::write_ntl_vec_long(expected, vl);
+  std::stringstream ss;
+  helib::write_raw_longs(ss, vl.elts(), vl.length());
+  EXPECT_EQ(ss.str(), expected.str());
+
+  std::vector<long> back(5);
+  helib::read_raw_longs(ss, back.data(), 5);
+  for (long i = 0; i < vl.length(); i++)
+    EXPECT_EQ(back[i], vl[i]);
+
+  // 32-bit vectors are read too, but the length must match
+  std::stringstream ss32;
+  helib::write_ntl_vec_long(ss32, vl, helib::Binio::BIT32);
+  std::stringstream bad(ss32.str());
+  helib::read_raw_longs(ss32, back.data(), 5);
+  EXPECT_EQ(back[4], long(int(vl[4])));
+  EXPECT_THROW(helib::read_raw_longs(bad, back.data(), 4), helib::IOError);
+}
+
+TEST(TestBinIO, bulkWordsAreLittleEndianAndRoundTrip)
+{
+  std::stringstream one;
+  helib::write_raw_int(one, 0x0102030405060708L);
+  helib::write_raw_int32(one, -2);
+  EXPECT_EQ(one.str(),
+            std::string("\x08\x07\x06\x05\x04\x03\x02\x01\xfe\xff\xff\xff", 12));
+
+  // Longer than the buffer used to swap the bytes on big-endian machines
+  std::vector<long> longs(1500);
+  std::vector<double> doubles(1500);
+  for (long i = 0; i < 1500; i++) {
+    longs[i] = (i - 750) * 1000000007L;
+    doubles[i] = (i - 750) / 7.0;
+  }
+  NTL::vec_long vl;
+  vl.SetLength(1500);
+  for (long i = 0; i < 1500; i++)
+    vl[i] = longs[i];
+
+  std::stringstream ss;
+  helib::write_raw_vector(ss, longs);
+  helib::write_raw_vector(ss, doubles);
+  helib::write_ntl_vec_long(ss, vl, helib::Binio::BIT32);
+  helib::write_raw_words(ss, longs.data(), 1500);
+
+  std::vector<long> longsBack;
+  std::vector<double> doublesBack;
+  NTL::vec_long vlBack;
+  std::vector<long> words(1500);
+  helib::read_raw_vector(ss, longsBack);
+  helib::read_raw_vector(ss, doublesBack);
+  helib::read_ntl_vec_long(ss, vlBack);
+  helib::read_raw_words(ss, words.data(), 1500);
+  EXPECT_EQ(longsBack, longs);
+  EXPECT_EQ(doublesBack, doubles);
+  EXPECT_EQ(words, longs);
+  ASSERT_EQ(vlBack.length(), 1500);
+  for (long i = 0; i < 1500; i++)
+    EXPECT_EQ(vlBack[i], long(int(vl[i])));
+}
+
 TEST_P(TestBinIO_BGV, singleFunctionSerialization)
 {
   std::stringstream str;
@@ -291,6 +362,53 @@ TEST(TestBinIO_BGV, readContextFromDeserializeCorrectlyBootstrappable)
   EXPECT_TRUE(deserialized_context.isBootstrappable());
 }
 
+TEST(TestBinIO_BGV, bootstrapBundleRestoresTheRecryptionData)
+{
+  // clang-format off
+  helib::Context context = helib::ContextBuilder<helib::BGV>()
+      .m(1271)
+      .p(2)
+      .r(1)
+      .gens({1026, 249})
+      .ords({30, -2})
+      .bits(30)
+      .bootstrappable(true)
+      .buildCache(true)
+      .mvec(helib::convert<NTL::Vec<long>>(std::vector<long>({31, 41})))
+      .build();
+  // clang-format on
+
+  std::stringstream str, bundle;
+  context.writeTo(str);
+  context.writeBootstrapBundleTo(bundle);
+  const std::string bytes = bundle.str();
+
+  helib::Context deserialized_context = helib::Context::readFrom(str, bundle);
+  EXPECT_EQ(context, deserialized_context);
+  EXPECT_TRUE(deserialized_context.isBootstrappable());
+
+  // Everything that was computed is written back identically
+  std::stringstream rewritten;
+  deserialized_context.writeBootstrapBundleTo(rewritten);
+  EXPECT_EQ(rewritten.str(), bytes);
+
+  // A bundle is only accepted by a context with the same parameters
+  // clang-format off
+  helib::Context other = helib::ContextBuilder<helib::BGV>()
+      .m(1271)
+      .p(2)
+      .r(1)
+      .gens({1026, 249})
+      .ords({30, -2})
+      .bits(60)
+      .bootstrappable(true)
+      .mvec(helib::convert<NTL::Vec<long>>(std::vector<long>({31, 41})))
+      .build();
+  // clang-format on
+  std::stringstream wrong(bytes);
+  EXPECT_THROW(other.enableBootStrappingFrom(wrong), helib::IOError);
+}
+
 TEST_P(TestBinIO_BGV, canPerformOperationWithDeserializedContext)
 {
   std::stringstream ss;
@@ -629,6 +747,101 @@ TEST_P(TestBinIO_BGV, canPerformOperationsOnDeserializedCiphertext)
   EXPECT_EQ(ptxt1, ptxt2);
 }
 
+TEST_P(TestBinIO_BGV, seededCiphertextsAreWrittenInAboutHalfTheSpace)
+{
+  helib::PtxtArray ptxt(ea), decrypted(ea);
+  ptxt.random();
+  helib::Ctxt full(secretKey);
+  ptxt.encrypt(full);
+
+  helib::SecKey seededKey(secretKey);
+  seededKey.setSeededEncryption(true);
+  helib::Ctxt seeded(seededKey);
+  ptxt.encrypt(seeded);
+
+  std::stringstream fullStr, seededStr;
+  full.writeTo(fullStr);
+  seeded.writeTo(seededStr);
+  EXPECT_LT(seededStr.str().size(), fullStr.str().size() * 6 / 10);
+
+  helib::Ctxt read(seededKey);
+  read.read(seededStr);
+  EXPECT_EQ(read, seeded);
+  decrypted.decrypt(read, secretKey);
+  EXPECT_EQ(decrypted, ptxt);
+
+  // Once the seeded part changes, the ciphertext is written in full
+  read.multiplyBy(read);
+  std::stringstream productStr;
+  read.writeTo(productStr);
+  helib::Ctxt product = helib::Ctxt::readFrom(productStr, seededKey);
+  EXPECT_EQ(product, read);
+}
+
+TEST_P(TestBinIO_BGV, compactCiphertextsAreSmallerAndStillDecrypt)
+{
+  helib::PtxtArray ptxt(ea), expected(ea), decrypted(ea);
+  ptxt.random();
+  helib::Ctxt ctxt(publicKey);
+  ptxt.encrypt(ctxt);
+  ctxt.multiplyBy(ctxt);
+  expected = ptxt;
+  expected *= ptxt;
+
+  std::stringstream fullStr, compactStr;
+  ctxt.writeTo(fullStr);
+  ctxt.writeCompactTo(compactStr);
+  EXPECT_LT(compactStr.str().size(), fullStr.str().size());
+
+  helib::Ctxt read(publicKey);
+  read.read(compactStr);
+  EXPECT_TRUE(read.getPrimeSet() <= ctxt.getPrimeSet());
+  EXPECT_TRUE(read.isCorrect());
+  decrypted.decrypt(read, secretKey);
+  EXPECT_EQ(decrypted, expected);
+}
+
+TEST_P(TestBinIO_BGV, mappedPublicKeyKeySwitchesLikeTheOriginal)
+{
+  const std::string file = "TestBinIO_mapped.pk";
+  {
+    std::ofstream out(file, std::ios::binary);
+    publicKey.writeMappableTo(out);
+  }
+
+  {
+    helib::PubKey mapped = helib::PubKey::readMappedFrom(file, context);
+    EXPECT_EQ(publicKey, mapped);
+
+    helib::PtxtArray ptxt(ea), expected(ea), decrypted(ea);
+    ptxt.random();
+    helib::Ctxt ctxt(mapped);
+    ptxt.encrypt(ctxt);
+    ctxt.multiplyBy(ctxt);
+    ea.rotate(ctxt, 1);
+    expected = ptxt;
+    expected *= ptxt;
+    rotate(expected, 1);
+    decrypted.decrypt(ctxt, secretKey);
+    EXPECT_EQ(decrypted, expected);
+
+    // Writing to a copy of a mapped column leaves the file alone
+    helib::DoubleCRT column(mapped.keySWlist()[0].b[0]);
+    column += column;
+    EXPECT_NE(column, mapped.keySWlist()[0].b[0]);
+    EXPECT_EQ(publicKey, mapped);
+  }
+
+  {
+    std::fstream corrupt(file, std::ios::in | std::ios::out | std::ios::binary);
+    corrupt.seekp(0);
+    corrupt.write("????", 4);
+  }
+  EXPECT_THROW(helib::PubKey::readMappedFrom(file, context), helib::IOError);
+  std::remove(file.c_str());
+  EXPECT_THROW(helib::PubKey::readMappedFrom(file, context), helib::IOError);
+}
+
 TEST_P(TestBinIO_CKKS, singleFunctionSerialization)
 {
   std::stringstream str;
@@ -626,6 +626,32 @@ TEST(TestCKKS, buildingCKKSContextWithMAsNotAPowerOfTwoThrows)
       helib::InvalidArgument);
 }
 
+TEST_P(TestCKKS, batchEncodingsMatchTheSingleOnes)
+{
+  std::vector<std::vector<std::complex<double>>> arrays(3);
+  for (long i = 0; i < helib::lsize(arrays); i++)
+    for (long j = 0; j < ea.size(); j++)
+      arrays[i].emplace_back(0.01 * (i + j), -0.02 * j);
+
+  std::vector<helib::EncodedPtxt> encoded;
+  ea.encodeBatch(encoded, arrays);
+  ASSERT_EQ(encoded.size(), arrays.size());
+  std::vector<helib::zzX> polys;
+  for (std::size_t i = 0; i < arrays.size(); i++) {
+    helib::EncodedPtxt single;
+    ea.encode(single, arrays[i]);
+    EXPECT_EQ(encoded[i].getCKKS().getPoly(), single.getCKKS().getPoly());
+    polys.push_back(single.getCKKS().getPoly());
+  }
+
+  std::vector<std::vector<std::complex<double>>> decoded;
+  double scaling = encoded[0].getCKKS().getScale();
+  ea.decodeBatch(decoded, polys, scaling);
+  ASSERT_EQ(decoded.size(), arrays.size());
+  for (std::size_t i = 0; i < arrays.size(); i++)
+    EXPECT_TRUE(cx_equals(decoded[i], arrays[i], epsilon)) << "array " << i;
+}
+
 INSTANTIATE_TEST_SUITE_P(typicalParameters,
                          TestCKKS,
                          ::testing::Values(
@@ -9,8 +9,17 @@
  * See the License for the specific language governing permissions and
  * limitations under the License. See accompanying LICENSE file.
  */
+#include <algorithm>
 #include <cmath> // isinf
+#include <cstdio>
+#include <fstream>
+#include <set>
+#include <sstream>
 #include <helib/helib.h>
+#include <helib/autotune.h>
+#include <helib/keySwitching.h>
+#include <helib/primeChain.h>
+#include <helib/residueBackend.h>
 
 #include "test_common.h"
 #include "gtest/gtest.h"
@@ -188,6 +197,273 @@ TEST_P(TestContextBGV, ContextCalculatingSecurityAfterModchainBuilt)
   EXPECT_FALSE(std::isinf(result));
 }
 
+TEST_P(TestContextBGV, crtTablesAreCachedPerPrimeSet)
+{
+  context->buildModChain(/*bits=*/100, /*c=*/2);
+  const helib::IndexSet& ctxtPrimes = context->getCtxtPrimes();
+  helib::IndexSet copy(ctxtPrimes);
+  EXPECT_EQ(&context->getCRTTable(ctxtPrimes), &context->getCRTTable(copy));
+  EXPECT_NE(&context->getCRTTable(ctxtPrimes),
+            &context->getCRTTable(context->getSpecialPrimes()));
+
+  // The reconstruction from the cached constants gives the polynomial back,
+  // in the symmetric and in the positive interval
+  NTL::ZZ Q = context->productOfPrimes(ctxtPrimes);
+  NTL::ZZX poly;
+  for (long i = 0; i < long(context->getPhiM()); i++)
+    SetCoeff(poly, i, NTL::RandomBnd(Q) - Q / 2);
+  helib::DoubleCRT dcrt(poly, *context, ctxtPrimes);
+  for (int pass = 0; pass < 2; pass++) {
+    NTL::ZZX back;
+    dcrt.toPoly(back);
+    EXPECT_EQ(back, poly);
+  }
+  NTL::ZZX positive, expected = poly;
+  dcrt.toPoly(positive, /*positive=*/true);
+  for (long i = 0; i <= deg(expected); i++)
+    if (expected[i] < 0)
+      expected[i] += Q;
+  expected.normalize();
+  EXPECT_EQ(positive, expected);
+}
+
+TEST_P(TestContextBGV, automorphPermsAreCachedAndMatchThePolynomials)
+{
+  context->buildModChain(/*bits=*/100, /*c=*/2);
+  const helib::PAlgebra& zMStar = context->getZMStar();
+  long k = 3;
+
+  const std::vector<long>& perm = context->getAutomorphPerm(k);
+  EXPECT_EQ(&perm, &context->getAutomorphPerm(k + m));
+  std::vector<long> sorted(perm);
+  std::sort(sorted.begin(), sorted.end());
+  for (long j = 0; j < long(sorted.size()); j++)
+    EXPECT_EQ(sorted[j], j);
+  EXPECT_THROW(context->getAutomorphPerm(m), helib::InvalidArgument);
+
+  NTL::ZZX poly, image;
+  for (long i = 0; i < long(zMStar.getPhiM()); i++) {
+    SetCoeff(poly, i, i + 1);
+    SetCoeff(image, (i * k) % m, i + 1);
+  }
+  image %= zMStar.getPhimX();
+
+  helib::DoubleCRT dcrt(poly, *context, context->getCtxtPrimes());
+  dcrt.automorph(k);
+  EXPECT_EQ(dcrt, helib::DoubleCRT(image, *context, context->getCtxtPrimes()));
+}
+
+TEST_P(TestContextBGV, residueBackendMatchesTheBuiltInKernels)
+{
+  context->buildModChain(/*bits=*/100, /*c=*/2);
+  const helib::IndexSet& primes = context->getCtxtPrimes();
+  long phim = context->getPhiM();
+
+  NTL::ZZX f, g;
+  for (long i = 0; i < phim; i++) {
+    SetCoeff(f, i, 3 * i + 1);
+    SetCoeff(g, i, 7 - i);
+  }
+  auto run = [&]() {
+    helib::DoubleCRT a(f, *context, primes), b(g, *context, primes);
+    helib::DoubleCRT sum(a), prod(a), ip(*context, primes);
+    sum += b;
+    sum -= 5;
+    prod *= b;
+    prod *= 11;
+    ip.innerProduct(std::vector<helib::DoubleCRT>{a, b},
+                    std::vector<helib::DoubleCRT>{b, a});
+    sum.automorph(3);
+    return std::vector<helib::DoubleCRT>{sum, prod, ip};
+  };
+
+  std::vector<helib::DoubleCRT> expected = run();
+  context->setResidueBackend(std::make_shared<helib::HostResidueBackend>());
+  EXPECT_NE(context->getResidueBackend(), nullptr);
+  std::vector<helib::DoubleCRT> result = run();
+  context->setResidueBackend(nullptr);
+  for (std::size_t i = 0; i < expected.size(); i++)
+    EXPECT_EQ(result[i], expected[i]);
+}
+
+TEST_P(TestContextBGV, narrowPrimesUseTheThirtyTwoBitKernels)
+{
+  context->buildModChain(/*bits=*/100,
+                         /*c=*/2,
+                         /*willBeBootstrappable=*/false,
+                         /*skHwt=*/0,
+                         /*resolution=*/3,
+                         /*bitsInSpecialPrimes=*/0,
+                         /*polyfunction=*/false,
+                         /*primeBits=*/31);
+  for (long i = 0; i < context->numPrimes(); i++)
+    EXPECT_LT(context->ithPrime(i), 1L << 31);
+  EXPECT_GE(context->bitSizeOfQ(), 100);
+  ASSERT_NE(context->getResidueBackend(), nullptr);
+
+  const helib::IndexSet& primes = context->allPrimes();
+  long phim = context->getPhiM();
+  NTL::ZZX f, g;
+  for (long i = 0; i < phim; i++) {
+    SetCoeff(f, i, NTL::RandomBnd(1L << 40));
+    SetCoeff(g, i, -NTL::RandomBnd(1L << 40));
+  }
+  auto run = [&]() {
+    helib::DoubleCRT a(f, *context, primes), b(g, *context, primes);
+    helib::DoubleCRT sum(a), prod(a), ip(*context, primes);
+    sum += b;
+    sum -= 5;
+    prod *= b;
+    prod *= 11;
+    std::vector<helib::DoubleCRT> as(7, a), bs(7, b);
+    ip.innerProduct(as, bs);
+    return std::vector<helib::DoubleCRT>{sum, prod, ip};
+  };
+
+  std::vector<helib::DoubleCRT> result = run();
+  context->setResidueBackend(nullptr);
+  std::vector<helib::DoubleCRT> expected = run();
+  for (std::size_t i = 0; i < expected.size(); i++)
+    EXPECT_EQ(result[i], expected[i]);
+
+  EXPECT_THROW(context->buildModChain(100, 2, false, 0, 3, 0, false, 20),
+               helib::InvalidArgument);
+}
+
+TEST_P(TestContextBGV, keyedRandomRowsDependOnlyOnTheirPrime)
+{
+  context->buildModChain(/*bits=*/100, /*c=*/2);
+  long phim = context->getPhiM();
+
+  NTL::ZZ seed = helib::KeySwitchASampler::newSeed();
+  EXPECT_TRUE(helib::KeySwitchASampler::isKeyed(seed));
+  NTL::ZZ oldSeed;
+  NTL::RandomBits(oldSeed, 256);
+  EXPECT_FALSE(helib::KeySwitchASampler::isKeyed(oldSeed));
+
+  // NTL's PRG is untouched
+  NTL::SetSeed(NTL::ZZ(7));
+  unsigned long expectedWord = NTL::RandomWord();
+  NTL::SetSeed(NTL::ZZ(7));
+  helib::DoubleCRT all(*context, context->allPrimes());
+  all.randomizeKeyed(seed, 3);
+  EXPECT_EQ(NTL::RandomWord(), expectedWord);
+
+  helib::DoubleCRT some(*context, context->getCtxtPrimes());
+  some.randomizeKeyed(seed, 3);
+  helib::DoubleCRT other(*context, context->getCtxtPrimes());
+  other.randomizeKeyed(seed, 4);
+  for (long i : context->getCtxtPrimes()) {
+    long q = context->ithPrime(i);
+    long differences = 0;
+    for (long j = 0; j < phim; j++) {
+      EXPECT_EQ(some.getMap()[i][j], all.getMap()[i][j]);
+      EXPECT_GE(some.getMap()[i][j], 0);
+      EXPECT_LT(some.getMap()[i][j], q);
+      differences += other.getMap()[i][j] != some.getMap()[i][j];
+    }
+    EXPECT_GT(differences, phim / 2);
+  }
+
+  // Copies that share their rows are randomized each on its own, as the
+  // key-switching matrices are
+  helib::DoubleCRT zero(*context, context->getCtxtPrimes());
+  std::vector<helib::DoubleCRT> copies(3, zero);
+  for (long k = 0; k < 3; k++)
+    copies[k].randomizeKeyed(seed, 3 + k);
+  EXPECT_TRUE(copies[0] == some);
+  EXPECT_TRUE(copies[1] == other);
+  EXPECT_TRUE(copies[2] != some);
+  EXPECT_TRUE(zero == helib::DoubleCRT(*context, context->getCtxtPrimes()));
+}
+
+TEST_P(TestContextBGV, tuningProfilesRoundTripAndSetTheThresholds)
+{
+  context->buildModChain(/*bits=*/100, /*c=*/2);
+  EXPECT_EQ(context->getTuningProfile(), nullptr);
+  EXPECT_EQ(helib::tuningProfile(*context).bsgsThreshold,
+            HELIB_KEYSWITCH_THRESH);
+
+  helib::TuningProfile profile = helib::TuningProfile::defaults(*context);
+  EXPECT_TRUE(profile.matches(*context));
+  profile.bsgsThreshold = 7;
+  profile.chenHanThresholdP2 = 1.25;
+  profile.innerProductMinBlock = 64;
+
+  std::stringstream str;
+  profile.writeTo(str);
+  helib::TuningProfile read = helib::TuningProfile::readFrom(str);
+  EXPECT_TRUE(read.matches(*context));
+  EXPECT_EQ(read.bsgsThreshold, 7);
+  EXPECT_EQ(read.chenHanThresholdP2, 1.25);
+  EXPECT_EQ(read.innerProductMinBlock, 64);
+  read.m++;
+  EXPECT_FALSE(read.matches(*context));
+
+  std::stringstream bad("{\"host\": 1}");
+  EXPECT_THROW(helib::TuningProfile::readFrom(bad), helib::IOError);
+
+  // The block grain does not change the inner products
+  const helib::IndexSet& primes = context->getCtxtPrimes();
+  std::vector<helib::DoubleCRT> a(3, helib::DoubleCRT(*context, primes));
+  std::vector<helib::DoubleCRT> b(3, helib::DoubleCRT(*context, primes));
+  for (long t = 0; t < 3; t++) {
+    a[t].randomize();
+    b[t].randomize();
+  }
+  helib::DoubleCRT expected(*context, primes);
+  expected.innerProduct(a, b);
+  context->setTuningProfile(std::make_shared<helib::TuningProfile>(read));
+  EXPECT_EQ(helib::tuningProfile(*context).bsgsThreshold, 7);
+  helib::DoubleCRT actual(*context, primes);
+  actual.innerProduct(a, b);
+  EXPECT_EQ(actual, expected);
+
+  context->setTuningProfile(nullptr);
+  EXPECT_EQ(helib::tuningProfile(*context).innerProductMinBlock, 256);
+}
+
+TEST_P(TestContextBGV, primeChainsAreCachedAcrossContexts)
+{
+  auto chainOf = [](const helib::Context& context) {
+    std::vector<long> primes;
+    for (long i = 0; i < context.numPrimes(); i++)
+      primes.push_back(context.ithPrime(i));
+    return primes;
+  };
+  auto build = [&]() {
+    std::shared_ptr<helib::Context> other =
+        helib::ContextBuilder<helib::BGV>()
+            .m(m)
+            .p(p)
+            .r(r)
+            .buildModChain(false)
+            .buildPtr();
+    other->buildModChain(/*bits=*/100, /*c=*/2);
+    return chainOf(*other);
+  };
+  context->buildModChain(/*bits=*/100, /*c=*/2);
+  std::vector<long> primes = chainOf(*context);
+  EXPECT_EQ(build(), primes);
+
+  // Searched again and written to the directory, then read from it
+  helib::setPrimeCacheDirectory(".");
+  EXPECT_EQ(build(), primes);
+  helib::clearPrimeCache();
+  EXPECT_EQ(build(), primes);
+
+  std::set<long> sizes;
+  for (long q : primes)
+    sizes.insert(NTL::NumBits(q));
+  for (long len : sizes) {
+    std::string name =
+        "./primes_" + std::to_string(m) + "_" + std::to_string(len) + ".txt";
+    EXPECT_TRUE(std::ifstream(name).good()) << name;
+    std::remove(name.c_str());
+  }
+  helib::setPrimeCacheDirectory("");
+}
+
 TEST_P(TestContextBGV, hasCorrectSlotRingWhenConstructed)
 {
   EXPECT_EQ(context->getSlotRing()->p, p);
@@ -244,6 +520,74 @@ TEST(TestContextBGV, securityHasLowerBoundOfZero)
 #endif
 }
 
+TEST(TestContextBGV, primeFactorFFTMatchesBluestein)
+{
+  const long m = 105;
+  NTL::zz_pBak bak;
+  bak.save();
+  long q = 1 + m * (1L << 20);
+  while (!NTL::ProbPrime(q))
+    q += m * (1L << 20);
+  NTL::zz_p::UserFFTInit(q);
+
+  NTL::zz_p root;
+  helib::FindPrimitiveRoot(root, m);
+
+  // 3 takes the direct DFT, 35 BluesteinFFT
+  helib::PrimeFactorFFT pfa({3, 35}, root);
+  ASSERT_EQ(pfa.size(), m);
+
+  NTL::zz_pX x;
+  random(x, m - 7);
+  std::vector<long> y(m);
+  pfa.apply(y.data(), x);
+
+  NTL::zz_pX powers;
+  NTL::Vec<NTL::mulmod_precon_t> powers_aux;
+  NTL::fftRep Rb;
+  helib::BluesteinInit(m, root, powers, powers_aux, Rb);
+  helib::BluesteinFFT(x, m, root, powers, powers_aux, Rb);
+  for (long i = 0; i < m; i++)
+    EXPECT_EQ(y[i], rep(coeff(x, i))) << "i = " << i;
+}
+
+TEST(TestContextBGV, factoredFFTMatchesTheDefaultOne)
+{
+  auto build = []() {
+    return helib::ContextBuilder<helib::BGV>()
+        .m(105)
+        .p(2)
+        .r(1)
+        .bits(100)
+        .c(2)
+        .buildPtr();
+  };
+  std::shared_ptr<helib::Context> context = build();
+  std::shared_ptr<helib::Context> factored = build();
+  NTL::Vec<long> mvec;
+  mvec.SetLength(2);
+  mvec[0] = 3;
+  mvec[1] = 35;
+  factored->useFactoredFFT(mvec);
+
+  NTL::ZZX poly;
+  for (long i = 0; i < context->getPhiM(); i++)
+    SetCoeff(poly, i, NTL::RandomBnd(1000));
+
+  for (long i = 0; i < context->numPrimes(); i++) {
+    NTL::vec_long y, yFactored;
+    context->ithModulus(i).FFT(y, poly);
+    factored->ithModulus(i).FFT(yFactored, poly);
+    EXPECT_EQ(y, yFactored) << " index: " << i;
+
+    context->ithModulus(i).restoreModulus();
+    NTL::zz_pX x, xFactored;
+    context->ithModulus(i).iFFT(x, y);
+    factored->ithModulus(i).iFFT(xFactored, yFactored);
+    EXPECT_EQ(x, xFactored) << " index: " << i;
+  }
+}
+
 /* The following tests are for the ContextBuilder class */
 
 TEST(TestContextBGV, contextBuilderWithDefaultArguments)
@@ -305,6 +649,27 @@ TEST(TestContextBGV, contextBuilderDoesNotClipDigitsSize)
   EXPECT_EQ(context_built.getDigits().size(), c);
 }
 
+TEST(TestContextBGV, contextBuilderDerivesScaleFromFailureProbability)
+{
+  // The default scale of 10 is about 2^{-75.8} per coefficient
+  double scale = helib::Context::scaleForFailureProbability(
+      std::pow(2.0, -75.8), /*phim=*/1);
+  EXPECT_NEAR(scale, 10.0, 0.01);
+
+  helib::Context context_built = helib::ContextBuilder<helib::BGV>()
+                                     .m(257)
+                                     .bits(100)
+                                     .failureProbability(std::pow(2.0, -40))
+                                     .build();
+  long phim = context_built.getPhiM();
+  EXPECT_LT(context_built.getScale(), 10.0);
+  EXPECT_LE(phim * std::erfc(context_built.getScale() / std::sqrt(2.0)),
+            std::pow(2.0, -40));
+
+  EXPECT_THROW(helib::ContextBuilder<helib::BGV>().failureProbability(0.0),
+               helib::InvalidArgument);
+}
+
 TEST_P(TestContextBGV, contextBuilderWithBasicParams)
 {
   // clang-format off
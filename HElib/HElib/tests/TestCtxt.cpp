@@ -17,6 +17,14 @@
 
 #include <helib/helib.h>
 #include <helib/debugging.h>
+#include <helib/automorphPrecon.h>
+#include <helib/CtPtrs.h>
+#include <helib/CtxtExpr.h>
+#include <helib/encryptionPool.h>
+#include <helib/equalityLookup.h>
+#include <helib/sample.h>
+#include <helib/slotPacking.h>
+#include <helib/norms.h>
 
 #include "test_common.h"
 #include "gtest/gtest.h"
@@ -141,6 +149,970 @@ TEST_P(TestCtxt, timesEqualsWithEncodedPtxtWorks)
   EXPECT_EQ(decrypted_result, expected_result);
 }
 
+TEST_P(TestCtxt, addScaledCtxtMatchesMultiplyThenAdd)
+{
+  const long p2r = context.getAlMod().getPPowR();
+  std::vector<long> a(ea.size()), b(ea.size());
+  for (long i = 0; i < ea.size(); i++) {
+    a[i] = NTL::RandomBnd(p2r);
+    b[i] = NTL::RandomBnd(p2r);
+  }
+  helib::Ctxt ca(publicKey), cb(publicKey);
+  publicKey.Encrypt(ca, helib::Ptxt<helib::BGV>(context, a));
+  publicKey.Encrypt(cb, helib::Ptxt<helib::BGV>(context, b));
+  // Different integer factors on both sides
+  cb.multByConstant(NTL::to_ZZ(3));
+
+  for (long c : {1l, -1l, 2l, 7l, p2r - 2}) {
+    helib::Ctxt fused(ca), reference(ca);
+    fused.addScaledCtxt(cb, NTL::to_ZZ(c));
+    helib::Ctxt tmp(cb);
+    tmp.multByConstant(NTL::to_ZZ(c));
+    reference.addCtxt(tmp);
+
+    helib::Ptxt<helib::BGV> fusedResult(context), referenceResult(context);
+    secretKey.Decrypt(fusedResult, fused);
+    secretKey.Decrypt(referenceResult, reference);
+    EXPECT_EQ(fusedResult, referenceResult) << "c = " << c;
+  }
+}
+
+TEST_P(TestCtxt, scalarConstantsMatchTheirPolynomials)
+{
+  const long p2r = context.getAlMod().getPPowR();
+  std::vector<long> a(ea.size());
+  for (long i = 0; i < ea.size(); i++)
+    a[i] = NTL::RandomBnd(p2r);
+  helib::Ctxt ca(publicKey);
+  publicKey.Encrypt(ca, helib::Ptxt<helib::BGV>(context, a));
+  // A non-trivial integer factor, which the added constants must follow
+  ca.multByConstant(NTL::to_ZZ(3));
+
+  for (long c : {1l, -1l, 5l, p2r - 2, 3 * p2r + 4}) {
+    helib::Ctxt scalar(ca), poly(ca);
+    scalar.addConstant(NTL::to_ZZ(c));
+    poly.addConstant(NTL::ZZX(NTL::to_ZZ(c)));
+    scalar.multByConstant(NTL::to_ZZ(c));
+    poly.multByConstant(NTL::ZZX(NTL::to_ZZ(c)));
+    scalar.addConstant(NTL::to_ZZ(c), /*neg=*/true);
+    poly.addConstant(NTL::ZZX(NTL::to_ZZ(-c)));
+
+    helib::Ptxt<helib::BGV> scalarResult(context), polyResult(context);
+    secretKey.Decrypt(scalarResult, scalar);
+    secretKey.Decrypt(polyResult, poly);
+    EXPECT_EQ(scalarResult, polyResult) << "c = " << c;
+  }
+
+  // Adding to an empty ciphertext creates the part that points to one
+  helib::Ctxt empty(publicKey);
+  empty.addConstant(NTL::to_ZZ(7));
+  helib::Ptxt<helib::BGV> result(context);
+  secretKey.Decrypt(result, empty);
+  std::vector<long> sevens(ea.size(), 7 % p2r);
+  EXPECT_EQ(result, helib::Ptxt<helib::BGV>(context, sevens));
+}
+
+TEST_P(TestCtxt, innerProductOfCiphertextsRelinearizesOnce)
+{
+  const long p2r = context.getAlMod().getPPowR();
+  const long n = 5;
+  std::vector<helib::Ctxt> v1(n, helib::Ctxt(publicKey)),
+      v2(n, helib::Ctxt(publicKey));
+  std::vector<long> expected(ea.size(), 0);
+  for (long i = 0; i < n; i++) {
+    std::vector<long> a(ea.size()), b(ea.size());
+    for (long j = 0; j < ea.size(); j++) {
+      a[j] = NTL::RandomBnd(p2r);
+      b[j] = NTL::RandomBnd(p2r);
+      expected[j] = (expected[j] + NTL::MulMod(a[j], b[j], p2r)) % p2r;
+    }
+    publicKey.Encrypt(v1[i], helib::Ptxt<helib::BGV>(context, a));
+    publicKey.Encrypt(v2[i], helib::Ptxt<helib::BGV>(context, b));
+  }
+  // An operand at a lower level, the others are dropped to it
+  v2[3].dropSmallAndSpecialPrimes();
+
+  helib::Ctxt result(publicKey);
+  helib::OpCounts counts;
+  {
+    helib::OpCountScope scope;
+    helib::innerProduct(result, v1, v2);
+    counts = scope.counts();
+  }
+  EXPECT_EQ(counts[helib::OpType::TensorProduct], n);
+  EXPECT_EQ(counts[helib::OpType::Relinearization], 1);
+  EXPECT_FALSE(result.inExtendedForm());
+
+  helib::Ptxt<helib::BGV> decrypted(context);
+  secretKey.Decrypt(decrypted, result);
+  EXPECT_EQ(decrypted, helib::Ptxt<helib::BGV>(context, expected));
+}
+
+TEST_P(TestCtxt, innerProductWithAKeyMatchesItsSteps)
+{
+  const long p2r = context.getAlMod().getPPowR();
+  std::vector<long> k(ea.size());
+  for (long i = 0; i < ea.size(); i++)
+    k[i] = NTL::RandomBnd(p2r);
+  helib::Ctxt ekey(publicKey);
+  publicKey.Encrypt(ekey, helib::Ptxt<helib::BGV>(context, k));
+  // A non-trivial integer factor, which the scaling of b must follow
+  ekey.multByConstant(NTL::to_ZZ(3));
+  std::vector<helib::DoubleCRTPrecon> ekeyPrecon = ekey.partsPrecon();
+
+  helib::zzX a, b;
+  a.SetLength(context.getPhiM());
+  b.SetLength(context.getPhiM());
+  for (long j = 0; j < context.getPhiM(); j++) {
+    a[j] = NTL::RandomBnd(1001) - 500;
+    b[j] = NTL::RandomBnd(1001) - 500;
+  }
+
+  helib::Ctxt expected(ekey);
+  expected.multByConstant(a);
+  expected.addConstant(b);
+
+  helib::Ctxt result(publicKey), plain(publicKey);
+  result.setToInnerProduct(ekey, ekeyPrecon, a, b);
+  plain.setToInnerProduct(ekey, {}, a, b);
+  EXPECT_EQ(result, expected);
+  EXPECT_EQ(plain, expected);
+
+  // With no key the result is b alone
+  helib::Ctxt empty(publicKey), bOnly(publicKey), emptyExpected(publicKey);
+  bOnly.setToInnerProduct(empty, {}, a, b);
+  emptyExpected.addConstant(b);
+  EXPECT_EQ(bOnly, emptyExpected);
+}
+
+TEST_P(TestCtxt, droppingToTheNaturalPrimeSetKeepsTheCapacity)
+{
+  helib::Ptxt<helib::BGV> ptxt(context);
+  ptxt.random();
+  helib::Ctxt c(publicKey);
+  publicKey.Encrypt(c, ptxt);
+  c.square();
+  helib::Ptxt<helib::BGV> expected(ptxt);
+  expected *= ptxt;
+
+  helib::Ctxt dropped(c);
+  dropped.dropToNaturalPrimeSet();
+  EXPECT_TRUE(dropped.getPrimeSet() <= c.getPrimeSet());
+  EXPECT_NEAR(dropped.capacity(), c.capacity(), 2.0);
+
+  // Once the noise is down to the rounding term, nothing more is dropped
+  helib::IndexSet s = dropped.getPrimeSet();
+  dropped.dropToNaturalPrimeSet();
+  EXPECT_EQ(dropped.getPrimeSet(), s);
+
+  helib::Ptxt<helib::BGV> result(context);
+  secretKey.Decrypt(result, dropped);
+  EXPECT_EQ(result, expected);
+}
+
+TEST_P(TestCtxt, lazyProductsStayExtendedUpToTheRelinearizationMatrices)
+{
+  // GenSecKey adds the matrices up to s^3
+  EXPECT_EQ(publicKey.maxRelinPower(), 3);
+
+  helib::Ptxt<helib::BGV> p1(context), p2(context), p3(context);
+  p1.random();
+  p2.random();
+  p3.random();
+  helib::Ctxt c1(publicKey), c2(publicKey), c3(publicKey);
+  publicKey.Encrypt(c1, p1);
+  publicKey.Encrypt(c2, p2);
+  publicKey.Encrypt(c3, p3);
+
+  c1.multiplyBy(c2, helib::RelinPolicy::Lazy);
+  EXPECT_EQ(c1.getPowerOfS(), 2);
+  // (1,s,s^2) * (1,s) is relinearized only once, with the s^3 matrix
+  c1.multiplyBy(c3, helib::RelinPolicy::Lazy);
+  EXPECT_EQ(c1.getPowerOfS(), 3);
+
+  helib::Ptxt<helib::BGV> expected(p1);
+  expected *= p2;
+  expected *= p3;
+  helib::Ptxt<helib::BGV> decrypted(context);
+  secretKey.Decrypt(decrypted, c1);
+  EXPECT_EQ(decrypted, expected);
+
+  c1.reLinearize();
+  EXPECT_TRUE(c1.inCanonicalForm());
+  secretKey.Decrypt(decrypted, c1);
+  EXPECT_EQ(decrypted, expected);
+
+  // Without the s^4 matrix, (1,s,s^2,s^3) is relinearized before a product
+  c3.multiplyBy(c2, helib::RelinPolicy::Lazy);
+  helib::Ctxt c4(publicKey);
+  publicKey.Encrypt(c4, p1);
+  c4.multiplyBy(c2, helib::RelinPolicy::Lazy);
+  c4.multiplyBy(c3, helib::RelinPolicy::Lazy);
+  EXPECT_EQ(c4.getPowerOfS(), 3);
+  helib::addRelinMatrices(secretKey, 4);
+  EXPECT_EQ(secretKey.maxRelinPower(), 4);
+}
+
+TEST_P(TestCtxt, fusedMultiplyMatchesTensorProductThenRelinearize)
+{
+  helib::Ptxt<helib::BGV> p1(context), p2(context);
+  p1.random();
+  p2.random();
+  helib::Ctxt c1(publicKey), c2(publicKey);
+  publicKey.Encrypt(c1, p1);
+  publicKey.Encrypt(c2, p2);
+
+  helib::Ctxt fused(c1), reference(c1);
+  fused.multiplyBy(c2);
+  reference.multLowLvl(c2);
+  reference.reLinearize();
+  EXPECT_EQ(fused, reference);
+
+  helib::Ctxt fusedSquare(c2), referenceSquare(c2);
+  fusedSquare.square();
+  referenceSquare.multLowLvl(referenceSquare);
+  referenceSquare.reLinearize();
+  EXPECT_EQ(fusedSquare, referenceSquare);
+
+  helib::Ptxt<helib::BGV> expected(p1), decrypted(context);
+  expected *= p2;
+  secretKey.Decrypt(decrypted, fused);
+  EXPECT_EQ(decrypted, expected);
+}
+
+TEST_P(TestCtxt, batchedRelinearizationMatchesOneByOne)
+{
+  // Products at two levels, a fresh ciphertext and an empty one
+  std::vector<helib::Ptxt<helib::BGV>> ptxts(5,
+                                            helib::Ptxt<helib::BGV>(context));
+  std::vector<helib::Ctxt> batch;
+  for (auto& ptxt : ptxts) {
+    ptxt.random();
+    batch.emplace_back(publicKey);
+    publicKey.Encrypt(batch.back(), ptxt);
+  }
+  helib::IndexSet lower = context.getCtxtPrimes();
+  lower.remove(lower.last());
+  batch[3].modDownToSet(lower);
+  for (long i : {0, 1, 2, 3})
+    batch[i].multLowLvl(batch[i]);
+  batch.emplace_back(publicKey);
+
+  std::vector<helib::Ctxt> reference(batch);
+  for (helib::Ctxt& ctxt : reference)
+    ctxt.reLinearize();
+  std::vector<helib::Ctxt*> ptrs;
+  for (helib::Ctxt& ctxt : batch)
+    ptrs.push_back(&ctxt);
+  helib::reLinearize(ptrs);
+
+  for (std::size_t i = 0; i < batch.size(); i++) {
+    EXPECT_EQ(batch[i], reference[i]);
+    EXPECT_TRUE(batch[i].inCanonicalForm());
+  }
+  for (long i : {0, 1, 2, 3}) {
+    helib::Ptxt<helib::BGV> expected(ptxts[i]), decrypted(context);
+    expected *= ptxts[i];
+    secretKey.Decrypt(decrypted, batch[i]);
+    EXPECT_EQ(decrypted, expected);
+  }
+}
+
+TEST_P(TestCtxt, doubleCRTInnerProductMatchesMultiplyThenAdd)
+{
+  const helib::IndexSet allPrimes =
+      context.getCtxtPrimes() | context.getSpecialPrimes();
+  std::vector<helib::DoubleCRT> a(3, helib::DoubleCRT(context, allPrimes));
+  std::vector<helib::DoubleCRT> b(4, helib::DoubleCRT(context, allPrimes));
+  for (auto& x : a) {
+    x.randomize();
+    x.removePrimes(context.getSpecialPrimes());
+  }
+  for (auto& x : b)
+    x.randomize();
+
+  helib::DoubleCRT expected = a[0];
+  expected.Mul(b[0], /*matchIndexSets=*/false);
+  for (std::size_t i = 1; i < a.size(); i++) {
+    helib::DoubleCRT term = a[i];
+    term.Mul(b[i], /*matchIndexSets=*/false);
+    expected += term;
+  }
+
+  // The result must not depend on how the grid is split between threads
+  const long savedThreads = NTL::AvailableThreads();
+  for (long threads : {1, 3, 8}) {
+    NTL::SetNumThreads(threads);
+    helib::DoubleCRT result(context, allPrimes);
+    result.innerProduct(a, b);
+    EXPECT_EQ(result.getIndexSet(), context.getCtxtPrimes());
+    EXPECT_EQ(result, expected);
+  }
+  NTL::SetNumThreads(savedThreads);
+}
+
+TEST_P(TestCtxt, longInnerProductsAreReducedOnceAtTheEnd)
+{
+  // More terms than the 128-bit accumulator holds for 60-bit primes, so
+  // that the sums are also folded along the way
+  const long n = 300;
+  const helib::IndexSet& s = context.getCtxtPrimes();
+  std::vector<helib::DoubleCRT> a(n, helib::DoubleCRT(context, s));
+  std::vector<helib::DoubleCRT> b(n, helib::DoubleCRT(context, s));
+  std::vector<helib::DoubleCRTPrecon> bPrecon;
+  for (long t = 0; t < n; t++) {
+    a[t].randomize();
+    b[t].randomize();
+    bPrecon.emplace_back(b[t]);
+  }
+
+  helib::DoubleCRT expected = a[0];
+  expected.Mul(b[0]);
+  for (long t = 1; t < n; t++) {
+    helib::DoubleCRT term = a[t];
+    term.Mul(b[t]);
+    expected += term;
+  }
+
+  helib::DoubleCRT result(context, s);
+  result.innerProduct(a, b);
+  EXPECT_EQ(result, expected);
+  result.innerProduct(a, b, bPrecon);
+  EXPECT_EQ(result, expected);
+}
+
+TEST_P(TestCtxt, rnsModDownMatchesTheBigIntegerOne)
+{
+  const helib::IndexSet& from = context.getCtxtPrimes();
+  helib::IndexSet to = from;
+  to.remove(from.last());
+  if (to.card() > 1)
+    to.remove(to.last());
+
+  for (long p : {1l, long(context.getAlMod().getPPowR())}) {
+    std::vector<helib::DoubleCRT> parts(3, helib::DoubleCRT(context, from));
+    std::vector<helib::DoubleCRT> expected;
+    std::vector<NTL::ZZX> deltas(parts.size());
+    std::vector<helib::DoubleCRT*> partPtrs;
+    for (long t : helib::range(parts.size())) {
+      parts[t].randomize();
+      expected.push_back(parts[t]);
+      expected[t].scaleDownToSet(to, p, deltas[t]);
+      partPtrs.push_back(&parts[t]);
+    }
+
+    // Copies that share the rows of the parts keep their values
+    std::vector<helib::DoubleCRT> copies(parts);
+    std::vector<std::vector<double>> fdeltas;
+    helib::DoubleCRT::scaleDownToSet(partPtrs, to, p, &fdeltas);
+    for (long t : helib::range(parts.size())) {
+      EXPECT_EQ(copies[t].getIndexSet(), from);
+      NTL::ZZX delta;
+      copies[t].scaleDownToSet(to, p, delta);
+      EXPECT_EQ(copies[t], expected[t]) << "p = " << p;
+    }
+    NTL::xdouble diff =
+        NTL::conv<NTL::xdouble>(context.productOfPrimes(from / to));
+    for (long t : helib::range(parts.size())) {
+      EXPECT_EQ(parts[t], expected[t]) << "p = " << p;
+      ASSERT_LE(long(fdeltas[t].size()), deltas[t].rep.length());
+      for (long h : helib::range(deltas[t].rep.length())) {
+        double fdelta = h < long(fdeltas[t].size()) ? fdeltas[t][h] : 0.0;
+        double reference = NTL::conv<double>(
+            NTL::conv<NTL::xdouble>(deltas[t].rep[h]) / diff);
+        EXPECT_NEAR(fdelta, reference, 1e-6);
+      }
+    }
+  }
+}
+
+TEST_P(TestCtxt, streamedDigitsRecombineToThePolynomial)
+{
+  const helib::IndexSet& s = context.getCtxtPrimes();
+  helib::DoubleCRT x(context, s);
+  x.randomize();
+  std::vector<helib::DoubleCRT> digits;
+  x.breakIntoDigits(digits);
+
+  helib::DoubleCRT sum(context, s | context.getSpecialPrimes());
+  NTL::ZZ factor(1);
+  long count = 0;
+  x.forEachDigit(context.getSpecialPrimes(),
+                 [&](long i, helib::DoubleCRT& digit) {
+                   ASSERT_LT(i, long(digits.size()));
+                   EXPECT_EQ(digit, digits[i]);
+                   digit *= factor;
+                   sum += digit;
+                   factor *= context.productOfPrimes(context.getDigit(i));
+                   count++;
+                 });
+  EXPECT_EQ(count, long(digits.size()));
+  sum.removePrimes(context.getSpecialPrimes());
+  EXPECT_EQ(sum, x);
+}
+
+TEST_P(TestCtxt, lowLevelsAreRelinearizedWithFewerSpecialPrimes)
+{
+  helib::IndexSet level(context.getCtxtPrimes().first());
+  if (context.getDigit(0).card() < 2)
+    GTEST_SKIP() << "The first digit must have more than one prime";
+  helib::IndexSet special = context.specialPrimesForLevel(level);
+  ASSERT_TRUE(special < context.getSpecialPrimes());
+
+  secretKey.GenLevelKeySWmatrices({1});
+  ASSERT_FALSE(secretKey.levelKeySWlist().empty());
+  helib::PubKey levelKey(secretKey);
+  const helib::KeySwitch* W = levelKey.getLevelKeySWmatrix(
+      levelKey.getKeySWmatrix(2, 1).fromKey, 0, level);
+  ASSERT_NE(W, nullptr);
+  EXPECT_EQ(W->NumCols(), 1ul);
+  EXPECT_EQ(W->specialPrimes(), special);
+
+  const long p2r = context.getAlMod().getPPowR();
+  std::vector<long> a(ea.size()), b(ea.size()), ab(ea.size());
+  for (long i = 0; i < ea.size(); i++) {
+    a[i] = NTL::RandomBnd(p2r);
+    b[i] = NTL::RandomBnd(p2r);
+    ab[i] = NTL::MulMod(a[i], b[i], p2r);
+  }
+  helib::Ctxt ca(levelKey), cb(levelKey);
+  levelKey.Encrypt(ca, helib::Ptxt<helib::BGV>(context, a));
+  levelKey.Encrypt(cb, helib::Ptxt<helib::BGV>(context, b));
+  ca.modDownToSet(level);
+  cb.modDownToSet(level);
+  ca.multiplyBy(cb);
+
+  EXPECT_TRUE(ca.inCanonicalForm());
+  EXPECT_TRUE(ca.getPrimeSet().disjointFrom(context.getSpecialPrimes()));
+  helib::Ptxt<helib::BGV> result(context);
+  secretKey.Decrypt(result, ca);
+  EXPECT_EQ(result, helib::Ptxt<helib::BGV>(context, ab));
+}
+
+TEST_P(TestCtxt, preconditionedProductsMatchThePlainProducts)
+{
+  const helib::IndexSet allPrimes =
+      context.getCtxtPrimes() | context.getSpecialPrimes();
+  std::vector<helib::DoubleCRT> a(3, helib::DoubleCRT(context, allPrimes));
+  std::vector<helib::DoubleCRT> b(3, helib::DoubleCRT(context, allPrimes));
+  std::vector<helib::DoubleCRTPrecon> bPrecon;
+  for (auto& x : a) {
+    x.randomize();
+    x.removePrimes(context.getSpecialPrimes());
+  }
+  for (auto& x : b) {
+    x.randomize();
+    bPrecon.emplace_back(x);
+  }
+
+  helib::DoubleCRT expected(context, allPrimes);
+  expected.innerProduct(a, b);
+  helib::DoubleCRT result(context, allPrimes);
+  result.innerProduct(a, b, bPrecon);
+  EXPECT_EQ(result, expected);
+
+  helib::DoubleCRT product = a[1];
+  product.Mul(b[1], bPrecon[1]);
+  helib::DoubleCRT plain = a[1];
+  plain.Mul(b[1], /*matchIndexSets=*/false);
+  EXPECT_EQ(product, plain);
+
+  // The key-switching matrices are prepared when they are generated
+  for (const helib::KeySwitch& W : publicKey.keySWlist()) {
+    ASSERT_EQ(W.bPrecon.size(), W.b.size());
+    for (std::size_t i = 0; i < W.b.size(); i++)
+      EXPECT_EQ(W.bPrecon[i].getIndexSet(), W.b[i].getIndexSet());
+  }
+}
+
+TEST_P(TestCtxt, batchedConversionsMatchOneByOne)
+{
+  const helib::IndexSet& s = context.getCtxtPrimes();
+  const long n = 3;
+  std::vector<helib::zzX> polys(n);
+  std::vector<const helib::zzX*> polyPtrs;
+  for (auto& poly : polys) {
+    poly.SetLength(context.getPhiM());
+    for (long j = 0; j < poly.length(); j++)
+      poly[j] = NTL::RandomBnd(1001) - 500;
+    polyPtrs.push_back(&poly);
+  }
+
+  const long savedThreads = NTL::AvailableThreads();
+  for (long threads : {1, 4, 8}) {
+    NTL::SetNumThreads(threads);
+    std::vector<helib::DoubleCRT> dcrts(n, helib::DoubleCRT(context, s));
+    std::vector<helib::DoubleCRT*> dcrtPtrs;
+    std::vector<const helib::DoubleCRT*> constPtrs;
+    for (auto& dcrt : dcrts) {
+      dcrtPtrs.push_back(&dcrt);
+      constPtrs.push_back(&dcrt);
+    }
+    helib::DoubleCRT::fromPolys(dcrtPtrs, polyPtrs, s);
+    for (long t = 0; t < n; t++)
+      EXPECT_EQ(dcrts[t], helib::DoubleCRT(polys[t], context, s));
+
+    std::vector<NTL::ZZX> back(n);
+    std::vector<NTL::ZZX*> backPtrs;
+    for (auto& poly : back)
+      backPtrs.push_back(&poly);
+    helib::DoubleCRT::toPolys(backPtrs, constPtrs, s);
+    for (long t = 0; t < n; t++) {
+      NTL::ZZX expected;
+      dcrts[t].toPoly(expected);
+      EXPECT_EQ(back[t], expected);
+      EXPECT_EQ(back[t], helib::convert<NTL::ZZX>(polys[t]));
+    }
+  }
+  NTL::SetNumThreads(savedThreads);
+}
+
+TEST_P(TestCtxt, keySwitchingMatricesDoNotDependOnTheThreadCount)
+{
+  const long savedThreads = NTL::AvailableThreads();
+  std::vector<std::vector<helib::KeySwitch>> lists;
+  for (long threads : {1, 4}) {
+    NTL::SetNumThreads(threads);
+    NTL::SetSeed(NTL::ZZ(17));
+    helib::SecKey sk(context);
+    sk.GenSecKey();
+    addSome1DMatrices(sk);
+    addFrbMatrices(sk);
+    lists.push_back(sk.keySWlist());
+  }
+  NTL::SetNumThreads(savedThreads);
+
+  ASSERT_EQ(lists[0].size(), lists[1].size());
+  for (std::size_t i = 0; i < lists[0].size(); i++)
+    EXPECT_EQ(lists[0][i], lists[1][i]);
+}
+
+TEST_P(TestCtxt, expandedKeySwitchingMatricesGiveTheSameCiphertexts)
+{
+  std::vector<std::string> products;
+  for (helib::KSMemoryMode mode :
+       {helib::KSMemoryMode::COMPACT, helib::KSMemoryMode::EXPANDED}) {
+    helib::setKSMemoryMode(mode);
+    NTL::SetSeed(NTL::ZZ(5));
+    helib::SecKey sk(context);
+    sk.GenSecKey();
+    addSome1DMatrices(sk);
+    for (const helib::KeySwitch& W : sk.keySWlist())
+      EXPECT_EQ(W.a.empty(), mode == helib::KSMemoryMode::COMPACT);
+
+    helib::Ptxt<helib::BGV> ptxt(context);
+    ptxt.random();
+    helib::EncodedPtxt eptxt;
+    ptxt.encode(eptxt);
+    helib::Ctxt ctxt(sk);
+    sk.Encrypt(ctxt, eptxt);
+    ctxt.multiplyBy(ctxt);
+    ctxt.smartAutomorph(context.getZMStar().genToPow(0, 1));
+
+    std::stringstream ss;
+    ctxt.writeTo(ss);
+    products.push_back(ss.str());
+  }
+  helib::setKSMemoryMode(helib::KSMemoryMode::COMPACT);
+  EXPECT_EQ(products[0], products[1]);
+}
+
+TEST_P(TestCtxt, encryptionNoiseDoesNotDependOnTheThreadCount)
+{
+  const long savedThreads = NTL::AvailableThreads();
+  helib::Ptxt<helib::BGV> ptxt(context);
+  ptxt.random();
+  std::vector<std::string> ciphertexts;
+  for (long threads : {1, 4}) {
+    NTL::SetNumThreads(threads);
+    NTL::SetSeed(NTL::ZZ(23));
+    helib::Ctxt ctxt(publicKey);
+    publicKey.Encrypt(ctxt, ptxt);
+
+    std::stringstream ss;
+    ctxt.writeTo(ss);
+    ciphertexts.push_back(ss.str());
+
+    helib::Ptxt<helib::BGV> decrypted(context);
+    secretKey.Decrypt(decrypted, ctxt);
+    EXPECT_EQ(decrypted, ptxt);
+  }
+  NTL::SetNumThreads(savedThreads);
+  EXPECT_EQ(ciphertexts[0], ciphertexts[1]);
+
+  // Every polynomial of a batch comes from a stream of its own
+  std::vector<helib::zzX> polys(2);
+  helib::sampleGaussianBounded(polys, context, 3.2);
+  EXPECT_NE(polys[0], polys[1]);
+}
+
+TEST_P(TestCtxt, batchEncryptionDoesNotDependOnTheThreadCount)
+{
+  const long savedThreads = NTL::AvailableThreads();
+  std::vector<helib::Ptxt<helib::BGV>> ptxts(5,
+                                             helib::Ptxt<helib::BGV>(context));
+  for (helib::Ptxt<helib::BGV>& ptxt : ptxts)
+    ptxt.random();
+  std::vector<std::string> batches;
+  for (long threads : {1, 4}) {
+    NTL::SetNumThreads(threads);
+    NTL::SetSeed(NTL::ZZ(29));
+    std::vector<helib::Ctxt> ctxts;
+    publicKey.Encrypt(ctxts, ptxts);
+    ASSERT_EQ(ctxts.size(), ptxts.size());
+
+    std::stringstream ss;
+    for (const helib::Ctxt& ctxt : ctxts)
+      ctxt.writeTo(ss);
+    batches.push_back(ss.str());
+
+    std::vector<helib::Ptxt<helib::BGV>> decrypted;
+    secretKey.Decrypt(decrypted, ctxts);
+    EXPECT_EQ(decrypted, ptxts);
+  }
+  NTL::SetNumThreads(savedThreads);
+  EXPECT_EQ(batches[0], batches[1]);
+
+  std::vector<helib::PtxtArray> arrays(3, helib::PtxtArray(context));
+  for (helib::PtxtArray& array : arrays)
+    array.random();
+  std::vector<helib::Ctxt> ctxts(arrays.size(), helib::Ctxt(publicKey));
+  helib::encrypt(ctxts, arrays);
+  std::vector<helib::PtxtArray> decrypted(arrays.size(),
+                                          helib::PtxtArray(context));
+  helib::decrypt(decrypted, ctxts, secretKey);
+  for (std::size_t i = 0; i < arrays.size(); i++)
+    EXPECT_EQ(decrypted[i], arrays[i]);
+}
+
+TEST_P(TestCtxt, pooledEncryptionsDecryptToThePlaintexts)
+{
+  helib::EncryptionPool pool(publicKey);
+  pool.fill(3);
+  EXPECT_EQ(pool.size(), 3);
+
+  // The last one has no encryption of zero left in the pool
+  for (long i = 0; i < 4; i++) {
+    helib::Ptxt<helib::BGV> ptxt(context);
+    ptxt.random();
+    helib::EncodedPtxt eptxt;
+    ptxt.encode(eptxt);
+    helib::Ctxt ctxt(publicKey);
+    EXPECT_EQ(pool.Encrypt(ctxt, eptxt), i < 3);
+    EXPECT_TRUE(ctxt.isCorrect());
+
+    helib::Ptxt<helib::BGV> decrypted(context);
+    secretKey.Decrypt(decrypted, ctxt);
+    EXPECT_EQ(decrypted, ptxt);
+  }
+  EXPECT_EQ(pool.size(), 0);
+
+  pool.fill(2);
+  std::stringstream ss;
+  pool.writeTo(ss);
+  helib::EncryptionPool readBack(publicKey);
+  readBack.read(ss);
+  EXPECT_EQ(readBack.size(), 2);
+
+  helib::Ptxt<helib::BGV> ptxt(context);
+  ptxt.random();
+  helib::EncodedPtxt eptxt;
+  ptxt.encode(eptxt);
+  helib::Ctxt ctxt(publicKey);
+  EXPECT_TRUE(readBack.Encrypt(ctxt, eptxt));
+  helib::Ptxt<helib::BGV> decrypted(context);
+  secretKey.Decrypt(decrypted, ctxt);
+  EXPECT_EQ(decrypted, ptxt);
+}
+
+TEST_P(TestCtxt, decryptionRebuildsTheKeyModuloTheSmallPrimes)
+{
+  helib::Ptxt<helib::BGV> ptxt(context);
+  ptxt.random();
+  helib::Ctxt c(publicKey);
+  publicKey.Encrypt(c, ptxt);
+
+  // The key has no small primes, it is rebuilt from its coefficients
+  helib::IndexSet primes = c.getPrimeSet() | context.getSmallPrimes();
+  c.modUpToSet(primes);
+  EXPECT_EQ(c.getPrimeSet(), primes);
+
+  helib::Ptxt<helib::BGV> decrypted(context);
+  secretKey.Decrypt(decrypted, c);
+  EXPECT_EQ(decrypted, ptxt);
+
+  // The coefficients are recomputed for a key that is read back
+  std::stringstream ss;
+  secretKey.writeTo(ss);
+  helib::SecKey readBack = helib::SecKey::readFrom(ss, context);
+  helib::Ptxt<helib::BGV> readBackDecrypted(context);
+  readBack.Decrypt(readBackDecrypted, c);
+  EXPECT_EQ(readBackDecrypted, ptxt);
+}
+
+TEST_P(TestCtxt, decryptingSomeSlotsOrCoefficientsMatchesTheFullDecryption)
+{
+  std::vector<long> values;
+  ea.random(values);
+  helib::Ctxt c(publicKey);
+  ea.encrypt(c, publicKey, values);
+
+  std::vector<long> slots{ea.size() - 1, 0, ea.size() / 2};
+  std::vector<long> someValues;
+  ea.decryptSlots(c, secretKey, someValues, slots);
+  ASSERT_EQ(someValues.size(), slots.size());
+  for (std::size_t k = 0; k < slots.size(); k++)
+    EXPECT_EQ(someValues[k], values[slots[k]]);
+  EXPECT_EQ(ea.decrypt1Slot(c, secretKey, 0), values[0]);
+
+  std::vector<NTL::ZZX> all, some;
+  ea.decrypt(c, secretKey, all);
+  ea.decryptSlots(c, secretKey, some, slots);
+  for (std::size_t k = 0; k < slots.size(); k++)
+    EXPECT_EQ(some[k], all[slots[k]]);
+
+  long phim = context.getPhiM();
+  std::vector<long> indices{0, 1, phim - 1};
+  std::vector<long> coeffs;
+  ea.decryptCoeffs(c, secretKey, coeffs, indices);
+  NTL::ZZX poly;
+  secretKey.Decrypt(poly, c);
+  for (std::size_t k = 0; k < indices.size(); k++)
+    EXPECT_EQ(coeffs[k], NTL::conv<long>(NTL::coeff(poly, indices[k])));
+
+  EXPECT_THROW(ea.decryptSlots(c, secretKey, someValues, {ea.size()}),
+               helib::OutOfRangeError);
+  EXPECT_THROW(ea.decryptCoeffs(c, secretKey, coeffs, {phim}),
+               helib::OutOfRangeError);
+}
+
+TEST_P(TestCtxt, wordSizeScaleToModulusMatchesTheIntegerCRT)
+{
+  const helib::IndexSet& s = context.getCtxtPrimes();
+  helib::DoubleCRT dcrt(context, s);
+  dcrt.randomize();
+
+  NTL::ZZX poly;
+  dcrt.toPoly(poly, /*positive=*/true);
+  const NTL::ZZ Q = context.productOfPrimes(s);
+
+  for (long q : {1025l, (1l << 40) + 15}) {
+    const long t = 257;
+    helib::zzX x, y;
+    std::vector<double> frac;
+    dcrt.scaleToModulus(x, y, frac, q, t);
+    ASSERT_EQ(x.length(), context.getPhiM());
+
+    for (long h = 0; h < context.getPhiM(); h++) {
+      NTL::ZZ X, Y;
+      DivRem(X, Y, coeff(poly, h) * q, Q);
+      if (2 * Y > Q) { // round to the nearest integer
+        Y -= Q;
+        X += 1;
+      }
+      EXPECT_EQ(x[h], rem(X, q)) << "h = " << h;
+      EXPECT_EQ(y[h], rem(Y, t)) << "h = " << h;
+      double expected = NTL::conv<double>(NTL::conv<NTL::xdouble>(Y) /
+                                          NTL::conv<NTL::xdouble>(Q));
+      EXPECT_NEAR(frac[h], expected, 1e-9) << "h = " << h;
+    }
+  }
+}
+
+TEST_P(TestCtxt, linearCombinationWorks)
+{
+  const long p2r = context.getAlMod().getPPowR();
+  std::vector<helib::Ctxt> ctxts;
+  std::vector<NTL::ZZ> coeffs{NTL::to_ZZ(0),
+                              NTL::to_ZZ(5),
+                              NTL::to_ZZ(-1),
+                              NTL::to_ZZ(p2r + 2)};
+  std::vector<long> expected(ea.size(), 0);
+  for (std::size_t j = 0; j < coeffs.size(); j++) {
+    std::vector<long> x(ea.size());
+    for (long i = 0; i < ea.size(); i++) {
+      x[i] = NTL::RandomBnd(p2r);
+      expected[i] = NTL::AddMod(
+          expected[i],
+          NTL::MulMod(x[i], rem(coeffs[j], p2r), p2r),
+          p2r);
+    }
+    ctxts.emplace_back(publicKey);
+    publicKey.Encrypt(ctxts.back(), helib::Ptxt<helib::BGV>(context, x));
+  }
+
+  helib::Ctxt result(publicKey);
+  helib::linearCombination(result, ctxts, coeffs);
+  helib::Ptxt<helib::BGV> decrypted(context);
+  secretKey.Decrypt(decrypted, result);
+  EXPECT_EQ(decrypted, helib::Ptxt<helib::BGV>(context, expected));
+
+  // All coefficients zero gives an empty ciphertext
+  std::vector<NTL::ZZ> zeros(ctxts.size(), NTL::ZZ::zero());
+  helib::linearCombination(result, ctxts, zeros);
+  EXPECT_TRUE(result.isEmpty());
+}
+
+TEST_P(TestCtxt, linearCombinationWithConstantsMatchesMultByConstant)
+{
+  const long p2r = context.getAlMod().getPPowR();
+  const long n = 3;
+  std::vector<helib::Ctxt> ctxts;
+  std::vector<helib::DoubleCRT> constants;
+  std::vector<double> sizes;
+  for (long j = 0; j < n; j++) {
+    std::vector<long> x(ea.size());
+    for (auto& slot : x)
+      slot = NTL::RandomBnd(p2r);
+    ctxts.emplace_back(publicKey);
+    publicKey.Encrypt(ctxts.back(), helib::Ptxt<helib::BGV>(context, x));
+
+    NTL::ZZX poly;
+    for (long k = 0; k < context.getPhiM(); k++)
+      SetCoeff(poly, k, NTL::RandomBnd(p2r));
+    constants.emplace_back(poly, context, context.getCtxtPrimes());
+    sizes.push_back(NTL::conv<double>(
+        helib::embeddingLargestCoeff(poly, context.getZMStar())));
+  }
+  // A ciphertext with a different prime set takes the unfused path
+  helib::IndexSet lowerPrimes = ctxts[0].getPrimeSet();
+  lowerPrimes.remove(lowerPrimes.last());
+  helib::Ctxt lower = ctxts[0];
+  lower.modDownToSet(lowerPrimes);
+
+  for (bool fused : {true, false}) {
+    std::vector<const helib::Ctxt*> ctxtPtrs;
+    std::vector<const helib::DoubleCRT*> constantPtrs;
+    for (long j = 0; j < n; j++) {
+      ctxtPtrs.push_back(&ctxts[j]);
+      constantPtrs.push_back(&constants[j]);
+    }
+    if (!fused)
+      ctxtPtrs[0] = &lower;
+
+    helib::Ctxt expected(helib::ZeroCtxtLike, ctxts[0]);
+    for (long j = 0; j < n; j++) {
+      helib::Ctxt term = *ctxtPtrs[j];
+      term.multByConstant(constants[j], sizes[j]);
+      expected += term;
+    }
+    helib::Ctxt result(publicKey);
+    helib::linearCombination(result, ctxtPtrs, constantPtrs, sizes);
+
+    helib::Ptxt<helib::BGV> decrypted(context), decryptedExpected(context);
+    secretKey.Decrypt(decrypted, result);
+    secretKey.Decrypt(decryptedExpected, expected);
+    EXPECT_EQ(decrypted, decryptedExpected);
+    EXPECT_EQ(result.getPrimeSet(), expected.getPrimeSet());
+    if (fused)
+      EXPECT_DOUBLE_EQ(NTL::conv<double>(result.getNoiseBound()),
+                       NTL::conv<double>(expected.getNoiseBound()));
+  }
+}
+
+TEST_P(TestCtxt, batchEmbeddingNormsMatchTheSingleOnes)
+{
+  // An odd number of inputs, so that one of them is not paired up
+  const long n = 5;
+  std::vector<NTL::ZZX> polys(n);
+  std::vector<const NTL::ZZX*> polyPtrs;
+  for (long j = 0; j < n; j++) {
+    for (long k = 0; k < context.getPhiM() - j; k++)
+      SetCoeff(polys[j], k, NTL::RandomBnd(1000) - 500);
+    polyPtrs.push_back(&polys[j]);
+  }
+
+  std::vector<NTL::xdouble> norms;
+  helib::embeddingLargestCoeffs(norms, polyPtrs, context.getZMStar());
+  ASSERT_EQ(norms.size(), polys.size());
+  for (long j = 0; j < n; j++) {
+    double single = NTL::conv<double>(
+        helib::embeddingLargestCoeff(polys[j], context.getZMStar()));
+    EXPECT_NEAR(NTL::conv<double>(norms[j]), single, 1e-9 * single);
+  }
+}
+
+TEST(TestCtxtNoiseArithmetic, inlineXdoubleOpsMatchNTL)
+{
+  // Values on both sides of the mantissa range, so that both the inline and
+  // the fallback paths are taken
+  const std::vector<double> values = {0.0, 1e-40, 0.5, 3.0, 1e20, 1e40, 1e300};
+  for (double u : values)
+    for (double v : values) {
+      NTL::xdouble a = NTL::to_xdouble(u) * NTL::to_xdouble(1e200);
+      NTL::xdouble b = NTL::to_xdouble(v);
+      for (const NTL::xdouble& x : {NTL::to_xdouble(u), a}) {
+        NTL::xdouble sum = x;
+        helib::xdoubleAddTo(sum, b);
+        EXPECT_DOUBLE_EQ(log(sum + 1.0), log(x + b + 1.0));
+
+        NTL::xdouble sumD = x;
+        helib::xdoubleAddTo(sumD, v);
+        EXPECT_DOUBLE_EQ(log(sumD + 1.0), log(x + b + 1.0));
+
+        NTL::xdouble prod = x;
+        helib::xdoubleMulBy(prod, v);
+        EXPECT_DOUBLE_EQ(log(prod + 1.0), log(x * b + 1.0));
+      }
+    }
+}
+
+TEST(TestCtxtSubtractAndDivideByP, matchesSubtractThenDivide)
+{
+  // Plaintext space p^r with r > 1, so that there is something to divide
+  const long p = 2, r = 4;
+  helib::Context context = helib::ContextBuilder<helib::BGV>()
+                               .m(45)
+                               .p(p)
+                               .r(r)
+                               .bits(300)
+                               .build();
+  helib::SecKey secretKey(context);
+  secretKey.GenSecKey();
+  const long p2r = context.getAlMod().getPPowR();
+  const long p2rMinus1 = p2r / p;
+
+  // a - b is divisible by p coefficient-wise, with quotient t
+  NTL::ZZX a, b, t;
+  for (long i = 0; i < context.getPhiM(); i++) {
+    SetCoeff(a, i, NTL::RandomBnd(p2r));
+    SetCoeff(t, i, NTL::RandomBnd(p2rMinus1));
+    SetCoeff(b, i, NTL::SubMod(rem(coeff(a, i), p2r),
+                               NTL::MulMod(rem(coeff(t, i), p2r), p, p2r),
+                               p2r));
+  }
+  helib::Ctxt ca(secretKey), cb(secretKey);
+  secretKey.Encrypt(ca, a, p2r);
+  // Encrypt b / (p + 1) and multiply back, so that the integer factors differ
+  secretKey.Encrypt(
+      cb, helib::MulMod(b, NTL::InvMod(p + 1, p2r), p2r, /*abs=*/true), p2r);
+  cb.multByConstant(NTL::to_ZZ(p + 1));
+
+  helib::Ctxt fused(ca), reference(ca);
+  fused.subtractAndDivideByP(cb);
+  reference.addCtxt(cb, true);
+  reference.divideByP();
+  EXPECT_EQ(fused.getPtxtSpace(), p2rMinus1);
+  EXPECT_EQ(reference.getPtxtSpace(), p2rMinus1);
+
+  NTL::ZZX fusedResult, referenceResult;
+  secretKey.Decrypt(fusedResult, fused);
+  secretKey.Decrypt(referenceResult, reference);
+  EXPECT_EQ(fusedResult, referenceResult);
+  for (long i = 0; i < context.getPhiM(); i++)
+    EXPECT_EQ(rem(coeff(fusedResult, i), p2rMinus1),
+              rem(coeff(t, i), p2rMinus1));
+
+  // The batched version updates every target from the same digit
+  helib::Ctxt first(ca), second(ca);
+  helib::subtractAndDivideByP({&first, &second}, cb);
+  for (const helib::Ctxt* target : {&first, &second}) {
+    NTL::ZZX result;
+    secretKey.Decrypt(result, *target);
+    EXPECT_EQ(result, fusedResult);
+  }
+}
+
 TEST_P(TestCtxt, mapTo01WorksCorrectlyForConstantInputs)
 {
   std::vector<long> data(ea.size());
@@ -188,6 +1160,301 @@ TEST_P(TestCtxt, mapTo01WorksCorrectlyForNonConstantInputs)
   EXPECT_EQ(ptxt, result);
 }
 
+TEST_P(TestCtxt, equalityLookupFindsTheMatchingRowOfEveryBlock)
+{
+  if (p <= 4)
+    GTEST_SKIP() << "The keys 0 to 3 must be distinct mod p";
+  // Blocks of two slots if they fit, else a single block
+  long keySlots = (ea.size() % 2 == 0) ? 2 : ea.size();
+  helib::EqualityLookup lookup(ea, keySlots);
+  long nRows = 3;
+
+  // Row i has key i+1 and value 10*(i+1) in every slot, and block b of the
+  // query looks for key (b mod 4): one block in four finds nothing
+  std::vector<helib::Ctxt> keys, values;
+  for (long i = 0; i < nRows; i++) {
+    helib::Ptxt<helib::BGV> key(context, std::vector<long>(ea.size(), i + 1));
+    helib::Ptxt<helib::BGV> value(context,
+                                  std::vector<long>(ea.size(), 10 * (i + 1)));
+    keys.emplace_back(publicKey);
+    values.emplace_back(publicKey);
+    publicKey.Encrypt(keys.back(), key);
+    publicKey.Encrypt(values.back(), value);
+  }
+  std::vector<long> queryData(ea.size()), expected(ea.size());
+  for (long j = 0; j < ea.size(); j++) {
+    long wanted = (j / keySlots) % 4;
+    queryData[j] = wanted;
+    expected[j] = (wanted == 0) ? 0 : 10 * wanted % p;
+  }
+  helib::Ctxt query(publicKey);
+  publicKey.Encrypt(query, helib::Ptxt<helib::BGV>(context, queryData));
+
+  helib::Ctxt result(publicKey);
+  lookup.lookup(result, keys, values, query);
+
+  helib::Ptxt<helib::BGV> decrypted(context);
+  secretKey.Decrypt(decrypted, result);
+  EXPECT_EQ(decrypted, helib::Ptxt<helib::BGV>(context, expected));
+}
+
+TEST_P(TestCtxt, totalProductsMatchesTotalProduct)
+{
+  std::vector<long> data(ea.size(), 1);
+  data[0] = 2 % p;
+  data[ea.size() - 1] = 3 % p;
+  helib::Ptxt<helib::BGV> ptxt(context, data);
+  helib::Ctxt ctxt(publicKey);
+  publicKey.Encrypt(ctxt, ptxt);
+
+  helib::totalProducts(ea, ctxt);
+
+  long product = 1;
+  for (long x : data)
+    product = product * x % p;
+  helib::Ptxt<helib::BGV> decrypted(context);
+  secretKey.Decrypt(decrypted, ctxt);
+  EXPECT_EQ(decrypted,
+            helib::Ptxt<helib::BGV>(context,
+                                    std::vector<long>(ea.size(), product)));
+}
+
+TEST_P(TestCtxt, preparedConstantsMatchTheEncodedOnes)
+{
+  const long p2r = context.getAlMod().getPPowR();
+  std::vector<long> a(ea.size()), k(ea.size());
+  for (long i = 0; i < ea.size(); i++) {
+    a[i] = NTL::RandomBnd(p2r);
+    k[i] = NTL::RandomBnd(p2r);
+  }
+  helib::EncodedPtxt encoded;
+  ea.encode(encoded, k);
+  helib::PreparedPtxt prepared(encoded);
+
+  helib::Ctxt ca(publicKey);
+  publicKey.Encrypt(ca, helib::Ptxt<helib::BGV>(context, a));
+  // A non-trivial integer factor, so the additions get a scaled form
+  ca.multByConstant(NTL::to_ZZ(3));
+
+  // The second round uses the kept forms
+  for (long round = 0; round < 2; round++) {
+    helib::Ctxt fromEncoded(ca), fromPrepared(ca);
+    fromEncoded += encoded;
+    fromPrepared += prepared;
+    fromEncoded *= encoded;
+    fromPrepared *= prepared;
+    fromEncoded -= encoded;
+    fromPrepared -= prepared;
+
+    helib::Ptxt<helib::BGV> encodedResult(context), preparedResult(context);
+    secretKey.Decrypt(encodedResult, fromEncoded);
+    secretKey.Decrypt(preparedResult, fromPrepared);
+    EXPECT_EQ(preparedResult, encodedResult) << "round " << round;
+  }
+  long forms = prepared.forms();
+  EXPECT_GE(forms, 1);
+
+  // A smaller prime set needs forms of its own
+  helib::IndexSet s = ca.getPrimeSet();
+  s.remove(s.last());
+  ca.modDownToSet(s);
+  helib::Ctxt fromEncoded(ca), fromPrepared(ca);
+  fromEncoded *= encoded;
+  fromPrepared *= prepared;
+  helib::Ptxt<helib::BGV> encodedResult(context), preparedResult(context);
+  secretKey.Decrypt(encodedResult, fromEncoded);
+  secretKey.Decrypt(preparedResult, fromPrepared);
+  EXPECT_EQ(preparedResult, encodedResult);
+  EXPECT_GT(prepared.forms(), forms);
+
+  prepared.clear();
+  EXPECT_EQ(prepared.forms(), 0);
+}
+
+TEST_P(TestCtxt, productTreesMatchThePlaintextProducts)
+{
+  for (long n : {1l, 2l, 3l, 6l}) {
+    std::vector<helib::Ptxt<helib::BGV>> ptxts;
+    std::vector<helib::Ctxt> ctxts;
+    for (long i = 0; i < n; i++) {
+      ptxts.emplace_back(context);
+      ptxts.back().random();
+      ctxts.emplace_back(publicKey);
+      publicKey.Encrypt(ctxts.back(), ptxts.back());
+    }
+
+    std::vector<helib::Ctxt> prefixes(ctxts);
+    helib::incrementalProduct(prefixes);
+    // out may be one of the inputs
+    helib::Ctxt& total = ctxts[n - 1];
+    helib::totalProduct(total, ctxts);
+
+    helib::Ptxt<helib::BGV> expected = ptxts[0];
+    helib::Ptxt<helib::BGV> decrypted(context);
+    for (long i = 0; i < n; i++) {
+      if (i > 0)
+        expected *= ptxts[i];
+      EXPECT_TRUE(prefixes[i].inCanonicalForm());
+      secretKey.Decrypt(decrypted, prefixes[i]);
+      EXPECT_EQ(decrypted, expected) << "n = " << n << ", i = " << i;
+    }
+    secretKey.Decrypt(decrypted, total);
+    EXPECT_EQ(decrypted, expected) << "n = " << n;
+  }
+}
+
+TEST_P(TestCtxt, coalescedRequestsShareTheirCiphertexts)
+{
+  const long nslots = ea.size();
+  if (nslots < 4)
+    GTEST_SKIP() << "Too few slots to coalesce";
+  const long p2r = context.getAlMod().getPPowR();
+
+  // Three small requests, all in the first slots of their ciphertexts
+  std::vector<std::vector<long>> occupancy = {{0, 1}, {0}, {0}};
+  std::vector<std::vector<long>> values(occupancy.size());
+  std::vector<helib::Ctxt> requests(occupancy.size(), helib::Ctxt(publicKey));
+  for (std::size_t j = 0; j < values.size(); j++) {
+    values[j].assign(nslots, 0);
+    for (long i : occupancy[j])
+      values[j][i] = NTL::RandomBnd(p2r);
+    ea.encrypt(requests[j], publicKey, values[j]);
+  }
+
+  helib::CtPtrs_vectorCt ptrs(requests);
+  helib::CoalescedRequests batch(ea, ptrs, occupancy);
+  ASSERT_EQ(batch.getShared().size(), 1u);
+
+  // The common circuit x^2 + 1, once for all the requests
+  for (helib::Ctxt& shared : batch.getShared()) {
+    shared.square();
+    shared.addConstant(NTL::to_ZZ(1));
+  }
+
+  std::vector<helib::Ctxt> results(requests.size(), helib::Ctxt(publicKey));
+  helib::CtPtrs_vectorCt outs(results);
+  batch.extractAll(outs);
+  for (std::size_t j = 0; j < values.size(); j++) {
+    std::vector<long> expected(nslots, 0), decrypted;
+    for (long i : occupancy[j])
+      expected[i] = (NTL::MulMod(values[j][i], values[j][i], p2r) + 1) % p2r;
+    ea.decrypt(results[j], secretKey, decrypted);
+    EXPECT_EQ(decrypted, expected) << "request " << j;
+  }
+
+  // A single answer in every slot
+  helib::Ctxt replicated(publicKey);
+  batch.extract(replicated, 2, 0);
+  std::vector<long> decrypted;
+  ea.decrypt(replicated, secretKey, decrypted);
+  long answer = (NTL::MulMod(values[2][0], values[2][0], p2r) + 1) % p2r;
+  EXPECT_EQ(decrypted, std::vector<long>(nslots, answer));
+}
+
+TEST_P(TestCtxt, lazyExpressionsMatchTheCtxtOperators)
+{
+  const long p2r = context.getAlMod().getPPowR();
+  std::vector<long> a(ea.size()), b(ea.size()), c(ea.size()), k(ea.size());
+  for (long i = 0; i < ea.size(); i++) {
+    a[i] = NTL::RandomBnd(p2r);
+    b[i] = NTL::RandomBnd(p2r);
+    c[i] = NTL::RandomBnd(p2r);
+    k[i] = NTL::RandomBnd(p2r);
+  }
+  helib::EncodedPtxt encoded;
+  ea.encode(encoded, k);
+  helib::PreparedPtxt prepared(encoded);
+
+  helib::Ctxt ca(publicKey), cb(publicKey), cc(publicKey);
+  ea.encrypt(ca, publicKey, a);
+  ea.encrypt(cb, publicKey, b);
+  ea.encrypt(cc, publicKey, c);
+  // Operands at different levels and with different integer factors
+  cb.multByConstant(NTL::to_ZZ(3));
+  cc.dropSmallAndSpecialPrimes();
+  cc.modDownToSet(cc.naturalPrimeSet());
+
+  helib::Ctxt eager = ca;
+  eager.multByConstant(NTL::to_ZZ(5));
+  eager += cb;
+  helib::Ctxt term = cc;
+  term.multByConstant(prepared);
+  eager -= term;
+
+  helib::Ctxt fused(publicKey);
+  fused = helib::lazy(ca) * 5 + helib::lazy(cb) - helib::lazy(cc) * prepared;
+  EXPECT_TRUE(fused.getPrimeSet() <= cc.getPrimeSet());
+
+  std::vector<long> expected, decrypted;
+  ea.decrypt(eager, secretKey, expected);
+  ea.decrypt(fused, secretKey, decrypted);
+  EXPECT_EQ(decrypted, expected);
+
+  // The result may be one of the operands
+  fused += helib::lazy(fused) * -1 + 2 * helib::lazy(ca);
+  ea.decrypt(fused, secretKey, decrypted);
+  for (long i = 0; i < ea.size(); i++)
+    EXPECT_EQ(decrypted[i], (2 * a[i]) % p2r);
+}
+
+TEST_P(TestCtxt, levelOrderedProductMultipliesTheLowFactorLast)
+{
+  const long n = 5;
+  std::vector<helib::Ptxt<helib::BGV>> ptxts;
+  std::vector<helib::Ctxt> ctxts;
+  for (long i = 0; i < n; i++) {
+    ptxts.emplace_back(context);
+    ptxts.back().random();
+    ctxts.emplace_back(publicKey);
+    publicKey.Encrypt(ctxts.back(), ptxts.back());
+  }
+  // The first factor has used up a level already
+  ctxts[0].multiplyBy(ctxts[0]);
+  ptxts[0] *= ptxts[0];
+
+  std::vector<const helib::Ctxt*> factors;
+  for (const helib::Ctxt& c : ctxts)
+    factors.push_back(&c);
+  helib::Ctxt ordered(publicKey), chained(ctxts[0]);
+  helib::levelOrderedProduct(ordered, factors);
+  for (long i = 1; i < n; i++)
+    chained.multiplyBy(ctxts[i]);
+  EXPECT_TRUE(ordered.inCanonicalForm());
+  EXPECT_GE(ordered.bitCapacity(), chained.bitCapacity());
+
+  helib::Ptxt<helib::BGV> expected = ptxts[0];
+  for (long i = 1; i < n; i++)
+    expected *= ptxts[i];
+  helib::Ptxt<helib::BGV> decrypted(context);
+  secretKey.Decrypt(decrypted, ordered);
+  EXPECT_EQ(decrypted, expected);
+
+  // Deferred leaves the last product extended
+  helib::Ctxt deferred(publicKey);
+  helib::levelOrderedProduct(deferred, factors, helib::RelinPolicy::Deferred);
+  EXPECT_TRUE(deferred.inExtendedForm());
+  secretKey.Decrypt(decrypted, deferred);
+  EXPECT_EQ(decrypted, expected);
+}
+
+TEST_P(TestCtxt, powerMatchesThePlaintextPower)
+{
+  // 39 and 47 take an addition chain shorter than the binary method, 30
+  // the binary method, 32 only squarings and 3p a Frobenius automorphism
+  for (long e : {39l, 47l, 30l, 32l, long(3 * p)}) {
+    helib::Ptxt<helib::BGV> ptxt(context);
+    ptxt.random();
+    helib::Ctxt ctxt(publicKey);
+    publicKey.Encrypt(ctxt, ptxt);
+    ctxt.power(e);
+    ptxt.power(e);
+
+    helib::Ptxt<helib::BGV> result(context);
+    secretKey.Decrypt(result, ctxt);
+    EXPECT_EQ(result, ptxt) << "e = " << e;
+  }
+}
+
 TEST_P(TestCtxtWithBadDimensions,
        frobeniusAutomorphWorksCorrectlyWithBadDimensions)
 {
@@ -233,6 +1500,82 @@ TEST_P(TestCtxt, frobeniusAutomorphWorksCorrectly)
   }
 }
 
+TEST_P(TestCtxt, hoistedAutomorphismsMatchSmartAutomorph)
+{
+  helib::Ptxt<helib::BGV> ptxt(context);
+  ptxt.random();
+  helib::Ctxt ctxt(publicKey);
+  publicKey.Encrypt(ctxt, ptxt);
+
+  helib::Ptxt<helib::BGV> hoisted(context), expected(context);
+  std::vector<helib::Ctxt> frob =
+      helib::buildGeneralAutomorphPrecon(ctxt, -1, ea)
+          ->automorphAll(ea.getDegree(), /*clean=*/true);
+  for (long i = 0; i < ea.getDegree(); ++i) {
+    helib::Ctxt reference(ctxt);
+    reference.frobeniusAutomorph(i);
+    secretKey.Decrypt(hoisted, frob[i]);
+    secretKey.Decrypt(expected, reference);
+    EXPECT_EQ(hoisted, expected) << "Frobenius failed with i=" << i;
+  }
+
+  if (ea.dimension() == 0)
+    return;
+  std::vector<long> ks;
+  for (long i = 0; i < ea.sizeOfDimension(0); ++i)
+    ks.push_back(context.getZMStar().genToPow(0, i));
+  std::vector<helib::Ctxt> rotated =
+      helib::BasicAutomorphPrecon(ctxt).automorph(ks);
+  for (std::size_t i = 0; i < ks.size(); ++i) {
+    helib::Ctxt reference(ctxt);
+    reference.smartAutomorph(ks[i]);
+    secretKey.Decrypt(hoisted, rotated[i]);
+    secretKey.Decrypt(expected, reference);
+    EXPECT_EQ(hoisted, expected) << "automorphism failed with k=" << ks[i];
+  }
+}
+
+TEST_P(TestCtxt, frobeniusCombinationsMatchTheirTerms)
+{
+  const long p2r = context.getAlMod().getPPowR();
+  const long d = ea.getDegree();
+  helib::Ptxt<helib::BGV> ptxt(context);
+  ptxt.random();
+  helib::Ctxt ctxt(publicKey);
+  publicKey.Encrypt(ctxt, ptxt);
+
+  std::vector<helib::DoubleCRT> constants;
+  for (long j = 0; j < d; j++) {
+    NTL::ZZX poly;
+    for (long k = 0; k < context.getPhiM(); k++)
+      SetCoeff(poly, k, NTL::RandomBnd(p2r));
+    constants.emplace_back(poly, context, context.getCtxtPrimes());
+  }
+  std::vector<const helib::DoubleCRT*> constantPtrs;
+  for (const helib::DoubleCRT& c : constants)
+    constantPtrs.push_back(&c);
+
+  std::vector<helib::Ctxt> out(d, helib::Ctxt(publicKey));
+  helib::frobeniusCombinations(helib::CtPtrs_vectorCt(out),
+                               ctxt,
+                               constantPtrs,
+                               std::vector<double>(d, -1.0));
+
+  helib::Ptxt<helib::BGV> decrypted(context), expected(context);
+  for (long i = 0; i < d; i++) {
+    helib::Ctxt sum(helib::ZeroCtxtLike, ctxt);
+    for (long j = 0; j < d; j++) {
+      helib::Ctxt term(ctxt);
+      term.frobeniusAutomorph(j);
+      term.multByConstant(constants[(i + j) % d]);
+      sum += term;
+    }
+    secretKey.Decrypt(decrypted, out[i]);
+    secretKey.Decrypt(expected, sum);
+    EXPECT_EQ(decrypted, expected) << "combination " << i;
+  }
+}
+
 TEST_P(TestCtxtWithBadDimensions, rotate1DRotatesCorrectlyWithBadDimensions)
 {
   std::vector<long> data(ea.size());
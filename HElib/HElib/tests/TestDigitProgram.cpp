@@ -0,0 +1,222 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include <helib/digitProgram.h>
+#include <helib/digitSimulation.h>
+#include <helib/fixedProgram.h>
+#include <helib/polyBundle.h>
+#include <helib/helib.h>
+
+#include "test_common.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+// The p = 2 chain evaluated on a cleartext integer mod 2^r
+std::vector<long> binaryChain(long x, long modulus)
+{
+  auto mod = [modulus](long a) { return ((a % modulus) + modulus) % modulus; };
+  long f2 = mod(x * x);
+  long f4 = mod(f2 * f2);
+  long t8 = mod(94 * f2 + 121 * f4);
+  long f8 = mod(112 * f2 + t8 * t8);
+  long u16 = mod(15364 * f4 - 14115 * f8);
+  long v16 = mod(28504 * f2 + 8968 * f4 - f8);
+  long f16 = mod(11136 * f4 - u16 * v16);
+  return {f2, f4, f8, f16};
+}
+
+TEST(TestDigitProgram, costOnlyCountsTheNeededOutputs)
+{
+  helib::DigitProgram program = helib::DigitProgram::binary();
+  EXPECT_EQ(program.getMaxPrecision(), 16);
+
+  // f2 for rows of size 2, f4 up to 4, f8 up to 8, and f16 beyond
+  std::vector<std::vector<long>> expected{{2, 1, 1, 1},
+                                          {3, 2, 2, 2},
+                                          {5, 3, 3, 3},
+                                          {9, 4, 4, 4},
+                                          {30, 4, 4, 4}};
+  for (const auto& row : expected) {
+    long multiplications, depth;
+    program.cost(multiplications, depth, row[0]);
+    EXPECT_EQ(program.outputsFor(row[0]), row[1]) << "rowSize " << row[0];
+    EXPECT_EQ(multiplications, row[2]) << "rowSize " << row[0];
+    EXPECT_EQ(depth, row[3]) << "rowSize " << row[0];
+  }
+  EXPECT_EQ(program.outputsFor(1), 0);
+}
+
+TEST(TestDigitProgram, parsedProgramMatchesBuiltInChain)
+{
+  std::istringstream text("# p = 2 chain\n"
+                          "square 0\n"
+                          "square 1\n"
+                          "lin 94 1 121 2\n"
+                          "square 3\n"
+                          "lin 112 1 1 4\n"
+                          "lin 15364 2 -14115 5\n"
+                          "lin 28504 1 8968 2 -1 5\n"
+                          "mul 6 7\n"
+                          "lin 11136 2 -1 8\n"
+                          "output 1 2\n"
+                          "output 2 4\n"
+                          "output 5 8\n"
+                          "output 9 16\n");
+  helib::DigitProgram parsed = helib::DigitProgram::parse(text);
+  helib::DigitProgram builtIn = helib::DigitProgram::binary();
+  EXPECT_TRUE(parsed == builtIn);
+
+  helib::Context context = helib::ContextBuilder<helib::BGV>()
+                               .m(45)
+                               .p(2)
+                               .r(16)
+                               .bits(500)
+                               .build();
+  helib::SecKey secretKey(context);
+  secretKey.GenSecKey();
+  const long p2r = context.getAlMod().getPPowR();
+
+  for (long x : {3l, 1234l, 40503l}) {
+    helib::Ctxt ctxt(secretKey);
+    secretKey.Encrypt(ctxt, NTL::ZZX(x), p2r);
+    std::vector<long> expected = binaryChain(x, p2r);
+    for (const helib::DigitProgram* program : {&parsed, &builtIn}) {
+      std::vector<std::pair<helib::Ctxt, long>> ctxtEval;
+      program->evaluate(ctxtEval, ctxt, /*rowSize=*/17);
+      ASSERT_EQ(ctxtEval.size(), expected.size());
+      for (std::size_t k = 0; k < expected.size(); k++) {
+        EXPECT_EQ(ctxtEval[k].second, 2l << k);
+        NTL::ZZX result;
+        secretKey.Decrypt(result, ctxtEval[k].first);
+        EXPECT_EQ(result, NTL::ZZX(expected[k])) << "x = " << x << ", k = " << k;
+      }
+    }
+
+    // A short row only evaluates what it needs
+    std::vector<std::pair<helib::Ctxt, long>> ctxtEval;
+    builtIn.evaluate(ctxtEval, ctxt, /*rowSize=*/3);
+    EXPECT_EQ(ctxtEval.size(), 2u);
+
+    // The compile-time evaluator gives the same results
+    for (long rowSize : {2l, 3l, 5l, 17l}) {
+      std::vector<std::pair<helib::Ctxt, long>> fixedEval;
+      helib::evaluateFixedProgram<helib::BINARY_DIGIT_CHAIN>(fixedEval,
+                                                            ctxt,
+                                                            rowSize);
+      ASSERT_EQ((long)fixedEval.size(), builtIn.outputsFor(rowSize));
+      for (std::size_t k = 0; k < fixedEval.size(); k++) {
+        EXPECT_EQ(fixedEval[k].second, 2l << k);
+        NTL::ZZX result;
+        secretKey.Decrypt(result, fixedEval[k].first);
+        EXPECT_EQ(result, NTL::ZZX(expected[k]))
+            << "x = " << x << ", rowSize = " << rowSize;
+      }
+    }
+  }
+}
+
+TEST(TestDigitProgram, fixedEvaluatorUsesFewTemporaries)
+{
+  // Only x and f2 for a single output, all four outputs share five
+  EXPECT_EQ((helib::FixedEvaluator<helib::BINARY_DIGIT_CHAIN, 1>::temporaries),
+            1);
+  EXPECT_EQ((helib::FixedEvaluator<helib::BINARY_DIGIT_CHAIN, 4>::temporaries),
+            5);
+  static_assert(helib::BINARY_DIGIT_CHAIN.outputsFor(9) == 4,
+                "outputsFor is usable at compile time");
+}
+
+TEST(TestDigitProgram, malformedProgramsThrow)
+{
+  for (const char* text : {"square 1\n",
+                           "mul 0\n",
+                           "lin 3\n",
+                           "lin 0 0\n",
+                           "cube 0\n",
+                           "square 0\noutput 1 4\noutput 1 2\n",
+                           "square x\n"}) {
+    std::istringstream str(text);
+    EXPECT_THROW(helib::DigitProgram::parse(str), helib::InvalidArgument)
+        << text;
+  }
+}
+
+TEST(TestDigitProgram, programsAreLoadedNextToThePolynomials)
+{
+  const std::string bundle = "TestDigitProgram.bin";
+  const std::string file = "slp5.txt";
+  helib::PolynomialBundle::write(bundle, {});
+  {
+    std::ofstream out(file);
+    out << "square 0\nmul 0 1\noutput 2 3\n";
+  }
+  helib::setPolynomialSource(bundle);
+
+  const helib::DigitProgram* program = helib::getDigitProgram(5);
+  ASSERT_NE(program, nullptr);
+  EXPECT_EQ(program->getMaxPrecision(), 3);
+  EXPECT_EQ(helib::getDigitProgram(7), nullptr);
+  // p = 2 falls back to the built-in chain
+  ASSERT_NE(helib::getDigitProgram(2), nullptr);
+  EXPECT_EQ(helib::getDigitProgram(2)->getMaxPrecision(), 16);
+
+  helib::setPolynomialSource("");
+  std::remove(bundle.c_str());
+  std::remove(file.c_str());
+}
+
+TEST(TestDigitProgram, shippedProgramsExtractTheLowestDigit)
+{
+  const std::vector<std::pair<long, long>> shipped{{3, 16},
+                                                   {5, 16},
+                                                   {17, 16},
+                                                   {127, 8}};
+  for (const auto& [p, maxPrecision] : shipped) {
+    helib::DigitProgram program = helib::DigitProgram::read(
+        std::string(HELIB_POLYNOMIALS_DIR) + "/slp" + std::to_string(p) +
+        ".txt");
+    ASSERT_EQ(program.getMaxPrecision(), maxPrecision) << "p = " << p;
+
+    // The largest power of p that the simulation holds in a long
+    long e = 1;
+    while (e < maxPrecision && NTL::power_long(p, e + 1) < (1L << 62))
+      e++;
+    const long ptxtSpace = NTL::power_long(p, e);
+
+    long multiplications, depth;
+    program.cost(multiplications, depth, maxPrecision);
+    for (long d = -p / 2; d <= p / 2; d++)
+      for (long u : {0l, 1l, -7l, 123456789l}) {
+        helib::SimulationCounts counts;
+        helib::SimulatedCtxt<NTL::ZZ> x(p,
+                                        NTL::ZZ(d) + NTL::ZZ(p) * u,
+                                        ptxtSpace,
+                                        &counts);
+        std::vector<std::pair<helib::SimulatedCtxt<NTL::ZZ>, long>> ctxtEval;
+        program.simulate(ctxtEval, x, maxPrecision);
+        ASSERT_EQ((long)ctxtEval.size(), program.outputsFor(maxPrecision));
+        EXPECT_EQ(counts.multiplications, multiplications) << "p = " << p;
+        for (const auto& [result, precision] : ctxtEval) {
+          NTL::ZZ modulus = NTL::power_ZZ(p, std::min(precision, e));
+          EXPECT_TRUE(IsZero((result.getValue() - d) % modulus))
+              << "p = " << p << ", d = " << d << ", precision = " << precision;
+        }
+      }
+  }
+}
+
+} // namespace
@@ -186,6 +186,47 @@ TEST_P(TestHEXL_BGV, encryptDecrypt)
   EXPECT_TRUE(ciphertextMatches(ea, secretKey, p0, c0));
 }
 
+TEST_P(TestHEXL_BGV, rotateAndModSwitch)
+{
+  helib::PtxtArray p0(ea);
+  p0.random();
+
+  helib::Ctxt c0(publicKey);
+  p0.encrypt(c0);
+
+  ea.rotate(c0, 1);
+  rotate(p0, 1);
+  EXPECT_TRUE(ciphertextMatches(ea, secretKey, p0, c0));
+
+  // Drop the top prime, if there is one to spare
+  helib::IndexSet primes = c0.getPrimeSet();
+  if (primes.card() > 1) {
+    c0.modDownToSet(primes / helib::IndexSet(primes.last()));
+    EXPECT_TRUE(ciphertextMatches(ea, secretKey, p0, c0));
+  }
+}
+
+TEST(TestHEXL, fmaAndPermuteMatchScalarCode)
+{
+  const long n = 37; // not a multiple of the vector width
+  const long modulus = 769;
+
+  std::vector<long> a(n), b(n), perm(n), result(n);
+  for (long j = 0; j < n; j++) {
+    a[j] = (j * 17 + 3) % modulus;
+    b[j] = (j * 29 + 11) % modulus;
+    perm[j] = (j * 5) % n; // 5 is invertible mod 37
+  }
+
+  intel::EltwiseFMAMod(result.data(), a.data(), 123, b.data(), n, modulus);
+  for (long j = 0; j < n; j++)
+    EXPECT_EQ(result[j], (a[j] * 123 + b[j]) % modulus);
+
+  intel::Permute(result.data(), a.data(), perm.data(), n);
+  for (long j = 0; j < n; j++)
+    EXPECT_EQ(result[j], a[perm[j]]);
+}
+
 TEST_P(TestHEXL, CModulusFFT)
 {
   NTL::SetNumThreads(1);
@@ -774,6 +774,48 @@ TEST_P(TestIO_BGV, canDecryptWithDeserializedSecretKey)
   EXPECT_EQ(ptxt, decrypted_result);
 }
 
+TEST_P(TestIO_BGV, keysAndCiphertextsRoundTripWithBase64Residues)
+{
+  helib::PtxtArray ptxt(ea), decrypted_result(ea);
+  ptxt.random();
+  helib::Ctxt ctxt(publicKey);
+  ptxt.encrypt(ctxt);
+
+  std::stringstream base64;
+  base64 << helib::jsonBase64Residues << secretKey << ctxt;
+
+  helib::SecKey deserialized_sk = helib::SecKey::readFromJSON(base64, context);
+  helib::Ctxt deserialized_ctxt =
+      helib::Ctxt::readFromJSON(base64, deserialized_sk);
+  EXPECT_EQ(secretKey, deserialized_sk);
+  EXPECT_EQ(ctxt, deserialized_ctxt);
+  decrypted_result.decrypt(deserialized_ctxt, deserialized_sk);
+  EXPECT_EQ(ptxt, decrypted_result);
+}
+
+TEST_P(TestIO_BGV, streamingAndJsonWrapperFormsReadEachOther)
+{
+  helib::PtxtArray ptxt(ea);
+  ptxt.random();
+  helib::Ctxt ctxt(publicKey);
+  ptxt.encrypt(ctxt);
+
+  // The tree puts the keys in alphabetical order, so the rows of every
+  // DoubleCRT come before its index set
+  std::stringstream fromTree;
+  fromTree << ctxt.writeToJSON();
+  helib::Ctxt streamed = helib::Ctxt::readFromJSON(fromTree, publicKey);
+  EXPECT_EQ(ctxt, streamed);
+
+  std::stringstream fromStream;
+  fromStream << helib::jsonBase64Residues << publicKey;
+  json j;
+  fromStream >> j;
+  helib::PubKey deserialized_pk =
+      helib::PubKey::readFromJSON(helib::wrap(j), context);
+  EXPECT_EQ(publicKey, deserialized_pk);
+}
+
 TEST_P(TestIO_BGV, serializeCiphertextWithStreamOperator)
 {
   std::stringstream str;
@@ -1921,9 +1963,12 @@ TEST_P(TestIO_BGV, contextBuilderLogsCorrectly)
   long skHwt = 64;
   long resolution = 1;
   long bitsInSpecialPrimes = 15;
+  long primeBits = 31;
   bool bootstrappableFlag = true;
   bool buildCacheFlag = true;
   bool thickFlag = true;
+  bool polyfunctionFlag = true;
+  bool lazyRecryptDataFlag = true;
 
   // clang-format off
   auto cb = helib::ContextBuilder<helib::BGV>()
@@ -1938,10 +1983,13 @@ TEST_P(TestIO_BGV, contextBuilderLogsCorrectly)
                           .skHwt(skHwt)
                           .resolution(resolution)
                           .bitsInSpecialPrimes(bitsInSpecialPrimes)
+                          .primeBits(primeBits)
                           .bootstrappable(bootstrappableFlag)
                           .mvec(mvec)
                           .buildCache(buildCacheFlag)
-                          .thickboot();
+                          .thickboot()
+                          .polyfunction(polyfunctionFlag)
+                          .lazyRecryptData(lazyRecryptDataFlag);
   // clang-format off
 
   std::stringstream ss;
@@ -1963,10 +2011,13 @@ TEST_P(TestIO_BGV, contextBuilderLogsCorrectly)
                          { "skHwt", skHwt },
                          { "resolution", resolution },
                          { "bitsInSpecialPrimes", bitsInSpecialPrimes },
+                         { "primeBits", primeBits },
                          { "bootstrappableFlag", bootstrappableFlag },
                          { "mvec", mvec },
                          { "buildCacheFlag", buildCacheFlag },
-                         { "thickFlag", thickFlag }
+                         { "thickFlag", thickFlag },
+                         { "polyfunctionFlag", polyfunctionFlag },
+                         { "lazyRecryptDataFlag", lazyRecryptDataFlag }
                       };
 
   EXPECT_EQ(actual_json.at("content"), expected_json);
@@ -1982,6 +2033,7 @@ TEST_P(TestIO_CKKS, contextBuilderLogsCorrectly)
   long skHwt = 64;
   long resolution = 1;
   long bitsInSpecialPrimes = 15;
+  long primeBits = 31;
 
   // clang-format off
   auto cb = helib::ContextBuilder<helib::CKKS>()
@@ -1994,7 +2046,8 @@ TEST_P(TestIO_CKKS, contextBuilderLogsCorrectly)
                           .bits(bits)
                           .skHwt(skHwt)
                           .resolution(resolution)
-                          .bitsInSpecialPrimes(bitsInSpecialPrimes);
+                          .bitsInSpecialPrimes(bitsInSpecialPrimes)
+                          .primeBits(primeBits);
   // clang-format off
 
   std::stringstream ss;
@@ -2014,7 +2067,8 @@ TEST_P(TestIO_CKKS, contextBuilderLogsCorrectly)
                           { "bits", bits },
                           { "skHwt", skHwt },
                           { "resolution", resolution },
-                          { "bitsInSpecialPrimes", bitsInSpecialPrimes } 
+                          { "bitsInSpecialPrimes", bitsInSpecialPrimes },
+                          { "primeBits", primeBits }
                        };
 
   EXPECT_EQ(actual_json.at("content"), expected_json);
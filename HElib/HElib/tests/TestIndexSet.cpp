@@ -0,0 +1,99 @@
+/* Copyright (C) 2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+#include <set>
+
+#include <helib/IndexSet.h>
+#include <helib/IndexMap.h>
+#include "test_common.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+// The elements of s, in increasing order
+std::set<long> elements(const helib::IndexSet& s)
+{
+  std::set<long> result;
+  for (long i : s)
+    result.insert(i);
+  return result;
+}
+
+TEST(TestIndexSet, setsAcrossTheInlineWordsBehaveLikeStdSets)
+{
+  const long big = helib::IndexSet::INLINE_BITS + 70;
+  helib::IndexSet s(3, 66);
+  s.insert(big);
+  s.insert(127);
+  std::set<long> expected;
+  for (long i = 3; i <= 66; i++)
+    expected.insert(i);
+  expected.insert(127);
+  expected.insert(big);
+
+  EXPECT_EQ(elements(s), expected);
+  EXPECT_EQ(s.card(), long(expected.size()));
+  EXPECT_EQ(s.first(), 3);
+  EXPECT_EQ(s.last(), big);
+  EXPECT_EQ(s.next(66), 127);
+  EXPECT_EQ(s.prev(big), 127);
+  EXPECT_EQ(s.prev(127), 66);
+  EXPECT_FALSE(s.isInterval());
+
+  helib::IndexSet t(60, 130);
+  EXPECT_EQ(elements(s & t).size(), 8u);
+  EXPECT_EQ((s | t).card(), s.card() + t.card() - (s & t).card());
+  EXPECT_EQ(s / t, s ^ (s & t));
+  EXPECT_TRUE((s & t) <= s);
+  EXPECT_TRUE(disjoint(s / t, t));
+  EXPECT_FALSE(disjoint(s, t));
+  EXPECT_EQ((s & t) | (s / t), s);
+
+  s.remove(big);
+  EXPECT_EQ(s.last(), 127);
+  s.remove(helib::IndexSet(100, 200));
+  EXPECT_EQ(s, helib::IndexSet(3, 66));
+  EXPECT_TRUE(s.isInterval());
+  s.retain(helib::IndexSet(200, 300));
+  EXPECT_TRUE(empty(s));
+  EXPECT_EQ(s.last(), -1);
+  EXPECT_EQ(s, helib::IndexSet::emptySet());
+}
+
+TEST(TestIndexSet, movedFromSetsAreEmpty)
+{
+  helib::IndexSet s(0, 500);
+  helib::IndexSet moved(std::move(s));
+  EXPECT_EQ(moved.card(), 501);
+  EXPECT_TRUE(empty(s));
+  EXPECT_EQ(elements(s).size(), 0u);
+
+  s = std::move(moved);
+  EXPECT_EQ(s, helib::IndexSet(0, 500));
+  EXPECT_TRUE(empty(moved));
+}
+
+TEST(TestIndexSet, mapElementsAreFreshAfterReinsertion)
+{
+  helib::IndexMap<std::vector<long>> map;
+  map.insert(helib::IndexSet(2, 4));
+  map[3].push_back(7);
+  EXPECT_EQ(map[3].size(), 1u);
+  EXPECT_THROW(map[5].clear(), helib::LogicError);
+
+  map.remove(3);
+  map.insert(3);
+  EXPECT_TRUE(map[3].empty());
+  EXPECT_EQ(map.getIndexSet(), helib::IndexSet(2, 4));
+}
+
+} // namespace
@@ -0,0 +1,145 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+#include <sstream>
+
+#include <helib/helib.h>
+#include <helib/keySetOptimizer.h>
+#include <helib/exceptions.h>
+
+#include "test_common.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+class TestKeySetOptimizer : public ::testing::Test
+{
+protected:
+  const helib::Context context = helib::ContextBuilder<helib::BGV>()
+                                     .m(45)
+                                     .p(19)
+                                     .r(1)
+                                     .bits(300)
+                                     .build();
+  helib::SecKey secretKey;
+
+  TestKeySetOptimizer() : secretKey(context) { secretKey.GenSecKey(); }
+};
+
+TEST_F(TestKeySetOptimizer, profilesRoundTripThroughText)
+{
+  helib::AutomorphismProfile profile;
+  profile.add(2, 5);
+  profile.add(7);
+  profile.add(2);
+
+  std::stringstream str;
+  profile.writeTo(str);
+  helib::AutomorphismProfile read = helib::AutomorphismProfile::readFrom(str);
+  EXPECT_EQ(read.counts(), profile.counts());
+  EXPECT_EQ(read.total(), 7);
+
+  std::istringstream malformed("2 5\n7 x\n");
+  EXPECT_THROW(helib::AutomorphismProfile::readFrom(malformed),
+               helib::IOError);
+}
+
+TEST_F(TestKeySetOptimizer, captureRecordsTheAutomorphismsAskedFor)
+{
+  helib::addAllMatrices(secretKey);
+  helib::Ctxt ctxt(secretKey);
+  secretKey.Encrypt(ctxt, NTL::ZZX(1));
+
+  helib::AutomorphismProfile profile;
+  ctxt.smartAutomorph(2); // not captured
+  {
+    helib::AutomorphismProfile::Capture capture(profile);
+    ctxt.smartAutomorph(2);
+    ctxt.smartAutomorph(2 + 45);
+    ctxt.smartAutomorph(7);
+    ctxt.smartAutomorph(1); // the identity is not an automorphism to key
+    {
+      helib::AutomorphismProfile::Suspend suspend;
+      ctxt.smartAutomorph(7);
+    }
+  }
+  ctxt.smartAutomorph(7); // not captured
+
+  std::map<long, long> expected{{2, 2}, {7, 1}};
+  EXPECT_EQ(profile.counts(), expected);
+}
+
+TEST_F(TestKeySetOptimizer, planKeepsToTheBudgetAndServesTheHeaviestFirst)
+{
+  helib::AutomorphismProfile profile;
+  profile.add(2, 10);
+  profile.add(7, 1);
+  long matrixBytes = helib::keySwitchMatrixBytes(context);
+  ASSERT_GT(matrixBytes, 0);
+
+  helib::KeySetPlan none = helib::planKeySet(context, profile, 0);
+  EXPECT_TRUE(none.keys.empty());
+  EXPECT_EQ(none.unreachable, 11);
+  EXPECT_EQ(none.expectedKeySwitches, none.baseKeySwitches);
+
+  helib::KeySetPlan one = helib::planKeySet(context, profile, matrixBytes);
+  EXPECT_EQ(one.keys, std::set<long>{2});
+  EXPECT_EQ(one.bytes, matrixBytes);
+  EXPECT_LT(one.expectedKeySwitches, none.expectedKeySwitches);
+
+  helib::KeySetPlan all =
+      helib::planKeySet(context, profile, 10 * matrixBytes);
+  EXPECT_LE(all.bytes, 10 * matrixBytes);
+  EXPECT_EQ(all.unreachable, 0);
+  EXPECT_LE(all.expectedKeySwitches, profile.total());
+
+  // The base matrices are not planned again
+  helib::KeySetPlan withBase =
+      helib::planKeySet(context, profile, matrixBytes, {2});
+  EXPECT_EQ(withBase.keys.count(2), 0);
+  EXPECT_EQ(withBase.baseKeySwitches, one.expectedKeySwitches);
+}
+
+TEST_F(TestKeySetOptimizer, optimizedMatricesReachTheProfile)
+{
+  helib::AutomorphismProfile profile;
+  profile.add(2, 3);
+  profile.add(7, 2);
+  long matrixBytes = helib::keySwitchMatrixBytes(context);
+
+  helib::KeySetPlan plan =
+      helib::addOptimizedMatrices(secretKey, profile, 4 * matrixBytes);
+  EXPECT_EQ(plan.unreachable, 0);
+  for (const auto& entry : profile.counts())
+    EXPECT_TRUE(secretKey.isReachable(entry.first));
+
+  // The automorphisms decrypt as X -> X^k
+  NTL::ZZX x;
+  NTL::SetX(x);
+  helib::Ctxt ctxt(secretKey);
+  secretKey.Encrypt(ctxt, x);
+  ctxt.smartAutomorph(7);
+  NTL::ZZX decrypted, expected;
+  secretKey.Decrypt(decrypted, ctxt);
+  NTL::SetCoeff(expected, 7);
+  expected %= context.getZMStar().getPhimX();
+  helib::PolyRed(decrypted, 19, true);
+  helib::PolyRed(expected, 19, true);
+  EXPECT_EQ(decrypted, expected);
+
+  // Planning again from the generated matrices adds nothing
+  helib::KeySetPlan again =
+      helib::addOptimizedMatrices(secretKey, profile, 4 * matrixBytes);
+  EXPECT_TRUE(again.keys.empty());
+}
+
+} // namespace
@@ -0,0 +1,177 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+#include <cstdio>
+#include <fstream>
+
+#include <helib/helib.h>
+#include <helib/matrixEngine.h>
+#include <helib/exceptions.h>
+
+#include "test_common.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+class TestMatrixEngine : public ::testing::Test
+{
+protected:
+  const long p = 19;
+  const long n = 3;
+  const std::string path = "TestMatrixEngine.bin";
+
+  const helib::Context context = helib::ContextBuilder<helib::BGV>()
+                                     .m(45)
+                                     .p(p)
+                                     .r(1)
+                                     .bits(300)
+                                     .build();
+  helib::SecKey secretKey;
+  const helib::EncryptedArray& ea;
+
+  TestMatrixEngine() : secretKey(context), ea(context.getEA())
+  {
+    secretKey.GenSecKey();
+    helib::addSome1DMatrices(secretKey);
+  }
+
+  void TearDown() override { std::remove(path.c_str()); }
+
+  std::vector<long> randomMatrix() const
+  {
+    std::vector<long> m(n * n);
+    for (long& x : m)
+      x = NTL::RandomBnd(p);
+    return m;
+  }
+
+  std::vector<long> product(const std::vector<long>& a,
+                            const std::vector<long>& b) const
+  {
+    std::vector<long> c(n * n, 0);
+    for (long i = 0; i < n; i++)
+      for (long j = 0; j < n; j++)
+        for (long k = 0; k < n; k++)
+          c[i * n + j] = (c[i * n + j] + a[i * n + k] * b[k * n + j]) % p;
+    return c;
+  }
+
+  std::vector<long> decrypt(const helib::MatrixEngine& engine,
+                            const helib::Ctxt& ctxt) const
+  {
+    helib::PtxtArray pa(ea);
+    pa.decrypt(ctxt, secretKey);
+    std::vector<long> m;
+    engine.unpack(m, pa);
+    for (long& x : m)
+      x = helib::mcMod(x, p);
+    return m;
+  }
+};
+
+TEST_F(TestMatrixEngine, mappedWeightsMatchTheInMemoryOnes)
+{
+  std::vector<long> w = randomMatrix();
+  helib::MappedWeights::write(path, n, w);
+  helib::MappedWeights mapped(path);
+  helib::InMemoryWeights inMemory(n, w);
+
+  EXPECT_EQ(mapped.dimension(), n);
+  helib::PtxtArray fromFile(ea), fromMemory(ea);
+  std::vector<long> a, b;
+  for (long k = 0; k < n; k++) {
+    mapped.operand(fromFile, k);
+    inMemory.operand(fromMemory, k);
+    fromFile.store(a);
+    fromMemory.store(b);
+    EXPECT_EQ(a, b);
+  }
+  EXPECT_THROW(mapped.operand(fromFile, n), helib::OutOfRangeError);
+}
+
+TEST_F(TestMatrixEngine, openingAFileThatIsNotAWeightFileThrows)
+{
+  {
+    std::ofstream out(path);
+    out << "not a weight file" << std::endl;
+  }
+  EXPECT_THROW(helib::MappedWeights weights(path), helib::IOError);
+  EXPECT_THROW(helib::MappedWeights weights("no/such/file"), helib::IOError);
+}
+
+TEST_F(TestMatrixEngine, matricesThatDoNotFitTheSlotsThrow)
+{
+  EXPECT_THROW(helib::MatrixEngine(ea, 4), helib::InvalidArgument);
+}
+
+TEST_F(TestMatrixEngine, productsByPlaintextAndEncryptedMatricesAreCorrect)
+{
+  helib::MatrixEngine engine(ea, n);
+  std::vector<long> a = randomMatrix(), b = randomMatrix();
+
+  helib::PtxtArray pa(ea), pb(ea);
+  engine.pack(pa, a);
+  engine.pack(pb, b);
+  helib::Ctxt ca(secretKey), cb(secretKey);
+  pa.encrypt(ca);
+  pb.encrypt(cb);
+
+  helib::Ctxt byPlain(ca);
+  engine.multiply(byPlain, helib::InMemoryWeights(n, b));
+  EXPECT_EQ(decrypt(engine, byPlain), product(a, b));
+
+  helib::MappedWeights::write(path, n, b);
+  helib::Ctxt byMapped(ca);
+  engine.multiply(byMapped, helib::MappedWeights(path));
+  EXPECT_EQ(decrypt(engine, byMapped), product(a, b));
+
+  helib::Ctxt byCtxt(ca);
+  engine.multiply(byCtxt, cb);
+  EXPECT_EQ(decrypt(engine, byCtxt), product(a, b));
+
+  // The square of a, with b aliasing a
+  engine.multiply(ca, ca);
+  EXPECT_EQ(decrypt(engine, ca), product(a, a));
+}
+
+TEST_F(TestMatrixEngine, pipelineAppliesTheLayersToTheBatch)
+{
+  helib::MatrixEngine engine(ea, n);
+  std::vector<long> w1 = randomMatrix(), w2 = randomMatrix();
+  helib::MatrixPipeline pipeline(engine);
+  pipeline.addLayer(std::make_shared<helib::InMemoryWeights>(n, w1));
+  pipeline.addLayer(std::make_shared<helib::InMemoryWeights>(n, w2),
+                    [](helib::Ctxt& x) { x.square(); },
+                    1);
+  EXPECT_EQ(pipeline.size(), 2);
+
+  std::vector<std::vector<long>> inputs = {randomMatrix(), randomMatrix()};
+  std::vector<helib::Ctxt> batch;
+  for (const auto& m : inputs) {
+    helib::PtxtArray pa(ea);
+    engine.pack(pa, m);
+    batch.emplace_back(secretKey);
+    pa.encrypt(batch.back());
+  }
+
+  // No RefreshPolicy, so no bootstrapping
+  EXPECT_EQ(pipeline.run(batch), 0);
+  for (std::size_t i = 0; i < batch.size(); i++) {
+    std::vector<long> y = product(product(inputs[i], w1), w2);
+    // The square is slot-wise
+    for (long& x : y)
+      x = x * x % p;
+    EXPECT_EQ(decrypt(engine, batch[i]), y);
+  }
+}
+
+} // namespace
@@ -0,0 +1,357 @@
+/* Copyright (C) 2020-2021 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <helib/asyncEval.h>
+#include <helib/helib.h>
+#include <helib/matmul.h>
+#include <helib/multicore.h>
+#include <helib/opCounters.h>
+
+#include "test_common.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+// Restore the number of NTL threads at the end of a test
+class TestMulticore : public ::testing::Test
+{
+protected:
+  const long savedThreads = NTL::AvailableThreads();
+  void TearDown() override { NTL::SetNumThreads(savedThreads); }
+};
+
+TEST_F(TestMulticore, nestedLoopsRunEveryIndexOnce)
+{
+  const long outer = 7, inner = 50;
+  for (long threads : {1, 3, 8}) {
+    NTL::SetNumThreads(threads);
+    std::vector<std::atomic<long>> runs(outer * inner);
+    for (auto& r : runs)
+      r = 0;
+    helib::parallelFor(outer, [&](long first, long last) {
+      for (long i = first; i < last; i++)
+        helib::parallelFor(inner, [&](long innerFirst, long innerLast) {
+          for (long j = innerFirst; j < innerLast; j++)
+            runs[i * inner + j]++;
+        });
+    });
+    for (long k = 0; k < outer * inner; k++)
+      EXPECT_EQ(runs[k].load(), 1) << "threads = " << threads << ", k = " << k;
+  }
+}
+
+TEST_F(TestMulticore, oneThreadRunsTheWholeRangeOnTheCaller)
+{
+  NTL::SetNumThreads(1);
+  long calls = 0;
+  helib::parallelFor(10, [&](long first, long last) {
+    calls++;
+    EXPECT_EQ(first, 0);
+    EXPECT_EQ(last, 10);
+  });
+  EXPECT_EQ(calls, 1);
+  EXPECT_EQ(helib::availableThreads(), 1);
+}
+
+TEST_F(TestMulticore, exceptionsReachTheCaller)
+{
+  NTL::SetNumThreads(4);
+  EXPECT_THROW(helib::parallelForEach(16,
+                                      [](long index) {
+                                        if (index == 5)
+                                          throw std::runtime_error("index 5");
+                                      }),
+               std::runtime_error);
+  // The scheduler is still usable afterwards
+  std::atomic<long> runs(0);
+  helib::parallelForEach(16, [&](long) { runs++; });
+  EXPECT_EQ(runs.load(), 16);
+}
+
+TEST_F(TestMulticore, workersCanStartLoopsOfTheirOwn)
+{
+  NTL::SetNumThreads(4);
+  helib::OpCountScope scope;
+  std::atomic<long> expected(0);
+  HELIB_EXEC_INDEX(4, index)
+  // Loops sized by availableThreads() stay parallel on the workers
+  const long cnt = helib::availableThreads();
+  expected += cnt;
+  HELIB_EXEC_INDEX(cnt, innerIndex)
+  helib::countOp(helib::OpType::NTT);
+  HELIB_EXEC_INDEX_END
+  HELIB_EXEC_INDEX_END
+  EXPECT_GE(expected.load(), 4);
+  // The nested workers adopt the scope too
+  EXPECT_EQ(scope.counts()[helib::OpType::NTT], expected.load());
+}
+
+TEST_F(TestMulticore, workersAdoptTheThreadSettings)
+{
+  NTL::SetNumThreads(4);
+  std::set<long> vals;
+  helib::setAutomorphVals(&vals);
+  helib::fhe_test_force_bsgs = 1;
+  std::atomic<long> mismatches(0);
+  HELIB_EXEC_INDEX(16, index)
+  if (helib::fhe_test_force_bsgs != 1 || !helib::isSetAutomorphVals())
+    mismatches++;
+  else
+    helib::recordAutomorphVal(index);
+  HELIB_EXEC_INDEX_END
+  EXPECT_EQ(mismatches.load(), 0);
+  EXPECT_EQ(vals.size(), 16u);
+
+  // Other threads keep their own settings
+  std::thread other([&mismatches]() {
+    if (helib::fhe_test_force_bsgs != 0 || helib::isSetAutomorphVals())
+      mismatches++;
+    helib::fhe_test_force_bsgs = -1;
+  });
+  other.join();
+  EXPECT_EQ(mismatches.load(), 0);
+  EXPECT_EQ(helib::fhe_test_force_bsgs, 1);
+
+  helib::setAutomorphVals(nullptr);
+  helib::fhe_test_force_bsgs = 0;
+}
+
+// A task group per level of a recursion, as in a divide and conquer
+long countLeaves(long depth)
+{
+  if (depth == 0)
+    return 1;
+  long left = 0, right = 0;
+  helib::TaskGroup group;
+  group.run([&]() { left = countLeaves(depth - 1); });
+  group.run([&]() { right = countLeaves(depth - 1); });
+  group.wait();
+  return left + right;
+}
+
+TEST_F(TestMulticore, taskGroupsNestAndRethrow)
+{
+  for (long threads : {1, 4}) {
+    NTL::SetNumThreads(threads);
+    EXPECT_EQ(countLeaves(10), 1024) << "threads = " << threads;
+
+    std::atomic<long> runs(0);
+    helib::TaskGroup group;
+    group.run([&]() { runs++; });
+    group.run([]() { throw std::runtime_error("task"); });
+    group.run([&]() { runs++; });
+    EXPECT_THROW(group.wait(), std::runtime_error);
+    EXPECT_EQ(runs.load(), 2);
+    // The group can be used again
+    group.run([&]() { runs++; });
+    group.wait();
+    EXPECT_EQ(runs.load(), 3);
+  }
+}
+
+TEST_F(TestMulticore, tasksAdoptTheCallerStateOnRequest)
+{
+  NTL::SetNumThreads(4);
+  helib::OpCountScope scope;
+  {
+    helib::TaskGroup group;
+    for (long i = 0; i < 8; i++)
+      group.run(helib::adoptCallerState(
+          []() { helib::countOp(helib::OpType::NTT); }));
+  }
+  EXPECT_EQ(scope.counts()[helib::OpType::NTT], 8);
+}
+
+TEST_F(TestMulticore, rangesAreAtLeastTheGrainSize)
+{
+  NTL::SetNumThreads(8);
+  std::atomic<long> calls(0), covered(0), tooSmall(0);
+  helib::parallelFor(100, 30, [&](long first, long last) {
+    calls++;
+    covered += last - first;
+    if (last - first < 30)
+      tooSmall++;
+  });
+  EXPECT_LE(calls.load(), 3);
+  EXPECT_EQ(covered.load(), 100);
+  EXPECT_EQ(tooSmall.load(), 0);
+}
+
+TEST_F(TestMulticore, pinnedWorkersStillRunLoops)
+{
+  NTL::SetNumThreads(4);
+  bool supported = helib::pinWorkers();
+  std::atomic<long> runs(0);
+  helib::parallelForEach(64, [&](long) { runs++; });
+  EXPECT_EQ(runs.load(), 64);
+  EXPECT_EQ(helib::pinWorkers(false), supported);
+}
+
+TEST_F(TestMulticore, nodeReplicasHoldCopiesOnlyOnSeveralNodes)
+{
+  NTL::SetNumThreads(4);
+  helib::pinWorkers();
+  helib::replicatePerNode();
+  helib::NodeReplicas<long> replicas;
+  bool replicated = helib::nodeCount() > 1;
+  std::atomic<long> wrong(0);
+  helib::parallelForEach(64, [&](long i) {
+    const long* copy = replicas.get(i % 4, [i]() { return 10 * (i % 4); });
+    if (replicated ? copy == nullptr || *copy != 10 * (i % 4)
+                   : copy != nullptr)
+      wrong++;
+  });
+  EXPECT_EQ(wrong.load(), 0);
+
+  helib::replicatePerNode(false);
+  helib::pinWorkers(false);
+  EXPECT_FALSE(helib::replicatingPerNode());
+  EXPECT_EQ(replicas.get(0, []() { return 0L; }), nullptr);
+}
+
+#ifdef HELIB_THREADS
+TEST_F(TestMulticore, asyncEvaluationsStartByPriority)
+{
+  helib::AsyncEvaluator evaluator(1);
+  std::promise<void> release;
+  std::shared_future<void> released = release.get_future().share();
+  auto blocker = evaluator.submit([released]() { released.wait(); });
+
+  std::mutex mx;
+  std::vector<long> order;
+  auto record = [&](long id) {
+    return [&, id]() {
+      std::lock_guard<std::mutex> lock(mx);
+      order.push_back(id);
+      return id;
+    };
+  };
+  helib::CancelToken token;
+  auto low = evaluator.submit(record(1), -1);
+  auto cancelled = evaluator.submit(record(2), 5, token);
+  auto high = evaluator.submit(record(3), 5);
+  auto mid = evaluator.submit(record(4));
+  auto midToo = evaluator.submit(record(5));
+  token.cancel();
+  EXPECT_EQ(evaluator.pending(), 5);
+  release.set_value();
+
+  blocker.get();
+  EXPECT_EQ(low.get(), 1);
+  EXPECT_EQ(high.get(), 3);
+  EXPECT_EQ(mid.get(), 4);
+  EXPECT_EQ(midToo.get(), 5);
+  EXPECT_THROW(cancelled.get(), helib::RuntimeError);
+  EXPECT_EQ(order, std::vector<long>({3, 4, 5, 1}));
+}
+
+TEST_F(TestMulticore, asyncEvaluationsRespectTheConcurrencyLimit)
+{
+  NTL::SetNumThreads(4);
+  std::atomic<long> now(0), most(0);
+  std::vector<std::future<long>> results;
+  {
+    helib::AsyncEvaluator evaluator(2);
+    for (long i = 0; i < 8; i++)
+      results.push_back(evaluator.submit([&, i]() {
+        long n = ++now;
+        for (long m = most.load(); n > m && !most.compare_exchange_weak(m, n);)
+          ;
+        // Loops inside the evaluations run on the shared scheduler
+        std::atomic<long> sum(0);
+        helib::parallelForEach(100, [&](long index) { sum += index; });
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        now--;
+        if (i == 3)
+          throw std::runtime_error("evaluation 3");
+        return sum.load();
+      }));
+  }
+  for (long i = 0; i < 8; i++) {
+    if (i == 3)
+      EXPECT_THROW(results[i].get(), std::runtime_error);
+    else
+      EXPECT_EQ(results[i].get(), 4950);
+  }
+  EXPECT_LE(most.load(), 2);
+  EXPECT_THROW(helib::AsyncEvaluator(0), helib::InvalidArgument);
+}
+
+TEST_F(TestMulticore, executionPoliciesSetTheThreadsOfTheirLoops)
+{
+  NTL::SetNumThreads(8);
+  std::atomic<long> calls(0), nestedWidth(0), covered(0);
+  {
+    helib::ExecutionPolicy policy;
+    policy.threads = 2;
+    helib::ExecutionPolicy::Scope scope(policy);
+    EXPECT_EQ(helib::availableThreads(), 2);
+    HELIB_EXEC_RANGE(100, first, last)
+    calls++;
+    nestedWidth = helib::availableThreads();
+    covered += last - first;
+    HELIB_EXEC_RANGE_END
+  }
+  EXPECT_EQ(calls.load(), 2);
+  EXPECT_EQ(nestedWidth.load(), 2);
+  EXPECT_EQ(covered.load(), 100);
+  EXPECT_EQ(helib::availableThreads(), 8);
+
+  // More threads than NTL's, and urgent loops run as the others do
+  NTL::SetNumThreads(1);
+  calls = 0;
+  covered = 0;
+  {
+    helib::ExecutionPolicy policy;
+    policy.threads = 4;
+    policy.urgent = true;
+    helib::ExecutionPolicy::Scope scope(policy);
+    helib::parallelFor(100, [&](long first, long last) {
+      calls++;
+      covered += last - first;
+    });
+    EXPECT_EQ(countLeaves(4), 16);
+  }
+  EXPECT_EQ(calls.load(), 4);
+  EXPECT_EQ(covered.load(), 100);
+  EXPECT_TRUE(helib::ExecutionPolicy::current().isDefault());
+}
+
+TEST_F(TestMulticore, callerPoliciesTakePrecedenceOverTheContextOnes)
+{
+  helib::Context context = helib::ContextBuilder<helib::BGV>().m(17).build();
+  EXPECT_TRUE(context.effectiveExecutionPolicy().isDefault());
+
+  helib::ExecutionPolicy background;
+  background.threads = 1;
+  context.setExecutionPolicy(background);
+  EXPECT_EQ(context.effectiveExecutionPolicy().threads, 1);
+
+  helib::ExecutionPolicy critical;
+  critical.threads = 6;
+  critical.urgent = true;
+  helib::ExecutionPolicy::Scope scope(critical);
+  EXPECT_EQ(context.effectiveExecutionPolicy().threads, 6);
+  EXPECT_TRUE(context.effectiveExecutionPolicy().urgent);
+}
+#endif
+
+} // namespace
@@ -0,0 +1,189 @@
+/* Copyright (C) 2020-2021 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+#include <thread>
+
+#include <helib/helib.h>
+#include <helib/fhe_stats.h>
+#include <helib/opCounters.h>
+
+#include "test_common.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+TEST(TestOpCounters, scopesCountOnlyTheirRegion)
+{
+  helib::countOp(helib::OpType::KeySwitch);
+  helib::OpCountScope outer;
+  helib::countOp(helib::OpType::KeySwitch, 2);
+  {
+    helib::OpCountScope inner;
+    EXPECT_EQ(helib::OpCountScope::current(), &inner);
+    helib::countOp(helib::OpType::Automorphism);
+    EXPECT_EQ(inner.counts()[helib::OpType::Automorphism], 1);
+    EXPECT_EQ(inner.counts()[helib::OpType::KeySwitch], 0);
+  }
+  EXPECT_EQ(helib::OpCountScope::current(), &outer);
+  EXPECT_EQ(outer.counts()[helib::OpType::KeySwitch], 2);
+  EXPECT_EQ(outer.counts()[helib::OpType::Automorphism], 1);
+  EXPECT_EQ(outer.counts()[helib::OpType::NTT], 0);
+}
+
+TEST(TestOpCounters, threadCountsIncludeEveryScope)
+{
+  helib::OpCounts before = helib::threadOpCounts();
+  {
+    helib::OpCountScope scope;
+    helib::countOp(helib::OpType::ModSwitch, 3);
+  }
+  helib::countOp(helib::OpType::ModSwitch);
+  helib::OpCounts expected;
+  expected[helib::OpType::ModSwitch] = 4;
+  EXPECT_EQ(helib::threadOpCounts() - before, expected);
+}
+
+TEST(TestOpCounters, workersOfParallelRegionsAdoptTheScope)
+{
+  const long n = 16;
+  helib::OpCountScope scope;
+  HELIB_EXEC_RANGE(n, first, last)
+  for (long i = first; i < last; i++)
+    helib::countOp(helib::OpType::NTT);
+  HELIB_EXEC_RANGE_END
+  EXPECT_EQ(scope.counts()[helib::OpType::NTT], n);
+
+  const long cnt = NTL::AvailableThreads();
+  HELIB_EXEC_INDEX(cnt, index)
+  helib::countOp(helib::OpType::TensorProduct, index + 1);
+  HELIB_EXEC_INDEX_END
+  EXPECT_EQ(scope.counts()[helib::OpType::TensorProduct], cnt * (cnt + 1) / 2);
+}
+
+TEST(TestOpCounters, totalsIncludeFinishedThreads)
+{
+  helib::OpCounts before = helib::totalOpCounts();
+  helib::OpCountScope scope;
+  std::thread worker([&scope]() {
+    helib::OpCountScope::Adopt adopt(&scope);
+    helib::countOp(helib::OpType::Relinearization, 5);
+  });
+  worker.join();
+  EXPECT_EQ(scope.counts()[helib::OpType::Relinearization], 5);
+  EXPECT_GE((helib::totalOpCounts() - before)[helib::OpType::Relinearization],
+            5);
+}
+
+TEST(TestOpCounters, multiplicationIsCounted)
+{
+  helib::Context context = helib::ContextBuilder<helib::BGV>()
+                               .m(45)
+                               .p(1009)
+                               .r(1)
+                               .bits(300)
+                               .build();
+  helib::SecKey secretKey(context);
+  secretKey.GenSecKey();
+  helib::addSome1DMatrices(secretKey);
+  const helib::PubKey& publicKey = secretKey;
+
+  helib::Ptxt<helib::BGV> ptxt(context);
+  helib::Ctxt ctxt(publicKey);
+  publicKey.Encrypt(ctxt, ptxt);
+
+  helib::OpCountScope scope;
+  ctxt.multiplyBy(ctxt);
+  helib::OpCounts ops = scope.counts();
+  EXPECT_EQ(ops[helib::OpType::TensorProduct], 1);
+  EXPECT_EQ(ops[helib::OpType::Relinearization], 1);
+  EXPECT_GE(ops[helib::OpType::KeySwitch], 1);
+  EXPECT_GT(ops[helib::OpType::NTT], 0);
+  EXPECT_EQ(ops[helib::OpType::RelinKeySwitch], 1);
+  EXPECT_EQ(ops[helib::OpType::AutomorphKeySwitch], 0);
+  EXPECT_GE(ops[helib::OpType::Digit], ops[helib::OpType::KeySwitch]);
+  EXPECT_GT(ops.averagePrimes(helib::OpType::RelinKeySwitch), 0);
+  EXPECT_GE(ops.averagePrimes(helib::OpType::TensorProduct),
+            ops.averagePrimes(helib::OpType::RelinKeySwitch));
+
+  helib::OpCountScope rotation;
+  context.getEA().rotate(ctxt, 1);
+  EXPECT_GE(rotation.counts()[helib::OpType::Automorphism], 1);
+  EXPECT_GE(rotation.counts()[helib::OpType::AutomorphKeySwitch], 1);
+  EXPECT_EQ(rotation.counts()[helib::OpType::RelinKeySwitch], 0);
+
+  helib::OpCountScope constant;
+  ctxt.multByConstant(ptxt);
+  EXPECT_EQ(constant.counts()[helib::OpType::ScalarMult], 1);
+  EXPECT_EQ(constant.counts().averagePrimes(helib::OpType::ScalarMult),
+            ctxt.getPrimeSet().card());
+}
+
+TEST(TestOpCounters, frobeniusKeySwitchesAreCountedApart)
+{
+  helib::Context context = helib::ContextBuilder<helib::BGV>()
+                               .m(45)
+                               .p(2)
+                               .r(1)
+                               .bits(300)
+                               .build();
+  helib::SecKey secretKey(context);
+  secretKey.GenSecKey();
+  helib::addFrbMatrices(secretKey);
+  const helib::PubKey& publicKey = secretKey;
+
+  helib::Ptxt<helib::BGV> ptxt(context);
+  helib::Ctxt ctxt(publicKey);
+  publicKey.Encrypt(ctxt, ptxt);
+
+  helib::OpCountScope scope;
+  ctxt.frobeniusAutomorph(1);
+  EXPECT_GE(scope.counts()[helib::OpType::FrobeniusKeySwitch], 1);
+  EXPECT_EQ(scope.counts()[helib::OpType::AutomorphKeySwitch], 0);
+}
+
+TEST(TestOpCounters, primeSetSizesAreAveraged)
+{
+  helib::OpCountScope scope;
+  helib::countOp(helib::OpType::Digit, 2, 5);
+  helib::countOp(helib::OpType::Digit, 1, 8);
+  helib::countOp(helib::OpType::NTT, 4);
+  helib::OpCounts counts = scope.counts();
+  EXPECT_EQ(counts[helib::OpType::Digit], 3);
+  EXPECT_DOUBLE_EQ(counts.averagePrimes(helib::OpType::Digit), 6.0);
+  EXPECT_EQ(counts.averagePrimes(helib::OpType::NTT), 0.0);
+  EXPECT_EQ(counts.averagePrimes(helib::OpType::ScalarMult), 0.0);
+}
+
+TEST(TestOpCounters, statsAreRecordedOnlyIfEnabled)
+{
+  helib::OpCounts counts;
+  counts[helib::OpType::Relinearization] = 7;
+
+  bool saved = helib::fhe_stats;
+  helib::fhe_stats = false;
+  helib::updateOpCountStats("TestOpCountersDisabled", counts);
+  helib::fhe_stats = true;
+  helib::updateOpCountStats("TestOpCounters", counts);
+  helib::updateOpCountStats("TestOpCounters", counts);
+  helib::fhe_stats = saved;
+
+  EXPECT_EQ(
+      helib::fetch_stats_record("TestOpCountersDisabled-relinearizations"),
+      nullptr);
+  const helib::fhe_stats_record* record =
+      helib::fetch_stats_record("TestOpCounters-relinearizations");
+  ASSERT_NE(record, nullptr);
+  EXPECT_EQ(record->getCount(), 2);
+  EXPECT_EQ(record->getSum(), 14);
+}
+
+} // namespace
@@ -815,6 +815,46 @@ TEST_P(TestPartialMatch, databaseLookupWorksWithQueryAPI)
   EXPECT_EQ(plaintext_result, results);
 }
 
+TEST_P(TestPartialMatch, lookupsFromSharedMasksMatchContains)
+{
+  helib::Matrix<helib::Ptxt<helib::BGV>> plaintext_database(2l, 3l);
+  std::vector<std::vector<long>> plaintext_database_numbers = {
+      {6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6},
+      {7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7},
+      {2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2}};
+  for (int i = 0; i < 3; ++i) {
+    plaintext_database(0, i) =
+        helib::Ptxt<helib::BGV>(context, plaintext_database_numbers[i]);
+    plaintext_database(1, i) =
+        helib::Ptxt<helib::BGV>(context, plaintext_database_numbers[i]);
+  }
+  helib::Database<helib::Ptxt<helib::BGV>> database(plaintext_database,
+                                                    context);
+
+  helib::Matrix<helib::Ptxt<helib::BGV>> query_data(1l, 3l);
+  std::vector<std::vector<long>> query_numbers = {
+      {6, 6, 6, 6, 6, 1, 6, 9, 6, 6, 6, 6},
+      {4, 7, 1, 7, 9, 7, 3, 8, 7, 9, 2, 7},
+      {2, 3, 2, 1, 2, 2, 2, 2, 2, 2, 2, 2}};
+  for (int i = 0; i < 3; ++i)
+    query_data(0, i) = helib::Ptxt<helib::BGV>(context, query_numbers[i]);
+
+  const helib::QueryExpr& a = helib::makeQueryExpr(0);
+  const helib::QueryExpr& b = helib::makeQueryExpr(1);
+  const helib::QueryExpr& c = helib::makeQueryExpr(2);
+  helib::Query_t queryAnd = helib::QueryBuilder(a && b).build(3);
+  helib::Query_t queryOr = helib::QueryBuilder(a || (b && c)).build(3);
+
+  // One set of masks serves every query over the same data
+  auto masks = database.getMasks(query_data);
+  EXPECT_EQ(database.containsFromMasks(queryAnd, masks),
+            database.contains(queryAnd, query_data));
+  EXPECT_EQ(database.containsFromMasks(queryOr, masks),
+            database.contains(queryOr, query_data));
+  EXPECT_EQ(database.getScoreFromMasks(queryAnd, masks),
+            database.getScore(queryAnd, query_data));
+}
+
 TEST_P(TestPartialMatch, scoringWorksWithDatabaseAndQueryAPIs)
 {
   helib::Matrix<helib::Ptxt<helib::BGV>> plaintext_database(2l, 5l);
@@ -12,6 +12,8 @@
 
 /* TestPermutations.cpp - Applying plaintext permutation to encrypted vector
  */
+#include <sstream>
+
 #include <NTL/ZZ.h>
 
 #include <helib/NumbTh.h>
@@ -257,6 +259,41 @@ TEST_P(TestPermutationsBGV, ciphertextPermutationsWithNewAPI)
   EXPECT_EQ(w, v);
 }
 
+TEST_P(TestPermutationsBGV, compiledPermutationsMatchTheNetwork)
+{
+  helib::PermIndepPrecomp pip(context, depth);
+  helib::PermIndepPrecomp cached(context, depth);
+  EXPECT_EQ(cached.getCost(), pip.getCost());
+  EXPECT_EQ(cached.getDepth(), pip.getDepth());
+
+  helib::Permut pi;
+  helib::randomPerm(pi, context.getNSlots());
+  helib::PermPrecomp pp(pip, pi);
+  helib::CompiledPermutation compiled(pp);
+  EXPECT_LE(compiled.depth(), pp.getNetwork().depth());
+
+  std::stringstream str;
+  compiled.writeTo(str);
+  helib::CompiledPermutation read(ea);
+  read.readFrom(str);
+  EXPECT_EQ(read.automorphisms(), compiled.automorphisms());
+
+  helib::PtxtArray v(context);
+  v.random();
+  helib::Ctxt ctxt(publicKey);
+  v.encrypt(ctxt);
+  helib::Ctxt fromRead(ctxt);
+  compiled.apply(ctxt);
+  read.apply(fromRead);
+  pp.apply(v);
+
+  helib::PtxtArray w(context);
+  w.decrypt(ctxt, secretKey);
+  EXPECT_EQ(w, v);
+  w.decrypt(fromRead, secretKey);
+  EXPECT_EQ(w, v);
+}
+
 // This test is in TestPermutations for now as this is where
 // this issue was discovered.
 TEST(TestPermutationsCKKS, ckksFailIfRBitsTooLarge)
@@ -0,0 +1,280 @@
+/* Copyright (C) 2012-2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+#include <cstdio>
+#include <fstream>
+
+#include <helib/polyBundle.h>
+#include <helib/exceptions.h>
+#include <helib/NumbTh.h>
+
+#include <NTL/BasicThreadPool.h>
+
+#include "test_common.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+class TestPolyBundle : public ::testing::Test
+{
+protected:
+  const std::string path = "TestPolyBundle.bin";
+
+  static NTL::ZZX randomPolynomial(long degree, long bits)
+  {
+    NTL::ZZX poly;
+    for (long i = 0; i <= degree; i++) {
+      NTL::ZZ c = NTL::RandomBits_ZZ(bits);
+      if (NTL::RandomBnd(2))
+        NTL::negate(c, c);
+      NTL::SetCoeff(poly, i, c);
+    }
+    NTL::SetCoeff(poly, degree, 1 + NTL::RandomBits_ZZ(bits));
+    return poly;
+  }
+
+  void TearDown() override
+  {
+    helib::setGenerateDigitPolynomials(false);
+    helib::setPolynomialSource("");
+    std::remove(path.c_str());
+  }
+};
+
+TEST_F(TestPolyBundle, decodedPolynomialsMatchWrittenOnes)
+{
+  std::vector<helib::PolynomialBundle::Entry> entries;
+  // Written out of order on purpose, the bundle sorts its index
+  entries.push_back({17, 1, 3, randomPolynomial(40, 200)});
+  entries.push_back({2, 1, 2, randomPolynomial(3, 2)});
+  entries.push_back({2, 1, 5, randomPolynomial(16, 8)});
+  // Sparse polynomial with zero coefficients in between
+  NTL::ZZX sparse;
+  NTL::SetCoeff(sparse, 0, -3);
+  NTL::SetCoeff(sparse, 9, 70000);
+  entries.push_back({127, 6, 7, sparse});
+
+  helib::PolynomialBundle::write(path, entries);
+  helib::PolynomialBundle bundle(path);
+
+  EXPECT_EQ(bundle.size(), (long)entries.size());
+  for (const auto& entry : entries) {
+    ASSERT_TRUE(bundle.contains(entry.p, entry.e_inner, entry.e));
+    NTL::ZZX decoded;
+    bundle.decode(decoded, entry.p, entry.e_inner, entry.e);
+    EXPECT_EQ(decoded, entry.poly);
+  }
+  EXPECT_EQ(bundle.maxPrecision(2, 1), 5);
+  EXPECT_EQ(bundle.maxPrecision(3, 1), 0);
+}
+
+TEST_F(TestPolyBundle, missingEntryThrows)
+{
+  helib::PolynomialBundle::write(path, {{2, 1, 2, NTL::ZZX(1)}});
+  helib::PolynomialBundle bundle(path);
+
+  NTL::ZZX poly;
+  EXPECT_FALSE(bundle.contains(2, 1, 3));
+  EXPECT_THROW(bundle.decode(poly, 2, 1, 3), helib::OutOfRangeError);
+}
+
+TEST_F(TestPolyBundle, bundleCanBeFollowedByOtherData)
+{
+  std::vector<helib::PolynomialBundle::Entry> entries;
+  entries.push_back({3, 1, 2, randomPolynomial(8, 30)});
+  entries.push_back({2, 1, 4, randomPolynomial(5, 3)});
+  entries.push_back({3, 2, 3, randomPolynomial(12, 60)});
+
+  std::size_t bundleEnd;
+  {
+    std::ofstream out(path, std::ios::binary);
+    helib::PolynomialBundle::write(out, entries);
+    bundleEnd = out.tellp();
+    out << "trailing data";
+  }
+  helib::PolynomialBundle bundle(path);
+  EXPECT_EQ(bundle.byteSize(), bundleEnd);
+
+  std::vector<helib::PolynomialBundle::Entry> ofThree = bundle.entries(3);
+  ASSERT_EQ(ofThree.size(), 2u);
+  EXPECT_EQ(ofThree[0].e_inner, 1);
+  EXPECT_EQ(ofThree[0].poly, entries[0].poly);
+  EXPECT_EQ(ofThree[1].e_inner, 2);
+  EXPECT_EQ(ofThree[1].poly, entries[2].poly);
+  EXPECT_TRUE(bundle.entries(5).empty());
+}
+
+TEST_F(TestPolyBundle, openingAFileThatIsNotABundleThrows)
+{
+  {
+    std::ofstream out(path);
+    out << "0 0 4 0 -1 0 -2" << std::endl;
+  }
+  EXPECT_THROW(helib::PolynomialBundle bundle(path), helib::IOError);
+  EXPECT_THROW(helib::PolynomialBundle bundle("no_such_bundle.bin"),
+               helib::IOError);
+}
+
+TEST_F(TestPolyBundle, registryReducesPolynomialsModPToTheE)
+{
+  NTL::ZZX poly;
+  NTL::SetCoeff(poly, 0, 33);  // 1 mod 2^5
+  NTL::SetCoeff(poly, 1, 31);  // -1 mod 2^5
+  NTL::SetCoeff(poly, 2, 64);  // 0 mod 2^5
+  helib::PolynomialBundle::write(path, {{2, 1, 5, poly}});
+  helib::setPolynomialSource(path);
+
+  NTL::ZZX expected;
+  NTL::SetCoeff(expected, 0, 1);
+  NTL::SetCoeff(expected, 1, -1);
+  const NTL::ZZX& first = helib::getDigitPolynomial(2, 1, 5);
+  EXPECT_EQ(first, expected);
+  // Later lookups return the cached entry
+  EXPECT_EQ(&helib::getDigitPolynomial(2, 1, 5), &first);
+  EXPECT_THROW(helib::getDigitPolynomial(2, 1, 6), helib::OutOfRangeError);
+  EXPECT_THROW(helib::getDigitPolynomial(3, 1, 5), helib::OutOfRangeError);
+}
+
+TEST_F(TestPolyBundle, registrySupportsConcurrentLookups)
+{
+  std::vector<helib::PolynomialBundle::Entry> entries;
+  for (long e = 2; e <= 9; e++)
+    entries.push_back({5, 1, e, randomPolynomial(20, 20)});
+  helib::PolynomialBundle::write(path, entries);
+  helib::setPolynomialSource(path);
+
+  const long nLookups = 64;
+  std::vector<const NTL::ZZX*> found(nLookups);
+  NTL_EXEC_RANGE(nLookups, first, last)
+  for (long i = first; i < last; i++)
+    found[i] = &helib::getDigitPolynomial(5, 1, 2 + i % 8);
+  NTL_EXEC_RANGE_END
+
+  for (long i = 0; i < nLookups; i++)
+    EXPECT_EQ(found[i], &helib::getDigitPolynomial(5, 1, 2 + i % 8));
+}
+
+TEST_F(TestPolyBundle, polynomialsInUseAreNotReleased)
+{
+  helib::PolynomialBundle::write(path, {{5, 1, 2, randomPolynomial(9, 20)}});
+  helib::setPolynomialSource(path);
+
+  {
+    helib::DigitPolynomialUse use(5);
+    const NTL::ZZX& poly = helib::getDigitPolynomial(5, 1, 2);
+    EXPECT_THROW(helib::releaseDigitPolynomials(5), helib::LogicError);
+    EXPECT_THROW(helib::setPolynomialSource(path), helib::LogicError);
+    EXPECT_EQ(&helib::getDigitPolynomial(5, 1, 2), &poly);
+    // Other primes are not held
+    helib::releaseDigitPolynomials(7);
+  }
+  helib::releaseDigitPolynomials(5);
+  helib::setPolynomialSource(path);
+}
+
+TEST_F(TestPolyBundle, generatedPolynomialsExtractTheLowestDigit)
+{
+  // Degrees of the polynomials of the Magma scripts
+  struct Case
+  {
+    long p, e_inner, e, degree;
+  };
+  for (const Case& c : std::vector<Case>{{3, 1, 4, 7},
+                                         {5, 1, 3, 9},
+                                         {7, 1, 2, 7},
+                                         {2, 1, 5, 6},
+                                         {3, 2, 5, 5},
+                                         {2, 3, 6, 3}}) {
+    NTL::ZZX poly;
+    helib::generateDigitPolynomial(poly, c.p, c.e_inner, c.e);
+    EXPECT_EQ(deg(poly), c.degree) << "p=" << c.p << ", e_inner=" << c.e_inner;
+
+    // Odd for odd p, even for p = 2 and e_inner = 1
+    if (c.p != 2 || c.e_inner == 1)
+      for (long i = (c.p == 2) ? 1 : 0; i <= deg(poly); i += 2)
+        EXPECT_EQ(coeff(poly, i), 0);
+
+    long q = NTL::power_long(c.p, c.e);
+    long step = NTL::power_long(c.p, c.e_inner);
+    for (long x = 0; x < q; x++) {
+      long digit = x % step;
+      if (digit > step / 2)
+        digit -= step;
+      if (digit < -((c.p - 1) / 2) || digit > c.p / 2)
+        continue; // not an input of precision e_inner
+      long value = helib::polyEvalMod(poly, x, q);
+      EXPECT_EQ(value, (digit + q) % q)
+          << "p=" << c.p << ", e_inner=" << c.e_inner << ", x=" << x;
+    }
+  }
+}
+
+TEST_F(TestPolyBundle, minimizedPolynomialsKeepTheFunction)
+{
+  struct Case
+  {
+    long p, e_inner, e;
+  };
+  for (const Case& c :
+       std::vector<Case>{{3, 1, 4}, {5, 1, 3}, {2, 1, 5}, {3, 2, 5}}) {
+    NTL::ZZX generated;
+    helib::generateDigitPolynomial(generated, c.p, c.e_inner, c.e);
+
+    // Spoil the coefficients with multiples of p^e, keeping the parity
+    long q = NTL::power_long(c.p, c.e);
+    NTL::ZZX poly = generated;
+    for (long i = 0; i <= deg(poly); i++)
+      if (!IsZero(coeff(poly, i)))
+        NTL::SetCoeff(poly, i, coeff(poly, i) + q * (i + 1));
+    helib::minimizeDigitPolynomial(poly, c.p, c.e_inner, c.e);
+    EXPECT_LE(deg(poly), deg(generated));
+
+    // Balanced, and no larger than the generated one, which is balanced too
+    NTL::ZZ half(q / 2), norm(0), generatedNorm(0);
+    for (long i = 0; i <= deg(poly); i++) {
+      EXPECT_LE(abs(coeff(poly, i)), half);
+      norm += abs(coeff(poly, i));
+    }
+    for (long i = 0; i <= deg(generated); i++)
+      generatedNorm += abs(coeff(generated, i));
+    EXPECT_LE(norm, generatedNorm) << "p=" << c.p << ", e_inner=" << c.e_inner;
+
+    long step = NTL::power_long(c.p, c.e_inner);
+    for (long x = 0; x < q; x += step)
+      for (long digit = -((c.p - 1) / 2); digit <= c.p / 2; digit++) {
+        long input = (x + digit + q) % q;
+        EXPECT_EQ(helib::polyEvalMod(poly, input, q), (digit + q) % q)
+            << "p=" << c.p << ", e_inner=" << c.e_inner << ", x=" << input;
+      }
+  }
+}
+
+TEST_F(TestPolyBundle, registryGeneratesMissingPolynomials)
+{
+  NTL::ZZX stored(NTL::INIT_MONO, 1);
+  helib::PolynomialBundle::write(path, {{3, 1, 4, stored}});
+  helib::setPolynomialSource(path);
+  EXPECT_THROW(helib::getDigitPolynomial(3, 1, 5), helib::OutOfRangeError);
+
+  helib::setGenerateDigitPolynomials(true);
+  NTL::ZZX expected;
+  helib::generateDigitPolynomial(expected, 3, 1, 5);
+  EXPECT_EQ(helib::getDigitPolynomial(3, 1, 5), expected);
+  // Polynomials of the source take precedence
+  EXPECT_EQ(helib::getDigitPolynomial(3, 1, 4), stored);
+
+  // Without any source every polynomial is generated
+  helib::setPolynomialSource("no_such_polynomials");
+  EXPECT_EQ(helib::getDigitPolynomial(3, 1, 5), expected);
+}
+
+} // namespace
@@ -0,0 +1,347 @@
+/* Copyright (C) 2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+#include <cstdint>
+#include <memory>
+
+#include <helib/ResidueSlab.h>
+#include <helib/ResidueArena.h>
+#include <helib/memoryStats.h>
+#include <helib/opCounters.h>
+#include <helib/helib.h>
+#include <helib/DualDoubleCRT.h>
+#include "test_common.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+// Fill row j with j*1000 + position
+void fillRows(helib::ResidueSlab& slab)
+{
+  for (long j : slab.getIndexSet())
+    for (long t = 0; t < slab.rowLength(); t++)
+      slab[j][t] = j * 1000 + t;
+}
+
+bool rowsAreFilled(const helib::ResidueSlab& slab, const helib::IndexSet& s)
+{
+  for (long j : s)
+    for (long t = 0; t < slab.rowLength(); t++)
+      if (slab[j][t] != j * 1000 + t)
+        return false;
+  return true;
+}
+
+TEST(TestResidueSlab, rowsAreAlignedAndKeptAcrossResizes)
+{
+  helib::ResidueSlab slab(13);
+  EXPECT_EQ(slab.rowStride() %
+                long(helib::ResidueSlab::ALIGNMENT / sizeof(long)),
+            0);
+  EXPECT_GE(slab.rowStride(), slab.rowLength());
+
+  helib::IndexSet s(2, 5);
+  slab.insert(s);
+  fillRows(slab);
+  for (long j : s)
+    EXPECT_EQ(reinterpret_cast<std::uintptr_t>(slab[j]) %
+                  helib::ResidueSlab::ALIGNMENT,
+              0u);
+
+  slab.insert(helib::IndexSet(7, 8));
+  EXPECT_TRUE(rowsAreFilled(slab, s));
+  for (long t = 0; t < slab.rowLength(); t++)
+    EXPECT_EQ(slab[8][t], 0);
+
+  slab.remove(helib::IndexSet(3));
+  EXPECT_FALSE(slab.getIndexSet().contains(3));
+  EXPECT_TRUE(rowsAreFilled(slab, helib::IndexSet(4, 5)));
+  EXPECT_THROW(slab[3][0] = 0, helib::LogicError);
+}
+
+TEST(TestResidueSlab, copiesCompareEqualAndWritesStayPrivate)
+{
+  helib::ResidueSlab slab(10);
+  slab.insert(helib::IndexSet(0, 3));
+  fillRows(slab);
+
+  helib::ResidueSlab copy(slab);
+  EXPECT_EQ(copy, slab);
+  copy[1][4] = -1;
+  EXPECT_NE(copy, slab);
+  EXPECT_TRUE(rowsAreFilled(slab, slab.getIndexSet()));
+
+  helib::ResidueSlab other(10);
+  other.insert(helib::IndexSet(5));
+  other = slab;
+  EXPECT_EQ(other, slab);
+
+  helib::ResidueSlab moved(std::move(other));
+  EXPECT_EQ(moved, slab);
+  EXPECT_TRUE(helib::empty(other.getIndexSet()));
+}
+
+TEST(TestResidueSlab, copiesShareTheSlabUntilTheFirstWrite)
+{
+  helib::ResidueSlab slab(10);
+  slab.insert(helib::IndexSet(0, 3));
+  fillRows(slab);
+
+  helib::ResidueSlab copy(slab);
+  EXPECT_TRUE(slab.isShared());
+  const helib::ResidueSlab& constCopy = copy;
+  EXPECT_EQ(constCopy[2], static_cast<const helib::ResidueSlab&>(slab)[2]);
+  EXPECT_TRUE(copy.isShared());
+
+  copy[2][0] = -1;
+  EXPECT_FALSE(copy.isShared());
+  EXPECT_FALSE(slab.isShared());
+  EXPECT_TRUE(rowsAreFilled(slab, slab.getIndexSet()));
+  EXPECT_EQ(copy[2][0], -1);
+
+  // Every copy written by its own thread gets its own slab
+  const long n = 8;
+  std::vector<helib::ResidueSlab> copies(n, slab);
+  HELIB_EXEC_RANGE(n, first, last)
+  for (long i = first; i < last; i++)
+    copies[i][1][0] = i;
+  HELIB_EXEC_RANGE_END
+  for (long i = 0; i < n; i++) {
+    EXPECT_EQ(copies[i][1][0], i);
+    EXPECT_EQ(copies[i][1][1], 1001);
+  }
+  EXPECT_TRUE(rowsAreFilled(slab, slab.getIndexSet()));
+  EXPECT_FALSE(slab.isShared());
+}
+
+TEST(TestResidueSlab, parallelWritesNeedAUniqueSlab)
+{
+  helib::ResidueSlab slab(10);
+  slab.insert(helib::IndexSet(0, 7));
+  fillRows(slab);
+
+  helib::ResidueSlab copy(slab);
+  EXPECT_THROW(copy.uniqueRow(0), helib::LogicError);
+
+  // Unshared once before the loop, the threads write their own rows
+  copy.makeUnique();
+  HELIB_EXEC_RANGE(8, first, last)
+  for (long i = first; i < last; i++)
+    copy.uniqueRow(i)[0] = -i;
+  HELIB_EXEC_RANGE_END
+  for (long i = 0; i < 8; i++)
+    EXPECT_EQ(copy[i][0], -i);
+  EXPECT_TRUE(rowsAreFilled(slab, slab.getIndexSet()));
+}
+
+TEST(TestResidueSlab, doubleCRTCopiesAndResizesPreserveValues)
+{
+  helib::Context context = helib::ContextBuilder<helib::BGV>()
+                               .m(45)
+                               .p(1009)
+                               .r(1)
+                               .bits(200)
+                               .build();
+  NTL::ZZX poly;
+  for (long i = 0; i < context.getPhiM(); i++)
+    SetCoeff(poly, i, i - 7);
+
+  helib::DoubleCRT dcrt(poly, context, context.getCtxtPrimes());
+  helib::DoubleCRT copy(dcrt);
+  EXPECT_EQ(copy, dcrt);
+
+  copy.addPrimes(context.getSpecialPrimes());
+  copy.removePrimes(context.getSpecialPrimes());
+  EXPECT_EQ(copy, dcrt);
+
+  NTL::ZZX back;
+  copy.toPoly(back);
+  EXPECT_EQ(back, poly);
+}
+
+TEST(TestResidueSlab, dualDoubleCRTsTransformOnlyWhenNeeded)
+{
+  helib::Context context = helib::ContextBuilder<helib::BGV>()
+                               .m(45)
+                               .p(1009)
+                               .r(1)
+                               .bits(200)
+                               .build();
+  const helib::IndexSet& s = context.getCtxtPrimes();
+  NTL::ZZX poly, c1, c2;
+  for (long i = 0; i < context.getPhiM(); i++) {
+    SetCoeff(poly, i, i - 7);
+    SetCoeff(c1, i, 3 * i);
+    SetCoeff(c2, i, 1 - i);
+  }
+  helib::DoubleCRT other(c2, context, s);
+
+  // Constants are kept until the evaluation form is needed
+  helib::DualDoubleCRT dual{helib::DoubleCRT(poly, context, s)};
+  dual += c1;
+  dual -= c2;
+  EXPECT_FALSE(dual.hasEval());
+  EXPECT_FALSE(dual.hasCoeffs());
+  dual *= other;
+  EXPECT_TRUE(dual.hasEval());
+
+  helib::DoubleCRT expected(poly, context, s);
+  expected += c1;
+  expected -= c2;
+  expected *= other;
+  EXPECT_EQ(dual.eval(), expected);
+
+  NTL::ZZX back;
+  expected.toPoly(back);
+  EXPECT_EQ(dual.coeffs(), back);
+  EXPECT_TRUE(dual.hasCoeffs());
+
+  // In coefficient form, constants are added without a transform
+  helib::DualDoubleCRT coeffs(poly, context, s);
+  coeffs += c1;
+  coeffs *= 5;
+  EXPECT_FALSE(coeffs.hasEval());
+  NTL::ZZX sum = (poly + c1) * 5;
+  EXPECT_EQ(coeffs.coeffs(), sum);
+  helib::DoubleCRT sumCRT(sum, context, s);
+  EXPECT_EQ(coeffs.eval(), sumCRT);
+  EXPECT_TRUE(coeffs.hasEval() && coeffs.hasCoeffs());
+}
+
+TEST(TestResidueSlab, arenaRecyclesSlabsOfTheSameSize)
+{
+  helib::ResidueArena arena;
+  EXPECT_EQ(helib::ResidueArena::current(), &arena);
+  {
+    helib::ResidueSlab warmup(100);
+    warmup.insert(helib::IndexSet(0, 4));
+  }
+  long allocations = arena.systemAllocations();
+  EXPECT_EQ(allocations, 1);
+
+  for (long i = 0; i < 10; i++) {
+    helib::ResidueSlab slab(100);
+    slab.insert(helib::IndexSet(0, 4));
+    slab[2][7] = i;
+    helib::ResidueSlab copy(slab);
+    EXPECT_EQ(copy[2][7], i);
+  }
+  // One new block for the copy, everything else comes from the cache
+  EXPECT_EQ(arena.systemAllocations(), allocations + 1);
+  EXPECT_GE(arena.reuses(), 19);
+
+  {
+    helib::ResidueArena inner(0); // caches nothing
+    EXPECT_EQ(helib::ResidueArena::current(), &inner);
+    helib::ResidueSlab slab(100);
+    slab.insert(helib::IndexSet(0, 4));
+    EXPECT_EQ(inner.reuses(), 0);
+  }
+  EXPECT_EQ(helib::ResidueArena::current(), &arena);
+}
+
+TEST(TestResidueSlab, slabsOnHugePagesKeepTheirRows)
+{
+  // Rows of 256 KiB, so that the slab spans a few huge pages
+  const long rowLen = 1L << 15;
+  const helib::IndexSet s(0, 9);
+  for (helib::HugePageMode mode :
+       {helib::HugePageMode::TRANSPARENT, helib::HugePageMode::EXPLICIT}) {
+    if (!helib::setHugePageMode(mode))
+      GTEST_SKIP() << "Huge pages are not supported on this platform";
+    EXPECT_EQ(helib::getHugePageMode(), mode);
+    helib::ResidueSlab slab(rowLen);
+    slab.insert(s);
+    fillRows(slab);
+    for (long j : s)
+      EXPECT_EQ(reinterpret_cast<std::uintptr_t>(slab[j]) %
+                    helib::ResidueSlab::ALIGNMENT,
+                0u);
+    helib::ResidueSlab copy(slab);
+    copy.makeUnique();
+    EXPECT_TRUE(rowsAreFilled(copy, s));
+    // Freed after the mode changed, the way it was allocated
+    helib::setHugePageMode(helib::HugePageMode::NONE);
+    EXPECT_TRUE(rowsAreFilled(slab, s));
+  }
+  EXPECT_EQ(helib::getHugePageMode(), helib::HugePageMode::NONE);
+}
+
+TEST(TestResidueSlab, workersOfParallelRegionsAdoptTheArena)
+{
+  helib::ResidueArena arena;
+  const long n = 8;
+  for (long round = 0; round < 2; round++) {
+    HELIB_EXEC_RANGE(n, first, last)
+    for (long i = first; i < last; i++) {
+      EXPECT_EQ(helib::ResidueArena::current(), &arena);
+      helib::ResidueSlab slab(64);
+      slab.insert(helib::IndexSet(0, 1));
+    }
+    HELIB_EXEC_RANGE_END
+  }
+  EXPECT_EQ(arena.systemAllocations() + arena.reuses(), 2 * n);
+  EXPECT_GE(arena.reuses(), n);
+}
+
+TEST(TestResidueSlab, memoryScopesRecordTheHighWaterMarkOfTheResidues)
+{
+  const long before = helib::residueBytes();
+  helib::MemoryScope outer;
+  long slabBytes;
+  {
+    helib::ResidueSlab first(100);
+    first.insert(helib::IndexSet(0, 4));
+    slabBytes = helib::residueBytes() - before;
+    EXPECT_GT(slabBytes, 0);
+
+    helib::MemoryScope inner;
+    {
+      helib::ResidueSlab second(100);
+      second.insert(helib::IndexSet(0, 4));
+    }
+    inner.stop();
+    EXPECT_EQ(inner.peakBytes(), before + 2 * slabBytes);
+    EXPECT_EQ(inner.allocatedBytes(), slabBytes);
+  }
+  EXPECT_EQ(helib::residueBytes(), before);
+
+  {
+    helib::ResidueSlab third(100);
+    third.insert(helib::IndexSet(0, 4));
+  }
+  EXPECT_EQ(outer.peakBytes(), before + 2 * slabBytes);
+  EXPECT_EQ(outer.allocatedBytes(), 3 * slabBytes);
+}
+
+TEST(TestResidueSlab, memoryScopesCanStopInAnyOrder)
+{
+  const long before = helib::residueBytes();
+  auto first = std::make_unique<helib::MemoryScope>();
+  helib::MemoryScope second;
+  long slabBytes;
+  {
+    helib::ResidueSlab slab(100);
+    slab.insert(helib::IndexSet(0, 4));
+    slabBytes = helib::residueBytes() - before;
+  }
+  first->stop();
+  {
+    helib::ResidueSlab slab(100);
+    slab.insert(helib::IndexSet(0, 9));
+  }
+  EXPECT_EQ(first->peakBytes(), before + slabBytes);
+  EXPECT_GT(second.peakBytes(), before + slabBytes);
+  EXPECT_EQ(first->allocatedBytes(), slabBytes);
+}
+
+} // namespace
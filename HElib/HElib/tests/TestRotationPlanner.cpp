@@ -0,0 +1,211 @@
+/* Copyright (C) 2021 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+#include <algorithm>
+
+#include <helib/helib.h>
+#include <helib/rotationPlanner.h>
+
+#include "test_common.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+// m = 31 * 41, with a native dimension of order 30 and a non-native one of
+// order 2
+class TestRotationPlanner : public ::testing::TestWithParam<bool>
+{
+protected:
+  helib::Context context;
+  helib::SecKey secretKey;
+  const helib::EncryptedArray& ea;
+  std::vector<long> values;
+
+  TestRotationPlanner() :
+      context(helib::ContextBuilder<helib::BGV>()
+                  .m(31 * 41)
+                  .p(2)
+                  .r(1)
+                  .bits(300)
+                  .c(2)
+                  .gens({1026, 249})
+                  .ords({30, -2})
+                  .build()),
+      secretKey(context),
+      ea(context.getEA())
+  {
+    secretKey.GenSecKey();
+    // With the minimal matrices, some automorphisms of the plans take
+    // several key switches
+    if (GetParam())
+      helib::addMinimal1DMatrices(secretKey);
+    else
+      helib::addSome1DMatrices(secretKey);
+    for (long i = 0; i < ea.size(); i++)
+      values.push_back(i % 2);
+  }
+
+  helib::Ctxt encrypt(const std::vector<long>& v) const
+  {
+    helib::Ctxt ctxt(secretKey);
+    ea.encrypt(ctxt, secretKey, v);
+    return ctxt;
+  }
+
+  std::vector<long> decrypt(const helib::Ctxt& ctxt) const
+  {
+    std::vector<long> v;
+    ea.decrypt(ctxt, secretKey, v);
+    return v;
+  }
+};
+
+TEST_P(TestRotationPlanner, plansCoverEverySlotOnce)
+{
+  const helib::RotationPlanner& planner = ea.getRotationPlanner();
+  long nSlots = ea.size();
+  for (long amount : {1L, 7L, nSlots - 1, -3L}) {
+    const helib::RotationPlan& plan = planner.plan(amount);
+    EXPECT_EQ(&plan, &planner.plan(amount + nSlots)) << "cached by amount";
+    EXPECT_LE(helib::lsize(plan.automorphisms), 1L << ea.dimension());
+    if (plan.masks.empty())
+      continue;
+    std::vector<long> covered(nSlots, 0);
+    for (const helib::zzX& mask : plan.masks) {
+      std::vector<long> slots;
+      NTL::ZZX poly;
+      helib::convert(poly, mask);
+      ea.decode(slots, poly);
+      for (long j = 0; j < nSlots; j++)
+        covered[j] += slots[j];
+    }
+    EXPECT_EQ(covered, std::vector<long>(nSlots, 1)) << "amount " << amount;
+  }
+}
+
+TEST_P(TestRotationPlanner, rotationsMatchTheSequentialOnes)
+{
+  const helib::RotationPlanner& planner = ea.getRotationPlanner();
+  helib::Ctxt ctxt = encrypt(values);
+  for (long amount : {1L, 5L, 29L, 30L, 31L, ea.size() - 1, -7L}) {
+    helib::Ctxt planned(ctxt), sequential(ctxt);
+    planner.rotate(planned, amount);
+    ea.rotate(sequential, amount);
+    EXPECT_EQ(decrypt(planned), decrypt(sequential)) << "amount " << amount;
+
+    const helib::RotationPlan& plan = planner.plan(amount);
+    EXPECT_GE(planner.plannedKeySwitches(plan, secretKey), 0);
+    EXPECT_GE(planner.sequentialKeySwitches(plan, secretKey), 0);
+  }
+}
+
+TEST_P(TestRotationPlanner, shiftsMatchTheSequentialOnes)
+{
+  const helib::RotationPlanner& planner = ea.getRotationPlanner();
+  helib::Ctxt ctxt = encrypt(values);
+  for (long amount : {1L, 4L, 30L, 33L, -2L, -31L, ea.size()}) {
+    helib::Ctxt planned(ctxt), sequential(ctxt);
+    planner.shift(planned, amount);
+    ea.shift(sequential, amount);
+    EXPECT_EQ(decrypt(planned), decrypt(sequential)) << "amount " << amount;
+  }
+}
+
+TEST_P(TestRotationPlanner, batchedRotationsMatchTheSingleOnes)
+{
+  const helib::RotationPlanner& planner = ea.getRotationPlanner();
+  helib::Ctxt ctxt = encrypt(values);
+  std::vector<long> amounts = {0, 1, 2, 31, 32, 45};
+  std::vector<helib::Ctxt> rotated = planner.rotations(ctxt, amounts);
+  ASSERT_EQ(rotated.size(), amounts.size());
+  for (std::size_t i = 0; i < amounts.size(); i++) {
+    helib::Ctxt expected(ctxt);
+    ea.rotate(expected, amounts[i]);
+    EXPECT_EQ(decrypt(rotated[i]), decrypt(expected))
+        << "amount " << amounts[i];
+  }
+}
+
+TEST_P(TestRotationPlanner, sumsUseThePlannedRotations)
+{
+  long nSlots = ea.size();
+  helib::Ctxt sums = encrypt(values);
+  helib::totalSums(ea, sums);
+  long total = 0;
+  for (long v : values)
+    total += v;
+  EXPECT_EQ(decrypt(sums), std::vector<long>(nSlots, total % 2));
+
+  helib::Ctxt running = encrypt(values);
+  helib::runningSums(ea, running);
+  std::vector<long> expected(nSlots);
+  long partial = 0;
+  for (long j = 0; j < nSlots; j++)
+    expected[j] = (partial += values[j]) % 2;
+  EXPECT_EQ(decrypt(running), expected);
+}
+
+TEST_P(TestRotationPlanner, rotationSums1DMatchTheSequentialOnes)
+{
+  const helib::RotationPlanner& planner = ea.getRotationPlanner();
+  helib::Ctxt ctxt = encrypt(values);
+  for (long i = 0; i < ea.dimension(); i++) {
+    long D = ea.sizeOfDimension(i);
+    std::vector<std::vector<long>> groups = {{1}, {}, {}};
+    for (long a = 2; a < D; a++)
+      groups[1 + a % 2].push_back(a);
+    for (bool zeroFill : {false, true}) {
+      std::vector<helib::Ctxt> sums =
+          planner.rotationSums1D(ctxt, i, groups, zeroFill);
+      ASSERT_EQ(sums.size(), groups.size());
+      for (std::size_t g = 0; g < groups.size(); g++) {
+        std::vector<long> expected(ea.size(), 0);
+        for (long a : groups[g]) {
+          helib::Ctxt tmp(ctxt);
+          if (zeroFill)
+            ea.shift1D(tmp, i, a);
+          else
+            ea.rotate1D(tmp, i, a);
+          std::vector<long> slots = decrypt(tmp);
+          for (long j = 0; j < ea.size(); j++)
+            expected[j] = (expected[j] + slots[j]) % 2;
+        }
+        EXPECT_EQ(decrypt(sums[g]), expected)
+            << "dimension " << i << ", group " << g;
+      }
+    }
+  }
+}
+
+TEST_P(TestRotationPlanner, batchedSumsMatchTheSingleOnes)
+{
+  std::vector<long> shifted(values);
+  std::rotate(shifted.begin(), shifted.begin() + 3, shifted.end());
+  std::vector<helib::Ctxt> totals = {encrypt(values), encrypt(shifted)};
+  std::vector<helib::Ctxt> running(totals);
+  helib::totalSums(ea, totals);
+  helib::runningSums(ea, running);
+  for (std::size_t t = 0; t < totals.size(); t++) {
+    helib::Ctxt total = encrypt(t == 0 ? values : shifted);
+    helib::Ctxt prefix(total);
+    helib::totalSums(ea, total);
+    helib::runningSums(ea, prefix);
+    EXPECT_EQ(decrypt(totals[t]), decrypt(total));
+    EXPECT_EQ(decrypt(running[t]), decrypt(prefix));
+  }
+}
+
+INSTANTIATE_TEST_SUITE_P(KeySets,
+                         TestRotationPlanner,
+                         ::testing::Values(false, true));
+
+} // namespace
@@ -0,0 +1,90 @@
+/* Copyright (C) 2020-2021 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+#include <cmath>
+#include <thread>
+#include <vector>
+
+#include <helib/fhe_stats.h>
+
+#include "test_common.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+TEST(TestStats, recordsKeepCountSumAndExtremes)
+{
+  static helib::fhe_stats_record record("TestStats-extremes");
+  EXPECT_EQ(record.getCount(), 0);
+  EXPECT_EQ(record.getMax(), 0);
+  EXPECT_EQ(record.percentile(0.5), 0);
+
+  for (double val : {3.0, -1.0, 0.0, 10.0})
+    record.update(val);
+  EXPECT_EQ(record.getCount(), 4);
+  EXPECT_EQ(record.getSum(), 12);
+  EXPECT_EQ(record.getMax(), 10);
+  EXPECT_EQ(record.getMin(), -1);
+  EXPECT_EQ(record.percentile(0), -1);
+  EXPECT_EQ(record.percentile(1), 10);
+  EXPECT_EQ(helib::fetch_stats_record("TestStats-extremes"), &record);
+}
+
+TEST(TestStats, bucketsAreLogarithmic)
+{
+  using Record = helib::fhe_stats_record;
+  EXPECT_EQ(Record::bucketOf(0), 0);
+  EXPECT_EQ(Record::bucketOf(-5), 0);
+  EXPECT_EQ(Record::bucketOf(std::ldexp(1.0, Record::MIN_EXP - 1)), 0);
+  EXPECT_EQ(Record::bucketOf(std::ldexp(1.0, Record::MIN_EXP)), 1);
+  EXPECT_EQ(Record::bucketOf(std::ldexp(1.0, Record::MAX_EXP)),
+            Record::BUCKETS - 1);
+  EXPECT_EQ(Record::bucketOf(std::ldexp(1.0, Record::MAX_EXP) * 0.99),
+            Record::BUCKETS - 2);
+  EXPECT_EQ(Record::bucketOf(2) - Record::bucketOf(1),
+            Record::BUCKETS_PER_OCTAVE);
+  EXPECT_EQ(Record::bucketOf(1.2), Record::bucketOf(1));
+  EXPECT_EQ(Record::bucketOf(1.3), Record::bucketOf(1) + 1);
+}
+
+TEST(TestStats, percentilesAreWithinOneBucket)
+{
+  static helib::fhe_stats_record record("TestStats-percentiles");
+  for (long i = 1; i <= 1000; i++)
+    record.update(i);
+  const double width = std::pow(2.0, 1.0 / record.BUCKETS_PER_OCTAVE);
+  for (double q : {0.1, 0.5, 0.9, 0.99}) {
+    double exact = q * 1000;
+    EXPECT_LE(record.percentile(q), exact * width) << "q = " << q;
+    EXPECT_GE(record.percentile(q), exact / width) << "q = " << q;
+  }
+}
+
+TEST(TestStats, concurrentUpdatesAreAllCounted)
+{
+  static helib::fhe_stats_record record("TestStats-concurrent");
+  const long nThreads = 8, n = 10000;
+  std::vector<std::thread> threads;
+  for (long t = 0; t < nThreads; t++)
+    threads.emplace_back([t]() {
+      for (long i = 0; i < n; i++)
+        record.update(t + 1);
+    });
+  for (std::thread& thread : threads)
+    thread.join();
+  EXPECT_EQ(record.getCount(), nThreads * n);
+  EXPECT_EQ(record.getSum(), n * nThreads * (nThreads + 1) / 2);
+  EXPECT_EQ(record.getMax(), nThreads);
+  EXPECT_EQ(record.percentile(1), nThreads);
+}
+
+} // namespace
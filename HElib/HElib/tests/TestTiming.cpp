@@ -0,0 +1,131 @@
+/* Copyright (C) 2020-2021 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+#include <sstream>
+#include <thread>
+
+#include <helib/timing.h>
+
+#include "test_common.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+void timedLeaf() { HELIB_NTIMER_START(TestTiming_leaf); }
+
+void timedBranch()
+{
+  HELIB_NTIMER_START(TestTiming_branch);
+  timedLeaf();
+  timedLeaf();
+}
+
+const helib::TimerTreeNode* findChild(const helib::TimerTreeNode& node,
+                                      const char* name)
+{
+  for (const helib::TimerTreeNode& child : node.children)
+    if (std::string(child.timer->name) == name)
+      return &child;
+  return nullptr;
+}
+
+TEST(TestTiming, nestedTimersAreChildrenOfTheRunningTimer)
+{
+  helib::resetAllTimers();
+  timedBranch();
+  timedLeaf();
+
+  helib::TimerTreeNode tree = helib::getThreadTimerTree();
+  const helib::TimerTreeNode* branch = findChild(tree, "TestTiming_branch");
+  const helib::TimerTreeNode* leaf = findChild(tree, "TestTiming_leaf");
+  ASSERT_NE(branch, nullptr);
+  ASSERT_NE(leaf, nullptr);
+  EXPECT_EQ(branch->numCalls, 1);
+  EXPECT_EQ(leaf->numCalls, 1);
+  const helib::TimerTreeNode* nested = findChild(*branch, "TestTiming_leaf");
+  ASSERT_NE(nested, nullptr);
+  EXPECT_EQ(nested->numCalls, 2);
+  EXPECT_LE(nested->time, branch->time);
+
+  // The flat timers still count every call
+  EXPECT_EQ(helib::getTimerByName("TestTiming_leaf")->getNumCalls(), 3);
+}
+
+TEST(TestTiming, timersStoppedOutOfOrderKeepTheTree)
+{
+  helib::resetAllTimers();
+  {
+    HELIB_NTIMER_START(TestTiming_outer);
+    HELIB_NTIMER_START(TestTiming_inner);
+    HELIB_NTIMER_STOP(TestTiming_outer);
+    timedLeaf();
+  }
+  timedLeaf();
+
+  helib::TimerTreeNode tree = helib::getThreadTimerTree();
+  const helib::TimerTreeNode* outer = findChild(tree, "TestTiming_outer");
+  ASSERT_NE(outer, nullptr);
+  const helib::TimerTreeNode* inner = findChild(*outer, "TestTiming_inner");
+  ASSERT_NE(inner, nullptr);
+  EXPECT_NE(findChild(*inner, "TestTiming_leaf"), nullptr);
+  const helib::TimerTreeNode* leaf = findChild(tree, "TestTiming_leaf");
+  ASSERT_NE(leaf, nullptr);
+  EXPECT_EQ(leaf->numCalls, 1);
+}
+
+TEST(TestTiming, mergedTreeIncludesFinishedThreads)
+{
+  helib::resetAllTimers();
+  timedBranch();
+  std::thread worker(timedBranch);
+  worker.join();
+
+  helib::TimerTreeNode tree = helib::getTimerTree();
+  const helib::TimerTreeNode* branch = findChild(tree, "TestTiming_branch");
+  ASSERT_NE(branch, nullptr);
+  EXPECT_EQ(branch->numCalls, 2);
+  const helib::TimerTreeNode* nested = findChild(*branch, "TestTiming_leaf");
+  ASSERT_NE(nested, nullptr);
+  EXPECT_EQ(nested->numCalls, 4);
+
+  std::ostringstream str;
+  helib::printTimerTree(str);
+  EXPECT_NE(str.str().find("\n    TestTiming_leaf: "), std::string::npos);
+}
+
+TEST(TestTiming, traceHasOneEventPerCallAndOneTrackPerThread)
+{
+  helib::startTimerTrace();
+  timedBranch();
+  std::thread worker(timedLeaf);
+  worker.join();
+  helib::stopTimerTrace();
+  timedLeaf();
+
+  std::ostringstream str;
+  helib::writeTimerTrace(str);
+  const std::string trace = str.str();
+  auto count = [&trace](const std::string& pattern) {
+    long n = 0;
+    for (std::size_t pos = trace.find(pattern); pos != std::string::npos;
+         pos = trace.find(pattern, pos + 1))
+      n++;
+    return n;
+  };
+  EXPECT_EQ(trace.rfind("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", 0),
+            0u);
+  EXPECT_EQ(count("\"name\":\"TestTiming_leaf\""), 3);
+  EXPECT_EQ(count("\"name\":\"TestTiming_branch\""), 1);
+  EXPECT_EQ(count("\"ph\":\"M\""), 2);
+}
+
+} // namespace
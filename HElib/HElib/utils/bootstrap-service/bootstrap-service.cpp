@@ -0,0 +1,274 @@
+/* Copyright (C) 2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+// A resident bootstrapping worker. The context, the public key with its
+// key-switching matrices, the recryption data and the digit extraction
+// polynomials are loaded once; then every request line read from the
+// standard input,
+//
+//   <input-ctxt-file> <output-ctxt-file>
+//
+// bootstraps all the ciphertexts of a container written by encrypt (or by
+// this service) in batches and writes them to a container of the same
+// shape. A line "ok <output> <count> <seconds>" or "error <input>: <what>"
+// answers every request, and the service stops at "quit" or at the end of
+// its input. The input can be a named pipe, or a socket through e.g. socat.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib> // ldiv
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#include <helib/helib.h>
+#include <helib/ArgMap.h>
+#include <helib/polyBundle.h>
+
+#include <NTL/BasicThreadPool.h>
+
+#include "Reader.h"
+#include "Writer.h"
+#include "common.h"
+
+struct CmdLineOpts
+{
+  std::string pkFilePath;
+  std::string bundleFilePath;
+  std::string polynomialsPath;
+  long batchSize = 0;
+  long nthreads = 0; // Default is 0 for number of cpus.
+  long inFlight = 0; // 0 for the batched thinReCrypt
+  long offset = 0;
+  bool thick = false;
+};
+
+class BootstrapService
+{
+public:
+  BootstrapService(const CmdLineOpts& opts,
+                   const helib::Context& context,
+                   const helib::PubKey& pk) :
+      opts(opts), context(context), pk(pk), zero(pk)
+  {}
+
+  // Bootstrap a fresh encryption of zero, so that the polynomials are
+  // decoded and the plans are built before the first request
+  void warmUp() const
+  {
+    helib::Ctxt ctxt(pk);
+    pk.Encrypt(ctxt, helib::Ptxt<helib::BGV>(context));
+    std::vector<helib::Ctxt> ctxts(1, ctxt);
+    bootstrap(ctxts);
+  }
+
+  // Bootstrap every ciphertext of inPath to outPath and return how many
+  // there were
+  long serve(const std::string& inPath, const std::string& outPath)
+  {
+    helib::Ctxt scratch(zero);
+    Reader<helib::Ctxt> reader(inPath, scratch);
+    const long rows = reader.getTOC().getRows();
+    const long cols = reader.getTOC().getCols();
+    Writer<helib::Ctxt> writer(outPath,
+                               rows,
+                               cols,
+                               estimateCtxtSize(context, opts.offset));
+
+    std::vector<helib::Ctxt> ctxts;
+    for (long done = 0; done < rows * cols; done += opts.batchSize) {
+      long bsz = std::min(opts.batchSize, rows * cols - done);
+      ctxts.resize(bsz, zero);
+
+      // The TOC is in column-major order, so is the numbering of the data
+      NTL_EXEC_RANGE(bsz, first, last)
+      Reader<helib::Ctxt> threadReader(reader);
+      for (long i = first; i < last; ++i) {
+        ldiv_t qr = ldiv(done + i, rows);
+        threadReader.readDatum(ctxts[i], qr.rem, qr.quot);
+      }
+      NTL_EXEC_RANGE_END
+      reader.prefetch(done + bsz, done + bsz + opts.batchSize);
+
+      bootstrap(ctxts);
+
+      NTL_EXEC_RANGE(bsz, first, last)
+      Writer<helib::Ctxt> threadWriter(writer);
+      for (long i = first; i < last; ++i) {
+        ldiv_t qr = ldiv(done + i, rows);
+        threadWriter.writeByLocation(ctxts[i], qr.rem, qr.quot);
+      }
+      NTL_EXEC_RANGE_END
+    }
+    return rows * cols;
+  }
+
+private:
+  const CmdLineOpts& opts;
+  const helib::Context& context;
+  const helib::PubKey& pk;
+  const helib::Ctxt zero;
+
+  void bootstrap(std::vector<helib::Ctxt>& ctxts) const
+  {
+    if (opts.thick) {
+      // Thick bootstrapping has no batched form
+      for (auto& ctxt : ctxts)
+        pk.reCrypt(ctxt);
+    } else if (opts.inFlight > 0) {
+      pk.thinReCryptPipelined(helib::PtrVector_vectorT<helib::Ctxt>(ctxts),
+                              opts.inFlight);
+    } else {
+      pk.thinReCrypt(ctxts);
+    }
+  }
+};
+
+// Answer the requests read from in until "quit" or its end
+void serveRequests(BootstrapService& service, std::istream& in)
+{
+  for (std::string line; std::getline(in, line);) {
+    std::istringstream iss(line);
+    std::string inPath, outPath, extra;
+    if (!(iss >> inPath))
+      continue; // blank line
+    if (inPath == "quit")
+      break;
+    if (!(iss >> outPath) || (iss >> extra)) {
+      std::cout << "error " << line
+                << ": expected <input-ctxt-file> <output-ctxt-file>"
+                << std::endl;
+      continue;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    try {
+      long count = service.serve(inPath, outPath);
+      std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start;
+      std::cout << "ok " << outPath << " " << count << " " << elapsed.count()
+                << std::endl;
+    } catch (const std::exception& e) {
+      std::remove(outPath.c_str());
+      // One line per answer
+      std::string what = e.what();
+      for (char& c : what)
+        if (c == '\n')
+          c = ' ';
+      std::cout << "error " << inPath << ": " << what << std::endl;
+    }
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  CmdLineOpts cmdLineOpts;
+
+  // clang-format off
+  helib::ArgMap()
+    .toggle()
+      .arg("--thick", cmdLineOpts.thick,
+           "perform thick bootstrapping.", nullptr)
+    .required()
+    .positional()
+      .arg("<pk-file>", cmdLineOpts.pkFilePath,
+           "the file containing the bootstrappable context and public key, or a worker file.",
+           nullptr)
+    .separator(helib::ArgMap::Separator::WHITESPACE)
+    .named()
+    .optional()
+      .arg("--bootstrap-bundle", cmdLineOpts.bundleFilePath,
+           "read the recryption data from this bundle instead of computing them.",
+           nullptr)
+      .arg("--polynomials", cmdLineOpts.polynomialsPath,
+           "bundle or directory of the digit extraction polynomials.",
+           nullptr)
+      .arg("-b", cmdLineOpts.batchSize,
+           "batch size, how many ctxts in memory. If not set or 0 defaults to the number of threads used.")
+      .arg("-n", cmdLineOpts.nthreads,
+           "number of threads to use. If not set or 0 defaults to the number of concurrent threads supported.", "num. of cores")
+      .arg("--in-flight", cmdLineOpts.inFlight,
+           "pipeline the thin bootstrapping stages with at most this many ctxts in progress. If not set or 0 the ctxts of a batch are bootstrapped together.")
+      .arg("--offset", cmdLineOpts.offset,
+           "byte packing offset in output files.")
+    .parse(argc, argv);
+  // clang-format on
+
+  // Set NTL nthreads
+  if (cmdLineOpts.nthreads == 0) {
+    cmdLineOpts.nthreads = std::thread::hardware_concurrency();
+    // hardware_concurrency may still return 0 if not supported on
+    // implementation.
+    if (cmdLineOpts.nthreads == 0) {
+      std::cerr << "C++ `hardware_concurrency` call not available on this"
+                   "platform.\nnthreads must be explicitly provided."
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (cmdLineOpts.nthreads > 0) {
+    NTL::SetNumThreads(cmdLineOpts.nthreads);
+  } else {
+    std::cerr << "Number of threads must be a positive integer." << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // Set default batch size.
+  if (cmdLineOpts.batchSize == 0) {
+    cmdLineOpts.batchSize = cmdLineOpts.nthreads;
+  }
+
+  // Check batch size above 1.
+  if (cmdLineOpts.batchSize < 1) {
+    std::cerr << "Batch size must be a positive integer." << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (cmdLineOpts.inFlight < 0) {
+    std::cerr << "Number of ctxts in flight must not be negative."
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::unique_ptr<helib::Context> contextp;
+  std::unique_ptr<helib::PubKey> pkp;
+
+  try {
+    // Load Context and PubKey
+    std::tie(contextp, pkp) = loadContextAndKey<helib::PubKey>(
+        cmdLineOpts.pkFilePath,
+        cmdLineOpts.bundleFilePath);
+
+    // After loading, as a worker file sets its own polynomials
+    if (!cmdLineOpts.polynomialsPath.empty())
+      helib::setPolynomialSource(cmdLineOpts.polynomialsPath);
+
+    if (!contextp->isBootstrappable() || contextp->getP() <= 0) {
+      std::cerr << "Context is not bootstrappable" << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    BootstrapService service(cmdLineOpts, *contextp, *pkp);
+    service.warmUp();
+    std::cerr << "Ready" << std::endl;
+
+    serveRequests(service, std::cin);
+  } catch (const std::exception& e) {
+    std::cerr << "Exit due to exception thrown during setup:\n"
+              << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,128 @@
+/* Copyright (C) 2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstdint>
+#include <streambuf>
+#include <string>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Records of the container files start on this boundary, so that every
+// record begins on its own cache line
+constexpr long RECORD_ALIGNMENT = 64;
+
+inline uint64_t alignRecord(uint64_t n)
+{
+  return (n + RECORD_ALIGNMENT - 1) / RECORD_ALIGNMENT * RECORD_ALIGNMENT;
+}
+
+// A whole file mapped into memory, shared with the page cache so that the
+// readers and writers of all threads, and of other processes, see the same
+// pages. Readers and Writers keep one of these in a shared_ptr, so copying
+// them for the threads of a batch costs no system calls.
+class MappedFile
+{
+private:
+  char* bytes = nullptr;
+  uint64_t len = 0;
+
+public:
+  MappedFile(const std::string& path, bool writable)
+  {
+    int fd = ::open(path.c_str(), writable ? O_RDWR : O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("Could not open '" + path + "'.");
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+      ::close(fd);
+      throw std::runtime_error("Could not stat '" + path + "'.");
+    }
+    len = st.st_size;
+    if (len > 0) {
+      void* p = ::mmap(nullptr,
+                       len,
+                       writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                       MAP_SHARED,
+                       fd,
+                       0);
+      if (p == MAP_FAILED) {
+        ::close(fd);
+        throw std::runtime_error("Could not map '" + path + "'.");
+      }
+      bytes = static_cast<char*>(p);
+    }
+    ::close(fd);
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  ~MappedFile()
+  {
+    if (bytes != nullptr) {
+      // Let the kernel write back the dirty pages in the background
+      ::msync(bytes, len, MS_ASYNC);
+      ::munmap(bytes, len);
+    }
+  }
+
+  char* data() const { return bytes; }
+  uint64_t size() const { return len; }
+
+  // Check that [offset, offset + n) lies in the file
+  void checkRange(uint64_t offset, uint64_t n) const
+  {
+    if (offset > len || n > len - offset)
+      throw std::out_of_range("Record at " + std::to_string(offset) +
+                              " extends past the end of the file.");
+  }
+
+  // Ask the kernel to read [offset, offset + n) ahead of its use
+  void prefetch(uint64_t offset, uint64_t n) const
+  {
+    if (bytes == nullptr || n == 0)
+      return;
+    checkRange(offset, n);
+    // madvise wants a page-aligned start
+    const uint64_t page = ::sysconf(_SC_PAGESIZE);
+    uint64_t start = offset / page * page;
+    ::madvise(bytes + start, offset + n - start, MADV_WILLNEED);
+  }
+};
+
+// A stream buffer over a record of a mapped file. Reads and writes stay in
+// the record: reading past its end is end of file, writing past it throws,
+// so a datum larger than the record size cannot overwrite the next one.
+class RecordBuf : public std::streambuf
+{
+public:
+  RecordBuf(char* begin, uint64_t n)
+  {
+    setg(begin, begin, begin + n);
+    setp(begin, begin + n);
+  }
+
+protected:
+  int_type overflow(int_type) override
+  {
+    throw std::length_error("Datum does not fit in its record.");
+  }
+};
+
+#endif // MAPPED_FILE_H
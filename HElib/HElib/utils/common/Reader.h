@@ -15,110 +15,110 @@
 
 #include <vector>
 #include <string>
-#include <fstream>
+#include <istream>
+#include <memory>
 #include <exception>
 
+#include "MappedFile.h"
 #include "TOC.h"
 
+// Reads the data of a TOC-indexed container file, which it maps into memory
+// once. Copies share the mapping and the TOC, so every thread of a batch can
+// have its own Reader without reopening the file, and every datum is read
+// straight from the mapped pages.
 template <typename D>
 class Reader
 {
 
 private:
-  const std::string filepath;
-  std::ifstream readStream;
+  std::shared_ptr<MappedFile> file;
   D& scratch;
   std::shared_ptr<TOC> toc;
 
+  void readAt(D& dest, uint64_t offset) const
+  {
+    file->checkRange(offset, 0);
+    RecordBuf buf(file->data() + offset, file->size() - offset);
+    std::istream in(&buf);
+    dest.read(in);
+  }
+
 public:
   Reader(const std::string& fname, D& init) :
-      filepath(fname),
-      readStream(filepath, std::ios::binary),
+      file(std::make_shared<MappedFile>(fname, /*writable=*/false)),
       scratch(init),
       toc(std::make_shared<TOC>())
   {
-    if (!readStream.is_open())
-      throw std::runtime_error("Could not open '" + filepath + "'.");
-    toc->read(readStream);
-  }
-
-  Reader(const Reader& rdr) :
-      filepath(rdr.filepath),
-      readStream(filepath, std::ios::binary),
-      scratch(rdr.scratch),
-      toc(rdr.toc)
-  {
-    if (!readStream.is_open())
-      throw std::runtime_error("Could not open '" + rdr.filepath + "'.");
+    RecordBuf buf(file->data(), file->size());
+    std::istream in(&buf);
+    toc->read(in);
+    if (!in)
+      throw std::runtime_error("Could not read the TOC of '" + fname + "'.");
   }
 
-  void readDatum(D& dest, int i, int j)
-  {
-    if (readStream.eof())
-      readStream.clear();
+  Reader(const Reader& rdr) = default;
 
-    readStream.seekg(toc->getIdx(i, j));
-    dest.read(readStream);
-  }
+  void readDatum(D& dest, int i, int j) { readAt(dest, toc->getIdx(i, j)); }
 
   std::unique_ptr<D> readDatum(int i, int j)
   {
-    if (readStream.eof())
-      readStream.clear();
-
     std::unique_ptr<D> ptr = std::make_unique<D>(scratch);
-    readStream.seekg(toc->getIdx(i, j));
-    ptr->read(readStream);
+    readAt(*ptr, toc->getIdx(i, j));
 
-    return std::move(ptr);
+    return ptr;
   }
 
   std::unique_ptr<std::vector<std::vector<D>>> readAll()
   {
-    if (readStream.eof())
-      readStream.clear();
-
     auto m_ptr = std::make_unique<std::vector<std::vector<D>>>(
         toc->getRows(),
         std::vector<D>(toc->getCols(), scratch));
 
     for (int i = 0; i < toc->getRows(); i++) {
       for (int j = 0; j < toc->getCols(); j++) {
-        readStream.seekg(toc->getIdx(i, j));
-        (*m_ptr)[i][j].read(readStream);
+        readAt((*m_ptr)[i][j], toc->getIdx(i, j));
       }
     }
 
-    return std::move(m_ptr);
+    return m_ptr;
   }
 
   std::unique_ptr<std::vector<D>> readRow(int i)
   {
-
-    if (readStream.eof())
-      readStream.clear();
-
     auto v_ptr = std::make_unique<std::vector<D>>(toc->getCols(), scratch);
     for (int n = 0; n < toc->getCols(); n++) {
-      readStream.seekg(toc->getIdx(i, n));
-      (*v_ptr)[n].read(readStream);
+      readAt((*v_ptr)[n], toc->getIdx(i, n));
     }
 
-    return std::move(v_ptr);
+    return v_ptr;
   }
 
   std::unique_ptr<std::vector<D>> readCol(int j)
   {
-    if (readStream.eof())
-      readStream.clear();
-
     auto v_ptr = std::make_unique<std::vector<D>>(toc->getRows(), scratch);
     for (int n = 0; n < toc->getRows(); n++) {
-      readStream.seekg(toc->getIdx(n, j));
-      (*v_ptr)[n].read(readStream);
+      readAt((*v_ptr)[n], toc->getIdx(n, j));
     }
 
-    return std::move(v_ptr);
+    return v_ptr;
+  }
+
+  // Ask the kernel to read ahead the records of the data numbered
+  // [first, last) in the column-major order of the TOC, e.g. the next batch
+  // while the current one is being processed
+  void prefetch(uint64_t first, uint64_t last) const
+  {
+    const uint64_t rows = toc->getRows();
+    const uint64_t count = rows * toc->getCols();
+    if (last > count)
+      last = count;
+    if (first >= last)
+      return;
+    uint64_t begin = toc->getIdx(first % rows, first / rows);
+    uint64_t end = (last < count) ? toc->getIdx(last % rows, last / rows)
+                                  : file->size();
+    if (end > begin)
+      file->prefetch(begin, end - begin);
   }
 
   const TOC& getTOC() const { return *toc; }
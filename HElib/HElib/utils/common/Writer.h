@@ -15,9 +15,11 @@
 
 #include <string>
 #include <fstream>
+#include <sstream>
 #include <memory>
 #include <exception>
 
+#include "MappedFile.h"
 #include "TOC.h"
 
 template <typename D>
@@ -26,8 +28,9 @@ class Writer
 
 private:
   std::shared_ptr<TOC> toc;
-  std::fstream writeStream;
+  std::shared_ptr<MappedFile> file;
   const std::string filepath;
+  uint64_t recordSize;
 
   void allocFile(long sizeInBytes) const
   {
@@ -60,50 +63,54 @@ private:
   }
 
 public:
-  // A fresh writer is responsible for setting the TOC.
+  // A fresh writer is responsible for setting the TOC. The records are
+  // rounded up to RECORD_ALIGNMENT bytes and start after the TOC, on that
+  // boundary too.
   Writer(const std::string& fpath,
          uint64_t rows,
          uint64_t cols,
          long recordSizeInBytes) :
-      // File needs alloc in body before stream is opened.
+      // File needs alloc in body before it is mapped.
       toc(std::make_shared<TOC>(rows, cols)),
       filepath(fpath)
   {
-    // Estimate for ctxt sizes.
-    const long tocSize = toc->memorySize();
-    const long fileSize = (cols * rows * recordSizeInBytes) + tocSize;
+    const uint64_t tocSize = alignRecord(toc->memorySize());
+    recordSize = alignRecord(recordSizeInBytes);
+    const long fileSize = (cols * rows * recordSize) + tocSize;
     allocFile(fileSize);
 
     // Set the TOC
     for (uint64_t j = 0; j < cols; ++j)
       for (uint64_t i = 0; i < rows; ++i)
-        toc->setIdx(i, j, (i + j * rows) * recordSizeInBytes + tocSize);
-
-    // Write it to file
-    writeStream.open(fpath, std::ios::in | std::ios::out | std::ios::binary);
-    if (!writeStream.is_open())
-      throw std::runtime_error("Could not open '" + fpath +
-                               "' for writing out TOC.");
-    writeStream.seekp(0);
-    toc->write(writeStream);
-  }
+        toc->setIdx(i, j, (i + j * rows) * recordSize + tocSize);
 
-  // A copied writer is not responsible for setting the TOC.
-  Writer(const Writer& other) :
-      toc(other.toc),
-      writeStream(other.filepath,
-                  std::ios::in | std::ios::out | std::ios::binary),
-      filepath(other.filepath)
-  {
-    if (!writeStream.is_open())
-      throw std::runtime_error("Could not open file '" + other.filepath +
-                               "' for copied Writer.");
+    // Write it to the mapped file
+    file = std::make_shared<MappedFile>(fpath, /*writable=*/true);
+    RecordBuf buf(file->data(), tocSize);
+    std::ostream out(&buf);
+    toc->write(out);
   }
 
+  // A copied writer shares the mapping and the TOC of the original.
+  Writer(const Writer& other) = default;
+
+  // Serialize data straight into its record. Throws if it does not fit in
+  // the record size given to the constructor.
   void writeByLocation(const D& data, uint64_t row, uint64_t col)
   {
-    writeStream.seekp(toc->getIdx(row, col));
-    data.writeTo(writeStream);
+    uint64_t offset = toc->getIdx(row, col);
+    file->checkRange(offset, recordSize);
+    RecordBuf buf(file->data() + offset, recordSize);
+    std::ostream out(&buf);
+    out.exceptions(std::ios::badbit);
+    try {
+      data.writeTo(out);
+    } catch (const std::length_error&) {
+      throw std::length_error("Datum at (" + std::to_string(row) + ", " +
+                              std::to_string(col) +
+                              ") does not fit in its record of " +
+                              std::to_string(recordSize) + " bytes.");
+    }
   }
 
   TOC& getTOC() { return *toc; }
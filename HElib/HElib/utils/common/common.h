@@ -17,6 +17,8 @@
 #include <fstream>
 
 #include <helib/helib.h>
+#include <helib/polyBundle.h>
+#include <helib/polyEval.h>
 
 inline std::string stripExtension(const std::string& s)
 {
@@ -34,8 +36,15 @@ inline std::string readline(std::istream& is)
 template <typename T1, typename T2>
 using uniq_pair = std::pair<std::unique_ptr<T1>, std::unique_ptr<T2>>;
 
+// With a bootstrapBundlePath, the recryption data of a bootstrappable
+// context are read from that bundle (see Context::writeBootstrapBundleTo)
+// instead of being computed. keyFilePath may also be a worker file of
+// create-context, which holds the recryption data and the public key, and
+// whose polynomials become the polynomial source.
 template <typename KEY>
-uniq_pair<helib::Context, KEY> loadContextAndKey(const std::string& keyFilePath)
+uniq_pair<helib::Context, KEY> loadContextAndKey(
+    const std::string& keyFilePath,
+    const std::string& bootstrapBundlePath = "")
 {
   std::ifstream keyFile(keyFilePath, std::ios::binary);
   if (!keyFile.is_open())
@@ -45,8 +54,21 @@ uniq_pair<helib::Context, KEY> loadContextAndKey(const std::string& keyFilePath)
   unsigned long m, p, r;
   std::vector<long> gens, ords;
 
-  std::unique_ptr<helib::Context> contextp(
-      helib::Context::readPtrFrom(keyFile));
+  std::unique_ptr<helib::Context> contextp;
+  if (helib::PolynomialBundle::isBundle(keyFilePath)) {
+    helib::setPolynomialSource(keyFilePath);
+    keyFile.seekg(helib::PolynomialBundle(keyFilePath).byteSize());
+    contextp.reset(helib::Context::readPtrFrom(keyFile, keyFile));
+    contextp->getRcData().digitExtractionPlans->readFrom(keyFile);
+  } else if (bootstrapBundlePath.empty()) {
+    contextp.reset(helib::Context::readPtrFrom(keyFile));
+  } else {
+    std::ifstream bundleFile(bootstrapBundlePath, std::ios::binary);
+    if (!bundleFile.is_open())
+      throw std::runtime_error("Cannot open bootstrap bundle file '" +
+                               bootstrapBundlePath + "'.");
+    contextp.reset(helib::Context::readPtrFrom(keyFile, bundleFile));
+  }
 
   std::unique_ptr<KEY> keyp = std::make_unique<KEY>(*contextp);
   if constexpr (std::is_same_v<KEY, helib::SecKey>) {
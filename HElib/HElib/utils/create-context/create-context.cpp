@@ -16,6 +16,8 @@
 #include <helib/helib.h>
 #include <helib/ArgMap.h>
 #include <helib/debugging.h>
+#include <helib/polyBundle.h>
+#include <helib/polyEval.h>
 
 #include <NTL/BasicThreadPool.h>
 
@@ -27,9 +29,12 @@ struct CmdLineOpts
   std::string outputPrefixPath;
   std::string scheme = "BGV";
   std::string bootstrappable = "NONE"; // NONE | THIN | FAT
+  std::string polynomialsPath;
   bool noSKM = false;
   bool frobSKM = false;
+  bool minimalSKM = false;
   bool infoFile = false;
+  bool workerFile = false;
 };
 
 // Captures parameters of both BGV and CKKS
@@ -52,12 +57,17 @@ void printoutToStream(const helib::Context& context,
                       std::ostream& out,
                       bool noSKM,
                       bool frobSKM,
+                      bool minimalSKM,
                       bool bootstrappable)
 {
-  if (!noSKM || bootstrappable)
-    out << "Key switching matrices created.\n";
-  if (frobSKM || bootstrappable)
-    out << "Frobenius matrices created.\n";
+  if (minimalSKM) {
+    out << "Bootstrapping key switching matrices created.\n";
+  } else {
+    if (!noSKM || bootstrappable)
+      out << "Key switching matrices created.\n";
+    if (frobSKM || bootstrappable)
+      out << "Frobenius matrices created.\n";
+  }
   if (bootstrappable)
     out << "Recrypt data created.\n";
 
@@ -89,6 +99,39 @@ void writeKeyToFile(std::string& pathPrefix,
   }
 }
 
+// Everything a bootstrapping worker loads, in one file: the polynomial
+// bundle of p (first, as its offsets are absolute), the context, its
+// recryption data, the digit extraction plans and the public key.
+void writeWorkerFile(const std::string& pathPrefix,
+                     const helib::Context& context,
+                     const helib::PubKey& pk)
+{
+  std::string path = pathPrefix + ".boot";
+  std::ofstream workerFile(path, std::ios::binary);
+  if (!workerFile.is_open()) {
+    throw std::runtime_error("Cannot write worker file at '" + path + "'.");
+  }
+
+  // Polynomials of a higher precision than the one that is bootstrapped are
+  // never used
+  std::vector<helib::PolynomialBundle::Entry> entries;
+  for (auto& entry : helib::readPolynomialSource(helib::getPolynomialSource(),
+                                                 context.getP())) {
+    if (entry.e <= context.getRcData().e)
+      entries.push_back(std::move(entry));
+  }
+  helib::PolynomialBundle::write(workerFile, std::move(entries));
+
+  context.writeTo(workerFile);
+  context.writeBootstrapBundleTo(workerFile);
+  context.getRcData().digitExtractionPlans->writeTo(workerFile);
+  pk.writeTo(workerFile);
+
+  if (!workerFile) {
+    throw std::runtime_error("Cannot write worker file at '" + path + "'.");
+  }
+}
+
 int main(int argc, char* argv[])
 {
   CmdLineOpts cmdLineOpts;
@@ -100,6 +143,10 @@ int main(int argc, char* argv[])
                "disable switch-key matrices.", nullptr)
          .arg("--frob-skm", cmdLineOpts.frobSKM,
                "generate Frobenius switch-key matrices.", nullptr)
+         .arg("--minimal-skm", cmdLineOpts.minimalSKM,
+               "generate only the switch-key matrices bootstrapping uses.", nullptr)
+         .arg("--worker-file", cmdLineOpts.workerFile,
+               "also write everything a bootstrapping worker loads to one file.", nullptr)
          .arg("--info-file", cmdLineOpts.infoFile,
                "print algebra info to file.", nullptr)
         .separator(helib::ArgMap::Separator::WHITESPACE)
@@ -110,6 +157,9 @@ int main(int argc, char* argv[])
                "choose an output prefix path.", nullptr)
           .arg("--bootstrap", cmdLineOpts.bootstrappable,
                "choose boostrapping option NONE | THIN | THICK.")
+          .arg("--polynomials", cmdLineOpts.polynomialsPath,
+               "bundle or directory of the digit extraction polynomials.",
+               nullptr)
         .required()
         .positional()
           .arg("<params-file>", cmdLineOpts.paramFileName,
@@ -184,6 +234,21 @@ int main(int argc, char* argv[])
     return EXIT_FAILURE;
   }
 
+  if (cmdLineOpts.bootstrappable == "NONE" &&
+      (cmdLineOpts.minimalSKM || cmdLineOpts.workerFile)) {
+    std::cerr << "Minimal switch-key matrices and worker files are only "
+                 "available for bootstrappable contexts."
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (cmdLineOpts.minimalSKM && cmdLineOpts.frobSKM) {
+    std::cerr << "Minimal switch-key matrices cannot be combined with "
+                 "Frobenius matrices."
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
   if (cmdLineOpts.bootstrappable != "NONE") {
     if (cmdLineOpts.noSKM) {
       std::cerr << "Cannot generate bootstrappable context without switch-key "
@@ -243,7 +308,9 @@ int main(int argc, char* argv[])
     secretKey.GenSecKey(); // A +-1/0 secret key
 
     // compute key-switching matrices
-    if (!cmdLineOpts.noSKM || cmdLineOpts.bootstrappable != "NONE") {
+    if (cmdLineOpts.minimalSKM) {
+      helib::addBootstrappingMatrices(secretKey);
+    } else if (!cmdLineOpts.noSKM || cmdLineOpts.bootstrappable != "NONE") {
       helib::addSome1DMatrices(secretKey);
       if (cmdLineOpts.frobSKM || cmdLineOpts.bootstrappable != "NONE") {
         helib::addFrbMatrices(secretKey);
@@ -254,6 +321,19 @@ int main(int argc, char* argv[])
       secretKey.genRecryptData();
     }
 
+    // The plans depend on the polynomials that are available, so the worker
+    // gets those chosen here along with the polynomials themselves
+    if (cmdLineOpts.workerFile) {
+      if (!cmdLineOpts.polynomialsPath.empty())
+        helib::setPolynomialSource(cmdLineOpts.polynomialsPath);
+      const helib::ThinRecryptData& rcData = contextp->getRcData();
+      for (bool lazy : {false, true})
+        rcData.digitExtractionPlans->get(*contextp,
+                                         rcData.e - rcData.ePrime,
+                                         contextp->getAlMod().getR(),
+                                         lazy);
+    }
+
     // If not set by user, returns params file name with truncated UTC
     if (cmdLineOpts.outputPrefixPath.empty()) {
       cmdLineOpts.outputPrefixPath =
@@ -275,12 +355,14 @@ int main(int argc, char* argv[])
                        out,
                        cmdLineOpts.noSKM,
                        cmdLineOpts.frobSKM,
+                       cmdLineOpts.minimalSKM,
                        cmdLineOpts.bootstrappable != "NONE");
     } else {
       printoutToStream(*contextp,
                        std::cout,
                        cmdLineOpts.noSKM,
                        cmdLineOpts.frobSKM,
+                       cmdLineOpts.minimalSKM,
                        cmdLineOpts.bootstrappable != "NONE");
     }
 
@@ -290,6 +372,10 @@ int main(int argc, char* argv[])
     writeKeyToFile(cmdLineOpts.outputPrefixPath, *contextp, secretKey, skOrPk);
     NTL_EXEC_INDEX_END
 
+    if (cmdLineOpts.workerFile) {
+      writeWorkerFile(cmdLineOpts.outputPrefixPath, *contextp, secretKey);
+    }
+
   } catch (const std::invalid_argument& e) {
     std::cerr << "Exit due to invalid argument thrown:\n"
               << e.what() << std::endl;
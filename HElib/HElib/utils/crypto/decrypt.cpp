@@ -100,12 +100,17 @@ void decryptFromTo(const CmdLineOpts& cmdLineOpts,
         threadReader.readDatum(ctxts[i], qr.quot, qr.rem);
       }
     }
+    NTL_EXEC_RANGE_END
 
-    // Decrypt using NTL threads
-    for (long i = first; i < last; ++i) {
-      sk.Decrypt(ptxts[i], ctxts[i]);
+    // With one column the data are stored in the order they are read, so
+    // the next batch can be read ahead while this one is decrypted
+    if (dims.second == 1) {
+      long next = (readBatches + 1) * cmdLineOpts.batchSize;
+      reader.prefetch(next, next + cmdLineOpts.batchSize);
     }
-    NTL_EXEC_RANGE_END
+
+    // Decrypt using NTL threads
+    sk.Decrypt(ptxts, ctxts);
 
     // Write out to stream
     for (const auto& ptxt : ptxts)
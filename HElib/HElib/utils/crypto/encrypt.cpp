@@ -98,16 +98,18 @@ void encryptFromTo(const CmdLineOpts& cmdLineOpts,
       std::getline(dataFile, ptxt_strings[j], '\n');
     }
 
-    // Spread across n threads
-    NTL_EXEC_RANGE(ctxts.size(), first, last)
-    Writer<helib::Ctxt> threadWriter(writer);
+    // Parse and encrypt across n threads
+    NTL_EXEC_RANGE(ptxts.size(), first, last)
     for (long i = first; i < last; ++i) {
       std::istringstream istr(ptxt_strings[i]);
       istr >> ptxts[i];
-      pk.Encrypt(ctxts[i], ptxts[i]);
     }
+    NTL_EXEC_RANGE_END
+    pk.Encrypt(ctxts, ptxts);
 
     // Write to file
+    NTL_EXEC_RANGE(ctxts.size(), first, last)
+    Writer<helib::Ctxt> threadWriter(writer);
     for (long i = first; i < last; ++i) {
       if (dims.second == 1) {
         threadWriter.writeByLocation(ctxts[i],
@@ -0,0 +1,183 @@
+/* Copyright (C) 2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+// Generate the digit extraction polynomials of a plaintext prime on all cores
+// and write them to a binary polynomial bundle, replacing the Magma scripts
+// of Scripts/. The polynomials of an input precision e_inner > 1 are only
+// kept if some of them is cheaper to evaluate than the polynomial of the
+// same precision for e_inner = 1, as otherwise the planner never uses them.
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <map>
+#include <thread>
+
+#include <helib/helib.h>
+#include <helib/ArgMap.h>
+#include <helib/polyBundle.h>
+#include <helib/polyEval.h>
+
+#include <NTL/BasicThreadPool.h>
+
+struct CmdLineOpts
+{
+  long p = 0;
+  long maxPrecision = 0;
+  std::string outputPath;
+  NTL::Vec<long> eInnerList;
+  long nthreads = 0; // Default is 0 for number of cpus.
+  long maxPower = 2;
+  bool lazy = false;
+};
+
+struct Task
+{
+  long e_inner;
+  long e;
+  NTL::ZZX poly;
+  long multiplications = 0;
+};
+
+int main(int argc, char* argv[])
+{
+  CmdLineOpts cmdLineOpts;
+
+  // clang-format off
+  helib::ArgMap()
+        .toggle()
+          .arg("--lazy", cmdLineOpts.lazy,
+               "cost the polynomials for lazy relinearization.", nullptr)
+        .separator(helib::ArgMap::Separator::WHITESPACE)
+        .named()
+          .arg("--e-inner", cmdLineOpts.eInnerList,
+               "input precisions, e.g. \"[1 5 6 16]\". If not set all "
+               "precisions below the maximum are generated.", nullptr)
+          .arg("-n", cmdLineOpts.nthreads,
+               "number of threads to use. If not set or 0 defaults to the "
+               "number of concurrent threads supported.", "num. of cores")
+          .arg("--max-power", cmdLineOpts.maxPower,
+               "highest power of s that can be relinearized.")
+        .required()
+        .positional()
+          .arg("<p>", cmdLineOpts.p, "the plaintext prime.", nullptr)
+          .arg("<max-precision>", cmdLineOpts.maxPrecision,
+               "the largest output precision e.", nullptr)
+          .arg("<bundle-file>", cmdLineOpts.outputPath,
+               "the bundle file to write.", nullptr)
+        .parse(argc, argv);
+  // clang-format on
+
+  if (cmdLineOpts.p < 2 || !NTL::ProbPrime(cmdLineOpts.p)) {
+    std::cerr << "p must be a prime number." << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (cmdLineOpts.maxPrecision < 2) {
+    std::cerr << "The maximum precision must be at least 2." << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // Set NTL nthreads
+  if (cmdLineOpts.nthreads == 0) {
+    cmdLineOpts.nthreads = std::thread::hardware_concurrency();
+    // hardware_concurrency may still return 0 if not supported on
+    // implementation.
+    if (cmdLineOpts.nthreads == 0) {
+      std::cerr << "C++ `hardware_concurrency` call not available on this"
+                   "platform.\nnthreads must be explicitly provided."
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  if (cmdLineOpts.nthreads > 0) {
+    NTL::SetNumThreads(cmdLineOpts.nthreads);
+  } else {
+    std::cerr << "Number of threads must be a positive integer." << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // e_inner = 1 is always generated, it is what the others are compared to
+  std::vector<long> eInners{1};
+  if (cmdLineOpts.eInnerList.length() == 0) {
+    for (long e_inner = 2; e_inner < cmdLineOpts.maxPrecision; e_inner++)
+      eInners.push_back(e_inner);
+  } else {
+    for (long e_inner : cmdLineOpts.eInnerList) {
+      if (e_inner < 1 || e_inner >= cmdLineOpts.maxPrecision) {
+        std::cerr << "Input precisions must be between 1 and the maximum "
+                     "precision."
+                  << std::endl;
+        return EXIT_FAILURE;
+      }
+      if (std::find(eInners.begin(), eInners.end(), e_inner) == eInners.end())
+        eInners.push_back(e_inner);
+    }
+  }
+
+  try {
+    // The cost of a polynomial grows with e / e_inner, so hand out the
+    // expensive ones first for a better balance between the threads
+    std::vector<Task> tasks;
+    for (long e_inner : eInners)
+      for (long e = e_inner + 1; e <= cmdLineOpts.maxPrecision; e++)
+        tasks.push_back({e_inner, e, NTL::ZZX(), 0});
+    std::sort(tasks.begin(), tasks.end(), [](const Task& a, const Task& b) {
+      return a.e * b.e_inner > b.e * a.e_inner;
+    });
+
+    std::atomic<long> next(0);
+    NTL_EXEC_INDEX(NTL::AvailableThreads(), index)
+    for (long i = next++; i < long(tasks.size()); i = next++) {
+      Task& task = tasks[i];
+      helib::generateDigitPolynomial(task.poly,
+                                     cmdLineOpts.p,
+                                     task.e_inner,
+                                     task.e);
+      task.multiplications = helib::getBestParameters({task.poly},
+                                                      cmdLineOpts.lazy,
+                                                      cmdLineOpts.maxPower)
+                                 .multiplications;
+    }
+    NTL_EXEC_INDEX_END
+
+    std::map<long, long> directCost; // e -> multiplications for e_inner = 1
+    for (const Task& task : tasks)
+      if (task.e_inner == 1)
+        directCost[task.e] = task.multiplications;
+
+    // A row is dropped as a whole, as a step of the planner needs all the
+    // polynomials of its precisions
+    std::map<long, bool> keepRow;
+    for (const Task& task : tasks)
+      keepRow[task.e_inner] = keepRow[task.e_inner] || task.e_inner == 1 ||
+                              task.multiplications < directCost[task.e];
+
+    std::vector<helib::PolynomialBundle::Entry> entries;
+    for (Task& task : tasks)
+      if (keepRow[task.e_inner])
+        entries.push_back(
+            {cmdLineOpts.p, task.e_inner, task.e, std::move(task.poly)});
+    helib::PolynomialBundle::write(cmdLineOpts.outputPath, entries);
+
+    for (const auto& [e_inner, keep] : keepRow)
+      if (!keep)
+        std::cout << "Pruned e_inner=" << e_inner
+                  << ", never cheaper than e_inner=1" << std::endl;
+    std::cout << "Wrote " << entries.size() << " polynomials to "
+              << cmdLineOpts.outputPath << std::endl;
+  } catch (const helib::Exception& e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
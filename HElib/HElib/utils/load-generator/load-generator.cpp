@@ -0,0 +1,509 @@
+/* Copyright (C) 2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+// An end-to-end load generator for a bootstrapping server. Simulated
+// clients encrypt random plaintexts and write them to TOC containers (as
+// encrypt does), then submit them to an in-process server. The server is an
+// AsyncEvaluator that reads the container, squares every ciphertext depth
+// times, and bootstraps all the ciphertexts that need it together before
+// each squaring (RefreshPolicy, so with the batched thinReCrypt). It then
+// writes the results to another container. The client reads the result
+// back, decrypts it and checks it.
+//
+// Requests arrive at a given total rate, with exponential inter-arrival
+// times (open loop), or one after the other per client (closed loop). The
+// latency of a request runs from its scheduled arrival to the check of its
+// result, so a server that falls behind shows in the tail. Every interval,
+// the requests completed, the throughput, the requests in flight and the
+// residue memory are printed. At the end, the p50/p99/p999 latencies and
+// the overall throughput are printed.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <thread>
+
+#include <helib/helib.h>
+#include <helib/ArgMap.h>
+#include <helib/asyncEval.h>
+#include <helib/memoryStats.h>
+#include <helib/polyBundle.h>
+#include <helib/refreshPolicy.h>
+
+#include <NTL/BasicThreadPool.h>
+
+#include "Reader.h"
+#include "Writer.h"
+#include "common.h"
+
+using Clock = std::chrono::steady_clock;
+
+struct CmdLineOpts
+{
+  std::string skFilePath;
+  std::string bundleFilePath;
+  std::string polynomialsPath;
+  std::string dir = ".";
+  long clients = 4;
+  double rate = 0;     // 0 for a closed loop
+  double duration = 30;
+  double interval = 1;
+  long ctxts = 1;      // per request
+  long depth = 4;      // squarings per request
+  long concurrent = 1; // requests evaluated at once
+  long nthreads = 0;   // Default is 0 for number of cpus.
+  bool thick = false;
+};
+
+// What the clients report
+class Stats
+{
+public:
+  void record(double seconds, bool correct)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    latencies.push_back(seconds);
+    if (!correct)
+      wrong++;
+  }
+
+  void fail()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    failed++;
+  }
+
+  long completed() const
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return latencies.size();
+  }
+
+  // The latency below which a fraction q of the requests completed
+  double quantile(double q) const
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (latencies.empty())
+      return 0;
+    std::vector<double> sorted(latencies);
+    std::sort(sorted.begin(), sorted.end());
+    long k = std::ceil(q * sorted.size()) - 1;
+    return sorted[std::max(k, 0l)];
+  }
+
+  long failures() const
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return failed;
+  }
+
+  long incorrect() const
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return wrong;
+  }
+
+private:
+  mutable std::mutex mutex;
+  std::vector<double> latencies;
+  long failed = 0;
+  long wrong = 0;
+};
+
+class Server
+{
+public:
+  Server(const CmdLineOpts& opts,
+         const helib::Context& context,
+         const helib::PubKey& pk) :
+      opts(opts),
+      context(context),
+      zero(pk),
+      policy(pk, opts.thick),
+      evaluator(opts.concurrent)
+  {}
+
+  // Evaluate the container inPath into outPath, asynchronously
+  std::future<void> submit(const std::string& inPath,
+                           const std::string& outPath)
+  {
+    inFlight++;
+    return evaluator.submit([this, inPath, outPath]() {
+      struct Done
+      {
+        std::atomic<long>& inFlight;
+        ~Done() { inFlight--; }
+      } done{inFlight};
+      evaluate(inPath, outPath);
+    });
+  }
+
+  long requestsInFlight() const { return inFlight; }
+
+private:
+  const CmdLineOpts& opts;
+  const helib::Context& context;
+  const helib::Ctxt zero;
+  const helib::RefreshPolicy policy;
+  helib::AsyncEvaluator evaluator;
+  std::atomic<long> inFlight{0};
+
+  void evaluate(const std::string& inPath, const std::string& outPath) const
+  {
+    helib::Ctxt scratch(zero);
+    Reader<helib::Ctxt> reader(inPath, scratch);
+    std::vector<helib::Ctxt> ctxts = *reader.readCol(0);
+
+    for (long d = 0; d < opts.depth; d++) {
+      // The ciphertexts that need it are bootstrapped together
+      std::vector<helib::Ctxt*> low;
+      for (helib::Ctxt& ctxt : ctxts)
+        if (policy.needsRefresh(ctxt))
+          low.push_back(&ctxt);
+      if (!low.empty())
+        policy.refresh(helib::PtrVector_vectorPt<helib::Ctxt>(low));
+      helib::parallelForEach(ctxts.size(),
+                             [&](long i) { ctxts[i].square(); });
+    }
+
+    Writer<helib::Ctxt> writer(outPath,
+                               ctxts.size(),
+                               1,
+                               estimateCtxtSize(context, 0));
+    for (std::size_t i = 0; i < ctxts.size(); i++)
+      writer.writeByLocation(ctxts[i], i, 0);
+  }
+};
+
+// A request whose result has not been checked yet
+struct Pending
+{
+  Clock::time_point arrival;
+  std::string inPath, outPath;
+  std::vector<helib::Ptxt<helib::BGV>> expected;
+  std::future<void> result;
+};
+
+class Client
+{
+public:
+  Client(long id,
+         const CmdLineOpts& opts,
+         const helib::SecKey& sk,
+         Server& server,
+         Stats& stats) :
+      id(id), opts(opts), sk(sk), server(server), stats(stats), random(id)
+  {}
+
+  // Submit requests until end, and check their results as they come
+  void run(Clock::time_point end)
+  {
+    bool closed = opts.rate <= 0;
+    std::thread receiver;
+    if (!closed)
+      receiver = std::thread([this]() { receive(); });
+
+    // Every client has its share of the total rate
+    std::exponential_distribution<double> gap(closed ? 1
+                                                     : opts.rate / opts.clients);
+    Clock::time_point next = Clock::now();
+    for (long seq = 0;; seq++) {
+      if (!closed) {
+        next += std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(gap(random)));
+        if (next >= end)
+          break;
+        std::this_thread::sleep_until(next);
+      } else {
+        next = Clock::now();
+        if (next >= end)
+          break;
+      }
+
+      Pending request = prepare(seq);
+      request.arrival = next;
+      if (closed)
+        check(request);
+      else {
+        std::lock_guard<std::mutex> lock(mutex);
+        inbox.push_back(std::move(request));
+        ready.notify_one();
+      }
+    }
+
+    if (!closed) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        finished = true;
+        ready.notify_one();
+      }
+      receiver.join();
+    }
+  }
+
+private:
+  long id;
+  const CmdLineOpts& opts;
+  const helib::SecKey& sk;
+  Server& server;
+  Stats& stats;
+  std::mt19937 random;
+
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::deque<Pending> inbox;
+  bool finished = false;
+
+  // Encrypt random plaintexts to a container and submit it
+  Pending prepare(long seq)
+  {
+    const helib::Context& context = sk.getContext();
+    Pending request;
+    std::string prefix = opts.dir + "/load-" + std::to_string(id) + "-" +
+                         std::to_string(seq);
+    request.inPath = prefix + ".in.ctxt";
+    request.outPath = prefix + ".out.ctxt";
+
+    Writer<helib::Ctxt> writer(request.inPath,
+                               opts.ctxts,
+                               1,
+                               estimateCtxtSize(context, 0));
+    for (long i = 0; i < opts.ctxts; i++) {
+      helib::Ptxt<helib::BGV> ptxt(context);
+      ptxt.random();
+      helib::Ctxt ctxt(sk);
+      sk.Encrypt(ctxt, ptxt);
+      writer.writeByLocation(ctxt, i, 0);
+      ptxt.power(1L << opts.depth);
+      request.expected.push_back(ptxt);
+    }
+    request.result = server.submit(request.inPath, request.outPath);
+    return request;
+  }
+
+  // Wait for the result of request, decrypt and check it
+  void check(Pending& request)
+  {
+    try {
+      request.result.get();
+      helib::Ctxt scratch(sk);
+      Reader<helib::Ctxt> reader(request.outPath, scratch);
+      bool correct = true;
+      for (long i = 0; i < opts.ctxts; i++) {
+        helib::Ptxt<helib::BGV> ptxt(sk.getContext());
+        sk.Decrypt(ptxt, *reader.readDatum(i, 0));
+        correct = correct && ptxt == request.expected[i];
+      }
+      std::chrono::duration<double> latency = Clock::now() - request.arrival;
+      stats.record(latency.count(), correct);
+    } catch (const std::exception& e) {
+      std::cerr << "Request " << request.inPath << " failed: " << e.what()
+                << std::endl;
+      stats.fail();
+    }
+    std::remove(request.inPath.c_str());
+    std::remove(request.outPath.c_str());
+  }
+
+  void receive()
+  {
+    for (;;) {
+      Pending request;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        ready.wait(lock, [this]() { return finished || !inbox.empty(); });
+        if (inbox.empty())
+          return;
+        request = std::move(inbox.front());
+        inbox.pop_front();
+      }
+      check(request);
+    }
+  }
+};
+
+int main(int argc, char* argv[])
+{
+  CmdLineOpts cmdLineOpts;
+
+  // clang-format off
+  helib::ArgMap()
+    .toggle()
+      .arg("--thick", cmdLineOpts.thick,
+           "perform thick bootstrapping.", nullptr)
+    .required()
+    .positional()
+      .arg("<sk-file>", cmdLineOpts.skFilePath,
+           "the file containing the bootstrappable context and secret key.",
+           nullptr)
+    .separator(helib::ArgMap::Separator::WHITESPACE)
+    .named()
+    .optional()
+      .arg("--bootstrap-bundle", cmdLineOpts.bundleFilePath,
+           "read the recryption data from this bundle instead of computing them.",
+           nullptr)
+      .arg("--polynomials", cmdLineOpts.polynomialsPath,
+           "bundle or directory of the digit extraction polynomials.",
+           nullptr)
+      .arg("-c", cmdLineOpts.clients,
+           "number of clients.")
+      .arg("--rate", cmdLineOpts.rate,
+           "requests per second of all the clients together. If not set or 0 every client waits for its result before the next request.")
+      .arg("--duration", cmdLineOpts.duration,
+           "seconds during which requests are submitted.")
+      .arg("--interval", cmdLineOpts.interval,
+           "seconds between two progress reports.")
+      .arg("--ctxts", cmdLineOpts.ctxts,
+           "ciphertexts per request.")
+      .arg("--depth", cmdLineOpts.depth,
+           "squarings per ciphertext, with bootstrapping as needed.")
+      .arg("--concurrent", cmdLineOpts.concurrent,
+           "requests evaluated at the same time by the server.")
+      .arg("-n", cmdLineOpts.nthreads,
+           "number of threads to use. If not set or 0 defaults to the number of concurrent threads supported.", "num. of cores")
+      .arg("--dir", cmdLineOpts.dir,
+           "directory of the request and result containers.")
+    .parse(argc, argv);
+  // clang-format on
+
+  // Set NTL nthreads
+  if (cmdLineOpts.nthreads == 0) {
+    cmdLineOpts.nthreads = std::thread::hardware_concurrency();
+    // hardware_concurrency may still return 0 if not supported on
+    // implementation.
+    if (cmdLineOpts.nthreads == 0) {
+      std::cerr << "C++ `hardware_concurrency` call not available on this"
+                   "platform.\nnthreads must be explicitly provided."
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (cmdLineOpts.nthreads > 0) {
+    NTL::SetNumThreads(cmdLineOpts.nthreads);
+  } else {
+    std::cerr << "Number of threads must be a positive integer." << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (cmdLineOpts.clients < 1 || cmdLineOpts.ctxts < 1 ||
+      cmdLineOpts.concurrent < 1) {
+    std::cerr << "The clients, ctxts and concurrent requests must be positive "
+                 "integers."
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (cmdLineOpts.depth < 0 || cmdLineOpts.depth > 20 ||
+      cmdLineOpts.rate < 0 || cmdLineOpts.duration <= 0 ||
+      cmdLineOpts.interval <= 0) {
+    std::cerr << "The depth must be in [0, 20], the rate not negative, and "
+                 "the duration and interval positive."
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::unique_ptr<helib::Context> contextp;
+  std::unique_ptr<helib::SecKey> skp;
+
+  try {
+    // Load Context and SecKey
+    std::tie(contextp, skp) = loadContextAndKey<helib::SecKey>(
+        cmdLineOpts.skFilePath,
+        cmdLineOpts.bundleFilePath);
+
+    if (!cmdLineOpts.polynomialsPath.empty())
+      helib::setPolynomialSource(cmdLineOpts.polynomialsPath);
+
+    if (!contextp->isBootstrappable() || contextp->getP() <= 0) {
+      std::cerr << "Context is not bootstrappable" << std::endl;
+      return EXIT_FAILURE;
+    }
+  } catch (const std::exception& e) {
+    std::cerr << "Exit due to exception thrown during setup:\n"
+              << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  Server server(cmdLineOpts, *contextp, *skp);
+  Stats stats;
+  helib::MemoryScope memory;
+
+  const Clock::time_point start = Clock::now();
+  const Clock::time_point end =
+      start + std::chrono::duration_cast<Clock::duration>(
+                  std::chrono::duration<double>(cmdLineOpts.duration));
+
+  std::vector<std::unique_ptr<Client>> clients;
+  std::vector<std::thread> threads;
+  for (long id = 0; id < cmdLineOpts.clients; id++) {
+    clients.push_back(std::make_unique<Client>(id,
+                                               cmdLineOpts,
+                                               *skp,
+                                               server,
+                                               stats));
+    threads.emplace_back([&, id]() { clients[id]->run(end); });
+  }
+
+  // Progress, until every client is done
+  std::atomic<bool> running{true};
+  std::thread reporter([&]() {
+    long before = 0;
+    auto interval = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(cmdLineOpts.interval));
+    for (Clock::time_point next = start + interval; running;
+         next += interval) {
+      std::this_thread::sleep_until(next);
+      long completed = stats.completed();
+      std::chrono::duration<double> elapsed = Clock::now() - start;
+      std::cout << std::fixed << std::setprecision(1) << "t=" << elapsed.count()
+                << " completed=" << completed << " throughput="
+                << (completed - before) / cmdLineOpts.interval
+                << " inFlight=" << server.requestsInFlight()
+                << " residueMB=" << helib::residueBytes() / double(1L << 20)
+                << std::endl;
+      before = completed;
+    }
+  });
+
+  for (std::thread& thread : threads)
+    thread.join();
+  running = false;
+  reporter.join();
+  memory.stop();
+
+  std::chrono::duration<double> elapsed = Clock::now() - start;
+  long completed = stats.completed();
+  std::cout << std::setprecision(4) << "requests=" << completed
+            << " failed=" << stats.failures()
+            << " incorrect=" << stats.incorrect()
+            << " seconds=" << elapsed.count()
+            << " throughput=" << completed / elapsed.count()
+            << " ctxtThroughput="
+            << completed * cmdLineOpts.ctxts / elapsed.count() << std::endl;
+  std::cout << "p50=" << stats.quantile(0.5) << " p99=" << stats.quantile(0.99)
+            << " p999=" << stats.quantile(0.999)
+            << " peakResidueMB=" << memory.peakBytes() / double(1L << 20)
+            << std::endl;
+
+  return stats.failures() == 0 && stats.incorrect() == 0 ? EXIT_SUCCESS
+                                                         : EXIT_FAILURE;
+}
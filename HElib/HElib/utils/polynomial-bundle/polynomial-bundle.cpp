@@ -0,0 +1,74 @@
+/* Copyright (C) 2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+// Convert a directory of poly{p}_{e_inner}_{e}.txt files to a binary
+// polynomial bundle that can be passed to helib::setPolynomialSource or
+// the HELIB_POLYNOMIALS environment variable.
+
+#include <iostream>
+
+#include <helib/helib.h>
+#include <helib/ArgMap.h>
+#include <helib/polyBundle.h>
+
+struct CmdLineOpts
+{
+  std::string inputDir;
+  std::string outputPath;
+};
+
+int main(int argc, char* argv[])
+{
+  CmdLineOpts cmdLineOpts;
+
+  // clang-format off
+  helib::ArgMap()
+        .required()
+        .positional()
+          .arg("<polynomial-dir>", cmdLineOpts.inputDir,
+               "directory with the polynomial text files.", nullptr)
+          .arg("<bundle-file>", cmdLineOpts.outputPath,
+               "the bundle file to write.", nullptr)
+        .parse(argc, argv);
+  // clang-format on
+
+  try {
+    std::vector<helib::PolynomialBundle::Entry> entries =
+        helib::readPolynomialDirectory(cmdLineOpts.inputDir);
+    if (entries.empty()) {
+      std::cerr << "No polynomial files found in " << cmdLineOpts.inputDir
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+    helib::PolynomialBundle::write(cmdLineOpts.outputPath, entries);
+
+    // Read everything back so a broken bundle is caught here
+    helib::PolynomialBundle bundle(cmdLineOpts.outputPath);
+    for (const auto& entry : entries) {
+      NTL::ZZX poly;
+      bundle.decode(poly, entry.p, entry.e_inner, entry.e);
+      if (poly != entry.poly) {
+        std::cerr << "Mismatch for p=" << entry.p
+                  << ", e_inner=" << entry.e_inner << ", e=" << entry.e
+                  << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+    std::cout << "Wrote " << bundle.size() << " polynomials to "
+              << cmdLineOpts.outputPath << std::endl;
+  } catch (const helib::Exception& e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
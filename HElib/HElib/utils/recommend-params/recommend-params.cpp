@@ -0,0 +1,523 @@
+/* Copyright (C) 2020 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+// Recommend bootstrappable BGV parameters for the polyfunction digit
+// extraction. The m are enumerated and given generators as in
+// misc/params.cpp, every (m, c, skHwt) gets the largest modulus that meets
+// the security level, and the configurations are ranked by an analytic cost
+// model of thin bootstrapping, amortized over the slots:
+//  - the linear maps cost one key switch per rotation, counted as in
+//    misc/params.cpp, for both CoeffToSlot and SlotToCoeff
+//  - the digit extraction costs one key switch per non-scalar multiplication
+//    of the plan of planDigitExtraction() for the e and e' of the context
+//  - a key switch costs (c + 2) * #primes NTTs of size phi(m)
+// The capacity after bootstrapping is the modulus left once every level of
+// the linear maps and of the digit extraction has taken the bits of a
+// product mod p^e. These are estimates to narrow down the candidates, which
+// should then be timed with test_bootstrapping.
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include <helib/helib.h>
+#include <helib/ArgMap.h>
+#include <helib/polyBundle.h>
+#include <helib/polyEval.h>
+
+#include <NTL/BasicThreadPool.h>
+
+struct CmdLineOpts
+{
+  long p = 0;
+  long r = 1;
+  double security = 128;
+  long minSlots = 1;
+  long lo = 1001;
+  long hi = 80000;
+  long m = 0;
+  long maxOrd = 100;
+  NTL::Vec<long> cList;
+  NTL::Vec<long> hwtList;
+  double minCapacity = 1;
+  long top = 10;
+  long nthreads = 0; // Default is 0 for number of cpus.
+  bool lazy = false;
+  std::string polynomials;
+};
+
+// An m with its generators, see misc/params.cpp
+struct Candidate
+{
+  long m;
+  long phim;
+  long d;
+  long nslots;
+  std::vector<long> mvec;
+  std::vector<long> gens;
+  std::vector<long> ords;
+  long rotations; // key switches of one linear map
+  long depth;     // levels of one linear map
+};
+
+struct Configuration
+{
+  const Candidate* candidate;
+  long c;
+  long skHwt;
+  long bits = 0;
+  double security = 0;
+  long e = 0;
+  long ePrime = 0;
+  long digitMultiplications = 0;
+  long digitDepth = 0;
+  double keyBytes = 0;
+  double capacity = 0;
+  double costPerSlot = 0;
+};
+
+// A heuristic measure for how good a certain (depth,cost) is
+static long weightedCost(long cost, long depth)
+{
+  return depth * (1L << 16) + cost;
+}
+
+// Compute phi(p^e)=p^{e-1}*(p-1) (assuming that p is a prime)
+static long computePhi(const NTL::Pair<long, long>& x)
+{
+  return NTL::power_long(x.a, x.b - 1) * (x.a - 1);
+}
+
+// The generators of misc/params.cpp: one or two factors of m are covered by
+// a single generator, which may be a bad dimension, every other factor gets
+// its own good dimension. Returns false if m is not suitable.
+static bool findCandidate(Candidate& candidate, long m, long p, long maxOrd)
+{
+  if (NTL::GCD(p, m) != 1)
+    return false;
+  long d = helib::multOrd(p, m);
+  if (d > maxOrd)
+    return false;
+
+  NTL::Vec<NTL::Pair<long, long>> fac;
+  helib::factorize(fac, m);
+  long k = fac.length();
+  if (k == 1)
+    return false;
+
+  std::vector<long> fac1(k), phivec(k);
+  long phisum = 0;
+  for (long i = 0; i < k; i++) {
+    fac1[i] = NTL::power_long(fac[i].a, fac[i].b);
+    phivec[i] = computePhi(fac[i]);
+    phisum += phivec[i];
+  }
+
+  long genIndex = -1, genIndex2 = -1;
+  bool goodGen = false;
+  long firstGen = 0;
+  long bestWeightedCost = NTL_MAX_LONG;
+  long bestCost = 0, bestDepth = 0;
+  auto consider = [&](long i, long j) {
+    long m1 = (j < 0) ? fac1[i] : fac1[i] * fac1[j];
+    long phim1 = (j < 0) ? phivec[i] : phivec[i] * phivec[j];
+    if (helib::multOrd(p, m1) != d)
+      return;
+
+    helib::PAlgebra pal1(m1, p);
+    if (pal1.numOfGens() > 1)
+      return;
+
+    bool good = (pal1.numOfGens() == 0 ||
+                 (pal1.numOfGens() == 1 && pal1.SameOrd(0)));
+
+    long cost = phisum - phivec[i] - ((j < 0) ? 0 : phivec[j]) + d - 1;
+    long depth = k - ((j < 0) ? 1 : 2);
+    cost += (2 - long(good)) * (phim1 / d - 1);
+    depth += (2 - long(good));
+
+    if (weightedCost(cost, depth) < bestWeightedCost) {
+      genIndex = i;
+      genIndex2 = j;
+      goodGen = good;
+      firstGen = pal1.ZmStarGen(0);
+      bestWeightedCost = weightedCost(cost, depth);
+      bestCost = cost;
+      bestDepth = depth;
+    }
+  };
+  for (long i = 0; i < k; i++)
+    consider(i, -1);
+  // search for two-generator solution
+  for (long i = 0; i < k; i++)
+    for (long j = i + 1; j < k; j++)
+      consider(i, j);
+  if (genIndex == -1)
+    return false;
+
+  std::vector<long> fac2 = fac1;
+  for (long i = genIndex - 1; i >= 0; i--)
+    std::swap(fac2[i], fac2[i + 1]);
+  if (genIndex2 != -1) {
+    for (long i = genIndex2; i < k - 1; i++)
+      std::swap(fac2[i], fac2[i + 1]);
+    fac2[0] *= fac2[k - 1];
+    fac2.resize(k - 1);
+  }
+  long k2 = fac2.size();
+
+  std::vector<long> genvec(k2), ordvec(k2);
+  genvec[0] = (firstGen == 0) ? 1 : firstGen;
+  ordvec[0] = helib::phi_N(fac2[0]) / d;
+  if (!goodGen)
+    ordvec[0] = -ordvec[0];
+  for (long i = 1; i < k2; i++) {
+    std::vector<long> gens, ords;
+    helib::findGenerators(gens, ords, fac2[i], 1);
+    if (gens.size() != 1 || ords[0] <= 0)
+      return false;
+    genvec[i] = gens[0];
+    ordvec[i] = ords[0];
+  }
+
+  // Lift the generators of the factors to Z_m^* by the CRT
+  std::vector<long> crtvec(k2);
+  long all1 = 0;
+  for (long i = 0; i < k2; i++) {
+    crtvec[i] =
+        (m / fac2[i]) * NTL::InvMod((m / fac2[i]) % fac2[i], fac2[i]);
+    all1 += crtvec[i];
+  }
+
+  // The factors are listed in reverse, a trivial last generator is dropped
+  candidate.m = m;
+  candidate.phim = helib::phi_N(m);
+  candidate.d = d;
+  candidate.nslots = candidate.phim / d;
+  candidate.mvec.assign(fac2.rbegin(), fac2.rend());
+  candidate.gens.clear();
+  candidate.ords.clear();
+  for (long i = k2 - 1; i >= 0; i--) {
+    candidate.gens.push_back((all1 - crtvec[i] + crtvec[i] * genvec[i]) % m);
+    candidate.ords.push_back(ordvec[i]);
+  }
+  if (candidate.gens.back() == 1) {
+    candidate.gens.pop_back();
+    candidate.ords.pop_back();
+  }
+  candidate.rotations = bestCost;
+  candidate.depth = bestDepth;
+  return true;
+}
+
+// Largest log2(q / s) for which the estimate of Context::securityLevel()
+// still reaches the target, 0 if there is none
+static double maxLog2AlphaInv(long phim, long skHwt, double security)
+{
+  double lo = 0, hi = phim;
+  if (helib::lweEstimateSecurity(phim, 1, skHwt) < security)
+    return 0;
+  for (long i = 0; i < 60; i++) {
+    double mid = (lo + hi) / 2;
+    if (helib::lweEstimateSecurity(phim, mid, skHwt) >= security)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static std::string format(const std::vector<long>& v)
+{
+  std::ostringstream out;
+  out << "[";
+  for (std::size_t i = 0; i < v.size(); i++)
+    out << (i ? " " : "") << v[i];
+  out << "]";
+  return out.str();
+}
+
+int main(int argc, char* argv[])
+{
+  CmdLineOpts cmdLineOpts;
+
+  // clang-format off
+  helib::ArgMap()
+        .toggle()
+          .arg("--lazy", cmdLineOpts.lazy,
+               "cost the digit extraction for lazy relinearization.", nullptr)
+        .separator(helib::ArgMap::Separator::WHITESPACE)
+        .named()
+          .arg("-r", cmdLineOpts.r, "the Hensel lifting parameter.")
+          .arg("--security", cmdLineOpts.security,
+               "the security level to reach.")
+          .arg("--min-slots", cmdLineOpts.minSlots,
+               "the smallest number of slots.")
+          .arg("--lo", cmdLineOpts.lo, "low value for m range.")
+          .arg("--hi", cmdLineOpts.hi, "high value for m range.")
+          .arg("-m", cmdLineOpts.m,
+               "use only the specified m value.", nullptr)
+          .arg("--max-ord", cmdLineOpts.maxOrd,
+               "disregard m where the order of p is larger.")
+          .arg("-c", cmdLineOpts.cList,
+               "numbers of key-switching digits, e.g. \"[2 3]\".", "[3]")
+          .arg("--sk-hwt", cmdLineOpts.hwtList,
+               "Hamming weights of the secret key, e.g. \"[120 180]\".",
+               "[120]")
+          .arg("--min-capacity", cmdLineOpts.minCapacity,
+               "the smallest estimated capacity after bootstrapping in bits.")
+          .arg("--top", cmdLineOpts.top,
+               "number of configurations to print.")
+          .arg("-n", cmdLineOpts.nthreads,
+               "number of threads to use. If not set or 0 defaults to the "
+               "number of concurrent threads supported.", "num. of cores")
+          .arg("--polynomials", cmdLineOpts.polynomials,
+               "bundle file or directory of the digit extraction "
+               "polynomials.", nullptr)
+        .required()
+        .positional()
+          .arg("<p>", cmdLineOpts.p, "the plaintext prime.", nullptr)
+        .parse(argc, argv);
+  // clang-format on
+
+  if (cmdLineOpts.p < 2 || !NTL::ProbPrime(cmdLineOpts.p)) {
+    std::cerr << "p must be a prime number." << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (cmdLineOpts.r < 1) {
+    std::cerr << "r must be a positive integer." << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (cmdLineOpts.cList.length() == 0)
+    cmdLineOpts.cList.append(3);
+  if (cmdLineOpts.hwtList.length() == 0)
+    cmdLineOpts.hwtList.append(helib::BOOT_DFLT_SK_HWT);
+  for (long c : cmdLineOpts.cList)
+    if (c < 1) {
+      std::cerr << "The numbers of digits must be positive." << std::endl;
+      return EXIT_FAILURE;
+    }
+  for (long skHwt : cmdLineOpts.hwtList)
+    if (skHwt < helib::MIN_SK_HWT) {
+      std::cerr << "The Hamming weights must be at least "
+                << helib::MIN_SK_HWT << "." << std::endl;
+      return EXIT_FAILURE;
+    }
+
+  // Set NTL nthreads
+  if (cmdLineOpts.nthreads == 0) {
+    cmdLineOpts.nthreads = std::thread::hardware_concurrency();
+    // hardware_concurrency may still return 0 if not supported on
+    // implementation.
+    if (cmdLineOpts.nthreads == 0) {
+      std::cerr << "C++ `hardware_concurrency` call not available on this"
+                   "platform.\nnthreads must be explicitly provided."
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  if (cmdLineOpts.nthreads > 0) {
+    NTL::SetNumThreads(cmdLineOpts.nthreads);
+  } else {
+    std::cerr << "Number of threads must be a positive integer." << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (!cmdLineOpts.polynomials.empty())
+    helib::setPolynomialSource(cmdLineOpts.polynomials);
+
+  if (cmdLineOpts.m)
+    cmdLineOpts.lo = cmdLineOpts.hi = cmdLineOpts.m;
+  if (cmdLineOpts.lo % 2 == 0)
+    cmdLineOpts.lo++;
+
+  try {
+    std::vector<Candidate> candidates;
+    for (long m = cmdLineOpts.lo; m <= cmdLineOpts.hi; m += 2) {
+      Candidate candidate;
+      if (findCandidate(candidate, m, cmdLineOpts.p, cmdLineOpts.maxOrd) &&
+          candidate.nslots >= cmdLineOpts.minSlots)
+        candidates.push_back(std::move(candidate));
+    }
+
+    std::vector<Configuration> configurations;
+    for (const Candidate& candidate : candidates)
+      for (long c : cmdLineOpts.cList)
+        for (long skHwt : cmdLineOpts.hwtList)
+          configurations.push_back({&candidate, c, skHwt});
+
+    // The plans only depend on p, r and e - e', so they are shared
+    std::mutex plansMutex;
+    std::map<long, std::pair<long, long>> plans;
+
+    std::atomic<long> next(0);
+    NTL_EXEC_INDEX(NTL::AvailableThreads(), index)
+    for (long i = next++; i < long(configurations.size()); i = next++) {
+      Configuration& config = configurations[i];
+      const Candidate& candidate = *config.candidate;
+      try {
+        double log2AlphaInv = maxLog2AlphaInv(candidate.phim,
+                                              config.skHwt,
+                                              cmdLineOpts.security);
+        if (log2AlphaInv == 0)
+          continue;
+        // Context::securityLevel() with s = 3.2 * sqrt(m), as m is odd
+        double maxLogQ =
+            log2AlphaInv + std::log2(3.2 * std::sqrt(double(candidate.m)));
+
+        // The special primes take about 1/c of the bits of the ciphertext
+        // primes, correct the guess by what the built chain actually has
+        std::unique_ptr<helib::Context> context;
+        long bits = std::floor(maxLogQ * config.c / (config.c + 1));
+        for (long attempt = 0; attempt < 6 && bits > 0; attempt++) {
+          auto tried = std::make_unique<helib::Context>(candidate.m,
+                                                        cmdLineOpts.p,
+                                                        cmdLineOpts.r,
+                                                        candidate.gens,
+                                                        candidate.ords);
+          tried->buildModChain(bits,
+                               config.c,
+                               /*willBeBootstrappable=*/true,
+                               config.skHwt);
+          double slack = maxLogQ - tried->bitSizeOfQ();
+          if (tried->securityLevel() >= cmdLineOpts.security) {
+            if (!context || bits > config.bits) {
+              context = std::move(tried);
+              config.bits = bits;
+            }
+            if (slack < 0.01 * maxLogQ)
+              break;
+          }
+          long step = std::floor(slack * config.c / (config.c + 1));
+          bits += (step == 0) ? -1 : step;
+        }
+        if (!context)
+          continue;
+
+        config.security = context->securityLevel();
+        helib::RecryptData::setAE(config.e, config.ePrime, *context);
+
+        long botHigh = config.e - config.ePrime;
+        std::pair<long, long> cost;
+        bool planned;
+        {
+          std::lock_guard<std::mutex> lock(plansMutex);
+          auto it = plans.find(botHigh);
+          planned = (it != plans.end());
+          if (planned)
+            cost = it->second;
+        }
+        if (!planned) {
+          helib::digitExtractionCost(
+              cost.first,
+              cost.second,
+              *context,
+              botHigh,
+              cmdLineOpts.r,
+              cmdLineOpts.lazy,
+              helib::planDigitExtraction(*context,
+                                         botHigh,
+                                         cmdLineOpts.r,
+                                         cmdLineOpts.lazy));
+          std::lock_guard<std::mutex> lock(plansMutex);
+          plans.emplace(botHigh, cost);
+        }
+        config.digitMultiplications = cost.first;
+        config.digitDepth = cost.second;
+
+        double phim = candidate.phim;
+        long nPrimes = context->getCtxtPrimes().card() +
+                       context->getSpecialPrimes().card();
+        double ctxtBits =
+            context->logOfProduct(context->getCtxtPrimes()) / std::log(2.0);
+
+        // One key-switching matrix holds c pairs of polynomials over every
+        // prime, one for each rotation of the linear maps and for the
+        // relinearization
+        long nMatrices = candidate.d;
+        for (long ord : candidate.ords)
+          nMatrices += std::abs(ord) - 1;
+        config.keyBytes = 16.0 * config.c * nPrimes * phim * nMatrices;
+
+        // Every level takes the bits of a product mod p^e
+        double levelBits =
+            config.e * std::log2(double(cmdLineOpts.p)) +
+            0.5 * std::log2(phim * config.skHwt) + 2;
+        long depth = 2 * candidate.depth + config.digitDepth;
+        config.capacity = ctxtBits - depth * levelBits;
+
+        long keySwitches = 2 * candidate.rotations + config.digitMultiplications;
+        double keySwitchCost =
+            (config.c + 2) * nPrimes * phim * std::log2(phim);
+        config.costPerSlot = keySwitches * keySwitchCost / candidate.nslots;
+      } catch (const helib::RuntimeError& e) {
+        config.bits = 0; // no e for this modulus, see RecryptData::setAE
+      }
+    }
+    NTL_EXEC_INDEX_END
+
+    configurations.erase(
+        std::remove_if(configurations.begin(),
+                       configurations.end(),
+                       [&](const Configuration& config) {
+                         return config.bits == 0 ||
+                                config.capacity < cmdLineOpts.minCapacity;
+                       }),
+        configurations.end());
+    std::sort(configurations.begin(),
+              configurations.end(),
+              [](const Configuration& a, const Configuration& b) {
+                return a.costPerSlot < b.costPerSlot;
+              });
+    if (long(configurations.size()) > cmdLineOpts.top)
+      configurations.resize(cmdLineOpts.top);
+
+    if (configurations.empty()) {
+      std::cerr << "No parameters meet the requirements." << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    // Relative costs, the fastest configuration is 1
+    double unit = configurations.front().costPerSlot;
+    for (const Configuration& config : configurations) {
+      const Candidate& candidate = *config.candidate;
+      std::cout << std::fixed << std::setprecision(2)
+                << "cost/slot=" << config.costPerSlot / unit
+                << " m=" << candidate.m << " phim=" << candidate.phim
+                << " nslots=" << candidate.nslots << " d=" << candidate.d
+                << " bits=" << config.bits << " c=" << config.c
+                << " skHwt=" << config.skHwt
+                << " security=" << std::setprecision(1) << config.security
+                << " e=" << config.e << " e'=" << config.ePrime
+                << " rotations=" << 2 * candidate.rotations
+                << " digit-mults=" << config.digitMultiplications
+                << " keys=" << std::setprecision(0)
+                << config.keyBytes / (1L << 20) << "MB"
+                << " capacity=" << config.capacity
+                << " mvec=\"" << format(candidate.mvec) << "\""
+                << " gens=\"" << format(candidate.gens) << "\""
+                << " ords=\"" << format(candidate.ords) << "\"" << std::endl;
+    }
+  } catch (const helib::Exception& e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -269,3 +269,23 @@ function teardown {
  run "${test_bootstrap}" boots.sk --quiet
  assert [ "$status" -eq 0 ]
 }
+
+@test "worker file and minimal-skm require a bootstrappable context" {
+  run "${create_context}" "${prefix_bgv}.params" --worker-file
+  assert [ "$status" -ne 0 ]
+  assert [ "$output" == "Minimal switch-key matrices and worker files are only available for bootstrappable contexts." ]
+  run "${create_context}" "${prefix_bgv}.params" --minimal-skm
+  assert [ "$status" -ne 0 ]
+  assert [ "$output" == "Minimal switch-key matrices and worker files are only available for bootstrappable contexts." ]
+}
+
+@test "bootstrap with worker file writes the worker file next to the keys" {
+  create-bootstrap-toy-params
+  mkdir -p polys
+  run "${create_context}" "${prefix_bootstrap}.params" --bootstrap THIN --minimal-skm --worker-file --polynomials polys -o worker
+  assert [ "$status" -eq 0 ]
+  assert [ "${lines[0]}" == "Bootstrapping key switching matrices created." ]
+  assert [ -f "worker.pk" ]
+  assert [ -f "worker.sk" ]
+  assert [ -f "worker.boot" ]
+}
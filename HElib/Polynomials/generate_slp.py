@@ -0,0 +1,188 @@
+#!/usr/bin/env python3
+"""Write the straight-line programs slp<p>.txt for odd p (see digitProgram.h).
+
+The program evaluates the digit extraction polynomials poly<p>_1_<e>.txt for
+e = 2, 4, 8, ... with the Paterson-Stockmeyer algorithm. Every power of x is
+computed once at the least depth and shared by all the outputs, and the
+baby-step size of each output is chosen for the fewest multiplications at
+the least depth of its polynomial. Every output is checked against its
+polynomial mod p^e.
+
+    generate_slp.py <p> <max precision> [<polynomial directory>]
+"""
+
+import os
+import sys
+
+BEAM = 400
+
+
+def read_polynomial(directory, p, e):
+    with open(os.path.join(directory, "poly%d_1_%d.txt" % (p, e))) as f:
+        return [int(c) for c in f.read().split()]
+
+
+def balanced(c, q):
+    c %= q
+    return c - q if 2 * c > q else c
+
+
+class Program:
+    def __init__(self):
+        self.lines = []
+        self.depth = [0]  # register 0 is x
+        self.powers = {1: 0}  # exponent -> register
+        self.multiplications = 0
+
+    def _define(self, line, depth):
+        self.lines.append(line)
+        self.depth.append(depth)
+        return len(self.depth) - 1
+
+    def square(self, a):
+        self.multiplications += 1
+        return self._define("square %d" % a, self.depth[a] + 1)
+
+    def mul(self, a, b):
+        if a == b:
+            return self.square(a)
+        self.multiplications += 1
+        return self._define("mul %d %d" % (a, b),
+                            max(self.depth[a], self.depth[b]) + 1)
+
+    def lin(self, terms):
+        terms = [(c, a) for c, a in terms if c != 0]
+        if not terms:
+            return None
+        if len(terms) == 1 and terms[0][0] == 1:
+            return terms[0][1]
+        text = " ".join("%d %d" % t for t in terms)
+        return self._define("lin " + text, max(self.depth[a] for _, a in terms))
+
+    def power(self, t):
+        # x^t = x^(2^j) * x^(t - 2^j) for the largest 2^j < t, at depth
+        # ceil(log2(t))
+        if t not in self.powers:
+            high = 1 << ((t - 1).bit_length() - 1)
+            if t % 2 == 0:
+                self.powers[t] = self.square(self.power(t // 2))
+            else:
+                self.powers[t] = self.mul(self.power(high),
+                                          self.power(t - high))
+        return self.powers[t]
+
+
+def evaluate(program, coeffs, k, q):
+    """Append the Paterson-Stockmeyer evaluation of the odd polynomial coeffs
+    with baby steps x, x^3, ..., x^(k-1) (k even), return its register"""
+    blocks = (len(coeffs) - 1) // k + 1
+
+    def block(i):
+        terms = []
+        for t in range(1, k, 2):
+            if i * k + t < len(coeffs):
+                c = balanced(coeffs[i * k + t], q)
+                if c:
+                    terms.append((c, program.power(t)))
+        return program.lin(terms)
+
+    def rec(first, count):
+        if count == 1:
+            return block(first)
+        half = 1 << ((count - 1).bit_length() - 1)
+        low = rec(first, half)
+        high = rec(first + half, count - half)
+        if high is None:
+            return low
+        product = program.mul(program.power(k * half), high)
+        return product if low is None else program.lin([(1, low), (1, product)])
+
+    return rec(0, blocks)
+
+
+def polynomial_of(program):
+    # The registers as integer polynomials in x, to check the outputs
+    regs = [[0, 1]]
+
+    def mul(a, b):
+        r = [0] * (len(a) + len(b) - 1)
+        for i, x in enumerate(a):
+            if x:
+                for j, y in enumerate(b):
+                    r[i + j] += x * y
+        return r
+
+    for line in program.lines:
+        op, *args = line.split()
+        args = [int(a) for a in args]
+        if op == "square":
+            regs.append(mul(regs[args[0]], regs[args[0]]))
+        elif op == "mul":
+            regs.append(mul(regs[args[0]], regs[args[1]]))
+        else:
+            r = []
+            for c, a in zip(args[::2], args[1::2]):
+                r += [0] * (len(regs[a]) - len(r))
+                for i, x in enumerate(regs[a]):
+                    r[i] += c * x
+            regs.append(r)
+    return regs
+
+
+def build(p, polynomials, choice):
+    program = Program()
+    outputs = []
+    for (e, coeffs), k in zip(polynomials, choice):
+        outputs.append((evaluate(program, coeffs, k, p ** e), e))
+    return program, outputs
+
+
+def main():
+    p = int(sys.argv[1])
+    top = int(sys.argv[2])
+    directory = sys.argv[3] if len(sys.argv) > 3 else "polynomials"
+    precisions = []
+    e = 2
+    while e < top:
+        precisions.append(e)
+        e *= 2
+    precisions.append(top)
+    polynomials = [(e, read_polynomial(directory, p, e)) for e in precisions]
+
+    # Choose the baby-step sizes of the outputs for the fewest
+    # multiplications, every output at the least depth of its polynomial
+    # (a beam search, the outputs share their powers)
+    beam = [[]]
+    for i, (e, coeffs) in enumerate(polynomials):
+        least = (len(coeffs) - 1).bit_length()
+        candidates = []
+        for choice in beam:
+            for k in range(2, len(coeffs) + 2, 2):
+                program, outputs = build(p, polynomials[: i + 1], choice + [k])
+                if program.depth[outputs[-1][0]] <= least:
+                    candidates.append((program.multiplications, choice + [k]))
+        candidates.sort()
+        beam = [choice for _, choice in candidates[:BEAM]]
+    choice = beam[0]
+
+    program, outputs = build(p, polynomials, choice)
+    regs = polynomial_of(program)
+    for (reg, e), (_, coeffs) in zip(outputs, polynomials):
+        got = regs[reg] + [0] * (len(coeffs) - len(regs[reg]))
+        assert len(got) == len(coeffs), "degree of output %d" % e
+        assert all((a - b) % p ** e == 0 for a, b in zip(got, coeffs)), e
+
+    print("# Digit extraction polynomials for p = %d, written by generate_slp.py"
+          % p)
+    print("# from poly%d_1_e.txt: Paterson-Stockmeyer with shared powers" % p)
+    print("# %d multiplications, depth %d for precision %d"
+          % (program.multiplications, program.depth[outputs[-1][0]],
+             outputs[-1][1]))
+    for line in program.lines:
+        print(line)
+    for reg, e in outputs:
+        print("output %d %d" % (reg, e))
+
+
+if __name__ == "__main__":
+    main()
@@ -52,7 +52,9 @@ bool squareWithThinBoot(helib::PubKey& pk, helib::Ctxt& c, const helib::SecKey*
     bool refreshed = false;
     if (c.bitCapacity() <= 200) {
         helib::Ctxt tmp(c);
-        pk.thinReCrypt(c, our_version, /*lazy*/ false, /*iterations*/ 5);
+        helib::BootstrapReport report;
+        pk.thinReCrypt(c, our_version, /*lazy*/ false, &report);
+        std::cout << report;
         if (areEqualCiphertexts(tmp, c, *secret_key))
             std::cout << "Thin bootstrapping successful!" << std::endl;
         else
@@ -283,7 +285,9 @@ static void BM_thinextract(long m,
     ea.encrypt(ctxt, public_key, ptxt);
 
     // Test digit extraction
-    wrapExtractDigitsThin(ctxt, botHigh, /*original ptxt exponent*/ r - botHigh, our_version, /*lazy*/ false, e_inner_compose_list, /*iterations*/ 5);
+    helib::BootstrapReport report;
+    wrapExtractDigitsThin(ctxt, botHigh, /*original ptxt exponent*/ r - botHigh, our_version, /*lazy*/ false, e_inner_compose_list, &report);
+    std::cout << report;
 
     std::vector<long> ptxt_res(nslots);
     ea.decrypt(ctxt, secret_key, ptxt_res);